@@ -14,12 +14,10 @@ camera {
 }
 {{/camera}}
 
-#declare Voxel = box {<-0.5, -0.5, -0.5>, <0.5, 0.5, 0.5>}
-#macro Vox(Pos, Color)
-    object {
-        Voxel
-        translate Pos
-        translate <0.5, 0.5, 0.5>
+// A box of voxels of the same color.
+#macro Vox(Pos, Size, Color)
+    box {
+        Pos, Pos + Size
         texture { pigment {color rgb Color / 255} }
     }
 #end
@@ -34,7 +32,5 @@ light_source {
 {{/light}}
 
 union {
-{{#voxels}}
-    Vox({{pos}}, {{color}})
-{{/voxels}}
+{{voxels}}
 }
@@ -0,0 +1,398 @@
+/*
+ * Ray march the voxels of a mesh brick map (see brickmap.h).
+ *
+ * We render the back faces of the grid box, and for each fragment march
+ * the camera ray through the grid cells, skipping the empty blocks, then
+ * through the voxels of the non empty blocks bricks.  The lighting is the
+ * same as in mesh.glsl, with the occlusion computed from the neighbor
+ * voxels of the hit face.
+ *
+ * The marching is done in the mesh space, where the voxels have a size
+ * of one.
+ *
+ * With SELECTION, the mesh is a selection mask, and we only output an
+ * outline along the edges of the selected faces, and a screen space hatch
+ * pattern inside them.
+ */
+
+uniform highp mat4  u_model;
+uniform highp mat4  u_view;
+uniform highp mat4  u_proj;
+uniform highp vec3  u_camera;
+uniform highp vec3  u_local_camera; // Camera position in the mesh space.
+
+// Brick map.
+uniform highp sampler3D u_grid_tex;
+uniform highp sampler3D u_pool_tex;
+uniform highp vec3  u_grid_origin;
+uniform highp vec3  u_grid_size;    // In blocks.
+uniform highp vec3  u_pool_size;    // In bricks.
+uniform highp float u_block_size;
+
+// Light parameters
+uniform lowp    vec3  u_l_dir;
+uniform lowp    float u_l_int;
+uniform lowp    float u_l_amb; // Ambient light coef.
+
+// Material parameters
+uniform lowp float u_m_metallic;
+uniform lowp float u_m_roughness;
+uniform lowp vec4  u_m_base_color;
+uniform lowp vec3  u_m_emissive_factor;
+
+uniform mediump float u_occlusion_strength;
+
+#ifdef SHADOW
+uniform highp   mat4      u_shadow_mvp;
+uniform mediump sampler2D u_shadow_tex;
+uniform mediump float     u_shadow_strength;
+#endif
+
+varying highp vec3 v_pos;
+
+#ifdef VERTEX_SHADER
+
+/************************************************************************/
+attribute highp vec3 a_pos;
+
+void main()
+{
+    v_pos = u_grid_origin + a_pos * u_grid_size * u_block_size;
+    gl_Position = u_proj * u_view * u_model * vec4(v_pos, 1.0);
+}
+/************************************************************************/
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+/************************************************************************/
+const mediump float M_PI = 3.141592653589793;
+// Larger than the diagonal of the biggest grid.
+const int MAX_BLOCK_STEPS = 1024;
+// Larger than the diagonal of the biggest blocks.
+const int MAX_VOXEL_STEPS = 96;
+
+// Same as in mesh.glsl.
+mediump vec3 F_Schlick(mediump vec3 f0, mediump float LdotH)
+{
+    mediump float fresnel = exp2((-5.55473 * LdotH - 6.98316) * LdotH);
+    return (1.0 - f0) * fresnel + f0;
+}
+
+mediump float V_GGX(mediump float NdotL, mediump float NdotV,
+                    mediump float alpha)
+{
+    mediump float a = alpha;
+    mediump float GGXV = NdotL * (NdotV * (1.0 - a) + a);
+    mediump float GGXL = NdotV * (NdotL * (1.0 - a) + a);
+    return 0.5 / (GGXV + GGXL);
+}
+
+mediump float D_GGX(mediump float NdotH, mediump float alpha)
+{
+    mediump float a2 = alpha * alpha;
+    mediump float f = (NdotH * a2 - NdotH) * NdotH + 1.0;
+    return a2 / (M_PI * f * f);
+}
+
+mediump vec3 compute_light(mediump vec3 L,
+                           mediump float light_intensity,
+                           mediump float light_ambient,
+                           mediump vec3 base_color,
+                           mediump float metallic,
+                           mediump float roughness,
+                           mediump vec3 N, mediump vec3 V)
+{
+    mediump vec3 H = normalize(L + V);
+
+    mediump float NdotL = clamp(dot(N, L), 0.0, 1.0);
+    mediump float NdotV = clamp(dot(N, V), 0.0, 1.0);
+    mediump float NdotH = clamp(dot(N, H), 0.0, 1.0);
+    mediump float LdotH = clamp(dot(L, H), 0.0, 1.0);
+
+    mediump float a_roughness = roughness * roughness;
+    mediump vec3 f0 = vec3(0.04);
+    mediump vec3 diffuse_color = base_color * (vec3(1.0) - f0) * (1.0 - metallic);
+    mediump vec3 specular_color = mix(f0, base_color, metallic);
+    mediump vec3  F   = F_Schlick(specular_color, LdotH);
+    mediump float Vis = V_GGX(NdotL, NdotV, a_roughness);
+    mediump float D   = D_GGX(NdotH, a_roughness);
+    mediump vec3 diffuseContrib = (1.0 - F) * (diffuse_color / M_PI);
+    mediump vec3 specContrib = F * (Vis * D);
+    mediump vec3 shade = NdotL * (diffuseContrib + specContrib);
+    shade = max(shade, vec3(0.0));
+    return light_intensity * shade + light_ambient * base_color;
+}
+
+// Return the grid texel of a block: the brick position and the non empty
+// flag in alpha.
+highp vec4 get_brick(highp vec3 cell)
+{
+    return texture3D(u_grid_tex, (cell + 0.5) / u_grid_size);
+}
+
+// Return the value of a voxel in a brick.
+lowp vec4 get_brick_voxel(highp vec4 brick, highp vec3 p)
+{
+    highp vec3 b = floor(brick.rgb * 255.0 + 0.5);
+    return texture3D(u_pool_tex, (b * u_block_size + p + 0.5) /
+                                 (u_pool_size * u_block_size));
+}
+
+// Return the value of any voxel of the grid.
+lowp vec4 get_voxel(highp vec3 p)
+{
+    highp vec3 cell = floor((p - u_grid_origin) / u_block_size);
+    highp vec4 brick;
+    if (any(lessThan(cell, vec3(0.0))) ||
+        any(greaterThanEqual(cell, u_grid_size))) return vec4(0.0);
+    brick = get_brick(cell);
+    if (brick.a < 0.5) return vec4(0.0);
+    return get_brick_voxel(brick, p - u_grid_origin - cell * u_block_size);
+}
+
+// Same alpha threshold as the meshes.
+bool is_solid(lowp vec4 v)
+{
+    return v.a > 126.5 / 255.0;
+}
+
+float solid(highp vec3 p)
+{
+    return is_solid(get_voxel(p)) ? 1.0 : 0.0;
+}
+
+// Axis of the smallest component, as a mask.
+highp vec3 min_axis(highp vec3 v)
+{
+    highp vec3 m = step(v, v.yzx) * step(v, v.zxy);
+    // In case of equality, only keep one axis.
+    if (m.x > 0.0) return vec3(1.0, 0.0, 0.0);
+    if (m.y > 0.0) return vec3(0.0, 1.0, 0.0);
+    return vec3(0.0, 0.0, 1.0);
+}
+
+/*
+ * March a ray through the grid.
+ *
+ * Return true if we hit a voxel, and set its position, value, the normal
+ * of the hit face, and the ray distance of the hit.
+ */
+bool ray_march(highp vec3 ro, highp vec3 rd,
+               out highp vec3 voxel, out lowp vec4 value,
+               out highp vec3 normal, out highp float t)
+{
+    highp vec3 inv, ta, tb, tsmall, tbig, stp, cell, tmax, tdelta, m;
+    highp vec3 vp, vtmax, bmin;
+    highp float tfar, texit;
+    highp vec4 brick;
+    int i, j;
+
+    inv = 1.0 / rd;
+    stp = sign(rd);
+
+    // Intersection with the grid box.
+    bmin = u_grid_origin;
+    ta = (bmin - ro) * inv;
+    tb = (bmin + u_grid_size * u_block_size - ro) * inv;
+    tsmall = min(ta, tb);
+    tbig = max(ta, tb);
+    t = max(max(tsmall.x, tsmall.y), max(tsmall.z, 0.0));
+    tfar = min(min(tbig.x, tbig.y), tbig.z);
+    if (t >= tfar) return false;
+    normal = t > 0.0 ? -stp * min_axis(-tsmall) : vec3(0.0);
+
+    // Blocks level.
+    cell = clamp(floor((ro + rd * t - bmin) / u_block_size),
+                 vec3(0.0), u_grid_size - 1.0);
+    tmax = (bmin + (cell + max(stp, 0.0)) * u_block_size - ro) * inv;
+    tdelta = u_block_size * abs(inv);
+
+    for (i = 0; i < MAX_BLOCK_STEPS; i++) {
+        brick = get_brick(cell);
+        if (brick.a > 0.5) {
+            // Voxels level, inside the block.
+            texit = min(min(tmax.x, tmax.y), tmax.z);
+            vp = clamp(floor(ro + rd * t - bmin - cell * u_block_size),
+                       vec3(0.0), vec3(u_block_size - 1.0));
+            vtmax = (bmin + cell * u_block_size + vp + max(stp, 0.0) - ro) *
+                    inv;
+            for (j = 0; j < MAX_VOXEL_STEPS; j++) {
+                value = get_brick_voxel(brick, vp);
+                if (is_solid(value)) {
+                    voxel = bmin + cell * u_block_size + vp;
+                    return true;
+                }
+                m = min_axis(vtmax);
+                t = dot(vtmax, m);
+                vp += m * stp;
+                // Don't rely on texit only, since the voxels of the
+                // neighbor bricks in the pool are unrelated.
+                if (t >= texit || any(lessThan(vp, vec3(0.0))) ||
+                    any(greaterThanEqual(vp, vec3(u_block_size)))) break;
+                vtmax += m * abs(inv);
+                normal = -m * stp;
+            }
+        }
+        m = min_axis(tmax);
+        t = dot(tmax, m);
+        if (t >= tfar) return false;
+        cell += m * stp;
+        tmax += m * tdelta;
+        normal = -m * stp;
+    }
+    return false;
+}
+
+// Occlusion of a face corner from its two sides and corner neighbors.
+mediump float corner_occlusion(mediump float s1, mediump float s2,
+                               mediump float c)
+{
+    if (s1 > 0.0 && s2 > 0.0) return 0.0;
+    return 1.0 - (s1 + s2 + c) / 3.0;
+}
+
+// Occlusion of a point of a voxel face, from the solid voxels around the
+// face, like the occlusion texture of the meshes.
+mediump float get_occlusion(highp vec3 voxel, highp vec3 n, highp vec3 p)
+{
+    highp vec3 q = voxel + n;
+    highp vec3 t1 = abs(n.yzx);
+    highp vec3 t2 = abs(n.zxy);
+    mediump vec2 uv = vec2(fract(dot(p, t1)), fract(dot(p, t2)));
+    mediump float s1m, s1p, s2m, s2p, a0, a1, a2, a3;
+
+    s1m = solid(q - t1);
+    s1p = solid(q + t1);
+    s2m = solid(q - t2);
+    s2p = solid(q + t2);
+    a0 = corner_occlusion(s1m, s2m, solid(q - t1 - t2));
+    a1 = corner_occlusion(s1p, s2m, solid(q + t1 - t2));
+    a2 = corner_occlusion(s1m, s2p, solid(q - t1 + t2));
+    a3 = corner_occlusion(s1p, s2p, solid(q + t1 + t2));
+    return mix(mix(a0, a1, uv.x), mix(a2, a3, uv.x), uv.y);
+}
+
+#ifdef SELECTION
+// Whether the edge of a selected face toward t is on the selection
+// outline: the neighbor face is not selected if there is no neighbor
+// voxel, or if it is hidden by a voxel in front.
+bool is_outline_edge(highp vec3 voxel, highp vec3 n, highp vec3 t)
+{
+    return solid(voxel + t) == 0.0 || solid(voxel + n + t) == 1.0;
+}
+
+lowp vec4 get_selection_color(highp vec3 voxel, highp vec3 n, highp vec3 p)
+{
+    highp vec3 t1 = abs(n.yzx);
+    highp vec3 t2 = abs(n.zxy);
+    highp vec2 uv = vec2(dot(p, t1), dot(p, t2));
+    highp vec2 f = clamp(uv - vec2(dot(voxel, t1), dot(voxel, t2)),
+                         0.0, 1.0);
+    mediump vec2 w = vec2(1.0 / 16.0);
+    lowp vec4 color = u_m_base_color;
+
+#if !defined(GL_ES) || __VERSION__ >= 300
+    // About 1.5 pixels lines.
+    w = clamp(fwidth(uv) * 1.5, 1.0 / 64.0, 0.25);
+#endif
+    if (    (f.x < w.x && is_outline_edge(voxel, n, -t1)) ||
+            (f.x > 1.0 - w.x && is_outline_edge(voxel, n, +t1)) ||
+            (f.y < w.y && is_outline_edge(voxel, n, -t2)) ||
+            (f.y > 1.0 - w.y && is_outline_edge(voxel, n, +t2))) {
+        color.a = min(1.0, color.a * 6.0);
+        return color;
+    }
+    if (mod(gl_FragCoord.x + gl_FragCoord.y, 8.0) >= 4.0) color.a *= 0.5;
+    return color;
+}
+#endif
+
+vec3 toneMap(vec3 color)
+{
+    return sqrt(color); // Gamma correction.
+}
+
+void main()
+{
+    highp vec3 rd, voxel, normal, p;
+    highp vec4 pos, clip;
+    highp float t;
+    lowp vec4 value;
+    vec4 base_color;
+    vec3 N, V, L, color;
+
+    rd = normalize(v_pos - u_local_camera);
+    // Avoid the divisions by zero in the marching.
+    rd = mix(rd, vec3(1e-6), vec3(lessThan(abs(rd), vec3(1e-6))));
+    if (!ray_march(u_local_camera, rd, voxel, value, normal, t)) discard;
+
+    p = u_local_camera + rd * t;
+    pos = u_model * vec4(p, 1.0);
+#ifdef SELECTION
+    // Move the depth a bit toward the camera, so that the overlay is not
+    // hidden by the voxels it covers.
+    clip = u_proj * u_view * u_model * vec4(p - rd * 0.05, 1.0);
+#else
+    clip = u_proj * u_view * pos;
+#endif
+    gl_FragDepth = (gl_DepthRange.diff * clip.z / clip.w +
+                    gl_DepthRange.near + gl_DepthRange.far) * 0.5;
+
+#ifdef SELECTION
+    // Camera inside a voxel.
+    if (normal == vec3(0.0)) {
+        gl_FragColor = u_m_base_color;
+        return;
+    }
+    gl_FragColor = get_selection_color(voxel, normal, p);
+    return;
+#endif
+
+    base_color = u_m_base_color * value * value; // srgb to linear (fast).
+
+#ifdef MATERIAL_UNLIT
+    gl_FragColor = vec4(sqrt(base_color.rgb), base_color.a);
+    return;
+#endif
+
+    // Camera inside a voxel.
+    if (normal == vec3(0.0)) normal = -rd;
+    N = normalize(mat3(u_model) * normal);
+    V = normalize(u_camera - pos.xyz);
+    L = normalize(u_l_dir);
+    color = compute_light(L, u_l_int, u_l_amb, base_color.rgb,
+                          u_m_metallic, u_m_roughness, N, V);
+
+#ifdef SHADOW
+    float NdotL = clamp(dot(N, L), 0.0, 1.0);
+    lowp vec2 PS[4]; // Poisson offsets used for the shadow map.
+    float visibility = 1.0;
+    mediump vec4 shadow_coord = u_shadow_mvp * pos;
+    shadow_coord /= shadow_coord.w;
+    lowp float bias = 0.005 * tan(acos(clamp(NdotL, 0.0, 1.0)));
+    bias = clamp(bias, 0.0015, 0.015);
+    shadow_coord.z -= bias;
+    PS[0] = vec2(-0.94201624, -0.39906216) / 1024.0;
+    PS[1] = vec2(+0.94558609, -0.76890725) / 1024.0;
+    PS[2] = vec2(-0.09418410, -0.92938870) / 1024.0;
+    PS[3] = vec2(+0.34495938, +0.29387760) / 1024.0;
+    for (int i = 0; i < 4; i++)
+        if (texture2D(u_shadow_tex, shadow_coord.xy +
+           PS[i]).z < shadow_coord.z) visibility -= 0.2;
+    if (NdotL <= 0.0) visibility = 0.5;
+    color *= mix(1.0, visibility, u_shadow_strength);
+#endif // SHADOW
+
+    if (u_occlusion_strength > 0.0) {
+        color = mix(color, color * get_occlusion(voxel, normal, p),
+                    u_occlusion_strength);
+    }
+
+    color += u_m_emissive_factor;
+    gl_FragColor = vec4(toneMap(color), 1.0);
+}
+/************************************************************************/
+
+#endif
@@ -162,20 +162,119 @@ mediump vec3 getNormal()
 #ifdef VERTEX_SHADER
 
 /************************************************************************/
+#ifndef FACES
 attribute highp   vec3 a_pos;
-attribute mediump vec3 a_normal;
-attribute mediump vec3 a_tangent;
 attribute mediump vec3 a_gradient;
 attribute lowp    vec4 a_color;
+#endif
+
+#ifdef FACES
+// Vertex pulling: the quads are given as one voxel_face_t each, and we
+// compute the packed vertices attributes from gl_VertexID, see
+// mesh_pack_faces.
+layout(std430, binding = 0) readonly buffer faces_buffer {
+    uvec2 u_faces[];
+};
+highp   vec3 a_pos;
+mediump vec3 a_gradient;
+lowp    vec4 a_color;
+mediump vec3 a_face_data;
+#elif defined(PACKED_VERTICES)
+// face * 4 + vertex index, shadow mask, borders mask.
+attribute mediump vec3 a_face_data;
+#else
+attribute mediump vec3 a_normal;
+attribute mediump vec3 a_tangent;
 attribute mediump vec2 a_occlusion_uv;
 attribute mediump vec2 a_bump_uv;   // bump tex base coordinates [0,255]
 attribute mediump vec2 a_uv;        // uv coordinates [0,1]
+#endif
 
 // Must match the value in goxel.h
 #define VOXEL_TEXTURE_SIZE 8.0
 
+#ifdef PACKED_VERTICES
+// Must match FACES_NORMALS and FACES_TANGENTS in block_def.h
+mediump vec3 get_face_normal(mediump float f)
+{
+    if (f < 0.5) return vec3(0.0, -1.0, 0.0);
+    if (f < 1.5) return vec3(0.0, +1.0, 0.0);
+    if (f < 2.5) return vec3(0.0, 0.0, -1.0);
+    if (f < 3.5) return vec3(0.0, 0.0, +1.0);
+    if (f < 4.5) return vec3(+1.0, 0.0, 0.0);
+    return vec3(-1.0, 0.0, 0.0);
+}
+
+mediump vec3 get_face_tangent(mediump float f)
+{
+    if (f < 0.5) return vec3(+1.0, 0.0, 0.0);
+    if (f < 1.5) return vec3(-1.0, 0.0, 0.0);
+    if (f < 4.5) return vec3(0.0, +1.0, 0.0);
+    return vec3(0.0, 0.0, +1.0);
+}
+#endif
+
+#ifdef FACES
+// Must match FACES_VERTICES and VERTICES_POSITIONS in block_def.h
+const vec3 FACES_CORNERS[24] = vec3[24](
+    vec3(0, 0, 0), vec3(1, 0, 0), vec3(1, 0, 1), vec3(0, 0, 1),
+    vec3(1, 1, 0), vec3(0, 1, 0), vec3(0, 1, 1), vec3(1, 1, 1),
+    vec3(0, 0, 0), vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0),
+    vec3(1, 0, 1), vec3(1, 1, 1), vec3(0, 1, 1), vec3(0, 0, 1),
+    vec3(1, 0, 0), vec3(1, 1, 0), vec3(1, 1, 1), vec3(1, 0, 1),
+    vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0));
+// Axis of the faces normals.
+const int FACES_AXIS[6] = int[6](1, 1, 2, 2, 0, 0);
+// Same order as the quads index buffer.
+const int QUAD_CORNERS[6] = int[6](0, 1, 2, 2, 3, 0);
+
+void unpack_face()
+{
+    uvec2 data = u_faces[gl_VertexID / 6];
+    int corner = QUAD_CORNERS[gl_VertexID % 6];
+    int face = int((data.x >> 18) & 7u);
+    int n = FACES_AXIS[face];
+    uint borders = (data.x >> 21) & 255u;
+    vec3 size = vec3(1.0);
+
+    // The quad min corner is already on the face plane.
+    size[n] = 0.0;
+    if ((data.x >> 31) != 0u) {
+        size[(n + 1) % 3] = float(((data.x >> 21) & 31u) + 1u);
+        size[(n + 2) % 3] = float(((data.x >> 26) & 31u) + 1u);
+        borders = 0u;
+    }
+    a_pos = vec3(data.x & 63u, (data.x >> 6) & 63u, (data.x >> 12) & 63u) +
+            FACES_CORNERS[face * 4 + corner] * size;
+    a_color = vec4(vec3(data.y & 255u, (data.y >> 8) & 255u,
+                        (data.y >> 16) & 255u) / 255.0, 1.0);
+    a_face_data = vec3(float(face * 4 + corner), float(data.y >> 24),
+                       float(borders));
+    a_gradient = vec3(0.0);
+}
+#endif
+
 void main()
 {
+#ifdef FACES
+    unpack_face();
+#endif
+#ifdef PACKED_VERTICES
+    // Compute the attributes that are not in the packed vertices.
+    mediump float face = floor(a_face_data.x / 4.0);
+    mediump float corner = a_face_data.x - face * 4.0;
+    mediump vec3 a_normal = get_face_normal(face);
+    mediump vec3 a_tangent = get_face_tangent(face);
+    // Must match VERTICE_UV in block_def.h
+    mediump vec2 a_uv = vec2((corner == 1.0 || corner == 2.0) ? 1.0 : 0.0,
+                             (corner >= 2.0) ? 1.0 : 0.0);
+    mediump vec2 a_occlusion_uv =
+        vec2(mod(a_face_data.y, 16.0), floor(a_face_data.y / 16.0)) *
+        VOXEL_TEXTURE_SIZE + a_uv * (VOXEL_TEXTURE_SIZE - 1.0);
+    mediump vec2 a_bump_uv =
+        vec2(mod(a_face_data.z, 16.0), floor(a_face_data.z / 16.0)) * 16.0;
+#endif
+
     vec4 pos = u_model * vec4(a_pos * u_pos_scale, 1.0);
     v_Position = vec3(pos.xyz) / pos.w;
 
@@ -190,12 +289,12 @@ void main()
 
 #ifdef HAS_TANGENTS
     mediump vec4 tangent = vec4(normalize(a_tangent), 1.0);
-    mediump vec3 normalW = normalize(a_normal);
+    mediump vec3 normalW = normalize(mat3(u_model) * a_normal);
     mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent.xyz, 0.0)));
     mediump vec3 bitangentW = cross(normalW, tangentW) * tangent.w;
     v_TBN = mat3(tangentW, bitangentW, normalW);
 #else
-    v_Normal = normalize(a_normal);
+    v_Normal = normalize(mat3(u_model) * a_normal);
 #endif
 
     v_gradient = a_gradient;
@@ -229,6 +328,12 @@ vec3 toneMap(vec3 color)
 void main()
 {
 
+#ifdef DEPTH_ONLY
+    // Depth pre-pass, only the vertex shader matters.
+    gl_FragColor = vec4(0.0);
+    return;
+#endif
+
 #ifdef ONLY_EDGES
     mediump vec3 n = 2.0 * texture2D(u_normal_sampler, v_UVCoord1).rgb - 1.0;
     if (n.z > 0.75)
@@ -0,0 +1,159 @@
+/*
+ * Generate the packed quads of a block, like mesh_generate_vertices
+ * followed by mesh_pack_vertices.
+ *
+ * Each invocation handles one voxel of the block.  The input is the
+ * (N + 2)^3 voxels cube around the block, one RGBA value per uint, and the
+ * quads are appended to the output buffer, three uints per vertex, using
+ * an atomic counter.
+ *
+ * N, MAX_QUADS, and the FACES_VERTICES, FACES_NEIGHBORS (flattened),
+ * VERTICES_POSITIONS and FACES_NORMALS tables are defined by the caller,
+ * from the values of block_def.h.
+ */
+
+#ifdef COMPUTE_SHADER
+
+layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+layout(std430, binding = 0) readonly buffer Voxels {
+    uint voxels[];
+};
+
+layout(std430, binding = 1) writeonly buffer Vertices {
+    uint vertices[];
+};
+
+layout(std430, binding = 2) buffer Counter {
+    uint nb_quads;
+};
+
+uniform int u_flat_faces;
+
+const int S = N + 2;
+
+uint get_voxel(ivec3 p)
+{
+    return voxels[((p.z + 1) * S + (p.y + 1)) * S + (p.x + 1)];
+}
+
+// Bit index of a neighbor, like in mesh_to_vertices.c.
+int nbit(ivec3 d)
+{
+    return (d.x + 1) + (d.y + 1) * 3 + (d.z + 1) * 9;
+}
+
+bool has(uint mask, ivec3 d)
+{
+    return (mask & (1u << nbit(d))) != 0u;
+}
+
+// Direction of the corner of a face vertex.
+ivec3 corner_dir(int f, int i)
+{
+    ivec3 n = FACES_NORMALS[f];
+    ivec3 c = VERTICES_POSITIONS[FACES_VERTICES[f * 4 + i]] * 2 - 1;
+    return c * (1 - abs(n)) + n;
+}
+
+// Direction of the edge e of a face, between the vertices e and e + 1.
+ivec3 edge_dir(int f, int e)
+{
+    return (corner_dir(f, e) + corner_dir(f, (e + 1) % 4)) / 2;
+}
+
+uint get_shadow_mask(uint mask, int f)
+{
+    int i;
+    uint ret = 0u;
+    bool e0, e1;
+    for (i = 0; i < 4; i++) {
+        e0 = has(mask, edge_dir(f, (i + 3) % 4));
+        e1 = has(mask, edge_dir(f, i));
+        if (e0 || e1 || has(mask, corner_dir(f, i))) ret |= 1u << i;
+        if (e1) ret |= 0x10u << i;
+    }
+    return ret;
+}
+
+uint get_border_mask(uint mask, int f)
+{
+    int e;
+    uint ret = 0u;
+    ivec3 n, t;
+    for (e = 0; e < 4; e++) {
+        n = FACES_NORMALS[f];
+        t = FACES_NORMALS[FACES_NEIGHBORS[f * 4 + e]];
+        if (has(mask, n + t)) {
+            ret |= 2u << (2 * e);
+        } else if (!has(mask, t)) {
+            ret |= 1u << (2 * e);
+        }
+    }
+    return ret;
+}
+
+// Same as the integer division by smax in C, that rounds toward zero.
+int scale_gradient(int s, int smax)
+{
+    return sign(s) * (abs(s) * 127 / smax);
+}
+
+void main()
+{
+    ivec3 pos = ivec3(gl_GlobalInvocationID);
+    ivec3 d, g, vpos;
+    uint v, a, mask = 0u, shadow, borders, q, w0, w1, w2;
+    int f, i, k, smax;
+    uint alphas[27];
+
+    v = get_voxel(pos);
+    if ((v >> 24) < 127u) return;
+    k = 0;
+    for (d.z = -1; d.z <= 1; d.z++)
+    for (d.y = -1; d.y <= 1; d.y++)
+    for (d.x = -1; d.x <= 1; d.x++, k++) {
+        a = get_voxel(pos + d) >> 24;
+        alphas[k] = a;
+        if (a >= 127u) mask |= 1u << k;
+    }
+
+    // Gradient of the alpha values of the solid neighbors.
+    g = ivec3(0);
+    k = 0;
+    for (d.z = -1; d.z <= 1; d.z++)
+    for (d.y = -1; d.y <= 1; d.y++)
+    for (d.x = -1; d.x <= 1; d.x++, k++) {
+        if ((mask & (1u << k)) != 0u) g -= int(alphas[k]) * d;
+    }
+    smax = max(abs(g.x), max(abs(g.y), abs(g.z)));
+
+    for (f = 0; f < 6; f++) {
+        if (has(mask, FACES_NORMALS[f])) continue;
+        if (u_flat_faces != 0 || smax == 0) {
+            d = FACES_NORMALS[f];
+        } else {
+            d = ivec3(scale_gradient(g.x, smax), scale_gradient(g.y, smax),
+                      scale_gradient(g.z, smax));
+        }
+        shadow = u_flat_faces != 0 ? 0u : get_shadow_mask(mask, f);
+        borders = get_border_mask(mask, f);
+        q = atomicAdd(nb_quads, 1u);
+        if (q >= uint(MAX_QUADS)) return;
+        // Same layout as voxel_packed_vertex_t.
+        w1 = shadow | (borders << 8) | ((v & 0xffu) << 16) |
+             (((v >> 8) & 0xffu) << 24);
+        w2 = ((v >> 16) & 0xffu) | (uint(d.x & 0xff) << 8) |
+             (uint(d.y & 0xff) << 16) | (uint(d.z & 0xff) << 24);
+        for (i = 0; i < 4; i++) {
+            vpos = pos + VERTICES_POSITIONS[FACES_VERTICES[f * 4 + i]];
+            w0 = uint(vpos.x) | (uint(vpos.y) << 8) | (uint(vpos.z) << 16) |
+                 (uint(f * 4 + i) << 24);
+            vertices[(q * 4u + uint(i)) * 3u + 0u] = w0;
+            vertices[(q * 4u + uint(i)) * 3u + 1u] = w1;
+            vertices[(q * 4u + uint(i)) * 3u + 2u] = w2;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * Apply a painter shape to a batch of blocks, like op_block in
+ * mesh_utils.c, or merge two batches of blocks, like merge_block, if MERGE
+ * is defined.
+ *
+ * Each invocation handles one voxel, and the voxels are updated in place,
+ * one RGBA value per uint.  The float operations of the GPU don't always
+ * round like the CPU ones, so the voxels whose value could depend on the
+ * rounding are left unchanged and flagged as uncertain, for the caller to
+ * compute them on the CPU.  Each block has FLAGS_SIZE uints of flags: the
+ * first one has the bit 1 set if any voxel changed and the bit 2 set if any
+ * voxel is uncertain, followed by one uncertain bit per voxel.
+ *
+ * N, FLAGS_SIZE, ERR_SCALE, and the MODE_ and SHAPE_ values are defined by
+ * the caller.
+ */
+
+#ifdef COMPUTE_SHADER
+
+layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+layout(std430, binding = 0) buffer Voxels {
+    uint voxels[];
+};
+
+layout(std430, binding = 1) readonly buffer Others {
+    uint others[];
+};
+
+layout(std430, binding = 2) readonly buffer Positions {
+    ivec4 positions[];
+};
+
+layout(std430, binding = 3) buffer Flags {
+    uint flags[];
+};
+
+uniform int u_mode;
+uniform vec4 u_color; // In the 0-255 range.
+uniform int u_use_color;
+
+uniform mat4 u_mat;
+uniform vec3 u_size;
+uniform float u_smoothness;
+uniform int u_shape;
+uniform int u_use_box;
+uniform vec3 u_box_min;
+uniform vec3 u_box_max;
+uniform int u_skip_src_empty;
+uniform int u_skip_dst_empty;
+
+bool g_uncertain;
+float g_err; // Tolerance on the shape function values.
+
+uvec4 unpack(uint v)
+{
+    return uvec4(v & 0xffu, (v >> 8) & 0xffu, (v >> 16) & 0xffu, v >> 24);
+}
+
+uint pack(uvec4 v)
+{
+    return v.r | (v.g << 8) | (v.b << 16) | (v.a << 24);
+}
+
+// Convert a float to an uint8_t like the CPU, that could round x
+// differently if it is close to an integer.
+uint to_u8(float x)
+{
+    if (abs(x - round(x)) < 1e-3) g_uncertain = true;
+    return uint(x);
+}
+
+uint mix_u8(uint x, uint y, uint a)
+{
+    precise float t, v;
+    if (a == 0u) return x;
+    if (a == 255u) return y;
+    t = float(a) / 255.0;
+    v = (1.0 - t) * float(x) + t * float(y);
+    return to_u8(v);
+}
+
+uvec4 combine(uvec4 a, uvec4 b, int mode)
+{
+    uint aa = a.a, ba = b.a, d;
+    uvec4 ret = a;
+    if (mode == MODE_PAINT) {
+        ret.r = mix_u8(a.r, b.r, ba);
+        ret.g = mix_u8(a.g, b.g, ba);
+        ret.b = mix_u8(a.b, b.b, ba);
+    } else if (mode == MODE_OVER) {
+        d = 255u * ba + aa * (255u - ba);
+        if (d != 0u)
+            ret.rgb = (255u * b.rgb * ba + a.rgb * aa * (255u - ba)) / d;
+        ret.a = ba + aa * (255u - ba) / 255u;
+    } else if (mode == MODE_SUB) {
+        ret.a = aa > ba ? aa - ba : 0u;
+    } else if (mode == MODE_MAX) {
+        ret = uvec4(b.rgb, max(aa, ba));
+    } else if (mode == MODE_SUB_CLAMP) {
+        ret.a = min(aa, 255u - ba);
+    } else if (mode == MODE_MULT_ALPHA) {
+        ret = ret * ba / 255u;
+    } else if (mode == MODE_INTERSECT) {
+        ret.a = min(aa, ba);
+    }
+    return ret;
+}
+
+// Flag the voxel if x is close to a threshold compared exactly on the CPU.
+void check_threshold(float x, float t)
+{
+    if (abs(x - t) < g_err) g_uncertain = true;
+}
+
+float sphere_func(vec3 p, vec3 s)
+{
+    float d = length(p);
+    float r;
+    // The CPU uses a special value at the center.
+    if (d < g_err) {
+        g_uncertain = true;
+        return 0.0;
+    }
+    r = s.x * s.y * s.z / length(vec3(s.y * s.z * p.x / d,
+                                      s.x * s.z * p.y / d,
+                                      s.x * s.y * p.z / d));
+    return r - d;
+}
+
+float cube_func(vec3 p, vec3 s, float sm)
+{
+    const float INF = uintBitsToFloat(0x7f800000u);
+    float min_v = INF, min_v2 = INF, ret = INF, v;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        check_threshold(p[i], -s[i] - sm);
+        check_threshold(p[i], +s[i] + sm);
+        check_threshold(p[i], -s[i] + sm);
+        check_threshold(p[i], +s[i] - sm);
+    }
+    // Outside the max cube, or inside the min cube.
+    if (any(lessThan(p, -s - sm)) || any(greaterThanEqual(p, s + sm)))
+        return -INF;
+    if (all(greaterThanEqual(p, -s + sm)) && all(lessThan(p, s - sm)))
+        return +INF;
+
+    for (i = 0; i < 3; i++) {
+        // The CPU ignores the null coordinates.
+        check_threshold(p[i], 0.0);
+        if (p[i] == 0.0) continue;
+        v = s[i] / abs(p[i]);
+        if (v < min_v) {
+            min_v2 = min_v;
+            min_v = v;
+            ret = s[i] - abs(p[i]);
+        } else {
+            min_v2 = min(min_v2, v);
+        }
+    }
+    // The CPU could pick an other axis.
+    if (min_v2 - min_v <= 1e-4 * min_v) g_uncertain = true;
+    return ret;
+}
+
+float cylinder_func(vec3 p, vec3 s)
+{
+    float d = length(p.xy);
+    float rz = s.z - abs(p.z);
+    float r;
+    // The CPU uses a special value on the axis.
+    if (d < g_err) {
+        g_uncertain = true;
+        return 0.0;
+    }
+    r = s.x * s.y / length(vec2(s.y * p.x / d, s.x * p.y / d));
+    return min(rz, r - d);
+}
+
+float shape_func(vec3 p)
+{
+    if (u_shape == SHAPE_SPHERE) return sphere_func(p, u_size);
+    if (u_shape == SHAPE_CUBE) return cube_func(p, u_size, u_smoothness);
+    return cylinder_func(p, u_size);
+}
+
+// Alpha of the painter color for a given value of the shape function,
+// or -1 if the voxel is skipped, like op_voxel_color.
+int get_alpha(float k)
+{
+    precise float v, a;
+    if (u_smoothness != 0.0)
+        v = clamp(k / u_smoothness, -1.0, 1.0) / 2.0 + 0.5;
+    else
+        v = (k >= 0.0) ? 1.0 : 0.0;
+    if (v == 0.0 && u_skip_src_empty != 0) return -1;
+    a = u_color.a * v;
+    if (uint(a) == 0u && u_skip_src_empty != 0) return -1;
+    return int(a);
+}
+
+// Compute the new value of a voxel of a block, or return false if it is
+// left unchanged.
+bool apply_shape(ivec3 vp, int x, uvec4 value, out uvec4 ret)
+{
+    precise vec3 q, p, dp;
+    float k;
+    int alpha, alpha2;
+
+    // Same as mat4_mul_vec3 of the row start, followed by the shape row
+    // function increments.
+    q = vec3(float(vp.x - x) + 0.5, float(vp.y) + 0.5, float(vp.z) + 0.5);
+    p = ((u_mat[0].xyz * q.x + u_mat[1].xyz * q.y) + u_mat[2].xyz * q.z) +
+        u_mat[3].xyz;
+    dp = u_mat[0].xyz;
+    p = p + float(x) * dp;
+
+    q = vec3(vp) + 0.5;
+    if (    u_use_box != 0 &&
+            !(all(greaterThanEqual(q, u_box_min)) &&
+              all(lessThan(q, u_box_max))))
+        return false;
+
+    g_err = ERR_SCALE * (1.0 + max(abs(p.x), max(abs(p.y), abs(p.z))) +
+                         max(u_size.x, max(u_size.y, u_size.z)) +
+                         u_smoothness);
+    // The alpha only increases with k, so if it is the same at both ends of
+    // the tolerance range, it is also the value of the CPU.
+    k = shape_func(p);
+    alpha = get_alpha(k - g_err);
+    alpha2 = get_alpha(k + g_err);
+    if (alpha != alpha2) g_uncertain = true;
+    if (alpha == -1 || g_uncertain) return false;
+    if (value.a == 0u && u_skip_dst_empty != 0) return false;
+    ret = combine(value, uvec4(u_color.rgb, uint(alpha)), u_mode);
+    return true;
+}
+
+void main()
+{
+    ivec3 gid = ivec3(gl_GlobalInvocationID);
+    int b = gid.z / N;
+    ivec3 pos = ivec3(gid.x, gid.y, gid.z % N);
+    int i = (pos.z * N + pos.y) * N + pos.x;
+    uint idx = uint(b * N * N * N + i);
+    uvec4 value = unpack(voxels[idx]), ret, c;
+
+    g_uncertain = false;
+#ifdef MERGE
+    c = unpack(others[idx]);
+    if (u_use_color != 0) c = c * uvec4(u_color) / 255u;
+    ret = combine(value, c, u_mode);
+#else
+    if (!apply_shape(positions[b].xyz + pos, pos.x, value, ret) &&
+            !g_uncertain)
+        return;
+#endif
+    if (g_uncertain) {
+        atomicOr(flags[b * FLAGS_SIZE], 2u);
+        atomicOr(flags[b * FLAGS_SIZE + 1 + i / 32], 1u << uint(i % 32));
+        return;
+    }
+    if (ret == value) return;
+    voxels[idx] = pack(ret);
+    atomicOr(flags[b * FLAGS_SIZE], 1u);
+}
+
+#endif
@@ -1,20 +1,37 @@
+#ifdef PACKED_VERTICES
+// The voxel position is computed per fragment from the face position.
+varying mediump vec3  v_pos;
+varying mediump float v_face;
+#else
 varying lowp  vec2 v_pos_data;
+#endif
 uniform highp mat4 u_model;
 uniform highp mat4 u_view;
 uniform highp mat4 u_proj;
-uniform lowp  vec2 u_block_id;
+// Bits 0-15 of the block id in x and y, bit 16 in z.
+uniform mediump vec3 u_block_id;
 
 #ifdef VERTEX_SHADER
 
 /************************************************************************/
 attribute highp vec3 a_pos;
+
+#ifdef PACKED_VERTICES
+attribute mediump vec3 a_face_data;
+#else
 attribute lowp  vec2 a_pos_data;
+#endif
 
 void main()
 {
     highp vec3 pos = a_pos;
     gl_Position = u_proj * u_view * u_model * vec4(pos, 1.0);
+#ifdef PACKED_VERTICES
+    v_pos = a_pos;
+    v_face = floor(a_face_data.x / 4.0);
+#else
     v_pos_data = a_pos_data;
+#endif
 }
 /************************************************************************/
 
@@ -23,10 +40,41 @@ void main()
 #ifdef FRAGMENT_SHADER
 
 /************************************************************************/
+#ifdef PACKED_VERTICES
+// Must match FACES_NORMALS in block_def.h
+mediump vec3 get_face_normal(mediump float f)
+{
+    if (f < 0.5) return vec3(0.0, -1.0, 0.0);
+    if (f < 1.5) return vec3(0.0, +1.0, 0.0);
+    if (f < 2.5) return vec3(0.0, 0.0, -1.0);
+    if (f < 3.5) return vec3(0.0, 0.0, +1.0);
+    if (f < 4.5) return vec3(+1.0, 0.0, 0.0);
+    return vec3(-1.0, 0.0, 0.0);
+}
+#endif
+
 void main()
 {
-    gl_FragColor.rg = u_block_id;
-    gl_FragColor.ba = v_pos_data;
+    gl_FragColor.rg = u_block_id.xy;
+#ifdef PACKED_VERTICES
+    // Same packing as get_pos_data in mesh_to_vertices.c.
+    mediump float f = floor(v_face + 0.5);
+#ifndef BLOCK_SIZE_32
+    mediump vec3 p = clamp(floor(v_pos - get_face_normal(f) * 0.5),
+                           0.0, 15.0);
+#else
+    // Add the 16^3 cube of the voxel to the low bits of the block id.
+    mediump vec3 p = clamp(floor(v_pos - get_face_normal(f) * 0.5),
+                           0.0, 31.0);
+    mediump vec3 s = floor(p / 16.0);
+    p -= s * 16.0;
+    gl_FragColor.r += (s.x + s.y * 2.0 + s.z * 4.0) / 255.0;
+#endif
+    gl_FragColor.ba = vec2(p.z * 16.0 + f + u_block_id.z * 8.0,
+                           p.x * 16.0 + p.y) / 255.0;
+#else
+    gl_FragColor.ba = v_pos_data + vec2(u_block_id.z * 8.0 / 255.0, 0.0);
+#endif
 }
 /************************************************************************/
 
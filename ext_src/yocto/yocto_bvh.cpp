@@ -1072,6 +1072,10 @@ void build_bvh(bvh_scene& scene, const bvh_params& params) {
   }
 #endif
 
+  build_instances_bvh(scene, params);
+}
+
+void build_instances_bvh(bvh_scene& scene, const bvh_params& params) {
   // build primitives
   auto prims = vector<bvh_prim>(scene.instances.size());
   for (auto idx = 0; idx < prims.size(); idx++) {
@@ -1161,7 +1165,7 @@ void refit_bvh(bvh_scene& scene, const vector<int>& updated_shapes,
       }
     } else {
       for (auto idx = 0; idx < node.num; idx++) {
-        auto& instance = scene.instances[idx];
+        auto& instance = scene.instances[node.prims[idx]];
         auto& sbvh     = scene.shapes[instance.shape];
         auto  bbox     = sbvh.nodes.empty()
                         ? invalidb3f
@@ -1285,6 +1289,11 @@ bool intersect_bvh(const bvh_shape& shape, const ray3f& ray_, int& element,
 bool intersect_bvh(const bvh_scene& scene, const ray3f& ray_, int& instance,
     int& element, vec2f& uv, float& distance, bool find_any,
     bool non_rigid_frames) {
+  // call the custom intersection if needed
+  if (scene.intersect) {
+    return scene.intersect(ray_, instance, element, uv, distance, find_any);
+  }
+
 #if YOCTO_EMBREE
   // call Embree if needed
   if (scene.embree_bvh) {
@@ -90,6 +90,7 @@
 #include "yocto_math.h"
 
 #include <atomic>
+#include <functional>
 
 // -----------------------------------------------------------------------------
 // BVH FOR RAY INTERSECTION AND CLOSEST ELEMENT
@@ -193,6 +194,11 @@ struct bvh_scene {
   // nodes
   vector<bvh_node> nodes = {};
 
+  // optional custom intersection, used instead of the nodes
+  std::function<bool(const ray3f& ray, int& instance, int& element,
+      vec2f& uv, float& distance, bool find_any)>
+      intersect = {};
+
 #if YOCTO_EMBREE
   // Embree opaque data
   void* embree_bvh       = nullptr;
@@ -243,6 +249,8 @@ inline bvh_scene make_instances_bvh(
 // Build the bvh acceleration structure.
 void build_bvh(bvh_shape& bvh, const bvh_params& params);
 void build_bvh(bvh_scene& bvh, const bvh_params& params);
+// Build only the top-level bvh, using the already built shapes bvh.
+void build_instances_bvh(bvh_scene& bvh, const bvh_params& params);
 
 // Refit bvh data
 void refit_bvh(bvh_shape& bvh, const bvh_params& params);
@@ -1091,8 +1091,7 @@ float sample_light_pdf(const yocto_scene& scene, const trace_lights& lights,
 vec3f sample_lights(const yocto_scene& scene, const trace_lights& lights,
     const bvh_scene& bvh, const vec3f& position, float rl, float rel,
     const vec2f& ruv) {
-  auto light_id = sample_uniform(
-      lights.instances.size() + lights.environments.size(), rl);
+  auto light_id = sample_discrete(lights.lights_cdf, rl);
   if (light_id < lights.instances.size()) {
     auto instance = lights.instances[light_id];
     return sample_light(scene, lights, instance, position, rel, ruv);
@@ -1103,18 +1102,40 @@ vec3f sample_lights(const yocto_scene& scene, const trace_lights& lights,
   }
 }
 
-// Sample lights pdf
+// Sample lights pdf. Instead of intersecting each light instance, we walk
+// all the intersections along the direction once, so that the cost does
+// not depend on the number of lights.
 float sample_lights_pdf(const yocto_scene& scene, const trace_lights& lights,
     const bvh_scene& bvh, const vec3f& position, const vec3f& direction) {
   auto pdf = 0.0f;
-  for (auto instance : lights.instances) {
-    pdf += sample_light_pdf(scene, lights, instance, bvh, position, direction);
+  if (!lights.instances.empty()) {
+    auto next_position = position;
+    for (auto bounce = 0; bounce < 100; bounce++) {
+      auto isec = intersect_bvh(bvh, {next_position, direction});
+      if (!isec.hit) break;
+      auto& instance      = scene.instances[isec.instance];
+      auto light_position = eval_position(
+          scene, instance, isec.element, isec.uv);
+      auto prob = lights.instances_pdf[isec.instance] /
+                  lights.lights_cdf.back();
+      if (prob > 0) {
+        auto light_normal = eval_normal(
+            scene, instance, isec.element, isec.uv, trace_non_rigid_frames);
+        // prob triangle * area triangle = area triangle mesh
+        auto area = lights.shape_cdfs[instance.shape].back();
+        pdf += prob * distance_squared(light_position, position) /
+               (abs(dot(light_normal, direction)) * area);
+      }
+      next_position = light_position + direction * 1e-3f;
+    }
   }
-  for (auto environment : lights.environments) {
-    pdf += sample_environment_pdf(scene, lights, environment, direction);
+  for (auto idx = 0; idx < lights.environments.size(); idx++) {
+    auto prob = sample_discrete_pdf(
+                    lights.lights_cdf, (int)lights.instances.size() + idx) /
+                lights.lights_cdf.back();
+    pdf += prob * sample_environment_pdf(
+                      scene, lights, lights.environments[idx], direction);
   }
-  pdf *= sample_uniform_pdf(
-      lights.instances.size() + lights.environments.size());
   return pdf;
 }
 
@@ -1619,6 +1640,38 @@ void make_trace_state(
   }
 }
 
+// Init the lights selection cdf. With many emissive instances, like the
+// blocks of a glowing voxels layer, picking the lights uniformly wastes
+// most samples on the small ones, so each emissive material is picked
+// like a single light, and then its instances by area.
+static void init_lights_cdf(trace_lights& lights, const yocto_scene& scene) {
+  auto material_areas = vector<float>(scene.materials.size(), 0);
+  for (auto idx : lights.instances) {
+    auto& instance = scene.instances[idx];
+    material_areas[instance.material] +=
+        lights.shape_cdfs[instance.shape].back();
+  }
+  auto nb_groups = (int)lights.environments.size();
+  for (auto area : material_areas) nb_groups += area > 0 ? 1 : 0;
+  lights.lights_cdf.clear();
+  lights.instances_pdf.assign(scene.instances.size(), 0);
+  auto sum = 0.0f;
+  for (auto idx : lights.instances) {
+    auto& instance = scene.instances[idx];
+    auto  area     = material_areas[instance.material];
+    if (area > 0) {
+      lights.instances_pdf[idx] = lights.shape_cdfs[instance.shape].back() /
+                                  (area * nb_groups);
+    }
+    sum += lights.instances_pdf[idx];
+    lights.lights_cdf.push_back(sum);
+  }
+  for (auto idx = 0; idx < lights.environments.size(); idx++) {
+    sum += 1.0f / nb_groups;
+    lights.lights_cdf.push_back(sum);
+  }
+}
+
 // Init trace lights
 trace_lights make_trace_lights(const yocto_scene& scene) {
   auto lights = trace_lights{};
@@ -1642,6 +1695,7 @@ trace_lights make_trace_lights(const yocto_scene& scene) {
           sample_environment_cdf(scene, environment);
     }
   }
+  init_lights_cdf(lights, scene);
   return lights;
 }
 void make_trace_lights(trace_lights& lights, const yocto_scene& scene) {
@@ -1666,6 +1720,7 @@ void make_trace_lights(trace_lights& lights, const yocto_scene& scene) {
           lights.environment_cdfs[environment.emission_tex]);
     }
   }
+  init_lights_cdf(lights, scene);
 }
 
 // Progressively compute an image by calling trace_samples multiple times.
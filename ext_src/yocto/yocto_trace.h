@@ -92,6 +92,12 @@ struct trace_lights {
   vector<int>           environments     = {};
   vector<vector<float>> shape_cdfs       = {};
   vector<vector<float>> environment_cdfs = {};
+  // lights selection cdf, over the instances then the environments; the
+  // emissive materials and the environments are picked uniformly, and the
+  // instances of a material proportionally to their area
+  vector<float> lights_cdf = {};
+  // selection probability of each scene instance, zero if not a light
+  vector<float> instances_pdf = {};
 
   bool empty() const { return instances.empty() && environments.empty(); }
 };
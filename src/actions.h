@@ -39,12 +39,17 @@ enum {
     X(img_unclone_layer),
     X(img_select_parent_layer),
     X(img_merge_visible_layers),
+    X(img_add_frame),
+    X(img_del_frame),
+    X(img_next_frame),
+    X(img_previous_frame),
     X(img_new_camera),
     X(img_del_camera),
     X(img_move_camera_up),
     X(img_move_camera_down),
     X(img_image_layer_to_mesh),
     X(img_new_shape_layer),
+    X(img_new_procedural_layer),
     X(img_new_material),
     X(img_del_material),
     X(img_auto_resize),
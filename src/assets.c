@@ -18,6 +18,8 @@
 
 #include "goxel.h"
 
+#include <pthread.h>
+
 typedef struct {
     const char      *path;
     int             size;
@@ -26,15 +28,48 @@ typedef struct {
 
 static asset_t ASSETS[]; // Defined in assets.inl
 
-const void *assets_get(const char *url, int *size)
+// The assets sorted by path, for the binary search in assets_get.
+static const asset_t **g_index = NULL;
+static int g_index_size = 0;
+static pthread_once_t g_index_once = PTHREAD_ONCE_INIT;
+
+// Sort by path, then by position in the list, so that we return the first
+// asset if several have the same path.
+static int asset_cmp(const void *a_, const void *b_)
+{
+    const asset_t *a = *(const asset_t**)a_, *b = *(const asset_t**)b_;
+    int r = strcmp(a->path, b->path);
+    if (r) return r;
+    return a < b ? -1 : a > b ? +1 : 0;
+}
+
+static void index_init(void)
 {
     int i;
+    for (i = 0; ASSETS[i].path; i++) {}
+    g_index_size = i;
+    g_index = calloc(g_index_size, sizeof(*g_index));
+    for (i = 0; i < g_index_size; i++) g_index[i] = &ASSETS[i];
+    qsort(g_index, g_index_size, sizeof(*g_index), asset_cmp);
+}
+
+const void *assets_get(const char *url, int *size)
+{
+    int lo, hi, mid, r;
+    pthread_once(&g_index_once, index_init);
     if (str_startswith(url, "asset://")) url += 8; // Skip asset://
-    for (i = 0; ASSETS[i].path; i++) {
-        if (strcmp(ASSETS[i].path, url) == 0) {
-            if (size) *size = ASSETS[i].size;
-            return ASSETS[i].data;
+    lo = 0;
+    hi = g_index_size - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        r = strcmp(g_index[mid]->path, url);
+        if (r == 0) {
+            while (mid > 0 && strcmp(g_index[mid - 1]->path, url) == 0) mid--;
+            if (size) *size = g_index[mid]->size;
+            return g_index[mid]->data;
         }
+        if (r < 0) lo = mid + 1;
+        else hi = mid - 1;
     }
     return NULL;
 }
@@ -18,7 +18,7 @@
 
 /* This file is autogenerated by tools/create_assets.py */
 
-{.path = "data/other/povray_template.pov", .size = 748, .data =
+{.path = "data/other/povray_template.pov", .size = 643, .data =
     "// Generated from goxel {{version}}\n"
     "// https://github.com/guillaumechereau/goxel\n"
     "\n"
@@ -35,12 +35,10 @@
     "}\n"
     "{{/camera}}\n"
     "\n"
-    "#declare Voxel = box {<-0.5, -0.5, -0.5>, <0.5, 0.5, 0.5>}\n"
-    "#macro Vox(Pos, Color)\n"
-    "    object {\n"
-    "        Voxel\n"
-    "        translate Pos\n"
-    "        translate <0.5, 0.5, 0.5>\n"
+    "// A box of voxels of the same color.\n"
+    "#macro Vox(Pos, Size, Color)\n"
+    "    box {\n"
+    "        Pos, Pos + Size\n"
     "        texture { pigment {color rgb Color / 255} }\n"
     "    }\n"
     "#end\n"
@@ -55,9 +53,7 @@
     "{{/light}}\n"
     "\n"
     "union {\n"
-    "{{#voxels}}\n"
-    "    Vox({{pos}}, {{color}})\n"
-    "{{/voxels}}\n"
+    "{{voxels}}\n"
     "}\n"
     ""
 },
@@ -48,7 +48,408 @@
     "#endif\n"
     ""
 },
-{.path = "data/shaders/mesh.glsl", .size = 8877, .data =
+{.path = "data/shaders/bricks.glsl", .size = 13368, .data =
+    "/*\n"
+    " * Ray march the voxels of a mesh brick map (see brickmap.h).\n"
+    " *\n"
+    " * We render the back faces of the grid box, and for each fragment march\n"
+    " * the camera ray through the grid cells, skipping the empty blocks, then\n"
+    " * through the voxels of the non empty blocks bricks.  The lighting is the\n"
+    " * same as in mesh.glsl, with the occlusion computed from the neighbor\n"
+    " * voxels of the hit face.\n"
+    " *\n"
+    " * The marching is done in the mesh space, where the voxels have a size\n"
+    " * of one.\n"
+    " *\n"
+    " * With SELECTION, the mesh is a selection mask, and we only output an\n"
+    " * outline along the edges of the selected faces, and a screen space hatch\n"
+    " * pattern inside them.\n"
+    " */\n"
+    "\n"
+    "uniform highp mat4  u_model;\n"
+    "uniform highp mat4  u_view;\n"
+    "uniform highp mat4  u_proj;\n"
+    "uniform highp vec3  u_camera;\n"
+    "uniform highp vec3  u_local_camera; // Camera position in the mesh space.\n"
+    "\n"
+    "// Brick map.\n"
+    "uniform highp sampler3D u_grid_tex;\n"
+    "uniform highp sampler3D u_pool_tex;\n"
+    "uniform highp vec3  u_grid_origin;\n"
+    "uniform highp vec3  u_grid_size;    // In blocks.\n"
+    "uniform highp vec3  u_pool_size;    // In bricks.\n"
+    "uniform highp float u_block_size;\n"
+    "\n"
+    "// Light parameters\n"
+    "uniform lowp    vec3  u_l_dir;\n"
+    "uniform lowp    float u_l_int;\n"
+    "uniform lowp    float u_l_amb; // Ambient light coef.\n"
+    "\n"
+    "// Material parameters\n"
+    "uniform lowp float u_m_metallic;\n"
+    "uniform lowp float u_m_roughness;\n"
+    "uniform lowp vec4  u_m_base_color;\n"
+    "uniform lowp vec3  u_m_emissive_factor;\n"
+    "\n"
+    "uniform mediump float u_occlusion_strength;\n"
+    "\n"
+    "#ifdef SHADOW\n"
+    "uniform highp   mat4      u_shadow_mvp;\n"
+    "uniform mediump sampler2D u_shadow_tex;\n"
+    "uniform mediump float     u_shadow_strength;\n"
+    "#endif\n"
+    "\n"
+    "varying highp vec3 v_pos;\n"
+    "\n"
+    "#ifdef VERTEX_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "attribute highp vec3 a_pos;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    v_pos = u_grid_origin + a_pos * u_grid_size * u_block_size;\n"
+    "    gl_Position = u_proj * u_view * u_model * vec4(v_pos, 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FRAGMENT_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "const mediump float M_PI = 3.141592653589793;\n"
+    "// Larger than the diagonal of the biggest grid.\n"
+    "const int MAX_BLOCK_STEPS = 1024;\n"
+    "// Larger than the diagonal of the biggest blocks.\n"
+    "const int MAX_VOXEL_STEPS = 96;\n"
+    "\n"
+    "// Same as in mesh.glsl.\n"
+    "mediump vec3 F_Schlick(mediump vec3 f0, mediump float LdotH)\n"
+    "{\n"
+    "    mediump float fresnel = exp2((-5.55473 * LdotH - 6.98316) * LdotH);\n"
+    "    return (1.0 - f0) * fresnel + f0;\n"
+    "}\n"
+    "\n"
+    "mediump float V_GGX(mediump float NdotL, mediump float NdotV,\n"
+    "                    mediump float alpha)\n"
+    "{\n"
+    "    mediump float a = alpha;\n"
+    "    mediump float GGXV = NdotL * (NdotV * (1.0 - a) + a);\n"
+    "    mediump float GGXL = NdotV * (NdotL * (1.0 - a) + a);\n"
+    "    return 0.5 / (GGXV + GGXL);\n"
+    "}\n"
+    "\n"
+    "mediump float D_GGX(mediump float NdotH, mediump float alpha)\n"
+    "{\n"
+    "    mediump float a2 = alpha * alpha;\n"
+    "    mediump float f = (NdotH * a2 - NdotH) * NdotH + 1.0;\n"
+    "    return a2 / (M_PI * f * f);\n"
+    "}\n"
+    "\n"
+    "mediump vec3 compute_light(mediump vec3 L,\n"
+    "                           mediump float light_intensity,\n"
+    "                           mediump float light_ambient,\n"
+    "                           mediump vec3 base_color,\n"
+    "                           mediump float metallic,\n"
+    "                           mediump float roughness,\n"
+    "                           mediump vec3 N, mediump vec3 V)\n"
+    "{\n"
+    "    mediump vec3 H = normalize(L + V);\n"
+    "\n"
+    "    mediump float NdotL = clamp(dot(N, L), 0.0, 1.0);\n"
+    "    mediump float NdotV = clamp(dot(N, V), 0.0, 1.0);\n"
+    "    mediump float NdotH = clamp(dot(N, H), 0.0, 1.0);\n"
+    "    mediump float LdotH = clamp(dot(L, H), 0.0, 1.0);\n"
+    "\n"
+    "    mediump float a_roughness = roughness * roughness;\n"
+    "    mediump vec3 f0 = vec3(0.04);\n"
+    "    mediump vec3 diffuse_color = base_color * (vec3(1.0) - f0) * (1.0 - metallic);\n"
+    "    mediump vec3 specular_color = mix(f0, base_color, metallic);\n"
+    "    mediump vec3  F   = F_Schlick(specular_color, LdotH);\n"
+    "    mediump float Vis = V_GGX(NdotL, NdotV, a_roughness);\n"
+    "    mediump float D   = D_GGX(NdotH, a_roughness);\n"
+    "    mediump vec3 diffuseContrib = (1.0 - F) * (diffuse_color / M_PI);\n"
+    "    mediump vec3 specContrib = F * (Vis * D);\n"
+    "    mediump vec3 shade = NdotL * (diffuseContrib + specContrib);\n"
+    "    shade = max(shade, vec3(0.0));\n"
+    "    return light_intensity * shade + light_ambient * base_color;\n"
+    "}\n"
+    "\n"
+    "// Return the grid texel of a block: the brick position and the non empty\n"
+    "// flag in alpha.\n"
+    "highp vec4 get_brick(highp vec3 cell)\n"
+    "{\n"
+    "    return texture3D(u_grid_tex, (cell + 0.5) / u_grid_size);\n"
+    "}\n"
+    "\n"
+    "// Return the value of a voxel in a brick.\n"
+    "lowp vec4 get_brick_voxel(highp vec4 brick, highp vec3 p)\n"
+    "{\n"
+    "    highp vec3 b = floor(brick.rgb * 255.0 + 0.5);\n"
+    "    return texture3D(u_pool_tex, (b * u_block_size + p + 0.5) /\n"
+    "                                 (u_pool_size * u_block_size));\n"
+    "}\n"
+    "\n"
+    "// Return the value of any voxel of the grid.\n"
+    "lowp vec4 get_voxel(highp vec3 p)\n"
+    "{\n"
+    "    highp vec3 cell = floor((p - u_grid_origin) / u_block_size);\n"
+    "    highp vec4 brick;\n"
+    "    if (any(lessThan(cell, vec3(0.0))) ||\n"
+    "        any(greaterThanEqual(cell, u_grid_size))) return vec4(0.0);\n"
+    "    brick = get_brick(cell);\n"
+    "    if (brick.a < 0.5) return vec4(0.0);\n"
+    "    return get_brick_voxel(brick, p - u_grid_origin - cell * u_block_size);\n"
+    "}\n"
+    "\n"
+    "// Same alpha threshold as the meshes.\n"
+    "bool is_solid(lowp vec4 v)\n"
+    "{\n"
+    "    return v.a > 126.5 / 255.0;\n"
+    "}\n"
+    "\n"
+    "float solid(highp vec3 p)\n"
+    "{\n"
+    "    return is_solid(get_voxel(p)) ? 1.0 : 0.0;\n"
+    "}\n"
+    "\n"
+    "// Axis of the smallest component, as a mask.\n"
+    "highp vec3 min_axis(highp vec3 v)\n"
+    "{\n"
+    "    highp vec3 m = step(v, v.yzx) * step(v, v.zxy);\n"
+    "    // In case of equality, only keep one axis.\n"
+    "    if (m.x > 0.0) return vec3(1.0, 0.0, 0.0);\n"
+    "    if (m.y > 0.0) return vec3(0.0, 1.0, 0.0);\n"
+    "    return vec3(0.0, 0.0, 1.0);\n"
+    "}\n"
+    "\n"
+    "/*\n"
+    " * March a ray through the grid.\n"
+    " *\n"
+    " * Return true if we hit a voxel, and set its position, value, the normal\n"
+    " * of the hit face, and the ray distance of the hit.\n"
+    " */\n"
+    "bool ray_march(highp vec3 ro, highp vec3 rd,\n"
+    "               out highp vec3 voxel, out lowp vec4 value,\n"
+    "               out highp vec3 normal, out highp float t)\n"
+    "{\n"
+    "    highp vec3 inv, ta, tb, tsmall, tbig, stp, cell, tmax, tdelta, m;\n"
+    "    highp vec3 vp, vtmax, bmin;\n"
+    "    highp float tfar, texit;\n"
+    "    highp vec4 brick;\n"
+    "    int i, j;\n"
+    "\n"
+    "    inv = 1.0 / rd;\n"
+    "    stp = sign(rd);\n"
+    "\n"
+    "    // Intersection with the grid box.\n"
+    "    bmin = u_grid_origin;\n"
+    "    ta = (bmin - ro) * inv;\n"
+    "    tb = (bmin + u_grid_size * u_block_size - ro) * inv;\n"
+    "    tsmall = min(ta, tb);\n"
+    "    tbig = max(ta, tb);\n"
+    "    t = max(max(tsmall.x, tsmall.y), max(tsmall.z, 0.0));\n"
+    "    tfar = min(min(tbig.x, tbig.y), tbig.z);\n"
+    "    if (t >= tfar) return false;\n"
+    "    normal = t > 0.0 ? -stp * min_axis(-tsmall) : vec3(0.0);\n"
+    "\n"
+    "    // Blocks level.\n"
+    "    cell = clamp(floor((ro + rd * t - bmin) / u_block_size),\n"
+    "                 vec3(0.0), u_grid_size - 1.0);\n"
+    "    tmax = (bmin + (cell + max(stp, 0.0)) * u_block_size - ro) * inv;\n"
+    "    tdelta = u_block_size * abs(inv);\n"
+    "\n"
+    "    for (i = 0; i < MAX_BLOCK_STEPS; i++) {\n"
+    "        brick = get_brick(cell);\n"
+    "        if (brick.a > 0.5) {\n"
+    "            // Voxels level, inside the block.\n"
+    "            texit = min(min(tmax.x, tmax.y), tmax.z);\n"
+    "            vp = clamp(floor(ro + rd * t - bmin - cell * u_block_size),\n"
+    "                       vec3(0.0), vec3(u_block_size - 1.0));\n"
+    "            vtmax = (bmin + cell * u_block_size + vp + max(stp, 0.0) - ro) *\n"
+    "                    inv;\n"
+    "            for (j = 0; j < MAX_VOXEL_STEPS; j++) {\n"
+    "                value = get_brick_voxel(brick, vp);\n"
+    "                if (is_solid(value)) {\n"
+    "                    voxel = bmin + cell * u_block_size + vp;\n"
+    "                    return true;\n"
+    "                }\n"
+    "                m = min_axis(vtmax);\n"
+    "                t = dot(vtmax, m);\n"
+    "                vp += m * stp;\n"
+    "                // Don't rely on texit only, since the voxels of the\n"
+    "                // neighbor bricks in the pool are unrelated.\n"
+    "                if (t >= texit || any(lessThan(vp, vec3(0.0))) ||\n"
+    "                    any(greaterThanEqual(vp, vec3(u_block_size)))) break;\n"
+    "                vtmax += m * abs(inv);\n"
+    "                normal = -m * stp;\n"
+    "            }\n"
+    "        }\n"
+    "        m = min_axis(tmax);\n"
+    "        t = dot(tmax, m);\n"
+    "        if (t >= tfar) return false;\n"
+    "        cell += m * stp;\n"
+    "        tmax += m * tdelta;\n"
+    "        normal = -m * stp;\n"
+    "    }\n"
+    "    return false;\n"
+    "}\n"
+    "\n"
+    "// Occlusion of a face corner from its two sides and corner neighbors.\n"
+    "mediump float corner_occlusion(mediump float s1, mediump float s2,\n"
+    "                               mediump float c)\n"
+    "{\n"
+    "    if (s1 > 0.0 && s2 > 0.0) return 0.0;\n"
+    "    return 1.0 - (s1 + s2 + c) / 3.0;\n"
+    "}\n"
+    "\n"
+    "// Occlusion of a point of a voxel face, from the solid voxels around the\n"
+    "// face, like the occlusion texture of the meshes.\n"
+    "mediump float get_occlusion(highp vec3 voxel, highp vec3 n, highp vec3 p)\n"
+    "{\n"
+    "    highp vec3 q = voxel + n;\n"
+    "    highp vec3 t1 = abs(n.yzx);\n"
+    "    highp vec3 t2 = abs(n.zxy);\n"
+    "    mediump vec2 uv = vec2(fract(dot(p, t1)), fract(dot(p, t2)));\n"
+    "    mediump float s1m, s1p, s2m, s2p, a0, a1, a2, a3;\n"
+    "\n"
+    "    s1m = solid(q - t1);\n"
+    "    s1p = solid(q + t1);\n"
+    "    s2m = solid(q - t2);\n"
+    "    s2p = solid(q + t2);\n"
+    "    a0 = corner_occlusion(s1m, s2m, solid(q - t1 - t2));\n"
+    "    a1 = corner_occlusion(s1p, s2m, solid(q + t1 - t2));\n"
+    "    a2 = corner_occlusion(s1m, s2p, solid(q - t1 + t2));\n"
+    "    a3 = corner_occlusion(s1p, s2p, solid(q + t1 + t2));\n"
+    "    return mix(mix(a0, a1, uv.x), mix(a2, a3, uv.x), uv.y);\n"
+    "}\n"
+    "\n"
+    "#ifdef SELECTION\n"
+    "// Whether the edge of a selected face toward t is on the selection\n"
+    "// outline: the neighbor face is not selected if there is no neighbor\n"
+    "// voxel, or if it is hidden by a voxel in front.\n"
+    "bool is_outline_edge(highp vec3 voxel, highp vec3 n, highp vec3 t)\n"
+    "{\n"
+    "    return solid(voxel + t) == 0.0 || solid(voxel + n + t) == 1.0;\n"
+    "}\n"
+    "\n"
+    "lowp vec4 get_selection_color(highp vec3 voxel, highp vec3 n, highp vec3 p)\n"
+    "{\n"
+    "    highp vec3 t1 = abs(n.yzx);\n"
+    "    highp vec3 t2 = abs(n.zxy);\n"
+    "    highp vec2 uv = vec2(dot(p, t1), dot(p, t2));\n"
+    "    highp vec2 f = clamp(uv - vec2(dot(voxel, t1), dot(voxel, t2)),\n"
+    "                         0.0, 1.0);\n"
+    "    mediump vec2 w = vec2(1.0 / 16.0);\n"
+    "    lowp vec4 color = u_m_base_color;\n"
+    "\n"
+    "#if !defined(GL_ES) || __VERSION__ >= 300\n"
+    "    // About 1.5 pixels lines.\n"
+    "    w = clamp(fwidth(uv) * 1.5, 1.0 / 64.0, 0.25);\n"
+    "#endif\n"
+    "    if (    (f.x < w.x && is_outline_edge(voxel, n, -t1)) ||\n"
+    "            (f.x > 1.0 - w.x && is_outline_edge(voxel, n, +t1)) ||\n"
+    "            (f.y < w.y && is_outline_edge(voxel, n, -t2)) ||\n"
+    "            (f.y > 1.0 - w.y && is_outline_edge(voxel, n, +t2))) {\n"
+    "        color.a = min(1.0, color.a * 6.0);\n"
+    "        return color;\n"
+    "    }\n"
+    "    if (mod(gl_FragCoord.x + gl_FragCoord.y, 8.0) >= 4.0) color.a *= 0.5;\n"
+    "    return color;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "vec3 toneMap(vec3 color)\n"
+    "{\n"
+    "    return sqrt(color); // Gamma correction.\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    highp vec3 rd, voxel, normal, p;\n"
+    "    highp vec4 pos, clip;\n"
+    "    highp float t;\n"
+    "    lowp vec4 value;\n"
+    "    vec4 base_color;\n"
+    "    vec3 N, V, L, color;\n"
+    "\n"
+    "    rd = normalize(v_pos - u_local_camera);\n"
+    "    // Avoid the divisions by zero in the marching.\n"
+    "    rd = mix(rd, vec3(1e-6), vec3(lessThan(abs(rd), vec3(1e-6))));\n"
+    "    if (!ray_march(u_local_camera, rd, voxel, value, normal, t)) discard;\n"
+    "\n"
+    "    p = u_local_camera + rd * t;\n"
+    "    pos = u_model * vec4(p, 1.0);\n"
+    "#ifdef SELECTION\n"
+    "    // Move the depth a bit toward the camera, so that the overlay is not\n"
+    "    // hidden by the voxels it covers.\n"
+    "    clip = u_proj * u_view * u_model * vec4(p - rd * 0.05, 1.0);\n"
+    "#else\n"
+    "    clip = u_proj * u_view * pos;\n"
+    "#endif\n"
+    "    gl_FragDepth = (gl_DepthRange.diff * clip.z / clip.w +\n"
+    "                    gl_DepthRange.near + gl_DepthRange.far) * 0.5;\n"
+    "\n"
+    "#ifdef SELECTION\n"
+    "    // Camera inside a voxel.\n"
+    "    if (normal == vec3(0.0)) {\n"
+    "        gl_FragColor = u_m_base_color;\n"
+    "        return;\n"
+    "    }\n"
+    "    gl_FragColor = get_selection_color(voxel, normal, p);\n"
+    "    return;\n"
+    "#endif\n"
+    "\n"
+    "    base_color = u_m_base_color * value * value; // srgb to linear (fast).\n"
+    "\n"
+    "#ifdef MATERIAL_UNLIT\n"
+    "    gl_FragColor = vec4(sqrt(base_color.rgb), base_color.a);\n"
+    "    return;\n"
+    "#endif\n"
+    "\n"
+    "    // Camera inside a voxel.\n"
+    "    if (normal == vec3(0.0)) normal = -rd;\n"
+    "    N = normalize(mat3(u_model) * normal);\n"
+    "    V = normalize(u_camera - pos.xyz);\n"
+    "    L = normalize(u_l_dir);\n"
+    "    color = compute_light(L, u_l_int, u_l_amb, base_color.rgb,\n"
+    "                          u_m_metallic, u_m_roughness, N, V);\n"
+    "\n"
+    "#ifdef SHADOW\n"
+    "    float NdotL = clamp(dot(N, L), 0.0, 1.0);\n"
+    "    lowp vec2 PS[4]; // Poisson offsets used for the shadow map.\n"
+    "    float visibility = 1.0;\n"
+    "    mediump vec4 shadow_coord = u_shadow_mvp * pos;\n"
+    "    shadow_coord /= shadow_coord.w;\n"
+    "    lowp float bias = 0.005 * tan(acos(clamp(NdotL, 0.0, 1.0)));\n"
+    "    bias = clamp(bias, 0.0015, 0.015);\n"
+    "    shadow_coord.z -= bias;\n"
+    "    PS[0] = vec2(-0.94201624, -0.39906216) / 1024.0;\n"
+    "    PS[1] = vec2(+0.94558609, -0.76890725) / 1024.0;\n"
+    "    PS[2] = vec2(-0.09418410, -0.92938870) / 1024.0;\n"
+    "    PS[3] = vec2(+0.34495938, +0.29387760) / 1024.0;\n"
+    "    for (int i = 0; i < 4; i++)\n"
+    "        if (texture2D(u_shadow_tex, shadow_coord.xy +\n"
+    "           PS[i]).z < shadow_coord.z) visibility -= 0.2;\n"
+    "    if (NdotL <= 0.0) visibility = 0.5;\n"
+    "    color *= mix(1.0, visibility, u_shadow_strength);\n"
+    "#endif // SHADOW\n"
+    "\n"
+    "    if (u_occlusion_strength > 0.0) {\n"
+    "        color = mix(color, color * get_occlusion(voxel, normal, p),\n"
+    "                    u_occlusion_strength);\n"
+    "    }\n"
+    "\n"
+    "    color += u_m_emissive_factor;\n"
+    "    gl_FragColor = vec4(toneMap(color), 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    ""
+},
+{.path = "data/shaders/mesh.glsl", .size = 12564, .data =
     "/* Goxel 3D voxels editor\n"
     " *\n"
     " * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>\n"
@@ -213,20 +614,119 @@
     "#ifdef VERTEX_SHADER\n"
     "\n"
     "/************************************************************************/\n"
+    "#ifndef FACES\n"
     "attribute highp   vec3 a_pos;\n"
-    "attribute mediump vec3 a_normal;\n"
-    "attribute mediump vec3 a_tangent;\n"
     "attribute mediump vec3 a_gradient;\n"
     "attribute lowp    vec4 a_color;\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FACES\n"
+    "// Vertex pulling: the quads are given as one voxel_face_t each, and we\n"
+    "// compute the packed vertices attributes from gl_VertexID, see\n"
+    "// mesh_pack_faces.\n"
+    "layout(std430, binding = 0) readonly buffer faces_buffer {\n"
+    "    uvec2 u_faces[];\n"
+    "};\n"
+    "highp   vec3 a_pos;\n"
+    "mediump vec3 a_gradient;\n"
+    "lowp    vec4 a_color;\n"
+    "mediump vec3 a_face_data;\n"
+    "#elif defined(PACKED_VERTICES)\n"
+    "// face * 4 + vertex index, shadow mask, borders mask.\n"
+    "attribute mediump vec3 a_face_data;\n"
+    "#else\n"
+    "attribute mediump vec3 a_normal;\n"
+    "attribute mediump vec3 a_tangent;\n"
     "attribute mediump vec2 a_occlusion_uv;\n"
     "attribute mediump vec2 a_bump_uv;   // bump tex base coordinates [0,255]\n"
     "attribute mediump vec2 a_uv;        // uv coordinates [0,1]\n"
+    "#endif\n"
     "\n"
     "// Must match the value in goxel.h\n"
     "#define VOXEL_TEXTURE_SIZE 8.0\n"
     "\n"
+    "#ifdef PACKED_VERTICES\n"
+    "// Must match FACES_NORMALS and FACES_TANGENTS in block_def.h\n"
+    "mediump vec3 get_face_normal(mediump float f)\n"
+    "{\n"
+    "    if (f < 0.5) return vec3(0.0, -1.0, 0.0);\n"
+    "    if (f < 1.5) return vec3(0.0, +1.0, 0.0);\n"
+    "    if (f < 2.5) return vec3(0.0, 0.0, -1.0);\n"
+    "    if (f < 3.5) return vec3(0.0, 0.0, +1.0);\n"
+    "    if (f < 4.5) return vec3(+1.0, 0.0, 0.0);\n"
+    "    return vec3(-1.0, 0.0, 0.0);\n"
+    "}\n"
+    "\n"
+    "mediump vec3 get_face_tangent(mediump float f)\n"
+    "{\n"
+    "    if (f < 0.5) return vec3(+1.0, 0.0, 0.0);\n"
+    "    if (f < 1.5) return vec3(-1.0, 0.0, 0.0);\n"
+    "    if (f < 4.5) return vec3(0.0, +1.0, 0.0);\n"
+    "    return vec3(0.0, 0.0, +1.0);\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FACES\n"
+    "// Must match FACES_VERTICES and VERTICES_POSITIONS in block_def.h\n"
+    "const vec3 FACES_CORNERS[24] = vec3[24](\n"
+    "    vec3(0, 0, 0), vec3(1, 0, 0), vec3(1, 0, 1), vec3(0, 0, 1),\n"
+    "    vec3(1, 1, 0), vec3(0, 1, 0), vec3(0, 1, 1), vec3(1, 1, 1),\n"
+    "    vec3(0, 0, 0), vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0),\n"
+    "    vec3(1, 0, 1), vec3(1, 1, 1), vec3(0, 1, 1), vec3(0, 0, 1),\n"
+    "    vec3(1, 0, 0), vec3(1, 1, 0), vec3(1, 1, 1), vec3(1, 0, 1),\n"
+    "    vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0));\n"
+    "// Axis of the faces normals.\n"
+    "const int FACES_AXIS[6] = int[6](1, 1, 2, 2, 0, 0);\n"
+    "// Same order as the quads index buffer.\n"
+    "const int QUAD_CORNERS[6] = int[6](0, 1, 2, 2, 3, 0);\n"
+    "\n"
+    "void unpack_face()\n"
+    "{\n"
+    "    uvec2 data = u_faces[gl_VertexID / 6];\n"
+    "    int corner = QUAD_CORNERS[gl_VertexID % 6];\n"
+    "    int face = int((data.x >> 18) & 7u);\n"
+    "    int n = FACES_AXIS[face];\n"
+    "    uint borders = (data.x >> 21) & 255u;\n"
+    "    vec3 size = vec3(1.0);\n"
+    "\n"
+    "    // The quad min corner is already on the face plane.\n"
+    "    size[n] = 0.0;\n"
+    "    if ((data.x >> 31) != 0u) {\n"
+    "        size[(n + 1) % 3] = float(((data.x >> 21) & 31u) + 1u);\n"
+    "        size[(n + 2) % 3] = float(((data.x >> 26) & 31u) + 1u);\n"
+    "        borders = 0u;\n"
+    "    }\n"
+    "    a_pos = vec3(data.x & 63u, (data.x >> 6) & 63u, (data.x >> 12) & 63u) +\n"
+    "            FACES_CORNERS[face * 4 + corner] * size;\n"
+    "    a_color = vec4(vec3(data.y & 255u, (data.y >> 8) & 255u,\n"
+    "                        (data.y >> 16) & 255u) / 255.0, 1.0);\n"
+    "    a_face_data = vec3(float(face * 4 + corner), float(data.y >> 24),\n"
+    "                       float(borders));\n"
+    "    a_gradient = vec3(0.0);\n"
+    "}\n"
+    "#endif\n"
+    "\n"
     "void main()\n"
     "{\n"
+    "#ifdef FACES\n"
+    "    unpack_face();\n"
+    "#endif\n"
+    "#ifdef PACKED_VERTICES\n"
+    "    // Compute the attributes that are not in the packed vertices.\n"
+    "    mediump float face = floor(a_face_data.x / 4.0);\n"
+    "    mediump float corner = a_face_data.x - face * 4.0;\n"
+    "    mediump vec3 a_normal = get_face_normal(face);\n"
+    "    mediump vec3 a_tangent = get_face_tangent(face);\n"
+    "    // Must match VERTICE_UV in block_def.h\n"
+    "    mediump vec2 a_uv = vec2((corner == 1.0 || corner == 2.0) ? 1.0 : 0.0,\n"
+    "                             (corner >= 2.0) ? 1.0 : 0.0);\n"
+    "    mediump vec2 a_occlusion_uv =\n"
+    "        vec2(mod(a_face_data.y, 16.0), floor(a_face_data.y / 16.0)) *\n"
+    "        VOXEL_TEXTURE_SIZE + a_uv * (VOXEL_TEXTURE_SIZE - 1.0);\n"
+    "    mediump vec2 a_bump_uv =\n"
+    "        vec2(mod(a_face_data.z, 16.0), floor(a_face_data.z / 16.0)) * 16.0;\n"
+    "#endif\n"
+    "\n"
     "    vec4 pos = u_model * vec4(a_pos * u_pos_scale, 1.0);\n"
     "    v_Position = vec3(pos.xyz) / pos.w;\n"
     "\n"
@@ -241,12 +741,12 @@
     "\n"
     "#ifdef HAS_TANGENTS\n"
     "    mediump vec4 tangent = vec4(normalize(a_tangent), 1.0);\n"
-    "    mediump vec3 normalW = normalize(a_normal);\n"
+    "    mediump vec3 normalW = normalize(mat3(u_model) * a_normal);\n"
     "    mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent.xyz, 0.0)));\n"
     "    mediump vec3 bitangentW = cross(normalW, tangentW) * tangent.w;\n"
     "    v_TBN = mat3(tangentW, bitangentW, normalW);\n"
     "#else\n"
-    "    v_Normal = normalize(a_normal);\n"
+    "    v_Normal = normalize(mat3(u_model) * a_normal);\n"
     "#endif\n"
     "\n"
     "    v_gradient = a_gradient;\n"
@@ -280,6 +780,12 @@
     "void main()\n"
     "{\n"
     "\n"
+    "#ifdef DEPTH_ONLY\n"
+    "    // Depth pre-pass, only the vertex shader matters.\n"
+    "    gl_FragColor = vec4(0.0);\n"
+    "    return;\n"
+    "#endif\n"
+    "\n"
     "#ifdef ONLY_EDGES\n"
     "    mediump vec3 n = 2.0 * texture2D(u_normal_sampler, v_UVCoord1).rgb - 1.0;\n"
     "    if (n.z > 0.75)\n"
@@ -342,6 +848,440 @@
     "#endif\n"
     ""
 },
+{.path = "data/shaders/mesh_compute.glsl", .size = 4463, .data =
+    "/*\n"
+    " * Generate the packed quads of a block, like mesh_generate_vertices\n"
+    " * followed by mesh_pack_vertices.\n"
+    " *\n"
+    " * Each invocation handles one voxel of the block.  The input is the\n"
+    " * (N + 2)^3 voxels cube around the block, one RGBA value per uint, and the\n"
+    " * quads are appended to the output buffer, three uints per vertex, using\n"
+    " * an atomic counter.\n"
+    " *\n"
+    " * N, MAX_QUADS, and the FACES_VERTICES, FACES_NEIGHBORS (flattened),\n"
+    " * VERTICES_POSITIONS and FACES_NORMALS tables are defined by the caller,\n"
+    " * from the values of block_def.h.\n"
+    " */\n"
+    "\n"
+    "#ifdef COMPUTE_SHADER\n"
+    "\n"
+    "layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;\n"
+    "\n"
+    "layout(std430, binding = 0) readonly buffer Voxels {\n"
+    "    uint voxels[];\n"
+    "};\n"
+    "\n"
+    "layout(std430, binding = 1) writeonly buffer Vertices {\n"
+    "    uint vertices[];\n"
+    "};\n"
+    "\n"
+    "layout(std430, binding = 2) buffer Counter {\n"
+    "    uint nb_quads;\n"
+    "};\n"
+    "\n"
+    "uniform int u_flat_faces;\n"
+    "\n"
+    "const int S = N + 2;\n"
+    "\n"
+    "uint get_voxel(ivec3 p)\n"
+    "{\n"
+    "    return voxels[((p.z + 1) * S + (p.y + 1)) * S + (p.x + 1)];\n"
+    "}\n"
+    "\n"
+    "// Bit index of a neighbor, like in mesh_to_vertices.c.\n"
+    "int nbit(ivec3 d)\n"
+    "{\n"
+    "    return (d.x + 1) + (d.y + 1) * 3 + (d.z + 1) * 9;\n"
+    "}\n"
+    "\n"
+    "bool has(uint mask, ivec3 d)\n"
+    "{\n"
+    "    return (mask & (1u << nbit(d))) != 0u;\n"
+    "}\n"
+    "\n"
+    "// Direction of the corner of a face vertex.\n"
+    "ivec3 corner_dir(int f, int i)\n"
+    "{\n"
+    "    ivec3 n = FACES_NORMALS[f];\n"
+    "    ivec3 c = VERTICES_POSITIONS[FACES_VERTICES[f * 4 + i]] * 2 - 1;\n"
+    "    return c * (1 - abs(n)) + n;\n"
+    "}\n"
+    "\n"
+    "// Direction of the edge e of a face, between the vertices e and e + 1.\n"
+    "ivec3 edge_dir(int f, int e)\n"
+    "{\n"
+    "    return (corner_dir(f, e) + corner_dir(f, (e + 1) % 4)) / 2;\n"
+    "}\n"
+    "\n"
+    "uint get_shadow_mask(uint mask, int f)\n"
+    "{\n"
+    "    int i;\n"
+    "    uint ret = 0u;\n"
+    "    bool e0, e1;\n"
+    "    for (i = 0; i < 4; i++) {\n"
+    "        e0 = has(mask, edge_dir(f, (i + 3) % 4));\n"
+    "        e1 = has(mask, edge_dir(f, i));\n"
+    "        if (e0 || e1 || has(mask, corner_dir(f, i))) ret |= 1u << i;\n"
+    "        if (e1) ret |= 0x10u << i;\n"
+    "    }\n"
+    "    return ret;\n"
+    "}\n"
+    "\n"
+    "uint get_border_mask(uint mask, int f)\n"
+    "{\n"
+    "    int e;\n"
+    "    uint ret = 0u;\n"
+    "    ivec3 n, t;\n"
+    "    for (e = 0; e < 4; e++) {\n"
+    "        n = FACES_NORMALS[f];\n"
+    "        t = FACES_NORMALS[FACES_NEIGHBORS[f * 4 + e]];\n"
+    "        if (has(mask, n + t)) {\n"
+    "            ret |= 2u << (2 * e);\n"
+    "        } else if (!has(mask, t)) {\n"
+    "            ret |= 1u << (2 * e);\n"
+    "        }\n"
+    "    }\n"
+    "    return ret;\n"
+    "}\n"
+    "\n"
+    "// Same as the integer division by smax in C, that rounds toward zero.\n"
+    "int scale_gradient(int s, int smax)\n"
+    "{\n"
+    "    return sign(s) * (abs(s) * 127 / smax);\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    ivec3 pos = ivec3(gl_GlobalInvocationID);\n"
+    "    ivec3 d, g, vpos;\n"
+    "    uint v, a, mask = 0u, shadow, borders, q, w0, w1, w2;\n"
+    "    int f, i, k, smax;\n"
+    "    uint alphas[27];\n"
+    "\n"
+    "    v = get_voxel(pos);\n"
+    "    if ((v >> 24) < 127u) return;\n"
+    "    k = 0;\n"
+    "    for (d.z = -1; d.z <= 1; d.z++)\n"
+    "    for (d.y = -1; d.y <= 1; d.y++)\n"
+    "    for (d.x = -1; d.x <= 1; d.x++, k++) {\n"
+    "        a = get_voxel(pos + d) >> 24;\n"
+    "        alphas[k] = a;\n"
+    "        if (a >= 127u) mask |= 1u << k;\n"
+    "    }\n"
+    "\n"
+    "    // Gradient of the alpha values of the solid neighbors.\n"
+    "    g = ivec3(0);\n"
+    "    k = 0;\n"
+    "    for (d.z = -1; d.z <= 1; d.z++)\n"
+    "    for (d.y = -1; d.y <= 1; d.y++)\n"
+    "    for (d.x = -1; d.x <= 1; d.x++, k++) {\n"
+    "        if ((mask & (1u << k)) != 0u) g -= int(alphas[k]) * d;\n"
+    "    }\n"
+    "    smax = max(abs(g.x), max(abs(g.y), abs(g.z)));\n"
+    "\n"
+    "    for (f = 0; f < 6; f++) {\n"
+    "        if (has(mask, FACES_NORMALS[f])) continue;\n"
+    "        if (u_flat_faces != 0 || smax == 0) {\n"
+    "            d = FACES_NORMALS[f];\n"
+    "        } else {\n"
+    "            d = ivec3(scale_gradient(g.x, smax), scale_gradient(g.y, smax),\n"
+    "                      scale_gradient(g.z, smax));\n"
+    "        }\n"
+    "        shadow = u_flat_faces != 0 ? 0u : get_shadow_mask(mask, f);\n"
+    "        borders = get_border_mask(mask, f);\n"
+    "        q = atomicAdd(nb_quads, 1u);\n"
+    "        if (q >= uint(MAX_QUADS)) return;\n"
+    "        // Same layout as voxel_packed_vertex_t.\n"
+    "        w1 = shadow | (borders << 8) | ((v & 0xffu) << 16) |\n"
+    "             (((v >> 8) & 0xffu) << 24);\n"
+    "        w2 = ((v >> 16) & 0xffu) | (uint(d.x & 0xff) << 8) |\n"
+    "             (uint(d.y & 0xff) << 16) | (uint(d.z & 0xff) << 24);\n"
+    "        for (i = 0; i < 4; i++) {\n"
+    "            vpos = pos + VERTICES_POSITIONS[FACES_VERTICES[f * 4 + i]];\n"
+    "            w0 = uint(vpos.x) | (uint(vpos.y) << 8) | (uint(vpos.z) << 16) |\n"
+    "                 (uint(f * 4 + i) << 24);\n"
+    "            vertices[(q * 4u + uint(i)) * 3u + 0u] = w0;\n"
+    "            vertices[(q * 4u + uint(i)) * 3u + 1u] = w1;\n"
+    "            vertices[(q * 4u + uint(i)) * 3u + 2u] = w2;\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "#endif\n"
+    ""
+},
+{.path = "data/shaders/mesh_op_compute.glsl", .size = 7848, .data =
+    "/*\n"
+    " * Apply a painter shape to a batch of blocks, like op_block in\n"
+    " * mesh_utils.c, or merge two batches of blocks, like merge_block, if MERGE\n"
+    " * is defined.\n"
+    " *\n"
+    " * Each invocation handles one voxel, and the voxels are updated in place,\n"
+    " * one RGBA value per uint.  The float operations of the GPU don't always\n"
+    " * round like the CPU ones, so the voxels whose value could depend on the\n"
+    " * rounding are left unchanged and flagged as uncertain, for the caller to\n"
+    " * compute them on the CPU.  Each block has FLAGS_SIZE uints of flags: the\n"
+    " * first one has the bit 1 set if any voxel changed and the bit 2 set if any\n"
+    " * voxel is uncertain, followed by one uncertain bit per voxel.\n"
+    " *\n"
+    " * N, FLAGS_SIZE, ERR_SCALE, and the MODE_ and SHAPE_ values are defined by\n"
+    " * the caller.\n"
+    " */\n"
+    "\n"
+    "#ifdef COMPUTE_SHADER\n"
+    "\n"
+    "layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;\n"
+    "\n"
+    "layout(std430, binding = 0) buffer Voxels {\n"
+    "    uint voxels[];\n"
+    "};\n"
+    "\n"
+    "layout(std430, binding = 1) readonly buffer Others {\n"
+    "    uint others[];\n"
+    "};\n"
+    "\n"
+    "layout(std430, binding = 2) readonly buffer Positions {\n"
+    "    ivec4 positions[];\n"
+    "};\n"
+    "\n"
+    "layout(std430, binding = 3) buffer Flags {\n"
+    "    uint flags[];\n"
+    "};\n"
+    "\n"
+    "uniform int u_mode;\n"
+    "uniform vec4 u_color; // In the 0-255 range.\n"
+    "uniform int u_use_color;\n"
+    "\n"
+    "uniform mat4 u_mat;\n"
+    "uniform vec3 u_size;\n"
+    "uniform float u_smoothness;\n"
+    "uniform int u_shape;\n"
+    "uniform int u_use_box;\n"
+    "uniform vec3 u_box_min;\n"
+    "uniform vec3 u_box_max;\n"
+    "uniform int u_skip_src_empty;\n"
+    "uniform int u_skip_dst_empty;\n"
+    "\n"
+    "bool g_uncertain;\n"
+    "float g_err; // Tolerance on the shape function values.\n"
+    "\n"
+    "uvec4 unpack(uint v)\n"
+    "{\n"
+    "    return uvec4(v & 0xffu, (v >> 8) & 0xffu, (v >> 16) & 0xffu, v >> 24);\n"
+    "}\n"
+    "\n"
+    "uint pack(uvec4 v)\n"
+    "{\n"
+    "    return v.r | (v.g << 8) | (v.b << 16) | (v.a << 24);\n"
+    "}\n"
+    "\n"
+    "// Convert a float to an uint8_t like the CPU, that could round x\n"
+    "// differently if it is close to an integer.\n"
+    "uint to_u8(float x)\n"
+    "{\n"
+    "    if (abs(x - round(x)) < 1e-3) g_uncertain = true;\n"
+    "    return uint(x);\n"
+    "}\n"
+    "\n"
+    "uint mix_u8(uint x, uint y, uint a)\n"
+    "{\n"
+    "    precise float t, v;\n"
+    "    if (a == 0u) return x;\n"
+    "    if (a == 255u) return y;\n"
+    "    t = float(a) / 255.0;\n"
+    "    v = (1.0 - t) * float(x) + t * float(y);\n"
+    "    return to_u8(v);\n"
+    "}\n"
+    "\n"
+    "uvec4 combine(uvec4 a, uvec4 b, int mode)\n"
+    "{\n"
+    "    uint aa = a.a, ba = b.a, d;\n"
+    "    uvec4 ret = a;\n"
+    "    if (mode == MODE_PAINT) {\n"
+    "        ret.r = mix_u8(a.r, b.r, ba);\n"
+    "        ret.g = mix_u8(a.g, b.g, ba);\n"
+    "        ret.b = mix_u8(a.b, b.b, ba);\n"
+    "    } else if (mode == MODE_OVER) {\n"
+    "        d = 255u * ba + aa * (255u - ba);\n"
+    "        if (d != 0u)\n"
+    "            ret.rgb = (255u * b.rgb * ba + a.rgb * aa * (255u - ba)) / d;\n"
+    "        ret.a = ba + aa * (255u - ba) / 255u;\n"
+    "    } else if (mode == MODE_SUB) {\n"
+    "        ret.a = aa > ba ? aa - ba : 0u;\n"
+    "    } else if (mode == MODE_MAX) {\n"
+    "        ret = uvec4(b.rgb, max(aa, ba));\n"
+    "    } else if (mode == MODE_SUB_CLAMP) {\n"
+    "        ret.a = min(aa, 255u - ba);\n"
+    "    } else if (mode == MODE_MULT_ALPHA) {\n"
+    "        ret = ret * ba / 255u;\n"
+    "    } else if (mode == MODE_INTERSECT) {\n"
+    "        ret.a = min(aa, ba);\n"
+    "    }\n"
+    "    return ret;\n"
+    "}\n"
+    "\n"
+    "// Flag the voxel if x is close to a threshold compared exactly on the CPU.\n"
+    "void check_threshold(float x, float t)\n"
+    "{\n"
+    "    if (abs(x - t) < g_err) g_uncertain = true;\n"
+    "}\n"
+    "\n"
+    "float sphere_func(vec3 p, vec3 s)\n"
+    "{\n"
+    "    float d = length(p);\n"
+    "    float r;\n"
+    "    // The CPU uses a special value at the center.\n"
+    "    if (d < g_err) {\n"
+    "        g_uncertain = true;\n"
+    "        return 0.0;\n"
+    "    }\n"
+    "    r = s.x * s.y * s.z / length(vec3(s.y * s.z * p.x / d,\n"
+    "                                      s.x * s.z * p.y / d,\n"
+    "                                      s.x * s.y * p.z / d));\n"
+    "    return r - d;\n"
+    "}\n"
+    "\n"
+    "float cube_func(vec3 p, vec3 s, float sm)\n"
+    "{\n"
+    "    const float INF = uintBitsToFloat(0x7f800000u);\n"
+    "    float min_v = INF, min_v2 = INF, ret = INF, v;\n"
+    "    int i;\n"
+    "\n"
+    "    for (i = 0; i < 3; i++) {\n"
+    "        check_threshold(p[i], -s[i] - sm);\n"
+    "        check_threshold(p[i], +s[i] + sm);\n"
+    "        check_threshold(p[i], -s[i] + sm);\n"
+    "        check_threshold(p[i], +s[i] - sm);\n"
+    "    }\n"
+    "    // Outside the max cube, or inside the min cube.\n"
+    "    if (any(lessThan(p, -s - sm)) || any(greaterThanEqual(p, s + sm)))\n"
+    "        return -INF;\n"
+    "    if (all(greaterThanEqual(p, -s + sm)) && all(lessThan(p, s - sm)))\n"
+    "        return +INF;\n"
+    "\n"
+    "    for (i = 0; i < 3; i++) {\n"
+    "        // The CPU ignores the null coordinates.\n"
+    "        check_threshold(p[i], 0.0);\n"
+    "        if (p[i] == 0.0) continue;\n"
+    "        v = s[i] / abs(p[i]);\n"
+    "        if (v < min_v) {\n"
+    "            min_v2 = min_v;\n"
+    "            min_v = v;\n"
+    "            ret = s[i] - abs(p[i]);\n"
+    "        } else {\n"
+    "            min_v2 = min(min_v2, v);\n"
+    "        }\n"
+    "    }\n"
+    "    // The CPU could pick an other axis.\n"
+    "    if (min_v2 - min_v <= 1e-4 * min_v) g_uncertain = true;\n"
+    "    return ret;\n"
+    "}\n"
+    "\n"
+    "float cylinder_func(vec3 p, vec3 s)\n"
+    "{\n"
+    "    float d = length(p.xy);\n"
+    "    float rz = s.z - abs(p.z);\n"
+    "    float r;\n"
+    "    // The CPU uses a special value on the axis.\n"
+    "    if (d < g_err) {\n"
+    "        g_uncertain = true;\n"
+    "        return 0.0;\n"
+    "    }\n"
+    "    r = s.x * s.y / length(vec2(s.y * p.x / d, s.x * p.y / d));\n"
+    "    return min(rz, r - d);\n"
+    "}\n"
+    "\n"
+    "float shape_func(vec3 p)\n"
+    "{\n"
+    "    if (u_shape == SHAPE_SPHERE) return sphere_func(p, u_size);\n"
+    "    if (u_shape == SHAPE_CUBE) return cube_func(p, u_size, u_smoothness);\n"
+    "    return cylinder_func(p, u_size);\n"
+    "}\n"
+    "\n"
+    "// Alpha of the painter color for a given value of the shape function,\n"
+    "// or -1 if the voxel is skipped, like op_voxel_color.\n"
+    "int get_alpha(float k)\n"
+    "{\n"
+    "    precise float v, a;\n"
+    "    if (u_smoothness != 0.0)\n"
+    "        v = clamp(k / u_smoothness, -1.0, 1.0) / 2.0 + 0.5;\n"
+    "    else\n"
+    "        v = (k >= 0.0) ? 1.0 : 0.0;\n"
+    "    if (v == 0.0 && u_skip_src_empty != 0) return -1;\n"
+    "    a = u_color.a * v;\n"
+    "    if (uint(a) == 0u && u_skip_src_empty != 0) return -1;\n"
+    "    return int(a);\n"
+    "}\n"
+    "\n"
+    "// Compute the new value of a voxel of a block, or return false if it is\n"
+    "// left unchanged.\n"
+    "bool apply_shape(ivec3 vp, int x, uvec4 value, out uvec4 ret)\n"
+    "{\n"
+    "    precise vec3 q, p, dp;\n"
+    "    float k;\n"
+    "    int alpha, alpha2;\n"
+    "\n"
+    "    // Same as mat4_mul_vec3 of the row start, followed by the shape row\n"
+    "    // function increments.\n"
+    "    q = vec3(float(vp.x - x) + 0.5, float(vp.y) + 0.5, float(vp.z) + 0.5);\n"
+    "    p = ((u_mat[0].xyz * q.x + u_mat[1].xyz * q.y) + u_mat[2].xyz * q.z) +\n"
+    "        u_mat[3].xyz;\n"
+    "    dp = u_mat[0].xyz;\n"
+    "    p = p + float(x) * dp;\n"
+    "\n"
+    "    q = vec3(vp) + 0.5;\n"
+    "    if (    u_use_box != 0 &&\n"
+    "            !(all(greaterThanEqual(q, u_box_min)) &&\n"
+    "              all(lessThan(q, u_box_max))))\n"
+    "        return false;\n"
+    "\n"
+    "    g_err = ERR_SCALE * (1.0 + max(abs(p.x), max(abs(p.y), abs(p.z))) +\n"
+    "                         max(u_size.x, max(u_size.y, u_size.z)) +\n"
+    "                         u_smoothness);\n"
+    "    // The alpha only increases with k, so if it is the same at both ends of\n"
+    "    // the tolerance range, it is also the value of the CPU.\n"
+    "    k = shape_func(p);\n"
+    "    alpha = get_alpha(k - g_err);\n"
+    "    alpha2 = get_alpha(k + g_err);\n"
+    "    if (alpha != alpha2) g_uncertain = true;\n"
+    "    if (alpha == -1 || g_uncertain) return false;\n"
+    "    if (value.a == 0u && u_skip_dst_empty != 0) return false;\n"
+    "    ret = combine(value, uvec4(u_color.rgb, uint(alpha)), u_mode);\n"
+    "    return true;\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    ivec3 gid = ivec3(gl_GlobalInvocationID);\n"
+    "    int b = gid.z / N;\n"
+    "    ivec3 pos = ivec3(gid.x, gid.y, gid.z % N);\n"
+    "    int i = (pos.z * N + pos.y) * N + pos.x;\n"
+    "    uint idx = uint(b * N * N * N + i);\n"
+    "    uvec4 value = unpack(voxels[idx]), ret, c;\n"
+    "\n"
+    "    g_uncertain = false;\n"
+    "#ifdef MERGE\n"
+    "    c = unpack(others[idx]);\n"
+    "    if (u_use_color != 0) c = c * uvec4(u_color) / 255u;\n"
+    "    ret = combine(value, c, u_mode);\n"
+    "#else\n"
+    "    if (!apply_shape(positions[b].xyz + pos, pos.x, value, ret) &&\n"
+    "            !g_uncertain)\n"
+    "        return;\n"
+    "#endif\n"
+    "    if (g_uncertain) {\n"
+    "        atomicOr(flags[b * FLAGS_SIZE], 2u);\n"
+    "        atomicOr(flags[b * FLAGS_SIZE + 1 + i / 32], 1u << uint(i % 32));\n"
+    "        return;\n"
+    "    }\n"
+    "    if (ret == value) return;\n"
+    "    voxels[idx] = pack(ret);\n"
+    "    atomicOr(flags[b * FLAGS_SIZE], 1u);\n"
+    "}\n"
+    "\n"
+    "#endif\n"
+    ""
+},
 {.path = "data/shaders/model3d.glsl", .size = 2766, .data =
     "#if defined(GL_ES) && defined(FRAGMENT_SHADER)\n"
     "#extension GL_OES_standard_derivatives : enable\n"
@@ -432,24 +1372,41 @@
     "#endif\n"
     ""
 },
-{.path = "data/shaders/pos_data.glsl", .size = 790, .data =
+{.path = "data/shaders/pos_data.glsl", .size = 2305, .data =
+    "#ifdef PACKED_VERTICES\n"
+    "// The voxel position is computed per fragment from the face position.\n"
+    "varying mediump vec3  v_pos;\n"
+    "varying mediump float v_face;\n"
+    "#else\n"
     "varying lowp  vec2 v_pos_data;\n"
+    "#endif\n"
     "uniform highp mat4 u_model;\n"
     "uniform highp mat4 u_view;\n"
     "uniform highp mat4 u_proj;\n"
-    "uniform lowp  vec2 u_block_id;\n"
+    "// Bits 0-15 of the block id in x and y, bit 16 in z.\n"
+    "uniform mediump vec3 u_block_id;\n"
     "\n"
     "#ifdef VERTEX_SHADER\n"
     "\n"
     "/************************************************************************/\n"
     "attribute highp vec3 a_pos;\n"
+    "\n"
+    "#ifdef PACKED_VERTICES\n"
+    "attribute mediump vec3 a_face_data;\n"
+    "#else\n"
     "attribute lowp  vec2 a_pos_data;\n"
+    "#endif\n"
     "\n"
     "void main()\n"
     "{\n"
     "    highp vec3 pos = a_pos;\n"
     "    gl_Position = u_proj * u_view * u_model * vec4(pos, 1.0);\n"
+    "#ifdef PACKED_VERTICES\n"
+    "    v_pos = a_pos;\n"
+    "    v_face = floor(a_face_data.x / 4.0);\n"
+    "#else\n"
     "    v_pos_data = a_pos_data;\n"
+    "#endif\n"
     "}\n"
     "/************************************************************************/\n"
     "\n"
@@ -458,10 +1415,41 @@
     "#ifdef FRAGMENT_SHADER\n"
     "\n"
     "/************************************************************************/\n"
+    "#ifdef PACKED_VERTICES\n"
+    "// Must match FACES_NORMALS in block_def.h\n"
+    "mediump vec3 get_face_normal(mediump float f)\n"
+    "{\n"
+    "    if (f < 0.5) return vec3(0.0, -1.0, 0.0);\n"
+    "    if (f < 1.5) return vec3(0.0, +1.0, 0.0);\n"
+    "    if (f < 2.5) return vec3(0.0, 0.0, -1.0);\n"
+    "    if (f < 3.5) return vec3(0.0, 0.0, +1.0);\n"
+    "    if (f < 4.5) return vec3(+1.0, 0.0, 0.0);\n"
+    "    return vec3(-1.0, 0.0, 0.0);\n"
+    "}\n"
+    "#endif\n"
+    "\n"
     "void main()\n"
     "{\n"
-    "    gl_FragColor.rg = u_block_id;\n"
-    "    gl_FragColor.ba = v_pos_data;\n"
+    "    gl_FragColor.rg = u_block_id.xy;\n"
+    "#ifdef PACKED_VERTICES\n"
+    "    // Same packing as get_pos_data in mesh_to_vertices.c.\n"
+    "    mediump float f = floor(v_face + 0.5);\n"
+    "#ifndef BLOCK_SIZE_32\n"
+    "    mediump vec3 p = clamp(floor(v_pos - get_face_normal(f) * 0.5),\n"
+    "                           0.0, 15.0);\n"
+    "#else\n"
+    "    // Add the 16^3 cube of the voxel to the low bits of the block id.\n"
+    "    mediump vec3 p = clamp(floor(v_pos - get_face_normal(f) * 0.5),\n"
+    "                           0.0, 31.0);\n"
+    "    mediump vec3 s = floor(p / 16.0);\n"
+    "    p -= s * 16.0;\n"
+    "    gl_FragColor.r += (s.x + s.y * 2.0 + s.z * 4.0) / 255.0;\n"
+    "#endif\n"
+    "    gl_FragColor.ba = vec2(p.z * 16.0 + f + u_block_id.z * 8.0,\n"
+    "                           p.x * 16.0 + p.y) / 255.0;\n"
+    "#else\n"
+    "    gl_FragColor.ba = v_pos_data + vec2(u_block_id.z * 8.0 / 255.0, 0.0);\n"
+    "#endif\n"
     "}\n"
     "/************************************************************************/\n"
     "\n"
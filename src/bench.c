@@ -0,0 +1,671 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro benchmarks of the core voxel operations.
+ *
+ * All the scenes are generated from fixed formulas and seeds, so that the
+ * results can be compared between two versions.  Each benchmark is run
+ * until it took at least BENCH_MIN_TIME, and the results are written as
+ * JSON.
+ */
+
+#include "goxel.h"
+#include "utils/frame_tasks.h"
+
+#define BENCH_MIN_TIME 0.5
+#define BENCH_MIN_ITERATIONS 3
+#define BENCH_MAX_ITERATIONS 10000
+
+typedef struct {
+    const char  *name;
+    int         (*pos)[3];  // All the voxels positions.
+    int         nb;
+    mesh_t      *mesh;
+} scene_t;
+
+typedef struct bench bench_t;
+struct bench {
+    const char      *name;
+    const char      *params;
+    const scene_t   *scene;
+    const char      *unit;      // What the items returned by run are.
+    // Called before and after each iteration, not timed.
+    void            (*setup)(bench_t *b);
+    void            (*cleanup)(bench_t *b);
+    // Run one iteration, and return the number of items processed.
+    double          (*run)(bench_t *b);
+
+    // Benchmark parameters.
+    const mesh_t    *other;
+    const shape_t   *shape;
+    int             mode;
+    int             effects;
+    const char      *path;
+
+    // Working data.
+    mesh_t          *mesh;
+    image_t         *img;
+    voxel_vertex_t  *verts;
+};
+
+// Simple LCG, so that the scenes don't depend on the libc rand.
+static uint32_t rand_next(uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+static void scene_finish(scene_t *scene)
+{
+    mesh_iterator_t iter;
+    mesh_stats_t stats;
+    int i = 0, pos[3];
+
+    mesh_get_stats(scene->mesh, &stats);
+    scene->nb = stats.nb_voxels;
+    scene->pos = malloc(scene->nb * sizeof(*scene->pos));
+    iter = mesh_get_iterator(scene->mesh, MESH_ITER_VOXELS);
+    while (mesh_iter(&iter, pos)) {
+        if (!mesh_get_alpha_at(scene->mesh, &iter, pos)) continue;
+        memcpy(scene->pos[i++], pos, sizeof(pos));
+    }
+    assert(i == scene->nb);
+}
+
+// Rolling hills, with the colors depending on the altitude.
+static void scene_init_terrain(scene_t *scene)
+{
+    int x, y, z, h;
+    uint8_t v[4];
+    mesh_accessor_t acc;
+
+    scene->name = "terrain";
+    scene->mesh = mesh_new();
+    acc = mesh_get_accessor(scene->mesh);
+    for (y = -128; y < 128; y++)
+    for (x = -128; x < 128; x++) {
+        h = 24 + 10 * sin(x * 0.05) * cos(y * 0.07) +
+                  6 * sin((x + y) * 0.13) + 3 * cos(x * 0.31 - y * 0.23);
+        for (z = 0; z < h; z++) {
+            vec4_set(v, 60 + z * 4, 160 - z * 2, 40 + (x & 15), 255);
+            mesh_set_at(scene->mesh, &acc, (int[]){x, y, z}, v);
+        }
+    }
+    scene_finish(scene);
+}
+
+static void scene_init_cube(scene_t *scene)
+{
+    float box[4][4];
+    const painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_cube,
+        .color = {200, 100, 50, 255},
+    };
+
+    scene->name = "cube";
+    scene->mesh = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), 64, 64, 64);
+    mesh_op(scene->mesh, &painter, box);
+    scene_finish(scene);
+}
+
+static void scene_init_scatter(scene_t *scene)
+{
+    int i, pos[3];
+    uint32_t seed = 1, c;
+    mesh_accessor_t acc;
+
+    scene->name = "scatter";
+    scene->mesh = mesh_new();
+    acc = mesh_get_accessor(scene->mesh);
+    for (i = 0; i < 100000; i++) {
+        pos[0] = (int)(rand_next(&seed) % 512) - 256;
+        pos[1] = (int)(rand_next(&seed) % 512) - 256;
+        pos[2] = (int)(rand_next(&seed) % 512) - 256;
+        c = rand_next(&seed);
+        mesh_set_at(scene->mesh, &acc, pos,
+                    (uint8_t[]){c & 255, (c >> 8) & 255, c >> 16, 255});
+    }
+    scene_finish(scene);
+}
+
+static void scene_release(scene_t *scene)
+{
+    mesh_delete(scene->mesh);
+    free(scene->pos);
+}
+
+static void setup_new_mesh(bench_t *b)
+{
+    b->mesh = mesh_new();
+}
+
+static void setup_copy_mesh(bench_t *b)
+{
+    b->mesh = mesh_copy(b->scene->mesh);
+    // Make sure we don't just measure the operations caches.
+    cache_registry_clear();
+}
+
+static void cleanup_mesh(bench_t *b)
+{
+    mesh_delete(b->mesh);
+    b->mesh = NULL;
+}
+
+static double run_set_at(bench_t *b)
+{
+    int i;
+    mesh_accessor_t acc = mesh_get_accessor(b->mesh);
+    uint8_t v[4] = {255, 255, 255, 255};
+    for (i = 0; i < b->scene->nb; i++) {
+        v[0] = i;
+        mesh_set_at(b->mesh, &acc, b->scene->pos[i], v);
+    }
+    return b->scene->nb;
+}
+
+static double run_get_at(bench_t *b)
+{
+    int i;
+    mesh_accessor_t acc = mesh_get_accessor(b->scene->mesh);
+    uint8_t v[4];
+    volatile int sum = 0;
+    for (i = 0; i < b->scene->nb; i++) {
+        mesh_get_at(b->scene->mesh, &acc, b->scene->pos[i], v);
+        sum += v[3];
+    }
+    return b->scene->nb;
+}
+
+static double run_op(bench_t *b)
+{
+    float box[4][4];
+    const painter_t painter = {
+        .mode = b->mode,
+        .shape = b->shape,
+        .color = {255, 0, 0, 255},
+    };
+    bbox_from_extents(box, VEC(0, 0, 16), 48, 48, 32);
+    mesh_op(b->mesh, &painter, box);
+    return 1;
+}
+
+static double run_merge(bench_t *b)
+{
+    mesh_merge(b->mesh, b->other, b->mode, NULL);
+    return 1;
+}
+
+static int select_cond(void *user, const mesh_t *mesh,
+                       const int base_pos[3], const int new_pos[3],
+                       mesh_accessor_t *mesh_accessor)
+{
+    uint8_t v0[4], v1[4];
+    mesh_get_at(mesh, mesh_accessor, base_pos, v0);
+    mesh_get_at(mesh, mesh_accessor, new_pos, v1);
+    return v1[3] && abs((int)v0[0] - (int)v1[0]) <= 8 ? 255 : 0;
+}
+
+static double run_select(bench_t *b)
+{
+    mesh_select(b->scene->mesh, b->scene->pos[0], select_cond, NULL,
+                b->mesh);
+    return 1;
+}
+
+static void setup_vertices(bench_t *b)
+{
+    b->verts = malloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4 *
+                      sizeof(*b->verts));
+}
+
+static void cleanup_vertices(bench_t *b)
+{
+    free(b->verts);
+    b->verts = NULL;
+}
+
+static double run_vertices(bench_t *b)
+{
+    int pos[3], nb = 0, size, subdivide;
+    mesh_iterator_t iter;
+
+    iter = mesh_get_iterator(b->scene->mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) {
+        mesh_generate_vertices(b->scene->mesh, pos, b->effects, b->verts,
+                               &size, &subdivide);
+        nb++;
+    }
+    return nb;
+}
+
+static double run_copy(bench_t *b)
+{
+    b->mesh = mesh_copy(b->scene->mesh);
+    // Also modify the copy, since this is what the copy is for.
+    mesh_set_at(b->mesh, NULL, b->scene->pos[0], (uint8_t[]){0, 0, 0, 0});
+    return 1;
+}
+
+static void setup_image(bench_t *b)
+{
+    b->img = image_new();
+    mesh_set(b->img->active_layer->mesh, b->scene->mesh);
+}
+
+static void cleanup_image(bench_t *b)
+{
+    image_delete(b->img);
+    b->img = NULL;
+}
+
+static double run_save(bench_t *b)
+{
+    save_to_file(b->img, b->path);
+    return b->scene->nb;
+}
+
+static double run_load(bench_t *b)
+{
+    if (gox_import(b->img, b->path) != 0) LOG_E("Cannot load %s", b->path);
+    return b->scene->nb;
+}
+
+static void bench_run_one(bench_t *b, FILE *out, bool first)
+{
+    int n;
+    double t, time = 0, min_time = DBL_MAX, items = 0;
+
+    for (n = 0; n < BENCH_MAX_ITERATIONS; n++) {
+        if (n >= BENCH_MIN_ITERATIONS && time >= BENCH_MIN_TIME) break;
+        if (b->setup) b->setup(b);
+        t = sys_get_time();
+        items += b->run(b);
+        t = sys_get_time() - t;
+        if (b->cleanup) b->cleanup(b);
+        time += t;
+        min_time = min(min_time, t);
+    }
+    LOG_I("bench %s %s %s: %.3f ms", b->name, b->scene->name,
+          b->params ?: "", time / n * 1000);
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"scene\": \"%s\", "
+            "\"params\": \"%s\", \"iterations\": %d, \"time\": %g, "
+            "\"min_time\": %g, \"rate\": %g, \"unit\": \"%s\"}",
+            first ? "" : ",", b->name, b->scene->name, b->params ?: "",
+            n, time / n, min_time, items / max(time, 1e-9), b->unit);
+    fflush(out);
+}
+
+int bench_run(const char *path)
+{
+    const char *gox_path = "/tmp/goxel_bench.gox";
+    scene_t scenes[3] = {};
+    FILE *out = stdout;
+    int i, j, k, nb = 0;
+    char params[64];
+    bench_t b;
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const char *shapes_names[] = {"sphere", "cube", "cylinder"};
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT};
+    const char *modes_names[] = {"over", "sub", "paint"};
+    const int effects[] = {0, EFFECT_MERGE_FACES, EFFECT_MARCHING_CUBES,
+                           EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH};
+    const char *effects_names[] = {"cubes", "merge_faces", "marching_cubes",
+                                   "marching_cubes_smooth"};
+
+    if (path && strcmp(path, "-") != 0) {
+        out = fopen(path, "w");
+        if (!out) {
+            LOG_E("Cannot open %s", path);
+            return -1;
+        }
+    }
+    scene_init_terrain(&scenes[0]);
+    scene_init_cube(&scenes[1]);
+    scene_init_scatter(&scenes[2]);
+
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"block_size\": %d,\n"
+            "  \"block_layout\": \"%s\",\n  \"benchmarks\": [",
+            GOXEL_VERSION_STR, BLOCK_SIZE,
+            BLOCK_MORTON ? "morton" : "linear");
+
+    for (i = 0; i < ARRAY_SIZE(scenes); i++) {
+        b = (bench_t){"mesh_set_at", .scene = &scenes[i], .unit = "voxels",
+                      .setup = setup_new_mesh, .cleanup = cleanup_mesh,
+                      .run = run_set_at};
+        bench_run_one(&b, out, nb++ == 0);
+        b = (bench_t){"mesh_get_at", .scene = &scenes[i], .unit = "voxels",
+                      .run = run_get_at};
+        bench_run_one(&b, out, nb++ == 0);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(shapes); i++)
+    for (j = 0; j < ARRAY_SIZE(modes); j++) {
+        snprintf(params, sizeof(params), "%s/%s",
+                 shapes_names[i], modes_names[j]);
+        b = (bench_t){"mesh_op", params, &scenes[0], "ops",
+                      .setup = setup_copy_mesh, .cleanup = cleanup_mesh,
+                      .run = run_op, .shape = shapes[i], .mode = modes[j]};
+        bench_run_one(&b, out, nb++ == 0);
+    }
+
+    for (i = 1; i < ARRAY_SIZE(scenes); i++) {
+        b = (bench_t){"mesh_merge", scenes[i].name, &scenes[0], "merges",
+                      .setup = setup_copy_mesh, .cleanup = cleanup_mesh,
+                      .run = run_merge, .other = scenes[i].mesh,
+                      .mode = MODE_OVER};
+        bench_run_one(&b, out, nb++ == 0);
+    }
+
+    b = (bench_t){"mesh_select", .scene = &scenes[0], .unit = "selections",
+                  .setup = setup_new_mesh, .cleanup = cleanup_mesh,
+                  .run = run_select};
+    bench_run_one(&b, out, nb++ == 0);
+
+    for (i = 0; i < ARRAY_SIZE(scenes); i++)
+    for (k = 0; k < ARRAY_SIZE(effects); k++) {
+        b = (bench_t){"mesh_generate_vertices", effects_names[k],
+                      &scenes[i], "blocks",
+                      .setup = setup_vertices, .cleanup = cleanup_vertices,
+                      .run = run_vertices, .effects = effects[k]};
+        bench_run_one(&b, out, nb++ == 0);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(scenes); i++) {
+        b = (bench_t){"mesh_copy", .scene = &scenes[i], .unit = "copies",
+                      .cleanup = cleanup_mesh, .run = run_copy};
+        bench_run_one(&b, out, nb++ == 0);
+    }
+
+    if (!DEFINED(WIN32)) {
+        for (i = 0; i < ARRAY_SIZE(scenes); i++) {
+            b = (bench_t){"gox_save", .scene = &scenes[i], .unit = "voxels",
+                          .setup = setup_image, .cleanup = cleanup_image,
+                          .run = run_save, .path = gox_path};
+            bench_run_one(&b, out, nb++ == 0);
+            b = (bench_t){"gox_load", .scene = &scenes[i], .unit = "voxels",
+                          .setup = setup_image, .cleanup = cleanup_image,
+                          .run = run_load, .path = gox_path};
+            bench_run_one(&b, out, nb++ == 0);
+        }
+        remove(gox_path);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    for (i = 0; i < ARRAY_SIZE(scenes); i++) scene_release(&scenes[i]);
+    return 0;
+}
+
+/*
+ * Rendering benchmark.
+ *
+ * The current image is rendered without the gui, from a fixed orbit of the
+ * camera, for each combination of effects of RENDER_CONFIGS.  A first
+ * orbit warms up the blocks caches, and only the second one is measured.
+ * We wait for the GPU at the end of each frame so that the frames don't
+ * overlap, and the GPU time of each pass comes from the profiler scopes.
+ */
+
+#define RENDER_ORBIT_FRAMES 120
+
+static const struct {
+    const char  *name;
+    int         effects;
+    bool        shadow;
+} RENDER_CONFIGS[] = {
+    {"plain", 0, false},
+    {"borders", EFFECT_BORDERS, false},
+    {"shadow", 0, true},
+    {"borders_shadow", EFFECT_BORDERS, true},
+    {"marching_cubes", EFFECT_MARCHING_CUBES, false},
+    {"marching_cubes_smooth", EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH,
+     false},
+    {"marching_cubes_shadow", EFFECT_MARCHING_CUBES, true},
+};
+
+#define NB_RENDER_CONFIGS ((int)ARRAY_SIZE(RENDER_CONFIGS))
+
+// Measures of a frame.  The GPU times are -1 if not known.
+typedef struct {
+    double      time;
+    double      gpu_main;   // Main view, without the shadow map.
+    double      gpu_shadow;
+    double      gpu_pick;
+    double      draw_calls;
+    double      upload_bytes;
+} render_frame_t;
+
+static struct {
+    int             step;   // Index of the next frame.
+    int             nb_done; // Number of configs with all their measures.
+    camera_t        *camera;
+    camera_t        *base_camera;
+    int             size[2];
+    // Got at the start, since the GL context can be gone at the end.
+    char            gl_renderer[128];
+    char            gl_version[128];
+    double          warmup_start;
+    double          warmup_times[NB_RENDER_CONFIGS];
+    render_frame_t  frames[NB_RENDER_CONFIGS][RENDER_ORBIT_FRAMES];
+} *g_render_bench = NULL;
+
+void bench_render_begin(void)
+{
+    float box[4][4];
+    image_t *img = goxel.image;
+
+    if (!goxel.graphics_initialized) goxel_create_graphics();
+    g_render_bench = calloc(1, sizeof(*g_render_bench));
+    snprintf(g_render_bench->gl_renderer, sizeof(g_render_bench->gl_renderer),
+             "%s", (const char*)glGetString(GL_RENDERER));
+    snprintf(g_render_bench->gl_version, sizeof(g_render_bench->gl_version),
+             "%s", (const char*)glGetString(GL_VERSION));
+    mesh_get_box(image_get_layers_mesh(img), true, box);
+    if (box_is_null(box)) mat4_copy(img->box, box);
+    g_render_bench->base_camera = camera_new("bench");
+    camera_fit_box(g_render_bench->base_camera, box);
+    g_render_bench->camera = image_add_camera(img, NULL);
+
+    profiler_set_enabled(true);
+    // We want all the blocks at each frame.
+    goxel.rend.async = false;
+    goxel.rend.settings.shadow_fit_view = false;
+    goxel.dynres.enabled = false;
+    goxel.views.split = false;
+}
+
+// Get the GPU times of the previous frame, that the profiler collected
+// at the start of this one.
+static void render_bench_collect(render_frame_t *frame)
+{
+    const profiler_event_t *events, *e;
+    double duration, time, view = -1;
+    int i, nb;
+
+    frame->gpu_shadow = 0;
+    frame->gpu_pick = 0;
+    if (!profiler_get_frame(0, &duration, &events, &nb)) nb = 0;
+    for (i = 0; i < nb; i++) {
+        e = &events[i];
+        if (!e->gpu) continue;
+        time = e->gpu_end >= e->gpu_start ? e->gpu_end - e->gpu_start : -1;
+        if (strcmp(e->name, "bench_view") == 0)
+            view = time;
+        else if (strcmp(e->name, "shadow_map") == 0 && frame->gpu_shadow >= 0)
+            frame->gpu_shadow = time < 0 ? -1 : frame->gpu_shadow + time;
+        else if (strcmp(e->name, "pick") == 0 && frame->gpu_pick >= 0)
+            frame->gpu_pick = time < 0 ? -1 : frame->gpu_pick + time;
+    }
+    frame->gpu_main = (view >= 0 && frame->gpu_shadow >= 0) ?
+                      view - frame->gpu_shadow : -1;
+    if (view < 0) frame->gpu_shadow = -1;
+}
+
+bool bench_render_iter(const float viewport[4], float scale)
+{
+    int config, frame, step = g_render_bench->step;
+    uint64_t counters[2][COUNTER_COUNT];
+    float center[2], p[3], n[3];
+    double time;
+    render_frame_t *out = NULL;
+
+    profiler_frame();
+    if (step > 0 && (step - 1) % (2 * RENDER_ORBIT_FRAMES) >=
+                    RENDER_ORBIT_FRAMES) {
+        config = (step - 1) / (2 * RENDER_ORBIT_FRAMES);
+        frame = (step - 1) % RENDER_ORBIT_FRAMES;
+        render_bench_collect(&g_render_bench->frames[config][frame]);
+        if (frame == RENDER_ORBIT_FRAMES - 1)
+            g_render_bench->nb_done = config + 1;
+    }
+    if (step >= NB_RENDER_CONFIGS * 2 * RENDER_ORBIT_FRAMES) return false;
+
+    config = step / (2 * RENDER_ORBIT_FRAMES);
+    frame = step % (2 * RENDER_ORBIT_FRAMES);
+    if (frame == 0) {
+        goxel.rend.settings.effects = RENDER_CONFIGS[config].effects;
+        goxel.rend.settings.shadow = RENDER_CONFIGS[config].shadow ? 0.3 : 0;
+        g_render_bench->warmup_start = sys_get_time();
+        LOG_I("bench render %s", RENDER_CONFIGS[config].name);
+    }
+    if (frame == RENDER_ORBIT_FRAMES) {
+        g_render_bench->warmup_times[config] =
+            sys_get_time() - g_render_bench->warmup_start;
+    }
+    if (frame >= RENDER_ORBIT_FRAMES)
+        out = &g_render_bench->frames[config][frame - RENDER_ORBIT_FRAMES];
+
+    camera_set(g_render_bench->camera, g_render_bench->base_camera);
+    camera_turntable(g_render_bench->camera,
+            2 * M_PI * (frame % RENDER_ORBIT_FRAMES) / RENDER_ORBIT_FRAMES, 0);
+    goxel.rend.fbo = 0;
+    goxel.rend.scale = scale;
+    g_render_bench->size[0] = viewport[2] * scale;
+    g_render_bench->size[1] = viewport[3] * scale;
+
+    counters_get(counters[0]);
+    time = sys_get_time();
+    frame_tasks_begin(goxel.frame_tasks_budget / 1000);
+    frame_tasks_run();
+    profiler_gpu_begin("bench_view");
+    goxel_render_view(viewport, false);
+    profiler_gpu_end();
+    // Also render the pick buffer, as the tools do at each frame.
+    vec2_set(center, viewport[0] + viewport[2] / 2,
+                     viewport[1] + viewport[3] / 2);
+    goxel_unproject(viewport, center, SNAP_MESH, 0, p, n);
+    GL(glFinish());
+    time = sys_get_time() - time;
+    counters_get(counters[1]);
+
+    if (out) {
+        out->time = time;
+        out->draw_calls = counters[1][COUNTER_GL_DRAW_CALLS] -
+                          counters[0][COUNTER_GL_DRAW_CALLS];
+        out->upload_bytes = counters[1][COUNTER_GL_UPLOAD_BYTES] -
+                            counters[0][COUNTER_GL_UPLOAD_BYTES];
+    }
+    g_render_bench->step++;
+    return true;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Write the percentiles of one of the measures of the frames, or null if
+// some of the values are not known.
+static void render_bench_write_stats(FILE *out, const char *name,
+                                     const render_frame_t *frames,
+                                     size_t offset)
+{
+    double v[RENDER_ORBIT_FRAMES], total = 0;
+    const int nb = RENDER_ORBIT_FRAMES;
+    int i;
+
+    fprintf(out, ",\n      \"%s\": ", name);
+    for (i = 0; i < nb; i++) {
+        v[i] = *(const double*)((const char*)&frames[i] + offset);
+        if (v[i] < 0) {
+            fprintf(out, "null");
+            return;
+        }
+        total += v[i];
+    }
+    qsort(v, nb, sizeof(*v), cmp_double);
+    fprintf(out, "{\"mean\": %g, \"p50\": %g, \"p90\": %g, \"p95\": %g, "
+            "\"p99\": %g, \"max\": %g}",
+            total / nb, v[nb / 2], v[(int)ceil(nb * 0.90) - 1],
+            v[(int)ceil(nb * 0.95) - 1], v[(int)ceil(nb * 0.99) - 1],
+            v[nb - 1]);
+}
+
+int bench_render_end(const char *path)
+{
+    FILE *out = stdout;
+    int i, nb = g_render_bench->nb_done;
+    const render_frame_t *frames;
+
+    if (path && strcmp(path, "-") != 0) {
+        out = fopen(path, "w");
+        if (!out) {
+            LOG_E("Cannot open %s", path);
+            goto end;
+        }
+    }
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"block_size\": %d,\n"
+            "  \"gl_renderer\": \"%s\",\n  \"gl_version\": \"%s\",\n"
+            "  \"size\": [%d, %d],\n  \"frames\": %d,\n  \"configs\": [",
+            GOXEL_VERSION_STR, BLOCK_SIZE,
+            g_render_bench->gl_renderer, g_render_bench->gl_version,
+            g_render_bench->size[0], g_render_bench->size[1],
+            RENDER_ORBIT_FRAMES);
+    for (i = 0; i < nb; i++) {
+        frames = g_render_bench->frames[i];
+        fprintf(out, "%s\n    {\n      \"name\": \"%s\",\n"
+                "      \"warmup_time\": %g",
+                i ? "," : "", RENDER_CONFIGS[i].name,
+                g_render_bench->warmup_times[i]);
+        render_bench_write_stats(out, "frame_time", frames,
+                                 offsetof(render_frame_t, time));
+        render_bench_write_stats(out, "gpu_main", frames,
+                                 offsetof(render_frame_t, gpu_main));
+        render_bench_write_stats(out, "gpu_shadow", frames,
+                                 offsetof(render_frame_t, gpu_shadow));
+        render_bench_write_stats(out, "gpu_pick", frames,
+                                 offsetof(render_frame_t, gpu_pick));
+        render_bench_write_stats(out, "draw_calls", frames,
+                                 offsetof(render_frame_t, draw_calls));
+        render_bench_write_stats(out, "upload_bytes", frames,
+                                 offsetof(render_frame_t, upload_bytes));
+        fprintf(out, "\n    }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+end:
+    camera_delete(g_render_bench->base_camera);
+    free(g_render_bench);
+    g_render_bench = NULL;
+    return (nb == NB_RENDER_CONFIGS) ? 0 : -1;
+}
@@ -0,0 +1,396 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "brickmap.h"
+
+#if !defined(GLES2) && defined(GL_VERSION_2_0)
+#   define HAS_3D_TEXTURE 1
+#else
+#   define HAS_3D_TEXTURE 0
+#endif
+
+#define N BLOCK_SIZE
+
+// Size of the pool along x and y, in bricks.  The pool grows along z.
+#define POOL_XY (256 / N)
+// Initial and maximum size of the pool along z, in voxels.
+#define POOL_MIN_DEPTH 64
+#define POOL_MAX_DEPTH 1024
+
+#define MAX_MAPS 8
+// Number of frames we keep the unused maps.
+#define KEEP_FRAMES 60
+// Blocks added around the mesh when we create a grid, so that we don't
+// have to rebuild it for each edit next to the border.
+#define GRID_MARGIN 2
+// Maximum number of cells of a grid.
+#define GRID_MAX_CELLS (256 * 256 * 256)
+
+#if HAS_3D_TEXTURE
+
+typedef struct {
+    brickmap_t  map;
+    bool        used;
+    bool        valid;      // Set to false when the pool has been reset.
+    uint64_t    key;
+    uint64_t    version;
+    int         *bricks;    // Brick index + 1 of each grid cell, or zero.
+    uint8_t     (*grid)[4]; // Copy of the grid texture data.
+    int         last_frame;
+} map_t;
+
+static struct {
+    int         support;    // 0: unknown, 1: supported, -1: not supported.
+    int         max_tex_size;
+    GLuint      pool_tex;
+    int         pool_depth; // In bricks.
+    int         *free_list;
+    int         nb_free;
+    bool        pool_full;  // Set when a brick allocation failed.
+    uint8_t     *buf;       // Voxels of a block.
+    map_t       maps[MAX_MAPS];
+    int         frame;
+} g_bm = {};
+
+static int floor_div(int x, int n)
+{
+    return (x >= 0) ? x / n : -((-x + n - 1) / n);
+}
+
+static void set_tex_params(void)
+{
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+}
+
+// (Re)create the pool texture with all the bricks free.  This invalidates
+// all the maps.
+static void pool_init(int depth)
+{
+    int i, nb = POOL_XY * POOL_XY * depth;
+
+    if (!g_bm.pool_tex) GL(glGenTextures(1, &g_bm.pool_tex));
+    GL(glBindTexture(GL_TEXTURE_3D, g_bm.pool_tex));
+    set_tex_params();
+    GL(glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, POOL_XY * N, POOL_XY * N,
+                    depth * N, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+    g_bm.pool_depth = depth;
+    g_bm.free_list = realloc(g_bm.free_list, nb * sizeof(int));
+    // In reverse order, so that the lowest indices are used first.
+    for (i = 0; i < nb; i++) g_bm.free_list[i] = nb - 1 - i;
+    g_bm.nb_free = nb;
+    for (i = 0; i < MAX_MAPS; i++) {
+        g_bm.maps[i].valid = false;
+        g_bm.maps[i].map.pool_tex = g_bm.pool_tex;
+    }
+}
+
+static bool pool_grow(void)
+{
+    if (g_bm.pool_depth * N * 2 > min(POOL_MAX_DEPTH, g_bm.max_tex_size))
+        return false;
+    LOG_I("Grow bricks pool to %d", g_bm.pool_depth * 2);
+    pool_init(g_bm.pool_depth * 2);
+    return true;
+}
+
+static void map_clear(map_t *map)
+{
+    int i, nb;
+    nb = map->map.grid_size[0] * map->map.grid_size[1] *
+         map->map.grid_size[2];
+    if (map->valid) {
+        for (i = 0; i < nb; i++) {
+            if (map->bricks[i])
+                g_bm.free_list[g_bm.nb_free++] = map->bricks[i] - 1;
+        }
+    }
+    free(map->bricks);
+    free(map->grid);
+    map->bricks = NULL;
+    map->grid = NULL;
+    map->valid = false;
+}
+
+static void map_release(map_t *map)
+{
+    map_clear(map);
+    if (map->map.grid_tex) GL(glDeleteTextures(1, &map->map.grid_tex));
+    memset(map, 0, sizeof(*map));
+}
+
+// Upload a block into the map.  Return false if the block is outside of
+// the grid or if the pool is full.
+static bool map_set_block(map_t *map, const mesh_t *mesh, const int pos[3],
+                          bool upload_grid)
+{
+    int i, c, b, cell[3];
+    const int *size = map->map.grid_size;
+    bool empty = true;
+
+    for (i = 0; i < 3; i++) {
+        cell[i] = (pos[i] - map->map.grid_origin[i]) / N;
+        if (pos[i] < map->map.grid_origin[i] || cell[i] >= size[i])
+            return false;
+    }
+    c = cell[0] + cell[1] * size[0] + cell[2] * size[0] * size[1];
+
+    mesh_read(mesh, pos, (int[]){N, N, N}, g_bm.buf);
+    for (i = 0; i < N * N * N; i++) {
+        if (g_bm.buf[i * 4 + 3] >= 127) {
+            empty = false;
+            break;
+        }
+    }
+
+    if (empty) {
+        if (map->bricks[c])
+            g_bm.free_list[g_bm.nb_free++] = map->bricks[c] - 1;
+        map->bricks[c] = 0;
+        memset(map->grid[c], 0, 4);
+    } else {
+        if (!map->bricks[c]) {
+            if (!g_bm.nb_free) {
+                g_bm.pool_full = true;
+                return false;
+            }
+            map->bricks[c] = g_bm.free_list[--g_bm.nb_free] + 1;
+        }
+        b = map->bricks[c] - 1;
+        map->grid[c][0] = b % POOL_XY;
+        map->grid[c][1] = (b / POOL_XY) % POOL_XY;
+        map->grid[c][2] = b / (POOL_XY * POOL_XY);
+        map->grid[c][3] = 255;
+        GL(glBindTexture(GL_TEXTURE_3D, g_bm.pool_tex));
+        GL(glTexSubImage3D(GL_TEXTURE_3D, 0, map->grid[c][0] * N,
+                           map->grid[c][1] * N, map->grid[c][2] * N,
+                           N, N, N, GL_RGBA, GL_UNSIGNED_BYTE, g_bm.buf));
+        counter_add(COUNTER_GL_UPLOAD_BYTES, N * N * N * 4);
+    }
+
+    if (upload_grid) {
+        GL(glBindTexture(GL_TEXTURE_3D, map->map.grid_tex));
+        GL(glTexSubImage3D(GL_TEXTURE_3D, 0, cell[0], cell[1], cell[2],
+                           1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, map->grid[c]));
+    }
+    return true;
+}
+
+static bool map_rebuild(map_t *map, const mesh_t *mesh)
+{
+    int i, nb, pos[3], bbox[2][3];
+    mesh_iterator_t iter;
+    brickmap_t *m = &map->map;
+
+    map_clear(map);
+    if (!mesh_get_bbox(mesh, bbox, false)) return false;
+    for (i = 0; i < 3; i++) {
+        m->grid_origin[i] = (floor_div(bbox[0][i], N) - GRID_MARGIN) * N;
+        m->grid_size[i] = floor_div(bbox[1][i], N) + 1 + GRID_MARGIN -
+                          m->grid_origin[i] / N;
+        if (m->grid_size[i] > g_bm.max_tex_size) return false;
+    }
+    if ((int64_t)m->grid_size[0] * m->grid_size[1] * m->grid_size[2] >
+            GRID_MAX_CELLS)
+        return false;
+    nb = m->grid_size[0] * m->grid_size[1] * m->grid_size[2];
+    map->bricks = calloc(nb, sizeof(*map->bricks));
+    map->grid = calloc(nb, sizeof(*map->grid));
+    map->valid = true;
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) {
+        if (!map_set_block(map, mesh, pos, false)) return false;
+    }
+
+    if (!m->grid_tex) GL(glGenTextures(1, &m->grid_tex));
+    GL(glBindTexture(GL_TEXTURE_3D, m->grid_tex));
+    set_tex_params();
+    GL(glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, m->grid_size[0],
+                    m->grid_size[1], m->grid_size[2], 0, GL_RGBA,
+                    GL_UNSIGNED_BYTE, map->grid));
+    counter_add(COUNTER_GL_UPLOAD_BYTES, nb * 4);
+    return true;
+}
+
+// Update a map from the list of modified blocks.  Return false if the map
+// needs to be rebuilt.
+static bool map_update(map_t *map, const mesh_t *mesh,
+                       const int (*blocks_pos)[3], int nb)
+{
+    int i;
+    for (i = 0; i < nb; i++) {
+        if (!map_set_block(map, mesh, blocks_pos[i], true)) return false;
+    }
+    return true;
+}
+
+static bool init(void)
+{
+    int major = 0;
+    const char *version;
+
+    GL(version = (const char*)glGetString(GL_VERSION));
+    if (version) sscanf(version, "%d", &major);
+    if (major < 2) return false;
+    GL(glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &g_bm.max_tex_size));
+    if (g_bm.max_tex_size < POOL_XY * N) return false;
+    g_bm.buf = malloc(N * N * N * 4);
+    pool_init(POOL_MIN_DEPTH / N);
+    return true;
+}
+
+bool brickmap_is_supported(void)
+{
+    if (!g_bm.support) {
+        g_bm.support = init() ? 1 : -1;
+        if (g_bm.support < 0) LOG_I("Brick maps not supported");
+    }
+    return g_bm.support > 0;
+}
+
+const brickmap_t *brickmap_get(const mesh_t *mesh)
+{
+    int i, nb;
+    uint64_t key;
+    map_t *map = NULL, *m;
+    int (*blocks_pos)[3] = NULL;
+    bool rebuild = false;
+
+    if (!brickmap_is_supported() || mesh_is_empty(mesh)) return NULL;
+    key = mesh_get_key(mesh);
+
+    // Same mesh as one of the maps, for example the clone layers.
+    for (i = 0; i < MAX_MAPS; i++) {
+        m = &g_bm.maps[i];
+        if (m->used && m->valid && m->key == key) {
+            m->last_frame = g_bm.frame;
+            return &m->map;
+        }
+    }
+
+    // A map of a previous version of the mesh.
+    for (i = 0; i < MAX_MAPS; i++) {
+        m = &g_bm.maps[i];
+        if (!m->used || !m->valid || m->last_frame == g_bm.frame) continue;
+        nb = mesh_get_changes(mesh, m->version, &blocks_pos);
+        if (nb < 0) continue;
+        map = m;
+        rebuild = !map_update(map, mesh, blocks_pos, nb);
+        free(blocks_pos);
+        break;
+    }
+
+    // Else take the least recently used map.
+    if (!map) {
+        rebuild = true;
+        for (i = 0; i < MAX_MAPS; i++) {
+            m = &g_bm.maps[i];
+            if (m->used && m->last_frame == g_bm.frame) continue;
+            if (!map || !m->used ||
+                    (map->used && m->last_frame < map->last_frame))
+                map = m;
+        }
+        if (!map) return NULL;
+    }
+
+    // Note: growing the pool invalidates all the maps, so we also need to
+    // rebuild this one.
+    while (rebuild) {
+        g_bm.pool_full = false;
+        if (map_rebuild(map, mesh)) break;
+        if (!g_bm.pool_full || !pool_grow()) {
+            map_release(map);
+            return NULL;
+        }
+    }
+
+    map->used = true;
+    map->map.pool_tex = g_bm.pool_tex;
+    map->map.pool_size[0] = POOL_XY;
+    map->map.pool_size[1] = POOL_XY;
+    map->map.pool_size[2] = g_bm.pool_depth;
+    map->key = key;
+    map->version = mesh_get_version(mesh);
+    map->last_frame = g_bm.frame;
+    return &map->map;
+}
+
+void brickmap_end_frame(void)
+{
+    int i;
+    map_t *map;
+    if (g_bm.support <= 0) return;
+    for (i = 0; i < MAX_MAPS; i++) {
+        map = &g_bm.maps[i];
+        if (map->used && g_bm.frame - map->last_frame > KEEP_FRAMES)
+            map_release(map);
+    }
+    g_bm.frame++;
+}
+
+void brickmap_release(void)
+{
+    int i;
+    if (g_bm.support > 0) {
+        for (i = 0; i < MAX_MAPS; i++) map_release(&g_bm.maps[i]);
+        GL(glDeleteTextures(1, &g_bm.pool_tex));
+    }
+    free(g_bm.free_list);
+    free(g_bm.buf);
+    memset(&g_bm, 0, sizeof(g_bm));
+}
+
+void brickmap_get_stats(int *nb_bricks, int *capacity)
+{
+    int nb = POOL_XY * POOL_XY * g_bm.pool_depth;
+    *nb_bricks = g_bm.support > 0 ? nb - g_bm.nb_free : 0;
+    *capacity = g_bm.support > 0 ? nb : 0;
+}
+
+#else // HAS_3D_TEXTURE
+
+bool brickmap_is_supported(void)
+{
+    return false;
+}
+
+const brickmap_t *brickmap_get(const mesh_t *mesh)
+{
+    return NULL;
+}
+
+void brickmap_end_frame(void)
+{
+}
+
+void brickmap_release(void)
+{
+}
+
+void brickmap_get_stats(int *nb_bricks, int *capacity)
+{
+    *nb_bricks = 0;
+    *capacity = 0;
+}
+
+#endif
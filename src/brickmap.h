@@ -0,0 +1,104 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Brick maps
+ *
+ * Copy of the meshes voxels into GL 3D textures, for the ray marching
+ * renderer.
+ *
+ * The voxels of each non empty block are uploaded into a brick of a pool
+ * texture shared by all the maps.  Each map then has an indirection grid
+ * texture, with one texel per block of the mesh bounding box, that gives
+ * the position of the block brick in the pool, or zero alpha if the block
+ * is empty.
+ *
+ * The maps are updated incrementally from the mesh changes journal (see
+ * <mesh_get_changes>).  This needs 3D textures, so it is never available
+ * with GLES2 or WebGL.
+ */
+
+#ifndef BRICKMAP_H
+#define BRICKMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mesh.h"
+#include "utils/gl.h"
+
+/*
+ * Type: brickmap_t
+ * The GL textures of a mesh brick map.
+ *
+ * Attributes:
+ *   grid_tex    - RGBA8 indirection texture, one texel per block.  The rgb
+ *                 values are the brick position in the pool, in bricks,
+ *                 and alpha is set if the block is not empty.
+ *   grid_origin - Position of the first voxel of the grid.
+ *   grid_size   - Size of the grid, in blocks.
+ *   pool_tex    - RGBA8 texture of all the bricks voxels.
+ *   pool_size   - Size of the pool texture, in bricks.
+ */
+typedef struct {
+    GLuint  grid_tex;
+    int     grid_origin[3];
+    int     grid_size[3];
+    GLuint  pool_tex;
+    int     pool_size[3];
+} brickmap_t;
+
+/*
+ * Function: brickmap_is_supported
+ * Return whether the brick maps can be used with the current context.
+ */
+bool brickmap_is_supported(void);
+
+/*
+ * Function: brickmap_get
+ * Return the up to date brick map of a mesh.
+ *
+ * The maps are reused from one frame to the other: a map is matched to a
+ * mesh by its key, or else by the changes journal, so that only the
+ * modified blocks are uploaded again.
+ *
+ * Return:
+ *   The map, or NULL if the mesh is empty, or if its blocks don't fit in
+ *   the pool.
+ */
+const brickmap_t *brickmap_get(const mesh_t *mesh);
+
+/*
+ * Function: brickmap_end_frame
+ * Release the maps that have not been used for a while.
+ */
+void brickmap_end_frame(void);
+
+/*
+ * Function: brickmap_release
+ * Release all the GL resources of the brick maps.
+ */
+void brickmap_release(void);
+
+/*
+ * Function: brickmap_get_stats
+ * Get the number of bricks used and the capacity of the pool.
+ */
+void brickmap_get_stats(int *nb_bricks, int *capacity);
+
+#endif // BRICKMAP_H
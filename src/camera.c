@@ -60,7 +60,7 @@ static void compute_clip(const float view_mat[4][4], float *near_, float *far_)
     int i;
     const int margin = 8 * BLOCK_SIZE;
     float vertices[8][3];
-    const mesh_t *mesh = goxel_get_layers_mesh(goxel.image);
+    const mesh_t *mesh = image_get_layers_mesh(goxel.image);
     mesh_iterator_t iter;
 
     if (!box_is_null(goxel.image->box)) {
@@ -159,12 +159,18 @@ void camera_fit_box(camera_t *cam, const float box[4][4])
  */
 uint32_t camera_get_key(const camera_t *cam)
 {
-    uint32_t key = 0;
-    key = XXH32(&cam->name, sizeof(cam->name), key);
-    key = XXH32(&cam->ortho, sizeof(cam->ortho), key);
-    key = XXH32(&cam->dist, sizeof(cam->dist), key);
-    key = XXH32(&cam->mat, sizeof(cam->mat), key);
-    return key;
+    struct {
+        float   mat[4][4];
+        float   dist;
+        bool    ortho;
+    } data;
+
+    memset(&data, 0, sizeof(data)); // Clear the padding bytes.
+    memcpy(data.mat, cam->mat, sizeof(data.mat));
+    data.dist = cam->dist;
+    data.ortho = cam->ortho;
+    return XXH32(cam->name, strnlen(cam->name, sizeof(cam->name)),
+                 XXH32(&data, sizeof(data), 0));
 }
 
 void camera_turntable(camera_t *camera, float rz, float rx)
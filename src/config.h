@@ -39,6 +39,20 @@ extern "C" {
 #   if !defined(__clang__) && __GNUC__ < 6
 #       define YOCTO 0
 #   endif
+// The path tracer runs its own threads.
+#   if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#       define YOCTO 0
+#   endif
+#endif
+
+// Set to 0 to run the parallel jobs and the tasks on the calling thread,
+// for the platforms without threads.
+#ifndef PARALLEL_THREADS
+#   if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#       define PARALLEL_THREADS 0
+#   else
+#       define PARALLEL_THREADS 1
+#   endif
 #endif
 
 // Disable OpenGL deprecation warnings on Mac.
@@ -0,0 +1,489 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "daemon.h"
+#include "file_format.h"
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_ARGS 8
+
+// A loaded image of the cache.
+typedef struct entry entry_t;
+struct entry {
+    entry_t     *next, *prev;   // In the cache list, most recent first.
+    char        *path;
+    int64_t     mtime;
+    int64_t     size;
+    image_t     *img;           // NULL if the file could not be loaded.
+    uint64_t    mem;
+    int         ref;
+    bool        removed;        // Not in the list anymore.
+    pthread_mutex_t lock;       // Held while the image is used.
+};
+
+static struct {
+    int             fd;
+    bool            quit;
+    uint64_t        budget;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    // Accepted connections waiting for a worker.
+    int             *queue;
+    int             queue_size;
+    int             queue_len;
+
+    // Images cache.
+    entry_t         *entries;
+    uint64_t        mem;
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        requests;
+    uint64_t        errors;
+} g_daemon = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Used for the requests that use some global state: the thumbnails render
+// goxel.image, and the gox saves share the incremental save state.
+static pthread_mutex_t g_global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void entry_delete(entry_t *entry)
+{
+    image_delete(entry->img);
+    pthread_mutex_destroy(&entry->lock);
+    free(entry->path);
+    free(entry);
+}
+
+// Remove an entry from the cache list, it is deleted once not used.
+// Called with the daemon lock.
+static void entry_remove(entry_t *entry)
+{
+    if (entry->removed) return;
+    DL_DELETE(g_daemon.entries, entry);
+    entry->removed = true;
+    g_daemon.mem -= entry->mem;
+    if (!entry->ref) entry_delete(entry);
+}
+
+static uint64_t image_get_mem(const image_t *img)
+{
+    const layer_t *layer;
+    uint64_t mem = 0;
+    DL_FOREACH(img->layers, layer)
+        mem += mesh_get_mem(layer->mesh);
+    return mem;
+}
+
+static int image_load(image_t *img, const char *path)
+{
+    const file_format_t *f;
+
+    if (str_endswith(path, ".gox")) return gox_import(img, path);
+    f = file_format_for_path(path, NULL, "r");
+    if (!f) return -1;
+    return f->import_func(img, path);
+}
+
+static void entry_release(entry_t *entry)
+{
+    entry_t *e, *prev;
+
+    pthread_mutex_unlock(&entry->lock);
+    pthread_mutex_lock(&g_daemon.lock);
+    entry->ref--;
+    if (!entry->img && !entry->removed) entry_remove(entry);
+    else if (entry->removed && !entry->ref) entry_delete(entry);
+    // Remove the least recently used images over the budget.
+    for (e = g_daemon.entries ? g_daemon.entries->prev : NULL;
+         e && g_daemon.mem > g_daemon.budget; e = prev) {
+        prev = e == g_daemon.entries ? NULL : e->prev;
+        if (!e->ref) entry_remove(e);
+    }
+    pthread_mutex_unlock(&g_daemon.lock);
+}
+
+/*
+ * Get the cached image of a file, loading it if needed.
+ *
+ * The entry is returned locked, and must be released with entry_release.
+ */
+static entry_t *entry_get(const char *path, char *err, int err_size)
+{
+    struct stat st;
+    entry_t *entry;
+    uint64_t mem;
+
+    if (stat(path, &st) != 0) {
+        snprintf(err, err_size, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+    pthread_mutex_lock(&g_daemon.lock);
+    DL_FOREACH(g_daemon.entries, entry) {
+        if (strcmp(entry->path, path) == 0) break;
+    }
+    if (entry && (entry->mtime != st.st_mtime || entry->size != st.st_size)) {
+        entry_remove(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        g_daemon.hits++;
+        entry->ref++;
+        DL_DELETE(g_daemon.entries, entry);
+        DL_PREPEND(g_daemon.entries, entry);
+        pthread_mutex_unlock(&g_daemon.lock);
+        // Wait for the other requests using it, or for the load.
+        pthread_mutex_lock(&entry->lock);
+        if (!entry->img) {
+            snprintf(err, err_size, "Cannot load %s", path);
+            entry_release(entry);
+            return NULL;
+        }
+        return entry;
+    }
+
+    // Add the entry first, so that the other requests on the same file
+    // wait for this load.
+    g_daemon.misses++;
+    entry = calloc(1, sizeof(*entry));
+    entry->path = strdup(path);
+    entry->mtime = st.st_mtime;
+    entry->size = st.st_size;
+    entry->ref = 1;
+    pthread_mutex_init(&entry->lock, NULL);
+    pthread_mutex_lock(&entry->lock);
+    DL_PREPEND(g_daemon.entries, entry);
+    pthread_mutex_unlock(&g_daemon.lock);
+
+    entry->img = image_new();
+    if (image_load(entry->img, path) != 0) {
+        image_delete(entry->img);
+        entry->img = NULL;
+        snprintf(err, err_size, "Cannot load %s", path);
+        entry_release(entry);
+        return NULL;
+    }
+    mem = image_get_mem(entry->img);
+    pthread_mutex_lock(&g_daemon.lock);
+    entry->mem = mem;
+    if (!entry->removed) g_daemon.mem += mem;
+    pthread_mutex_unlock(&g_daemon.lock);
+    return entry;
+}
+
+static int export_image(const image_t *img, const char *path)
+{
+    const file_format_t *f;
+
+    if (str_endswith(path, ".gox")) {
+        pthread_mutex_lock(&g_global_lock);
+        save_to_file(img, path);
+        pthread_mutex_unlock(&g_global_lock);
+        return 0;
+    }
+    f = file_format_for_path(path, NULL, "w");
+    if (!f) return -1;
+    return f->export_func(img, path);
+}
+
+// Same as the --render option, with the default camera.
+static int render_thumbnail(image_t *img, const char *path,
+                            int w, int h, int samples)
+{
+    pathtracer_t *pt = &goxel.pathtracer;
+    image_t *prev_img;
+    camera_t *camera;
+    int ret;
+
+    pthread_mutex_lock(&g_global_lock);
+    prev_img = goxel.image;
+    goxel.image = img;
+    if (!img->cameras) image_add_camera(img, NULL);
+    camera = img->active_camera ?: img->cameras;
+    img->active_camera = camera;
+    camera->aspect = (float)w / h;
+    camera_update(camera);
+    mat4_copy(camera->view_mat, goxel.rend.view_mat);
+    mat4_copy(camera->proj_mat, goxel.rend.proj_mat);
+    if (samples > 0) pt->num_samples = samples;
+    pt->w = w;
+    pt->h = h;
+    pt->buf = calloc(pt->w * pt->h, 4);
+    pathtracer_render(pt, 0, 1);
+    ret = pathtracer_save(pt, path);
+    free(pt->buf);
+    pt->buf = NULL;
+    goxel.image = prev_img;
+    pthread_mutex_unlock(&g_global_lock);
+    return ret;
+}
+
+static int get_stats(image_t *img, char *out, int size)
+{
+    const mesh_t *mesh;
+    const layer_t *layer;
+    mesh_stats_t stats;
+    int nb_layers = 0, bbox[2][3];
+    char bbox_str[128] = "null";
+
+    DL_FOREACH(img->layers, layer) nb_layers++;
+    mesh = image_get_layers_mesh(img);
+    mesh_get_stats(mesh, &stats);
+    if (mesh_get_bbox(mesh, bbox, true)) {
+        snprintf(bbox_str, sizeof(bbox_str), "[[%d, %d, %d], [%d, %d, %d]]",
+                 bbox[0][0], bbox[0][1], bbox[0][2],
+                 bbox[1][0], bbox[1][1], bbox[1][2]);
+    }
+    snprintf(out, size, "{\"layers\": %d, \"blocks\": %d, "
+             "\"voxels\": %" PRId64 ", \"bbox\": %s, \"mem\": %" PRIu64 "}",
+             nb_layers, stats.nb_blocks, stats.nb_voxels, bbox_str,
+             image_get_mem(img));
+    return 0;
+}
+
+// Split a request line into words, in place.
+static int parse_args(char *line, char *argv[MAX_ARGS])
+{
+    int argc = 0;
+    char *s = line;
+
+    while (argc < MAX_ARGS) {
+        while (*s == ' ' || *s == '\t') s++;
+        if (!*s || *s == '\n' || *s == '\r') break;
+        if (*s == '"') {
+            argv[argc++] = ++s;
+            while (*s && *s != '"') s++;
+        } else {
+            argv[argc++] = s;
+            while (*s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r')
+                s++;
+        }
+        if (!*s) break;
+        *s++ = '\0';
+    }
+    return argc;
+}
+
+// Process a request, and write the answer into out.
+static int process(int argc, char **argv, char *out, int size)
+{
+    entry_t *entry;
+    int ret = 0, w = 128, h = 128, samples = 0;
+    const char *cmd = argc ? argv[0] : "";
+
+    if (strcmp(cmd, "status") == 0) {
+        pthread_mutex_lock(&g_daemon.lock);
+        snprintf(out, size, "{\"requests\": %" PRIu64 ", \"errors\": %"
+                 PRIu64 ", \"cache_hits\": %" PRIu64 ", \"cache_misses\": %"
+                 PRIu64 ", \"cache_mem\": %" PRIu64 "}",
+                 g_daemon.requests, g_daemon.errors, g_daemon.hits,
+                 g_daemon.misses, g_daemon.mem);
+        pthread_mutex_unlock(&g_daemon.lock);
+        return 0;
+    }
+    if (strcmp(cmd, "shutdown") == 0) {
+        pthread_mutex_lock(&g_daemon.lock);
+        g_daemon.quit = true;
+        shutdown(g_daemon.fd, SHUT_RDWR);
+        pthread_mutex_unlock(&g_daemon.lock);
+        return 0;
+    }
+
+    if (    !(strcmp(cmd, "load") == 0 && argc == 2) &&
+            !(strcmp(cmd, "stats") == 0 && argc == 2) &&
+            !(strcmp(cmd, "convert") == 0 && argc == 3) &&
+            !(strcmp(cmd, "thumbnail") == 0 && argc >= 3 && argc <= 6)) {
+        snprintf(out, size, "Invalid request");
+        return -1;
+    }
+    if (strcmp(cmd, "thumbnail") == 0 && argc >= 5) {
+        w = atoi(argv[3]);
+        h = atoi(argv[4]);
+        if (argc == 6) samples = atoi(argv[5]);
+        if (w <= 0 || h <= 0 || w > 8192 || h > 8192) {
+            snprintf(out, size, "Invalid size");
+            return -1;
+        }
+    }
+
+    entry = entry_get(argv[1], out, size);
+    if (!entry) return -1;
+    if (strcmp(cmd, "stats") == 0) {
+        ret = get_stats(entry->img, out, size);
+    } else if (strcmp(cmd, "convert") == 0) {
+        ret = export_image(entry->img, argv[2]);
+        if (ret) snprintf(out, size, "Cannot export %s", argv[2]);
+    } else if (strcmp(cmd, "thumbnail") == 0) {
+        ret = render_thumbnail(entry->img, argv[2], w, h, samples);
+        if (ret) snprintf(out, size, "Cannot save %s", argv[2]);
+    }
+    entry_release(entry);
+    return ret;
+}
+
+static void serve(int fd)
+{
+    FILE *in;
+    char line[4096], out[1024], *argv[MAX_ARGS];
+    int argc, ret, len;
+    double time;
+
+    in = fdopen(fd, "r");
+    if (!in) {
+        close(fd);
+        return;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        argc = parse_args(line, argv);
+        if (!argc) continue;
+        time = sys_get_time();
+        out[0] = '\0';
+        ret = process(argc, argv, out, sizeof(out));
+        LOG_D("%s %s (%.3fs)", argv[0], ret ? "error" : "ok",
+              sys_get_time() - time);
+        pthread_mutex_lock(&g_daemon.lock);
+        g_daemon.requests++;
+        if (ret) g_daemon.errors++;
+        pthread_mutex_unlock(&g_daemon.lock);
+
+        len = snprintf(line, sizeof(line), "%s%s%s\n", ret ? "ERR" : "OK",
+                       out[0] ? " " : "", out);
+        if (write(fd, line, min(len, sizeof(line) - 1)) < 0) break;
+    }
+    fclose(in);
+}
+
+static void *worker_func(void *arg)
+{
+    int fd;
+
+    while (true) {
+        pthread_mutex_lock(&g_daemon.lock);
+        while (!g_daemon.queue_len && !g_daemon.quit)
+            pthread_cond_wait(&g_daemon.cond, &g_daemon.lock);
+        if (!g_daemon.queue_len) {
+            pthread_mutex_unlock(&g_daemon.lock);
+            break;
+        }
+        fd = g_daemon.queue[0];
+        memmove(g_daemon.queue, g_daemon.queue + 1,
+                --g_daemon.queue_len * sizeof(*g_daemon.queue));
+        pthread_mutex_unlock(&g_daemon.lock);
+        serve(fd);
+    }
+    return NULL;
+}
+
+int daemon_run(const char *path, int nb_workers, int cache_size)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    pthread_t *workers;
+    int i, fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_E("Socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    g_daemon.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_daemon.fd < 0) {
+        LOG_E("Cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+    // Remove the socket of a previous run.
+    unlink(path);
+    if (    bind(g_daemon.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(g_daemon.fd, 64) != 0) {
+        LOG_E("Cannot listen on %s: %s", path, strerror(errno));
+        close(g_daemon.fd);
+        return -1;
+    }
+    // Don't die if a client closes its connection before the answer.
+    signal(SIGPIPE, SIG_IGN);
+
+    g_daemon.budget = (uint64_t)max(cache_size, 0) * MB;
+    nb_workers = max(nb_workers, 1);
+    workers = calloc(nb_workers, sizeof(*workers));
+    for (i = 0; i < nb_workers; i++)
+        pthread_create(&workers[i], NULL, worker_func, NULL);
+    LOG_I("Daemon listening on %s with %d workers", path, nb_workers);
+
+    while (true) {
+        fd = accept(g_daemon.fd, NULL, NULL);
+        pthread_mutex_lock(&g_daemon.lock);
+        if (g_daemon.quit) {
+            pthread_mutex_unlock(&g_daemon.lock);
+            if (fd >= 0) close(fd);
+            break;
+        }
+        if (fd < 0) {
+            pthread_mutex_unlock(&g_daemon.lock);
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_E("Cannot accept connection: %s", strerror(errno));
+            break;
+        }
+        if (g_daemon.queue_len >= g_daemon.queue_size) {
+            g_daemon.queue_size = max(g_daemon.queue_size * 2, 16);
+            g_daemon.queue = realloc(g_daemon.queue,
+                    g_daemon.queue_size * sizeof(*g_daemon.queue));
+        }
+        g_daemon.queue[g_daemon.queue_len++] = fd;
+        pthread_cond_signal(&g_daemon.cond);
+        pthread_mutex_unlock(&g_daemon.lock);
+    }
+
+    // Let the workers finish the queued connections.
+    pthread_mutex_lock(&g_daemon.lock);
+    g_daemon.quit = true;
+    pthread_cond_broadcast(&g_daemon.cond);
+    pthread_mutex_unlock(&g_daemon.lock);
+    for (i = 0; i < nb_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    close(g_daemon.fd);
+    unlink(path);
+    while (g_daemon.entries) entry_remove(g_daemon.entries);
+    free(g_daemon.queue);
+    g_daemon.queue = NULL;
+    g_daemon.queue_len = g_daemon.queue_size = 0;
+    LOG_I("Daemon stopped");
+    return 0;
+}
+
+#else // No sockets support.
+
+int daemon_run(const char *path, int nb_workers, int cache_size)
+{
+    LOG_E("The daemon is not supported on this system");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,66 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Daemon
+ *
+ * Serve conversion, thumbnail and stats requests over a unix socket, so
+ * that the tools converting many files don't pay the startup cost of a
+ * new process for each of them.
+ *
+ * The requests are lines of space separated words (use double quotes for
+ * the paths with spaces), and each gets a one line answer, starting with
+ * 'OK' or 'ERR'.  A connection can send several requests:
+ *
+ *  load INPUT                  - Load a file into the cache.
+ *  convert INPUT OUTPUT        - Export a file to an other format.
+ *  thumbnail INPUT OUTPUT [W H [SAMPLES]]
+ *                              - Render a file with the path tracer.
+ *  stats INPUT                 - Answer a JSON object with the number of
+ *                                layers, blocks, voxels, the bounding box
+ *                                and the memory used.
+ *  status                      - Answer a JSON object with the cache and
+ *                                requests counters.
+ *  shutdown                    - Stop the daemon.
+ *
+ * The connections are served in parallel by a pool of threads.  The loaded
+ * images are kept in a cache, keyed by path, modification time and size,
+ * so that the requests on the same file don't load it again.  The requests
+ * on the same image are serialized, as well as the thumbnails, since the
+ * path tracer renders the global image.  This is only supported on the
+ * posix systems.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/*
+ * Function: daemon_run
+ * Serve the requests until a shutdown request.
+ *
+ * Parameters:
+ *   path       - Path of the unix socket to create.
+ *   nb_workers - Number of connections served in parallel.
+ *   cache_size - Memory budget of the images cache, in MB.
+ *
+ * Return:
+ *   0 on success, or -1 if the socket cannot be created.
+ */
+int daemon_run(const char *path, int nb_workers, int cache_size);
+
+#endif // DAEMON_H
@@ -26,6 +26,11 @@
 // The global hash table of file formats.
 file_format_t *file_formats = NULL;
 
+static struct {
+    bool (*f)(void *user, float progress);
+    void *user;
+} g_progress = {};
+
 static bool endswith(const char *str, const char *end)
 {
     const char *start;
@@ -78,3 +83,16 @@ void file_format_iter(const char *mode, void *user,
         fun(user, f);
     }
 }
+
+void file_format_set_progress_callback(bool (*f)(void *user, float progress),
+                                       void *user)
+{
+    g_progress.f = f;
+    g_progress.user = user;
+}
+
+bool file_format_report_progress(float progress)
+{
+    if (!g_progress.f) return true;
+    return g_progress.f(g_progress.user, progress);
+}
@@ -40,6 +40,29 @@ const file_format_t *file_format_for_path(const char *path, const char *name,
 void file_format_iter(const char *mode, void *user,
                       void (*f)(void *user, const file_format_t *f));
 
+/*
+ * Function: file_format_set_progress_callback
+ * Set a function called regularly by the long exports to report their
+ * progress.
+ *
+ * Parameters:
+ *   f    - The callback, with the progress in [0, 1].  If it returns
+ *          false, the current export is cancelled and returns an error.
+ *          Can be NULL.
+ *   user - User data passed to the callback.
+ */
+void file_format_set_progress_callback(bool (*f)(void *user, float progress),
+                                       void *user);
+
+/*
+ * Function: file_format_report_progress
+ * Called by the exports to report their progress.
+ *
+ * Return:
+ *   False if the export should be cancelled.
+ */
+bool file_format_report_progress(float progress);
+
 // The global list of registered file formats.
 extern file_format_t *file_formats;
 
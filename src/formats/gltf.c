@@ -19,9 +19,12 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "voxelize.h"
 #include "utils/json.h"
 #include "utils/vec.h"
 
+#include <errno.h>
+
 #define CGLTF_IMPLEMENTATION
 #define CGLTF_WRITE_IMPLEMENTATION
 #include "../ext_src/cgltf/cgltf_write.h"
@@ -30,6 +33,11 @@ typedef struct {
     cgltf_data *data;
     palette_t palette;
     cgltf_material *default_mat;
+    // All the binary data goes into a single buffer.
+    cgltf_buffer *buffer;
+    uint8_t *bin;
+    int bin_size;
+    int bin_capacity;
 } gltf_t;
 
 typedef struct {
@@ -45,8 +53,13 @@ typedef struct {
 
 typedef struct {
     bool vertex_color;
+    bool mesh_per_layer; // One mesh per layer instead of one per block.
 } export_options_t;
 
+// Max number of vertices in a layer primitive, so that we can use 16 bits
+// indices.
+#define PRIMITIVE_MAX_VERTICES 65536
+
 static export_options_t g_export_options = {};
 
 
@@ -142,7 +155,7 @@ static void gltf_init(gltf_t *g, const export_options_t *options,
     ALLOC(g->data->nodes, 1 + nb_blocks + DL_SIZE(img->layers));
     ALLOC(g->data->meshes, nb_blocks);
     ALLOC(g->data->accessors, nb_blocks * 4);
-    ALLOC(g->data->buffers, nb_blocks * 2 + 1);
+    ALLOC(g->data->buffers, 1);
     ALLOC(g->data->buffer_views, nb_blocks * 2 + 1);
     ALLOC(g->data->images, 1);
     ALLOC(g->data->textures, 1);
@@ -150,6 +163,33 @@ static void gltf_init(gltf_t *g, const export_options_t *options,
 
 #define add_item(data, list) ({ &data->list[data->list##_count++]; })
 
+// Append some data to the binary buffer, and create a buffer view for it.
+static cgltf_buffer_view *add_buffer_view(gltf_t *g, const void *data,
+                                          int size, cgltf_buffer_view_type type)
+{
+    cgltf_buffer_view *buffer_view;
+    int ofs;
+
+    if (!g->buffer) g->buffer = add_item(g->data, buffers);
+    // Keep all the views aligned to 4 bytes.
+    ofs = (g->bin_size + 3) & ~3;
+    if (ofs + size > g->bin_capacity) {
+        g->bin_capacity = max(g->bin_capacity * 2, ofs + size);
+        g->bin = realloc(g->bin, g->bin_capacity);
+    }
+    memset(g->bin + g->bin_size, 0, ofs - g->bin_size);
+    memcpy(g->bin + ofs, data, size);
+    g->bin_size = ofs + size;
+    g->buffer->size = g->bin_size;
+
+    buffer_view = add_item(g->data, buffer_views);
+    buffer_view->buffer = g->buffer;
+    buffer_view->offset = ofs;
+    buffer_view->size = size;
+    buffer_view->type = type;
+    return buffer_view;
+}
+
 // Create a buffer view and attribute.
 static void make_attribute(gltf_t *g, cgltf_buffer_view *buffer_view,
                            cgltf_primitive *primitive,
@@ -186,27 +226,32 @@ static void make_attribute(gltf_t *g, cgltf_buffer_view *buffer_view,
 static void make_quad_indices(gltf_t *g, cgltf_primitive *primitive,
                               int nb, int size)
 {
-    cgltf_buffer *buffer;
     cgltf_buffer_view *buffer_view;
     cgltf_accessor *accessor;
-    uint16_t *data;
-    int i;
-
-    data = calloc(nb * 6, sizeof(*data));
-    for (i = 0; i < nb * 6; i++)
-        data[i] = (i / 6) * 4 + ((int[]){0, 1, 2, 2, 3, 0})[i % 6];
-    buffer = add_item(g->data, buffers);
-    buffer->size = nb * 6 * sizeof(*data);
-    buffer->uri = data_new(data, nb * 6 * sizeof(*data), NULL);
-    free(data);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = nb * 6 * sizeof(*data);
-    buffer_view->type = cgltf_buffer_view_type_indices;
+    uint16_t *data16 = NULL;
+    uint32_t *data32 = NULL;
+    bool use_32 = nb * 4 > PRIMITIVE_MAX_VERTICES;
+    int i, v;
+
+    if (use_32)
+        data32 = calloc(nb * 6, sizeof(*data32));
+    else
+        data16 = calloc(nb * 6, sizeof(*data16));
+    for (i = 0; i < nb * 6; i++) {
+        v = (i / 6) * 4 + ((int[]){0, 1, 2, 2, 3, 0})[i % 6];
+        if (use_32) data32[i] = v;
+        else data16[i] = v;
+    }
+    buffer_view = add_buffer_view(g, use_32 ? (void*)data32 : (void*)data16,
+                                  nb * 6 * (use_32 ? 4 : 2),
+                                  cgltf_buffer_view_type_indices);
+    free(data16);
+    free(data32);
 
     accessor = add_item(g->data, accessors);
     accessor->buffer_view = buffer_view;
-    accessor->component_type = cgltf_component_type_r_16u;
+    accessor->component_type = use_32 ? cgltf_component_type_r_32u :
+                                        cgltf_component_type_r_16u;
     accessor->count = nb * 6;
     accessor->type = cgltf_type_scalar;
     primitive->indices = accessor;
@@ -214,7 +259,7 @@ static void make_quad_indices(gltf_t *g, cgltf_primitive *primitive,
 
 static void fill_buffer(const gltf_t *g, gltf_vertex_t *bverts,
                         const voxel_vertex_t *verts, int nb, int subdivide,
-                        bool vertex_color)
+                        const int ofs[3], bool vertex_color)
 {
     int i, c, s = 0;
     float uv[2];
@@ -224,9 +269,9 @@ static void fill_buffer(const gltf_t *g, gltf_vertex_t *bverts,
         s = max(next_pow2(ceil(log2(g->palette.size))), 16);
 
     for (i = 0; i < nb; i++) {
-        bverts[i].pos[0] = (float)verts[i].pos[0] / subdivide;
-        bverts[i].pos[1] = (float)verts[i].pos[1] / subdivide;
-        bverts[i].pos[2] = (float)verts[i].pos[2] / subdivide;
+        bverts[i].pos[0] = (float)verts[i].pos[0] / subdivide + ofs[0];
+        bverts[i].pos[1] = (float)verts[i].pos[1] / subdivide + ofs[1];
+        bverts[i].pos[2] = (float)verts[i].pos[2] / subdivide + ofs[2];
         bverts[i].normal[0] = verts[i].normal[0];
         bverts[i].normal[1] = verts[i].normal[1];
         bverts[i].normal[2] = verts[i].normal[2];
@@ -248,7 +293,7 @@ static void fill_buffer(const gltf_t *g, gltf_vertex_t *bverts,
     }
 }
 
-static void get_pos_min_max(gltf_vertex_t *bverts, int nb,
+static void get_pos_min_max(const gltf_vertex_t *bverts, int nb,
                             float pos_min[3], float pos_max[3])
 {
     int i;
@@ -316,99 +361,151 @@ static cgltf_material *get_default_mat(
     return g->default_mat;
 }
 
-static void save_layer(gltf_t *g, cgltf_node *root_node,
-                       const image_t *img, const layer_t *layer,
-                       const export_options_t *options)
+// Add a primitive with the given vertices to a mesh.
+static void add_primitive(gltf_t *g, cgltf_mesh *gmesh,
+                          const image_t *img, const layer_t *layer,
+                          const export_options_t *options,
+                          const gltf_vertex_t *gverts, int nb_elems, int size)
 {
-    cgltf_mesh *gmesh;
     cgltf_primitive *primitive;
-    cgltf_buffer *buffer;
-    cgltf_node *node, *layer_node;
     cgltf_buffer_view *buffer_view;
-    mesh_iterator_t iter;
-    int nb_elems, bpos[3], size = 0, subdivide;
-    voxel_vertex_t *verts;
-    const int N = BLOCK_SIZE;
-    gltf_vertex_t *gverts;
-    int buf_size, start_nodes_count, i;
     float pos_min[3], pos_max[3];
-    mesh_t *mesh = layer->mesh;
+    int nb = nb_elems * size;
+
+    primitive = add_item(gmesh, primitives);
+    primitive->type = cgltf_primitive_type_triangles;
+    ALLOC(primitive->attributes, 3);
+    if (layer->material) {
+        primitive->material = g->data->materials +
+                                  get_material_idx(img, layer->material);
+    } else {
+        primitive->material = get_default_mat(g, options);
+    }
 
-    start_nodes_count = g->data->nodes_count;
+    if (size == 4)
+        make_quad_indices(g, primitive, nb_elems, size);
+
+    get_pos_min_max(gverts, nb, pos_min, pos_max);
+    buffer_view = add_buffer_view(g, gverts, nb * sizeof(*gverts),
+                                  cgltf_buffer_view_type_vertices);
+    buffer_view->stride = sizeof(gltf_vertex_t);
+
+    make_attribute(g, buffer_view, primitive,
+                   "POSITION",
+                   cgltf_component_type_r_32f,
+                   cgltf_type_vec3, false,
+                   nb, offsetof(gltf_vertex_t, pos),
+                   pos_min, pos_max);
+    make_attribute(g, buffer_view, primitive,
+                   "NORMAL",
+                   cgltf_component_type_r_32f,
+                   cgltf_type_vec3, false,
+                   nb, offsetof(gltf_vertex_t, normal),
+                   NULL, NULL);
+
+    if (options->vertex_color) {
+        make_attribute(g, buffer_view, primitive,
+                       "COLOR_0",
+                       cgltf_component_type_r_8u,
+                       cgltf_type_vec4, true,
+                       nb, offsetof(gltf_vertex_t, color),
+                       NULL, NULL);
+    } else {
+        make_attribute(g, buffer_view, primitive,
+                       "TEXCOORD_0",
+                       cgltf_component_type_r_32f, cgltf_type_vec2, false,
+                       nb, offsetof(gltf_vertex_t, texcoord),
+                       NULL, NULL);
+    }
+}
 
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    gverts = calloc(N * N * N * 6 * 4, sizeof(*gverts));
-
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, bpos)) {
-        nb_elems = mesh_generate_vertices(mesh, bpos,
-                                    goxel.rend.settings.effects, verts,
-                                    &size, &subdivide);
-        if (!nb_elems) continue;
-        fill_buffer(g, gverts, verts, nb_elems * size, subdivide,
-                    options->vertex_color);
-        get_pos_min_max(gverts, nb_elems * size, pos_min, pos_max);
-        buf_size = nb_elems * size * sizeof(*gverts);
-
-        buffer = add_item(g->data, buffers);
-        buffer->size = buf_size;
-        buffer->uri = data_new(gverts, buf_size, NULL);
+typedef struct {
+    gltf_t                  *g;
+    const image_t           *img;
+    const layer_t           *layer;
+    const export_options_t  *options;
+    cgltf_mesh              *gmesh;     // Only for mesh_per_layer.
+    gltf_vertex_t           *gverts;
+    int                     nb;         // Number of vertices in gverts.
+    int                     size;
+} save_layer_t;
+
+static int save_block(void *user, const mesh_block_vertices_t *b)
+{
+    save_layer_t *s = user;
+    gltf_t *g = s->g;
+    cgltf_mesh *gmesh;
+    cgltf_node *node;
+    int nb = b->nb * b->size;
+
+    if (!nb) goto end;
+    if (!s->options->mesh_per_layer) {
+        fill_buffer(g, s->gverts, b->verts, nb, b->subdivide,
+                    (int[]){0, 0, 0}, s->options->vertex_color);
         gmesh = add_item(g->data, meshes);
         ALLOC(gmesh->primitives, 1);
-        primitive = add_item(gmesh, primitives);
-        primitive->type = cgltf_primitive_type_triangles;
-        ALLOC(primitive->attributes, 3);
-        if (layer->material) {
-            primitive->material = g->data->materials +
-                                      get_material_idx(img, layer->material);
-        } else {
-            primitive->material = get_default_mat(g, options);
-        }
+        add_primitive(g, gmesh, s->img, s->layer, s->options, s->gverts,
+                      b->nb, b->size);
+        node = add_item(g->data, nodes);
+        vec3_set(node->translation, b->pos[0], b->pos[1], b->pos[2]);
+        node->has_translation = true;
+        node->mesh = gmesh;
+        goto end;
+    }
 
-        if (size == 4)
-            make_quad_indices(g, primitive, nb_elems, size);
+    // Pack the blocks into primitives of at most 64k vertices.
+    if (s->nb && s->nb + nb > PRIMITIVE_MAX_VERTICES) {
+        add_primitive(g, s->gmesh, s->img, s->layer, s->options, s->gverts,
+                      s->nb / s->size, s->size);
+        s->nb = 0;
+    }
+    fill_buffer(g, s->gverts + s->nb, b->verts, nb, b->subdivide,
+                b->pos, s->options->vertex_color);
+    s->nb += nb;
+    s->size = b->size;
 
-        buffer_view = add_item(g->data, buffer_views);
-        buffer_view->buffer = buffer;
-        buffer_view->size = buf_size;
-        buffer_view->stride = sizeof(gltf_vertex_t);
-        buffer_view->type = cgltf_buffer_view_type_vertices;
+end:
+    return file_format_report_progress((b->index + 1.0) / b->count) ? 0 : -1;
+}
 
-        make_attribute(g, buffer_view, primitive,
-                       "POSITION",
-                       cgltf_component_type_r_32f,
-                       cgltf_type_vec3, false,
-                       nb_elems * size, offsetof(gltf_vertex_t, pos),
-                       pos_min, pos_max);
-        make_attribute(g, buffer_view, primitive,
-                       "NORMAL",
-                       cgltf_component_type_r_32f,
-                       cgltf_type_vec3, false,
-                       nb_elems * size, offsetof(gltf_vertex_t, normal),
-                       NULL, NULL);
+static int save_layer(gltf_t *g, cgltf_node *root_node,
+                      const image_t *img, const layer_t *layer,
+                      const export_options_t *options)
+{
+    cgltf_node *node, *layer_node;
+    mesh_iterator_t iter;
+    int bpos[3], nb_blocks = 0, start_nodes_count, i, capacity, ret;
+    const int N = BLOCK_SIZE;
+    const int max_block_verts = N * N * N * 6 * 4;
+    save_layer_t s = {g, img, layer, options};
+    mesh_t *mesh = layer->mesh;
 
-        if (options->vertex_color) {
-            make_attribute(g, buffer_view, primitive,
-                           "COLOR_0",
-                           cgltf_component_type_r_8u,
-                           cgltf_type_vec4, true,
-                           nb_elems * size, offsetof(gltf_vertex_t, color),
-                           NULL, NULL);
-        } else {
-            make_attribute(g, buffer_view, primitive,
-                           "TEXCOORD_0",
-                           cgltf_component_type_r_32f, cgltf_type_vec2, false,
-                           nb_elems * size, offsetof(gltf_vertex_t, texcoord),
-                           NULL, NULL);
+    start_nodes_count = g->data->nodes_count;
+
+    capacity = max_block_verts;
+    if (options->mesh_per_layer) {
+        capacity += PRIMITIVE_MAX_VERTICES;
+        iter = mesh_get_iterator(mesh,
+                MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+        while (mesh_iter(&iter, bpos)) nb_blocks++;
+        if (nb_blocks) {
+            s.gmesh = add_item(g->data, meshes);
+            ALLOC(s.gmesh->primitives, nb_blocks);
         }
+    }
+    s.gverts = calloc(capacity, sizeof(*s.gverts));
+
+    ret = mesh_iter_vertices(mesh,
+            goxel.rend.settings.effects | EFFECT_MERGE_FACES, &s, save_block);
+    if (!ret && s.nb) {
+        add_primitive(g, s.gmesh, img, layer, options, s.gverts,
+                      s.nb / s.size, s.size);
+    }
+    if (!ret && s.gmesh) {
         node = add_item(g->data, nodes);
-        vec3_set(node->translation, bpos[0], bpos[1], bpos[2]);
-        node->has_translation = true;
-        node->mesh = gmesh;
+        node->mesh = s.gmesh;
     }
-    free(verts);
-    free(gverts);
+    free(s.gverts);
 
     // Add all the new created nodes into a single layer node.
     layer_node = add_item(g->data, nodes);
@@ -417,6 +514,7 @@ static void save_layer(gltf_t *g, cgltf_node *root_node,
         *add_item(layer_node, children) = &g->data->nodes[i];
     }
     *add_item(root_node, children) = layer_node;
+    return ret;
 }
 
 static void create_palette_texture(gltf_t *g, const image_t *img)
@@ -428,7 +526,6 @@ static void create_palette_texture(gltf_t *g, const image_t *img)
     uint8_t c[4];
     uint8_t (*data)[3];
     uint8_t *png;
-    cgltf_buffer *buffer;
     cgltf_buffer_view *buffer_view;
     cgltf_image *image;
     cgltf_texture *texture;
@@ -447,12 +544,7 @@ static void create_palette_texture(gltf_t *g, const image_t *img)
         memcpy(data[i], g->palette.entries[i].color, 3);
     png = img_write_to_mem((void*)data, s, s, 3, &size);
     free(data);
-    buffer = add_item(g->data, buffers);
-    buffer->size = size;
-    buffer->uri = data_new(png, size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = size;
+    buffer_view = add_buffer_view(g, png, size, cgltf_buffer_view_type_invalid);
     image = add_item(g->data, images);
     image->mime_type = strdup("image/png");
     image->buffer_view = buffer_view;
@@ -461,14 +553,63 @@ static void create_palette_texture(gltf_t *g, const image_t *img)
     free(png);
 }
 
-static void gltf_export(const image_t *img, const char *path,
-                        const export_options_t *options)
+/*
+ * Write the glb binary container: a JSON chunk followed by a BIN chunk
+ * with the buffer data.
+ */
+static int write_glb(const cgltf_data *data, const uint8_t *bin, int bin_size,
+                     const char *path)
+{
+    FILE *file;
+    char *json;
+    int json_size, json_len, bin_len;
+    uint32_t header[3], chunk[2];
+    const uint8_t pad[4] = {' ', ' ', ' ', ' '};
+    const uint8_t zeros[4] = {};
+
+    json_size = cgltf_write(NULL, NULL, 0, data);
+    json = malloc(json_size);
+    cgltf_write(NULL, json, json_size, data);
+    json_size--; // Remove the null terminator.
+    json_len = (json_size + 3) & ~3;
+    bin_len = (bin_size + 3) & ~3;
+
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        free(json);
+        return -1;
+    }
+    header[0] = 0x46546C67; // 'glTF'
+    header[1] = 2;
+    header[2] = 12 + 8 + json_len + (bin_size ? 8 + bin_len : 0);
+    fwrite(header, sizeof(header), 1, file);
+    chunk[0] = json_len;
+    chunk[1] = 0x4E4F534A; // 'JSON'
+    fwrite(chunk, sizeof(chunk), 1, file);
+    fwrite(json, json_size, 1, file);
+    fwrite(pad, json_len - json_size, 1, file);
+    if (bin_size) {
+        chunk[0] = bin_len;
+        chunk[1] = 0x004E4942; // 'BIN'
+        fwrite(chunk, sizeof(chunk), 1, file);
+        fwrite(bin, bin_size, 1, file);
+        fwrite(zeros, bin_len - bin_size, 1, file);
+    }
+    fclose(file);
+    free(json);
+    return 0;
+}
+
+static int gltf_export(const image_t *img, const char *path,
+                       const export_options_t *options, bool glb)
 {
     gltf_t g = {};
     const layer_t *layer;
     cgltf_scene *scene;
     cgltf_node *root_node;
     material_t *mat;
+    int ret = 0;
 
     gltf_init(&g, options, img);
 
@@ -492,29 +633,233 @@ static void gltf_export(const image_t *img, const char *path,
 
     ALLOC(root_node->children, DL_SIZE(img->layers));
     DL_FOREACH(img->layers, layer) {
-        save_layer(&g, root_node, img, layer, options);
+        ret = save_layer(&g, root_node, img, layer, options);
+        if (ret) {
+            LOG_W("Export cancelled");
+            goto end;
+        }
     }
 
-    cgltf_write_file(NULL, path, g.data);
+    if (glb) {
+        ret = write_glb(g.data, g.bin, g.bin_size, path);
+    } else {
+        if (g.buffer) g.buffer->uri = data_new(g.bin, g.bin_size, NULL);
+        if (cgltf_write_file(NULL, path, g.data) != cgltf_result_success) {
+            LOG_E("Cannot save to %s", path);
+            ret = -1;
+        }
+    }
+    if (!ret) file_format_report_progress(1);
+end:
     cgltf_free(g.data);
     free(g.palette.entries);
+    free(g.bin);
+    return ret;
 }
 
 static int export_as_gltf(const image_t *img, const char *path)
 {
-    gltf_export(img, path, &g_export_options);
-    return 0;
+    return gltf_export(img, path, &g_export_options, false);
+}
+
+static int export_as_glb(const image_t *img, const char *path)
+{
+    return gltf_export(img, path, &g_export_options, true);
 }
 
 static void export_gui(void)
 {
     gui_checkbox("Vertex color", &g_export_options.vertex_color,
                  "Save colors as a vertex attribute");
+    gui_checkbox("One mesh per layer", &g_export_options.mesh_per_layer,
+                 "Pack all the blocks of a layer into a single mesh");
+}
+
+/*
+ * Import, by voxelizing the triangles of the meshes.
+ */
+
+typedef struct {
+    const cgltf_data *data;
+    const char  *path;
+    UT_array    *tris;
+    UT_array    *textures;
+    int         *images;    // Texture index of each image, or -1, or -2 if
+                            // not loaded yet.
+} gltf_import_t;
+
+static UT_icd triangle_icd = {sizeof(voxelize_triangle_t), NULL, NULL, NULL};
+static UT_icd texture_icd = {sizeof(voxelize_texture_t), NULL, NULL, NULL};
+
+// Get the encoded data of an image, from the binary buffer, an embedded
+// base64 uri, or an external file.
+static char *image_get_data(const gltf_import_t *imp, const cgltf_image *img,
+                            int *size)
+{
+    const cgltf_options options = {};
+    const char *base64, *sep;
+    char *data, *uri, path[1024];
+    int len;
+
+    if (img->buffer_view) {
+        *size = img->buffer_view->size;
+        data = malloc(*size);
+        memcpy(data, cgltf_buffer_view_data(img->buffer_view), *size);
+        return data;
+    }
+    if (!img->uri) return NULL;
+    if (strncmp(img->uri, "data:", 5) == 0) {
+        base64 = strstr(img->uri, ";base64,");
+        if (!base64) return NULL;
+        base64 += 8;
+        len = strlen(base64);
+        *size = len / 4 * 3 - (len && base64[len - 1] == '=') -
+                (len > 1 && base64[len - 2] == '=');
+        if (cgltf_load_buffer_base64(&options, *size, base64,
+                                     (void**)&data) != cgltf_result_success)
+            return NULL;
+        return data;
+    }
+    sep = strrchr(imp->path, '/');
+    if (strrchr(imp->path, '\\') > sep) sep = strrchr(imp->path, '\\');
+    uri = strdup(img->uri);
+    cgltf_decode_uri(uri);
+    snprintf(path, sizeof(path), "%.*s%s",
+             sep ? (int)(sep - imp->path + 1) : 0, imp->path, uri);
+    free(uri);
+    return read_file(path, size);
+}
+
+// Return the index of the texture of an image, or -1.
+static int get_texture(gltf_import_t *imp, const cgltf_texture *texture)
+{
+    voxelize_texture_t tex;
+    char *data;
+    int i, size, bpp = 4;
+
+    if (!texture || !texture->image) return -1;
+    i = texture->image - imp->data->images;
+    if (imp->images[i] != -2) return imp->images[i];
+    imp->images[i] = -1;
+    data = image_get_data(imp, texture->image, &size);
+    if (!data) {
+        LOG_W("Cannot load texture image %d", i);
+        return -1;
+    }
+    tex.data = img_read_from_mem(data, size, &tex.w, &tex.h, &bpp);
+    free(data);
+    if (!tex.data) {
+        LOG_W("Cannot read texture image %d", i);
+        return -1;
+    }
+    utarray_push_back(imp->textures, &tex);
+    imp->images[i] = utarray_len(imp->textures) - 1;
+    return imp->images[i];
+}
+
+static void import_primitive(gltf_import_t *imp, const cgltf_primitive *prim,
+                             const float mat[4][4])
+{
+    const cgltf_accessor *pos = NULL, *color = NULL, *uv = NULL;
+    const cgltf_attribute *attr;
+    const cgltf_texture_view *tex_view = NULL;
+    voxelize_triangle_t tri = {.texture = -1};
+    float factor[4] = {1, 1, 1, 1}, c[4];
+    int i, j, k, idx, count, uv_set = 0;
+
+    if (prim->type != cgltf_primitive_type_triangles) return;
+    if (prim->material && prim->material->has_pbr_metallic_roughness) {
+        memcpy(factor,
+               prim->material->pbr_metallic_roughness.base_color_factor,
+               sizeof(factor));
+        tex_view = &prim->material->pbr_metallic_roughness.base_color_texture;
+        tri.texture = get_texture(imp, tex_view->texture);
+        uv_set = tex_view->texcoord;
+    }
+    for (i = 0; i < prim->attributes_count; i++) {
+        attr = &prim->attributes[i];
+        if (attr->type == cgltf_attribute_type_position)
+            pos = attr->data;
+        if (attr->type == cgltf_attribute_type_color && attr->index == 0)
+            color = attr->data;
+        if (attr->type == cgltf_attribute_type_texcoord &&
+                attr->index == uv_set)
+            uv = attr->data;
+    }
+    if (!pos) return;
+    count = prim->indices ? prim->indices->count : pos->count;
+
+    for (i = 0; i + 2 < count; i += 3) {
+        for (j = 0; j < 3; j++) {
+            idx = prim->indices ? cgltf_accessor_read_index(prim->indices,
+                                                            i + j) : i + j;
+            cgltf_accessor_read_float(pos, idx, tri.pos[j], 3);
+            mat4_mul_vec3(mat, tri.pos[j], tri.pos[j]);
+            vec4_set(c, 1, 1, 1, 1);
+            if (color) cgltf_accessor_read_float(color, idx, c, 4);
+            for (k = 0; k < 4; k++)
+                tri.color[j][k] = clamp(c[k] * factor[k] * 255, 0, 255);
+            tri.uv[j][0] = tri.uv[j][1] = 0;
+            if (uv) cgltf_accessor_read_float(uv, idx, tri.uv[j], 2);
+        }
+        utarray_push_back(imp->tris, &tri);
+    }
+}
+
+static int gltf_import(image_t *image, const char *path)
+{
+    cgltf_options options = {};
+    cgltf_data *data = NULL;
+    cgltf_node *node;
+    gltf_import_t imp = {.path = path};
+    voxelize_texture_t *tex = NULL;
+    float mat[4][4];
+    int i, j, ret;
+
+    if (cgltf_parse_file(&options, path, &data) != cgltf_result_success ||
+        cgltf_load_buffers(&options, data, path) != cgltf_result_success) {
+        LOG_E("Cannot load gltf file %s", path);
+        cgltf_free(data);
+        return -1;
+    }
+    imp.data = data;
+    utarray_new(imp.tris, &triangle_icd);
+    utarray_new(imp.textures, &texture_icd);
+    imp.images = malloc(max(data->images_count, 1) * sizeof(*imp.images));
+    for (i = 0; i < data->images_count; i++) imp.images[i] = -2;
+
+    for (i = 0; i < data->nodes_count; i++) {
+        node = &data->nodes[i];
+        if (!node->mesh) continue;
+        cgltf_node_transform_world(node, (float*)mat);
+        for (j = 0; j < node->mesh->primitives_count; j++)
+            import_primitive(&imp, &node->mesh->primitives[j], mat);
+    }
+    cgltf_free(data);
+
+    ret = voxelize_import(image, (voxelize_triangle_t*)utarray_front(imp.tris),
+                          utarray_len(imp.tris),
+                          (voxelize_texture_t*)utarray_front(imp.textures));
+    while ((tex = (voxelize_texture_t*)utarray_next(imp.textures, tex)))
+        free(tex->data);
+    utarray_free(imp.tris);
+    utarray_free(imp.textures);
+    free(imp.images);
+    return ret;
 }
 
 FILE_FORMAT_REGISTER(gltf,
     .name = "gltf",
     .ext = "glTF2\0*.gltf\0",
+    .import_func = gltf_import,
     .export_gui = export_gui,
     .export_func = export_as_gltf,
 )
+
+FILE_FORMAT_REGISTER(glb,
+    .name = "glb",
+    .ext = "glTF2 binary\0*.glb\0",
+    .import_func = gltf_import,
+    .export_gui = export_gui,
+    .export_func = export_as_glb,
+)
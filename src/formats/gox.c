@@ -18,18 +18,22 @@
 
 
 #include "goxel.h"
+#include "utils/parallel.h"
+#include "xxhash.h"
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
-#define VERSION 2 // Current version of the file format.
+#define VERSION 3 // Current version of the file format.
 
 /*
- * File format, version 2:
+ * File format, version 3:
  *
  * This is inspired by the png format, where the file consists of a list of
  * chunks with different types.
  *
  *  4 bytes magic string        : "GOX "
- *  4 bytes version             : 2
+ *  4 bytes version             : 3
  *  List of chunks:
  *      4 bytes: type
  *      4 bytes: data length
@@ -48,9 +52,45 @@
  *  IMG : a dict of info:
  *      - box: the image gox.
  *
+ *  INFO: a dict summary of the image, only in the full saves, so that
+ *      the file browsers don't have to load the file:
+ *      - layer: the name of a layer, repeated for each layer.
+ *      - nb-blocks: total number of blocks of the layers.
+ *      - nb-voxels: total number of voxels of the layers (int64).
+ *      - bbox: bounding box of all the layers voxels (int[2][3]).
+ *      - offsets: file offset of the first chunk after the blocks, and
+ *        file size (int64[2]).  A different file size means that some
+ *        data has been appended, and that the info is outdated.
+ *
  *  PREV: a png image for preview.
  *
- *  BL16: a 16^3 block saved as a 64x64 png image.
+ *  BL16: a 16^3 block saved as a 64x64 png image (only up to version 2).
+ *
+ *  BLKS: a list of 16^3 blocks (since version 3):
+ *      4 bytes: number of blocks.
+ *      4 bytes: uncompressed data size.
+ *      n bytes: zlib compressed data, for each block:
+ *          2 bytes: number of colors (0 if more than 256).
+ *          if zero colors: 16^3 * 4 bytes: RGBA values.
+ *          else:
+ *              4 bytes per color: the colors palette.
+ *              if more than one color: 16^3 bytes: palette indices.
+ *
+ *  BREF: a list of 16^3 blocks stored in separate files (blocks stores):
+ *      4 bytes: number of blocks.
+ *      for each block:
+ *          8 bytes: hash of the block voxels.
+ *      The blocks are in the 'blocks' directory next to the file, in files
+ *      named after the hash in hexadecimal ('<hash>.blk'), each containing
+ *      the data of a BLKS chunk with a single block.
+ *
+ *  The blocks of all the BL16, BLKS and BREF chunks are indexed in the
+ *  file order.
+ *
+ *  APND: marks the start of data appended by an incremental save.  All
+ *      the layers, materials, cameras and image info read so far are
+ *      discarded, but the blocks can still be referenced by the layers
+ *      that follow.
  *
  *  LAYR: a layer:
  *      4 bytes: number of blocks.
@@ -62,6 +102,15 @@
  *          4 bytes: 0
  *      [DICT]
  *
+ *  FRAM: an animation frame (the layers voxels in this frame):
+ *      4 bytes: number of layers.
+ *      for each layer:
+ *          4 bytes: layer id.
+ *          the blocks list, as in LAYR.
+ *      [DICT] containing the following entries:
+ *          active: set on the frame currently in the layers (that has
+ *                  no layers of its own).
+ *
  *  CAMR: a camera:
  *      [DICT] containing the following entries:
  *          name: string
@@ -84,10 +133,159 @@ typedef struct {
     void            *v;
     uint64_t        uid;
     int             index;
+    uint64_t        hash;       // Hash of the voxels, in the blocks stores.
 } block_hash_t;
 
+// A chunk of blocks data, that we encode or decode in parallel with the
+// other chunks.
+typedef struct {
+    char            type[4];    // "BL16", "BLKS" or "BREF".
+    uint8_t         *data;
+    int             size;
+    int             first;      // Index of the first block of the chunk.
+    int             nb;         // Number of blocks in the chunk.
+    uint64_t        hash;       // For BREF, the hash of the block file.
+} block_chunk_t;
+
+// Arguments of the parallel encode and decode functions.
+typedef struct {
+    block_chunk_t   *chunks;
+    block_hash_t    **blocks;   // When saving, all the blocks by index.
+    mesh_t          **meshes;   // When loading, single block meshes.
+    int             *progress;  // When saving, number of chunks encoded.
+    const char      *store;     // Directory of the blocks files.
+    const bool      *decode;    // When loading, the chunks to decode.
+} blocks_job_t;
+
+// Number of blocks we put in each BLKS chunk.
+#define BLKS_BATCH_SIZE 64
+// Maximum number of blocks we accept in a BLKS or BREF chunk.
+#define BLKS_MAX_SIZE 65536
+
+// The blocks are always stored as cubes of 16 voxels in the files, even if
+// the meshes use an other block size.
+#define FILE_BLOCK_SIZE 16
+#define FILE_BLOCK_DIM ((int[]){FILE_BLOCK_SIZE, FILE_BLOCK_SIZE, \
+                                FILE_BLOCK_SIZE})
+#define BLOCK_VOXELS (FILE_BLOCK_SIZE * FILE_BLOCK_SIZE * FILE_BLOCK_SIZE)
+
 #define CHUNK_BUFF_SIZE (1 << 20) // 1 MiB max buffer size!
 
+// Number of decompressed BLKS chunks kept by the lazy loader.
+#define PAGER_CACHE_SIZE 8
+
+// Position of a blocks chunk in a file opened lazily, or data of a chunk
+// only used by hidden layers.
+typedef struct {
+    char            type[4];
+    long            offset;     // Offset of the chunk data in the file.
+    int             size;
+    int             first;
+    int             nb;
+    uint8_t         *data;      // Set if the chunk is kept in memory.
+    int             nb_pages;   // Paged blocks still using the data.
+} chunk_index_t;
+
+// A decompressed BLKS chunk, with the offset of each block in the data.
+typedef struct {
+    int             chunk;      // Index of the chunk, -1 if unused.
+    uint8_t         *data;
+    int             size;
+    int             *offsets;   // -1 for invalid blocks.
+    uint64_t        last_use;
+} pager_cache_t;
+
+// Pager that reads the blocks from a gox file when they are first
+// accessed.  The file stays open until all the blocks are loaded.  Without
+// a file, the pager reads from the chunks data kept in memory.
+typedef struct gox_pager gox_pager_t;
+struct gox_pager {
+    mesh_pager_t    pager;
+    gox_pager_t     *next, *prev;
+    char            *path;
+    pthread_mutex_t lock;
+    FILE            *file;
+    // Set instead of the file if the file got overwritten.
+    uint8_t         *file_data;
+    long            file_size;
+    chunk_index_t   *chunks;
+    int             nb_chunks;
+    pager_cache_t   cache[PAGER_CACHE_SIZE];
+    uint64_t        tick;
+};
+
+// All the pagers still in use, so that we can detach them from their file
+// before we overwrite it.
+static gox_pager_t *g_pagers = NULL;
+static pthread_mutex_t g_pagers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t g_lazy_load_size = 64 * MB;
+
+// The last gox file we saved or loaded, so that the incremental saves only
+// need to append the blocks that are not already in it.
+typedef struct {
+    char            *path;
+    int64_t         size;       // Size of the file when we last wrote it.
+    int64_t         mtime;
+    int64_t         base_size;  // Size after the last full save.
+    block_hash_t    *blocks;    // Blocks already in the file.
+    int             nb_blocks;  // Number of blocks in the file.
+    int             nb_appends;
+} saved_file_t;
+
+static saved_file_t g_saved = {};
+
+// Maximum number of incremental saves before we rewrite the whole file.
+#define MAX_APPENDS 64
+
+// Everything needed to write an image, so that the save can run in a
+// background thread while the image keeps being edited.
+typedef struct {
+    const image_t   *img;
+    char            *path;
+    saved_file_t    *state;     // The blocks already in the file.
+    bool            append;
+    bool            store;      // Write the blocks into a blocks store.
+    uint8_t         *preview;   // PNG data, rendered on the main thread.
+    int             preview_size;
+    typeof(goxel.rend.light) light;
+    float           ambient;
+    float           shadow;
+    // Number of blocks chunks encoded, and total number, read from the
+    // main thread.
+    int             progress;
+    int             total;
+    // Set for the background saves.
+    image_t         *copy;      // Frozen copy of the image.
+    uint32_t        key;        // Key of the image when we started.
+    bool            autosave;
+    bool            done;
+    task_t          *task;
+} save_job_t;
+
+// The running background save, if any.
+static save_job_t *g_save_job = NULL;
+
+static saved_file_t g_autosave = {};
+static int g_autosave_interval = 5 * 60; // In seconds, zero to disable.
+
+// The hashes of the blocks data already in a blocks store, by data id, so
+// that the next saves only read and hash the new blocks.  Only used by the
+// save jobs, or when no save is running.
+static struct {
+    char            *dir;
+    block_hash_t    *blocks;
+} g_store = {};
+
+// On the web the autosaves go into a blocks store kept in the browser
+// IndexedDB, so that they only need to write the new blocks.
+#define WEB_STORE_DIR "/store"
+
+void gox_set_lazy_load_size(int64_t size)
+{
+    g_lazy_load_size = size;
+}
+
 // XXX: should be something in goxel.h
 static const shape_t *SHAPES[] = {
     &shape_sphere,
@@ -95,6 +293,22 @@ static const shape_t *SHAPES[] = {
     &shape_cylinder,
 };
 
+// Procedural layers parameters, as saved in the LAYR chunks.
+typedef struct {
+    int32_t seed;
+    int32_t octaves;
+    float   scale;
+    float   height;
+    float   amplitude;
+} file_procedural_t;
+
+typedef struct {
+    int32_t shape;      // Index in SHAPES.
+    int32_t op;
+    float   pos[3];
+    float   size[3];
+} file_procedural_prim_t;
+
 typedef struct {
     char     type[4];
     int      length;
@@ -228,7 +442,7 @@ static void chunk_write_all(FILE *out, const char *type,
 {
     fwrite(type, 4, 1, out);
     write_int32(out, size);
-    fwrite(data, size, 1, out);
+    if (size) fwrite(data, size, 1, out);
     write_int32(out, 0);        // CRC XXX: todo.
 }
 
@@ -252,29 +466,555 @@ static const material_t *get_material(const image_t *img, int idx)
     return NULL;
 }
 
-void save_to_file(const image_t *img, const char *path)
+// Compute the palette of a block voxels, and return the number of colors,
+// or zero if there are more than 256 of them.
+static int block_get_palette(const uint8_t *voxels, uint8_t palette[256][4],
+                             uint8_t *indices)
+{
+    // Small open addressing hash table of the colors.
+    struct { uint32_t color; int index; } table[512] = {};
+    uint32_t color;
+    int i, j, nb = 0;
+
+    for (i = 0; i < BLOCK_VOXELS; i++) {
+        memcpy(&color, voxels + i * 4, 4);
+        for (j = (color * 2654435761u) >> 23;; j = (j + 1) % 512) {
+            if (!table[j].index || table[j].color == color) break;
+        }
+        if (!table[j].index) {
+            if (nb == 256) return 0;
+            table[j].color = color;
+            table[j].index = ++nb; // Zero is used for empty slots.
+            memcpy(palette[nb - 1], &color, 4);
+        }
+        indices[i] = table[j].index - 1;
+    }
+    return nb;
+}
+
+uint8_t *gox_encode_blocks(int nb, const uint8_t *const *blocks, int *size)
+{
+    uint8_t *buf, *p, palette[256][4], indices[BLOCK_VOXELS], *z, *ret;
+    const uint8_t *voxels;
+    uint16_t nb_colors;
+    int j, raw_size, z_size;
+
+    buf = malloc(nb * (2 + BLOCK_VOXELS * 4));
+    p = buf;
+    for (j = 0; j < nb; j++) {
+        voxels = blocks[j];
+        nb_colors = block_get_palette(voxels, palette, indices);
+        memcpy(p, &nb_colors, 2);
+        p += 2;
+        if (nb_colors == 0) {
+            memcpy(p, voxels, BLOCK_VOXELS * 4);
+            p += BLOCK_VOXELS * 4;
+            continue;
+        }
+        memcpy(p, palette, nb_colors * 4);
+        p += nb_colors * 4;
+        if (nb_colors == 1) continue;
+        memcpy(p, indices, BLOCK_VOXELS);
+        p += BLOCK_VOXELS;
+    }
+    raw_size = p - buf;
+    z = img_zlib_compress(buf, raw_size, &z_size);
+    free(buf);
+
+    *size = 8 + z_size;
+    ret = malloc(*size);
+    memcpy(ret + 0, &nb, 4);
+    memcpy(ret + 4, &raw_size, 4);
+    memcpy(ret + 8, z, z_size);
+    free(z);
+    return ret;
+}
+
+static void encode_blocks_chunk(void *user, int i)
+{
+    const blocks_job_t *job = user;
+    block_chunk_t *chunk = &job->chunks[i];
+    const uint8_t **voxels;
+    int j;
+
+    voxels = malloc(chunk->nb * sizeof(*voxels));
+    for (j = 0; j < chunk->nb; j++)
+        voxels[j] = job->blocks[chunk->first + j]->v;
+    chunk->data = gox_encode_blocks(chunk->nb, voxels, &chunk->size);
+    free(voxels);
+    __atomic_add_fetch(job->progress, 1, __ATOMIC_RELAXED);
+}
+
+static void detach_pagers(const char *path);
+
+static void saved_file_reset(saved_file_t *state, const char *path)
+{
+    block_hash_t *data, *tmp;
+    HASH_ITER(hh, state->blocks, data, tmp) {
+        HASH_DEL(state->blocks, data);
+        free(data);
+    }
+    free(state->path);
+    *state = (saved_file_t){.path = path ? strdup(path) : NULL};
+}
+
+// Record the file size and time after we wrote or read it.
+static void saved_file_update(saved_file_t *state)
+{
+    struct stat st;
+    if (stat(state->path, &st) != 0) {
+        saved_file_reset(state, NULL);
+        return;
+    }
+    state->size = st.st_size;
+    state->mtime = st.st_mtime;
+}
+
+// Check if a file is still the same as when we last wrote it.
+static bool saved_file_matches(const saved_file_t *state,
+                               const char *path)
+{
+    struct stat st;
+    if (!state->path || strcmp(state->path, path) != 0) return false;
+    if (stat(path, &st) != 0) return false;
+    return st.st_size == state->size && st.st_mtime == state->mtime;
+}
+
+static block_hash_t *saved_file_add_block(saved_file_t *state, uint64_t uid,
+                                          int index)
+{
+    block_hash_t *data;
+    HASH_FIND(hh, state->blocks, &uid, sizeof(uid), data);
+    if (data) return data;
+    data = calloc(1, sizeof(*data));
+    data->uid = uid;
+    data->index = index;
+    HASH_ADD(hh, state->blocks, uid, sizeof(data->uid), data);
+    return data;
+}
+
+// Directory of the blocks files of a blocks store manifest.
+static void get_store_dir(const char *path, char *buf, int size)
+{
+    const char *sep = strrchr(path, '/');
+    if (sep)
+        snprintf(buf, size, "%.*s/blocks", (int)(sep - path), path);
+    else
+        snprintf(buf, size, "blocks");
+}
+
+// Path of a block file in a blocks store, return false if it doesn't fit
+// in the buffer.
+static bool get_store_block_path(const char *store, uint64_t hash,
+                                 char *buf, int size)
+{
+    int n;
+    n = snprintf(buf, size, "%s/%016llx.blk", store,
+                 (unsigned long long)hash);
+    return n >= 0 && n < size;
+}
+
+// Set the store of the hashes cache, the hashes are forgotten if it
+// changed.
+static void store_cache_set_dir(const char *dir)
+{
+    block_hash_t *data, *tmp;
+    if (g_store.dir && strcmp(g_store.dir, dir) == 0) return;
+    HASH_ITER(hh, g_store.blocks, data, tmp) {
+        HASH_DEL(g_store.blocks, data);
+        free(data);
+    }
+    free(g_store.dir);
+    g_store.dir = strdup(dir);
+}
+
+static void store_cache_add(uint64_t uid, uint64_t hash)
+{
+    block_hash_t *data;
+    HASH_FIND(hh, g_store.blocks, &uid, sizeof(uid), data);
+    if (!data) {
+        data = calloc(1, sizeof(*data));
+        data->uid = uid;
+        HASH_ADD(hh, g_store.blocks, uid, sizeof(data->uid), data);
+    }
+    data->hash = hash;
+}
+
+// Hash a new block of a store save, and write its file unless it is
+// already in the store.  The hash is set to zero on error.
+static void store_block(void *user, int i)
+{
+    const blocks_job_t *job = user;
+    block_hash_t *data = job->blocks[i];
+    const uint8_t *voxels = data->v;
+    char path[1024], tmp_path[1024 + 16];
+    uint8_t *buf;
+    int size;
+    bool ok;
+    FILE *out;
+    struct stat st;
+
+    __atomic_add_fetch(job->progress, 1, __ATOMIC_RELAXED);
+    if (!voxels) return; // Hash from the cache, already in the store.
+    data->hash = (uint64_t)XXH32(voxels, BLOCK_VOXELS * 4, 0) << 32 |
+                 XXH32(voxels, BLOCK_VOXELS * 4, 1) | 1;
+    if (!get_store_block_path(job->store, data->hash, path, sizeof(path))) {
+        LOG_E("Blocks store path too long: %s", job->store);
+        data->hash = 0;
+        return;
+    }
+    if (stat(path, &st) == 0) return;
+
+    // Different data ids can have the same voxels, so several threads
+    // can write the same block.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, i);
+    buf = gox_encode_blocks(1, &voxels, &size);
+    out = fopen(tmp_path, "wb");
+    ok = out && fwrite(buf, size, 1, out) == 1;
+    if (out && fclose(out) != 0) ok = false;
+    free(buf);
+    if (ok && rename(tmp_path, path) == 0) return;
+    if (out) remove(tmp_path);
+    // On Windows rename fails if an other thread already wrote the block.
+    if (ok && stat(path, &st) == 0) return;
+    LOG_E("Cannot write block %s: %s", path, strerror(errno));
+    data->hash = 0;
+}
+
+// Create a save job, should be called from the main thread.
+static save_job_t *save_job_new(const image_t *img, const char *path,
+                                saved_file_t *state, bool append)
+{
+    save_job_t *job = calloc(1, sizeof(*job));
+    uint8_t *preview;
+    layer_t *layer;
+
+    // The hidden clone and shape layers are only updated when needed.
+    DL_FOREACH(img->layers, layer) image_update_layer((image_t*)img, layer);
+    job->img = img;
+    job->path = strdup(path);
+    job->state = state;
+    job->append = append;
+    job->light = goxel.rend.light;
+    job->ambient = goxel.rend.settings.ambient;
+    job->shadow = goxel.rend.settings.shadow;
+    // We need the graphics to render the preview.  The incremental saves
+    // keep the preview of the last full save.
+    if (goxel.graphics_initialized && !append) {
+        preview = calloc(128 * 128, 4);
+        goxel_render_to_buf(preview, 128, 128, 4);
+        job->preview = img_write_to_mem(preview, 128, 128, 4,
+                                        &job->preview_size);
+        free(preview);
+    }
+    return job;
+}
+
+static void save_job_delete(save_job_t *job)
+{
+    image_delete(job->copy);
+    free(job->preview);
+    free(job->path);
+    free(job);
+}
+
+// Save an image, either as a new file written to a temporary file and
+// then renamed, or by appending the changes since the last save to the
+// file.  Can run in any thread.
+// A block as stored in the file.
+typedef struct {
+    int         pos[3];
+    uint64_t    uid;
+} file_block_t;
+
+static int file_block_cmp(const void *a_, const void *b_)
+{
+    const file_block_t *a = a_, *b = b_;
+    int i;
+    for (i = 2; i >= 0; i--) {
+        if (a->pos[i] != b->pos[i]) return a->pos[i] < b->pos[i] ? -1 : +1;
+    }
+    return 0;
+}
+
+// Write the parameters of a procedural layer into its dict.
+static void write_procedural(chunk_t *c, FILE *out, const layer_t *layer)
+{
+    const procedural_t *proc = layer->procedural;
+    const procedural_prim_t *prim;
+    file_procedural_t params;
+    file_procedural_prim_t fprim;
+    int i, j;
+
+    chunk_write_dict_value(c, out, "proc-kernel", proc->kernel->id,
+                           strlen(proc->kernel->id));
+    params = (file_procedural_t){
+        .seed = proc->seed,
+        .octaves = proc->octaves,
+        .scale = proc->scale,
+        .height = proc->height,
+        .amplitude = proc->amplitude,
+    };
+    chunk_write_dict_value(c, out, "proc-params", &params, sizeof(params));
+    // One value per primitive, since the dict values are limited in size.
+    for (i = 0; i < proc->nb_prims; i++) {
+        prim = &proc->prims[i];
+        memset(&fprim, 0, sizeof(fprim));
+        for (j = 0; j < ARRAY_SIZE(SHAPES); j++) {
+            if (SHAPES[j] == prim->shape) fprim.shape = j;
+        }
+        fprim.op = prim->op;
+        memcpy(fprim.pos, prim->pos, sizeof(fprim.pos));
+        memcpy(fprim.size, prim->size, sizeof(fprim.size));
+        chunk_write_dict_value(c, out, "proc-prim", &fprim, sizeof(fprim));
+    }
+    chunk_write_dict_value(c, out, "color", layer->color,
+                           sizeof(layer->color));
+}
+
+// Read a procedural layer parameter from its dict.
+static void read_procedural(const char *key, const char *value, int size,
+                            layer_t *layer)
+{
+    const procedural_kernel_t *kernel;
+    procedural_t *proc;
+    procedural_prim_t *prim;
+    file_procedural_t params;
+    file_procedural_prim_t fprim;
+
+    if (strcmp(key, "proc-kernel") == 0) {
+        kernel = procedural_get_kernel(value, 0);
+        if (!kernel) {
+            LOG_W("Unknown procedural kernel %s", value);
+            return;
+        }
+        free(layer->procedural);
+        layer->procedural = procedural_new(kernel);
+        layer->procedural->nb_prims = 0;
+        return;
+    }
+    proc = layer->procedural;
+    if (!proc) return;
+    if (strcmp(key, "proc-params") == 0 && size == sizeof(params)) {
+        memcpy(&params, value, size);
+        proc->seed = params.seed;
+        proc->octaves = clamp(params.octaves, 1, 16);
+        proc->scale = params.scale;
+        proc->height = params.height;
+        proc->amplitude = params.amplitude;
+    }
+    if (    strcmp(key, "proc-prim") == 0 && size == sizeof(fprim) &&
+            proc->nb_prims < PROCEDURAL_MAX_PRIMS) {
+        memcpy(&fprim, value, size);
+        prim = &proc->prims[proc->nb_prims++];
+        prim->shape = SHAPES[clamp(fprim.shape, 0, ARRAY_SIZE(SHAPES) - 1)];
+        prim->op = fprim.op;
+        memcpy(prim->pos, fprim.pos, sizeof(prim->pos));
+        memcpy(prim->size, fprim.size, sizeof(prim->size));
+    }
+}
+
+/*
+ * Get the list of the blocks of a mesh as they are stored in the file,
+ * with the ids of their data.  If the mesh blocks don't have the size of
+ * the file blocks, we split or group them, and use the hash of the voxels
+ * as the data id, so that identical blocks are still only saved once.
+ */
+static file_block_t *get_file_blocks(const mesh_t *mesh, int *nb)
+{
+    file_block_t *ret = NULL;
+    int i, j, k, n = 0, allocated = 0, bpos[3], p[3], pos[3];
+    const int S = FILE_BLOCK_SIZE;
+    mesh_iterator_t iter;
+    uint8_t *voxels;
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        // All the file blocks overlapping the mesh block.
+        for (p[2] = 0; p[2] < max(BLOCK_SIZE / S, 1); p[2]++)
+        for (p[1] = 0; p[1] < max(BLOCK_SIZE / S, 1); p[1]++)
+        for (p[0] = 0; p[0] < max(BLOCK_SIZE / S, 1); p[0]++) {
+            if (n == allocated) {
+                allocated = max(256, allocated * 2);
+                ret = realloc(ret, allocated * sizeof(*ret));
+            }
+            for (i = 0; i < 3; i++) {
+                pos[i] = bpos[i] + p[i] * S;
+                ret[n].pos[i] = pos[i] - (((pos[i] % S) + S) % S);
+            }
+            if (BLOCK_SIZE == S) {
+                mesh_get_block_data(mesh, &iter, bpos, &ret[n].uid);
+            }
+            n++;
+        }
+    }
+
+    if (BLOCK_SIZE != S) {
+        if (n) qsort(ret, n, sizeof(*ret), file_block_cmp);
+        voxels = malloc(BLOCK_VOXELS * 4);
+        for (i = 0, j = 0; i < n; i++) {
+            if (j && file_block_cmp(&ret[i], &ret[j - 1]) == 0) continue;
+            mesh_read(mesh, ret[i].pos, FILE_BLOCK_DIM, voxels);
+            for (k = 0; k < BLOCK_VOXELS; k++) {
+                if (voxels[k * 4 + 3]) break;
+            }
+            if (k == BLOCK_VOXELS) continue; // Empty.
+            ret[j] = ret[i];
+            ret[j].uid = (uint64_t)XXH32(voxels, BLOCK_VOXELS * 4, 0) << 32 |
+                         XXH32(voxels, BLOCK_VOXELS * 4, 1) | 1;
+            j++;
+        }
+        n = j;
+        free(voxels);
+    }
+    *nb = n;
+    return ret;
+}
+
+// All the meshes saved in a file: the layers ones, followed by the ones of
+// the animation frames.
+static const mesh_t **get_saved_meshes(const image_t *img, int *nb)
+{
+    const layer_t *layer;
+    const anim_frame_t *frame;
+    const mesh_t **ret;
+    int i, n = 0;
+
+    DL_COUNT(img->layers, layer, n);
+    DL_FOREACH(img->frames, frame) n += frame->nb_meshes;
+    ret = calloc(max(n, 1), sizeof(*ret));
+    n = 0;
+    DL_FOREACH(img->layers, layer) ret[n++] = layer->mesh;
+    DL_FOREACH(img->frames, frame) {
+        for (i = 0; i < frame->nb_meshes; i++)
+            ret[n++] = frame->meshes[i].mesh;
+    }
+    *nb = n;
+    return ret;
+}
+
+// Write the list of the blocks of a mesh, that must already be in the file.
+static void write_mesh_blocks(chunk_t *c, FILE *out,
+                              const saved_file_t *state, const mesh_t *mesh)
+{
+    file_block_t *fblocks = NULL;
+    block_hash_t *data;
+    int i, nb_blocks = 0;
+
+    if (mesh) fblocks = get_file_blocks(mesh, &nb_blocks);
+    chunk_write_int32(c, out, nb_blocks);
+    for (i = 0; i < nb_blocks; i++) {
+        HASH_FIND(hh, state->blocks, &fblocks[i].uid,
+                  sizeof(fblocks[i].uid), data);
+        assert(data);
+        chunk_write_int32(c, out, data->index);
+        chunk_write_int32(c, out, fblocks[i].pos[0]);
+        chunk_write_int32(c, out, fblocks[i].pos[1]);
+        chunk_write_int32(c, out, fblocks[i].pos[2]);
+        chunk_write_int32(c, out, 0);
+    }
+    free(fblocks);
+}
+
+/*
+ * Write the INFO chunk.  The offsets are only known once the whole file is
+ * written, so we return the position of their value in the file, to patch
+ * it at the end.
+ */
+static long write_info(FILE *out, const image_t *img)
+{
+    const layer_t *layer;
+    chunk_t c;
+    mesh_stats_t stats;
+    int i, nb_blocks = 0, bbox[2][3] = {}, aabb[2][3];
+    int64_t nb_voxels = 0, offsets[2] = {};
+    bool empty = true;
+    long pos;
+
+    chunk_write_start(&c, out, "INFO");
+    DL_FOREACH(img->layers, layer) {
+        chunk_write_dict_value(&c, out, "layer", layer->name,
+                               strlen(layer->name));
+        if (!layer->mesh) continue;
+        mesh_get_stats(layer->mesh, &stats);
+        nb_blocks += stats.nb_blocks;
+        nb_voxels += stats.nb_voxels;
+        if (!mesh_get_bbox(layer->mesh, aabb, true)) continue;
+        for (i = 0; i < 3; i++) {
+            bbox[0][i] = empty ? aabb[0][i] : min(bbox[0][i], aabb[0][i]);
+            bbox[1][i] = empty ? aabb[1][i] : max(bbox[1][i], aabb[1][i]);
+        }
+        empty = false;
+    }
+    chunk_write_dict_value(&c, out, "nb-blocks", &nb_blocks,
+                           sizeof(nb_blocks));
+    chunk_write_dict_value(&c, out, "nb-voxels", &nb_voxels,
+                           sizeof(nb_voxels));
+    if (!empty)
+        chunk_write_dict_value(&c, out, "bbox", bbox, sizeof(bbox));
+    // Chunk header, dict key and value size.
+    pos = ftell(out) + 8 + c.length + 4 + strlen("offsets") + 4;
+    chunk_write_dict_value(&c, out, "offsets", offsets, sizeof(offsets));
+    chunk_write_finish(&c, out);
+    return pos;
+}
+
+static bool write_image(save_job_t *job)
 {
     // XXX: remove all empty blocks before saving.
-    LOG_I("Save to %s", path);
-    block_hash_t *blocks_table = NULL, *data, *data_tmp;
+    LOG_I("Save to %s%s", job->path, job->append ? " (incremental)" : "");
+    const image_t *img = job->img;
+    const char *path = job->path;
+    saved_file_t *state = job->state;
+    bool append = job->append;
+    block_hash_t *blocks_table = NULL, *data, *data_tmp, **blocks;
+    block_chunk_t *chunks;
+    file_block_t *fblocks;
     layer_t *layer;
+    anim_frame_t *frame;
+    const mesh_t **meshes, *mesh;
     chunk_t c;
-    int nb_blocks, index, size, bpos[3], material_idx;
-    uint64_t uid;
+    int i, j, m, nb_blocks, nb_chunks, nb_refs, first, index, material_idx;
+    int nb_meshes;
+    long info_pos = -1;
+    int64_t offsets[2];
     FILE *out;
-    uint8_t *png, *preview;
+    char *tmp_path = NULL, store[1024], block_path[1024];
     camera_t *camera;
     material_t *material;
-    mesh_iterator_t iter;
-
-    img = img ?: goxel.image;
-    out = fopen(path, "wb");
+    block_hash_t *cached;
+    bool store_failed = false;
+
+    if (job->store) {
+        get_store_dir(path, store, sizeof(store));
+        // Create the blocks directory.
+        if (!get_store_block_path(store, 0, block_path, sizeof(block_path))) {
+            LOG_E("Blocks store path too long: %s", store);
+            return false;
+        }
+        sys_make_dir(block_path);
+        store_cache_set_dir(store);
+    }
+    if (!append) {
+        // The blocks not loaded yet could come from the file we overwrite.
+        detach_pagers(path);
+        saved_file_reset(state, path);
+        asprintf(&tmp_path, "%s.tmp", path);
+    }
+    out = fopen(tmp_path ?: path, append ? "ab" : "wb");
     if (!out) {
         LOG_E("Cannot save to %s: %s", path, strerror(errno));
-        return;
+        saved_file_reset(state, NULL);
+        free(tmp_path);
+        return false;
+    }
+    if (append) {
+        chunk_write_all(out, "APND", NULL, 0);
+        state->nb_appends++;
+    } else {
+        fwrite("GOX ", 4, 1, out);
+        write_int32(out, VERSION);
     }
-    fwrite("GOX ", 4, 1, out);
-    write_int32(out, VERSION);
 
     // Write image info.
     chunk_write_start(&c, out, "IMG ");
@@ -282,36 +1022,102 @@ void save_to_file(const image_t *img, const char *path)
         chunk_write_dict_value(&c, out, "box", &img->box, sizeof(img->box));
     chunk_write_finish(&c, out);
 
-    preview = calloc(128 * 128, 4);
-    goxel_render_to_buf(preview, 128, 128, 4);
-    png = img_write_to_mem(preview, 128, 128, 4, &size);
-    chunk_write_all(out, "PREV", (char*)png, size);
-    free(preview);
-    free(png);
+    // The appended info would be after all the blocks, so useless.
+    if (!append) info_pos = write_info(out, img);
 
-    // Add all the blocks data into the hash table.
-    index = 0;
-    DL_FOREACH(img->layers, layer) {
-        iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
-        while (mesh_iter(&iter, bpos)) {
-            mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
-            HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
+    if (job->preview)
+        chunk_write_all(out, "PREV", (char*)job->preview, job->preview_size);
+
+    // Add all the blocks data not already in the file into the hash table.
+    first = index = state->nb_blocks;
+    meshes = get_saved_meshes(img, &nb_meshes);
+    for (m = 0; m < nb_meshes; m++) {
+        fblocks = get_file_blocks(meshes[m], &nb_blocks);
+        for (i = 0; i < nb_blocks; i++) {
+            HASH_FIND(hh, state->blocks, &fblocks[i].uid,
+                      sizeof(fblocks[i].uid), data);
+            if (data) continue;
+            HASH_FIND(hh, blocks_table, &fblocks[i].uid,
+                      sizeof(fblocks[i].uid), data);
             if (data) continue;
             data = calloc(1, sizeof(*data));
-            data->v = mesh_get_block_data(layer->mesh, &iter, bpos, NULL);
-            assert(data->v);
-            data->uid = uid;
+            data->uid = fblocks[i].uid;
             data->index = index++;
             HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
+            // The blocks stores don't need the voxels of the blocks they
+            // already have.
+            if (job->store) {
+                HASH_FIND(hh, g_store.blocks, &data->uid, sizeof(data->uid),
+                          cached);
+                if (cached) {
+                    data->hash = cached->hash;
+                    continue;
+                }
+            }
+            // Note: uniform blocks don't have a voxels array, so we always
+            // make a copy of the block values.
+            data->v = malloc(BLOCK_VOXELS * 4);
+            mesh_read(meshes[m], fblocks[i].pos, FILE_BLOCK_DIM, data->v);
+        }
+        free(fblocks);
+    }
+    free(meshes);
+
+    blocks = calloc(max(index - first, 1), sizeof(*blocks));
+    HASH_ITER(hh, blocks_table, data, data_tmp)
+        blocks[data->index - first] = data;
+
+    // Write the new blocks files of a store in parallel, and only their
+    // hashes in the file.
+    if (job->store) {
+        __atomic_store_n(&job->total, index - first, __ATOMIC_RELAXED);
+        parallel_for(index - first, store_block,
+                     &(blocks_job_t){.blocks = blocks, .store = store,
+                                     .progress = &job->progress});
+        for (i = 0; i < index - first; i += BLKS_MAX_SIZE) {
+            nb_refs = min(BLKS_MAX_SIZE, index - first - i);
+            chunk_write_start(&c, out, "BREF");
+            chunk_write_int32(&c, out, nb_refs);
+            for (j = 0; j < nb_refs; j++) {
+                data = blocks[i + j];
+                if (!data->hash) store_failed = true;
+                chunk_write(&c, out, (char*)&data->hash, sizeof(data->hash));
+            }
+            chunk_write_finish(&c, out);
+        }
+    } else {
+        // Encode all the blocks chunks in parallel, then write them in the
+        // blocks index order.
+        nb_chunks = (index - first + BLKS_BATCH_SIZE - 1) / BLKS_BATCH_SIZE;
+        chunks = calloc(max(nb_chunks, 1), sizeof(*chunks));
+        __atomic_store_n(&job->total, nb_chunks, __ATOMIC_RELAXED);
+        for (i = 0; i < nb_chunks; i++) {
+            chunks[i].first = i * BLKS_BATCH_SIZE;
+            chunks[i].nb = min(BLKS_BATCH_SIZE,
+                               index - first - chunks[i].first);
+        }
+        parallel_for(nb_chunks, encode_blocks_chunk,
+                     &(blocks_job_t){.chunks = chunks, .blocks = blocks,
+                                     .progress = &job->progress});
+        for (i = 0; i < nb_chunks; i++) {
+            chunk_write_all(out, "BLKS", (char*)chunks[i].data,
+                            chunks[i].size);
+            free(chunks[i].data);
         }
+        free(chunks);
     }
+    free(blocks);
 
-    // Write all the blocks chunks.
+    // The new blocks are now part of the file.
     HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
-        chunk_write_all(out, "BL16", (char*)png, size);
-        free(png);
+        HASH_DEL(blocks_table, data);
+        free(data->v);
+        data->v = NULL;
+        if (job->store && data->hash) store_cache_add(data->uid, data->hash);
+        HASH_ADD(hh, state->blocks, uid, sizeof(data->uid), data);
     }
+    state->nb_blocks = index;
+    offsets[0] = ftell(out);
 
     // Write all the materials.
     DL_FOREACH(img->materials, material) {
@@ -332,27 +1138,9 @@ void save_to_file(const image_t *img, const char *path)
     // Write all the layers.
     DL_FOREACH(img->layers, layer) {
         chunk_write_start(&c, out, "LAYR");
-        nb_blocks = 0;
-        if (!layer->base_id && !layer->shape) {
-            iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
-            while (mesh_iter(&iter, bpos)) {
-                nb_blocks++;
-            }
-        }
-        chunk_write_int32(&c, out, nb_blocks);
-        if (!layer->base_id && !layer->shape) {
-            iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
-            while (mesh_iter(&iter, bpos)) {
-                mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
-                HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
-                assert(data);
-                chunk_write_int32(&c, out, data->index);
-                chunk_write_int32(&c, out, bpos[0]);
-                chunk_write_int32(&c, out, bpos[1]);
-                chunk_write_int32(&c, out, bpos[2]);
-                chunk_write_int32(&c, out, 0);
-            }
-        }
+        mesh = (!layer->base_id && !layer->shape && !layer->procedural) ?
+               layer->mesh : NULL;
+        write_mesh_blocks(&c, out, state, mesh);
         chunk_write_dict_value(&c, out, "name", layer->name,
                                strlen(layer->name));
         chunk_write_dict_value(&c, out, "mat", &layer->mat,
@@ -377,12 +1165,28 @@ void save_to_file(const image_t *img, const char *path)
             chunk_write_dict_value(&c, out, "color", layer->color,
                                 sizeof(layer->color));
         }
+        if (layer->procedural)
+            write_procedural(&c, out, layer);
         chunk_write_dict_value(&c, out, "visible", &layer->visible,
                                sizeof(layer->visible));
 
         chunk_write_finish(&c, out);
     }
 
+    // Write the animation frames.  The active frame meshes are the layers
+    // ones, so it doesn't have any.
+    DL_FOREACH(img->frames, frame) {
+        chunk_write_start(&c, out, "FRAM");
+        chunk_write_int32(&c, out, frame->nb_meshes);
+        for (i = 0; i < frame->nb_meshes; i++) {
+            chunk_write_int32(&c, out, frame->meshes[i].layer_id);
+            write_mesh_blocks(&c, out, state, frame->meshes[i].mesh);
+        }
+        if (frame == img->active_frame)
+            chunk_write_dict_value(&c, out, "active", NULL, 0);
+        chunk_write_finish(&c, out);
+    }
+
     // Write all the cameras.
     DL_FOREACH(img->cameras, camera) {
         chunk_write_start(&c, out, "CAMR");
@@ -406,113 +1210,1224 @@ void save_to_file(const image_t *img, const char *path)
 
     // Write the light settings.
     chunk_write_start(&c, out, "LIGH");
-    chunk_write_dict_value(&c, out, "pitch", &goxel.rend.light.pitch,
-                           sizeof(goxel.rend.light.pitch));
-    chunk_write_dict_value(&c, out, "yaw", &goxel.rend.light.yaw,
-                           sizeof(goxel.rend.light.yaw));
-    chunk_write_dict_value(&c, out, "intensity", &goxel.rend.light.intensity,
-                           sizeof(goxel.rend.light.intensity));
-    chunk_write_dict_value(&c, out, "fixed", &goxel.rend.light.fixed,
-                           sizeof(goxel.rend.light.fixed));
-    chunk_write_dict_value(&c, out, "ambient", &goxel.rend.settings.ambient,
-                           sizeof(goxel.rend.settings.ambient));
-    chunk_write_dict_value(&c, out, "shadow", &goxel.rend.settings.shadow,
-                           sizeof(goxel.rend.settings.shadow));
+    chunk_write_dict_value(&c, out, "pitch", &job->light.pitch,
+                           sizeof(job->light.pitch));
+    chunk_write_dict_value(&c, out, "yaw", &job->light.yaw,
+                           sizeof(job->light.yaw));
+    chunk_write_dict_value(&c, out, "intensity", &job->light.intensity,
+                           sizeof(job->light.intensity));
+    chunk_write_dict_value(&c, out, "fixed", &job->light.fixed,
+                           sizeof(job->light.fixed));
+    chunk_write_dict_value(&c, out, "ambient", &job->ambient,
+                           sizeof(job->ambient));
+    chunk_write_dict_value(&c, out, "shadow", &job->shadow,
+                           sizeof(job->shadow));
     chunk_write_finish(&c, out);
 
-    HASH_ITER(hh, blocks_table, data, data_tmp) {
-        HASH_DEL(blocks_table, data);
-        free(data);
+    if (info_pos >= 0) {
+        offsets[1] = ftell(out);
+        fseek(out, info_pos, SEEK_SET);
+        fwrite(offsets, sizeof(offsets), 1, out);
     }
 
-    fclose(out);
+    if (fclose(out) != 0 || store_failed) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        saved_file_reset(state, NULL);
+        free(tmp_path);
+        return false;
+    }
+    if (tmp_path) {
+        // Only replace the file once it has been fully written.  On
+        // Windows rename fails if the destination exists.
+        if (rename(tmp_path, path) != 0) {
+            remove(path);
+            if (rename(tmp_path, path) != 0) {
+                LOG_E("Cannot save to %s: %s", path, strerror(errno));
+                saved_file_reset(state, NULL);
+                free(tmp_path);
+                return false;
+            }
+        }
+        free(tmp_path);
+    }
+    saved_file_update(state);
+    if (!append) state->base_size = state->size;
+    return true;
 }
 
-// Iter info of a gox file, without actually reading it.
-// For the moment only returns the image preview if available.
-int gox_iter_infos(const char *path,
-                   int (*callback)(const char *attr, int size,
-                                   void *value, void *user),
-                   void *user)
+// Check if we can append the changes to a file rather than rewriting it.
+// We still rewrite the whole file from time to time, so that it doesn't
+// keep growing with the blocks that are not used anymore.
+static bool can_append(const saved_file_t *state, const char *path)
 {
+    return saved_file_matches(state, path) &&
+           state->nb_appends < MAX_APPENDS &&
+           state->size < 2 * state->base_size + 1 * MB;
+}
+
+void save_to_file(const image_t *img, const char *path)
+{
+    save_job_t *job;
+    gox_save_wait();
+    job = save_job_new(img ?: goxel.image, path, &g_saved, false);
+    write_image(job);
+    save_job_delete(job);
+}
+
+void save_to_file_incremental(const image_t *img, const char *path)
+{
+    save_job_t *job;
+    gox_save_wait();
+    job = save_job_new(img ?: goxel.image, path, &g_saved,
+                       can_append(&g_saved, path));
+    write_image(job);
+    save_job_delete(job);
+}
+
+void save_to_store(const image_t *img, const char *path)
+{
+    save_job_t *job;
+    gox_save_wait();
+    job = save_job_new(img ?: goxel.image, path, &g_saved, false);
+    job->store = true;
+    write_image(job);
+    save_job_delete(job);
+}
+
+static void save_task_func(void *user)
+{
+    save_job_t *job = user;
+    job->done = write_image(job);
+}
+
+// Start a background save job.
+static bool save_start(image_t *img, const char *path, saved_file_t *state,
+                       bool autosave, bool store)
+{
+    save_job_t *job;
+    if (g_save_job) return false;
+    job = save_job_new(img, path, state,
+                       !store && can_append(state, path));
+    job->store = store;
+    job->copy = image_copy(img);
+    job->img = job->copy;
+    job->key = image_get_key(img);
+    job->autosave = autosave;
+    job->task = task_start(save_task_func, job);
+    g_save_job = job;
+    return true;
+}
+
+void save_to_file_async(image_t *img, const char *path)
+{
+    gox_save_wait();
+    save_start(img ?: goxel.image, path, &g_saved, false, false);
+}
+
+// Add the hashes of the blocks used by a store file into a set.
+static int store_gc_add_file(const char *dir, const char *name, void *user)
+{
+    block_hash_t **used = user, *data;
+    char path[1024], magic[4] = {};
     FILE *in;
     chunk_t c;
-    uint8_t *png;
-    char magic[4];
+    int i, nb;
+    uint64_t hash;
 
+    if (!str_endswith(name, ".gox")) return 0;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
     in = fopen(path, "rb");
-
-    if (fread(magic, 4, 1, in) != 1) goto error;
-    if (strncmp(magic, "GOX ", 4) != 0) goto error;
+    if (!in) return 0;
+    if (fread(magic, 4, 1, in) != 1 || strncmp(magic, "GOX ", 4) != 0) {
+        fclose(in);
+        return 0;
+    }
     read_int32(in);
-
     while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) break;
-        if (strncmp(c.type, "LAYR", 4) == 0) break;
-        if (strncmp(c.type, "PREV", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            callback(c.type, c.length, png, user);
-            free(png);
-        } else {
-            // Ignore other blocks.
+        if (strncmp(c.type, "BREF", 4) != 0) {
             chunk_read(&c, in, NULL, c.length, __LINE__);
+            chunk_read_finish(&c, in);
+            continue;
         }
+        nb = chunk_read_int32(&c, in, __LINE__);
+        for (i = 0; i < nb && c.pos + 8 <= c.length; i++) {
+            chunk_read(&c, in, (char*)&hash, 8, __LINE__);
+            HASH_FIND(hh, *used, &hash, sizeof(hash), data);
+            if (data) continue;
+            data = calloc(1, sizeof(*data));
+            data->hash = hash;
+            HASH_ADD(hh, *used, hash, sizeof(data->hash), data);
+        }
+        chunk_read(&c, in, NULL, c.length - c.pos, __LINE__);
         chunk_read_finish(&c, in);
     }
     fclose(in);
     return 0;
-
-error:
-    fclose(in);
-    LOG_W("Cannot get gox file info");
-    return -1;
 }
 
+typedef struct {
+    block_hash_t    *used;
+    int             nb_deleted;
+} store_gc_t;
 
-static block_hash_t *hash_find_at(block_hash_t *hash, int index)
+static int store_gc_delete_block(const char *dir, const char *name,
+                                 void *user)
 {
-    int i;
-    for (i = 0; i < index; i++) {
-        hash = hash->hh.next;
+    store_gc_t *gc = user;
+    block_hash_t *data;
+    uint64_t hash;
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    // Left by an interrupted save.
+    if (str_endswith(name, ".tmp")) {
+        sys_delete_file(path);
+        return 0;
     }
-    return hash;
+    if (strlen(name) != 20 || !str_endswith(name, ".blk")) return 0;
+    hash = strtoull(name, NULL, 16);
+    HASH_FIND(hh, gc->used, &hash, sizeof(hash), data);
+    if (data) return 0;
+    if (sys_delete_file(path) == 0) gc->nb_deleted++;
+    return 0;
 }
 
+int gox_store_gc(const char *dir)
+{
+    store_gc_t gc = {};
+    block_hash_t *data, *tmp, *used;
+    char store[1024];
+
+    gox_save_wait();
+    if (sys_list_dir(dir, store_gc_add_file, &gc.used) < 0) return -1;
+    snprintf(store, sizeof(store), "%s/blocks", dir);
+    sys_list_dir(store, store_gc_delete_block, &gc);
+
+    // Forget the hashes of the deleted blocks.
+    if (g_store.dir && strcmp(g_store.dir, store) == 0) {
+        HASH_ITER(hh, g_store.blocks, data, tmp) {
+            HASH_FIND(hh, gc.used, &data->hash, sizeof(data->hash), used);
+            if (used) continue;
+            HASH_DEL(g_store.blocks, data);
+            free(data);
+        }
+    }
+    HASH_ITER(hh, gc.used, data, tmp) {
+        HASH_DEL(gc.used, data);
+        free(data);
+    }
+    return gc.nb_deleted;
+}
 
-// Ugly macro that check dict key/value and copy them if needed.
-#define DICT_CPY(key, dst) ({ \
-    bool r = false; \
-    if (strcmp(key, dict_key) == 0) { \
-        if (dict_value_size != sizeof(dst)) { \
-            LOG_E("Dict value %s size doesn't match!", key); \
-        } else { \
-            memcpy(&(dst), dict_value, dict_value_size); \
-            r = true; \
-        } \
-    } \
-    r; })
+#ifdef __EMSCRIPTEN__
 
+// Called once the web store has been loaded from the IndexedDB.
+KEEPALIVE void gox_web_store_on_loaded(void)
+{
+    image_t *img = goxel.image;
+    char path[1024];
+    struct stat st;
+
+    // Restore the last session, unless something has been done already.
+    snprintf(path, sizeof(path), "%s/autosave.gox", WEB_STORE_DIR);
+    if (!img || img->path || image_get_key(img) != img->saved_key) return;
+    if (stat(path, &st) != 0) return;
+    if (load_from_file(path) != 0) return;
+    // So that saving doesn't overwrite the autosave.
+    free(goxel.image->path);
+    goxel.image->path = NULL;
+}
 
-int load_from_file(const char *path)
+// Mount the web store and load its content from the IndexedDB.
+static void web_store_init(void)
+{
+    EM_ASM({
+        var dir = UTF8ToString($0);
+        FS.mkdir(dir);
+        FS.mount(IDBFS, {}, dir);
+        FS.syncfs(true, function(err) {
+            if (err) console.warn('Cannot load the store', err);
+            else Module._gox_web_store_on_loaded();
+        });
+    }, WEB_STORE_DIR);
+}
+
+// Write the changes of the web store into the IndexedDB.  Only the files
+// modified since the last sync are written, that is the manifest and the
+// new blocks.
+static void web_store_sync(void)
+{
+    gox_store_gc(WEB_STORE_DIR);
+    EM_ASM({
+        FS.syncfs(false, function(err) {
+            if (err) console.warn('Cannot save the store', err);
+        });
+    });
+}
+
+#endif
+
+// Release the background save job once it is done.
+static void save_finish(void)
+{
+    save_job_t *job = g_save_job;
+    image_t *img = goxel.image;
+    task_wait(job->task);
+    task_delete(job->task);
+    g_save_job = NULL;
+    if (job->done && !job->autosave) {
+        if (img && img->path && strcmp(img->path, job->path) == 0)
+            img->saved_key = job->key;
+        sys_on_saved(job->path);
+    }
+#ifdef __EMSCRIPTEN__
+    if (job->done && job->store) web_store_sync();
+#endif
+    save_job_delete(job);
+}
+
+void gox_save_wait(void)
+{
+    if (g_save_job) save_finish();
+}
+
+float gox_save_get_progress(void)
+{
+    int total;
+    if (!g_save_job) return -1;
+    total = __atomic_load_n(&g_save_job->total, __ATOMIC_RELAXED);
+    if (!total) return 0;
+    return (float)__atomic_load_n(&g_save_job->progress, __ATOMIC_RELAXED) /
+           total;
+}
+
+void gox_set_autosave_interval(int seconds)
+{
+    g_autosave_interval = max(seconds, 0);
+}
+
+int gox_get_autosave_interval(void)
+{
+    return g_autosave_interval;
+}
+
+// Path of the autosave file of an image.
+static void get_autosave_path(const image_t *img, char *buf, int size)
+{
+    if (DEFINED(__EMSCRIPTEN__))
+        snprintf(buf, size, "%s/autosave.gox", WEB_STORE_DIR);
+    else if (img->path)
+        snprintf(buf, size, "%s.autosave.gox", img->path);
+    else
+        snprintf(buf, size, "%s/autosave.gox", sys_get_user_dir());
+}
+
+void gox_iter(double time)
+{
+    static double last_autosave = 0;
+    static uint32_t autosave_key = 0;
+    image_t *img = goxel.image;
+    uint32_t key;
+    char path[1024];
+
+#ifdef __EMSCRIPTEN__
+    static bool web_store_initialized = false;
+    if (!web_store_initialized) {
+        web_store_init();
+        web_store_initialized = true;
+    }
+#endif
+
+    if (g_save_job && task_is_done(g_save_job->task)) save_finish();
+    if (g_save_job) {
+        goxel_set_help_text("Saving %s... %d%%", g_save_job->path,
+                            (int)(gox_save_get_progress() * 100));
+        return;
+    }
+
+    if (!img || !g_autosave_interval) return;
+    if (!last_autosave) last_autosave = time;
+    if (time - last_autosave < g_autosave_interval) return;
+    last_autosave = time;
+    key = image_get_key(img);
+    if (key == img->saved_key || key == autosave_key) return;
+    autosave_key = key;
+    get_autosave_path(img, path, sizeof(path));
+    sys_make_dir(path);
+    save_start(img, path, &g_autosave, true, DEFINED(__EMSCRIPTEN__));
+}
+
+// Get the next value of a dict from a chunk data.  Return a pointer to the
+// following value, or NULL at the end of the dict.
+static const uint8_t *dict_next(const uint8_t *p, const uint8_t *end,
+                                char key[256], const uint8_t **value,
+                                int *size)
+{
+    int32_t n;
+    if (end - p < 4) return NULL;
+    memcpy(&n, p, 4);
+    if (n <= 0 || n >= 256 || end - p < 8 + n) return NULL;
+    memcpy(key, p + 4, n);
+    key[n] = '\0';
+    p += 4 + n;
+    memcpy(&n, p, 4);
+    if (n < 0 || end - p - 4 < n) return NULL;
+    *value = p + 4;
+    *size = n;
+    return p + 4 + n;
+}
+
+// Pass the values of an INFO chunk to a gox_iter_infos callback.
+static void iter_info_chunk(const uint8_t *data, int size, int64_t file_size,
+                            int (*callback)(const char *attr, int size,
+                                            void *value, void *user),
+                            void *user)
+{
+    const uint8_t *p, *value, *end = data + size;
+    char key[256];
+    int n;
+    int64_t offsets[2] = {};
+
+    for (p = data; (p = dict_next(p, end, key, &value, &n)); ) {
+        if (strcmp(key, "offsets") == 0 && n == sizeof(offsets))
+            memcpy(offsets, value, sizeof(offsets));
+    }
+    if (offsets[1] != file_size) return; // Outdated.
+    for (p = data; (p = dict_next(p, end, key, &value, &n)); ) {
+        if (strcmp(key, "offsets") == 0) continue;
+        callback(key, n, (void*)value, user);
+    }
+}
+
+/*
+ * Read the chunks of the file header until the first blocks, and pass the
+ * infos to the callback.  If cache is set, the header chunks are also
+ * copied into it.
+ */
+static bool iter_infos_chunks(FILE *in, int64_t file_size, FILE *cache,
+                              int (*callback)(const char *attr, int size,
+                                              void *value, void *user),
+                              void *user)
+{
+    chunk_t c;
+    uint8_t *data;
+
+    while (chunk_read_start(&c, in)) {
+        if (strncmp(c.type, "BL16", 4) == 0) break;
+        if (strncmp(c.type, "BLKS", 4) == 0) break;
+        if (strncmp(c.type, "LAYR", 4) == 0) break;
+        if (c.length < 0 || c.length > CHUNK_BUFF_SIZE) return false;
+        if (    strncmp(c.type, "PREV", 4) != 0 &&
+                strncmp(c.type, "INFO", 4) != 0) {
+            // Ignore other chunks.
+            chunk_read(&c, in, NULL, c.length, __LINE__);
+            chunk_read_finish(&c, in);
+            continue;
+        }
+        data = calloc(1, c.length);
+        chunk_read(&c, in, (char*)data, c.length, __LINE__);
+        chunk_read_finish(&c, in);
+        if (cache) chunk_write_all(cache, c.type, (char*)data, c.length);
+        if (strncmp(c.type, "PREV", 4) == 0)
+            callback(c.type, c.length, data, user);
+        else
+            iter_info_chunk(data, c.length, file_size, callback, user);
+        free(data);
+    }
+    return true;
+}
+
+/*
+ * The header chunks of the gox files read by gox_iter_infos are cached in
+ * the user directory, with the size and modification time of the file:
+ *  4 bytes magic string: "GOXI"
+ *  8 bytes: file size
+ *  8 bytes: file modification time
+ *  List of chunks, as in the gox file.
+ */
+static bool get_infos_cache_path(const char *path, char *buf, int size)
+{
+    const char *dir = sys_get_user_dir();
+    if (!dir) return false;
+    snprintf(buf, size, "%s/infos/%08x%08x.bin", dir,
+             XXH32(path, strlen(path), 0), XXH32(path, strlen(path), 1));
+    return true;
+}
+
+int gox_iter_infos(const char *path,
+                   int (*callback)(const char *attr, int size,
+                                   void *value, void *user),
+                   void *user)
+{
+    FILE *in, *cache = NULL;
+    struct stat st;
+    char magic[4], cache_path[1024], *tmp_path = NULL;
+    int64_t header[2], file_header[2];
+    bool has_cache, ok;
+
+    if (stat(path, &st) != 0) goto error;
+    header[0] = st.st_size;
+    header[1] = st.st_mtime;
+    has_cache = get_infos_cache_path(path, cache_path, sizeof(cache_path));
+
+    // Try the cache first.
+    in = has_cache ? fopen(cache_path, "rb") : NULL;
+    if (in) {
+        if (    fread(magic, 4, 1, in) == 1 &&
+                strncmp(magic, "GOXI", 4) == 0 &&
+                fread(file_header, sizeof(file_header), 1, in) == 1 &&
+                memcmp(file_header, header, sizeof(header)) == 0) {
+            ok = iter_infos_chunks(in, header[0], NULL, callback, user);
+            fclose(in);
+            if (ok) return 0;
+            goto error;
+        }
+        fclose(in);
+    }
+
+    in = fopen(path, "rb");
+    if (!in) goto error;
+    if (fread(magic, 4, 1, in) != 1 || strncmp(magic, "GOX ", 4) != 0) {
+        fclose(in);
+        goto error;
+    }
+    read_int32(in);
+
+    if (has_cache) {
+        sys_make_dir(cache_path);
+        asprintf(&tmp_path, "%s.tmp", cache_path);
+        cache = fopen(tmp_path, "wb");
+    }
+    if (cache) {
+        fwrite("GOXI", 4, 1, cache);
+        fwrite(header, sizeof(header), 1, cache);
+    }
+    ok = iter_infos_chunks(in, header[0], cache, callback, user);
+    fclose(in);
+    if (cache) {
+        if (fclose(cache) != 0 || !ok || rename(tmp_path, cache_path) != 0)
+            remove(tmp_path);
+    }
+    free(tmp_path);
+    if (ok) return 0;
+
+error:
+    LOG_W("Cannot get gox file info");
+    return -1;
+}
+
+
+// Decode a single block from the uncompressed data of a BLKS chunk.  If
+// voxels is NULL, only skip the block.  Return a pointer to the next block,
+// or NULL if the data is invalid.
+static const uint8_t *blks_decode_block(const uint8_t *p, const uint8_t *end,
+                                        uint8_t *voxels)
+{
+    uint16_t nb_colors;
+    int j;
+
+    if (end - p < 2) return NULL;
+    memcpy(&nb_colors, p, 2);
+    p += 2;
+    if (nb_colors > 256) return NULL;
+    if (nb_colors == 0) {
+        if (end - p < BLOCK_VOXELS * 4) return NULL;
+        if (voxels) memcpy(voxels, p, BLOCK_VOXELS * 4);
+        return p + BLOCK_VOXELS * 4;
+    }
+    if (nb_colors == 1) {
+        if (end - p < 4) return NULL;
+        for (j = 0; voxels && j < BLOCK_VOXELS; j++)
+            memcpy(voxels + j * 4, p, 4);
+        return p + 4;
+    }
+    if (end - p < nb_colors * 4 + BLOCK_VOXELS) return NULL;
+    for (j = 0; j < BLOCK_VOXELS; j++) {
+        if (p[nb_colors * 4 + j] >= nb_colors) return NULL;
+        if (voxels) memcpy(voxels + j * 4, p + p[nb_colors * 4 + j] * 4, 4);
+    }
+    return p + nb_colors * 4 + BLOCK_VOXELS;
+}
+
+static uint8_t *blks_uncompress(const uint8_t *data, int size, int *out_size)
+{
+    int raw_size;
+    if (size < 8) return NULL;
+    memcpy(&raw_size, data + 4, 4);
+    return img_zlib_uncompress(data + 8, size - 8, raw_size, out_size);
+}
+
+int gox_decode_blocks(const uint8_t *data, int size, int nb,
+                      uint8_t *voxels)
+{
+    uint8_t *buf;
+    const uint8_t *p, *end;
+    int i, buf_size, data_nb;
+
+    if (size < 8) return -1;
+    memcpy(&data_nb, data, 4);
+    if (data_nb != nb) return -1;
+    buf = blks_uncompress(data, size, &buf_size);
+    if (!buf) return -1;
+    p = buf;
+    end = buf + buf_size;
+    for (i = 0; i < nb && p; i++)
+        p = blks_decode_block(p, end, voxels + (size_t)i * BLOCK_VOXELS * 4);
+    free(buf);
+    return p ? 0 : -1;
+}
+
+// Decode the blocks of a BLKS chunk, return false if the data is invalid.
+static bool decode_blks(const block_chunk_t *chunk, mesh_t **meshes)
+{
+    uint8_t *buf, *voxels;
+    const uint8_t *p, *end;
+    int i, size;
+    bool ret = false;
+
+    buf = blks_uncompress(chunk->data, chunk->size, &size);
+    if (!buf) return false;
+    voxels = malloc(BLOCK_VOXELS * 4);
+    p = buf;
+    end = buf + size;
+    for (i = 0; i < chunk->nb; i++) {
+        p = blks_decode_block(p, end, voxels);
+        if (!p) goto end;
+        mesh_write(meshes[i], (int[]){0, 0, 0}, FILE_BLOCK_DIM, voxels);
+    }
+    ret = true;
+end:
+    free(voxels);
+    free(buf);
+    return ret;
+}
+
+static uint8_t *decode_bl16_voxels(const uint8_t *data, int size)
+{
+    uint8_t *voxels;
+    int w, h, bpp = 4;
+
+    voxels = img_read_from_mem((const char*)data, size, &w, &h, &bpp);
+    if (!voxels || w != 64 || h != 64 || bpp != 4) {
+        free(voxels);
+        return NULL;
+    }
+    return voxels;
+}
+
+static bool decode_bl16(const block_chunk_t *chunk, mesh_t *mesh)
+{
+    uint8_t *voxels;
+
+    voxels = decode_bl16_voxels(chunk->data, chunk->size);
+    if (!voxels) return false;
+    mesh_write(mesh, (int[]){0, 0, 0}, FILE_BLOCK_DIM, voxels);
+    free(voxels);
+    return true;
+}
+
+static void decode_blocks_chunk(void *user, int i)
+{
+    const blocks_job_t *job = user;
+    block_chunk_t *chunk = &job->chunks[i];
+    mesh_t **meshes = job->meshes + chunk->first;
+    char path[1024];
+    bool ok;
+    int j;
+
+    if (job->decode && !job->decode[i]) {
+        for (j = 0; j < chunk->nb; j++) meshes[j] = NULL;
+        return;
+    }
+    for (j = 0; j < chunk->nb; j++) meshes[j] = mesh_new();
+    if (strncmp(chunk->type, "BREF", 4) == 0) {
+        if (get_store_block_path(job->store, chunk->hash, path, sizeof(path)))
+            chunk->data = (uint8_t*)read_file(path, &chunk->size);
+        if (!chunk->data) {
+            LOG_W("Missing block file %s", path);
+            return;
+        }
+    }
+    if (strncmp(chunk->type, "BL16", 4) == 0)
+        ok = decode_bl16(chunk, meshes[0]);
+    else
+        ok = decode_blks(chunk, meshes);
+    if (!ok) LOG_W("Invalid blocks chunk");
+    free(chunk->data);
+    chunk->data = NULL;
+}
+
+// Add a block from a layer chunk into a mesh.  The blocks are stored into
+// single block meshes, so that we can directly share their data between
+// all the layers using them.
+static void load_block(mesh_t *mesh, const mesh_t *block, const int pos[3])
+{
+    uint8_t *voxels;
+    if (    BLOCK_SIZE == FILE_BLOCK_SIZE &&
+            pos[0] % BLOCK_SIZE == 0 &&
+            pos[1] % BLOCK_SIZE == 0 &&
+            pos[2] % BLOCK_SIZE == 0) {
+        mesh_copy_block(block, (int[]){0, 0, 0}, mesh, pos);
+        return;
+    }
+    // Unaligned blocks shouldn't happen, but the format allows it.
+    voxels = malloc(BLOCK_VOXELS * 4);
+    mesh_read(block, (int[]){0, 0, 0}, FILE_BLOCK_DIM, voxels);
+    mesh_write(mesh, pos, FILE_BLOCK_DIM, voxels);
+    free(voxels);
+}
+
+// Read some bytes of the file of a pager.  Called with the pager lock.
+static bool pager_read(gox_pager_t *pager, long offset, int size,
+                       uint8_t *out)
+{
+    if (offset < 0 || size < 0 || offset + size > pager->file_size)
+        return false;
+    if (pager->file_data) {
+        memcpy(out, pager->file_data + offset, size);
+        return true;
+    }
+    if (!pager->file || fseek(pager->file, offset, SEEK_SET) != 0)
+        return false;
+    return size == 0 || fread(out, size, 1, pager->file) == 1;
+}
+
+// Read the data of a chunk, from memory if we kept it.  Called with the
+// pager lock.
+static bool pager_read_chunk(gox_pager_t *pager, const chunk_index_t *chunk,
+                             uint8_t *out)
+{
+    if (chunk->data) {
+        memcpy(out, chunk->data, chunk->size);
+        return true;
+    }
+    return pager_read(pager, chunk->offset, chunk->size, out);
+}
+
+// Binary search of the chunk containing a block.
+static chunk_index_t *pager_find_chunk(gox_pager_t *pager, int page)
+{
+    int a = 0, b = pager->nb_chunks - 1, m;
+
+    while (a < b) {
+        m = (a + b + 1) / 2;
+        if (pager->chunks[m].first <= page) a = m;
+        else b = m - 1;
+    }
+    if (a > b) return NULL;
+    if (page < pager->chunks[a].first ||
+            page >= pager->chunks[a].first + pager->chunks[a].nb)
+        return NULL;
+    return &pager->chunks[a];
+}
+
+// Return the decompressed data of a BLKS chunk, from the cache if
+// possible.  Called with the pager lock.
+static pager_cache_t *pager_get_blks(gox_pager_t *pager, int chunk_idx)
+{
+    const chunk_index_t *chunk = &pager->chunks[chunk_idx];
+    pager_cache_t *entry = &pager->cache[0];
+    uint8_t *data;
+    const uint8_t *p, *end;
+    int i, size = 0;
+
+    for (i = 0; i < PAGER_CACHE_SIZE; i++) {
+        if (pager->cache[i].chunk == chunk_idx) {
+            entry = &pager->cache[i];
+            entry->last_use = ++pager->tick;
+            return entry;
+        }
+        if (pager->cache[i].last_use < entry->last_use)
+            entry = &pager->cache[i];
+    }
+
+    data = malloc(max(chunk->size, 1));
+    if (!pager_read_chunk(pager, chunk, data)) {
+        free(data);
+        return NULL;
+    }
+    free(entry->data);
+    free(entry->offsets);
+    entry->data = blks_uncompress(data, chunk->size, &size);
+    entry->size = entry->data ? size : 0;
+    free(data);
+    entry->offsets = calloc(max(chunk->nb, 1), sizeof(*entry->offsets));
+    entry->chunk = chunk_idx;
+    entry->last_use = ++pager->tick;
+    p = entry->data;
+    end = p + entry->size;
+    for (i = 0; i < chunk->nb; i++) {
+        entry->offsets[i] = p ? p - entry->data : -1;
+        if (p) p = blks_decode_block(p, end, NULL);
+    }
+    return entry;
+}
+
+static bool pager_load(mesh_pager_t *pager_, int page, uint8_t *voxels)
+{
+    gox_pager_t *pager = (gox_pager_t*)pager_;
+    const chunk_index_t *chunk;
+    pager_cache_t *entry;
+    uint8_t *data, *bl16;
+    int ofs;
+    bool ret = false;
+
+    chunk = pager_find_chunk(pager, page);
+    if (!chunk) return false;
+
+    pthread_mutex_lock(&pager->lock);
+    if (strncmp(chunk->type, "BL16", 4) == 0) {
+        data = malloc(max(chunk->size, 1));
+        if (pager_read_chunk(pager, chunk, data)) {
+            bl16 = decode_bl16_voxels(data, chunk->size);
+            if (bl16) memcpy(voxels, bl16, BLOCK_VOXELS * 4);
+            ret = bl16 != NULL;
+            free(bl16);
+        }
+        free(data);
+    } else {
+        entry = pager_get_blks(pager, chunk - pager->chunks);
+        if (entry && entry->data) {
+            ofs = entry->offsets[page - chunk->first];
+            if (ofs >= 0) {
+                ret = blks_decode_block(entry->data + ofs,
+                                        entry->data + entry->size,
+                                        voxels) != NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pager->lock);
+    if (!ret) LOG_W("Cannot load block %d from %s", page, pager->path);
+    return ret;
+}
+
+// Free the data of the chunks kept in memory once all their blocks have
+// been loaded or deleted.
+static void pager_free_page(mesh_pager_t *pager_, int page)
+{
+    gox_pager_t *pager = (gox_pager_t*)pager_;
+    chunk_index_t *chunk;
+
+    chunk = pager_find_chunk(pager, page);
+    if (!chunk) return;
+    pthread_mutex_lock(&pager->lock);
+    if (chunk->data && --chunk->nb_pages == 0) {
+        free(chunk->data);
+        chunk->data = NULL;
+        mem_stats_add(MEM_DEFERRED, -chunk->size);
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+static void pager_release(mesh_pager_t *pager_)
+{
+    gox_pager_t *pager = (gox_pager_t*)pager_;
+    int i;
+
+    pthread_mutex_lock(&g_pagers_lock);
+    DL_DELETE(g_pagers, pager);
+    pthread_mutex_unlock(&g_pagers_lock);
+    if (pager->file) fclose(pager->file);
+    for (i = 0; i < PAGER_CACHE_SIZE; i++) {
+        free(pager->cache[i].data);
+        free(pager->cache[i].offsets);
+    }
+    for (i = 0; i < pager->nb_chunks; i++) {
+        if (!pager->chunks[i].data) continue;
+        free(pager->chunks[i].data);
+        mem_stats_add(MEM_DEFERRED, -pager->chunks[i].size);
+    }
+    pthread_mutex_destroy(&pager->lock);
+    free(pager->file_data);
+    free(pager->chunks);
+    free(pager->path);
+    free(pager);
+}
+
+static gox_pager_t *pager_new(const char *path, FILE *file, long file_size)
+{
+    gox_pager_t *pager = calloc(1, sizeof(*pager));
+    int i;
+
+    pager->pager.ref = 1;
+    pager->pager.load = pager_load;
+    pager->pager.release = pager_release;
+    pager->pager.free_page = pager_free_page;
+    pager->path = strdup(path);
+    pager->file = file;
+    pager->file_size = file_size;
+    pthread_mutex_init(&pager->lock, NULL);
+    for (i = 0; i < PAGER_CACHE_SIZE; i++) pager->cache[i].chunk = -1;
+    pthread_mutex_lock(&g_pagers_lock);
+    DL_APPEND(g_pagers, pager);
+    pthread_mutex_unlock(&g_pagers_lock);
+    return pager;
+}
+
+// Read the whole file of all the pagers using a given path into memory,
+// so that we can safely overwrite it.
+static void detach_pagers(const char *path)
+{
+    gox_pager_t *pager;
+    uint8_t *data;
+
+    pthread_mutex_lock(&g_pagers_lock);
+    DL_FOREACH(g_pagers, pager) {
+        if (strcmp(pager->path, path) != 0) continue;
+        pthread_mutex_lock(&pager->lock);
+        if (pager->file) {
+            data = calloc(1, max(pager->file_size, 1));
+            if (!pager_read(pager, 0, pager->file_size, data))
+                LOG_E("Cannot read %s", path);
+            pager->file_data = data;
+            fclose(pager->file);
+            pager->file = NULL;
+        }
+        pthread_mutex_unlock(&pager->lock);
+    }
+    pthread_mutex_unlock(&g_pagers_lock);
+}
+
+// Add the position of a blocks chunk to the index of a pager, and return
+// the number of blocks in the chunk.
+static int pager_add_chunk(gox_pager_t *pager, chunk_t *c, FILE *in,
+                           int first)
+{
+    chunk_index_t *chunk;
+    int nb = 1;
+
+    pager->chunks = realloc(pager->chunks,
+                            (pager->nb_chunks + 1) * sizeof(*pager->chunks));
+    chunk = &pager->chunks[pager->nb_chunks++];
+    *chunk = (chunk_index_t){};
+    memcpy(chunk->type, c->type, 4);
+    chunk->offset = ftell(in);
+    chunk->size = c->length;
+    chunk->first = first;
+    if (strncmp(c->type, "BLKS", 4) == 0) {
+        nb = 0;
+        if (c->length >= 8) nb = chunk_read_int32(c, in, __LINE__);
+        if (nb < 0 || nb > BLKS_MAX_SIZE) {
+            LOG_W("Invalid blocks chunk");
+            nb = 0;
+        }
+    }
+    chunk_read(c, in, NULL, c->length - c->pos, __LINE__);
+    chunk->nb = nb;
+    return nb;
+}
+
+// Same as load_block, but only load the block data when it is first
+// accessed.
+static void load_block_paged(mesh_t *mesh, gox_pager_t *pager, int index,
+                             const int pos[3])
+{
+    uint8_t *voxels;
+    if (    BLOCK_SIZE == FILE_BLOCK_SIZE &&
+            pos[0] % BLOCK_SIZE == 0 &&
+            pos[1] % BLOCK_SIZE == 0 &&
+            pos[2] % BLOCK_SIZE == 0) {
+        mesh_set_block_paged(mesh, pos, &pager->pager, index);
+        return;
+    }
+    voxels = calloc(1, BLOCK_VOXELS * 4);
+    pager_load(&pager->pager, index, voxels);
+    mesh_write(mesh, pos, FILE_BLOCK_DIM, voxels);
+    free(voxels);
+}
+
+
+// The blocks list of a layer or frame mesh.  The blocks are only added
+// into the meshes once the whole file has been read, so that we know which
+// ones are needed right away.
+typedef struct {
+    mesh_t          *mesh;
+    int             (*blocks)[4];   // Index and position of each block.
+    int             nb;
+    int             allocated;
+    bool            defer;          // Hidden layer or inactive frame.
+} mesh_blocks_t;
+
+// What is needed to read the blocks lists of the layers and frames chunks.
+typedef struct {
+    int             version;
+    block_chunk_t   *chunks;
+    int             nb_chunks;
+    mesh_t          **blocks;       // All the blocks, in the file order.
+    int             nb_blocks;
+    gox_pager_t     *pager;
+    saved_file_t    *state;
+    const uint64_t  *hashes;
+    int             nb_hashes;
+    const char      *store;
+    const char      *path;
+    mesh_blocks_t   *lists;
+    int             nb_lists;
+} blocks_loader_t;
+
+// Read the list of the blocks of a mesh, as written by write_mesh_blocks.
+// nb_blocks is the number of blocks read so far in the file.
+static void read_mesh_blocks(chunk_t *c, FILE *in, mesh_t *mesh,
+                             blocks_loader_t *loader, int nb_blocks,
+                             bool defer)
+{
+    int i, nb, index, x, y, z;
+    mesh_blocks_t *list;
+
+    loader->lists = realloc(loader->lists,
+                            (loader->nb_lists + 1) * sizeof(*loader->lists));
+    list = &loader->lists[loader->nb_lists++];
+    *list = (mesh_blocks_t){.mesh = mesh, .defer = defer};
+
+    nb = chunk_read_int32(c, in, __LINE__);
+    assert(nb >= 0);
+    for (i = 0; i < nb; i++) {
+        index = chunk_read_int32(c, in, __LINE__);
+        assert(index >= 0);
+        x = chunk_read_int32(c, in, __LINE__);
+        y = chunk_read_int32(c, in, __LINE__);
+        z = chunk_read_int32(c, in, __LINE__);
+        if (loader->version == 1) { // Previous version blocks pos.
+            x -= 8; y -= 8; z -= 8;
+        }
+        chunk_read_int32(c, in, __LINE__);
+        if (index >= nb_blocks) {
+            LOG_W("Invalid block index %d", index);
+            continue;
+        }
+        if (list->nb == list->allocated) {
+            list->allocated = max(64, list->allocated * 2);
+            list->blocks = realloc(list->blocks,
+                                   list->allocated * sizeof(*list->blocks));
+        }
+        memcpy(list->blocks[list->nb++], (int[]){index, x, y, z},
+               sizeof(*list->blocks));
+    }
+}
+
+static void clear_mesh_blocks(blocks_loader_t *loader)
+{
+    int i;
+    for (i = 0; i < loader->nb_lists; i++) free(loader->lists[i].blocks);
+    free(loader->lists);
+    loader->lists = NULL;
+    loader->nb_lists = 0;
+}
+
+// Check if a file block is exactly a block of the meshes.
+static bool is_mesh_block(const int pos[3])
+{
+    return BLOCK_SIZE == FILE_BLOCK_SIZE &&
+           pos[0] % BLOCK_SIZE == 0 &&
+           pos[1] % BLOCK_SIZE == 0 &&
+           pos[2] % BLOCK_SIZE == 0;
+}
+
+// Check if a block can stay compressed in memory until it is accessed.
+static bool can_defer_block(const block_chunk_t *chunk, const int pos[3])
+{
+    return is_mesh_block(pos) && strncmp(chunk->type, "BREF", 4) != 0;
+}
+
+// Move the data of the chunks only used by deferred blocks into a pager,
+// so that they are only decoded when first accessed, and free the others.
+static gox_pager_t *defer_chunks(blocks_loader_t *loader, const bool *decode,
+                                 const int *nb_pages)
+{
+    gox_pager_t *pager = NULL;
+    block_chunk_t *chunk;
+    chunk_index_t *index;
+    int i;
+
+    for (i = 0; i < loader->nb_chunks; i++) {
+        chunk = &loader->chunks[i];
+        if (decode[i]) continue;
+        if (!nb_pages[i]) {
+            free(chunk->data);
+            chunk->data = NULL;
+            continue;
+        }
+        if (!pager) pager = pager_new(loader->path, NULL, 0);
+        pager->chunks = realloc(pager->chunks,
+                (pager->nb_chunks + 1) * sizeof(*pager->chunks));
+        index = &pager->chunks[pager->nb_chunks++];
+        *index = (chunk_index_t){
+            .size = chunk->size,
+            .first = chunk->first,
+            .nb = chunk->nb,
+            .data = chunk->data,
+            .nb_pages = nb_pages[i],
+        };
+        memcpy(index->type, chunk->type, 4);
+        mem_stats_add(MEM_DEFERRED, chunk->size);
+        chunk->data = NULL;
+    }
+    return pager;
+}
+
+/*
+ * Add the blocks of all the lists into their meshes.
+ *
+ * Only the chunks used by the visible layers are decoded.  The chunks only
+ * used by the hidden layers and the inactive frames keep their compressed
+ * data in memory, and each block gets decoded when first accessed.
+ */
+static void add_mesh_blocks(blocks_loader_t *loader)
+{
+    const mesh_blocks_t *list;
+    const block_chunk_t *chunk;
+    gox_pager_t *pager = loader->pager;
+    int *chunks_idx;    // Chunk of each block.
+    int *nb_pages;      // Number of deferred blocks using each chunk.
+    bool *decode;
+    int i, j, index;
+    const int *pos;
+    uint64_t uid;
+
+    chunks_idx = calloc(max(loader->nb_blocks, 1), sizeof(*chunks_idx));
+    nb_pages = calloc(max(loader->nb_chunks, 1), sizeof(*nb_pages));
+    decode = calloc(max(loader->nb_chunks, 1), sizeof(*decode));
+    for (i = 0; i < loader->nb_chunks; i++) {
+        chunk = &loader->chunks[i];
+        for (j = 0; j < chunk->nb; j++) chunks_idx[chunk->first + j] = i;
+    }
+    // The big files are already paged, and only have the pager chunks.
+    for (i = 0; i < loader->nb_lists && !pager; i++) {
+        list = &loader->lists[i];
+        for (j = 0; j < list->nb; j++) {
+            index = chunks_idx[list->blocks[j][0]];
+            if (list->defer && can_defer_block(&loader->chunks[index],
+                                               list->blocks[j] + 1))
+                nb_pages[index]++;
+            else
+                decode[index] = true;
+        }
+    }
+    if (loader->nb_chunks) {
+        parallel_for(loader->nb_chunks, decode_blocks_chunk,
+                     &(blocks_job_t){.chunks = loader->chunks,
+                                     .meshes = loader->blocks,
+                                     .store = loader->store,
+                                     .decode = decode});
+        pager = defer_chunks(loader, decode, nb_pages);
+    }
+
+    for (i = 0; i < loader->nb_lists; i++) {
+        list = &loader->lists[i];
+        for (j = 0; j < list->nb; j++) {
+            index = list->blocks[j][0];
+            pos = list->blocks[j] + 1;
+            if (!loader->pager && loader->blocks[index])
+                load_block(list->mesh, loader->blocks[index], pos);
+            else
+                load_block_paged(list->mesh, pager, index, pos);
+            // Remember the blocks stored in the file, for the incremental
+            // saves.
+            if (!loader->state || !is_mesh_block(pos)) continue;
+            mesh_get_block_data(list->mesh, NULL, pos, &uid);
+            if (uid) saved_file_add_block(loader->state, uid, index);
+            // So that the next saves into the store don't need to hash
+            // the block again.
+            if (uid && index < loader->nb_hashes && loader->hashes[index]) {
+                store_cache_set_dir(loader->store);
+                store_cache_add(uid, loader->hashes[index]);
+            }
+        }
+    }
+
+    // The block data used by the layers are not deleted, since they are
+    // shared with the layers meshes.
+    for (i = 0; i < loader->nb_blocks && !loader->pager; i++)
+        mesh_delete(loader->blocks[i]);
+    // The memory pager is kept alive by the paged blocks.
+    if (pager && pager != loader->pager) mesh_pager_release(&pager->pager);
+    free(chunks_idx);
+    free(nb_pages);
+    free(decode);
+}
+
+// Ugly macro that check dict key/value and copy them if needed.
+#define DICT_CPY(key, dst) ({ \
+    bool r = false; \
+    if (strcmp(key, dict_key) == 0) { \
+        if (dict_value_size != sizeof(dst)) { \
+            LOG_E("Dict value %s size doesn't match!", key); \
+        } else { \
+            memcpy(&(dst), dict_value, dict_value_size); \
+            r = true; \
+        } \
+    } \
+    r; })
+
+
+// Remove all layers, materials and camera.
+// XXX: should have a way to create a totally empty image instead.
+static void image_clear(image_t *img)
 {
     layer_t *layer, *layer_tmp;
-    block_hash_t *blocks_table = NULL, *data, *data_tmp;
-    FILE *in;
+    camera_t *camera, *camera_tmp;
+    material_t *mat, *mat_tmp;
+
+    DL_FOREACH_SAFE(img->layers, layer, layer_tmp) {
+        mesh_delete(layer->mesh);
+        free(layer);
+    }
+    DL_FOREACH_SAFE(img->materials, mat, mat_tmp) {
+        material_delete(mat);
+    }
+    DL_FOREACH_SAFE(img->cameras, camera, camera_tmp) {
+        camera_delete(camera);
+    }
+
+    img->layers = NULL;
+    image_layers_changed(img);
+    image_clear_frames(img);
+    img->active_layer = NULL;
+    img->materials = NULL;
+    img->active_material = NULL;
+    img->cameras = NULL;
+    img->active_camera = NULL;
+
+    memset(&img->box, 0, sizeof(img->box));
+}
+
+/*
+ * Load a gox file into an image.
+ *
+ * Parameters:
+ *   img        - The image to load into.
+ *   path       - Path of the file.
+ *   state      - If set, remember the blocks of the file there, for the
+ *                incremental saves.
+ *   set_light  - Also set the global render light from the file.
+ */
+static int load_image(image_t *img, const char *path, saved_file_t *state,
+                      bool set_light)
+{
+    layer_t *layer;
+    mesh_t **blocks = NULL; // All the blocks, in the file order.
+    block_chunk_t *chunks = NULL, *chunk;
+    int blocks_count = 0, blocks_allocated = 0;
+    int chunks_count = 0, chunks_allocated = 0;
+    gox_pager_t *pager = NULL;
+    FILE *in, *pager_file;
+    long file_size;
     char magic[4] = {};
-    uint8_t *voxel_data;
-    int nb_blocks;
-    int w, h, bpp;
-    uint8_t *png;
+    int nb_blocks, nb_meshes;
     chunk_t c;
-    int i, index, version, x, y, z, material_idx;
+    int i, version, material_idx;
+    bool is_block, is_ref;
+    char store[1024];
+    uint64_t *hashes = NULL; // Hashes of the blocks, zero if not in a store.
+    int nb_hashes = 0;
     int  dict_value_size;
     char dict_key[256];
     char dict_value[256];
-    uint64_t uid = 1;
     int aabb[2][3];
-    camera_t *camera, *camera_tmp;
-    material_t *mat, *mat_tmp;
+    camera_t *camera;
+    material_t *mat;
+    anim_frame_t *frame;
+    blocks_loader_t loader = {};
 
     in = fopen(path, "rb");
     if (!in) return -1;
@@ -524,61 +2439,116 @@ int load_from_file(const char *path)
         LOG_W("Cannot open gox file version %d", version);
         goto error;
     }
-
-    // Remove all layers, materials and camera.
-    // XXX: should have a way to create a totally empty image instead.
-    DL_FOREACH_SAFE(goxel.image->layers, layer, layer_tmp) {
-        mesh_delete(layer->mesh);
-        free(layer);
-    }
-    DL_FOREACH_SAFE(goxel.image->materials, mat, mat_tmp) {
-        material_delete(mat);
-    }
-    DL_FOREACH_SAFE(goxel.image->cameras, camera, camera_tmp) {
-        camera_delete(camera);
+    loader.version = version;
+
+    image_clear(img);
+    if (state) saved_file_reset(state, path);
+
+    // For big files, only index the blocks chunks, and read them from a
+    // separate file handle when needed.
+    fseek(in, 0, SEEK_END);
+    file_size = ftell(in);
+    fseek(in, 8, SEEK_SET);
+    // The lazy loading needs the file blocks to be the mesh blocks.
+    if (BLOCK_SIZE == FILE_BLOCK_SIZE && file_size >= g_lazy_load_size) {
+        pager_file = fopen(path, "rb");
+        if (pager_file) pager = pager_new(path, pager_file, file_size);
     }
 
-    goxel.image->layers = NULL;
-    goxel.image->materials = NULL;
-    goxel.image->active_material = NULL;
-    goxel.image->cameras = NULL;
-    goxel.image->active_camera = NULL;
-
-    memset(&goxel.image->box, 0, sizeof(goxel.image->box));
+    get_store_dir(path, store, sizeof(store));
 
     while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            bpp = 4;
-            voxel_data = img_read_from_mem((void*)png, c.length, &w, &h, &bpp);
-            assert(w == 64 && h == 64 && bpp == 4);
-            data = calloc(1, sizeof(*data));
-            data->v = calloc(1, 64 * 64 * 4);
-            memcpy(data->v, voxel_data, 64 * 64 * 4);
-            data->uid = ++uid;
-            HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
-            free(voxel_data);
-            free(png);
+        is_ref = strncmp(c.type, "BREF", 4) == 0;
+        is_block = is_ref || strncmp(c.type, "BL16", 4) == 0 ||
+                   strncmp(c.type, "BLKS", 4) == 0;
+
+        // The blocks stores files only have the blocks hashes, so there
+        // is nothing to page.
+        if (is_ref && pager && blocks_count == 0) {
+            mesh_pager_release(&pager->pager);
+            pager = NULL;
+        }
 
-        } else if (strncmp(c.type, "LAYR", 4) == 0) {
-            layer = image_add_layer(goxel.image, NULL);
+        if (is_ref && pager) {
+            LOG_W("Cannot load blocks files in a paged file");
+            chunk_read(&c, in, NULL, c.length, __LINE__);
+
+        } else if (is_ref) {
             nb_blocks = chunk_read_int32(&c, in, __LINE__);
-            assert(nb_blocks >= 0);
+            if (nb_blocks < 0 || nb_blocks > BLKS_MAX_SIZE ||
+                    nb_blocks * 8 > c.length - 4) {
+                LOG_W("Invalid blocks chunk");
+                nb_blocks = 0;
+            }
+            if (chunks_count + nb_blocks > chunks_allocated) {
+                chunks_allocated = max(chunks_count + nb_blocks,
+                                       chunks_allocated * 2);
+                chunks = realloc(chunks, chunks_allocated * sizeof(*chunks));
+            }
+            if (blocks_count + nb_blocks > blocks_allocated) {
+                blocks_allocated = max(blocks_count + nb_blocks,
+                                       blocks_allocated * 2);
+                blocks = realloc(blocks, blocks_allocated * sizeof(*blocks));
+            }
+            hashes = realloc(hashes, max(blocks_allocated, 1) *
+                             sizeof(*hashes));
+            for (; nb_hashes < blocks_count; nb_hashes++)
+                hashes[nb_hashes] = 0;
+            // One chunk per block, so that they are read in parallel.
             for (i = 0; i < nb_blocks; i++) {
-                index = chunk_read_int32(&c, in, __LINE__);
-                assert(index >= 0);
-                x = chunk_read_int32(&c, in, __LINE__);
-                y = chunk_read_int32(&c, in, __LINE__);
-                z = chunk_read_int32(&c, in, __LINE__);
-                if (version == 1) { // Previous version blocks pos.
-                    x -= 8; y -= 8; z -= 8;
+                chunk = &chunks[chunks_count++];
+                *chunk = (block_chunk_t){
+                    .type = "BREF",
+                    .first = blocks_count,
+                    .nb = 1,
+                };
+                chunk_read(&c, in, (char*)&chunk->hash, 8, __LINE__);
+                hashes[nb_hashes++] = chunk->hash;
+                blocks_count++;
+            }
+            chunk_read(&c, in, NULL, c.length - c.pos, __LINE__);
+
+        } else if (is_block && pager) {
+            blocks_count += pager_add_chunk(pager, &c, in, blocks_count);
+
+        } else if (is_block) {
+            if (chunks_count == chunks_allocated) {
+                chunks_allocated = max(64, chunks_allocated * 2);
+                chunks = realloc(chunks, chunks_allocated * sizeof(*chunks));
+            }
+            chunk = &chunks[chunks_count++];
+            *chunk = (block_chunk_t){
+                .data = malloc(max(c.length, 1)),
+                .size = c.length,
+                .first = blocks_count,
+                .nb = 1,
+            };
+            memcpy(chunk->type, c.type, 4);
+            chunk_read(&c, in, (char*)chunk->data, c.length, __LINE__);
+            if (strncmp(c.type, "BLKS", 4) == 0) {
+                chunk->nb = 0;
+                if (c.length >= 8) memcpy(&chunk->nb, chunk->data, 4);
+                if (chunk->nb < 0 || chunk->nb > BLKS_MAX_SIZE) {
+                    LOG_W("Invalid blocks chunk");
+                    chunk->nb = 0;
                 }
-                chunk_read_int32(&c, in, __LINE__);
-                data = hash_find_at(blocks_table, index);
-                assert(data);
-                mesh_blit(layer->mesh, data->v, x, y, z, 16, 16, 16, NULL);
             }
+            blocks_count += chunk->nb;
+            if (blocks_count > blocks_allocated) {
+                blocks_allocated = max(blocks_count, blocks_allocated * 2);
+                blocks = realloc(blocks, blocks_allocated * sizeof(*blocks));
+            }
+
+        } else if (strncmp(c.type, "APND", 4) == 0) {
+            // Only the data after the last APND chunk is used.
+            image_clear(img);
+            clear_mesh_blocks(&loader);
+            if (state) state->nb_appends++;
+
+        } else if (strncmp(c.type, "LAYR", 4) == 0) {
+            layer = image_add_layer(img, NULL);
+            read_mesh_blocks(&c, in, layer->mesh, &loader, blocks_count,
+                             false);
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 if (strcmp(dict_key, "name") == 0)
@@ -587,12 +2557,14 @@ int load_from_file(const char *path)
                 DICT_CPY("mat", layer->mat);
 
                 if (strcmp(dict_key, "img-path") == 0) {
-                    layer->image = texture_new_image(dict_value, TF_NEAREST);
+                    layer->image = texture_new_image(
+                            dict_value, TF_NEAREST | TF_MIPMAP | TF_ASYNC);
                 }
 
                 typeof(layer->id) id;
-                if (DICT_CPY("id", id)) {
-                    if (id) layer->id = id;
+                if (DICT_CPY("id", id) && id) {
+                    layer->id = id;
+                    image_layers_changed(img);
                 }
 
                 DICT_CPY("base_id", layer->base_id);
@@ -607,13 +2579,41 @@ int load_from_file(const char *path)
                     }
                 }
                 DICT_CPY("color", layer->color);
+                read_procedural(dict_key, dict_value, dict_value_size, layer);
                 DICT_CPY("visible", layer->visible);
                 if (DICT_CPY("material", material_idx))
-                    layer->material = get_material(goxel.image, material_idx);
+                    layer->material = get_material(img, material_idx);
+            }
+            // The hidden layers are only decoded once shown or edited.
+            loader.lists[loader.nb_lists - 1].defer = !layer->visible;
+        } else if (strncmp(c.type, "FRAM", 4) == 0) {
+            frame = calloc(1, sizeof(*frame));
+            DL_APPEND(img->frames, frame);
+            nb_meshes = chunk_read_int32(&c, in, __LINE__);
+            // Each mesh has at least its layer id and number of blocks.
+            if (nb_meshes < 0 || nb_meshes > (c.length - c.pos) / 8) {
+                LOG_W("Invalid frame chunk");
+                nb_meshes = 0;
+            }
+            frame->meshes = calloc(max(nb_meshes, 1),
+                                   sizeof(*frame->meshes));
+            // The active frame has no meshes, so all of them are deferred.
+            for (i = 0; i < nb_meshes; i++) {
+                frame->meshes[i].layer_id = chunk_read_int32(&c, in,
+                                                             __LINE__);
+                frame->meshes[i].mesh = mesh_new();
+                frame->nb_meshes++;
+                read_mesh_blocks(&c, in, frame->meshes[i].mesh, &loader,
+                                 blocks_count, true);
+            }
+            while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
+                                          &dict_value_size, __LINE__))) {
+                if (strcmp(dict_key, "active") == 0)
+                    img->active_frame = frame;
             }
         } else if (strncmp(c.type, "CAMR", 4) == 0) {
             camera = camera_new("unnamed");
-            DL_APPEND(goxel.image->cameras, camera);
+            DL_APPEND(img->cameras, camera);
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 if (strcmp(dict_key, "name") == 0) {
@@ -623,10 +2623,10 @@ int load_from_file(const char *path)
                 DICT_CPY("ortho", camera->ortho);
                 DICT_CPY("mat", camera->mat);
                 if (strcmp(dict_key, "active") == 0)
-                    goxel.image->active_camera = camera;
+                    img->active_camera = camera;
             }
         } else if (strncmp(c.type, "MATE", 4) == 0) {
-            mat = image_add_material(goxel.image, NULL);
+            mat = image_add_material(img, NULL);
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 if (strcmp(dict_key, "name") == 0)
@@ -639,9 +2639,9 @@ int load_from_file(const char *path)
         } else if (strncmp(c.type, "IMG ", 4) == 0) {
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
-                DICT_CPY("box", goxel.image->box);
+                DICT_CPY("box", img->box);
             }
-        } else if (strncmp(c.type, "LIGH", 4) == 0) {
+        } else if (strncmp(c.type, "LIGH", 4) == 0 && set_light) {
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 DICT_CPY("pitch", goxel.rend.light.pitch);
@@ -658,27 +2658,46 @@ int load_from_file(const char *path)
         chunk_read_finish(&c, in);
     }
 
-    // Free the block hash table.  We do not delete the block data because
-    // they have been used by the meshes.
-    HASH_ITER(hh, blocks_table, data, data_tmp) {
-        HASH_DEL(blocks_table, data);
-        free(data->v);
-        free(data);
+    loader.chunks = chunks;
+    loader.nb_chunks = chunks_count;
+    loader.blocks = blocks;
+    loader.nb_blocks = blocks_count;
+    loader.pager = pager;
+    loader.state = state;
+    loader.hashes = hashes;
+    loader.nb_hashes = nb_hashes;
+    loader.store = store;
+    loader.path = path;
+    add_mesh_blocks(&loader);
+    clear_mesh_blocks(&loader);
+    free(chunks);
+    free(blocks);
+    free(hashes);
+    // The pager is kept alive by the paged blocks.
+    if (pager) mesh_pager_release(&pager->pager);
+    if (img->frames && !img->active_frame) {
+        LOG_W("No active frame");
+        image_clear_frames(img);
     }
 
-    goxel.image->path = strdup(path);
-    goxel.image->saved_key = image_get_key(goxel.image);
+    img->path = strdup(path);
+    img->saved_key = image_get_key(img);
     fclose(in);
+    if (state) {
+        state->nb_blocks = blocks_count;
+        saved_file_update(state);
+        state->base_size = state->size;
+    }
 
     // Add a default camera if there is none.
-    if (!goxel.image->cameras) {
-        image_add_camera(goxel.image, NULL);
-        camera_fit_box(goxel.image->active_camera, goxel.image->box);
+    if (!img->cameras) {
+        image_add_camera(img, NULL);
+        camera_fit_box(img->active_camera, img->box);
     }
 
     // Set default image box if we didn't have one.
-    if (box_is_null(goxel.image->box)) {
-        mesh_get_bbox(goxel_get_layers_mesh(goxel.image), aabb, true);
+    if (box_is_null(img->box)) {
+        mesh_get_bbox(image_get_layers_mesh(img), aabb, true);
         if (aabb[0][0] > aabb[1][0]) {
             aabb[0][0] = -16;
             aabb[0][1] = -16;
@@ -687,18 +2706,28 @@ int load_from_file(const char *path)
             aabb[1][1] = 16;
             aabb[1][2] = 32;
         }
-        bbox_from_aabb(goxel.image->box, aabb);
+        bbox_from_aabb(img->box, aabb);
     }
+    return 0;
 
+error:
+    fclose(in);
+    return -1;
+}
+
+int load_from_file(const char *path)
+{
+    gox_save_wait();
+    if (load_image(goxel.image, path, &g_saved, true) != 0) return -1;
     // Update plane, snap mask not to confuse people.
     plane_from_vectors(goxel.plane, goxel.image->box[3],
                        VEC(1, 0, 0), VEC(0, 1, 0));
-
     return 0;
+}
 
-error:
-    fclose(in);
-    return -1;
+int gox_import(image_t *img, const char *path)
+{
+    return load_image(img, path, NULL, false);
 }
 
 static void a_open(void)
@@ -728,8 +2757,7 @@ static void a_save_as(void)
         goxel.image->path = strdup(path);
         goxel.image->saved_key = image_get_key(goxel.image);
     }
-    save_to_file(goxel.image, goxel.image->path);
-    sys_on_saved(path);
+    save_to_file_async(goxel.image, goxel.image->path);
 }
 
 ACTION_REGISTER(save_as,
@@ -747,8 +2775,7 @@ static void a_save(void)
         goxel.image->path = strdup(path);
         goxel.image->saved_key = image_get_key(goxel.image);
     }
-    save_to_file(goxel.image, goxel.image->path);
-    sys_on_saved(path);
+    save_to_file_async(goxel.image, goxel.image->path);
 }
 
 ACTION_REGISTER(save,
@@ -0,0 +1,195 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * LAS point clouds (ASPRS LASer format, versions 1.0 to 1.4).
+ *
+ * The file starts with a public header giving the point data format, the
+ * size of the point records, the number of points and their bounds, and
+ * the scale and offset applied to the integer positions of the records.
+ * The records start at the point data offset, after the variable length
+ * records that we ignore.  The z axis is up.
+ *
+ * All the uncompressed point data formats (0 to 10) are supported.  The
+ * formats 2, 3, 5, 7, 8 and 10 have an RGB color, normally as 16 bits
+ * values, but since some files use 8 bits values, we assume 8 bits if all
+ * the colors of the first chunk of points are below 256.  The compressed
+ * LAZ files are not supported.
+ *
+ * Since the header has the bounds of the points, the file is only read
+ * once, in chunks, see <pointcloud_import>.
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+#include "pointcloud.h"
+#include "utils/reader.h"
+
+#include <errno.h>
+
+#define HEADER_SIZE 375 // Size of the 1.4 header, the biggest one.
+
+typedef struct {
+    pointcloud_reader_t reader;
+    FILE        *file;
+    int         format;
+    int         record_size;
+    int         color_ofs;      // Offset of the color in a record, or -1.
+    int         color_shift;    // 8 for 16 bits colors, or -1 if unknown.
+    uint32_t    data_ofs;
+    int64_t     nb_read;
+    double      scale[3];
+    double      ofs[3];
+    uint8_t     *buf;
+} las_reader_t;
+
+// Get a reader on a record of the buffer, at a given offset.
+static reader_t las_record(const las_reader_t *r, int i, int ofs)
+{
+    reader_t rec = {r->buf + (size_t)i * r->record_size, r->record_size};
+    reader_seek(&rec, ofs);
+    return rec;
+}
+
+static int las_read(pointcloud_reader_t *reader,
+                    pointcloud_point_t *points, int size)
+{
+    las_reader_t *r = (void*)reader;
+    reader_t rec;
+    int i, k, nb;
+
+    nb = min(size, r->reader.nb_points - r->nb_read);
+    if (nb <= 0) return 0;
+    if (!r->buf) r->buf = malloc((size_t)size * r->record_size);
+    if (fread(r->buf, r->record_size, nb, r->file) != (size_t)nb) {
+        LOG_E("Cannot read las file: truncated point data");
+        return -1;
+    }
+    // Guess the depth of the colors from the first chunk.
+    if (r->color_ofs >= 0 && r->color_shift < 0) {
+        r->color_shift = 0;
+        for (i = 0; i < nb * 3; i++) {
+            rec = las_record(r, i / 3, r->color_ofs + i % 3 * 2);
+            if (reader_u16(&rec) > 255) r->color_shift = 8;
+        }
+    }
+    for (i = 0; i < nb; i++) {
+        rec = las_record(r, i, 0);
+        for (k = 0; k < 3; k++)
+            points[i].pos[k] = reader_i32(&rec) * r->scale[k] + r->ofs[k];
+        memset(points[i].color, 255, 3);
+        if (r->color_ofs < 0) continue;
+        reader_seek(&rec, r->color_ofs);
+        for (k = 0; k < 3; k++)
+            points[i].color[k] = min(reader_u16(&rec) >> r->color_shift, 255);
+    }
+    r->nb_read += nb;
+    return nb;
+}
+
+static int las_rewind(pointcloud_reader_t *reader)
+{
+    las_reader_t *r = (void*)reader;
+    r->nb_read = 0;
+    return fseek(r->file, r->data_ofs, SEEK_SET);
+}
+
+static int las_import(image_t *image, const char *path)
+{
+    // Size of the records and offset of the color of each point format.
+    const int FORMATS[11][2] = {
+        {20, -1}, {28, -1}, {26, 20}, {34, 28}, {57, -1}, {63, 28},
+        {30, -1}, {36, 30}, {38, 30}, {59, -1}, {67, 30},
+    };
+    las_reader_t r = {
+        .reader = {.read = las_read, .rewind = las_rewind},
+        .color_shift = -1,
+    };
+    uint8_t header[HEADER_SIZE] = {};
+    reader_t h = {header, sizeof(header)};
+    int version, header_size, k, ret = -1;
+    double b[2][3];
+
+    r.file = fopen(path, "rb");
+    if (!r.file) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fread(header, 1, sizeof(header), r.file) < 227 ||
+            memcmp(header, "LASF", 4) != 0)
+        goto error;
+
+    reader_seek(&h, 24);
+    version = reader_u8(&h) * 10 + reader_u8(&h);
+    reader_seek(&h, 94);
+    header_size = reader_u16(&h);
+    r.data_ofs = reader_u32(&h);
+    reader_u32(&h); // Number of variable length records.
+    r.format = reader_u8(&h);
+    r.record_size = reader_u16(&h);
+    r.reader.nb_points = reader_u32(&h);
+    if (version >= 14 && header_size >= 255 && !r.reader.nb_points) {
+        reader_seek(&h, 247);
+        r.reader.nb_points = reader_i64(&h);
+    }
+    reader_seek(&h, 131);
+    for (k = 0; k < 3; k++) r.scale[k] = reader_double(&h);
+    for (k = 0; k < 3; k++) r.ofs[k] = reader_double(&h);
+    for (k = 0; k < 3; k++) {
+        b[1][k] = reader_double(&h);
+        b[0][k] = reader_double(&h);
+    }
+
+    // The two high bits of the format are set for the LAZ files.
+    if (r.format & 0xc0) {
+        LOG_E("Cannot import %s: compressed las files are not supported",
+              path);
+        goto end;
+    }
+    if (    r.format >= ARRAY_SIZE(FORMATS) ||
+            r.record_size < FORMATS[r.format][0] ||
+            r.reader.nb_points < 0 ||
+            header_size < 227 || r.data_ofs < header_size)
+        goto error;
+    r.color_ofs = FORMATS[r.format][1];
+
+    // Ignore the bounds if they look wrong, so that we compute them.
+    r.reader.has_bounds = true;
+    for (k = 0; k < 3; k++) {
+        if (!(b[0][k] <= b[1][k]) || !isfinite(b[0][k]) || !isfinite(b[1][k]))
+            r.reader.has_bounds = false;
+    }
+    memcpy(r.reader.bounds, b, sizeof(b));
+
+    if (las_rewind(&r.reader)) goto error;
+    ret = pointcloud_import(image, &r.reader);
+    goto end;
+
+error:
+    LOG_E("Cannot parse las file %s", path);
+end:
+    free(r.buf);
+    fclose(r.file);
+    return ret;
+}
+
+FILE_FORMAT_REGISTER(las,
+    .name = "las",
+    .ext = "las\0*.las\0",
+    .import_func = las_import,
+)
@@ -25,10 +25,14 @@ static int png_export(const image_t *img, const char *path, int w, int h)
     uint8_t *buf;
     int bpp = img->export_transparent_background ? 4 : 3;
     if (!path) return -1;
+    if (!goxel.graphics_initialized) {
+        LOG_E("Png export needs a graphic context, use --render instead");
+        return -1;
+    }
     LOG_I("Exporting to file %s", path);
     buf = calloc(w * h, bpp);
     goxel_render_to_buf(buf, w, h, bpp);
-    img_write(buf, w, h, bpp, path);
+    img_write_png(buf, w, h, bpp, img->export_png_compression, path);
     free(buf);
     return 0;
 }
@@ -59,6 +63,8 @@ static void export_gui(void) {
     gui_checkbox("Transparent background",
                  &goxel.image->export_transparent_background,
                  NULL);
+    gui_input_int("Compression", &goxel.image->export_png_compression,
+                  1, 9);
 }
 
 static int export_as_png(const image_t *img, const char *path)
@@ -18,17 +18,48 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "utils/parallel.h"
+
+typedef struct {
+    bool separate_files; // One png file per z slice.
+} export_options_t;
+
+static export_options_t g_export_options = {};
+
+// A slab of the volume, written as one file per slice.
+typedef struct {
+    const char      *path;
+    const uint8_t   *data;
+    int             w, h;
+    int             z;      // Index of the first slice of the slab.
+} slab_t;
+
+static void get_slice_path(const char *path, int z, char *out, int size)
+{
+    const char *ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) ext = path + strlen(path);
+    snprintf(out, size, "%.*s_%04d%s", (int)(ext - path), path, z, ext);
+}
+
+static void write_slice(void *user, int i)
+{
+    const slab_t *slab = user;
+    char path[1024];
+    get_slice_path(slab->path, slab->z + i, path, sizeof(path));
+    img_write(slab->data + (size_t)i * slab->w * slab->h * 4,
+              slab->w, slab->h, 4, path);
+}
 
 static int export_as_png_slices(const image_t *image, const char *path)
 {
+    const int N = BLOCK_SIZE;
     float box[4][4];
     const mesh_t *mesh;
-    int x, y, z, w, h, d, pos[3], start_pos[3];
-    uint8_t c[4];
-    uint8_t *img;
-    mesh_iterator_t iter = {0};
+    int j, y, z, w, h, d, n, start_pos[3], size[3];
+    uint8_t *img, *data;
+    slab_t slab;
 
-    mesh = goxel_get_layers_mesh(image);
+    mesh = image_get_layers_mesh(image);
     mat4_copy(image->box, box);
     if (box_is_null(box)) mesh_get_box(mesh, true, box);
     w = box[0][0] * 2;
@@ -37,26 +68,55 @@ static int export_as_png_slices(const image_t *image, const char *path)
     start_pos[0] = box[3][0] - box[0][0];
     start_pos[1] = box[3][1] - box[1][1];
     start_pos[2] = box[3][2] - box[2][2];
-    img = calloc(w * h * d, 4);
-    for (z = 0; z < d; z++)
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        pos[0] = x + start_pos[0];
-        pos[1] = y + start_pos[1];
-        pos[2] = z + start_pos[2];
-        mesh_get_at(mesh, &iter, pos, c);
-        img[(y * w * d + z * w + x) * 4 + 0] = c[0];
-        img[(y * w * d + z * w + x) * 4 + 1] = c[1];
-        img[(y * w * d + z * w + x) * 4 + 2] = c[2];
-        img[(y * w * d + z * w + x) * 4 + 3] = c[3];
+
+    // Write one file per slice, one slab of slices at a time, so that we
+    // only need the memory for a few slices.
+    if (g_export_options.separate_files) {
+        data = malloc((size_t)w * h * N * 4);
+        for (z = 0; z < d; z += N) {
+            n = min(N, d - z);
+            mesh_read(mesh, (int[]){start_pos[0], start_pos[1],
+                                    start_pos[2] + z},
+                      (int[]){w, h, n}, data);
+            slab = (slab_t){path, data, w, h, z};
+            parallel_for(n, write_slice, &slab);
+        }
+        free(data);
+        return 0;
+    }
+
+    // Read the volume by rows of blocks, and put the z slices side by side
+    // into the image.
+    img = malloc((size_t)w * h * d * 4);
+    data = malloc((size_t)w * N * d * 4);
+    for (y = 0; y < h; y += N) {
+        n = min(N, h - y);
+        size[0] = w;
+        size[1] = n;
+        size[2] = d;
+        mesh_read(mesh, (int[]){start_pos[0], start_pos[1] + y, start_pos[2]},
+                  size, data);
+        for (z = 0; z < d; z++)
+        for (j = 0; j < n; j++) {
+            memcpy(&img[((size_t)(y + j) * w * d + z * w) * 4],
+                   &data[((size_t)z * w * n + j * w) * 4], w * 4);
+        }
     }
+    free(data);
     img_write(img, w * d, h, 4, path);
     free(img);
     return 0;
 }
 
+static void export_gui(void)
+{
+    gui_checkbox("One file per slice", &g_export_options.separate_files,
+                 "Save each z slice into its own png file");
+}
+
 FILE_FORMAT_REGISTER(png_slices,
     .name = "png slices",
     .ext = "png\0*.png\0",
+    .export_gui = export_gui,
     .export_func = export_as_png_slices,
 )
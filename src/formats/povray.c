@@ -22,18 +22,51 @@
 #include "file_format.h"
 #include "utils/mustache.h"
 
+// Marker put in place of the voxels in the rendered template, so that we
+// can stream the voxels directly to the file.
+#define VOXELS_MARKER "@@GOXEL_VOXELS@@"
+
+/*
+ * Write all the voxels of a mesh, merging the runs of voxels of the same
+ * color along the x axis into single boxes.
+ */
+static void write_voxels(FILE *file, const mesh_t *mesh)
+{
+    const int N = BLOCK_SIZE;
+    mesh_iterator_t iter;
+    int bpos[3], x, y, z, n;
+    uint8_t (*data)[4], *v;
+
+    data = malloc(N * N * N * sizeof(*data));
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_read(mesh, bpos, (int[]){N, N, N}, (uint8_t*)data);
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++)
+        for (x = 0; x < N; x += n) {
+            n = 1;
+            v = data[(z * N + y) * N + x];
+            if (v[3] < 127) continue;
+            while (x + n < N && data[(z * N + y) * N + x + n][3] >= 127 &&
+                   memcmp(data[(z * N + y) * N + x + n], v, 3) == 0) n++;
+            fprintf(file, "    Vox(<%d, %d, %d>, <%d, 1, 1>, <%d, %d, %d>)\n",
+                    bpos[0] + x, bpos[1] + y, bpos[2] + z, n,
+                    v[0], v[1], v[2]);
+        }
+    }
+    free(data);
+}
+
 static int export_as_pov(const image_t *image, const char *path)
 {
     FILE *file;
     layer_t *layer;
-    int size, p[3], w, h;
-    char *buf;
+    int size, w, h;
+    char *buf, *voxels;
     const char *template;
-    uint8_t v[4];
     float modelview[4][4], light_dir[3];
-    mustache_t *m, *m_cam, *m_light, *m_voxels, *m_voxel;
+    mustache_t *m, *m_cam, *m_light;
     camera_t camera = *image->active_camera;
-    mesh_iterator_t iter;
 
     w = image->export_width;
     h = image->export_height;
@@ -65,20 +98,7 @@ static int export_as_pov(const image_t *image, const char *path)
                      goxel.rend.settings.ambient);
     mustache_add_str(m_light, "point_at", "<%.1f, %.1f, %.1f + 1024>",
                      -light_dir[0], -light_dir[1], -light_dir[2]);
-
-    m_voxels = mustache_add_list(m, "voxels");
-    DL_FOREACH(image->layers, layer) {
-        iter = mesh_get_iterator(layer->mesh, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, p)) {
-            mesh_get_at(layer->mesh, &iter, p, v);
-            if (v[3] < 127) continue;
-            m_voxel = mustache_add_dict(m_voxels, NULL);
-            mustache_add_str(m_voxel, "pos", "<%d, %d, %d>",
-                             p[0], p[1], p[2]);
-            mustache_add_str(m_voxel, "color", "<%d, %d, %d>",
-                             v[0], v[1], v[2]);
-        }
-    }
+    mustache_add_str(m, "voxels", VOXELS_MARKER);
 
     size = mustache_render(m, template, NULL);
     buf = calloc(size + 1, 1);
@@ -86,7 +106,20 @@ static int export_as_pov(const image_t *image, const char *path)
     mustache_free(m);
 
     file = fopen(path, "wb");
-    fwrite(buf, 1, size, file);
+    if (!file) {
+        LOG_E("Cannot save to %s", path);
+        free(buf);
+        return -1;
+    }
+    voxels = strstr(buf, VOXELS_MARKER);
+    assert(voxels);
+    fwrite(buf, 1, voxels - buf, file);
+    DL_FOREACH(image->layers, layer) {
+        write_voxels(file, layer->mesh);
+    }
+    voxels += strlen(VOXELS_MARKER);
+    if (*voxels == '\n') voxels++; // Each voxel line already ends with one.
+    fwrite(voxels, 1, size - (voxels - buf), file);
     fclose(file);
     free(buf);
     return 0;
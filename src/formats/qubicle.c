@@ -18,11 +18,12 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "utils/reader.h"
+
+#include <limits.h>
 
 // Load qubicle files.
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
 #define WRITE(type, v, file) \
     ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
 
@@ -36,47 +37,96 @@ static void apply_orientation(int orientation, int pos[3])
     }
 }
 
-static int qubicle_import(image_t *image, const char *path)
+/*
+ * Decode the voxels of a matrix into a dense slab in goxel space, of size
+ * (w, d, h) since the y and z axis are swapped.
+ *
+ * If left handed the y axis is also flipped, so we put the slices from the
+ * end of the slab.
+ */
+static void decode_matrix(reader_t *r, int compression, int orientation,
+                          int w, int h, int d, uint8_t *slab)
 {
-    FILE *file;
-    int version, color_format, orientation, compression, vmask, mat_count;
-    int i, j, r, index, len, w, h, d, pos[3], vpos[3], x, y, z, bbox[2][3];
-    union {
-        uint8_t v[4];
-        uint32_t uint32;
-        struct {
-            uint8_t r, g, b, a;
-        };
-    } v;
     const uint32_t CODEFLAG = 2;
     const uint32_t NEXTSLICEFLAG = 6;
+    int x, y, z, index, j, len;
+    uint32_t v;
+    uint8_t *dst;
+
+    #define DST(x, y, z) (slab + (((y) * d + \
+                (orientation == 1 ? (z) : d - 1 - (z))) * w + (x)) * 4)
+
+    if (compression == 0) {
+        for (z = 0; z < d; z++)
+        for (y = 0; y < h; y++) {
+            dst = DST(0, y, z);
+            reader_read(r, dst, w * 4);
+            for (x = 0; x < w; x++) {
+                if (dst[x * 4 + 3]) dst[x * 4 + 3] = 255;
+                else memset(dst + x * 4, 0, 4);
+            }
+        }
+        return;
+    }
+
+    for (z = 0; z < d; z++) {
+        index = 0;
+        while (reader_remaining(r) > 0) {
+            v = reader_u32(r);
+            if (v == NEXTSLICEFLAG) {
+                break; // Next z.
+            }
+            len = 1;
+            if (v == CODEFLAG) {
+                len = reader_u32(r);
+                v = reader_u32(r);
+            }
+            v = (v >> 24) ? v | 0xffu << 24 : 0;
+            len = min(len, w * h - index);
+            for (j = 0; j < len; j++, index++) {
+                memcpy(DST(index % w, index / w, z), &v, 4);
+            }
+        }
+    }
+    #undef DST
+}
+
+static int qubicle_import(image_t *image, const char *path)
+{
+    int version, color_format, orientation, compression, vmask, mat_count;
+    int i, len, size, w, h, d, pos[3], bbox[2][3], origin[3];
+    uint8_t *data, *slab;
+    reader_t r;
     layer_t *layer;
-    mesh_iterator_t iter = {0};
 
-    file = fopen(path, "rb");
-    version = READ(uint32_t, file);
+    data = (uint8_t*)read_file(path, &size);
+    if (!data) {
+        LOG_E("Cannot read file %s", path);
+        return -1;
+    }
+    r = (reader_t){data, size};
+
+    version = reader_u32(&r);
     (void)version;
-    color_format = READ(uint32_t, file);
+    color_format = reader_u32(&r);
     (void)color_format;
-    orientation = READ(uint32_t, file);
-    compression = READ(uint32_t, file);
-    vmask = READ(uint32_t, file);
+    orientation = reader_u32(&r);
+    compression = reader_u32(&r);
+    vmask = reader_u32(&r);
     (void)vmask;
-    mat_count = READ(uint32_t, file);
+    mat_count = reader_u32(&r);
 
-    for (i = 0; i < mat_count; i++) {
-        layer = image_add_layer(goxel.image, NULL);
-        iter = mesh_get_accessor(layer->mesh);
+    for (i = 0; i < mat_count && reader_remaining(&r) > 0; i++) {
+        layer = image_add_layer(image, NULL);
         memset(layer->name, 0, sizeof(layer->name));
-        len = READ(uint8_t, file);
-        r = (int)fread(layer->name, len, 1, file);
-        (void)r;
-        w = READ(uint32_t, file);
-        h = READ(uint32_t, file);
-        d = READ(uint32_t, file);
-        pos[0] = READ(int32_t, file);
-        pos[1] = READ(int32_t, file);
-        pos[2] = READ(int32_t, file);
+        len = reader_u8(&r);
+        reader_read(&r, layer->name, len); // Names are at most 255 chars.
+        w = reader_u32(&r);
+        h = reader_u32(&r);
+        d = reader_u32(&r);
+        pos[0] = reader_i32(&r);
+        pos[1] = reader_i32(&r);
+        pos[2] = reader_i32(&r);
 
         // Set the layer bounding box.
         vec3_set(bbox[0], pos[0], pos[1], pos[2]);
@@ -90,62 +140,37 @@ static int qubicle_import(image_t *image, const char *path)
         }
         bbox_from_aabb(layer->box, bbox);
 
-        if (compression == 0) {
-            for (index = 0; index < w * h * d; index++) {
-                v.uint32 = READ(uint32_t, file);
-                if (!v.a) continue;
-                v.a = v.a ? 255 : 0;
-                vpos[0] = pos[0] + index % w;
-                vpos[1] = pos[1] + (index % (w * h)) / w;
-                vpos[2] = pos[2] + index / (w * h);
-                apply_orientation(orientation, vpos);
-                mesh_set_at(layer->mesh, &iter, vpos, v.v);
-            }
-        } else {
-            for (z = 0; z < d; z++) {
-                index = 0;
-                while (true) {
-                    v.uint32 = READ(uint32_t, file);
-                    if (v.uint32 == NEXTSLICEFLAG) {
-                        break; // Next z.
-                    }
-                    len = 1;
-                    if (v.uint32 == CODEFLAG) {
-                        len = READ(uint32_t, file);
-                        v.uint32 = READ(uint32_t, file);
-                        v.a = v.a ? 255 : 0;
-                    }
-                    for (j = 0; j < len; j++) {
-                        x = index % w;
-                        y = index / w;
-                        v.a = v.a ? 255 : 0;
-                        vpos[0] = pos[0] + x;
-                        vpos[1] = pos[1] + y;
-                        vpos[2] = pos[2] + z;
-                        apply_orientation(orientation, vpos);
-                        mesh_set_at(layer->mesh, &iter, vpos, v.v);
-                        index++;
-                    }
-                }
-            }
+        if (w < 0 || h < 0 || d < 0 || (int64_t)w * h * d > INT_MAX / 4) {
+            LOG_E("Invalid qubicle matrix size");
+            break;
         }
+        slab = calloc((size_t)w * h * d, 4);
+        decode_matrix(&r, compression, orientation, w, h, d, slab);
+        vec3_set(origin, pos[0], pos[2], pos[1]);
+        if (orientation != 1) origin[1] = -(pos[2] + d - 1);
+        mesh_write(layer->mesh, origin, (int[]){w, d, h}, slab);
+        free(slab);
     }
+    free(data);
     return 0;
 }
 
 static int qubicle_export(const image_t *img, const char *path)
 {
     FILE *file;
-    int i, count, x, y, z, pos[3], bbox[2][3];
-    uint8_t v[4];
+    int i, count, y, z, w, h, d, bbox[2][3];
+    uint8_t *slab, *out;
     layer_t *layer;
-    mesh_iterator_t iter;
     mesh_t *mesh;
 
     count = 0;
     DL_COUNT(img->layers, layer, count);
 
     file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s", path);
+        return -1;
+    }
     WRITE(uint32_t, 257, file); // version
     WRITE(uint32_t, 0, file);   // color format RGBA
     WRITE(uint32_t, 1, file);   // orientation right handed
@@ -162,24 +187,31 @@ static int qubicle_export(const image_t *img, const char *path)
         else
             if (!mesh_get_bbox(mesh, bbox, true)) continue;
 
+        w = bbox[1][0] - bbox[0][0];
+        h = bbox[1][1] - bbox[0][1];
+        d = bbox[1][2] - bbox[0][2];
         WRITE(uint8_t, strlen(layer->name), file);
         fwrite(layer->name, strlen(layer->name), 1, file);
-        WRITE(uint32_t, bbox[1][0] - bbox[0][0], file);
-        WRITE(uint32_t, bbox[1][2] - bbox[0][2], file);
-        WRITE(uint32_t, bbox[1][1] - bbox[0][1], file);
+        WRITE(uint32_t, w, file);
+        WRITE(uint32_t, d, file);
+        WRITE(uint32_t, h, file);
         WRITE(int32_t, bbox[0][0], file);
         WRITE(int32_t, bbox[0][2], file);
         WRITE(int32_t, bbox[0][1], file);
-        iter = mesh_get_accessor(mesh);
-        for (y = bbox[0][1]; y < bbox[1][1]; y++)
-        for (z = bbox[0][2]; z < bbox[1][2]; z++)
-        for (x = bbox[0][0]; x < bbox[1][0]; x++) {
-            pos[0] = x;
-            pos[1] = y;
-            pos[2] = z;
-            mesh_get_at(mesh, &iter, pos, v);
-            fwrite(v, 4, 1, file);
+
+        // Read the whole layer box at once, then reorder the rows from
+        // goxel (x, y, z) order to the file (x, z, y) order.
+        slab = malloc((size_t)w * h * d * 4);
+        out = malloc((size_t)w * h * d * 4);
+        mesh_read(mesh, bbox[0], (int[]){w, h, d}, slab);
+        for (y = 0; y < h; y++)
+        for (z = 0; z < d; z++) {
+            memcpy(out + ((y * d + z) * w) * 4,
+                   slab + ((z * h + y) * w) * 4, w * 4);
         }
+        fwrite(out, 4, (size_t)w * h * d, file);
+        free(slab);
+        free(out);
         i++;
     }
     fclose(file);
@@ -0,0 +1,348 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Export of animated camera sequences, either as numbered png files, or as
+ * raw frames written to the standard input of an encoder command.
+ *
+ * The frames are rendered with <offscreen_render_sequence>, so that the
+ * rendering of a frame overlaps the read back of the previous one, and each
+ * frame is then encoded in a background task while the next ones render.
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+#include "offscreen.h"
+#include "utils/parallel.h"
+
+#include <signal.h>
+
+// Maximum number of frames being encoded at the same time.  The frames
+// written to a command are always encoded one at a time, in order.
+#define MAX_PENDING 4
+
+enum {
+    SEQUENCE_ORBIT,     // Full turn around the active camera target.
+    SEQUENCE_CAMERAS,   // Path through the image cameras, in order.
+};
+
+typedef struct {
+    int     path;
+    int     nb_frames;
+    char    command[256];
+} export_options_t;
+
+static export_options_t g_export_options = {
+    .path = SEQUENCE_ORBIT,
+    .nb_frames = 36,
+    .command = "ffmpeg -y -f rawvideo -pix_fmt {fmt} -s {w}x{h} -r 24 -i - "
+               "-pix_fmt yuv420p {path}",
+};
+
+typedef struct sequence sequence_t;
+
+typedef struct {
+    sequence_t  *seq;
+    int         index;
+    uint8_t     *img;
+    int         error;
+} frame_t;
+
+struct sequence {
+    int         w, h, bpp, nb;
+    char        *base;      // Path without the extension, for the pngs.
+    FILE        *pipe;      // Encoder standard input.
+    frame_t     frames[MAX_PENDING];
+    task_t      *tasks[MAX_PENDING];
+    int         max_pending;
+    int         error;
+};
+
+// Interpolate two cameras, turning around their targets.
+static void mix_cameras(const camera_t *a, const camera_t *b, float t,
+                        camera_t *out)
+{
+    float ca[3], cb[3], center[3], x[3], y[3], z[3];
+
+    mat4_mul_vec3(a->mat, VEC(0, 0, -a->dist), ca);
+    mat4_mul_vec3(b->mat, VEC(0, 0, -b->dist), cb);
+    vec3_mix(ca, cb, t, center);
+    vec3_mix(a->mat[2], b->mat[2], t, z);
+    vec3_mix(a->mat[1], b->mat[1], t, y);
+    if (vec3_norm2(z) == 0) vec3_copy(a->mat[2], z);
+    vec3_normalize(z, z);
+    vec3_cross(y, z, x);
+    if (vec3_norm2(x) == 0) vec3_copy(a->mat[0], x);
+    vec3_normalize(x, x);
+    vec3_cross(z, x, y);
+
+    *out = *a;
+    out->dist = mix(a->dist, b->dist, t);
+    mat4_set_identity(out->mat);
+    vec3_copy(x, out->mat[0]);
+    vec3_copy(y, out->mat[1]);
+    vec3_copy(z, out->mat[2]);
+    vec3_addk(center, z, out->dist, out->mat[3]);
+}
+
+// Compute the cameras of all the frames.
+static void get_cameras(const image_t *img, int path, int nb, float aspect,
+                        camera_t *cameras)
+{
+    int i, k, nb_cams = 0;
+    float t;
+    const camera_t *cam, *path_cams[64];
+    const camera_t *base = img->active_camera ?: img->cameras;
+
+    if (path == SEQUENCE_CAMERAS) {
+        DL_FOREACH(img->cameras, cam) {
+            if (nb_cams < ARRAY_SIZE(path_cams)) path_cams[nb_cams++] = cam;
+        }
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (nb_cams >= 2) {
+            t = (nb > 1) ? (float)i / (nb - 1) * (nb_cams - 1) : 0;
+            k = min((int)t, nb_cams - 2);
+            mix_cameras(path_cams[k], path_cams[k + 1], t - k, &cameras[i]);
+        } else {
+            cameras[i] = nb_cams ? *path_cams[0] : *base;
+            if (path == SEQUENCE_ORBIT)
+                camera_turntable(&cameras[i], 2 * M_PI * i / nb, 0);
+        }
+        cameras[i].next = cameras[i].prev = NULL;
+        cameras[i].aspect = aspect;
+        camera_update(&cameras[i]);
+    }
+}
+
+static void encode_frame(void *user)
+{
+    frame_t *frame = user;
+    sequence_t *seq = frame->seq;
+    size_t size = (size_t)seq->w * seq->h * seq->bpp;
+    char *path;
+
+    if (seq->pipe) {
+        if (fwrite(frame->img, 1, size, seq->pipe) != size) {
+            LOG_E("Cannot write frame %d to the encoder", frame->index);
+            frame->error = -1;
+        }
+    } else {
+        asprintf(&path, "%s-%04d.png", seq->base, frame->index);
+        img_write(frame->img, seq->w, seq->h, seq->bpp, path);
+        free(path);
+    }
+    free(frame->img);
+    frame->img = NULL;
+}
+
+// Wait for the encoding of a frame slot, and release it.
+static void wait_frame(sequence_t *seq, int slot)
+{
+    if (!seq->tasks[slot]) return;
+    task_wait(seq->tasks[slot]);
+    task_delete(seq->tasks[slot]);
+    seq->tasks[slot] = NULL;
+    if (seq->frames[slot].error) seq->error = seq->frames[slot].error;
+}
+
+static int on_frame(void *user, int i, uint8_t *img)
+{
+    sequence_t *seq = user;
+    int slot = i % seq->max_pending;
+    frame_t *frame = &seq->frames[slot];
+
+    wait_frame(seq, slot);
+    if (seq->error) {
+        free(img);
+        return seq->error;
+    }
+    *frame = (frame_t){seq, i, img};
+    seq->tasks[slot] = task_start(encode_frame, frame);
+    return file_format_report_progress((i + 1.0) / seq->nb) ? 0 : -1;
+}
+
+// Replace the {w}, {h}, {fmt} and {path} variables of the encoder command.
+static char *expand_command(const char *cmd, int w, int h, int bpp,
+                            const char *path)
+{
+    char *ret = calloc(1, 1), *tmp, value[1024];
+    const char *end;
+
+    while (*cmd) {
+        value[0] = '\0';
+        end = cmd + 1;
+        if (str_startswith(cmd, "{w}")) {
+            snprintf(value, sizeof(value), "%d", w);
+            end = cmd + 3;
+        } else if (str_startswith(cmd, "{h}")) {
+            snprintf(value, sizeof(value), "%d", h);
+            end = cmd + 3;
+        } else if (str_startswith(cmd, "{fmt}")) {
+            snprintf(value, sizeof(value), "%s", bpp == 4 ? "rgba" : "rgb24");
+            end = cmd + 5;
+        } else if (str_startswith(cmd, "{path}")) {
+            snprintf(value, sizeof(value), "\"%s\"", path);
+            end = cmd + 6;
+        } else {
+            snprintf(value, sizeof(value), "%c", *cmd);
+        }
+        asprintf(&tmp, "%s%s", ret, value);
+        free(ret);
+        ret = tmp;
+        cmd = end;
+    }
+    return ret;
+}
+
+static int sequence_export(const image_t *img, const char *path, bool video)
+{
+    sequence_t seq = {};
+    camera_t *cameras;
+    char *cmd;
+    int i, ret;
+#ifdef SIGPIPE
+    void (*sigpipe_handler)(int) = SIG_DFL;
+#endif
+
+    if (!path) return -1;
+    if (!goxel.graphics_initialized) {
+        LOG_E("Sequence export needs a graphic context");
+        return -1;
+    }
+    if (!img->cameras) {
+        LOG_E("Sequence export needs a camera");
+        return -1;
+    }
+    seq.w = img->export_width;
+    seq.h = img->export_height;
+    seq.bpp = img->export_transparent_background ? 4 : 3;
+    seq.nb = max(g_export_options.nb_frames, 1);
+    seq.max_pending = video ? 1 : MAX_PENDING;
+
+    if (video) {
+        cmd = expand_command(g_export_options.command, seq.w, seq.h,
+                             seq.bpp, path);
+        LOG_I("Exporting to command %s", cmd);
+#ifdef SIGPIPE
+        // So that we get an error instead of a crash if the command exits.
+        sigpipe_handler = signal(SIGPIPE, SIG_IGN);
+#endif
+        seq.pipe = popen(cmd, "w");
+        free(cmd);
+        if (!seq.pipe) {
+            LOG_E("Cannot run the encoder command");
+            ret = -1;
+            goto end;
+        }
+    } else {
+        seq.base = strdup(path);
+        if (str_endswith(seq.base, ".png"))
+            seq.base[strlen(seq.base) - 4] = '\0';
+        LOG_I("Exporting to files %s-XXXX.png", seq.base);
+    }
+
+    cameras = calloc(seq.nb, sizeof(*cameras));
+    get_cameras(img, g_export_options.path, seq.nb, (float)seq.w / seq.h,
+                cameras);
+    ret = offscreen_render_sequence(seq.nb, cameras, seq.w, seq.h, seq.bpp,
+                                    on_frame, &seq);
+    for (i = 0; i < seq.max_pending; i++) wait_frame(&seq, i);
+    ret = ret ?: seq.error;
+    if (seq.pipe && pclose(seq.pipe) != 0 && !ret) {
+        LOG_E("Encoder command failed");
+        ret = -1;
+    }
+    free(cameras);
+    free(seq.base);
+end:
+#ifdef SIGPIPE
+    if (video) signal(SIGPIPE, sigpipe_handler);
+#endif
+    return ret;
+}
+
+static void export_gui(bool video)
+{
+    int maxsize, i;
+    const char *paths[] = {"Orbit", "Cameras"};
+
+    GL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize));
+    maxsize /= 2; // Because the frames are rendered at twice the size.
+    goxel.show_export_viewport = true;
+    gui_group_begin(NULL);
+    gui_checkbox("Custom size", &goxel.image->export_custom_size, NULL);
+    if (!goxel.image->export_custom_size) {
+        goxel.image->export_width = goxel.gui.viewport[2];
+        goxel.image->export_height = goxel.gui.viewport[3];
+    }
+    gui_enabled_begin(goxel.image->export_custom_size);
+    i = goxel.image->export_width;
+    if (gui_input_int("w", &i, 1, maxsize))
+        goxel.image->export_width = clamp(i, 1, maxsize);
+    i = goxel.image->export_height;
+    if (gui_input_int("h", &i, 1, maxsize))
+        goxel.image->export_height = clamp(i, 1, maxsize);
+    gui_enabled_end();
+    gui_group_end();
+
+    gui_combo("Path", &g_export_options.path, paths, ARRAY_SIZE(paths));
+    gui_input_int("Frames", &g_export_options.nb_frames, 1, 10000);
+    if (video) {
+        gui_input_text("Command", g_export_options.command,
+                       sizeof(g_export_options.command));
+    } else {
+        gui_checkbox("Transparent background",
+                     &goxel.image->export_transparent_background, NULL);
+    }
+}
+
+static void export_gui_pngs(void)
+{
+    export_gui(false);
+}
+
+static void export_gui_video(void)
+{
+    export_gui(true);
+}
+
+static int export_as_pngs(const image_t *img, const char *path)
+{
+    return sequence_export(img, path, false);
+}
+
+static int export_as_video(const image_t *img, const char *path)
+{
+    return sequence_export(img, path, true);
+}
+
+FILE_FORMAT_REGISTER(png_sequence,
+    .name = "png sequence",
+    .ext = "png\0*.png\0",
+    .export_gui = export_gui_pngs,
+    .export_func = export_as_pngs,
+)
+
+FILE_FORMAT_REGISTER(video,
+    .name = "video",
+    .ext = "mp4\0*.mp4\0",
+    .export_gui = export_gui_video,
+    .export_func = export_as_video,
+)
@@ -20,13 +20,27 @@
 #include "file_format.h"
 #include <errno.h>
 
+static void export_block(void *user, const int pos[3], uint64_t id,
+                         const uint8_t (*voxels)[4])
+{
+    const int N = BLOCK_SIZE;
+    FILE *out = user;
+    const uint8_t *v;
+    int i;
+
+    for (i = 0; i < N * N * N; i++) {
+        v = voxels[i];
+        if (v[3] < 127) continue;
+        fprintf(out, "%d %d %d %02x%02x%02x\n",
+                pos[0] + i % N, pos[1] + i / N % N, pos[2] + i / (N * N),
+                v[0], v[1], v[2]);
+    }
+}
+
 static int export_as_txt(const image_t *image, const char *path)
 {
     FILE *out;
-    const mesh_t *mesh = goxel_get_layers_mesh(image);
-    int p[3];
-    uint8_t v[4];
-    mesh_iterator_t iter;
+    const mesh_t *mesh = image_get_layers_mesh(image);
 
     out = fopen(path, "w");
     if (!out) {
@@ -37,13 +51,7 @@ static int export_as_txt(const image_t *image, const char *path)
     fprintf(out, "# One line per voxel\n");
     fprintf(out, "# X Y Z RRGGBB\n");
 
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, p)) {
-        mesh_get_at(mesh, &iter, p, v);
-        if (v[3] < 127) continue;
-        fprintf(out, "%d %d %d %02x%02x%02x\n",
-                p[0], p[1], p[2], v[0], v[1], v[2]);
-    }
+    mesh_foreach_block(mesh, 0, export_block, out);
     fclose(out);
     return 0;
 }
@@ -0,0 +1,863 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * OpenVDB sparse volumes.
+ *
+ * Each visible layer is saved as two grids of the standard 5-4-3 tree
+ * configuration: a float grid named after the layer with the voxels
+ * alpha, and a vec3s grid named '<layer>.Cd' with the colors, both in
+ * [0, 1].  The voxels are in the grids index space.
+ *
+ * A goxel block covers exactly BLOCK_SIZE / 8 vdb leaf nodes along each
+ * axis, so the leaves are built directly from the blocks, and only the non
+ * empty ones are saved.
+ * The values are saved with the active mask compression, that is only the
+ * values of the active voxels.
+ *
+ * The import supports the float and vec3s grids of the same configuration,
+ * in full or half precision, without compression or zip compressed.  Blosc
+ * is not supported: the files using it can only be read if all their
+ * values were stored uncompressed, which openvdb does when blosc doesn't
+ * reduce the size.
+ *
+ * Format reference: the openvdb io code (file version 222 and later).
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+#include "utils/parallel.h"
+#include "utils/reader.h"
+
+#define VDB_MAGIC 0x56444220
+#define VDB_FILE_VERSION 224
+#define VDB_MIN_FILE_VERSION 222 // Per grid compression and mask metadata.
+
+// Compression flags.
+enum {
+    COMPRESS_ZIP            = 0x1,
+    COMPRESS_ACTIVE_MASK    = 0x2,
+    COMPRESS_BLOSC          = 0x4,
+};
+
+// Metadata byte before the compressed values of a node.
+enum {
+    NO_MASK_OR_INACTIVE_VALS,
+    NO_MASK_AND_MINUS_BG,
+    NO_MASK_AND_ONE_INACTIVE_VAL,
+    MASK_AND_NO_INACTIVE_VALS,
+    MASK_AND_ONE_INACTIVE_VAL,
+    MASK_AND_TWO_INACTIVE_VALS,
+    NO_MASK_AND_ALL_VALS,
+};
+
+// Log2 size of the tree nodes: upper internal, lower internal, leaf.
+#define UPPER_LOG2 5
+#define LOWER_LOG2 4
+#define LEAF_LOG2 3
+#define LEAF_DIM (1 << LEAF_LOG2)
+#define LOWER_SPAN (1 << (LOWER_LOG2 + LEAF_LOG2))
+#define UPPER_SPAN (1 << (UPPER_LOG2 + LOWER_LOG2 + LEAF_LOG2))
+
+#define LEAF_SIZE (1 << (3 * LEAF_LOG2))
+
+// Number of leaves covered by a block, along each axis and in total.
+#define BLOCK_LEAVES_DIM (BLOCK_SIZE / LEAF_DIM)
+#define BLOCK_LEAVES (BLOCK_LEAVES_DIM * BLOCK_LEAVES_DIM * BLOCK_LEAVES_DIM)
+
+// A leaf node of 8^3 voxels.  The voxels are indexed by
+// x << 6 | y << 3 | z, as in openvdb.
+typedef struct {
+    int         pos[3];
+    uint64_t    mask[LEAF_SIZE / 64];   // Active voxels.
+    uint8_t     (*values)[4];           // RGBA of the active voxels.
+} leaf_t;
+
+static int leaf_index(int x, int y, int z)
+{
+    return x << (2 * LEAF_LOG2) | y << LEAF_LOG2 | z;
+}
+
+static bool mask_get(const uint64_t *mask, int i)
+{
+    return mask[i / 64] & (1ULL << (i % 64));
+}
+
+static void mask_set(uint64_t *mask, int i)
+{
+    mask[i / 64] |= 1ULL << (i % 64);
+}
+
+static int mask_count(const uint64_t *mask, int size)
+{
+    int i, ret = 0;
+    for (i = 0; i < size / 64; i++) ret += __builtin_popcountll(mask[i]);
+    return ret;
+}
+
+/************************************************************************/
+/* Export                                                               */
+
+// Index of a child in the upper and lower internal nodes.
+static int upper_index(const int pos[3])
+{
+    return ((pos[0] & (UPPER_SPAN - 1)) / LOWER_SPAN) << (2 * UPPER_LOG2) |
+           ((pos[1] & (UPPER_SPAN - 1)) / LOWER_SPAN) << UPPER_LOG2 |
+           ((pos[2] & (UPPER_SPAN - 1)) / LOWER_SPAN);
+}
+
+static int lower_index(const int pos[3])
+{
+    return ((pos[0] & (LOWER_SPAN - 1)) / LEAF_DIM) << (2 * LOWER_LOG2) |
+           ((pos[1] & (LOWER_SPAN - 1)) / LEAF_DIM) << LOWER_LOG2 |
+           ((pos[2] & (LOWER_SPAN - 1)) / LEAF_DIM);
+}
+
+// Order of the leaves in the file: by root key, then by upper and lower
+// internal nodes indices.
+static int leaf_cmp(const void *a_, const void *b_)
+{
+    const leaf_t *a = a_, *b = b_;
+    int i, ka, kb;
+    for (i = 0; i < 3; i++) {
+        ka = a->pos[i] & ~(UPPER_SPAN - 1);
+        kb = b->pos[i] & ~(UPPER_SPAN - 1);
+        if (ka != kb) return ka < kb ? -1 : 1;
+    }
+    ka = upper_index(a->pos);
+    kb = upper_index(b->pos);
+    if (ka != kb) return ka < kb ? -1 : 1;
+    ka = lower_index(a->pos);
+    kb = lower_index(b->pos);
+    return (ka > kb) - (ka < kb);
+}
+
+static bool same_root(const leaf_t *a, const leaf_t *b)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if ((a->pos[i] ^ b->pos[i]) & ~(UPPER_SPAN - 1)) return false;
+    }
+    return true;
+}
+
+static bool same_upper(const leaf_t *a, const leaf_t *b)
+{
+    return same_root(a, b) && upper_index(a->pos) == upper_index(b->pos);
+}
+
+// Split the blocks of a mesh into leaves, in parallel.
+typedef struct {
+    const mesh_t    *mesh;
+    const int       (*blocks)[3];
+    leaf_t          *leaves;    // BLOCK_LEAVES per block, empty ones have
+                                // no values.
+} leaves_job_t;
+
+static void block_to_leaves(void *user, int i)
+{
+    const int N = BLOCK_SIZE;
+    const leaves_job_t *job = user;
+    uint8_t (*voxels)[4];
+    const uint8_t *v;
+    int j, x, y, z, k, nb;
+    leaf_t *leaf;
+
+    // Too big for the stack with the 32^3 blocks.
+    voxels = malloc(N * N * N * sizeof(*voxels));
+    mesh_read(job->mesh, job->blocks[i], (int[]){N, N, N},
+              (uint8_t*)voxels);
+    for (j = 0; j < BLOCK_LEAVES; j++) {
+        leaf = &job->leaves[i * BLOCK_LEAVES + j];
+        leaf->pos[0] = job->blocks[i][0] +
+                       j % BLOCK_LEAVES_DIM * LEAF_DIM;
+        leaf->pos[1] = job->blocks[i][1] +
+                       j / BLOCK_LEAVES_DIM % BLOCK_LEAVES_DIM * LEAF_DIM;
+        leaf->pos[2] = job->blocks[i][2] +
+                       j / (BLOCK_LEAVES_DIM * BLOCK_LEAVES_DIM) * LEAF_DIM;
+        for (x = 0; x < LEAF_DIM; x++)
+        for (y = 0; y < LEAF_DIM; y++)
+        for (z = 0; z < LEAF_DIM; z++) {
+            v = voxels[((leaf->pos[2] - job->blocks[i][2] + z) * N +
+                        (leaf->pos[1] - job->blocks[i][1] + y)) * N +
+                        (leaf->pos[0] - job->blocks[i][0] + x)];
+            if (v[3]) mask_set(leaf->mask, leaf_index(x, y, z));
+        }
+        nb = mask_count(leaf->mask, LEAF_SIZE);
+        if (!nb) continue;
+        leaf->values = malloc(nb * sizeof(*leaf->values));
+        for (k = 0, nb = 0; k < LEAF_SIZE; k++) {
+            if (!mask_get(leaf->mask, k)) continue;
+            x = k >> (2 * LEAF_LOG2);
+            y = (k >> LEAF_LOG2) & (LEAF_DIM - 1);
+            z = k & (LEAF_DIM - 1);
+            v = voxels[((leaf->pos[2] - job->blocks[i][2] + z) * N +
+                        (leaf->pos[1] - job->blocks[i][1] + y)) * N +
+                        (leaf->pos[0] - job->blocks[i][0] + x)];
+            memcpy(leaf->values[nb++], v, 4);
+        }
+    }
+    free(voxels);
+}
+
+// Return the sorted non empty leaves of a mesh.
+static leaf_t *get_leaves(const mesh_t *mesh, int *nb)
+{
+    mesh_iterator_t iter;
+    int (*blocks)[3] = NULL, pos[3], i, n = 0, allocated = 0;
+    leaves_job_t job = {.mesh = mesh};
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS | MESH_ITER_SKIP_EMPTY);
+    while (mesh_iter(&iter, pos)) {
+        if (n == allocated) {
+            allocated = max(64, allocated * 2);
+            blocks = realloc(blocks, allocated * sizeof(*blocks));
+        }
+        memcpy(blocks[n++], pos, sizeof(pos));
+    }
+    job.blocks = (const int (*)[3])blocks;
+    job.leaves = calloc(max(n, 1) * BLOCK_LEAVES, sizeof(*job.leaves));
+    parallel_for(n, block_to_leaves, &job);
+    free(blocks);
+
+    for (i = 0, *nb = 0; i < n * BLOCK_LEAVES; i++) {
+        if (job.leaves[i].values) job.leaves[(*nb)++] = job.leaves[i];
+    }
+    qsort(job.leaves, *nb, sizeof(*job.leaves), leaf_cmp);
+    return job.leaves;
+}
+
+static void write_u32(FILE *file, uint32_t v)
+{
+    fwrite(&v, 4, 1, file);
+}
+
+static void write_string(FILE *file, const char *str)
+{
+    write_u32(file, strlen(str));
+    fwrite(str, strlen(str), 1, file);
+}
+
+// Write the values of a node without any active value: only the metadata
+// telling that the inactive values are all the background.
+static void write_no_values(FILE *file)
+{
+    fputc(NO_MASK_OR_INACTIVE_VALS, file);
+}
+
+// Write an internal node with no tile: child mask, empty value mask, and
+// no values.
+static void write_internal_node(FILE *file, const uint64_t *child_mask,
+                                int size)
+{
+    uint64_t *value_mask = calloc(size / 64, sizeof(uint64_t));
+    fwrite(child_mask, size / 8, 1, file);
+    fwrite(value_mask, size / 8, 1, file);
+    write_no_values(file);
+    free(value_mask);
+}
+
+static void write_topology(FILE *file, const leaf_t *leaves, int nb,
+                           int value_size)
+{
+    const float background[3] = {0};
+    const int upper_size = 1 << (3 * UPPER_LOG2);
+    const int lower_size = 1 << (3 * LOWER_LOG2);
+    uint64_t *upper_mask, *lower_mask;
+    int i, j, k, root_end, upper_end, nb_children = 0;
+    int origin[3];
+
+    upper_mask = malloc(upper_size / 8);
+    lower_mask = malloc(lower_size / 8);
+
+    write_u32(file, 1); // Buffer count.
+    fwrite(background, value_size, 1, file);
+    for (i = 0; i < nb; i++) {
+        if (i == 0 || !same_root(&leaves[i - 1], &leaves[i])) nb_children++;
+    }
+    write_u32(file, 0); // Number of tiles.
+    write_u32(file, nb_children);
+
+    for (i = 0; i < nb; i = root_end) {
+        for (root_end = i; root_end < nb; root_end++) {
+            if (!same_root(&leaves[i], &leaves[root_end])) break;
+        }
+        for (k = 0; k < 3; k++)
+            origin[k] = leaves[i].pos[k] & ~(UPPER_SPAN - 1);
+        fwrite(origin, sizeof(origin), 1, file);
+        memset(upper_mask, 0, upper_size / 8);
+        for (j = i; j < root_end; j++)
+            mask_set(upper_mask, upper_index(leaves[j].pos));
+        write_internal_node(file, upper_mask, upper_size);
+
+        for (j = i; j < root_end; j = upper_end) {
+            memset(lower_mask, 0, lower_size / 8);
+            for (upper_end = j; upper_end < root_end; upper_end++) {
+                if (!same_upper(&leaves[j], &leaves[upper_end])) break;
+                mask_set(lower_mask, lower_index(leaves[upper_end].pos));
+            }
+            write_internal_node(file, lower_mask, lower_size);
+            for (k = j; k < upper_end; k++)
+                fwrite(leaves[k].mask, sizeof(leaves[k].mask), 1, file);
+        }
+    }
+    free(upper_mask);
+    free(lower_mask);
+}
+
+// Write the leaves values: the active values of each leaf, as the alpha
+// (one channel) or the colors (three channels).
+static void write_buffers(FILE *file, const leaf_t *leaves, int nb,
+                          int channels)
+{
+    int i, j, c, n;
+    float *values;
+
+    values = malloc(LEAF_SIZE * channels * sizeof(*values));
+    for (i = 0; i < nb; i++) {
+        fwrite(leaves[i].mask, sizeof(leaves[i].mask), 1, file);
+        // All the inactive values are the background, so we only save the
+        // active ones.
+        fputc(NO_MASK_OR_INACTIVE_VALS, file);
+        n = mask_count(leaves[i].mask, LEAF_SIZE);
+        for (j = 0; j < n; j++) {
+            if (channels == 1) {
+                values[j] = leaves[i].values[j][3] / 255.f;
+                continue;
+            }
+            for (c = 0; c < 3; c++)
+                values[j * 3 + c] = leaves[i].values[j][c] / 255.f;
+        }
+        fwrite(values, sizeof(*values) * channels, n, file);
+    }
+    free(values);
+}
+
+static void write_grid(FILE *file, const char *name, const leaf_t *leaves,
+                       int nb, int channels)
+{
+    long pos_offset, end;
+    int64_t pos[3];
+
+    // Grid descriptor.
+    write_string(file, name);
+    write_string(file, channels == 1 ? "Tree_float_5_4_3" :
+                                       "Tree_vec3s_5_4_3");
+    write_string(file, ""); // Instance parent.
+    // Grid, block and end positions, set once the grid is written.
+    pos_offset = ftell(file);
+    fwrite((int64_t[3]){0}, sizeof(int64_t), 3, file);
+    pos[0] = ftell(file);
+
+    write_u32(file, COMPRESS_ACTIVE_MASK);
+    // Metadata.
+    if (channels == 1) {
+        write_u32(file, 1);
+        write_string(file, "class");
+        write_string(file, "string");
+        write_string(file, "fog volume");
+    } else {
+        write_u32(file, 0);
+    }
+    // Transform: unit scale, the voxels are in index space.
+    write_string(file, "UniformScaleMap");
+    fwrite((double[]){1, 1, 1, 1, 1, 1}, sizeof(double), 6, file);
+
+    write_topology(file, leaves, nb, channels * sizeof(float));
+    pos[1] = ftell(file);
+    write_buffers(file, leaves, nb, channels);
+    pos[2] = ftell(file);
+
+    end = ftell(file);
+    fseek(file, pos_offset, SEEK_SET);
+    fwrite(pos, sizeof(pos), 1, file);
+    fseek(file, end, SEEK_SET);
+}
+
+static void write_header(FILE *file, int nb_grids)
+{
+    const int64_t magic = VDB_MAGIC;
+    char uuid[37];
+    uint8_t r[16];
+    int i;
+
+    fwrite(&magic, sizeof(magic), 1, file);
+    write_u32(file, VDB_FILE_VERSION);
+    write_u32(file, 10); // Library major version.
+    write_u32(file, 0);  // Library minor version.
+    fputc(1, file);      // Has grid offsets.
+    // Random (version 4) uuid, as 36 chars.
+    for (i = 0; i < 16; i++) r[i] = rand();
+    r[6] = (r[6] & 0x0f) | 0x40;
+    r[8] = (r[8] & 0x3f) | 0x80;
+    snprintf(uuid, sizeof(uuid),
+             "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+             "%02x%02x%02x%02x%02x%02x",
+             r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9],
+             r[10], r[11], r[12], r[13], r[14], r[15]);
+    fwrite(uuid, 36, 1, file);
+    write_u32(file, 0); // File metadata.
+    write_u32(file, nb_grids);
+}
+
+static int vdb_export(const image_t *image, const char *path)
+{
+    FILE *file;
+    const layer_t *layer;
+    leaf_t *leaves;
+    int i, nb, nb_grids = 0;
+    char name[300];
+
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s", path);
+        return -1;
+    }
+    image_update((image_t*)image);
+    DL_FOREACH(image->layers, layer) {
+        if (layer->visible && layer->mesh) nb_grids += 2;
+    }
+    write_header(file, nb_grids);
+
+    DL_FOREACH(image->layers, layer) {
+        if (!layer->visible || !layer->mesh) continue;
+        leaves = get_leaves(layer->mesh, &nb);
+        write_grid(file, layer->name, leaves, nb, 1);
+        snprintf(name, sizeof(name), "%s.Cd", layer->name);
+        write_grid(file, name, leaves, nb, 3);
+        for (i = 0; i < nb; i++) free(leaves[i].values);
+        free(leaves);
+    }
+    fclose(file);
+    return 0;
+}
+
+/************************************************************************/
+/* Import                                                               */
+
+// Cursor into the file data, with the options of the current grid.
+typedef struct {
+    reader_t        in;
+    uint32_t        compression;
+    int             channels;
+    bool            half;
+} vdb_reader_t;
+
+// Read a string into a buffer, truncating it if needed.
+static void read_string(reader_t *in, char *out, int size)
+{
+    uint32_t len = reader_u32(in);
+    const uint8_t *p = reader_bytes(in, len);
+    len = p ? min(len, size - 1) : 0;
+    if (p) memcpy(out, p, len);
+    out[len] = '\0';
+}
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (h >> 15) & 1, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    float v;
+    if (exp == 0) v = ldexpf(mant, -24);
+    else if (exp == 31) v = mant ? NAN : INFINITY;
+    else v = ldexpf(mant | 0x400, exp - 25);
+    return sign ? -v : v;
+}
+
+// Read n values into a float array, handling the compression and half
+// floats.
+static void read_data(vdb_reader_t *r, float *out, int n)
+{
+    const int size = n * r->channels * (r->half ? 2 : 4);
+    const uint8_t *p;
+    uint8_t *buf = NULL;
+    int64_t nb_bytes;
+    int i, buf_size;
+
+    if (n == 0) return;
+    p = NULL;
+    if (r->compression & (COMPRESS_ZIP | COMPRESS_BLOSC)) {
+        nb_bytes = reader_i64(&r->in);
+        if (nb_bytes <= 0) {
+            if (-nb_bytes == size) p = reader_bytes(&r->in, size);
+        } else if (r->compression & COMPRESS_BLOSC) {
+            LOG_E("Blosc compressed vdb files are not supported");
+        } else {
+            p = reader_bytes(&r->in, nb_bytes);
+            buf = p ? img_zlib_uncompress(p, nb_bytes, size, &buf_size)
+                    : NULL;
+            p = (buf && buf_size == size) ? buf : NULL;
+        }
+    } else {
+        p = reader_bytes(&r->in, size);
+    }
+    if (!p) {
+        r->in.error = true;
+        memset(out, 0, n * r->channels * sizeof(*out));
+        free(buf);
+        return;
+    }
+    for (i = 0; i < n * r->channels; i++) {
+        if (r->half) out[i] = half_to_float(p[i * 2] | p[i * 2 + 1] << 8);
+        else memcpy(&out[i], p + i * 4, 4);
+    }
+    free(buf);
+}
+
+// Read the compressed values of a node, and put the active ones in 'out',
+// in order.  Return the number of active values.
+static int read_values(vdb_reader_t *r, const uint64_t *value_mask, int size,
+                       float *out)
+{
+    const int c = r->channels;
+    int metadata, i, nb_active, n, j;
+    float *tmp;
+
+    metadata = *(reader_bytes(&r->in, 1) ?: (const uint8_t[]){0});
+    // The inactive values, kept in full precision.
+    if (    metadata == NO_MASK_AND_ONE_INACTIVE_VAL ||
+            metadata == MASK_AND_ONE_INACTIVE_VAL ||
+            metadata == MASK_AND_TWO_INACTIVE_VALS) {
+        reader_bytes(&r->in, c * 4);
+        if (metadata == MASK_AND_TWO_INACTIVE_VALS) reader_bytes(&r->in, c * 4);
+    }
+    // Selection mask between the inactive values.
+    if (    metadata == MASK_AND_NO_INACTIVE_VALS ||
+            metadata == MASK_AND_ONE_INACTIVE_VAL ||
+            metadata == MASK_AND_TWO_INACTIVE_VALS) {
+        reader_bytes(&r->in, size / 8);
+    }
+
+    nb_active = mask_count(value_mask, size);
+    if (    (r->compression & COMPRESS_ACTIVE_MASK) &&
+            metadata != NO_MASK_AND_ALL_VALS) {
+        read_data(r, out, nb_active);
+        return nb_active;
+    }
+    // All the values are saved, keep only the active ones.
+    n = size;
+    tmp = malloc(n * c * sizeof(*tmp));
+    read_data(r, tmp, n);
+    for (i = 0, j = 0; i < n; i++) {
+        if (mask_get(value_mask, i))
+            memcpy(&out[j++ * c], &tmp[i * c], c * sizeof(*tmp));
+    }
+    free(tmp);
+    return nb_active;
+}
+
+// An active tile of an internal node, filled with a constant value.
+typedef struct {
+    int     pos[3];
+    int     size;
+    float   value[3];
+} tile_t;
+
+typedef struct {
+    leaf_t  *leaves;
+    int     nb_leaves;
+    tile_t  *tiles;
+    int     nb_tiles;
+} tree_t;
+
+static void add_leaf(tree_t *tree, const int pos[3])
+{
+    leaf_t *leaf;
+    tree->leaves = realloc(tree->leaves,
+                           (tree->nb_leaves + 1) * sizeof(*tree->leaves));
+    leaf = &tree->leaves[tree->nb_leaves++];
+    memset(leaf, 0, sizeof(*leaf));
+    memcpy(leaf->pos, pos, sizeof(leaf->pos));
+}
+
+static void add_tiles(vdb_reader_t *r, tree_t *tree, const int origin[3],
+                      int log2, int child_span, const uint64_t *child_mask,
+                      const uint64_t *value_mask, const float *values)
+{
+    const int size = 1 << (3 * log2);
+    int i, j = 0;
+    tile_t *tile;
+
+    for (i = 0; i < size; i++) {
+        if (!mask_get(value_mask, i)) continue;
+        j++;
+        if (mask_get(child_mask, i)) continue;
+        tree->tiles = realloc(tree->tiles,
+                              (tree->nb_tiles + 1) * sizeof(*tree->tiles));
+        tile = &tree->tiles[tree->nb_tiles++];
+        tile->pos[0] = origin[0] + (i >> (2 * log2)) * child_span;
+        tile->pos[1] = origin[1] + ((i >> log2) & ((1 << log2) - 1)) *
+                                   child_span;
+        tile->pos[2] = origin[2] + (i & ((1 << log2) - 1)) * child_span;
+        tile->size = child_span;
+        memcpy(tile->value, &values[(j - 1) * r->channels],
+               r->channels * sizeof(float));
+    }
+}
+
+// Read an internal node topology, and its children recursively.  The
+// children size is 1 << child_log2.
+static void read_internal_node(vdb_reader_t *r, tree_t *tree,
+                               const int origin[3], int log2, int child_log2)
+{
+    const int size = 1 << (3 * log2);
+    const int child_span = 1 << child_log2;
+    uint64_t *child_mask, *value_mask;
+    float *values;
+    int i, pos[3];
+
+    child_mask = calloc(size / 64, sizeof(uint64_t));
+    value_mask = calloc(size / 64, sizeof(uint64_t));
+    values = malloc(size * r->channels * sizeof(*values));
+    reader_read(&r->in, child_mask, size / 8);
+    reader_read(&r->in, value_mask, size / 8);
+    read_values(r, value_mask, size, values);
+    add_tiles(r, tree, origin, log2, child_span, child_mask, value_mask,
+              values);
+    free(values);
+    free(value_mask);
+
+    for (i = 0; i < size && !r->in.error; i++) {
+        if (!mask_get(child_mask, i)) continue;
+        pos[0] = origin[0] + (i >> (2 * log2)) * child_span;
+        pos[1] = origin[1] + ((i >> log2) & ((1 << log2) - 1)) * child_span;
+        pos[2] = origin[2] + (i & ((1 << log2) - 1)) * child_span;
+        if (child_log2 == LEAF_LOG2) {
+            add_leaf(tree, pos);
+            reader_read(&r->in, tree->leaves[tree->nb_leaves - 1].mask,
+                    LEAF_SIZE / 8);
+        } else {
+            read_internal_node(r, tree, pos, LOWER_LOG2, LEAF_LOG2);
+        }
+    }
+    free(child_mask);
+}
+
+static void read_tree(vdb_reader_t *r, tree_t *tree)
+{
+    uint32_t i, nb_tiles, nb_children;
+    int origin[3];
+
+    reader_u32(&r->in); // Buffer count.
+    reader_bytes(&r->in, r->channels * 4); // Background.
+    nb_tiles = reader_u32(&r->in);
+    nb_children = reader_u32(&r->in);
+    for (i = 0; i < nb_tiles && !r->in.error; i++) {
+        reader_bytes(&r->in, 12 + r->channels * 4 + 1);
+        LOG_W("Ignore vdb root tile");
+    }
+    for (i = 0; i < nb_children && !r->in.error; i++) {
+        reader_read(&r->in, origin, sizeof(origin));
+        read_internal_node(r, tree, origin, UPPER_LOG2,
+                           LOWER_LOG2 + LEAF_LOG2);
+    }
+}
+
+// Set the voxels of a 8^3 cube of a layer from the grid values.  The
+// density gives the alpha, the colors the rgb values.
+static void apply_values(const vdb_reader_t *r, mesh_t *mesh, const int pos[3],
+                         const uint64_t *mask, const float *values)
+{
+    uint8_t voxels[LEAF_SIZE][4];
+    uint8_t *v;
+    int i, j = 0, c, x, y, z;
+
+    mesh_read(mesh, pos, (int[]){LEAF_DIM, LEAF_DIM, LEAF_DIM},
+              (uint8_t*)voxels);
+    for (i = 0; i < LEAF_SIZE; i++) {
+        if (mask && !mask_get(mask, i)) continue;
+        x = i >> (2 * LEAF_LOG2);
+        y = (i >> LEAF_LOG2) & (LEAF_DIM - 1);
+        z = i & (LEAF_DIM - 1);
+        v = voxels[(z * LEAF_DIM + y) * LEAF_DIM + x];
+        if (r->channels == 1) {
+            v[3] = clamp(values[j] * 255 + 0.5f, 0, 255);
+            if (v[3] && !v[0] && !v[1] && !v[2]) memset(v, 255, 3);
+        } else {
+            for (c = 0; c < 3; c++)
+                v[c] = clamp(values[j * 3 + c] * 255 + 0.5f, 0, 255);
+            if (!v[3]) v[3] = 255;
+        }
+        if (mask) j++;
+    }
+    mesh_write(mesh, pos, (int[]){LEAF_DIM, LEAF_DIM, LEAF_DIM},
+               (uint8_t*)voxels);
+}
+
+static void apply_tile(const vdb_reader_t *r, mesh_t *mesh, const tile_t *tile)
+{
+    int x, y, z;
+    for (z = 0; z < tile->size; z += LEAF_DIM)
+    for (y = 0; y < tile->size; y += LEAF_DIM)
+    for (x = 0; x < tile->size; x += LEAF_DIM) {
+        apply_values(r, mesh, (int[]){tile->pos[0] + x, tile->pos[1] + y,
+                                      tile->pos[2] + z}, NULL, tile->value);
+    }
+}
+
+// Get the layer for a grid: the color grid 'name.Cd' goes into the layer
+// of the 'name' grid.  The first grid uses the current layer.
+static layer_t *get_grid_layer(image_t *image, const char *name,
+                               layer_t **first)
+{
+    char base[256];
+    layer_t *layer;
+    int len = strlen(name);
+
+    if (len > 3 && strcmp(name + len - 3, ".Cd") == 0) len -= 3;
+    snprintf(base, sizeof(base), "%.*s", len, name);
+    if (*first) {
+        DL_FOREACH(image->layers, layer) {
+            if (strcmp(layer->name, base) == 0) return layer;
+        }
+    }
+    layer = *first ? image_add_layer(image, NULL) : image->active_layer;
+    *first = layer;
+    snprintf(layer->name, sizeof(layer->name), "%s", base);
+    return layer;
+}
+
+static int read_grid(vdb_reader_t *r, image_t *image, const char *name,
+                     layer_t **first)
+{
+    char map_type[64], buf[256];
+    uint32_t i, nb_meta;
+    tree_t tree = {};
+    float *values;
+    layer_t *layer;
+    int n;
+
+    r->compression = reader_u32(&r->in);
+    nb_meta = reader_u32(&r->in);
+    for (i = 0; i < nb_meta && !r->in.error; i++) {
+        read_string(&r->in, buf, sizeof(buf)); // Name.
+        read_string(&r->in, buf, sizeof(buf)); // Type.
+        reader_bytes(&r->in, reader_u32(&r->in));
+    }
+    // The transform is ignored, we always import in index space.
+    read_string(&r->in, map_type, sizeof(map_type));
+    if (    strcmp(map_type, "UniformScaleMap") == 0 ||
+            strcmp(map_type, "ScaleMap") == 0) {
+        reader_bytes(&r->in, 6 * 8);
+    } else if (strcmp(map_type, "UniformScaleTranslateMap") == 0 ||
+               strcmp(map_type, "ScaleTranslateMap") == 0) {
+        reader_bytes(&r->in, 9 * 8);
+    } else if (strcmp(map_type, "TranslationMap") == 0) {
+        reader_bytes(&r->in, 3 * 8);
+    } else if (strcmp(map_type, "AffineMap") == 0 ||
+               strcmp(map_type, "UnitaryMap") == 0) {
+        reader_bytes(&r->in, 16 * 8);
+    } else {
+        LOG_E("Unsupported vdb transform: %s", map_type);
+        return -1;
+    }
+
+    read_tree(r, &tree);
+    layer = get_grid_layer(image, name, first);
+    values = malloc(LEAF_SIZE * r->channels * sizeof(*values));
+    for (i = 0; i < tree.nb_leaves && !r->in.error; i++) {
+        reader_read(&r->in, tree.leaves[i].mask, LEAF_SIZE / 8);
+        n = read_values(r, tree.leaves[i].mask, LEAF_SIZE, values);
+        if (n) apply_values(r, layer->mesh, tree.leaves[i].pos,
+                            tree.leaves[i].mask, values);
+    }
+    for (i = 0; i < tree.nb_tiles && !r->in.error; i++)
+        apply_tile(r, layer->mesh, &tree.tiles[i]);
+    free(values);
+    free(tree.leaves);
+    free(tree.tiles);
+    return r->in.error ? -1 : 0;
+}
+
+static int vdb_import(image_t *image, const char *path)
+{
+    vdb_reader_t r;
+    uint8_t *data;
+    int size, ret = 0;
+    uint32_t version, i, nb_meta, nb_grids;
+    bool has_offsets;
+    char name[256], type[256], parent[256], *sep;
+    int64_t pos[3];
+    layer_t *first = NULL;
+
+    data = (uint8_t*)read_file(path, &size);
+    if (!data) {
+        LOG_E("Cannot read file %s", path);
+        return -1;
+    }
+    r = (vdb_reader_t){.in = {data, size}};
+    if (reader_i64(&r.in) != VDB_MAGIC) {
+        LOG_E("Not a vdb file: %s", path);
+        goto error;
+    }
+    version = reader_u32(&r.in);
+    if (version < VDB_MIN_FILE_VERSION) {
+        LOG_E("Unsupported vdb file version: %d", version);
+        goto error;
+    }
+    reader_u32(&r.in); // Library version.
+    reader_u32(&r.in);
+    has_offsets = *(reader_bytes(&r.in, 1) ?: (const uint8_t[]){0});
+    reader_bytes(&r.in, 36); // uuid.
+    nb_meta = reader_u32(&r.in);
+    for (i = 0; i < nb_meta && !r.in.error; i++) {
+        read_string(&r.in, name, sizeof(name));
+        read_string(&r.in, type, sizeof(type));
+        reader_bytes(&r.in, reader_u32(&r.in));
+    }
+    nb_grids = reader_u32(&r.in);
+
+    for (i = 0; i < nb_grids && !r.in.error; i++) {
+        read_string(&r.in, name, sizeof(name));
+        // Names made unique get a suffix after a record separator.
+        if ((sep = strchr(name, '\x1e'))) *sep = '\0';
+        read_string(&r.in, type, sizeof(type));
+        read_string(&r.in, parent, sizeof(parent));
+        pos[0] = reader_i64(&r.in);
+        pos[1] = reader_i64(&r.in);
+        pos[2] = reader_i64(&r.in);
+
+        r.half = str_endswith(type, "_HalfFloat");
+        if (r.half) type[strlen(type) - strlen("_HalfFloat")] = '\0';
+        r.channels = strcmp(type, "Tree_float_5_4_3") == 0 ? 1 :
+                     strcmp(type, "Tree_vec3s_5_4_3") == 0 ? 3 : 0;
+        if (!r.channels) {
+            LOG_W("Skip vdb grid %s of type %s", name, type);
+            if (!has_offsets) break;
+            reader_seek(&r.in, pos[2]);
+            continue;
+        }
+        if (has_offsets) reader_seek(&r.in, pos[0]);
+        ret = read_grid(&r, image, name, &first);
+        if (ret) break;
+        if (has_offsets) reader_seek(&r.in, pos[2]);
+    }
+    if (r.in.error) LOG_E("Cannot parse vdb file %s", path);
+    free(data);
+    return (r.in.error || ret) ? -1 : 0;
+
+error:
+    free(data);
+    return -1;
+}
+
+FILE_FORMAT_REGISTER(vdb,
+    .name = "openvdb",
+    .ext = "vdb\0*.vdb\0",
+    .import_func = vdb_import,
+    .export_func = vdb_export,
+)
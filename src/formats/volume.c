@@ -0,0 +1,342 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Import of dense volumes: raw scans (uint8 or uint16 values, as in the
+ * CT / MRI datasets) and heightmap images.
+ *
+ * The volumes are converted one layer of 16^3 blocks at a time, with the
+ * blocks of a layer computed in parallel, and directly written into the
+ * active layer mesh, so that we never need the memory for the whole RGBA
+ * volume.  The blocks that have no voxel above the threshold are skipped
+ * before filling them, and the written blocks get compressed after each
+ * layer, so the memory used stays proportional to the occupied volume.
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+#include "utils/parallel.h"
+
+#include <errno.h>
+
+#ifndef WIN32
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+typedef struct {
+    float threshold;    // Normalized value under which voxels are empty.
+    int   height;       // Height of the heightmaps white level, in voxels.
+} import_options_t;
+
+static import_options_t g_import_options = {
+    .threshold = 0.1,
+    .height = 64,
+};
+
+// A dense source volume, converted one block at a time.
+typedef struct volume volume_t;
+struct volume {
+    int     size[3];
+    // Fill the RGBA values of a block, and return false if it is empty.
+    // The block position is in voxels, and the block can go past the
+    // volume size.
+    bool    (*get_block)(const volume_t *vol, const int pos[3],
+                         uint8_t *voxels);
+    // Raw volumes.
+    const uint8_t *data;
+    int     bytes;      // Bytes per value.
+    int     max;        // Maximum value, used to normalize the values.
+    // Heightmaps.
+    const uint8_t *img;
+    int     bpp;
+};
+
+// Blocks of a layer, converted in parallel.
+typedef struct {
+    const volume_t  *vol;
+    int             z;
+    int             nb[2];      // Number of blocks along x and y.
+    uint8_t         *voxels;    // RGBA values of each block.
+    bool            *filled;    // Set for the non empty blocks.
+} layer_job_t;
+
+static void convert_block(void *user, int i)
+{
+    const int N = BLOCK_SIZE;
+    const layer_job_t *job = user;
+    int pos[3] = {(i % job->nb[0]) * N, (i / job->nb[0]) * N, job->z};
+    uint8_t *voxels = job->voxels + (size_t)i * N * N * N * 4;
+    job->filled[i] = job->vol->get_block(job->vol, pos, voxels);
+}
+
+static int import_volume(image_t *image, const volume_t *vol)
+{
+    const int N = BLOCK_SIZE;
+    mesh_t *mesh = image->active_layer->mesh;
+    layer_job_t job = {.vol = vol};
+    int i, aabb[2][3] = {{0, 0, 0}, {vol->size[0], vol->size[1],
+                                      vol->size[2]}};
+    const uint8_t *voxels;
+
+    job.nb[0] = (vol->size[0] + N - 1) / N;
+    job.nb[1] = (vol->size[1] + N - 1) / N;
+    job.voxels = malloc((size_t)job.nb[0] * job.nb[1] * N * N * N * 4);
+    job.filled = calloc(job.nb[0] * job.nb[1], sizeof(*job.filled));
+    for (job.z = 0; job.z < vol->size[2]; job.z += N) {
+        parallel_for(job.nb[0] * job.nb[1], convert_block, &job);
+        for (i = 0; i < job.nb[0] * job.nb[1]; i++) {
+            if (!job.filled[i]) continue;
+            voxels = job.voxels + (size_t)i * N * N * N * 4;
+            mesh_write(mesh, (int[]){(i % job.nb[0]) * N,
+                                     (i / job.nb[0]) * N, job.z},
+                       (int[]){N, N, N}, voxels);
+        }
+        // Only compress the blocks written since the last call.
+        mesh_remove_empty_blocks(mesh, false);
+        if (!file_format_report_progress((float)job.z / vol->size[2]))
+            break;
+    }
+    free(job.voxels);
+    free(job.filled);
+    bbox_from_aabb(image->active_layer->box, aabb);
+    return 0;
+}
+
+static int raw_get_value(const volume_t *vol, size_t i)
+{
+    if (vol->bytes == 1) return vol->data[i];
+    return vol->data[i * 2] | vol->data[i * 2 + 1] << 8;
+}
+
+static bool raw_get_block(const volume_t *vol, const int pos[3],
+                          uint8_t *voxels)
+{
+    const int N = BLOCK_SIZE;
+    int x, y, z, v, threshold, size[3];
+    size_t row;
+    bool filled = false;
+
+    threshold = max(1, ceilf(g_import_options.threshold * vol->max));
+    size[0] = min(N, vol->size[0] - pos[0]);
+    size[1] = min(N, vol->size[1] - pos[1]);
+    size[2] = min(N, vol->size[2] - pos[2]);
+
+    // Check first if the block is empty, without touching the output.
+    for (z = 0; z < size[2] && !filled; z++)
+    for (y = 0; y < size[1] && !filled; y++) {
+        row = ((size_t)(pos[2] + z) * vol->size[1] + pos[1] + y) *
+              vol->size[0] + pos[0];
+        for (x = 0; x < size[0]; x++) {
+            if (raw_get_value(vol, row + x) >= threshold) {
+                filled = true;
+                break;
+            }
+        }
+    }
+    if (!filled) return false;
+
+    memset(voxels, 0, N * N * N * 4);
+    for (z = 0; z < size[2]; z++)
+    for (y = 0; y < size[1]; y++) {
+        row = ((size_t)(pos[2] + z) * vol->size[1] + pos[1] + y) *
+              vol->size[0] + pos[0];
+        for (x = 0; x < size[0]; x++) {
+            v = raw_get_value(vol, row + x);
+            if (v < threshold) continue;
+            // Gray scale transfer function from the threshold up.
+            v = 32 + (int64_t)(v - threshold) * 223 /
+                     max(1, vol->max - threshold);
+            memcpy(&voxels[((z * N + y) * N + x) * 4],
+                   (uint8_t[]){v, v, v, 255}, 4);
+        }
+    }
+    return true;
+}
+
+// Parse the volume size and type from the file name, following the usual
+// convention of the scans datasets, eg: 'bonsai_256x256x256_uint8.raw'.
+static int parse_raw_name(const char *path, int size[3], int *bytes)
+{
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    const char *s;
+    int n;
+
+    for (s = name; *s; s++) {
+        if (*s != '_') continue;
+        if (sscanf(s, "_%dx%dx%d%n", &size[0], &size[1], &size[2], &n) != 3)
+            continue;
+        *bytes = strncmp(s + n, "_uint16", 7) == 0 ? 2 : 1;
+        return 0;
+    }
+    return -1;
+}
+
+static int raw_import(image_t *image, const char *path)
+{
+    volume_t vol = {.get_block = raw_get_block};
+    size_t i, nb;
+    int64_t file_size;
+    uint8_t *data;
+    int ret;
+#ifndef WIN32
+    int fd;
+    struct stat st;
+#else
+    int size;
+#endif
+
+    if (parse_raw_name(path, vol.size, &vol.bytes)) {
+        LOG_E("Cannot get the volume size from the file name: %s", path);
+        LOG_E("Expected a name like 'name_WxHxD_uint8.raw'");
+        return -1;
+    }
+    if (    vol.size[0] <= 0 || vol.size[1] <= 0 || vol.size[2] <= 0 ||
+            vol.size[0] > (1 << 16) || vol.size[1] > (1 << 16) ||
+            vol.size[2] > (1 << 16)) {
+        LOG_E("Invalid volume size");
+        return -1;
+    }
+    nb = (size_t)vol.size[0] * vol.size[1] * vol.size[2];
+
+#ifndef WIN32
+    // Map the file, so that only the pages we read are loaded, and the
+    // system can drop them again under memory pressure.
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    file_size = st.st_size;
+    data = file_size ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_E("Cannot map %s", path);
+        return -1;
+    }
+#else
+    data = (uint8_t*)read_file(path, &size);
+    if (!data) {
+        LOG_E("Cannot read file %s", path);
+        return -1;
+    }
+    file_size = size;
+#endif
+
+    ret = -1;
+    if (file_size < (int64_t)(nb * vol.bytes)) {
+        LOG_E("File too small for a %dx%dx%d volume",
+              vol.size[0], vol.size[1], vol.size[2]);
+        goto end;
+    }
+    vol.data = data;
+    vol.max = 255;
+    if (vol.bytes == 2) {
+        // Most 16 bits scans only use 12 bits, so normalize the values by
+        // the actual maximum.
+        vol.max = 1;
+        for (i = 0; i < nb; i++)
+            vol.max = max(vol.max, raw_get_value(&vol, i));
+    }
+    ret = import_volume(image, &vol);
+
+end:
+#ifndef WIN32
+    munmap(data, file_size);
+#else
+    free(data);
+#endif
+    return ret;
+}
+
+// Fill a block of a heightmap: each pixel gives a column of voxels, with
+// a height proportional to the pixel brightness, and the pixel color.
+static bool heightmap_get_block(const volume_t *vol, const int pos[3],
+                                uint8_t *voxels)
+{
+    const int N = BLOCK_SIZE;
+    int x, y, z, h, v, heights[N][N];
+    const uint8_t *px;
+    bool filled = false;
+
+    memset(heights, 0, sizeof(heights));
+    for (y = 0; y < min(N, vol->size[1] - pos[1]); y++)
+    for (x = 0; x < min(N, vol->size[0] - pos[0]); x++) {
+        // The image rows go down, our y axis goes up.
+        px = vol->img + ((size_t)(vol->size[1] - 1 - pos[1] - y) *
+                         vol->size[0] + pos[0] + x) * vol->bpp;
+        if (vol->bpp == 2 && px[1] == 0) continue;
+        if (vol->bpp == 4 && px[3] == 0) continue;
+        v = vol->bpp >= 3 ? (px[0] + px[1] + px[2]) / 3 : px[0];
+        h = (v * g_import_options.height + 254) / 255;
+        if (h < g_import_options.threshold * g_import_options.height)
+            continue;
+        heights[y][x] = min(h - pos[2], N);
+        filled = filled || heights[y][x] > 0;
+    }
+    if (!filled) return false;
+
+    memset(voxels, 0, N * N * N * 4);
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        if (heights[y][x] <= 0) continue;
+        px = vol->img + ((size_t)(vol->size[1] - 1 - pos[1] - y) *
+                         vol->size[0] + pos[0] + x) * vol->bpp;
+        for (z = 0; z < heights[y][x]; z++) {
+            memcpy(&voxels[((z * N + y) * N + x) * 4],
+                   vol->bpp >= 3 ? (uint8_t[]){px[0], px[1], px[2], 255} :
+                                   (uint8_t[]){px[0], px[0], px[0], 255},
+                   4);
+        }
+    }
+    return true;
+}
+
+static int heightmap_import(image_t *image, const char *path)
+{
+    volume_t vol = {.get_block = heightmap_get_block};
+    int ret;
+    uint8_t *img;
+
+    img = img_read(path, &vol.size[0], &vol.size[1], &vol.bpp);
+    if (!img) {
+        LOG_E("Cannot read image %s", path);
+        return -1;
+    }
+    vol.img = img;
+    vol.size[2] = max(1, g_import_options.height);
+    ret = import_volume(image, &vol);
+    free(img);
+    return ret;
+}
+
+FILE_FORMAT_REGISTER(raw_volume,
+    .name = "raw volume",
+    .ext = "raw\0*.raw\0",
+    .import_func = raw_import,
+)
+
+FILE_FORMAT_REGISTER(heightmap,
+    .name = "heightmap",
+    .ext = "png\0*.png\0",
+    .import_func = heightmap_import,
+)
@@ -20,6 +20,7 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "utils/reader.h"
 #include <limits.h>
 
 static const uint32_t VOX_DEFAULT_PALETTE[256];
@@ -32,8 +33,6 @@ static inline void hexcolor(uint32_t v, uint8_t out[4])
     out[3] = (v >>  0) & 0xff;
 }
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
 #define WRITE(type, v, file) \
     ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
 
@@ -42,29 +41,29 @@ static inline void hexcolor(uint32_t v, uint8_t out[4])
 // Import the old magica voxel file format:
 //
 // d, h, w, <data>, <palette>
-static int vox_import_old(const char *path)
+static int vox_import_old(image_t *image, reader_t *r)
 {
-    FILE *file;
     int w, h, d, i;
-    uint8_t *voxels;
+    const uint8_t *voxels;
     uint8_t (*palette)[4];
     uint8_t (*cube)[4];
 
-    file = fopen(path, "rb");
-    d = READ(uint32_t, file);
-    h = READ(uint32_t, file);
-    w = READ(uint32_t, file);
+    d = reader_i32(r);
+    h = reader_i32(r);
+    w = reader_i32(r);
+    if (    w <= 0 || h <= 0 || d <= 0 ||
+            (int64_t)w * h * d > reader_remaining(r)) {
+        LOG_E("Invalid vox file size");
+        return -1;
+    }
 
-    voxels = calloc(w * h * d, 1);
+    voxels = reader_bytes(r, w * h * d);
     palette = calloc(256, sizeof(*palette));
     cube = calloc(w * h * d, sizeof(*cube));
-    for (i = 0; i < w * h * d; i++) {
-        voxels[i] = READ(uint8_t, file);
-    }
     for (i = 0; i < 256; i++) {
-        palette[i][0] = READ(uint8_t, file);
-        palette[i][1] = READ(uint8_t, file);
-        palette[i][2] = READ(uint8_t, file);
+        palette[i][0] = reader_u8(r);
+        palette[i][1] = reader_u8(r);
+        palette[i][2] = reader_u8(r);
         palette[i][3] = 255;
     }
     memset(palette[255], 0, 4);
@@ -74,12 +73,10 @@ static int vox_import_old(const char *path)
         memcpy(cube[i], palette[voxels[i]], 4);
     }
 
-    mesh_blit(goxel.image->active_layer->mesh, (uint8_t*)cube,
+    mesh_blit(image->active_layer->mesh, (uint8_t*)cube,
               -w / 2, -h / 2, -d / 2, w, h, d, NULL);
     free(palette);
-    free(voxels);
     free(cube);
-    fclose(file);
     return 0;
 }
 
@@ -104,7 +101,7 @@ struct node {
         } rgba;
         struct {
             int nb;
-            uint8_t *values;
+            const uint8_t *values; // Points into the file data.
         } xyzi;
         struct {
             int id;
@@ -124,29 +121,29 @@ struct node {
     };
 };
 
-static int read_string(FILE *file, char **out)
+static int read_string(reader_t *r, char **out)
 {
-    int size, r;
-    size = READ(int32_t, file);
+    int size;
+    const uint8_t *p;
+    size = reader_i32(r);
+    p = reader_bytes(r, size);
+    if (!p) size = 0;
     *out = calloc(size + 1, 1);
-    r = fread(*out, 1, size, file);
-    if (r != size) {
-        return -1;
-    }
-    return size;
+    if (p) memcpy(*out, p, size);
+    return p ? size : -1;
 }
 
-static void read_dict(FILE *file, void *user,
+static void read_dict(reader_t *r, void *user,
                       void (*callback)(void *user, const char *key, int size,
                                        const char *value))
 {
     int nb, i, size;
     char *key, *value;
-    nb = READ(int32_t, file);
-    for (i = 0; i < nb; i++) {
-        read_string(file, &key);
-        size = read_string(file, &value);
-        if (callback) callback(user, key, size, value);
+    nb = reader_i32(r);
+    for (i = 0; i < nb && r->pos < r->size; i++) {
+        read_string(r, &key);
+        size = read_string(r, &value);
+        if (callback && size >= 0) callback(user, key, size, value);
         free(key);
         free(value);
     }
@@ -187,8 +184,6 @@ static void free_node(node_t *node)
 
     if (node_is(node, "RGBA"))
         free(node->rgba.values);
-    if (node_is(node, "XYZI"))
-        free(node->xyzi.values);
 
     DL_FOREACH_SAFE(node->children, child, tmp) {
         DL_DELETE(node->children, child);
@@ -199,93 +194,88 @@ static void free_node(node_t *node)
     free(node);
 }
 
-static node_t *read_node(FILE *file)
+static node_t *read_node(reader_t *r)
 {
-    int i, r, size, children_size;
+    int i, size, children_size, start, end;
+    const uint8_t *p;
     node_t *node, *child, *child2;
-    long fpos;
 
     node = calloc(1, sizeof(*node));
     node->node_id = -1;
-    r = fread(node->id, 1, 4, file);
-    if (r != 4) goto error;
-
-    size = READ(uint32_t, file);
-    children_size = READ(uint32_t, file);
-
-    fpos = ftell(file);
+    p = reader_bytes(r, 4);
+    if (!p) goto error;
+    memcpy(node->id, p, 4);
+
+    size = reader_i32(r);
+    children_size = reader_i32(r);
+    start = r->pos;
+    if (size < 0 || children_size < 0 ||
+            size > r->size - start ||
+            children_size > r->size - start - size) {
+        LOG_W("Invalid vox chunk size");
+        goto error;
+    }
+    end = start + size;
 
     if (strncmp(node->id, "MAIN", 4) == 0) {
         // Nothing to do.
     }
     else if (strncmp(node->id, "SIZE", 4) == 0) {
-        node->size.w = READ(uint32_t, file);
-        node->size.h = READ(uint32_t, file);
-        node->size.d = READ(uint32_t, file);
+        node->size.w = reader_i32(r);
+        node->size.h = reader_i32(r);
+        node->size.d = reader_i32(r);
     }
     else if (strncmp(node->id, "RGBA", 4) == 0) {
-        node->rgba.values = malloc(4 * 256);
-        for (i = 1; i < 256; i++) {
-            node->rgba.values[i][0] = READ(uint8_t, file);
-            node->rgba.values[i][1] = READ(uint8_t, file);
-            node->rgba.values[i][2] = READ(uint8_t, file);
-            node->rgba.values[i][3] = READ(uint8_t, file);
-        }
-        // Skip the last value!
-        for (i = 0; i < 4; i++) READ(uint8_t, file);
+        node->rgba.values = calloc(256, 4);
+        // The file colors start at index one.
+        p = reader_bytes(r, 4 * 256);
+        if (p) memcpy(node->rgba.values + 1, p, 4 * 255);
     }
     else if (strncmp(node->id, "XYZI", 4) == 0) {
-        node->xyzi.nb = READ(uint32_t, file);
-        node->xyzi.values = calloc(node->xyzi.nb, 4);
-        for (i = 0; i < node->xyzi.nb; i++) {
-            node->xyzi.values[i * 4 + 0] = READ(uint8_t, file);
-            node->xyzi.values[i * 4 + 1] = READ(uint8_t, file);
-            node->xyzi.values[i * 4 + 2] = READ(uint8_t, file);
-            node->xyzi.values[i * 4 + 3] = READ(uint8_t, file);
-        }
+        node->xyzi.nb = reader_i32(r);
+        if (node->xyzi.nb < 0 || node->xyzi.nb > (end - r->pos) / 4)
+            node->xyzi.nb = 0;
+        node->xyzi.values = reader_bytes(r, node->xyzi.nb * 4);
     }
     else if (strncmp(node->id, "nTRN", 4) == 0) {
-        node->node_id = READ(int32_t, file);
-        read_dict(file, NULL, NULL);
+        node->node_id = reader_i32(r);
+        read_dict(r, NULL, NULL);
         node->nb_children = 1;
         node->children_ids = calloc(1, sizeof(int));
-        *node->children_ids = READ(int32_t, file);
-        READ(int32_t, file);
-        READ(int32_t, file);
-        node->ntrn.nb_frames = READ(int32_t, file);
-        for (i = 0; i < node->ntrn.nb_frames; i++) {
-            read_dict(file, node, on_trn_dict);
+        *node->children_ids = reader_i32(r);
+        reader_i32(r);
+        reader_i32(r);
+        node->ntrn.nb_frames = reader_i32(r);
+        for (i = 0; i < node->ntrn.nb_frames && r->pos < end; i++) {
+            read_dict(r, node, on_trn_dict);
         }
     }
     else if (strncmp(node->id, "nSHP", 4) == 0) {
-        node->node_id = READ(int32_t, file);
-        read_dict(file, NULL, NULL);
-        node->nshp.nb_models = READ(int32_t, file);
-        for (i = 0; i < node->nshp.nb_models; i++) {
-            node->nshp.model_id = READ(int32_t, file);
-            read_dict(file, NULL, NULL);
+        node->node_id = reader_i32(r);
+        read_dict(r, NULL, NULL);
+        node->nshp.nb_models = reader_i32(r);
+        for (i = 0; i < node->nshp.nb_models && r->pos < end; i++) {
+            node->nshp.model_id = reader_i32(r);
+            read_dict(r, NULL, NULL);
         }
     }
     else if (strncmp(node->id, "nGRP", 4) == 0) {
-        node->node_id = READ(int32_t, file);
-        read_dict(file, NULL, NULL);
-        node->nb_children = READ(int32_t, file);
+        node->node_id = reader_i32(r);
+        read_dict(r, NULL, NULL);
+        node->nb_children = max(0, min(reader_i32(r), (end - r->pos) / 4));
         node->children_ids = calloc(node->nb_children, sizeof(int));
         for (i = 0; i < node->nb_children; i++) {
-            node->children_ids[i] = READ(int32_t, file);
+            node->children_ids[i] = reader_i32(r);
         }
     }
 
-    if (ftell(file) < fpos + size) {
-        fseek(file, fpos + size, SEEK_SET);
-    }
-
-    while (ftell(file) < fpos + size + children_size) {
-        child = read_node(file);
-        if (!child) continue;
+    r->pos = end;
+    while (r->pos < end + children_size) {
+        child = read_node(r);
+        if (!child) break;
         DL_APPEND(node->children, child);
     }
-
+    r->pos = end + children_size;
 
     // Set the parents.
     DL_FOREACH(node->children, child) {
@@ -339,17 +329,105 @@ static void node_apply_mat(const node_t *node, float mat[4][4])
     }
 }
 
+// Check if a matrix is a translation by an integer vector.
+static bool mat_is_int_translation(const float mat[4][4], int out[3])
+{
+    int i, j;
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 4; j++) {
+        if (mat[i][j] != (i == j ? 1 : 0)) return false;
+    }
+    for (i = 0; i < 3; i++) {
+        out[i] = (int)roundf(mat[3][i]);
+        if (out[i] != mat[3][i]) return false;
+    }
+    return true;
+}
+
+/*
+ * Write the voxels of a XYZI chunk into a mesh, one block at a time.
+ *
+ * The voxels are first bucketed per block with a counting sort, then each
+ * block is filled with a single mesh_read / mesh_write pair, which is a lot
+ * faster than setting the voxels one by one.
+ */
+static void import_voxels(mesh_t *mesh, const node_t *xyzi,
+                          const uint8_t (*palette)[4], const int ofs[3])
+{
+    const int N = BLOCK_SIZE;
+    const uint8_t *v;
+    int i, k, nb, cell, start, bmin[3], bmax[3], dim[3], p[3], bpos[3];
+    int *counts, *order;
+    uint8_t (*data)[4];
+
+    nb = xyzi->xyzi.nb;
+    if (!nb) return;
+
+    // The voxel coordinates are in [0, 255], so the blocks are in a
+    // small grid.
+    for (i = 0; i < 3; i++) {
+        bmin[i] = (int)floor((ofs[i] + 0.0) / N);
+        bmax[i] = (int)floor((ofs[i] + 255.0) / N);
+        dim[i] = bmax[i] - bmin[i] + 1;
+    }
+    counts = calloc(dim[0] * dim[1] * dim[2] + 1, sizeof(*counts));
+    order = malloc(nb * sizeof(*order));
+    data = malloc(N * N * N * sizeof(*data));
+
+    #define CELL(v) ( \
+        (((int)floor((ofs[2] + v[2]) / (float)N) - bmin[2]) * dim[1] + \
+         ((int)floor((ofs[1] + v[1]) / (float)N) - bmin[1])) * dim[0] + \
+         ((int)floor((ofs[0] + v[0]) / (float)N) - bmin[0]))
+
+    for (i = 0; i < nb; i++) {
+        v = &xyzi->xyzi.values[i * 4];
+        counts[CELL(v) + 1]++;
+    }
+    for (i = 0; i < dim[0] * dim[1] * dim[2]; i++)
+        counts[i + 1] += counts[i];
+    for (i = 0; i < nb; i++) {
+        v = &xyzi->xyzi.values[i * 4];
+        order[counts[CELL(v)]++] = i;
+    }
+    // counts[cell] now points to the end of the cell.
+
+    start = 0;
+    for (cell = 0; cell < dim[0] * dim[1] * dim[2]; cell++) {
+        if (counts[cell] == start) continue;
+        bpos[0] = (bmin[0] + cell % dim[0]) * N;
+        bpos[1] = (bmin[1] + cell / dim[0] % dim[1]) * N;
+        bpos[2] = (bmin[2] + cell / (dim[0] * dim[1])) * N;
+        // Read the block first, since we might merge into existing content.
+        mesh_read(mesh, bpos, (int[]){N, N, N}, (uint8_t*)data);
+        for (k = start; k < counts[cell]; k++) {
+            v = &xyzi->xyzi.values[order[k] * 4];
+            if (!v[3]) continue; // Not sure what c == 0 means.
+            p[0] = ofs[0] + v[0] - bpos[0];
+            p[1] = ofs[1] + v[1] - bpos[1];
+            p[2] = ofs[2] + v[2] - bpos[2];
+            memcpy(data[(p[2] * N + p[1]) * N + p[0]], palette[v[3]], 4);
+        }
+        mesh_write(mesh, bpos, (int[]){N, N, N}, (uint8_t*)data);
+        start = counts[cell];
+    }
+
+    #undef CELL
+    free(counts);
+    free(order);
+    free(data);
+}
+
 static int import_layer(image_t *image,
                         const node_t *size, const node_t *xyzi,
                         const node_t *rgba, const node_t *tree,
                         int model_id)
 {
-    int i, x, y, z, c, pos[3];
+    int i, ofs[3], trans[3];
     layer_t *layer;
-    uint8_t color[4];
-    mesh_iterator_t iter = {0};
+    uint8_t palette[256][4];
     const node_t *shape;
     float mat[4][4] = MAT4_IDENTITY;
+    bool move = false;
 
     // Use the current layer for first shape, then create new layers.
     if (size == tree->children)
@@ -357,58 +435,69 @@ static int import_layer(image_t *image,
     else
         layer = image_add_layer(image, NULL);
 
-    for (i = 0; i < xyzi->xyzi.nb; i++) {
-        x = xyzi->xyzi.values[i * 4 + 0];
-        y = xyzi->xyzi.values[i * 4 + 1];
-        z = xyzi->xyzi.values[i * 4 + 2];
-        c = xyzi->xyzi.values[i * 4 + 3];
-        pos[0] = x - size->size.w / 2;
-        pos[1] = y - size->size.h / 2;
-        pos[2] = z - size->size.d / 2;
-        if (!c) continue; // Not sure what c == 0 means.
+    for (i = 0; i < 256; i++) {
         if (rgba)
-            memcpy(color, rgba->rgba.values[c], 4);
+            memcpy(palette[i], rgba->rgba.values[i], 4);
         else
-            hexcolor(VOX_DEFAULT_PALETTE[c], color);
-        mesh_set_at(layer->mesh, &iter, pos, color);
+            hexcolor(VOX_DEFAULT_PALETTE[i], palette[i]);
     }
 
-    // Apply the transformation.
+    ofs[0] = -size->size.w / 2;
+    ofs[1] = -size->size.h / 2;
+    ofs[2] = -size->size.d / 2;
+
+    // Apply the transformation.  Integer translations are applied directly
+    // to the voxel positions, anything else requires to move the mesh.
     // XXX: would be better to properly support layer transformations!
     shape = tree_find_shape(tree, model_id);
     if (shape) {
         node_apply_mat(shape, mat);
-        mesh_move(layer->mesh, mat);
+        if (mat_is_int_translation(mat, trans)) {
+            for (i = 0; i < 3; i++) ofs[i] += trans[i];
+        } else {
+            move = true;
+        }
     }
 
+    import_voxels(layer->mesh, xyzi, palette, ofs);
+    if (move) mesh_move(layer->mesh, mat);
     return 0;
 }
 
 static int vox_import(image_t *image, const char *path)
 {
-    FILE *file;
-    char magic[4];
-    int r, i, version;
+    uint8_t *data;
+    int size, i, version, ret;
+    reader_t r;
     node_t *tree, *size_n, *xyzi_n, *rgba_n;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN, "vox\0*.vox\0",
                                         NULL, NULL);
     if (!path) return -1;
-    file = fopen(path, "rb");
-    r = fread(magic, 1, 4, file);
-    if (r != 4) FILE_ERROR("Cannot read file");
+    data = (uint8_t*)read_file(path, &size);
+    if (!data || size < 8) {
+        LOG_E("Cannot read file %s", path);
+        free(data);
+        return -1;
+    }
 
-    if (strncmp(magic, "VOX ", 4) != 0) {
+    r = (reader_t){data, size};
+    if (strncmp((char*)data, "VOX ", 4) != 0) {
         LOG_D("Old style magica voxel file");
-        fclose(file);
-        return vox_import_old(path);
+        ret = vox_import_old(image, &r);
+        free(data);
+        return ret;
     }
 
-    if (strncmp(magic, "VOX ", 4) != 0) FILE_ERROR("Wrong magic string");
-    version = READ(uint32_t, file);
+    r.pos = 4;
+    version = reader_i32(&r);
     if (version != 150) LOG_W("Magica voxel file version %d!", version);
-    tree = read_node(file);
-    if (!tree) goto error;
+    tree = read_node(&r);
+    if (!tree) {
+        LOG_E("Cannot parse vox file %s", path);
+        free(data);
+        return -1;
+    }
 
     // Get the palette.
     DL_FOREACH(tree->children, rgba_n) {
@@ -420,16 +509,14 @@ static int vox_import(image_t *image, const char *path)
     DL_FOREACH(tree->children, size_n) {
         if (strncmp(size_n->id, "SIZE", 4) != 0) continue;
         xyzi_n = size_n->next;
-        if (strncmp(xyzi_n->id, "XYZI", 4) != 0) continue;
+        if (!xyzi_n || strncmp(xyzi_n->id, "XYZI", 4) != 0) continue;
         import_layer(image, size_n, xyzi_n, rgba_n, tree, i);
         i++;
     }
 
     free_node(tree);
-
+    free(data);
     return 0;
-error:
-    return -1;
 }
 
 static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
@@ -451,99 +538,337 @@ static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
     return best;
 }
 
-static int voxel_cmp(const void *a_, const void *b_)
+// Histogram of the exported colors, as an open addressing hash table that
+// gives the index of each color in the list of distinct colors.
+typedef struct {
+    uint32_t    *slots;     // Color of each slot, zero for empty slots.
+    int         *ids;
+    int         capacity;
+    uint8_t     (*colors)[4];
+    uint32_t    *counts;
+    int         nb;
+} color_hist_t;
+
+// Return the slot of a color in the hash table, or of the empty slot where
+// it should be inserted.
+static int color_hist_find(const color_hist_t *hist, uint32_t color)
 {
-    const uint8_t *a = a_;
-    const uint8_t *b = b_;
-    if (a[2] != b[2]) return cmp(a[2], b[2]);
-    if (a[1] != b[1]) return cmp(a[1], b[1]);
-    if (a[0] != b[0]) return cmp(a[0], b[0]);
-    return 0;
+    uint32_t i, mask = hist->capacity - 1;
+    for (i = (color * 2654435761u) & mask;; i = (i + 1) & mask) {
+        if (!hist->slots[i] || hist->slots[i] == color) return i;
+    }
+}
+
+static void color_hist_grow(color_hist_t *hist)
+{
+    uint32_t color;
+    int i, slot;
+
+    free(hist->slots);
+    free(hist->ids);
+    hist->capacity = max(1024, hist->capacity * 2);
+    hist->slots = calloc(hist->capacity, sizeof(*hist->slots));
+    hist->ids = calloc(hist->capacity, sizeof(*hist->ids));
+    hist->colors = realloc(hist->colors,
+                           hist->capacity / 2 * sizeof(*hist->colors));
+    hist->counts = realloc(hist->counts,
+                           hist->capacity / 2 * sizeof(*hist->counts));
+    for (i = 0; i < hist->nb; i++) {
+        memcpy(&color, hist->colors[i], 4);
+        slot = color_hist_find(hist, color);
+        hist->slots[slot] = color;
+        hist->ids[slot] = i;
+    }
+}
+
+// Add a color with alpha set to the histogram and return its index.
+static int color_hist_add(color_hist_t *hist, const uint8_t c[4])
+{
+    uint32_t color;
+    int slot;
+
+    if (hist->nb >= hist->capacity / 2) color_hist_grow(hist);
+    memcpy(&color, c, 4);
+    slot = color_hist_find(hist, color);
+    if (hist->slots[slot]) return hist->ids[slot];
+    hist->slots[slot] = color;
+    hist->ids[slot] = hist->nb;
+    memcpy(hist->colors[hist->nb], c, 4);
+    hist->counts[hist->nb] = 0;
+    return hist->nb++;
+}
+
+static void color_hist_release(color_hist_t *hist)
+{
+    free(hist->slots);
+    free(hist->ids);
+    free(hist->colors);
+    free(hist->counts);
+}
+
+// A voxel of an exported model, with the index of its color in the
+// histogram.
+typedef struct {
+    uint8_t     pos[3];
+    uint32_t    color;
+} model_voxel_t;
+
+// An exported model.  The vox format limits the models to 256^3, so the
+// bigger layers get split into several models.
+typedef struct {
+    const char      *name;
+    int             pos[3];     // Position of the model bottom corner.
+    int             size[3];
+    model_voxel_t   *voxels;
+    int             nb;
+    int             allocated;
+} model_t;
+
+#define MODEL_MAX_SIZE 256
+
+// Split the voxels of a layer into models, iterating the mesh block by
+// block.
+static void add_layer_models(const layer_t *layer, color_hist_t *hist,
+                             model_t **models, int *nb_models)
+{
+    const int N = BLOCK_SIZE;
+    int aabb[2][3], nb[3], i, x, y, z, bpos[3], t[3], id;
+    uint8_t (*block)[4], *v;
+    model_t *layer_models, *model;
+    mesh_iterator_t iter;
+    mesh_stats_t stats;
+
+    if (!mesh_get_bbox(layer->mesh, aabb, true)) return;
+    for (i = 0; i < 3; i++) {
+        nb[i] = (aabb[1][i] - aabb[0][i] + MODEL_MAX_SIZE - 1) /
+                MODEL_MAX_SIZE;
+    }
+    *models = realloc(*models, (*nb_models + nb[0] * nb[1] * nb[2]) *
+                               sizeof(**models));
+    layer_models = *models + *nb_models;
+    for (i = 0; i < nb[0] * nb[1] * nb[2]; i++) {
+        t[0] = i % nb[0];
+        t[1] = i / nb[0] % nb[1];
+        t[2] = i / nb[0] / nb[1];
+        model = &layer_models[i];
+        *model = (model_t){.name = layer->name};
+        for (x = 0; x < 3; x++) {
+            model->pos[x] = aabb[0][x] + t[x] * MODEL_MAX_SIZE;
+            model->size[x] = min(MODEL_MAX_SIZE,
+                                 aabb[1][x] - model->pos[x]);
+        }
+    }
+    *nb_models += nb[0] * nb[1] * nb[2];
+    // With a single model we know in advance how many voxels it can get.
+    if (nb[0] * nb[1] * nb[2] == 1) {
+        mesh_get_stats(layer->mesh, &stats);
+        model = &layer_models[0];
+        model->allocated = stats.nb_voxels;
+        model->voxels = malloc(model->allocated * sizeof(*model->voxels));
+    }
+
+    block = malloc(N * N * N * 4);
+    iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_read(layer->mesh, bpos, (int[]){N, N, N}, (uint8_t*)block);
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++)
+        for (x = 0; x < N; x++) {
+            v = block[x + y * N + z * N * N];
+            if (v[3] < 127) continue;
+            t[0] = (bpos[0] + x - aabb[0][0]) / MODEL_MAX_SIZE;
+            t[1] = (bpos[1] + y - aabb[0][1]) / MODEL_MAX_SIZE;
+            t[2] = (bpos[2] + z - aabb[0][2]) / MODEL_MAX_SIZE;
+            model = &layer_models[t[0] + t[1] * nb[0] + t[2] * nb[0] * nb[1]];
+            if (model->nb == model->allocated) {
+                model->allocated = max(4096, model->allocated * 2);
+                model->voxels = realloc(model->voxels, model->allocated *
+                                        sizeof(*model->voxels));
+            }
+            id = color_hist_add(hist, (uint8_t[]){v[0], v[1], v[2], 255});
+            hist->counts[id]++;
+            model->voxels[model->nb++] = (model_voxel_t){
+                .pos = {bpos[0] + x - model->pos[0],
+                        bpos[1] + y - model->pos[1],
+                        bpos[2] + z - model->pos[2]},
+                .color = id,
+            };
+        }
+    }
+    free(block);
+}
+
+// Small buffer used to compute the size of the chunks before writing them.
+typedef struct {
+    uint8_t *data;
+    int     size;
+    int     allocated;
+} buffer_t;
+
+static void buffer_write(buffer_t *buf, const void *data, int size)
+{
+    if (buf->size + size > buf->allocated) {
+        buf->allocated = max(buf->size + size, buf->allocated * 2);
+        buf->data = realloc(buf->data, buf->allocated);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void buffer_write_int(buffer_t *buf, int32_t v)
+{
+    buffer_write(buf, &v, 4);
+}
+
+static void buffer_write_string(buffer_t *buf, const char *str)
+{
+    buffer_write_int(buf, strlen(str));
+    buffer_write(buf, str, strlen(str));
+}
+
+// Write a chunk from a buffer, and reset the buffer.
+static void write_chunk(FILE *file, const char *id, buffer_t *buf)
+{
+    fwrite(id, 4, 1, file);
+    WRITE(uint32_t, buf->size, file);
+    WRITE(uint32_t, 0, file);
+    fwrite(buf->data, buf->size, 1, file);
+    buf->size = 0;
+}
+
+// Write the scene graph: a root transform and group, with a transform and
+// shape nodes for each model.
+static void write_scene_graph(FILE *file, const model_t *models, int nb)
+{
+    buffer_t buf = {};
+    char trans[64];
+    int i;
+
+    buffer_write_int(&buf, 0);      // Node id.
+    buffer_write_int(&buf, 0);      // Attributes.
+    buffer_write_int(&buf, 1);      // Child node id.
+    buffer_write_int(&buf, -1);     // Reserved.
+    buffer_write_int(&buf, -1);     // Layer id.
+    buffer_write_int(&buf, 1);      // Number of frames.
+    buffer_write_int(&buf, 0);      // Frame attributes.
+    write_chunk(file, "nTRN", &buf);
+
+    buffer_write_int(&buf, 1);
+    buffer_write_int(&buf, 0);
+    buffer_write_int(&buf, nb);
+    for (i = 0; i < nb; i++) buffer_write_int(&buf, 2 + i * 2);
+    write_chunk(file, "nGRP", &buf);
+
+    for (i = 0; i < nb; i++) {
+        buffer_write_int(&buf, 2 + i * 2);
+        buffer_write_int(&buf, 1);
+        buffer_write_string(&buf, "_name");
+        buffer_write_string(&buf, models[i].name);
+        buffer_write_int(&buf, 3 + i * 2);
+        buffer_write_int(&buf, -1);
+        buffer_write_int(&buf, -1);
+        buffer_write_int(&buf, 1);
+        // The translation is the position of the model center.
+        snprintf(trans, sizeof(trans), "%d %d %d",
+                 models[i].pos[0] + models[i].size[0] / 2,
+                 models[i].pos[1] + models[i].size[1] / 2,
+                 models[i].pos[2] + models[i].size[2] / 2);
+        buffer_write_int(&buf, 1);
+        buffer_write_string(&buf, "_t");
+        buffer_write_string(&buf, trans);
+        write_chunk(file, "nTRN", &buf);
+
+        buffer_write_int(&buf, 3 + i * 2);
+        buffer_write_int(&buf, 0);
+        buffer_write_int(&buf, 1);      // Number of models.
+        buffer_write_int(&buf, i);
+        buffer_write_int(&buf, 0);
+        write_chunk(file, "nSHP", &buf);
+    }
+    free(buf.data);
 }
 
 static int vox_export(const image_t *image, const char *path)
 {
     FILE *file;
-    int children_size, nb_vox = 0, i, pos[3];
-    int xmin = INT_MAX, ymin = INT_MAX, zmin = INT_MAX;
-    int xmax = INT_MIN, ymax = INT_MIN, zmax = INT_MIN;
+    int i, j, nb_models = 0;
+    long children_size;
     uint8_t (*palette)[4];
+    uint8_t *indices, idx;
     bool use_default_palette = true;
-    uint8_t *voxels;
-    uint8_t v[4];
-    mesh_iterator_t iter;
-    const mesh_t *mesh;
+    color_hist_t hist = {};
+    model_t *models = NULL, *model;
+    const layer_t *layer;
+
+    // Put the voxels of all the visible layers into models, and build the
+    // histogram of the colors at the same time.
+    image_update((image_t*)image);
+    DL_FOREACH(image->layers, layer) {
+        if (!layer->visible || !layer->mesh) continue;
+        add_layer_models(layer, &hist, &models, &nb_models);
+    }
+    if (!nb_models) {
+        models = calloc(1, sizeof(*models));
+        models[0] = (model_t){.name = "", .size = {1, 1, 1}};
+        nb_models = 1;
+    }
 
-    mesh = goxel_get_layers_mesh(image);
+    // Compute the palette index of each color.
     palette = calloc(256, sizeof(*palette));
     for (i = 0; i < 256; i++)
         hexcolor(VOX_DEFAULT_PALETTE[i], palette[i]);
-
-    // Iter all the voxels to get the count and the size.
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        use_default_palette = use_default_palette &&
-                            get_color_index(v, palette, true) != -1;
-        nb_vox++;
-        xmin = min(xmin, pos[0]);
-        ymin = min(ymin, pos[1]);
-        zmin = min(zmin, pos[2]);
-        xmax = max(xmax, pos[0] + 1);
-        ymax = max(ymax, pos[1] + 1);
-        zmax = max(zmax, pos[2] + 1);
-    }
-    if (!use_default_palette)
-        quantization_gen_palette(mesh, 255, (void*)(palette + 1));
-
-    children_size = 12 + 4 * 3 +      // SIZE chunk
-                    12 + 4 + 4 * nb_vox + // XYZI chunk
-                    (use_default_palette ? 0 : (12 + 4 * 256)); // RGBA chunk.
+    indices = calloc(max(hist.nb, 1), 1);
+    for (i = 0; i < hist.nb && use_default_palette; i++) {
+        j = get_color_index(hist.colors[i], palette, true);
+        use_default_palette = j != -1;
+        indices[i] = j;
+    }
+    if (!use_default_palette && hist.nb <= 255) {
+        memset(palette, 0, 256 * sizeof(*palette));
+        for (i = 0; i < hist.nb; i++) {
+            memcpy(palette[i + 1], hist.colors[i], 4);
+            indices[i] = i + 1;
+        }
+    } else if (!use_default_palette) {
+        quantization_gen_palette_from_colors(
+                (const uint8_t (*)[4])hist.colors, hist.counts, hist.nb,
+                255, palette + 1);
+        for (i = 0; i < hist.nb; i++)
+            indices[i] = get_color_index(hist.colors[i], palette, false);
+    }
 
     file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s", path);
+        goto end;
+    }
     fprintf(file, "VOX ");
     WRITE(uint32_t, 150, file);     // Version
     fprintf(file, "MAIN");
     WRITE(uint32_t, 0, file);       // Main chunck size.
-    WRITE(uint32_t, children_size, file);
+    WRITE(uint32_t, 0, file);       // Children size, set at the end.
 
-    fprintf(file, "SIZE");
-    WRITE(uint32_t, 4 * 3, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, xmax - xmin, file);
-    WRITE(uint32_t, ymax - ymin, file);
-    WRITE(uint32_t, zmax - zmin, file);
-
-    fprintf(file, "XYZI");
-    WRITE(uint32_t, 4 * nb_vox + 4, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, nb_vox, file);
+    for (i = 0; i < nb_models; i++) {
+        model = &models[i];
+        fprintf(file, "SIZE");
+        WRITE(uint32_t, 4 * 3, file);
+        WRITE(uint32_t, 0, file);
+        WRITE(uint32_t, model->size[0], file);
+        WRITE(uint32_t, model->size[1], file);
+        WRITE(uint32_t, model->size[2], file);
 
-    voxels = calloc(nb_vox, 4);
-    i = 0;
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        pos[0] -= xmin;
-        pos[1] -= ymin;
-        pos[2] -= zmin;
-        assert(pos[0] >= 0 && pos[0] < 255);
-        assert(pos[1] >= 0 && pos[1] < 255);
-        assert(pos[2] >= 0 && pos[2] < 255);
-
-        voxels[i * 4 + 0] = pos[0];
-        voxels[i * 4 + 1] = pos[1];
-        voxels[i * 4 + 2] = pos[2];
-        voxels[i * 4 + 3] = get_color_index(v, palette, false);
-        i++;
+        fprintf(file, "XYZI");
+        WRITE(uint32_t, 4 * model->nb + 4, file);
+        WRITE(uint32_t, 0, file);
+        WRITE(uint32_t, model->nb, file);
+        for (j = 0; j < model->nb; j++) {
+            idx = indices[model->voxels[j].color];
+            fwrite(model->voxels[j].pos, 3, 1, file);
+            fwrite(&idx, 1, 1, file);
+        }
     }
-    qsort(voxels, nb_vox, 4, voxel_cmp);
-    for (i = 0; i < nb_vox; i++)
-        fwrite(voxels + i * 4, 4, 1, file);
-    free(voxels);
+
+    write_scene_graph(file, models, nb_models);
 
     if (!use_default_palette) {
         fprintf(file, "RGBA");
@@ -558,8 +883,17 @@ static int vox_export(const image_t *image, const char *path)
         WRITE(uint32_t, 0, file);
     }
 
+    children_size = ftell(file) - 20;
+    fseek(file, 16, SEEK_SET);
+    WRITE(uint32_t, children_size, file);
     fclose(file);
+
+end:
+    for (i = 0; i < nb_models; i++) free(models[i].voxels);
+    free(models);
+    free(indices);
     free(palette);
+    color_hist_release(&hist);
     return 0;
 }
 
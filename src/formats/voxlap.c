@@ -24,6 +24,9 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "utils/reader.h"
+
+#include <limits.h>
 
 /*
  * Structure that represents a single voxel and visible faces.
@@ -46,8 +49,6 @@ typedef struct {
 } slab_t;
 
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
 #define WRITE(type, v, file) \
     ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
 
@@ -75,49 +76,61 @@ static void swap_color(uint32_t v, uint8_t ret[4])
 
 static int kv6_import(image_t *image, const char *path)
 {
-    FILE *file;
-    char magic[4];
-    int i, r, ret = 0, w, h, d, blklen, x, y, z = 0, nb, p = 0;
-    uint32_t *xoffsets = NULL;
+    int i, ret = 0, size, w, h, d, blklen, x, y, z = 0, nb, p = 0;
+    uint8_t *data;
+    const uint8_t *magic;
     uint16_t *xyoffsets = NULL;
     uint8_t (*cube)[4] = NULL;
     uint8_t color[4] = {0};
-    (void)r;
+    reader_t r;
     struct {
         uint32_t color;
-        uint8_t zpos;
+        uint16_t zpos;
         uint8_t visface;
     } *blocks = NULL;
 
-    file = fopen(path, "rb");
-    r = fread(magic, 1, 4, file);
-    if (strncmp(magic, "Kvxl ", 4) != 0) raise("Invalid magic");
-    w = READ(uint32_t, file);
-    h = READ(uint32_t, file);
-    d = READ(uint32_t, file);
-    cube = calloc(w * h * d, sizeof(*cube));
-
-    READ(float, file);
-    READ(float, file);
-    READ(float, file);
-    blklen = READ(uint32_t, file);
+    data = (uint8_t*)read_file(path, &size);
+    if (!data) {
+        LOG_E("Cannot read file %s", path);
+        return -1;
+    }
+    r = (reader_t){data, size};
+    magic = reader_bytes(&r, 4);
+    if (!magic || strncmp((const char*)magic, "Kvxl", 4) != 0)
+        raise("Invalid magic");
+    w = reader_i32(&r);
+    h = reader_i32(&r);
+    d = reader_i32(&r);
+    reader_float(&r);
+    reader_float(&r);
+    reader_float(&r);
+    blklen = reader_i32(&r);
+    // Each block uses 8 bytes, and each column 2 bytes.
+    if (    w <= 0 || h <= 0 || d <= 0 || blklen < 0 ||
+            (int64_t)w * h * d > INT_MAX / 4 ||
+            (int64_t)blklen * 8 + (int64_t)w * h * 2 > reader_remaining(&r))
+        raise("Invalid kv6 file size");
+
+    cube = calloc((size_t)w * h * d, sizeof(*cube));
     blocks = calloc(blklen, sizeof(*blocks));
     for (i = 0; i < blklen; i++) {
-        blocks[i].color = READ(uint32_t, file);
-        blocks[i].zpos = READ(uint16_t, file);
-        blocks[i].visface = READ(uint8_t, file);
-        READ(uint8_t, file); // lighting
+        blocks[i].color = reader_u32(&r);
+        blocks[i].zpos = reader_u16(&r);
+        blocks[i].visface = reader_u8(&r);
+        reader_u8(&r); // lighting
     }
-    xoffsets = calloc(w, sizeof(*xoffsets));
+    reader_bytes(&r, w * 4); // x offsets.
     xyoffsets = calloc(w * h, sizeof(*xyoffsets));
-    for (i = 0; i < w; i++)      xoffsets[i] = READ(uint32_t, file);
-    for (i = 0; i < w * h; i++) xyoffsets[i] = READ(uint16_t, file);
+    for (i = 0; i < w * h; i++) xyoffsets[i] = reader_u16(&r);
+    if (r.error) raise("Invalid kv6 file: unexpected end");
 
     for (x = 0; x < w; x++)
     for (y = 0; y < h; y++) {
         nb = xyoffsets[x * h + y];
+        if (nb > blklen - p) raise("Invalid kv6 file: bad offsets");
         for (i = 0; i < nb; i++, p++) {
             z = blocks[p].zpos;
+            if (z >= d) raise("Invalid kv6 file: bad block position");
             swap_color(blocks[p].color, cube[AT(x, y, z, w, h, d)]);
         }
     }
@@ -146,46 +159,57 @@ static int kv6_import(image_t *image, const char *path)
 end:
     free(cube);
     free(blocks);
-    free(xoffsets);
     free(xyoffsets);
-    fclose(file);
+    free(data);
     return ret;
 }
 
 static int kvx_import(image_t *image, const char *path)
 {
-    FILE *file;
-    int i, r, ret = 0, nb, size, lastz = 0, len, visface;
+    int i, ret = 0, nb, size, file_size, lastz = 0, len, visface;
     int w, h, d, px, py, pz, x, y, z;
     int offsetsize, voxdatasize;
     int aabb[2][3];
     uint8_t color = 0;
+    uint8_t *data;
     uint8_t (*palette)[4] = NULL;
     uint32_t *xoffsets = NULL;
     uint16_t *xyoffsets = NULL;
     uint8_t (*cube)[4] = NULL;
-    long datpos;
-    (void)r;
+    int64_t datpos;
+    reader_t r;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN,
                                         "kvx\0*.kvx\0", NULL, NULL);
     if (!path) return -1;
 
-    file = fopen(path, "rb");
-    size = READ(uint32_t, file);
-    w = READ(uint32_t, file);
-    h = READ(uint32_t, file);
-    d = READ(uint32_t, file);
-    cube = calloc(w * h * d, sizeof(*cube));
-
-    px = READ(uint32_t, file) / 256;
-    py = READ(uint32_t, file) / 256;
-    pz = READ(uint32_t, file) / 256;
+    data = (uint8_t*)read_file(path, &file_size);
+    if (!data) {
+        LOG_E("Cannot read file %s", path);
+        return -1;
+    }
+    // The palette is stored at the end of the file.
+    r = (reader_t){data, max(file_size - 256 * 3, 0)};
+    size = reader_i32(&r);
+    w = reader_i32(&r);
+    h = reader_i32(&r);
+    d = reader_i32(&r);
+    // Each column uses 2 bytes of offsets.
+    if (    w <= 0 || h <= 0 || d <= 0 ||
+            (int64_t)w * h * d > INT_MAX / 4 ||
+            (int64_t)w * (h + 1) * 2 > reader_remaining(&r))
+        raise("Invalid kvx file size");
+    cube = calloc((size_t)w * h * d, sizeof(*cube));
+
+    px = reader_u32(&r) / 256;
+    py = reader_u32(&r) / 256;
+    pz = reader_u32(&r) / 256;
 
     xoffsets = calloc(w + 1, sizeof(*xoffsets));
     xyoffsets = calloc(w * (h + 1), sizeof(*xyoffsets));
-    for (i = 0; i < w + 1; i++)        xoffsets[i] = READ(uint32_t, file);
-    for (i = 0; i < w * (h + 1); i++) xyoffsets[i] = READ(uint16_t, file);
+    for (i = 0; i < w + 1; i++)        xoffsets[i] = reader_u32(&r);
+    for (i = 0; i < w * (h + 1); i++) xyoffsets[i] = reader_u16(&r);
+    if (r.error) raise("Invalid kvx file: unexpected end");
 
     // Make sure the final x offset points pass the end the voxel data.
     // Just a warning for the moment.
@@ -193,18 +217,19 @@ static int kvx_import(image_t *image, const char *path)
     voxdatasize = size - 24 - offsetsize;
     if (xoffsets[w] != offsetsize + voxdatasize) LOG_W("Invalide kvx file");
 
-    datpos = ftell(file);
-
     // Read the palette at the end of the file first.
-    fseek(file, -256 * 3, SEEK_END);
+    datpos = r.pos;
+    r.size = file_size;
+    reader_seek(&r, file_size - 256 * 3);
     palette = calloc(256, sizeof(*palette));
     for (i = 0; i < 256; i++) {
-        palette[i][0] = clamp(round(READ(uint8_t, file) * 255 / 63.f), 0, 255);
-        palette[i][1] = clamp(round(READ(uint8_t, file) * 255 / 63.f), 0, 255);
-        palette[i][2] = clamp(round(READ(uint8_t, file) * 255 / 63.f), 0, 255);
+        palette[i][0] = clamp(round(reader_u8(&r) * 255 / 63.f), 0, 255);
+        palette[i][1] = clamp(round(reader_u8(&r) * 255 / 63.f), 0, 255);
+        palette[i][2] = clamp(round(reader_u8(&r) * 255 / 63.f), 0, 255);
         palette[i][3] = 255;
     }
-    fseek(file, datpos, SEEK_SET);
+    r.size = file_size - 256 * 3;
+    reader_seek(&r, datpos);
 
     for (x = 0; x < w; x++)
     for (y = 0; y < h; y++) {
@@ -212,12 +237,13 @@ static int kvx_import(image_t *image, const char *path)
             raise("Invalid format");
         nb = xyoffsets[x * (h + 1) + y + 1] - xyoffsets[x * (h + 1) + y];
         while (nb > 0) {
-            z = READ(uint8_t, file);
-            len = READ(uint8_t, file);
-            visface = READ(uint8_t, file);
-            assert(z + len - 1  < d);
+            z = reader_u8(&r);
+            len = reader_u8(&r);
+            visface = reader_u8(&r);
+            if (r.error) raise("Invalid kvx file: unexpected end");
+            if (z + len > d) raise("Invalid kvx file: bad slab position");
             for (i = 0; i < len; i++) {
-                color = READ(uint8_t, file);
+                color = reader_u8(&r);
                 memcpy(cube[AT(x, y, z + i, w, h, d)], palette[color], 4);
             }
             nb -= len + 3;
@@ -250,7 +276,7 @@ end:
     free(cube);
     free(xoffsets);
     free(xyoffsets);
-    fclose(file);
+    free(data);
     return ret;
 }
 
@@ -274,14 +300,43 @@ static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
     return best;
 }
 
-// Sort the voxels as they appear in the slabs.
-static int voxel_cmp(const void *a_, const void *b_)
+// Key of a voxel for the radix sort: its z, or its xy column index.
+static int voxel_key(const voxel_t *v, bool column, const int size[3])
+{
+    return column ? v->pos[0] * size[1] + v->pos[1] : v->pos[2];
+}
+
+// Stable counting sort of the voxels on one of their keys.
+static void counting_sort(const voxel_t *src, voxel_t *dst, int nb,
+                          bool column, const int size[3])
 {
-    const voxel_t *a = (void*)a_;
-    const voxel_t *b = (void*)b_;
-    return cmp(a->pos[0], b->pos[0]) ?:
-           cmp(a->pos[1], b->pos[1]) ?:
-           cmp(a->pos[2], b->pos[2]);
+    int i, k, sum, n, *counts;
+
+    n = column ? size[0] * size[1] : size[2];
+    counts = calloc(n, sizeof(*counts));
+    for (i = 0; i < nb; i++) counts[voxel_key(&src[i], column, size)]++;
+    for (k = 0, sum = 0; k < n; k++) {
+        sum += counts[k];
+        counts[k] = sum - counts[k];
+    }
+    for (i = 0; i < nb; i++)
+        dst[counts[voxel_key(&src[i], column, size)]++] = src[i];
+    free(counts);
+}
+
+/*
+ * Sort the voxels as they appear in the slabs: by x, then y, then z.
+ *
+ * This is a LSD radix sort, with a counting sort on z followed by a stable
+ * one on the xy column, so that it stays linear with the number of voxels.
+ * The positions must be inside the model size.
+ */
+static void sort_voxels(voxel_t *voxels, int nb, const int size[3])
+{
+    voxel_t *tmp = malloc(max(nb, 1) * sizeof(*tmp));
+    counting_sort(voxels, tmp, nb, false, size);
+    counting_sort(tmp, voxels, nb, true, size);
+    free(tmp);
 }
 
 /*
@@ -309,6 +364,20 @@ static bool slab_append(slab_t *slab, voxel_t *vox)
     return true;
 }
 
+// Check if all the visible voxels of a block are in the current palette.
+static void check_palette_block(void *user, const int pos[3], uint64_t id,
+                                const uint8_t (*voxels)[4])
+{
+    const int N = BLOCK_SIZE;
+    bool *use_current_palette = user;
+    int i;
+
+    for (i = 0; i < N * N * N && *use_current_palette; i++) {
+        if (voxels[i][3] < 127) continue;
+        if (palette_search(goxel.palette, voxels[i], true) < 0)
+            *use_current_palette = false;
+    }
+}
 
 static int kvx_export(const image_t *image, const char *path)
 {
@@ -318,7 +387,7 @@ static int kvx_export(const image_t *image, const char *path)
     mesh_accessor_t acc;
     uint8_t v[4];
     float box[4][4];
-    int pos[3], size[3], orig[3], x, y, i;
+    int size[3], orig[3], x, y, i;
     UT_array *slabs;
     UT_array *voxels;
     slab_t *slab;
@@ -328,7 +397,7 @@ static int kvx_export(const image_t *image, const char *path)
     uint32_t *xyoffsets;
     bool use_current_palette = false;
     float pivot[3];
-    const mesh_t *mesh = goxel_get_layers_mesh(image);
+    const mesh_t *mesh = image_get_layers_mesh(image);
 
     UT_icd voxel_icd = {sizeof(voxel_t), NULL, NULL, NULL};
     UT_icd slab_icd = {sizeof(slab_t), NULL, NULL, NULL};
@@ -347,17 +416,11 @@ static int kvx_export(const image_t *image, const char *path)
 
     // If the current palette is enough to export the model, use it, else
     // create a palette.
+    palette_load(goxel.palette);
     if (goxel.palette->size == 256) {
         use_current_palette = true;
-        iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, pos)) {
-            mesh_get_at(mesh, &iter, pos, v);
-            if (v[3] < 127) continue;
-            if (palette_search(goxel.palette, v, true) < 0) {
-                use_current_palette = false;
-                break;
-            }
-        }
+        mesh_foreach_block(mesh, MESH_FOREACH_UNIQUE, check_palette_block,
+                           &use_current_palette);
     }
     palette = calloc(256, sizeof(*palette));
     if (use_current_palette) {
@@ -415,7 +478,7 @@ static int kvx_export(const image_t *image, const char *path)
     }
 
     // Sort the voxels by xy columns in order they will be in the slabs.
-    utarray_sort(voxels, voxel_cmp);
+    sort_voxels((voxel_t*)utarray_front(voxels), utarray_len(voxels), size);
 
     // Iter the voxels and generates the slabs array.
     utarray_new(slabs, &slab_icd);
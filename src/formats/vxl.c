@@ -20,9 +20,7 @@
 
 #include "goxel.h"
 #include "file_format.h"
-
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
+#include "utils/reader.h"
 
 #define raise(msg) do { \
         LOG_E(msg); \
@@ -36,14 +34,13 @@ static inline int AT(int x, int y, int z) {
     return x + y * 512 + z * 512 * 512;
 }
 
-static void swap_color(uint32_t v, uint8_t ret[4])
+// The file colors are stored as BGRA.
+static void swap_color(const uint8_t *v, uint8_t ret[4])
 {
-    uint8_t o[4];
-    memcpy(o, &v, 4);
-    ret[0] = o[2];
-    ret[1] = o[1];
-    ret[2] = o[0];
-    ret[3] = o[3];
+    ret[0] = v[2];
+    ret[1] = v[1];
+    ret[2] = v[0];
+    ret[3] = v[3];
 }
 
 static int vxl_import(image_t *image, const char *path)
@@ -55,9 +52,10 @@ static int vxl_import(image_t *image, const char *path)
     int ret = 0, size;
     int w = 512, h = 512, d = 64, x, y, z;
     uint8_t (*cube)[4] = NULL;
-    uint8_t *data, *v;
+    uint8_t *data;
+    const uint8_t *span, *color;
+    reader_t r;
 
-    uint32_t *color;
     int i;
     int number_4byte_chunks;
     int top_color_start;
@@ -69,9 +67,13 @@ static int vxl_import(image_t *image, const char *path)
 
     if (!path) return -1;
 
-    cube = calloc(w * h * d, sizeof(*cube));
     data = (void*)read_file(path, &size);
-    v = data;
+    if (!data) {
+        LOG_E("Cannot read file %s", path);
+        return -1;
+    }
+    r = (reader_t){data, size};
+    cube = calloc(w * h * d, sizeof(*cube));
 
     for (y = 0; y < h; y++)
     for (x = 0; x < w; x++) {
@@ -81,41 +83,40 @@ static int vxl_import(image_t *image, const char *path)
 
         z = 0;
         while (true) {
-            number_4byte_chunks = v[0];
-            top_color_start = v[1];
-            top_color_end = v[2];
+            span = reader_bytes(&r, 4);
+            if (!span) raise("Invalid vxl file: unexpected end");
+            number_4byte_chunks = span[0];
+            top_color_start = span[1];
+            top_color_end = span[2];
+            if (    top_color_start > d || top_color_end >= d ||
+                    top_color_end < top_color_start - 1)
+                raise("Invalid vxl file: bad span");
 
             for (i = z; i < top_color_start; i++)
                 cube[AT(x, y, i)][3] = 0;
 
-            color = (uint32_t*)(v + 4);
-            for (z = top_color_start; z <= top_color_end; z++) {
-                CHECK(z >= 0 && z < d);
-                swap_color(*color++, cube[AT(x, y, z)]);
-            }
-
             len_bottom = top_color_end - top_color_start + 1;
+            color = reader_bytes(&r, 4 * len_bottom);
+            if (!color) raise("Invalid vxl file: unexpected end");
+            for (z = top_color_start; z <= top_color_end; z++, color += 4)
+                swap_color(color, cube[AT(x, y, z)]);
 
             // check for end of data marker
-            if (number_4byte_chunks == 0) {
-                // infer ACTUAL number of 4-byte chunks from the length of the
-                // color data
-                v += 4 * (len_bottom + 1);
-                break;
-            }
+            if (number_4byte_chunks == 0) break;
 
             // infer the number of bottom colors in next span from chunk length
             len_top = (number_4byte_chunks-1) - len_bottom;
+            color = reader_bytes(&r, 4 * len_top);
+            if (len_top < 0 || !color || reader_remaining(&r) < 4)
+                raise("Invalid vxl file: bad span");
 
-            // now skip the v pointer past the data to the beginning of the
-            // next span
-            v += v[0] * 4;
-
-            bottom_color_end   = v[3]; // aka air start
+            bottom_color_end   = r.data[r.pos + 3]; // aka air start
             bottom_color_start = bottom_color_end - len_top;
+            if (bottom_color_start < 0 || bottom_color_end > d)
+                raise("Invalid vxl file: bad span");
 
-            for(z = bottom_color_start; z < bottom_color_end; z++)
-                swap_color(*color++, cube[AT(x, y, z)]);
+            for (z = bottom_color_start; z < bottom_color_end; z++, color += 4)
+                swap_color(color, cube[AT(x, y, z)]);
         }
     }
 
@@ -124,24 +125,38 @@ static int vxl_import(image_t *image, const char *path)
     if (box_is_null(image->box)) {
         bbox_from_extents(image->box, vec3_zero, w / 2, h / 2, d / 2);
     }
+end:
     free(cube);
     free(data);
     return ret;
 }
 
-static int is_surface(int x, int y, int z, uint8_t map[512][512][64])
+/*
+ * Sparse map used for the export: for each column we keep a 64 bits mask
+ * of the solid voxels, and the colors are only allocated for the columns
+ * that have some solid voxels.
+ */
+typedef struct {
+    uint64_t mask[512][512];
+    uint32_t (*colors[512][512])[64];
+} map_t;
+
+static inline bool bit(uint64_t mask, int z)
 {
-   if (map[x][y][z]==0) return 0;
-   if (x == 0 || x == 511) return 1;
-   if (y == 0 || y == 511) return 1;
-   if (z == 0 || z == 63) return 1;
-   if (x   >   0 && map[x-1][y][z]==0) return 1;
-   if (x+1 < 512 && map[x+1][y][z]==0) return 1;
-   if (y   >   0 && map[x][y-1][z]==0) return 1;
-   if (y+1 < 512 && map[x][y+1][z]==0) return 1;
-   if (z   >   0 && map[x][y][z-1]==0) return 1;
-   if (z+1 <  64 && map[x][y][z+1]==0) return 1;
-   return 0;
+    return z >= 0 && z < 64 && (mask >> z) & 1;
+}
+
+// Return the mask of the surface voxels of a column: the solid voxels that
+// are on the map border or have an empty neighbor.
+static uint64_t get_surface_mask(const map_t *map, int x, int y)
+{
+    uint64_t m = map->mask[x][y], inside;
+    if (!m) return 0;
+    if (x == 0 || x == 511 || y == 0 || y == 511) return m;
+    inside = (m << 1) & (m >> 1) &
+             map->mask[x - 1][y] & map->mask[x + 1][y] &
+             map->mask[x][y - 1] & map->mask[x][y + 1];
+    return m & ~inside;
 }
 
 static void write_color(FILE *f, uint32_t color)
@@ -155,15 +170,18 @@ static void write_color(FILE *f, uint32_t color)
 }
 
 #define MAP_Z  64
-void write_map(const char *filename,
-               uint8_t map[512][512][64],
-               uint32_t color[512][512][64])
+static void write_map(const char *filename, const map_t *map)
 {
     int i,j,k;
+    uint64_t solid, surface;
+    const uint32_t *color;
     FILE *f = fopen(filename, "wb");
 
     for (j = 0; j < 512; ++j) {
         for (i=0; i < 512; ++i) {
+            solid = map->mask[i][j];
+            surface = get_surface_mask(map, i, j);
+            color = map->colors[i][j] ? *map->colors[i][j] : NULL;
             k = 0;
             while (k < MAP_Z) {
                 int z;
@@ -178,17 +196,17 @@ void write_map(const char *filename,
 
                 // find the air region
                 air_start = k;
-                while (k < MAP_Z && !map[i][j][k])
+                while (k < MAP_Z && !bit(solid, k))
                     ++k;
 
                 // find the top region
                 top_colors_start = k;
-                while (k < MAP_Z && is_surface(i,j,k,map))
+                while (k < MAP_Z && bit(surface, k))
                     ++k;
                 top_colors_end = k;
 
                 // now skip past the solid voxels
-                while (k < MAP_Z && map[i][j][k] && !is_surface(i,j,k,map))
+                while (k < MAP_Z && bit(solid, k) && !bit(surface, k))
                     ++k;
 
                 // at the end of the solid voxels, we have colored voxels.
@@ -200,7 +218,7 @@ void write_map(const char *filename,
                 bottom_colors_start = k;
 
                 z = k;
-                while (z < MAP_Z && is_surface(i,j,z,map))
+                while (z < MAP_Z && bit(surface, z))
                     ++z;
 
                 if (z == MAP_Z || 0)
@@ -209,7 +227,7 @@ void write_map(const char *filename,
                 else {
                     // otherwise, these are real bottom colors so we can write
                     // them
-                    while (is_surface(i,j,k,map))
+                    while (bit(surface, k))
                         ++k;
                 }
                 bottom_colors_end = k;
@@ -230,9 +248,9 @@ void write_map(const char *filename,
                 fputc(air_start, f);
 
                 for (z=0; z < top_colors_len; ++z)
-                    write_color(f, color[i][j][top_colors_start + z]);
+                    write_color(f, color[top_colors_start + z]);
                 for (z=0; z < bottom_colors_len; ++z)
-                    write_color(f, color[i][j][bottom_colors_start + z]);
+                    write_color(f, color[bottom_colors_start + z]);
             }
         }
     }
@@ -241,30 +259,48 @@ void write_map(const char *filename,
 
 static int export_as_vxl(const image_t *image, const char *path)
 {
-    uint8_t (*map)[512][512][64];
-    uint32_t (*color)[512][512][64];
-    const mesh_t *mesh = goxel_get_layers_mesh(image);
-    mesh_iterator_t iter = {0};
-    uint8_t c[4];
-    int x, y, z, pos[3];
+    const int N = BLOCK_SIZE;
+    map_t *map;
+    const mesh_t *mesh = image_get_layers_mesh(image);
+    mesh_iterator_t iter;
+    uint8_t (*data)[4];
+    int i, x, y, z, bpos[3], pos[3];
     assert(path);
 
     map = calloc(1, sizeof(*map));
-    color = calloc(1, sizeof(*color));
-    for (z = 0; z < 64; z++)
-    for (y = 0; y < 512; y++)
-    for (x = 0; x < 512; x++) {
-        pos[0] = 256 - x;
-        pos[1] = y - 256;
-        pos[2] = 31 - z;
-        mesh_get_at(mesh, &iter, pos, c);
-        if (c[3] <= 127) continue;
-        (*map)[x][y][z] = 1;
-        memcpy(&((*color)[x][y][z]), c, 4);
+    data = malloc(N * N * N * sizeof(*data));
+
+    // Only visit the existing blocks of the mesh.
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        // Skip the blocks outside of the map.
+        if (bpos[0] + N <= -255 || bpos[0] > 256 ||
+            bpos[1] + N <= -256 || bpos[1] > 255 ||
+            bpos[2] + N <= -32  || bpos[2] > 31) continue;
+        mesh_read(mesh, bpos, (int[]){N, N, N}, (uint8_t*)data);
+        for (i = 0; i < N * N * N; i++) {
+            if (data[i][3] <= 127) continue;
+            pos[0] = bpos[0] + i % N;
+            pos[1] = bpos[1] + i / N % N;
+            pos[2] = bpos[2] + i / (N * N);
+            x = 256 - pos[0];
+            y = pos[1] + 256;
+            z = 31 - pos[2];
+            if (x < 0 || x >= 512 || y < 0 || y >= 512 || z < 0 || z >= 64)
+                continue;
+            map->mask[x][y] |= 1ULL << z;
+            if (!map->colors[x][y])
+                map->colors[x][y] = calloc(1, sizeof(*map->colors[x][y]));
+            memcpy(&(*map->colors[x][y])[z], data[i], 4);
+        }
     }
-    write_map(path, *map, *color);
+    free(data);
+
+    write_map(path, map);
+    for (y = 0; y < 512; y++)
+    for (x = 0; x < 512; x++)
+        free(map->colors[x][y]);
     free(map);
-    free(color);
     return 0;
 }
 
@@ -18,6 +18,11 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "pointcloud.h"
+#include "voxelize.h"
+#include "xxhash.h"
+
+#include <errno.h>
 
 typedef struct {
     union {
@@ -35,16 +40,54 @@ typedef struct {
 
 static UT_icd line_icd = {sizeof(line_t), NULL, NULL, NULL};
 
-static int lines_find(UT_array *lines, const line_t *line, int search_nb)
+// List of unique lines, with an open addressing hash table of the lines
+// indices + 1 to weld the duplicates.
+typedef struct {
+    UT_array    *lines;
+    int         *table;
+    int         capacity;
+} lines_t;
+
+static void lines_init(lines_t *lines)
+{
+    utarray_new(lines->lines, &line_icd);
+    lines->capacity = 1024;
+    lines->table = calloc(lines->capacity, sizeof(*lines->table));
+}
+
+static void lines_release(lines_t *lines)
 {
-    int i, len;
-    line_t *l;
-    len = utarray_len(lines);
-    for (i = len - 1; (i >= 0) && (i > len - 1 - search_nb); i--) {
-        l = (line_t*)utarray_eltptr(lines, i);
-        if (memcmp(l, line, sizeof(*line)) == 0) return i + 1;
+    utarray_free(lines->lines);
+    free(lines->table);
+}
+
+static int lines_len(const lines_t *lines)
+{
+    return utarray_len(lines->lines);
+}
+
+static int *lines_find(lines_t *lines, const line_t *line)
+{
+    uint32_t h;
+    const line_t *l;
+    h = XXH32(line, sizeof(*line), 0);
+    for (h &= lines->capacity - 1; lines->table[h];
+         h = (h + 1) & (lines->capacity - 1)) {
+        l = (line_t*)utarray_eltptr(lines->lines, lines->table[h] - 1);
+        if (memcmp(l, line, sizeof(*line)) == 0) break;
+    }
+    return &lines->table[h];
+}
+
+static void lines_grow(lines_t *lines)
+{
+    int i, len = lines_len(lines);
+    free(lines->table);
+    lines->capacity *= 2;
+    lines->table = calloc(lines->capacity, sizeof(*lines->table));
+    for (i = 0; i < len; i++) {
+        *lines_find(lines, (line_t*)utarray_eltptr(lines->lines, i)) = i + 1;
     }
-    return 0;
 }
 
 /*
@@ -54,163 +97,747 @@ static int lines_find(UT_array *lines, const line_t *line, int search_nb)
  * Parameters:
  *   lines      - The list.
  *   line       - The new line we want to add.
- *   search_nb  - How far into the list we search for a similar line.  If
- *                a similar line is found we just return its index insead
- *                of adding a new one.
+ *   weld       - If set and a similar line is already in the list, we just
+ *                return its index instead of adding a new one.
  */
-static int lines_add(UT_array *lines, const line_t *line, int search_nb)
+static int lines_add(lines_t *lines, const line_t *line, bool weld)
 {
-    int idx;
-    idx = lines_find(lines, line, search_nb);
-    if (idx) return idx;
-    utarray_push_back(lines, line);
-    return utarray_len(lines);
+    int *idx;
+    if (!weld) {
+        utarray_push_back(lines->lines, line);
+        return lines_len(lines);
+    }
+    idx = lines_find(lines, line);
+    if (*idx) return *idx;
+    utarray_push_back(lines->lines, line);
+    *idx = lines_len(lines);
+    if (lines_len(lines) * 2 > lines->capacity) lines_grow(lines);
+    return lines_len(lines);
 }
 
-static int export(const mesh_t *mesh, const char *path, bool ply)
+// Buffered output, a lot faster than calling fprintf for each line.
+typedef struct {
+    FILE    *file;
+    char    *buf;
+    int     len;
+} writer_t;
+
+enum { WRITER_BUF_SIZE = 1 << 20 };
+
+static void writer_flush(writer_t *w)
 {
-    // XXX: Merge faces that can be merged into bigger ones.
-    //      Allow to chose between quads or triangles.
-    //      Also export mlt file for the colors.
-    voxel_vertex_t* verts;
+    fwrite(w->buf, 1, w->len, w->file);
+    w->len = 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void writer_printf(writer_t *w, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    // No line is bigger than 256 bytes.
+    if (w->len + 256 > WRITER_BUF_SIZE) writer_flush(w);
+    va_start(ap, fmt);
+    n = vsnprintf(w->buf + w->len, WRITER_BUF_SIZE - w->len, fmt, ap);
+    va_end(ap);
+    w->len += min(n, WRITER_BUF_SIZE - w->len - 1);
+}
+
+typedef struct {
+    lines_t f, v, vn;
+    int size;
+} export_t;
+
+static int add_block(void *user, const mesh_block_vertices_t *b)
+{
+    export_t *e = user;
+    const voxel_vertex_t *verts = b->verts;
+    const int size = b->size;
     float v[3];
-    uint8_t c[3];
-    int nb_elems, i, j, bpos[3];
-    float mat[4][4];
-    FILE *out;
-    const int N = BLOCK_SIZE;
-    int size = 0, subdivide;
-    UT_array *lines_f, *lines_v, *lines_vn;
-    line_t line, face, *line_ptr = NULL;
-    mesh_iterator_t iter;
-
-    utarray_new(lines_f, &line_icd);
-    utarray_new(lines_v, &line_icd);
-    utarray_new(lines_vn, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    face = (line_t){};
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, bpos)) {
-        mat4_set_identity(mat);
-        mat4_itranslate(mat, bpos[0], bpos[1], bpos[2]);
-        nb_elems = mesh_generate_vertices(mesh, bpos,
-                                    goxel.rend.settings.effects, verts,
-                                    &size, &subdivide);
-        for (i = 0; i < nb_elems; i++) {
-            // Put the vertices.
-            for (j = 0; j < size; j++) {
-                v[0] = verts[i * size + j].pos[0] / (float)subdivide;
-                v[1] = verts[i * size + j].pos[1] / (float)subdivide;
-                v[2] = verts[i * size + j].pos[2] / (float)subdivide;
-                mat4_mul_vec3(mat, v, v);
-                memcpy(c, verts[i * size + j].color, 3);
-                line = (line_t){
-                    .v = {v[0], v[1], v[2]}, .c = {c[0], c[1], c[2]}};
-                // XXX: not sure about the search nb value to use here.
-                face.vs[j] = lines_add(lines_v, &line, 1024);
-            }
-            // Put the normals
-            for (j = 0; j < size; j++) {
-                v[0] = verts[i * size + j].normal[0];
-                v[1] = verts[i * size + j].normal[1];
-                v[2] = verts[i * size + j].normal[2];
-                line = (line_t){.vn = {v[0], v[1], v[2]}};
-                face.vns[j] = lines_add(lines_vn, &line, 512);
-            }
-            lines_add(lines_f, &face, 0);
+    int i, j;
+    line_t line, face = {};
+
+    e->size = size;
+    for (i = 0; i < b->nb; i++) {
+        // Put the vertices.
+        for (j = 0; j < size; j++) {
+            v[0] = verts[i * size + j].pos[0] / (float)b->subdivide + b->pos[0];
+            v[1] = verts[i * size + j].pos[1] / (float)b->subdivide + b->pos[1];
+            v[2] = verts[i * size + j].pos[2] / (float)b->subdivide + b->pos[2];
+            line = (line_t){.v = {v[0], v[1], v[2]},
+                            .c = {verts[i * size + j].color[0],
+                                  verts[i * size + j].color[1],
+                                  verts[i * size + j].color[2]}};
+            face.vs[j] = lines_add(&e->v, &line, true);
+        }
+        // Put the normals
+        for (j = 0; j < size; j++) {
+            v[0] = verts[i * size + j].normal[0];
+            v[1] = verts[i * size + j].normal[1];
+            v[2] = verts[i * size + j].normal[2];
+            line = (line_t){.vn = {v[0], v[1], v[2]}};
+            face.vns[j] = lines_add(&e->vn, &line, true);
         }
+        lines_add(&e->f, &face, false);
+    }
+    return file_format_report_progress((b->index + 1.0) / b->count) ? 0 : -1;
+}
+
+static int export(const mesh_t *mesh, const char *path, bool ply)
+{
+    // XXX: Allow to chose between quads or triangles.
+    //      Also export mlt file for the colors.
+    writer_t out;
+    int size, ret;
+    export_t e = {};
+    lines_t *lines_f = &e.f, *lines_v = &e.v, *lines_vn = &e.vn;
+    line_t *line_ptr = NULL;
+
+    lines_init(lines_f);
+    lines_init(lines_v);
+    lines_init(lines_vn);
+    ret = mesh_iter_vertices(mesh,
+            goxel.rend.settings.effects | EFFECT_MERGE_FACES |
+            EFFECT_FLAT_FACES, &e, add_block);
+    if (ret) {
+        LOG_W("Export cancelled");
+        goto end;
     }
-    out = fopen(path, "w");
+    size = e.size;
+
+    out.file = fopen(path, "w");
+    if (!out.file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        ret = -1;
+        goto end;
+    }
+    out.buf = malloc(WRITER_BUF_SIZE);
+    out.len = 0;
     if (ply) {
-        fprintf(out, "ply\n");
-        fprintf(out, "format ascii 1.0\n");
-        fprintf(out, "comment Generated from Goxel " GOXEL_VERSION_STR "\n");
-        fprintf(out, "element vertex %d\n", utarray_len(lines_v));
-        fprintf(out, "property float x\n");
-        fprintf(out, "property float y\n");
-        fprintf(out, "property float z\n");
-        fprintf(out, "property float red\n");
-        fprintf(out, "property float green\n");
-        fprintf(out, "property float blue\n");
-        fprintf(out, "element face %d\n", utarray_len(lines_f));
-        fprintf(out, "property list uchar int vertex_indices\n");
-        fprintf(out, "end_header\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
-            fprintf(out, "%g %g %g %f %f %f\n",
-                    line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
-                    line_ptr->c[0] / 255.,
-                    line_ptr->c[1] / 255.,
-                    line_ptr->c[2] / 255.);
+        writer_printf(&out, "ply\n");
+        writer_printf(&out, "format ascii 1.0\n");
+        writer_printf(&out, "comment Generated from Goxel "
+                            GOXEL_VERSION_STR "\n");
+        writer_printf(&out, "element vertex %d\n", lines_len(lines_v));
+        writer_printf(&out, "property float x\n");
+        writer_printf(&out, "property float y\n");
+        writer_printf(&out, "property float z\n");
+        writer_printf(&out, "property float red\n");
+        writer_printf(&out, "property float green\n");
+        writer_printf(&out, "property float blue\n");
+        writer_printf(&out, "element face %d\n", lines_len(lines_f));
+        writer_printf(&out, "property list uchar int vertex_indices\n");
+        writer_printf(&out, "end_header\n");
+        while( (line_ptr = (line_t*)utarray_next(lines_v->lines, line_ptr))) {
+            writer_printf(&out, "%g %g %g %f %f %f\n",
+                           line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
+                           line_ptr->c[0] / 255.,
+                           line_ptr->c[1] / 255.,
+                           line_ptr->c[2] / 255.);
         }
-        while( (line_ptr = (line_t*)utarray_next(lines_f, line_ptr))) {
+        while( (line_ptr = (line_t*)utarray_next(lines_f->lines, line_ptr))) {
             if (size == 4) {
-                fprintf(out, "4 %d %d %d %d\n", line_ptr->vs[0] - 1,
-                                                line_ptr->vs[1] - 1,
-                                                line_ptr->vs[2] - 1,
-                                                line_ptr->vs[3] - 1);
+                writer_printf(&out, "4 %d %d %d %d\n", line_ptr->vs[0] - 1,
+                                                       line_ptr->vs[1] - 1,
+                                                       line_ptr->vs[2] - 1,
+                                                       line_ptr->vs[3] - 1);
             } else {
-                fprintf(out, "3 %d %d %d\n",    line_ptr->vs[0] - 1,
-                                                line_ptr->vs[1] - 1,
-                                                line_ptr->vs[2] - 1);
+                writer_printf(&out, "3 %d %d %d\n",    line_ptr->vs[0] - 1,
+                                                       line_ptr->vs[1] - 1,
+                                                       line_ptr->vs[2] - 1);
             }
         }
     } else {
-        fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
-            fprintf(out, "v %g %g %g %f %f %f\n",
-                    line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
-                    line_ptr->c[0] / 255.,
-                    line_ptr->c[1] / 255.,
-                    line_ptr->c[2] / 255.);
+        writer_printf(&out, "# Goxel " GOXEL_VERSION_STR "\n");
+        while( (line_ptr = (line_t*)utarray_next(lines_v->lines, line_ptr))) {
+            writer_printf(&out, "v %g %g %g %f %f %f\n",
+                           line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
+                           line_ptr->c[0] / 255.,
+                           line_ptr->c[1] / 255.,
+                           line_ptr->c[2] / 255.);
         }
-        while( (line_ptr = (line_t*)utarray_next(lines_vn, line_ptr))) {
-            fprintf(out, "vn %g %g %g\n",
-                    line_ptr->vn[0], line_ptr->vn[1], line_ptr->vn[2]);
+        while( (line_ptr = (line_t*)utarray_next(lines_vn->lines, line_ptr))) {
+            writer_printf(&out, "vn %g %g %g\n",
+                           line_ptr->vn[0], line_ptr->vn[1], line_ptr->vn[2]);
         }
-        while( (line_ptr = (line_t*)utarray_next(lines_f, line_ptr))) {
+        while( (line_ptr = (line_t*)utarray_next(lines_f->lines, line_ptr))) {
             if (size == 4) {
-                fprintf(out, "f %d//%d %d//%d %d//%d %d//%d\n",
-                             line_ptr->vs[0], line_ptr->vns[0],
-                             line_ptr->vs[1], line_ptr->vns[1],
-                             line_ptr->vs[2], line_ptr->vns[2],
-                             line_ptr->vs[3], line_ptr->vns[3]);
+                writer_printf(&out, "f %d//%d %d//%d %d//%d %d//%d\n",
+                                    line_ptr->vs[0], line_ptr->vns[0],
+                                    line_ptr->vs[1], line_ptr->vns[1],
+                                    line_ptr->vs[2], line_ptr->vns[2],
+                                    line_ptr->vs[3], line_ptr->vns[3]);
             } else {
-                fprintf(out, "f %d//%d %d//%d %d//%d\n",
-                             line_ptr->vs[0], line_ptr->vns[0],
-                             line_ptr->vs[1], line_ptr->vns[1],
-                             line_ptr->vs[2], line_ptr->vns[2]);
+                writer_printf(&out, "f %d//%d %d//%d %d//%d\n",
+                                    line_ptr->vs[0], line_ptr->vns[0],
+                                    line_ptr->vs[1], line_ptr->vns[1],
+                                    line_ptr->vs[2], line_ptr->vns[2]);
             }
         }
     }
-    fclose(out);
-    utarray_free(lines_f);
-    utarray_free(lines_v);
-    utarray_free(lines_vn);
-    free(verts);
-    return 0;
+    writer_flush(&out);
+    fclose(out.file);
+    free(out.buf);
+    file_format_report_progress(1);
+end:
+    lines_release(lines_f);
+    lines_release(lines_v);
+    lines_release(lines_vn);
+    return ret;
 }
 
 static int wavefront_export(const image_t *image, const char *path)
 {
-    const mesh_t *mesh = goxel_get_layers_mesh(image);
+    const mesh_t *mesh = image_get_layers_mesh(image);
     return export(mesh, path, false);
 }
 
 int ply_export(const image_t *image, const char *path)
 {
-    const mesh_t *mesh = goxel_get_layers_mesh(image);
+    const mesh_t *mesh = image_get_layers_mesh(image);
     return export(mesh, path, true);
 }
 
+/*
+ * Import of the polygon meshes, by voxelizing their triangles.
+ */
+
+typedef struct {
+    float       pos[3];
+    uint8_t     color[4];
+    float       uv[2];
+} vertex_t;
+
+typedef struct {
+    char        name[128];
+    uint8_t     color[4];
+    int         texture;
+} obj_material_t;
+
+static UT_icd vertex_icd = {sizeof(vertex_t), NULL, NULL, NULL};
+static UT_icd material_icd = {sizeof(obj_material_t), NULL, NULL, NULL};
+static UT_icd triangle_icd = {sizeof(voxelize_triangle_t), NULL, NULL, NULL};
+static UT_icd texture_icd = {sizeof(voxelize_texture_t), NULL, NULL, NULL};
+
+typedef struct {
+    UT_array    *tris;
+    UT_array    *textures;
+} import_t;
+
+static void import_init(import_t *imp)
+{
+    utarray_new(imp->tris, &triangle_icd);
+    utarray_new(imp->textures, &texture_icd);
+}
+
+static void import_release(import_t *imp)
+{
+    voxelize_texture_t *tex = NULL;
+    while ((tex = (voxelize_texture_t*)utarray_next(imp->textures, tex)))
+        free(tex->data);
+    utarray_free(imp->tris);
+    utarray_free(imp->textures);
+}
+
+static int import_finish(import_t *imp, image_t *image)
+{
+    int ret;
+    ret = voxelize_import(image, (voxelize_triangle_t*)utarray_front(imp->tris),
+                          utarray_len(imp->tris),
+                          (voxelize_texture_t*)utarray_front(imp->textures));
+    import_release(imp);
+    return ret;
+}
+
+// Get the path of a file relative to the imported file.
+static void get_relative_path(const char *path, const char *name,
+                              char *out, int size)
+{
+    const char *sep = strrchr(path, '/');
+    if (strrchr(path, '\\') > sep) sep = strrchr(path, '\\');
+    snprintf(out, size, "%.*s%s", sep ? (int)(sep - path + 1) : 0, path, name);
+}
+
+// Load a texture file, relative to the imported file, and return its index
+// or -1.
+static int import_add_texture(import_t *imp, const char *path,
+                              const char *name)
+{
+    voxelize_texture_t tex;
+    char tex_path[1024], *data;
+    int size, bpp = 4;
+
+    get_relative_path(path, name, tex_path, sizeof(tex_path));
+    data = read_file(tex_path, &size);
+    if (!data) {
+        LOG_W("Cannot open texture %s", tex_path);
+        return -1;
+    }
+    tex.data = img_read_from_mem(data, size, &tex.w, &tex.h, &bpp);
+    free(data);
+    if (!tex.data) {
+        LOG_W("Cannot read texture %s", tex_path);
+        return -1;
+    }
+    utarray_push_back(imp->textures, &tex);
+    return utarray_len(imp->textures) - 1;
+}
+
+// Add the triangles of a polygon, as a fan.
+static void import_add_polygon(import_t *imp, const vertex_t **verts, int nb,
+                               const uint8_t color[4], int texture)
+{
+    voxelize_triangle_t tri = {.texture = texture};
+    int i, j, k;
+
+    for (i = 1; i + 1 < nb; i++) {
+        for (j = 0; j < 3; j++) {
+            const vertex_t *v = verts[j ? i + j - 1 : 0];
+            vec3_copy(v->pos, tri.pos[j]);
+            // Flip the texture coordinates, since they go up.
+            tri.uv[j][0] = v->uv[0];
+            tri.uv[j][1] = 1 - v->uv[1];
+            for (k = 0; k < 4; k++)
+                tri.color[j][k] = v->color[k] * color[k] / 255;
+        }
+        utarray_push_back(imp->tris, &tri);
+    }
+}
+
+// Split a text file into lines, in place.
+static char *next_line(char **data)
+{
+    char *line = *data;
+    if (!*line) return NULL;
+    *data += strcspn(line, "\r\n");
+    if (**data == '\r' && (*data)[1] == '\n') *(*data)++ = '\0';
+    if (**data) *(*data)++ = '\0';
+    return line;
+}
+
+static void obj_read_mtl(import_t *imp, const char *path, const char *name,
+                         UT_array *materials)
+{
+    char mtl_path[1024], *data, *p, *line, tex_name[512];
+    obj_material_t *mat = NULL;
+    float c[3];
+
+    get_relative_path(path, name, mtl_path, sizeof(mtl_path));
+    data = read_file(mtl_path, NULL);
+    if (!data) {
+        LOG_W("Cannot open material file %s", mtl_path);
+        return;
+    }
+    p = data;
+    while ((line = next_line(&p))) {
+        line += strspn(line, " \t");
+        if (strncmp(line, "newmtl ", 7) == 0) {
+            utarray_extend_back(materials);
+            mat = (obj_material_t*)utarray_back(materials);
+            if (!mat) continue;
+            snprintf(mat->name, sizeof(mat->name), "%s", line + 7);
+            memset(mat->color, 255, 4);
+            mat->texture = -1;
+        }
+        if (!mat) continue;
+        if (sscanf(line, "Kd %f %f %f", &c[0], &c[1], &c[2]) == 3) {
+            mat->color[0] = clamp(c[0] * 255, 0, 255);
+            mat->color[1] = clamp(c[1] * 255, 0, 255);
+            mat->color[2] = clamp(c[2] * 255, 0, 255);
+        }
+        if (sscanf(line, "map_Kd %511[^\n]", tex_name) == 1)
+            mat->texture = import_add_texture(imp, mtl_path, tex_name);
+    }
+    free(data);
+}
+
+// Get a vertex from an obj index, that starts at one, or is relative to
+// the end of the list if negative.
+static const void *obj_get(UT_array *array, int i)
+{
+    i = i < 0 ? (int)utarray_len(array) + i : i - 1;
+    if (i < 0 || i >= (int)utarray_len(array)) return NULL;
+    return utarray_eltptr(array, i);
+}
+
+static int wavefront_import(image_t *image, const char *path)
+{
+    import_t imp;
+    UT_array *positions, *uvs, *materials;
+    vertex_t v, face[64];
+    const vertex_t *verts[64];
+    const vertex_t *pos, *uv;
+    const obj_material_t *mat = NULL;
+    const uint8_t white[4] = {255, 255, 255, 255};
+    char *data, *p, *line, *tok, *save, name[512];
+    float c[3];
+    int nb, n, i, vi, ti;
+
+    data = read_file(path, NULL);
+    if (!data) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    import_init(&imp);
+    utarray_new(positions, &vertex_icd);
+    utarray_new(uvs, &vertex_icd);
+    utarray_new(materials, &material_icd);
+
+    p = data;
+    while ((line = next_line(&p))) {
+        line += strspn(line, " \t");
+        if (strncmp(line, "v ", 2) == 0) {
+            v = (vertex_t){.color = {255, 255, 255, 255}};
+            n = sscanf(line, "v %f %f %f %f %f %f", &v.pos[0], &v.pos[1],
+                       &v.pos[2], &c[0], &c[1], &c[2]);
+            if (n < 3) continue;
+            if (n == 6) {
+                for (i = 0; i < 3; i++) v.color[i] = clamp(c[i] * 255, 0, 255);
+            }
+            utarray_push_back(positions, &v);
+        } else if (strncmp(line, "vt ", 3) == 0) {
+            v = (vertex_t){};
+            sscanf(line, "vt %f %f", &v.uv[0], &v.uv[1]);
+            utarray_push_back(uvs, &v);
+        } else if (sscanf(line, "mtllib %511[^\n]", name) == 1) {
+            obj_read_mtl(&imp, path, name, materials);
+        } else if (sscanf(line, "usemtl %511[^\n]", name) == 1) {
+            mat = NULL;
+            while ((mat = (obj_material_t*)utarray_next(materials, mat))) {
+                if (strcmp(mat->name, name) == 0) break;
+            }
+        } else if (strncmp(line, "f ", 2) == 0) {
+            nb = 0;
+            for (tok = strtok_r(line + 2, " \t", &save); tok && nb < 64;
+                 tok = strtok_r(NULL, " \t", &save)) {
+                vi = ti = 0;
+                if (sscanf(tok, "%d/%d", &vi, &ti) < 1) continue;
+                pos = obj_get(positions, vi);
+                if (!pos) continue;
+                face[nb] = *pos;
+                uv = ti ? obj_get(uvs, ti) : NULL;
+                if (uv) memcpy(face[nb].uv, uv->uv, sizeof(face[nb].uv));
+                verts[nb] = &face[nb];
+                nb++;
+            }
+            import_add_polygon(&imp, verts, nb, mat ? mat->color : white,
+                               mat ? mat->texture : -1);
+        }
+    }
+    free(data);
+    utarray_free(positions);
+    utarray_free(uvs);
+    utarray_free(materials);
+    return import_finish(&imp, image);
+}
+
+enum {
+    PLY_ASCII,
+    PLY_BINARY_LE,
+    PLY_BINARY_BE,
+};
+
+typedef struct {
+    char        name[64];
+    int         type;       // Size in bytes, negative for signed, and
+                            // zero for float, one for double, see ply_read.
+    bool        is_list;
+    int         count_type;
+} ply_property_t;
+
+typedef struct {
+    char            name[64];
+    int             count;
+    int             nb_props;
+    ply_property_t  props[32];
+} ply_element_t;
+
+typedef struct {
+    int         format;
+    const char  *p;
+    const char  *end;
+    bool        error;
+} ply_reader_t;
+
+enum {
+    PLY_FLOAT = 100,
+    PLY_DOUBLE,
+};
+
+static int ply_parse_type(const char *name)
+{
+    const struct {
+        const char *name;
+        int type;
+    } TYPES[] = {
+        {"char", -1}, {"int8", -1}, {"uchar", 1}, {"uint8", 1},
+        {"short", -2}, {"int16", -2}, {"ushort", 2}, {"uint16", 2},
+        {"int", -4}, {"int32", -4}, {"uint", 4}, {"uint32", 4},
+        {"float", PLY_FLOAT}, {"float32", PLY_FLOAT},
+        {"double", PLY_DOUBLE}, {"float64", PLY_DOUBLE},
+    };
+    int i;
+    for (i = 0; i < ARRAY_SIZE(TYPES); i++) {
+        if (strcmp(TYPES[i].name, name) == 0) return TYPES[i].type;
+    }
+    return 0;
+}
+
+static double ply_read(ply_reader_t *r, int type)
+{
+    uint8_t buf[8];
+    int i, size;
+    uint64_t u = 0;
+    char *end;
+    double ret;
+    float f;
+
+    if (r->format == PLY_ASCII) {
+        ret = strtod(r->p, &end);
+        if (end == r->p) r->error = true;
+        r->p = end;
+        return ret;
+    }
+    size = type == PLY_FLOAT ? 4 : type == PLY_DOUBLE ? 8 : abs(type);
+    if (r->end - r->p < size) {
+        r->error = true;
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = r->p[r->format == PLY_BINARY_LE ? i : size - 1 - i];
+        u |= (uint64_t)buf[i] << (i * 8);
+    }
+    r->p += size;
+    if (type == PLY_FLOAT) {
+        memcpy(&f, buf, 4);
+        return f;
+    }
+    if (type == PLY_DOUBLE) {
+        memcpy(&ret, buf, 8);
+        return ret;
+    }
+    if (type > 0) return u;
+    // Sign extension.
+    return (int64_t)(u << (64 - size * 8)) >> (64 - size * 8);
+}
+
+static int ply_find_prop(const ply_element_t *elem, const char *const *names)
+{
+    int i;
+    for (; *names; names++) {
+        for (i = 0; i < elem->nb_props; i++) {
+            if (strcmp(elem->props[i].name, *names) == 0) return i;
+        }
+    }
+    return -1;
+}
+
+// Read all the values of a list property, and return the number of values.
+static int ply_read_list(ply_reader_t *r, const ply_property_t *prop,
+                         double *out, int size)
+{
+    int i, n;
+    double v;
+
+    n = ply_read(r, prop->count_type);
+    if (n < 0) r->error = true;
+    for (i = 0; i < n && !r->error; i++) {
+        v = ply_read(r, prop->type);
+        if (i < size) out[i] = v;
+    }
+    return min(n, size);
+}
+
+// The vertices of a ply file without faces, imported as a point cloud.
+typedef struct {
+    pointcloud_reader_t reader;
+    const vertex_t  *vertices;
+    int             nb;
+    int             pos;
+} ply_points_t;
+
+static int ply_points_read(pointcloud_reader_t *reader,
+                           pointcloud_point_t *points, int size)
+{
+    ply_points_t *r = (void*)reader;
+    const vertex_t *v;
+    int i, k;
+
+    size = min(size, r->nb - r->pos);
+    for (i = 0; i < size; i++) {
+        v = &r->vertices[r->pos++];
+        for (k = 0; k < 3; k++) points[i].pos[k] = v->pos[k];
+        memcpy(points[i].color, v->color, 3);
+    }
+    return size;
+}
+
+static int ply_points_rewind(pointcloud_reader_t *reader)
+{
+    ((ply_points_t*)reader)->pos = 0;
+    return 0;
+}
+
+static int ply_import(image_t *image, const char *path)
+{
+    import_t imp;
+    ply_element_t elems[16], *elem;
+    ply_property_t *prop;
+    ply_reader_t r = {};
+    vertex_t *vertices = NULL, face[64];
+    const vertex_t *verts[64];
+    const uint8_t white[4] = {255, 255, 255, 255};
+    int nb_elems = 0, nb_vertices = 0, size, i, j, k, n, nb, nb_uvs;
+    int texture = -1, attrs[9], idx_prop, uv_prop, ret;
+    bool has_faces = false;
+    ply_points_t points = {
+        .reader = {.read = ply_points_read, .rewind = ply_points_rewind,
+                   .y_up = true},
+    };
+    char *data, *p, *line, name[512], type[32], count_type[32];
+    double values[32], indices[64], uvs[128];
+
+    static const char *const ATTRS[9][4] = {
+        {"x"}, {"y"}, {"z"}, {"red", "r"}, {"green", "g"}, {"blue", "b"},
+        {"alpha", "a"}, {"u", "s", "texture_u"}, {"v", "t", "texture_v"}};
+
+    data = read_file(path, &size);
+    if (!data) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    import_init(&imp);
+    p = data;
+    if (!(line = next_line(&p)) || strcmp(line, "ply") != 0) goto error;
+    while (true) {
+        if (!(line = next_line(&p))) goto error;
+        if (strcmp(line, "end_header") == 0) break;
+        if (strcmp(line, "format ascii 1.0") == 0)
+            r.format = PLY_ASCII;
+        else if (strcmp(line, "format binary_little_endian 1.0") == 0)
+            r.format = PLY_BINARY_LE;
+        else if (strcmp(line, "format binary_big_endian 1.0") == 0)
+            r.format = PLY_BINARY_BE;
+        else if (sscanf(line, "comment TextureFile %511[^\n]", name) == 1)
+            texture = import_add_texture(&imp, path, name);
+        else if (strncmp(line, "element ", 8) == 0) {
+            if (nb_elems >= ARRAY_SIZE(elems)) goto error;
+            elem = &elems[nb_elems++];
+            memset(elem, 0, sizeof(*elem));
+            if (sscanf(line, "element %63s %d", elem->name,
+                       &elem->count) != 2) goto error;
+        } else if (strncmp(line, "property ", 9) == 0) {
+            if (!nb_elems) goto error;
+            elem = &elems[nb_elems - 1];
+            if (elem->nb_props >= ARRAY_SIZE(elem->props)) goto error;
+            prop = &elem->props[elem->nb_props++];
+            if (sscanf(line, "property list %31s %31s %63s", count_type, type,
+                       prop->name) == 3) {
+                prop->is_list = true;
+                prop->count_type = ply_parse_type(count_type);
+            } else if (sscanf(line, "property %31s %63s", type,
+                              prop->name) != 2) {
+                goto error;
+            }
+            prop->type = ply_parse_type(type);
+            if (!prop->type || (prop->is_list && !prop->count_type))
+                goto error;
+        }
+    }
+    // The binary data starts just after the header.
+    r.p = p;
+    r.end = data + size;
+
+    for (i = 0; i < nb_elems; i++) {
+        elem = &elems[i];
+        for (k = 0; k < 9; k++) attrs[k] = ply_find_prop(elem, ATTRS[k]);
+        idx_prop = ply_find_prop(elem, (const char*[]){
+                "vertex_indices", "vertex_index", NULL});
+        uv_prop = ply_find_prop(elem, (const char*[]){"texcoord", NULL});
+        if (strcmp(elem->name, "vertex") == 0) {
+            free(vertices);
+            nb_vertices = elem->count;
+            vertices = calloc(max(nb_vertices, 1), sizeof(*vertices));
+        }
+        for (j = 0; j < elem->count && !r.error; j++) {
+            nb = nb_uvs = 0;
+            for (k = 0; k < elem->nb_props; k++) {
+                prop = &elem->props[k];
+                if (!prop->is_list)
+                    values[k] = ply_read(&r, prop->type);
+                else if (k == idx_prop)
+                    nb = ply_read_list(&r, prop, indices, ARRAY_SIZE(indices));
+                else if (k == uv_prop)
+                    nb_uvs = ply_read_list(&r, prop, uvs, ARRAY_SIZE(uvs));
+                else
+                    ply_read_list(&r, prop, NULL, 0);
+            }
+            if (r.error) break;
+            if (strcmp(elem->name, "vertex") == 0) {
+                vertices[j] = (vertex_t){.color = {255, 255, 255, 255}};
+                for (k = 0; k < 9; k++) {
+                    if (attrs[k] < 0) continue;
+                    if (k < 3) {
+                        vertices[j].pos[k] = values[attrs[k]];
+                    } else if (k < 7) {
+                        // Colors can be floats between 0 and 1.
+                        vertices[j].color[k - 3] = clamp(values[attrs[k]] *
+                            (elem->props[attrs[k]].type >= PLY_FLOAT ?
+                             255 : 1), 0, 255);
+                    } else {
+                        vertices[j].uv[k - 7] = values[attrs[k]];
+                    }
+                }
+            }
+            if (strcmp(elem->name, "face") == 0) {
+                has_faces = true;
+                for (k = 0; k < nb; k++) {
+                    n = indices[k];
+                    if (n < 0 || n >= nb_vertices) break;
+                    face[k] = vertices[n];
+                    if (k * 2 + 1 < nb_uvs) {
+                        face[k].uv[0] = uvs[k * 2 + 0];
+                        face[k].uv[1] = uvs[k * 2 + 1];
+                    }
+                    verts[k] = &face[k];
+                }
+                if (k == nb)
+                    import_add_polygon(&imp, verts, nb, white, texture);
+            }
+        }
+        if (r.error) goto error;
+    }
+    free(data);
+    // Without any face, this is a point cloud, like the scans.
+    if (!has_faces && nb_vertices) {
+        points.vertices = vertices;
+        points.nb = nb_vertices;
+        ret = pointcloud_import(image, &points.reader);
+        free(vertices);
+        import_release(&imp);
+        return ret;
+    }
+    free(vertices);
+    return import_finish(&imp, image);
+
+error:
+    LOG_E("Cannot parse ply file %s", path);
+    free(vertices);
+    free(data);
+    import_release(&imp);
+    return -1;
+}
+
 FILE_FORMAT_REGISTER(obj,
     .name = "obj",
     .ext = "obj\0*.obj\0",
+    .import_func = wavefront_import,
     .export_func = wavefront_export,
 )
 
 FILE_FORMAT_REGISTER(ply,
     .name = "ply",
     .ext = "ply\0*.ply\0",
+    .import_func = ply_import,
     .export_func = ply_export,
 )
@@ -0,0 +1,155 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * XYZ point clouds.
+ *
+ * Text files with one point per line, as 'x y z' values separated by
+ * spaces, tabs, commas or semicolons, with the z axis up.  If there are
+ * at least six values, the last three are the color, as integers between
+ * 0 and 255, so that the common 'x y z r g b', 'x y z i r g b' and
+ * 'x y z nx ny nz r g b' variants all work.  The lines that don't start
+ * with three numbers, like the headers, are ignored.
+ *
+ * The file is read in chunks, twice, since we first need the bounds of
+ * the cloud, see <pointcloud_import>.
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+#include "pointcloud.h"
+
+#include <errno.h>
+
+#define BUF_SIZE (1 << 20)
+
+typedef struct {
+    pointcloud_reader_t reader;
+    FILE        *file;
+    char        *buf;       // BUF_SIZE + 1 bytes.
+    int         start;      // Start of the unparsed data in the buffer.
+    int         end;
+    bool        eof;
+    bool        error;
+} xyz_reader_t;
+
+// Return the next line of the file, or NULL at the end.
+static char *xyz_next_line(xyz_reader_t *r)
+{
+    char *line, *nl;
+    int n;
+
+    while (true) {
+        line = r->buf + r->start;
+        nl = memchr(line, '\n', r->end - r->start);
+        if (nl) {
+            *nl = '\0';
+            r->start = nl - r->buf + 1;
+            return line;
+        }
+        // Without a new line, the rest of the buffer is the last line, or
+        // a line too long to be a point.
+        if (r->eof || (r->start == 0 && r->end == BUF_SIZE)) {
+            if (r->start == r->end) return NULL;
+            r->buf[r->end] = '\0';
+            r->start = r->end;
+            return line;
+        }
+        memmove(r->buf, line, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        n = fread(r->buf + r->end, 1, BUF_SIZE - r->end, r->file);
+        r->end += n;
+        if (n == 0) {
+            r->eof = true;
+            r->error = ferror(r->file);
+        }
+    }
+}
+
+static int xyz_parse_line(const char *line, double *values, int size)
+{
+    int n;
+    char *end;
+
+    for (n = 0; n < size; n++) {
+        line += strspn(line, " \t,;\r");
+        values[n] = strtod(line, &end);
+        if (end == line) break;
+        line = end;
+    }
+    return n;
+}
+
+static int xyz_read(pointcloud_reader_t *reader,
+                    pointcloud_point_t *points, int size)
+{
+    xyz_reader_t *r = (void*)reader;
+    const char *line;
+    double values[16];
+    int nb = 0, n, k;
+
+    while (nb < size && (line = xyz_next_line(r))) {
+        n = xyz_parse_line(line, values, ARRAY_SIZE(values));
+        if (n < 3) continue;
+        for (k = 0; k < 3; k++) {
+            points[nb].pos[k] = values[k];
+            points[nb].color[k] = n >= 6 ? clamp(values[n - 3 + k], 0, 255)
+                                         : 255;
+        }
+        nb++;
+    }
+    if (r->error) {
+        LOG_E("Cannot read xyz file");
+        return -1;
+    }
+    return nb;
+}
+
+static int xyz_rewind(pointcloud_reader_t *reader)
+{
+    xyz_reader_t *r = (void*)reader;
+    r->start = r->end = 0;
+    r->eof = false;
+    return fseek(r->file, 0, SEEK_SET);
+}
+
+static int xyz_import(image_t *image, const char *path)
+{
+    xyz_reader_t r = {
+        .reader = {.read = xyz_read, .rewind = xyz_rewind},
+    };
+    int ret;
+
+    r.file = fopen(path, "rb");
+    if (!r.file) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    r.buf = malloc(BUF_SIZE + 1);
+    ret = pointcloud_import(image, &r.reader);
+    free(r.buf);
+    fclose(r.file);
+    return ret;
+}
+
+FILE_FORMAT_REGISTER(xyz,
+    .name = "xyz",
+    .ext = "xyz\0*.xyz\0",
+    .import_func = xyz_import,
+)
@@ -19,14 +19,98 @@
 #include "goxel.h"
 #include "xxhash.h"
 #include "file_format.h"
+#include "gpu_ops.h"
+#include "offscreen.h"
 
 #include "shader_cache.h"
+#include "utils/frame_tasks.h"
+#include "utils/parallel.h"
 
 #include <stdarg.h>
 
+// Lowest resolution scale used by the dynamic resolution.
+#define DYNRES_MIN_SCALE 0.25f
+
 // The global goxel instance.
 goxel_t goxel = {};
 
+// An image texture being decoded in a background task.
+typedef struct image_load image_load_t;
+struct image_load {
+    image_load_t *next, *prev;
+    texture_t   *tex;
+    char        *data;      // The encoded file.
+    int         size;
+    uint8_t     *img;       // The decoded pixels, set by the task.
+    int         w, h, bpp;
+    task_t      *task;
+};
+
+static image_load_t *g_image_loads = NULL;
+
+static void image_load_task(void *user)
+{
+    image_load_t *load = user;
+    load->img = img_read_from_mem(load->data, load->size,
+                                  &load->w, &load->h, &load->bpp);
+}
+
+static void image_load_upload(void *user);
+
+static void image_load_delete(image_load_t *load)
+{
+    frame_task_remove(image_load_upload, load);
+    DL_DELETE(g_image_loads, load);
+    task_delete(load->task);
+    texture_delete(load->tex);
+    free(load->data);
+    free(load->img);
+    free(load);
+}
+
+// Upload a decoded image, run as a frame task.
+static void image_load_upload(void *user)
+{
+    image_load_t *load = user;
+    texture_t *tex = load->tex;
+
+    if (!load->img || load->w != tex->w || load->h != tex->h) {
+        LOG_E("Cannot decode image %s", tex->path);
+    } else if (tex->ref > 1) { // Otherwise nobody uses it anymore.
+        texture_set_data(tex, load->img, load->w, load->h, load->bpp);
+    }
+    tex->flags &= ~TF_ASYNC;
+    image_load_delete(load);
+}
+
+// Called on the main thread by tasks_update once an image is decoded.
+static void image_load_done(void *user)
+{
+    frame_task_add(0, image_load_upload, user);
+}
+
+static texture_t *texture_new_image_async(const char *path, int flags)
+{
+    image_load_t *load;
+    int w, h;
+
+    load = calloc(1, sizeof(*load));
+    load->data = read_file(path, &load->size);
+    if (!load->data || !img_get_size_from_mem(load->data, load->size,
+                                              &w, &h)) {
+        LOG_E("Cannot open image %s", path);
+        free(load->data);
+        free(load);
+        return NULL;
+    }
+    load->tex = texture_new_empty(w, h, flags);
+    load->tex->path = strdup(path);
+    DL_APPEND(g_image_loads, load);
+    load->task = task_start_full(image_load_task, image_load_done, load,
+                                 0, NULL);
+    return texture_copy(load->tex);
+}
+
 texture_t *texture_new_image(const char *path, int flags)
 {
     char *data;
@@ -36,6 +120,10 @@ texture_t *texture_new_image(const char *path, int flags)
     int w, h, bpp = 0;
     texture_t *tex;
 
+    if ((flags & TF_ASYNC) && !str_startswith(path, "asset://"))
+        return texture_new_image_async(path, flags);
+    flags &= ~TF_ASYNC;
+
     if (str_startswith(path, "asset://")) {
         data = (char*)assets_get(path, &size);
     } else {
@@ -53,14 +141,20 @@ texture_t *texture_new_image(const char *path, int flags)
 static void unpack_pos_data(uint32_t v, int pos[3], int *face,
                             int *cube_id)
 {
-    assert(BLOCK_SIZE == 16);
     int x, y, z, f, i;
     x = v >> 28;
     y = (v >> 24) & 0x0f;
     z = (v >> 20) & 0x0f;
-    f = (v >> 16) & 0x0f;
-    i = v & 0xffff;
+    f = (v >> 16) & 0x07;
+    i = (v & 0xffff) | (((v >> 19) & 0x01) << 16);
     assert(f < 6);
+#if BLOCK_SIZE > 16
+    // The low bits of the id give the 16^3 cube of the block.
+    x += (i & 1) * 16;
+    y += ((i >> 1) & 1) * 16;
+    z += ((i >> 2) & 1) * 16;
+    i >>= RENDER_PICK_SUB_BITS;
+#endif
     pos[0] = x;
     pos[1] = y;
     pos[2] = z;
@@ -82,7 +176,7 @@ void inputs_insert_char(inputs_t *inputs, uint32_t c)
     }
 }
 
-static camera_t *get_camera(void)
+static camera_t *get_image_camera(void)
 {
     if (!goxel.image->cameras)
         image_add_camera(goxel.image, NULL);
@@ -91,6 +185,73 @@ static camera_t *get_camera(void)
     return goxel.image->cameras;
 }
 
+// Orthographic camera of a split view, initially looking at the same
+// target as the image camera.
+static camera_t *get_view_camera(int view)
+{
+    static const struct {
+        const char *name;
+        float rz, rx;
+    } VIEWS[] = {
+        [1] = {"front", 0, 90},
+        [2] = {"right", -90, 90},
+        [3] = {"top", 0, 0},
+    };
+    const camera_t *image_camera;
+    camera_t *camera = goxel.views.cameras[view];
+    float target[3];
+
+    if (camera) return camera;
+    image_camera = get_image_camera();
+    mat4_mul_vec3(image_camera->mat, VEC(0, 0, -image_camera->dist), target);
+    camera = camera_new(VIEWS[view].name);
+    camera->ortho = true;
+    camera->dist = image_camera->dist;
+    mat4_set_identity(camera->mat);
+    mat4_itranslate(camera->mat, target[0], target[1], target[2]);
+    mat4_itranslate(camera->mat, 0, 0, camera->dist);
+    camera_turntable(camera, VIEWS[view].rz * DD2R, VIEWS[view].rx * DD2R);
+    goxel.views.cameras[view] = camera;
+    return camera;
+}
+
+static camera_t *get_camera(void)
+{
+    if (goxel.views.split && goxel.views.current)
+        return get_view_camera(goxel.views.current);
+    return get_image_camera();
+}
+
+// The perspective view is at the top left, the top view at the top right,
+// and the front and right views below them, with one pixel between them.
+void goxel_get_view_rect(const float viewport[4], int view, float out[4])
+{
+    const int POS[4][2] = {{0, 1}, {0, 0}, {1, 0}, {1, 1}};
+    float w = floorf((viewport[2] - 1) / 2);
+    float h = floorf((viewport[3] - 1) / 2);
+
+    out[0] = viewport[0] + POS[view][0] * (viewport[2] - w);
+    out[1] = viewport[1] + POS[view][1] * (viewport[3] - h);
+    out[2] = w;
+    out[3] = h;
+}
+
+// Index of the split view at a given position, or the current view if the
+// position is between the views.
+static int get_view_at(const float viewport[4], const float pos[2])
+{
+    int i;
+    float rect[4];
+
+    for (i = 0; i < (int)ARRAY_SIZE(goxel.views.cameras); i++) {
+        goxel_get_view_rect(viewport, i, rect);
+        if (pos[0] >= rect[0] && pos[0] < rect[0] + rect[2] &&
+            pos[1] >= rect[1] && pos[1] < rect[1] + rect[3])
+            return i;
+    }
+    return goxel.views.current;
+}
+
 // XXX: lot of cleanup to do here.
 static bool goxel_unproject_on_plane(
         const float viewport[4], const float pos[2], const float plane[4][4],
@@ -149,16 +310,124 @@ static bool goxel_unproject_on_box(
     return false;
 }
 
+// Unproject on the visible layers using a ray cast into the meshes blocks
+// instead of the pick buffer, so that it works without graphics.  We keep
+// the nearest hit of all the layers, so that we don't need to merge them.
+static bool goxel_unproject_on_mesh_cpu(
+        const float view[4], const float pos[2],
+        float out[3], float normal[3])
+{
+    float o[3], d[3], p[3], v[3], dist, best = INFINITY;
+    int voxel_pos[3], n[3];
+    const layer_t *layer;
+
+    camera_get_ray(get_camera(), pos, view, o, d);
+    image_update(goxel.image);
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (!layer->visible || !layer->mesh) continue;
+        if (!mesh_raycast(layer->mesh, o, d, voxel_pos, n)) continue;
+        p[0] = voxel_pos[0] + 0.5 + n[0] * 0.5;
+        p[1] = voxel_pos[1] + 0.5 + n[1] * 0.5;
+        p[2] = voxel_pos[2] + 0.5 + n[2] * 0.5;
+        vec3_sub(p, o, v);
+        dist = vec3_dot(v, d);
+        if (dist >= best) continue;
+        best = dist;
+        vec3_copy(p, out);
+        normal[0] = n[0];
+        normal[1] = n[1];
+        normal[2] = n[2];
+    }
+    return best != INFINITY;
+}
+
+// Key of the pick buffer content, so that we only render it when needed.
+static uint32_t get_pick_key(const int view_size[2])
+{
+    uint32_t key = 0, k;
+    const layer_t *layer;
+    const camera_t *camera = get_camera();
+
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (!layer->visible || !layer->mesh) continue;
+        k = layer_get_key(layer);
+        key = XXH32(&k, sizeof(k), key);
+    }
+    key = XXH32(view_size, 2 * sizeof(*view_size), key);
+    key = XXH32(camera->view_mat, sizeof(camera->view_mat), key);
+    key = XXH32(camera->proj_mat, sizeof(camera->proj_mat), key);
+    key = XXH32(&goxel.rend.settings.effects,
+                sizeof(goxel.rend.settings.effects), key);
+    return key ?: 1;
+}
+
+/*
+ * Read a pixel of the pick buffer.
+ *
+ * After the buffer got rendered, we start an asynchronous read of the whole
+ * buffer into a pixel buffer object.  The calls of the next frames then get
+ * the pixels from the CPU copy, without stalling the pipeline.
+ */
+static uint32_t pick_read_pixel(int x, int y)
+{
+    uint32_t pixel;
+    int w = goxel.pick_fbo->w, h = goxel.pick_fbo->h;
+
+#if !defined(GLES2) || defined(GLES3)
+    const uint32_t *data;
+    if (goxel.pick_data) return goxel.pick_data[y * w + x];
+    if (goxel.pick_pbo && goxel.pick_pbo_frame != goxel.frame_count) {
+        GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, goxel.pick_pbo));
+        GL(data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, w * h * 4,
+                                   GL_MAP_READ_BIT));
+        if (data) {
+            goxel.pick_data = malloc(w * h * 4);
+            memcpy(goxel.pick_data, data, w * h * 4);
+            GL(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+        }
+        GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+        if (goxel.pick_data) return goxel.pick_data[y * w + x];
+    }
+#endif
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, goxel.pick_fbo->framebuffer));
+    GL(glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixel));
+    return pixel;
+}
+
+static void pick_start_read(void)
+{
+    free(goxel.pick_data);
+    goxel.pick_data = NULL;
+#if !defined(GLES2) || defined(GLES3)
+    int w = goxel.pick_fbo->w, h = goxel.pick_fbo->h;
+    if (!goxel.pick_pbo) GL(glGenBuffers(1, &goxel.pick_pbo));
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, goxel.pick_pbo));
+    GL(glBufferData(GL_PIXEL_PACK_BUFFER, w * h * 4, NULL, GL_STREAM_READ));
+    GL(glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    goxel.pick_pbo_frame = goxel.frame_count;
+#endif
+}
+
+/*
+ * Unproject on the visible layers, using the pick buffer.
+ *
+ * The layers meshes are rendered one after the other into the pick buffer,
+ * sharing the same blocks ids table, so that we never need to merge them.
+ */
 static bool goxel_unproject_on_mesh(
-        const float view[4], const float pos[2], const mesh_t *mesh,
+        const float view[4], const float pos[2],
         float out[3], float normal[3])
 {
+    const layer_t *layer;
     int view_size[2] = {view[2], view[3]};
-    // XXX: No need to render the fbo if it is not dirty.
+    uint32_t key;
+
     if (goxel.pick_fbo && (goxel.pick_fbo->w != view_size[0] ||
                            goxel.pick_fbo->h != view_size[1])) {
         texture_delete(goxel.pick_fbo);
         goxel.pick_fbo = NULL;
+        goxel.pick_fbo_key = 0;
     }
 
     if (!goxel.pick_fbo) {
@@ -166,10 +435,6 @@ static bool goxel_unproject_on_mesh(
                 view_size[0], view_size[1], TF_DEPTH);
     }
 
-    renderer_t rend = {.settings = goxel.rend.settings};
-    mat4_copy(goxel.rend.view_mat, rend.view_mat);
-    mat4_copy(goxel.rend.proj_mat, rend.proj_mat);
-
     uint32_t pixel;
     int voxel_pos[3];
     int face, block_id, block_pos[3];
@@ -177,22 +442,43 @@ static bool goxel_unproject_on_mesh(
     float rect[4] = {0, 0, view_size[0], view_size[1]};
     uint8_t clear_color[4] = {0, 0, 0, 0};
 
-    rend.settings.shadow = 0;
-    rend.fbo = goxel.pick_fbo->framebuffer;
-    rend.scale = 1;
-    render_mesh(&rend, mesh, NULL, EFFECT_RENDER_POS);
-    render_submit(&rend, rect, clear_color);
+    image_update(goxel.image);
+    key = get_pick_key(view_size);
+    if (key != goxel.pick_fbo_key) {
+        renderer_t rend = {.settings = goxel.rend.settings};
+        // Not goxel.rend matrices, that are the ones of the last rendered
+        // view when the view is split.
+        mat4_copy(get_camera()->view_mat, rend.view_mat);
+        mat4_copy(get_camera()->proj_mat, rend.proj_mat);
+        rend.settings.shadow = 0;
+        rend.fbo = goxel.pick_fbo->framebuffer;
+        rend.scale = 1;
+        rend.blocks_table = &goxel.pick_blocks;
+        profiler_gpu_begin("pick");
+        DL_FOREACH(goxel.image->layers, layer) {
+            if (!layer->visible || !layer->mesh) continue;
+            render_mesh(&rend, layer->mesh, NULL, EFFECT_RENDER_POS);
+        }
+        render_submit(&rend, rect, clear_color);
+        profiler_gpu_end();
+        goxel.pick_fbo_key = key;
+        pick_start_read();
+    }
+
+    // Too many blocks visible to give them all an id.
+    if (goxel.pick_blocks.overflow)
+        return goxel_unproject_on_mesh_cpu(view, pos, out, normal);
 
     x = round(pos[0] - view[0]);
     y = round(pos[1] - view[1]);
     GL(glViewport(0, 0, goxel.pick_fbo->w, goxel.pick_fbo->h));
     if (x < 0 || x >= view_size[0] ||
         y < 0 || y >= view_size[1]) return false;
-    GL(glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixel));
+    pixel = pick_read_pixel(x, y);
 
     unpack_pos_data(pixel, voxel_pos, &face, &block_id);
-    if (!block_id) return false;
-    render_get_block_pos(&rend, mesh, block_id, block_pos);
+    if (!render_get_block_pos(&goxel.pick_blocks, block_id, block_pos))
+        return false;
     out[0] = block_pos[0] + voxel_pos[0] + 0.5;
     out[1] = block_pos[1] + voxel_pos[1] + 0.5;
     out[2] = block_pos[2] + voxel_pos[2] + 0.5;
@@ -203,7 +489,6 @@ static bool goxel_unproject_on_mesh(
     return true;
 }
 
-
 int goxel_unproject(const float viewport[4],
                     const float pos[2], int snap_mask, float offset,
                     float out[3], float normal[3])
@@ -225,8 +510,10 @@ int goxel_unproject(const float viewport[4],
     for (i = 0; i < 7; i++) {
         if (!(snap_mask & (1 << i))) continue;
         if ((1 << i) == SNAP_MESH) {
-            r = goxel_unproject_on_mesh(viewport, pos,
-                            goxel_get_layers_mesh(goxel.image), p, n);
+            if (goxel.cpu_picking || !goxel.graphics_initialized)
+                r = goxel_unproject_on_mesh_cpu(viewport, pos, p, n);
+            else
+                r = goxel_unproject_on_mesh(viewport, pos, p, n);
         }
         if ((1 << i) == SNAP_PLANE)
             r = goxel_unproject_on_plane(viewport, pos,
@@ -311,7 +598,7 @@ KEEPALIVE
 void goxel_init(void)
 {
     shapes_init();
-    goxel_init_sound();
+    if (!goxel.headless) goxel_init_sound();
 
     // Load and set default palette.
     palette_load_all(&goxel.palettes);
@@ -328,15 +615,34 @@ void goxel_init(void)
     goxel_add_gesture(GESTURE_DRAG, GESTURE_MMB, on_rotate);
     goxel_add_gesture(GESTURE_HOVER, 0, on_hover);
 
+    goxel.idle_mode = true;
+    goxel.idle_fps = 4;
+    goxel.dynres.enabled = true;
+    goxel.dynres.budget = 8;
+    goxel.dynres.shadow = true;
+    goxel.dynres.scale = 1;
+    goxel.frame_tasks_budget = 4;
+    goxel.paging.spill = true;
+    goxel.rend.gpu_meshing = true;
+    // The large operations can use the GL context of the main thread.
+    if (!goxel.headless) gpu_ops_enable();
     goxel_reset();
 }
 
 void goxel_reset(void)
 {
+    int i;
+
     image_delete(goxel.image);
     goxel.image = image_new();
     settings_load();
 
+    // The split views cameras get recreated from the new image camera.
+    for (i = 0; i < (int)ARRAY_SIZE(goxel.views.cameras); i++) {
+        camera_delete(goxel.views.cameras[i]);
+        goxel.views.cameras[i] = NULL;
+    }
+
     // Put plane horizontal at the origin.
     plane_from_vectors(goxel.plane,
             VEC(0, 0, 0), VEC(1, 0, 0), VEC(0, 1, 0));
@@ -347,6 +653,7 @@ void goxel_reset(void)
 
     action_exec2(ACTION_tool_set_brush);
     goxel.tool_radius = 0.5;
+    goxel.image_layer_depth = 1;
     goxel.painter = (painter_t) {
         .shape = &shape_cube,
         .mode = MODE_OVER,
@@ -375,6 +682,9 @@ void goxel_reset(void)
 
     goxel.pathtracer = (pathtracer_t) {
         .num_samples = 512,
+        .noise_threshold = 0.005,
+        .focus = {0.5, 0.5},
+        .bvh_fast = true,
         .world = {
             .type = PT_WORLD_UNIFORM,
             .energy = 1,
@@ -393,6 +703,10 @@ void goxel_reset(void)
 
 void goxel_release(void)
 {
+    gox_save_wait();
+    sync_delete(goxel.sync);
+    goxel.sync = NULL;
+    while (g_image_loads) image_load_delete(g_image_loads);
     pathtracer_stop(&goxel.pathtracer);
     gui_release();
 }
@@ -404,6 +718,9 @@ void goxel_release(void)
 void goxel_create_graphics(void)
 {
     render_init();
+    render_prepare_shaders(&goxel.rend);
+    goxel.rend.async = true;
+    goxel.rend.occlusion_culling = true;
     goxel.graphics_initialized = true;
 }
 
@@ -413,12 +730,32 @@ void goxel_create_graphics(void)
  */
 void goxel_release_graphics(void)
 {
+    profiler_release();
     render_deinit();
     model3d_release_graphics();
     gui_release_graphics();
     shaders_release_all();
+    offscreen_release();
     texture_delete(goxel.pick_fbo);
     goxel.pick_fbo = NULL;
+    goxel.pick_fbo_key = 0;
+#if !defined(GLES2) || defined(GLES3)
+    if (goxel.pick_pbo) GL(glDeleteBuffers(1, &goxel.pick_pbo));
+    goxel.pick_pbo = 0;
+#endif
+    free(goxel.pick_data);
+    goxel.pick_data = NULL;
+    free(goxel.pick_blocks.pos);
+    goxel.pick_blocks = (render_blocks_table_t){};
+    texture_delete(goxel.dynres.target);
+    goxel.dynres.target = NULL;
+    gpu_timer_delete(goxel.dynres.timer);
+    goxel.dynres.timer = NULL;
+    texture_delete(goxel.late_cursor.scene);
+    texture_delete(goxel.late_cursor.target);
+    goxel.late_cursor.scene = NULL;
+    goxel.late_cursor.target = NULL;
+    goxel.late_cursor.key = 0;
     goxel.graphics_initialized = false;
 }
 
@@ -430,10 +767,73 @@ static void update_window_title(void)
     sys_set_window_title(buf);
 }
 
+void goxel_set_paging(void)
+{
+    char dir[1024];
+    bool spill_history = image_history_get_spill_steps() > 0;
+    snprintf(dir, sizeof(dir), "%s/swap", sys_get_user_dir());
+    if ((goxel.paging.spill && goxel.paging.budget) || spill_history) {
+        sys_make_dir(dir);
+        strcat(dir, "/"); // sys_make_dir only creates the parents.
+        sys_make_dir(dir);
+        dir[strlen(dir) - 1] = '\0';
+    }
+    if (mesh_set_paging((uint64_t)goxel.paging.budget * MB,
+                        goxel.paging.spill ? dir : NULL) != 0) {
+        LOG_W("Cannot create the blocks spill file in %s", dir);
+    }
+    if (mesh_set_spill_dir(spill_history ? dir : NULL) != 0)
+        LOG_W("Cannot create the undo history spill file in %s", dir);
+}
+
+// Exchange the edits of the active layer with the other instance, if we
+// are connected to one.
+static void sync_iter(void)
+{
+    if (!goxel.sync) return;
+    if (sync_update(goxel.sync, goxel.image->active_layer->mesh) < 0) {
+        LOG_W("Sync connection closed");
+        sync_delete(goxel.sync);
+        goxel.sync = NULL;
+    }
+}
+
+// Page out the least recently used blocks if we are over the memory
+// budget.  Since the paged out voxels are released in place, we only do it
+// when no background task can be reading a mesh.
+static void page_out(void)
+{
+    const mesh_t **meshes = NULL;
+    const image_t *img = goxel.image, *snap;
+    const layer_t *layer;
+    int nb = 0, allocated = 0;
+
+    if (    !goxel.paging.budget || !img ||
+            tasks_get_nb_active() ||
+            goxel.pathtracer.status == PT_RUNNING) {
+        mesh_page_out(NULL, 0);
+        return;
+    }
+    // The image is part of its own history list.
+    DL_FOREACH2(img->history, snap, history_next) {
+        DL_FOREACH(snap->layers, layer) {
+            if (!layer->mesh) continue;
+            if (nb == allocated) {
+                allocated = allocated * 2 ?: 64;
+                meshes = realloc(meshes, allocated * sizeof(*meshes));
+            }
+            meshes[nb++] = layer->mesh;
+        }
+    }
+    mesh_page_out(meshes, nb);
+    free(meshes);
+}
+
 KEEPALIVE
 int goxel_iter(inputs_t *inputs)
 {
-    double time = sys_get_time();
+    double time = goxel.fixed_time_step ?
+                  goxel.frame_time + goxel.fixed_time_step : sys_get_time();
     uint64_t mesh_key;
     float pitch;
     camera_t *camera = get_camera();
@@ -441,11 +841,21 @@ int goxel_iter(inputs_t *inputs)
     if (!goxel.graphics_initialized)
         goxel_create_graphics();
 
+    profiler_frame();
+    profiler_mark_input(); // The inputs have just been read.
+    profiler_begin("goxel_iter");
     goxel.delta_time = time - goxel.frame_time;
     goxel.fps = mix(goxel.fps, 1.0 / goxel.delta_time, 0.1);
     goxel.frame_time = time;
+    goxel.dynres.moving = false; // Set again by the camera gestures.
     goxel_set_help_text(NULL);
     goxel_set_hint_text(NULL);
+    gox_iter(time);
+    sync_iter();
+    frame_tasks_begin(goxel.frame_tasks_budget / 1000);
+    tasks_update();
+    frame_tasks_run();
+    page_out();
     goxel.screen_size[0] = inputs->window_size[0];
     goxel.screen_size[1] = inputs->window_size[1];
     goxel.screen_scale = inputs->scale;
@@ -454,10 +864,13 @@ int goxel_iter(inputs_t *inputs)
     camera_update(camera);
     mat4_copy(camera->view_mat, goxel.rend.view_mat);
     mat4_copy(camera->proj_mat, goxel.rend.proj_mat);
+    profiler_begin("gui_iter");
     gui_iter(inputs);
+    profiler_end();
 
     if (DEFINED(SOUND) && time - goxel.last_click_time > 0.1) {
-        mesh_key = mesh_get_key(goxel_get_render_mesh(goxel.image));
+        mesh_key = mesh_get_key(goxel_get_render_mesh(goxel.image)) ^
+                   mesh_get_key(goxel.tool_overlay);
         if (goxel.last_mesh_key != mesh_key) {
             if (goxel.last_mesh_key) {
                 pitch = goxel.painter.mode == MODE_OVER ? 1.0 :
@@ -480,6 +893,7 @@ int goxel_iter(inputs_t *inputs)
         goxel.request_test_graphic_release = false;
     }
 
+    profiler_end();
     return goxel.quit ? 1 : 0;
 }
 
@@ -542,6 +956,7 @@ static bool unproject_delta(const float win[3], const float model[4][4],
 static int on_pan(const gesture_t *gest, void *user)
 {
     camera_t *camera = get_camera();
+    goxel.dynres.moving = true;
     if (gest->state == GESTURE_BEGIN) {
         mat4_copy(camera->mat, goxel.move_origin.camera_mat);
         vec2_copy(gest->pos, goxel.move_origin.pos);
@@ -567,6 +982,7 @@ static int on_rotate(const gesture_t *gest, void *user)
     float x1, y1, x2, y2, x_rot, z_rot;
     camera_t *camera = get_camera();
 
+    goxel.dynres.moving = true;
     if (gest->state == GESTURE_BEGIN) {
         mat4_copy(camera->mat, goxel.move_origin.camera_mat);
         vec2_copy(gest->pos, goxel.move_origin.pos);
@@ -590,13 +1006,13 @@ static int on_zoom(const gesture_t *gest, void *user)
     double zoom;
     camera_t *camera = get_camera();
 
+    goxel.dynres.moving = true;
     zoom = (gest->pos[1] - gest->last_pos[1]) / 10.0;
     mat4_itranslate(camera->mat, 0, 0,
             -camera->dist * (1 - pow(1.1, -zoom)));
     camera->dist *= pow(1.1, -zoom);
     // Auto adjust the camera rotation position.
-    if (goxel_unproject_on_mesh(gest->viewport, gest->pos,
-                                goxel_get_layers_mesh(goxel.image), p, n)) {
+    if (goxel_unproject_on_mesh(gest->viewport, gest->pos, p, n)) {
         camera_set_target(camera, p);
     }
     return 0;
@@ -622,10 +1038,34 @@ static int on_hover(const gesture_t *gest, void *user)
 void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
                          bool capture_keys)
 {
-    float p[3], n[3];
-    camera_t *camera = get_camera();
+    float p[3], n[3], a, rect[4];
+    camera_t *camera;
+    pathtracer_t *pt = &goxel.pathtracer;
+    const touch_t *touch = &inputs->touches[0];
 
     painter_t painter = goxel.painter;
+
+    // With the split views, the inputs go to the view under the mouse, and
+    // stay there until the buttons are released.
+    if (goxel.views.split) {
+        if (!touch->down[0] && !touch->down[1] && !touch->down[2])
+            goxel.views.current = get_view_at(viewport, touch->pos);
+        goxel_get_view_rect(viewport, goxel.views.current, rect);
+        viewport = rect;
+    }
+    camera = get_camera();
+
+    // Let the path tracer render the tiles under the mouse first.  The
+    // image is centered in the view, keeping its aspect ratio.
+    if (pt->status == PT_RUNNING && pt->w && pt->h) {
+        a = 1.0 * pt->w / pt->h / viewport[2] * viewport[3];
+        pt->focus[0] = ((inputs->touches[0].pos[0] - viewport[0]) /
+                        viewport[2] - 0.5) / min(a, 1.f) + 0.5;
+        pt->focus[1] = 0.5 - ((inputs->touches[0].pos[1] - viewport[1]) /
+                        viewport[3] - 0.5) / min(1.f / a, 1.f);
+        pt->focus[0] = clamp(pt->focus[0], 0, 1);
+        pt->focus[1] = clamp(pt->focus[1], 0, 1);
+    }
     gesture_update(goxel.gestures_count, goxel.gestures,
                    inputs, viewport, NULL);
     set_flag(&goxel.cursor.flags, CURSOR_SHIFT, inputs->keys[KEY_LEFT_SHIFT]);
@@ -659,7 +1099,7 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
         camera->dist *= pow(1.1, -inputs->mouse_wheel);
         // Auto adjust the camera rotation position.
         if (goxel_unproject_on_mesh(viewport, inputs->touches[0].pos,
-                                goxel_get_layers_mesh(goxel.image), p, n)) {
+                                    p, n)) {
             camera_set_target(camera, p);
         }
         return;
@@ -685,13 +1125,40 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
     // XXX: this should be an action!
     if (inputs->keys['C']) {
         if (goxel_unproject_on_mesh(viewport, inputs->touches[0].pos,
-                                goxel_get_layers_mesh(goxel.image), p, n)) {
+                                    p, n)) {
             camera_set_target(camera, p);
         }
     }
 }
 
 KEEPALIVE
+static uint32_t goxel_get_redraw_key(void)
+{
+    struct {
+        uint32_t image;
+        uint32_t camera;
+        const void *tool;
+        int screen_size[2];
+        bool split;
+    } k = {};
+    k.image = goxel.image ? image_get_key(goxel.image) : 0;
+    k.camera = camera_get_key(get_camera());
+    k.tool = goxel.tool;
+    k.screen_size[0] = goxel.screen_size[0];
+    k.screen_size[1] = goxel.screen_size[1];
+    k.split = goxel.views.split;
+    return XXH32(&k, sizeof(k), 0);
+}
+
+bool goxel_needs_redraw(void)
+{
+    if (goxel.rend.stats.nb_pending) return true;
+    if (frame_tasks_get_nb()) return true;
+    if (goxel.pathtracer.status == PT_RUNNING) return true;
+    if (gox_save_get_progress() >= 0) return true;
+    return goxel_get_redraw_key() != goxel.redraw_key;
+}
+
 void goxel_render(void)
 {
     uint8_t color[4];
@@ -704,7 +1171,10 @@ void goxel_render(void)
     GL(glDisable(GL_SCISSOR_TEST));
     GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT |
                GL_STENCIL_BUFFER_BIT));
+    profiler_gpu_begin("goxel_render");
     gui_render();
+    profiler_gpu_end();
+    goxel.redraw_key = goxel_get_redraw_key();
 }
 
 static void render_export_viewport(const float viewport[4])
@@ -741,6 +1211,9 @@ static void render_pathtrace_view(const float viewport[4])
         pt->buf = calloc(pt->w * pt->h, 4);
         texture_delete(pt->texture);
         pt->texture = texture_new_surface(pt->w, pt->h, 0);
+        pt->dirty[0] = pt->dirty[1] = 0;
+        pt->dirty[2] = pt->w;
+        pt->dirty[3] = pt->h;
     }
     pathtracer_iter(pt, viewport);
 
@@ -750,7 +1223,11 @@ static void render_pathtrace_view(const float viewport[4])
     mat4_iscale(mat, viewport[2], viewport[3], 1);
     mat4_itranslate(mat, 0.5, 0.5, 0);
     mat4_iscale(mat, min(a, 1.f), min(1.f / a, 1.f), 1);
-    texture_set_data(pt->texture, pt->buf, pt->w, pt->h, 4);
+    // Only upload the part of the buffer that changed.
+    texture_set_sub_data(pt->texture, pt->buf, pt->w,
+                         pt->dirty[0], pt->dirty[1],
+                         pt->dirty[2], pt->dirty[3], 4);
+    memset(pt->dirty, 0, sizeof(pt->dirty));
     render_img(&goxel.rend, pt->texture, mat,
                EFFECT_NO_SHADING | EFFECT_PROJ_SCREEN | EFFECT_ANTIALIASING);
     render_submit(&goxel.rend, viewport, goxel.back_color);
@@ -874,7 +1351,20 @@ static void render_symmetry_axis(
     }
 }
 
-void goxel_render_view(const float viewport[4], bool render_mode)
+// Queue the items that follow the cursor: the tool preview overlay and the
+// tool cursor.
+static void render_cursor_items(const cursor_t *curs, int effects)
+{
+    if (goxel.tool_overlay && goxel.image->active_layer->visible) {
+        render_mesh(&goxel.rend, goxel.tool_overlay,
+                    goxel.image->active_layer->material, effects);
+    }
+    if (goxel.tool && !goxel.no_edit) tool_render_cursor(goxel.tool, curs);
+}
+
+// Queue all the items of the 3d view.  The cursor items are only added if
+// a cursor is given.
+static void queue_view_items(const float viewport[4], const cursor_t *curs)
 {
     const layer_t *layer;
     renderer_t *rend = &goxel.rend;
@@ -882,11 +1372,6 @@ void goxel_render_view(const float viewport[4], bool render_mode)
     int effects = 0;
     camera_t *camera = get_camera();
 
-    if (render_mode) {
-        render_pathtrace_view(viewport);
-        return;
-    }
-
     camera->aspect = viewport[2] / viewport[3];
     camera_update(camera);
     mat4_copy(camera->view_mat, goxel.rend.view_mat);
@@ -894,10 +1379,16 @@ void goxel_render_view(const float viewport[4], bool render_mode)
 
     effects |= goxel.view_effects;
 
+    profiler_begin("render_layers");
     for (layer = goxel_get_render_layers(true); layer; layer = layer->next) {
         if (layer->visible && layer->mesh)
-            render_mesh(rend, layer->mesh, layer->material, effects);
+            render_mesh_instance(rend, layer->mesh, layer->mat,
+                                 layer->material, effects);
     }
+    // Drawn after the layers, so that the overlay faces win over the
+    // layers faces at the same place.
+    if (curs) render_cursor_items(curs, effects);
+    profiler_end();
 
     if (!box_is_null(goxel.image->active_layer->box))
         render_box(rend, goxel.image->active_layer->box,
@@ -905,7 +1396,11 @@ void goxel_render_view(const float viewport[4], bool render_mode)
 
     // Render all the image layers.
     DL_FOREACH(goxel.image->layers, layer) {
-        if (layer->visible && layer->image)
+        if (!layer->visible || !layer->image) continue;
+        // Placeholder outline while the image is decoded.
+        if (!layer->image->tex)
+            render_box(rend, layer->mat, layer_box_color, EFFECT_WIREFRAME);
+        else
             render_img(rend, layer->image, layer->mat, EFFECT_NO_SHADING);
     }
 
@@ -930,10 +1425,10 @@ void goxel_render_view(const float viewport[4], bool render_mode)
         float b[4][4];
         uint8_t c[4];
         vec4_set(c, 0, 255, 0, 80);
-        mesh_get_box(goxel_get_layers_mesh(goxel.image), true, b);
+        mesh_get_box(image_get_layers_mesh(goxel.image), true, b);
         render_box(rend, b, c, EFFECT_WIREFRAME);
         vec4_set(c, 0, 255, 255, 80);
-        mesh_get_box(goxel_get_layers_mesh(goxel.image), false, b);
+        mesh_get_box(image_get_layers_mesh(goxel.image), false, b);
         render_box(rend, b, c, EFFECT_WIREFRAME);
     }
     if (goxel.snap_mask & SNAP_PLANE)
@@ -949,67 +1444,300 @@ void goxel_render_view(const float viewport[4], bool render_mode)
         render_export_viewport(viewport);
 
     render_axis_arrows(viewport);
+}
+
+// Queue all the items of the 3d view, and submit them.
+static void render_view_items(const float viewport[4])
+{
+    queue_view_items(viewport, &goxel.cursor);
     render_submit(&goxel.rend, viewport, goxel.back_color);
 }
 
-void image_update(image_t *img);
+// Adapt the dynamic resolution scale to the GPU time of the last views.
+static void dynres_update(void)
+{
+    double time;
+    int id;
+    float scale, budget = goxel.dynres.budget / 1000;
+
+    if (!goxel.dynres.timer) goxel.dynres.timer = gpu_timer_new();
+    while (gpu_timer_poll(goxel.dynres.timer, &time, &id)) {
+        if (time <= 0) continue;
+        // The cost is mostly proportional to the number of pixels.
+        scale = id / 100.f * sqrtf(budget / time);
+        scale = clamp(scale, DYNRES_MIN_SCALE, 1.f);
+        goxel.dynres.scale = mix(goxel.dynres.scale, scale, 0.5f);
+    }
+}
 
-const mesh_t *goxel_get_layers_mesh(const image_t *img)
+/*
+ * Render the view into the dynamic resolution target, then upscale it to
+ * the screen.  The target has no multisampling, and the shadows can be
+ * disabled as well.
+ */
+static void render_view_dynres(const float viewport[4], float scale)
 {
-    uint32_t key = 0, k;
-    layer_t *layer;
+    renderer_t *rend = &goxel.rend;
+    const float rect[4] = {0, 0, viewport[2], viewport[3]};
+    int w = viewport[2] * rend->scale, h = viewport[3] * rend->scale;
+    int fbo = rend->fbo;
+    float rend_scale = rend->scale;
+    float shadow = rend->settings.shadow;
+    float mat[4][4];
+    texture_t *target = goxel.dynres.target;
+
+    if (!target || target->tex_w < w || target->tex_h < h) {
+        texture_delete(target);
+        target = texture_new_buffer(w, h, TF_DEPTH);
+        goxel.dynres.target = target;
+    }
+    rend->fbo = target->framebuffer;
+    rend->scale = rend_scale * scale;
+    if (!goxel.dynres.shadow) rend->settings.shadow = 0;
+    // Only the part of the target we render into is used as texture.
+    target->w = max((int)(rect[2] * rend->scale), 1);
+    target->h = max((int)(rect[3] * rend->scale), 1);
+
+    gpu_timer_begin(goxel.dynres.timer, round(scale * 100));
+    render_view_items(rect);
+    gpu_timer_end(goxel.dynres.timer);
+    rend->fbo = fbo;
+    rend->scale = rend_scale;
+
+    // The framebuffer rows go up, so we flip the image.
+    mat4_set_identity(mat);
+    mat4_iscale(mat, viewport[2], viewport[3], 1);
+    mat4_itranslate(mat, 0.5, 0.5, 0);
+    mat4_iscale(mat, 1, -1, 1);
+    render_img(rend, target, mat, EFFECT_NO_SHADING | EFFECT_PROJ_SCREEN);
+    render_submit(rend, viewport, NULL);
+    rend->settings.shadow = shadow;
+}
 
-    image_update((image_t*)img);
-    DL_FOREACH(img->layers, layer) {
-        if (!layer->visible) continue;
-        if (!layer->mesh) continue;
-        k = layer_get_key(layer);
-        key = XXH32(&k, sizeof(k), key);
+/*
+ * Get the cursor at the latest position of the mouse, read just before
+ * rendering, so that the cursor items don't lag behind the mouse when the
+ * frames take long.
+ */
+static void latch_cursor(const float viewport[4], cursor_t *curs)
+{
+    float pos[2], p[3], n[3];
+    int snaped;
+
+    *curs = goxel.cursor;
+    if (!curs->snaped || (curs->flags & CURSOR_OUT)) return;
+    if (!sys_get_cursor_pos(pos)) return;
+    // Same coordinates as the gestures, with the y axis going up.
+    pos[1] = goxel.screen_size[1] - pos[1];
+    if (    pos[0] < viewport[0] || pos[0] >= viewport[0] + viewport[2] ||
+            pos[1] < viewport[1] || pos[1] >= viewport[1] + viewport[3])
+        return;
+    snaped = goxel_unproject(viewport, pos, curs->snap_mask,
+                             curs->snap_offset, p, n);
+    if (!snaped) return;
+    profiler_mark_input();
+    curs->snaped = snaped;
+    vec3_copy(p, curs->pos);
+    vec3_copy(n, curs->normal);
+}
+
+/*
+ * Render the view with the low latency cursor.  The view without the
+ * cursor items is only rendered again when its render key changes, so
+ * when only the cursor moves, the frame costs a copy of the last render
+ * and the cursor items.
+ */
+static void render_view_late_cursor(const float viewport[4])
+{
+    renderer_t *rend = &goxel.rend;
+    const float rect[4] = {0, 0, viewport[2], viewport[3]};
+    int w = viewport[2] * rend->scale, h = viewport[3] * rend->scale;
+    int fbo = rend->fbo, nb_pending;
+    bool occlusion_culling = rend->occlusion_culling;
+    uint32_t key;
+    float mat[4][4];
+    cursor_t curs;
+    texture_t *scene = goxel.late_cursor.scene;
+    texture_t *target = goxel.late_cursor.target;
+
+    if (!scene || scene->w != w || scene->h != h) {
+        texture_delete(scene);
+        texture_delete(target);
+        scene = texture_new_buffer(w, h, TF_DEPTH);
+        target = texture_new_buffer(w, h, TF_DEPTH);
+        goxel.late_cursor.scene = scene;
+        goxel.late_cursor.target = target;
+        goxel.late_cursor.key = 0;
     }
-    if (key != goxel.layers_mesh_hash) {
-        goxel.layers_mesh_hash = key;
-        if (!goxel.layers_mesh_) goxel.layers_mesh_ = mesh_new();
-        mesh_clear(goxel.layers_mesh_);
-        DL_FOREACH(img->layers, layer) {
-            if (!layer->visible) continue;
-            mesh_merge(goxel.layers_mesh_, layer->mesh, MODE_OVER, NULL);
-        }
+
+    queue_view_items(rect, NULL);
+    key = render_get_key(rend, rect, goxel.back_color);
+    if (key != goxel.late_cursor.key) {
+        rend->fbo = scene->framebuffer;
+        render_submit(rend, rect, goxel.back_color);
+        goxel.late_cursor.stats = rend->stats;
+        // Not reused until all its blocks are ready.
+        goxel.late_cursor.key = rend->stats.nb_pending ? 0 : key;
+    } else {
+        render_discard(rend);
+    }
+
+#ifndef GLES2
+    // Copy the scene with its depth, so that the cursor items are hidden
+    // by the voxels in front of them.
+    GL(glDisable(GL_SCISSOR_TEST));
+    GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, scene->framebuffer));
+    GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target->framebuffer));
+    GL(glBlitFramebuffer(0, 0, w, h, 0, 0, w, h,
+                         GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT,
+                         GL_NEAREST));
+#endif
+
+    latch_cursor(viewport, &curs);
+    rend->fbo = target->framebuffer;
+    rend->keep_target = true;
+    // The occlusion state is the one of the scene items.
+    rend->occlusion_culling = false;
+    render_cursor_items(&curs, goxel.view_effects);
+    render_submit(rend, rect, NULL);
+    nb_pending = rend->stats.nb_pending;
+    rend->keep_target = false;
+    rend->occlusion_culling = occlusion_culling;
+    rend->fbo = fbo;
+
+    // The framebuffer rows go up, so we flip the image.
+    mat4_set_identity(mat);
+    mat4_iscale(mat, viewport[2], viewport[3], 1);
+    mat4_itranslate(mat, 0.5, 0.5, 0);
+    mat4_iscale(mat, 1, -1, 1);
+    render_img(rend, target, mat, EFFECT_NO_SHADING | EFFECT_PROJ_SCREEN);
+    render_submit(rend, viewport, NULL);
+    rend->stats = goxel.late_cursor.stats;
+    rend->stats.nb_pending += nb_pending;
+}
+
+/*
+ * Render the four split views one after the other.  The layers meshes and
+ * the blocks render items are cached, and the views share the shadow map,
+ * so only the culling is done again for each view.
+ */
+static void render_split_views(const float viewport[4])
+{
+    renderer_t *rend = &goxel.rend;
+    int i, current = goxel.views.current, nb_pending = 0;
+    float rect[4];
+
+    for (i = 0; i < (int)ARRAY_SIZE(goxel.views.cameras); i++) {
+        goxel.views.current = i;
+        rend->views.nb = ARRAY_SIZE(goxel.views.cameras);
+        rend->views.current = i;
+        goxel_get_view_rect(viewport, i, rect);
+        render_view_items(rect);
+        nb_pending += rend->stats.nb_pending;
     }
-    return goxel.layers_mesh_;
+    rend->views.nb = 0;
+    rend->views.current = 0;
+    goxel.views.current = current;
+    // So that we keep redrawing until the blocks of all the views are ready.
+    rend->stats.nb_pending = nb_pending;
+}
+
+void goxel_render_view(const float viewport[4], bool render_mode)
+{
+    float scale;
+
+    if (render_mode) {
+        profiler_begin("pathtrace_view");
+        render_pathtrace_view(viewport);
+        profiler_end();
+        return;
+    }
+
+    // No dynamic resolution for the split views, since they are smaller.
+    if (goxel.views.split) {
+        profiler_begin("render_split_views");
+        render_split_views(viewport);
+        profiler_end();
+        return;
+    }
+
+    profiler_begin("render_view");
+    dynres_update();
+    // Quantize the scale so that it doesn't change at every frame.
+    scale = round(goxel.dynres.scale * 20) / 20;
+    if (goxel.dynres.enabled && goxel.dynres.moving && scale < 1) {
+        render_view_dynres(viewport, scale);
+    } else if (goxel.late_cursor.enabled && !DEFINED(GLES2)) {
+        gpu_timer_begin(goxel.dynres.timer, 100);
+        render_view_late_cursor(viewport);
+        gpu_timer_end(goxel.dynres.timer);
+    } else {
+        gpu_timer_begin(goxel.dynres.timer, 100);
+        render_view_items(viewport);
+        gpu_timer_end(goxel.dynres.timer);
+    }
+    profiler_end();
 }
 
 const mesh_t *goxel_get_render_mesh(const image_t *img)
 {
     uint32_t key, k;
-    const mesh_t *mesh;
+    const mesh_t **meshes;
     layer_t *layer;
+    int nb = 0;
 
     if (!goxel.tool_mesh)
-        return goxel_get_layers_mesh(img);
+        return image_get_layers_mesh(img);
 
-    key = mesh_get_key(goxel_get_layers_mesh(img));
+    key = mesh_get_key(image_get_layers_mesh(img));
     k = mesh_get_key(goxel.tool_mesh);
     key = XXH32(&k, sizeof(k), key);
-    if (key != goxel.render_mesh_hash) {
+    if (key != goxel.render_mesh_hash || !goxel.render_merger.mesh) {
         image_update(goxel.image);
         goxel.render_mesh_hash = key;
-        if (!goxel.render_mesh_) goxel.render_mesh_ = mesh_new();
-        mesh_clear(goxel.render_mesh_);
+        DL_COUNT(goxel.image->layers, layer, nb);
+        meshes = calloc(nb, sizeof(*meshes));
+        nb = 0;
         DL_FOREACH(goxel.image->layers, layer) {
-            if (!layer->visible) continue;
-            mesh = layer->mesh;
-            if (mesh == goxel.image->active_layer->mesh)
-                mesh = goxel.tool_mesh;
-            mesh_merge(goxel.render_mesh_, mesh, MODE_OVER, NULL);
+            if (!layer->visible || !layer->mesh) continue;
+            meshes[nb] = layer->mesh;
+            if (layer->mesh == goxel.image->active_layer->mesh)
+                meshes[nb] = goxel.tool_mesh;
+            nb++;
         }
+        mesh_merger_update(&goxel.render_merger, nb, meshes, MODE_OVER);
+        free(meshes);
+    }
+    return goxel.render_merger.mesh;
+}
+
+// Add a group of layers to the render layers, using the merger of the
+// group to only recompute the blocks that changed.
+static void add_render_layer(layer_t *layer, int group,
+                             int nb, const mesh_t **meshes)
+{
+    mesh_merger_t *merger;
+    if (group == goxel.nb_render_layers_mergers) {
+        goxel.render_layers_mergers = realloc(goxel.render_layers_mergers,
+                (group + 1) * sizeof(*goxel.render_layers_mergers));
+        goxel.render_layers_mergers[group] = (mesh_merger_t){};
+        goxel.nb_render_layers_mergers++;
     }
-    return goxel.render_mesh_;
+    merger = &goxel.render_layers_mergers[group];
+    mesh_merger_update(merger, nb, meshes, MODE_OVER);
+    mesh_set(layer->mesh, merger->mesh);
+    mat4_set_identity(layer->mat);
+    DL_APPEND(goxel.render_layers, layer);
 }
 
 const layer_t *goxel_get_render_layers(bool with_tool_preview)
 {
     uint32_t hash, k;
-    layer_t *l, *layer, *tmp;
+    layer_t *l, *layer, *tmp, *instance;
+    const layer_t *base;
+    const mesh_t **meshes;
+    int i, nb = 0, nb_groups = 0;
+    float model[4][4];
 
     hash = image_get_key(goxel.image);
     if (with_tool_preview && goxel.tool_mesh) {
@@ -1026,59 +1754,145 @@ const layer_t *goxel_get_render_layers(bool with_tool_preview)
             layer_delete(layer);
         }
 
+        // The consecutive layers with the same material are merged
+        // together.  The clone layers that can be are rendered as
+        // instances of their base mesh, so that they share its blocks.
+        DL_COUNT(goxel.image->layers, l, i);
+        meshes = calloc(i, sizeof(*meshes));
+        layer = NULL;
         DL_FOREACH(goxel.image->layers, l) {
             if (!l->visible) continue;
             if (!l->mesh) continue;
-            layer = layer_copy(l);
+            base = image_get_clone_instance(goxel.image, l, model);
+            if (base) {
+                if (layer) add_render_layer(layer, nb_groups++, nb, meshes);
+                layer = NULL;
+                nb = 0;
+                instance = layer_copy(l);
+                mesh_set(instance->mesh, base->mesh);
+                mat4_copy(model, instance->mat);
+                DL_APPEND(goxel.render_layers, instance);
+                continue;
+            }
+            if (layer && layer->material != l->material) {
+                add_render_layer(layer, nb_groups++, nb, meshes);
+                layer = NULL;
+                nb = 0;
+            }
+            if (!layer) layer = layer_copy(l);
+            meshes[nb] = l->mesh;
             if (    with_tool_preview && goxel.tool_mesh &&
                     l->mesh == goxel.image->active_layer->mesh)
             {
-                mesh_set(layer->mesh, goxel.tool_mesh);
+                meshes[nb] = goxel.tool_mesh;
             }
+            nb++;
+        }
+        if (layer) add_render_layer(layer, nb_groups++, nb, meshes);
+        free(meshes);
 
-            if (    goxel.render_layers &&
-                    goxel.render_layers->prev->material == layer->material)
-            {
-                mesh_merge(goxel.render_layers->prev->mesh, layer->mesh,
-                           MODE_OVER, NULL);
-                layer_delete(layer);
-            } else {
-                DL_APPEND(goxel.render_layers, layer);
+        for (i = nb_groups; i < goxel.nb_render_layers_mergers; i++)
+            mesh_merger_release(&goxel.render_layers_mergers[i]);
+        goxel.nb_render_layers_mergers = nb_groups;
+    }
+    return goxel.render_layers;
+}
+
+/*
+ * The add and paint operations never remove voxels, so in the blocks of
+ * the path the merged mesh covers all the original voxels: rendering those
+ * blocks over the layers gives the same image as the merge.  This doesn't
+ * work with the smooth or ray marched rendering, where the surface of a
+ * block depends on its neighbors.
+ */
+static bool can_use_tool_overlay(int mode)
+{
+    if (mode != MODE_OVER && mode != MODE_MAX && mode != MODE_PAINT)
+        return false;
+    if (goxel.view_effects & (EFFECT_MARCHING_CUBES | EFFECT_RAY_MARCHING |
+                              EFFECT_SEMI_TRANSPARENT))
+        return false;
+    return true;
+}
+
+void goxel_set_tool_preview(const mesh_t *orig, const mesh_t *path,
+                            int mode, const uint8_t color[4],
+                            int nb, int (*blocks_pos)[3])
+{
+    mesh_t **preview, **other;
+    mesh_iterator_t iter;
+    int (*all_pos)[3] = NULL, bpos[3], allocated = 0;
+
+    if (can_use_tool_overlay(mode)) {
+        preview = &goxel.tool_overlay;
+        other = &goxel.tool_mesh;
+    } else {
+        preview = &goxel.tool_mesh;
+        other = &goxel.tool_overlay;
+    }
+    mesh_delete(*other);
+    *other = NULL;
+
+    // Only update the changed blocks if nobody touched the preview.
+    if (    nb >= 0 && *preview &&
+            mesh_get_key(*preview) == goxel.tool_preview_key) {
+        mesh_merge_blocks(*preview, orig, path, mode, color, nb, blocks_pos);
+        goxel.tool_preview_key = mesh_get_key(*preview);
+        return;
+    }
+
+    if (!*preview) *preview = mesh_new();
+    if (preview == &goxel.tool_mesh) {
+        mesh_set(*preview, orig);
+        mesh_merge(*preview, path, mode, color);
+    } else {
+        mesh_clear(*preview);
+        nb = 0;
+        iter = mesh_get_iterator(path, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            if (nb == allocated) {
+                allocated = max(16, allocated * 2);
+                all_pos = realloc(all_pos, allocated * sizeof(*all_pos));
             }
+            memcpy(all_pos[nb++], bpos, sizeof(bpos));
         }
+        mesh_merge_blocks(*preview, orig, path, mode, color, nb, all_pos);
+        free(all_pos);
     }
-    return goxel.render_layers;
+    goxel.tool_preview_key = mesh_get_key(*preview);
+}
+
+void goxel_apply_tool_preview(mesh_t *mesh)
+{
+    mesh_iterator_t iter;
+    int bpos[3];
+
+    if (goxel.tool_mesh) mesh_set(mesh, goxel.tool_mesh);
+    if (goxel.tool_overlay) {
+        iter = mesh_get_iterator(goxel.tool_overlay, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos))
+            mesh_copy_block(goxel.tool_overlay, bpos, mesh, bpos);
+    }
+    mesh_delete(goxel.tool_mesh);
+    mesh_delete(goxel.tool_overlay);
+    goxel.tool_mesh = NULL;
+    goxel.tool_overlay = NULL;
+}
+
+const mesh_t *goxel_get_tool_preview(void)
+{
+    return goxel.tool_overlay ?: goxel.tool_mesh;
 }
 
 // Render the view into an RGB[A] buffer.
 void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp)
 {
     camera_t *camera = get_camera();
-    const mesh_t *mesh;
-    texture_t *fbo;
-    renderer_t rend = goxel.rend;
-    float rect[4] = {0, 0, w * 2, h * 2};
-    uint8_t *tmp_buf;
 
     camera->aspect = (float)w / h;
     camera_update(camera);
-
-    mesh = goxel_get_layers_mesh(goxel.image);
-    fbo = texture_new_buffer(w * 2, h * 2, TF_DEPTH);
-
-    mat4_copy(camera->view_mat, rend.view_mat);
-    mat4_copy(camera->proj_mat, rend.proj_mat);
-    rend.fbo = fbo->framebuffer;
-    rend.scale = 1.0;
-
-    // XXX: use goxel_get_render_layers!
-    render_mesh(&rend, mesh, NULL, 0);
-    render_submit(&rend, rect, (bpp == 3) ? goxel.back_color : NULL);
-    tmp_buf = calloc(w * h * 4, bpp);
-    texture_get_data(fbo, w * 2, h * 2, bpp, tmp_buf);
-    img_downsample(tmp_buf, w * 2, h * 2, bpp, buf);
-    free(tmp_buf);
-    texture_delete(fbo);
+    offscreen_render(1, &camera->view_mat, camera->proj_mat, w, h, bpp,
+                     &buf);
 }
 
 // XXX: we could merge all the set_xxx_text function into a single one.
@@ -1108,7 +1922,7 @@ void goxel_import_image_plane(const char *path)
 {
     layer_t *layer;
     texture_t *tex;
-    tex = texture_new_image(path, TF_NEAREST);
+    tex = texture_new_image(path, TF_NEAREST | TF_MIPMAP | TF_ASYNC);
     if (!tex) return;
     image_history_push(goxel.image);
     layer = image_add_layer(goxel.image, NULL);
@@ -1117,9 +1931,46 @@ void goxel_import_image_plane(const char *path)
     mat4_iscale(layer->mat, layer->image->w, layer->image->h, 1);
 }
 
-void goxel_on_low_memory(void)
+// Total memory reported in the memory stats, except for the gui.
+static int64_t get_reported_mem(void)
 {
-    render_on_low_memory(&goxel.rend);
+    int64_t total = 0, mem;
+    int tag;
+    for (tag = 0; tag < MEM_COUNT; tag++) {
+        if (tag == MEM_GUI) continue;
+        mem_stats_get(tag, &mem, NULL);
+        total += mem;
+    }
+    return total;
+}
+
+int64_t goxel_on_low_memory(int level)
+{
+    int64_t mem = get_reported_mem(), freed;
+    int i;
+
+    render_on_low_memory(&goxel.rend, level >= LOW_MEMORY_CRITICAL);
+    if (level < LOW_MEMORY_COMPACT) {
+        cache_registry_shrink(0.5);
+    } else {
+        cache_registry_clear();
+        image_history_compact(goxel.image);
+        // The merged meshes are only caches.
+        mesh_merger_release(&goxel.image->layers_merger);
+        goxel.image->layers_mesh_key = 0;
+        mesh_merger_release(&goxel.render_merger);
+        goxel.render_mesh_hash = 0;
+        for (i = 0; i < goxel.nb_render_layers_mergers; i++)
+            mesh_merger_release(&goxel.render_layers_mergers[i]);
+        goxel.render_layers_hash = 0;
+    }
+    if (level >= LOW_MEMORY_CRITICAL)
+        pathtracer_stop(&goxel.pathtracer);
+    mesh_trim_pools();
+
+    freed = mem - get_reported_mem();
+    LOG_I("Low memory level %d: freed %.1f MB", level, freed / (1024. * 1024));
+    return freed;
 }
 
 int goxel_import_file(const char *path, const char *format)
@@ -1162,21 +2013,17 @@ int goxel_export_to_file(const char *path, const char *format)
 static void a_cut_as_new_layer(void)
 {
     layer_t *new_layer;
-    painter_t painter;
+    mask_t *mask;
 
     image_t *img = goxel.image;
     layer_t *layer = img->active_layer;
-    const float (*box)[4][4] = &goxel.selection;
 
     new_layer = image_duplicate_layer(img, layer);
-    painter = (painter_t) {
-        .shape = &shape_cube,
-        .mode = MODE_INTERSECT,
-        .color = {255, 255, 255, 255},
-    };
-    mesh_op(new_layer->mesh, &painter, *box);
-    painter.mode = MODE_SUB;
-    mesh_op(layer->mesh, &painter, *box);
+    mask = mask_new();
+    mask_add_box(mask, goxel.selection);
+    mask_apply(mask, new_layer->mesh, MODE_INTERSECT, NULL);
+    mask_apply(mask, layer->mesh, MODE_SUB, NULL);
+    mask_delete(mask);
 }
 
 ACTION_REGISTER(cut_as_new_layer,
@@ -1198,8 +2045,22 @@ ACTION_REGISTER(reset_selection,
 static void a_fill_selection(void)
 {
     layer_t *layer = goxel.image->active_layer;
+    const painter_t *painter = &goxel.painter;
+    mask_t *mask;
+
     if (box_is_null(goxel.selection)) return;
-    mesh_op(layer->mesh, &goxel.painter, goxel.selection);
+    // The mask only works for the plain cube shape.
+    if (    painter->shape != &shape_cube || painter->smoothness ||
+            painter->symmetry || (painter->box && !box_is_null(*painter->box))
+            || painter->mode == MODE_INTERSECT)
+    {
+        mesh_op(layer->mesh, painter, goxel.selection);
+        return;
+    }
+    mask = mask_new();
+    mask_add_box(mask, goxel.selection);
+    mask_apply(mask, layer->mesh, painter->mode, painter->color);
+    mask_delete(mask);
 }
 
 ACTION_REGISTER(fill_selection,
@@ -1210,18 +2071,14 @@ ACTION_REGISTER(fill_selection,
 
 static void copy_action(void)
 {
-    painter_t painter;
+    const mesh_t *mesh = goxel.image->active_layer->mesh;
     mesh_delete(goxel.clipboard.mesh);
     mat4_copy(goxel.selection, goxel.clipboard.box);
-    goxel.clipboard.mesh = mesh_copy(goxel.image->active_layer->mesh);
-    if (!box_is_null(goxel.selection)) {
-        painter = (painter_t) {
-            .shape = &shape_cube,
-            .mode = MODE_INTERSECT,
-            .color = {255, 255, 255, 255},
-        };
-        mesh_op(goxel.clipboard.mesh, &painter, goxel.selection);
-    }
+    // The clipboard shares the blocks data with the layer.
+    if (box_is_null(goxel.selection))
+        goxel.clipboard.mesh = mesh_copy(mesh);
+    else
+        goxel.clipboard.mesh = mesh_copy_box(mesh, goxel.selection);
 }
 
 static void past_action(void)
@@ -1233,15 +2090,18 @@ static void past_action(void)
     mat4_set_identity(mat);
     if (!goxel.clipboard.mesh) return;
 
-    tmp = mesh_copy(goxel.clipboard.mesh);
-    if (    !box_is_null(goxel.selection) &&
-            !box_is_null(goxel.clipboard.box)) {
-        vec3_copy(goxel.selection[3], p1);
-        vec3_copy(goxel.clipboard.box[3], p2);
-        mat4_itranslate(mat, +p1[0], +p1[1], +p1[2]);
-        mat4_itranslate(mat, -p2[0], -p2[1], -p2[2]);
-        mesh_move(tmp, mat);
+    if (    box_is_null(goxel.selection) ||
+            box_is_null(goxel.clipboard.box)) {
+        mesh_merge(mesh, goxel.clipboard.mesh, MODE_OVER, NULL);
+        return;
     }
+    // With a block aligned offset, the move only re-keys the blocks.
+    tmp = mesh_copy(goxel.clipboard.mesh);
+    vec3_copy(goxel.selection[3], p1);
+    vec3_copy(goxel.clipboard.box[3], p2);
+    mat4_itranslate(mat, +p1[0], +p1[1], +p1[2]);
+    mat4_itranslate(mat, -p2[0], -p2[1], -p2[2]);
+    mesh_move(tmp, mat);
     mesh_merge(mesh, tmp, MODE_OVER, NULL);
     mesh_delete(tmp);
 }
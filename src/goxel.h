@@ -40,6 +40,7 @@
 #include "inputs.h"
 #include "layer.h"
 #include "log.h"
+#include "mask.h"
 #include "material.h"
 #include "mesh.h"
 #include "mesh_utils.h"
@@ -49,6 +50,7 @@
 #include "pathtracer.h"
 #include "render.h"
 #include "shape.h"
+#include "sync.h"
 #include "system.h"
 #include "theme.h"
 #include "tools.h"
@@ -58,9 +60,14 @@
 
 #include "utils/box.h"
 #include "utils/cache.h"
+#include "utils/counters.h"
 #include "utils/gl.h"
+#include "utils/gpu_timer.h"
 #include "utils/img.h"
+#include "utils/mem_stats.h"
+#include "utils/mempool.h"
 #include "utils/plane.h"
+#include "utils/profiler.h"
 #include "utils/sound.h"
 #include "utils/texture.h"
 #include "utils/vec.h"
@@ -426,14 +433,25 @@ enum {
 #define ICON_COLORIZABLE_END   41
 
 // #### Block ##################
-// The block size can only be 16.
-#define BLOCK_SIZE 16
 #define VOXEL_TEXTURE_SIZE 8
 
 // Generate an optimal palette whith a fixed number of colors from a mesh.
 void quantization_gen_palette(const mesh_t *mesh, int nb,
                               uint8_t (*palette)[4]);
 
+// Same as quantization_gen_palette, but from a histogram of distinct
+// colors.
+void quantization_gen_palette_from_colors(
+        const uint8_t (*colors)[4], const uint32_t *counts, int nb_colors,
+        int nb, uint8_t (*palette)[4]);
+
+// Improve a palette for a histogram of distinct colors with a few
+// iterations of k-means: each palette color is moved to the average of the
+// colors closer to it than to any other palette color.
+void quantization_refine_palette(
+        const uint8_t (*colors)[4], const uint32_t *counts, int nb_colors,
+        int nb, uint8_t (*palette)[4], int iterations);
+
 // #### Goxel : core object ####
 
 // Flags to set where the mouse snap.  In order of priority.
@@ -457,6 +475,12 @@ typedef struct goxel
 
     // Flag so that we reinit OpenGL after the context has been killed.
     bool       graphics_initialized;
+    // Set when running from the command line without any window, in which
+    // case the graphics are never initialized.
+    bool       headless;
+    // Connection to an other instance we share the active layer edits
+    // with, see --sync.
+    sync_t     *sync;
     // We can't reset the graphics in the middle of the gui, so use this.
     // for testing.
     bool       request_test_graphic_release;
@@ -464,15 +488,21 @@ typedef struct goxel
     // Tools can set this mesh and it will replace the current layer mesh
     // during render.
     mesh_t     *tool_mesh;
-
-    mesh_t     *layers_mesh_;
-    uint32_t   layers_mesh_hash;
-
-    mesh_t     *render_mesh_; // All the layers + tool mesh.
+    // Or this one, that only contains the blocks changed by the tool, and
+    // is rendered over the layers.  See goxel_set_tool_preview.
+    mesh_t     *tool_overlay;
+    uint64_t   tool_preview_key;
+
+    // The merged meshes are updated incrementally, only recomputing the
+    // blocks that changed.
+    mesh_merger_t render_merger; // All the layers + tool mesh.
     uint32_t   render_mesh_hash;
 
     layer_t    *render_layers;
     uint32_t   render_layers_hash;
+    // One merger per group of layers in render_layers.
+    mesh_merger_t *render_layers_mergers;
+    int        nb_render_layers_mergers;
 
     struct     {
         mesh_t *mesh;
@@ -490,10 +520,65 @@ typedef struct goxel
     uint8_t    image_box_color[4];
     bool       hide_box;
 
+    // Split of the 3d view into the perspective view and the front, right
+    // and top orthographic views.  The orthographic views cameras are not
+    // part of the image.  See goxel_render_view.
+    struct {
+        bool        split;
+        int         current;    // View of the inputs and get_camera.
+        camera_t    *cameras[4]; // The first one is unused.
+    } views;
+
     texture_t  *pick_fbo;
+    // The pick buffer is only rendered when its key changes, and then read
+    // back asynchronously into pick_data.
+    uint32_t   pick_fbo_key;
+    GLuint     pick_pbo;
+    int        pick_pbo_frame; // Frame at which we started the read.
+    uint32_t   *pick_data;
+    render_blocks_table_t pick_blocks; // Blocks of the pick buffer.
+    bool       cpu_picking; // Pick the mesh with a ray cast instead.
     painter_t  painter;
     renderer_t rend;
 
+    // Dynamic resolution: while the camera moves, the view is rendered into
+    // a lower resolution offscreen target, with the resolution adapted to
+    // keep the GPU time of the view under a budget.
+    struct {
+        bool        enabled;
+        float       budget;     // Target GPU time of the view (ms).
+        bool        shadow;     // Keep the shadows while moving.
+        float       scale;      // Resolution scale to use, in (0, 1].
+        bool        moving;     // Set by the camera gestures.
+        texture_t   *target;
+        gpu_timer_t *timer;
+    } dynres;
+
+    // Low latency cursor: the view without the cursor items (tool overlay,
+    // brush outline) is rendered into an offscreen target, that is reused
+    // as long as nothing in it changes, and the cursor items are drawn over
+    // a copy of it, at the position of the mouse read just before.  The
+    // targets have no multisampling, so this is off by default.
+    struct {
+        bool            enabled;
+        texture_t       *scene;     // Last render of the view.
+        texture_t       *target;    // The scene plus the cursor items.
+        uint32_t        key;        // Render key of the scene, or zero.
+        render_stats_t  stats;      // Stats of the scene render.
+    } late_cursor;
+
+    // Time budget of the main thread deferred work (blocks meshing, GL
+    // uploads) per frame, in ms.  See utils/frame_tasks.h.
+    float      frame_tasks_budget;
+
+    // Memory budget of the blocks data in MB, or zero to keep all the
+    // blocks in memory, and whether the paged out blocks are written into a
+    // spill file.  See goxel_set_paging.
+    struct {
+        int         budget;
+        bool        spill;
+    } paging;
+
     cursor_t   cursor;
 
     tool_t     *tool;
@@ -506,6 +591,10 @@ typedef struct goxel
 
     float      selection[4][4];   // The selection box.
 
+    // Maximum height of the image layers turned into meshes.  If more than
+    // one, the pixels are extruded according to their luminance.
+    int        image_layer_depth;
+
     struct {
         float  rotation[4];
         float  pos[2];
@@ -522,7 +611,15 @@ typedef struct goxel
     int        frame_count; // Global frames counter.
     double     frame_time;  // Clock time at beginning of the frame (sec)
     double     fps;         // Average fps.
+    // If set, the frames time increases by this value instead of following
+    // the clock, to replay inputs deterministically.
+    double     fixed_time_step;
     bool       quit;        // Set to true to quit the application.
+    // If set, the main loop only renders at full speed when something
+    // changed, and otherwise at most idle_fps frames per second.
+    bool       idle_mode;
+    int        idle_fps;
+    uint32_t   redraw_key;  // goxel_get_redraw_key() of the last frame.
 
     int        view_effects; // EFFECT_WIREFRAME | EFFECT_GRID | EFFECT_EDGES
 
@@ -555,6 +652,25 @@ void goxel_reset(void);
 int goxel_iter(inputs_t *inputs);
 void goxel_render(void);
 
+/*
+ * Function: goxel_needs_redraw
+ * Check if the last rendered frame might be out of date.
+ *
+ * Return true if the image, the camera or the tool changed since the last
+ * call to <goxel_render>, or if a background job (meshing, path tracing,
+ * saving) is still running and will deliver new results.  Used by the main
+ * loop to throttle the frames in idle mode, the inputs are not checked.
+ */
+bool goxel_needs_redraw(void);
+
+/*
+ * Function: goxel_set_paging
+ * Apply the goxel.paging settings, and the undo history spill setting.
+ *
+ * The spill files are created in the swap directory of the user dir.
+ */
+void goxel_set_paging(void);
+
 /*
  * Function: goxel_create_graphics
  * Called after the graphics context has been created.
@@ -567,17 +683,47 @@ void goxel_create_graphics(void);
  */
 void goxel_release_graphics(void);
 
+// Levels of memory pressure, see goxel_on_low_memory.
+enum {
+    LOW_MEMORY_TRIM = 1,
+    LOW_MEMORY_COMPACT,
+    LOW_MEMORY_CRITICAL,
+};
+
 /*
  * Function: goxel_on_low_memory
- * Attempt to release cached memory
+ * Attempt to release some memory.
+ *
+ * The levels are cumulative:
+ *
+ *   LOW_MEMORY_TRIM     - Trim the least recently used render items and
+ *                         operations caches items.
+ *   LOW_MEMORY_COMPACT  - Also compress the undo history, clear the caches,
+ *                         and free the merged layers meshes, that will be
+ *                         recomputed when needed.
+ *   LOW_MEMORY_CRITICAL - Also release all the render items, and the path
+ *                         tracer scene.
+ *
+ * Return:
+ *   The number of bytes freed, as reported in the memory stats.
  */
-void goxel_on_low_memory(void);
+int64_t goxel_on_low_memory(int level);
 
 int goxel_unproject(const float viewport[4],
                     const float pos[2], int snap_mask, float offset,
                     float out[3], float normal[3]);
 
+/*
+ * Function: goxel_render_view
+ * Render the 3d view, or the four split views if goxel.views.split is set.
+ */
 void goxel_render_view(const float viewport[4], bool render_mode);
+
+/*
+ * Function: goxel_get_view_rect
+ * Get the viewport of one of the split views inside the 3d view viewport.
+ */
+void goxel_get_view_rect(const float viewport[4], int view, float out[4]);
 void goxel_render_export_view(const float viewport[4]);
 // Called by the gui when the mouse hover a 3D view.
 // XXX: change the name since we also call it when the mouse get out of
@@ -585,7 +731,6 @@ void goxel_render_export_view(const float viewport[4]);
 void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
                          bool capture_keys);
 
-const mesh_t *goxel_get_layers_mesh(const image_t *img);
 const mesh_t *goxel_get_render_mesh(const image_t *img);
 
 /*
@@ -597,11 +742,51 @@ const mesh_t *goxel_get_render_mesh(const image_t *img);
  *
  * It also can replace the current layer mesh with the tool preview.
  *
+ * The clone layers can be returned as instances of their base layer mesh,
+ * in which case the layer mat is the model matrix to render the mesh with
+ * (it is the identity for the other layers).
+ *
  * This is the function that should be used the get the actual list of layers
  * to be rendered.
  */
 const layer_t *goxel_get_render_layers(bool with_tool_preview);
 
+/*
+ * Function: goxel_set_tool_preview
+ * Set the preview of a tool operation on the active layer.
+ *
+ * The preview is the merge of the tool path into the original layer mesh.
+ * If the operation can't remove any voxel, only the blocks of the path are
+ * merged, into goxel.tool_overlay, that is rendered over the layers: the
+ * layers meshes and render items are left untouched during the operation.
+ * Otherwise the whole merge is set into goxel.tool_mesh, that replaces the
+ * active layer mesh during render.
+ *
+ * Parameters:
+ *   orig       - The active layer mesh before the operation.
+ *   path       - The tool path, as an alpha mask.
+ *   mode       - The operation mode.
+ *   color      - The operation color.
+ *   nb         - Number of blocks of the path changed since the last
+ *                call, or -1 to recompute the whole preview.
+ *   blocks_pos - Position of the changed blocks.
+ */
+void goxel_set_tool_preview(const mesh_t *orig, const mesh_t *path,
+                            int mode, const uint8_t color[4],
+                            int nb, int (*blocks_pos)[3]);
+
+/*
+ * Function: goxel_apply_tool_preview
+ * Apply the tool preview to the unchanged layer mesh, and remove it.
+ */
+void goxel_apply_tool_preview(mesh_t *mesh);
+
+/*
+ * Function: goxel_get_tool_preview
+ * Return the current tool preview mesh, or NULL.
+ */
+const mesh_t *goxel_get_tool_preview(void);
+
 void goxel_set_help_text(const char *msg, ...);
 void goxel_set_hint_text(const char *msg, ...);
 
@@ -614,15 +799,129 @@ int goxel_export_to_file(const char *path, const char *format);
 void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp);
 
 void save_to_file(const image_t *img, const char *path);
+
+// Same as save_to_file, but if the file is the one we last saved or
+// loaded, only append the changes to it.  The whole file still gets
+// rewritten from time to time to remove the unused data.
+void save_to_file_incremental(const image_t *img, const char *path);
+
+/*
+ * Function: save_to_store
+ * Save an image into a blocks store.
+ *
+ * The file only references the blocks, that are saved as separate files
+ * named after the hash of their voxels, in a 'blocks' directory next to
+ * it.  Only the blocks not already in the store get written, so this is
+ * fast for big images saved often.  The files can be loaded with
+ * <load_from_file>, as long as the blocks directory is kept with them.
+ *
+ * The web build uses it for the autosaves, with the store kept in the
+ * browser IndexedDB.
+ */
+void save_to_store(const image_t *img, const char *path);
+
+/*
+ * Function: gox_store_gc
+ * Delete the blocks of a store not used by any of its files anymore.
+ *
+ * Parameters:
+ *   dir    - The directory of the store files.
+ *
+ * Return:
+ *   The number of blocks deleted, or -1 if the directory cannot be read.
+ */
+int gox_store_gc(const char *dir);
+
+// Save an image in a background thread.  A frozen copy of the image is
+// saved, so it can keep being edited in the meantime.  Any previous
+// background save is finished first.
+void save_to_file_async(image_t *img, const char *path);
+
+// Wait for the background save to be done, if there is one.
+void gox_save_wait(void);
+
+// Return the progress from 0 to 1 of the background save, or -1 if there
+// is none.
+float gox_save_get_progress(void);
+
+// Called every frame, to finish the background saves and start the
+// autosaves.
+void gox_iter(double time);
+
+// Interval in seconds of the autosaves, zero to disable them.  The image is
+// saved next to its file with an .autosave.gox extension.
+void gox_set_autosave_interval(int seconds);
+int gox_get_autosave_interval(void);
 int load_from_file(const char *path);
 
-// Iter info of a gox file, without actually reading it.
-// For the moment only returns the image preview if available.
+// Load a gox file into an image.  Unlike load_from_file, this doesn't
+// change any global state (render light, incremental saves), so it can be
+// called from any thread, as long as each thread uses its own image.
+int gox_import(image_t *img, const char *path);
+
+// Files bigger than this size (64MB by default) have their blocks loaded
+// from the disk only when first accessed.
+void gox_set_lazy_load_size(int64_t size);
+
+/*
+ * Function: gox_iter_infos
+ * Iter the infos of a gox file, without actually loading it.
+ *
+ * Only the chunks before the blocks are read, and they are cached in the
+ * user directory, so this is fast enough to list big directories.
+ *
+ * The attributes passed to the callback are:
+ *   PREV      - The png image preview.
+ *   layer     - The name of a layer, once per layer.
+ *   nb-blocks - Total number of blocks in the layers (int).
+ *   nb-voxels - Total number of voxels in the layers (int64_t).
+ *   bbox      - Bounding box of the voxels (int[2][3]), if not empty.
+ *
+ * Only the preview is available for the files written by older versions,
+ * or after an incremental save.
+ *
+ * Return:
+ *   0 on success, -1 if the file cannot be read.
+ */
 int gox_iter_infos(const char *path,
                    int (*callback)(const char *attr, int size,
                                    void *value, void *user),
                    void *user);
 
+/*
+ * Function: gox_encode_blocks
+ * Compress some 16^3 blocks with the codec of the gox BLKS chunks.
+ *
+ * The blocks are stored with a palette when they have at most 256 colors,
+ * and the whole data is then compressed with zlib.
+ *
+ * Parameters:
+ *   nb     - Number of blocks.
+ *   blocks - The RGBA voxels of each block, in xyz order.
+ *   size   - Receive the size of the returned data.
+ *
+ * Return:
+ *   The encoded data, that should be freed by the caller.
+ */
+uint8_t *gox_encode_blocks(int nb, const uint8_t *const *blocks, int *size);
+
+/*
+ * Function: gox_decode_blocks
+ * Decode some blocks encoded with <gox_encode_blocks>.
+ *
+ * Parameters:
+ *   data   - The encoded data.
+ *   size   - Size of the encoded data.
+ *   nb     - Number of blocks in the data.
+ *   voxels - Receive the RGBA voxels of all the blocks, 16^3 * 4 bytes per
+ *            block.
+ *
+ * Return:
+ *   0 on success, -1 if the data is invalid.
+ */
+int gox_decode_blocks(const uint8_t *data, int size, int nb,
+                      uint8_t *voxels);
+
 // Section: box_edit
 /*
  * Function: gox_edit
@@ -652,5 +951,32 @@ void settings_save(void);
  * Run all the unit tests */
 void tests_run(void);
 
+/* Function: bench_run
+ * Run the benchmarks of the core voxel operations.
+ *
+ * The results are written as JSON into a file, or to stdout if path is
+ * NULL or "-". */
+int bench_run(const char *path);
+
+/* Function: bench_render_begin
+ * Start the rendering benchmark of the current image.
+ *
+ * The benchmark renders a fixed orbit of the camera with several effects
+ * combinations.  It should be followed by calls to <bench_render_iter> at
+ * each frame, and then <bench_render_end>. */
+void bench_render_begin(void);
+
+/* Function: bench_render_iter
+ * Render the next frame of the rendering benchmark into the default
+ * framebuffer.
+ *
+ * Return false when all the frames have been rendered. */
+bool bench_render_iter(const float viewport[4], float scale);
+
+/* Function: bench_render_end
+ * Write the JSON results of the rendering benchmark into a file, or to
+ * stdout if path is NULL or "-", and release the benchmark. */
+int bench_render_end(const char *path);
+
 
 #endif // GOXEL_H
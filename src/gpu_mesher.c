@@ -0,0 +1,192 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "gpu_mesher.h"
+
+#if !defined(GLES2) && defined(GL_VERSION_4_3)
+#   define HAS_COMPUTE_SHADER 1
+#else
+#   define HAS_COMPUTE_SHADER 0
+#endif
+
+#define N BLOCK_SIZE
+// All the faces of all the voxels.
+#define MAX_QUADS (N * N * N * 6)
+
+#if HAS_COMPUTE_SHADER
+
+static struct {
+    int         support;    // 0: unknown, 1: supported, -1: not supported.
+    gl_shader_t *shader;
+    GLuint      voxels_buffer;
+    GLuint      vertices_buffer;
+    GLuint      counter_buffer;
+} g_mesher = {};
+
+// Create the defines of the tables used by the shader.
+static void get_include(char *out, int size)
+{
+    int i, n = 0;
+#define ADD(...) n += snprintf(out + n, size - n, __VA_ARGS__)
+    ADD("#define N %d\n#define MAX_QUADS %d\n", N, MAX_QUADS);
+    ADD("const int FACES_VERTICES[24] = int[](");
+    for (i = 0; i < 24; i++)
+        ADD("%d%s", FACES_VERTICES[i / 4][i % 4], i < 23 ? "," : ");\n");
+    ADD("const int FACES_NEIGHBORS[24] = int[](");
+    for (i = 0; i < 24; i++)
+        ADD("%d%s", FACES_NEIGHBORS[i / 4][i % 4], i < 23 ? "," : ");\n");
+    ADD("const ivec3 VERTICES_POSITIONS[8] = ivec3[](");
+    for (i = 0; i < 8; i++)
+        ADD("ivec3(%d,%d,%d)%s", VERTICES_POSITIONS[i][0],
+            VERTICES_POSITIONS[i][1], VERTICES_POSITIONS[i][2],
+            i < 7 ? "," : ");\n");
+    ADD("const ivec3 FACES_NORMALS[6] = ivec3[](");
+    for (i = 0; i < 6; i++)
+        ADD("ivec3(%d,%d,%d)%s", FACES_NORMALS[i][0], FACES_NORMALS[i][1],
+            FACES_NORMALS[i][2], i < 5 ? "," : ");\n");
+#undef ADD
+    assert(n < size);
+}
+
+static GLuint create_buffer(int size)
+{
+    GLuint buffer;
+    GL(glGenBuffers(1, &buffer));
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer));
+    GL(glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_DYNAMIC_DRAW));
+    counter_add(COUNTER_GL_BUFFERS_CREATED, 1);
+    return buffer;
+}
+
+static bool init(void)
+{
+    int major = 0, minor = 0;
+    const char *version, *code;
+    char include[2048];
+
+    GL(version = (const char*)glGetString(GL_VERSION));
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    if (    !(major > 4 || (major == 4 && minor >= 3)) &&
+            !(gl_has_extension("GL_ARB_compute_shader") &&
+              gl_has_extension("GL_ARB_shader_storage_buffer_object")))
+        return false;
+
+    code = assets_get("asset://data/shaders/mesh_compute.glsl", NULL);
+    assert(code);
+    get_include(include, sizeof(include));
+    g_mesher.shader = gl_shader_create_compute(code, include);
+    if (!g_mesher.shader) return false;
+    g_mesher.voxels_buffer = create_buffer((N + 2) * (N + 2) * (N + 2) * 4);
+    g_mesher.vertices_buffer = create_buffer(
+            MAX_QUADS * 4 * sizeof(voxel_packed_vertex_t));
+    g_mesher.counter_buffer = create_buffer(sizeof(uint32_t));
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0));
+    return true;
+}
+
+bool gpu_mesher_is_supported(void)
+{
+    if (!g_mesher.support) {
+        g_mesher.support = init() ? 1 : -1;
+        if (g_mesher.support < 0) LOG_I("GPU meshing not supported");
+    }
+    return g_mesher.support > 0;
+}
+
+int gpu_mesher_run(const uint8_t *data, int effects)
+{
+    GLint prog;
+    uint32_t nb = 0;
+    gl_shader_t *shader;
+
+    if (!gpu_mesher_is_supported()) return -1;
+    shader = g_mesher.shader;
+    // The meshing happens in the middle of the blocks rendering.
+    GL(glGetIntegerv(GL_CURRENT_PROGRAM, &prog));
+    GL(glUseProgram(shader->prog));
+    gl_update_uniform(shader, "u_flat_faces",
+                      (effects & EFFECT_FLAT_FACES) ? 1 : 0);
+
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_mesher.voxels_buffer));
+    GL(glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                       (N + 2) * (N + 2) * (N + 2) * 4, data));
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_mesher.counter_buffer));
+    GL(glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(nb), &nb));
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_mesher.voxels_buffer));
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1,
+                        g_mesher.vertices_buffer));
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2,
+                        g_mesher.counter_buffer));
+    GL(glDispatchCompute(N / 4, N / 4, N / 4));
+    GL(glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT));
+
+    // This waits for the dispatch to be done.
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_mesher.counter_buffer));
+    GL(glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(nb), &nb));
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0));
+    GL(glUseProgram(prog));
+    counter_add(COUNTER_GL_UPLOAD_BYTES, (N + 2) * (N + 2) * (N + 2) * 4);
+    return min(nb, MAX_QUADS);
+}
+
+void gpu_mesher_copy(GLuint buffer, intptr_t offset, int nb)
+{
+    if (!nb) return;
+    GL(glBindBuffer(GL_COPY_READ_BUFFER, g_mesher.vertices_buffer));
+    GL(glBindBuffer(GL_COPY_WRITE_BUFFER, buffer));
+    GL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                           0, offset,
+                           nb * 4 * sizeof(voxel_packed_vertex_t)));
+    GL(glBindBuffer(GL_COPY_READ_BUFFER, 0));
+    GL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+}
+
+void gpu_mesher_release(void)
+{
+    GLuint buffers[3] = {g_mesher.voxels_buffer, g_mesher.vertices_buffer,
+                         g_mesher.counter_buffer};
+    if (g_mesher.support > 0) {
+        gl_shader_delete(g_mesher.shader);
+        GL(glDeleteBuffers(3, buffers));
+        counter_add(COUNTER_GL_BUFFERS_DELETED, 3);
+    }
+    memset(&g_mesher, 0, sizeof(g_mesher));
+}
+
+#else // HAS_COMPUTE_SHADER
+
+bool gpu_mesher_is_supported(void)
+{
+    return false;
+}
+
+int gpu_mesher_run(const uint8_t *data, int effects)
+{
+    return -1;
+}
+
+void gpu_mesher_copy(GLuint buffer, intptr_t offset, int nb)
+{
+}
+
+void gpu_mesher_release(void)
+{
+}
+
+#endif
@@ -0,0 +1,79 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: GPU mesher
+ *
+ * Generate the packed quads of the blocks with a compute shader.
+ *
+ * This gives the same quads as <mesh_generate_vertices> followed by
+ * <mesh_pack_vertices>, possibly in a different order, for the effects
+ * that don't use the marching cubes or the faces merging.  It needs GL 4.3
+ * or the compute shader and shader storage buffer extensions, so it is
+ * never available with GLES2 or WebGL.
+ */
+
+#ifndef GPU_MESHER_H
+#define GPU_MESHER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "utils/gl.h"
+
+/*
+ * Function: gpu_mesher_is_supported
+ * Return whether the compute shaders can be used with the current context.
+ */
+bool gpu_mesher_is_supported(void);
+
+/*
+ * Function: gpu_mesher_run
+ * Generate the quads of a block into the mesher output buffer.
+ *
+ * This waits for the GPU to know the number of quads, and keeps the
+ * current program bound.
+ *
+ * Parameters:
+ *   data    - The (N + 2)^3 RGBA voxels around the block, as returned by
+ *             <mesh_read>.
+ *   effects - The render effects, only EFFECT_FLAT_FACES is used.
+ *
+ * Return:
+ *   The number of quads, or -1 in case of error.
+ */
+int gpu_mesher_run(const uint8_t *data, int effects);
+
+/*
+ * Function: gpu_mesher_copy
+ * Copy the vertices generated by the last call to <gpu_mesher_run>.
+ *
+ * Parameters:
+ *   buffer - Destination GL buffer.
+ *   offset - Offset in the destination buffer, in bytes.
+ *   nb     - Number of quads to copy.
+ */
+void gpu_mesher_copy(GLuint buffer, intptr_t offset, int nb);
+
+/*
+ * Function: gpu_mesher_release
+ * Release all the GL resources of the mesher.
+ */
+void gpu_mesher_release(void);
+
+#endif // GPU_MESHER_H
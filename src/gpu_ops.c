@@ -0,0 +1,287 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "gpu_ops.h"
+
+#include <pthread.h>
+
+#if !defined(GLES2) && defined(GL_VERSION_4_3)
+#   define HAS_COMPUTE_SHADER 1
+#else
+#   define HAS_COMPUTE_SHADER 0
+#endif
+
+#define N BLOCK_SIZE
+#define BLOCK_BYTES (N * N * N * 4)
+
+// Relative tolerance on the shape functions values computed on the GPU.
+#define ERR_SCALE 1e-4
+
+#if HAS_COMPUTE_SHADER
+
+static struct {
+    bool        enabled;
+    pthread_t   thread;
+    int         support;    // 0: unknown, 1: supported, -1: not supported.
+    gl_shader_t *op_shader;
+    gl_shader_t *merge_shader;
+    GLuint      voxels_buffer;
+    GLuint      others_buffer;
+    GLuint      positions_buffer;
+    GLuint      flags_buffer;
+} g_ops = {};
+
+static void get_include(char *out, int size, bool merge)
+{
+    int n = 0;
+#define ADD(...) n += snprintf(out + n, size - n, __VA_ARGS__)
+    ADD("#define N %d\n#define FLAGS_SIZE %d\n", N, GPU_OPS_FLAGS_SIZE);
+    ADD("#define ERR_SCALE %g\n", ERR_SCALE);
+    ADD("#define MODE_OVER %d\n#define MODE_SUB %d\n", MODE_OVER, MODE_SUB);
+    ADD("#define MODE_SUB_CLAMP %d\n#define MODE_PAINT %d\n",
+        MODE_SUB_CLAMP, MODE_PAINT);
+    ADD("#define MODE_MAX %d\n#define MODE_INTERSECT %d\n",
+        MODE_MAX, MODE_INTERSECT);
+    ADD("#define MODE_MULT_ALPHA %d\n", MODE_MULT_ALPHA);
+    ADD("#define SHAPE_SPHERE 0\n#define SHAPE_CUBE 1\n");
+    if (merge) ADD("#define MERGE\n");
+#undef ADD
+    assert(n < size);
+}
+
+static GLuint create_buffer(int size)
+{
+    GLuint buffer;
+    GL(glGenBuffers(1, &buffer));
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer));
+    GL(glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_DYNAMIC_DRAW));
+    counter_add(COUNTER_GL_BUFFERS_CREATED, 1);
+    return buffer;
+}
+
+static bool init(void)
+{
+    int major = 0, minor = 0;
+    const char *version, *code;
+    char include[1024];
+
+    GL(version = (const char*)glGetString(GL_VERSION));
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    if (    !(major > 4 || (major == 4 && minor >= 3)) &&
+            !(gl_has_extension("GL_ARB_compute_shader") &&
+              gl_has_extension("GL_ARB_shader_storage_buffer_object")))
+        return false;
+
+    code = assets_get("asset://data/shaders/mesh_op_compute.glsl", NULL);
+    assert(code);
+    get_include(include, sizeof(include), false);
+    g_ops.op_shader = gl_shader_create_compute(code, include);
+    get_include(include, sizeof(include), true);
+    g_ops.merge_shader = gl_shader_create_compute(code, include);
+    if (!g_ops.op_shader || !g_ops.merge_shader) {
+        if (g_ops.op_shader) gl_shader_delete(g_ops.op_shader);
+        if (g_ops.merge_shader) gl_shader_delete(g_ops.merge_shader);
+        return false;
+    }
+    g_ops.voxels_buffer = create_buffer(GPU_OPS_BATCH * BLOCK_BYTES);
+    g_ops.others_buffer = create_buffer(GPU_OPS_BATCH * BLOCK_BYTES);
+    g_ops.positions_buffer = create_buffer(GPU_OPS_BATCH * 4 * sizeof(int));
+    g_ops.flags_buffer = create_buffer(
+            GPU_OPS_BATCH * GPU_OPS_FLAGS_SIZE * sizeof(uint32_t));
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0));
+    return true;
+}
+
+void gpu_ops_enable(void)
+{
+    g_ops.enabled = true;
+    g_ops.thread = pthread_self();
+}
+
+bool gpu_ops_is_available(void)
+{
+    if (!g_ops.enabled || !pthread_equal(pthread_self(), g_ops.thread))
+        return false;
+    if (!g_ops.support) {
+        g_ops.support = init() ? 1 : -1;
+        if (g_ops.support < 0) LOG_I("GPU operations not supported");
+    }
+    return g_ops.support > 0;
+}
+
+static void upload(GLuint buffer, int size, const void *data)
+{
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer));
+    GL(glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data));
+    counter_add(COUNTER_GL_UPLOAD_BYTES, size);
+}
+
+static void download(GLuint buffer, int size, void *data)
+{
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer));
+    GL(glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data));
+}
+
+// Run the shader on a batch of blocks, and read back the voxels and flags.
+static void run(gl_shader_t *shader, int nb, uint8_t *data, uint32_t *flags)
+{
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_ops.voxels_buffer));
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, g_ops.others_buffer));
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2,
+                        g_ops.positions_buffer));
+    GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, g_ops.flags_buffer));
+    GL(glDispatchCompute(N / 4, N / 4, N / 4 * nb));
+    GL(glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT));
+    // This waits for the dispatch to be done.
+    download(g_ops.voxels_buffer, nb * BLOCK_BYTES, data);
+    download(g_ops.flags_buffer,
+             nb * GPU_OPS_FLAGS_SIZE * sizeof(uint32_t), flags);
+    GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0));
+}
+
+bool gpu_ops_apply(const gpu_op_t *op, int nb, const int (*pos)[3],
+                   uint8_t *data, uint32_t *flags)
+{
+    const painter_t *painter = op->painter;
+    const float (*b)[4];
+    float box_min[3], box_max[3];
+    int (*positions)[4], i, shape;
+    GLint prog;
+    gl_shader_t *shader;
+
+    assert(nb <= GPU_OPS_BATCH);
+    if (painter->shape == &shape_sphere) shape = 0;
+    else if (painter->shape == &shape_cube) shape = 1;
+    else if (painter->shape == &shape_cylinder) shape = 2;
+    else return false;
+    if (!gpu_ops_is_available()) return false;
+
+    shader = g_ops.op_shader;
+    // We could be in the middle of a rendering.
+    GL(glGetIntegerv(GL_CURRENT_PROGRAM, &prog));
+    GL(glUseProgram(shader->prog));
+    gl_update_uniform(shader, "u_mode", painter->mode);
+    gl_update_uniform(shader, "u_color", VEC(painter->color[0],
+                      painter->color[1], painter->color[2],
+                      painter->color[3]));
+    gl_update_uniform(shader, "u_mat", op->mat);
+    gl_update_uniform(shader, "u_size", op->size);
+    gl_update_uniform(shader, "u_smoothness", painter->smoothness);
+    gl_update_uniform(shader, "u_shape", shape);
+    gl_update_uniform(shader, "u_use_box", op->use_box ? 1 : 0);
+    if (op->use_box) {
+        // Same bounds as bbox_contains_vec.
+        b = *painter->box;
+        vec3_set(box_min, b[3][0] - b[0][0], b[3][1] - b[1][1],
+                 b[3][2] - b[2][2]);
+        vec3_set(box_max, b[3][0] + b[0][0], b[3][1] + b[1][1],
+                 b[3][2] + b[2][2]);
+        gl_update_uniform(shader, "u_box_min", box_min);
+        gl_update_uniform(shader, "u_box_max", box_max);
+    }
+    gl_update_uniform(shader, "u_skip_src_empty", op->skip_src_empty ? 1 : 0);
+    gl_update_uniform(shader, "u_skip_dst_empty", op->skip_dst_empty ? 1 : 0);
+
+    positions = calloc(nb, sizeof(*positions));
+    for (i = 0; i < nb; i++) memcpy(positions[i], pos[i], sizeof(pos[i]));
+    upload(g_ops.positions_buffer, nb * sizeof(*positions), positions);
+    free(positions);
+    upload(g_ops.voxels_buffer, nb * BLOCK_BYTES, data);
+    memset(flags, 0, nb * GPU_OPS_FLAGS_SIZE * sizeof(uint32_t));
+    upload(g_ops.flags_buffer, nb * GPU_OPS_FLAGS_SIZE * sizeof(uint32_t),
+           flags);
+    run(shader, nb, data, flags);
+    GL(glUseProgram(prog));
+    return true;
+}
+
+bool gpu_ops_merge(int mode, const uint8_t color[4], int nb, uint8_t *data,
+                   const uint8_t *other, uint32_t *flags)
+{
+    GLint prog;
+    gl_shader_t *shader;
+
+    assert(nb <= GPU_OPS_BATCH);
+    if (!gpu_ops_is_available()) return false;
+    shader = g_ops.merge_shader;
+    GL(glGetIntegerv(GL_CURRENT_PROGRAM, &prog));
+    GL(glUseProgram(shader->prog));
+    gl_update_uniform(shader, "u_mode", mode);
+    gl_update_uniform(shader, "u_use_color", color ? 1 : 0);
+    if (color) {
+        gl_update_uniform(shader, "u_color",
+                          VEC(color[0], color[1], color[2], color[3]));
+    }
+    upload(g_ops.voxels_buffer, nb * BLOCK_BYTES, data);
+    upload(g_ops.others_buffer, nb * BLOCK_BYTES, other);
+    memset(flags, 0, nb * GPU_OPS_FLAGS_SIZE * sizeof(uint32_t));
+    upload(g_ops.flags_buffer, nb * GPU_OPS_FLAGS_SIZE * sizeof(uint32_t),
+           flags);
+    run(shader, nb, data, flags);
+    GL(glUseProgram(prog));
+    return true;
+}
+
+void gpu_ops_release(void)
+{
+    GLuint buffers[4] = {g_ops.voxels_buffer, g_ops.others_buffer,
+                         g_ops.positions_buffer, g_ops.flags_buffer};
+    bool enabled = g_ops.enabled;
+    pthread_t thread = g_ops.thread;
+
+    if (g_ops.support > 0) {
+        gl_shader_delete(g_ops.op_shader);
+        gl_shader_delete(g_ops.merge_shader);
+        GL(glDeleteBuffers(4, buffers));
+        counter_add(COUNTER_GL_BUFFERS_DELETED, 4);
+    }
+    memset(&g_ops, 0, sizeof(g_ops));
+    // The resources are created again on the next use.
+    g_ops.enabled = enabled;
+    g_ops.thread = thread;
+}
+
+#else // HAS_COMPUTE_SHADER
+
+void gpu_ops_enable(void)
+{
+}
+
+bool gpu_ops_is_available(void)
+{
+    return false;
+}
+
+bool gpu_ops_apply(const gpu_op_t *op, int nb, const int (*pos)[3],
+                   uint8_t *data, uint32_t *flags)
+{
+    return false;
+}
+
+bool gpu_ops_merge(int mode, const uint8_t color[4], int nb, uint8_t *data,
+                   const uint8_t *other, uint32_t *flags)
+{
+    return false;
+}
+
+void gpu_ops_release(void)
+{
+}
+
+#endif
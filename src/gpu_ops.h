@@ -0,0 +1,121 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: GPU ops
+ *
+ * Apply the painters and the merges of the large <mesh_op> and
+ * <mesh_merge> operations to batches of blocks with a compute shader.
+ *
+ * The results are the same as on the CPU: the float operations of the GPU
+ * can round differently, so the voxels whose value could depend on the
+ * rounding are left unchanged and flagged as uncertain, and the caller
+ * computes them on the CPU.  Like the GPU mesher, this needs GL 4.3 or the
+ * compute shader and shader storage buffer extensions, and since it uses
+ * the GL context it is only available on the thread that called
+ * <gpu_ops_enable>.
+ */
+
+#ifndef GPU_OPS_H
+#define GPU_OPS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mesh.h"
+#include "mesh_utils.h"
+
+// Maximum number of blocks per call.
+#define GPU_OPS_BATCH 256
+
+// Number of flags uints of each block: the first one is a mask of
+// GPU_OPS_CHANGED and GPU_OPS_UNCERTAIN, followed by one bit per voxel set
+// if the voxel needs to be computed on the CPU.
+#define GPU_OPS_FLAGS_SIZE (1 + BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE / 32)
+
+enum {
+    GPU_OPS_CHANGED     = 1 << 0,
+    GPU_OPS_UNCERTAIN   = 1 << 1,
+};
+
+// Arguments of a painter operation, like in op_block.
+typedef struct {
+    const painter_t *painter;
+    float           mat[4][4];  // Voxels positions to shape space.
+    float           size[3];    // Size of the shape.
+    bool            use_box;    // Clip the voxels with the painter box.
+    bool            skip_src_empty;
+    bool            skip_dst_empty;
+} gpu_op_t;
+
+/*
+ * Function: gpu_ops_enable
+ * Allow the GPU operations on the current thread, that owns the GL context.
+ */
+void gpu_ops_enable(void);
+
+/*
+ * Function: gpu_ops_is_available
+ * Return whether the GPU operations can be used on the current thread.
+ */
+bool gpu_ops_is_available(void);
+
+/*
+ * Function: gpu_ops_apply
+ * Apply a painter to a batch of blocks.
+ *
+ * Parameters:
+ *   op     - The painter operation.  Only the sphere, cube and cylinder
+ *            shapes are supported.
+ *   nb     - Number of blocks, up to GPU_OPS_BATCH.
+ *   pos    - Position of each block.
+ *   data   - The N^3 RGBA voxels of each block, updated in place.
+ *   flags  - Output of the GPU_OPS_FLAGS_SIZE flags of each block.
+ *
+ * Return:
+ *   false if the operation could not be done on the GPU.
+ */
+bool gpu_ops_apply(const gpu_op_t *op, int nb, const int (*pos)[3],
+                   uint8_t *data, uint32_t *flags);
+
+/*
+ * Function: gpu_ops_merge
+ * Merge a batch of blocks into an other one, like <combine_voxels>.
+ *
+ * Parameters:
+ *   mode   - The merge mode.
+ *   color  - Color multiplied with the other blocks, or NULL.
+ *   nb     - Number of blocks, up to GPU_OPS_BATCH.
+ *   data   - The N^3 RGBA voxels of each destination block, updated in
+ *            place.
+ *   other  - The N^3 RGBA voxels of each merged block.
+ *   flags  - Output of the GPU_OPS_FLAGS_SIZE flags of each block.
+ *
+ * Return:
+ *   false if the operation could not be done on the GPU.
+ */
+bool gpu_ops_merge(int mode, const uint8_t color[4], int nb, uint8_t *data,
+                   const uint8_t *other, uint32_t *flags);
+
+/*
+ * Function: gpu_ops_release
+ * Release all the GL resources of the GPU operations.
+ */
+void gpu_ops_release(void);
+
+#endif // GPU_OPS_H
@@ -424,11 +424,35 @@ static void load_fonts_texture()
     GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
     GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
                     GL_RGBA, GL_UNSIGNED_BYTE, pixels));
+    mem_stats_add(MEM_TEXTURES, (int64_t)width * height * 4);
     io.Fonts->TexID = (void *)(intptr_t)tex_id;
 }
 
+// Dear imgui allocation functions, to report the GUI memory usage.  We
+// store the size of each allocation before its data.
+#define GUI_ALLOC_HEADER 16
+
+static void *gui_alloc(size_t size, void *user)
+{
+    char *data = (char*)malloc(size + GUI_ALLOC_HEADER);
+    if (!data) return NULL;
+    *(size_t*)data = size;
+    mem_stats_add(MEM_GUI, size);
+    return data + GUI_ALLOC_HEADER;
+}
+
+static void gui_free(void *ptr, void *user)
+{
+    char *data;
+    if (!ptr) return;
+    data = (char*)ptr - GUI_ALLOC_HEADER;
+    mem_stats_add(MEM_GUI, -(int64_t)*(size_t*)data);
+    free(data);
+}
+
 static void init_ImGui(void)
 {
+    ImGui::SetAllocatorFunctions(gui_alloc, gui_free);
     ImGui::CreateContext();
     ImGuiIO& io = ImGui::GetIO();
     io.DeltaTime = 1.0f/60.0f;
@@ -564,6 +588,8 @@ void gui_release_graphics(void)
     g_tex_icons = NULL;
 
     GL(glDeleteTextures(1, (GLuint*)&io.Fonts->TexID));
+    mem_stats_add(MEM_TEXTURES,
+                  -(int64_t)io.Fonts->TexWidth * io.Fonts->TexHeight * 4);
     io.Fonts->TexID = 0;
     io.Fonts->Clear();
 }
@@ -1615,6 +1641,120 @@ bool gui_palette_entry(const uint8_t color[4], uint8_t target[4])
     return ret;
 }
 
+static ImU32 profiler_scope_color(const char *name, bool gpu)
+{
+    // Use the name to get a stable color for each scope.
+    uint32_t h = 0;
+    while (*name) h = h * 31 + *name++;
+    return ImColor::HSV((h % 64) / 64.f, gpu ? 0.3 : 0.5, 0.8);
+}
+
+bool gui_profiler_timeline(int *frame)
+{
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    const float w = ImGui::GetContentRegionAvail().x;
+    const float graph_h = 40;
+    const float row_h = ImGui::GetFontSize() + 2;
+    const ImU32 text_color = ImGui::GetColorU32(COLOR(WIDGET, TEXT, false));
+    const profiler_event_t *events, *ev;
+    double duration, scale, latency, max_duration = 1. / 30;
+    float bar_w, h, x;
+    int i, nb, nb_frames, nb_rows = 0, nb_cpu_rows = 0;
+    int row, gpu_depth[32] = {};
+    bool ret = false;
+    ImVec2 pos, a, b;
+    ImU32 color;
+
+    // Duration of all the recorded frames, most recent on the right.
+    for (nb_frames = 0; profiler_get_frame(nb_frames, &duration, NULL, NULL);
+         nb_frames++) {
+        max_duration = max(max_duration, duration);
+    }
+    pos = ImGui::GetCursorScreenPos();
+    ImGui::InvisibleButton("frames", ImVec2(w, graph_h));
+    draw_list->AddRectFilled(pos, pos + ImVec2(w, graph_h),
+                             ImGui::GetColorU32(COLOR(WIDGET, INNER, false)));
+    bar_w = w / PROFILER_NB_FRAMES;
+    for (i = 0; i < nb_frames; i++) {
+        profiler_get_frame(i, &duration, NULL, NULL);
+        h = duration / max_duration * graph_h;
+        x = pos.x + w - (i + 1) * bar_w;
+        color = (i == *frame) ? 0xFFFFFFFF :
+                (duration < 1. / 55) ? 0xFF40C040 :
+                (duration < 1. / 28) ? 0xFF40C0C0 : 0xFF4040C0;
+        draw_list->AddRectFilled(ImVec2(x, pos.y + graph_h - h),
+                                 ImVec2(x + bar_w, pos.y + graph_h), color);
+    }
+    // 60 fps line.
+    h = graph_h - graph_h / max_duration / 60;
+    draw_list->AddLine(pos + ImVec2(0, h), pos + ImVec2(w, h), 0x80FFFFFF);
+    if (ImGui::IsItemHovered()) {
+        i = (pos.x + w - ImGui::GetMousePos().x) / bar_w;
+        if (profiler_get_frame(i, &duration, NULL, NULL)) {
+            ImGui::SetTooltip("%.2f ms", duration * 1000);
+            if (ImGui::IsItemClicked()) {
+                *frame = i;
+                ret = true;
+            }
+        }
+    }
+
+    // Scopes of the selected frame.  The GPU scopes are shown in their own
+    // rows under the CPU ones.
+    if (!profiler_get_frame(*frame, &duration, &events, &nb)) return ret;
+    ImGui::Text("Frame: %.2f ms", duration * 1000);
+    latency = profiler_get_input_latency(*frame);
+    if (latency >= 0)
+        ImGui::Text("Input latency: %.2f ms", latency * 1000);
+    scale = duration;
+    for (ev = events; ev < events + nb; ev++) {
+        nb_cpu_rows = max(nb_cpu_rows, ev->depth + 1);
+        if (ev->gpu && ev->gpu_end >= ev->gpu_start)
+            scale = max(scale, ev->gpu_end);
+    }
+    for (ev = events; ev < events + nb; ev++) {
+        gpu_depth[ev->depth] = (ev->depth ? gpu_depth[ev->depth - 1] : 0) +
+                               (ev->gpu ? 1 : 0);
+        if (ev->gpu) nb_rows = max(nb_rows, gpu_depth[ev->depth]);
+    }
+    nb_rows += nb_cpu_rows;
+
+    pos = ImGui::GetCursorScreenPos();
+    ImGui::Dummy(ImVec2(w, nb_rows * row_h));
+    draw_list->AddRectFilled(pos, pos + ImVec2(w, nb_rows * row_h),
+                             ImGui::GetColorU32(COLOR(WIDGET, INNER, false)));
+    for (ev = events; ev < events + nb; ev++) {
+        gpu_depth[ev->depth] = (ev->depth ? gpu_depth[ev->depth - 1] : 0) +
+                               (ev->gpu ? 1 : 0);
+        if (ev->end < ev->start) continue;
+        for (i = 0; i < (ev->gpu ? 2 : 1); i++) {
+            if (i == 0) {
+                row = ev->depth;
+                a = pos + ImVec2(ev->start / scale * w, row * row_h);
+                b = pos + ImVec2(ev->end / scale * w, (row + 1) * row_h);
+                duration = ev->end - ev->start;
+            } else {
+                if (ev->gpu_end < ev->gpu_start) continue;
+                row = nb_cpu_rows + gpu_depth[ev->depth] - 1;
+                a = pos + ImVec2(ev->gpu_start / scale * w, row * row_h);
+                b = pos + ImVec2(ev->gpu_end / scale * w, (row + 1) * row_h);
+                duration = ev->gpu_end - ev->gpu_start;
+            }
+            b.x = max(b.x, a.x + 1);
+            draw_list->AddRectFilled(a, b - ImVec2(0, 1),
+                                     profiler_scope_color(ev->name, i));
+            draw_list->PushClipRect(a, b, true);
+            draw_list->AddText(a + ImVec2(2, 1), text_color, ev->name);
+            draw_list->PopClipRect();
+            if (ImGui::IsWindowHovered() && ImGui::IsMouseHoveringRect(a, b)) {
+                ImGui::SetTooltip("%s%s: %.2f ms", ev->name,
+                                  i ? " (GPU)" : "", duration * 1000);
+            }
+        }
+    }
+    return ret;
+}
+
 bool gui_menu_begin(const char *label)
 {
     return ImGui::BeginMenu(label);
@@ -123,6 +123,19 @@ bool gui_layer_item(int i, int icon, bool *visible, bool *edit,
 bool gui_is_key_down(int key);
 bool gui_palette_entry(const uint8_t color[4], uint8_t target[4]);
 
+/*
+ * Function: gui_profiler_timeline
+ * Show the durations of the profiler frames, and the scopes of one frame.
+ *
+ * Parameters:
+ *   frame - Index of the frame to show the scopes of, as in
+ *           <profiler_get_frame>.  Set to the clicked frame if any.
+ *
+ * Return:
+ *   true if a frame has been clicked.
+ */
+bool gui_profiler_timeline(int *frame);
+
 bool gui_need_full_version(void);
 
 
@@ -17,27 +17,118 @@
  */
 
 #include "goxel.h"
+#include "brickmap.h"
 
 void gui_debug_panel(void)
 {
     mesh_global_stats_t stats;
+    cache_stats_t cache_stats;
+    cache_t *cache;
+    const char *name;
+    int i, nb_bricks, bricks_capacity;
+    char buf[64];
+    uint64_t nb_gets;
+    bool profiling;
+    const char *path;
+    static int profiler_frame = 0;
+    uint64_t counters[COUNTER_COUNT];
+    static uint64_t last_counters[COUNTER_COUNT] = {};
+    int64_t mem, mem_peak;
 
     gui_text("FPS: %d", (int)round(goxel.fps));
     mesh_get_global_stats(&stats);
     gui_text("Nb meshes: %d", stats.nb_meshes);
     gui_text("Nb blocks: %d", stats.nb_blocks);
+    gui_text("Nb compressed: %d", stats.nb_compressed);
     gui_text("Mem: %dM", (int)(stats.mem / (1 << 20)));
+    gui_text("Pools mem: %dM", (int)(stats.pools_mem / (1 << 20)));
+    gui_text("Dedup blocks: %d (%dM)", stats.nb_dedup,
+             (int)(stats.dedup_mem / (1 << 20)));
+    gui_text("Paged blocks: %d (%dM, file %dM)", stats.nb_paged,
+             (int)(stats.paged_mem / (1 << 20)),
+             (int)(stats.spill_size / (1 << 20)));
+    gui_text("Page outs/ins: %d / %d", (int)stats.nb_page_outs,
+             (int)stats.nb_page_ins);
+    nb_gets = stats.nb_lookups + stats.nb_accessor_hits;
+    gui_text("Accessor hit rate: %d%%",
+             nb_gets ? (int)(stats.nb_accessor_hits * 100 / nb_gets) : 0);
+    gui_text("Drawn blocks: %d", goxel.rend.stats.nb_blocks);
+    gui_text("Culled blocks: %d", goxel.rend.stats.nb_culled);
+    gui_text("Occluded blocks: %d", goxel.rend.stats.nb_occluded);
+    gui_text("Lod blocks: %d", goxel.rend.stats.nb_lod);
+    gui_text("Ray marched meshes: %d", goxel.rend.stats.nb_ray_marched);
+    gui_text("Overlay draws: %d", goxel.rend.stats.nb_overlay_draws);
+    if (goxel.rend.stats.overdraw)
+        gui_text("Overdraw: %.2f", goxel.rend.stats.overdraw);
+    brickmap_get_stats(&nb_bricks, &bricks_capacity);
+    gui_text("Bricks: %d / %d", nb_bricks, bricks_capacity);
+    render_get_cache_stats(&cache_stats);
+    gui_text("Render cache: %dM / %dM (%d items)",
+             cache_stats.size / MB, cache_stats.max_size / MB,
+             cache_stats.nb_items);
+    gui_text("Cache hits: %d, misses: %d",
+             (int)cache_stats.hits, (int)cache_stats.misses);
+    gui_text("Cache evictions: %d", (int)cache_stats.evictions);
+    for (i = 0; cache_registry_get(i, &name, &cache); i++) {
+        cache_get_stats(cache, &cache_stats);
+        nb_gets = cache_stats.hits + cache_stats.misses;
+        gui_text("%s cache: %dM / %dM (%d items)", name,
+                 cache_stats.size / MB, cache_stats.max_size / MB,
+                 cache_stats.nb_items);
+        gui_text("%s hit rate: %d%%", name,
+                 nb_gets ? (int)(cache_stats.hits * 100 / nb_gets) : 0);
+    }
+    gui_text("Undo memory: %dM / %dM",
+             (int)(image_history_get_mem(goxel.image) / MB),
+             (int)(image_history_get_budget() / MB));
 
     if (!DEFINED(GLES2)) {
         gui_checkbox_flag("Show wireframe", &goxel.view_effects,
                           EFFECT_WIREFRAME, NULL);
     }
 
+    gui_checkbox("CPU picking", &goxel.cpu_picking, NULL);
+
+    // The counters totals, and their increase since the last frame.
+    counters_get(counters);
+    if (COUNTERS && gui_collapsing_header("Counters", false)) {
+        for (i = 0; i < COUNTER_COUNT; i++) {
+            gui_text("%s: %llu (+%llu)", counter_get_name(i),
+                     (unsigned long long)counters[i],
+                     (unsigned long long)(counters[i] - last_counters[i]));
+        }
+    }
+    memcpy(last_counters, counters, sizeof(counters));
+
+    if (gui_collapsing_header("Memory", false)) {
+        for (i = 0; i < MEM_COUNT; i++) {
+            mem_stats_get(i, &mem, &mem_peak);
+            gui_text("%s: %.1fM (peak %.1fM)", mem_stats_get_name(i),
+                     (double)mem / MB, (double)mem_peak / MB);
+        }
+    }
+
+    if (gui_collapsing_header("Profiler", false)) {
+        profiling = profiler_is_enabled();
+        if (gui_checkbox("Record", &profiling, NULL))
+            profiler_set_enabled(profiling);
+        // Stop the recording to inspect the clicked frame.
+        if (gui_profiler_timeline(&profiler_frame))
+            profiler_set_enabled(false);
+        if (gui_button("Save trace", -1, 0)) {
+            path = sys_get_save_path("json\0*.json\0", "trace.json");
+            if (path && profiler_dump_trace(path) != 0)
+                LOG_E("Cannot save trace to %s", path);
+        }
+    }
+
     if (gui_button("Clear undo history", -1, 0)) {
         image_history_resize(goxel.image, 0);
     }
-    if (gui_button("On low memory", -1, 0)) {
-        goxel_on_low_memory();
+    for (i = LOW_MEMORY_TRIM; i <= LOW_MEMORY_CRITICAL; i++) {
+        snprintf(buf, sizeof(buf), "On low memory (level %d)", i);
+        if (gui_button(buf, -1, 0))
+            goxel_on_low_memory(i);
     }
     if (gui_button("Test release", -1, 0)) {
         goxel.request_test_graphic_release = true;
@@ -38,19 +38,78 @@ static void toggle_layer_only_visible(layer_t *layer)
     layer->visible = true;
 }
 
+static void gui_procedural(procedural_t *proc)
+{
+    const char *OPS[] = {"Union", "Subtract", "Intersect"};
+    const procedural_kernel_t *kernel;
+    procedural_prim_t *prim;
+    int i;
+    char label[32];
+
+    gui_text("Kernel");
+    if (gui_combo_begin("##kernel", proc->kernel->name)) {
+        for (i = 0; (kernel = procedural_get_kernel(NULL, i)); i++) {
+            if (gui_combo_item(kernel->name, kernel == proc->kernel))
+                proc->kernel = kernel;
+        }
+        gui_combo_end();
+    }
+
+    if (proc->kernel == &procedural_terrain) {
+        gui_group_begin(NULL);
+        gui_input_int("Seed", &proc->seed, 0, 0);
+        gui_input_int("Octaves", &proc->octaves, 1, 8);
+        gui_input_float("Scale", &proc->scale, 1, 1, 4096, "%.0f");
+        gui_input_float("Height", &proc->height, 0.05, 0, 1, NULL);
+        gui_input_float("Amplitude", &proc->amplitude, 0.05, 0, 1, NULL);
+        gui_group_end();
+    }
+
+    if (proc->kernel == &procedural_csg) {
+        for (i = 0; i < proc->nb_prims; i++) {
+            prim = &proc->prims[i];
+            snprintf(label, sizeof(label), "prim%d", i);
+            gui_push_id(label);
+            gui_group_begin(NULL);
+            tool_gui_shape(&prim->shape);
+            gui_combo("##op", &prim->op, OPS, ARRAY_SIZE(OPS));
+            gui_input_float("x", &prim->pos[0], 1, 0, 0, "%.0f");
+            gui_input_float("y", &prim->pos[1], 1, 0, 0, "%.0f");
+            gui_input_float("z", &prim->pos[2], 1, 0, 0, "%.0f");
+            gui_input_float("w", &prim->size[0], 1, 1, 4096, "%.0f");
+            gui_input_float("h", &prim->size[1], 1, 1, 4096, "%.0f");
+            gui_input_float("d", &prim->size[2], 1, 1, 4096, "%.0f");
+            if (gui_button("Remove", 1, 0)) {
+                memmove(prim, prim + 1,
+                        (proc->nb_prims - i - 1) * sizeof(*prim));
+                proc->nb_prims--;
+            }
+            gui_group_end();
+            gui_pop_id();
+        }
+        if (    proc->nb_prims < PROCEDURAL_MAX_PRIMS &&
+                gui_button("Add primitive", 1, 0)) {
+            proc->prims[proc->nb_prims++] = (procedural_prim_t){
+                .shape = &shape_sphere,
+                .size = {8, 8, 8},
+            };
+        }
+    }
+}
 
 void gui_layers_panel(void)
 {
     layer_t *layer;
     material_t *material;
-    int i = 0, icon, bbox[2][3];
+    int i = 0, icon, bbox[2][3], nb_frames;
     bool current, visible, bounded;
 
     gui_group_begin(NULL);
     DL_FOREACH_REVERSE(goxel.image->layers, layer) {
         current = goxel.image->active_layer == layer;
         visible = layer->visible;
-        icon = layer->base_id ? ICON_LINK : layer->shape ? ICON_SHAPE : -1;
+        icon = layer->base_id ? ICON_LINK :
+               (layer->shape || layer->procedural) ? ICON_SHAPE : -1;
         gui_layer_item(i, icon, &visible, &current,
                        layer->name, sizeof(layer->name));
         if (current && goxel.image->active_layer != layer) {
@@ -85,15 +144,36 @@ void gui_layers_panel(void)
     if (!box_is_null(goxel.image->box) && gui_button("Crop to image", 1, 0)) {
         mesh_crop(layer->mesh, goxel.image->box);
     }
-    if (layer->shape)
+    if (layer->shape || layer->procedural)
         gui_action_button(ACTION_img_unclone_layer, "To mesh", 1);
 
     if (gui_action_button(ACTION_img_new_shape_layer, "New Shape Layer", 1)) {
         action_exec2(ACTION_tool_set_move);
     }
+    if (gui_action_button(ACTION_img_new_procedural_layer,
+                          "New Procedural Layer", 1)) {
+        action_exec2(ACTION_tool_set_move);
+    }
 
     gui_group_end();
 
+    gui_group_begin(NULL);
+    nb_frames = image_get_nb_frames(goxel.image);
+    if (nb_frames) {
+        gui_text("Frame %d / %d", image_get_frame(goxel.image) + 1,
+                 nb_frames);
+        gui_action_button(ACTION_img_previous_frame, NULL, 0);
+        gui_same_line();
+        gui_action_button(ACTION_img_next_frame, NULL, 0);
+        gui_same_line();
+        gui_action_button(ACTION_img_add_frame, NULL, 0);
+        gui_same_line();
+        gui_action_button(ACTION_img_del_frame, NULL, 0);
+    } else {
+        gui_action_button(ACTION_img_add_frame, "Add animation frame", 1);
+    }
+    gui_group_end();
+
     if (layer->base_id) {
         gui_group_begin(NULL);
         gui_action_button(ACTION_img_unclone_layer, "Unclone", 1);
@@ -101,9 +181,13 @@ void gui_layers_panel(void)
         gui_group_end();
     }
     if (layer->image) {
+        gui_group_begin(NULL);
+        gui_input_int("Depth", &goxel.image_layer_depth, 1, 256);
         gui_action_button(ACTION_img_image_layer_to_mesh, "To Mesh", 1);
+        gui_group_end();
     }
-    if (!layer->shape && gui_checkbox("Bounded", &bounded, NULL)) {
+    if (    !layer->shape && !layer->procedural &&
+            gui_checkbox("Bounded", &bounded, NULL)) {
         if (bounded) {
             mesh_get_bbox(layer->mesh, bbox, true);
             if (bbox[0][0] > bbox[1][0]) memset(bbox, 0, sizeof(bbox));
@@ -120,6 +204,11 @@ void gui_layers_panel(void)
         tool_gui_shape(&layer->shape);
         gui_color("##color", layer->color);
     }
+    if (layer->procedural) {
+        tool_gui_drag_mode(&goxel.tool_drag_mode);
+        gui_procedural(layer->procedural);
+        gui_color("##color", layer->color);
+    }
 
     gui_text("Material");
     if (gui_combo_begin("##material",
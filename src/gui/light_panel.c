@@ -35,6 +35,8 @@ void gui_light_panel(void)
         if (gui_input_float("Shadow", &v, 0.1, 0, 0, NULL)) {
             goxel.rend.settings.shadow = clamp(v, 0, 1);
         }
+        gui_checkbox("Fit shadow to view", &goxel.rend.settings.shadow_fit_view,
+                     NULL);
     }
 
     v = goxel.rend.settings.ambient;
@@ -44,6 +44,7 @@ void gui_palette_panel(void)
     free(names);
 
     p = goxel.palette;
+    palette_load(p);
 
     for (i = 0; i < p->size; i++) {
         snprintf(id, sizeof(id), "%d", i);
@@ -47,6 +47,31 @@ void gui_render_panel(void)
     gui_group_end();
 
     gui_input_int("Samples", &pt->num_samples, 1, 10000);
+    gui_input_float("Noise", &pt->noise_threshold, 0.001, 0, 1, "%.3f");
+    gui_checkbox("Denoise", &pt->denoise,
+                 "Filter the noise of the image, guided by the surfaces "
+                 "colors and normals");
+
+    gui_text("Intersection");
+    gui_group_begin(NULL);
+    gui_selectable_toggle("BVH", &pt->backend, PT_BACKEND_BVH, NULL, -1);
+    gui_selectable_toggle("Voxels", &pt->backend, PT_BACKEND_VOXELS,
+                          "Faster to start, only for the cube rendering",
+                          -1);
+    gui_group_end();
+    if (pt->backend == PT_BACKEND_BVH) {
+        gui_checkbox("Fast BVH build", &pt->bvh_fast,
+                     "Faster to start, but slower to trace.  The command "
+                     "line renders always use the slower build");
+    }
+    if (pt->bvh_time)
+        gui_text("BVH build: %.0f ms", pt->bvh_time * 1000);
+
+    gui_group_begin("Threads");
+    gui_input_int("Count (0: auto)", &pt->nb_threads, 0, 1024);
+    gui_checkbox("Pin to cpus", &pt->pin_threads,
+                 "Run each thread on its own cpu");
+    gui_group_end();
 
     if (pt->status == PT_STOPPED && gui_button("Start", 1, 0))
         pt->status = PT_RUNNING;
@@ -39,7 +39,8 @@ int gui_settings_popup(void *data)
 {
     const char **names;
     theme_t *theme;
-    int i, nb, current;
+    int i, nb, current, budget, interval, steps;
+    bool changed;
     theme_t *themes = theme_get_list();
 
     gui_popup_body_begin();
@@ -85,6 +86,65 @@ int gui_settings_popup(void *data)
     gui_same_line();
     if (gui_button("Save", 0, 0)) theme_save();
 #endif
+    if (gui_collapsing_header("Rendering", false)) {
+        budget = render_get_cache_budget() / MB;
+        // The cache size is an int, so we can't go over 2GB.
+        if (gui_input_int("Cache (MB)", &budget, 64, 2047))
+            render_set_cache_budget(budget * MB);
+        gui_checkbox("Idle mode", &goxel.idle_mode,
+                     "Only redraw at full speed when something changed");
+        if (goxel.idle_mode)
+            gui_input_int("Idle FPS", &goxel.idle_fps, 1, 60);
+        gui_checkbox("Dynamic resolution", &goxel.dynres.enabled,
+                     "Lower the resolution while moving the camera");
+        if (goxel.dynres.enabled) {
+            gui_input_float("Budget (ms)", &goxel.dynres.budget, 1, 1, 100,
+                            NULL);
+            gui_checkbox("Shadows while moving", &goxel.dynres.shadow, NULL);
+        }
+        if (!DEFINED(GLES2)) {
+            gui_checkbox("Low latency cursor", &goxel.late_cursor.enabled,
+                         "Draw the cursor over a cached view "
+                         "(no antialiasing)");
+        }
+        gui_input_float("Upload budget (ms)", &goxel.frame_tasks_budget,
+                        1, 0, 100, NULL);
+        gui_checkbox("GPU meshing", &goxel.rend.gpu_meshing,
+                     "Generate the blocks faces with compute shaders");
+        gui_checkbox("Vertex pulling", &goxel.rend.vertex_pulling,
+                     "Upload 8 bytes per face instead of the vertices");
+        gui_checkbox("Background uploads", &goxel.rend.background_uploads,
+                     "Create the blocks buffers in a second thread");
+        gui_checkbox("Depth pre-pass", &goxel.rend.depth_prepass,
+                     "Render the depth first with the shadows and borders");
+    }
+
+    if (gui_collapsing_header("Undo", false)) {
+        budget = image_history_get_budget() / MB;
+        if (gui_input_int("Memory (MB)", &budget, 16, 65536))
+            image_history_set_budget((uint64_t)budget * MB);
+        steps = image_history_get_spill_steps();
+        if (gui_input_int("Spill after (steps)", &steps, 0, 1000)) {
+            image_history_set_spill_steps(steps);
+            goxel_set_paging();
+        }
+    }
+
+    if (gui_collapsing_header("Paging", false)) {
+        changed = gui_input_int("Budget (MB)", &goxel.paging.budget,
+                                0, 65536);
+        changed = gui_checkbox("Spill to disk", &goxel.paging.spill,
+                       "Write the paged out blocks in the user directory") ||
+                  changed;
+        if (changed) goxel_set_paging();
+    }
+
+    if (gui_collapsing_header("Autosave", false)) {
+        interval = gox_get_autosave_interval() / 60;
+        if (gui_input_int("Interval (min)", &interval, 0, 1440))
+            gox_set_autosave_interval(interval * 60);
+    }
+
     if (gui_collapsing_header("Paths", false)) {
         gui_text("Palettes: %s/palettes", sys_get_user_dir());
         gui_text("Progs: %s/progs", sys_get_user_dir());
@@ -115,6 +175,59 @@ static int settings_ini_handler(void *user, const char *section,
             theme_set(value);
         }
     }
+    if (strcmp(section, "render") == 0) {
+        if (strcmp(name, "cache_budget") == 0) {
+            render_set_cache_budget(clamp(atoi(value), 64, 2047) * MB);
+        }
+        if (strcmp(name, "idle_mode") == 0) {
+            goxel.idle_mode = atoi(value);
+        }
+        if (strcmp(name, "idle_fps") == 0) {
+            goxel.idle_fps = clamp(atoi(value), 1, 60);
+        }
+        if (strcmp(name, "dynres") == 0) {
+            goxel.dynres.enabled = atoi(value);
+        }
+        if (strcmp(name, "dynres_budget") == 0) {
+            goxel.dynres.budget = clamp(atof(value), 1, 100);
+        }
+        if (strcmp(name, "dynres_shadow") == 0) {
+            goxel.dynres.shadow = atoi(value);
+        }
+        if (strcmp(name, "late_cursor") == 0) {
+            goxel.late_cursor.enabled = atoi(value);
+        }
+        if (strcmp(name, "gpu_meshing") == 0) {
+            goxel.rend.gpu_meshing = atoi(value);
+        }
+        if (strcmp(name, "vertex_pulling") == 0) {
+            goxel.rend.vertex_pulling = atoi(value);
+        }
+        if (strcmp(name, "background_uploads") == 0) {
+            goxel.rend.background_uploads = atoi(value);
+        }
+        if (strcmp(name, "depth_prepass") == 0) {
+            goxel.rend.depth_prepass = atoi(value);
+        }
+    }
+    if (strcmp(section, "undo") == 0) {
+        if (strcmp(name, "memory_budget") == 0) {
+            image_history_set_budget(
+                    (uint64_t)clamp(atoi(value), 16, 65536) * MB);
+        }
+        if (strcmp(name, "spill_steps") == 0)
+            image_history_set_spill_steps(clamp(atoi(value), 0, 1000));
+    }
+    if (strcmp(section, "paging") == 0) {
+        if (strcmp(name, "budget") == 0)
+            goxel.paging.budget = clamp(atoi(value), 0, 65536);
+        if (strcmp(name, "spill") == 0)
+            goxel.paging.spill = atoi(value);
+    }
+    if (strcmp(section, "autosave") == 0) {
+        if (strcmp(name, "interval") == 0)
+            gox_set_autosave_interval(clamp(atoi(value), 0, 1440) * 60);
+    }
     if (strcmp(section, "shortcuts") == 0) {
         if ((a = action_get_by_name(name))) {
             strncpy(a->shortcut, value, sizeof(a->shortcut) - 1);
@@ -130,6 +243,7 @@ void settings_load(void)
     char path[1024];
     snprintf(path, sizeof(path), "%s/settings.ini", sys_get_user_dir());
     ini_parse(path, settings_ini_handler, NULL);
+    goxel_set_paging();
 }
 
 static int shortcut_save_callback(action_t *a, void *user)
@@ -154,6 +268,32 @@ void settings_save(void)
     fprintf(file, "[ui]\n");
     fprintf(file, "theme=%s\n", theme_get()->name);
 
+    fprintf(file, "[render]\n");
+    fprintf(file, "cache_budget=%d\n", render_get_cache_budget() / MB);
+    fprintf(file, "idle_mode=%d\n", goxel.idle_mode);
+    fprintf(file, "idle_fps=%d\n", goxel.idle_fps);
+    fprintf(file, "dynres=%d\n", goxel.dynres.enabled);
+    fprintf(file, "dynres_budget=%g\n", goxel.dynres.budget);
+    fprintf(file, "dynres_shadow=%d\n", goxel.dynres.shadow);
+    fprintf(file, "late_cursor=%d\n", goxel.late_cursor.enabled);
+    fprintf(file, "gpu_meshing=%d\n", goxel.rend.gpu_meshing);
+    fprintf(file, "vertex_pulling=%d\n", goxel.rend.vertex_pulling);
+    fprintf(file, "background_uploads=%d\n",
+            goxel.rend.background_uploads);
+    fprintf(file, "depth_prepass=%d\n", goxel.rend.depth_prepass);
+
+    fprintf(file, "[undo]\n");
+    fprintf(file, "memory_budget=%d\n",
+            (int)(image_history_get_budget() / MB));
+    fprintf(file, "spill_steps=%d\n", image_history_get_spill_steps());
+
+    fprintf(file, "[paging]\n");
+    fprintf(file, "budget=%d\n", goxel.paging.budget);
+    fprintf(file, "spill=%d\n", goxel.paging.spill);
+
+    fprintf(file, "[autosave]\n");
+    fprintf(file, "interval=%d\n", gox_get_autosave_interval() / 60);
+
     fprintf(file, "[shortcuts]\n");
     actions_iter(shortcut_save_callback, file);
 
@@ -35,6 +35,8 @@ void gui_view_panel(void)
         gui_color_small(COLORS[i].label, COLORS[i].color);
     }
     gui_checkbox("Hide box", &goxel.hide_box, NULL);
+    gui_checkbox("Split views", &goxel.views.split,
+                 "Also show the front, right and top orthographic views");
 
     gui_text("Effects");
 
@@ -64,4 +66,8 @@ void gui_view_panel(void)
         gui_checkbox_flag("Smooth Colors", &goxel.rend.settings.effects,
                           EFFECT_MC_SMOOTH, NULL);
     }
+    gui_checkbox_flag("Ray marching", &goxel.rend.settings.effects,
+                      EFFECT_RAY_MARCHING,
+                      "Ray march the voxels instead of drawing the faces, "
+                      "faster for very large scenes");
 }
@@ -103,26 +103,133 @@ static void make_uniq_name(
     }
 }
 
+/*
+ * Index of the layers by id, so that the lookups don't have to walk the
+ * list, which made the per frame update of the images with hundreds of
+ * layers quadratic.  It is built lazily, updated when a layer is appended,
+ * and simply deleted for the other changes, see <image_layers_changed>.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    int             id;
+    layer_t         *layer;
+} layer_entry_t;
+
+struct layers_index {
+    layer_entry_t   *table;     // Hash table of the entries.
+    layer_entry_t   *entries;
+    int             nb;
+    int             capacity;
+    int             free_id;    // All the ids below are used.
+};
+
+void image_layers_changed(image_t *img)
+{
+    layers_index_t *index = img->layers_index;
+    if (!index) return;
+    HASH_CLEAR(hh, index->table);
+    free(index->entries);
+    free(index);
+    img->layers_index = NULL;
+}
+
+static void layers_index_add(layers_index_t *index, layer_t *layer)
+{
+    layer_entry_t *entry;
+    // With duplicated ids we keep the first layer of the list.
+    HASH_FIND_INT(index->table, &layer->id, entry);
+    if (entry) return;
+    entry = &index->entries[index->nb++];
+    entry->id = layer->id;
+    entry->layer = layer;
+    HASH_ADD_INT(index->table, id, entry);
+}
+
+static layers_index_t *img_get_layers_index(const image_t *img_)
+{
+    // The index is only a cache, so we allow to update it on a const image.
+    image_t *img = (image_t*)img_;
+    layers_index_t *index = img->layers_index;
+    layer_t *layer;
+    int nb;
+
+    if (index) return index;
+    DL_COUNT(img->layers, layer, nb);
+    index = calloc(1, sizeof(*index));
+    index->capacity = nb * 2 + 16;
+    index->entries = calloc(index->capacity, sizeof(*index->entries));
+    index->free_id = 1;
+    DL_FOREACH(img->layers, layer) layers_index_add(index, layer);
+    img->layers_index = index;
+    return index;
+}
+
+// Add a layer at the end of the list.
+static void img_append_layer(image_t *img, layer_t *layer)
+{
+    layers_index_t *index = img->layers_index;
+    DL_APPEND(img->layers, layer);
+    if (!index) return;
+    if (index->nb == index->capacity)
+        image_layers_changed(img);
+    else
+        layers_index_add(index, layer);
+}
+
+// Same as img_get_layer, but the layer doesn't have to exist.
+static layer_t *img_find_layer(const image_t *img, int id)
+{
+    layer_entry_t *entry;
+    HASH_FIND_INT(img_get_layers_index(img)->table, &id, entry);
+    return entry ? entry->layer : NULL;
+}
+
 static layer_t *img_get_layer(const image_t *img, int id)
 {
     layer_t *layer;
     if (id == 0) return NULL;
-    DL_FOREACH(img->layers, layer)
-        if (layer->id == id) return layer;
-    assert(false);
-    return NULL;
+    layer = img_find_layer(img, id);
+    assert(layer);
+    return layer;
 }
 
+// Return the smallest id not used by any layer.
 static int img_get_new_id(const image_t *img)
 {
-    int id;
-    layer_t *layer;
-    for (id = 1;; id++) {
-        DL_FOREACH(img->layers, layer)
-            if (layer->id == id) break;
-        if (layer == NULL) break;
+    layers_index_t *index = img_get_layers_index(img);
+    while (img_find_layer(img, index->free_id)) index->free_id++;
+    return index->free_id;
+}
+
+static anim_frame_t *frame_get(const image_t *img, int index)
+{
+    anim_frame_t *frame;
+    DL_FOREACH(img->frames, frame) {
+        if (index-- == 0) return frame;
     }
-    return id;
+    return NULL;
+}
+
+static void frame_release_meshes(anim_frame_t *frame)
+{
+    int i;
+    for (i = 0; i < frame->nb_meshes; i++) mesh_delete(frame->meshes[i].mesh);
+    free(frame->meshes);
+    frame->meshes = NULL;
+    frame->nb_meshes = 0;
+}
+
+static anim_frame_t *frame_copy(const anim_frame_t *other)
+{
+    anim_frame_t *frame = calloc(1, sizeof(*frame));
+    int i;
+    frame->nb_meshes = other->nb_meshes;
+    frame->meshes = calloc(max(other->nb_meshes, 1), sizeof(*frame->meshes));
+    for (i = 0; i < other->nb_meshes; i++) {
+        frame->meshes[i].layer_id = other->meshes[i].layer_id;
+        frame->meshes[i].mesh = mesh_copy(other->meshes[i].mesh);
+    }
+    return frame;
 }
 
 static layer_t *layer_clone(layer_t *other)
@@ -140,57 +247,222 @@ static layer_t *layer_clone(layer_t *other)
     mat4_set_identity(layer->mat);
     layer->base_id = other->id;
     layer->base_mesh_key = mesh_get_key(other->mesh);
+    layer->base_mesh_version = mesh_get_version(other->mesh);
+    mat4_copy(layer->mat, layer->update_mat);
+    layer->update_mesh_key = mesh_get_key(layer->mesh);
     return layer;
 }
 
-// Make sure the layer mesh is up to date.
-void image_update(image_t *img)
+const layer_t *image_get_clone_instance(const image_t *img,
+                                        const layer_t *layer,
+                                        float model[4][4])
+{
+    const layer_t *base;
+    float det, v, tmp[3];
+    int i, j, nb;
+
+    if (!layer->base_id) return NULL;
+    base = img_get_layer(img, layer->base_id);
+    if (!base || !base->mesh) return NULL;
+
+    // Each axis has to map to exactly one other axis.
+    for (i = 0; i < 3; i++) {
+        for (j = 0, nb = 0; j < 3; j++) {
+            v = fabs(layer->mat[i][j]);
+            if (v > 1e-4 && fabs(v - 1) > 1e-4) return NULL;
+            nb += v > 0.5;
+        }
+        if (nb != 1) return NULL;
+        if (fabs(layer->mat[i][3]) > 1e-4) return NULL;
+        v = layer->mat[3][i];
+        if (fabs(v - round(v)) > 1e-4) return NULL;
+    }
+    if (fabs(layer->mat[3][3] - 1) > 1e-4) return NULL;
+    // Mirrors would flip the faces winding.
+    vec3_cross(layer->mat[1], layer->mat[2], tmp);
+    det = vec3_dot(layer->mat[0], tmp);
+    if (det < 0.5) return NULL;
+
+    // mesh_move maps the voxels positions, that are the corners of the
+    // voxels cubes: rotate the cubes around their centers instead.
+    mat4_set_identity(model);
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++)
+            model[i][j] = round(layer->mat[i][j]);
+        model[3][i] = round(layer->mat[3][i]);
+    }
+    mat4_itranslate(model, -0.5, -0.5, -0.5);
+    model[3][0] += 0.5;
+    model[3][1] += 0.5;
+    model[3][2] += 0.5;
+    return base;
+}
+
+// Update a clone layer mesh after its base mesh changed.  If the clone
+// has not been moved or edited since the last update, and the journal of
+// the base mesh still has the changes, only the changed blocks are moved.
+static void update_clone(layer_t *layer, const layer_t *base)
+{
+    int nb = -1;
+    int (*blocks_pos)[3] = NULL;
+
+    if (    layer->base_mesh_key &&
+            layer->update_mesh_key == mesh_get_key(layer->mesh) &&
+            mat4_equal(layer->mat, layer->update_mat)) {
+        nb = mesh_get_changes(base->mesh, layer->base_mesh_version,
+                              &blocks_pos);
+    }
+    if (nb < 0 || !mesh_move_blocks(layer->mesh, base->mesh, layer->mat,
+                                    nb, (const int (*)[3])blocks_pos)) {
+        mesh_set(layer->mesh, base->mesh);
+        mesh_move(layer->mesh, layer->mat);
+    }
+    free(blocks_pos);
+    layer->base_mesh_key = mesh_get_key(base->mesh);
+    layer->base_mesh_version = mesh_get_version(base->mesh);
+    mat4_copy(layer->mat, layer->update_mat);
+    layer->update_mesh_key = mesh_get_key(layer->mesh);
+}
+
+// Check if a shape layer mesh can be moved by a whole number of voxels
+// instead of being generated again, and get the translation.  The shapes
+// clipped by the image box cannot.
+static bool shape_get_translation(const image_t *img, const layer_t *layer,
+                                  float mat[4][4])
+{
+    int i;
+
+    if (layer->update_mesh_key != mesh_get_key(layer->mesh)) return false;
+    if (    !box_is_null(img->box) &&
+            !(box_contains(img->box, layer->mat) &&
+              box_contains(img->box, layer->update_mat)))
+        return false;
+    mat4_set_identity(mat);
+    for (i = 0; i < 3; i++) {
+        mat[3][i] = layer->mat[3][i] - layer->update_mat[3][i];
+        if (mat[3][i] != roundf(mat[3][i])) return false;
+    }
+    return true;
+}
+
+static void update_shape(image_t *img, layer_t *layer)
 {
     painter_t painter = {};
     uint32_t key;
-    layer_t *layer, *base;
+    float mat[4][4];
+
+    // The translation is not part of the key, so that we can move the
+    // mesh rather than generating it again.
+    key = XXH32(layer->mat, sizeof(float[3][4]), 0);
+    key = XXH32(layer->shape, sizeof(layer->shape), key);
+    key = XXH32(layer->color, sizeof(layer->color), key);
+    if (key == layer->shape_key && mat4_equal(layer->mat, layer->update_mat))
+        return;
+    if (key == layer->shape_key && shape_get_translation(img, layer, mat)) {
+        mesh_move(layer->mesh, mat);
+    } else {
+        painter.mode = MODE_OVER;
+        painter.shape = layer->shape;
+        painter.box = &img->box;
+        vec4_copy(layer->color, painter.color);
+        mesh_clear(layer->mesh);
+        mesh_op(layer->mesh, &painter, layer->mat);
+    }
+    layer->shape_key = key;
+    mat4_copy(layer->mat, layer->update_mat);
+    layer->update_mesh_key = mesh_get_key(layer->mesh);
+}
 
-    DL_FOREACH(img->layers, layer) {
-        base = img_get_layer(img, layer->base_id);
-        if (base && layer->base_mesh_key != mesh_get_key(base->mesh)) {
-            mesh_set(layer->mesh, base->mesh);
-            mesh_move(layer->mesh, layer->mat);
-            layer->base_mesh_key = mesh_get_key(base->mesh);
+// Update a clone, shape or procedural layer mesh, and first its base
+// layer, that could be a hidden clone too.  The depth protects against
+// cycles of clones.
+static void update_layer(image_t *img, layer_t *layer, int depth)
+{
+    uint32_t key;
+    layer_t *base;
+
+    base = img_get_layer(img, layer->base_id);
+    if (base && depth < 16) update_layer(img, base, depth + 1);
+    if (base && layer->base_mesh_key != mesh_get_key(base->mesh))
+        update_clone(layer, base);
+    if (layer->shape) update_shape(img, layer);
+    if (layer->procedural) {
+        key = procedural_get_key(layer->procedural);
+        key = XXH32(layer->mat, sizeof(layer->mat), key);
+        key = XXH32(layer->color, sizeof(layer->color), key);
+        if (key != layer->procedural_key) {
+            procedural_apply(layer->procedural, layer->mat, layer->color,
+                             layer->mesh);
+            layer->procedural_key = key;
         }
-        if (layer->shape) {
-            key = XXH32(layer->mat, sizeof(layer->mat), 0);
-            key = XXH32(layer->shape, sizeof(layer->shape), key);
-            key = XXH32(layer->color, sizeof(layer->color), key);
-            if (key != layer->shape_key) {
-                painter.mode = MODE_OVER;
-                painter.shape = layer->shape;
-                painter.box = &goxel.image->box;
-                vec4_copy(layer->color, painter.color);
-                mesh_clear(layer->mesh);
-                mesh_op(layer->mesh, &painter, layer->mat);
-                layer->shape_key = key;
-            }
+    }
+}
+
+void image_update_layer(image_t *img, layer_t *layer)
+{
+    update_layer(img, layer, 0);
+}
+
+// Make sure the visible and active layers meshes are up to date.  The
+// hidden layers only get updated when shown.
+void image_update(image_t *img)
+{
+    layer_t *layer;
+
+    DL_FOREACH(img->layers, layer) {
+        if (layer->visible || layer == img->active_layer)
+            update_layer(img, layer, 0);
+    }
+}
+
+const mesh_t *image_get_layers_mesh(const image_t *img_)
+{
+    // The merge is only a cache, so we allow to update it on a const image.
+    image_t *img = (image_t*)img_;
+    uint32_t key = 0, k;
+    layer_t *layer;
+    const mesh_t **meshes;
+    int nb = 0;
+
+    image_update(img);
+    // Only update the merge once the transaction is done.
+    if (img->transaction && img->layers_merger.mesh)
+        return img->layers_merger.mesh;
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        if (!layer->mesh) continue;
+        k = layer_get_key(layer);
+        key = XXH32(&k, sizeof(k), key);
+        nb++;
+    }
+    if (key != img->layers_mesh_key || !img->layers_merger.mesh) {
+        img->layers_mesh_key = key;
+        meshes = calloc(nb, sizeof(*meshes));
+        nb = 0;
+        DL_FOREACH(img->layers, layer) {
+            if (!layer->visible || !layer->mesh) continue;
+            meshes[nb++] = layer->mesh;
         }
+        profiler_begin("layers_merge");
+        mesh_merger_update(&img->layers_merger, nb, meshes, MODE_OVER);
+        profiler_end();
+        free(meshes);
     }
+    return img->layers_merger.mesh;
 }
 
 image_t *image_new(void)
 {
-    layer_t *layer;
     image_t *img = calloc(1, sizeof(*img));
     const int aabb[2][3] = {{-16, -16, 0}, {16, 16, 32}};
     bbox_from_aabb(img->box, aabb);
     img->export_width = 1024;
     img->export_height = 1024;
+    img->export_png_compression = 3;
     image_add_material(img, NULL);
     image_add_camera(img, NULL);
-    layer = image_add_layer(img, NULL);
-    layer->visible = true;
-    layer->id = img_get_new_id(img);
-    layer->material = img->active_material;
-    DL_APPEND(img->layers, layer);
+    image_add_layer(img, NULL);
     DL_APPEND2(img->history, img, history_prev, history_next);
-    img->active_layer = layer;
     // Prevent saving an empty image.
     img->saved_key = image_get_key(img);
     return img;
@@ -205,11 +477,13 @@ static image_t *image_snap(image_t *other)
     layer_t *layer, *other_layer;
     camera_t *camera, *other_camera;
     material_t *material, *other_material;
+    anim_frame_t *frame, *other_frame;
 
     img = calloc(1, sizeof(*img));
     *img = *other;
 
     img->layers = NULL;
+    img->layers_index = NULL;
     img->active_layer = NULL;
     DL_FOREACH(other->layers, other_layer) {
         layer = layer_copy(other_layer);
@@ -241,11 +515,33 @@ static image_t *image_snap(image_t *other)
         }
     }
 
+    img->frames = NULL;
+    img->active_frame = NULL;
+    DL_FOREACH(other->frames, other_frame) {
+        frame = frame_copy(other_frame);
+        DL_APPEND(img->frames, frame);
+        if (other_frame == other->active_frame)
+            img->active_frame = frame;
+    }
+
     img->history = img->history_next = img->history_prev = NULL;
+    img->layers_merger = (mesh_merger_t){};
+    img->layers_mesh_key = 0;
+    img->history_mem = 0;
+    img->history_mem_key = 0;
+    img->history_compacted = false;
+    img->history_spilled = false;
     return img;
 }
 
 
+image_t *image_copy(image_t *img)
+{
+    image_t *copy = image_snap(img);
+    copy->path = NULL;
+    return copy;
+}
+
 void image_delete(image_t *img)
 {
     image_t *hist, *snap, *snap_tmp;
@@ -255,6 +551,8 @@ void image_delete(image_t *img)
 
     if (!img) return;
 
+    image_layers_changed(img);
+    image_clear_frames(img);
     while ((layer = img->layers)) {
         DL_DELETE(img->layers, layer);
         layer_delete(layer);
@@ -267,6 +565,7 @@ void image_delete(image_t *img)
         DL_DELETE(img->materials, mat);
         material_delete(mat);
     }
+    mesh_merger_release(&img->layers_merger);
 
     // Path is shared between images and snaps!
     // XXX: find a better way.
@@ -282,6 +581,7 @@ void image_delete(image_t *img)
         image_delete(snap);
     }
 
+    mem_stats_add(MEM_HISTORY, -(int64_t)img->history_mem);
     free(img);
 }
 
@@ -296,7 +596,7 @@ layer_t *image_add_layer(image_t *img, layer_t *layer)
     layer->visible = true;
     layer->id = img_get_new_id(img);
     layer->material = img->active_material;
-    DL_APPEND(img->layers, layer);
+    img_append_layer(img, layer);
     img->active_layer = layer;
     return layer;
 }
@@ -317,7 +617,28 @@ layer_t *image_add_shape_layer(image_t *img)
         mat4_iscale(layer->mat, 4, 4, 4);
     }
     layer->id = img_get_new_id(img);
-    DL_APPEND(img->layers, layer);
+    img_append_layer(img, layer);
+    img->active_layer = layer;
+    return layer;
+}
+
+layer_t *image_add_procedural_layer(image_t *img)
+{
+    layer_t *layer;
+    assert(img);
+    layer = layer_new("procedural");
+    layer->visible = true;
+    layer->procedural = procedural_new(&procedural_terrain);
+    vec4_copy(goxel.painter.color, layer->color);
+    // Use the selection if any, otherwise the image box.
+    if (!box_is_null(goxel.selection))
+        mat4_copy(goxel.selection, layer->mat);
+    else if (!box_is_null(img->box))
+        mat4_copy(img->box, layer->mat);
+    else
+        mat4_iscale(layer->mat, 32, 32, 16);
+    layer->id = img_get_new_id(img);
+    img_append_layer(img, layer);
     img->active_layer = layer;
     return layer;
 }
@@ -328,10 +649,11 @@ void image_delete_layer(image_t *img, layer_t *layer)
     assert(img);
     assert(layer);
     DL_DELETE(img->layers, layer);
+    image_layers_changed(img);
     if (layer == img->active_layer) img->active_layer = NULL;
 
     // Unclone all layers cloned from this one.
-    DL_FOREACH(goxel.image->layers, other) {
+    DL_FOREACH(img->layers, other) {
         if (other->base_id == layer->id) {
             other->base_id = 0;
         }
@@ -342,7 +664,7 @@ void image_delete_layer(image_t *img, layer_t *layer)
         layer = layer_new("unnamed");
         layer->visible = true;
         layer->id = img_get_new_id(img);
-        DL_APPEND(img->layers, layer);
+        img_append_layer(img, layer);
     }
     if (!img->active_layer) img->active_layer = img->layers->prev;
 }
@@ -363,6 +685,7 @@ static void image_move_layer(image_t *img, layer_t *layer, int d)
     if (!other || !layer) return;
     DL_DELETE(img->layers, layer);
     DL_PREPEND_ELEM(img->layers, other, layer);
+    image_layers_changed(img);
 }
 
 layer_t *image_duplicate_layer(image_t *img, layer_t *other)
@@ -375,7 +698,7 @@ layer_t *image_duplicate_layer(image_t *img, layer_t *other)
                    layer_name_exists);
     layer->visible = true;
     layer->id = img_get_new_id(img);
-    DL_APPEND(img->layers, layer);
+    img_append_layer(img, layer);
     img->active_layer = layer;
     return layer;
 }
@@ -389,7 +712,7 @@ layer_t *image_clone_layer(image_t *img, layer_t *other)
     layer = layer_clone(other);
     layer->visible = true;
     layer->id = img_get_new_id(img);
-    DL_APPEND(img->layers, layer);
+    img_append_layer(img, layer);
     img->active_layer = layer;
     return layer;
 }
@@ -398,35 +721,172 @@ void image_unclone_layer(image_t *img, layer_t *layer)
 {
     assert(img);
     assert(layer);
+    image_update_layer(img, layer);
     layer->base_id = 0;
     layer->shape = NULL;
+    // The mesh keeps its procedural blocks, they still get loaded lazily.
+    free(layer->procedural);
+    layer->procedural = NULL;
 }
 
+/*
+ * Merge all the visible layers into the top most one.  All the meshes are
+ * merged at once with mesh_merge_n, instead of folding them two by two,
+ * which was very slow for images with many layers.
+ */
 void image_merge_visible_layers(image_t *img)
 {
-    layer_t *layer, *other, *last = NULL;
+    layer_t *layer, *tmp, *other, *last = NULL;
+    const mesh_t **meshes;
+    mesh_t *mesh;
+    int nb = 0;
+
     assert(img);
     DL_FOREACH(img->layers, layer) {
         if (!layer->visible) continue;
         image_unclone_layer(img, layer);
+        last = layer;
+        nb++;
+    }
+    if (!last) return;
+    img->active_layer = last;
+    if (nb == 1) return;
 
-        if (last) {
-            // Unclone all layers cloned from this one.
-            DL_FOREACH(goxel.image->layers, other) {
-                if (other->base_id == last->id) {
-                    other->base_id = 0;
-                }
-            }
-            SWAP(layer->mesh, last->mesh);
-            mesh_merge(layer->mesh, last->mesh, MODE_OVER, NULL);
-            DL_DELETE(img->layers, last);
-            layer_delete(last);
+    meshes = calloc(nb, sizeof(*meshes));
+    nb = 0;
+    DL_FOREACH(img->layers, layer) {
+        if (layer->visible) meshes[nb++] = layer->mesh;
+    }
+    mesh = mesh_new();
+    mesh_merge_n(mesh, nb, meshes, MODE_OVER);
+    free(meshes);
+    mesh_delete(last->mesh);
+    last->mesh = mesh;
+
+    // Unclone all layers cloned from the merged ones.
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->base_id) continue;
+        other = img_find_layer(img, layer->base_id);
+        if (other && other->visible && other != last) layer->base_id = 0;
+    }
+    DL_FOREACH_SAFE(img->layers, layer, tmp) {
+        if (!layer->visible || layer == last) continue;
+        DL_DELETE(img->layers, layer);
+        layer_delete(layer);
+    }
+    image_layers_changed(img);
+}
+
+
+// Keep a copy of the layers meshes into a frame.  The copies share all
+// their blocks with the layers.
+static void frame_store(anim_frame_t *frame, image_t *img)
+{
+    layer_t *layer;
+    int nb;
+
+    frame_release_meshes(frame);
+    DL_COUNT(img->layers, layer, nb);
+    frame->meshes = calloc(max(nb, 1), sizeof(*frame->meshes));
+    DL_FOREACH(img->layers, layer) {
+        image_update_layer(img, layer);
+        frame->meshes[frame->nb_meshes].layer_id = layer->id;
+        frame->meshes[frame->nb_meshes].mesh = mesh_copy(layer->mesh);
+        frame->nb_meshes++;
+    }
+}
+
+// Put the meshes of a frame back into the layers.  The layers added after
+// the frame was stored are empty in it.
+static void frame_restore(anim_frame_t *frame, image_t *img)
+{
+    layer_t *layer;
+    int i, j = 0, n = frame->nb_meshes;
+
+    DL_FOREACH(img->layers, layer) {
+        // The meshes are in the layers order, unless they were moved.
+        for (i = 0; i < n; i++) {
+            if (frame->meshes[(j + i) % n].layer_id == layer->id) break;
         }
-        last = layer;
+        if (i == n) {
+            mesh_clear(layer->mesh);
+            continue;
+        }
+        j = (j + i) % n;
+        mesh_set(layer->mesh, frame->meshes[j].mesh);
+        j = (j + 1) % n;
     }
-    if (last) img->active_layer = last;
+    frame_release_meshes(frame);
 }
 
+int image_add_frame(image_t *img)
+{
+    anim_frame_t *frame;
+    if (!img->frames) {
+        img->active_frame = calloc(1, sizeof(*img->active_frame));
+        DL_APPEND(img->frames, img->active_frame);
+    }
+    frame_store(img->active_frame, img);
+    frame = calloc(1, sizeof(*frame));
+    DL_APPEND_ELEM(img->frames, img->active_frame, frame);
+    img->active_frame = frame;
+    return image_get_frame(img);
+}
+
+void image_set_frame(image_t *img, int index)
+{
+    anim_frame_t *frame = frame_get(img, index);
+    if (!frame || frame == img->active_frame) return;
+    frame_store(img->active_frame, img);
+    frame_restore(frame, img);
+    img->active_frame = frame;
+}
+
+void image_delete_frame(image_t *img, int index)
+{
+    anim_frame_t *frame = frame_get(img, index), *other;
+    if (!frame) return;
+    if (frame == img->active_frame) {
+        other = frame->next ?: frame->prev;
+        frame_restore(other, img);
+        img->active_frame = other;
+    }
+    DL_DELETE(img->frames, frame);
+    frame_release_meshes(frame);
+    free(frame);
+    // A single frame is not an animation anymore.
+    if (!img->frames->next) image_clear_frames(img);
+}
+
+void image_clear_frames(image_t *img)
+{
+    anim_frame_t *frame;
+    while ((frame = img->frames)) {
+        DL_DELETE(img->frames, frame);
+        frame_release_meshes(frame);
+        free(frame);
+    }
+    img->active_frame = NULL;
+}
+
+int image_get_nb_frames(const image_t *img)
+{
+    anim_frame_t *frame;
+    int nb;
+    DL_COUNT(img->frames, frame, nb);
+    return nb;
+}
+
+int image_get_frame(const image_t *img)
+{
+    anim_frame_t *frame;
+    int i = 0;
+    DL_FOREACH(img->frames, frame) {
+        if (frame == img->active_frame) return i;
+        i++;
+    }
+    return -1;
+}
 
 camera_t *image_add_camera(image_t *img, camera_t *cam)
 {
@@ -518,9 +978,10 @@ void image_set(image_t *img, image_t *other)
         DL_DELETE(img->layers, layer);
         layer_delete(layer);
     }
+    image_layers_changed(img);
     DL_FOREACH(other->layers, other_layer) {
         layer = layer_copy(other_layer);
-        DL_APPEND(img->layers, layer);
+        img_append_layer(img, layer);
         if (other_layer == other->active_layer)
             img->active_layer = layer;
     }
@@ -540,11 +1001,161 @@ static void debug_print_history(image_t *img)
 static void debug_print_history(image_t *img) {}
 #endif
 
+// Number of undo steps after which we compact the snapshots.
+#define HISTORY_COLD_STEPS 8
+
+static uint64_t g_history_budget = 512 * MB;
+// Number of undo steps after which we spill the snapshots, or zero.
+static int g_history_spill_steps = 0;
+
+void image_history_set_budget(uint64_t size)
+{
+    g_history_budget = size;
+}
+
+uint64_t image_history_get_budget(void)
+{
+    return g_history_budget;
+}
+
+void image_history_set_spill_steps(int steps)
+{
+    g_history_spill_steps = steps;
+}
+
+int image_history_get_spill_steps(void)
+{
+    return g_history_spill_steps;
+}
+
+// Memory used by a snapshot that is not shared with the next image of the
+// history.  We compare the layers with the same id.
+static uint64_t image_get_unshared_mem(const image_t *img,
+                                       const image_t *next)
+{
+    const layer_t *layer, *other;
+    uint64_t ret = 0;
+    DL_FOREACH(img->layers, layer) {
+        other = img_find_layer(next, layer->id);
+        ret += mesh_get_unshared_mem(layer->mesh, other ? other->mesh : NULL);
+    }
+    return ret;
+}
+
+// Update the memory used by a snapshot, using the cached value if the
+// snapshot and the next image didn't change since the last call.
+static uint64_t history_update_mem(image_t *snap)
+{
+    uint32_t keys[2] = {image_get_key(snap),
+                        image_get_key(snap->history_next)};
+    uint32_t key = XXH32(keys, sizeof(keys), 0);
+    uint64_t mem;
+    if (key != snap->history_mem_key) {
+        mem = image_get_unshared_mem(snap, snap->history_next);
+        mem_stats_add(MEM_HISTORY, (int64_t)mem - (int64_t)snap->history_mem);
+        snap->history_mem = mem;
+        snap->history_mem_key = key;
+    }
+    return snap->history_mem;
+}
+
+// Compact the old snapshots, and spill the older ones to disk if enabled,
+// then remove the oldest ones until the history fits into the memory
+// budget.  We always keep at least one undo step.
+static void history_cleanup(image_t *img)
+{
+    image_t *snap;
+    layer_t *layer;
+    uint64_t total = 0;
+    int step = 0;
+
+    for (snap = img->history_prev; snap != img; snap = snap->history_prev) {
+        if (++step > HISTORY_COLD_STEPS && !snap->history_compacted) {
+            DL_FOREACH(snap->layers, layer) mesh_compact(layer->mesh);
+            snap->history_compacted = true;
+        }
+        if (    g_history_spill_steps && step > g_history_spill_steps &&
+                !snap->history_spilled) {
+            DL_FOREACH(snap->layers, layer) mesh_spill(layer->mesh);
+            snap->history_spilled = true;
+        }
+        total += history_update_mem(snap);
+        if (snap == img->history) break;
+    }
+
+    while (total > g_history_budget && img->history != img->history_prev) {
+        snap = img->history;
+        total -= snap->history_mem;
+        DL_DELETE2(img->history, snap, history_prev, history_next);
+        image_delete(snap);
+    }
+}
+
+void image_history_compact(image_t *img)
+{
+    image_t *snap;
+    layer_t *layer;
+    for (snap = img->history; snap && snap != img; snap = snap->history_next) {
+        if (snap->history_compacted) continue;
+        DL_FOREACH(snap->layers, layer) mesh_compact(layer->mesh);
+        snap->history_compacted = true;
+    }
+}
+
+uint64_t image_history_get_mem(image_t *img)
+{
+    image_t *snap;
+    uint64_t total = 0;
+    for (snap = img->history; snap && snap != img; snap = snap->history_next)
+        total += history_update_mem(snap);
+    return total;
+}
+
+// Only keep the layers meshes changes of a snapshot relative to the next
+// one in the history, so that we don't keep a full copy of all the blocks
+// for each undo step.
+static void history_make_delta(image_t *snap, const image_t *next)
+{
+    layer_t *layer, *other;
+    DL_FOREACH(snap->layers, layer) {
+        if (mesh_is_delta(layer->mesh)) continue;
+        other = img_find_layer(next, layer->id);
+        if (other) mesh_make_delta(layer->mesh, other->mesh);
+    }
+}
+
+// Restore the layers meshes of an history image stored as changes relative
+// to the current image.  The current image meshes are then stored as
+// changes relative to the history image in turn.
+static void history_apply_delta(image_t *img, image_t *hist)
+{
+    layer_t *layer, *other;
+    mesh_t *tmp;
+    DL_FOREACH(hist->layers, layer) {
+        if (!mesh_is_delta(layer->mesh)) continue;
+        other = img_find_layer(img, layer->id);
+        if (other) {
+            mesh_apply_delta(layer->mesh, other->mesh);
+            continue;
+        }
+        // Shouldn't happen unless the image has been modified without
+        // pushing its history.
+        LOG_E("Cannot restore layer %d from history", layer->id);
+        tmp = mesh_new();
+        mesh_apply_delta(layer->mesh, tmp);
+        mesh_delete(tmp);
+    }
+}
+
 void image_history_push(image_t *img)
 {
-    image_t *snap = image_snap(img);
+    image_t *snap;
     image_t *hist;
 
+    // The whole transaction is a single history step.
+    if (img->transaction) return;
+    snap = image_snap(img);
+
     // Discard previous undo.
     while ((hist = img->history_next)) {
         DL_DELETE2(img->history, hist, history_prev, history_next);
@@ -555,14 +1166,31 @@ void image_history_push(image_t *img)
     DL_DELETE2(img->history, img,  history_prev, history_next);
     DL_APPEND2(img->history, snap, history_prev, history_next);
     DL_APPEND2(img->history, img,  history_prev, history_next);
+    if (snap != img->history) history_make_delta(snap->history_prev, snap);
+    history_cleanup(img);
     debug_print_history(img);
 }
 
+void image_begin_transaction(image_t *img)
+{
+    if (img->transaction++) return;
+    img->transaction = 0;
+    image_history_push(img);
+    img->transaction = 1;
+    mesh_ops_cache_enable(false);
+}
+
+void image_end_transaction(image_t *img)
+{
+    assert(img->transaction > 0);
+    if (--img->transaction) return;
+    mesh_ops_cache_enable(true);
+}
+
 void image_history_resize(image_t *img, int size)
 {
     int i, nb = 0;
     image_t *hist;
-    layer_t *layer, *layer_tmp;
 
     // First cound the size of the history to compute how many we are going
     // to remove.
@@ -570,15 +1198,8 @@ void image_history_resize(image_t *img, int size)
     nb = max(0, nb - size);
     for (i = 0; i < nb; i++) {
         hist = img->history;
-
-        // XXX: do that in a function!
-        DL_FOREACH_SAFE(hist->layers, layer, layer_tmp) {
-            assert(layer);
-            DL_DELETE(hist->layers, layer);
-            layer_delete(layer);
-        }
         DL_DELETE2(img->history, hist, history_prev, history_next);
-        free(hist);
+        image_delete(hist);
     }
 }
 
@@ -591,6 +1212,15 @@ static void swap(image_t *a, image_t *b)
     SWAP(a->history, b->history);
     SWAP(a->history_next, b->history_next);
     SWAP(a->history_prev, b->history_prev);
+    // Keep the layers merge with the current image, so that it can still
+    // be updated incrementally.
+    SWAP(a->layers_merger, b->layers_merger);
+    SWAP(a->layers_mesh_key, b->layers_mesh_key);
+    // The history memory reported to the stats stays with the snapshots.
+    SWAP(a->history_mem, b->history_mem);
+    SWAP(a->history_mem_key, b->history_mem_key);
+    // The snapshot deltas changed, so they can have new data to spill.
+    a->history_spilled = b->history_spilled = false;
 }
 
 void image_undo(image_t *img)
@@ -602,6 +1232,7 @@ void image_undo(image_t *img)
     }
     DL_DELETE2(img->history, img, history_prev, history_next);
     DL_PREPEND_ELEM2(img->history, prev, img, history_prev, history_next);
+    history_apply_delta(img, prev);
     swap(img, prev);
 
     // Don't move the camera for an undo.
@@ -622,6 +1253,7 @@ void image_redo(image_t *img)
     }
     DL_DELETE2(img->history, next, history_prev, history_next);
     DL_PREPEND_ELEM2(img->history, img, next, history_prev, history_next);
+    history_apply_delta(img, next);
     swap(img, next);
     debug_print_history(img);
 }
@@ -644,7 +1276,8 @@ static void image_clear_layer(void)
 
 bool image_layer_can_edit(const image_t *img, const layer_t *layer)
 {
-    return !layer->base_id && !layer->image && !layer->shape;
+    return !layer->base_id && !layer->image && !layer->shape &&
+           !layer->procedural;
 }
 
 /*
@@ -657,11 +1290,22 @@ uint32_t image_get_key(const image_t *img)
     layer_t *layer;
     camera_t *camera;
     material_t *material;
+    anim_frame_t *frame;
+    uint64_t mesh_key;
+    int i;
 
     DL_FOREACH(img->layers, layer) {
         k = layer_get_key(layer);
         key = XXH32(&k, sizeof(k), key);
     }
+    DL_FOREACH(img->frames, frame) {
+        k = frame == img->active_frame;
+        key = XXH32(&k, sizeof(k), key);
+        for (i = 0; i < frame->nb_meshes; i++) {
+            mesh_key = mesh_get_key(frame->meshes[i].mesh);
+            key = XXH32(&mesh_key, sizeof(mesh_key), key);
+        }
+    }
     DL_FOREACH(img->cameras, camera) {
         k = camera_get_key(camera);
         key = XXH32(&k, sizeof(k), key);
@@ -673,37 +1317,188 @@ uint32_t image_get_key(const image_t *img)
     return key;
 }
 
+// Expand a row of grey, grey alpha, RGB or RGBA pixels to RGBA.  Each
+// case is a simple loop that the compiler can vectorize.
+static void pixels_to_rgba(const uint8_t *src, int bpp, int n, uint8_t *dst)
+{
+    int i;
+    switch (bpp) {
+    case 1:
+        for (i = 0; i < n; i++) {
+            dst[i * 4 + 0] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i];
+            dst[i * 4 + 3] = 255;
+        }
+        break;
+    case 2:
+        for (i = 0; i < n; i++) {
+            dst[i * 4 + 0] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i * 2];
+            dst[i * 4 + 3] = src[i * 2 + 1];
+        }
+        break;
+    case 3:
+        for (i = 0; i < n; i++) {
+            dst[i * 4 + 0] = src[i * 3 + 0];
+            dst[i * 4 + 1] = src[i * 3 + 1];
+            dst[i * 4 + 2] = src[i * 3 + 2];
+            dst[i * 4 + 3] = 255;
+        }
+        break;
+    default:
+        memcpy(dst, src, n * 4);
+        break;
+    }
+}
+
+// Number of voxels of a pixel column: one if we don't extrude, otherwise
+// from one to depth according to the luminance, or zero if transparent.
+static int pixel_height(const uint8_t c[4], int depth)
+{
+    int lum;
+    if (depth <= 1) return 1;
+    if (c[3] == 0) return 0;
+    lum = (c[0] * 77 + c[1] * 150 + c[2] * 29) >> 8;
+    return 1 + (lum * (depth - 1) + 127) / 255;
+}
+
+// Return the only non null component of a vector, or -1.
+static int get_axis(const float v[3])
+{
+    int i, ret = -1;
+    for (i = 0; i < 3; i++) {
+        if (v[i] == 0) continue;
+        if (ret != -1) return -1;
+        ret = i;
+    }
+    return ret;
+}
+
+/*
+ * Fast path of image_image_layer_to_mesh when the layer is aligned with
+ * the axes: the pixels rows and columns then map to fixed voxels rows and
+ * columns, so we can fill a dense buffer and write it with a single
+ * mesh_write.  Return false if this cannot be used.
+ */
+static bool image_layer_to_mesh_aligned(layer_t *layer, const uint8_t *rgba,
+                                        int w, int h, int depth)
+{
+    int i, j, k, n, ax[3], aabb[2][3], size[3], pos[3], p[3];
+    int *cols, *rows, *zs;
+    float u;
+    uint8_t *buf;
+    const float (*mat)[4] = layer->mat;
+
+    ax[0] = get_axis(mat[0]);
+    ax[1] = get_axis(mat[1]);
+    ax[2] = get_axis(mat[2]);
+    if (ax[0] == -1 || ax[1] == -1 || ax[0] == ax[1]) return false;
+    if (ax[2] == -1 || ax[2] == ax[0] || ax[2] == ax[1]) return false;
+
+    // Voxels coordinates of each column, row, and depth, computed with the
+    // same float operations as the general transform.
+    cols = malloc(w * sizeof(*cols));
+    rows = malloc(h * sizeof(*rows));
+    zs = malloc(depth * sizeof(*zs));
+    for (i = 0; i < w; i++) {
+        u = i / (float)w - 0.5f;
+        cols[i] = round(mat[0][ax[0]] * u + mat[3][ax[0]]);
+    }
+    for (j = 0; j < h; j++) {
+        u = 0.5f - j / (float)h;
+        rows[j] = round(mat[1][ax[1]] * u + mat[3][ax[1]]);
+    }
+    for (k = 0; k < depth; k++)
+        zs[k] = round(mat[2][ax[2]] * (float)k + mat[3][ax[2]]);
+
+    aabb[0][ax[0]] = min(cols[0], cols[w - 1]);
+    aabb[1][ax[0]] = max(cols[0], cols[w - 1]) + 1;
+    aabb[0][ax[1]] = min(rows[0], rows[h - 1]);
+    aabb[1][ax[1]] = max(rows[0], rows[h - 1]) + 1;
+    aabb[0][ax[2]] = min(zs[0], zs[depth - 1]);
+    aabb[1][ax[2]] = max(zs[0], zs[depth - 1]) + 1;
+    for (i = 0; i < 3; i++) size[i] = aabb[1][i] - aabb[0][i];
+
+    // Don't allocate a huge buffer for a scaled up image.
+    if (    (int64_t)size[0] * size[1] * size[2] > 2 * (int64_t)w * h * depth ||
+            (int64_t)size[0] * size[1] * size[2] > (1 << 26)) {
+        free(cols);
+        free(rows);
+        free(zs);
+        return false;
+    }
+
+    n = size[0] * size[1] * size[2];
+    buf = malloc(n * 4);
+    mesh_read(layer->mesh, aabb[0], size, buf);
+    for (j = 0; j < h; j++)
+    for (i = 0; i < w; i++) {
+        p[ax[0]] = cols[i];
+        p[ax[1]] = rows[j];
+        n = pixel_height(&rgba[(j * w + i) * 4], depth);
+        for (k = 0; k < n; k++) {
+            p[ax[2]] = zs[k];
+            pos[0] = p[0] - aabb[0][0];
+            pos[1] = p[1] - aabb[0][1];
+            pos[2] = p[2] - aabb[0][2];
+            memcpy(&buf[((pos[2] * size[1] + pos[1]) * size[0] + pos[0]) * 4],
+                   &rgba[(j * w + i) * 4], 4);
+        }
+    }
+    mesh_write(layer->mesh, aabb[0], size, buf);
+    free(buf);
+    free(cols);
+    free(rows);
+    free(zs);
+    return true;
+}
+
 /*
- * Turn an image layer into a mesh of 1 voxel depth.
+ * Turn an image layer into a mesh.
+ *
+ * If depth is more than one, each pixel is extruded along the layer z axis
+ * with a height proportional to its luminance, otherwise we get a mesh of
+ * one voxel depth.
  */
-static void image_image_layer_to_mesh(image_t *img, layer_t *layer)
+static void image_image_layer_to_mesh(image_t *img, layer_t *layer,
+                                      int depth)
 {
-    uint8_t *data;
-    int i, j, w, h, bpp = 0, pos[3];
-    uint8_t c[4];
+    uint8_t *data, *rgba;
+    int i, j, k, n, w, h, bpp = 0, pos[3];
     float p[3];
-    assert(img);
-    assert(layer);
     mesh_accessor_t acc;
 
-    image_history_push(img);
+    assert(img);
+    assert(layer);
     data = img_read(layer->image->path, &w, &h, &bpp);
-    acc = mesh_get_accessor(layer->mesh);
-    for (j = 0; j < w; j++)
-    for (i = 0; i < h; i++) {
-        vec3_set(p, i / (float)h - 0.5, 0.5 - j / (float)w, 0);
-        mat4_mul_vec3(layer->mat, p, p);
-        pos[0] = round(p[0]);
-        pos[1] = round(p[1]);
-        pos[2] = round(p[2]);
-        memset(c, 0, 4);
-        c[3] = 255;
-        memcpy(c, data + (j * w + i) * bpp, bpp);
-        mesh_set_at(layer->mesh, &acc, pos, c);
+    if (!data) {
+        LOG_E("Cannot read image %s", layer->image->path);
+        return;
+    }
+    image_history_push(img);
+    rgba = malloc(w * h * 4);
+    for (j = 0; j < h; j++)
+        pixels_to_rgba(data + j * w * bpp, bpp, w, rgba + j * w * 4);
+    free(data);
+
+    if (!image_layer_to_mesh_aligned(layer, rgba, w, h, depth)) {
+        acc = mesh_get_accessor(layer->mesh);
+        mesh_begin_write(layer->mesh);
+        for (j = 0; j < h; j++)
+        for (i = 0; i < w; i++) {
+            n = pixel_height(&rgba[(j * w + i) * 4], depth);
+            for (k = 0; k < n; k++) {
+                vec3_set(p, i / (float)w - 0.5, 0.5 - j / (float)h, k);
+                mat4_mul_vec3(layer->mat, p, p);
+                pos[0] = round(p[0]);
+                pos[1] = round(p[1]);
+                pos[2] = round(p[2]);
+                mesh_set_at(layer->mesh, &acc, pos, &rgba[(j * w + i) * 4]);
+            }
+        }
+        mesh_end_write(layer->mesh);
     }
     texture_delete(layer->image);
     layer->image = NULL;
-    free(data);
+    free(rgba);
 }
 
 ACTION_REGISTER(layer_clear,
@@ -820,6 +1615,58 @@ ACTION_REGISTER(img_merge_visible_layers,
     .flags = ACTION_TOUCH_IMAGE,
 )
 
+static void a_img_add_frame(void)
+{
+    image_add_frame(goxel.image);
+}
+
+ACTION_REGISTER(img_add_frame,
+    .help = "Add an animation frame after the current one",
+    .cfunc = a_img_add_frame,
+    .flags = ACTION_TOUCH_IMAGE,
+    .icon = ICON_ADD,
+)
+
+static void a_img_del_frame(void)
+{
+    image_delete_frame(goxel.image, image_get_frame(goxel.image));
+}
+
+ACTION_REGISTER(img_del_frame,
+    .help = "Delete the current animation frame",
+    .cfunc = a_img_del_frame,
+    .flags = ACTION_TOUCH_IMAGE,
+    .icon = ICON_REMOVE,
+)
+
+static void a_img_next_frame(void)
+{
+    image_t *img = goxel.image;
+    int nb = image_get_nb_frames(img);
+    if (nb) image_set_frame(img, (image_get_frame(img) + 1) % nb);
+}
+
+ACTION_REGISTER(img_next_frame,
+    .help = "Show the next animation frame",
+    .cfunc = a_img_next_frame,
+    .flags = ACTION_TOUCH_IMAGE,
+    .icon = ICON_ARROW_FORWARD,
+)
+
+static void a_img_previous_frame(void)
+{
+    image_t *img = goxel.image;
+    int nb = image_get_nb_frames(img);
+    if (nb) image_set_frame(img, (image_get_frame(img) + nb - 1) % nb);
+}
+
+ACTION_REGISTER(img_previous_frame,
+    .help = "Show the previous animation frame",
+    .cfunc = a_img_previous_frame,
+    .flags = ACTION_TOUCH_IMAGE,
+    .icon = ICON_ARROW_BACK,
+)
+
 static void a_img_new_camera(void)
 {
     image_add_camera(goxel.image, NULL);
@@ -870,7 +1717,8 @@ ACTION_REGISTER(img_move_camera_down,
 
 static void a_img_image_layer_to_mesh(void)
 {
-    image_image_layer_to_mesh(goxel.image, goxel.image->active_layer);
+    image_image_layer_to_mesh(goxel.image, goxel.image->active_layer,
+                              goxel.image_layer_depth);
 }
 
 ACTION_REGISTER(img_image_layer_to_mesh,
@@ -890,6 +1738,17 @@ ACTION_REGISTER(img_new_shape_layer,
     .flags = ACTION_TOUCH_IMAGE,
 )
 
+static void a_img_new_procedural_layer(void)
+{
+    image_add_procedural_layer(goxel.image);
+}
+
+ACTION_REGISTER(img_new_procedural_layer,
+    .help = "Add a new procedural layer to the image",
+    .cfunc = a_img_new_procedural_layer,
+    .flags = ACTION_TOUCH_IMAGE,
+)
+
 static void a_img_new_material(void)
 {
     image_add_material(goxel.image, NULL);
@@ -22,6 +22,7 @@
 #include "camera.h"
 #include "layer.h"
 #include "material.h"
+#include "mesh_utils.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -29,9 +30,29 @@
 typedef struct history history_t;
 
 typedef struct image image_t;
+typedef struct layers_index layers_index_t;
+
+/*
+ * Frame of an animation.
+ *
+ * A frame keeps a copy of the meshes of the layers, that shares its blocks
+ * with the other frames, so only the blocks that differ between frames use
+ * memory.  The meshes of the active frame are the layers meshes themselves,
+ * so the active frame doesn't keep any.
+ */
+typedef struct anim_frame anim_frame_t;
+struct anim_frame {
+    anim_frame_t    *next, *prev;
+    int             nb_meshes;
+    struct {
+        int     layer_id;
+        mesh_t  *mesh;
+    } *meshes;
+};
 struct image {
 
     layer_t *layers;
+    layers_index_t *layers_index; // Lookup of the layers by id.
     layer_t *active_layer;
 
     camera_t *cameras;
@@ -40,6 +61,9 @@ struct image {
     material_t *materials;
     material_t *active_material;
 
+    anim_frame_t *frames; // Animation frames, NULL if there are none.
+    anim_frame_t *active_frame;
+
     float    box[4][4];
 
     // For saving.
@@ -49,26 +73,197 @@ struct image {
     int      export_width;
     int      export_height;
     bool     export_transparent_background;
+    int      export_png_compression; // From 1 (fastest) to 9 (smallest).
     uint32_t saved_key;     // image_get_key() value of saved file.
 
+    // Merge of the visible layers, see image_get_layers_mesh.
+    mesh_merger_t layers_merger;
+    uint32_t layers_mesh_key;
+
     image_t *history;
     image_t *history_next, *history_prev;
+    // Cached memory used by a snapshot, not shared with the next one.
+    uint64_t history_mem;
+    uint32_t history_mem_key;
+    bool     history_compacted;
+    bool     history_spilled;
+
+    int      transaction;   // Depth of the open transactions.
 };
 
 image_t *image_new(void);
+
+/*
+ * Function: image_layers_changed
+ * Must be called after the layers list or the layers ids of an image have
+ * been modified directly, without the image functions.
+ */
+void image_layers_changed(image_t *img);
+
+/*
+ * Function: image_copy
+ * Create a frozen copy of an image, without its history nor path.
+ *
+ * The layers meshes are shared with the original image, so this is cheap,
+ * and the copy can be read from an other thread while the original keeps
+ * being modified.
+ */
+image_t *image_copy(image_t *img);
+
 void image_delete(image_t *img);
+
+/*
+ * Function: image_update
+ * Make sure the visible layers and the active layer meshes are up to date.
+ *
+ * The clone, shape and procedural layers that are hidden are not updated,
+ * use <image_update_layer> to get their mesh.
+ */
+void image_update(image_t *img);
+
+// Make sure a layer mesh is up to date, even if it is hidden.
+void image_update_layer(image_t *img, layer_t *layer);
+
+/*
+ * Function: image_get_layers_mesh
+ * Return the merge of all the visible layers of an image.
+ *
+ * The merge is cached in the image, and only updated incrementally when
+ * the layers change.  The returned mesh is owned by the image.
+ */
+const mesh_t *image_get_layers_mesh(const image_t *img);
 layer_t *image_add_layer(image_t *img, layer_t *layer);
+
+/*
+ * Function: image_add_procedural_layer
+ * Add a new procedural layer, in the selection box if any, or else in the
+ * image box.
+ */
+layer_t *image_add_procedural_layer(image_t *img);
+layer_t *image_clone_layer(image_t *img, layer_t *other);
 void image_delete_layer(image_t *img, layer_t *layer);
 layer_t *image_duplicate_layer(image_t *img, layer_t *layer);
 void image_merge_visible_layers(image_t *img);
 
+/*
+ * Function: image_add_frame
+ * Add an animation frame after the active one, as a copy of it, and make
+ * it active.
+ *
+ * The first call turns the image into an animation of two frames.
+ *
+ * Return:
+ *   The index of the new frame.
+ */
+int image_add_frame(image_t *img);
+
+/*
+ * Function: image_set_frame
+ * Change the active animation frame.
+ *
+ * The layers meshes are replaced by the ones of the frame, which only
+ * costs the blocks that differ from the current frame.
+ */
+void image_set_frame(image_t *img, int index);
+
+// Delete an animation frame.  Deleting the last one leaves an image
+// without animation, with the meshes of the active frame.
+void image_delete_frame(image_t *img, int index);
+
+// Remove all the animation frames, keeping the active one.
+void image_clear_frames(image_t *img);
+
+int image_get_nb_frames(const image_t *img);
+
+// Index of the active frame, or -1 if the image has no frames.
+int image_get_frame(const image_t *img);
+
 void image_history_push(image_t *img);
 void image_undo(image_t *img);
 void image_redo(image_t *img);
 void image_history_resize(image_t *img, int size);
 
+/*
+ * Function: image_history_compact
+ * Compress the blocks of all the undo history snapshots.
+ *
+ * Normally only the snapshots older than a few undo steps get compressed.
+ */
+void image_history_compact(image_t *img);
+
+/*
+ * Function: image_begin_transaction
+ * Start a batch of edits, for procedural or macro-style changes.
+ *
+ * A single history snapshot is pushed when the transaction starts.  Until
+ * <image_end_transaction>, the calls to <image_history_push> are ignored,
+ * the mesh operations don't use their caches (see <mesh_ops_cache_enable>)
+ * and <image_get_layers_mesh> keeps returning the merge from before the
+ * transaction, so that the layers meshes can be modified directly with
+ * many operations and only get rendered once.
+ *
+ * Transactions can be nested, only the outermost one has any effect.  The
+ * caches are disabled for the calling thread only.
+ */
+void image_begin_transaction(image_t *img);
+
+/*
+ * Function: image_end_transaction
+ * End a transaction started with <image_begin_transaction>.
+ */
+void image_end_transaction(image_t *img);
+
+/*
+ * Function: image_history_set_budget
+ * Set the maximum memory used by the undo history.
+ *
+ * Each time we push a new snapshot, the oldest ones are removed until the
+ * memory not shared between the snapshots fits into the budget.
+ */
+void image_history_set_budget(uint64_t size);
+uint64_t image_history_get_budget(void);
+
+/*
+ * Function: image_history_set_spill_steps
+ * Set the number of undo steps after which the snapshots are spilled.
+ *
+ * The blocks only used by the older snapshots are moved into a spill file
+ * (see <mesh_spill>), and loaded back when needed after an undo.
+ *
+ * Parameters:
+ *   steps - Number of steps, or zero to keep all the history in memory.
+ */
+void image_history_set_spill_steps(int steps);
+int image_history_get_spill_steps(void);
+
+/*
+ * Function: image_history_get_mem
+ * Return the memory used by the undo history of an image.
+ */
+uint64_t image_history_get_mem(image_t *img);
+
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
 
+/*
+ * Function: image_get_clone_instance
+ * Check if a clone layer can be rendered as an instance of its base layer.
+ *
+ * This is only the case if the clone transformation is made of rotations
+ * of multiple of 90° and integer translations, so that the transformed base
+ * mesh is exactly the baked clone voxels.
+ *
+ * Parameters:
+ *   img    - The image.
+ *   layer  - A layer of the image.
+ *   model  - Set to the model matrix to use to render the base mesh.
+ *
+ * Return:
+ *   The base layer, or NULL if the layer can't be rendered as an instance.
+ */
+const layer_t *image_get_clone_instance(const image_t *img,
+                                        const layer_t *layer,
+                                        float model[4][4]);
+
 material_t *image_add_material(image_t *img, material_t *mat);
 void image_delete_material(image_t *img, material_t *mat);
 
@@ -0,0 +1,176 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+/*
+ * Trace file format:
+ *
+ *   'GOXI' magic, uint32 version, then for each frame:
+ *     int32[2]  window size
+ *     float     scale
+ *     uint8[64] keys, one bit per key
+ *     uint32[16] chars
+ *     4 x (float[2] pos, uint8 buttons bits)
+ *     float     mouse wheel
+ *
+ * All the values are little endian.
+ */
+
+#define TRACE_VERSION 1
+
+struct inputs_trace {
+    FILE *file;
+    bool write;
+};
+
+static void write_u32(FILE *file, uint32_t v)
+{
+    uint8_t b[4] = {v, v >> 8, v >> 16, v >> 24};
+    fwrite(b, 4, 1, file);
+}
+
+static void write_float(FILE *file, float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, 4);
+    write_u32(file, u);
+}
+
+static bool read_u32(FILE *file, uint32_t *v)
+{
+    uint8_t b[4];
+    if (fread(b, 4, 1, file) != 1) return false;
+    *v = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+    return true;
+}
+
+static bool read_float(FILE *file, float *v)
+{
+    uint32_t u;
+    if (!read_u32(file, &u)) return false;
+    memcpy(v, &u, 4);
+    return true;
+}
+
+inputs_trace_t *inputs_trace_open(const char *path, bool write)
+{
+    inputs_trace_t *trace;
+    FILE *file;
+    char magic[4];
+    uint32_t version;
+
+    file = fopen(path, write ? "wb" : "rb");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return NULL;
+    }
+    if (write) {
+        fwrite("GOXI", 4, 1, file);
+        write_u32(file, TRACE_VERSION);
+    } else {
+        if (    fread(magic, 4, 1, file) != 1 ||
+                memcmp(magic, "GOXI", 4) != 0 ||
+                !read_u32(file, &version)) {
+            LOG_E("Invalid inputs trace: %s", path);
+            fclose(file);
+            return NULL;
+        }
+        if (version != TRACE_VERSION) {
+            LOG_E("Unsupported inputs trace version: %d", version);
+            fclose(file);
+            return NULL;
+        }
+    }
+    trace = calloc(1, sizeof(*trace));
+    trace->file = file;
+    trace->write = write;
+    return trace;
+}
+
+int inputs_trace_write(inputs_trace_t *trace, const inputs_t *inputs)
+{
+    uint8_t keys[ARRAY_SIZE(inputs->keys) / 8] = {};
+    uint8_t buttons;
+    int i, j;
+    const touch_t *touch;
+
+    assert(trace->write);
+    write_u32(trace->file, inputs->window_size[0]);
+    write_u32(trace->file, inputs->window_size[1]);
+    write_float(trace->file, inputs->scale);
+    for (i = 0; i < ARRAY_SIZE(inputs->keys); i++) {
+        if (inputs->keys[i]) keys[i / 8] |= 1 << (i % 8);
+    }
+    fwrite(keys, sizeof(keys), 1, trace->file);
+    for (i = 0; i < ARRAY_SIZE(inputs->chars); i++)
+        write_u32(trace->file, inputs->chars[i]);
+    for (i = 0; i < ARRAY_SIZE(inputs->touches); i++) {
+        touch = &inputs->touches[i];
+        write_float(trace->file, touch->pos[0]);
+        write_float(trace->file, touch->pos[1]);
+        buttons = 0;
+        for (j = 0; j < ARRAY_SIZE(touch->down); j++) {
+            if (touch->down[j]) buttons |= 1 << j;
+        }
+        fwrite(&buttons, 1, 1, trace->file);
+    }
+    write_float(trace->file, inputs->mouse_wheel);
+    return ferror(trace->file) ? -1 : 0;
+}
+
+bool inputs_trace_read(inputs_trace_t *trace, inputs_t *inputs)
+{
+    uint8_t keys[ARRAY_SIZE(inputs->keys) / 8];
+    uint8_t buttons;
+    uint32_t w, h;
+    int i, j;
+    touch_t *touch;
+    FILE *file = trace->file;
+
+    assert(!trace->write);
+    memset(inputs, 0, sizeof(*inputs));
+    if (!read_u32(file, &w) || !read_u32(file, &h)) return false;
+    inputs->window_size[0] = (int32_t)w;
+    inputs->window_size[1] = (int32_t)h;
+    if (!read_float(file, &inputs->scale)) return false;
+    if (fread(keys, sizeof(keys), 1, file) != 1) return false;
+    for (i = 0; i < ARRAY_SIZE(inputs->keys); i++)
+        inputs->keys[i] = keys[i / 8] & (1 << (i % 8));
+    for (i = 0; i < ARRAY_SIZE(inputs->chars); i++) {
+        if (!read_u32(file, &inputs->chars[i])) return false;
+    }
+    for (i = 0; i < ARRAY_SIZE(inputs->touches); i++) {
+        touch = &inputs->touches[i];
+        if (    !read_float(file, &touch->pos[0]) ||
+                !read_float(file, &touch->pos[1]) ||
+                fread(&buttons, 1, 1, file) != 1)
+            return false;
+        for (j = 0; j < ARRAY_SIZE(touch->down); j++)
+            touch->down[j] = buttons & (1 << j);
+    }
+    if (!read_float(file, &inputs->mouse_wheel)) return false;
+    return true;
+}
+
+void inputs_trace_close(inputs_trace_t *trace)
+{
+    if (!trace) return;
+    fclose(trace->file);
+    free(trace);
+}
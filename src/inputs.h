@@ -74,4 +74,44 @@ typedef struct inputs
 // Conveniance function to add a char in the inputs.
 void inputs_insert_char(inputs_t *inputs, uint32_t c);
 
+/*
+ * Type: inputs_trace_t
+ * A file of recorded inputs, one per frame, that can be replayed.
+ *
+ * Only the values that affect goxel are saved: the framebuffer and the
+ * safe margins are not.
+ */
+typedef struct inputs_trace inputs_trace_t;
+
+/*
+ * Function: inputs_trace_open
+ * Open an inputs trace file.
+ *
+ * Parameters:
+ *   path  - Path of the file.
+ *   write - If set, create a new trace to record into, else open an
+ *           existing trace to replay.
+ *
+ * Return:
+ *   The trace, or NULL in case of error.
+ */
+inputs_trace_t *inputs_trace_open(const char *path, bool write);
+
+/*
+ * Function: inputs_trace_write
+ * Append the inputs of a frame to a trace.
+ */
+int inputs_trace_write(inputs_trace_t *trace, const inputs_t *inputs);
+
+/*
+ * Function: inputs_trace_read
+ * Read the inputs of the next frame from a trace.
+ *
+ * Return:
+ *   false at the end of the trace, or if the file is invalid.
+ */
+bool inputs_trace_read(inputs_trace_t *trace, inputs_t *inputs);
+
+void inputs_trace_close(inputs_trace_t *trace);
+
 #endif // INPUTS_H
@@ -33,21 +33,42 @@ void layer_delete(layer_t *layer)
 {
     mesh_delete(layer->mesh);
     texture_delete(layer->image);
+    free(layer->procedural);
     free(layer);
 }
 
+/*
+ * Function: layer_get_key
+ * Return a value that is guarantied to change when the layer change.
+ *
+ * This is called for all the layers at each frame, so we hash all the
+ * attributes in a single pass, and only the used part of the name.
+ */
 uint32_t layer_get_key(const layer_t *layer)
 {
-    uint32_t key;
-    key = mesh_get_key(layer->mesh);
-    key = XXH32(&layer->visible, sizeof(layer->visible), key);
-    key = XXH32(&layer->name, sizeof(layer->name), key);
-    key = XXH32(&layer->box, sizeof(layer->box), key);
-    key = XXH32(&layer->mat, sizeof(layer->mat), key);
-    key = XXH32(&layer->shape, sizeof(layer->shape), key);
-    key = XXH32(&layer->color, sizeof(layer->color), key);
-    key = XXH32(&layer->material, sizeof(layer->material), key);
-    return key;
+    struct {
+        uint64_t            mesh_key;
+        float               box[4][4];
+        float               mat[4][4];
+        const shape_t       *shape;
+        uint32_t            procedural;
+        const material_t    *material;
+        uint8_t             color[4];
+        bool                visible;
+    } data;
+
+    memset(&data, 0, sizeof(data)); // Clear the padding bytes.
+    data.mesh_key = mesh_get_key(layer->mesh);
+    memcpy(data.box, layer->box, sizeof(data.box));
+    memcpy(data.mat, layer->mat, sizeof(data.mat));
+    data.shape = layer->shape;
+    if (layer->procedural)
+        data.procedural = procedural_get_key(layer->procedural);
+    data.material = layer->material;
+    memcpy(data.color, layer->color, sizeof(data.color));
+    data.visible = layer->visible;
+    return XXH32(layer->name, strnlen(layer->name, sizeof(layer->name)),
+                 XXH32(&data, sizeof(data), 0));
 }
 
 layer_t *layer_copy(layer_t *other)
@@ -64,8 +85,13 @@ layer_t *layer_copy(layer_t *other)
     layer->id = other->id;
     layer->base_id = other->base_id;
     layer->base_mesh_key = other->base_mesh_key;
+    layer->base_mesh_version = other->base_mesh_version;
     layer->shape = other->shape;
     layer->shape_key = other->shape_key;
+    mat4_copy(other->update_mat, layer->update_mat);
+    layer->update_mesh_key = other->update_mesh_key;
+    layer->procedural = procedural_copy(other->procedural);
+    layer->procedural_key = other->procedural_key;
     memcpy(layer->color, other->color, sizeof(layer->color));
     return layer;
 }
@@ -21,6 +21,7 @@
 
 #include "material.h"
 #include "mesh.h"
+#include "procedural.h"
 #include "shape.h"
 #include "utils/texture.h"
 
@@ -40,10 +41,18 @@ struct layer {
     // For clone layers:
     int         base_id;
     uint64_t    base_mesh_key;
+    uint64_t    base_mesh_version;  // Version of the base mesh we copied.
     // For shape layers.
     const shape_t *shape;
-    uint32_t    shape_key;
+    uint32_t    shape_key;      // Key of all but the translation.
+    // For clone and shape layers, the matrix and mesh key after the last
+    // mesh update, so that we can only update the changed parts.
+    float       update_mat[4][4];
+    uint64_t    update_mesh_key;
     uint8_t     color[4];
+    // For procedural layers (also use the color).
+    procedural_t *procedural;
+    uint32_t    procedural_key;
 };
 
 layer_t *layer_new(const char *name);
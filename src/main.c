@@ -17,9 +17,21 @@
  */
 
 #include "goxel.h"
+#include "daemon.h"
+#include "pointcloud.h"
+#include "voxelize.h"
 #include <getopt.h>
+#include <pthread.h>
 
-#ifdef GLES2
+#ifndef WIN32
+#   include <sys/mman.h>
+#   include <sys/wait.h>
+#   include <unistd.h>
+#endif
+
+#if defined(GLES3)
+#   define GLFW_INCLUDE_ES3
+#elif defined(GLES2)
 #   define GLFW_INCLUDE_ES2
 #endif
 #include <GLFW/glfw3.h>
@@ -28,6 +40,46 @@ static inputs_t     *g_inputs = NULL;
 static GLFWwindow   *g_window = NULL;
 static float        g_scale = 1;
 
+// Hidden window whose context shares the objects of the main one, for the
+// background uploads of the renderer.  The lock is held while its context
+// is current on the upload thread.
+static GLFWwindow   *g_upload_window = NULL;
+static pthread_mutex_t g_upload_lock = PTHREAD_MUTEX_INITIALIZER;
+static inputs_trace_t *g_record = NULL;
+
+// Time of the last window event, used by the idle mode.  We keep rendering
+// at full speed for IDLE_DELAY seconds after it, so that the GUI has time
+// to settle (hover effects, tooltips, etc).
+#define IDLE_DELAY 1.0
+static double       g_last_event_time = 0;
+
+// Replay of an inputs trace, with the time of each frame.
+typedef struct {
+    inputs_trace_t *trace;
+    int     nb_frames;
+    int     allocated;
+    double  *cpu_times;
+    double  *gpu_times;     // -1 if not known.
+} replay_t;
+
+static replay_t     *g_replay = NULL;
+
+// Start time of the application, and time of the last startup step.
+static double       g_start_time = 0;
+static double       g_step_time = 0;
+
+/*
+ * Log the time spent in a startup step, and since the start of the
+ * application, so that we can see where the launch time goes.
+ */
+static void log_startup_step(const char *step)
+{
+    double time = sys_get_time();
+    LOG_I("Startup %-12s %7.1f ms (total %7.1f ms)", step,
+          (time - g_step_time) * 1000, (time - g_start_time) * 1000);
+    g_step_time = time;
+}
+
 static void on_glfw_error(int code, const char *msg)
 {
     fprintf(stderr, "glfw error %d (%s)\n", code, msg);
@@ -37,29 +89,155 @@ static void on_glfw_error(int code, const char *msg)
 void on_scroll(GLFWwindow *win, double x, double y)
 {
     g_inputs->mouse_wheel = y;
+    g_last_event_time = sys_get_time();
 }
 
 void on_char(GLFWwindow *win, unsigned int c)
 {
     inputs_insert_char(g_inputs, c);
+    g_last_event_time = sys_get_time();
 }
 
 void on_drop(GLFWwindow* win, int count, const char** paths)
 {
     int i;
+    g_last_event_time = sys_get_time();
     for (i = 0;  i < count;  i++)
         goxel_import_file(paths[i], NULL);
 }
 
+// The other inputs are read directly at each frame, we only need to know
+// when they happened.
+static void on_key(GLFWwindow *win, int key, int scancode, int action,
+                   int mods)
+{
+    g_last_event_time = sys_get_time();
+}
+
+static void on_mouse_button(GLFWwindow *win, int button, int action,
+                            int mods)
+{
+    g_last_event_time = sys_get_time();
+}
+
+static void on_cursor_pos(GLFWwindow *win, double x, double y)
+{
+    g_last_event_time = sys_get_time();
+}
+
+// Used to late latch the cursor, see sys_get_cursor_pos.
+static bool get_cursor_pos(void *user, float pos[2])
+{
+    double x, y;
+    glfwGetCursorPos(g_window, &x, &y);
+    pos[0] = x;
+    pos[1] = y;
+    return true;
+}
+
+static void on_window_size(GLFWwindow *win, int w, int h)
+{
+    g_last_event_time = sys_get_time();
+}
+
+static void on_window_refresh(GLFWwindow *win)
+{
+    g_last_event_time = sys_get_time();
+}
+
+static void on_window_focus(GLFWwindow *win, int focused)
+{
+    g_last_event_time = sys_get_time();
+}
+
+/*
+ * In idle mode, if nothing happened for a while and nothing changed since
+ * the last frame, wait for new events instead of rendering at the screen
+ * refresh rate.  We still render at most goxel.idle_fps frames per second
+ * so that the timed tasks (autosave, etc) keep running.
+ */
+static void idle_wait(void)
+{
+    if (DEFINED(EMSCRIPTEN) || !goxel.idle_mode) return;
+    if (sys_get_time() - g_last_event_time < IDLE_DELAY) return;
+    if (goxel_needs_redraw()) return;
+#if GLFW_VERSION_MAJOR >= 3 && GLFW_VERSION_MINOR >= 2
+    glfwWaitEventsTimeout(1.0 / max(goxel.idle_fps, 1));
+#endif
+}
+
 typedef struct
 {
     char *input;
     char *export;
     float scale;
+
+    // Batch conversion.
+    char *convert;      // Output pattern, '{}' is replaced by the input name.
+    const char *list;   // File with one input path per line, or '-'.
+    int jobs;
+    char **inputs;
+    int nb_inputs;
+
+    bool bench;
+    const char *bench_output;
+    bool bench_render;
+    const char *bench_render_output;
+
+    const char *record;
+    const char *replay;
+    const char *replay_output;
+
+    bool mem_report;
+    const char *mem_report_output;
+
+    const char *sync;
+
+    // Requests server.
+    const char *daemon;
+    int daemon_cache;   // Images cache size in MB.
+
+    // Headless path tracer render.
+    char *render;
+    int size[2];
+    int samples;
+    uint32_t seed;
+    const char *camera;
+    float turntable;
+    bool set_light;
+    float light[2];     // Pitch and yaw in degree.
+    int world;          // PT_WORLD_ value, or -1 to keep the default.
+    int floor;          // PT_FLOOR_ value, or -1 to keep the default.
+    int tiles[2];       // Part and number of parts of the tiles to render.
+    bool denoise;
 } args_t;
 
 #define OPT_HELP 1
 #define OPT_VERSION 2
+#define OPT_SIZE 3
+#define OPT_SAMPLES 4
+#define OPT_SEED 5
+#define OPT_CAMERA 6
+#define OPT_TURNTABLE 7
+#define OPT_LIGHT 8
+#define OPT_WORLD 9
+#define OPT_FLOOR 10
+#define OPT_TILES 11
+#define OPT_DENOISE 12
+#define OPT_CONVERT 13
+#define OPT_LIST 14
+#define OPT_JOBS 15
+#define OPT_BENCH 16
+#define OPT_RECORD 17
+#define OPT_REPLAY 18
+#define OPT_REPLAY_OUTPUT 19
+#define OPT_MEM_REPORT 20
+#define OPT_SYNC 21
+#define OPT_DAEMON 22
+#define OPT_DAEMON_CACHE 23
+#define OPT_VOXELIZE 24
+#define OPT_BENCH_RENDER 25
+#define OPT_POINTS 26
 
 typedef struct {
     const char *name;
@@ -71,8 +249,58 @@ typedef struct {
 
 static const gox_option_t OPTIONS[] = {
     {"export", 'e', required_argument, "FILENAME",
-        .help="Export the image to a file"},
+        .help="Export the image to a file, without a window"},
     {"scale", 's', required_argument, "FLOAT", .help="Set UI scale"},
+    {"render", 'r', required_argument, "FILENAME",
+        .help="Render the image with the path tracer, without a window"},
+    {"size", OPT_SIZE, required_argument, "WxH",
+        .help="Size of the render"},
+    {"samples", OPT_SAMPLES, required_argument, "N",
+        .help="Number of samples per pixel of the render"},
+    {"seed", OPT_SEED, required_argument, "N",
+        .help="Random seed of the render"},
+    {"camera", OPT_CAMERA, required_argument, "NAME",
+        .help="Camera of the image to use for the render"},
+    {"turntable", OPT_TURNTABLE, required_argument, "DEG",
+        .help="Rotate the camera around the image before the render"},
+    {"light", OPT_LIGHT, required_argument, "PITCH,YAW",
+        .help="Light direction of the render, in degree"},
+    {"world", OPT_WORLD, required_argument, "none|uniform|sky",
+        .help="World of the render"},
+    {"floor", OPT_FLOOR, required_argument, "none|plane",
+        .help="Floor of the render"},
+    {"tiles", OPT_TILES, required_argument, "I/N",
+        .help="Only render the Ith of N parts of the image"},
+    {"denoise", OPT_DENOISE, .help="Denoise the render"},
+    {"convert", OPT_CONVERT, required_argument, "PATTERN",
+        .help="Convert all the inputs, {} is replaced by the input name"},
+    {"list", OPT_LIST, required_argument, "FILE",
+        .help="Read the inputs to convert from a file, one per line"},
+    {"jobs", OPT_JOBS, required_argument, "N",
+        .help="Number of files to convert in parallel"},
+    {"bench", OPT_BENCH, optional_argument, "FILE",
+        .help="Run the benchmarks, and write the JSON results to FILE"},
+    {"bench-render", OPT_BENCH_RENDER, optional_argument, "FILE",
+        .help="Benchmark the rendering of the input file in a window of "
+              "--size, and write the JSON results to FILE"},
+    {"record", OPT_RECORD, required_argument, "FILE",
+        .help="Record the inputs of the session into FILE"},
+    {"replay", OPT_REPLAY, required_argument, "FILE",
+        .help="Replay recorded inputs and report the frames time"},
+    {"replay-output", OPT_REPLAY_OUTPUT, required_argument, "FILE",
+        .help="Write the JSON replay report to FILE"},
+    {"mem-report", OPT_MEM_REPORT, optional_argument, "FILE",
+        .help="Print the memory used by each subsystem at exit"},
+    {"sync", OPT_SYNC, required_argument, "[HOST:]PORT",
+        .help="Share the active layer edits with an other goxel"},
+    {"daemon", OPT_DAEMON, required_argument, "SOCKET",
+        .help="Serve conversion requests on a unix socket"},
+    {"daemon-cache", OPT_DAEMON_CACHE, required_argument, "MB",
+        .help="Memory budget of the daemon loaded images"},
+    {"voxelize", OPT_VOXELIZE, required_argument, "SIZE[,solid]",
+        .help="Size of the imported polygon meshes (obj, ply, gltf)"},
+    {"points", OPT_POINTS, required_argument, "SIZE[,majority]",
+        .help="Size and colors of the imported point clouds (ply, xyz, las)"},
     {"help", OPT_HELP, .help="Give this help list"},
     {"version", OPT_VERSION, .help="Print program version"},
     {}
@@ -83,7 +311,7 @@ static void print_help(void)
     const gox_option_t *opt;
     char buf[128];
 
-    printf("Usage: goxel [OPTION...] [INPUT]\n");
+    printf("Usage: goxel [OPTION...] [INPUT...]\n");
     printf("A 3D voxels editor\n");
     printf("\n");
 
@@ -93,7 +321,9 @@ static void print_help(void)
         else
             printf("      ");
 
-        if (opt->has_arg)
+        if (opt->has_arg == optional_argument)
+            snprintf(buf, sizeof(buf), "--%s[=%s]", opt->name, opt->arg_name);
+        else if (opt->has_arg)
             snprintf(buf, sizeof(buf), "--%s=%s", opt->name, opt->arg_name);
         else
             snprintf(buf, sizeof(buf), "--%s", opt->name);
@@ -103,6 +333,17 @@ static void print_help(void)
     printf("Report bugs to <guillaume@noctua-software.com>.\n");
 }
 
+static int parse_enum(const char *opt, const char *value,
+                      const char *const names[])
+{
+    int i;
+    for (i = 0; names[i]; i++) {
+        if (strcmp(value, names[i]) == 0) return i;
+    }
+    LOG_E("Invalid --%s value: %s", opt, value);
+    exit(-1);
+}
+
 static void parse_options(int argc, char **argv, args_t *args)
 {
     int i, c, option_index;
@@ -120,7 +361,7 @@ static void parse_options(int argc, char **argv, args_t *args)
     }
 
     while (true) {
-        c = getopt_long(argc, argv, "e:s:", long_options, &option_index);
+        c = getopt_long(argc, argv, "e:s:r:", long_options, &option_index);
         if (c == -1) break;
         switch (c) {
         case 'e':
@@ -129,6 +370,114 @@ static void parse_options(int argc, char **argv, args_t *args)
         case 's':
             args->scale = atof(optarg);
             break;
+        case 'r':
+            args->render = optarg;
+            break;
+        case OPT_SIZE:
+            if (sscanf(optarg, "%dx%d", &args->size[0], &args->size[1]) != 2
+                    || args->size[0] <= 0 || args->size[1] <= 0) {
+                LOG_E("Invalid --size value: %s", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_SAMPLES:
+            args->samples = atoi(optarg);
+            break;
+        case OPT_SEED:
+            args->seed = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_CAMERA:
+            args->camera = optarg;
+            break;
+        case OPT_TURNTABLE:
+            args->turntable = atof(optarg);
+            break;
+        case OPT_LIGHT:
+            if (sscanf(optarg, "%f,%f",
+                       &args->light[0], &args->light[1]) != 2) {
+                LOG_E("Invalid --light value: %s", optarg);
+                exit(-1);
+            }
+            args->set_light = true;
+            break;
+        case OPT_WORLD:
+            args->world = parse_enum("world", optarg,
+                    (const char*[]){"none", "uniform", "sky", NULL});
+            break;
+        case OPT_FLOOR:
+            args->floor = parse_enum("floor", optarg,
+                    (const char*[]){"none", "plane", NULL});
+            break;
+        case OPT_TILES:
+            if (sscanf(optarg, "%d/%d", &args->tiles[0], &args->tiles[1]) != 2
+                    || args->tiles[1] < 1 || args->tiles[0] < 0
+                    || args->tiles[0] >= args->tiles[1]) {
+                LOG_E("Invalid --tiles value: %s", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_DENOISE:
+            args->denoise = true;
+            break;
+        case OPT_CONVERT:
+            args->convert = optarg;
+            break;
+        case OPT_LIST:
+            args->list = optarg;
+            break;
+        case OPT_JOBS:
+            args->jobs = atoi(optarg);
+            if (args->jobs < 1) {
+                LOG_E("Invalid --jobs value: %s", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_BENCH:
+            args->bench = true;
+            args->bench_output = optarg;
+            break;
+        case OPT_BENCH_RENDER:
+            args->bench_render = true;
+            args->bench_render_output = optarg;
+            break;
+        case OPT_RECORD:
+            args->record = optarg;
+            break;
+        case OPT_REPLAY:
+            args->replay = optarg;
+            break;
+        case OPT_REPLAY_OUTPUT:
+            args->replay_output = optarg;
+            break;
+        case OPT_MEM_REPORT:
+            args->mem_report = true;
+            args->mem_report_output = optarg;
+            break;
+        case OPT_SYNC:
+            args->sync = optarg;
+            break;
+        case OPT_DAEMON:
+            args->daemon = optarg;
+            break;
+        case OPT_DAEMON_CACHE:
+            args->daemon_cache = atoi(optarg);
+            break;
+        case OPT_VOXELIZE:
+            if (atoi(optarg) < 1) {
+                LOG_E("Invalid --voxelize value: %s", optarg);
+                exit(-1);
+            }
+            voxelize_set_options(atoi(optarg), strstr(optarg, ",solid"));
+            break;
+        case OPT_POINTS:
+            if (atoi(optarg) < 1) {
+                LOG_E("Invalid --points value: %s", optarg);
+                exit(-1);
+            }
+            pointcloud_set_options(atoi(optarg),
+                                   strstr(optarg, ",majority") ?
+                                   POINTCLOUD_MAJORITY : POINTCLOUD_AVERAGE);
+            break;
         case OPT_HELP:
             print_help();
             exit(0);
@@ -141,6 +490,8 @@ static void parse_options(int argc, char **argv, args_t *args)
     }
     if (optind < argc) {
         args->input = argv[optind];
+        args->inputs = argv + optind;
+        args->nb_inputs = argc - optind;
     }
 }
 
@@ -164,6 +515,7 @@ static void loop_function(void)
         glfwWaitEvents();
         goto end;
     }
+    idle_wait();
     // The input struct gets all the values in framebuffer coordinates,
     // On retina display, this might not be the same as the window
     // size.
@@ -199,15 +551,163 @@ static void loop_function(void)
     g_inputs->touches[0].down[2] =
         glfwGetMouseButton(g_window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
 
+    if (g_record) inputs_trace_write(g_record, g_inputs);
     goxel_iter(g_inputs);
     goxel_render();
 
     memset(g_inputs, 0, sizeof(*g_inputs));
     glfwSwapBuffers(g_window);
+    if (goxel.frame_count == 1) log_startup_step("first frame");
 end:
     glfwPollEvents();
 }
 
+/*
+ * Main loop used when we replay an inputs trace: the inputs come from the
+ * trace instead of the window, and we wait for the GPU at the end of each
+ * frame so that the frames times don't depend on each other.
+ */
+static void replay_loop_function(void)
+{
+    replay_t *replay = g_replay;
+    int win_size[2];
+    double time;
+
+    if (!inputs_trace_read(replay->trace, g_inputs)) {
+        // Close the last profiler frame to get its GPU time.
+        profiler_frame();
+        if (replay->nb_frames)
+            replay->gpu_times[replay->nb_frames - 1] =
+                profiler_get_gpu_time(0);
+        goxel.quit = true;
+        return;
+    }
+    glfwGetWindowSize(g_window, &win_size[0], &win_size[1]);
+    if (    win_size[0] != g_inputs->window_size[0] ||
+            win_size[1] != g_inputs->window_size[1]) {
+        glfwSetWindowSize(g_window, g_inputs->window_size[0],
+                          g_inputs->window_size[1]);
+    }
+
+    if (replay->nb_frames >= replay->allocated) {
+        replay->allocated = max(1024, replay->allocated * 2);
+        replay->cpu_times = realloc(replay->cpu_times,
+                replay->allocated * sizeof(*replay->cpu_times));
+        replay->gpu_times = realloc(replay->gpu_times,
+                replay->allocated * sizeof(*replay->gpu_times));
+    }
+
+    GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+    time = sys_get_time();
+    goxel_iter(g_inputs);
+    // The profiler got the GPU time of the previous frame.
+    if (replay->nb_frames)
+        replay->gpu_times[replay->nb_frames - 1] = profiler_get_gpu_time(0);
+    goxel_render();
+    replay->cpu_times[replay->nb_frames] = sys_get_time() - time;
+    replay->gpu_times[replay->nb_frames] = -1;
+    replay->nb_frames++;
+    GL(glFinish());
+
+    memset(g_inputs, 0, sizeof(*g_inputs));
+    glfwSwapBuffers(g_window);
+    glfwPollEvents();
+}
+
+/*
+ * Main loop used by the rendering benchmark: the frames are rendered by
+ * the benchmark without the gui, and the inputs are ignored.
+ */
+static void bench_render_loop_function(void)
+{
+    int win_size[2], fb_size[2];
+    float viewport[4];
+
+    glfwGetWindowSize(g_window, &win_size[0], &win_size[1]);
+    glfwGetFramebufferSize(g_window, &fb_size[0], &fb_size[1]);
+    goxel.screen_size[0] = win_size[0];
+    goxel.screen_size[1] = win_size[1];
+    goxel.screen_scale = (float)fb_size[0] / max(win_size[0], 1);
+    vec4_set(viewport, 0, 0, win_size[0], win_size[1]);
+    if (!bench_render_iter(viewport, goxel.screen_scale)) {
+        goxel.quit = true;
+        return;
+    }
+    glfwSwapBuffers(g_window);
+    // Only to keep the window alive.
+    glfwPollEvents();
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Write the statistics of a list of frames times as a JSON object.
+static void replay_write_stats(FILE *out, const double *times, int nb)
+{
+    double *sorted, total = 0;
+    int i;
+
+    sorted = malloc(max(nb, 1) * sizeof(*sorted));
+    memcpy(sorted, times, nb * sizeof(*sorted));
+    qsort(sorted, nb, sizeof(*sorted), cmp_double);
+    for (i = 0; i < nb; i++) total += sorted[i];
+    fprintf(out, "{\"total\": %g, \"mean\": %g, \"median\": %g, "
+            "\"p95\": %g, \"p99\": %g, \"max\": %g}",
+            total, nb ? total / nb : 0,
+            nb ? sorted[nb / 2] : 0,
+            nb ? sorted[(int)ceil(nb * 0.95) - 1] : 0,
+            nb ? sorted[(int)ceil(nb * 0.99) - 1] : 0,
+            nb ? sorted[nb - 1] : 0);
+    free(sorted);
+}
+
+static int replay_report(const replay_t *replay, const char *trace_path,
+                         const char *path)
+{
+    FILE *out = stdout;
+    int i, nb_gpu = 0;
+    double *gpu_times;
+
+    if (path && strcmp(path, "-") != 0) {
+        out = fopen(path, "w");
+        if (!out) {
+            LOG_E("Cannot open %s", path);
+            return -1;
+        }
+    }
+    // Only use the GPU times if we got all of them.
+    gpu_times = malloc(max(replay->nb_frames, 1) * sizeof(*gpu_times));
+    for (i = 0; i < replay->nb_frames; i++) {
+        if (replay->gpu_times[i] >= 0)
+            gpu_times[nb_gpu++] = replay->gpu_times[i];
+    }
+    if (nb_gpu != replay->nb_frames) nb_gpu = 0;
+
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"trace\": \"%s\",\n",
+            GOXEL_VERSION_STR, trace_path);
+    fprintf(out, "  \"frames\": %d,\n  \"cpu\": ", replay->nb_frames);
+    replay_write_stats(out, replay->cpu_times, replay->nb_frames);
+    fprintf(out, ",\n  \"gpu\": ");
+    if (nb_gpu)
+        replay_write_stats(out, gpu_times, nb_gpu);
+    else
+        fprintf(out, "null");
+    fprintf(out, ",\n  \"frames_cpu\": [");
+    for (i = 0; i < replay->nb_frames; i++)
+        fprintf(out, "%s%g", i ? ", " : "", replay->cpu_times[i]);
+    fprintf(out, "],\n  \"frames_gpu\": [");
+    for (i = 0; i < nb_gpu; i++)
+        fprintf(out, "%s%g", i ? ", " : "", gpu_times[i]);
+    fprintf(out, "]\n}\n");
+
+    free(gpu_times);
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
 #ifndef __EMSCRIPTEN__
 static void start_main_loop(void (*func)(void))
 {
@@ -215,6 +715,10 @@ static void start_main_loop(void (*func)(void))
         func();
         if (goxel.quit) break;
     }
+    pthread_mutex_lock(&g_upload_lock);
+    if (g_upload_window) glfwDestroyWindow(g_upload_window);
+    g_upload_window = NULL;
+    pthread_mutex_unlock(&g_upload_lock);
     glfwTerminate();
 }
 #else
@@ -265,9 +769,326 @@ static void set_window_title(void *user, const char *title)
     glfwSetWindowTitle(g_window, title);
 }
 
+#ifndef __EMSCRIPTEN__
+
+static bool set_upload_context_current(void *user, bool current)
+{
+    if (!current) {
+        glfwMakeContextCurrent(NULL);
+        pthread_mutex_unlock(&g_upload_lock);
+        return true;
+    }
+    pthread_mutex_lock(&g_upload_lock);
+    if (!g_upload_window) {
+        pthread_mutex_unlock(&g_upload_lock);
+        return false;
+    }
+    glfwMakeContextCurrent(g_upload_window);
+    return true;
+}
+
+// Create the hidden window of the background uploads context.
+static void create_upload_window(GLFWwindow *window)
+{
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    g_upload_window = glfwCreateWindow(1, 1, "", NULL, window);
+    glfwWindowHint(GLFW_VISIBLE, GL_TRUE);
+    if (!g_upload_window) {
+        LOG_W("Cannot create the upload context");
+        return;
+    }
+    sys_callbacks.set_upload_context_current = set_upload_context_current;
+}
+
+#else
+// WebGL doesn't support shared contexts.
+static void create_upload_window(GLFWwindow *window) {}
+#endif
+
+/*
+ * Render the input file with the path tracer into args->render.  This
+ * doesn't need any window or graphic context.
+ */
+static int render_headless(const args_t *args)
+{
+    pathtracer_t *pt = &goxel.pathtracer;
+    image_t *img = goxel.image;
+    camera_t *camera = NULL;
+    int ret;
+
+    if (!args->input) {
+        LOG_E("trying to render an empty image");
+        return -1;
+    }
+    if (goxel_import_file(args->input, NULL) != 0) return -1;
+    img = goxel.image;
+
+    if (args->camera) {
+        DL_FOREACH(img->cameras, camera) {
+            if (strcmp(camera->name, args->camera) == 0) break;
+        }
+        if (!camera) {
+            LOG_E("No camera named %s", args->camera);
+            return -1;
+        }
+    } else {
+        if (!img->cameras) image_add_camera(img, NULL);
+        camera = img->active_camera ?: img->cameras;
+    }
+    img->active_camera = camera;
+    if (args->size[0]) {
+        img->export_width = args->size[0];
+        img->export_height = args->size[1];
+    }
+    camera_turntable(camera, args->turntable * DD2R, 0);
+    camera->aspect = (float)img->export_width / img->export_height;
+    camera_update(camera);
+    // The light direction can depend on the view.
+    mat4_copy(camera->view_mat, goxel.rend.view_mat);
+    mat4_copy(camera->proj_mat, goxel.rend.proj_mat);
+
+    if (args->set_light) {
+        goxel.rend.light.pitch = args->light[0] * DD2R;
+        goxel.rend.light.yaw = args->light[1] * DD2R;
+    }
+    if (args->world != -1) pt->world.type = args->world;
+    if (args->floor != -1) pt->floor.type = args->floor;
+    if (args->samples > 0) pt->num_samples = args->samples;
+    pt->seed = args->seed;
+    pt->denoise = args->denoise;
+
+    pt->w = img->export_width;
+    pt->h = img->export_height;
+    pt->buf = calloc(pt->w * pt->h, 4);
+    pathtracer_render(pt, args->tiles[0], args->tiles[1]);
+    ret = pathtracer_save(pt, args->render);
+    free(pt->buf);
+    pt->buf = NULL;
+    return ret;
+}
+
+/*
+ * Create the --sync connection: wait for a connection if only a port is
+ * given, else connect to HOST:PORT.
+ */
+static sync_t *start_sync(const char *addr)
+{
+    char host[256];
+    int port;
+
+    if (sscanf(addr, "%255[^:]:%d", host, &port) == 2)
+        return sync_connect(host, port);
+    if (sscanf(addr, "%d", &port) == 1)
+        return sync_listen(port);
+    LOG_E("Invalid --sync value: %s", addr);
+    return NULL;
+}
+
+/*
+ * Convert the input file into args->export.  This doesn't need any window
+ * or graphic context either, the gox files are just saved without preview.
+ */
+static int export_headless(const args_t *args)
+{
+    if (!args->input) {
+        LOG_E("trying to export an empty image");
+        return -1;
+    }
+    if (goxel_import_file(args->input, NULL) != 0) return -1;
+    return goxel_export_to_file(args->export, NULL);
+}
+
+/*
+ * Batch conversion state, shared between all the worker processes.
+ */
+typedef struct {
+    int next;           // Index of the next input to convert.
+    struct {
+        int status;     // 0: not done, 1: converted, -1: error.
+        float time;     // Conversion time in seconds.
+    } files[];
+} convert_state_t;
+
+// Read the list of inputs from a file, one path per line.
+static int read_inputs_list(const char *path, char ***inputs, int *nb)
+{
+    FILE *file;
+    char line[1024], **list;
+    int len, allocated = max(*nb, 16);
+
+    file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
+    // Keep the inputs from the command line, that point into argv.
+    list = calloc(allocated, sizeof(*list));
+    if (*nb) memcpy(list, *inputs, *nb * sizeof(*list));
+    *inputs = list;
+    while (fgets(line, sizeof(line), file)) {
+        len = strlen(line);
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (!len) continue;
+        if (*nb >= allocated) {
+            allocated *= 2;
+            *inputs = realloc(*inputs, allocated * sizeof(**inputs));
+        }
+        (*inputs)[(*nb)++] = strdup(line);
+    }
+    if (file != stdin) fclose(file);
+    return 0;
+}
+
+// Replace all the '{}' of the pattern by the input file name, without
+// directory and extension.
+static void get_output_path(const char *pattern, const char *input,
+                            char *out, int size)
+{
+    const char *name, *ext;
+    int name_len, len = 0;
+
+    name = strrchr(input, '/') ? strrchr(input, '/') + 1 : input;
+    ext = strrchr(name, '.');
+    name_len = ext && ext != name ? ext - name : strlen(name);
+
+    while (*pattern && len < size - 1) {
+        if (pattern[0] == '{' && pattern[1] == '}') {
+            len += snprintf(out + len, size - len, "%.*s", name_len, name);
+            len = min(len, size - 1);
+            pattern += 2;
+        } else {
+            out[len++] = *pattern++;
+        }
+    }
+    out[len] = '\0';
+}
+
+static int convert_file(const char *input, const char *pattern)
+{
+    char path[1024];
+
+    get_output_path(pattern, input, path, sizeof(path));
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    if (goxel_import_file(input, NULL) != 0) return -1;
+    return goxel_export_to_file(path, NULL);
+}
+
+// Convert the inputs until there are none left.  Each worker picks the
+// next input from the shared state, so that the big files don't stall the
+// others.
+static void convert_worker(const args_t *args, convert_state_t *state)
+{
+    int i;
+    double time;
+
+    while ((i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) <
+            args->nb_inputs) {
+        time = sys_get_time();
+        state->files[i].status =
+            convert_file(args->inputs[i], args->convert) == 0 ? 1 : -1;
+        state->files[i].time = sys_get_time() - time;
+        printf("%s: %s (%.3fs)\n", args->inputs[i],
+               state->files[i].status == 1 ? "ok" : "error",
+               state->files[i].time);
+        fflush(stdout);
+    }
+}
+
+/*
+ * Convert all the inputs to the args->convert pattern, using args->jobs
+ * worker processes.
+ *
+ * The importers and exporters work on the global goxel image, so the
+ * workers are separate processes forked after the initialization rather
+ * than threads: they each have their own image, and still share the
+ * startup cost.
+ */
+static int convert_headless(args_t *args)
+{
+    convert_state_t *state;
+    size_t size;
+    int i, nb_ok = 0, nb_jobs = 0;
+    double time, total = 0;
+
+    if (args->list && read_inputs_list(args->list, &args->inputs,
+                                       &args->nb_inputs) != 0)
+        return -1;
+    if (!args->nb_inputs) {
+        LOG_E("No input to convert");
+        return -1;
+    }
+
+    size = sizeof(*state) + args->nb_inputs * sizeof(state->files[0]);
+    time = sys_get_time();
+
+#ifndef WIN32
+    state = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) return -1;
+    memset(state, 0, size);
+    if (args->jobs > 1) {
+        // Note: there must not be any thread running at this point.
+        fflush(stdout);
+        for (i = 0; i < min(args->jobs, args->nb_inputs); i++) {
+            pid_t pid = fork();
+            if (pid < 0) break;
+            if (pid == 0) {
+                convert_worker(args, state);
+                _exit(0);
+            }
+            nb_jobs++;
+        }
+    }
+    while (wait(NULL) > 0);
+#else
+    state = calloc(1, size);
+#endif
+    // Convert in this process if we could not start any worker.
+    if (nb_jobs == 0) convert_worker(args, state);
+
+    time = sys_get_time() - time;
+    for (i = 0; i < args->nb_inputs; i++) {
+        if (state->files[i].status == 1) nb_ok++;
+        if (state->files[i].status == 0)
+            printf("%s: not converted\n", args->inputs[i]);
+        total += state->files[i].time;
+    }
+    printf("Converted %d/%d files in %.2fs (%.1f files/s, %.3fs per file, "
+           "%d jobs)\n", nb_ok, args->nb_inputs, time,
+           args->nb_inputs / max(time, 0.001),
+           total / args->nb_inputs, max(nb_jobs, 1));
+
+#ifndef WIN32
+    munmap(state, size);
+#else
+    free(state);
+#endif
+    return nb_ok == args->nb_inputs ? 0 : -1;
+}
+
+// Print the memory stats at exit.  Called after goxel_release, so the
+// current values show what has not been freed.
+static void mem_report(const args_t *args)
+{
+    FILE *out = stdout;
+    if (!args->mem_report) return;
+    if (args->mem_report_output) {
+        out = fopen(args->mem_report_output, "w");
+        if (!out) {
+            LOG_E("Cannot write %s", args->mem_report_output);
+            return;
+        }
+    }
+    mem_stats_report(out);
+    if (out != stdout) fclose(out);
+}
+
 int main(int argc, char **argv)
 {
-    args_t args = {.scale = 1};
+    args_t args = {.scale = 1, .world = -1, .floor = -1, .tiles = {0, 1},
+                   .jobs = 1, .daemon_cache = 1024};
     GLFWwindow *window;
     GLFWmonitor *monitor;
     const GLFWvidmode *mode;
@@ -275,15 +1096,40 @@ int main(int argc, char **argv)
     inputs_t inputs = {};
     g_inputs = &inputs;
 
+    g_start_time = g_step_time = sys_get_time();
     // Setup sys callbacks.
     sys_callbacks.set_window_title = set_window_title;
     parse_options(argc, argv, &args);
 
     g_scale = args.scale;
 
+    if (    args.render || args.export || args.convert || args.bench ||
+            args.daemon) {
+        goxel.headless = true;
+        goxel_init();
+        if (args.daemon)
+            ret = daemon_run(args.daemon, args.jobs, args.daemon_cache);
+        else if (args.bench)
+            ret = bench_run(args.bench_output);
+        else if (args.convert)
+            ret = convert_headless(&args);
+        else if (args.render)
+            ret = render_headless(&args);
+        else
+            ret = export_headless(&args);
+        goxel_release();
+        mem_report(&args);
+        return ret;
+    }
+
     glfwSetErrorCallback(on_glfw_error);
     glfwInit();
     glfwWindowHint(GLFW_SAMPLES, 4);
+#ifdef GLES3
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+#endif
     monitor = glfwGetPrimaryMonitor();
     mode = glfwGetVideoMode(monitor);
     if (mode) {
@@ -293,39 +1139,89 @@ int main(int argc, char **argv)
     window = glfwCreateWindow(width, height, "Goxel", NULL, NULL);
     assert(window);
     g_window = window;
+    create_upload_window(window);
     glfwMakeContextCurrent(window);
     if (!DEFINED(EMSCRIPTEN))
         glfwSetScrollCallback(window, on_scroll);
     glfwSetDropCallback(window, on_drop);
     glfwSetCharCallback(window, on_char);
+    glfwSetKeyCallback(window, on_key);
+    glfwSetMouseButtonCallback(window, on_mouse_button);
+    glfwSetCursorPosCallback(window, on_cursor_pos);
+    glfwSetWindowSizeCallback(window, on_window_size);
+    glfwSetWindowRefreshCallback(window, on_window_refresh);
+    glfwSetWindowFocusCallback(window, on_window_focus);
     glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, false);
     set_window_icon(window);
 
 #ifdef WIN32
     glewInit();
 #endif
+    log_startup_step("window");
     goxel_init();
+    log_startup_step("init");
     // Run the unit tests in debug.
     if (DEBUG) {
         tests_run();
         goxel_reset();
+        log_startup_step("tests");
     }
 
-    if (args.input)
+    if (args.input) {
         goxel_import_file(args.input, NULL);
+        log_startup_step("import");
+    }
+
+    if (args.sync) {
+        goxel.sync = start_sync(args.sync);
+        if (!goxel.sync) exit(-1);
+    }
+
+    if (args.replay) {
+        g_replay = calloc(1, sizeof(*g_replay));
+        g_replay->trace = inputs_trace_open(args.replay, false);
+        if (!g_replay->trace) exit(-1);
+        goxel.fixed_time_step = 1.0 / 60;
+        profiler_set_enabled(true);
+        glfwSwapInterval(0);
+        start_main_loop(replay_loop_function);
+        ret = replay_report(g_replay, args.replay, args.replay_output);
+        inputs_trace_close(g_replay->trace);
+        free(g_replay->cpu_times);
+        free(g_replay->gpu_times);
+        free(g_replay);
+        goxel_release();
+        mem_report(&args);
+        return ret;
+    }
 
-    if (args.export) {
+    if (args.bench_render) {
         if (!args.input) {
-            LOG_E("trying to export an empty image");
-            ret = -1;
-        } else {
-            ret = goxel_export_to_file(args.export, NULL);
+            LOG_E("No input file to benchmark");
+            exit(-1);
         }
-        goto end;
+        if (args.size[0])
+            glfwSetWindowSize(window, args.size[0], args.size[1]);
+        glfwSwapInterval(0);
+        bench_render_begin();
+        start_main_loop(bench_render_loop_function);
+        ret = bench_render_end(args.bench_render_output);
+        goxel_release();
+        mem_report(&args);
+        return ret;
     }
+
+    if (args.record) {
+        g_record = inputs_trace_open(args.record, true);
+        if (!g_record) exit(-1);
+    }
+
+    // Not with the replays, that only use the recorded inputs.
+    sys_callbacks.get_cursor_pos = get_cursor_pos;
     start_main_loop(loop_function);
-end:
     glfwTerminate();
+    inputs_trace_close(g_record);
     goxel_release();
+    mem_report(&args);
     return ret;
 }
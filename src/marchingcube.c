@@ -17,11 +17,14 @@
  */
 
 #include "goxel.h"
-#include <limits.h>
+
+#include <pthread.h>
 
 // Number of sub position per voxel in the marching
-// cube rendering.
-#define MC_VOXEL_SUB_POS 8 // XXX: try to make it higher (up to 16!)
+// cube rendering.  Lower with the big blocks, so that the vertices
+// positions still fit in 8 bits.
+// XXX: try to make it higher (up to 16!)
+#define MC_VOXEL_SUB_POS (BLOCK_SIZE > 16 ? 4 : 8)
 
 static const int N = BLOCK_SIZE;
 
@@ -234,6 +237,81 @@ static int split_poly(int nb, mc_vert_t *poly, mc_vert_t (*out)[3],
     return nb * 2;
 }
 
+/*
+ * Polygons of the flat triangles of each marching cube case, when all the
+ * corners are either fully opaque or fully transparent, so that all the
+ * vertices are in the middle of the edges.  For each case we store the
+ * size of each polygon followed by its edges, and a final zero.
+ *
+ * This only depends on the vertices positions, so we compute it once
+ * with the same get_poly code used for the other cells, so that it also
+ * follows the rounding of MC_VOXEL_SUB_POS.
+ */
+static int8_t g_polys_table[256][24];
+static pthread_once_t g_polys_table_once = PTHREAD_ONCE_INIT;
+
+static void polys_table_init(void)
+{
+    int c, v, i, j, k, nb, size, densities[8];
+    mc_vert_t tri[5][3], poly[6 * 6];
+
+    for (c = 0; c < 256; c++) {
+        for (v = 0; v < 8; v++) densities[v] = (c & (1 << v)) ? 255 : 0;
+        nb = mc_compute(densities, tri);
+        for (i = 0; i < nb; i++)
+        for (v = 0; v < 3; v++)
+            mc_interp_pos(&tri[i][v], tri[i][v].pos, true);
+        for (i = 0, k = 0; i < nb; ) {
+            i += get_poly(nb - i, tri + i, poly, &size);
+            g_polys_table[c][k++] = size;
+            for (j = 0; j < size; j++) g_polys_table[c][k++] = poly[j].edge;
+        }
+        assert(k < ARRAY_SIZE(g_polys_table[c]));
+    }
+}
+
+/*
+ * Compute the flat triangles of a cell whose corners are all fully opaque
+ * or fully transparent, from the polygons table.  The polygons only need
+ * to be split by split_poly if their vertices have different colors,
+ * otherwise this gives the same triangles fan.
+ */
+static int mc_compute_flat(int cube_index, const uint8_t *colors[8],
+                           mc_vert_t (*out)[3])
+{
+    const int8_t *p = g_polys_table[cube_index];
+    int i, size, ret = 0;
+    bool uniform;
+    mc_vert_t poly[6 * 6];
+    const uint8_t *c0, *c1;
+
+    for (; (size = *p++); p += size) {
+        uniform = true;
+        for (i = 0; i < size; i++) {
+            poly[i].edge = p[i];
+            poly[i].v0 = EDGES_VERTICES[p[i]][0];
+            poly[i].v1 = EDGES_VERTICES[p[i]][1];
+            poly[i].mu = 0.5;
+            mc_interp_pos(&poly[i], poly[i].pos, true);
+            c0 = colors[poly[i].v0];
+            c1 = colors[poly[i].v1];
+            memcpy(poly[i].color, c0[3] > c1[3] ? c0 : c1, 4);
+            uniform = uniform && color_eq(poly[i].color, poly[0].color);
+        }
+        if (!uniform) {
+            ret += split_poly(size, poly, out + ret, NULL);
+            continue;
+        }
+        for (i = 0; i < size - 2; i++) {
+            out[ret][0] = poly[i];
+            out[ret][1] = poly[i + 1];
+            out[ret][2] = poly[size - 1];
+            ret++;
+        }
+    }
+    return ret;
+}
+
 static int split_triangles(int nb, const mc_vert_t (*tri)[3],
                            mc_vert_t (*out)[3])
 {
@@ -248,18 +326,34 @@ static int split_triangles(int nb, const mc_vert_t (*tri)[3],
     return ret;
 }
 
+/*
+ * Return the mask of the cells of a row that have both solid and empty
+ * corners, from the solid bits of the (N + 1)^2 rows of voxels.  The other
+ * cells don't produce any triangle.
+ */
+static uint64_t get_surface_cells(const uint64_t *rows, int y, int z)
+{
+    const int S = N + 1;
+    uint64_t all, any;
+    all = rows[z * S + y] & rows[z * S + y + 1] &
+          rows[(z + 1) * S + y] & rows[(z + 1) * S + y + 1];
+    any = rows[z * S + y] | rows[z * S + y + 1] |
+          rows[(z + 1) * S + y] | rows[(z + 1) * S + y + 1];
+    return (any | any >> 1) & ~(all & all >> 1) & ((1ULL << N) - 1);
+}
+
 int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
                               int effects, voxel_vertex_t *out,
                               int *size, int *subdivide)
 {
-    int i, vi, x, y, z, v, vx, vy, vz, nb_tri, nb_tri_tot = 0;
-    uint8_t tmp[4];
-    uint8_t *data;
-
-    int densities[8];
-    int p[3], s[3];
-    int rect[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
-                      {INT_MIN, INT_MIN, INT_MIN}};
+    const int S = N + 1;
+    int i, vi, x, y, z, v, nb_tri, nb_tri_tot = 0;
+    uint8_t *data, range[2];
+    const uint8_t *c1, *c2, *colors[8];
+    int densities[8], cube_index;
+    bool binary;
+    uint64_t rows[(BLOCK_SIZE + 1) * (BLOCK_SIZE + 1)] = {}, cells;
+    bool has_solid = false, has_empty = false;
 
     mc_vert_t tri[30][3];
     float n[3];
@@ -267,81 +361,73 @@ int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
 
     *size = 3;      // Triangles.
     *subdivide = MC_VOXEL_SUB_POS;
+    if (flat) pthread_once(&g_polys_table_once, polys_table_init);
+
+    // The cells only use the voxels of the block and the first layer of
+    // the next blocks, and have no triangles if all their corners are
+    // solid, or all empty.  If that is the case for all the cells we can
+    // tell from the blocks occupancy, without reading the voxels.
+    for (i = 0; i < 8; i++) {
+        mesh_get_block_alpha_range(mesh, NULL, (int[]){
+                block_pos[0] + (i & 1) * N,
+                block_pos[1] + ((i >> 1) & 1) * N,
+                block_pos[2] + ((i >> 2) & 1) * N}, range);
+        if (range[0] >= 127) has_solid = true;
+        else if (range[1] < 127) has_empty = true;
+        else break;
+    }
+    if (i == 8 && !(has_solid && has_empty)) return 0;
 
-    // To speed things up we first get the voxel cube around the block.
-    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
-    p[0] = block_pos[0] - 1;
-    p[1] = block_pos[1] - 1;
-    p[2] = block_pos[2] - 1;
-    s[0] = N + 2;
-    s[1] = N + 2;
-    s[2] = N + 2;
-    mesh_read(mesh, p, s, data);
-
-#define get_at(d, x, y, z, out) do { \
-    memcpy(out, &data[( \
-                (x + 1) + \
-                (y + 1) * (N + 2) + \
-                (z + 1) * (N + 2) * (N + 2)) * 4], 4); \
-} while (0)
-
-    // Get the smallest rect we need to consider.
-    // XXX: can we measure how much we gain with that?
-    for (z = -1; z < N + 1; z++)
-    for (y = -1; y < N + 1; y++)
-    for (x = -1; x < N + 1; x++) {
-        get_at(data, x, y, z, tmp);
-        if (tmp[3]) {
-            rect[0][0] = min(rect[0][0], x - 2);
-            rect[0][1] = min(rect[0][1], y - 2);
-            rect[0][2] = min(rect[0][2], z - 2);
-            rect[1][0] = max(rect[1][0], x + 2);
-            rect[1][1] = max(rect[1][1], y + 2);
-            rect[1][2] = max(rect[1][2], z + 2);
-        }
+    // To speed things up we first get the voxel cube of the cells.
+    data = malloc(S * S * S * 4);
+    mesh_read(mesh, block_pos, (int[]){S, S, S}, data);
+
+#define get_at(x, y, z) (&data[(((z) * S + (y)) * S + (x)) * 4])
+
+    // Solid bits of each row of voxels along x, so that we can find the
+    // cells crossing the surface with a few ANDs and ORs per row of cells.
+    for (z = 0; z < S; z++)
+    for (y = 0; y < S; y++)
+    for (x = 0; x < S; x++) {
+        if (get_at(x, y, z)[3] >= 127) rows[z * S + y] |= 1ULL << x;
     }
-    rect[0][0] = max(rect[0][0], 0);
-    rect[0][1] = max(rect[0][1], 0);
-    rect[0][2] = max(rect[0][2], 0);
-    rect[1][0] = min(rect[1][0], N);
-    rect[1][1] = min(rect[1][1], N);
-    rect[1][2] = min(rect[1][2], N);
-
-    // Add up the contribution of each voxel to the vertices values.
-    for (z = rect[0][2]; z < rect[1][2]; z++)
-    for (y = rect[0][1]; y < rect[1][1]; y++)
-    for (x = rect[0][0]; x < rect[1][0]; x++) {
-        memset(densities, 0, sizeof(densities));
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (cells = get_surface_cells(rows, y, z); cells; cells &= cells - 1) {
+        x = __builtin_ctzll(cells);
+        binary = true;
+        cube_index = 0;
         for (v = 0; v < 8; v++) {
-            vx = x + VERTICES_POSITIONS[v][0];
-            vy = y + VERTICES_POSITIONS[v][1];
-            vz = z + VERTICES_POSITIONS[v][2];
-            get_at(data, vx, vy, vz, tmp);
-            densities[v] = tmp[3];
+            colors[v] = get_at(x + VERTICES_POSITIONS[v][0],
+                               y + VERTICES_POSITIONS[v][1],
+                               z + VERTICES_POSITIONS[v][2]);
+            densities[v] = colors[v][3];
+            binary = binary && (densities[v] == 0 || densities[v] == 255);
+            if (densities[v] >= 127) cube_index |= 1 << v;
         }
-        nb_tri = mc_compute(densities, tri);
-
-        for (i = 0; i < nb_tri; i++) {
-            for (v = 0; v < 3; v++) {
-                mc_interp_pos(&tri[i][v], tri[i][v].pos, flat);
-                uint8_t c1[4], c2[4];
-                get_at(data, x + VERTICES_POSITIONS[tri[i][v].v0][0],
-                             y + VERTICES_POSITIONS[tri[i][v].v0][1],
-                             z + VERTICES_POSITIONS[tri[i][v].v0][2],
-                             c1);
-                get_at(data, x + VERTICES_POSITIONS[tri[i][v].v1][0],
-                             y + VERTICES_POSITIONS[tri[i][v].v1][1],
-                             z + VERTICES_POSITIONS[tri[i][v].v1][2],
-                             c2);
-                memcpy(tri[i][v].color, c1[3] > c2[3] ? c1 : c2, 4);
+        if (flat && binary) {
+            nb_tri = mc_compute_flat(cube_index, colors, tri);
+        } else {
+            nb_tri = mc_compute(densities, tri);
+            for (i = 0; i < nb_tri; i++) {
+                for (v = 0; v < 3; v++) {
+                    mc_interp_pos(&tri[i][v], tri[i][v].pos, flat);
+                    c1 = colors[tri[i][v].v0];
+                    c2 = colors[tri[i][v].v1];
+                    memcpy(tri[i][v].color, c1[3] > c2[3] ? c1 : c2, 4);
+                }
             }
+            if (flat) nb_tri = split_triangles(nb_tri, tri, tri);
         }
-        if (flat) nb_tri = split_triangles(nb_tri, tri, tri);
 
         for (i = 0; i < nb_tri; i++) {
             compute_triangle_normal(tri[i], n);
             for (v = 0; v < 3; v++) {
                 vi = nb_tri_tot * 3 + v;
+                // Clear all the attributes, so that identical vertices can
+                // be merged with mesh_index_vertices.
+                memset(&out[vi], 0, sizeof(out[vi]));
                 memcpy(out[vi].color, tri[i][v].color, sizeof(out[vi].color));
                 out[vi].color[3] = 255;
                 out[vi].pos[0] = tri[i][v].pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
@@ -350,14 +436,11 @@ int mesh_generate_vertices_mc(const mesh_t *mesh, const int block_pos[3],
                 out[vi].normal[0] = n[0] * 64;
                 out[vi].normal[1] = n[1] * 64;
                 out[vi].normal[2] = n[2] * 64;
-                // XXX: this shouldn't matter.
-                memset(out[vi].occlusion_uv, 0, sizeof(out[vi].occlusion_uv));
-                memset(out[vi].bump_uv, 0, sizeof(out[vi].bump_uv));
-                memset(out[vi].gradient, 0, sizeof(out[vi].gradient));
             }
             nb_tri_tot++;
         }
     }
+#undef get_at
     free(data);
     return nb_tri_tot;
 }
@@ -0,0 +1,369 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#define N BLOCK_SIZE
+#define NB_WORDS (N * N * N / 64)
+
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    bool            full;           // Set if all the bits are set.
+    uint64_t        bits[NB_WORDS]; // One bit per voxel, in xyz order.
+} mask_block_t;
+
+struct mask {
+    mask_block_t *blocks;
+};
+
+static inline int voxel_index(const int bpos[3], const int pos[3])
+{
+    return (pos[0] - bpos[0]) + (pos[1] - bpos[1]) * N +
+           (pos[2] - bpos[2]) * N * N;
+}
+
+static void get_block_pos(const int pos[3], int bpos[3])
+{
+    bpos[0] = pos[0] & ~(N - 1);
+    bpos[1] = pos[1] & ~(N - 1);
+    bpos[2] = pos[2] & ~(N - 1);
+}
+
+static mask_block_t *find_block(const mask_t *mask, const int bpos[3])
+{
+    mask_block_t *block;
+    HASH_FIND(hh, mask->blocks, bpos, 3 * sizeof(int), block);
+    return block;
+}
+
+static mask_block_t *add_block(mask_t *mask, const int bpos[3])
+{
+    mask_block_t *block;
+    block = find_block(mask, bpos);
+    if (block) return block;
+    block = calloc(1, sizeof(*block));
+    memcpy(block->pos, bpos, sizeof(block->pos));
+    HASH_ADD(hh, mask->blocks, pos, sizeof(block->pos), block);
+    return block;
+}
+
+static void remove_block(mask_t *mask, mask_block_t *block)
+{
+    HASH_DEL(mask->blocks, block);
+    free(block);
+}
+
+static void set_block_full(mask_block_t *block)
+{
+    memset(block->bits, 0xff, sizeof(block->bits));
+    block->full = true;
+}
+
+// Update the full flag of a block after its bits changed, and remove it if
+// it's empty.
+static void update_block(mask_t *mask, mask_block_t *block)
+{
+    uint64_t all = ~0ULL, any = 0;
+    int i;
+    for (i = 0; i < NB_WORDS; i++) {
+        all &= block->bits[i];
+        any |= block->bits[i];
+    }
+    if (!any) {
+        remove_block(mask, block);
+        return;
+    }
+    block->full = all == ~0ULL;
+}
+
+mask_t *mask_new(void)
+{
+    return calloc(1, sizeof(mask_t));
+}
+
+void mask_delete(mask_t *mask)
+{
+    if (!mask) return;
+    mask_clear(mask);
+    free(mask);
+}
+
+mask_t *mask_copy(const mask_t *mask)
+{
+    mask_t *ret = mask_new();
+    mask_block_t *block, *tmp, *new_block;
+
+    HASH_ITER(hh, mask->blocks, block, tmp) {
+        new_block = malloc(sizeof(*new_block));
+        *new_block = *block;
+        HASH_ADD(hh, ret->blocks, pos, sizeof(new_block->pos), new_block);
+    }
+    return ret;
+}
+
+void mask_clear(mask_t *mask)
+{
+    mask_block_t *block, *tmp;
+    HASH_ITER(hh, mask->blocks, block, tmp) {
+        remove_block(mask, block);
+    }
+}
+
+bool mask_is_empty(const mask_t *mask)
+{
+    return mask->blocks == NULL;
+}
+
+bool mask_get_at(const mask_t *mask, const int pos[3])
+{
+    int bpos[3], i;
+    mask_block_t *block;
+
+    get_block_pos(pos, bpos);
+    block = find_block(mask, bpos);
+    if (!block) return false;
+    i = voxel_index(bpos, pos);
+    return block->bits[i / 64] & (1ULL << (i % 64));
+}
+
+void mask_set_at(mask_t *mask, const int pos[3], bool value)
+{
+    int bpos[3], i;
+    mask_block_t *block;
+
+    get_block_pos(pos, bpos);
+    block = value ? add_block(mask, bpos) : find_block(mask, bpos);
+    if (!block) return;
+    i = voxel_index(bpos, pos);
+    if (value)
+        block->bits[i / 64] |= 1ULL << (i % 64);
+    else
+        block->bits[i / 64] &= ~(1ULL << (i % 64));
+    update_block(mask, block);
+}
+
+void mask_add_box(mask_t *mask, const float box[4][4])
+{
+    float bbox[4][4], mat[4][4], size[3], p[3], dp[3], k[N];
+    int aabb[2][3], bpos[3], x, y, z, i;
+    mask_block_t *block;
+
+    if (box_is_null(box)) return;
+    // Same as in mesh_op: the matrix from the mesh to the shape space.
+    box_get_size(box, size);
+    mat4_copy(box, mat);
+    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
+    mat4_invert(mat, mat);
+    vec3_copy(mat[0], dp);
+
+    box_get_bbox(box, bbox);
+    bbox_to_aabb(bbox, aabb);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = (aabb[0][i] - 1) & ~(N - 1);
+        aabb[1][i] = aabb[1][i] + 1;
+    }
+    for (bpos[2] = aabb[0][2]; bpos[2] < aabb[1][2]; bpos[2] += N)
+    for (bpos[1] = aabb[0][1]; bpos[1] < aabb[1][1]; bpos[1] += N)
+    for (bpos[0] = aabb[0][0]; bpos[0] < aabb[1][0]; bpos[0] += N) {
+        block = add_block(mask, bpos);
+        if (block->full) continue;
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++) {
+            vec3_set(p, bpos[0] + 0.5, bpos[1] + y + 0.5, bpos[2] + z + 0.5);
+            mat4_mul_vec3(mat, p, p);
+            shape_cube.func_row(p, dp, N, size, 0, k);
+            for (x = 0; x < N; x++) {
+                if (k[x] < 0.f) continue;
+                i = x + y * N + z * N * N;
+                block->bits[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+        update_block(mask, block);
+    }
+}
+
+void mask_add_mesh(mask_t *mask, const mesh_t *mesh)
+{
+    const int size[3] = {N, N, N};
+    uint8_t (*voxels)[4];
+    mesh_iterator_t iter;
+    mask_block_t *block;
+    int bpos[3], i;
+
+    voxels = malloc(N * N * N * 4);
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_read(mesh, bpos, size, (uint8_t*)voxels);
+        block = add_block(mask, bpos);
+        if (block->full) continue;
+        for (i = 0; i < N * N * N; i++) {
+            if (voxels[i][3])
+                block->bits[i / 64] |= 1ULL << (i % 64);
+        }
+        update_block(mask, block);
+    }
+    free(voxels);
+}
+
+void mask_merge(mask_t *mask, const mask_t *other, int mode)
+{
+    mask_block_t *block, *other_block, *tmp;
+    int i;
+
+    assert(mode == MODE_OVER || mode == MODE_SUB || mode == MODE_INTERSECT);
+    if (mode == MODE_OVER) {
+        HASH_ITER(hh, other->blocks, other_block, tmp) {
+            block = add_block(mask, other_block->pos);
+            if (block->full) continue;
+            if (other_block->full) {
+                set_block_full(block);
+                continue;
+            }
+            for (i = 0; i < NB_WORDS; i++)
+                block->bits[i] |= other_block->bits[i];
+            update_block(mask, block);
+        }
+    }
+
+    if (mode == MODE_SUB) {
+        HASH_ITER(hh, other->blocks, other_block, tmp) {
+            block = find_block(mask, other_block->pos);
+            if (!block) continue;
+            if (other_block->full) {
+                remove_block(mask, block);
+                continue;
+            }
+            for (i = 0; i < NB_WORDS; i++)
+                block->bits[i] &= ~other_block->bits[i];
+            update_block(mask, block);
+        }
+    }
+
+    if (mode == MODE_INTERSECT) {
+        HASH_ITER(hh, mask->blocks, block, tmp) {
+            other_block = find_block(other, block->pos);
+            if (!other_block) {
+                remove_block(mask, block);
+                continue;
+            }
+            if (other_block->full) continue;
+            for (i = 0; i < NB_WORDS; i++)
+                block->bits[i] &= other_block->bits[i];
+            update_block(mask, block);
+        }
+    }
+}
+
+void mask_apply(const mask_t *mask, mesh_t *mesh, int mode,
+                const uint8_t color[4])
+{
+    const int size[3] = {N, N, N};
+    const uint8_t white[4] = {255, 255, 255, 255};
+    uint8_t (*a)[4], (*b)[4], (*out)[4];
+    mesh_iterator_t iter;
+    mask_block_t *block, *tmp;
+    uint64_t id;
+    int bpos[3], i, j, nb = 0, allocated = 0;
+    int (*blocks_pos)[3] = NULL;
+    bool skip_dst_empty;
+
+    color = color ?: white;
+    a = malloc(N * N * N * 4);
+    b = malloc(N * N * N * 4);
+    out = malloc(N * N * N * 4);
+
+    if (mode == MODE_INTERSECT) {
+        // Only the blocks that are partially in the mask need to be
+        // modified, the full ones are kept as they are.
+        // We first get the list of blocks since we modify the mesh.
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            if (nb == allocated) {
+                allocated = max(16, allocated * 2);
+                blocks_pos = realloc(blocks_pos,
+                                     allocated * sizeof(*blocks_pos));
+            }
+            memcpy(blocks_pos[nb++], bpos, sizeof(bpos));
+        }
+        for (j = 0; j < nb; j++) {
+            block = find_block(mask, blocks_pos[j]);
+            if (block && block->full) continue;
+            if (!block) {
+                mesh_clear_block(mesh, NULL, blocks_pos[j]);
+                continue;
+            }
+            mesh_read(mesh, blocks_pos[j], size, (uint8_t*)a);
+            for (i = 0; i < N * N * N; i++) {
+                if (!(block->bits[i / 64] & (1ULL << (i % 64))))
+                    memset(a[i], 0, 4);
+            }
+            mesh_write(mesh, blocks_pos[j], size, (uint8_t*)a);
+        }
+        free(blocks_pos);
+        goto end;
+    }
+
+    for (i = 0; i < N * N * N; i++) memcpy(b[i], color, 4);
+    skip_dst_empty = mode == MODE_SUB || mode == MODE_SUB_CLAMP ||
+                     mode == MODE_MULT_ALPHA;
+    HASH_ITER(hh, mask->blocks, block, tmp) {
+        mesh_get_block_data(mesh, NULL, block->pos, &id);
+        if (!id && skip_dst_empty) continue;
+        if (block->full && mode == MODE_SUB && color[3] == 255) {
+            mesh_clear_block(mesh, NULL, block->pos);
+            continue;
+        }
+        mesh_read(mesh, block->pos, size, (uint8_t*)a);
+        combine_voxels((uint8_t*)a, (uint8_t*)b, N * N * N, mode, NULL,
+                       (uint8_t*)out);
+        if (!block->full) {
+            for (i = 0; i < N * N * N; i++) {
+                if (!(block->bits[i / 64] & (1ULL << (i % 64))))
+                    memcpy(out[i], a[i], 4);
+            }
+        }
+        mesh_write(mesh, block->pos, size, (uint8_t*)out);
+    }
+
+end:
+    free(a);
+    free(b);
+    free(out);
+}
+
+void mask_to_mesh(const mask_t *mask, mesh_t *mesh, const uint8_t color[4])
+{
+    const int size[3] = {N, N, N};
+    uint8_t (*voxels)[4];
+    mask_block_t *block, *tmp;
+    int i;
+
+    mesh_clear(mesh);
+    voxels = malloc(N * N * N * 4);
+    HASH_ITER(hh, mask->blocks, block, tmp) {
+        for (i = 0; i < N * N * N; i++) {
+            if (block->bits[i / 64] & (1ULL << (i % 64)))
+                memcpy(voxels[i], color, 4);
+            else
+                memset(voxels[i], 0, 4);
+        }
+        mesh_write(mesh, block->pos, size, (uint8_t*)voxels);
+    }
+    free(voxels);
+}
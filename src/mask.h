@@ -0,0 +1,97 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MASK_H
+#define MASK_H
+
+#include "mesh.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Type: mask_t
+ * A set of voxels positions, used for the selections.
+ *
+ * The mask is stored per block, with one bit per voxel.  The blocks with
+ * all their voxels set are flagged as full, so that the operations can
+ * skip them, and the empty blocks are not stored at all.
+ */
+typedef struct mask mask_t;
+
+mask_t *mask_new(void);
+void mask_delete(mask_t *mask);
+mask_t *mask_copy(const mask_t *mask);
+void mask_clear(mask_t *mask);
+bool mask_is_empty(const mask_t *mask);
+
+bool mask_get_at(const mask_t *mask, const int pos[3]);
+void mask_set_at(mask_t *mask, const int pos[3], bool value);
+
+/*
+ * Function: mask_add_box
+ * Add all the voxels inside a box to a mask.
+ *
+ * This uses the same test as <mesh_op> with a cube shape: a voxel is
+ * inside if its center is inside the box.
+ */
+void mask_add_box(mask_t *mask, const float box[4][4]);
+
+/*
+ * Function: mask_add_mesh
+ * Add all the non transparent voxels of a mesh to a mask.
+ */
+void mask_add_mesh(mask_t *mask, const mesh_t *mesh);
+
+/*
+ * Function: mask_merge
+ * Combine a mask with an other one.
+ *
+ * Parameters:
+ *   mask  - The mask to modify.
+ *   other - The other mask.
+ *   mode  - MODE_OVER for the union, MODE_SUB for the difference, or
+ *           MODE_INTERSECT for the intersection.
+ */
+void mask_merge(mask_t *mask, const mask_t *other, int mode);
+
+/*
+ * Function: mask_apply
+ * Apply an operation to the voxels of a mesh that are in a mask.
+ *
+ * With MODE_INTERSECT, this removes all the voxels of the mesh that are
+ * not in the mask.  With the other modes, each masked voxel is combined
+ * with the color as with <combine_voxels>, and the other voxels are not
+ * changed.
+ *
+ * Parameters:
+ *   mask  - The mask.
+ *   mesh  - The mesh to modify.
+ *   mode  - One of the <MODE> enum value.
+ *   color - The color to combine the voxels with, or NULL for white.
+ */
+void mask_apply(const mask_t *mask, mesh_t *mesh, int mode,
+                const uint8_t color[4]);
+
+/*
+ * Function: mask_to_mesh
+ * Set a mesh to the voxels of a mask, all with the same color.
+ */
+void mask_to_mesh(const mask_t *mask, mesh_t *mesh, const uint8_t color[4]);
+
+#endif // MASK_H
@@ -17,10 +17,22 @@
  */
 
 #include "mesh.h"
+#include "utils/counters.h"
+#include "utils/mem_stats.h"
+#include "utils/mempool.h"
+#include "utils/page_store.h"
+#include "utils/parallel.h"
 #include "uthash.h"
+#include "utlist.h"
+#include "xxhash.h"
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -39,35 +51,332 @@ enum {
     MESH_ITER_FINISHED                  = 1 << 9,
     MESH_ITER_BOX                       = 1 << 10,
     MESH_ITER_MESH2                     = 1 << 11,
+    MESH_ITER_NEIGHBORS                 = 1 << 12,
+    MESH_ITER_ORIENTED_BOX              = 1 << 13,
+};
+
+// Directions of the six neighbors of a block.  Opposite directions only
+// differ by the first bit of their index.
+static const int NEIGHBORS_DIRS[6][3] = {
+    {0, 0, -1}, {0, 0, +1},
+    {0, -1, 0}, {0, +1, 0},
+    {-1, 0, 0}, {+1, 0, 0},
 };
 
 typedef struct block_data block_data_t;
+/*
+ * The data of a block.  The voxels can be stored in three ways:
+ *
+ * - As a full RGBA array in 'voxels'.
+ * - As a palette of up to 256 colors, with one byte index per voxel.
+ * - If all the voxels have the same value (like the empty blocks, or the
+ *   inside of a solid model), only this value is kept in 'color'.
+ *
+ * The compact formats are only used for reading: the RGBA array is
+ * allocated again the first time we write into the block.
+ */
 struct block_data
 {
     int         ref;
     uint64_t    id;
-    uint8_t     voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE][4]; // RGBA voxels.
+    uint8_t     (*voxels)[4];   // RGBA voxels, or NULL if compressed.
+    uint8_t     *indices;       // Palette index of each voxel, or NULL.
+    uint8_t     (*palette)[4];
+    int         nb_colors;      // Size of the palette.
+    uint8_t     color[4];       // Value of all the voxels if uniform.
+    // Occupancy mask of the voxels (alpha > 0), one bit per voxel, with
+    // one word per row along x.  Kept for all the formats.
+    block_row_t mask[BLOCK_SIZE * BLOCK_SIZE];
+    int         nb_voxels;      // Number of bits set in the mask.
+    // Bounding box of the non empty voxels relative to the block, cached
+    // for the data id bbox_id.  Protected by g_table_cache_lock.
+    int8_t      bbox[2][3];
+    uint64_t    bbox_id;
+    // Set if the data is in the intern table, in which case it is never
+    // modified in place.
+    bool        interned;
+    uint32_t    hash;           // Hash of the content, if interned.
+    // Hash of the voxels values, cached for the data id content_hash_id,
+    // see block_data_get_content_hash.  Only accessed atomically.
+    uint64_t    content_hash;
+    uint64_t    content_hash_id;
+    // Bloom filter of the colors of the full RGBA voxels, cached for the
+    // data id colors_bloom_id, see block_data_get_colors_bloom.  Only
+    // accessed atomically.
+    uint64_t    colors_bloom;
+    uint64_t    colors_bloom_id;
+    // Set until the voxels are loaded from the pager, see
+    // block_data_load.  Only accessed atomically.
+    mesh_pager_t *pager;
+    int         page;
+    // Value of g_page_clock the last time the data was used, to page out
+    // the least recently used data first.
+    uint32_t    last_used;
+};
+
+// Locks used when loading the paged blocks data, indexed by the data
+// address, so that different blocks can be loaded in parallel.
+#define PAGE_LOCKS_COUNT 16
+static pthread_mutex_t g_page_locks[PAGE_LOCKS_COUNT] = {
+    [0 ... PAGE_LOCKS_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER
 };
 
+/*
+ * Global table of the blocks data indexed by the hash of their content,
+ * so that identical blocks share the same data even when they were
+ * created independently.  The table doesn't hold any reference: the data
+ * remove themselves from it when they are released.  In case of hash
+ * collision, the second data is just not interned.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    uint32_t        hash;
+    block_data_t    *data;
+} intern_entry_t;
+
+static intern_entry_t *g_intern_table = NULL;
+static pthread_mutex_t g_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool g_dedup_enabled = true;
+
 struct block
 {
-    UT_hash_handle  hh;     // The hash table of pos -> blocks in a mesh.
+    int             ref;    // Number of tables pages referencing the block.
     block_data_t    *data;
     int             pos[3];
     uint64_t        id;
+    int             index;  // Index in the table blocks array.
 };
 
+static block_t *block_copy(const block_t *other);
+static void block_release(block_t *block);
+
+/*
+ * The blocks of a mesh are indexed in an open addressing hash table, using
+ * linear probing.  The key is the block position packed into a single
+ * 64 bits value, so that a lookup is just a multiplication and a few
+ * comparisons.  A slot is 16 bytes, so four of them fit in a cache line,
+ * and most probe sequences don't leave the first line.
+ *
+ * Deleted slots are marked with a tombstone, that way removing a block
+ * never moves the other blocks around.  The table is rebuilt when the
+ * number of used slots (including tombstones) reaches 3/4 of the capacity.
+ *
+ * The blocks are also kept in a dense array, in insertion order, that the
+ * iterators and the parallel algorithms can directly index, and where the
+ * positions can be read without touching the blocks.  Removing a block
+ * leaves a hole in the array, the holes are only compacted when the array
+ * needs to grow, and the blocks keep their index when the table is copied,
+ * so that an iterator can continue after the mesh has been modified.
+ *
+ * Both arrays are split into pages of TABLE_PAGE_SIZE items (or a single
+ * smaller page for the small tables) that are shared between the copies of
+ * a table, as well as the blocks themselves.  Copying a table only copies
+ * the pages pointers, and a page or a block is only copied the first time
+ * it is modified, see table_own_block.  The blocks are referenced by the
+ * entries pages, so a block shared by two tables always has a reference
+ * count above one, or is in a shared page.
+ */
+typedef struct {
+    uint64_t    key;
+    block_t     *block;     // NULL if the slot is empty.
+} block_slot_t;
+
+typedef struct {
+    int         pos[3];
+    block_t     *block;     // NULL if the block has been removed.
+} block_entry_t;
+
+#define TABLE_PAGE_SHIFT 8
+#define TABLE_PAGE_SIZE (1 << TABLE_PAGE_SHIFT)
+
+typedef struct {
+    int             ref;
+    block_slot_t    slots[];
+} slots_page_t;
+
+typedef struct {
+    int             ref;
+    block_entry_t   entries[];
+} entries_page_t;
+
+// Iterate all the blocks of a table, in insertion order.  The current
+// block can be removed during the iteration.
+#define TABLE_FOREACH(table, block, i) \
+    for (i = 0; i < (table)->nb_entries; i++) \
+        if (!((block) = table_entry(table, i)->block)) {} else
+
+/*
+ * Coarse occupancy index above the blocks, used to skip large empty regions
+ * without looking up each block position.
+ *
+ * The level 1 cells group 8x8x8 blocks, and the level 2 cells group 8x8x8
+ * level 1 cells, so a level 2 cell covers 128x128x128 blocks.  Each cell
+ * has a 512 bits mask of its children that contain at least one block, and
+ * the cells of a level are kept in an open addressing hash table, like the
+ * blocks.  The index is updated when a block is added or removed.
+ *
+ * The cells that become empty are left in the table, so that they act as
+ * tombstones, and are only removed when the level table is rebuilt.
+ */
+#define CELL_LEVELS 2
+
+typedef struct {
+    int         pos[3];     // Position in units of the cell size.
+    int         count;      // Number of non empty children, or zero.
+    bool        used;       // Set if the slot is used.
+    uint64_t    mask[8];    // Bit (y * 8 + x) of mask[z].
+} cell_t;
+
+typedef struct {
+    cell_t      *cells;
+    int         capacity;   // Number of slots (power of two, or zero).
+    int         used;       // Number of used slots.
+} cell_level_t;
+
+// An entry of the blocks changes journal.
+typedef struct {
+    uint64_t    version;
+    int         pos[3];
+} journal_entry_t;
+
+// Maximum number of entries kept in a journal.
+#define JOURNAL_MAX_SIZE 4096
+
+typedef struct {
+    int             ref;        // Used to implement copy on write.
+    int             capacity;   // Number of slots (power of two, or zero).
+    int             count;      // Number of blocks in the table.
+    int             used;       // Number of non empty slots.
+    slots_page_t    **slots;
+    // All the blocks, in insertion order, with holes.
+    entries_page_t  **entries;
+    int             nb_entries;
+    int             entries_capacity;
+    uint64_t        version;    // Unique id changed when adding or
+                                // removing blocks.
+    // Occupancy index of the blocks, level 1 first.
+    cell_level_t    levels[CELL_LEVELS];
+
+    // Journal of the modified blocks positions, see mesh_get_changes.
+    // Each entry has a new unique version, so that we can recognize the
+    // versions that are part of the history of the table, including across
+    // copies.
+    uint64_t        journal_base;   // Version before the first entry.
+    journal_entry_t *journal;
+    int             journal_size;
+    int             journal_allocated;
+    // Set when the current version might have been seen by someone, in
+    // which case we can't reuse the last entry for the next change.
+    bool            journal_seen;
+
+    // Journal version of the last call to mesh_remove_empty_blocks, and
+    // whether it also compressed the blocks, so that the next call only
+    // has to check the blocks modified since.
+    uint64_t        clean_version;
+    bool            clean_compressed;
+
+    // Values computed from the blocks, cached for the table version and
+    // journal version they were computed at.  Protected by
+    // g_table_cache_lock.
+    // Positions of the missing blocks next to the non empty blocks, see
+    // table_get_neighbors.
+    int             (*neighbors)[3];
+    int             nb_neighbors;
+    uint64_t        neighbors_version;
+    uint64_t        neighbors_journal_version;
+    // Exact bounding box, see mesh_get_bbox.
+    int             bbox[2][3];
+    uint64_t        bbox_version;
+    uint64_t        bbox_journal_version;
+    // Voxels statistics, see mesh_get_stats.
+    mesh_stats_t    stats;
+    uint64_t        stats_version;
+    uint64_t        stats_journal_version;
+    // Content hash, see mesh_get_hash.
+    uint64_t        hash;
+    uint64_t        hash_version;
+    uint64_t        hash_journal_version;
+} block_table_t;
+
+static pthread_mutex_t g_table_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A block of a mesh stored as changes relative to an other mesh.
+typedef struct {
+    int             pos[3];
+    block_data_t    *data;  // NULL if there is no block at this position.
+} delta_entry_t;
+
 struct mesh
 {
-    block_t *blocks;
-    int *ref;   // Used to implement copy on write of the blocks.
+    block_table_t *blocks; // Shared between copies of the mesh.
     uint64_t key; // Two meshes with the same key have the same value.
+    // Set instead of the blocks for meshes stored as changes relative to
+    // an other mesh, see mesh_make_delta.
+    delta_entry_t *delta;
+    int delta_size;
+    // Current write session, see mesh_begin_write: number of nested
+    // sessions, unique id at the start of the session, key given to the
+    // mesh by the session, and journal version at the start.
+    int write_depth;
+    uint64_t write_session;
+    uint64_t write_key;
+    uint64_t write_version;
 };
 
 static uint64_t g_uid = 2; // Global id counter.
 
+// Return a new unique id.  This can be called from any thread.
+static inline uint64_t new_uid(void)
+{
+    return __atomic_fetch_add(&g_uid, 1, __ATOMIC_RELAXED);
+}
+
 static mesh_global_stats_t g_global_stats = {};
 
+/*
+ * The blocks data and tables reference counters are atomic, so that copies
+ * of a mesh can be read and deleted from other threads, while the original
+ * mesh keeps being edited.  Writing into a mesh is only ever done when
+ * nobody else references its table or data, so the values themselves
+ * don't need any locking.
+ */
+static inline void ref_inc(int *ref)
+{
+    __atomic_add_fetch(ref, 1, __ATOMIC_RELAXED);
+}
+
+// Return the new value of the counter.
+static inline int ref_dec(int *ref)
+{
+    return __atomic_sub_fetch(ref, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline int ref_get(const int *ref)
+{
+    return __atomic_load_n(ref, __ATOMIC_ACQUIRE);
+}
+
+// Increase a counter, unless it already reached zero.
+static inline bool ref_inc_not_zero(int *ref)
+{
+    int v = __atomic_load_n(ref, __ATOMIC_RELAXED);
+    while (v) {
+        if (__atomic_compare_exchange_n(ref, &v, v + 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+#define STATS_ADD(attr, v) \
+    __atomic_add_fetch(&g_global_stats.attr, v, __ATOMIC_RELAXED)
+
+// Blocks data memory, also reported to the memory stats.
+#define MEM_ADD(v) do { \
+    STATS_ADD(mem, v); \
+    mem_stats_add(MEM_BLOCKS, (int64_t)(v)); \
+} while (0)
+
 #define N BLOCK_SIZE
 
 #define vec3_copy(a, b) do {b[0] = a[0]; b[1] = a[1]; b[2] = a[2];} while (0)
@@ -78,7 +387,70 @@ static mesh_global_stats_t g_global_stats = {};
         for (y = 0; y < N; y++) \
             for (x = 0; x < N; x++)
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
+#define VOXELS_SIZE (N * N * N * 4)
+
+/*
+ * The blocks, blocks data, and voxels arrays are all allocated from
+ * memory pools, since we have a lot of them and they are constantly
+ * created and released when editing.
+ */
+static mempool_t g_blocks_pool = MEMPOOL_INIT(sizeof(block_t));
+static mempool_t g_datas_pool = MEMPOOL_INIT(sizeof(block_data_t));
+static mempool_t g_voxels_pool = MEMPOOL_INIT(VOXELS_SIZE);
+static mempool_t g_indices_pool = MEMPOOL_INIT(N * N * N);
+
+static block_data_t *block_data_alloc(void)
+{
+    block_data_t *data = mempool_alloc(&g_datas_pool);
+    memset(data, 0, sizeof(*data));
+    return data;
+}
+
+/*
+ * Index of a voxel in the blocks data arrays.
+ *
+ * By default the voxels are stored linearly, x first.  If BLOCK_MORTON is
+ * set (with the morton scons option) they are stored in Z-order instead,
+ * so that the neighbor voxels along y and z are closer in memory, at the
+ * cost of copying the rows one voxel at a time in mesh_read and
+ * mesh_write.  DATA_POS is the inverse of DATA_INDEX.
+ */
+#if BLOCK_MORTON
+// Spread the five bits of a coordinate two bits apart, and back.
+#define MORTON_SPREAD(v) (((v) & 1) | ((v) & 2) << 2 | ((v) & 4) << 4 | \
+                          ((v) & 8) << 6 | ((v) & 16) << 8)
+#define MORTON_COMPACT(i) (((i) & 1) | ((i) >> 2 & 2) | ((i) >> 4 & 4) | \
+                           ((i) >> 6 & 8) | ((i) >> 8 & 16))
+#define MORTON_SPREAD_4(v) MORTON_SPREAD(v), MORTON_SPREAD(v + 1), \
+                           MORTON_SPREAD(v + 2), MORTON_SPREAD(v + 3)
+static const uint16_t MORTON[32] = {
+    MORTON_SPREAD_4(0),  MORTON_SPREAD_4(4),  MORTON_SPREAD_4(8),
+    MORTON_SPREAD_4(12), MORTON_SPREAD_4(16), MORTON_SPREAD_4(20),
+    MORTON_SPREAD_4(24), MORTON_SPREAD_4(28),
+};
+#define DATA_INDEX(x, y, z) \
+    (MORTON[x] | MORTON[y] << 1 | MORTON[z] << 2)
+#define DATA_POS(i, x, y, z) do { \
+    (x) = MORTON_COMPACT(i); \
+    (y) = MORTON_COMPACT((i) >> 1); \
+    (z) = MORTON_COMPACT((i) >> 2); \
+} while (0)
+#else
+#define DATA_INDEX(x, y, z) ((x) + (y) * N + (z) * N * N)
+#define DATA_POS(i, x, y, z) do { \
+    (x) = (i) % N; \
+    (y) = (i) / N % N; \
+    (z) = (i) / (N * N); \
+} while (0)
+#endif
+
+// Pointer to the RGBA value of a voxel in a block data.  Compressed
+// blocks data can only be read this way, for writing we first need to
+// call block_prepare_write.
+#define DATA_AT(d, x, y, z) \
+    ((d)->voxels ? (d)->voxels[DATA_INDEX(x, y, z)] : \
+     (d)->indices ? (d)->palette[(d)->indices[DATA_INDEX(x, y, z)]] : \
+     (d)->color)
 #define BLOCK_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
 
 static void mat4_mul_vec4(float mat[4][4], const float v[4], float out[4])
@@ -120,6 +492,49 @@ static void box_get_bbox(float box[4][4], int bbox[2][3])
     memcpy(bbox, ret, sizeof(ret));
 }
 
+// Test if a box is not axis aligned.
+static bool box_is_oriented(const float box[4][4])
+{
+    return box[0][1] || box[0][2] || box[1][0] ||
+           box[1][2] || box[2][0] || box[2][1];
+}
+
+// Test of the intersection of a box with a block, using the separating
+// axis theorem: we test the axes of the box and of the block, and their
+// cross products.  The block is grown by one voxel on each side, so that
+// float errors never reject a block that the box only touches.
+static bool box_intersect_block(const float box[4][4], const int pos[3])
+{
+    float t[3], l[3], ra, rb;
+    const float h = N / 2.0f;
+    int i, j, k;
+
+    for (i = 0; i < 3; i++) t[i] = pos[i] + h - box[3][i];
+    for (k = 0; k < 15; k++) {
+        if (k < 3) {
+            l[0] = k == 0; l[1] = k == 1; l[2] = k == 2;
+        } else if (k < 6) {
+            memcpy(l, box[k - 3], sizeof(l));
+        } else {
+            // Cross product of the block axis i with the box axis j.
+            i = (k - 6) / 3;
+            j = (k - 6) % 3;
+            l[0] = (i == 1) * box[j][2] - (i == 2) * box[j][1];
+            l[1] = (i == 2) * box[j][0] - (i == 0) * box[j][2];
+            l[2] = (i == 0) * box[j][1] - (i == 1) * box[j][0];
+        }
+        ra = 0;
+        for (j = 0; j < 3; j++) {
+            ra += fabsf(box[j][0] * l[0] + box[j][1] * l[1] +
+                        box[j][2] * l[2]);
+        }
+        rb = (h + 1) * (fabsf(l[0]) + fabsf(l[1]) + fabsf(l[2]));
+        if (fabsf(t[0] * l[0] + t[1] * l[1] + t[2] * l[2]) > ra + rb)
+            return false;
+    }
+    return true;
+}
+
 static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
 {
     int i;
@@ -131,682 +546,3238 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
 
 static block_data_t *get_empty_data(void)
 {
-    static block_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
-    }
-    return data;
+    // Statically allocated so that it's safe to use from any thread.
+    static block_data_t data = {.ref = 1, .id = 0};
+    return &data;
 }
 
-static bool block_is_empty(const block_t *block, bool fast)
-{
-    int x, y, z;
-    if (!block) return true;
-    if (block->data->id == 0) return true;
-    if (fast) return false;
+// Marker of a deleted slot in the blocks table.
+static block_t g_tombstone;
+#define TOMBSTONE (&g_tombstone)
 
-    BLOCK_ITER(x, y, z) {
-        if (BLOCK_AT(block, x, y, z)[3]) return false;
-    }
-    return true;
+// Pack a block position into a 64 bits key.  We use 21 bits per axis,
+// that is about one million blocks in each direction.
+static inline uint64_t block_key(const int pos[3])
+{
+    const uint64_t m = (1 << 21) - 1;
+    return (((uint64_t)(pos[0] / N) & m) << 0) |
+           (((uint64_t)(pos[1] / N) & m) << 21) |
+           (((uint64_t)(pos[2] / N) & m) << 42);
 }
 
-static block_t *block_new(const int pos[3])
+static inline uint32_t block_key_hash(uint64_t key)
 {
-    block_t *block = calloc(1, sizeof(*block));
-    memcpy(block->pos, pos, sizeof(block->pos));
-    block->data = get_empty_data();
-    block->data->ref++;
-    block->id = g_uid++;
-    return block;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key ^ (key >> 32);
 }
 
-static void block_delete(block_t *block)
+// Number of slots or entries in each page of an array of a given capacity.
+static inline int table_page_len(int capacity)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        g_global_stats.nb_blocks--;
-        g_global_stats.mem -= sizeof(*block->data);
-    }
-    free(block);
+    return min(capacity, TABLE_PAGE_SIZE);
 }
 
-static block_t *block_copy(const block_t *other)
+static inline int table_nb_pages(int capacity)
 {
-    block_t *block = malloc(sizeof(*block));
-    *block = *other;
-    memset(&block->hh, 0, sizeof(block->hh));
-    block->data->ref++;
-    block->id = g_uid++;
-    return block;
+    return capacity ? capacity / table_page_len(capacity) : 0;
 }
 
-static void block_set_data(block_t *block, block_data_t *data)
+static inline block_slot_t *table_slot(const block_table_t *table,
+                                       uint32_t i)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        g_global_stats.nb_blocks--;
-        g_global_stats.mem -= sizeof(*block->data);
-    }
-    block->data = data;
-    data->ref++;
+    return &table->slots[i >> TABLE_PAGE_SHIFT]->
+            slots[i & (TABLE_PAGE_SIZE - 1)];
 }
 
-// Copy the data if there are any other blocks having reference to it.
-static void block_prepare_write(block_t *block)
+static inline block_entry_t *table_entry(const block_table_t *table, int i)
 {
-    if (block->data->ref == 1) {
-        block->data->id = ++g_uid;
-        return;
-    }
-    block->data->ref--;
-    block_data_t *data;
-    data = calloc(1, sizeof(*block->data));
-    memcpy(data->voxels, block->data->voxels, N * N * N * 4);
-    data->ref = 1;
-    block->data = data;
-    block->data->id = ++g_uid;
+    return &table->entries[i >> TABLE_PAGE_SHIFT]->
+            entries[i & (TABLE_PAGE_SIZE - 1)];
+}
 
-    g_global_stats.nb_blocks++;
-    g_global_stats.mem += sizeof(*block->data);
+static slots_page_t *slots_page_new(const slots_page_t *src, int len)
+{
+    slots_page_t *page;
+    page = calloc(1, sizeof(*page) + len * sizeof(*page->slots));
+    page->ref = 1;
+    if (src) memcpy(page->slots, src->slots, len * sizeof(*page->slots));
+    return page;
 }
 
-static void block_get_at(const block_t *block, const int pos[3],
-                         uint8_t out[4])
+static void slots_page_release(slots_page_t *page)
 {
-    int x, y, z;
-    if (!block) {
-        memset(out, 0, 4);
-        return;
-    }
-    x = pos[0] - block->pos[0];
-    y = pos[1] - block->pos[1];
-    z = pos[2] - block->pos[2];
-    assert(x >= 0 && x < N);
-    assert(y >= 0 && y < N);
-    assert(z >= 0 && z < N);
-    memcpy(out, BLOCK_AT(block, x, y, z), 4);
+    if (ref_dec(&page->ref)) return;
+    free(page);
 }
 
-/*
- * Function: mesh_get_bbox
- *
- * Get the bounding box of a mesh.
- *
- * Inputs:
- *   mesh   - The mesh
- *   exact  - If true, compute the exact bounding box.  If false, returns
- *            an approximation that might be slightly bigger than the
- *            actual box, but faster to compute.
- *
- * Outputs:
- *   bbox  - The bounding box as the bottom left and top right corner of
- *           the mesh.  If the mesh is empty, this will contain all zero.
- *
- * Returns:
- *   true if the mesh is not empty.
- */
-bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact)
+// Create a new entries page of len_new entries, with the first len entries
+// copied from an other page.  The new page gets a reference to the blocks.
+static entries_page_t *entries_page_new(const entries_page_t *src, int len,
+                                        int len_new)
 {
-    block_t *block;
-    int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
-                     {INT_MIN, INT_MIN, INT_MIN}};
-    int pos[3];
-    mesh_iterator_t iter;
-    bool empty = false;
+    entries_page_t *page;
+    int i;
 
-    if (!exact) {
-        for (block = mesh->blocks; block; block = block->hh.next) {
-            if (block_is_empty(block, true)) continue;
-            ret[0][0] = min(ret[0][0], block->pos[0]);
-            ret[0][1] = min(ret[0][1], block->pos[1]);
-            ret[0][2] = min(ret[0][2], block->pos[2]);
-            ret[1][0] = max(ret[1][0], block->pos[0] + N);
-            ret[1][1] = max(ret[1][1], block->pos[1] + N);
-            ret[1][2] = max(ret[1][2], block->pos[1] + N);
-        }
-    } else {
-        iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
-        while (mesh_iter(&iter, pos)) {
-            if (!mesh_get_alpha_at(mesh, &iter, pos)) continue;
-            ret[0][0] = min(ret[0][0], pos[0]);
-            ret[0][1] = min(ret[0][1], pos[1]);
-            ret[0][2] = min(ret[0][2], pos[2]);
-            ret[1][0] = max(ret[1][0], pos[0] + 1);
-            ret[1][1] = max(ret[1][1], pos[1] + 1);
-            ret[1][2] = max(ret[1][2], pos[2] + 1);
-        }
+    page = calloc(1, sizeof(*page) + len_new * sizeof(*page->entries));
+    page->ref = 1;
+    if (!src) return page;
+    memcpy(page->entries, src->entries, len * sizeof(*page->entries));
+    for (i = 0; i < len; i++) {
+        if (page->entries[i].block) ref_inc(&page->entries[i].block->ref);
     }
-    empty = ret[0][0] >= ret[1][0];
-    if (empty) memset(ret, 0, sizeof(ret));
-    memcpy(bbox, ret, sizeof(ret));
-    return !empty;
+    return page;
 }
 
-static void mesh_prepare_write(mesh_t *mesh)
+static void entries_page_release(entries_page_t *page, int len)
 {
-    block_t *blocks, *block, *new_block;
-    assert(*mesh->ref > 0);
-    mesh->key = g_uid++;
-    if (*mesh->ref == 1)
-        return;
-    (*mesh->ref)--;
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
-    *mesh->ref = 1;
-    blocks = mesh->blocks;
-    mesh->blocks = NULL;
-    for (block = blocks; block; block = block->hh.next) {
-        block->id = g_uid++; // Invalidate all accessors.
-        new_block = block_copy(block);
-        HASH_ADD(hh, mesh->blocks, pos, sizeof(new_block->pos), new_block);
+    int i;
+    if (ref_dec(&page->ref)) return;
+    for (i = 0; i < len; i++) {
+        if (page->entries[i].block) block_release(page->entries[i].block);
     }
-    g_global_stats.nb_meshes++;
+    free(page);
 }
 
-static block_t *mesh_add_block(mesh_t *mesh, const int pos[3]);
-
-static void mesh_add_neighbors_blocks(mesh_t *mesh)
+// Return a slot of a table for writing, copying its page first if it is
+// shared with an other table.
+static block_slot_t *table_write_slot(block_table_t *table, uint32_t i)
 {
-    const int POS[6][3] = {
-        {0, 0, -1}, {0, 0, +1},
-        {0, -1, 0}, {0, +1, 0},
-        {-1, 0, 0}, {+1, 0, 0},
-    };
-    int i, p[3] = {};
-    uint64_t key = mesh->key;
-    block_t *block, *tmp, *other;
-
-    mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        if (block_is_empty(block, true)) continue;
-        for (i = 0; i < 6; i++) {
-            p[0] = block->pos[0] + POS[i][0] * N;
-            p[1] = block->pos[1] + POS[i][1] * N;
-            p[2] = block->pos[2] + POS[i][2] * N;
-            HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), other);
-            if (!other) mesh_add_block(mesh, p);
-        }
+    slots_page_t **page = &table->slots[i >> TABLE_PAGE_SHIFT], *old;
+    if (ref_get(&(*page)->ref) > 1) {
+        old = *page;
+        *page = slots_page_new(old, table_page_len(table->capacity));
+        slots_page_release(old);
     }
-    // Adding empty blocks shouldn't change the key of the mesh.
-    mesh->key = key;
+    return &(*page)->slots[i & (TABLE_PAGE_SIZE - 1)];
 }
 
-void mesh_remove_empty_blocks(mesh_t *mesh, bool fast)
+// Same as table_write_slot for the blocks entries.
+static block_entry_t *table_write_entry(block_table_t *table, int i)
 {
-    block_t *block, *tmp;
-    uint64_t key = mesh->key;
-    mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        if (block_is_empty(block, false)) {
-            HASH_DEL(mesh->blocks, block);
-            assert(mesh->blocks != block);
-            block_delete(block);
-        }
+    entries_page_t **page = &table->entries[i >> TABLE_PAGE_SHIFT], *old;
+    int len;
+    if (ref_get(&(*page)->ref) > 1) {
+        old = *page;
+        len = table_page_len(table->entries_capacity);
+        *page = entries_page_new(old, len, len);
+        entries_page_release(old, len);
     }
-    // Empty blocks shouldn't change the key of the mesh.
-    mesh->key = key;
+    return &(*page)->entries[i & (TABLE_PAGE_SIZE - 1)];
 }
 
-bool mesh_is_empty(const mesh_t *mesh)
+static void table_free_slots(block_table_t *table)
 {
-    return mesh->blocks == NULL;
+    int i;
+    for (i = 0; i < table_nb_pages(table->capacity); i++)
+        slots_page_release(table->slots[i]);
+    free(table->slots);
+    table->slots = NULL;
 }
 
-mesh_t *mesh_new(void)
+static block_table_t *table_new(void)
 {
-    mesh_t *mesh;
-    mesh = calloc(1, sizeof(*mesh));
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
-    mesh->key = 1; // Empty mesh key.
-    *mesh->ref = 1;
-    g_global_stats.nb_meshes++;
-    return mesh;
+    block_table_t *table = calloc(1, sizeof(*table));
+    table->ref = 1;
+    table->version = new_uid();
+    table->journal_base = new_uid();
+    return table;
 }
 
-mesh_iterator_t mesh_get_iterator(const mesh_t *mesh, int flags)
+static uint64_t table_get_journal_version(const block_table_t *table)
 {
-    return (mesh_iterator_t){
-        .mesh = mesh,
-        .flags = flags,
-    };
+    return table->journal_size ?
+        table->journal[table->journal_size - 1].version : table->journal_base;
 }
 
-mesh_iterator_t mesh_get_union_iterator(
-        const mesh_t *m1, const mesh_t *m2, int flags)
+// Mark the current journal version as seen.  Can be called from any
+// thread, since it doesn't change the value of the table.
+static void table_see_journal(const block_table_t *table)
 {
-    return (mesh_iterator_t){
-        .mesh = m1,
-        .mesh2 = m2,
-        .flags = flags,
-    };
+    __atomic_store_n((bool*)&table->journal_seen, true, __ATOMIC_RELAXED);
 }
 
-mesh_iterator_t mesh_get_box_iterator(const mesh_t *mesh,
-                                      const float box[4][4], int flags)
+// Add the position of a modified block to the journal.
+static void table_log(block_table_t *table, const int pos[3])
 {
-    int mesh_bbox[2][3];
-    mesh_iterator_t iter = {
-        .mesh = mesh,
-        .flags = MESH_ITER_BOX | MESH_ITER_VOXELS | flags,
-    };
-    memcpy(iter.box, box, sizeof(iter.box));
-    box_get_bbox(iter.box, iter.bbox);
-
-    if (flags & MESH_ITER_SKIP_EMPTY) {
-        mesh_get_bbox(mesh, mesh_bbox, false);
-        bbox_intersection(mesh_bbox, iter.bbox, iter.bbox);
+    const int half = JOURNAL_MAX_SIZE / 2;
+    journal_entry_t *last;
+
+    // Consecutive changes of the same block only need one entry, as long
+    // as nobody saw the intermediate version.
+    last = table->journal_size ? &table->journal[table->journal_size - 1]
+                               : NULL;
+    if (    last && !table->journal_seen &&
+            memcmp(last->pos, pos, sizeof(last->pos)) == 0) {
+        last->version = new_uid();
+        return;
+    }
+    table->journal_seen = false;
+
+    // Forget the oldest half of the journal when it is full.
+    if (table->journal_size == JOURNAL_MAX_SIZE) {
+        table->journal_base = table->journal[half - 1].version;
+        memmove(table->journal, table->journal + half,
+                (JOURNAL_MAX_SIZE - half) * sizeof(*table->journal));
+        table->journal_size -= half;
     }
+    if (table->journal_size == table->journal_allocated) {
+        table->journal_allocated = max(16, table->journal_allocated * 2);
+        table->journal = realloc(table->journal,
+                table->journal_allocated * sizeof(*table->journal));
+    }
+    table->journal[table->journal_size++] = (journal_entry_t){
+        .version = new_uid(),
+        .pos = {pos[0], pos[1], pos[2]},
+    };
+}
 
-    return iter;
+// Copy the journal of a table into a new table.
+static void table_copy_journal(const block_table_t *src, block_table_t *dst)
+{
+    free(dst->journal);
+    dst->journal_base = src->journal_base;
+    dst->journal_size = src->journal_size;
+    dst->journal_allocated = src->journal_size;
+    dst->journal = malloc(max(1, src->journal_size) * sizeof(*dst->journal));
+    if (src->journal_size)
+        memcpy(dst->journal, src->journal,
+               src->journal_size * sizeof(*dst->journal));
+    dst->journal_seen = __atomic_load_n(&src->journal_seen,
+                                        __ATOMIC_RELAXED);
+    dst->clean_version = src->clean_version;
+    dst->clean_compressed = src->clean_compressed;
 }
 
-mesh_accessor_t mesh_get_accessor(const mesh_t *mesh)
+static block_t *table_find(const block_table_t *table, const int pos[3])
 {
-    return (mesh_accessor_t){0};
+    uint64_t key;
+    uint32_t i, mask;
+    const block_slot_t *slot;
+
+    if (!table->count) return NULL;
+    key = block_key(pos);
+    mask = table->capacity - 1;
+    for (i = block_key_hash(key) & mask;; i = (i + 1) & mask) {
+        slot = table_slot(table, i);
+        if (!slot->block) return NULL;
+        if (slot->key == key && slot->block != TOMBSTONE) return slot->block;
+    }
 }
 
+static inline uint32_t cell_hash(const int pos[3])
+{
+    const uint64_t m = (1 << 21) - 1;
+    return block_key_hash(((uint64_t)pos[0] & m) << 0 |
+                          ((uint64_t)pos[1] & m) << 21 |
+                          ((uint64_t)pos[2] & m) << 42);
+}
 
-void mesh_clear(mesh_t *mesh)
+// Return the slot of a cell, or the empty slot where it should be added.
+static cell_t *cell_level_lookup(const cell_level_t *level, const int pos[3])
 {
-    assert(mesh);
-    block_t *block, *tmp;
-    mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        HASH_DEL(mesh->blocks, block);
-        assert(mesh->blocks != block);
-        block_delete(block);
+    uint32_t i, mask = level->capacity - 1;
+    cell_t *cell;
+
+    for (i = cell_hash(pos) & mask;; i = (i + 1) & mask) {
+        cell = &level->cells[i];
+        if (!cell->used || memcmp(cell->pos, pos, sizeof(cell->pos)) == 0)
+            return cell;
     }
-    mesh->key = 1; // Empty mesh key.
-    mesh->blocks = NULL;
 }
 
-void mesh_delete(mesh_t *mesh)
+// Rebuild a level table, removing the empty cells, and grow it if needed so
+// that it is at most half full.
+static void cell_level_rehash(cell_level_t *level)
 {
-    block_t *block, *tmp;
-    if (!mesh) return;
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
-        HASH_ITER(hh, mesh->blocks, block, tmp) {
-            HASH_DEL(mesh->blocks, block);
-            assert(mesh->blocks != block);
-            block_delete(block);
-        }
-        free(mesh->ref);
-        g_global_stats.nb_meshes--;
+    cell_level_t old = *level;
+    int i, nb = 0, capacity = 16;
+
+    for (i = 0; i < old.capacity; i++)
+        nb += old.cells[i].used && old.cells[i].count;
+    while (capacity < (nb + 1) * 2) capacity *= 2;
+    level->cells = calloc(capacity, sizeof(*level->cells));
+    level->capacity = capacity;
+    level->used = nb;
+    for (i = 0; i < old.capacity; i++) {
+        if (!old.cells[i].used || !old.cells[i].count) continue;
+        *cell_level_lookup(level, old.cells[i].pos) = old.cells[i];
     }
-    free(mesh);
+    free(old.cells);
 }
 
-mesh_t *mesh_copy(const mesh_t *other)
+// Get the cell at a given position of a level, adding it if needed.
+static cell_t *cell_level_get(cell_level_t *level, const int pos[3])
 {
-    mesh_t *mesh = calloc(1, sizeof(*mesh));
-    mesh->blocks = other->blocks;
-    mesh->ref = other->ref;
-    mesh->key = other->key;
-    (*mesh->ref)++;
-    return mesh;
+    cell_t *cell;
+    if ((level->used + 1) * 4 > level->capacity * 3) cell_level_rehash(level);
+    cell = cell_level_lookup(level, pos);
+    if (!cell->used) {
+        cell->used = true;
+        vec3_copy(pos, cell->pos);
+        level->used++;
+    }
+    return cell;
 }
 
-void mesh_set(mesh_t *mesh, const mesh_t *other)
+// Position of the cell of a given level containing a block, and the index
+// of its child containing the block.
+static void cell_get_pos(const int bpos[3], int level, int pos[3],
+                         int child[3])
 {
-    block_t *block, *tmp;
-    assert(mesh && other);
-    if (mesh->blocks == other->blocks) return; // Already the same.
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
-        HASH_ITER(hh, mesh->blocks, block, tmp) {
-            HASH_DEL(mesh->blocks, block);
-            assert(mesh->blocks != block);
-            block_delete(block);
-        }
-        free(mesh->ref);
-        g_global_stats.nb_meshes--;
+    int i, b;
+    for (i = 0; i < 3; i++) {
+        b = bpos[i] / N; // Exact, since the blocks positions are aligned.
+        pos[i] = b >> (3 * level);
+        child[i] = (b >> (3 * (level - 1))) & 7;
     }
-    mesh->blocks = other->blocks;
-    mesh->ref = other->ref;
-    mesh->key = other->key;
-    (*mesh->ref)++;
 }
 
-static uint64_t get_block_id(const block_t *block)
+static void table_index_add(block_table_t *table, const int bpos[3])
 {
-    return block ? block->id : 1;
+    int l, pos[3], c[3];
+    cell_t *cell;
+    uint64_t bit;
+
+    for (l = 1; l <= CELL_LEVELS; l++) {
+        cell_get_pos(bpos, l, pos, c);
+        cell = cell_level_get(&table->levels[l - 1], pos);
+        bit = 1ULL << (c[1] * 8 + c[0]);
+        // The upper levels are already set.
+        if (cell->mask[c[2]] & bit) return;
+        cell->mask[c[2]] |= bit;
+        if (cell->count++) return;
+    }
 }
 
-static block_t *mesh_get_block_at(const mesh_t *mesh, const int pos[3],
-                                  mesh_accessor_t *it)
+static void table_index_remove(block_table_t *table, const int bpos[3])
 {
-    block_t *block;
-    int p[3] = {};
-    p[0] = pos[0] & ~(int)(N - 1);
-    p[1] = pos[1] & ~(int)(N - 1);
-    p[2] = pos[2] & ~(int)(N - 1);
-    if (!it) {
-        HASH_FIND(hh, mesh->blocks, p, sizeof(p), block);
-        return block;
+    int l, pos[3], c[3];
+    cell_t *cell;
+
+    for (l = 1; l <= CELL_LEVELS; l++) {
+        cell_get_pos(bpos, l, pos, c);
+        cell = cell_level_lookup(&table->levels[l - 1], pos);
+        assert(cell->used && cell->count);
+        cell->mask[c[2]] &= ~(1ULL << (c[1] * 8 + c[0]));
+        if (--cell->count) return;
     }
+}
 
-    if (    it->block_id && it->block_id == get_block_id(it->block) &&
-            vec3_equal(it->block_pos, p)) {
-        return it->block;
+static void table_copy_index(const block_table_t *src, block_table_t *dst)
+{
+    int l;
+    const cell_level_t *level;
+    for (l = 0; l < CELL_LEVELS; l++) {
+        level = &src->levels[l];
+        free(dst->levels[l].cells);
+        dst->levels[l] = *level;
+        dst->levels[l].cells = malloc(max(level->capacity, 1) *
+                                      sizeof(*level->cells));
+        if (level->capacity)
+            memcpy(dst->levels[l].cells, level->cells,
+                   level->capacity * sizeof(*level->cells));
     }
-    HASH_FIND(hh, mesh->blocks, p, sizeof(p), block);
-    it->block = block;
-    it->block_id = get_block_id(block);
-    vec3_copy(p, it->block_pos);
-    return block;
 }
 
-static block_t *mesh_add_block(mesh_t *mesh, const int pos[3])
+/*
+ * Return the size of the largest aligned empty region containing a block
+ * position, that is N if there is no block at this position but the level
+ * 1 cell is not empty, up to the size of a level 2 cell, or zero if there
+ * is a block at this position.
+ */
+static int table_get_empty_size(const block_table_t *table,
+                                const int bpos[3])
 {
-    block_t *block;
+    int l, pos[3], c[3];
+    const cell_t *cell;
+
+    if (!table->count) return N << (3 * CELL_LEVELS);
+    for (l = CELL_LEVELS; l >= 1; l--) {
+        cell_get_pos(bpos, l, pos, c);
+        cell = cell_level_lookup(&table->levels[l - 1], pos);
+        if (!cell->used || !cell->count) return N << (3 * l);
+        if (!(cell->mask[c[2]] & (1ULL << (c[1] * 8 + c[0]))))
+            return N << (3 * (l - 1));
+    }
+    return 0;
+}
+
+static void table_insert_slot(block_table_t *table, block_t *block)
+{
+    uint64_t key = block_key(block->pos);
+    uint32_t i, mask = table->capacity - 1;
+    block_slot_t *slot;
+
+    for (i = block_key_hash(key) & mask;; i = (i + 1) & mask) {
+        slot = table_slot(table, i);
+        if (!slot->block) table->used++;
+        if (!slot->block || slot->block == TOMBSTONE) break;
+    }
+    slot = table_write_slot(table, i);
+    slot->key = key;
+    slot->block = block;
+}
+
+// Index of the slot of a block of the table.
+static uint32_t table_find_slot(const block_table_t *table,
+                                const block_t *block)
+{
+    uint64_t key = block_key(block->pos);
+    uint32_t i, mask = table->capacity - 1;
+
+    for (i = block_key_hash(key) & mask;; i = (i + 1) & mask) {
+        assert(table_slot(table, i)->block);
+        if (table_slot(table, i)->block == block) return i;
+    }
+}
+
+// Rebuild the slots, getting rid of the tombstones, and grow the table if
+// needed so that it is at most half full.
+static void table_rehash(block_table_t *table)
+{
+    block_t *block;
+    int i, capacity = 16;
+
+    while (capacity < (table->count + 1) * 2) capacity *= 2;
+    table_free_slots(table);
+    table->capacity = capacity;
+    table->slots = malloc(table_nb_pages(capacity) * sizeof(*table->slots));
+    for (i = 0; i < table_nb_pages(capacity); i++)
+        table->slots[i] = slots_page_new(NULL, table_page_len(capacity));
+    table->used = 0;
+    TABLE_FOREACH(table, block, i) table_insert_slot(table, block);
+}
+
+/*
+ * Make sure that a block of a table is not shared with any other table
+ * before we modify it, and return the block to use, that is a copy of the
+ * block if it was shared.  Also needed before changing the block index.
+ */
+static block_t *table_own_block(block_table_t *table, block_t *block)
+{
+    block_entry_t *entry;
+    block_t *copy;
+
+    entry = table_write_entry(table, block->index);
+    // Only the entry of this table references the block.
+    if (ref_get(&block->ref) == 1) return block;
+    copy = block_copy(block);
+    entry->block = copy;
+    table_write_slot(table, table_find_slot(table, block))->block = copy;
+    // Invalidate the accessors of the block.  The block could be read by
+    // other threads at the same time, so we use an atomic store.
+    __atomic_store_n(&block->id, new_uid(), __ATOMIC_RELAXED);
+    block_release(block);
+    // Also invalidate the accessors caches.
+    table->version = new_uid();
+    return copy;
+}
+
+// Test if a block of a table could be read from an other table.
+static bool table_block_is_shared(const block_table_t *table,
+                                  const block_t *block)
+{
+    const entries_page_t *page;
+    page = table->entries[block->index >> TABLE_PAGE_SHIFT];
+    return ref_get(&block->ref) > 1 || ref_get(&page->ref) > 1;
+}
+
+// Make room for a new entry in the blocks array, by removing the holes if
+// there are enough of them, otherwise by growing the array.
+static void table_reserve_entry(block_table_t *table)
+{
+    int i, j, len, nb;
+    block_t *block;
+    block_entry_t entry;
+    entries_page_t *page;
+
+    if (table->nb_entries < table->entries_capacity) return;
+    if (table->nb_entries - table->count > table->nb_entries / 2) {
+        for (i = 0, j = 0; i < table->nb_entries; i++) {
+            block = table_entry(table, i)->block;
+            if (!block) continue;
+            if (i != j) {
+                block = table_own_block(table, block);
+                entry = *table_entry(table, i);
+                *table_write_entry(table, j) = entry;
+                table_write_entry(table, i)->block = NULL;
+                block->index = j;
+            }
+            j++;
+        }
+        table->nb_entries = j;
+        return;
+    }
+    // Grow the single page of the small tables, or add a new page.
+    len = table->entries_capacity;
+    if (len < TABLE_PAGE_SIZE) {
+        page = entries_page_new(len ? table->entries[0] : NULL, len,
+                                min(max(16, len * 2), TABLE_PAGE_SIZE));
+        if (len) entries_page_release(table->entries[0], len);
+        if (!table->entries) table->entries = malloc(sizeof(*table->entries));
+        table->entries[0] = page;
+        table->entries_capacity = min(max(16, len * 2), TABLE_PAGE_SIZE);
+        return;
+    }
+    nb = table_nb_pages(len);
+    table->entries = realloc(table->entries,
+                             (nb + 1) * sizeof(*table->entries));
+    table->entries[nb] = entries_page_new(NULL, 0, TABLE_PAGE_SIZE);
+    table->entries_capacity += TABLE_PAGE_SIZE;
+}
+
+// The caller is responsible for making sure that there is no block at the
+// same position already.  The table takes the reference of the block.
+static void table_add(block_table_t *table, block_t *block)
+{
+    block_entry_t *entry;
+
+    if ((table->used + 1) * 4 > table->capacity * 3) table_rehash(table);
+    table_insert_slot(table, block);
+    table->count++;
+    table->version = new_uid();
+    table_index_add(table, block->pos);
+    table_reserve_entry(table);
+    block->index = table->nb_entries++;
+    entry = table_write_entry(table, block->index);
+    vec3_copy(block->pos, entry->pos);
+    entry->block = block;
+}
+
+// Remove a block from a table, and release the table reference to it.
+static void table_remove(block_table_t *table, block_t *block)
+{
+    table_write_slot(table, table_find_slot(table, block))->block =
+        TOMBSTONE;
+    table->count--;
+    table->version = new_uid();
+    table_index_remove(table, block->pos);
+    table_write_entry(table, block->index)->block = NULL;
+    block_release(block);
+}
+
+// Test if a row of voxels is fully transparent.
+static bool row_is_empty(const uint8_t *data, int len)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+        if (data[i * 4 + 3]) return false;
+    }
+    return true;
+}
+
+#define MASK_AT(d, y, z) ((d)->mask[(y) + (z) * N])
+
+static inline bool block_data_is_paged(const block_data_t *data)
+{
+    return __atomic_load_n(&data->pager, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static void block_data_load(const block_data_t *data);
+
+// Clock of the blocks usage, incremented at each call to mesh_page_out.
+static uint32_t g_page_clock = 1;
+
+// Mark a block data as used, for the paging.
+static inline void block_data_touch(const block_data_t *data)
+{
+    uint32_t clock = __atomic_load_n(&g_page_clock, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&data->last_used, __ATOMIC_RELAXED) != clock) {
+        __atomic_store_n(&((block_data_t*)data)->last_used, clock,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+// The paged blocks are assumed not to be empty, so that we don't need to
+// load them.
+static bool block_is_empty(const block_t *block)
+{
+    if (!block) return true;
+    if (block->data->id == 0) return true;
+    if (block_data_is_paged(block->data)) return false;
+    return block->data->nb_voxels == 0;
+}
+
+// Recompute the occupancy mask of a row of voxels.
+static void block_data_update_mask(block_data_t *data, int y, int z)
+{
+    int x;
+    block_row_t mask = 0;
+    for (x = 0; x < N; x++) {
+        if (DATA_AT(data, x, y, z)[3]) mask |= (block_row_t)1 << x;
+    }
+    data->nb_voxels += __builtin_popcount(mask) -
+                       __builtin_popcount(MASK_AT(data, y, z));
+    MASK_AT(data, y, z) = mask;
+}
+
+// Compute the bounding box of the non empty voxels of a block, using the
+// occupancy mask.  Return false if the block is empty.
+static bool block_get_bbox(const block_t *block, int bbox[2][3])
+{
+    int y, z;
+    block_row_t mask, all = 0;
+    int ret[2][3] = {{N, N, N}, {0, 0, 0}};
+
+    block_data_load(block->data);
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        mask = MASK_AT(block->data, y, z);
+        if (!mask) continue;
+        all |= mask;
+        ret[0][1] = min(ret[0][1], y);
+        ret[0][2] = min(ret[0][2], z);
+        ret[1][1] = max(ret[1][1], y + 1);
+        ret[1][2] = max(ret[1][2], z + 1);
+    }
+    if (!all) return false;
+    ret[0][0] = __builtin_ctz(all);
+    ret[1][0] = 32 - __builtin_clz(all);
+    bbox[0][0] = block->pos[0] + ret[0][0];
+    bbox[0][1] = block->pos[1] + ret[0][1];
+    bbox[0][2] = block->pos[2] + ret[0][2];
+    bbox[1][0] = block->pos[0] + ret[1][0];
+    bbox[1][1] = block->pos[1] + ret[1][1];
+    bbox[1][2] = block->pos[2] + ret[1][2];
+    return true;
+}
+
+// Memory used by the voxels of a block data.
+static int block_data_mem(const block_data_t *data)
+{
+    if (data->voxels) return VOXELS_SIZE;
+    if (data->indices) return N * N * N + data->nb_colors * 4;
+    return 0;
+}
+
+static void block_data_free_voxels(block_data_t *data)
+{
+    MEM_ADD(-block_data_mem(data));
+    if (!data->voxels) STATS_ADD(nb_compressed, -1);
+    mempool_free(&g_voxels_pool, data->voxels);
+    mempool_free(&g_indices_pool, data->indices);
+    free(data->palette);
+    data->voxels = NULL;
+    data->indices = NULL;
+    data->palette = NULL;
+    data->nb_colors = 0;
+}
+
+static void intern_remove(block_data_t *data)
+{
+    intern_entry_t *entry;
+    pthread_mutex_lock(&g_intern_lock);
+    HASH_FIND(hh, g_intern_table, &data->hash, sizeof(data->hash), entry);
+    if (entry && entry->data == data) {
+        HASH_DEL(g_intern_table, entry);
+        free(entry);
+    }
+    pthread_mutex_unlock(&g_intern_lock);
+}
+
+static void block_data_release(block_data_t *data)
+{
+    if (ref_dec(&data->ref)) return;
+    if (data->pager) {
+        if (data->pager->free_page)
+            data->pager->free_page(data->pager, data->page);
+        mesh_pager_release(data->pager);
+    }
+    if (data->interned) intern_remove(data);
+    block_data_free_voxels(data);
+    STATS_ADD(nb_blocks, -1);
+    MEM_ADD(-sizeof(*data));
+    mempool_free(&g_datas_pool, data);
+}
+
+// Fill a full RGBA voxels array from a block data in any format.
+static void block_data_get_voxels(const block_data_t *data,
+                                  uint8_t (*voxels)[4])
+{
+    int i;
+    block_data_load(data);
+    if (data->voxels) {
+        memcpy(voxels, data->voxels, VOXELS_SIZE);
+        return;
+    }
+    for (i = 0; i < N * N * N; i++) {
+        memcpy(voxels[i], data->indices ? data->palette[data->indices[i]] :
+                                          data->color, 4);
+    }
+}
+
+// Make sure a block data uses a full RGBA voxels array.
+static void block_data_expand(block_data_t *data)
+{
+    uint8_t (*voxels)[4];
+    block_data_load(data);
+    if (data->voxels) return;
+    voxels = mempool_alloc(&g_voxels_pool);
+    block_data_get_voxels(data, voxels);
+    block_data_free_voxels(data);
+    data->voxels = voxels;
+    MEM_ADD(VOXELS_SIZE);
+}
+
+// Compute the palette of some RGBA voxels, and the palette index of each
+// voxel.  Return the number of colors, or zero if there are more than 256.
+static int voxels_get_palette(const uint8_t (*voxels)[4],
+                              uint32_t palette[256], uint8_t *indices)
+{
+    // Small open addressing hash table of the colors of the block.
+    struct { uint32_t color; int index; } table[512];
+    uint32_t color;
+    int i, j, nb = 0;
+
+    memset(table, 0, sizeof(table));
+    for (i = 0; i < N * N * N; i++) {
+        memcpy(&color, voxels[i], 4);
+        for (j = (color * 2654435761u) >> 23;; j = (j + 1) % 512) {
+            if (!table[j].index || table[j].color == color) break;
+        }
+        if (!table[j].index) {
+            if (nb == 256) return 0;
+            table[j].color = color;
+            table[j].index = ++nb; // Zero is used for empty slots.
+            palette[nb - 1] = color;
+        }
+        indices[i] = table[j].index - 1;
+    }
+    return nb;
+}
+
+// Set the value of a block data without voxels array from a palette.
+static void block_data_set_palette(block_data_t *data, int nb,
+                                   const uint32_t *palette,
+                                   uint8_t *indices)
+{
+    STATS_ADD(nb_compressed, 1);
+    if (nb == 1) {
+        memcpy(data->color, &palette[0], 4);
+        mempool_free(&g_indices_pool, indices);
+        return;
+    }
+    data->indices = indices;
+    data->palette = malloc(nb * 4);
+    memcpy(data->palette, palette, nb * 4);
+    data->nb_colors = nb;
+    MEM_ADD(block_data_mem(data));
+}
+
+// Convert a block data to the smallest format that can hold its voxels:
+// uniform if all the voxels have the same value, palette indexed if there
+// are no more than 256 different values.  This doesn't change the value
+// of the data, so we keep the same id.
+static void block_compress(block_t *block)
+{
+    block_data_t *data = block->data;
+    uint32_t palette[256];
+    uint8_t *indices;
+    int nb;
+
+    if (block_data_is_paged(data)) return;
+    if (!data->voxels || data->interned) return;
+    indices = mempool_alloc(&g_indices_pool);
+    nb = voxels_get_palette((const uint8_t (*)[4])data->voxels, palette,
+                            indices);
+    if (!nb) {
+        mempool_free(&g_indices_pool, indices);
+        return;
+    }
+
+    if (ref_get(&data->ref) == 1) {
+        block_data_free_voxels(data);
+    } else {
+        // The data could be read by other threads, so we don't change it
+        // in place.
+        data = block_data_alloc();
+        data->ref = 1;
+        data->id = block->data->id;
+        memcpy(data->mask, block->data->mask, sizeof(data->mask));
+        data->nb_voxels = block->data->nb_voxels;
+        STATS_ADD(nb_blocks, 1);
+        MEM_ADD(sizeof(*data));
+        block_data_release(block->data);
+        block->data = data;
+    }
+    block_data_set_palette(data, nb, palette, indices);
+}
+
+void mesh_pager_release(mesh_pager_t *pager)
+{
+    if (ref_dec(&pager->ref)) return;
+    pager->release(pager);
+}
+
+// Reorder some voxels given in the linear order into the blocks layout.
+static void voxels_from_linear(uint8_t (*voxels)[4])
+{
+    uint8_t (*tmp)[4];
+    int i, x, y, z;
+
+    tmp = mempool_alloc(&g_voxels_pool);
+    memcpy(tmp, voxels, VOXELS_SIZE);
+    for (i = 0; i < N * N * N; i++) {
+        DATA_POS(i, x, y, z);
+        memcpy(voxels[i], tmp[x + y * N + z * N * N], 4);
+    }
+    mempool_free(&g_voxels_pool, tmp);
+}
+
+// Load the voxels of a paged block data.  This doesn't change the value
+// of the data, so it can be called from any thread, even if the data is
+// shared.  The paged data is counted as compressed in the stats.
+static void block_data_load(const block_data_t *data_)
+{
+    block_data_t *data = (block_data_t*)data_;
+    pthread_mutex_t *lock;
+    mesh_pager_t *pager;
+    uint8_t (*voxels)[4];
+    uint32_t palette[256];
+    uint8_t *indices;
+    block_row_t mask;
+    int nb, x, y, z, nb_voxels;
+
+    block_data_touch(data);
+    if (!block_data_is_paged(data)) return;
+    lock = &g_page_locks[((uintptr_t)data / sizeof(*data)) %
+                          PAGE_LOCKS_COUNT];
+    pthread_mutex_lock(lock);
+    pager = data->pager;
+    if (!pager) { // Already loaded by an other thread.
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    voxels = mempool_alloc(&g_voxels_pool);
+    if (!pager->load(pager, data->page, (uint8_t*)voxels))
+        memset(voxels, 0, VOXELS_SIZE);
+    if (BLOCK_MORTON) voxels_from_linear(voxels);
+    // The paged out data already have their mask, so we recompute it in a
+    // way that never gives wrong values to the other threads.
+    nb_voxels = 0;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        mask = 0;
+        for (x = 0; x < N; x++) {
+            if (voxels[DATA_INDEX(x, y, z)][3])
+                mask |= (block_row_t)1 << x;
+        }
+        MASK_AT(data, y, z) = mask;
+        nb_voxels += __builtin_popcount(mask);
+    }
+    data->nb_voxels = nb_voxels;
+    indices = mempool_alloc(&g_indices_pool);
+    nb = voxels_get_palette((const uint8_t (*)[4])voxels, palette, indices);
+    STATS_ADD(nb_compressed, -1);
+    if (nb) {
+        mempool_free(&g_voxels_pool, voxels);
+        block_data_set_palette(data, nb, palette, indices);
+    } else {
+        mempool_free(&g_indices_pool, indices);
+        data->voxels = voxels;
+        MEM_ADD(VOXELS_SIZE);
+    }
+    __atomic_store_n(&data->pager, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(lock);
+    if (pager->free_page) pager->free_page(pager, data->page);
+    mesh_pager_release(pager);
+}
+
+// Hash of a block data content.  Since block_compress always gives the
+// same format for the same voxels, we can directly hash the stored values.
+static uint32_t block_data_hash(const block_data_t *data)
+{
+    uint32_t hash;
+    if (data->voxels) return XXH32(data->voxels, VOXELS_SIZE, 0);
+    if (data->indices) {
+        hash = XXH32(data->palette, data->nb_colors * 4, 1);
+        return XXH32(data->indices, N * N * N, hash);
+    }
+    return XXH32(data->color, 4, 2);
+}
+
+static bool block_data_equal(const block_data_t *a, const block_data_t *b)
+{
+    if (!a->voxels != !b->voxels || !a->indices != !b->indices)
+        return false;
+    if (a->voxels) return memcmp(a->voxels, b->voxels, VOXELS_SIZE) == 0;
+    if (a->indices) {
+        return a->nb_colors == b->nb_colors &&
+               memcmp(a->palette, b->palette, a->nb_colors * 4) == 0 &&
+               memcmp(a->indices, b->indices, N * N * N) == 0;
+    }
+    return memcmp(a->color, b->color, 4) == 0;
+}
+
+// Replace the data of a block by an identical one from the intern table
+// if there is one, otherwise add the data to the table.  Should be called
+// after block_compress.
+static void block_intern(block_t *block)
+{
+    block_data_t *data = block->data, *other = NULL;
+    intern_entry_t *entry;
+    uint32_t hash;
+
+    if (!g_dedup_enabled || data->interned || data->id == 0) return;
+    if (block_data_is_paged(data)) return;
+    hash = block_data_hash(data);
+    pthread_mutex_lock(&g_intern_lock);
+    HASH_FIND(hh, g_intern_table, &hash, sizeof(hash), entry);
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry));
+        entry->hash = hash;
+        entry->data = data;
+        HASH_ADD(hh, g_intern_table, hash, sizeof(hash), entry);
+        data->hash = hash;
+        data->interned = true;
+    } else if (ref_inc_not_zero(&entry->data->ref)) {
+        other = entry->data;
+    }
+    pthread_mutex_unlock(&g_intern_lock);
+    if (!other) return;
+    // The interned data might have been paged out since.
+    block_data_load(other);
+    if (!block_data_equal(other, data)) {
+        block_data_release(other);
+        return;
+    }
+    STATS_ADD(nb_dedup, 1);
+    STATS_ADD(dedup_mem, sizeof(*data) + block_data_mem(data));
+    block_data_release(data);
+    block->data = other;
+}
+
+static block_t *block_new(const int pos[3])
+{
+    block_t *block = mempool_alloc(&g_blocks_pool);
+    memset(block, 0, sizeof(*block));
+    block->ref = 1;
+    memcpy(block->pos, pos, sizeof(block->pos));
+    block->data = get_empty_data();
+    ref_inc(&block->data->ref);
+    block->id = new_uid();
+    return block;
+}
+
+static void block_release(block_t *block)
+{
+    if (ref_dec(&block->ref)) return;
+    block_data_release(block->data);
+    mempool_free(&g_blocks_pool, block);
+}
+
+static void table_delete(block_table_t *table)
+{
+    int i;
+    for (i = 0; i < table_nb_pages(table->entries_capacity); i++) {
+        entries_page_release(table->entries[i],
+                             table_page_len(table->entries_capacity));
+    }
+    free(table->entries);
+    table_free_slots(table);
+    free(table->journal);
+    free(table->neighbors);
+    for (i = 0; i < CELL_LEVELS; i++) free(table->levels[i].cells);
+    free(table);
+}
+
+static void table_release(block_table_t *table)
+{
+    if (ref_dec(&table->ref)) return;
+    table_delete(table);
+    STATS_ADD(nb_meshes, -1);
+}
+
+static block_t *block_copy(const block_t *other)
+{
+    block_t *block = mempool_alloc(&g_blocks_pool);
+    *block = *other;
+    block->ref = 1;
+    ref_inc(&block->data->ref);
+    block->id = new_uid();
+    return block;
+}
+
+static void block_set_data(block_t *block, block_data_t *data)
+{
+    block_data_release(block->data);
+    block->data = data;
+    ref_inc(&data->ref);
+}
+
+// Copy the data if there are any other blocks having reference to it,
+// and make sure the voxels array is allocated.  If session is set, the data
+// that already got a new id since the start of the session keep it.
+static void block_prepare_write(block_t *block, uint64_t session)
+{
+    block_data_t *data;
+    if (ref_get(&block->data->ref) == 1 && !block->data->interned) {
+        block_data_expand(block->data);
+        if (!session || block->data->id < session)
+            block->data->id = new_uid();
+        return;
+    }
+    counter_add(COUNTER_BLOCK_COPIES, 1);
+    data = block_data_alloc();
+    data->voxels = mempool_alloc(&g_voxels_pool);
+    block_data_get_voxels(block->data, data->voxels);
+    memcpy(data->mask, block->data->mask, sizeof(data->mask));
+    data->nb_voxels = block->data->nb_voxels;
+    data->ref = 1;
+    block_data_release(block->data);
+    block->data = data;
+    block->data->id = new_uid();
+
+    STATS_ADD(nb_blocks, 1);
+    MEM_ADD(sizeof(*block->data) + VOXELS_SIZE);
+}
+
+static void block_get_at(const block_t *block, const int pos[3],
+                         uint8_t out[4])
+{
+    int x, y, z;
+    if (!block) {
+        memset(out, 0, 4);
+        return;
+    }
+    x = pos[0] - block->pos[0];
+    y = pos[1] - block->pos[1];
+    z = pos[2] - block->pos[2];
+    assert(x >= 0 && x < N);
+    assert(y >= 0 && y < N);
+    assert(z >= 0 && z < N);
+    block_data_load(block->data);
+    memcpy(out, BLOCK_AT(block, x, y, z), 4);
+}
+
+/*
+ * Function: mesh_get_bbox
+ *
+ * Get the bounding box of a mesh.
+ *
+ * Inputs:
+ *   mesh   - The mesh
+ *   exact  - If true, compute the exact bounding box.  If false, returns
+ *            an approximation that might be slightly bigger than the
+ *            actual box, but faster to compute.
+ *
+ * Outputs:
+ *   bbox  - The bounding box as the bottom left and top right corner of
+ *           the mesh.  If the mesh is empty, this will contain all zero.
+ *
+ * Returns:
+ *   true if the mesh is not empty.
+ */
+// Same as block_get_bbox, but keep the result in the block data, so that we
+// only compute it again for the modified blocks.  Must be called with
+// g_table_cache_lock held.
+static bool block_get_bbox_cached(const block_t *block, int bbox[2][3])
+{
+    block_data_t *data = block->data;
+    int i, b[2][3];
+
+    if (data->id == 0) return false; // Static empty data.
+    if (data->bbox_id != data->id) {
+        memset(data->bbox, 0, sizeof(data->bbox));
+        if (block_get_bbox(block, b)) {
+            for (i = 0; i < 3; i++) {
+                data->bbox[0][i] = b[0][i] - block->pos[i];
+                data->bbox[1][i] = b[1][i] - block->pos[i];
+            }
+        }
+        data->bbox_id = data->id;
+    }
+    if (data->bbox[0][0] >= data->bbox[1][0]) return false;
+    for (i = 0; i < 3; i++) {
+        bbox[0][i] = block->pos[i] + data->bbox[0][i];
+        bbox[1][i] = block->pos[i] + data->bbox[1][i];
+    }
+    return true;
+}
+
+bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact)
+{
+    block_t *block;
+    int i;
+    // Only the cached values of the table are modified.
+    block_table_t *table = (block_table_t*)mesh->blocks;
+    uint64_t journal_version;
+    int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                     {INT_MIN, INT_MIN, INT_MIN}};
+    int b[2][3];
+    bool empty = false;
+
+    if (!exact) {
+        TABLE_FOREACH(mesh->blocks, block, i) {
+            if (block_is_empty(block)) continue;
+            ret[0][0] = min(ret[0][0], block->pos[0]);
+            ret[0][1] = min(ret[0][1], block->pos[1]);
+            ret[0][2] = min(ret[0][2], block->pos[2]);
+            ret[1][0] = max(ret[1][0], block->pos[0] + N);
+            ret[1][1] = max(ret[1][1], block->pos[1] + N);
+            ret[1][2] = max(ret[1][2], block->pos[2] + N);
+        }
+    } else {
+        journal_version = table_get_journal_version(table);
+        pthread_mutex_lock(&g_table_cache_lock);
+        if (    table->bbox_version != table->version ||
+                table->bbox_journal_version != journal_version) {
+            TABLE_FOREACH(table, block, i) {
+                if (!block_get_bbox_cached(block, b)) continue;
+                ret[0][0] = min(ret[0][0], b[0][0]);
+                ret[0][1] = min(ret[0][1], b[0][1]);
+                ret[0][2] = min(ret[0][2], b[0][2]);
+                ret[1][0] = max(ret[1][0], b[1][0]);
+                ret[1][1] = max(ret[1][1], b[1][1]);
+                ret[1][2] = max(ret[1][2], b[1][2]);
+            }
+            memcpy(table->bbox, ret, sizeof(ret));
+            table->bbox_version = table->version;
+            table->bbox_journal_version = journal_version;
+        }
+        memcpy(ret, table->bbox, sizeof(ret));
+        pthread_mutex_unlock(&g_table_cache_lock);
+    }
+    empty = ret[0][0] >= ret[1][0];
+    if (empty) memset(ret, 0, sizeof(ret));
+    memcpy(bbox, ret, sizeof(ret));
+    return !empty;
+}
+
+// Share the pages of a table into a new table.  The blocks keep the same
+// indices, holes included, so that the iterators of the mesh are still
+// valid.  The accessors are invalidated by the new version.
+static block_table_t *table_copy(const block_table_t *table)
+{
+    block_table_t *ret;
+    int i, nb;
+
+    ret = table_new();
+    ret->capacity = table->capacity;
+    ret->count = table->count;
+    ret->used = table->used;
+    nb = table_nb_pages(table->capacity);
+    ret->slots = malloc(max(nb, 1) * sizeof(*ret->slots));
+    for (i = 0; i < nb; i++) {
+        ret->slots[i] = table->slots[i];
+        ref_inc(&ret->slots[i]->ref);
+    }
+    ret->nb_entries = table->nb_entries;
+    ret->entries_capacity = table->entries_capacity;
+    nb = table_nb_pages(table->entries_capacity);
+    ret->entries = malloc(max(nb, 1) * sizeof(*ret->entries));
+    for (i = 0; i < nb; i++) {
+        ret->entries[i] = table->entries[i];
+        ref_inc(&ret->entries[i]->ref);
+    }
+    table_copy_index(table, ret);
+    table_copy_journal(table, ret);
+    return ret;
+}
+
+static void mesh_prepare_write(mesh_t *mesh)
+{
+    block_table_t *table;
+
+    assert(ref_get(&mesh->blocks->ref) > 0);
+    // During a write session, only change the key once, unless it has
+    // been set to an other value, or a copy of the mesh could have it.
+    if (!mesh->write_depth || mesh->key != mesh->write_key ||
+            ref_get(&mesh->blocks->ref) > 1) {
+        mesh->key = new_uid();
+        mesh->write_key = mesh->key;
+    }
+    if (ref_get(&mesh->blocks->ref) == 1)
+        return;
+    counter_add(COUNTER_MESH_TABLE_COPIES, 1);
+    table = mesh->blocks;
+    mesh->blocks = table_copy(table);
+    STATS_ADD(nb_meshes, 1);
+    // Only release the old table after we are done with it, since the
+    // other references could be dropped in the meantime.
+    table_release(table);
+}
+
+// Remove a block if it is empty, or else compress it, unless fast is set.
+static void block_cleanup(block_table_t *table, block_t *block, bool fast)
+{
+    const block_data_t *data = block->data;
+
+    if (block_is_empty(block)) {
+        table_remove(table, block);
+        return;
+    }
+    if (fast) return;
+    // Don't copy the shared blocks if there is nothing to do.
+    if (data->interned || block_data_is_paged(data)) return;
+    if (!data->voxels && !g_dedup_enabled) return;
+    block = table_own_block(table, block);
+    block_compress(block);
+    block_intern(block);
+}
+
+void mesh_remove_empty_blocks(mesh_t *mesh, bool fast)
+{
+    block_table_t *table;
+    block_t *block;
+    uint64_t key = mesh->key;
+    int i, nb = -1, (*blocks_pos)[3];
+
+    mesh_prepare_write(mesh);
+    table = mesh->blocks;
+    // If possible only check the blocks modified since the last call.
+    if (table->clean_version && (fast || table->clean_compressed))
+        nb = mesh_get_changes(mesh, table->clean_version, &blocks_pos);
+    if (nb >= 0) {
+        for (i = 0; i < nb; i++) {
+            block = table_find(table, blocks_pos[i]);
+            if (block) block_cleanup(table, block, fast);
+        }
+        free(blocks_pos);
+    } else {
+        TABLE_FOREACH(table, block, i)
+            block_cleanup(table, block, fast);
+    }
+    table->clean_version = mesh_get_version(mesh);
+    table->clean_compressed = !fast;
+    // Empty blocks shouldn't change the key of the mesh.
+    mesh->key = key;
+}
+
+bool mesh_is_empty(const mesh_t *mesh)
+{
+    return mesh->blocks->count == 0;
+}
+
+mesh_t *mesh_new(void)
+{
+    mesh_t *mesh;
+    mesh = calloc(1, sizeof(*mesh));
+    mesh->blocks = table_new();
+    mesh->key = 1; // Empty mesh key.
+    STATS_ADD(nb_meshes, 1);
+    return mesh;
+}
+
+void mesh_begin_write(mesh_t *mesh)
+{
+    if (mesh->write_depth++) return;
+    mesh->write_session = new_uid();
+    mesh->write_key = 0;
+    mesh->write_version = mesh_get_version(mesh);
+}
+
+// Give a new id to a block data modified during the session.
+static void session_update_block(mesh_t *mesh, block_t *block)
+{
+    block_data_t *data = block->data;
+    if (data->id < mesh->write_session || data->interned) return;
+    if (ref_get(&data->ref) != 1) return;
+    if (table_block_is_shared(mesh->blocks, block)) return;
+    data->id = new_uid();
+}
+
+void mesh_end_write(mesh_t *mesh)
+{
+    int i, nb, (*blocks_pos)[3];
+    block_t *block;
+
+    assert(mesh->write_depth > 0);
+    if (--mesh->write_depth) return;
+    // The values read during the session might have been cached with the
+    // ids of the data we kept modifying, so change them again.
+    nb = mesh_get_changes(mesh, mesh->write_version, &blocks_pos);
+    if (nb >= 0) {
+        for (i = 0; i < nb; i++) {
+            block = table_find(mesh->blocks, blocks_pos[i]);
+            if (block) session_update_block(mesh, block);
+        }
+        free(blocks_pos);
+    } else {
+        TABLE_FOREACH(mesh->blocks, block, i)
+            session_update_block(mesh, block);
+    }
+    if (mesh->key == mesh->write_key) mesh->key = new_uid();
+    mesh->write_session = 0;
+}
+
+mesh_iterator_t mesh_get_iterator(const mesh_t *mesh, int flags)
+{
+    return (mesh_iterator_t){
+        .mesh = mesh,
+        .flags = flags,
+    };
+}
+
+mesh_iterator_t mesh_get_union_iterator(
+        const mesh_t *m1, const mesh_t *m2, int flags)
+{
+    return (mesh_iterator_t){
+        .mesh = m1,
+        .mesh2 = m2,
+        .flags = flags,
+    };
+}
+
+mesh_iterator_t mesh_get_box_iterator(const mesh_t *mesh,
+                                      const float box[4][4], int flags)
+{
+    int mesh_bbox[2][3];
+    mesh_iterator_t iter = {
+        .mesh = mesh,
+        .flags = MESH_ITER_BOX | MESH_ITER_VOXELS | flags,
+    };
+    memcpy(iter.box, box, sizeof(iter.box));
+    box_get_bbox(iter.box, iter.bbox);
+    if (box_is_oriented(box)) iter.flags |= MESH_ITER_ORIENTED_BOX;
+
+    if (flags & MESH_ITER_SKIP_EMPTY) {
+        mesh_get_bbox(mesh, mesh_bbox, false);
+        bbox_intersection(mesh_bbox, iter.bbox, iter.bbox);
+    }
+
+    return iter;
+}
+
+mesh_accessor_t mesh_get_accessor(const mesh_t *mesh)
+{
+    return (mesh_accessor_t){0};
+}
+
+
+void mesh_clear(mesh_t *mesh)
+{
+    assert(mesh);
+    mesh_prepare_write(mesh);
+    table_delete(mesh->blocks);
+    mesh->blocks = table_new();
+    mesh->key = 1; // Empty mesh key.
+}
+
+void mesh_delete(mesh_t *mesh)
+{
+    int i;
+    if (!mesh) return;
+    if (mesh->blocks) table_release(mesh->blocks);
+    for (i = 0; i < mesh->delta_size; i++) {
+        if (mesh->delta[i].data) block_data_release(mesh->delta[i].data);
+    }
+    free(mesh->delta);
+    free(mesh);
+}
+
+mesh_t *mesh_copy(const mesh_t *other)
+{
+    mesh_t *mesh = calloc(1, sizeof(*mesh));
+    assert(other->blocks);
+    mesh->blocks = other->blocks;
+    mesh->key = other->key;
+    ref_inc(&mesh->blocks->ref);
+    // The copy keeps the current version.
+    table_see_journal(mesh->blocks);
+    return mesh;
+}
+
+void mesh_set(mesh_t *mesh, const mesh_t *other)
+{
+    assert(mesh && other);
+    if (mesh->blocks == other->blocks) return; // Already the same.
+    ref_inc(&other->blocks->ref);
+    table_see_journal(other->blocks);
+    table_release(mesh->blocks);
+    mesh->blocks = other->blocks;
+    mesh->key = other->key;
+}
+
+static uint64_t get_block_id(const block_t *block)
+{
+    return block ? __atomic_load_n(&block->id, __ATOMIC_RELAXED) : 1;
+}
+
+// Index of a block position in the accessor cache: we use the parity of
+// the block coordinates, so that any 2x2x2 group of blocks can be cached
+// at the same time.  This is enough for all the stencils of one voxel
+// radius.
+static inline int accessor_cache_index(const int bpos[3])
+{
+    return (((bpos[0] / N) & 1) << 0) |
+           (((bpos[1] / N) & 1) << 1) |
+           (((bpos[2] / N) & 1) << 2);
+}
+
+// The cached blocks are only valid as long as no block has been added or
+// removed from the table, so we use the table version to check them.  That
+// way we never dereference a block that could have been deleted.
+static void accessor_cache_set(const mesh_t *mesh, mesh_accessor_t *it,
+                               const int bpos[3], block_t *block)
+{
+    typeof(it->cache[0]) *c = &it->cache[accessor_cache_index(bpos)];
+    c->block = block;
+    c->version = mesh->blocks->version;
+    vec3_copy(bpos, c->pos);
+}
+
+static block_t *mesh_get_block_at(const mesh_t *mesh, const int pos[3],
+                                  mesh_accessor_t *it)
+{
+    block_t *block;
+    int p[3] = {};
+    typeof(it->cache[0]) *c;
+
+    p[0] = pos[0] & ~(int)(N - 1);
+    p[1] = pos[1] & ~(int)(N - 1);
+    p[2] = pos[2] & ~(int)(N - 1);
+    if (!it) {
+        counter_add(COUNTER_MESH_LOOKUPS, 1);
+        return table_find(mesh->blocks, p);
+    }
+
+    if (    it->block_id && it->block_id == get_block_id(it->block) &&
+            vec3_equal(it->block_pos, p)) {
+        counter_add(COUNTER_MESH_ACCESSOR_HITS, 1);
+        return it->block;
+    }
+    c = &it->cache[accessor_cache_index(p)];
+    if (c->version == mesh->blocks->version && vec3_equal(c->pos, p)) {
+        counter_add(COUNTER_MESH_ACCESSOR_HITS, 1);
+        block = c->block;
+    } else {
+        counter_add(COUNTER_MESH_LOOKUPS, 1);
+        block = table_find(mesh->blocks, p);
+        accessor_cache_set(mesh, it, p, block);
+    }
+    it->block = block;
+    it->block_id = get_block_id(block);
+    vec3_copy(p, it->block_pos);
+    return block;
+}
+
+static block_t *mesh_add_block(mesh_t *mesh, const int pos[3])
+{
+    block_t *block;
     assert(pos[0] % BLOCK_SIZE == 0);
     assert(pos[1] % BLOCK_SIZE == 0);
     assert(pos[2] % BLOCK_SIZE == 0);
     assert(!mesh_get_block_at(mesh, pos, NULL));
     mesh_prepare_write(mesh);
-    block = block_new(pos);
-    HASH_ADD(hh, mesh->blocks, pos, sizeof(block->pos), block);
-    return block;
+    block = block_new(pos);
+    table_add(mesh->blocks, block);
+    table_log(mesh->blocks, pos);
+    return block;
+}
+
+void mesh_get_at(const mesh_t *mesh, mesh_iterator_t *it,
+                 const int pos[3], uint8_t out[4])
+{
+    block_t *block;
+    int p[3];
+
+    if (it && it->block_id && it->block_id == get_block_id(it->block)) {
+        p[0] = pos[0] - it->block_pos[0];
+        p[1] = pos[1] - it->block_pos[1];
+        p[2] = pos[2] - it->block_pos[2];
+        if (    p[0] >= 0 && p[0] < N &&
+                p[1] >= 0 && p[1] < N &&
+                p[2] >= 0 && p[2] < N) {
+            if (!it->block) {
+                memset(out, 0, 4);
+                return;
+            }
+            block_data_load(it->block->data);
+            memcpy(out, BLOCK_AT(it->block, p[0], p[1], p[2]), 4);
+            return;
+        }
+    }
+
+    block = mesh_get_block_at(mesh, pos, it);
+    return block_get_at(block, pos, out);
+}
+
+void mesh_set_at(mesh_t *mesh, mesh_iterator_t *iter,
+                 const int pos[3], const uint8_t v[4])
+{
+    int p[3] = {pos[0] & ~(int)(N - 1),
+                pos[1] & ~(int)(N - 1),
+                pos[2] & ~(int)(N - 1)};
+    block_row_t *mask, bit;
+    mesh_prepare_write(mesh);
+
+    block_t *block = mesh_get_block_at(mesh, p, iter);
+
+    if (!block) {
+        block = mesh_add_block(mesh, p);
+        if (iter) {
+            iter->block = block;
+            iter->block_id = get_block_id(block);
+            vec3_copy(p, iter->block_pos);
+            accessor_cache_set(mesh, iter, p, block);
+        }
+    } else if (table_block_is_shared(mesh->blocks, block)) {
+        block = table_own_block(mesh->blocks, block);
+        if (iter) {
+            iter->block = block;
+            iter->block_id = get_block_id(block);
+            accessor_cache_set(mesh, iter, p, block);
+        }
+    }
+
+    block_prepare_write(block, mesh->write_session);
+    table_log(mesh->blocks, block->pos);
+    p[0] = pos[0] - block->pos[0];
+    p[1] = pos[1] - block->pos[1];
+    p[2] = pos[2] - block->pos[2];
+    assert(p[0] >= 0 && p[0] < N);
+    assert(p[1] >= 0 && p[1] < N);
+    assert(p[2] >= 0 && p[2] < N);
+    memcpy(BLOCK_AT(block, p[0], p[1], p[2]), v, 4);
+    mask = &MASK_AT(block->data, p[1], p[2]);
+    bit = (block_row_t)1 << p[0];
+    if (v[3] && !(*mask & bit)) block->data->nb_voxels++;
+    if (!v[3] && (*mask & bit)) block->data->nb_voxels--;
+    if (v[3])
+        *mask |= bit;
+    else
+        *mask &= ~bit;
+}
+
+void mesh_clear_block(mesh_t *mesh, mesh_iterator_t *it, const int pos[3])
+{
+    block_t *block;
+    mesh_prepare_write(mesh);
+    block = mesh_get_block_at(mesh, pos, it);
+    if (!block) return;
+    table_log(mesh->blocks, block->pos);
+    if (it) {
+        it->block = NULL;
+        it->cache[accessor_cache_index(block->pos)].version = 0;
+    }
+    table_remove(mesh->blocks, block);
+}
+
+
+void mesh_fill_block(mesh_t *mesh, const int pos[3], const uint8_t v[4])
+{
+    block_t *block;
+    block_data_t *data;
+
+    if (!v[3]) {
+        mesh_clear_block(mesh, NULL, pos);
+        return;
+    }
+    mesh_prepare_write(mesh);
+    block = mesh_get_block_at(mesh, pos, NULL);
+    if (!block) block = mesh_add_block(mesh, pos);
+    block = table_own_block(mesh->blocks, block);
+    data = block_data_alloc();
+    data->ref = 1;
+    data->id = new_uid();
+    memcpy(data->color, v, 4);
+    memset(data->mask, 0xff, sizeof(data->mask));
+    data->nb_voxels = N * N * N;
+    STATS_ADD(nb_blocks, 1);
+    MEM_ADD(sizeof(*data));
+    STATS_ADD(nb_compressed, 1);
+    block_data_release(block->data);
+    block->data = data;
+    table_log(mesh->blocks, pos);
+    block_intern(block);
+}
+
+// Iterate the blocks of the bounding box of the iterator box, skipping
+// the ones that don't intersect the box itself.
+static bool mesh_iter_next_block_box(mesh_iterator_t *it)
+{
+    int i, size;
+    const mesh_t *mesh = it->mesh;
+    if (!it->block_id) {
+        it->block_pos[0] = it->bbox[0][0] & ~(int)(N - 1);
+        it->block_pos[1] = it->bbox[0][1] & ~(int)(N - 1);
+        it->block_pos[2] = it->bbox[0][2] & ~(int)(N - 1);
+        goto check;
+    }
+
+next:
+    for (i = 0; i < 3; i++) {
+        it->block_pos[i] += N;
+        if (it->block_pos[i] <= it->bbox[1][i]) break;
+        it->block_pos[i] = it->bbox[0][i] & ~(int)(N - 1);
+    }
+    if (i == 3) return false;
+
+check:
+    if (    (it->flags & MESH_ITER_ORIENTED_BOX) &&
+            !box_intersect_block(it->box, it->block_pos))
+        goto next;
+    if (it->flags & MESH_ITER_SKIP_EMPTY) {
+        // Jump to the end of the empty region along x.
+        size = table_get_empty_size(mesh->blocks, it->block_pos);
+        if (size) {
+            it->block_pos[0] = (it->block_pos[0] & ~(size - 1)) + size - N;
+            goto next;
+        }
+    }
+    it->block = table_find(mesh->blocks, it->block_pos);
+    it->block_id = get_block_id(it->block);
+    vec3_copy(it->block_pos, it->pos);
+    return true;
+}
+
+// Move an iterator to the next block of a table blocks array.
+static bool mesh_iter_next_table_block(mesh_iterator_t *it,
+                                       const block_table_t *table)
+{
+    const block_entry_t *entry;
+    while (it->block_index < table->nb_entries) {
+        entry = table_entry(table, it->block_index++);
+        if (!entry->block) continue;
+        it->block = entry->block;
+        it->block_id = get_block_id(it->block);
+        vec3_copy(entry->pos, it->block_pos);
+        vec3_copy(entry->pos, it->pos);
+        return true;
+    }
+    return false;
+}
+
+static bool mesh_iter_next_block_union(mesh_iterator_t *it)
+{
+    if (!(it->flags & MESH_ITER_MESH2)) {
+        if (mesh_iter_next_table_block(it, it->mesh->blocks)) return true;
+        it->flags |= MESH_ITER_MESH2;
+        it->block_index = 0;
+    }
+    while (mesh_iter_next_table_block(it, it->mesh2->blocks)) {
+        // Discard blocks that we already did from the first mesh.
+        if (!mesh_get_block_at(it->mesh, it->block_pos, NULL)) return true;
+    }
+    return false;
+}
+
+/*
+ * Test if a missing block position is yielded as the neighbor of the block
+ * in the given direction.  Since a position can be the neighbor of several
+ * blocks, we only yield it for the first non empty block in the directions
+ * order.
+ */
+static bool is_first_neighbor(const block_table_t *table, const int pos[3],
+                              int dir)
+{
+    int i, p[3];
+    const block_t *block;
+    for (i = 0; i < (dir ^ 1); i++) {
+        p[0] = pos[0] + NEIGHBORS_DIRS[i][0] * N;
+        p[1] = pos[1] + NEIGHBORS_DIRS[i][1] * N;
+        p[2] = pos[2] + NEIGHBORS_DIRS[i][2] * N;
+        block = table_find(table, p);
+        if (block && !block_is_empty(block)) return false;
+    }
+    return true;
+}
+
+/*
+ * Get the positions next to the non empty blocks of a table that don't
+ * have any block.  The list is cached in the table until a block is added,
+ * removed or modified, so that we don't compute it again each time we
+ * render the same mesh.  Can be called from any thread.
+ */
+static int table_get_neighbors(const block_table_t *table_,
+                               const int (**ret)[3])
+{
+    // Only the cache is modified.
+    block_table_t *table = (block_table_t*)table_;
+    const block_t *block;
+    uint64_t journal_version = table_get_journal_version(table);
+    int i, j, nb, allocated = 0, p[3];
+
+    pthread_mutex_lock(&g_table_cache_lock);
+    if (    table->neighbors &&
+            table->neighbors_version == table->version &&
+            table->neighbors_journal_version == journal_version)
+        goto end;
+
+    free(table->neighbors);
+    table->neighbors = NULL;
+    nb = 0;
+    TABLE_FOREACH(table, block, j) {
+        if (block_is_empty(block)) continue;
+        for (i = 0; i < 6; i++) {
+            p[0] = block->pos[0] + NEIGHBORS_DIRS[i][0] * N;
+            p[1] = block->pos[1] + NEIGHBORS_DIRS[i][1] * N;
+            p[2] = block->pos[2] + NEIGHBORS_DIRS[i][2] * N;
+            if (table_find(table, p)) continue;
+            if (!is_first_neighbor(table, p, i)) continue;
+            if (nb == allocated) {
+                allocated = max(64, allocated * 2);
+                table->neighbors = realloc(table->neighbors,
+                        allocated * sizeof(*table->neighbors));
+            }
+            memcpy(table->neighbors[nb++], p, sizeof(p));
+        }
+    }
+    if (!table->neighbors) table->neighbors = malloc(sizeof(int[3]));
+    table->nb_neighbors = nb;
+    table->neighbors_version = table->version;
+    table->neighbors_journal_version = journal_version;
+
+end:
+    *ret = (const int (*)[3])table->neighbors;
+    nb = table->nb_neighbors;
+    pthread_mutex_unlock(&g_table_cache_lock);
+    return nb;
+}
+
+// Iterate the positions next to the non empty blocks of the mesh that
+// don't have any block.  We don't add those blocks into the mesh, so
+// that iterating a mesh never changes it.
+static bool mesh_iter_next_neighbor(mesh_iterator_t *it)
+{
+    const int (*neighbors)[3];
+    int nb;
+
+    if (!(it->flags & MESH_ITER_NEIGHBORS)) {
+        it->flags |= MESH_ITER_NEIGHBORS;
+        it->neighbor_index = 0;
+    }
+    // We get the list again each time in case the mesh got modified.
+    nb = table_get_neighbors(it->mesh->blocks, &neighbors);
+    if (it->neighbor_index >= nb) return false;
+    it->block = NULL;
+    it->block_id = get_block_id(NULL);
+    vec3_copy(neighbors[it->neighbor_index], it->block_pos);
+    vec3_copy(neighbors[it->neighbor_index], it->pos);
+    it->neighbor_index++;
+    return true;
+}
+
+static bool mesh_iter_next_block(mesh_iterator_t *it)
+{
+    const mesh_t *mesh;
+    // Note: we don't go through mesh_get_block_at, since the accessor
+    // cache could contain blocks of the other mesh of an union iterator.
+    if (it->block_id && it->block_id != get_block_id(it->block)) {
+        mesh = (it->flags & MESH_ITER_MESH2) ? it->mesh2 : it->mesh;
+        it->block = table_find(mesh->blocks, it->block_pos);
+        it->block_id = get_block_id(it->block);
+    }
+
+    if (it->flags & MESH_ITER_BOX) return mesh_iter_next_block_box(it);
+    if (it->flags & MESH_ITER_NEIGHBORS) return mesh_iter_next_neighbor(it);
+    if (it->mesh2) {
+        if (mesh_iter_next_block_union(it)) return true;
+        goto neighbors;
+    }
+
+    if (!mesh_iter_next_table_block(it, it->mesh->blocks)) goto neighbors;
+    return true;
+
+neighbors:
+    if (!(it->flags & MESH_ITER_INCLUDES_NEIGHBORS)) return false;
+    return mesh_iter_next_neighbor(it);
+}
+
+int mesh_iter(mesh_iterator_t *it, int pos[3])
+{
+    int i;
+    if (!it->block_id) { // First call.
+        if (!mesh_iter_next_block(it)) return 0;
+        goto end;
+    }
+    if (it->flags & MESH_ITER_BLOCKS) goto next_block;
+
+    for (i = 0; i < 3; i++) {
+        if (++it->pos[i] < it->block_pos[i] + N) break;
+        it->pos[i] = it->block_pos[i];
+    }
+    if (i < 3) goto end;
+
+next_block:
+    if (!mesh_iter_next_block(it)) return 0;
+
+end:
+    if (pos) vec3_copy(it->pos, pos);
+    return 1;
+}
+
+int mesh_get_blocks_array_size(const mesh_t *mesh)
+{
+    return mesh->blocks->nb_entries;
+}
+
+bool mesh_get_block_pos_by_index(const mesh_t *mesh, int index, int pos[3])
+{
+    const block_entry_t *entry;
+    assert(index >= 0 && index < mesh->blocks->nb_entries);
+    entry = table_entry(mesh->blocks, index);
+    if (!entry->block) return false;
+    vec3_copy(entry->pos, pos);
+    return true;
+}
+
+uint64_t mesh_get_key(const mesh_t *mesh)
+{
+    return mesh ? mesh->key : 0;
+}
+
+void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
+                          const int bpos[3], uint64_t *id)
+{
+    block_t *block = NULL;
+    if (    iter &&
+            iter->block_id &&
+            iter->block_id == get_block_id(iter->block) &&
+            memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
+        block = iter->block;
+    } else {
+        block = table_find(mesh->blocks, bpos);
+    }
+    if (!block) {
+        if (id) *id = 0;
+        return NULL;
+    }
+    block_data_touch(block->data);
+    if (id) *id = block->data->id;
+    if (block_data_is_paged(block->data)) return NULL;
+    return block->data->voxels;
+}
+
+void mesh_get_block_alpha_range(const mesh_t *mesh, mesh_accessor_t *iter,
+                                const int bpos[3], uint8_t range[2])
+{
+    block_t *block = NULL;
+    const block_data_t *data;
+    int i;
+
+    if (    iter &&
+            iter->block_id &&
+            iter->block_id == get_block_id(iter->block) &&
+            memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
+        block = iter->block;
+    } else {
+        block = table_find(mesh->blocks, bpos);
+    }
+    range[0] = 0;
+    range[1] = 0;
+    if (!block) return;
+    data = block->data;
+    if (block_data_is_paged(data)) {
+        range[1] = 255;
+        return;
+    }
+    if (data->nb_voxels == 0) return;
+    if (data->voxels) {
+        range[0] = data->nb_voxels == N * N * N ? 1 : 0;
+        range[1] = 255;
+    } else if (data->indices) {
+        range[0] = 255;
+        for (i = 0; i < data->nb_colors; i++) {
+            range[0] = min(range[0], data->palette[i][3]);
+            range[1] = max(range[1], data->palette[i][3]);
+        }
+    } else {
+        range[0] = range[1] = data->color[3];
+    }
+}
+
+uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *iter,
+                          const int pos[3])
+{
+    uint8_t v[4];
+    mesh_get_at(mesh, iter, pos, v);
+    return v[3];
+}
+
+void mesh_copy_block(const mesh_t *src, const int src_pos[3],
+                     mesh_t *dst, const int dst_pos[3])
+{
+    block_t *b1, *b2;
+    mesh_prepare_write(dst);
+    b1 = mesh_get_block_at(src, src_pos, NULL);
+    b2 = mesh_get_block_at(dst, dst_pos, NULL);
+    if (!b1) {
+        if (b2) {
+            table_log(dst->blocks, dst_pos);
+            table_remove(dst->blocks, b2);
+        }
+        return;
+    }
+    if (!b2) b2 = mesh_add_block(dst, dst_pos);
+    b2 = table_own_block(dst->blocks, b2);
+    block_set_data(b2, b1->data);
+    table_log(dst->blocks, dst_pos);
+}
+
+void mesh_set_block_paged(mesh_t *mesh, const int pos[3],
+                          mesh_pager_t *pager, int page)
+{
+    block_t *block;
+    block_data_t *data;
+
+    assert(((pos[0] | pos[1] | pos[2]) & (N - 1)) == 0);
+    mesh_prepare_write(mesh);
+    block = mesh_get_block_at(mesh, pos, NULL);
+    if (!block) block = mesh_add_block(mesh, pos);
+    block = table_own_block(mesh->blocks, block);
+    data = block_data_alloc();
+    data->id = new_uid();
+    ref_inc(&pager->ref);
+    data->pager = pager;
+    data->page = page;
+    STATS_ADD(nb_blocks, 1);
+    MEM_ADD(sizeof(*data));
+    STATS_ADD(nb_compressed, 1);
+    block_set_data(block, data);
+    table_log(mesh->blocks, pos);
+}
+
+// Iterate all the blocks positions intersecting a box, and for each
+// compute the intersection of the box with the block.
+#define BOX_BLOCKS_ITER(pos, size, bpos, a, b) \
+    for (bpos[2] = pos[2] & ~(int)(N - 1); bpos[2] < pos[2] + size[2]; \
+         bpos[2] += N) \
+    for (bpos[1] = pos[1] & ~(int)(N - 1); bpos[1] < pos[1] + size[1]; \
+         bpos[1] += N) \
+    for (bpos[0] = pos[0] & ~(int)(N - 1); bpos[0] < pos[0] + size[0]; \
+         bpos[0] += N) \
+    if (a[0] = max(pos[0], bpos[0]), \
+        a[1] = max(pos[1], bpos[1]), \
+        a[2] = max(pos[2], bpos[2]), \
+        b[0] = min(pos[0] + size[0], bpos[0] + N), \
+        b[1] = min(pos[1] + size[1], bpos[1] + N), \
+        b[2] = min(pos[2] + size[2], bpos[2] + N), \
+        true)
+
+void mesh_read(const mesh_t *mesh,
+               const int pos[3], const int size[3],
+               uint8_t *data)
+{
+    block_t *block;
+    int bpos[3], a[3], b[3], x, y, z;
+    uint8_t *dst;
+
+    BOX_BLOCKS_ITER(pos, size, bpos, a, b) {
+        block = table_find(mesh->blocks, bpos);
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++) {
+            dst = &data[(((z - pos[2]) * size[1] + (y - pos[1])) * size[0] +
+                         (a[0] - pos[0])) * 4];
+            if (!block) {
+                memset(dst, 0, (b[0] - a[0]) * 4);
+                continue;
+            }
+            block_data_load(block->data);
+            // The rows are only contiguous with the linear layout.
+            if (!block->data->voxels || BLOCK_MORTON) {
+                for (x = a[0]; x < b[0]; x++) {
+                    memcpy(dst + (x - a[0]) * 4,
+                           BLOCK_AT(block, x - bpos[0], y - bpos[1],
+                                           z - bpos[2]), 4);
+                }
+                continue;
+            }
+            memcpy(dst, BLOCK_AT(block, a[0] - bpos[0], y - bpos[1],
+                                        z - bpos[2]),
+                   (b[0] - a[0]) * 4);
+        }
+    }
+}
+
+typedef struct {
+    const block_t   **blocks;
+    void (*func)(void *user, const int pos[3], uint64_t id,
+                 const uint8_t (*voxels)[4]);
+    void            *user;
+} foreach_job_t;
+
+static int foreach_block_id_cmp(const void *a_, const void *b_)
+{
+    const block_t *a = *(const block_t**)a_, *b = *(const block_t**)b_;
+    return (a->data->id > b->data->id) - (a->data->id < b->data->id);
+}
+
+static void foreach_block(void *user, int i)
+{
+    const foreach_job_t *job = user;
+    const block_t *block = job->blocks[i];
+    const block_data_t *data = block->data;
+    uint8_t (*voxels)[4], (*tmp)[4];
+    int j, x, y, z;
+
+    block_data_load(data);
+    if (data->voxels && !BLOCK_MORTON) {
+        job->func(job->user, block->pos, data->id,
+                  (const uint8_t (*)[4])data->voxels);
+        return;
+    }
+    voxels = mempool_alloc(&g_voxels_pool);
+    block_data_get_voxels(data, voxels);
+    if (BLOCK_MORTON) {
+        tmp = mempool_alloc(&g_voxels_pool);
+        for (j = 0; j < N * N * N; j++) {
+            DATA_POS(j, x, y, z);
+            memcpy(tmp[x + y * N + z * N * N], voxels[j], 4);
+        }
+        mempool_free(&g_voxels_pool, voxels);
+        voxels = tmp;
+    }
+    job->func(job->user, block->pos, data->id,
+              (const uint8_t (*)[4])voxels);
+    mempool_free(&g_voxels_pool, voxels);
+}
+
+int mesh_foreach_block(const mesh_t *mesh, int flags,
+                       void (*func)(void *user, const int pos[3],
+                                    uint64_t id,
+                                    const uint8_t (*voxels)[4]),
+                       void *user)
+{
+    foreach_job_t job = {.func = func, .user = user};
+    const block_t *block;
+    int i, j, nb = 0;
+
+    if (!mesh->blocks) return 0;
+    job.blocks = malloc(max(mesh->blocks->nb_entries, 1) *
+                        sizeof(*job.blocks));
+    TABLE_FOREACH(mesh->blocks, block, i) {
+        if (block_is_empty(block)) continue;
+        job.blocks[nb++] = block;
+    }
+    if (flags & MESH_FOREACH_UNIQUE) {
+        qsort(job.blocks, nb, sizeof(*job.blocks), foreach_block_id_cmp);
+        for (i = 0, j = 0; i < nb; i++) {
+            if (j && job.blocks[j - 1]->data->id == job.blocks[i]->data->id)
+                continue;
+            job.blocks[j++] = job.blocks[i];
+        }
+        nb = j;
+    }
+    if (flags & MESH_FOREACH_PARALLEL) {
+        parallel_for(nb, foreach_block, &job);
+    } else {
+        for (i = 0; i < nb; i++) foreach_block(&job, i);
+    }
+    free(job.blocks);
+    return nb;
+}
+
+/*
+ * Replacement of colors, see mesh_replace_colors.
+ *
+ * Each block data is first checked against a summary of its colors: the
+ * value itself for the uniform data, the palette for the indexed data, and
+ * a cached bloom filter of the colors for the full RGBA data.  Only the
+ * data that might contain a source color are rewritten into a new data, in
+ * parallel, and then set into the blocks.
+ */
+typedef struct {
+    int             nb;
+    uint32_t        src[256];
+    uint32_t        dst[256];
+    uint64_t        bloom;      // Bloom filter of the source colors.
+    bool            clear;      // Set if some colors become empty.
+    uint64_t        session;    // Write session of the mesh.
+    block_t         **blocks;   // Sorted by data.
+    int             *firsts;    // First block of each data.
+    block_data_t    **results;  // New data of each data, or NULL.
+} recolor_job_t;
+
+static inline uint64_t color_bloom_bit(uint32_t color)
+{
+    return (uint64_t)1 << ((color * 2654435761u) >> 26);
+}
+
+// Bloom filter of the colors of the non empty voxels of a full RGBA data.
+// The value is cached for the data id colors_bloom_id, except for the data
+// modified in place during a write session, since they keep their id.
+static uint64_t block_data_get_colors_bloom(const block_data_t *data_,
+                                            uint64_t session)
+{
+    // Only the cached value is modified.
+    block_data_t *data = (block_data_t*)data_;
+    const uint32_t *voxels = (const uint32_t*)data->voxels;
+    uint64_t bloom = 0;
+    uint32_t last = 0;
+    bool cache = !session || data->id < session;
+    int i;
+
+    if (cache && __atomic_load_n(&data->colors_bloom_id, __ATOMIC_ACQUIRE) ==
+            data->id)
+        return __atomic_load_n(&data->colors_bloom, __ATOMIC_RELAXED);
+    for (i = 0; i < N * N * N; i++) {
+        // Most voxels have the same color as the previous one.
+        if (voxels[i] == last || !data->voxels[i][3]) continue;
+        last = voxels[i];
+        bloom |= color_bloom_bit(last);
+    }
+    if (cache) {
+        __atomic_store_n(&data->colors_bloom, bloom, __ATOMIC_RELAXED);
+        __atomic_store_n(&data->colors_bloom_id, data->id, __ATOMIC_RELEASE);
+    }
+    return bloom;
+}
+
+// Replace the colors of some RGBA voxels, and return the number of
+// replaced voxels.  We do one pass per color, with a simple compare and
+// select loop that the compiler can vectorize, always comparing to the
+// input so that a color is never replaced twice.  The passes are done in
+// reverse so that the first pair of a color wins.
+static int voxels_replace_colors(const recolor_job_t *job,
+                                 const uint32_t *in, uint32_t *out)
+{
+    int i, k, nb = 0;
+    uint32_t src, dst;
+
+    memcpy(out, in, VOXELS_SIZE);
+    for (k = job->nb - 1; k >= 0; k--) {
+        src = job->src[k];
+        dst = job->dst[k];
+        for (i = 0; i < N * N * N; i++) {
+            nb += in[i] == src;
+            out[i] = in[i] == src ? dst : out[i];
+        }
+    }
+    return nb;
+}
+
+static bool recolor_map(const recolor_job_t *job, uint32_t *color)
+{
+    int k;
+    for (k = 0; k < job->nb; k++) {
+        if (*color != job->src[k]) continue;
+        *color = job->dst[k];
+        return true;
+    }
+    return false;
+}
+
+// Compute the new value of a block data, or NULL if it doesn't change.
+static block_data_t *recolor_data(const recolor_job_t *job,
+                                  const block_data_t *data)
+{
+    block_data_t *ret;
+    uint32_t palette[256], color, *voxels = NULL;
+    uint8_t lut[256], *indices = NULL;
+    int i, k, y, z, nb = 0;
+    bool changed = false;
+
+    block_data_load(data);
+    if (data->voxels) {
+        if (!(block_data_get_colors_bloom(data, job->session) & job->bloom))
+            return NULL;
+        voxels = mempool_alloc(&g_voxels_pool);
+        if (!voxels_replace_colors(job, (const uint32_t*)data->voxels,
+                                   voxels)) {
+            mempool_free(&g_voxels_pool, voxels);
+            return NULL;
+        }
+        // We might now have less than 256 colors.
+        indices = mempool_alloc(&g_indices_pool);
+        nb = voxels_get_palette((const uint8_t (*)[4])voxels, palette,
+                                indices);
+        if (nb) {
+            mempool_free(&g_voxels_pool, voxels);
+            voxels = NULL;
+        } else {
+            mempool_free(&g_indices_pool, indices);
+        }
+    } else if (data->indices) {
+        // Rewrite the palette, merging the colors that become equal.  The
+        // palette is in the order of the first use of the colors, so the
+        // result is the same as what block_compress would give.
+        for (i = 0; i < data->nb_colors; i++) {
+            memcpy(&color, data->palette[i], 4);
+            changed |= recolor_map(job, &color);
+            for (k = 0; k < nb; k++) {
+                if (palette[k] == color) break;
+            }
+            if (k == nb) palette[nb++] = color;
+            lut[i] = k;
+        }
+        if (!changed) return NULL;
+        indices = mempool_alloc(&g_indices_pool);
+        for (i = 0; i < N * N * N; i++) indices[i] = lut[data->indices[i]];
+    } else {
+        memcpy(&color, data->color, 4);
+        if (!recolor_map(job, &color)) return NULL;
+        palette[nb++] = color;
+    }
+
+    ret = block_data_alloc();
+    ret->id = new_uid();
+    STATS_ADD(nb_blocks, 1);
+    MEM_ADD(sizeof(*ret));
+    if (voxels) {
+        ret->voxels = (uint8_t (*)[4])voxels;
+        MEM_ADD(VOXELS_SIZE);
+    } else {
+        block_data_set_palette(ret, nb, palette, indices);
+    }
+    if (!job->clear) {
+        memcpy(ret->mask, data->mask, sizeof(ret->mask));
+        ret->nb_voxels = data->nb_voxels;
+    } else {
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++)
+            block_data_update_mask(ret, y, z);
+    }
+    return ret;
+}
+
+static void recolor_job(void *user, int i)
+{
+    recolor_job_t *job = user;
+    job->results[i] = recolor_data(job, job->blocks[job->firsts[i]]->data);
+}
+
+static int recolor_block_cmp(const void *a_, const void *b_)
+{
+    const block_t *a = *(const block_t**)a_, *b = *(const block_t**)b_;
+    return (a->data > b->data) - (a->data < b->data);
+}
+
+int mesh_replace_colors(mesh_t *mesh, int nb, const uint8_t (*src)[4],
+                        const uint8_t (*dst)[4])
+{
+    recolor_job_t *job;
+    block_t *block;
+    int i, j, nb_blocks = 0, nb_datas = 0, ret = 0;
+
+    job = calloc(1, sizeof(*job));
+    for (i = 0; i < nb && job->nb < 256; i++) {
+        // The empty voxels are never replaced.
+        if (!src[i][3]) continue;
+        memcpy(&job->src[job->nb], src[i], 4);
+        memcpy(&job->dst[job->nb], dst[i], 4);
+        if (!dst[i][3]) {
+            job->dst[job->nb] = 0;
+            job->clear = true;
+        }
+        job->bloom |= color_bloom_bit(job->src[job->nb]);
+        job->nb++;
+    }
+    if (!job->nb || !mesh->blocks->count) goto end;
+
+    mesh_prepare_write(mesh);
+    job->session = mesh->write_session;
+    job->blocks = malloc(mesh->blocks->nb_entries * sizeof(*job->blocks));
+    job->firsts = malloc(mesh->blocks->nb_entries * sizeof(*job->firsts));
+    TABLE_FOREACH(mesh->blocks, block, i) {
+        if (block_is_empty(block)) continue;
+        job->blocks[nb_blocks++] = block;
+    }
+    // Only compute once the blocks that share the same data.
+    qsort(job->blocks, nb_blocks, sizeof(*job->blocks), recolor_block_cmp);
+    for (i = 0; i < nb_blocks; i++) {
+        if (i && job->blocks[i]->data == job->blocks[i - 1]->data) continue;
+        job->firsts[nb_datas++] = i;
+    }
+    job->results = calloc(max(nb_datas, 1), sizeof(*job->results));
+    parallel_for(nb_datas, recolor_job, job);
+
+    for (i = 0; i < nb_datas; i++) {
+        if (!job->results[i]) continue;
+        for (j = job->firsts[i];
+             j < (i + 1 < nb_datas ? job->firsts[i + 1] : nb_blocks); j++) {
+            block = table_own_block(mesh->blocks, job->blocks[j]);
+            block_set_data(block, job->results[i]);
+            table_log(mesh->blocks, block->pos);
+            ret++;
+            if (block_is_empty(block))
+                table_remove(mesh->blocks, block);
+            else
+                block_intern(block);
+        }
+    }
+    free(job->blocks);
+    free(job->firsts);
+    free(job->results);
+end:
+    free(job);
+    return ret;
+}
+
+void mesh_write(mesh_t *mesh,
+                const int pos[3], const int size[3],
+                const uint8_t *data)
+{
+    block_t *block;
+    block_data_t *new_data;
+    int bpos[3], a[3], b[3], x, y, z;
+    bool empty, full;
+    const uint8_t *src;
+
+    mesh_prepare_write(mesh);
+    BOX_BLOCKS_ITER(pos, size, bpos, a, b) {
+        // Check if the part we write is empty.
+        empty = true;
+        for (z = a[2]; z < b[2] && empty; z++)
+        for (y = a[1]; y < b[1] && empty; y++) {
+            src = &data[(((z - pos[2]) * size[1] + (y - pos[1])) * size[0] +
+                         (a[0] - pos[0])) * 4];
+            empty = row_is_empty(src, b[0] - a[0]);
+        }
+        full = (b[0] - a[0]) == N && (b[1] - a[1]) == N && (b[2] - a[2]) == N;
+        block = table_find(mesh->blocks, bpos);
+
+        if (empty && !block) continue;
+        if (empty && full) {
+            table_log(mesh->blocks, bpos);
+            table_remove(mesh->blocks, block);
+            continue;
+        }
+        if (!block) block = mesh_add_block(mesh, bpos);
+        block = table_own_block(mesh->blocks, block);
+        if (full) {
+            // All the voxels are replaced, so we don't need to copy the
+            // previous ones.
+            new_data = block_data_alloc();
+            new_data->voxels = mempool_alloc(&g_voxels_pool);
+            new_data->id = new_uid();
+            STATS_ADD(nb_blocks, 1);
+            MEM_ADD(sizeof(*new_data) + VOXELS_SIZE);
+            block_set_data(block, new_data);
+        } else {
+            block_prepare_write(block, mesh->write_session);
+        }
+        table_log(mesh->blocks, bpos);
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++) {
+            src = &data[(((z - pos[2]) * size[1] + (y - pos[1])) * size[0] +
+                         (a[0] - pos[0])) * 4];
+            if (BLOCK_MORTON) {
+                for (x = a[0]; x < b[0]; x++) {
+                    memcpy(BLOCK_AT(block, x - bpos[0], y - bpos[1],
+                                           z - bpos[2]),
+                           src + (x - a[0]) * 4, 4);
+                }
+            } else {
+                memcpy(BLOCK_AT(block, a[0] - bpos[0], y - bpos[1],
+                                       z - bpos[2]),
+                       src, (b[0] - a[0]) * 4);
+            }
+            block_data_update_mask(block->data, y - bpos[1], z - bpos[2]);
+        }
+        if (full) {
+            block_compress(block);
+            block_intern(block);
+            continue;
+        }
+        // We might have cleared the last voxels of the block.
+        if (block_is_empty(block)) table_remove(mesh->blocks, block);
+    }
+}
+
+
+// State of a 3D DDA walk along a ray, over a grid of cells of a given size.
+typedef struct {
+    int     pos[3];     // Position of the current cell.
+    int     step[3];
+    float   t_max[3];   // Ray parameter of the next cell on each axis.
+    float   t_delta[3];
+    int     size;
+} dda_t;
+
+static void dda_init(dda_t *dda, const float o[3], const float d[3],
+                     float t, int size, const int clamp[2][3])
+{
+    int i;
+    float p;
+    dda->size = size;
+    for (i = 0; i < 3; i++) {
+        p = o[i] + d[i] * t;
+        dda->pos[i] = floorf(p / size) * size;
+        if (clamp) dda->pos[i] = min(max(dda->pos[i], clamp[0][i]),
+                                     clamp[1][i] - size);
+        dda->step[i] = d[i] > 0 ? 1 : d[i] < 0 ? -1 : 0;
+        if (!dda->step[i]) {
+            dda->t_max[i] = INFINITY;
+            dda->t_delta[i] = INFINITY;
+            continue;
+        }
+        dda->t_delta[i] = size / fabsf(d[i]);
+        dda->t_max[i] = (dda->pos[i] + (d[i] > 0 ? size : 0) - o[i]) / d[i];
+    }
+}
+
+// Move to the next cell, and return the axis that we crossed.
+static int dda_step(dda_t *dda, float *t)
+{
+    int axis = 0;
+    if (dda->t_max[1] < dda->t_max[axis]) axis = 1;
+    if (dda->t_max[2] < dda->t_max[axis]) axis = 2;
+    *t = dda->t_max[axis];
+    dda->pos[axis] += dda->step[axis] * dda->size;
+    dda->t_max[axis] += dda->t_delta[axis];
+    return axis;
+}
+
+// Move to the first cell after the aligned cube of a given size that
+// contains the current cell, and return the axis that we crossed.
+static int dda_skip(dda_t *dda, const float o[3], const float d[3],
+                    int size, float *t)
+{
+    int i, k, axis = -1, start[3];
+    float t_exit = INFINITY, t_axis;
+
+    for (i = 0; i < 3; i++) {
+        start[i] = dda->pos[i] & ~(size - 1);
+        if (!dda->step[i]) continue;
+        t_axis = (start[i] + (d[i] > 0 ? size : 0) - o[i]) / d[i];
+        if (axis == -1 || t_axis < t_exit) {
+            t_exit = t_axis;
+            axis = i;
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        if (!dda->step[i] || dda->t_max[i] > t_exit) continue;
+        k = (t_exit - dda->t_max[i]) / dda->t_delta[i] + 1;
+        dda->pos[i] += k * dda->step[i] * dda->size;
+        dda->t_max[i] += k * dda->t_delta[i];
+    }
+    // Make sure rounding errors don't leave us in the cube.
+    if (    dda->pos[axis] >= start[axis] &&
+            dda->pos[axis] < start[axis] + size) {
+        dda->pos[axis] = d[axis] > 0 ? start[axis] + size
+                                     : start[axis] - dda->size;
+        dda->t_max[axis] = t_exit + dda->t_delta[axis];
+    }
+    *t = t_exit;
+    return axis;
 }
 
-void mesh_get_at(const mesh_t *mesh, mesh_iterator_t *it,
-                 const int pos[3], uint8_t out[4])
+// Intersection of a ray with an integer box, using the slabs method.
+static bool ray_clip_bbox(const float o[3], const float d[3],
+                          const int bbox[2][3], float *t0, float *t1,
+                          int *axis)
 {
-    block_t *block;
-    int p[3];
+    int i;
+    float a, b, tmp;
+    *t0 = 0;
+    *t1 = INFINITY;
+    *axis = -1;
+    for (i = 0; i < 3; i++) {
+        if (d[i] == 0) {
+            if (o[i] < bbox[0][i] || o[i] >= bbox[1][i]) return false;
+            continue;
+        }
+        a = (bbox[0][i] - o[i]) / d[i];
+        b = (bbox[1][i] - o[i]) / d[i];
+        if (a > b) {tmp = a; a = b; b = tmp;}
+        if (a > *t0) {
+            *t0 = a;
+            *axis = i;
+        }
+        *t1 = min(*t1, b);
+    }
+    return *t0 < *t1;
+}
 
-    if (it && it->block_id && it->block_id == get_block_id(it->block)) {
-        p[0] = pos[0] - it->block_pos[0];
-        p[1] = pos[1] - it->block_pos[1];
-        p[2] = pos[2] - it->block_pos[2];
-        if (    p[0] >= 0 && p[0] < N &&
-                p[1] >= 0 && p[1] < N &&
-                p[2] >= 0 && p[2] < N) {
-            if (!it->block)
-                memset(out, 0, 4);
-            else
-                memcpy(out, BLOCK_AT(it->block, p[0], p[1], p[2]), 4);
-            return;
+bool mesh_raycast(const mesh_t *mesh, const float origin[3],
+                  const float dir[3], int pos[3], int normal[3])
+{
+    int bbox[2][3], block_box[2][3], axis, block_axis, i, x, y, z, size;
+    float t, t_end, voxel_t;
+    dda_t blocks, voxels;
+    const block_t *block;
+
+    if (dir[0] == 0 && dir[1] == 0 && dir[2] == 0) return false;
+    if (!mesh_get_bbox(mesh, bbox, false)) return false;
+    if (!ray_clip_bbox(origin, dir, bbox, &t, &t_end, &axis)) return false;
+
+    // Walk the blocks first, skipping the empty regions of the blocks
+    // index, and only walk the voxels of the non empty blocks, using the
+    // occupancy masks.
+    dda_init(&blocks, origin, dir, t, N, bbox);
+    block_axis = axis;
+    while (t < t_end) {
+        size = table_get_empty_size(mesh->blocks, blocks.pos);
+        if (size > N) {
+            block_axis = dda_skip(&blocks, origin, dir, size, &t);
+            continue;
+        }
+        block = size ? NULL : table_find(mesh->blocks, blocks.pos);
+        if (!block_is_empty(block)) {
+            block_data_load(block->data);
+            for (i = 0; i < 3; i++) {
+                block_box[0][i] = block->pos[i];
+                block_box[1][i] = block->pos[i] + N;
+            }
+            voxel_t = t;
+            axis = block_axis;
+            dda_init(&voxels, origin, dir, voxel_t, 1, block_box);
+            while (true) {
+                x = voxels.pos[0] - block->pos[0];
+                y = voxels.pos[1] - block->pos[1];
+                z = voxels.pos[2] - block->pos[2];
+                if (x < 0 || x >= N || y < 0 || y >= N || z < 0 || z >= N)
+                    break;
+                if (MASK_AT(block->data, y, z) & ((block_row_t)1 << x)) {
+                    vec3_copy(voxels.pos, pos);
+                    memset(normal, 0, 3 * sizeof(*normal));
+                    // If the ray starts inside a voxel, use the main
+                    // direction of the ray.
+                    if (axis == -1) {
+                        axis = 0;
+                        if (fabsf(dir[1]) > fabsf(dir[axis])) axis = 1;
+                        if (fabsf(dir[2]) > fabsf(dir[axis])) axis = 2;
+                    }
+                    normal[axis] = dir[axis] > 0 ? -1 : +1;
+                    return true;
+                }
+                axis = dda_step(&voxels, &voxel_t);
+            }
         }
+        block_axis = dda_step(&blocks, &t);
     }
+    return false;
+}
 
-    block = mesh_get_block_at(mesh, pos, it);
-    return block_get_at(block, pos, out);
+uint64_t mesh_get_version(const mesh_t *mesh)
+{
+    table_see_journal(mesh->blocks);
+    return table_get_journal_version(mesh->blocks);
 }
 
-void mesh_set_at(mesh_t *mesh, mesh_iterator_t *iter,
-                 const int pos[3], const uint8_t v[4])
+static int pos_cmp(const void *a_, const void *b_)
 {
-    int p[3] = {pos[0] & ~(int)(N - 1),
-                pos[1] & ~(int)(N - 1),
-                pos[2] & ~(int)(N - 1)};
-    mesh_prepare_write(mesh);
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 2; i >= 0; i--) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : +1;
+    }
+    return 0;
+}
 
-    block_t *block = mesh_get_block_at(mesh, p, iter);
+int mesh_get_changes(const mesh_t *mesh, uint64_t version,
+                     int (**blocks_pos)[3])
+{
+    const block_table_t *table = mesh->blocks;
+    int i, j, start, lo, hi, nb;
 
-    if (!block) {
-        block = mesh_add_block(mesh, p);
-        if (iter) {
-            iter->block = block;
-            iter->block_id = get_block_id(block);
-            vec3_copy(p, iter->block_pos);
+    *blocks_pos = NULL;
+    if (version == table_get_journal_version(table)) return 0;
+    if (version == table->journal_base) {
+        start = 0;
+    } else {
+        // The versions of the entries are increasing, so we can use a
+        // binary search.
+        lo = 0;
+        hi = table->journal_size - 1;
+        while (lo < hi) {
+            i = (lo + hi) / 2;
+            if (table->journal[i].version < version) lo = i + 1;
+            else hi = i;
         }
+        if (    table->journal_size == 0 ||
+                table->journal[lo].version != version) return -1;
+        start = lo + 1;
     }
 
-    block_prepare_write(block);
-    p[0] = pos[0] - block->pos[0];
-    p[1] = pos[1] - block->pos[1];
-    p[2] = pos[2] - block->pos[2];
-    assert(p[0] >= 0 && p[0] < N);
-    assert(p[1] >= 0 && p[1] < N);
-    assert(p[2] >= 0 && p[2] < N);
-    memcpy(BLOCK_AT(block, p[0], p[1], p[2]), v, 4);
+    nb = table->journal_size - start;
+    *blocks_pos = malloc(nb * sizeof(**blocks_pos));
+    for (i = 0; i < nb; i++)
+        memcpy((*blocks_pos)[i], table->journal[start + i].pos,
+               sizeof(**blocks_pos));
+    // Remove the duplicated positions.
+    qsort(*blocks_pos, nb, sizeof(**blocks_pos), pos_cmp);
+    for (i = 1, j = 0; i < nb; i++) {
+        if (pos_cmp((*blocks_pos)[i], (*blocks_pos)[j]) != 0)
+            memcpy((*blocks_pos)[++j], (*blocks_pos)[i],
+                   sizeof(**blocks_pos));
+    }
+    return j + 1;
 }
 
-void mesh_clear_block(mesh_t *mesh, mesh_iterator_t *it, const int pos[3])
+/*
+ * Paging of the blocks data over the memory budget.  The voxels of the
+ * least recently used data are moved into a page store, and the data get a
+ * swap pager that loads them back, so that the rest of the code handles
+ * them like the lazily loaded blocks.
+ *
+ * A new swap pager is created when the spill file setting changes, the old
+ * ones are released once all their pages have been loaded back.
+ */
+typedef struct swap_pager swap_pager_t;
+struct swap_pager {
+    mesh_pager_t    pager;
+    page_store_t    *store;
+    char            *dir;   // Spill files directory, or NULL.
+    swap_pager_t    *next, *prev;
+};
+
+// Number of mesh_page_out calls to wait before scanning the blocks again,
+// when we could not go under the budget.
+#define PAGE_RETRY_DELAY 60
+
+static struct {
+    swap_pager_t    *current;   // Holds a reference.
+    swap_pager_t    *list;      // All the alive pagers, for the stats.
+    pthread_mutex_t lock;       // Protects the list.
+    uint64_t        budget;
+    uint32_t        retry_clock;
+    int             nb_files;
+} g_paging = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool swap_load(mesh_pager_t *pager, int page, uint8_t *voxels)
 {
-    block_t *block;
-    mesh_prepare_write(mesh);
-    block = mesh_get_block_at(mesh, pos, it);
-    if (!block) return;
-    HASH_DEL(mesh->blocks, block);
-    assert(mesh->blocks != block);
-    block_delete(block);
-    if (it) it->block = NULL;
+    swap_pager_t *swap = (swap_pager_t*)pager;
+    STATS_ADD(nb_page_ins, 1);
+    return page_store_read(swap->store, page, voxels, VOXELS_SIZE);
 }
 
+static void swap_free_page(mesh_pager_t *pager, int page)
+{
+    swap_pager_t *swap = (swap_pager_t*)pager;
+    page_store_remove(swap->store, page);
+    STATS_ADD(nb_paged, -1);
+}
 
-static bool mesh_iter_next_block_box(mesh_iterator_t *it)
+static void swap_release(mesh_pager_t *pager)
 {
-    int i;
-    const mesh_t *mesh = it->mesh;
-    if (!it->block_id) {
-        it->block_pos[0] = it->bbox[0][0] & ~(int)(N - 1);
-        it->block_pos[1] = it->bbox[0][1] & ~(int)(N - 1);
-        it->block_pos[2] = it->bbox[0][2] & ~(int)(N - 1);
-        goto end;
-    }
+    swap_pager_t *swap = (swap_pager_t*)pager;
+    pthread_mutex_lock(&g_paging.lock);
+    DL_DELETE(g_paging.list, swap);
+    pthread_mutex_unlock(&g_paging.lock);
+    page_store_delete(swap->store);
+    free(swap->dir);
+    free(swap);
+}
 
-    for (i = 0; i < 3; i++) {
-        it->block_pos[i] += N;
-        if (it->block_pos[i] <= it->bbox[1][i]) break;
-        it->block_pos[i] = it->bbox[0][i] & ~(int)(N - 1);
+static swap_pager_t *swap_new(const char *dir)
+{
+    swap_pager_t *swap;
+    page_store_t *store;
+    char path[1024];
+
+    if (dir) {
+        snprintf(path, sizeof(path), "%s/swap-%d-%d.bin", dir,
+                 (int)getpid(), g_paging.nb_files++);
     }
-    if (i == 3) return false;
+    store = page_store_new(dir ? path : NULL);
+    if (!store) return NULL;
+    swap = calloc(1, sizeof(*swap));
+    swap->pager = (mesh_pager_t) {
+        .ref = 1,
+        .load = swap_load,
+        .release = swap_release,
+        .free_page = swap_free_page,
+    };
+    swap->store = store;
+    swap->dir = dir ? strdup(dir) : NULL;
+    pthread_mutex_lock(&g_paging.lock);
+    DL_APPEND(g_paging.list, swap);
+    pthread_mutex_unlock(&g_paging.lock);
+    return swap;
+}
 
-end:
-    HASH_FIND(hh, mesh->blocks, it->block_pos, 3 * sizeof(int), it->block);
-    it->block_id = get_block_id(it->block);
-    vec3_copy(it->block_pos, it->pos);
+static bool block_data_is_swapped(const block_data_t *data)
+{
+    mesh_pager_t *pager = __atomic_load_n(&data->pager, __ATOMIC_ACQUIRE);
+    return pager && pager->load == swap_load;
+}
+
+// Move the voxels of a block data into the swap pager store.  The data
+// keeps its id, mask and bounding box, only the voxels are released.
+static bool block_data_page_out(block_data_t *data, swap_pager_t *swap)
+{
+    uint8_t (*voxels)[4];
+    uint8_t (*tmp)[4];
+    int i, x, y, z, page;
+
+    voxels = mempool_alloc(&g_voxels_pool);
+    block_data_get_voxels(data, voxels);
+    // The pagers give the voxels in the linear order.
+    if (BLOCK_MORTON) {
+        tmp = mempool_alloc(&g_voxels_pool);
+        for (i = 0; i < N * N * N; i++) {
+            DATA_POS(i, x, y, z);
+            memcpy(tmp[x + y * N + z * N * N], voxels[i], 4);
+        }
+        mempool_free(&g_voxels_pool, voxels);
+        voxels = tmp;
+    }
+    page = page_store_add(swap->store, voxels, VOXELS_SIZE);
+    mempool_free(&g_voxels_pool, voxels);
+    if (page < 0) return false;
+
+    block_data_free_voxels(data);
+    STATS_ADD(nb_compressed, 1);
+    STATS_ADD(nb_paged, 1);
+    STATS_ADD(nb_page_outs, 1);
+    ref_inc(&swap->pager.ref);
+    data->page = page;
+    __atomic_store_n(&data->pager, &swap->pager, __ATOMIC_RELEASE);
     return true;
 }
 
-static bool mesh_iter_next_block_union(mesh_iterator_t *it)
+int mesh_set_paging(uint64_t budget, const char *spill_dir)
 {
-    it->block = it->block ? it->block->hh.next : it->mesh->blocks;
-    if (!it->block && !(it->flags & MESH_ITER_MESH2)) {
-        it->block = it->mesh2->blocks;
-        it->flags |= MESH_ITER_MESH2;
+    swap_pager_t *swap = g_paging.current;
+    bool same_dir;
+
+    g_paging.budget = budget;
+    g_paging.retry_clock = 0;
+    same_dir = swap && (swap->dir && spill_dir ?
+                        strcmp(swap->dir, spill_dir) == 0 :
+                        !swap->dir && !spill_dir);
+    if (!budget || !same_dir) {
+        if (swap) mesh_pager_release(&swap->pager);
+        g_paging.current = NULL;
     }
-    if (!it->block) return false;
-    it->block_id = it->block->id;
-    vec3_copy(it->block->pos, it->block_pos);
-    vec3_copy(it->block->pos, it->pos);
+    if (!budget || same_dir) return 0;
+    g_paging.current = swap_new(spill_dir);
+    if (g_paging.current) return 0;
+    // Keep the pages in memory if we cannot create the spill file.
+    g_paging.current = swap_new(NULL);
+    return -1;
+}
+
+typedef struct {
+    block_data_t    *data;
+    uint32_t        last_used;
+} page_candidate_t;
+
+static int candidate_ptr_cmp(const void *a_, const void *b_)
+{
+    const page_candidate_t *a = a_, *b = b_;
+    return ((uintptr_t)a->data > (uintptr_t)b->data) -
+           ((uintptr_t)a->data < (uintptr_t)b->data);
+}
+
+static int candidate_age_cmp(const void *a_, const void *b_)
+{
+    const page_candidate_t *a = a_, *b = b_;
+    return (a->last_used > b->last_used) - (a->last_used < b->last_used);
+}
 
-    // Discard blocks that we already did from the first mesh.
-    if (it->flags & MESH_ITER_MESH2) {
-        if (mesh_get_block_at(it->mesh, it->block_pos, NULL))
-            return mesh_iter_next_block_union(it);
+static void add_candidate(block_data_t *data, page_candidate_t **list,
+                          int *nb, int *allocated)
+{
+    if (!data || data->id == 0 || block_data_is_paged(data)) return;
+    if (!data->voxels && !data->indices) return; // Nothing to gain.
+    if (*nb == *allocated) {
+        *allocated = *allocated * 2 ?: 1024;
+        *list = realloc(*list, *allocated * sizeof(**list));
     }
-    return true;
+    (*list)[(*nb)++] = (page_candidate_t) {data, data->last_used};
 }
 
-static bool mesh_iter_next_block(mesh_iterator_t *it)
+void mesh_page_out(const mesh_t **meshes, int nb)
 {
-    if (it->block_id && it->block_id != get_block_id(it->block)) {
-        it->block = mesh_get_block_at(
-            (it->flags & MESH_ITER_MESH2) ? it->mesh2 : it->mesh,
-            it->block_pos,
-            it);
+    uint32_t clock;
+    uint64_t target;
+    page_candidate_t *list = NULL;
+    const block_t *block;
+    int i, j, k, nb_list = 0, allocated = 0;
+
+    clock = __atomic_add_fetch(&g_page_clock, 1, __ATOMIC_RELAXED);
+    if (!nb || !g_paging.current || !g_paging.budget) return;
+    if (__atomic_load_n(&g_global_stats.mem, __ATOMIC_RELAXED) <=
+            g_paging.budget)
+        return;
+    if (clock < g_paging.retry_clock) return;
+
+    for (i = 0; i < nb; i++) {
+        if (meshes[i]->blocks) {
+            TABLE_FOREACH(meshes[i]->blocks, block, j)
+                add_candidate(block->data, &list, &nb_list, &allocated);
+        }
+        for (j = 0; j < meshes[i]->delta_size; j++)
+            add_candidate(meshes[i]->delta[j].data, &list, &nb_list,
+                          &allocated);
     }
+    // Remove the data shared by several blocks.
+    qsort(list, nb_list, sizeof(*list), candidate_ptr_cmp);
+    for (i = 0, k = 0; i < nb_list; i++) {
+        if (k && list[k - 1].data == list[i].data) continue;
+        list[k++] = list[i];
+    }
+    nb_list = k;
+
+    // Go a bit under the budget, so that we don't page out at every frame.
+    qsort(list, nb_list, sizeof(*list), candidate_age_cmp);
+    target = g_paging.budget / 8 * 7;
+    for (i = 0; i < nb_list; i++) {
+        if (__atomic_load_n(&g_global_stats.mem, __ATOMIC_RELAXED) <= target)
+            break;
+        // Used since the previous call.
+        if (list[i].last_used >= clock - 1) break;
+        if (!block_data_page_out(list[i].data, g_paging.current)) break;
+    }
+    if (__atomic_load_n(&g_global_stats.mem, __ATOMIC_RELAXED) > target)
+        g_paging.retry_clock = clock + PAGE_RETRY_DELAY;
+    free(list);
+}
 
-    if (it->flags & MESH_ITER_BOX) return mesh_iter_next_block_box(it);
-    if (it->mesh2) return mesh_iter_next_block_union(it);
+// Swap pager of the history spill file, see mesh_spill.
+static swap_pager_t *g_spill;
 
-    it->block = it->block ? it->block->hh.next : it->mesh->blocks;
-    if (!it->block) return false;
-    it->block_id = it->block->id;
-    vec3_copy(it->block->pos, it->block_pos);
-    vec3_copy(it->block->pos, it->pos);
-    return true;
+int mesh_set_spill_dir(const char *dir)
+{
+    if (g_spill && dir && g_spill->dir && strcmp(g_spill->dir, dir) == 0)
+        return 0;
+    if (g_spill) mesh_pager_release(&g_spill->pager);
+    g_spill = NULL;
+    if (!dir) return 0;
+    g_spill = swap_new(dir);
+    return g_spill ? 0 : -1;
 }
 
-int mesh_iter(mesh_iterator_t *it, int pos[3])
+// Page out a block data to the spill file if it is only used once.
+static bool spill_data(block_data_t *data)
 {
+    if (!data || data->id == 0 || block_data_is_paged(data)) return false;
+    if (!data->voxels && !data->indices) return false;
+    if (ref_get(&data->ref) != 1) return false;
+    return block_data_page_out(data, g_spill);
+}
+
+int mesh_spill(mesh_t *mesh)
+{
+    block_t *block;
+    int i, nb = 0;
+
+    if (!g_spill) return 0;
+    for (i = 0; i < mesh->delta_size; i++)
+        nb += spill_data(mesh->delta[i].data);
+    // Only if nobody else could be reading the same blocks.
+    if (!mesh->blocks || ref_get(&mesh->blocks->ref) != 1) return nb;
+    TABLE_FOREACH(mesh->blocks, block, i) {
+        if (table_block_is_shared(mesh->blocks, block)) continue;
+        nb += spill_data(block->data);
+    }
+    return nb;
+}
+
+void mesh_get_global_stats(mesh_global_stats_t *stats)
+{
+    uint64_t counters[COUNTER_COUNT];
+    swap_pager_t *swap;
+    page_store_stats_t store_stats;
+
+    *stats = g_global_stats;
+    pthread_mutex_lock(&g_paging.lock);
+    DL_FOREACH(g_paging.list, swap) {
+        page_store_get_stats(swap->store, &store_stats);
+        stats->paged_mem += store_stats.mem;
+        stats->spill_size += store_stats.file_size;
+    }
+    pthread_mutex_unlock(&g_paging.lock);
+    counters_get(counters);
+    stats->nb_lookups = counters[COUNTER_MESH_LOOKUPS];
+    stats->nb_accessor_hits = counters[COUNTER_MESH_ACCESSOR_HITS];
+    stats->nb_block_copies = counters[COUNTER_BLOCK_COPIES];
+    stats->nb_table_copies = counters[COUNTER_MESH_TABLE_COPIES];
+    stats->pools_mem = mempool_get_mem(&g_blocks_pool) +
+                       mempool_get_mem(&g_datas_pool) +
+                       mempool_get_mem(&g_voxels_pool) +
+                       mempool_get_mem(&g_indices_pool);
+}
+
+void mesh_trim_pools(void)
+{
+    mempool_trim(&g_blocks_pool);
+    mempool_trim(&g_datas_pool);
+    mempool_trim(&g_voxels_pool);
+    mempool_trim(&g_indices_pool);
+}
+
+void mesh_get_stats(const mesh_t *mesh, mesh_stats_t *stats)
+{
+    // Only the cached values of the table are modified.
+    block_table_t *table = (block_table_t*)mesh->blocks;
+    const block_t *block;
+    const block_data_t *data;
+    uint64_t journal_version = table_get_journal_version(table);
+    mesh_stats_t ret = {0};
     int i;
-    if (!it->block_id) { // First call.
-        // XXX: this is not good: mesh_iter shouldn't make change to the
-        // mesh.
-        if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
-            mesh_add_neighbors_blocks((mesh_t*)it->mesh);
-        if (!mesh_iter_next_block(it)) return 0;
+
+    pthread_mutex_lock(&g_table_cache_lock);
+    if (    table->stats_version == table->version &&
+            table->stats_journal_version == journal_version)
         goto end;
+    TABLE_FOREACH(table, block, i) {
+        data = block->data;
+        if (data->id == 0) continue; // Static empty data.
+        // The paged out data still have their mask, no need to load them.
+        if (!block_data_is_swapped(data)) block_data_load(data);
+        if (!data->nb_voxels) continue;
+        ret.nb_blocks++;
+        ret.nb_voxels += data->nb_voxels;
+        if (block_data_is_swapped(data)) ret.max_colors += data->nb_voxels;
+        else if (data->indices) ret.max_colors += data->nb_colors;
+        else if (!data->voxels) ret.max_colors += 1;
+        else ret.max_colors += data->nb_voxels;
     }
-    if (it->flags & MESH_ITER_BLOCKS) goto next_block;
+    table->stats = ret;
+    table->stats_version = table->version;
+    table->stats_journal_version = journal_version;
+end:
+    *stats = table->stats;
+    pthread_mutex_unlock(&g_table_cache_lock);
+}
 
-    for (i = 0; i < 3; i++) {
-        if (++it->pos[i] < it->block_pos[i] + N) break;
-        it->pos[i] = it->block_pos[i];
+// The bundled xxhash is built without the 64 bits functions, so we combine
+// two XXH32 with different seeds, as for the gox blocks uids.
+static uint64_t hash64(const void *data, size_t len)
+{
+    return (uint64_t)XXH32(data, len, 0) << 32 | XXH32(data, len, 1);
+}
+
+// Hash of the voxels of a block data.  Unlike block_data_hash it doesn't
+// depend on the way the data is stored, and all the voxels with a zero
+// alpha give the same value, so that two blocks have the same hash if
+// mesh_diff would see them as equal.  The value is kept until the data id
+// changes, that is until the next write to the block.  Can be called from
+// any thread.
+static uint64_t block_data_get_content_hash(const block_data_t *data_)
+{
+    // Only the cached value is modified.
+    block_data_t *data = (block_data_t*)data_;
+    uint8_t voxels[N * N * N][4];
+    uint64_t hash;
+    int i;
+
+    if (data->id == 0) return 0; // Static empty data.
+    if (__atomic_load_n(&data->content_hash_id, __ATOMIC_ACQUIRE) ==
+            data->id)
+        return __atomic_load_n(&data->content_hash, __ATOMIC_RELAXED);
+    block_data_load(data);
+    hash = 0;
+    if (data->nb_voxels) {
+        block_data_get_voxels(data, voxels);
+        for (i = 0; i < N * N * N; i++) {
+            if (!voxels[i][3]) memset(voxels[i], 0, 4);
+        }
+        hash = hash64(voxels, sizeof(voxels));
     }
-    if (i < 3) goto end;
+    __atomic_store_n(&data->content_hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&data->content_hash_id, data->id, __ATOMIC_RELEASE);
+    return hash;
+}
 
-next_block:
-    if (!mesh_iter_next_block(it)) {
-        // XXX: this is not good: mesh_iter shouldn't make changes to the
-        // mesh.
-        if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
-            mesh_remove_empty_blocks((mesh_t*)it->mesh, true);
-        return 0;
+typedef struct {
+    int         pos[3];
+    uint64_t    hash;
+} hash_entry_t;
+
+typedef struct {
+    const block_t   **blocks;
+    hash_entry_t    *entries;
+} hash_job_t;
+
+static void hash_block(void *user, int i)
+{
+    const hash_job_t *job = user;
+    const block_t *block = job->blocks[i];
+    memcpy(job->entries[i].pos, block->pos, sizeof(block->pos));
+    job->entries[i].hash = block_data_get_content_hash(block->data);
+}
+
+static int hash_entry_cmp(const void *a_, const void *b_)
+{
+    const hash_entry_t *a = a_, *b = b_;
+    int i;
+    for (i = 2; i >= 0; i--) {
+        if (a->pos[i] != b->pos[i]) return a->pos[i] < b->pos[i] ? -1 : 1;
     }
+    return 0;
+}
 
-end:
-    if (pos) vec3_copy(it->pos, pos);
-    return 1;
+uint64_t mesh_get_hash(const mesh_t *mesh)
+{
+    // Only the cached values of the table are modified.
+    block_table_t *table = (block_table_t*)mesh->blocks;
+    const block_t *block;
+    uint64_t journal_version = table_get_journal_version(table);
+    uint64_t version = table->version;
+    hash_job_t job;
+    int i, nb = 0, count;
+    uint64_t ret;
+
+    pthread_mutex_lock(&g_table_cache_lock);
+    if (    table->hash_version == version &&
+            table->hash_journal_version == journal_version) {
+        ret = table->hash;
+        pthread_mutex_unlock(&g_table_cache_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&g_table_cache_lock);
+
+    // The blocks hashes are computed in parallel, without the lock.
+    job.blocks = malloc(max(table->count, 1) * sizeof(*job.blocks));
+    TABLE_FOREACH(table, block, i) {
+        job.blocks[nb++] = block;
+    }
+    // Zeroed so that the padding of the entries doesn't change the hash.
+    job.entries = calloc(max(nb, 1), sizeof(*job.entries));
+    parallel_for(nb, hash_block, &job);
+
+    // The empty blocks are skipped, the same as missing blocks.
+    for (i = 0, count = 0; i < nb; i++) {
+        if (!job.entries[i].hash) continue;
+        job.entries[count++] = job.entries[i];
+    }
+    qsort(job.entries, count, sizeof(*job.entries), hash_entry_cmp);
+    ret = hash64(job.entries, count * sizeof(*job.entries));
+    free(job.blocks);
+    free(job.entries);
+
+    pthread_mutex_lock(&g_table_cache_lock);
+    table->hash = ret;
+    table->hash_version = version;
+    table->hash_journal_version = journal_version;
+    pthread_mutex_unlock(&g_table_cache_lock);
+    return ret;
 }
 
-uint64_t mesh_get_key(const mesh_t *mesh)
+static int ptr_cmp(const void *a, const void *b)
 {
-    return mesh ? mesh->key : 0;
+    const uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+    return (x > y) - (x < y);
 }
 
-void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
-                          const int bpos[3], uint64_t *id)
+int mesh_get_mem(const mesh_t *mesh)
 {
-    block_t *block = NULL;
-    if (    iter &&
-            iter->block_id &&
-            iter->block_id == get_block_id(iter->block) &&
-            memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
-        block = iter->block;
-    } else {
-        HASH_FIND(hh, mesh->blocks, bpos, sizeof(iter->pos), block);
+    const block_t *block;
+    uintptr_t *datas;
+    int i, nb = 0;
+    int64_t mem = sizeof(*mesh);
+
+    mem += mesh->delta_size * sizeof(*mesh->delta);
+    if (!mesh->blocks) return min(mem, (int64_t)INT_MAX);
+    datas = malloc(max(mesh->blocks->count, 1) * sizeof(*datas));
+    TABLE_FOREACH(mesh->blocks, block, i) {
+        mem += sizeof(*block);
+        if (block->data->id == 0) continue; // Static empty data.
+        datas[nb++] = (uintptr_t)block->data;
+    }
+    qsort(datas, nb, sizeof(*datas), ptr_cmp);
+    for (i = 0; i < nb; i++) {
+        if (i > 0 && datas[i] == datas[i - 1]) continue;
+        mem += sizeof(block_data_t) +
+               block_data_mem((const block_data_t*)datas[i]);
     }
-    if (id) *id = block ? block->data->id : 0;
-    return block ? block->data->voxels : NULL;
+    free(datas);
+    return min(mem, (int64_t)INT_MAX);
 }
 
-uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *iter,
-                          const int pos[3])
+void mesh_set_dedup(bool enabled)
 {
-    uint8_t v[4];
-    mesh_get_at(mesh, iter, pos, v);
-    return v[3];
+    g_dedup_enabled = enabled;
 }
 
-void mesh_copy_block(const mesh_t *src, const int src_pos[3],
-                     mesh_t *dst, const int dst_pos[3])
+uint64_t mesh_get_unshared_mem(const mesh_t *mesh, const mesh_t *other)
 {
-    block_t *b1, *b2;
-    mesh_prepare_write(dst);
-    b1 = mesh_get_block_at(src, src_pos, NULL);
-    b2 = mesh_get_block_at(dst, dst_pos, NULL);
-    if (!b2) b2 = mesh_add_block(dst, dst_pos);
-    block_set_data(b2, b1->data);
+    block_t *block, *other_block;
+    const block_data_t *data;
+    uint64_t ret = 0;
+    int i;
+
+    for (i = 0; i < mesh->delta_size; i++) {
+        data = mesh->delta[i].data;
+        if (data && data->id != 0)
+            ret += sizeof(*data) + block_data_mem(data);
+    }
+    if (!mesh->blocks) return ret;
+    if (other && !other->blocks) other = NULL;
+    if (other && mesh->blocks == other->blocks) return 0;
+    TABLE_FOREACH(mesh->blocks, block, i) {
+        if (block->data->id == 0) continue; // Static empty data.
+        other_block = other ? table_find(other->blocks, block->pos) : NULL;
+        if (other_block && other_block->data == block->data) continue;
+        ret += sizeof(*block->data) + block_data_mem(block->data);
+    }
+    return ret;
 }
 
-void mesh_read(const mesh_t *mesh,
-               const int pos[3], const int size[3],
-               uint8_t *data)
+void mesh_compact(mesh_t *mesh)
 {
-    // For the moment we only support the case where we get the rectangle
-    // of a block plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
+    block_t *block, tmp;
+    int i;
 
-    block_t *block;
-    int block_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
-    int i, z, y, x, dx, dy, dz, p[3];
-    uint8_t v[4];
-    mesh_accessor_t accessor;
+    for (i = 0; i < mesh->delta_size; i++) {
+        tmp = (block_t){.data = mesh->delta[i].data};
+        if (!tmp.data || ref_get(&tmp.data->ref) != 1) continue;
+        block_compress(&tmp);
+        block_intern(&tmp);
+        mesh->delta[i].data = tmp.data;
+    }
+    // Only if nobody else could be reading the same blocks.
+    if (!mesh->blocks || ref_get(&mesh->blocks->ref) != 1) return;
+    TABLE_FOREACH(mesh->blocks, block, i) {
+        if (ref_get(&block->data->ref) != 1) continue;
+        if (table_block_is_shared(mesh->blocks, block)) continue;
+        block_compress(block);
+        block_intern(block);
+    }
+}
 
-    memset(data, 0, size[0] * size[1] * size[2] * 4);
-    block = mesh_get_block_at(mesh, block_pos, NULL);
-    if (!block) goto rest;
+bool mesh_is_delta(const mesh_t *mesh)
+{
+    return mesh->blocks == NULL;
+}
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        dx = x + 1;
-        dy = y + 1;
-        dz = z + 1;
-        memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &block->data->voxels[z * N * N + y * N + x],
-               4);
-    }
-
-rest:
-    // Fill the rest.
-    // In order to optimize access, we iter in such a way to avoid changing
-    // the current block: start with the planes, then the edges, and finally
-    // the 8 corners.
-    accessor = mesh_get_accessor(mesh);
-    const int ranges[26][3][2] = {
-        // 6 planes.
-        {{0,         1}, {1,     N + 1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 1}},
-        {{1,     N + 1}, {0,         1}, {1,     N + 1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{1,     N + 1}, {1,     N + 1}, {0,         1}},
-        {{1,     N + 1}, {1,     N + 1}, {N + 1, N + 2}},
-        // 4 edges moving along X.
-        {{1,     N + 1}, {0,         1}, {0,         1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {0,         1}},
-        {{1,     N + 1}, {0,         1}, {N + 1, N + 2}},
-        {{1,     N + 1}, {N + 1, N + 2}, {N + 1, N + 2}},
-        // 4 edges moving along Y.
-        {{0,         1}, {1,     N + 1}, {0,         1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {0,         1}},
-        {{0,         1}, {1,     N + 1}, {1,     N + 2}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 2}},
-        // 4 edges moving along Z.
-        {{0,         1}, {0,         1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {0,         1}, {1,     N + 1}},
-        {{0,         1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {1,     N + 1}},
-        // 8 Corners.
-        {{0,     1    }, {0,     1    }, {0,     1    }},
-        {{N + 1, N + 2}, {0,     1    }, {0,     1    }},
-        {{0,     1    }, {N + 1, N + 2}, {0,     1    }},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {0,     1    }},
-        {{0,     1    }, {0,     1    }, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {0,     1    }, {N + 1, N + 2}},
-        {{0,     1    }, {N + 1, N + 2}, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {N + 1, N + 2}},
-    };
+bool mesh_make_delta(mesh_t *mesh, const mesh_t *base)
+{
+    int i, nb, (*pos)[3];
+    block_t *block;
+
+    assert(mesh->blocks && base->blocks);
+    nb = mesh_get_changes(base, mesh_get_version(mesh), &pos);
+    if (nb < 0) return false;
+    mesh->delta = calloc(max(nb, 1), sizeof(*mesh->delta));
+    mesh->delta_size = nb;
+    for (i = 0; i < nb; i++) {
+        memcpy(mesh->delta[i].pos, pos[i], sizeof(pos[i]));
+        block = table_find(mesh->blocks, pos[i]);
+        if (!block) continue;
+        mesh->delta[i].data = block->data;
+        ref_inc(&block->data->ref);
+    }
+    free(pos);
+    table_release(mesh->blocks);
+    mesh->blocks = NULL;
+    return true;
+}
 
-    for (i = 0; i < 26; i++)
-    for (z = ranges[i][2][0]; z < ranges[i][2][1]; z++)
-    for (y = ranges[i][1][0]; y < ranges[i][1][1]; y++)
-    for (x = ranges[i][0][0]; x < ranges[i][0][1]; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &accessor, p, v);
-        memcpy(&data[(z * size[1] * size[0] + y * size[0] + x) * 4], v, 4);
+void mesh_apply_delta(mesh_t *mesh, mesh_t *base)
+{
+    delta_entry_t *entry, *tmp_delta;
+    block_t *block;
+    block_data_t *data;
+    uint64_t key = base->key;
+    int i, tmp_size;
+
+    assert(mesh->delta && base->blocks);
+    // No need to copy the blocks if the meshes are the same.
+    if (mesh->delta_size) mesh_prepare_write(base);
+    // Swap the data of each block with the one of the delta.
+    for (i = 0; i < mesh->delta_size; i++) {
+        entry = &mesh->delta[i];
+        block = table_find(base->blocks, entry->pos);
+        if (block) block = table_own_block(base->blocks, block);
+        data = block ? block->data : NULL;
+        if (entry->data && !block) {
+            block = block_new(entry->pos);
+            block_data_release(block->data);
+            table_add(base->blocks, block);
+        }
+        if (!entry->data && block) {
+            // Keep the data when the table releases the block.
+            ref_inc(&data->ref);
+            table_remove(base->blocks, block);
+        }
+        if (entry->data) block->data = entry->data;
+        entry->data = data;
+        table_log(base->blocks, entry->pos);
     }
+
+    mesh->blocks = base->blocks;
+    base->blocks = NULL;
+    tmp_delta = mesh->delta;
+    tmp_size = mesh->delta_size;
+    mesh->delta = base->delta;
+    mesh->delta_size = base->delta_size;
+    base->delta = tmp_delta;
+    base->delta_size = tmp_size;
+    base->key = key;
 }
 
+typedef struct {
+    const block_data_t  *a, *b;     // NULL if the block is missing.
+    mesh_diff_t         diff;
+    block_row_t         mask[N * N];
+} diff_block_t;
 
-void mesh_get_global_stats(mesh_global_stats_t *stats)
+typedef struct {
+    diff_block_t    *blocks;
+    int             flags;
+} diff_job_t;
+
+static bool voxels_equal(const uint8_t a[4], const uint8_t b[4])
 {
-    *stats = g_global_stats;
+    return (a[3] == 0 && b[3] == 0) || memcmp(a, b, 4) == 0;
+}
+
+// Compare the voxels of two blocks data, any of them can be NULL.
+static void diff_block(void *user, int i)
+{
+    const diff_job_t *job = user;
+    diff_block_t *block = &job->blocks[i];
+    const block_data_t *a = block->a, *b = block->b;
+    const uint8_t empty[4] = {};
+    const uint8_t *va, *vb;
+    bool all = job->flags & MESH_DIFF_VOXELS;
+    int x, y, z, nb_a, nb_b;
+    block_row_t row;
+
+    if (a) block_data_load(a);
+    if (b) block_data_load(b);
+    nb_a = a ? a->nb_voxels : 0;
+    nb_b = b ? b->nb_voxels : 0;
+    if (nb_a == 0 && nb_b == 0) return;
+    block->diff.type = (nb_a == 0) ? MESH_DIFF_ADDED :
+                       (nb_b == 0) ? MESH_DIFF_REMOVED : MESH_DIFF_CHANGED;
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        row = (a ? a->mask[y + z * N] : 0) | (b ? b->mask[y + z * N] : 0);
+        if (!row) continue;
+        for (x = 0; x < N; x++) {
+            if (!(row & ((block_row_t)1 << x))) continue;
+            va = a ? DATA_AT(a, x, y, z) : empty;
+            vb = b ? DATA_AT(b, x, y, z) : empty;
+            if (voxels_equal(va, vb)) continue;
+            block->diff.nb_voxels++;
+            if (!all) return;
+            block->mask[y + z * N] |= (block_row_t)1 << x;
+        }
+    }
+    if (!block->diff.nb_voxels) block->diff.type = 0;
+}
+
+int mesh_diff(const mesh_t *a, const mesh_t *b, int flags,
+              void (*callback)(void *user, const mesh_diff_t *diff),
+              void *user)
+{
+    block_t *block, *other;
+    diff_job_t job = {.flags = flags};
+    int i, nb = 0, ret = 0;
+
+    assert(a->blocks && b->blocks);
+    if (a->blocks == b->blocks || a->key == b->key) return 0;
+
+    // Only the blocks with different data ids need to be compared.
+    job.blocks = calloc(a->blocks->count + b->blocks->count,
+                        sizeof(*job.blocks));
+    TABLE_FOREACH(a->blocks, block, i) {
+        other = table_find(b->blocks, block->pos);
+        if (other && other->data->id == block->data->id) continue;
+        job.blocks[nb].a = block->data;
+        job.blocks[nb].b = other ? other->data : NULL;
+        memcpy(job.blocks[nb++].diff.pos, block->pos, sizeof(block->pos));
+    }
+    TABLE_FOREACH(b->blocks, block, i) {
+        if (table_find(a->blocks, block->pos)) continue;
+        job.blocks[nb].b = block->data;
+        memcpy(job.blocks[nb++].diff.pos, block->pos, sizeof(block->pos));
+    }
+
+    parallel_for(nb, diff_block, &job);
+
+    for (i = 0; i < nb; i++) {
+        if (!job.blocks[i].diff.type) continue;
+        ret++;
+        if (!callback) continue;
+        if (flags & MESH_DIFF_VOXELS)
+            job.blocks[i].diff.mask = job.blocks[i].mask;
+        else
+            job.blocks[i].diff.nb_voxels = 0;
+        callback(user, &job.blocks[i].diff);
+    }
+    free(job.blocks);
+    return ret;
 }
@@ -22,7 +22,36 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#define BLOCK_SIZE 16
+/*
+ * The size of the blocks can be set at build time to 8, 16 or 32 (with the
+ * block_size scons option).  All the blocks kernels use it as a compile
+ * time constant.
+ */
+#ifndef BLOCK_SIZE
+#   define BLOCK_SIZE 16
+#endif
+
+#if BLOCK_SIZE != 8 && BLOCK_SIZE != 16 && BLOCK_SIZE != 32
+#   error "BLOCK_SIZE should be 8, 16 or 32"
+#endif
+
+// Set to store the voxels of the blocks in Morton order (morton scons
+// option) instead of the linear order.
+#ifndef BLOCK_MORTON
+#   define BLOCK_MORTON 0
+#endif
+
+/*
+ * Type: block_row_t
+ * Bits mask of a row of voxels of a block along x.
+ */
+#if BLOCK_SIZE == 8
+typedef uint8_t block_row_t;
+#elif BLOCK_SIZE == 16
+typedef uint16_t block_row_t;
+#else
+typedef uint32_t block_row_t;
+#endif
 
 /* Type: mesh_t
  * Opaque type that represents a mesh.
@@ -70,10 +99,26 @@ typedef struct {
     int block_pos[3];
     uint64_t block_id;
 
+    // Small direct mapped cache of the last accessed blocks, so that
+    // accesses crossing blocks boundaries don't need a hash lookup.
+    struct {
+        block_t *block;
+        int pos[3];
+        uint64_t version; // Version of the mesh blocks table.
+    } cache[8];
+
     int pos[3];
     float box[4][4];
     int bbox[2][3];
 
+    // Index of the next entry of the mesh blocks array, when iterating
+    // all the blocks.
+    int block_index;
+
+    // Index of the next neighbor position to yield, when iterating with
+    // MESH_ITER_INCLUDES_NEIGHBORS.
+    int neighbor_index;
+
     int flags;
 } mesh_iterator_t;
 typedef mesh_iterator_t mesh_accessor_t;
@@ -110,6 +155,18 @@ static inline void mesh_get_block_aabb(const int pos[3], int aabb[2][3])
     aabb[1][2] = pos[2] + BLOCK_SIZE;
 }
 
+/*
+ * Function: mesh_copy
+ * Create a copy of a mesh.
+ *
+ * The copy shares all its data with the original mesh until one of them
+ * is modified, so this is very cheap.
+ *
+ * The copy can also be used as a read only snapshot of the mesh from an
+ * other thread: it is safe to read and delete the copy while the original
+ * mesh keeps being modified, as long as the copy itself is not modified.
+ * The copy has to be created on the thread that owns the original mesh.
+ */
 mesh_t *mesh_copy(const mesh_t *mesh);
 
 void mesh_set(mesh_t *mesh, const mesh_t *other);
@@ -135,6 +192,26 @@ uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *it,
 void mesh_set_at(mesh_t *mesh, mesh_iterator_t *it,
                  const int pos[3], const uint8_t v[4]);
 
+/*
+ * Function: mesh_begin_write
+ * Start a write session on a mesh.
+ *
+ * Normally each write gives a new key to the mesh, and a new id to the
+ * modified block data.  During a session this is only done once per block,
+ * so that loops writing many voxels don't keep generating new ids.
+ *
+ * The key and the blocks data ids are only guaranteed to reflect the
+ * changes after <mesh_end_write>, so the values read from the mesh during
+ * the session should not be cached with them.  Sessions can be nested.
+ */
+void mesh_begin_write(mesh_t *mesh);
+
+/*
+ * Function: mesh_end_write
+ * End a write session started with <mesh_begin_write>.
+ */
+void mesh_end_write(mesh_t *mesh);
+
 // XXX: we should remove this one I guess.
 void mesh_remove_empty_blocks(mesh_t *mesh, bool fast);
 
@@ -144,6 +221,15 @@ void mesh_remove_empty_blocks(mesh_t *mesh, bool fast);
  */
 void mesh_clear_block(mesh_t *mesh, mesh_iterator_t *it, const int pos[3]);
 
+/*
+ * Function: mesh_fill_block
+ * Set all the voxels of a block to the same value.
+ *
+ * The block data is stored uniform and shared with the other blocks filled
+ * with the same value, so this is much faster than setting each voxel.
+ */
+void mesh_fill_block(mesh_t *mesh, const int pos[3], const uint8_t v[4]);
+
 /*
  * Function: mesh_is_empty
  *
@@ -194,6 +280,26 @@ mesh_iterator_t mesh_get_union_iterator(
 
 int mesh_iter(mesh_iterator_t *it, int pos[3]);
 
+/*
+ * Function: mesh_raycast
+ * Find the first non empty voxel hit by a ray.
+ *
+ * This walks the blocks along the ray with a 3D DDA, and only walks the
+ * voxels of the non empty blocks, using their occupancy masks.
+ *
+ * Parameters:
+ *   mesh   - The mesh.
+ *   origin - Origin of the ray.
+ *   dir    - Direction of the ray.
+ *   pos    - Set to the position of the voxel hit.
+ *   normal - Set to the normal of the face of the voxel hit.
+ *
+ * Return:
+ *   True if the ray hit a voxel.
+ */
+bool mesh_raycast(const mesh_t *mesh, const float origin[3],
+                  const float dir[3], int pos[3], int normal[3]);
+
 /*
  * Function: mesh_get_key
  *
@@ -214,23 +320,529 @@ int mesh_iter(mesh_iterator_t *it, int pos[3]);
  */
 uint64_t mesh_get_key(const mesh_t *mesh);
 
+/*
+ * Function: mesh_get_blocks_array_size
+ * Return the size of the mesh blocks array.
+ *
+ * The blocks of a mesh are stored in a dense array in insertion order,
+ * that can be directly indexed with <mesh_get_block_pos_by_index>, for
+ * example to process the blocks in parallel.  The array can have holes
+ * left by removed blocks, so its size can be bigger than the number of
+ * blocks.  The indices are only valid until new blocks are added.
+ */
+int mesh_get_blocks_array_size(const mesh_t *mesh);
+
+/*
+ * Function: mesh_get_block_pos_by_index
+ * Get the position of a block from its index in the mesh blocks array.
+ *
+ * Parameters:
+ *   mesh  - The mesh.
+ *   index - Index between zero and <mesh_get_blocks_array_size>.
+ *   pos   - Set to the position of the block.
+ *
+ * Return:
+ *   False if there is no block at this index.
+ */
+bool mesh_get_block_pos_by_index(const mesh_t *mesh, int index, int pos[3]);
+
+/*
+ * Function: mesh_get_version
+ * Return the current version of the mesh changes journal.
+ *
+ * Each modification of the blocks of a mesh is recorded into a journal, so
+ * that we can ask for the blocks modified since a given version with
+ * <mesh_get_changes>.  Contrary to the mesh key, the version only changes
+ * when some blocks are actually modified.
+ */
+uint64_t mesh_get_version(const mesh_t *mesh);
+
+/*
+ * Function: mesh_get_changes
+ * Get the positions of the blocks modified since a given version.
+ *
+ * The version must come from <mesh_get_version>, either called on this
+ * mesh, or on a mesh that this mesh has been copied from.
+ *
+ * Parameters:
+ *   mesh       - The mesh.
+ *   version    - A previous version of the mesh.
+ *   blocks_pos - Set to an allocated array of the modified blocks
+ *                positions, without duplicates.  The caller should free it.
+ *
+ * Return:
+ *   The number of modified blocks, or -1 if the journal doesn't go back to
+ *   the given version (for example after a mesh_clear, or if the version
+ *   is too old), in which case the whole mesh should be considered
+ *   modified.
+ */
+int mesh_get_changes(const mesh_t *mesh, uint64_t version,
+                     int (**blocks_pos)[3]);
+
+/*
+ * Function: mesh_get_block_data
+ * Get the raw voxels data of a block.
+ *
+ * Blocks stored in a compressed format (uniform or palette) don't have any
+ * voxels array, in that case this returns NULL, as well as for the blocks
+ * that are paged out.  Use <mesh_read> to get the values of a block.  The
+ * voxels are not in the linear order if the blocks use the Morton layout.
+ *
+ * This also marks the block as used, so that it doesn't get paged out by
+ * <mesh_page_out>.
+ *
+ * Parameters:
+ *   mesh     - The mesh.
+ *   accessor - Optional accessor pointing to the block.
+ *   bpos     - Position of the block.
+ *   id       - Set to the id of the block data, or zero if the block is
+ *              not in the mesh.  Blocks data with the same id have the
+ *              same value.
+ */
 void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *accessor,
                           const int bpos[3], uint64_t *id);
 
+/*
+ * Function: mesh_get_block_alpha_range
+ * Get a range containing the alpha values of all the voxels of a block.
+ *
+ * This only looks at the block occupancy mask and storage format, without
+ * reading the voxels, so the range can be larger than the actual one.  The
+ * blocks not in the mesh have a zero range, and the paged blocks are not
+ * loaded.
+ *
+ * Parameters:
+ *   mesh     - The mesh.
+ *   accessor - Optional accessor pointing to the block.
+ *   bpos     - Position of the block.
+ *   range    - Set to the minimum and maximum alpha values.
+ */
+void mesh_get_block_alpha_range(const mesh_t *mesh, mesh_accessor_t *accessor,
+                                const int bpos[3], uint8_t range[2]);
+
 // Maybe replace this with a generic mesh_copy_part function?
 void mesh_copy_block(const mesh_t *src, const int src_pos[3],
                      mesh_t *dst, const int dst_pos[3]);
 
+/*
+ * Type: mesh_pager_t
+ * Source of blocks voxels that are only loaded when first accessed.
+ *
+ * Attributes:
+ *   ref      - Reference counter, the pager is released when it drops to
+ *              zero.  Each paged block holds a reference until its voxels
+ *              are loaded.
+ *   load     - Fill the RGBA voxels of a page.  Can be called from any
+ *              thread.  Return false in case of error, in which case the
+ *              block is left empty.
+ *   release  - Called when the last reference is dropped.
+ *   free_page - Optional, called when a page is not needed anymore, after
+ *              it has been loaded or if its block data is released first.
+ */
+typedef struct mesh_pager mesh_pager_t;
+struct mesh_pager {
+    int ref;
+    bool (*load)(mesh_pager_t *pager, int page, uint8_t *voxels);
+    void (*release)(mesh_pager_t *pager);
+    void (*free_page)(mesh_pager_t *pager, int page);
+};
+
+/*
+ * Function: mesh_pager_release
+ * Decrease the reference counter of a pager.
+ */
+void mesh_pager_release(mesh_pager_t *pager);
+
+/*
+ * Function: mesh_set_block_paged
+ * Set a block of a mesh to some voxels loaded lazily from a pager.
+ *
+ * The block is considered not empty until it is loaded, and it is loaded
+ * the first time any of its voxels are read.
+ *
+ * Parameters:
+ *   mesh   - The mesh.
+ *   pos    - Position of the block, must be aligned to the blocks size.
+ *   pager  - The pager, a new reference is taken.
+ *   page   - Index passed to the pager load function.
+ */
+void mesh_set_block_paged(mesh_t *mesh, const int pos[3],
+                          mesh_pager_t *pager, int page);
+
+/*
+ * Function: mesh_read
+ * Read the voxels of a box of the mesh into a dense array.
+ *
+ * The data is copied directly from the blocks, row by row, so this is
+ * much faster than calling <mesh_get_at> for every voxel.
+ *
+ * Parameters:
+ *   mesh - The mesh.
+ *   pos  - Position of the bottom left corner of the box.
+ *   size - Size of the box.
+ *   data - Output RGBA values, in xyz order.  Must be at least
+ *          size[0] * size[1] * size[2] * 4 bytes.
+ */
 void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data);
 
+/*
+ * Function: mesh_write
+ * Write a dense array of voxels into a box of the mesh.
+ *
+ * This is the opposite of <mesh_read>: all the voxels in the box are
+ * replaced, including with the empty values.
+ * The blocks fully covered by the box get new data without reading the
+ * previous one, and the blocks left empty are removed.
+ *
+ * Parameters:
+ *   mesh - The mesh.
+ *   pos  - Position of the bottom left corner of the box.
+ *   size - Size of the box.
+ *   data - RGBA values, in xyz order.
+ */
+void mesh_write(mesh_t *mesh,
+                const int pos[3], const int size[3],
+                const uint8_t *data);
+
+// Flags of mesh_foreach_block.
+enum {
+    MESH_FOREACH_PARALLEL   = 1 << 0,
+    MESH_FOREACH_UNIQUE     = 1 << 1,
+};
+
+/*
+ * Function: mesh_foreach_block
+ * Call a function with the voxels of all the non empty blocks of a mesh.
+ *
+ * The voxels are given as a dense RGBA array of the block, in the xyz
+ * order.  If the block data is stored that way, this is the data itself,
+ * so that there is no copy.  Otherwise (compressed or paged out blocks,
+ * Morton layout) the voxels are decoded into a temporary buffer.  The
+ * voxels are only valid during the call, and the mesh must not be modified
+ * until the function returns.
+ *
+ * Parameters:
+ *   mesh  - The mesh.
+ *   flags - Union of:
+ *           MESH_FOREACH_PARALLEL - Do the calls from a pool of threads
+ *           with <parallel_for>, in any order.
+ *           MESH_FOREACH_UNIQUE - Only do one call per block data id,
+ *           with the position of any of the blocks that use it.
+ *   func  - The function called for each block, with the block position,
+ *           its data id and its voxels.
+ *   user  - User data passed to the function.
+ *
+ * Return:
+ *   The number of calls.
+ */
+int mesh_foreach_block(const mesh_t *mesh, int flags,
+                       void (*func)(void *user, const int pos[3],
+                                    uint64_t id,
+                                    const uint8_t (*voxels)[4]),
+                       void *user);
+
+/*
+ * Function: mesh_replace_colors
+ * Replace some colors by others in all the voxels of a mesh.
+ *
+ * This is a lot faster than setting the voxels one by one: only the blocks
+ * that contain a source color are rewritten, in parallel, and the indexed
+ * blocks only get a new palette.
+ *
+ * Parameters:
+ *   mesh - The mesh.
+ *   nb   - Number of colors to replace (up to 256).
+ *   src  - The colors to replace.  The empty colors (zero alpha) are
+ *          ignored.  If a color is given twice, the first one is used.
+ *   dst  - The new colors.  The voxels replaced by an empty color are
+ *          removed.
+ *
+ * Return:
+ *   The number of modified blocks.
+ */
+int mesh_replace_colors(mesh_t *mesh, int nb, const uint8_t (*src)[4],
+                        const uint8_t (*dst)[4]);
+
 typedef struct {
     int       nb_meshes;
     int       nb_blocks;
+    int       nb_compressed; // Uniform or palette blocks.
     uint64_t  mem;
+    // Number of blocks data replaced by an identical one since the start,
+    // and the memory saved that way.
+    int       nb_dedup;
+    uint64_t  dedup_mem;
+    // Hot path counters since the start, see utils/counters.h.
+    uint64_t  nb_lookups;       // Blocks hash table lookups.
+    uint64_t  nb_accessor_hits; // Blocks found from an accessor cache.
+    uint64_t  nb_block_copies;  // Copy on write of blocks data.
+    uint64_t  nb_table_copies;  // Copy on write of meshes blocks tables.
+    // Memory allocated by the blocks memory pools, used or not.
+    uint64_t  pools_mem;
+    // Blocks data currently paged out by <mesh_page_out>, the memory and
+    // spill file size of their compressed voxels, and the number of page
+    // outs and page ins since the start.
+    int       nb_paged;
+    uint64_t  paged_mem;
+    uint64_t  spill_size;
+    uint64_t  nb_page_outs;
+    uint64_t  nb_page_ins;
 } mesh_global_stats_t;
 
 void mesh_get_global_stats(mesh_global_stats_t *stats);
 
+/*
+ * Function: mesh_set_paging
+ * Set the memory budget of the blocks data.
+ *
+ * When the blocks memory goes over the budget, <mesh_page_out> moves the
+ * voxels of the least recently used blocks out of the RAM, compressed,
+ * either in memory or in a spill file.  They are loaded back the first
+ * time they are read, like the blocks set with <mesh_set_block_paged>.
+ *
+ * The blocks already paged out stay where they are.
+ *
+ * Parameters:
+ *   budget     - Maximum memory of the blocks data, or zero to disable the
+ *                paging.
+ *   spill_dir  - Directory where to create the spill file, or NULL to keep
+ *                the compressed voxels in memory.
+ *
+ * Return:
+ *   0 on success, -1 if the spill file could not be created, in which
+ *   case the compressed voxels are kept in memory.
+ */
+int mesh_set_paging(uint64_t budget, const char *spill_dir);
+
+/*
+ * Function: mesh_page_out
+ * Page out the least recently used blocks data of some meshes, until the
+ * blocks memory is under the budget set with <mesh_set_paging>.
+ *
+ * Each call also starts a new period for the blocks usage, so this should
+ * be called once per frame.  It does nothing if the memory is under the
+ * budget.  The blocks read or rendered (see <mesh_get_block_data>) since
+ * the previous call are never paged out.
+ *
+ * Since the voxels are released in place, this must be called when no
+ * other thread is reading any mesh.  If nb is zero, this only starts a
+ * new period.
+ */
+void mesh_page_out(const mesh_t **meshes, int nb);
+
+/*
+ * Function: mesh_set_spill_dir
+ * Set the directory of the spill file used by <mesh_spill>.
+ *
+ * The file is created for the session, and removed once all its pages
+ * have been loaded back or released.
+ *
+ * Parameters:
+ *   dir - Directory where to create the file, or NULL to disable
+ *         <mesh_spill>.
+ *
+ * Return:
+ *   0 on success, -1 if the file could not be created.
+ */
+int mesh_set_spill_dir(const char *dir);
+
+/*
+ * Function: mesh_spill
+ * Move the voxels of the blocks data only used by a mesh into the spill
+ * file set with <mesh_set_spill_dir>.
+ *
+ * This doesn't change the value of the mesh: the data keep their ids, and
+ * are loaded back the first time they are read.  The data shared by
+ * several blocks are only written once.  This is used for the old undo
+ * history snapshots.  Like <mesh_page_out>, this must be called when no
+ * other thread is reading any mesh.
+ *
+ * Return:
+ *   The number of blocks data written.
+ */
+int mesh_spill(mesh_t *mesh);
+
+/*
+ * Function: mesh_trim_pools
+ * Give back to the system the unused memory of the blocks memory pools.
+ */
+void mesh_trim_pools(void);
+
+/*
+ * Type: mesh_stats_t
+ * Statistics about the voxels of a mesh, see <mesh_get_stats>.
+ *
+ * Attributes:
+ *   nb_blocks  - Number of non empty blocks.
+ *   nb_voxels  - Number of non empty voxels.
+ *   max_colors - Upper bound of the number of different colors, that can
+ *                be used to allocate a palette.
+ */
+typedef struct {
+    int         nb_blocks;
+    int64_t     nb_voxels;
+    int64_t     max_colors;
+} mesh_stats_t;
+
+/*
+ * Function: mesh_get_stats
+ * Get the number of voxels of a mesh without iterating them.
+ *
+ * The values come from counters kept in each block, and are cached until
+ * the mesh changes.  The blocks not loaded yet from a file are loaded.
+ */
+void mesh_get_stats(const mesh_t *mesh, mesh_stats_t *stats);
+
+/*
+ * Function: mesh_get_hash
+ * Return a 64 bits hash of the voxels of a mesh.
+ *
+ * Two meshes with the same voxels have the same hash, whatever the way
+ * their blocks are stored.  As with <mesh_diff>, the voxels with a zero
+ * alpha are all considered equal, and the empty blocks are ignored.
+ *
+ * The hash is computed from the positions and content hashes of the
+ * blocks.  The blocks hashes are kept until the blocks are modified, and
+ * the mesh hash until the mesh changes, so this is only expensive for the
+ * modified blocks.
+ */
+uint64_t mesh_get_hash(const mesh_t *mesh);
+
+/*
+ * Function: mesh_get_mem
+ * Return the memory used by a mesh and its blocks data, in bytes.
+ *
+ * A block data shared by several blocks of the mesh is only counted once.
+ * This is used to give a cost to the meshes kept in caches.
+ */
+int mesh_get_mem(const mesh_t *mesh);
+
+/*
+ * Function: mesh_set_dedup
+ * Enable or disable the blocks deduplication.
+ *
+ * If enabled (the default), the blocks content is hashed when they get
+ * compressed (see <mesh_remove_empty_blocks>), and the blocks with the same
+ * content share the same data, even across unrelated meshes.
+ */
+void mesh_set_dedup(bool enabled);
+
+/*
+ * Function: mesh_get_unshared_mem
+ * Return the memory used by the blocks data of a mesh that are not also
+ * used at the same position in an other mesh.
+ *
+ * Parameters:
+ *   mesh  - The mesh.
+ *   other - The other mesh, or NULL to get all the blocks memory.
+ */
+uint64_t mesh_get_unshared_mem(const mesh_t *mesh, const mesh_t *other);
+
+/*
+ * Function: mesh_compact
+ * Compress the blocks data that are only used by this mesh.
+ *
+ * This doesn't change the value of the mesh.  It is used for the old undo
+ * history snapshots, that are not likely to be read again soon.
+ */
+void mesh_compact(mesh_t *mesh);
+
+/*
+ * Function: mesh_make_delta
+ * Store a mesh as the changes needed to go from an other mesh to it.
+ *
+ * After this call the mesh only keeps the blocks that differ from the base
+ * mesh, and can only be deleted or restored with <mesh_apply_delta>.  The
+ * key of the mesh doesn't change.  This is used for the undo history.
+ *
+ * Parameters:
+ *   mesh - The mesh to convert.
+ *   base - A mesh that has been modified from the mesh.
+ *
+ * Return:
+ *   false if the base mesh changes journal doesn't go back to the mesh, in
+ *   which case the mesh is not modified.
+ */
+bool mesh_make_delta(mesh_t *mesh, const mesh_t *base);
+
+/*
+ * Function: mesh_apply_delta
+ * Restore a mesh stored with <mesh_make_delta>.
+ *
+ * The base mesh must have the same value as when the delta was created.
+ * Its blocks are moved to the restored mesh, and it becomes in turn stored
+ * as the changes relative to the restored mesh.  The cost is proportional
+ * to the number of changed blocks.
+ */
+void mesh_apply_delta(mesh_t *mesh, mesh_t *base);
+
+/*
+ * Function: mesh_is_delta
+ * Return true if a mesh is stored as changes relative to an other mesh.
+ */
+bool mesh_is_delta(const mesh_t *mesh);
+
+/* Enum: MESH_DIFF
+ * Kinds of block differences, and flags of <mesh_diff>.
+ *
+ * MESH_DIFF_ADDED   - The block is empty in the first mesh only.
+ * MESH_DIFF_REMOVED - The block is empty in the second mesh only.
+ * MESH_DIFF_CHANGED - The block has different voxels in both meshes.
+ * MESH_DIFF_VOXELS  - Flag to also compute the changed voxels.
+ */
+enum {
+    MESH_DIFF_ADDED     = 1,
+    MESH_DIFF_REMOVED   = 2,
+    MESH_DIFF_CHANGED   = 3,
+
+    MESH_DIFF_VOXELS    = 1 << 0,
+};
+
+/*
+ * Type: mesh_diff_t
+ * A block that differs between two meshes.
+ *
+ * Attributes:
+ *   type      - One of MESH_DIFF_ADDED, MESH_DIFF_REMOVED or
+ *               MESH_DIFF_CHANGED.
+ *   pos       - Position of the block.
+ *   nb_voxels - Number of changed voxels (only with MESH_DIFF_VOXELS).
+ *   mask      - Bits mask of the changed voxels, one row along x for each
+ *               y + z * BLOCK_SIZE (only with MESH_DIFF_VOXELS, else NULL).
+ */
+typedef struct {
+    int                 type;
+    int                 pos[3];
+    int                 nb_voxels;
+    const block_row_t   *mask;
+} mesh_diff_t;
+
+/*
+ * Function: mesh_diff
+ * Compare two meshes block by block.
+ *
+ * The blocks that share the same data, as the blocks of meshes copied from
+ * each other, or the identical blocks deduplicated by the intern table, are
+ * skipped without reading their voxels.  The other blocks are compared in
+ * parallel.  The voxels with a zero alpha are all considered equal, and a
+ * missing block is the same as an empty one.
+ *
+ * Parameters:
+ *   a        - The first mesh.
+ *   b        - The second mesh.
+ *   flags    - Zero or MESH_DIFF_VOXELS.
+ *   callback - Called from the calling thread for each block that differs,
+ *              in no particular order.  Can be NULL.
+ *   user     - User data passed to the callback.
+ *
+ * Return:
+ *   The number of blocks that differ, so zero if the meshes have the same
+ *   voxels.
+ */
+int mesh_diff(const mesh_t *a, const mesh_t *b, int flags,
+              void (*callback)(void *user, const mesh_diff_t *diff),
+              void *user);
+
 #endif // MESH_H
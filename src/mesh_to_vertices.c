@@ -18,6 +18,10 @@
 
 
 #include "goxel.h"
+#include "xxhash.h"
+#include "utils/parallel.h"
+
+#include <pthread.h>
 
 static const int N = BLOCK_SIZE;
 
@@ -148,25 +152,98 @@ static uint8_t block_get_shadow_mask(uint32_t neighboors_mask, int f)
     return ret;
 }
 
-static uint8_t block_get_border_mask(uint32_t neighboors_mask, int f)
+/*
+ * Lookup tables of the values computed from the 27 bits neighbours masks.
+ *
+ * The shadow mask of a face is a OR of some of the mask bits, so we can
+ * split the mask into its three z slices of 9 bits, and OR the values of
+ * each slice.  For each face and slice we store:
+ *
+ *   bits 0-7:   the shadow mask, see block_get_shadow_mask.
+ *   bits 8-11:  the neighbours next to each edge of the face (t).
+ *   bits 12-15: the neighbours over each edge of the face (n + t).
+ *
+ * The border mask only depends on bits 8-15, and is given by a second
+ * table.  The gradient only depends on the difference of the number of
+ * neighbours on each side of the voxel along the three axis, from -9 to 9,
+ * if all the neighbours have the same alpha.
+ */
+static uint16_t g_faces_table[6][3][512];
+static uint8_t g_borders_table[256];
+static int8_t g_gradients_table[19][19][19][3];
+static pthread_once_t g_tables_once = PTHREAD_ONCE_INIT;
+
+static void tables_init(void)
 {
 #define M(x, y, z) (1 << ((x + 1) + (y + 1) * 3 + (z + 1) * 9))
-    int e;
-    uint8_t ret = 0;
+    int f, s, i, e, x, y, z, smax;
+    uint32_t mask;
+    uint16_t v;
     const int *n, *t;
-    for (e = 0; e < 4; e++) {
+
+    for (f = 0; f < 6; f++)
+    for (s = 0; s < 3; s++)
+    for (i = 0; i < 512; i++) {
+        mask = (uint32_t)i << (s * 9);
+        v = block_get_shadow_mask(mask, f);
         n = FACES_NORMALS[f];
-        t = FACES_NORMALS[FACES_NEIGHBORS[f][e]];
-        if (neighboors_mask & M(n[0] + t[0], n[1] + t[1], n[2] + t[2])) {
-            ret |= 2 << (2 * e);
-        } else if (!(neighboors_mask & M(t[0], t[1], t[2]))) {
-            ret |= 1 << (2 * e);
+        for (e = 0; e < 4; e++) {
+            t = FACES_NORMALS[FACES_NEIGHBORS[f][e]];
+            if (mask & M(t[0], t[1], t[2]))
+                v |= 0x100 << e;
+            if (mask & M(n[0] + t[0], n[1] + t[1], n[2] + t[2]))
+                v |= 0x1000 << e;
         }
+        g_faces_table[f][s][i] = v;
+    }
+    for (i = 0; i < 256; i++) {
+        for (e = 0; e < 4; e++) {
+            if (i & (0x10 << e))
+                g_borders_table[i] |= 2 << (2 * e);
+            else if (!(i & (1 << e)))
+                g_borders_table[i] |= 1 << (2 * e);
+        }
+    }
+    for (z = -9; z <= 9; z++)
+    for (y = -9; y <= 9; y++)
+    for (x = -9; x <= 9; x++) {
+        smax = max(abs(x), max(abs(y), abs(z)));
+        if (!smax) continue;
+        g_gradients_table[z + 9][y + 9][x + 9][0] = x * 127 / smax;
+        g_gradients_table[z + 9][y + 9][x + 9][1] = y * 127 / smax;
+        g_gradients_table[z + 9][y + 9][x + 9][2] = z * 127 / smax;
     }
-    return ret;
 #undef M
 }
 
+// Get the shadow and border masks of a face from the tables.
+static void get_face_masks(uint32_t neighboors_mask, int f,
+                           uint8_t *shadow_mask, uint8_t *borders_mask)
+{
+    uint16_t v = g_faces_table[f][0][neighboors_mask & 511] |
+                 g_faces_table[f][1][(neighboors_mask >> 9) & 511] |
+                 g_faces_table[f][2][neighboors_mask >> 18];
+    *shadow_mask = v & 0xff;
+    *borders_mask = g_borders_table[v >> 8];
+}
+
+/*
+ * Same as block_get_gradient, from the tables, when all the neighbours in
+ * the mask have the same alpha value.  Set the gradient to zero if the
+ * face normal should be used instead.
+ */
+static void get_mask_gradient(uint32_t neighboors_mask, int8_t gradient[3])
+{
+    // Masks of the neighbours at -1 along x, y and z.
+    const uint32_t X = 0x1249249, Y = 0x01c0e07, Z = 0x00001ff;
+    const uint32_t m = neighboors_mask;
+    memcpy(gradient, g_gradients_table
+            [9 + __builtin_popcount(m & Z) - __builtin_popcount(m & Z << 18)]
+            [9 + __builtin_popcount(m & Y) - __builtin_popcount(m & Y << 6)]
+            [9 + __builtin_popcount(m & X) - __builtin_popcount(m & X << 2)],
+           3);
+}
+
 #define data_get_at(d, x, y, z, out) do { \
     memcpy(out, &data[( \
                 ((x) + 1) + \
@@ -192,6 +269,70 @@ static uint32_t get_neighboors(const uint8_t *data,
     return ret;
 }
 
+// A row of voxels of the block with one voxel of margin on each side.
+#if BLOCK_SIZE > 16
+typedef uint64_t padded_row_t;
+#else
+typedef uint32_t padded_row_t;
+#endif
+
+/*
+ * Compute the visibility mask of each row of voxels of the block: bit x is
+ * set if the voxel is solid and has at least one of its six faces
+ * visible.  We first compute the solid bits of all the rows of the
+ * (N + 2)^3 cube, so that testing the faces is only a few shifts and ANDs
+ * per row.  The solid rows are also returned in rows, and the rows of the
+ * solid voxels that are not fully opaque in partial_rows.  Return true if
+ * there is any of those.
+ */
+static bool get_visible_rows(const uint8_t *data,
+                             block_row_t visible[BLOCK_SIZE * BLOCK_SIZE],
+                             padded_row_t *rows, padded_row_t *partial_rows)
+{
+    const int S = N + 2;
+    padded_row_t r, hidden, partial = 0;
+    int x, y, z;
+    uint8_t a;
+
+    memset(rows, 0, S * S * sizeof(*rows));
+    memset(partial_rows, 0, S * S * sizeof(*partial_rows));
+    for (z = 0; z < S; z++)
+    for (y = 0; y < S; y++)
+    for (x = 0; x < S; x++) {
+        a = data[((z * S + y) * S + x) * 4 + 3];
+        if (a < 127) continue;
+        rows[z * S + y] |= (padded_row_t)1 << x;
+        if (a != 255) partial_rows[z * S + y] |= (padded_row_t)1 << x;
+        partial |= partial_rows[z * S + y];
+    }
+#define ROW(y, z) (rows[((z) + 1) * S + (y) + 1])
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        r = ROW(y, z);
+        hidden = (r >> 1) & (r << 1) &
+                 ROW(y - 1, z) & ROW(y + 1, z) &
+                 ROW(y, z - 1) & ROW(y, z + 1);
+        visible[z * N + y] = (block_row_t)((r & ~hidden) >> 1);
+    }
+#undef ROW
+    return partial != 0;
+}
+
+/*
+ * Get the 27 bits neighbours mask of a voxel from the padded rows: each
+ * of the nine rows around the voxel gives three bits at once.
+ */
+static uint32_t get_rows_mask(const padded_row_t *rows, int x, int y, int z)
+{
+    const int S = N + 2;
+    int i;
+    uint32_t ret = 0;
+    for (i = 0; i < 9; i++)
+        ret |= (uint32_t)((rows[(z + i / 3) * S + y + i % 3] >> x) & 7)
+                    << (i * 3);
+    return ret;
+}
+
 /* Packing of block id, pos, and face:
  *
  *    x   :  4 bits
@@ -201,34 +342,186 @@ static uint32_t get_neighboors(const uint8_t *data,
  *    face:  3 bits
  *    -------------
  *    tot : 16 bits
+ *
+ * With blocks of 32 the position is only given modulo 16.  The pick
+ * buffer doesn't use it for the quads, since the pos_data shader computes
+ * the positions of the packed vertices itself.
  */
 static uint16_t get_pos_data(uint16_t x, uint16_t y, uint16_t z, uint16_t f)
 {
-    assert(BLOCK_SIZE == 16);
-    return (x << 12) | (y << 8) | (z << 4) | (f << 0);
+    return ((x & 15) << 12) | ((y & 15) << 8) | ((z & 15) << 4) | (f << 0);
 }
 
 
-int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
-                           int effects, voxel_vertex_t *out,
-                           int *size, int *subdivide)
+/*
+ * Put a quad face f covering size voxels starting at pos.  The size along
+ * the normal axis should be one.
+ */
+static void put_quad(voxel_vertex_t *out, int f,
+                     const int pos[3], const int size[3],
+                     const uint8_t color[4], const int8_t gradient[3],
+                     uint8_t shadow_mask, uint8_t borders_mask)
 {
-    int x, y, z, f;
-    int i, nb = 0;
-    uint32_t neighboors_mask;
-    uint8_t shadow_mask, borders_mask;
+    int i, j;
     const int ts = VOXEL_TEXTURE_SIZE;
-    uint8_t *data, neighboors[27], v[4];
-    int8_t normal[3], tangent[3], gradient[3];
-    int pos[3];
     const int *vpos;
+    int8_t normal[3], tangent[3];
 
-    if (effects & EFFECT_MARCHING_CUBES)
-        return mesh_generate_vertices_mc(mesh, block_pos, effects, out,
-                                         size, subdivide);
+    block_get_normal(f, normal, tangent);
+    for (i = 0; i < 4; i++) {
+        vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+        for (j = 0; j < 3; j++)
+            out[i].pos[j] = pos[j] + vpos[j] * size[j];
+        memcpy(out[i].normal, normal, sizeof(normal));
+        memcpy(out[i].tangent, tangent, sizeof(tangent));
+        memcpy(out[i].gradient, gradient, 3);
+        memcpy(out[i].color, color, 4);
+        out[i].color[3] = out[i].color[3] ? 255 : 0;
+        out[i].occlusion_uv[0] =
+            shadow_mask % 16 * ts + VERTICE_UV[i][0] * (ts - 1);
+        out[i].occlusion_uv[1] =
+            shadow_mask / 16 * ts + VERTICE_UV[i][1] * (ts - 1);
+        out[i].uv[0] = VERTICE_UV[i][0] * 255;
+        out[i].uv[1] = VERTICE_UV[i][1] * 255;
+        // For testing:
+        // This put a border bump on all the edges of the voxel.
+        out[i].bump_uv[0] = (borders_mask % 16) * 16;
+        out[i].bump_uv[1] = (borders_mask / 16) * 16;
+        out[i].pos_data = get_pos_data(pos[0], pos[1], pos[2], f);
+    }
+}
 
-    *size = 4;      // Quad.
-    *subdivide = 1; // Unit is one voxel.
+/*
+ * Faces waiting to be merged, stored per face direction, and then per
+ * slice along the normal axis.
+ */
+typedef struct {
+    uint8_t color[4];
+    int8_t  gradient[3];
+    bool    set;
+} merge_face_t;
+
+#define MERGE_FACE_AT(faces, f, s, u, v) \
+    (faces[(((f) * N + (s)) * N + (v)) * N + (u)])
+
+static bool merge_face_eq(const merge_face_t *a, const merge_face_t *b)
+{
+    return b->set &&
+           a->color[0] == b->color[0] && a->color[1] == b->color[1] &&
+           a->color[2] == b->color[2] && !a->color[3] == !b->color[3] &&
+           memcmp(a->gradient, b->gradient, 3) == 0;
+}
+
+/*
+ * Greedy merge all the faces of a given direction into rectangles, and put
+ * the corresponding quads.  Return the number of quads.
+ */
+static int merge_faces(merge_face_t *faces, int f, voxel_vertex_t *out)
+{
+    int n, u, v, s, i, j, w, h, k, nb = 0;
+    int pos[3], size[3];
+    merge_face_t face;
+
+    // Axis of the normal, and the two axis of the slices.
+    n = FACES_NORMALS[f][0] ? 0 : FACES_NORMALS[f][1] ? 1 : 2;
+    u = (n + 1) % 3;
+    v = (n + 2) % 3;
+
+    for (s = 0; s < N; s++)
+    for (j = 0; j < N; j++)
+    for (i = 0; i < N; i++) {
+        face = MERGE_FACE_AT(faces, f, s, i, j);
+        if (!face.set) continue;
+        for (w = 1; i + w < N; w++) {
+            if (!merge_face_eq(&face, &MERGE_FACE_AT(faces, f, s, i + w, j)))
+                break;
+        }
+        for (h = 1; j + h < N; h++) {
+            for (k = 0; k < w; k++) {
+                if (!merge_face_eq(&face,
+                            &MERGE_FACE_AT(faces, f, s, i + k, j + h)))
+                    break;
+            }
+            if (k < w) break;
+        }
+        for (k = 0; k < w * h; k++)
+            MERGE_FACE_AT(faces, f, s, i + k % w, j + k / w).set = false;
+        pos[n] = s;
+        pos[u] = i;
+        pos[v] = j;
+        size[n] = 1;
+        size[u] = w;
+        size[v] = h;
+        put_quad(out + nb * 4, f, pos, size, face.color, face.gradient, 0, 0);
+        nb++;
+    }
+    return nb;
+}
+
+/*
+ * A visible face of a voxel, before it is turned into a quad.
+ */
+typedef struct {
+    uint8_t pos[3];
+    uint8_t f;
+    uint8_t color[4];
+    int8_t  gradient[3];
+    uint8_t shadow_mask;
+    uint8_t borders_mask;
+} block_face_t;
+
+/*
+ * Parts of a block whose faces are cached separately by mesh_get_vertices,
+ * so that changing a block doesn't tessellate again all its neighbours.
+ * The faces of a voxel only depend on its 26 neighbours, so the interior
+ * voxels only depend on the block data, the voxels of each side (without
+ * the edges) also depend on the neighbour block on this side, and only
+ * the voxels of the edges and corners depend on all the neighbours.
+ */
+enum {
+    PART_INTERIOR = 0,
+    PART_SIDE,          // Six parts, in the FACES_NORMALS order.
+    PART_EDGES = PART_SIDE + 6,
+    PARTS_COUNT,
+};
+
+static int get_voxel_part(const int pos[3])
+{
+    int i, f, nb = 0, d[3];
+    for (i = 0; i < 3; i++) {
+        d[i] = pos[i] == 0 ? -1 : pos[i] == N - 1 ? +1 : 0;
+        nb += d[i] != 0;
+    }
+    if (nb == 0) return PART_INTERIOR;
+    if (nb > 1) return PART_EDGES;
+    for (f = 0; f < 6; f++) {
+        if (memcmp(FACES_NORMALS[f], d, sizeof(d)) == 0)
+            return PART_SIDE + f;
+    }
+    assert(false);
+    return PART_EDGES;
+}
+
+/*
+ * Compute the visible faces of the voxels of a block that are in a set of
+ * parts (bit i set for the part i).  The faces are sorted by voxel, in the
+ * z, y, x order, and then by face.  Return the number of faces.
+ */
+static int get_block_faces(const mesh_t *mesh, const int block_pos[3],
+                           int effects, int parts, block_face_t *out)
+{
+    int x, y, z, f, pos[3], nb = 0;
+    block_row_t visible[BLOCK_SIZE * BLOCK_SIZE], row;
+    padded_row_t rows[(BLOCK_SIZE + 2) * (BLOCK_SIZE + 2)];
+    padded_row_t partial_rows[(BLOCK_SIZE + 2) * (BLOCK_SIZE + 2)];
+    uint32_t neighboors_mask;
+    uint8_t *data, neighboors[27], v[4];
+    int8_t voxel_gradient[3];
+    bool has_partial, partial;
+    block_face_t *face;
+    const bool all = parts == (1 << PARTS_COUNT) - 1;
+
+    pthread_once(&g_tables_once, tables_init);
 
     // To speed things up we first get the voxel cube around the block.
     // XXX: can we do this while still using mesh iterators somehow?
@@ -238,47 +531,580 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
               IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
               IVEC(N + 2, N + 2, N + 2), data);
 
+    has_partial = get_visible_rows(data, visible, rows, partial_rows);
+
     for (z = 0; z < N; z++)
     for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
+    for (row = visible[z * N + y]; row; row &= row - 1) {
+        x = __builtin_ctz(row);
         pos[0] = x;
         pos[1] = y;
         pos[2] = z;
+        if (!all && !(parts & (1 << get_voxel_part(pos)))) continue;
         data_get_at(data, x, y, z, v);
-        if (v[3] < 127) continue;    // Non visible
-        neighboors_mask = get_neighboors(data, pos, neighboors);
+        neighboors_mask = get_rows_mask(rows, x, y, z);
+        // The gradient is weighted by the neighbours alpha, so we only
+        // use the tables if they are all opaque.
+        partial = has_partial && get_rows_mask(partial_rows, x, y, z);
+        if (partial)
+            get_neighboors(data, pos, neighboors);
+        else
+            get_mask_gradient(neighboors_mask, voxel_gradient);
+        for (f = 0; f < 6; f++) {
+            if (!block_is_face_visible(neighboors_mask, f)) continue;
+            face = &out[nb++];
+            face->pos[0] = x;
+            face->pos[1] = y;
+            face->pos[2] = z;
+            face->f = f;
+            memcpy(face->color, v, 4);
+            get_face_masks(neighboors_mask, f, &face->shadow_mask,
+                           &face->borders_mask);
+            if (effects & EFFECT_FLAT_FACES) {
+                face->gradient[0] = FACES_NORMALS[f][0];
+                face->gradient[1] = FACES_NORMALS[f][1];
+                face->gradient[2] = FACES_NORMALS[f][2];
+                face->shadow_mask = 0;
+            } else if (partial) {
+                block_get_gradient(neighboors_mask, neighboors, f,
+                                   face->gradient);
+            } else if (voxel_gradient[0] || voxel_gradient[1] ||
+                       voxel_gradient[2]) {
+                memcpy(face->gradient, voxel_gradient, 3);
+            } else {
+                face->gradient[0] = FACES_NORMALS[f][0];
+                face->gradient[1] = FACES_NORMALS[f][1];
+                face->gradient[2] = FACES_NORMALS[f][2];
+            }
+        }
+    }
+    free(data);
+    return nb;
+}
+
+/*
+ * Put the quads of some faces, merging them if EFFECT_MERGE_FACES is set.
+ * Return the number of quads.
+ */
+static int put_faces_quads(const block_face_t *faces, int nb_faces,
+                           int effects, voxel_vertex_t *out)
+{
+    int i, f, n, pos[3], nb = 0;
+    merge_face_t *merge = NULL, *m;
+    const block_face_t *face;
+
+    if (effects & EFFECT_MERGE_FACES)
+        merge = calloc(6 * N * N * N, sizeof(*merge));
+
+    for (i = 0; i < nb_faces; i++) {
+        face = &faces[i];
+        f = face->f;
+        // Faces without occlusion can be merged together.
+        if (merge && !face->shadow_mask) {
+            n = FACES_NORMALS[f][0] ? 0 : FACES_NORMALS[f][1] ? 1 : 2;
+            m = &MERGE_FACE_AT(merge, f, face->pos[n],
+                               face->pos[(n + 1) % 3],
+                               face->pos[(n + 2) % 3]);
+            memcpy(m->color, face->color, 4);
+            memcpy(m->gradient, face->gradient, 3);
+            m->set = true;
+            continue;
+        }
+        pos[0] = face->pos[0];
+        pos[1] = face->pos[1];
+        pos[2] = face->pos[2];
+        put_quad(out + nb * 4, f, pos, IVEC(1, 1, 1), face->color,
+                 face->gradient, face->shadow_mask, face->borders_mask);
+        nb++;
+    }
+    if (merge) {
+        for (f = 0; f < 6; f++)
+            nb += merge_faces(merge, f, out + nb * 4);
+        free(merge);
+    }
+    return nb;
+}
+
+int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
+                           int effects, voxel_vertex_t *out,
+                           int *size, int *subdivide)
+{
+    block_face_t *faces;
+    int nb;
+
+    if (effects & EFFECT_MARCHING_CUBES)
+        return mesh_generate_vertices_mc(mesh, block_pos, effects, out,
+                                         size, subdivide);
+
+    *size = 4;      // Quad.
+    *subdivide = 1; // Unit is one voxel.
+    faces = malloc(N * N * N * 6 * sizeof(*faces));
+    nb = get_block_faces(mesh, block_pos, effects, (1 << PARTS_COUNT) - 1,
+                         faces);
+    nb = put_faces_quads(faces, nb, effects, out);
+    free(faces);
+    return nb;
+}
+
+/*
+ * Downsample the voxels around a block for a given lod level: each cell of
+ * the output is the average color of the solid voxels of a cube of size
+ * (1 << lod), and is solid if any of those voxels is solid.  The output
+ * includes a border of one cell, like the data of mesh_generate_vertices.
+ */
+static void get_lod_data(const mesh_t *mesh, const int block_pos[3],
+                         int lod, uint8_t *out)
+{
+    const int s = 1 << lod, M = N / s, S = M + 2, D = N + 2 * s;
+    int x, y, z, i, c[4], nb;
+    uint8_t *data;
+    const uint8_t *v;
+
+    data = malloc(D * D * D * 4);
+    mesh_read(mesh,
+              IVEC(block_pos[0] - s, block_pos[1] - s, block_pos[2] - s),
+              IVEC(D, D, D), data);
+    for (z = 0; z < S; z++)
+    for (y = 0; y < S; y++)
+    for (x = 0; x < S; x++) {
+        memset(c, 0, sizeof(c));
+        nb = 0;
+        for (i = 0; i < s * s * s; i++) {
+            v = &data[(((z * s + i / (s * s)) * D +
+                         y * s + i / s % s) * D +
+                         x * s + i % s) * 4];
+            if (v[3] < 127) continue;
+            c[0] += v[0];
+            c[1] += v[1];
+            c[2] += v[2];
+            nb++;
+        }
+        out += 4;
+        out[-4] = nb ? c[0] / nb : 0;
+        out[-3] = nb ? c[1] / nb : 0;
+        out[-2] = nb ? c[2] / nb : 0;
+        out[-1] = nb ? 255 : 0;
+    }
+    free(data);
+}
+
+int mesh_generate_vertices_lod(const mesh_t *mesh, const int block_pos[3],
+                               int effects, int lod, voxel_vertex_t *out,
+                               int *size, int *subdivide)
+{
+    const int s = 1 << lod, M = N / s, S = M + 2;
+    int x, y, z, i, f, xx, yy, zz, pos[3], nb = 0;
+    uint32_t neighboors_mask;
+    uint8_t *data, shadow_mask, borders_mask;
+    const uint8_t *v;
+    int8_t gradient[3], voxel_gradient[3];
+
+    if (lod == 0 || (effects & EFFECT_MARCHING_CUBES))
+        return mesh_generate_vertices(mesh, block_pos, effects, out,
+                                      size, subdivide);
+    assert(lod <= 3);
+    *size = 4;
+    *subdivide = 1;
+    pthread_once(&g_tables_once, tables_init);
+    data = malloc(S * S * S * 4);
+    get_lod_data(mesh, block_pos, lod, data);
+
+#define CELL(x, y, z) (&data[((((z) + 1) * S + (y) + 1) * S + (x) + 1) * 4])
+    for (z = 0; z < M; z++)
+    for (y = 0; y < M; y++)
+    for (x = 0; x < M; x++) {
+        v = CELL(x, y, z);
+        if (!v[3]) continue;
+        i = 0;
+        neighboors_mask = 0;
+        for (zz = -1; zz <= 1; zz++)
+        for (yy = -1; yy <= 1; yy++)
+        for (xx = -1; xx <= 1; xx++, i++) {
+            if (CELL(x + xx, y + yy, z + zz)[3]) neighboors_mask |= 1 << i;
+        }
+        // The cells are either empty or opaque.
+        get_mask_gradient(neighboors_mask, voxel_gradient);
         for (f = 0; f < 6; f++) {
             if (!block_is_face_visible(neighboors_mask, f)) continue;
-            block_get_normal(f, normal, tangent);
-            block_get_gradient(neighboors_mask, neighboors, f, gradient);
-            shadow_mask = block_get_shadow_mask(neighboors_mask, f);
-            borders_mask = block_get_border_mask(neighboors_mask, f);
-            for (i = 0; i < 4; i++) {
-                vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
-                out[nb * 4 + i].pos[0] = x + vpos[0];
-                out[nb * 4 + i].pos[1] = y + vpos[1];
-                out[nb * 4 + i].pos[2] = z + vpos[2];
-                memcpy(out[nb * 4 + i].normal, normal, sizeof(normal));
-                memcpy(out[nb * 4 + i].tangent, tangent, sizeof(tangent));
-                memcpy(out[nb * 4 + i].gradient, gradient, sizeof(gradient));
-                memcpy(out[nb * 4 + i].color, v, sizeof(v));
-                out[nb * 4 + i].color[3] = out[nb * 4 + i].color[3] ? 255 : 0;
-                out[nb * 4 + i].occlusion_uv[0] =
-                    shadow_mask % 16 * ts + VERTICE_UV[i][0] * (ts - 1);
-                out[nb * 4 + i].occlusion_uv[1] =
-                    shadow_mask / 16 * ts + VERTICE_UV[i][1] * (ts - 1);
-                out[nb * 4 + i].uv[0] = VERTICE_UV[i][0] * 255;
-                out[nb * 4 + i].uv[1] = VERTICE_UV[i][1] * 255;
-                // For testing:
-                // This put a border bump on all the edges of the voxel.
-                out[nb * 4 + i].bump_uv[0] = (borders_mask % 16) * 16;
-                out[nb * 4 + i].bump_uv[1] = (borders_mask / 16) * 16;
-                out[nb * 4 + i].pos_data = get_pos_data(x, y, z, f);
+            if (voxel_gradient[0] || voxel_gradient[1] || voxel_gradient[2]) {
+                memcpy(gradient, voxel_gradient, 3);
+            } else {
+                gradient[0] = FACES_NORMALS[f][0];
+                gradient[1] = FACES_NORMALS[f][1];
+                gradient[2] = FACES_NORMALS[f][2];
             }
+            get_face_masks(neighboors_mask, f, &shadow_mask, &borders_mask);
+            pos[0] = x * s;
+            pos[1] = y * s;
+            pos[2] = z * s;
+            put_quad(out + nb * 4, f, pos, IVEC(s, s, s), v, gradient,
+                     shadow_mask, 0);
             nb++;
         }
     }
+#undef CELL
     free(data);
     return nb;
 }
 
+void mesh_pack_vertices(const voxel_vertex_t *verts, int nb,
+                        voxel_packed_vertex_t *out)
+{
+    int i;
+    const int ts = VOXEL_TEXTURE_SIZE;
+    const voxel_vertex_t *v;
+
+    _Static_assert(sizeof(voxel_packed_vertex_t) == 12, "");
+    for (i = 0; i < nb; i++) {
+        v = &verts[i];
+        memcpy(out[i].pos, v->pos, 3);
+        memcpy(out[i].color, v->color, 3);
+        memcpy(out[i].gradient, v->gradient, 3);
+        // Invert what put_quad did.
+        out[i].face = (v->pos_data & 0x7) * 4 + i % 4;
+        out[i].shadow_mask = v->occlusion_uv[0] / ts +
+                             v->occlusion_uv[1] / ts * 16;
+        out[i].borders_mask = v->bump_uv[0] / 16 + v->bump_uv[1] / 16 * 16;
+    }
+}
+
+void mesh_pack_faces(const voxel_packed_vertex_t *verts, int nb,
+                     voxel_face_t *out)
+{
+    int i, c, j, f, n, pmin[3], pmax[3];
+    uint32_t data;
+    const voxel_packed_vertex_t *q;
+
+    _Static_assert(sizeof(voxel_face_t) == 8, "");
+    for (i = 0; i < nb; i++) {
+        q = &verts[i * 4];
+        f = q[0].face / 4;
+        for (j = 0; j < 3; j++) {
+            pmin[j] = pmax[j] = q[0].pos[j];
+            for (c = 1; c < 4; c++) {
+                pmin[j] = min(pmin[j], q[c].pos[j]);
+                pmax[j] = max(pmax[j], q[c].pos[j]);
+            }
+        }
+        // Index of the normal axis.
+        n = FACES_NORMALS[f][0] ? 0 : FACES_NORMALS[f][1] ? 1 : 2;
+        data = pmin[0] | pmin[1] << 6 | pmin[2] << 12 | f << 18;
+        if (    pmax[(n + 1) % 3] - pmin[(n + 1) % 3] == 1 &&
+                pmax[(n + 2) % 3] - pmin[(n + 2) % 3] == 1) {
+            data |= (uint32_t)q[0].borders_mask << 21;
+        } else {
+            data |= (uint32_t)(pmax[(n + 1) % 3] - pmin[(n + 1) % 3] - 1)
+                        << 21 |
+                    (uint32_t)(pmax[(n + 2) % 3] - pmin[(n + 2) % 3] - 1)
+                        << 26 |
+                    1u << 31;
+        }
+        out[i].data[0] = data;
+        out[i].data[1] = q[0].color[0] | q[0].color[1] << 8 |
+                         q[0].color[2] << 16 |
+                         (uint32_t)q[0].shadow_mask << 24;
+    }
+}
+
+int mesh_index_vertices(voxel_vertex_t *verts, int nb, uint16_t *indices)
+{
+    int i, nb_unique = 0, *table, capacity = 1, ret;
+    uint32_t h;
+
+    while (capacity < nb * 2) capacity *= 2;
+    // Open addressing hash table of the unique vertices indices + 1.
+    table = calloc(capacity, sizeof(*table));
+    for (i = 0; i < nb; i++) {
+        h = XXH32(&verts[i], sizeof(verts[i]), 0);
+        for (h &= capacity - 1; table[h]; h = (h + 1) & (capacity - 1)) {
+            if (memcmp(&verts[table[h] - 1], &verts[i],
+                       sizeof(verts[i])) == 0) break;
+        }
+        if (!table[h]) {
+            if (nb_unique > UINT16_MAX) {
+                // Put back the vertices we already merged.  Each index is
+                // lower or equal to its position, so we can go backward.
+                while (i--) verts[i] = verts[indices[i]];
+                ret = -1;
+                goto end;
+            }
+            // Since nb_unique <= i, we can move the vertex in place.
+            verts[nb_unique++] = verts[i];
+            table[h] = nb_unique;
+        }
+        indices[i] = table[h] - 1;
+    }
+    ret = nb_unique;
+end:
+    free(table);
+    return ret;
+}
+
+/*
+ * Global cache of the blocks vertices.  The items are reference counted,
+ * so that a block can be evicted while another thread still uses it.
+ */
+#define VERTICES_CACHE_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+    uint64_t ids[27];
+    int effects;
+    int lod;
+    int part;       // Index + 1 of the part for the block_part_t items.
+} vertices_key_t;
+
+// The faces of a part of a block, also stored in the vertices cache.
+typedef struct {
+    int             ref;
+    int             nb;
+    block_face_t    faces[];
+} block_part_t;
+
+static cache_t *g_vertices_cache = NULL;
+static pthread_mutex_t g_vertices_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void mesh_vertices_release(mesh_vertices_t *vertices)
+{
+    if (!vertices) return;
+    if (__atomic_sub_fetch(&vertices->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        free(vertices);
+}
+
+static int vertices_del(void *data)
+{
+    mesh_vertices_release(data);
+    return 0;
+}
+
+static void block_part_release(block_part_t *part)
+{
+    if (__atomic_sub_fetch(&part->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        free(part);
+}
+
+static int block_part_del(void *data)
+{
+    block_part_release(data);
+    return 0;
+}
+
+// Get an item from the vertices cache, with a new reference.
+static void *vertices_cache_get(const vertices_key_t *key)
+{
+    int *ret;
+    pthread_mutex_lock(&g_vertices_cache_lock);
+    if (!g_vertices_cache) g_vertices_cache = cache_create(VERTICES_CACHE_SIZE);
+    ret = cache_get(g_vertices_cache, key, sizeof(*key));
+    // Both items types start with their reference count.
+    if (ret) __atomic_add_fetch(ret, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_vertices_cache_lock);
+    return ret;
+}
+
+// Add a new item to the vertices cache, unless another thread already
+// added the same one in the meantime.  The item should have a reference
+// count of two, one being for the cache.
+static void vertices_cache_add(const vertices_key_t *key, void *data,
+                               int cost, int (*del)(void *data))
+{
+    pthread_mutex_lock(&g_vertices_cache_lock);
+    if (!cache_get(g_vertices_cache, key, sizeof(*key)))
+        cache_add(g_vertices_cache, key, sizeof(*key), data, cost, del);
+    else
+        (*(int*)data)--;
+    pthread_mutex_unlock(&g_vertices_cache_lock);
+}
+
+static int block_face_cmp(const void *a_, const void *b_)
+{
+    const block_face_t *a = a_, *b = b_;
+    return cmp(((a->pos[2] * N + a->pos[1]) * N + a->pos[0]) * 6 + a->f,
+               ((b->pos[2] * N + b->pos[1]) * N + b->pos[0]) * 6 + b->f);
+}
+
+/*
+ * Generate the quads of a block from the faces of its parts, only
+ * computing the parts that are not in the cache.  The faces are sorted
+ * back in the voxels order, so that we get exactly the same quads as
+ * mesh_generate_vertices.
+ */
+static int get_vertices_from_parts(const mesh_t *mesh, const int pos[3],
+                                   const vertices_key_t *block_key,
+                                   int effects, voxel_vertex_t *out)
+{
+    // Index of the neighbour block of each side, in the keys ids.
+    const int SIDES_IDS[6] = {10, 16, 4, 22, 14, 12};
+    const int center = 13;
+    vertices_key_t keys[PARTS_COUNT];
+    block_part_t *parts[PARTS_COUNT] = {}, *part;
+    block_face_t *faces;
+    int i, nb = 0, missing = 0, nb_faces, counts[PARTS_COUNT] = {};
+
+    for (i = 0; i < PARTS_COUNT; i++) {
+        memset(&keys[i], 0, sizeof(keys[i]));
+        keys[i].effects = block_key->effects & EFFECT_FLAT_FACES;
+        keys[i].part = i + 1;
+        keys[i].ids[center] = block_key->ids[center];
+        if (i >= PART_SIDE && i < PART_EDGES) {
+            keys[i].ids[SIDES_IDS[i - PART_SIDE]] =
+                block_key->ids[SIDES_IDS[i - PART_SIDE]];
+        }
+        if (i == PART_EDGES)
+            memcpy(keys[i].ids, block_key->ids, sizeof(keys[i].ids));
+        parts[i] = vertices_cache_get(&keys[i]);
+        if (!parts[i]) missing |= 1 << i;
+    }
+
+    faces = malloc(N * N * N * 6 * sizeof(*faces));
+    if (missing) {
+        counter_add(COUNTER_BLOCK_PARTS_MESHED, __builtin_popcount(missing));
+        nb_faces = get_block_faces(mesh, pos, effects, missing, faces);
+        for (i = 0; i < nb_faces; i++)
+            counts[get_voxel_part(IVEC(faces[i].pos[0], faces[i].pos[1],
+                                       faces[i].pos[2]))]++;
+        for (i = 0; i < PARTS_COUNT; i++) {
+            if (!(missing & (1 << i))) continue;
+            parts[i] = malloc(sizeof(*part) +
+                              counts[i] * sizeof(*part->faces));
+            parts[i]->ref = 2; // One for the cache.
+            parts[i]->nb = 0;
+        }
+        for (i = 0; i < nb_faces; i++) {
+            part = parts[get_voxel_part(IVEC(faces[i].pos[0],
+                                             faces[i].pos[1],
+                                             faces[i].pos[2]))];
+            part->faces[part->nb++] = faces[i];
+        }
+        for (i = 0; i < PARTS_COUNT; i++) {
+            if (!(missing & (1 << i))) continue;
+            vertices_cache_add(&keys[i], parts[i], sizeof(*part) +
+                               parts[i]->nb * sizeof(*part->faces),
+                               block_part_del);
+        }
+    }
+
+    for (i = 0; i < PARTS_COUNT; i++) {
+        memcpy(faces + nb, parts[i]->faces,
+               parts[i]->nb * sizeof(*faces));
+        nb += parts[i]->nb;
+        block_part_release(parts[i]);
+    }
+    qsort(faces, nb, sizeof(*faces), block_face_cmp);
+    nb = put_faces_quads(faces, nb, effects, out);
+    free(faces);
+    return nb;
+}
+
+mesh_vertices_t *mesh_get_vertices(const mesh_t *mesh, const int pos[3],
+                                   int effects, int lod)
+{
+    // The effects that change the generated vertices.
+    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+                             EFFECT_MERGE_FACES | EFFECT_FLAT_FACES;
+    vertices_key_t key;
+    voxel_vertex_t *buf;
+    mesh_vertices_t *ret;
+    int i, x, y, z, p[3], nb, size, subdivide;
+
+    memset(&key, 0, sizeof(key));
+    key.effects = effects & effects_mask;
+    key.lod = lod;
+    for (i = 0, z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++, i++) {
+        p[0] = pos[0] + x * N;
+        p[1] = pos[1] + y * N;
+        p[2] = pos[2] + z * N;
+        mesh_get_block_data(mesh, NULL, p, &key.ids[i]);
+    }
+
+    ret = vertices_cache_get(&key);
+    if (ret) return ret;
+
+    // Generate the vertices outside of the lock.
+    buf = malloc(N * N * N * 6 * 4 * sizeof(*buf));
+    if (lod == 0 && !(effects & EFFECT_MARCHING_CUBES)) {
+        nb = get_vertices_from_parts(mesh, pos, &key, effects, buf);
+        size = 4;
+        subdivide = 1;
+    } else {
+        nb = mesh_generate_vertices_lod(mesh, pos, effects, lod, buf,
+                                        &size, &subdivide);
+    }
+    ret = malloc(sizeof(*ret) + nb * size * sizeof(*buf));
+    *ret = (mesh_vertices_t){.ref = 2, // One for the cache.
+                             .nb = nb, .size = size, .subdivide = subdivide};
+    memcpy(ret->verts, buf, nb * size * sizeof(*buf));
+    free(buf);
+    vertices_cache_add(&key, ret, sizeof(*ret) + nb * size * sizeof(*buf),
+                       vertices_del);
+    return ret;
+}
+
+void mesh_vertices_cache_clear(void)
+{
+    pthread_mutex_lock(&g_vertices_cache_lock);
+    if (g_vertices_cache) cache_clear(g_vertices_cache);
+    pthread_mutex_unlock(&g_vertices_cache_lock);
+}
+
+// Number of blocks tessellated in parallel by mesh_iter_vertices.
+#define ITER_VERTICES_BATCH 64
+
+typedef struct {
+    const mesh_t            *mesh;
+    int                     effects;
+    mesh_block_vertices_t   *blocks;
+    mesh_vertices_t         **vertices;
+} iter_vertices_job_t;
+
+static void iter_vertices_block(void *user, int i)
+{
+    iter_vertices_job_t *job = user;
+    mesh_block_vertices_t *b = &job->blocks[i];
+    mesh_vertices_t *v;
+
+    v = mesh_get_vertices(job->mesh, b->pos, job->effects, 0);
+    job->vertices[i] = v;
+    b->verts = v->verts;
+    b->nb = v->nb;
+    b->size = v->size;
+    b->subdivide = v->subdivide;
+}
+
+int mesh_iter_vertices(const mesh_t *mesh, int effects, void *user,
+                       int (*f)(void *user, const mesh_block_vertices_t *b))
+{
+    mesh_iterator_t iter;
+    int i, start, n, count = 0, ret = 0, (*positions)[3] = NULL;
+    mesh_block_vertices_t blocks[ITER_VERTICES_BATCH];
+    mesh_vertices_t *vertices[ITER_VERTICES_BATCH];
+    iter_vertices_job_t job = {mesh, effects, blocks, vertices};
+
+    iter = mesh_get_iterator(mesh,
+            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+    while (mesh_iter(&iter, NULL)) count++;
+    positions = malloc(max(count, 1) * sizeof(*positions));
+    iter = mesh_get_iterator(mesh,
+            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+    for (i = 0; i < count && mesh_iter(&iter, positions[i]); i++) {}
+
+    for (start = 0; start < count && !ret; start += n) {
+        n = min(ITER_VERTICES_BATCH, count - start);
+        for (i = 0; i < n; i++) {
+            blocks[i] = (mesh_block_vertices_t){
+                .pos = {positions[start + i][0], positions[start + i][1],
+                        positions[start + i][2]},
+                .index = start + i,
+                .count = count,
+            };
+        }
+        parallel_for(n, iter_vertices_block, &job);
+        for (i = 0; i < n; i++) {
+            if (!ret) ret = f(user, &blocks[i]);
+            mesh_vertices_release(vertices[i]);
+        }
+    }
+    free(positions);
+    return ret;
+}
@@ -17,12 +17,28 @@
  */
 
 #include "goxel.h"
+#include "gpu_ops.h"
+#include "utils/parallel.h"
 #include "xxhash.h"
 
 #include <limits.h>
+#include <pthread.h>
 
 #define N BLOCK_SIZE
 
+// Memory budgets of the operations caches, in bytes.
+#define OP_CACHE_SIZE           (64 * MB)
+#define MERGE_CACHE_SIZE        (64 * MB)
+#define BLOCKS_MERGE_CACHE_SIZE (16 * MB)
+#define STAMP_CACHE_SIZE        (32 * MB)
+
+// Largest box volume, in voxels, of the operations applied with a stamp.
+#define STAMP_MAX_VOLUME        (128 * 128 * 128)
+
+// Minimum number of blocks to compute of the operations done on the GPU,
+// when it is available.
+#define GPU_OPS_MIN_BLOCKS      64
+
 // Used for the cache.
 static int mesh_del(void *data_)
 {
@@ -31,6 +47,73 @@ static int mesh_del(void *data_)
     return 0;
 }
 
+// The operations caches, shared by all the meshes.  The cached meshes
+// must only be used with the cache locked, since an other thread could
+// delete them.
+static cache_t *g_op_cache = NULL;
+static cache_t *g_merge_cache = NULL;
+static cache_t *g_blocks_merge_cache = NULL;
+static cache_t *g_stamp_cache = NULL;
+static pthread_once_t g_caches_once = PTHREAD_ONCE_INIT;
+// Number of calls to mesh_ops_cache_enable(false) not matched yet.
+static __thread int t_caches_disabled = 0;
+
+static void caches_init(void)
+{
+    g_op_cache = cache_create(OP_CACHE_SIZE);
+    cache_register(g_op_cache, "Mesh op");
+    g_blocks_merge_cache = cache_create(BLOCKS_MERGE_CACHE_SIZE);
+    cache_register(g_blocks_merge_cache, "Blocks merge");
+    g_merge_cache = cache_create(MERGE_CACHE_SIZE);
+    cache_register(g_merge_cache, "Mesh merge");
+    g_stamp_cache = cache_create(STAMP_CACHE_SIZE);
+    cache_register(g_stamp_cache, "Brush stamps");
+}
+
+void mesh_ops_cache_enable(bool enabled)
+{
+    t_caches_disabled += enabled ? -1 : +1;
+    assert(t_caches_disabled >= 0);
+}
+
+// Visited voxels bitset of a block, for mesh_select.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint64_t        mask[N * N * N / 64];
+} select_block_t;
+
+// Get the word and bit of a voxel in the visited bitsets.
+static uint64_t *select_get_mask(select_block_t **blocks,
+                                 select_block_t **last,
+                                 const int pos[3], uint64_t *bit)
+{
+    int bpos[3] = {pos[0] & ~(N - 1), pos[1] & ~(N - 1), pos[2] & ~(N - 1)};
+    int idx;
+    select_block_t *block = *last;
+
+    if (!block || memcmp(block->pos, bpos, sizeof(bpos)) != 0) {
+        HASH_FIND(hh, *blocks, bpos, sizeof(bpos), block);
+        if (!block) {
+            block = calloc(1, sizeof(*block));
+            memcpy(block->pos, bpos, sizeof(bpos));
+            HASH_ADD(hh, *blocks, pos, sizeof(block->pos), block);
+        }
+        *last = block;
+    }
+    idx = (pos[0] - bpos[0]) + (pos[1] - bpos[1]) * N +
+          (pos[2] - bpos[2]) * N * N;
+    *bit = 1ULL << (idx % 64);
+    return &block->mask[idx / 64];
+}
+
+/*
+ * Flood fill from the start position: each selected voxel is pushed once
+ * in a queue, and we test its neighbors that are not selected yet.  A
+ * neighbor rejected by the condition can still be selected later from
+ * another voxel, so we only mark the voxels as visited when they get
+ * selected.
+ */
 int mesh_select(const mesh_t *mesh,
                 const int start_pos[3],
                 int (*cond)(void *user, const mesh_t *mesh,
@@ -39,10 +122,11 @@ int mesh_select(const mesh_t *mesh,
                             mesh_accessor_t *mesh_accessor),
                 void *user, mesh_t *selection)
 {
-    int i, a;
-    int pos[3], p[3];
-    bool keep = true;
-    mesh_iterator_t iter;
+    int i, a, pos[3], p[3];
+    uint64_t *mask, bit;
+    int (*queue)[3] = NULL;
+    int queue_size = 0, queue_alloc = 0, queue_start = 0;
+    select_block_t *blocks = NULL, *last = NULL, *block, *tmp;
     mesh_accessor_t mesh_accessor, selection_accessor;
     mesh_clear(selection);
 
@@ -51,87 +135,117 @@ int mesh_select(const mesh_t *mesh,
 
     if (!mesh_get_alpha_at(mesh, &mesh_accessor, start_pos))
         return 0;
+    mesh_begin_write(selection);
     mesh_set_at(selection, &selection_accessor, start_pos,
                 (uint8_t[]){255, 255, 255, 255});
+    mask = select_get_mask(&blocks, &last, start_pos, &bit);
+    *mask |= bit;
+    queue_alloc = 1024;
+    queue = malloc(queue_alloc * sizeof(*queue));
+    memcpy(queue[queue_size++], start_pos, sizeof(queue[0]));
 
-    // XXX: Very inefficient algorithm!
-    // Iter and test all the neighbors of the selection until there is
-    // no more possible changes.
-    while (keep) {
-        keep = false;
-        iter = mesh_get_iterator(selection, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, pos)) {
-            // Shouldn't be needed if the iter function did filter the voxels.
-            if (!mesh_get_alpha_at(selection, &selection_accessor, pos))
-                continue;
-
-            for (i = 0; i < 6; i++) {
-                p[0] = pos[0] + FACES_NORMALS[i][0];
-                p[1] = pos[1] + FACES_NORMALS[i][1];
-                p[2] = pos[2] + FACES_NORMALS[i][2];
-                if (mesh_get_alpha_at(selection, &selection_accessor, p))
-                    continue; // Already done.
-                if (!mesh_get_alpha_at(mesh, &mesh_accessor, p))
-                    continue; // No voxel here.
-                a = cond(user, mesh, pos, p, &mesh_accessor);
-                if (a) {
-                    mesh_set_at(selection, &selection_accessor, p,
-                                (uint8_t[]){255, 255, 255, a});
-                    keep = true;
-                }
+    while (queue_start < queue_size) {
+        memcpy(pos, queue[queue_start++], sizeof(pos));
+        for (i = 0; i < 6; i++) {
+            p[0] = pos[0] + FACES_NORMALS[i][0];
+            p[1] = pos[1] + FACES_NORMALS[i][1];
+            p[2] = pos[2] + FACES_NORMALS[i][2];
+            mask = select_get_mask(&blocks, &last, p, &bit);
+            if (*mask & bit) continue; // Already done.
+            if (!mesh_get_alpha_at(mesh, &mesh_accessor, p))
+                continue; // No voxel here.
+            a = cond(user, mesh, pos, p, &mesh_accessor);
+            if (!a) continue;
+            *mask |= bit;
+            mesh_set_at(selection, &selection_accessor, p,
+                        (uint8_t[]){255, 255, 255, a});
+            // Reuse the consumed part of the queue before growing it.
+            if (queue_size == queue_alloc && queue_start > queue_alloc / 2) {
+                memmove(queue, queue + queue_start,
+                        (queue_size - queue_start) * sizeof(*queue));
+                queue_size -= queue_start;
+                queue_start = 0;
+            }
+            if (queue_size == queue_alloc) {
+                queue_alloc *= 2;
+                queue = realloc(queue, queue_alloc * sizeof(*queue));
             }
+            memcpy(queue[queue_size++], p, sizeof(queue[0]));
         }
     }
+
+    mesh_end_write(selection);
+    free(queue);
+    HASH_ITER(hh, blocks, block, tmp) {
+        HASH_DEL(blocks, block);
+        free(block);
+    }
     return 0;
 }
 
 
-// XXX: need to redo this function from scratch.  Even the API is a bit
-// stupid.
+/*
+ * Each voxel of the box gets the value of its projection on the plane, and
+ * the other voxels of the blocks covered by the box are cleared.
+ *
+ * The plane voxels are read once, and then we write whole blocks.
+ */
 void mesh_extrude(mesh_t *mesh,
                   const float plane[4][4],
                   const float box[4][4])
 {
-    float proj[4][4];
-    float n[3], pos[3], p[3];
-    mesh_iterator_t iter;
-    int vpos[3];
-    uint8_t value[4];
+    const int size[3] = {N, N, N};
+    float b0[3], b1[3];
+    int i, x, y, z, v[3], lo[3], hi[3], blo[3], bhi[3], bpos[3];
+    int src_pos[3], src_size[3], idx;
+    bool proj[3], empty = false;
+    uint8_t (*src)[4] = NULL, (*data)[4];
 
-    vec3_normalize(plane[2], n);
-    vec3_copy(plane[3], pos);
-
-    // Generate the projection into the plane.
-    // XXX: *very* ugly code, fix this!
-    mat4_set_identity(proj);
-
-    if (fabs(plane[2][0]) > 0.1) {
-        proj[0][0] = 0;
-        proj[3][0] = pos[0];
+    assert(box_is_bbox(box));
+    // Range of the voxels inside the box, as in bbox_contains_vec, and of
+    // the blocks covered by the box, as in mesh_get_box_iterator.
+    for (i = 0; i < 3; i++) {
+        b0[i] = box[3][i] - box[i][i];
+        b1[i] = box[3][i] + box[i][i];
+        lo[i] = ceil(b0[i]);
+        hi[i] = (int)ceil(b1[i]) - 1;
+        blo[i] = (int)floor(min(b0[i], b1[i])) & ~(N - 1);
+        bhi[i] = ceil(max(b0[i], b1[i]));
+        empty = empty || hi[i] < lo[i];
+        proj[i] = fabs(plane[2][i]) > 0.1;
+        src_pos[i] = proj[i] ? floor(plane[3][i]) : lo[i];
+        src_size[i] = proj[i] ? 1 : hi[i] - lo[i] + 1;
     }
-    if (fabs(plane[2][1]) > 0.1) {
-        proj[1][1] = 0;
-        proj[3][1] = pos[1];
-    }
-    if (fabs(plane[2][2]) > 0.1) {
-        proj[2][2] = 0;
-        proj[3][2] = pos[2];
+
+    if (!empty) {
+        src = malloc(src_size[0] * src_size[1] * src_size[2] * 4);
+        mesh_read(mesh, src_pos, src_size, (uint8_t*)src);
     }
+    data = malloc(N * N * N * 4);
 
-    // XXX: use an accessor to speed up access.
-    iter = mesh_get_box_iterator(mesh, box, 0);
-    while (mesh_iter(&iter, vpos)) {
-        vec3_set(p, vpos[0], vpos[1], vpos[2]);
-        if (!bbox_contains_vec(box, p)) {
-            memset(value, 0, 4);
-        } else {
-            mat4_mul_vec3(proj, p, p);
-            int pi[3] = {floor(p[0]), floor(p[1]), floor(p[2])};
-            mesh_get_at(mesh, NULL, pi, value);
+    for (bpos[2] = blo[2]; bpos[2] <= bhi[2]; bpos[2] += N)
+    for (bpos[1] = blo[1]; bpos[1] <= bhi[1]; bpos[1] += N)
+    for (bpos[0] = blo[0]; bpos[0] <= bhi[0]; bpos[0] += N) {
+        memset(data, 0, N * N * N * 4);
+        for (z = 0; z < N && !empty; z++)
+        for (y = 0; y < N; y++) {
+            v[1] = bpos[1] + y;
+            v[2] = bpos[2] + z;
+            if (v[1] < lo[1] || v[1] > hi[1]) continue;
+            if (v[2] < lo[2] || v[2] > hi[2]) continue;
+            for (x = 0; x < N; x++) {
+                v[0] = bpos[0] + x;
+                if (v[0] < lo[0] || v[0] > hi[0]) continue;
+                idx = 0;
+                for (i = 2; i >= 0; i--)
+                    idx = idx * src_size[i] + (proj[i] ? 0 : v[i] - lo[i]);
+                memcpy(data[(z * N + y) * N + x], src[idx], 4);
+            }
         }
-        mesh_set_at(mesh, NULL, vpos, value);
+        mesh_write(mesh, bpos, size, (uint8_t*)data);
     }
-
+    free(src);
+    free(data);
 }
 
 static void mesh_fill(
@@ -148,10 +262,12 @@ static void mesh_fill(
     mesh_clear(mesh);
     accessor = mesh_get_accessor(mesh);
     iter = mesh_get_box_iterator(mesh, box, 0);
+    mesh_begin_write(mesh);
     while (mesh_iter(&iter, pos)) {
         get_color(pos, color, user_data);
         mesh_set_at(mesh, &accessor, pos, color);
     }
+    mesh_end_write(mesh);
 }
 
 static void mesh_move_get_color(const int pos[3], uint8_t c[4], void *user)
@@ -164,35 +280,111 @@ static void mesh_move_get_color(const int pos[3], uint8_t c[4], void *user)
     mesh_get_at(mesh, NULL, pi, c);
 }
 
+// Check if a matrix is a translation by a whole number of voxels.
+static bool mat_get_int_translation(const float mat[4][4], int t[3])
+{
+    int i, j;
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 4; j++) {
+        if (mat[i][j] != (i == j ? 1 : 0)) return false;
+    }
+    if (mat[3][3] != 1) return false;
+    for (i = 0; i < 3; i++) {
+        t[i] = (int)mat[3][i];
+        if (mat[3][i] != t[i]) return false;
+    }
+    return true;
+}
+
+/*
+ * Integer translation of a mesh.  If the offset is a multiple of the block
+ * size we just move the blocks, sharing their data, otherwise we copy the
+ * voxels of each block into the (up to eight) destination blocks it covers.
+ */
+static void mesh_translate(mesh_t *mesh, const int t[3])
+{
+    const int size[3] = {BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE};
+    mesh_t *src_mesh;
+    mesh_iterator_t iter;
+    int bpos[3], pos[3];
+    uint8_t *data = NULL;
+    bool aligned;
+
+    if (!t[0] && !t[1] && !t[2]) return;
+    aligned = ((t[0] | t[1] | t[2]) & (BLOCK_SIZE - 1)) == 0;
+    if (!aligned) data = malloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4);
+    src_mesh = mesh_copy(mesh);
+    mesh_clear(mesh);
+    iter = mesh_get_iterator(src_mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        pos[0] = bpos[0] + t[0];
+        pos[1] = bpos[1] + t[1];
+        pos[2] = bpos[2] + t[2];
+        if (aligned) {
+            mesh_copy_block(src_mesh, bpos, mesh, pos);
+            continue;
+        }
+        mesh_read(src_mesh, bpos, size, data);
+        mesh_write(mesh, pos, size, data);
+    }
+    free(data);
+    mesh_delete(src_mesh);
+}
+
 void mesh_move(mesh_t *mesh, const float mat[4][4])
 {
     float box[4][4];
-    mesh_t *src_mesh = mesh_copy(mesh);
+    mesh_t *src_mesh;
     float imat[4][4];
+    int t[3];
 
+    if (mat_get_int_translation(mat, t)) {
+        mesh_translate(mesh, t);
+        return;
+    }
     mat4_invert(mat, imat);
     mesh_get_box(mesh, true, box);
     if (box_is_null(box)) return;
+    src_mesh = mesh_copy(mesh);
     mat4_mul(mat, box, box);
     mesh_fill(mesh, box, mesh_move_get_color, USER_PASS(src_mesh, &imat));
     mesh_delete(src_mesh);
     mesh_remove_empty_blocks(mesh, false);
 }
 
+bool mesh_move_blocks(mesh_t *mesh, const mesh_t *src, const float mat[4][4],
+                      int nb, const int (*blocks_pos)[3])
+{
+    const int size[3] = {BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE};
+    int i, t[3], pos[3];
+    uint8_t *data = NULL;
+    bool aligned;
+
+    if (!mat_get_int_translation(mat, t)) return false;
+    // Same as mesh_translate, but only for the given blocks.  The empty
+    // source blocks clear their destination.
+    aligned = ((t[0] | t[1] | t[2]) & (BLOCK_SIZE - 1)) == 0;
+    if (!aligned) data = malloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4);
+    for (i = 0; i < nb; i++) {
+        pos[0] = blocks_pos[i][0] + t[0];
+        pos[1] = blocks_pos[i][1] + t[1];
+        pos[2] = blocks_pos[i][2] + t[2];
+        if (aligned) {
+            mesh_copy_block(src, blocks_pos[i], mesh, pos);
+            continue;
+        }
+        mesh_read(src, blocks_pos[i], size, data);
+        mesh_write(mesh, pos, size, data);
+    }
+    free(data);
+    return true;
+}
+
 void mesh_blit(mesh_t *mesh, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
                mesh_iterator_t *iter)
 {
-    mesh_iterator_t default_iter = {0};
-    int pos[3];
-    if (!iter) iter = &default_iter;
-    for (pos[2] = z; pos[2] < z + d; pos[2]++)
-    for (pos[1] = y; pos[1] < y + h; pos[1]++)
-    for (pos[0] = x; pos[0] < x + w; pos[0]++) {
-        mesh_set_at(mesh, iter, pos, data);
-        data += 4;
-    }
-    mesh_remove_empty_blocks(mesh, false);
+    mesh_write(mesh, (int[]){x, y, z}, (int[]){w, h, d}, data);
 }
 
 void mesh_shift_alpha(mesh_t *mesh, int v)
@@ -202,11 +394,13 @@ void mesh_shift_alpha(mesh_t *mesh, int v)
     uint8_t value[4];
 
     iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
+    mesh_begin_write(mesh);
     while (mesh_iter(&iter, pos)) {
         mesh_get_at(mesh, &iter, pos, value);
         value[3] = clamp(value[3] + v, 0, 255);
         mesh_set_at(mesh, NULL, pos, value);
     }
+    mesh_end_write(mesh);
 }
 
 // Multiply two colors together.
@@ -266,43 +460,904 @@ static void combine(const uint8_t a[4], const uint8_t b[4], int mode,
     memcpy(out, ret, 4);
 }
 
+/*
+ * Vectorized versions of the combine modes that only do bytes min/max
+ * operations.  We use the gcc vector extensions, so that the same code
+ * compiles to SSE2, AVX or NEON instructions, and process four voxels at
+ * a time.
+ */
+typedef uint8_t u8x16_t __attribute__((vector_size(16)));
 
-void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
+// Note: the vector comparisons return -1 for true, and 0 for false.
+#define V_MIN(a, b) \
+    (((u8x16_t)((a) < (b)) & (a)) | ((u8x16_t)((a) >= (b)) & (b)))
+#define V_MAX(a, b) \
+    (((u8x16_t)((a) > (b)) & (a)) | ((u8x16_t)((a) <= (b)) & (b)))
+
+static bool combine_voxels_vec(const uint8_t *a, const uint8_t *b, int n,
+                               int mode, uint8_t *out)
+{
+    const u8x16_t ALPHA = {0, 0, 0, 255, 0, 0, 0, 255,
+                           0, 0, 0, 255, 0, 0, 0, 255};
+    const u8x16_t RGB = ~ALPHA;
+    u8x16_t va, vb, r;
+    int i;
+
+    if (    mode != MODE_SUB && mode != MODE_SUB_CLAMP &&
+            mode != MODE_MAX && mode != MODE_INTERSECT)
+        return false;
+
+    for (i = 0; i < n; i += 4) {
+        memcpy(&va, a + i * 4, 16);
+        memcpy(&vb, b + i * 4, 16);
+        switch (mode) {
+        case MODE_SUB:
+            r = (va & RGB) | ((va - V_MIN(va, vb)) & ALPHA);
+            break;
+        case MODE_SUB_CLAMP:
+            r = (va & RGB) | (V_MIN(va, ~vb) & ALPHA);
+            break;
+        case MODE_MAX:
+            r = (vb & RGB) | (V_MAX(va, vb) & ALPHA);
+            break;
+        default: // MODE_INTERSECT
+            r = (va & RGB) | (V_MIN(va, vb) & ALPHA);
+            break;
+        }
+        memcpy(out + i * 4, &r, 16);
+    }
+    return true;
+}
+
+#undef V_MIN
+#undef V_MAX
+
+void combine_voxels(const uint8_t *a, const uint8_t *b, int n, int mode,
+                    const uint8_t color[4], uint8_t *out)
+{
+    int i = 0;
+    uint8_t v[4];
+
+    if (!color && n >= 4 && combine_voxels_vec(a, b, n & ~3, mode, out))
+        i = n & ~3;
+    for (; i < n; i++) {
+        memcpy(v, b + i * 4, 4);
+        if (color) color_mul(v, color, v);
+        combine(a + i * 4, v, mode, out + i * 4);
+    }
+}
+
+
+static int blocks_pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 2; i >= 0; i--) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : +1;
+    }
+    return 0;
+}
+
+// Get all the blocks positions yielded by a blocks iterator.
+static int get_blocks_pos(mesh_iterator_t *iter, int (**out)[3])
+{
+    int nb = 0, allocated = 0, bpos[3];
+    *out = NULL;
+    while (mesh_iter(iter, bpos)) {
+        if (nb == allocated) {
+            allocated = max(16, allocated * 2);
+            *out = realloc(*out, allocated * sizeof(**out));
+        }
+        memcpy((*out)[nb++], bpos, sizeof(bpos));
+    }
+    return nb;
+}
+
+/*
+ * Get the positions of the blocks that intersect the box of a mesh_op.  If
+ * the operation can only change the existing voxels, we only test the
+ * blocks of the mesh, otherwise we use a box iterator.
+ */
+static int get_op_blocks_pos(const mesh_t *mesh, const float box[4][4],
+                             bool only_existing, int (**out)[3])
+{
+    int i, size, nb = 0, allocated = 0, bpos[3], aabb[2][3];
+    mesh_iterator_t iter;
+
+    *out = NULL;
+    if (only_existing) {
+        // Directly read the mesh blocks array.
+        size = mesh_get_blocks_array_size(mesh);
+        *out = malloc(max(size, 1) * sizeof(**out));
+        for (i = 0; i < size; i++) {
+            if (!mesh_get_block_pos_by_index(mesh, i, bpos)) continue;
+            mesh_get_block_aabb(bpos, aabb);
+            if (!box_intersect_aabb(box, aabb)) continue;
+            memcpy((*out)[nb++], bpos, sizeof(bpos));
+        }
+        return nb;
+    }
+
+    iter = mesh_get_box_iterator(mesh, box, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        if (nb == allocated) {
+            allocated = max(16, allocated * 2);
+            *out = realloc(*out, allocated * sizeof(**out));
+        }
+        memcpy((*out)[nb++], bpos, sizeof(bpos));
+    }
+    return nb;
+}
+
+// Arguments of the per block mesh_op tasks.
+typedef struct {
+    const mesh_t    *mesh;
+    const painter_t *painter;
+    int             mode;
+    float           mat[4][4];
+    float           size[3];
+    bool            use_box;
+    bool            skip_src_empty;
+    bool            skip_dst_empty;
+    int             (*blocks_pos)[3];
+    mesh_t          **results;  // New block value, or NULL if unchanged.
+    bool            gpu;        // Leave the blocks to evaluate to the GPU.
+    bool            *gpu_pending;
+} op_job_t;
+
+/*
+ * Classify a block against the shape of an operation.  Return -1 if all
+ * the voxels are outside of the shape, +1 if they are all fully inside, or
+ * 0 if we don't know.
+ *
+ * For the outside test we use the bounding sphere of the block in the
+ * normalized shape space, where the sphere and the cylinder have a radius
+ * of one.  Since all the shapes are convex, the block is inside if the
+ * voxels at its corners are inside.
+ */
+static int op_classify_block(const op_job_t *job, const int bpos[3])
+{
+    const painter_t *painter = job->painter;
+    const shape_t *shape = painter->shape;
+    const float eps = 0.001;
+    float c[3], p[3], r = 0, d, s;
+    int i, j;
+
+    s = min3(job->size[0], job->size[1], job->size[2]);
+    if (s <= 0) return 0;
+
+    if (shape == &shape_sphere || shape == &shape_cylinder) {
+        vec3_set(c, bpos[0] + N / 2.0, bpos[1] + N / 2.0, bpos[2] + N / 2.0);
+        mat4_mul_vec3(job->mat, c, c);
+        for (j = 0; j < 3; j++) c[j] /= job->size[j];
+        for (i = 0; i < 8; i++) {
+            vec3_set(p, bpos[0] + (i & 1) * N, bpos[1] + (i >> 1 & 1) * N,
+                     bpos[2] + (i >> 2 & 1) * N);
+            mat4_mul_vec3(job->mat, p, p);
+            for (j = 0; j < 3; j++) p[j] /= job->size[j];
+            r = max(r, vec3_dist(c, p));
+        }
+        r += painter->smoothness / s;
+        d = (shape == &shape_sphere) ? vec3_norm(c) : vec2_norm(c);
+        if (d > 1 + r) return -1;
+    }
+
+    if (painter->smoothness || job->use_box) return 0;
+    for (i = 0; i < 8; i++) {
+        vec3_set(p, bpos[0] + 0.5 + (i & 1) * (N - 1),
+                    bpos[1] + 0.5 + (i >> 1 & 1) * (N - 1),
+                    bpos[2] + 0.5 + (i >> 2 & 1) * (N - 1));
+        mat4_mul_vec3(job->mat, p, p);
+        if (shape->func(p, job->size, 0) <= eps) return 0;
+    }
+    return +1;
+}
+
+/*
+ * Apply the painter to a block fully inside the shape: all the voxels are
+ * combined with the same color, so we don't need to evaluate the shape.
+ * If the block was empty the result is uniform.
+ */
+static mesh_t *op_block_inside(const op_job_t *job, const int bpos[3],
+                               uint64_t id)
 {
-    int i, vp[3];
+    const int size[3] = {N, N, N};
+    uint8_t value[4] = {0}, (*data)[4];
+    mesh_t *res = mesh_new();
+    int i;
+
+    if (!id) {
+        combine(value, job->painter->color, job->mode, value);
+        mesh_fill_block(res, bpos, value);
+        return res;
+    }
+    data = malloc(N * N * N * 4);
+    mesh_read(job->mesh, bpos, size, (uint8_t*)data);
+    for (i = 0; i < N * N * N; i++) {
+        if (!data[i][3] && job->skip_dst_empty) continue;
+        combine(data[i], job->painter->color, job->mode, data[i]);
+    }
+    mesh_write(res, bpos, size, (uint8_t*)data);
+    free(data);
+    return res;
+}
+
+/*
+ * Get the painter color at a voxel, from the value k of the shape function
+ * at its center.  Return false if the voxel is skipped.
+ */
+static bool op_voxel_color(const op_job_t *job, const int vp[3], float k,
+                           uint8_t c[4])
+{
+    const painter_t *painter = job->painter;
+    float p[3], v;
+
+    vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
+    if (job->use_box && !bbox_contains_vec(*painter->box, p))
+        return false;
+    if (painter->smoothness) {
+        v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
+    } else {
+        v = (k >= 0.f) ? 1.f : 0.f;
+    }
+    if (!v && job->skip_src_empty) return false;
+    memcpy(c, painter->color, 4);
+    c[3] *= v;
+    if (!c[3] && job->skip_src_empty) return false;
+    return true;
+}
+
+// Evaluate the shape function for a row of voxels of a block.
+static void op_row(const op_job_t *job, const int bpos[3], int y, int z,
+                   float k[N])
+{
+    const painter_t *painter = job->painter;
+    float p[3], dp[3];
+
+    // Moving by one voxel along x in the mesh moves the shape point by
+    // the first column of the matrix.
+    vec3_copy(job->mat[0], dp);
+    vec3_set(p, bpos[0] + 0.5, bpos[1] + y + 0.5, bpos[2] + z + 0.5);
+    mat4_mul_vec3(job->mat, p, p);
+    painter->shape->func_row(p, dp, N, job->size, painter->smoothness, k);
+}
+
+// Apply the painter to one block of the mesh.  This only reads the mesh,
+// so it can run on any thread: the new value of the block is put in a new
+// mesh at the same position.
+static void op_block(void *user, int i)
+{
+    op_job_t *job = user;
+    const int *bpos = job->blocks_pos[i];
+    mesh_accessor_t accessor, res_accessor;
+    mesh_t *res = NULL;
+    int x, y, z, vp[3];
+    uint64_t id;
+    float k[N];
     uint8_t value[4], new_value[4], c[4];
+
+    mesh_get_block_data(job->mesh, NULL, bpos, &id);
+    if (!id && job->skip_dst_empty) return;
+
+    switch (op_classify_block(job, bpos)) {
+    case -1:
+        // Only the intersection changes the voxels outside of the shape.
+        if (job->mode == MODE_INTERSECT && id)
+            job->results[i] = mesh_new();
+        return;
+    case +1:
+        job->results[i] = op_block_inside(job, bpos, id);
+        return;
+    }
+    if (job->gpu) {
+        job->gpu_pending[i] = true;
+        return;
+    }
+
+    accessor = mesh_get_accessor(job->mesh);
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        op_row(job, bpos, y, z, k);
+        for (x = 0; x < N; x++) {
+            vec3_set(vp, bpos[0] + x, bpos[1] + y, bpos[2] + z);
+            if (!op_voxel_color(job, vp, k[x], c)) continue;
+            mesh_get_at(job->mesh, &accessor, vp, value);
+            if (!value[3] && job->skip_dst_empty) continue;
+            combine(value, c, job->mode, new_value);
+            if (vec4_equal(value, new_value)) continue;
+            if (!res) {
+                res = mesh_new();
+                mesh_copy_block(job->mesh, bpos, res, bpos);
+                res_accessor = mesh_get_accessor(res);
+                mesh_begin_write(res);
+            }
+            mesh_set_at(res, &res_accessor, vp, new_value);
+        }
+    }
+    if (res) mesh_end_write(res);
+    job->results[i] = res;
+}
+
+// A batch of blocks of a mesh_op evaluated on the GPU.
+typedef struct {
+    const op_job_t  *job;
+    int             idx[GPU_OPS_BATCH];     // Index of the blocks in the job.
+    int             pos[GPU_OPS_BATCH][3];
+    uint8_t         *data;
+    uint32_t        *flags;
+} op_gpu_batch_t;
+
+static void op_gpu_read(void *user, int i)
+{
+    const int size[3] = {N, N, N};
+    op_gpu_batch_t *batch = user;
+    mesh_read(batch->job->mesh, batch->pos[i], size,
+              batch->data + i * N * N * N * 4);
+}
+
+// Compute the uncertain voxels of a block returned by the GPU, and create
+// the new block if it changed.
+static void op_gpu_finish(void *user, int i)
+{
+    const int size[3] = {N, N, N};
+    op_gpu_batch_t *batch = user;
+    const op_job_t *job = batch->job;
+    const int *bpos = batch->pos[i];
+    const uint32_t *flags = batch->flags + i * GPU_OPS_FLAGS_SIZE;
+    uint8_t (*data)[4] = (void*)(batch->data + i * N * N * N * 4);
+    bool changed = flags[0] & GPU_OPS_CHANGED;
+    int x, y, z, j, vp[3];
+    float k[N];
+    uint8_t c[4], v[4];
+    mesh_t *res;
+
+    if (flags[0] & GPU_OPS_UNCERTAIN) {
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++) {
+            j = (z * N + y) * N;
+            for (x = 0; x < N; x++) {
+                if (flags[1 + (j + x) / 32] & (1u << ((j + x) % 32))) break;
+            }
+            if (x == N) continue;
+            op_row(job, bpos, y, z, k);
+            for (x = 0; x < N; x++, j++) {
+                if (!(flags[1 + j / 32] & (1u << (j % 32)))) continue;
+                vec3_set(vp, bpos[0] + x, bpos[1] + y, bpos[2] + z);
+                if (!op_voxel_color(job, vp, k[x], c)) continue;
+                if (!data[j][3] && job->skip_dst_empty) continue;
+                combine(data[j], c, job->mode, v);
+                if (vec4_equal(v, data[j])) continue;
+                memcpy(data[j], v, 4);
+                changed = true;
+            }
+        }
+    }
+    if (!changed) return;
+    res = mesh_new();
+    mesh_write(res, bpos, size, (uint8_t*)data);
+    job->results[batch->idx[i]] = res;
+}
+
+// Evaluate on the CPU a block that the GPU could not do.
+static void op_block_pending(void *user, int i)
+{
+    op_job_t *job = user;
+    if (job->gpu_pending[i]) op_block(job, i);
+}
+
+/*
+ * Evaluate the blocks left by op_block on the GPU, by batches.  Return
+ * false if the GPU failed, in which case the blocks not done yet are still
+ * pending.
+ */
+static bool op_apply_gpu(op_job_t *job, int nb)
+{
+    gpu_op_t op = {
+        .painter = job->painter,
+        .use_box = job->use_box,
+        .skip_src_empty = job->skip_src_empty,
+        .skip_dst_empty = job->skip_dst_empty,
+    };
+    op_gpu_batch_t *batch;
+    int i = 0, n;
+    bool ret = true;
+
+    mat4_copy(job->mat, op.mat);
+    vec3_copy(job->size, op.size);
+    batch = calloc(1, sizeof(*batch));
+    batch->job = job;
+    batch->data = malloc(GPU_OPS_BATCH * N * N * N * 4);
+    batch->flags = malloc(GPU_OPS_BATCH * GPU_OPS_FLAGS_SIZE *
+                          sizeof(*batch->flags));
+    while (true) {
+        for (n = 0; i < nb && n < GPU_OPS_BATCH; i++) {
+            if (!job->gpu_pending[i]) continue;
+            batch->idx[n] = i;
+            memcpy(batch->pos[n++], job->blocks_pos[i], sizeof(int[3]));
+        }
+        if (!n) break;
+        parallel_for(n, op_gpu_read, batch);
+        if (!gpu_ops_apply(&op, n, (const int (*)[3])batch->pos,
+                           batch->data, batch->flags)) {
+            ret = false;
+            break;
+        }
+        parallel_for(n, op_gpu_finish, batch);
+        for (n--; n >= 0; n--) job->gpu_pending[batch->idx[n]] = false;
+    }
+    free(batch->data);
+    free(batch->flags);
+    free(batch);
+    return ret;
+}
+
+// Apply a painter by evaluating the shape on all the blocks of the box.
+static void op_apply(mesh_t *mesh, const painter_t *painter,
+                     const float box[4][4])
+{
+    int i, nb, vp[3];
     mesh_iterator_t iter;
-    mesh_accessor_t accessor;
-    float size[3], p[3];
-    float mat[4][4];
-    float (*shape_func)(const float[3], const float[3], float smoothness);
-    float k, v;
     int mode = painter->mode;
-    bool use_box, skip_src_empty, skip_dst_empty;
+    float grown_box[4][4];
+    int aabb[2][3];
+    op_job_t job = {.mesh = mesh, .painter = painter, .mode = mode};
+
+    box_get_size(box, job.size);
+    // The smooth shapes extend outside of the box by the smoothness.
+    mat4_copy(box, grown_box);
+    for (i = 0; i < 3; i++) {
+        if (!job.size[i]) continue;
+        vec3_imul(grown_box[i], 1 + painter->smoothness / job.size[i]);
+    }
+    mat4_copy(box, job.mat);
+    mat4_iscale(job.mat, 1 / job.size[0], 1 / job.size[1], 1 / job.size[2]);
+    mat4_invert(job.mat, job.mat);
+    job.use_box = painter->box && !box_is_null(*painter->box);
+    job.skip_src_empty = mode == MODE_SUB ||
+                         mode == MODE_SUB_CLAMP ||
+                         mode == MODE_MULT_ALPHA;
+    job.skip_dst_empty = mode == MODE_SUB ||
+                         mode == MODE_SUB_CLAMP ||
+                         mode == MODE_MULT_ALPHA ||
+                         mode == MODE_INTERSECT;
+
+    // for intersection start by deleting all the blocks that are not in
+    // the box.
+    if (mode == MODE_INTERSECT) {
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, vp)) {
+            mesh_get_block_aabb(vp, aabb);
+            if (box_intersect_aabb(grown_box, aabb)) continue;
+            mesh_clear_block(mesh, &iter, vp);
+        }
+    }
+
+    // Compute the new value of all the blocks touched by the box in
+    // parallel, and then copy them into the mesh.
+    nb = get_op_blocks_pos(mesh, grown_box, job.skip_dst_empty,
+                           &job.blocks_pos);
+    job.results = calloc(nb, sizeof(*job.results));
+    // Only evaluate the shapes on the GPU if there are enough blocks to
+    // make the transfers worth it.
+    job.gpu = nb >= GPU_OPS_MIN_BLOCKS && gpu_ops_is_available();
+    if (job.gpu) job.gpu_pending = calloc(nb, sizeof(*job.gpu_pending));
+    parallel_for(nb, op_block, &job);
+    if (job.gpu && !op_apply_gpu(&job, nb)) {
+        job.gpu = false;
+        parallel_for(nb, op_block_pending, &job);
+    }
+    for (i = 0; i < nb; i++) {
+        if (!job.results[i]) continue;
+        mesh_copy_block(job.results[i], job.blocks_pos[i],
+                        mesh, job.blocks_pos[i]);
+        mesh_delete(job.results[i]);
+    }
+    free(job.blocks_pos);
+    free(job.results);
+    free(job.gpu_pending);
+}
+
+// Arguments of the per block tasks of op_apply_stamp.
+typedef struct {
+    const mesh_t    *mesh;
+    mesh_t          *stamp;
+    int             origin[3];
+    int             mode;
+    const uint8_t   *color;
+    bool            skip_dst_empty;
+    int             (*blocks_pos)[3];
+    mesh_t          **results;  // New block value, or NULL if unchanged.
+} stamp_job_t;
+
+// Combine the stamp voxels that fall into one block of the mesh.
+static void stamp_block(void *user, int i)
+{
+    const int size[3] = {N, N, N};
+    stamp_job_t *job = user;
+    const int *bpos = job->blocks_pos[i];
+    uint8_t (*data)[4], (*stamp)[4], c[4], v[4];
+    bool changed = false, skip_src_empty;
+    uint64_t id;
+    int j, spos[3];
+
+    mesh_get_block_data(job->mesh, NULL, bpos, &id);
+    if (!id && job->skip_dst_empty) return;
+    skip_src_empty = job->skip_dst_empty; // Same modes.
+    data = malloc(N * N * N * 4);
+    stamp = malloc(N * N * N * 4);
+    vec3_set(spos, bpos[0] - job->origin[0], bpos[1] - job->origin[1],
+             bpos[2] - job->origin[2]);
+    mesh_read(job->stamp, spos, size, (uint8_t*)stamp);
+    if (id)
+        mesh_read(job->mesh, bpos, size, (uint8_t*)data);
+    else
+        memset(data, 0, N * N * N * 4);
+    for (j = 0; j < N * N * N; j++) {
+        if (!stamp[j][3]) continue;
+        if (!data[j][3] && job->skip_dst_empty) continue;
+        memcpy(c, job->color, 4);
+        c[3] = (int)c[3] * stamp[j][3] / 255;
+        if (!c[3] && skip_src_empty) continue;
+        combine(data[j], c, job->mode, v);
+        if (vec4_equal(v, data[j])) continue;
+        memcpy(data[j], v, 4);
+        changed = true;
+    }
+    if (changed) {
+        job->results[i] = mesh_new();
+        mesh_write(job->results[i], bpos, size, (uint8_t*)data);
+    }
+    free(data);
+    free(stamp);
+}
+
+/*
+ * Get the voxelized shape of a painter, in white with the coverage as
+ * alpha.  The shape only depends on the box up to an integer translation,
+ * so the stamps are cached for the box moved to the origin voxel, and
+ * origin is set to the translation to apply to the returned stamp.
+ */
+static mesh_t *get_stamp(const painter_t *painter, const float box[4][4],
+                         int origin[3])
+{
+    painter_t stamp_painter = {
+        .shape = painter->shape,
+        .mode = MODE_MAX,
+        .color = {255, 255, 255, 255},
+        .smoothness = painter->smoothness,
+    };
+    mesh_t *stamp;
+    struct {
+        const shape_t   *shape;
+        float           box[4][4];
+        float           smoothness;
+    } key;
+    int i;
+
+    memset(&key, 0, sizeof(key));
+    key.shape = painter->shape;
+    mat4_copy(box, key.box);
+    for (i = 0; i < 3; i++) {
+        origin[i] = floor(box[3][i]);
+        key.box[3][i] -= origin[i];
+    }
+    key.smoothness = painter->smoothness;
+
+    cache_lock(g_stamp_cache);
+    stamp = cache_get(g_stamp_cache, &key, sizeof(key));
+    if (stamp) stamp = mesh_copy(stamp);
+    cache_unlock(g_stamp_cache);
+    if (stamp) return stamp;
+
+    stamp = mesh_new();
+    op_apply(stamp, &stamp_painter, key.box);
+    cache_add(g_stamp_cache, &key, sizeof(key), mesh_copy(stamp),
+              mesh_get_mem(stamp), mesh_del);
+    return stamp;
+}
+
+/*
+ * Apply a painter by compositing its cached stamp with the mesh blocks, so
+ * that repeated operations with the same shape and size, like the strokes
+ * of a brush, don't have to evaluate the shape again.  The voxels outside
+ * of the shape are left untouched, as with mesh_op_symmetry.
+ *
+ * We don't use the stamps for the intersection, that also changes the
+ * voxels outside of the shape, with a clipping box, or for large boxes,
+ * that are usually not repeated.  Return false in those cases.
+ */
+static bool op_apply_stamp(mesh_t *mesh, const painter_t *painter,
+                           const float box[4][4])
+{
+    stamp_job_t job = {.mesh = mesh, .mode = painter->mode,
+                       .color = painter->color};
+    int i, j, k, n = 0, allocated = 0, spos[3], bpos[3];
+    float size[3];
+    uint64_t id;
+    mesh_iterator_t iter;
+
+    if (painter->mode == MODE_INTERSECT) return false;
+    if (painter->box && !box_is_null(*painter->box)) return false;
+    box_get_size(box, size);
+    for (i = 0; i < 3; i++) size[i] = 2 * size[i] + 2 * painter->smoothness;
+    if (size[0] * size[1] * size[2] > STAMP_MAX_VOLUME) return false;
+
+    job.stamp = get_stamp(painter, box, job.origin);
+    job.skip_dst_empty = painter->mode == MODE_SUB ||
+                         painter->mode == MODE_SUB_CLAMP ||
+                         painter->mode == MODE_MULT_ALPHA;
+
+    // Each stamp block covers up to eight blocks of the mesh.
+    iter = mesh_get_iterator(job.stamp, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, spos)) {
+        for (k = 0; k < 8; k++) {
+            for (j = 0; j < 3; j++) {
+                bpos[j] = (spos[j] + job.origin[j] +
+                           ((k >> j) & 1) * (N - 1)) & ~(N - 1);
+            }
+            if (job.skip_dst_empty) {
+                mesh_get_block_data(mesh, NULL, bpos, &id);
+                if (!id) continue;
+            }
+            if (n == allocated) {
+                allocated = max(16, allocated * 2);
+                job.blocks_pos = realloc(job.blocks_pos,
+                                         allocated * sizeof(*job.blocks_pos));
+            }
+            memcpy(job.blocks_pos[n++], bpos, sizeof(bpos));
+        }
+    }
+    if (n) qsort(job.blocks_pos, n, sizeof(*job.blocks_pos), blocks_pos_cmp);
+    for (i = 1, j = 0; i < n; i++) {
+        if (blocks_pos_cmp(job.blocks_pos[i], job.blocks_pos[j]) != 0)
+            memcpy(job.blocks_pos[++j], job.blocks_pos[i], sizeof(bpos));
+    }
+    n = min(n, j + 1);
+
+    job.results = calloc(n, sizeof(*job.results));
+    parallel_for(n, stamp_block, &job);
+    for (i = 0; i < n; i++) {
+        if (!job.results[i]) continue;
+        mesh_copy_block(job.results[i], job.blocks_pos[i],
+                        mesh, job.blocks_pos[i]);
+        mesh_delete(job.results[i]);
+    }
+    mesh_delete(job.stamp);
+    free(job.blocks_pos);
+    free(job.results);
+    return true;
+}
+
+/*
+ * Get the mirror flips of all the boxes of an operation with symmetry, in
+ * the order of the recursive mesh_op calls: the mirrored boxes first, and
+ * the box itself last.
+ */
+static int symmetry_get_flips(int symmetry, int flips, int *out)
+{
+    int i, n = 0, sym = symmetry;
+    for (i = 0; i < 3; i++) {
+        if (!(symmetry & (1 << i))) continue;
+        sym &= ~(1 << i);
+        n += symmetry_get_flips(sym, flips | (1 << i), out + n);
+    }
+    out[n++] = flips;
+    return n;
+}
+
+// Mirror all the blocks of a mesh into an other one.  o2 is twice the
+// symmetry origin.
+static void mesh_mirror(const mesh_t *src, mesh_t *dst, int flips,
+                        const int o2[3])
+{
+    const int size[3] = {N, N, N};
+    int i, x, y, z, bpos[3], pos[3], s[3];
+    mesh_iterator_t iter;
+    uint8_t (*a)[4], (*b)[4];
+
+    a = malloc(N * N * N * 4);
+    b = malloc(N * N * N * 4);
+    iter = mesh_get_iterator(src, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_read(src, bpos, size, (uint8_t*)a);
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++)
+        for (x = 0; x < N; x++) {
+            vec3_set(s, x, y, z);
+            for (i = 0; i < 3; i++) {
+                if (flips & (1 << i)) s[i] = N - 1 - s[i];
+            }
+            memcpy(b[(s[2] * N + s[1]) * N + s[0]], a[(z * N + y) * N + x],
+                   4);
+        }
+        for (i = 0; i < 3; i++)
+            pos[i] = (flips & (1 << i)) ? o2[i] - bpos[i] - N : bpos[i];
+        mesh_write(dst, pos, size, (uint8_t*)b);
+    }
+    free(a);
+    free(b);
+}
+
+// Arguments of the per block tasks of mesh_op_symmetry.
+typedef struct {
+    const mesh_t    *mesh;
+    int             mode;
+    bool            skip_dst_empty;
+    int             nb_stamps;
+    mesh_t          *stamps[8];
+    int             (*blocks_pos)[3];
+    mesh_t          **results;  // New block value, or NULL if unchanged.
+} sym_job_t;
+
+// Combine all the stamps with one block of the mesh, in order.
+static void sym_block(void *user, int i)
+{
+    const int size[3] = {N, N, N};
+    sym_job_t *job = user;
+    const int *bpos = job->blocks_pos[i];
+    uint8_t (*data)[4], (*stamp)[4], v[4];
+    bool changed = false;
+    uint64_t id;
+    int j, k;
+
+    data = malloc(N * N * N * 4);
+    stamp = malloc(N * N * N * 4);
+    mesh_read(job->mesh, bpos, size, (uint8_t*)data);
+    for (k = 0; k < job->nb_stamps; k++) {
+        mesh_get_block_data(job->stamps[k], NULL, bpos, &id);
+        if (!id) continue;
+        mesh_read(job->stamps[k], bpos, size, (uint8_t*)stamp);
+        for (j = 0; j < N * N * N; j++) {
+            if (!stamp[j][3]) continue;
+            if (!data[j][3] && job->skip_dst_empty) continue;
+            combine(data[j], stamp[j], job->mode, v);
+            if (vec4_equal(v, data[j])) continue;
+            memcpy(data[j], v, 4);
+            changed = true;
+        }
+    }
+    if (changed) {
+        job->results[i] = mesh_new();
+        mesh_write(job->results[i], bpos, size, (uint8_t*)data);
+    }
+    free(data);
+    free(stamp);
+}
+
+/*
+ * Apply a painter with symmetry in a single pass.  We evaluate the shape
+ * only once, into a stamp mesh that contains the painter color for each
+ * covered voxel, and get the stamps of the mirrored boxes by mirroring its
+ * blocks.  Then all the stamps are combined with each block of the mesh,
+ * in the same order as the recursive calls would do.
+ *
+ * This only works if the symmetry planes fall between the voxels or in
+ * their middle, and if there is no clipping box, since this one is not
+ * mirrored.  The intersection mode also clears the voxels outside of the
+ * shapes, so we don't support it either.  Return false in those cases.
+ */
+static bool mesh_op_symmetry(mesh_t *mesh, const painter_t *painter,
+                             const float box[4][4])
+{
+    const float *o = painter->symmetry_origin;
+    painter_t stamp_painter;
+    mesh_t *stamp;
+    sym_job_t job = {.mesh = mesh, .mode = painter->mode};
+    int i, j, n = 0, allocated = 0, nb_stamps, flips[8], o2[3], bpos[3];
+    uint64_t id;
+    mesh_iterator_t iter;
+
+    if (painter->mode == MODE_INTERSECT) return false;
+    if (painter->box && !box_is_null(*painter->box)) return false;
+    for (i = 0; i < 3; i++) {
+        o2[i] = round(o[i] * 2);
+        if ((painter->symmetry & (1 << i)) && o2[i] != o[i] * 2)
+            return false;
+    }
+
+    stamp_painter = *painter;
+    stamp_painter.symmetry = 0;
+    stamp_painter.mode = MODE_MAX;
+    stamp = mesh_new();
+    mesh_op(stamp, &stamp_painter, box);
+
+    nb_stamps = symmetry_get_flips(painter->symmetry, 0, flips);
+    for (i = 0; i < nb_stamps; i++) {
+        if (!flips[i]) {
+            job.stamps[i] = mesh_copy(stamp);
+            continue;
+        }
+        job.stamps[i] = mesh_new();
+        mesh_mirror(stamp, job.stamps[i], flips[i], o2);
+    }
+    mesh_delete(stamp);
+    job.nb_stamps = nb_stamps;
+    job.skip_dst_empty = painter->mode == MODE_SUB ||
+                         painter->mode == MODE_SUB_CLAMP ||
+                         painter->mode == MODE_MULT_ALPHA;
+
+    // Get the unique positions of all the stamps blocks.
+    for (i = 0; i < nb_stamps; i++) {
+        iter = mesh_get_iterator(job.stamps[i], MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            if (job.skip_dst_empty) {
+                mesh_get_block_data(mesh, NULL, bpos, &id);
+                if (!id) continue;
+            }
+            if (n == allocated) {
+                allocated = max(16, allocated * 2);
+                job.blocks_pos = realloc(job.blocks_pos,
+                                         allocated * sizeof(*job.blocks_pos));
+            }
+            memcpy(job.blocks_pos[n++], bpos, sizeof(bpos));
+        }
+    }
+    if (n) qsort(job.blocks_pos, n, sizeof(*job.blocks_pos), blocks_pos_cmp);
+    for (i = 1, j = 0; i < n; i++) {
+        if (blocks_pos_cmp(job.blocks_pos[i], job.blocks_pos[j]) != 0)
+            memcpy(job.blocks_pos[++j], job.blocks_pos[i], sizeof(bpos));
+    }
+    n = min(n, j + 1);
+
+    job.results = calloc(n, sizeof(*job.results));
+    parallel_for(n, sym_block, &job);
+    for (i = 0; i < n; i++) {
+        if (!job.results[i]) continue;
+        mesh_copy_block(job.results[i], job.blocks_pos[i],
+                        mesh, job.blocks_pos[i]);
+        mesh_delete(job.results[i]);
+    }
+    for (i = 0; i < nb_stamps; i++) mesh_delete(job.stamps[i]);
+    free(job.blocks_pos);
+    free(job.results);
+    return true;
+}
+
+void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
+{
+    int i;
     painter_t painter2;
     float box2[4][4];
-    int aabb[2][3];
     mesh_t *cached;
-    static cache_t *cache = NULL;
     const float *sym_o = painter->symmetry_origin;
 
     // Check if the operation has been cached.
-    if (!cache) cache = cache_create(32);
+    pthread_once(&g_caches_once, caches_init);
+    // Only put the values of the painter in the key, so that two painters
+    // with different clipping box pointers but the same box share the
+    // cached result.
     struct {
-        uint64_t  id;
-        float     box[4][4];
-        painter_t painter;
+        uint64_t        id;
+        float           box[4][4];
+        int             mode;
+        const shape_t   *shape;
+        uint8_t         color[4];
+        float           smoothness;
+        int             symmetry;
+        float           symmetry_origin[3];
+        float           clip_box[4][4];
     } key;
     memset(&key, 0, sizeof(key));
     key.id = mesh_get_key(mesh);
     mat4_copy(box, key.box);
-    key.painter = *painter;
-    cached = cache_get(cache, &key, sizeof(key));
-    if (cached) {
-        mesh_set(mesh, cached);
-        return;
+    key.mode = painter->mode;
+    key.shape = painter->shape;
+    memcpy(key.color, painter->color, 4);
+    key.smoothness = painter->smoothness;
+    key.symmetry = painter->symmetry;
+    vec3_copy(painter->symmetry_origin, key.symmetry_origin);
+    if (painter->box) mat4_copy(*painter->box, key.clip_box);
+    if (!t_caches_disabled) {
+        cache_lock(g_op_cache);
+        cached = cache_get(g_op_cache, &key, sizeof(key));
+        if (cached) mesh_set(mesh, cached);
+        cache_unlock(g_op_cache);
+        if (cached) return;
     }
 
+    if (painter->symmetry && mesh_op_symmetry(mesh, painter, box))
+        goto end;
+
     if (painter->symmetry) {
         painter2 = *painter;
         for (i = 0; i < 3; i++) {
@@ -319,59 +1374,14 @@ void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
         }
     }
 
-    shape_func = painter->shape->func;
-    box_get_size(box, size);
-    mat4_copy(box, mat);
-    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
-    mat4_invert(mat, mat);
-    use_box = painter->box && !box_is_null(*painter->box);
-    skip_src_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA;
-    skip_dst_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA ||
-                     mode == MODE_INTERSECT;
+    if (!op_apply_stamp(mesh, painter, box))
+        op_apply(mesh, painter, box);
 
-    // for intersection start by deleting all the blocks that are not in
-    // the box.
-    if (mode == MODE_INTERSECT) {
-        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
-        while (mesh_iter(&iter, vp)) {
-            mesh_get_block_aabb(vp, aabb);
-            if (box_intersect_aabb(box, aabb)) continue;
-            mesh_clear_block(mesh, &iter, vp);
-        }
-    }
-
-    iter = mesh_get_box_iterator(mesh, box,
-                                 skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0);
-
-    // XXX: for the moment we cannot use the same accessor for both
-    // setting and getting!  Need to fix that!!
-    accessor = mesh_get_accessor(mesh);
-    while (mesh_iter(&iter, vp)) {
-        vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
-        if (use_box && !bbox_contains_vec(*painter->box, p)) continue;
-        mat4_mul_vec3(mat, p, p);
-        k = shape_func(p, size, painter->smoothness);
-        if (painter->smoothness) {
-            v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
-        } else {
-            v = (k >= 0.f) ? 1.f : 0.f;
-        }
-        if (!v && skip_src_empty) continue;
-        memcpy(c, painter->color, 4);
-        c[3] *= v;
-        if (!c[3] && skip_src_empty) continue;
-        mesh_get_at(mesh, &accessor, vp, value);
-        if (!value[3] && skip_dst_empty) continue;
-        combine(value, c, mode, new_value);
-        if (!vec4_equal(value, new_value))
-            mesh_set_at(mesh, &accessor, vp, new_value);
-    }
-
-    cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
+end:
+    if (t_caches_disabled) return;
+    cached = mesh_copy(mesh);
+    cache_add(g_op_cache, &key, sizeof(key), cached, mesh_get_mem(cached),
+              mesh_del);
 }
 
 // XXX: remove this function!
@@ -382,16 +1392,62 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4])
     bbox_from_aabb(box, bbox);
 }
 
-static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
-                        int mode, const uint8_t color[4])
+// Key of the blocks merge cache.
+typedef struct {
+    uint64_t id1;
+    uint64_t id2;
+    int      mode;
+    uint8_t  color[4];
+} block_merge_key_t;
+_Static_assert(sizeof(block_merge_key_t) == 24, "");
+
+// Arguments of the per block mesh_merge tasks.
+typedef struct {
+    const mesh_t    *mesh;
+    const mesh_t    *other;
+    int             mode;
+    const uint8_t   *color;
+    int             (*blocks_pos)[3];
+    block_merge_key_t *keys;
+    mesh_t          **results;  // Merged block (at the origin), or NULL.
+} merge_job_t;
+
+// Compute the merge of one block.  This only reads the meshes, so it can
+// run on any thread.
+static void merge_block(void *user, int i)
+{
+    merge_job_t *job = user;
+    const int *pos = job->blocks_pos[i];
+    const int size[3] = {N, N, N};
+    uint8_t *v1, *v2;
+    mesh_t *block;
+
+    if (!job->keys[i].mode) return; // Nothing to compute.
+    if (job->results[i]) return; // Computed on the GPU.
+    v1 = malloc(N * N * N * 4);
+    v2 = malloc(N * N * N * 4);
+    mesh_read(job->mesh, pos, size, v1);
+    mesh_read(job->other, pos, size, v2);
+    combine_voxels(v1, v2, N * N * N, job->mode, job->color, v1);
+    block = mesh_new();
+    mesh_write(block, (int[]){0, 0, 0}, size, v1);
+    free(v1);
+    free(v2);
+    job->results[i] = block;
+}
+
+/*
+ * Try to merge a block without computing anything, either because the
+ * result is trivial or because it is in the cache.  Return false if the
+ * block needs to be computed, in which case the cache key is set.
+ */
+static bool block_merge_fast(mesh_t *mesh, const mesh_t *other,
+                             const int pos[3], int mode,
+                             const uint8_t color[4], cache_t *cache,
+                             block_merge_key_t *key)
 {
-    int p[3];
-    int x, y, z;
     uint64_t id1, id2;
     mesh_t *block;
-    uint8_t v1[4], v2[4];
-    static cache_t *cache = NULL;
-    mesh_accessor_t a1, a2, a3;
 
     mesh_get_block_data(mesh,  NULL, pos, &id1);
     mesh_get_block_data(other, NULL, pos, &id2);
@@ -403,54 +1459,169 @@ static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
              mode == MODE_SUB ||
              mode == MODE_SUB_CLAMP) && id2 == 0)
     {
-        return;
+        return true;
     }
 
     if ((mode == MODE_OVER || mode == MODE_MAX) && id1 == 0 && !color) {
         mesh_copy_block(other, pos, mesh, pos);
-        return;
+        return true;
     }
 
-    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return;
+    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return true;
     if ((mode == MODE_MULT_ALPHA) && id2 == 0) {
         // XXX: could just delete the block.
     }
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create(512);
-    struct {
-        uint64_t id1;
-        uint64_t id2;
-        int      mode;
-        uint8_t  color[4];
-    } key = { id1, id2, mode };
-    if (color) memcpy(key.color, color, 4);
-    _Static_assert(sizeof(key) == 24, "");
-    block = cache_get(cache, &key, sizeof(key));
-    if (block) goto end;
+    *key = (block_merge_key_t){ id1, id2, mode };
+    if (color) memcpy(key->color, color, 4);
+    if (!cache) return false;
+    cache_lock(cache);
+    block = cache_get(cache, key, sizeof(*key));
+    if (block) mesh_copy_block(block, (int[]){0, 0, 0}, mesh, pos);
+    cache_unlock(cache);
+    return block != NULL;
+}
+
+// Return whether merging an empty block with a mode leaves the destination
+// unchanged.
+static bool mode_skips_empty(int mode)
+{
+    return mode == MODE_OVER || mode == MODE_MAX ||
+           mode == MODE_SUB || mode == MODE_SUB_CLAMP;
+}
+
+/*
+ * Merge some blocks of a mesh into an other.  First do all the blocks that
+ * don't need any computation, then compute the others in parallel, and
+ * finally copy them into the mesh.
+ */
+// A batch of blocks of a mesh_merge computed on the GPU.
+typedef struct {
+    const merge_job_t *job;
+    int             idx[GPU_OPS_BATCH];     // Index of the blocks in the job.
+    uint8_t         *data;
+    uint8_t         *other;
+    uint32_t        *flags;
+} merge_gpu_batch_t;
+
+static void merge_gpu_read(void *user, int i)
+{
+    const int size[3] = {N, N, N};
+    merge_gpu_batch_t *batch = user;
+    const merge_job_t *job = batch->job;
+    const int *pos = job->blocks_pos[batch->idx[i]];
+    mesh_read(job->mesh, pos, size, batch->data + i * N * N * N * 4);
+    mesh_read(job->other, pos, size, batch->other + i * N * N * N * 4);
+}
+
+// Compute the uncertain voxels of a block returned by the GPU.
+static void merge_gpu_finish(void *user, int i)
+{
+    const int size[3] = {N, N, N};
+    merge_gpu_batch_t *batch = user;
+    const merge_job_t *job = batch->job;
+    const uint32_t *flags = batch->flags + i * GPU_OPS_FLAGS_SIZE;
+    uint8_t *v1 = batch->data + i * N * N * N * 4;
+    const uint8_t *v2 = batch->other + i * N * N * N * 4;
+    mesh_t *block;
+    int j;
 
+    if (flags[0] & GPU_OPS_UNCERTAIN) {
+        for (j = 0; j < N * N * N; j++) {
+            if (!(flags[1 + j / 32] & (1u << (j % 32)))) continue;
+            combine_voxels(v1 + j * 4, v2 + j * 4, 1, job->mode, job->color,
+                           v1 + j * 4);
+        }
+    }
     block = mesh_new();
-    a1 = mesh_get_accessor(mesh);
-    a2 = mesh_get_accessor(other);
-    a3 = mesh_get_accessor(block);
+    mesh_write(block, (int[]){0, 0, 0}, size, v1);
+    job->results[batch->idx[i]] = block;
+}
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &a1, p, v1);
-        mesh_get_at(other, &a2, p, v2);
-        if (color) color_mul(v2, color, v2);
-        combine(v1, v2, mode, v1);
-        mesh_set_at(block, &a3, (int[]){x, y, z}, v1);
-    }
-    cache_add(cache, &key, sizeof(key), block, 1, mesh_del);
+/*
+ * Compute the blocks of a merge on the GPU, by batches.  If the GPU fails
+ * the blocks not done yet are left to merge_block.
+ */
+static void merge_blocks_gpu(merge_job_t *job, int nb)
+{
+    merge_gpu_batch_t *batch;
+    int i = 0, n;
+
+    batch = calloc(1, sizeof(*batch));
+    batch->job = job;
+    batch->data = malloc(GPU_OPS_BATCH * N * N * N * 4);
+    batch->other = malloc(GPU_OPS_BATCH * N * N * N * 4);
+    batch->flags = malloc(GPU_OPS_BATCH * GPU_OPS_FLAGS_SIZE *
+                          sizeof(*batch->flags));
+    while (true) {
+        for (n = 0; i < nb && n < GPU_OPS_BATCH; i++) {
+            if (job->keys[i].mode) batch->idx[n++] = i;
+        }
+        if (!n) break;
+        parallel_for(n, merge_gpu_read, batch);
+        if (!gpu_ops_merge(job->mode, job->color, n, batch->data,
+                           batch->other, batch->flags))
+            break;
+        parallel_for(n, merge_gpu_finish, batch);
+    }
+    free(batch->data);
+    free(batch->other);
+    free(batch->flags);
+    free(batch);
+}
+
+static void merge_blocks(mesh_t *mesh, const mesh_t *other, int mode,
+                         const uint8_t color[4],
+                         int nb, int (*blocks_pos)[3])
+{
+    mesh_t *block;
+    int i, nb_compute = 0;
+    merge_job_t job = {mesh, other, mode, color, blocks_pos};
 
+    pthread_once(&g_caches_once, caches_init);
+    job.keys = calloc(nb, sizeof(*job.keys));
+    job.results = calloc(nb, sizeof(*job.results));
+    for (i = 0; i < nb; i++) {
+        if (block_merge_fast(mesh, other, blocks_pos[i], mode, color,
+                             t_caches_disabled ? NULL : g_blocks_merge_cache,
+                             &job.keys[i]))
+            job.keys[i].mode = 0;
+        else
+            nb_compute++;
+    }
+    if (nb_compute >= GPU_OPS_MIN_BLOCKS && gpu_ops_is_available())
+        merge_blocks_gpu(&job, nb);
+    parallel_for(nb, merge_block, &job);
+    if (t_caches_disabled) {
+        for (i = 0; i < nb; i++) {
+            if (!job.results[i]) continue;
+            mesh_copy_block(job.results[i], (int[]){0, 0, 0},
+                            mesh, blocks_pos[i]);
+            mesh_delete(job.results[i]);
+        }
+        goto end;
+    }
+    cache_lock(g_blocks_merge_cache);
+    for (i = 0; i < nb; i++) {
+        if (!job.results[i]) continue;
+        // The same block could have been computed several times.
+        block = cache_get(g_blocks_merge_cache, &job.keys[i],
+                          sizeof(job.keys[i]));
+        if (block) {
+            mesh_delete(job.results[i]);
+        } else {
+            block = job.results[i];
+            cache_add(g_blocks_merge_cache, &job.keys[i],
+                      sizeof(job.keys[i]), block, mesh_get_mem(block),
+                      mesh_del);
+        }
+        mesh_copy_block(block, (int[]){0, 0, 0}, mesh, blocks_pos[i]);
+    }
+    cache_unlock(g_blocks_merge_cache);
 end:
-    mesh_copy_block(block, (int[]){0, 0, 0}, mesh, pos);
-    return;
+    free(job.keys);
+    free(job.results);
 }
 
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
@@ -458,13 +1629,12 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
 {
     mesh_t *cached;
     assert(mesh && other);
-    static cache_t *cache = NULL;
     mesh_iterator_t iter;
-    int bpos[3];
+    int nb, (*blocks_pos)[3];
     uint64_t id1, id2;
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create(512);
+    pthread_once(&g_caches_once, caches_init);
     id1 = mesh_get_key(mesh);
     id2 = mesh_get_key(other);
     struct {
@@ -475,18 +1645,232 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
     } key = { id1, id2, mode };
     if (color) memcpy(key.color, color, 4);
     _Static_assert(sizeof(key) == 24, "");
-    cached = cache_get(cache, &key, sizeof(key));
-    if (cached) {
-        mesh_set(mesh, cached);
+    if (!t_caches_disabled) {
+        cache_lock(g_merge_cache);
+        cached = cache_get(g_merge_cache, &key, sizeof(key));
+        if (cached) mesh_set(mesh, cached);
+        cache_unlock(g_merge_cache);
+        if (cached) return;
+    }
+
+    // No need to visit the blocks that are only in the destination mesh
+    // if they are left unchanged, as when pasting into a large layer.
+    if (mode_skips_empty(mode))
+        iter = mesh_get_iterator(other, MESH_ITER_BLOCKS);
+    else
+        iter = mesh_get_union_iterator(mesh, other, MESH_ITER_BLOCKS);
+    nb = get_blocks_pos(&iter, &blocks_pos);
+    merge_blocks(mesh, other, mode, color, nb, blocks_pos);
+    free(blocks_pos);
+
+    if (t_caches_disabled) return;
+    cached = mesh_copy(mesh);
+    cache_add(g_merge_cache, &key, sizeof(key), cached, mesh_get_mem(cached),
+              mesh_del);
+}
+
+void mesh_merge_blocks(mesh_t *mesh, const mesh_t *base,
+                       const mesh_t *other, int mode,
+                       const uint8_t color[4],
+                       int nb, int (*blocks_pos)[3])
+{
+    int i;
+    for (i = 0; i < nb; i++)
+        mesh_copy_block(base, blocks_pos[i], mesh, blocks_pos[i]);
+    merge_blocks(mesh, other, mode, color, nb, blocks_pos);
+}
+
+// Arguments of the per block mesh_merge_n tasks.
+typedef struct {
+    const mesh_t    *mesh;
+    int             nb;
+    const mesh_t    **meshes;
+    int             mode;
+    int             (*blocks_pos)[3];
+    mesh_t          **results;  // Merged block (at the origin), or NULL.
+    const mesh_t    **copies;   // Mesh to copy the block from, or NULL.
+} merge_n_job_t;
+
+// Compose all the meshes blocks at a given position in one pass.
+static void merge_n_block(void *user, int i)
+{
+    merge_n_job_t *job = user;
+    const int *pos = job->blocks_pos[i];
+    const int size[3] = {N, N, N};
+    uint8_t *v1, *v2;
+    uint64_t id;
+    int j, nb_src = 0, last = -1;
+    mesh_t *block;
+
+    for (j = 0; j < job->nb; j++) {
+        mesh_get_block_data(job->meshes[j], NULL, pos, &id);
+        if (id == 0 && mode_skips_empty(job->mode)) continue;
+        nb_src++;
+        last = j;
+    }
+    if (nb_src == 0) return;
+    // A single block over an empty one is just copied in the final pass.
+    mesh_get_block_data(job->mesh, NULL, pos, &id);
+    if (    nb_src == 1 && id == 0 &&
+            (job->mode == MODE_OVER || job->mode == MODE_MAX)) {
+        job->copies[i] = job->meshes[last];
         return;
     }
 
-    iter = mesh_get_union_iterator(mesh, other, MESH_ITER_BLOCKS);
-    while (mesh_iter(&iter, bpos)) {
-        block_merge(mesh, other, bpos, mode, color);
+    v1 = malloc(N * N * N * 4);
+    v2 = malloc(N * N * N * 4);
+    mesh_read(job->mesh, pos, size, v1);
+    for (j = 0; j < job->nb; j++) {
+        mesh_get_block_data(job->meshes[j], NULL, pos, &id);
+        if (id == 0 && mode_skips_empty(job->mode)) continue;
+        mesh_read(job->meshes[j], pos, size, v2);
+        combine_voxels(v1, v2, N * N * N, job->mode, NULL, v1);
+    }
+    block = mesh_new();
+    mesh_write(block, (int[]){0, 0, 0}, size, v1);
+    free(v1);
+    free(v2);
+    job->results[i] = block;
+}
+
+/*
+ * Merge several meshes at some blocks positions.  Each block is computed
+ * from all the meshes at once, in parallel, so that we don't create any
+ * intermediate merged mesh.
+ */
+static void merge_n_blocks(mesh_t *mesh, int nb, const mesh_t **meshes,
+                           int mode, int n, int (*blocks_pos)[3])
+{
+    int i;
+    merge_n_job_t job = {mesh, nb, meshes, mode, blocks_pos};
+
+    job.results = calloc(n, sizeof(*job.results));
+    job.copies = calloc(n, sizeof(*job.copies));
+    parallel_for(n, merge_n_block, &job);
+    for (i = 0; i < n; i++) {
+        if (job.copies[i]) {
+            mesh_copy_block(job.copies[i], blocks_pos[i],
+                            mesh, blocks_pos[i]);
+        }
+        if (job.results[i]) {
+            mesh_copy_block(job.results[i], (int[]){0, 0, 0},
+                            mesh, blocks_pos[i]);
+            mesh_delete(job.results[i]);
+        }
+    }
+    free(job.results);
+    free(job.copies);
+}
+
+// Sort a list of blocks positions and remove the duplicates.
+static int blocks_pos_uniq(int n, int (*blocks_pos)[3])
+{
+    int i, j;
+    if (n == 0) return 0;
+    qsort(blocks_pos, n, sizeof(*blocks_pos), blocks_pos_cmp);
+    for (i = 1, j = 0; i < n; i++) {
+        if (blocks_pos_cmp(blocks_pos[i], blocks_pos[j]) != 0)
+            memcpy(blocks_pos[++j], blocks_pos[i], sizeof(*blocks_pos));
     }
+    return j + 1;
+}
+
+void mesh_merge_n(mesh_t *mesh, int nb, const mesh_t **meshes, int mode)
+{
+    int i, n = 0, nb_pos, (*blocks_pos)[3] = NULL, (*pos)[3];
+    mesh_iterator_t iter;
 
-    cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
+    // Union of the blocks positions of all the meshes.
+    for (i = -1; i < nb; i++) {
+        iter = mesh_get_iterator(i == -1 ? mesh : meshes[i],
+                                 MESH_ITER_BLOCKS);
+        nb_pos = get_blocks_pos(&iter, &pos);
+        if (!nb_pos) continue;
+        blocks_pos = realloc(blocks_pos, (n + nb_pos) * sizeof(*blocks_pos));
+        memcpy(blocks_pos + n, pos, nb_pos * sizeof(*pos));
+        n += nb_pos;
+        free(pos);
+    }
+    n = blocks_pos_uniq(n, blocks_pos);
+    merge_n_blocks(mesh, nb, meshes, mode, n, blocks_pos);
+    free(blocks_pos);
+}
+
+void mesh_merger_update(mesh_merger_t *merger, int nb,
+                        const mesh_t **meshes, int mode)
+{
+    int i, n = 0, allocated = 0, bpos[3], (*blocks_pos)[3] = NULL;
+    int nb_changes, (*changes)[3];
+    uint64_t id1, id2;
+    mesh_iterator_t iter;
+
+    if (!merger->mesh) merger->mesh = mesh_new();
+
+    // If the number of meshes changed, we redo the full merge.
+    if (nb != merger->nb) {
+        mesh_merger_release(merger);
+        merger->mesh = mesh_new();
+        merger->nb = nb;
+        merger->srcs = calloc(nb, sizeof(*merger->srcs));
+        mesh_merge_n(merger->mesh, nb, meshes, mode);
+        for (i = 0; i < nb; i++)
+            merger->srcs[i] = mesh_copy(meshes[i]);
+        return;
+    }
+
+    // Collect the positions of all the blocks that changed in any of the
+    // meshes since the last update.  We use the changes journal if it
+    // goes back to our copy, otherwise we compare all the blocks ids.
+    for (i = 0; i < nb; i++) {
+        if (mesh_get_key(merger->srcs[i]) == mesh_get_key(meshes[i]))
+            continue;
+        nb_changes = mesh_get_changes(
+                meshes[i], mesh_get_version(merger->srcs[i]), &changes);
+        if (nb_changes >= 0) {
+            if (n + nb_changes > allocated) {
+                allocated = max(allocated * 2, n + nb_changes);
+                blocks_pos = realloc(blocks_pos,
+                                     allocated * sizeof(*blocks_pos));
+            }
+            memcpy(blocks_pos + n, changes, nb_changes * sizeof(*changes));
+            n += nb_changes;
+            free(changes);
+            mesh_set(merger->srcs[i], meshes[i]);
+            continue;
+        }
+        iter = mesh_get_union_iterator(merger->srcs[i], meshes[i],
+                                       MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            mesh_get_block_data(merger->srcs[i], NULL, bpos, &id1);
+            mesh_get_block_data(meshes[i], NULL, bpos, &id2);
+            if (id1 == id2) continue;
+            if (n == allocated) {
+                allocated = max(16, allocated * 2);
+                blocks_pos = realloc(blocks_pos,
+                                     allocated * sizeof(*blocks_pos));
+            }
+            memcpy(blocks_pos[n++], bpos, sizeof(bpos));
+        }
+        mesh_set(merger->srcs[i], meshes[i]);
+    }
+    if (!n) return;
+
+    // Recompute those blocks only.
+    n = blocks_pos_uniq(n, blocks_pos);
+    for (i = 0; i < n; i++)
+        mesh_clear_block(merger->mesh, NULL, blocks_pos[i]);
+    merge_n_blocks(merger->mesh, nb, meshes, mode, n, blocks_pos);
+    free(blocks_pos);
+}
+
+void mesh_merger_release(mesh_merger_t *merger)
+{
+    int i;
+    if (merger->mesh) mesh_delete(merger->mesh);
+    for (i = 0; i < merger->nb; i++)
+        mesh_delete(merger->srcs[i]);
+    free(merger->srcs);
+    *merger = (mesh_merger_t){};
 }
 
 void mesh_crop(mesh_t *mesh, const float box[4][4])
@@ -499,11 +1883,84 @@ void mesh_crop(mesh_t *mesh, const float box[4][4])
     mesh_op(mesh, &painter, box);
 }
 
+// Test the voxels of a row against the box shape, like mask_add_box.
+static void box_row(const float mat[4][4], const float size[3],
+                    const float dp[3], int x, int y, int z, int n, float *k)
+{
+    float p[3] = {x + 0.5, y + 0.5, z + 0.5};
+    mat4_mul_vec3(mat, p, p);
+    shape_cube.func_row(p, dp, n, size, 0, k);
+}
+
+mesh_t *mesh_copy_box(const mesh_t *mesh, const float box[4][4])
+{
+    const int bsize[3] = {N, N, N};
+    float mat[4][4], size[3], dp[3], bbox[4][4], k[N];
+    int aabb[2][3], bpos[3], x, y, z, i;
+    bool inside, outside;
+    mesh_t *ret;
+    mesh_iterator_t iter;
+    uint8_t (*data)[4] = NULL;
+
+    ret = mesh_new();
+    if (box_is_null(box)) return ret;
+    box_get_size(box, size);
+    mat4_copy(box, mat);
+    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
+    mat4_invert(mat, mat);
+    vec3_copy(mat[0], dp);
+    box_get_bbox(box, bbox);
+    bbox_to_aabb(bbox, aabb);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] -= 1;
+        aabb[1][i] += 1;
+    }
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        if (    bpos[0] + N <= aabb[0][0] || bpos[0] >= aabb[1][0] ||
+                bpos[1] + N <= aabb[0][1] || bpos[1] >= aabb[1][1] ||
+                bpos[2] + N <= aabb[0][2] || bpos[2] >= aabb[1][2])
+            continue;
+        // The box is convex, so the block is inside if all its corner
+        // voxels are.
+        inside = true;
+        for (i = 0; i < 4 && inside; i++) {
+            box_row(mat, size, dp, bpos[0], bpos[1] + (i & 1) * (N - 1),
+                    bpos[2] + (i >> 1) * (N - 1), N, k);
+            inside = k[0] >= 0.f && k[N - 1] >= 0.f;
+        }
+        if (inside) {
+            mesh_copy_block(mesh, bpos, ret, bpos);
+            continue;
+        }
+        if (!data) data = malloc(N * N * N * 4);
+        mesh_read(mesh, bpos, bsize, (uint8_t*)data);
+        outside = true;
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++) {
+            box_row(mat, size, dp, bpos[0], bpos[1] + y, bpos[2] + z, N, k);
+            for (x = 0; x < N; x++) {
+                if (k[x] >= 0.f) {
+                    outside = false;
+                    continue;
+                }
+                memset(data[x + y * N + z * N * N], 0, 4);
+            }
+        }
+        if (!outside) mesh_write(ret, bpos, bsize, (uint8_t*)data);
+    }
+    free(data);
+    mesh_remove_empty_blocks(ret, false);
+    return ret;
+}
+
 /* Function: mesh_crc32
  * Compute the crc32 of the mesh data as an array of xyz rgba values.
  *
  * This is only used in the tests, to make sure that we can still open
- * old file formats.
+ * old file formats, since the values are stored in the tests.  It reads
+ * all the voxels, so use <mesh_get_hash> to compare meshes.
  */
 uint32_t mesh_crc32(const mesh_t *mesh)
 {
@@ -51,6 +51,24 @@ enum {
 };
 
 
+/*
+ * Function: combine_voxels
+ * Apply an array of source voxels into an array of destination voxels.
+ *
+ * The simple modes use vector instructions to process several voxels at
+ * once.
+ *
+ * Parameters:
+ *   a      - Destination RGBA voxels.
+ *   b      - Source RGBA voxels.
+ *   n      - Number of voxels.
+ *   mode   - One of the <MODE> enum value.
+ *   color  - If not NULL, multiply the source voxels with this color.
+ *   out    - Output RGBA voxels.  Can be the same as a or b.
+ */
+void combine_voxels(const uint8_t *a, const uint8_t *b, int n, int mode,
+                    const uint8_t color[4], uint8_t *out);
+
 // Structure used for the OpenGL array data of blocks.
 // XXX: we can probably make it smaller.
 typedef struct voxel_vertex
@@ -66,6 +84,43 @@ typedef struct voxel_vertex
     uint8_t  bump_uv[2]                 __attribute__((aligned(4)));
 } voxel_vertex_t;
 
+/*
+ * Type: voxel_packed_vertex_t
+ * Compact version of voxel_vertex_t for the quads vertices.
+ *
+ * The normal, tangent and uv attributes are computed from the face
+ * index and the vertex index in the quad, and the occlusion and bump
+ * texture coordinates from the shadow and borders masks.  The color alpha
+ * is always 255 for visible faces.
+ */
+typedef struct voxel_packed_vertex
+{
+    uint8_t  pos[3];
+    uint8_t  face;          // face * 4 + vertex index in the quad.
+    uint8_t  shadow_mask;
+    uint8_t  borders_mask;
+    uint8_t  color[3];
+    int8_t   gradient[3];
+} voxel_packed_vertex_t;
+
+/*
+ * Type: voxel_face_t
+ * A whole quad packed into 8 bytes, for the vertex pulling render path.
+ *
+ * The vertex shader expands it into the quad vertices, see
+ * <mesh_pack_faces>.  The bits are:
+ *
+ *    data[0]: x, y, z of the quad min corner (6 bits each), face (3 bits),
+ *             then, if the last bit is set, the quad size minus one along
+ *             the two other axes (5 bits each), or else the borders mask
+ *             of a one voxel quad (8 bits).
+ *    data[1]: color rgb (24 bits), shadow mask (8 bits).
+ */
+typedef struct voxel_face
+{
+    uint32_t data[2];
+} voxel_face_t;
+
 
 // Type: painter_t
 // The painting context, including the tool, brush, mode, radius,
@@ -94,6 +149,11 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4]);
  * This function render geometrical 3d shapes into a mesh.
  * The shape, mode and color are defined in the painter argument.
  *
+ * The shapes of the small boxes are voxelized once and cached as stamps:
+ * applying the same shape with the same size and sub voxel offset at an
+ * other position, like for the brush strokes, only blends the stamp
+ * voxels into the mesh blocks.
+ *
  * Parameters:
  *   mesh    - The mesh we paint into.
  *   painter - Defines the paint operation to apply.
@@ -105,7 +165,19 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4]);
  */
 void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4]);
 
-// XXX: to cleanup.
+/* Function: mesh_extrude
+ *
+ * Extrude the voxels of a plane along its normal.
+ *
+ * All the voxels inside the box are set to the value of their projection
+ * on the plane, and the other voxels of the blocks covered by the box are
+ * cleared.
+ *
+ * Parameters:
+ *   mesh  - The mesh to modify.
+ *   plane - The plane of the source voxels.
+ *   box   - An axis aligned box.
+ */
 void mesh_extrude(mesh_t *mesh,
                   const float plane[4][4],
                   const float box[4][4]);
@@ -115,6 +187,9 @@ void mesh_extrude(mesh_t *mesh,
  * Blit voxel data into a mesh.
  * This is the fastest way to quickly put data into a mesh.
  *
+ * This is the same as <mesh_write>: only the blocks touched by the data
+ * are modified.
+ *
  * Parameters:
  *   mesh - The mesh we blit into.
  *   data - Pointer to voxel data (RGBA values, in xyz order).
@@ -124,14 +199,48 @@ void mesh_extrude(mesh_t *mesh,
  *   w    - Width of the data.
  *   h    - Height of the data.
  *   d    - Depth of the data.
- *   iter - Optional iterator for optimized access.
+ *   iter - Unused.
  */
 void mesh_blit(mesh_t *mesh, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
                mesh_iterator_t *iter);
 
+/*
+ * Function: mesh_move
+ * Apply a transformation matrix to a mesh.
+ *
+ * The integer translations directly move the voxels, the other
+ * transformations resample the mesh with the nearest voxels.
+ */
 void mesh_move(mesh_t *mesh, const float mat[4][4]);
 
+/*
+ * Function: mesh_move_blocks
+ * Update a moved copy of a mesh after some of its blocks changed.
+ *
+ * The destination mesh should be the source mesh moved with <mesh_move>
+ * before the changes.  Only the voxels coming from the changed blocks are
+ * updated, and if the translation is a multiple of the block size the
+ * blocks data are directly shared with the source.
+ *
+ * This only supports the whole voxels translations, since the other
+ * transformations resample the whole mesh.
+ *
+ * Parameters:
+ *   mesh       - The moved mesh to update.
+ *   src        - The source mesh.
+ *   mat        - The transformation matrix.
+ *   nb         - Number of changed blocks.
+ *   blocks_pos - Positions of the changed blocks in the source mesh, as
+ *                returned by <mesh_get_changes>.
+ *
+ * Return:
+ *   false if the matrix is not a whole voxels translation, in which case
+ *   the mesh is not modified.
+ */
+bool mesh_move_blocks(mesh_t *mesh, const mesh_t *src, const float mat[4][4],
+                      int nb, const int (*blocks_pos)[3]);
+
 void mesh_shift_alpha(mesh_t *mesh, int v);
 
 // Compute the selection mask for a given condition.
@@ -157,6 +266,83 @@ int mesh_select(const mesh_t *mesh,
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
                 const uint8_t color[4]);
 
+/*
+ * Function: mesh_merge_n
+ * Merge several meshes in order into an other one.
+ *
+ * The result is the same as calling <mesh_merge> for each mesh, but each
+ * block is composed from all the meshes in a single pass, and the blocks
+ * are computed in parallel.
+ *
+ * Parameters:
+ *   mesh   - The destination mesh we merge into.
+ *   nb     - Number of meshes to merge.
+ *   meshes - The meshes to merge, from bottom to top.
+ *   mode   - The blending function used.  One of the <MODE> enum values.
+ */
+void mesh_merge_n(mesh_t *mesh, int nb, const mesh_t **meshes, int mode);
+
+/*
+ * Function: mesh_merge_blocks
+ * Recompute some blocks of the merge of two meshes.
+ *
+ * Each given block of the destination mesh is set to the merge of the same
+ * blocks of base and other, as <mesh_merge> would do.  This is used to
+ * keep a merge up to date when only a few blocks of the sources changed.
+ *
+ * Parameters:
+ *   mesh       - The destination mesh.
+ *   base       - The mesh we merge into.
+ *   other      - The source mesh we merge.
+ *   mode       - The blending function used.
+ *   color      - A color to apply to the source mesh, or NULL.
+ *   nb         - Number of blocks to recompute.
+ *   blocks_pos - Positions of the blocks to recompute.
+ */
+void mesh_merge_blocks(mesh_t *mesh, const mesh_t *base,
+                       const mesh_t *other, int mode,
+                       const uint8_t color[4],
+                       int nb, int (*blocks_pos)[3]);
+
+/*
+ * Type: mesh_merger_t
+ * Keep the merge of a list of meshes up to date incrementally.
+ *
+ * Attributes:
+ *   mesh - The merged mesh.
+ *   nb   - Number of merged meshes.
+ *   srcs - Copies of the merged meshes, as of the last update.
+ */
+typedef struct {
+    mesh_t  *mesh;
+    int     nb;
+    mesh_t  **srcs;
+} mesh_merger_t;
+
+/*
+ * Function: mesh_merger_update
+ * Update the merge of a list of meshes.
+ *
+ * The result is the same as merging all the meshes in order into an empty
+ * mesh, but only the blocks that changed in any of the meshes since the
+ * last call are recomputed.  If the number of meshes changed, we redo the
+ * full merge.
+ *
+ * Parameters:
+ *   merger - A merger, initialized to zero before the first call.
+ *   nb     - Number of meshes.
+ *   meshes - The meshes to merge, from bottom to top.
+ *   mode   - The blending function used.  One of the <MODE> enum values.
+ */
+void mesh_merger_update(mesh_merger_t *merger, int nb,
+                        const mesh_t **meshes, int mode);
+
+/*
+ * Function: mesh_merger_release
+ * Release the memory used by a merger, and reset it to zero.
+ */
+void mesh_merger_release(mesh_merger_t *merger);
+
 /*
  * Function: mesh_generate_vertices
  * Generate a vertice array for rendering a mesh block.
@@ -164,7 +350,10 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
  * Parameters:
  *   mesh       - Input mesh.
  *   block_pos  - Position of the mesh block to render.
- *   effects    - Effect flags.
+ *   effects    - Effect flags.  With EFFECT_MERGE_FACES, the coplanar
+ *                faces of the same color and without occlusion are merged
+ *                into bigger quads.  The pos_data attribute of the merged
+ *                quads is then only the position of their first voxel.
  *   out        - Output array.
  *   size       - Output the size of a single face.
  *                4 for quads and 3 for triangles.  Normal mesh uses quad
@@ -177,14 +366,195 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
                            int effects, voxel_vertex_t *out,
                            int *size, int *subdivide);
 
+/*
+ * Function: mesh_generate_vertices_lod
+ * Generate a lower level of detail vertice array for a mesh block.
+ *
+ * The voxels are first downsampled by cubes of (1 << lod) voxels, and we
+ * generate the faces of those bigger voxels.  The positions are still in
+ * voxel units, so the output can be used the same way as the one of
+ * <mesh_generate_vertices>.
+ *
+ * Parameters:
+ *   lod        - The level of detail, from 0 (full resolution) to 3.  The
+ *                marching cubes effect only supports the level 0.
+ *
+ * See <mesh_generate_vertices> for the other parameters.
+ */
+int mesh_generate_vertices_lod(const mesh_t *mesh, const int block_pos[3],
+                               int effects, int lod, voxel_vertex_t *out,
+                               int *size, int *subdivide);
+
+/*
+ * Type: mesh_vertices_t
+ * Reference counted vertices of a mesh block, as returned by
+ * <mesh_get_vertices>.
+ */
+typedef struct mesh_vertices {
+    int             ref;
+    int             nb;         // Number of faces.
+    int             size;       // Vertices per face: 3 or 4.
+    int             subdivide;
+    voxel_vertex_t  verts[];
+} mesh_vertices_t;
+
+/*
+ * Function: mesh_get_vertices
+ * Get the vertices of a mesh block from a global cache.
+ *
+ * The cache is shared by the renderer, the exports and the path tracer, so
+ * that a block is only tessellated once for all of them.  The key is the
+ * data id of the block and of its 26 neighbors, plus the effects that
+ * change the geometry.  The faces of the interior, of each side, and of
+ * the edges of the blocks are also cached separately, keyed only on the
+ * blocks they depend on, so that after a change the neighbour blocks only
+ * compute again the faces next to it.  This function is thread safe.
+ *
+ * Parameters:
+ *   mesh    - The mesh.
+ *   pos     - Position of the block.
+ *   effects - Effect flags, as for <mesh_generate_vertices>.
+ *   lod     - Level of detail, as for <mesh_generate_vertices_lod>.
+ *
+ * Return:
+ *   A new reference to the vertices, to release with
+ *   <mesh_vertices_release>.
+ */
+mesh_vertices_t *mesh_get_vertices(const mesh_t *mesh, const int pos[3],
+                                   int effects, int lod);
+
+/*
+ * Function: mesh_vertices_release
+ * Release a reference returned by <mesh_get_vertices>.
+ */
+void mesh_vertices_release(mesh_vertices_t *vertices);
+
+/*
+ * Function: mesh_vertices_cache_clear
+ * Remove all the vertices from the global cache.
+ */
+void mesh_vertices_cache_clear(void);
+
+/*
+ * Type: mesh_block_vertices_t
+ * The vertices of a mesh block, as passed by <mesh_iter_vertices>.
+ */
+typedef struct {
+    int                     pos[3];     // Position of the block.
+    const voxel_vertex_t    *verts;
+    int                     nb;         // Number of faces.
+    int                     size;       // Vertices per face: 3 or 4.
+    int                     subdivide;
+    int                     index;      // Index of the block in the mesh.
+    int                     count;      // Total number of blocks.
+} mesh_block_vertices_t;
+
+/*
+ * Function: mesh_iter_vertices
+ * Generate the vertices of all the blocks of a mesh, and pass them to a
+ * callback one block at a time.
+ *
+ * The blocks are tessellated in parallel by batches, so the memory used
+ * stays bounded whatever the size of the mesh.  The callback is always
+ * called on the calling thread, in the mesh blocks order, including for
+ * the blocks without faces so that it can report the progress.
+ *
+ * Parameters:
+ *   mesh    - The mesh.
+ *   effects - Effect flags passed to <mesh_generate_vertices>.
+ *   user    - User data passed to the callback.
+ *   f       - The callback.  If it returns a non zero value, we stop the
+ *             iteration and return this value.
+ *
+ * Return:
+ *   Zero, or the value returned by the callback if it stopped the
+ *   iteration.
+ */
+int mesh_iter_vertices(const mesh_t *mesh, int effects, void *user,
+                       int (*f)(void *user, const mesh_block_vertices_t *b));
+
+/*
+ * Function: mesh_pack_vertices
+ * Convert quads vertices generated by <mesh_generate_vertices> into the
+ * compact <voxel_packed_vertex_t> format.
+ *
+ * Parameters:
+ *   verts  - Input vertices, four per quad.
+ *   nb     - Number of vertices.
+ *   out    - Output array.
+ */
+void mesh_pack_vertices(const voxel_vertex_t *verts, int nb,
+                        voxel_packed_vertex_t *out);
+
+/*
+ * Function: mesh_pack_faces
+ * Convert packed quads vertices into one <voxel_face_t> per quad.
+ *
+ * The gradients are lost, and so are the borders masks of the quads
+ * larger than a voxel, which only come from the merged faces, where they
+ * are always zero.
+ *
+ * Parameters:
+ *   verts  - Input packed vertices, four per quad.
+ *   nb     - Number of quads.
+ *   out    - Output array.
+ */
+void mesh_pack_faces(const voxel_packed_vertex_t *verts, int nb,
+                     voxel_face_t *out);
+
+/*
+ * Function: mesh_index_vertices
+ * Merge the identical vertices of a list of triangles.
+ *
+ * This is used for the marching cube triangles, where most vertices on the
+ * cells edges are shared by several triangles.
+ *
+ * Parameters:
+ *   verts   - The triangles vertices, replaced by the unique vertices.
+ *   nb      - Number of vertices.
+ *   indices - Output indices into the unique vertices, nb values.
+ *
+ * Return:
+ *   The number of unique vertices, or -1 if there are too many for
+ *   16 bits indices, in which case the vertices are left unchanged.
+ */
+int mesh_index_vertices(voxel_vertex_t *verts, int nb, uint16_t *indices);
+
+/*
+ * Function: mesh_ops_cache_enable
+ * Enable or disable the caches of <mesh_op> and <mesh_merge>.
+ *
+ * Without the caches the operations are applied directly to the mesh,
+ * and their results are not kept alive by the cache, so that the next
+ * operations on the same blocks don't have to copy them.  This is useful
+ * for long batches of operations whose intermediate results won't be
+ * needed again.  The <mesh_op> stamps are still cached, since they don't
+ * depend on the mesh.
+ *
+ * This only affects the calling thread.  The calls can be nested: the
+ * caches are enabled again after as many calls with true as with false.
+ */
+void mesh_ops_cache_enable(bool enabled);
+
 // XXX: use int[2][3] for the box?
 void mesh_crop(mesh_t *mesh, const float box[4][4]);
 
+/*
+ * Function: mesh_copy_box
+ * Create a copy of the voxels of a mesh inside a box.
+ *
+ * Same as a copy followed by <mesh_crop>, but the blocks fully inside the
+ * box just share their data with the source mesh, so that only the blocks
+ * crossing the box border are processed voxel per voxel.
+ */
+mesh_t *mesh_copy_box(const mesh_t *mesh, const float box[4][4]);
+
 /* Function: mesh_crc32
  * Compute the crc32 of the mesh data as an array of xyz rgba values.
  *
  * This is only used in the tests, to make sure that we can still open
- * old file formats.
+ * old file formats, since the values are stored in the tests.  It reads
+ * all the voxels, so use <mesh_get_hash> to compare meshes.
  */
 uint32_t mesh_crc32(const mesh_t *mesh);
 
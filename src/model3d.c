@@ -315,7 +315,8 @@ void model3d_render(model3d_t *model3d,
         GL(glBindBuffer(GL_ARRAY_BUFFER, model3d->vertex_buffer));
         GL(glBufferData(GL_ARRAY_BUFFER,
                         model3d->nb_vertices * sizeof(*model3d->vertices),
-                        model3d->vertices, GL_STATIC_DRAW));
+                        model3d->vertices,
+                        model3d->stream ? GL_STREAM_DRAW : GL_STATIC_DRAW));
         model3d->dirty = false;
     }
     GL(glBindBuffer(GL_ARRAY_BUFFER, model3d->vertex_buffer));
@@ -350,8 +351,10 @@ void model3d_render(model3d_t *model3d,
             gl_update_uniform(g_shader, "u_l_diff", 0.8);
 
         }
+        counter_add(COUNTER_GL_DRAW_CALLS, 1);
         GL(glDrawArrays(GL_TRIANGLES, 0, model3d->nb_vertices));
     } else {
+        counter_add(COUNTER_GL_DRAW_CALLS, 1);
         GL(glDrawArrays(GL_LINES, 0, model3d->nb_vertices));
     }
     GL(glDisableVertexAttribArray(A_POS_LOC));
@@ -53,6 +53,7 @@ typedef struct {
     uint32_t vertex_buffer;
     int      nb_lines;
     bool     dirty;
+    bool     stream;    // The vertices are updated for each draw.
 } model3d_t;
 
 void model3d_release_graphics(void);
@@ -0,0 +1,248 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "offscreen.h"
+
+// Number of render target sizes we keep.
+#define MAX_TARGETS 4
+
+typedef struct {
+    int         w, h;       // Output size.
+    texture_t   *fbo;       // Render target, at twice the output size.
+    texture_t   *small_fbo; // Downsampled target.
+    GLuint      pbos[2];    // Read back buffers, used in turn.
+    int         last_use;
+} target_t;
+
+static struct {
+    target_t    targets[MAX_TARGETS];
+    int         tick;
+} g_off = {};
+
+static void target_release(target_t *target)
+{
+    texture_delete(target->fbo);
+    texture_delete(target->small_fbo);
+#ifndef GLES2
+    if (target->pbos[0]) GL(glDeleteBuffers(2, target->pbos));
+#endif
+    *target = (target_t){};
+}
+
+// Return the target of a given size, replacing the least recently used one
+// if needed.
+static target_t *get_target(int w, int h)
+{
+    int i;
+    target_t *target = NULL;
+
+    for (i = 0; i < MAX_TARGETS; i++) {
+        if (g_off.targets[i].w == w && g_off.targets[i].h == h) {
+            target = &g_off.targets[i];
+            goto end;
+        }
+        if (!target || g_off.targets[i].last_use < target->last_use)
+            target = &g_off.targets[i];
+    }
+
+    target_release(target);
+    target->w = w;
+    target->h = h;
+    target->fbo = texture_new_buffer(w * 2, h * 2, TF_DEPTH);
+#ifndef GLES2
+    target->small_fbo = texture_new_buffer(w, h, 0);
+    GL(glGenBuffers(2, target->pbos));
+    for (i = 0; i < 2; i++) {
+        GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, target->pbos[i]));
+        GL(glBufferData(GL_PIXEL_PACK_BUFFER, w * h * 4, NULL,
+                        GL_STREAM_READ));
+    }
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+#endif
+
+end:
+    target->last_use = ++g_off.tick;
+    return target;
+}
+
+static void render_view(target_t *target, const float view[4][4],
+                        const float proj[4][4], int bpp)
+{
+    renderer_t rend = goxel.rend;
+    const layer_t *layer;
+    float rect[4] = {0, 0, target->w * 2, target->h * 2};
+
+    rend.async = false; // We want all the blocks.
+    mat4_copy(view, rend.view_mat);
+    mat4_copy(proj, rend.proj_mat);
+    rend.fbo = target->fbo->framebuffer;
+    rend.scale = 1.0;
+
+    for (layer = goxel_get_render_layers(false); layer; layer = layer->next) {
+        if (layer->visible && layer->mesh)
+            render_mesh_instance(&rend, layer->mesh, layer->mat,
+                                 layer->material, 0);
+    }
+    render_submit(&rend, rect, (bpp == 3) ? goxel.back_color : NULL);
+}
+
+#ifndef GLES2
+
+// Downsample the last rendered view and start its read back.
+static void start_read(target_t *target, GLuint pbo)
+{
+    int w = target->w, h = target->h;
+
+    GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, target->fbo->framebuffer));
+    GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER,
+                         target->small_fbo->framebuffer));
+    GL(glBlitFramebuffer(0, 0, w * 2, h * 2, 0, 0, w, h,
+                         GL_COLOR_BUFFER_BIT, GL_LINEAR));
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, target->small_fbo->framebuffer));
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo));
+    GL(glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+}
+
+// Wait for a read back and return a copy of the image, with the rows
+// flipped and the alpha removed if needed.
+static uint8_t *end_read(target_t *target, GLuint pbo, int bpp)
+{
+    int i, j, w = target->w, h = target->h;
+    const uint8_t *data;
+    uint8_t *out = calloc(w * h, bpp);
+
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo));
+    GL(data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, w * h * 4,
+                               GL_MAP_READ_BIT));
+    if (data) {
+        for (i = 0; i < h; i++)
+        for (j = 0; j < w; j++) {
+            memcpy(&out[(i * w + j) * bpp],
+                   &data[((h - i - 1) * w + j) * 4], bpp);
+        }
+        GL(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+    }
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    return out;
+}
+
+static int render_views(int nb, const float (*views)[4][4],
+                        const float (*projs)[4][4], int w, int h, int bpp,
+                        int (*callback)(void *user, int i, uint8_t *img),
+                        void *user)
+{
+    int i, ret = 0;
+    target_t *target = get_target(w, h);
+
+    // The read back of each view is only waited for after the next view
+    // has been submitted.
+    for (i = 0; i < nb && !ret; i++) {
+        render_view(target, views[i], projs[i], bpp);
+        start_read(target, target->pbos[i % 2]);
+        if (i > 0) {
+            ret = callback(user, i - 1,
+                           end_read(target, target->pbos[(i - 1) % 2], bpp));
+        }
+    }
+    if (nb > 0 && !ret) {
+        ret = callback(user, nb - 1,
+                       end_read(target, target->pbos[(nb - 1) % 2], bpp));
+    }
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    return ret;
+}
+
+#else // GLES2
+
+static int render_views(int nb, const float (*views)[4][4],
+                        const float (*projs)[4][4], int w, int h, int bpp,
+                        int (*callback)(void *user, int i, uint8_t *img),
+                        void *user)
+{
+    int i, ret = 0;
+    target_t *target = get_target(w, h);
+    uint8_t *tmp_buf, *out;
+
+    tmp_buf = calloc(w * h * 4, bpp);
+    for (i = 0; i < nb && !ret; i++) {
+        render_view(target, views[i], projs[i], bpp);
+        texture_get_data(target->fbo, w * 2, h * 2, bpp, tmp_buf);
+        out = calloc(w * h, bpp);
+        img_downsample(tmp_buf, w * 2, h * 2, bpp, out);
+        ret = callback(user, i, out);
+    }
+    free(tmp_buf);
+    return ret;
+}
+
+#endif
+
+typedef struct {
+    uint8_t **out;
+    size_t  size;
+} render_data_t;
+
+static int copy_image(void *user, int i, uint8_t *img)
+{
+    render_data_t *data = user;
+    memcpy(data->out[i], img, data->size);
+    free(img);
+    return 0;
+}
+
+void offscreen_render(int nb, const float (*views)[4][4],
+                      const float proj[4][4], int w, int h, int bpp,
+                      uint8_t **out)
+{
+    int i;
+    float (*projs)[4][4] = calloc(nb, sizeof(*projs));
+    render_data_t data = {out, (size_t)w * h * bpp};
+
+    for (i = 0; i < nb; i++) mat4_copy(proj, projs[i]);
+    render_views(nb, views, projs, w, h, bpp, copy_image, &data);
+    free(projs);
+}
+
+int offscreen_render_sequence(int nb, const camera_t *cameras,
+                              int w, int h, int bpp,
+                              int (*callback)(void *user, int i, uint8_t *img),
+                              void *user)
+{
+    int i, ret;
+    float (*views)[4][4] = calloc(nb, sizeof(*views));
+    float (*projs)[4][4] = calloc(nb, sizeof(*projs));
+
+    for (i = 0; i < nb; i++) {
+        mat4_copy(cameras[i].view_mat, views[i]);
+        mat4_copy(cameras[i].proj_mat, projs[i]);
+    }
+    ret = render_views(nb, views, projs, w, h, bpp, callback, user);
+    free(views);
+    free(projs);
+    return ret;
+}
+
+void offscreen_release(void)
+{
+    int i;
+    for (i = 0; i < MAX_TARGETS; i++)
+        target_release(&g_off.targets[i]);
+    g_off.tick = 0;
+}
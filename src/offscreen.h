@@ -0,0 +1,98 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Offscreen rendering
+ *
+ * Render the image into CPU buffers, for the previews, the png export or
+ * turntable sequences.
+ *
+ * The views are rendered at twice the output resolution and then
+ * downsampled.  The render targets are kept from one call to the other,
+ * per output size.  With desktop GL the downsampling is done by the GPU
+ * with a framebuffer blit, and the pixels are read back into pixel buffer
+ * objects, so that when several views are rendered in a row the read back
+ * of a view overlaps the rendering of the next one.  With GLES2 we fall
+ * back to a synchronous read and a CPU downsampling.
+ */
+
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <stdint.h>
+
+#include "camera.h"
+
+/*
+ * Function: offscreen_render
+ * Render the visible layers of the image from several points of view.
+ *
+ * All the views share the same blocks render cache, so only the first one
+ * has to generate the blocks vertices.
+ *
+ * Parameters:
+ *   nb    - Number of views.
+ *   views - View matrix of each view.
+ *   proj  - Projection matrix, shared by all the views.
+ *   w     - Width of the output images.
+ *   h     - Height of the output images.
+ *   bpp   - 3 for RGB images over the background color, or 4 for RGBA
+ *           images with a transparent background.
+ *   out   - Receive the images, w * h * bpp bytes each, rows from top to
+ *           bottom.
+ */
+void offscreen_render(int nb, const float (*views)[4][4],
+                      const float proj[4][4], int w, int h, int bpp,
+                      uint8_t **out);
+
+/*
+ * Function: offscreen_render_sequence
+ * Render the visible layers of the image from a sequence of cameras, and
+ * pass each image to a callback as soon as it has been read back.
+ *
+ * The callback of an image is called after the next image has been
+ * submitted, so the callback can hand the image to a background thread
+ * while the GPU keeps working.
+ *
+ * Parameters:
+ *   nb       - Number of images.
+ *   cameras  - Array of the cameras of each image, with their matrices
+ *              up to date (see <camera_update>).
+ *   w        - Width of the images.
+ *   h        - Height of the images.
+ *   bpp      - 3 or 4, as for <offscreen_render>.
+ *   callback - Called with each image, in order.  The callback takes the
+ *              ownership of the image, and can return an error code to
+ *              stop the rendering.
+ *   user     - User data passed to the callback.
+ *
+ * Return:
+ *   Zero, or the first error returned by the callback.
+ */
+int offscreen_render_sequence(int nb, const camera_t *cameras,
+                              int w, int h, int bpp,
+                              int (*callback)(void *user, int i, uint8_t *img),
+                              void *user);
+
+/*
+ * Function: offscreen_release
+ * Release all the GL resources of the offscreen renderer.
+ */
+void offscreen_release(void);
+
+#endif // OFFSCREEN_H
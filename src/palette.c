@@ -135,20 +135,41 @@ static int parse_png(const void *data, int len, palette_t *palette)
 }
 
 
+// Only get the name of a gimp palette, from its header.
+static void parse_gpl_name(const char *data, char *name)
+{
+    const char *start, *end;
+    int r, g, b;
+    for (start = data; *start; start = end + 1) {
+        end = strchr(start, '\n');
+        if (!end) end = start + strlen(start);
+        if (sscanf(start, "Name: %[^\n]", name) == 1) return;
+        // The colors start after the header.
+        if (sscanf(start, "%d %d %d", &r, &g, &b) == 3) return;
+        if (!*end) return;
+    }
+}
+
 static int on_palette(int i, const char *path, void *user)
 {
     palette_t **list = user;
-    const char *data;
     palette_t *pal;
     pal = calloc(1, sizeof(*pal));
-    data = assets_get(path, NULL);
-    pal->size = parse_gpl(data, pal->name, &pal->columns, NULL);
-    pal->entries = calloc(pal->size, sizeof(*pal->entries));
-    parse_gpl(data, NULL, NULL, pal->entries);
+    pal->data = assets_get(path, NULL);
+    parse_gpl_name(pal->data, pal->name);
     DL_APPEND(*list, pal);
     return 0;
 }
 
+void palette_load(palette_t *pal)
+{
+    if (!pal->data) return;
+    pal->size = parse_gpl(pal->data, NULL, &pal->columns, NULL);
+    pal->entries = calloc(pal->size, sizeof(*pal->entries));
+    parse_gpl(pal->data, NULL, NULL, pal->entries);
+    pal->data = NULL;
+}
+
 static int on_palette2(const char *dir, const char *name, void *user)
 {
     palette_t **list = user;
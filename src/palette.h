@@ -34,11 +34,28 @@ struct palette {
     int     size;
     int     allocated;
     palette_entry_t *entries;
+    // Gimp palette data not parsed yet, see <palette_load>.
+    const char *data;
 };
 
-// Load all the available palettes into a list.
+/*
+ * Function: palette_load_all
+ * Load all the available palettes into a list.
+ *
+ * Only the names of the built-in palettes are read, their colors are
+ * parsed the first time we call <palette_load> on them.
+ */
 void palette_load_all(palette_t **list);
 
+/*
+ * Function: palette_load
+ * Make sure that the colors of a palette are loaded.
+ *
+ * This needs to be called before using the size or entries of any palette
+ * from <palette_load_all>.
+ */
+void palette_load(palette_t *palette);
+
 /*
  * Function: palette_search
  * Search a given color in a palette
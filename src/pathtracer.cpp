@@ -44,13 +44,28 @@
 #include <iterator>
 #include <future>
 #include <deque>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#   include <pthread.h>
+#   include <sched.h>
+#endif
 
 extern "C" {
 #include "goxel.h"
+#include "utils/parallel.h"
 }
 
 #include "xxhash.h"
 
+#if HAVE_OIDN
+#   include <OpenImageDenoise/oidn.h>
+#endif
+
 using namespace yocto;
 using namespace std;
 typedef yocto::image<vec4f> image4f;
@@ -66,6 +81,149 @@ enum {
     CHANGE_MATERIAL     = 1 << 7,
 };
 
+// Grid step of the first preview after a camera change.
+#define PREVIEW_STEP 8
+// Max angle (in radian) the camera can turn for us to reproject the image.
+#define REPROJECT_MAX_ANGLE (20 * DD2R)
+// Size of the tonemapping lookup table.
+#define TONEMAP_LUT_SIZE 16384
+
+/*
+ * Key of the shape of a mesh block: the data ids of the block and of its
+ * 26 neighbors, plus the effects that change the geometry.  Same key as
+ * the renderer uses for its blocks.  Since the mesh deduplicates the blocks
+ * data (see mesh_set_dedup), the blocks with the same content and the same
+ * neighbors content get the same key, and so share a single shape, with
+ * one instance per block.
+ */
+struct block_key_t {
+    uint64_t ids[27];
+    int effects;
+
+    bool operator==(const block_key_t &other) const {
+        return memcmp(this, &other, sizeof(*this)) == 0;
+    }
+};
+
+struct block_key_hash {
+    size_t operator()(const block_key_t &key) const {
+        return XXH32(&key, sizeof(key), 0);
+    }
+};
+
+// A block shape in the scene, shared by all the blocks with the same key.
+struct block_shape_t {
+    int shape;      // Index in the scene shapes, or -1 if empty.
+    int sync;       // Last sync_mesh call that used it.
+};
+
+/*
+ * For the voxels intersection backend: the visible voxels faces of a block
+ * shape, so that we can find the quad hit by a ray traversing the voxels.
+ * Each face is indexed by (voxel index) * 6 + direction, with the
+ * directions +x, -x, +y, -y, +z, -z.
+ */
+struct shape_face_t {
+    uint32_t face;
+    uint32_t element;   // Index of the quad in the shape.
+};
+
+struct shape_voxels_t {
+    vector<shape_face_t> faces; // Sorted by face.
+    // Bit mask of the voxels that have at least one face.
+    uint64_t occupancy[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE / 64];
+};
+
+struct vec3i_hash {
+    size_t operator()(const vec3i &v) const {
+        return XXH32(&v, sizeof(v), 0);
+    }
+};
+
+/*
+ * Persistent pool of threads used to trace the image.  Each batch of
+ * samples is split into tiles (the yocto image regions), distributed
+ * round robin into per thread queues.  A thread takes the tiles from the
+ * back of its own queue, and when it is empty steals them from the front of
+ * the other queues.  The last thread to finish a batch queues the tiles of
+ * the next one, so there is no thread creation during a render.
+ *
+ * The finished tiles are published by storing their samples count in
+ * tiles_samples, that the main thread reads without lock.
+ *
+ * The cancellation is cooperative: the cancel flag is also given to yocto
+ * (in the trace params), which checks it before each sample, so that
+ * stopping a render only waits for the samples being traced, and not for
+ * whole tiles.  The tiles interrupted that way are not published.
+ *
+ * The sampling is adaptive: after each batch we estimate the noise of a
+ * tile from how much its pixels changed, and stop sampling the tiles whose
+ * noise is below the threshold.  The tiles of a batch are queued by
+ * decreasing noise, weighted by the distance to the focus point, so that
+ * the noisy tiles close to the focus are rendered first.
+ *
+ * After a camera change, the first batches are previews at 1/8, 1/4 and 1/2
+ * of the resolution: we only trace one sample per cell of the grid, and
+ * fill the cells of the preview image with it.  The finest preview step
+ * done is published in tiles_preview.
+ */
+struct trace_worker_t {
+    std::mutex lock;
+    deque<int> tiles;
+};
+
+struct trace_pool_t {
+    vector<std::thread> threads;
+    vector<unique_ptr<trace_worker_t>> workers;
+    bool pinned;
+    std::mutex lock;
+    std::condition_variable cond;       // New batch or quit.
+    std::condition_variable idle_cond;  // Render finished.
+    bool quit;
+    bool active;        // A render is running.
+    int batch_id;
+    atomic<int> remaining;  // Tiles of the current batch not done yet.
+
+    // The current render.
+    image4f *image;
+    trace_state *state;
+    const yocto_scene *scene;
+    const bvh_scene *bvh;
+    const trace_lights *lights;
+    trace_params params;
+    vector<image_region> tiles;
+    unique_ptr<atomic<int>[]> tiles_samples;
+    vector<float> tiles_noise;      // Estimated noise, or -1 if unknown.
+    vector<float> luminance;        // Of each pixel after the last batch.
+    float noise_threshold;          // 0 to disable the adaptive sampling.
+    float focus[2];                 // Point to render first.
+    int first_tile, end_tile;       // Range of tiles to render.
+    atomic<int> preview_step;       // Grid step of the preview, 0 if done.
+    unique_ptr<atomic<int>[]> tiles_preview;
+    image4f *preview;
+    vector<float> *depth;           // Distance of each pixel center.
+    vector<vec3f> *albedo;          // Albedo of each pixel center.
+    vector<vec3f> *normal;          // Normal of each pixel center.
+    // Copy of the image at the end of a batch, for the denoiser.
+    bool snapshot_wanted;
+    bool snapshot_ready;
+    image4f *snapshot;
+    int snapshot_batch;             // Batch id of the snapshot.
+    atomic<int> *current_sample;
+    atomic<bool> cancel;
+};
+
+// A denoising of the image running in a background task.
+struct denoise_job_t {
+    task_t *task;
+    int batch;                  // Batch id of the input image.
+    image4f color;
+    image4f output;
+    const vector<float> *depth;
+    const vector<vec3f> *albedo;
+    const vector<vec3f> *normal;
+};
+
 struct pathtracer_internal {
 
     // Different hash keys to quickly check for state changes.
@@ -86,23 +244,59 @@ struct pathtracer_internal {
     bvh_params bvh_prms;
     tonemap_params tonemap_prms;
     atomic<int> trace_sample;
-    vector<future<void>> trace_futures;
-    deque<image_region> trace_queue;
-    std::mutex trace_queuem;
-    atomic<bool> trace_stop;
+    trace_pool_t pool;
+    vector<int> tiles_shown;    // Samples of each tile we displayed.
+    vector<int> previews_shown; // Preview step of each tile we displayed.
+    image4f preview;
+    // Distance of the surface seen by each pixel: -1 if unknown, flt_max
+    // for the background.  Used to reproject the image when the camera
+    // moves.
+    vector<float> depth;
+    vector<bool> reprojected;   // Pixels we got from the reprojection.
+    // The albedo and normal of the first hits, to guide the denoiser.
+    vector<vec3f> albedo;
+    vector<vec3f> normal;
+    image4f snapshot;
+    denoise_job_t denoise_job;
+    image4f denoised;
+    int denoised_batch = -1;    // Batch id of the denoised image, or -1.
+    bool denoise;               // Value of pt->denoise we displayed.
+    yocto_camera prev_camera;
+    float noise_threshold;
     float exposure;
+    int part, nb_parts;         // Part of the tiles to render.
+    // Lookup table of the channels tonemapping, and the srgb flag it was
+    // computed for (-1 if not computed yet).
+    uint8_t tonemap_lut[TONEMAP_LUT_SIZE];
+    int tonemap_lut_srgb = -1;
+
+    // The blocks shapes, so that we only tessellate the blocks that changed
+    // since the last sync.
+    unordered_map<block_key_t, block_shape_t, block_key_hash> block_shapes;
+    vector<int> free_shapes;        // Unused slots in scene.shapes.
+    vector<frame3f> blocks_frames;  // Frames of the blocks instances.
+    bool blocks_aligned;    // Set if all the blocks are on the blocks grid.
+    int sync_count;
+    // Shapes whose bvh needs to be rebuilt, and whether the instances
+    // changed, in which case we also rebuild the top level bvh instead of
+    // refitting it.
+    vector<int> updated_shapes;
+    bool instances_changed;
+    bool bvh_sah;       // The bvh was built with the SAH builder.
+    bool final_render;  // Set by pathtracer_render.
+
+    // Voxels intersection backend.
+    bool use_voxels;
+    vector<shape_voxels_t> shapes_voxels;   // Indexed as the scene shapes.
+    // Blocks instances indexed by block position / BLOCK_SIZE.
+    unordered_map<vec3i, vector<int>, vec3i_hash> grid;
+    vec3i grid_min, grid_max;   // Bounding box of the grid cells.
+    vector<int> grid_others;    // Other instances (floor, light).
+
+    int64_t mem_reported = 0;   // Memory reported to the memory stats.
 };
 
 
-template <typename T>
-inline bool try_pop(std::deque<T> &queue, std::mutex &mut, T& value) {
-    lock_guard<mutex> lock(mut);
-    if (queue.empty()) return false;
-    value = queue.front();
-    queue.pop_front();
-    return true;
-}
-
 
 /*
  * Get a item from a list by name or create a new one if it doesn't exists
@@ -156,86 +350,445 @@ static int get_material_id(pathtracer_t *pt, const material_t *mat,
     return getindex(p->scene.materials, m);
 }
 
+/*
+ * Create the yocto shape of a block.
+ *
+ * The vertices with the same position and color are shared between the
+ * faces, and the normals are only stored for the smooth marching cubes
+ * effect: for flat faces yocto falls back to the geometric normal of the
+ * primitives, which matches the mesh one since all the faces are wound
+ * counter clockwise.  This makes the shapes about four times smaller.
+ */
 static yocto_shape create_shape_for_block(
         const mesh_t *mesh, const int block_pos[3])
 {
-    voxel_vertex_t* vertices;
-    int i, nb, size, subdivide;
+    mesh_vertices_t *v;
+    const voxel_vertex_t *vertices, *vert;
+    int i, nb, size, subdivide, effects, idx;
+    bool smooth;
+    uint64_t key;
+    vector<int> indices;
+    unordered_map<uint64_t, int> welded;
     yocto_shape shape = {};
 
-    vertices = (voxel_vertex_t*)calloc(
-                BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
-                sizeof(*vertices));
-    nb = mesh_generate_vertices(mesh, block_pos,
-                                goxel.rend.settings.effects,
-                                vertices, &size, &subdivide);
+    effects = goxel.rend.settings.effects;
+    smooth = (effects & EFFECT_MARCHING_CUBES) && (effects & EFFECT_MC_SMOOTH);
+    v = mesh_get_vertices(mesh, block_pos, effects, 0);
+    vertices = v->verts;
+    nb = v->nb;
+    size = v->size;
+    subdivide = v->subdivide;
     if (!nb) goto end;
 
     // Set vertices data.
-    shape.positions.resize(nb * size);
-    shape.colors.resize(nb * size);
-    shape.normals.resize(nb * size);
+    indices.resize(nb * size);
+    welded.reserve(nb * size);
     for (i = 0; i < nb * size; i++) {
-        shape.positions[i] = {vertices[i].pos[0] / (float)subdivide,
-                              vertices[i].pos[1] / (float)subdivide,
-                              vertices[i].pos[2] / (float)subdivide};
-        shape.colors[i] = {vertices[i].color[0] / 255.f,
-                           vertices[i].color[1] / 255.f,
-                           vertices[i].color[2] / 255.f,
-                           1.0f};
-        shape.normals[i] = {vertices[i].normal[0] / 128.f,
-                            vertices[i].normal[1] / 128.f,
-                            vertices[i].normal[2] / 128.f};
+        vert = &vertices[i];
+        key = (uint64_t)vert->pos[0] << 40 | (uint64_t)vert->pos[1] << 32 |
+              (uint64_t)vert->pos[2] << 24 | (uint64_t)vert->color[0] << 16 |
+              (uint64_t)vert->color[1] << 8 | (uint64_t)vert->color[2];
+        auto it = welded.find(key);
+        // The smooth normals only depend on the position, but check it
+        // anyway so that we never mix them.
+        if (it != welded.end() && (!smooth || memcmp(
+                vertices[it->second].normal, vert->normal, 3) == 0)) {
+            indices[i] = indices[it->second];
+            continue;
+        }
+        welded[key] = i;
+        idx = shape.positions.size();
+        indices[i] = idx;
+        shape.positions.push_back({vert->pos[0] / (float)subdivide,
+                                   vert->pos[1] / (float)subdivide,
+                                   vert->pos[2] / (float)subdivide});
+        shape.colors.push_back({vert->color[0] / 255.f,
+                                vert->color[1] / 255.f,
+                                vert->color[2] / 255.f,
+                                1.0f});
+        if (smooth) {
+            shape.normals.push_back({vert->normal[0] / 128.f,
+                                     vert->normal[1] / 128.f,
+                                     vert->normal[2] / 128.f});
+        }
     }
+    shape.positions.shrink_to_fit();
+    shape.colors.shrink_to_fit();
+    shape.normals.shrink_to_fit();
 
     // Set primitives (quads or triangles) data.
     if (size == 4) {
         shape.quads.resize(nb);
-        for (i = 0; i < nb; i++)
-            shape.quads[i] = {i * 4 + 0, i * 4 + 1, i * 4 + 2, i * 4 + 3};
+        for (i = 0; i < nb; i++) {
+            shape.quads[i] = {indices[i * 4 + 0], indices[i * 4 + 1],
+                              indices[i * 4 + 2], indices[i * 4 + 3]};
+        }
     } else {
         shape.triangles.resize(nb);
-        for (i = 0; i < nb; i++)
-            shape.triangles[i] = {i * 3 + 0, i * 3 + 1, i * 3 + 2};
+        for (i = 0; i < nb; i++) {
+            shape.triangles[i] = {indices[i * 3 + 0], indices[i * 3 + 1],
+                                  indices[i * 3 + 2]};
+        }
     }
 
 end:
-    free(vertices);
+    mesh_vertices_release(v);
     return shape;
 }
 
-// Stop the asynchronous renderer.
-void stop_render(vector<future<void>>& futures,
-    deque<image_region>& queue,
-    std::mutex& queuem,
-    atomic<bool>* cancel)
+static bool tile_is_done(const trace_pool_t *pool, int tile)
+{
+    const float noise = pool->tiles_noise[tile];
+    if (tile < pool->first_tile || tile >= pool->end_tile) return true;
+    if (pool->tiles_samples[tile] >= pool->params.samples) return true;
+    // We need at least two batches to estimate the noise.
+    return pool->noise_threshold > 0 && noise >= 0 &&
+           pool->tiles_samples[tile] >= 2 * pool->params.batch &&
+           noise < pool->noise_threshold;
+}
+
+/*
+ * Queue the tiles of a new batch into the workers queues.
+ * Called with the pool lock held.  Return false if all the tiles are done.
+ */
+static bool pool_queue_batch(trace_pool_t *pool)
+{
+    int i, nb = pool->workers.size(), sample = pool->params.samples;
+    const vec2i size = pool->image->size();
+    vector<pair<float, int>> tiles;
+    float priority, dx, dy;
+
+    for (i = 0; i < (int)pool->tiles.size(); i++) {
+        if (tile_is_done(pool, i)) continue;
+        sample = min(sample, (int)pool->tiles_samples[i]);
+        const auto &tile = pool->tiles[i];
+        dx = (tile.min.x + tile.max.x) / 2.f / size.x - pool->focus[0];
+        dy = (tile.min.y + tile.max.y) / 2.f / size.y - pool->focus[1];
+        priority = pool->tiles_noise[i] >= 0 ? pool->tiles_noise[i] : 1;
+        priority /= 1 + 4 * (dx * dx + dy * dy);
+        tiles.push_back({priority, i});
+    }
+    *pool->current_sample = sample;
+    if (tiles.empty()) return false;
+
+    // The workers take their own tiles from the back of their queue, so
+    // we put the highest priorities last.
+    sort(tiles.begin(), tiles.end());
+    pool->remaining = tiles.size();
+    for (i = 0; i < (int)tiles.size(); i++) {
+        auto &worker = pool->workers[i % nb];
+        lock_guard<mutex> guard{worker->lock};
+        worker->tiles.push_back(tiles[i].second);
+    }
+    pool->batch_id++;
+    pool->cond.notify_all();
+    return true;
+}
+
+/*
+ * Update the noise estimation of a tile after a batch of k samples, from
+ * the change of its pixels luminance.  If the N samples have a standard
+ * deviation s, the mean changes by about s * sqrt(k) / N, and its error is
+ * s / sqrt(N), so we can estimate the error as change * sqrt(N / k).  We
+ * use the relative error, since this is what we see after the tone
+ * mapping.
+ */
+static void update_tile_noise(trace_pool_t *pool, int tile, int k)
+{
+    const auto &region = pool->tiles[tile];
+    const image4f &image = *pool->image;
+    float l, *prev, change = 0;
+    int i, j, n = pool->tiles_samples[tile];
+
+    for (j = region.min.y; j < region.max.y; j++)
+    for (i = region.min.x; i < region.max.x; i++) {
+        const vec4f &c = image[{i, j}];
+        l = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+        prev = &pool->luminance[j * image.size().x + i];
+        change += fabs(l - *prev) / (l + 0.1f);
+        *prev = l;
+    }
+    change /= region.size().x * region.size().y;
+    // The first batch changes from zero, so it doesn't tell anything.
+    pool->tiles_noise[tile] = (n == k) ? -1 : change * sqrtf((float)n / k);
+}
+
+/*
+ * Trace one sample on the pixels of a tile grid, and fill the cells of the
+ * preview image with it.  The samples are also accumulated in the state, so
+ * they are not lost for the full resolution render.
+ */
+static void trace_preview(trace_pool_t *pool, int tile, int step)
+{
+    const auto &region = pool->tiles[tile];
+    image4f &image = *pool->image;
+    int i, j, x, y;
+
+    for (j = region.min.y; j < region.max.y; j += step)
+    for (i = region.min.x; i < region.max.x; i += step) {
+        // Skip the pixels already traced by the previous preview.
+        if (step < PREVIEW_STEP && (i - region.min.x) % (2 * step) == 0 &&
+                                   (j - region.min.y) % (2 * step) == 0)
+            continue;
+        if (pool->cancel) return;
+        trace_region(image, *pool->state, *pool->scene, *pool->bvh,
+                     *pool->lights, {{i, j}, {i + 1, j + 1}}, 1,
+                     pool->params);
+    }
+    if (pool->cancel) return;
+    for (j = region.min.y; j < region.max.y; j += step)
+    for (i = region.min.x; i < region.max.x; i += step) {
+        for (y = j; y < min(j + step, region.max.y); y++)
+        for (x = i; x < min(i + step, region.max.x); x++)
+            (*pool->preview)[{x, y}] = image[{i, j}];
+    }
+    pool->tiles_preview[tile].store(step, memory_order_release);
+}
+
+/*
+ * Compute the distance, albedo and normal of the surface seen by the
+ * center of each pixel of a tile.
+ */
+static void update_tile_aovs(trace_pool_t *pool, int tile)
+{
+    const auto &region = pool->tiles[tile];
+    const auto &scene = *pool->scene;
+    const auto &camera = scene.cameras.at(pool->params.camera);
+    const vec2i size = pool->image->size();
+    int i, j, k;
+    vec3f albedo, normal;
+
+    for (j = region.min.y; j < region.max.y; j++)
+    for (i = region.min.x; i < region.max.x; i++) {
+        if (pool->cancel) return;
+        k = j * size.x + i;
+        auto ray = eval_camera(camera, {i, j}, size, {0.5f, 0.5f}, zero2f);
+        auto isec = intersect_bvh(*pool->bvh, ray);
+        if (!isec.hit) {
+            (*pool->depth)[k] = flt_max;
+            (*pool->albedo)[k] = zero3f;
+            (*pool->normal)[k] = zero3f;
+            continue;
+        }
+        const auto &instance = scene.instances[isec.instance];
+        auto mat = eval_material(scene, instance, isec.element, isec.uv);
+        albedo = mat.diffuse + mat.specular + mat.transmission;
+        if (albedo == zero3f) albedo = mat.emission;
+        normal = eval_normal(scene, instance, isec.element, isec.uv);
+        if (dot(normal, ray.d) > 0) normal = -normal;
+        (*pool->depth)[k] = isec.distance;
+        (*pool->albedo)[k] = {clamp(albedo.x, 0.f, 1.f),
+                              clamp(albedo.y, 0.f, 1.f),
+                              clamp(albedo.z, 0.f, 1.f)};
+        (*pool->normal)[k] = normal;
+    }
+}
+
+// Get a tile from the worker queue, or steal one from an other worker.
+static bool pool_get_tile(trace_pool_t *pool, int id, int *tile)
+{
+    int i, nb = pool->workers.size();
+    for (i = 0; i < nb; i++) {
+        auto &worker = pool->workers[(id + i) % nb];
+        lock_guard<mutex> guard{worker->lock};
+        if (worker->tiles.empty()) continue;
+        if (i == 0) {
+            *tile = worker->tiles.back();
+            worker->tiles.pop_back();
+        } else {
+            *tile = worker->tiles.front();
+            worker->tiles.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+static void pool_worker_func(trace_pool_t *pool, int id)
+{
+    int tile, batch_id = 0, sample, num_samples, step;
+
+    while (true) {
+        {
+            unique_lock<mutex> guard{pool->lock};
+            pool->cond.wait(guard, [&]() {
+                return pool->quit ||
+                       (pool->active && pool->batch_id != batch_id); });
+            if (pool->quit) return;
+            batch_id = pool->batch_id;
+        }
+
+        while (pool_get_tile(pool, id, &tile)) {
+            // The step can only change once all the tiles of the batch
+            // are done, so it is the one of this tile.
+            step = pool->preview_step;
+            // Only this thread changes the tile until the batch is done.
+            sample = pool->tiles_samples[tile].load(memory_order_relaxed);
+            num_samples = min(pool->params.batch,
+                              pool->params.samples - sample);
+            if (!pool->cancel && step) {
+                trace_preview(pool, tile, step);
+            } else if (!pool->cancel) {
+                trace_region(*pool->image, *pool->state, *pool->scene,
+                             *pool->bvh, *pool->lights, pool->tiles[tile],
+                             num_samples, pool->params);
+                if (sample == 0) update_tile_aovs(pool, tile);
+                // Don't publish a tile interrupted by a cancel.
+                if (!pool->cancel) {
+                    pool->tiles_samples[tile].store(sample + num_samples,
+                                                    memory_order_release);
+                    update_tile_noise(pool, tile, num_samples);
+                }
+            }
+            if (--pool->remaining) continue;
+
+            // We finished the batch, start the next one.
+            lock_guard<mutex> guard{pool->lock};
+            if (pool->snapshot_wanted && !step && !pool->cancel) {
+                *pool->snapshot = *pool->image;
+                pool->snapshot_batch = pool->batch_id;
+                pool->snapshot_wanted = false;
+                pool->snapshot_ready = true;
+            }
+            if (pool->preview_step)
+                pool->preview_step = pool->preview_step > 2 ?
+                                     pool->preview_step / 2 : 0;
+            if (pool->cancel || !pool_queue_batch(pool)) {
+                pool->active = false;
+                pool->idle_cond.notify_all();
+            }
+        }
+    }
+}
+
+// Stop the running render, if any.
+static void stop_render(pathtracer_internal_t *p)
+{
+    trace_pool_t *pool = &p->pool;
+    unique_lock<mutex> guard{pool->lock};
+    pool->cancel = true;
+    pool->idle_cond.wait(guard, [&]() { return !pool->active; });
+}
+
+// Stop and join all the threads of the pool.
+static void pool_release(trace_pool_t *pool)
 {
-    if (cancel) *cancel = true;
-    for (auto& f : futures) f.get();
-    futures.clear();
     {
-        std::lock_guard<mutex> guard{queuem};
-        queue.clear();
+        lock_guard<mutex> guard{pool->lock};
+        pool->quit = true;
+        pool->cond.notify_all();
     }
+    for (auto &thread : pool->threads) thread.join();
+    pool->threads.clear();
+    pool->workers.clear();
+    pool->quit = false;
 }
 
+/*
+ * Make sure the pool has the wanted number of threads (0 for one per cpu),
+ * optionally pinned each to a cpu.  Must be called with no render running.
+ */
+static void pool_init(trace_pool_t *pool, int nb_threads, bool pinned)
+{
+    int i, nb_cpus = max(1, (int)std::thread::hardware_concurrency());
+
+    if (nb_threads <= 0) nb_threads = nb_cpus;
+    if ((int)pool->threads.size() == nb_threads && pool->pinned == pinned)
+        return;
+    pool_release(pool);
+    pool->pinned = pinned;
+    for (i = 0; i < nb_threads; i++)
+        pool->workers.emplace_back(new trace_worker_t());
+    for (i = 0; i < nb_threads; i++) {
+        pool->threads.emplace_back(pool_worker_func, pool, i);
+#ifdef __linux__
+        if (pinned) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(i % nb_cpus, &cpuset);
+            pthread_setaffinity_np(pool->threads.back().native_handle(),
+                                   sizeof(cpuset), &cpuset);
+        }
+#endif
+    }
+}
+
+static int get_block_shape(pathtracer_t *pt, const mesh_t *mesh,
+                           const int block_pos[3])
+{
+    // The effects that change the generated vertices.
+    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+                             EFFECT_MERGE_FACES | EFFECT_FLAT_FACES;
+    pathtracer_internal_t *p = pt->p;
+    block_key_t key;
+    block_shape_t *block;
+    yocto_shape shape;
+    int i, x, y, z, pos[3];
+
+    memset(&key, 0, sizeof(key));
+    key.effects = goxel.rend.settings.effects & effects_mask;
+    for (i = 0, z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++, i++) {
+        pos[0] = block_pos[0] + x * BLOCK_SIZE;
+        pos[1] = block_pos[1] + y * BLOCK_SIZE;
+        pos[2] = block_pos[2] + z * BLOCK_SIZE;
+        mesh_get_block_data(mesh, NULL, pos, &key.ids[i]);
+    }
+
+    block = &p->block_shapes[key];
+    if (block->sync) { // Already there.
+        block->sync = p->sync_count;
+        return block->shape;
+    }
+    block->sync = p->sync_count;
+    block->shape = -1;
+    shape = create_shape_for_block(mesh, block_pos);
+    if (shape.positions.empty()) return -1;
+    shape.uri = "<block>";
+    if (!p->free_shapes.empty()) {
+        block->shape = p->free_shapes.back();
+        p->free_shapes.pop_back();
+        p->scene.shapes[block->shape] = std::move(shape);
+    } else {
+        block->shape = p->scene.shapes.size();
+        p->scene.shapes.push_back(std::move(shape));
+    }
+    p->updated_shapes.push_back(block->shape);
+    return block->shape;
+}
+
+// Check if a block instance frame is a translation to a block position, as
+// the voxels backend grid expects.  This is not the case of the blocks of
+// the rotated or shifted clone layers instances.
+static bool frame_is_block_aligned(const frame3f &frame)
+{
+    const int N = BLOCK_SIZE;
+    return frame.x == vec3f{1, 0, 0} && frame.y == vec3f{0, 1, 0} &&
+           frame.z == vec3f{0, 0, 1} &&
+           fmodf(frame.o.x, N) == 0 && fmodf(frame.o.y, N) == 0 &&
+           fmodf(frame.o.z, N) == 0;
+}
 
 static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
 {
     uint32_t key = 0, k;
     mesh_iterator_t iter;
     const mesh_t *mesh;
-    int block_pos[3], i, changed = 0;
-    yocto_shape shape;
+    int block_pos[3], i, changed = 0, material;
     yocto_instance instance;
     pathtracer_internal_t *p = pt->p;
     const layer_t *layers, *layer;
+    vector<frame3f> blocks_frames;
+    frame3f model;
+    auto &instances = p->scene.instances;
 
     layers = goxel_get_render_layers(false);
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->mesh) continue;
         k = mesh_get_key(layer->mesh);
         key = XXH32(&k, sizeof(k), key);
+        key = XXH32(layer->mat, sizeof(layer->mat), key);
         i = get_material_id(pt, layer->material, &changed);
         key = XXH32(&i, sizeof(i), key);
     }
@@ -245,35 +798,65 @@ static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
     key = XXH32(&goxel.rend.settings.effects,
                 sizeof(goxel.rend.settings.effects), key);
     key = XXH32(&pt->floor.type, sizeof(pt->floor.type), key);
+    key = XXH32(&pt->backend, sizeof(pt->backend), key);
     key = XXH32(&force, sizeof(force), key);
     if (!force && key == p->mesh_key) return changed;
 
     p->mesh_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
-    p->scene = {};
-    p->lights = {};
+    stop_render(p);
     changed |= CHANGE_MESH;
-
+    p->sync_count++;
+
+    // Recreate all the blocks instances, reusing the shapes of the blocks
+    // that didn't change.  The clone layers instances use the same shapes
+    // as their base layer, with the layer model matrix.
+    instances.erase(remove_if(instances.begin(), instances.end(),
+                        [](const yocto_instance &inst) {
+                            return inst.uri == "<block>"; }),
+                    instances.end());
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->mesh) continue;
         mesh = layer->mesh;
+        material = get_material_id(pt, layer->material, &changed);
+        model = {{layer->mat[0][0], layer->mat[0][1], layer->mat[0][2]},
+                 {layer->mat[1][0], layer->mat[1][1], layer->mat[1][2]},
+                 {layer->mat[2][0], layer->mat[2][1], layer->mat[2][2]},
+                 {layer->mat[3][0], layer->mat[3][1], layer->mat[3][2]}};
         iter = mesh_get_iterator(mesh,
                         MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
         while (mesh_iter(&iter, block_pos)) {
-            shape = create_shape_for_block(mesh, block_pos);
-            // shape.material = get_material_id(pt, layer->material, &changed);
-            if (shape.positions.empty()) continue;
-            p->scene.shapes.push_back(shape);
-            instance.material = get_material_id(pt, layer->material, &changed);
-            instance.uri = shape.uri;
-            instance.shape = p->scene.shapes.size() - 1;
-            instance.frame = translation_frame(vec3f(
+            i = get_block_shape(pt, mesh, block_pos);
+            if (i == -1) continue;
+            instance = {};
+            instance.uri = "<block>";
+            instance.material = material;
+            instance.shape = i;
+            instance.frame = model * translation_frame(vec3f(
                                     block_pos[0], block_pos[1], block_pos[2]));
-            p->scene.instances.push_back(instance);
+            instances.push_back(instance);
+            blocks_frames.push_back(instance.frame);
         }
     }
 
+    // Release the shapes that are not used anymore.
+    for (auto it = p->block_shapes.begin(); it != p->block_shapes.end();) {
+        if (it->second.sync == p->sync_count) {
+            it++;
+            continue;
+        }
+        if (it->second.shape != -1) {
+            p->scene.shapes[it->second.shape] = {};
+            p->free_shapes.push_back(it->second.shape);
+        }
+        it = p->block_shapes.erase(it);
+    }
+
+    if (blocks_frames != p->blocks_frames) {
+        p->blocks_aligned = all_of(blocks_frames.begin(), blocks_frames.end(),
+                                   frame_is_block_aligned);
+        p->blocks_frames = std::move(blocks_frames);
+        p->instances_changed = true;
+    }
     return changed;
 }
 
@@ -292,10 +875,18 @@ static int sync_floor(pathtracer_t *pt, bool force)
     if (!force && key == p->floor_key) return 0;
     changed |= CHANGE_FLOOR;
     p->floor_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
-
-    if (pt->floor.type == PT_FLOOR_NONE) return changed;
+    stop_render(p);
+
+    p->instances_changed = true;
+    if (pt->floor.type == PT_FLOOR_NONE) {
+        p->scene.instances.erase(
+                remove_if(p->scene.instances.begin(),
+                          p->scene.instances.end(),
+                          [](const yocto_instance &inst) {
+                              return inst.uri == "<floor>"; }),
+                p->scene.instances.end());
+        return changed;
+    }
 
     color[0] = pt->floor.color[0] / 255.f;
     color[1] = pt->floor.color[1] / 255.f;
@@ -320,6 +911,7 @@ static int sync_floor(pathtracer_t *pt, bool force)
     }
     shape->quads.push_back({0, 1, 3, 2});
     // shape->material = get_material_id(pt, pt->floor.material, &changed);
+    p->updated_shapes.push_back(getindex(p->scene.shapes, shape));
     instance = getdefault(p->scene.instances, "<floor>");
     instance->material = get_material_id(pt, pt->floor.material, &changed);
     instance->shape = getindex(p->scene.shapes, shape);
@@ -347,8 +939,8 @@ static int sync_camera(pathtracer_t *pt, int w, int h,
     key = XXH32(&h, sizeof(h), key);
     if (!force && key == p->camera_key) return 0;
     p->camera_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
+    p->prev_camera = *cam;
 
     mat4_copy(camera->mat, m);
     cam->frame = frame3f(mat4f({m[0][0], m[0][1], m[0][2], m[0][3]},
@@ -381,8 +973,7 @@ static int sync_world(pathtracer_t *pt, bool force)
     key = XXH32(&pt->world.color, sizeof(pt->world.color), key);
     if (!force && key == p->world_key) return 0;
     p->world_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
 
     texture = getdefault(p->scene.textures, "<world>");
     texture->uri = "textures/uniform.hdr";
@@ -394,7 +985,8 @@ static int sync_world(pathtracer_t *pt, bool force)
 
     switch (pt->world.type) {
     case PT_WORLD_NONE:
-        return true;
+        p->scene.environments.clear();
+        return CHANGE_WORLD;
     case PT_WORLD_SKY:
         texture->hdr = make_sunsky({512, 256}, pif / 4, turbidity, has_sun,
                           1.0f, 0, {color.x, color.y, color.z});
@@ -433,8 +1025,7 @@ static int sync_light(pathtracer_t *pt, bool force)
 
     if (!force && key == p->light_key) return 0;
     p->light_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
 
     ke = goxel.rend.light.intensity;
     material = getdefault(p->scene.materials, "<light>");
@@ -448,6 +1039,8 @@ static int sync_light(pathtracer_t *pt, bool force)
     shape->positions.push_back({1, 1, 0});
     shape->triangles.push_back({0, 1, 2});
 
+    p->updated_shapes.push_back(getindex(p->scene.shapes, shape));
+    p->instances_changed = true;
     instance = getdefault(p->scene.instances, "<light>");
     instance->material = getindex(p->scene.materials, material);
     instance->shape = getindex(p->scene.shapes, shape);
@@ -462,66 +1055,1092 @@ static int sync_options(pathtracer_t *pt, bool force)
     uint64_t key = 0;
     pathtracer_internal_t *p = pt->p;
     key = XXH32(&pt->num_samples, sizeof(pt->num_samples), key);
+    key = XXH32(&pt->nb_threads, sizeof(pt->nb_threads), key);
+    key = XXH32(&pt->pin_threads, sizeof(pt->pin_threads), key);
+    key = XXH32(&pt->noise_threshold, sizeof(pt->noise_threshold), key);
+    key = XXH32(&pt->seed, sizeof(pt->seed), key);
     if (!force && key == p->options_key) return 0;
     p->options_key = key;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
     p->trace_prms.samples = pt->num_samples;
     p->trace_prms.resolution = max(pt->w, pt->h);
+    p->noise_threshold = pt->noise_threshold;
+    p->trace_prms.seed = pt->seed ? pt->seed : trace_default_seed;
     return CHANGE_OPTIONS;
 }
 
-static void start_render(
-        image4f& image, trace_state& state,
-        const yocto_scene& scene, const bvh_scene& bvh,
-        const trace_lights& lights,
-        vector<future<void>>& futures, atomic<int>& current_sample,
-        deque<image_region>& queue,
-        mutex& queuem,
-        const trace_params& trace_prms,
-        atomic<bool>* cancel)
-{
-    auto& camera     = scene.cameras.at(trace_prms.camera);
-    auto  image_size = camera_resolution(camera, trace_prms.resolution);
-    state            = make_trace_state(image_size, trace_prms.seed);
-    auto regions = make_regions(image.size(), trace_prms.region, true);
-    if (cancel) *cancel = false;
-
-    futures.clear();
-    futures.emplace_back(async([trace_prms, regions, &current_sample, &image,
-                                &scene, &lights, &bvh, &state, &queue,
-                                &queuem, cancel]() {
-        for (auto sample = 0; sample < trace_prms.samples;
-             sample += trace_prms.batch) {
-            if (cancel && *cancel) return;
-            current_sample   = sample;
-            auto num_samples = min(trace_prms.batch,
-                                   trace_prms.samples - current_sample);
-            auto futures  = vector<future<void>>{};
-            int nthreads = std::thread::hardware_concurrency();
-            std::atomic<size_t> next_idx(0);
-            for (int thread_id = 0; thread_id < nthreads; thread_id++) {
-                futures.emplace_back(async(std::launch::async,
-                            [num_samples, &trace_prms, &image, &scene, &lights,
-                             &bvh, &state, &queue, &queuem, &next_idx, cancel,
-                             &regions]() {
-                    while (true) {
-                        if (cancel && *cancel) break;
-                        auto idx = next_idx.fetch_add(1);
-                        if (idx >= regions.size()) break;
-                        auto region = regions[idx];
-                        trace_region(image, state, scene, bvh, lights,
-                                     region, num_samples, trace_prms);
-                        {
-                            std::lock_guard<mutex> guard{queuem};
-                            queue.push_back(region);
-                        }
-                    }
-                }));
+/*
+ * Start a new render.  If preview is set, we first trace the low resolution
+ * previews.
+ */
+static void start_render(pathtracer_internal_t *p, bool preview)
+{
+    trace_pool_t *pool = &p->pool;
+    const auto &camera = p->scene.cameras.at(p->trace_prms.camera);
+    int i;
+
+    p->state = make_trace_state(
+            camera_resolution(camera, p->trace_prms.resolution),
+            p->trace_prms.seed);
+
+    pool->image = &p->image;
+    pool->state = &p->state;
+    pool->scene = &p->scene;
+    pool->bvh = &p->bvh;
+    pool->lights = &p->lights;
+    pool->params = p->trace_prms;
+    pool->params.cancel = &pool->cancel;
+    pool->current_sample = &p->trace_sample;
+    pool->tiles = make_regions(p->image.size(), p->trace_prms.region, true);
+    pool->tiles_samples.reset(new atomic<int>[pool->tiles.size()]);
+    for (i = 0; i < (int)pool->tiles.size(); i++) pool->tiles_samples[i] = 0;
+    pool->tiles_noise.assign(pool->tiles.size(), -1);
+    pool->luminance.assign(p->image.count(), 0);
+    pool->tiles_preview.reset(new atomic<int>[pool->tiles.size()]);
+    for (i = 0; i < (int)pool->tiles.size(); i++) pool->tiles_preview[i] = 0;
+    pool->preview = &p->preview;
+    pool->depth = &p->depth;
+    pool->albedo = &p->albedo;
+    pool->normal = &p->normal;
+    pool->snapshot = &p->snapshot;
+    pool->first_tile = 0;
+    pool->end_tile = pool->tiles.size();
+    if (p->nb_parts > 1) {
+        pool->first_tile = p->part * pool->tiles.size() / p->nb_parts;
+        pool->end_tile = (p->part + 1) * pool->tiles.size() / p->nb_parts;
+    }
+    p->tiles_shown.assign(pool->tiles.size(), 0);
+    p->previews_shown.assign(pool->tiles.size(), 0);
+
+    lock_guard<mutex> guard{pool->lock};
+    pool->snapshot_wanted = false;
+    pool->snapshot_ready = false;
+    pool->noise_threshold = p->noise_threshold;
+    pool->preview_step = preview ? PREVIEW_STEP : 0;
+    pool->cancel = false;
+    pool->active = pool_queue_batch(pool);
+}
+
+static void set_shape_bvh_data(bvh_shape &sbvh, const yocto_shape &shape)
+{
+    sbvh.points    = shape.points;
+    sbvh.lines     = shape.lines;
+    sbvh.triangles = shape.triangles;
+    sbvh.quads     = shape.quads;
+    sbvh.quadspos  = shape.quadspos;
+    sbvh.positions = shape.positions;
+    sbvh.radius    = shape.radius;
+}
+
+/*
+ * Compute the voxels faces of a block shape, from its quads.
+ */
+static void make_shape_voxels(const yocto_shape &shape, shape_voxels_t *sv)
+{
+    const int N = BLOCK_SIZE;
+    int e, i, a, a1, a2, dir, c, u, v, vpos[3], vmin[3], vmax[3], idx;
+    vec3f p0, p1, p3, n;
+
+    sv->faces.clear();
+    memset(sv->occupancy, 0, sizeof(sv->occupancy));
+    for (e = 0; e < (int)shape.quads.size(); e++) {
+        const auto &q = shape.quads[e];
+        p0 = shape.positions[q.x];
+        p1 = shape.positions[q.y];
+        p3 = shape.positions[q.w];
+        n = cross(p1 - p0, p3 - p0);
+        a = (fabs(n.x) >= fabs(n.y) && fabs(n.x) >= fabs(n.z)) ? 0 :
+            (fabs(n.y) >= fabs(n.z)) ? 1 : 2;
+        dir = n[a] > 0 ? 0 : 1;
+        for (i = 0; i < 3; i++) {
+            vmin[i] = (int)round(min(min(p0[i], p1[i]),
+                                     min(p3[i], shape.positions[q.z][i])));
+            vmax[i] = (int)round(max(max(p0[i], p1[i]),
+                                     max(p3[i], shape.positions[q.z][i])));
+        }
+        // The face of a voxel is on its side of the quad plane.
+        c = vmin[a] - (dir == 0 ? 1 : 0);
+        a1 = (a + 1) % 3;
+        a2 = (a + 2) % 3;
+        for (u = vmin[a1]; u < vmax[a1]; u++)
+        for (v = vmin[a2]; v < vmax[a2]; v++) {
+            vpos[a] = c;
+            vpos[a1] = u;
+            vpos[a2] = v;
+            if (    vpos[0] < 0 || vpos[0] >= N ||
+                    vpos[1] < 0 || vpos[1] >= N ||
+                    vpos[2] < 0 || vpos[2] >= N) continue;
+            idx = (vpos[2] * N + vpos[1]) * N + vpos[0];
+            sv->faces.push_back({(uint32_t)(idx * 6 + a * 2 + dir),
+                                 (uint32_t)e});
+            sv->occupancy[idx / 64] |= 1ULL << (idx % 64);
+        }
+    }
+    sort(sv->faces.begin(), sv->faces.end(),
+         [](const shape_face_t &x, const shape_face_t &y) {
+             return x.face < y.face; });
+}
+
+// Return the quad of a voxel face, or -1.
+static int get_voxel_face(const shape_voxels_t &sv, const int pos[3],
+                          int axis, int dir)
+{
+    const int N = BLOCK_SIZE;
+    int idx = (pos[2] * N + pos[1]) * N + pos[0];
+    uint32_t face = idx * 6 + axis * 2 + dir;
+    auto it = lower_bound(sv.faces.begin(), sv.faces.end(), face,
+                          [](const shape_face_t &x, uint32_t f) {
+                              return x.face < f; });
+    if (it == sv.faces.end() || it->face != face) return -1;
+    return it->element;
+}
+
+/*
+ * Traverse the voxels of a block instance between t0 and t1.
+ *
+ * entry_axis is the axis of the block face by which the ray entered the
+ * block at t0, or -1 if the ray started inside the block.
+ */
+static bool intersect_block(const pathtracer_internal_t *p,
+                            int instance_id, const ray3f &ray,
+                            float t0, float t1, int entry_axis,
+                            int &element, vec2f &uv, float &distance)
+{
+    const int N = BLOCK_SIZE;
+    const auto &instance = p->scene.instances[instance_id];
+    const auto &shape = p->scene.shapes[instance.shape];
+    const shape_voxels_t &sv = p->shapes_voxels[instance.shape];
+    vec3f org = ray.o - instance.frame.o; // Ray origin in the block.
+    vec3f hit, e1, e3;
+    int i, vpos[3], step[3], axis = entry_axis, idx, e = -1;
+    float tnext[3], t = t0;
+
+    for (i = 0; i < 3; i++) {
+        vpos[i] = clamp((int)floor(org[i] + ray.d[i] * t0), 0, N - 1);
+        step[i] = ray.d[i] > 0 ? 1 : -1;
+    }
+    // If we entered the block by a face, make sure we start from the
+    // voxel just behind it, whatever the rounding.
+    if (axis != -1) vpos[axis] = step[axis] > 0 ? 0 : N - 1;
+
+    while (t <= t1) {
+        for (i = 0; i < 3; i++) {
+            tnext[i] = ray.d[i] == 0 ? flt_max :
+                (vpos[i] + (step[i] > 0 ? 1 : 0) - org[i]) / ray.d[i];
+        }
+        i = (tnext[0] < tnext[1] && tnext[0] < tnext[2]) ? 0 :
+            (tnext[1] < tnext[2]) ? 1 : 2;
+
+        idx = (vpos[2] * N + vpos[1]) * N + vpos[0];
+        if (sv.occupancy[idx / 64] & (1ULL << (idx % 64))) {
+            // The face by which we entered the voxel, then the one by
+            // which we leave it, for the rays going out of a voxel.
+            if (axis != -1 && t >= ray.tmin) {
+                e = get_voxel_face(sv, vpos, axis, step[axis] > 0 ? 1 : 0);
+                if (e != -1) distance = t;
+            }
+            if (e == -1 && tnext[i] >= ray.tmin) {
+                e = get_voxel_face(sv, vpos, i, step[i] > 0 ? 0 : 1);
+                if (e != -1) distance = tnext[i];
+            }
+            if (e != -1) break;
+        }
+        t = tnext[i];
+        vpos[i] += step[i];
+        axis = i;
+        if (vpos[i] < 0 || vpos[i] >= N) break;
+    }
+    if (e == -1 || distance > ray.tmax) return false;
+
+    // Compute the quad uv coordinates of the hit point.
+    const auto &q = shape.quads[e];
+    hit = org + ray.d * distance - shape.positions[q.x];
+    e1 = shape.positions[q.y] - shape.positions[q.x];
+    e3 = shape.positions[q.w] - shape.positions[q.x];
+    uv = {clamp(dot(hit, e1) / dot(e1, e1), 0.f, 1.f),
+          clamp(dot(hit, e3) / dot(e3, e3), 0.f, 1.f)};
+    element = e;
+    return true;
+}
+
+/*
+ * Intersection of the voxels backend: we intersect the non blocks
+ * instances with their bvh, and then traverse the grid of blocks, and the
+ * voxels inside each non empty block.
+ */
+static bool intersect_voxels(const pathtracer_internal_t *p,
+                             const ray3f &ray_, int &instance, int &element,
+                             vec2f &uv, float &distance, bool find_any)
+{
+    const int N = BLOCK_SIZE;
+    ray3f ray = ray_;
+    bool hit = false;
+    int i, cell[3], step[3], axis = -1, e;
+    float t0, t1, tnear, tfar, ta, tb, tnext[3], texit, d;
+    vec2f euv;
+
+    for (int other : p->grid_others) {
+        if (!intersect_bvh(p->bvh, other, ray, e, euv, d, find_any)) continue;
+        hit = true;
+        instance = other;
+        element = e;
+        uv = euv;
+        distance = d;
+        ray.tmax = d;
+        if (find_any) return true;
+    }
+    if (p->grid.empty()) return hit;
+
+    // Clip the ray to the grid bounding box.
+    t0 = ray.tmin;
+    t1 = ray.tmax;
+    for (i = 0; i < 3; i++) {
+        if (ray.d[i] == 0) {
+            if (    ray.o[i] < p->grid_min[i] * N ||
+                    ray.o[i] > (p->grid_max[i] + 1) * N) return hit;
+            continue;
+        }
+        ta = (p->grid_min[i] * N - ray.o[i]) / ray.d[i];
+        tb = ((p->grid_max[i] + 1) * N - ray.o[i]) / ray.d[i];
+        tnear = min(ta, tb);
+        tfar = max(ta, tb);
+        if (tnear > t0) {
+            t0 = tnear;
+            axis = i;
+        }
+        t1 = min(t1, tfar);
+    }
+    if (t0 > t1) return hit;
+
+    for (i = 0; i < 3; i++) {
+        cell[i] = clamp((int)floor((ray.o[i] + ray.d[i] * t0) / N),
+                        p->grid_min[i], p->grid_max[i]);
+        step[i] = ray.d[i] > 0 ? 1 : -1;
+    }
+    if (axis != -1)
+        cell[axis] = step[axis] > 0 ? p->grid_min[axis] : p->grid_max[axis];
+
+    while (true) {
+        for (i = 0; i < 3; i++) {
+            tnext[i] = ray.d[i] == 0 ? flt_max :
+                ((cell[i] + (step[i] > 0 ? 1 : 0)) * N - ray.o[i]) / ray.d[i];
+        }
+        i = (tnext[0] < tnext[1] && tnext[0] < tnext[2]) ? 0 :
+            (tnext[1] < tnext[2]) ? 1 : 2;
+        texit = min(tnext[i], t1);
+
+        auto it = p->grid.find({cell[0], cell[1], cell[2]});
+        if (it != p->grid.end()) {
+            for (int block : it->second) {
+                if (!intersect_block(p, block, ray, t0, texit, axis,
+                                     e, euv, d))
+                    continue;
+                hit = true;
+                instance = block;
+                element = e;
+                uv = euv;
+                distance = d;
+                ray.tmax = d;
+                if (find_any) return true;
+            }
+            // The next blocks are all further away.
+            if (hit && distance <= texit) return true;
+        }
+        if (tnext[i] > t1 || tnext[i] > ray.tmax) break;
+        t0 = tnext[i];
+        cell[i] += step[i];
+        axis = i;
+        if (cell[i] < p->grid_min[i] || cell[i] > p->grid_max[i]) break;
+    }
+    return hit;
+}
+
+// Build the grid of blocks instances for the voxels backend.
+static void update_grid(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    const auto &scene = p->scene;
+    const int N = BLOCK_SIZE;
+    vec3i cell;
+    int i, j;
+
+    p->grid.clear();
+    p->grid_others.clear();
+    p->grid_min = {INT_MAX, INT_MAX, INT_MAX};
+    p->grid_max = {INT_MIN, INT_MIN, INT_MIN};
+    for (i = 0; i < (int)scene.instances.size(); i++) {
+        const auto &instance = scene.instances[i];
+        if (instance.uri != "<block>") {
+            p->grid_others.push_back(i);
+            continue;
+        }
+        cell = {(int)floor(instance.frame.o.x / N),
+                (int)floor(instance.frame.o.y / N),
+                (int)floor(instance.frame.o.z / N)};
+        p->grid[cell].push_back(i);
+        for (j = 0; j < 3; j++) {
+            p->grid_min[j] = min(p->grid_min[j], cell[j]);
+            p->grid_max[j] = max(p->grid_max[j], cell[j]);
+        }
+    }
+    p->bvh.intersect = [p](const ray3f &ray, int &instance, int &element,
+                           vec2f &uv, float &distance, bool find_any) {
+        return intersect_voxels(p, ray, instance, element, uv, distance,
+                                find_any);
+    };
+}
+
+/*
+ * Bvh builders, used instead of the yocto ones, that start one thread per
+ * cpu for each shape, which is slow with the many small shapes of the
+ * blocks.  The shapes are built in parallel, each one on a single thread,
+ * and the top level bvh is split into subtrees built in parallel.
+ *
+ * There are two builders:
+ * - LBVH: the primitives are sorted along a Morton curve, and each range is
+ *   split at the highest bit that differs in its codes.  Very fast, but
+ *   the trees are not as good, so we use it for the interactive renders.
+ * - Binned SAH: each range is split at the best of 16 bins per axis,
+ *   according to the surface area heuristic.  Used for the final renders.
+ *
+ * The nodes are stored with the children after their parents, since this
+ * is what the yocto refit expects.
+ */
+
+struct build_prim_t {
+    bbox3f      bbox;
+    vec3f       center;
+    uint32_t    code;   // Morton code of the center (LBVH only).
+    int         id;
+};
+
+// A subtree left to build in parallel.
+struct build_task_t {
+    int node;
+    int start, end;
+    vector<bvh_node> nodes;
+};
+
+struct bvh_builder_t {
+    build_prim_t *prims;
+    bool sah;
+    vector<bvh_node> *nodes;
+    // If not zero, the ranges up to this size are added to the tasks
+    // instead of being built.
+    int task_size;
+    vector<build_task_t> tasks;
+};
+
+// Spread the 10 lower bits of a value every 3 bits.
+static uint32_t morton_expand(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static float bbox_area(const bbox3f &b)
+{
+    vec3f size = b.max - b.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+}
+
+// Split a range of prims sorted by Morton codes.
+static int split_lbvh(build_prim_t *prims, int start, int end, int *axis)
+{
+    uint32_t a = prims[start].code, b = prims[end - 1].code;
+    int bit, lo = start, hi = end - 1, m;
+
+    *axis = 0;
+    if (a == b) return (start + end) / 2;
+    // All the codes of the range share the bits above this one, so we
+    // look for the first code that has it set.
+    bit = 31 - __builtin_clz(a ^ b);
+    while (lo < hi) {
+        m = (lo + hi) / 2;
+        if ((prims[m].code >> bit) & 1) hi = m;
+        else lo = m + 1;
+    }
+    *axis = 2 - bit % 3;
+    return lo;
+}
+
+// Split a range of prims at the best bin boundary.
+static int split_sah(build_prim_t *prims, int start, int end, int *axis)
+{
+    const int NB = 16;
+    bbox3f cbox = invalidb3f, bins[NB], right[NB];
+    int counts[NB], i, b, a, best_bin = -1, nb_left, mid;
+    float cost, best_cost = flt_max, scale;
+    bbox3f left;
+
+    for (i = start; i < end; i++) cbox = merge(cbox, prims[i].center);
+    *axis = 0;
+    for (a = 0; a < 3; a++) {
+        if (cbox.max[a] <= cbox.min[a]) continue;
+        scale = NB / (cbox.max[a] - cbox.min[a]);
+        for (b = 0; b < NB; b++) {
+            bins[b] = invalidb3f;
+            counts[b] = 0;
+        }
+        for (i = start; i < end; i++) {
+            b = min(NB - 1, (int)((prims[i].center[a] - cbox.min[a]) * scale));
+            bins[b] = merge(bins[b], prims[i].bbox);
+            counts[b]++;
+        }
+        right[NB - 1] = bins[NB - 1];
+        for (b = NB - 2; b > 0; b--) right[b] = merge(right[b + 1], bins[b]);
+        left = invalidb3f;
+        nb_left = 0;
+        for (b = 1; b < NB; b++) {
+            left = merge(left, bins[b - 1]);
+            nb_left += counts[b - 1];
+            if (nb_left == 0 || nb_left == end - start) continue;
+            cost = nb_left * bbox_area(left) +
+                   (end - start - nb_left) * bbox_area(right[b]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_bin = b;
+                *axis = a;
+            }
+        }
+    }
+    mid = (start + end) / 2;
+    if (best_bin < 0) return mid; // All the centers are the same.
+
+    a = *axis;
+    scale = NB / (cbox.max[a] - cbox.min[a]);
+    mid = std::partition(prims + start, prims + end,
+            [&](const build_prim_t &p) {
+                return min(NB - 1, (int)((p.center[a] - cbox.min[a]) *
+                                         scale)) < best_bin;
+            }) - prims;
+    return mid;
+}
+
+static void build_node(bvh_builder_t *b, int node_id, int start, int end)
+{
+    vector<bvh_node> &nodes = *b->nodes;
+    bbox3f bbox = invalidb3f;
+    int i, mid, axis, child;
+
+    for (i = start; i < end; i++) bbox = merge(bbox, b->prims[i].bbox);
+    nodes[node_id].bbox = bbox;
+    if (end - start <= bvh_max_prims) {
+        nodes[node_id].internal = false;
+        nodes[node_id].num = end - start;
+        for (i = 0; i < end - start; i++)
+            nodes[node_id].prims[i] = b->prims[start + i].id;
+        return;
+    }
+    if (b->task_size && end - start <= b->task_size) {
+        b->tasks.push_back({node_id, start, end, {}});
+        return;
+    }
+    mid = b->sah ? split_sah(b->prims, start, end, &axis) :
+                   split_lbvh(b->prims, start, end, &axis);
+    child = nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[node_id].internal = true;
+    nodes[node_id].axis = axis;
+    nodes[node_id].num = 2;
+    nodes[node_id].prims[0] = child;
+    nodes[node_id].prims[1] = child + 1;
+    build_node(b, child, start, mid);
+    build_node(b, child + 1, mid, end);
+}
+
+static void build_task_func(void *user, int i)
+{
+    bvh_builder_t *b = (bvh_builder_t*)user;
+    build_task_t &task = b->tasks[i];
+    bvh_builder_t sub = {b->prims, b->sah, &task.nodes};
+    task.nodes.reserve(2 * (task.end - task.start));
+    task.nodes.emplace_back();
+    build_node(&sub, 0, task.start, task.end);
+}
+
+/*
+ * Build the nodes of a bvh from its primitives bounding boxes.  If
+ * parallel is set, the subtrees are built with parallel_for.
+ */
+static void build_nodes(vector<bvh_node> &nodes, vector<build_prim_t> &prims,
+                        bool sah, bool parallel)
+{
+    const int n = prims.size();
+    bvh_builder_t b = {prims.data(), sah, &nodes};
+    bbox3f cbox = invalidb3f;
+    vec3f scale;
+    int i, offset;
+
+    nodes.clear();
+    nodes.reserve(2 * max(n, 1));
+    nodes.emplace_back();
+    nodes[0].bbox = invalidb3f;
+    if (!n) return;
+
+    if (!sah) {
+        for (i = 0; i < n; i++) cbox = merge(cbox, prims[i].center);
+        for (i = 0; i < 3; i++)
+            scale[i] = 1023.f / max(cbox.max[i] - cbox.min[i], 1e-6f);
+        for (auto &prim : prims) {
+            vec3f c = (prim.center - cbox.min) * scale;
+            prim.code = morton_expand((uint32_t)c.x) << 2 |
+                        morton_expand((uint32_t)c.y) << 1 |
+                        morton_expand((uint32_t)c.z);
+        }
+        sort(prims.begin(), prims.end(),
+             [](const build_prim_t &a, const build_prim_t &b) {
+                 return a.code < b.code; });
+    }
+
+    if (parallel) b.task_size = max(1024, n / 64);
+    build_node(&b, 0, 0, n);
+    if (b.tasks.empty()) return;
+
+    parallel_for(b.tasks.size(), build_task_func, &b);
+    // Attach the subtrees, their local node i > 0 goes to offset + i - 1.
+    for (auto &task : b.tasks) {
+        offset = nodes.size();
+        for (auto &node : task.nodes) {
+            if (!node.internal) continue;
+            node.prims[0] += offset - 1;
+            node.prims[1] += offset - 1;
+        }
+        nodes[task.node] = task.nodes[0];
+        nodes.insert(nodes.end(), task.nodes.begin() + 1, task.nodes.end());
+    }
+}
+
+/*
+ * Build the bvh of a shape.  Return false if the shape type is not
+ * supported, in which case we use the yocto builder.
+ */
+static bool build_shape_bvh(bvh_shape &shape, bool sah)
+{
+    vector<build_prim_t> prims;
+    bbox3f bbox;
+    int i, j;
+
+    if (!shape.quads.empty()) {
+        prims.resize(shape.quads.size());
+        for (i = 0; i < (int)shape.quads.size(); i++) {
+            const vec4i &q = shape.quads[i];
+            bbox = invalidb3f;
+            for (j = 0; j < 4; j++) bbox = merge(bbox, shape.positions[q[j]]);
+            prims[i] = {bbox, center(bbox), 0, i};
+        }
+    } else if (!shape.triangles.empty()) {
+        prims.resize(shape.triangles.size());
+        for (i = 0; i < (int)shape.triangles.size(); i++) {
+            const vec3i &t = shape.triangles[i];
+            bbox = invalidb3f;
+            for (j = 0; j < 3; j++) bbox = merge(bbox, shape.positions[t[j]]);
+            prims[i] = {bbox, center(bbox), 0, i};
+        }
+    } else {
+        return false;
+    }
+    build_nodes(shape.nodes, prims, sah, false);
+    return true;
+}
+
+// Build the top level bvh, from the bvh of the instances shapes.
+static void build_top_bvh(bvh_scene &bvh, bool sah)
+{
+    vector<build_prim_t> prims;
+    bbox3f bbox;
+    int i;
+
+    prims.reserve(bvh.instances.size());
+    for (i = 0; i < (int)bvh.instances.size(); i++) {
+        const auto &sbvh = bvh.shapes[bvh.instances[i].shape];
+        if (sbvh.nodes.empty()) continue;
+        bbox = transform_bbox(bvh.instances[i].frame, sbvh.nodes[0].bbox);
+        prims.push_back({bbox, center(bbox), 0, i});
+    }
+    build_nodes(bvh.nodes, prims, sah, true);
+}
+
+// Arguments of the parallel build of the shapes.
+struct shapes_build_t {
+    pathtracer_internal_t *p;
+    const vector<int> *shapes;
+    bool sah;
+};
+
+static void build_shape_func(void *user, int i)
+{
+    shapes_build_t *job = (shapes_build_t*)user;
+    pathtracer_internal_t *p = job->p;
+    bvh_shape &sbvh = p->bvh.shapes[(*job->shapes)[i]];
+    bvh_params params = p->bvh_prms;
+
+    if (build_shape_bvh(sbvh, job->sah)) return;
+    params.high_quality = job->sah;
+    params.noparallel = true;
+    build_bvh(sbvh, params);
+}
+
+/*
+ * Update the two level bvh of the scene: only the bvh of the updated shapes
+ * are rebuilt, and the top level bvh is refit, unless the instances changed.
+ *
+ * With the voxels backend, the blocks shapes don't get a bvh, instead we
+ * traverse their voxels faces.
+ *
+ * The final renders always use the SAH builder, the interactive ones the
+ * LBVH builder if pt->bvh_fast is set.
+ */
+static void update_bvh(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    const auto &scene = p->scene;
+    bool use_voxels, sah;
+    int i;
+    vector<int> shapes;
+    shapes_build_t job = {p, &shapes};
+    double time = sys_get_time();
+
+    // The voxels grid can't contain the unaligned instances of the clone
+    // layers, in which case we fall back to the bvh.
+    use_voxels = pt->backend == PT_BACKEND_VOXELS &&
+                 !(goxel.rend.settings.effects & EFFECT_MARCHING_CUBES) &&
+                 p->blocks_aligned;
+    sah = p->final_render || !pt->bvh_fast;
+    if (use_voxels != p->use_voxels || sah != p->bvh_sah) {
+        p->use_voxels = use_voxels;
+        p->bvh_sah = sah;
+        p->updated_shapes.clear();
+        for (i = 0; i < (int)scene.shapes.size(); i++)
+            p->updated_shapes.push_back(i);
+        p->instances_changed = true;
+    }
+
+    p->bvh.shapes.resize(scene.shapes.size());
+    p->shapes_voxels.resize(scene.shapes.size());
+    // The shapes might have moved in memory when the list grew.
+    for (i = 0; i < (int)scene.shapes.size(); i++)
+        set_shape_bvh_data(p->bvh.shapes[i], scene.shapes[i]);
+    for (int idx : p->updated_shapes) {
+        if (use_voxels && scene.shapes[idx].uri == "<block>") {
+            make_shape_voxels(scene.shapes[idx], &p->shapes_voxels[idx]);
+            vector<bvh_node>().swap(p->bvh.shapes[idx].nodes);
+            continue;
+        }
+        if (scene.shapes[idx].positions.empty()) continue;
+        shapes.push_back(idx);
+    }
+    p->updated_shapes.clear();
+
+    p->bvh.instances = {};
+    if (!scene.instances.empty()) {
+        p->bvh.instances = {&scene.instances[0].frame,
+                            (int)scene.instances.size(),
+                            sizeof(scene.instances[0])};
+    }
+
+    job.sah = sah;
+    parallel_for(shapes.size(), build_shape_func, &job);
+
+    if (use_voxels) {
+        vector<bvh_node>().swap(p->bvh.nodes);
+        update_grid(pt);
+    } else {
+        p->bvh.intersect = {};
+        if (p->instances_changed || p->bvh.nodes.empty()) {
+            build_top_bvh(p->bvh, sah);
+            p->instances_changed = false;
+        } else {
+            refit_bvh(p->bvh, {}, p->bvh_prms);
+        }
+    }
+    pt->bvh_time = sys_get_time() - time;
+}
+
+// Add a rect to the part of the display buffer that needs an upload.
+static void set_dirty(pathtracer_t *pt, const image_region &region)
+{
+    int *d = pt->dirty;
+    int x0 = region.min.x, y0 = region.min.y;
+    int x1 = region.max.x, y1 = region.max.y;
+    if (d[2] > 0 && d[3] > 0) {
+        x0 = min(x0, d[0]);
+        y0 = min(y0, d[1]);
+        x1 = max(x1, d[0] + d[2]);
+        y1 = max(y1, d[1] + d[3]);
+    }
+    d[0] = x0;
+    d[1] = y0;
+    d[2] = x1 - x0;
+    d[3] = y1 - y0;
+}
+
+/*
+ * Tonemap a region of an image directly into the display buffer, skipping
+ * the pixels set in mask if given.  With the default contrast, saturation
+ * and filmic settings, the tonemapping of a channel only depends on its
+ * value, so we use a lookup table instead of a pow per channel for the
+ * sRGB conversion, and we don't need the intermediate float image.
+ */
+static void tonemap_region(pathtracer_t *pt, const image4f &img,
+                           const image_region &region,
+                           const vector<bool> *mask)
+{
+    pathtracer_internal_t *p = pt->p;
+    const tonemap_params &prms = p->tonemap_prms;
+    const uint8_t *lut = p->tonemap_lut;
+    const int n = TONEMAP_LUT_SIZE;
+    int i, j, k;
+    uint8_t *dst;
+    vec3f scale;
+    vec4b v;
+    float c;
+
+    set_dirty(pt, region);
+    if (prms.contrast != 0.5f || prms.logcontrast != 0.5f ||
+            prms.saturation != 0.5f || prms.filmic) {
+        tonemap(p->display, img, region, prms);
+        for (j = region.min.y; j < region.max.y; j++)
+        for (i = region.min.x; i < region.max.x; i++) {
+            if (mask && (*mask)[j * pt->w + i]) continue;
+            v = float_to_byte(p->display[{i, j}]);
+            memcpy(&pt->buf[(j * pt->w + i) * 4], &v, 4);
+        }
+        return;
+    }
+
+    if (p->tonemap_lut_srgb != (int)prms.srgb) {
+        for (k = 0; k < n; k++) {
+            c = (k + 0.5f) / n;
+            if (prms.srgb) c = rgb_to_srgb(c);
+            p->tonemap_lut[k] = clamp((int)(c * 256), 0, 255);
+        }
+        p->tonemap_lut_srgb = prms.srgb;
+    }
+
+    scale = prms.tint * exp2f(prms.exposure) * (float)n;
+    for (j = region.min.y; j < region.max.y; j++) {
+        const vec4f *src = &img[{region.min.x, j}];
+        dst = &pt->buf[(j * pt->w + region.min.x) * 4];
+        for (i = 0; i < region.max.x - region.min.x; i++, dst += 4) {
+            if (mask && (*mask)[j * pt->w + region.min.x + i]) continue;
+            dst[0] = lut[clamp((int)(src[i].x * scale.x), 0, n - 1)];
+            dst[1] = lut[clamp((int)(src[i].y * scale.y), 0, n - 1)];
+            dst[2] = lut[clamp((int)(src[i].z * scale.z), 0, n - 1)];
+            dst[3] = clamp((int)(src[i].w * 256), 0, 255);
+        }
+    }
+}
+
+// One pass of the a-trous filter.
+struct atrous_pass_t {
+    const denoise_job_t *job;
+    const vector<vec3f> *src;
+    vector<vec3f> *dst;
+    int step;
+    float sigma;        // Color sigma of the pass.
+};
+
+static void atrous_row(void *user, int j)
+{
+    const float kernel[3] = {3 / 8.f, 1 / 4.f, 1 / 16.f};
+    const atrous_pass_t *pass = (const atrous_pass_t*)user;
+    const denoise_job_t *job = pass->job;
+    const vec2i size = job->color.size();
+    const vector<vec3f> &src = *pass->src;
+    const vector<float> &depth = *job->depth;
+    const vector<vec3f> &albedo = *job->albedo;
+    const vector<vec3f> &normal = *job->normal;
+    int i, k, x, y, dx, dy, p, q;
+    float w, wsum, d;
+    vec3f c, sum, cp, cq;
+
+    for (i = 0; i < size.x; i++) {
+        p = j * size.x + i;
+        // Compare the colors in a compressed range, so that the bright
+        // pixels don't dominate.
+        cp = src[p] / (1.f + src[p]);
+        sum = zero3f;
+        wsum = 0;
+        for (dy = -2; dy <= 2; dy++)
+        for (dx = -2; dx <= 2; dx++) {
+            x = i + dx * pass->step;
+            y = j + dy * pass->step;
+            if (x < 0 || x >= size.x || y < 0 || y >= size.y) continue;
+            q = y * size.x + x;
+            if ((depth[p] == flt_max) != (depth[q] == flt_max)) continue;
+            w = kernel[dx < 0 ? -dx : dx] * kernel[dy < 0 ? -dy : dy];
+            cq = src[q] / (1.f + src[q]);
+            c = cq - cp;
+            w *= expf(-dot(c, c) / (pass->sigma * pass->sigma));
+            if (depth[p] != flt_max) {
+                d = dot(normal[p], normal[q]);
+                if (d <= 0) continue;
+                for (k = 0; k < 6; k++) d *= d; // pow(d, 64)
+                w *= d;
+                c = albedo[q] - albedo[p];
+                w *= expf(-dot(c, c) / (0.1f * 0.1f));
+                d = (depth[q] - depth[p]) / (0.02f * depth[p] * pass->step);
+                w *= expf(-d * d);
             }
+            sum += src[q] * w;
+            wsum += w;
+        }
+        (*pass->dst)[p] = wsum > 0 ? sum / wsum : src[p];
+    }
+}
+
+/*
+ * Edge avoiding a-trous wavelet filter (Dammertz et al. 2010): a 5x5
+ * kernel applied several times with a growing step, whose weights drop
+ * across the edges of the normal, albedo and depth AOVs.  We filter the
+ * illumination (the color divided by the albedo), so that the voxels
+ * colors stay sharp.
+ */
+static void denoise_atrous(denoise_job_t *job)
+{
+    const int nb_passes = 5;
+    const int n = job->color.count();
+    vector<vec3f> a(n), b(n);
+    atrous_pass_t pass = {job};
+    vec3f albedo;
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+        albedo = (*job->albedo)[i];
+        albedo = {max(albedo.x, 0.01f), max(albedo.y, 0.01f),
+                  max(albedo.z, 0.01f)};
+        a[i] = xyz(job->color[i]) / albedo;
+    }
+    for (k = 0; k < nb_passes; k++) {
+        pass.src = &a;
+        pass.dst = &b;
+        pass.step = 1 << k;
+        pass.sigma = 0.5f / (1 << k);
+        parallel_for(job->color.size().y, atrous_row, &pass);
+        swap(a, b);
+    }
+    job->output = image4f(job->color.size());
+    for (i = 0; i < n; i++) {
+        albedo = (*job->albedo)[i];
+        albedo = {max(albedo.x, 0.01f), max(albedo.y, 0.01f),
+                  max(albedo.z, 0.01f)};
+        job->output[i] = {a[i] * albedo, job->color[i].w};
+    }
+}
+
+#if HAVE_OIDN
+// Denoise with Open Image Denoise.  Return false in case of error.
+static bool denoise_oidn(denoise_job_t *job)
+{
+    const vec2i size = job->color.size();
+    const char *err;
+    bool ret;
+    int i;
+    OIDNDevice device;
+    OIDNFilter filter;
+
+    job->output = image4f(size);
+    device = oidnNewDevice(OIDN_DEVICE_TYPE_DEFAULT);
+    oidnCommitDevice(device);
+    filter = oidnNewFilter(device, "RT");
+    oidnSetSharedFilterImage(filter, "color", job->color.data(),
+            OIDN_FORMAT_FLOAT3, size.x, size.y, 0, sizeof(vec4f), 0);
+    oidnSetSharedFilterImage(filter, "albedo", (void*)job->albedo->data(),
+            OIDN_FORMAT_FLOAT3, size.x, size.y, 0, sizeof(vec3f), 0);
+    oidnSetSharedFilterImage(filter, "normal", (void*)job->normal->data(),
+            OIDN_FORMAT_FLOAT3, size.x, size.y, 0, sizeof(vec3f), 0);
+    oidnSetSharedFilterImage(filter, "output", job->output.data(),
+            OIDN_FORMAT_FLOAT3, size.x, size.y, 0, sizeof(vec4f), 0);
+    oidnSetFilter1b(filter, "hdr", true);
+    oidnCommitFilter(filter);
+    oidnExecuteFilter(filter);
+    ret = oidnGetDeviceError(device, &err) == OIDN_ERROR_NONE;
+    if (!ret) LOG_W("OIDN error: %s", err);
+    oidnReleaseFilter(filter);
+    oidnReleaseDevice(device);
+    for (i = 0; i < (int)job->color.count(); i++)
+        job->output[i].w = job->color[i].w;
+    return ret;
+}
+#endif
+
+static void denoise_task_func(void *user)
+{
+    denoise_job_t *job = (denoise_job_t*)user;
+#if HAVE_OIDN
+    if (denoise_oidn(job)) return;
+#endif
+    denoise_atrous(job);
+}
+
+// Wait for the running denoising job, if any.
+static void denoise_wait(pathtracer_internal_t *p)
+{
+    if (!p->denoise_job.task) return;
+    task_wait(p->denoise_job.task);
+    task_delete(p->denoise_job.task);
+    p->denoise_job.task = NULL;
+}
+
+/*
+ * Show the result of the denoising job when it is done, and start a new
+ * one when the image got new samples.  During the render we ask the
+ * workers for a copy of the image at the end of a batch, so that we don't
+ * read it while it changes.
+ */
+static void update_denoise(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    trace_pool_t *pool = &p->pool;
+    denoise_job_t *job = &p->denoise_job;
+
+    if (job->task) {
+        if (!task_is_done(job->task)) return;
+        denoise_wait(p);
+        swap(p->denoised, job->output);
+        p->denoised_batch = job->batch;
+        tonemap_region(pt, p->denoised,
+                       image_region({0, 0}, {pt->w, pt->h}), nullptr);
+    }
+
+    {
+        lock_guard<mutex> guard{pool->lock};
+        if (!pool->active) {
+            if (p->trace_sample == 0 || p->denoised_batch == pool->batch_id)
+                return;
+            job->color = p->image;
+            job->batch = pool->batch_id;
+        } else if (pool->snapshot_ready) {
+            pool->snapshot_ready = false;
+            swap(job->color, p->snapshot);
+            job->batch = pool->snapshot_batch;
+        } else {
+            pool->snapshot_wanted = true;
+            return;
+        }
+    }
+    job->depth = &p->depth;
+    job->albedo = &p->albedo;
+    job->normal = &p->normal;
+    job->task = task_start(denoise_task_func, job);
+}
+
+/*
+ * Reproject the displayed image into the new camera, using the depth of
+ * the pixels rendered with the previous one, so that we have a sharp
+ * image to show while the new render starts.  Only done if the camera
+ * moved slightly, since we can't fill the disoccluded areas.
+ */
+static void reproject(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    const yocto_camera &prev = p->prev_camera;
+    const yocto_camera &cam = p->scene.cameras[0];
+    const int w = pt->w, h = pt->h;
+    const frame3f inv = inverse(cam.frame);
+    vector<uint8_t> buf(pt->buf, pt->buf + w * h * 4);
+    vector<float> depth(w * h, -1);
+    float dist, d, u, v;
+    int i, j, k, t, x, y;
+    vec3f pos, local;
+
+    if ((int)p->depth.size() != w * h || prev.film != cam.film ||
+            dot(prev.frame.z, cam.frame.z) < cos(REPROJECT_MAX_ANGLE)) {
+        p->depth = depth;
+        p->reprojected.assign(w * h, false);
+        return;
+    }
+
+    // Ignore the depth of the pixels we didn't display yet.
+    for (t = 0; t < (int)p->tiles_shown.size(); t++) {
+        if (p->tiles_shown[t]) continue;
+        const image_region &region = p->pool.tiles[t];
+        for (j = region.min.y; j < region.max.y; j++)
+        for (i = region.min.x; i < region.max.x; i++) {
+            if (!p->reprojected[j * w + i]) p->depth[j * w + i] = -1;
         }
-        current_sample = trace_prms.samples;
-    }));
+    }
+
+    dist = cam.lens;
+    if (cam.focus < flt_max)
+        dist = cam.lens * cam.focus / (cam.focus - cam.lens);
+    for (j = 0; j < h; j++)
+    for (i = 0; i < w; i++) {
+        d = p->depth[j * w + i];
+        if (d <= 0 || d == flt_max) continue;
+        auto ray = eval_camera(prev, {i, j}, {w, h}, {0.5f, 0.5f}, zero2f);
+        pos = ray.o + ray.d * d;
+        local = transform_point(inv, pos);
+        if (local.z >= 0) continue;
+        u = 0.5f + local.x / -local.z * dist / cam.film.x;
+        v = 0.5f - local.y / -local.z * dist / cam.film.y;
+        x = floor(u * w);
+        y = floor(v * h);
+        if (x < 0 || x >= w || y < 0 || y >= h) continue;
+        d = length(pos - cam.frame.o);
+        k = y * w + x;
+        if (depth[k] > 0 && depth[k] <= d) continue;
+        depth[k] = d;
+        memcpy(&pt->buf[k * 4], &buf[(j * w + i) * 4], 4);
+    }
+
+    // Fill the one pixel cracks we get when moving closer.
+    for (j = 1; j < h - 1; j++)
+    for (i = 1; i < w - 1; i++) {
+        k = j * w + i;
+        if (depth[k] > 0) continue;
+        if (depth[k - 1] > 0 && depth[k + 1] > 0) {
+            depth[k] = depth[k - 1];
+            memcpy(&pt->buf[k * 4], &pt->buf[(k - 1) * 4], 4);
+        } else if (depth[k - w] > 0 && depth[k + w] > 0) {
+            depth[k] = depth[k - w];
+            memcpy(&pt->buf[k * 4], &pt->buf[(k - w) * 4], 4);
+        }
+    }
+
+    p->reprojected.assign(w * h, false);
+    for (k = 0; k < w * h; k++) p->reprojected[k] = depth[k] > 0;
+    p->depth = depth;
+    set_dirty(pt, image_region({0, 0}, {w, h}));
+}
+
+// Report the approximate memory used by the scene, the bvh and the images
+// to the memory stats.
+static void update_mem_stats(pathtracer_internal_t *p)
+{
+    auto vec_mem = [](const auto &v) -> int64_t {
+        return v.capacity() * sizeof(v[0]);
+    };
+    int64_t mem = 0;
+
+    for (const auto &shape : p->scene.shapes) {
+        mem += vec_mem(shape.points) + vec_mem(shape.lines) +
+               vec_mem(shape.triangles) + vec_mem(shape.quads) +
+               vec_mem(shape.quadspos) + vec_mem(shape.quadsnorm) +
+               vec_mem(shape.quadstexcoord) + vec_mem(shape.positions) +
+               vec_mem(shape.normals) + vec_mem(shape.texcoords) +
+               vec_mem(shape.colors) + vec_mem(shape.radius) +
+               vec_mem(shape.tangents);
+    }
+    for (const auto &sbvh : p->bvh.shapes) mem += vec_mem(sbvh.nodes);
+    mem += vec_mem(p->bvh.nodes);
+    for (const auto &sv : p->shapes_voxels)
+        mem += sizeof(sv) + vec_mem(sv.faces);
+    for (const auto &cell : p->grid)
+        mem += sizeof(cell) + vec_mem(cell.second);
+    for (const image4f *img : {&p->image, &p->display, &p->preview,
+                               &p->snapshot, &p->denoised}) {
+        mem += (int64_t)img->count() * sizeof(vec4f);
+    }
+    mem += vec_mem(p->depth) + vec_mem(p->albedo) + vec_mem(p->normal);
+
+    mem_stats_add(MEM_PATHTRACER, mem - p->mem_reported);
+    p->mem_reported = mem;
 }
 
 static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
@@ -533,9 +2152,11 @@ static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
     if (force) changes |= CHANGE_FORCE;
 
     changes |= sync_mesh(pt, w, h, changes);
+    // The floor position depends on the image box, but the world and the
+    // light don't need an update when only the mesh changed.
     changes |= sync_floor(pt, changes);
-    changes |= sync_world(pt, changes);
-    changes |= sync_light(pt, changes);
+    changes |= sync_world(pt, changes & CHANGE_FORCE);
+    changes |= sync_light(pt, changes & CHANGE_FORCE);
     changes |= sync_camera(pt, w, h, viewport,
                            goxel.image->active_camera, changes);
     changes |= sync_options(pt, changes);
@@ -547,9 +2168,10 @@ static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
 
     // Update BVH if needed.
     if (changes & (CHANGE_MESH | CHANGE_LIGHT | CHANGE_FLOOR)) {
-        p->bvh = make_bvh(p->scene, p->bvh_prms);
+        update_bvh(pt);
     }
-    if (changes & (CHANGE_LIGHT | CHANGE_MATERIAL)) {
+    if (changes & (CHANGE_MESH | CHANGE_WORLD | CHANGE_LIGHT |
+                   CHANGE_MATERIAL)) {
         p->lights = make_trace_lights(p->scene);
     }
 
@@ -559,49 +2181,29 @@ static int sync(pathtracer_t *pt, int w, int h, const float viewport[4],
             p->trace_prms.sampler = trace_params::sampler_type::eyelight;
         }
         p->trace_prms.resolution = max(w, h);
+        stop_render(p);
+        denoise_wait(p);
+        p->denoised_batch = -1;
+        if (changes == CHANGE_CAMERA) {
+            reproject(pt);
+        } else {
+            p->depth.assign(w * h, -1);
+            p->reprojected.assign(w * h, false);
+        }
+        p->albedo.assign(w * h, zero3f);
+        p->normal.assign(w * h, zero3f);
         p->image = image4f({w, h});
         p->display = image4f({w, h});
+        p->preview = image4f({w, h});
+        pool_init(&p->pool, pt->nb_threads, pt->pin_threads);
 
-        stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                    &p->trace_stop);
-
-        p->state = make_trace_state({w, h});
         p->trace_sample = 0;
-        p->trace_stop = false;
-        start_render(p->image, p->state, p->scene,
-                     p->bvh, p->lights,
-                     p->trace_futures, p->trace_sample,
-                     p->trace_queue, p->trace_queuem, p->trace_prms,
-                     &p->trace_stop);
+        start_render(p, changes & CHANGE_CAMERA);
+        update_mem_stats(p);
     }
     return changes;
 }
 
-static void make_preview(pathtracer_t *pt)
-{
-    int i, j, pi, pj;
-    pathtracer_internal_t *p = pt->p;
-    trace_params preview_prms = p->trace_prms;
-    int preview_ratio = 8;
-    image4f preview;
-    vec4b v;
-
-    preview_prms.resolution /= preview_ratio;
-    preview_prms.samples = 1;
-
-    preview = trace_image(p->scene, p->bvh, p->lights, preview_prms);
-    preview = tonemap(preview, p->tonemap_prms);
-
-    for (i = 0; i < pt->h; i++) {
-        for (j = 0; j < pt->w; j++) {
-            pi = clamp(i / preview_ratio, 0, preview.size().y - 1);
-            pj = clamp(j / preview_ratio, 0, preview.size().x - 1);
-            v = float_to_byte(preview[{pj, pi}]);
-            memcpy(&pt->buf[(i * pt->w + j) * 4], &v, 4);
-        }
-    }
-}
-
 /*
  * Function: pathtracer_iter
  * Iter the rendering process of the current mesh.
@@ -613,35 +2215,50 @@ static void make_preview(pathtracer_t *pt)
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4])
 {
     pathtracer_internal_t *p;
-    int changes, i, j, size = 0;
-    image_region region = image_region{};
-    vec4b v;
+    int changes, t, samples, step, size = 0;
 
     if (!pt->p) pt->p = new pathtracer_internal_t();
     p = pt->p;
     p->trace_prms.resolution = max(pt->w, pt->h);
+    {
+        lock_guard<mutex> guard{p->pool.lock};
+        p->pool.focus[0] = pt->focus[0];
+        p->pool.focus[1] = pt->focus[1];
+    }
     changes = sync(pt, pt->w, pt->h, viewport, pt->force_restart);
     pt->force_restart = false;
     assert(p->display.size()[0] == pt->w);
     assert(p->display.size()[1] == pt->h);
     if (changes) pt->status = PT_RUNNING;
 
-    if (changes & CHANGE_CAMERA) {
-        make_preview(pt);
-        pt->progress = 0;
-        return;
+    // Show the raw tiles again if we stop denoising.
+    if (p->denoise != pt->denoise) {
+        p->denoise = pt->denoise;
+        p->denoised_batch = -1;
+        p->tiles_shown.assign(p->tiles_shown.size(), 0);
+        p->previews_shown.assign(p->previews_shown.size(), 0);
     }
 
-    while (try_pop(p->trace_queue, p->trace_queuem, region)) {
-        tonemap(p->display, p->image, region, p->tonemap_prms);
-        for (i = region.min[1]; i < region.max[1]; i++)
-        for (j = region.min[0]; j < region.max[0]; j++) {
-            v = float_to_byte(p->display[{j, i}]);
-            memcpy(&pt->buf[(i * pt->w + j) * 4], &v, 4);
+    // Display the tiles that got new samples or a finer preview since the
+    // last call.  The previews don't replace the reprojected pixels.
+    for (t = 0; t < (int)p->tiles_shown.size(); t++) {
+        const image_region &region = p->pool.tiles[t];
+        samples = p->pool.tiles_samples[t].load(memory_order_acquire);
+        if (samples != p->tiles_shown[t]) {
+            p->tiles_shown[t] = samples;
+            // Keep the denoised image once we have one.
+            if (p->denoised_batch >= 0) continue;
+            tonemap_region(pt, p->image, region, nullptr);
+        } else {
+            step = p->pool.tiles_preview[t].load(memory_order_acquire);
+            if (samples || step == p->previews_shown[t]) continue;
+            p->previews_shown[t] = step;
+            tonemap_region(pt, p->preview, region, &p->reprojected);
         }
         size += region.size().x * region.size().y;
         if (size >= p->image.size().x * p->image.size().y) break;
     }
+    if (pt->denoise) update_denoise(pt);
     pt->progress = (float)p->trace_sample / p->trace_prms.samples;
 
     if (pt->status != PT_FINISHED &&
@@ -651,6 +2268,55 @@ void pathtracer_iter(pathtracer_t *pt, const float viewport[4])
 }
 
 
+/*
+ * Function: pathtracer_render
+ * Render the current image until it is finished, without the GUI.
+ */
+void pathtracer_render(pathtracer_t *pt, int part, int nb_parts)
+{
+    const float viewport[4] = {0, 0, (float)pt->w, (float)pt->h};
+    pathtracer_internal_t *p;
+
+    if (!pt->p) pt->p = new pathtracer_internal_t();
+    p = pt->p;
+    p->part = part;
+    p->nb_parts = nb_parts;
+    p->final_render = true;
+    pt->force_restart = true;
+    pathtracer_iter(pt, viewport);
+    {
+        unique_lock<mutex> guard{p->pool.lock};
+        p->pool.idle_cond.wait(guard, [&]() { return !p->pool.active; });
+    }
+    // Update the buffer with all the tiles.
+    pathtracer_iter(pt, viewport);
+    if (p->denoise_job.task) {
+        task_wait(p->denoise_job.task);
+        update_denoise(pt);
+    }
+}
+
+/*
+ * Function: pathtracer_save
+ * Save the rendered image into a file.
+ */
+int pathtracer_save(const pathtracer_t *pt, const char *path)
+{
+    if (!pt->p) return -1;
+    try {
+        if (is_hdr_filename(path) && pt->p->denoised_batch >= 0)
+            save_image(path, pt->p->denoised);
+        else if (is_hdr_filename(path))
+            save_image(path, pt->p->image);
+        else
+            img_write(pt->buf, pt->w, pt->h, 4, path);
+    } catch (const std::exception &e) {
+        LOG_E("Cannot save %s: %s", path, e.what());
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Stop the pathtracer thread if it is running.
  */
@@ -658,8 +2324,10 @@ void pathtracer_stop(pathtracer_t *pt)
 {
     pathtracer_internal_t *p = pt->p;
     if (!p) return;
-    stop_render(p->trace_futures, p->trace_queue, p->trace_queuem,
-                &p->trace_stop);
+    stop_render(p);
+    denoise_wait(p);
+    pool_release(&p->pool);
+    mem_stats_add(MEM_PATHTRACER, -p->mem_reported);
     delete p;
     pt->p = nullptr;
 }
@@ -671,6 +2339,8 @@ extern "C" {
 }
 
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4]) {}
+void pathtracer_render(pathtracer_t *pt, int part, int nb_parts) {}
+int pathtracer_save(const pathtracer_t *pt, const char *path) { return -1; }
 void pathtracer_stop(pathtracer_t *pt) {}
 
 #endif // YOCTO
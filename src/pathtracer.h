@@ -29,6 +29,12 @@ enum {
     PT_FLOOR_PLANE,
 };
 
+// How the rays are intersected with the mesh.
+enum {
+    PT_BACKEND_BVH = 0, // Bvh of the tessellated blocks.
+    PT_BACKEND_VOXELS,  // Traversal of the voxels grid (cube mode only).
+};
+
 enum {
     PT_STOPPED = 0,
     PT_RUNNING,
@@ -42,11 +48,24 @@ typedef struct {
     int status;
     uint8_t *buf;       // RGBA buffer.
     int w, h;           // Size of the buffer.
+    int dirty[4];       // Rect of buf changed since the last upload.
     float progress;
     bool force_restart;
     texture_t *texture;
     pathtracer_internal_t *p;
     int num_samples;
+    // Stop sampling the tiles whose estimated noise is below this value.
+    // 0 to always use num_samples.
+    float noise_threshold;
+    float focus[2];     // Point to render first, in [0, 1] image coords.
+    int backend;        // One of the PT_BACKEND values.
+    // Use the fast bvh builder for the interactive renders.
+    bool bvh_fast;
+    double bvh_time;    // Duration of the last bvh update (sec).
+    int nb_threads;     // Number of render threads, 0 for one per cpu.
+    bool pin_threads;   // Pin each render thread to a cpu.
+    uint32_t seed;      // Random seed of the render, 0 for the default.
+    bool denoise;       // Show a denoised version of the image.
     struct {
         int type;
         float energy;
@@ -70,6 +89,35 @@ typedef struct {
  */
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4]);
 
+/*
+ * Function: pathtracer_render
+ * Render the current image to completion, without the GUI.
+ *
+ * The buffer must already be allocated.  The tiles of the image are split
+ * into nb_parts ranges, and we only render the given one, so that a single
+ * frame can be rendered on several machines.  The pixels of the other
+ * parts are left transparent.  Since each pixel has its own seeded random
+ * generator, the result doesn't depend on the split.
+ *
+ * Parameters:
+ *   pt       - A pathtracer instance.
+ *   part     - Index of the range of tiles to render.
+ *   nb_parts - Number of ranges, 1 to render the full image.
+ */
+void pathtracer_render(pathtracer_t *pt, int part, int nb_parts);
+
+/*
+ * Function: pathtracer_save
+ * Save the rendered image into a file.
+ *
+ * HDR formats (exr, hdr, pfm) get the linear radiance, the other ones the
+ * tonemapped buffer.
+ *
+ * Return:
+ *   0 on success.
+ */
+int pathtracer_save(const pathtracer_t *pt, const char *path);
+
 /*
  * Stop the pathtracer thread if it is running.
  */
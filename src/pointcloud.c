@@ -0,0 +1,331 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pointcloud.h"
+
+#include "goxel.h"
+#include "file_format.h"
+#include "utils/parallel.h"
+
+#include <float.h>
+
+#define N BLOCK_SIZE
+
+// Number of points read and binned at once.
+#define CHUNK_SIZE (1 << 18)
+
+// Number of points quantized by each parallel call.
+#define SLICE_SIZE 4096
+
+// Number of tables of partial blocks, each one filled by a single worker.
+#define NB_PARTS 16
+
+// Number of blocks reduced in parallel before we write them into the mesh.
+#define BATCH_SIZE 256
+
+static struct {
+    int     size;
+    int     mode;
+} g_options = {
+    .size = 256,
+    .mode = POINTCLOUD_AVERAGE,
+};
+
+// Colors of the points of a voxel.
+typedef struct {
+    uint32_t    count;          // Number of points.
+    union {
+        uint32_t    sum[3];     // POINTCLOUD_AVERAGE: sum of the colors.
+        struct {                // POINTCLOUD_MAJORITY: Boyer-Moore vote.
+            uint32_t    color;
+            uint32_t    votes;
+        };
+    };
+} voxel_acc_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    voxel_acc_t     voxels[N * N * N];
+} partial_block_t;
+
+// A point quantized to the voxels grid.
+typedef struct {
+    int         bpos[3];        // Position of the block.
+    int         idx;            // Index of the voxel in the block.
+    int         part;           // Table of the block, or -1 to skip it.
+    uint8_t     color[3];
+} quant_point_t;
+
+typedef struct {
+    pointcloud_point_t  *points;
+    quant_point_t       *quant;
+    int                 nb;             // Number of points in the chunk.
+    int                 mode;
+    double              min[3];         // Min of the points positions.
+    double              scale;
+    int                 box[2][3];      // Voxels range of the cloud.
+    partial_block_t     *parts[NB_PARTS];
+    partial_block_t     **blocks;       // All the blocks, once read.
+    int                 first;          // First block of the current batch.
+    uint8_t             *voxels;        // Values of the batch blocks.
+} job_t;
+
+// Read the next chunk of points, in the z up convention.
+static int read_points(pointcloud_reader_t *reader, pointcloud_point_t *points)
+{
+    int i, nb;
+    double y;
+
+    nb = reader->read(reader, points, CHUNK_SIZE);
+    if (nb <= 0 || !reader->y_up) return nb;
+    for (i = 0; i < nb; i++) {
+        y = points[i].pos[1];
+        points[i].pos[1] = -points[i].pos[2];
+        points[i].pos[2] = y;
+    }
+    return nb;
+}
+
+static bool point_is_valid(const pointcloud_point_t *p)
+{
+    return isfinite(p->pos[0]) && isfinite(p->pos[1]) && isfinite(p->pos[2]);
+}
+
+// Compute the bounds of the cloud, in the z up convention.
+static int get_bounds(job_t *job, pointcloud_reader_t *reader,
+                      double bounds[2][3], int64_t *count)
+{
+    int i, k, nb;
+    double b[2][3];
+
+    if (reader->has_bounds) {
+        memcpy(b, reader->bounds, sizeof(b));
+        if (reader->y_up) {
+            for (i = 0; i < 2; i++) {
+                bounds[i][0] = b[i][0];
+                bounds[i][1] = -b[1 - i][2];
+                bounds[i][2] = b[i][1];
+            }
+        } else {
+            memcpy(bounds, b, sizeof(b));
+        }
+        *count = reader->nb_points;
+        return 0;
+    }
+    for (k = 0; k < 3; k++) {
+        bounds[0][k] = DBL_MAX;
+        bounds[1][k] = -DBL_MAX;
+    }
+    *count = 0;
+    while ((nb = read_points(reader, job->points)) > 0) {
+        for (i = 0; i < nb; i++) {
+            if (!point_is_valid(&job->points[i])) continue;
+            for (k = 0; k < 3; k++) {
+                bounds[0][k] = min(bounds[0][k], job->points[i].pos[k]);
+                bounds[1][k] = max(bounds[1][k], job->points[i].pos[k]);
+            }
+        }
+        *count += nb;
+    }
+    if (nb < 0 || reader->rewind(reader)) return -1;
+    return 0;
+}
+
+static void quantize_slice(void *user, int slice)
+{
+    job_t *job = user;
+    const pointcloud_point_t *p;
+    quant_point_t *q;
+    int i, k, v[3];
+    uint32_t h;
+
+    for (i = slice * SLICE_SIZE; i < min(job->nb, (slice + 1) * SLICE_SIZE);
+         i++) {
+        p = &job->points[i];
+        q = &job->quant[i];
+        q->part = -1;
+        if (!point_is_valid(p)) continue;
+        for (k = 0; k < 3; k++) {
+            v[k] = job->box[0][k] + (int)clamp(
+                    floor((p->pos[k] - job->min[k]) * job->scale),
+                    0, job->box[1][k] - job->box[0][k] - 1);
+            q->bpos[k] = v[k] & ~(N - 1);
+        }
+        q->idx = (v[0] - q->bpos[0]) + (v[1] - q->bpos[1]) * N +
+                 (v[2] - q->bpos[2]) * N * N;
+        h = (uint32_t)q->bpos[0] * 73856093u ^
+            (uint32_t)q->bpos[1] * 19349663u ^
+            (uint32_t)q->bpos[2] * 83492791u;
+        q->part = (h / N) % NB_PARTS;
+        memcpy(q->color, p->color, 3);
+    }
+}
+
+// Add the points of the chunk to the blocks of one table.
+static void accumulate_part(void *user, int part)
+{
+    job_t *job = user;
+    const quant_point_t *q;
+    partial_block_t *block = NULL;
+    voxel_acc_t *acc;
+    uint32_t color;
+    int i, k;
+
+    for (i = 0; i < job->nb; i++) {
+        q = &job->quant[i];
+        if (q->part != part) continue;
+        if (!block || memcmp(block->pos, q->bpos, sizeof(q->bpos)) != 0) {
+            HASH_FIND(hh, job->parts[part], q->bpos, sizeof(q->bpos), block);
+            if (!block) {
+                block = calloc(1, sizeof(*block));
+                memcpy(block->pos, q->bpos, sizeof(q->bpos));
+                HASH_ADD(hh, job->parts[part], pos, sizeof(block->pos),
+                         block);
+            }
+        }
+        acc = &block->voxels[q->idx];
+        acc->count++;
+        if (job->mode == POINTCLOUD_AVERAGE) {
+            for (k = 0; k < 3; k++) acc->sum[k] += q->color[k];
+            continue;
+        }
+        color = q->color[0] | q->color[1] << 8 | q->color[2] << 16;
+        if (acc->votes == 0) acc->color = color;
+        if (acc->color == color) acc->votes++;
+        else acc->votes--;
+    }
+}
+
+static void reduce_block(void *user, int i)
+{
+    job_t *job = user;
+    const partial_block_t *block = job->blocks[job->first + i];
+    const voxel_acc_t *acc;
+    uint8_t *v = job->voxels + (size_t)i * N * N * N * 4;
+    int j, k;
+
+    for (j = 0; j < N * N * N; j++, v += 4) {
+        acc = &block->voxels[j];
+        if (!acc->count) {
+            memset(v, 0, 4);
+            continue;
+        }
+        for (k = 0; k < 3; k++) {
+            if (job->mode == POINTCLOUD_AVERAGE)
+                v[k] = (acc->sum[k] + acc->count / 2) / acc->count;
+            else
+                v[k] = acc->color >> (k * 8);
+        }
+        v[3] = 255;
+    }
+}
+
+int pointcloud_import(image_t *image, pointcloud_reader_t *reader)
+{
+    job_t job = {.mode = g_options.mode};
+    mesh_t *mesh = image->active_layer->mesh;
+    partial_block_t *block, *tmp;
+    double bounds[2][3], size;
+    int64_t count = 0, done = 0;
+    int i, k, nb_blocks = 0, batch, ret = -1;
+
+    job.points = malloc(CHUNK_SIZE * sizeof(*job.points));
+    job.quant = malloc(CHUNK_SIZE * sizeof(*job.quant));
+    if (get_bounds(&job, reader, bounds, &count)) goto end;
+    if (bounds[0][0] > bounds[1][0]) {
+        LOG_E("No points to import");
+        goto end;
+    }
+
+    // Scale the largest side to the options size, and center the cloud.
+    size = max3(bounds[1][0] - bounds[0][0], bounds[1][1] - bounds[0][1],
+                bounds[1][2] - bounds[0][2]);
+    job.scale = size > 0 ? (g_options.size - 0.01) / size : 1;
+    for (k = 0; k < 3; k++) {
+        job.min[k] = bounds[0][k];
+        job.box[1][k] = max(1, (int)ceil(
+                    (bounds[1][k] - bounds[0][k]) * job.scale - 0.001));
+        job.box[0][k] = k == 2 ? 0 : -(job.box[1][k] / 2);
+        job.box[1][k] += job.box[0][k];
+    }
+
+    while ((job.nb = read_points(reader, job.points)) > 0) {
+        parallel_for((job.nb + SLICE_SIZE - 1) / SLICE_SIZE, quantize_slice,
+                     &job);
+        parallel_for(NB_PARTS, accumulate_part, &job);
+        done += job.nb;
+        if (count && !file_format_report_progress(0.9 * done / count))
+            goto end;
+    }
+    if (job.nb < 0) goto end;
+
+    // Write the blocks, one batch at a time.
+    for (i = 0; i < NB_PARTS; i++) nb_blocks += HASH_COUNT(job.parts[i]);
+    if (!nb_blocks) {
+        LOG_E("No points to import");
+        goto end;
+    }
+    job.blocks = malloc(max(nb_blocks, 1) * sizeof(*job.blocks));
+    nb_blocks = 0;
+    for (i = 0; i < NB_PARTS; i++) {
+        HASH_ITER(hh, job.parts[i], block, tmp)
+            job.blocks[nb_blocks++] = block;
+        HASH_CLEAR(hh, job.parts[i]);
+    }
+    job.voxels = malloc((size_t)BATCH_SIZE * N * N * N * 4);
+    mesh_begin_write(mesh);
+    for (job.first = 0; job.first < nb_blocks; job.first += BATCH_SIZE) {
+        batch = min(BATCH_SIZE, nb_blocks - job.first);
+        parallel_for(batch, reduce_block, &job);
+        for (i = 0; i < batch; i++) {
+            mesh_write(mesh, job.blocks[job.first + i]->pos, (int[]){N, N, N},
+                       job.voxels + (size_t)i * N * N * N * 4);
+            free(job.blocks[job.first + i]);
+            job.blocks[job.first + i] = NULL;
+        }
+        if (!file_format_report_progress(
+                    0.9 + 0.1 * (job.first + batch) / nb_blocks)) {
+            mesh_end_write(mesh);
+            goto end;
+        }
+    }
+    mesh_end_write(mesh);
+    bbox_from_aabb(image->active_layer->box, job.box);
+    ret = 0;
+
+end:
+    for (i = 0; i < NB_PARTS; i++) {
+        HASH_ITER(hh, job.parts[i], block, tmp) {
+            HASH_DEL(job.parts[i], block);
+            free(block);
+        }
+    }
+    for (i = 0; job.blocks && i < nb_blocks; i++) free(job.blocks[i]);
+    free(job.blocks);
+    free(job.voxels);
+    free(job.points);
+    free(job.quant);
+    return ret;
+}
+
+void pointcloud_set_options(int size, int mode)
+{
+    g_options.size = max(1, size);
+    g_options.mode = mode;
+}
@@ -0,0 +1,95 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Point cloud
+ *
+ * Conversion of point clouds into voxels, used by the ply, xyz and las
+ * importers.
+ *
+ * The points are streamed from the file in chunks, so that the memory used
+ * only depends on the number of voxels, not on the number of points.  Each
+ * chunk is first quantized to the voxels grid in parallel, and then each
+ * worker accumulates the colors of the points of the blocks it owns, into
+ * its own table of partial blocks, so that no locking is needed.  Once all
+ * the points are read, the colors of each voxel are reduced to a single
+ * value and the blocks are written directly into the mesh.
+ */
+
+#ifndef POINTCLOUD_H
+#define POINTCLOUD_H
+
+#include "image.h"
+
+typedef struct {
+    double      pos[3];
+    uint8_t     color[3];
+} pointcloud_point_t;
+
+// How the colors of the points in the same voxel are combined.
+enum {
+    POINTCLOUD_AVERAGE,
+    POINTCLOUD_MAJORITY,    // The most frequent color.
+};
+
+/*
+ * Type: pointcloud_reader_t
+ * Source of the points of an import, implemented by each file format.
+ */
+typedef struct pointcloud_reader pointcloud_reader_t;
+struct pointcloud_reader {
+    // Read the next points, and return the number of points read, zero
+    // at the end of the file, or -1 in case of error.
+    int     (*read)(pointcloud_reader_t *reader,
+                    pointcloud_point_t *points, int size);
+    // Go back to the first point.  Only needed if has_bounds is not set,
+    // since we then read the points twice.
+    int     (*rewind)(pointcloud_reader_t *reader);
+    bool    y_up;           // Use the y up convention of the polygons.
+    bool    has_bounds;     // Set if the bounds are known in advance.
+    double  bounds[2][3];   // Min and max of the points positions.
+    int64_t nb_points;      // Number of points if known, for the progress.
+};
+
+/*
+ * Function: pointcloud_import
+ * Add the points of an imported file into the active layer.
+ *
+ * The cloud is scaled so that its largest side has the size set with
+ * <pointcloud_set_options>, and placed on the ground, centered, like the
+ * polygon meshes imports.
+ *
+ * Return:
+ *   0 on success, or -1 in case of error, or if the import was cancelled,
+ *   see <file_format_report_progress>.
+ */
+int pointcloud_import(image_t *image, pointcloud_reader_t *reader);
+
+/*
+ * Function: pointcloud_set_options
+ * Set the options of the point clouds imports.
+ *
+ * Parameters:
+ *   size   - Number of voxels along the largest side of the clouds
+ *            (256 by default).
+ *   mode   - One of the POINTCLOUD_ values (POINTCLOUD_AVERAGE by
+ *            default).
+ */
+void pointcloud_set_options(int size, int mode);
+
+#endif // POINTCLOUD_H
@@ -0,0 +1,372 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "procedural.h"
+
+#include "xxhash.h"
+
+#define N BLOCK_SIZE
+#define PROCEDURAL_CACHE_SIZE (64 * MB)
+
+// Distance from a block center to its corners.
+#define BLOCK_RADIUS (N * 0.8660254f)
+
+// The layer box space.
+typedef struct {
+    float   center[3];
+    float   axes[3][3]; // Normalized.
+    float   s[3];       // Half size, in voxels.
+} frame_t;
+
+// Pager of the blocks crossing the surface of a procedural layer.
+typedef struct {
+    mesh_pager_t    pager;
+    procedural_t    proc;
+    frame_t         frame;
+    uint8_t         color[4];
+    int             (*blocks)[3];   // Position of each page block.
+} proc_pager_t;
+
+static cache_t *g_cache = NULL;
+static pthread_once_t g_cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_init(void)
+{
+    g_cache = cache_create(PROCEDURAL_CACHE_SIZE);
+    cache_register(g_cache, "Procedural");
+}
+
+static int mesh_del(void *data)
+{
+    mesh_delete(data);
+    return 0;
+}
+
+static void frame_init(const float box[4][4], frame_t *frame)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        frame->s[i] = vec3_norm(box[i]);
+        vec3_set(frame->axes[i], 0, 0, 0);
+        if (frame->s[i])
+            vec3_mul(box[i], 1 / frame->s[i], frame->axes[i]);
+    }
+    vec3_copy(box[3], frame->center);
+}
+
+static void frame_to_local(const frame_t *frame, const float p[3],
+                           float out[3])
+{
+    float d[3];
+    vec3_sub(p, frame->center, d);
+    out[0] = vec3_dot(d, frame->axes[0]);
+    out[1] = vec3_dot(d, frame->axes[1]);
+    out[2] = vec3_dot(d, frame->axes[2]);
+}
+
+// Exact signed distance to a box centered at the origin.
+static float box_sdf(const float p[3], const float s[3])
+{
+    float q[3], out[3];
+    int i;
+    for (i = 0; i < 3; i++) {
+        q[i] = fabsf(p[i]) - s[i];
+        out[i] = max(q[i], 0);
+    }
+    return vec3_norm(out) + min(max3(q[0], q[1], q[2]), 0);
+}
+
+// Lower bound of the distance to an ellipsoid.
+static float ellipsoid_sdf(const float p[3], const float s[3])
+{
+    float k = vec3_norm(VEC(p[0] / s[0], p[1] / s[1], p[2] / s[2]));
+    return (k - 1) * min3(s[0], s[1], s[2]);
+}
+
+// Lower bound of the distance to an elliptic cylinder along z.
+static float cylinder_sdf(const float p[3], const float s[3])
+{
+    float dxy, dz;
+    dxy = (vec2_norm(VEC(p[0] / s[0], p[1] / s[1])) - 1) * min(s[0], s[1]);
+    dz = fabsf(p[2]) - s[2];
+    return min(max(dxy, dz), 0) + vec2_norm(VEC(max(dxy, 0), max(dz, 0)));
+}
+
+static float prim_sdf(const procedural_prim_t *prim, const float p[3])
+{
+    float q[3], s[3];
+    int i;
+    for (i = 0; i < 3; i++) {
+        q[i] = p[i] - prim->pos[i];
+        s[i] = max(prim->size[i], 0.5f);
+    }
+    if (prim->shape == &shape_cube) return box_sdf(q, s);
+    if (prim->shape == &shape_cylinder) return cylinder_sdf(q, s);
+    return ellipsoid_sdf(q, s);
+}
+
+static float csg_sdf(const procedural_t *proc, const float p[3],
+                     const float s[3])
+{
+    int i;
+    float d = INFINITY, v;
+    for (i = 0; i < proc->nb_prims; i++) {
+        v = prim_sdf(&proc->prims[i], p);
+        switch (proc->prims[i].op) {
+        case CSG_SUBTRACT:  d = max(d, -v); break;
+        case CSG_INTERSECT: d = max(d, v);  break;
+        default:            d = min(d, v);  break;
+        }
+    }
+    return d;
+}
+
+// Random value in [-1, 1] of a lattice point.
+static float lattice_value(int x, int y, int seed)
+{
+    uint32_t h;
+    h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^
+        (uint32_t)seed * 0xcb1ab31fu;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (h & 0xffffff) / (float)0xffffff * 2 - 1;
+}
+
+static float fade(float t)
+{
+    return t * t * (3 - 2 * t);
+}
+
+// 2d value noise in [-1, 1].  Its gradient is at most 3 sqrt(2), since the
+// fade function derivative is at most 1.5.
+static float value_noise(float x, float y, int seed)
+{
+    int ix = floorf(x), iy = floorf(y);
+    float tx = fade(x - ix), ty = fade(y - iy);
+    float v00, v10, v01, v11;
+    v00 = lattice_value(ix, iy, seed);
+    v10 = lattice_value(ix + 1, iy, seed);
+    v01 = lattice_value(ix, iy + 1, seed);
+    v11 = lattice_value(ix + 1, iy + 1, seed);
+    return mix(mix(v00, v10, tx), mix(v01, v11, tx), ty);
+}
+
+static float terrain_sdf(const procedural_t *proc, const float p[3],
+                         const float s[3])
+{
+    int i;
+    float v = 0, amp = 1, freq, norm = 0, grad = 0, h, k;
+
+    freq = 1 / max(proc->scale, 1);
+    for (i = 0; i < max(proc->octaves, 1); i++) {
+        v += amp * value_noise(p[0] * freq, p[1] * freq, proc->seed + i);
+        grad += amp * freq;
+        norm += amp;
+        amp *= 0.5;
+        freq *= 2;
+    }
+    k = proc->amplitude * s[2];
+    h = s[2] * (2 * proc->height - 1) + k * v / norm;
+    // Divide by the max slope, so that we never overestimate the
+    // distance to the surface.
+    grad = k * 3 * M_SQRT2 * grad / norm;
+    return (p[2] - h) / sqrtf(1 + grad * grad);
+}
+
+const procedural_kernel_t procedural_terrain = {
+    .id     = "terrain",
+    .name   = "Terrain",
+    .sdf    = terrain_sdf,
+};
+
+const procedural_kernel_t procedural_csg = {
+    .id     = "csg",
+    .name   = "CSG",
+    .sdf    = csg_sdf,
+};
+
+static const procedural_kernel_t *KERNELS[] = {
+    &procedural_terrain,
+    &procedural_csg,
+};
+
+const procedural_kernel_t *procedural_get_kernel(const char *id, int idx)
+{
+    int i;
+    if (!id) return (idx >= 0 && idx < ARRAY_SIZE(KERNELS)) ?
+                    KERNELS[idx] : NULL;
+    for (i = 0; i < ARRAY_SIZE(KERNELS); i++) {
+        if (strcmp(KERNELS[i]->id, id) == 0) return KERNELS[i];
+    }
+    return NULL;
+}
+
+procedural_t *procedural_new(const procedural_kernel_t *kernel)
+{
+    procedural_t *proc = calloc(1, sizeof(*proc));
+    proc->kernel = kernel;
+    proc->octaves = 4;
+    proc->scale = 64;
+    proc->height = 0.5;
+    proc->amplitude = 0.5;
+    proc->nb_prims = 2;
+    proc->prims[0] = (procedural_prim_t){
+        .shape = &shape_cube, .op = CSG_UNION,
+        .size = {8, 8, 8},
+    };
+    proc->prims[1] = (procedural_prim_t){
+        .shape = &shape_sphere, .op = CSG_SUBTRACT,
+        .size = {10, 10, 10},
+    };
+    return proc;
+}
+
+procedural_t *procedural_copy(const procedural_t *proc)
+{
+    procedural_t *ret;
+    if (!proc) return NULL;
+    ret = malloc(sizeof(*ret));
+    memcpy(ret, proc, sizeof(*ret));
+    return ret;
+}
+
+uint32_t procedural_get_key(const procedural_t *proc)
+{
+    // Hash the attributes one by one, since the padding bytes of the
+    // primitives can have any value.
+    const procedural_prim_t *prim;
+    uint32_t key;
+    int i;
+
+    key = XXH32(&proc->kernel, sizeof(proc->kernel), 0);
+    key = XXH32(&proc->seed, sizeof(proc->seed), key);
+    key = XXH32(&proc->octaves, sizeof(proc->octaves), key);
+    key = XXH32(&proc->scale, sizeof(proc->scale), key);
+    key = XXH32(&proc->height, sizeof(proc->height), key);
+    key = XXH32(&proc->amplitude, sizeof(proc->amplitude), key);
+    for (i = 0; i < proc->nb_prims; i++) {
+        prim = &proc->prims[i];
+        key = XXH32(&prim->shape, sizeof(prim->shape), key);
+        key = XXH32(&prim->op, sizeof(prim->op), key);
+        key = XXH32(prim->pos, sizeof(prim->pos), key);
+        key = XXH32(prim->size, sizeof(prim->size), key);
+    }
+    return key;
+}
+
+static bool pager_load(mesh_pager_t *pager_, int page, uint8_t *voxels)
+{
+    const proc_pager_t *pager = (proc_pager_t*)pager_;
+    const frame_t *frame = &pager->frame;
+    const int *bpos = pager->blocks[page];
+    int x, y, z;
+    float p[3];
+
+    memset(voxels, 0, N * N * N * 4);
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        frame_to_local(frame, VEC(bpos[0] + x + 0.5,
+                                  bpos[1] + y + 0.5,
+                                  bpos[2] + z + 0.5), p);
+        if (box_sdf(p, frame->s) >= 0) continue;
+        if (pager->proc.kernel->sdf(&pager->proc, p, frame->s) >= 0)
+            continue;
+        memcpy(&voxels[(x + y * N + z * N * N) * 4], pager->color, 4);
+    }
+    return true;
+}
+
+static void pager_release(mesh_pager_t *pager_)
+{
+    proc_pager_t *pager = (proc_pager_t*)pager_;
+    free(pager->blocks);
+    free(pager);
+}
+
+void procedural_apply(const procedural_t *proc, const float box[4][4],
+                      const uint8_t color[4], mesh_t *mesh)
+{
+    struct {
+        uint32_t    proc;
+        float       box[4][4];
+        uint8_t     color[4];
+    } key;
+    float bbox[4][4], p[3], d;
+    int aabb[2][3], bpos[3], i, nb = 0, allocated = 0;
+    mesh_t *cached;
+    proc_pager_t *pager;
+    frame_t frame;
+
+    pthread_once(&g_cache_once, cache_init);
+    memset(&key, 0, sizeof(key));
+    key.proc = procedural_get_key(proc);
+    mat4_copy(box, key.box);
+    memcpy(key.color, color, 4);
+    cache_lock(g_cache);
+    cached = cache_get(g_cache, &key, sizeof(key));
+    if (cached) mesh_set(mesh, cached);
+    cache_unlock(g_cache);
+    if (cached) return;
+
+    mesh_clear(mesh);
+    if (box_is_null(box)) return;
+    frame_init(box, &frame);
+    pager = calloc(1, sizeof(*pager));
+    pager->pager.ref = 1;
+    pager->pager.load = pager_load;
+    pager->pager.release = pager_release;
+    pager->proc = *proc;
+    pager->frame = frame;
+    memcpy(pager->color, color, 4);
+
+    // First list all the blocks crossing the surface, since the pager
+    // blocks array must not change once the mesh uses it.
+    box_get_bbox(box, bbox);
+    bbox_to_aabb(bbox, aabb);
+    for (i = 0; i < 3; i++) aabb[0][i] &= ~(N - 1);
+    for (bpos[2] = aabb[0][2]; bpos[2] < aabb[1][2]; bpos[2] += N)
+    for (bpos[1] = aabb[0][1]; bpos[1] < aabb[1][1]; bpos[1] += N)
+    for (bpos[0] = aabb[0][0]; bpos[0] < aabb[1][0]; bpos[0] += N) {
+        frame_to_local(&frame, VEC(bpos[0] + N / 2.f, bpos[1] + N / 2.f,
+                                   bpos[2] + N / 2.f), p);
+        d = box_sdf(p, frame.s);
+        if (d >= BLOCK_RADIUS) continue;
+        d = max(d, proc->kernel->sdf(proc, p, frame.s));
+        if (d >= BLOCK_RADIUS) continue;
+        if (d <= -BLOCK_RADIUS) {
+            mesh_fill_block(mesh, bpos, color);
+            continue;
+        }
+        if (nb == allocated) {
+            allocated = max(64, allocated * 2);
+            pager->blocks = realloc(pager->blocks,
+                                    allocated * sizeof(*pager->blocks));
+        }
+        memcpy(pager->blocks[nb++], bpos, sizeof(bpos));
+    }
+    for (i = 0; i < nb; i++)
+        mesh_set_block_paged(mesh, pager->blocks[i], &pager->pager, i);
+    mesh_pager_release(&pager->pager);
+
+    cached = mesh_copy(mesh);
+    cache_add(g_cache, &key, sizeof(key), cached, mesh_get_mem(cached),
+              mesh_del);
+}
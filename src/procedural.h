@@ -0,0 +1,167 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Procedural layers
+ *
+ * Layers whose voxels are computed from a signed distance kernel (noise
+ * terrain, CSG of primitives...) instead of being stored.
+ *
+ * The kernel is evaluated in the space of the layer box: positions are in
+ * voxels, relative to the box center and along the box axes.  Only the
+ * blocks crossing the surface are evaluated, and lazily: they are added
+ * to the layer mesh as paged blocks (see <mesh_set_block_paged>), so that
+ * their voxels are only computed the first time they are read, for
+ * example by the renderer for the blocks in view, or by an export.  The
+ * loads happen on the threads reading the mesh, so in parallel when the
+ * blocks are processed by parallel tasks.
+ *
+ * The blocks far from the surface are either skipped or filled at once,
+ * which is why the kernels have to return a distance that is never
+ * larger than the actual distance to the surface.
+ */
+
+#ifndef PROCEDURAL_H
+#define PROCEDURAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mesh.h"
+#include "shape.h"
+
+#define PROCEDURAL_MAX_PRIMS 8
+
+// CSG operations of the primitives.
+enum {
+    CSG_UNION,
+    CSG_SUBTRACT,
+    CSG_INTERSECT,
+};
+
+/*
+ * Type: procedural_prim_t
+ * A primitive of a CSG procedural layer.
+ *
+ * Attributes:
+ *   shape - One of shape_sphere, shape_cube or shape_cylinder.
+ *   op    - CSG operation, applied to the previous primitives.
+ *   pos   - Center, relative to the layer box center, in voxels.
+ *   size  - Half size, in voxels.
+ */
+typedef struct {
+    const shape_t *shape;
+    int     op;
+    float   pos[3];
+    float   size[3];
+} procedural_prim_t;
+
+typedef struct procedural procedural_t;
+
+/*
+ * Type: procedural_kernel_t
+ * A procedural layer distance function.
+ *
+ * Attributes:
+ *   id   - Unique id, used to save the layers.
+ *   name - Name shown in the gui.
+ *   sdf  - Return the signed distance from a point to the surface,
+ *          negative inside.  The point and the box half size are given
+ *          in voxels, in the layer box space.  The value must never be
+ *          larger (in absolute value) than the real distance.  Can be
+ *          called from any thread.
+ */
+typedef struct procedural_kernel {
+    const char *id;
+    const char *name;
+    float (*sdf)(const procedural_t *proc, const float p[3],
+                 const float s[3]);
+} procedural_kernel_t;
+
+/*
+ * Type: procedural_t
+ * Parameters of a procedural layer.
+ *
+ * Attributes:
+ *   kernel    - The distance function.
+ *   seed      - Terrain noise seed.
+ *   octaves   - Number of terrain noise octaves.
+ *   scale     - Size of the largest terrain features, in voxels.
+ *   height    - Mean terrain height, relative to the box height.
+ *   amplitude - Terrain height variation, relative to the box height.
+ *   nb_prims  - Number of CSG primitives.
+ *   prims     - The CSG primitives, applied in order.
+ */
+struct procedural {
+    const procedural_kernel_t *kernel;
+    int     seed;
+    int     octaves;
+    float   scale;
+    float   height;
+    float   amplitude;
+    int     nb_prims;
+    procedural_prim_t prims[PROCEDURAL_MAX_PRIMS];
+};
+
+extern const procedural_kernel_t procedural_terrain;
+extern const procedural_kernel_t procedural_csg;
+
+/*
+ * Function: procedural_get_kernel
+ * Return a builtin kernel from its id, or its index if id is NULL.
+ *
+ * Return NULL if there is no such kernel.
+ */
+const procedural_kernel_t *procedural_get_kernel(const char *id, int idx);
+
+/*
+ * Function: procedural_new
+ * Create new procedural parameters with some default values.
+ */
+procedural_t *procedural_new(const procedural_kernel_t *kernel);
+
+/*
+ * Function: procedural_copy
+ * Create a copy of procedural parameters.
+ */
+procedural_t *procedural_copy(const procedural_t *proc);
+
+/*
+ * Function: procedural_get_key
+ * Return a hash of the procedural parameters.
+ */
+uint32_t procedural_get_key(const procedural_t *proc);
+
+/*
+ * Function: procedural_apply
+ * Set a mesh to the voxels of a procedural layer.
+ *
+ * The previous content of the mesh is replaced.  The blocks crossing the
+ * surface are only evaluated when first read.  The results are cached
+ * per parameters, so that going back to previous values is free.
+ *
+ * Parameters:
+ *   proc  - The procedural parameters.
+ *   box   - The layer box.  Nothing is generated outside of it.
+ *   color - The color of the voxels.
+ *   mesh  - The mesh to set.
+ */
+void procedural_apply(const procedural_t *proc, const float box[4][4],
+                      const uint8_t color[4], mesh_t *mesh);
+
+#endif // PROCEDURAL_H
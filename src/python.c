@@ -0,0 +1,720 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Python module, built instead of the goxel program with 'scons python=1'.
+ *
+ *  import goxel
+ *  img = goxel.Image('model.vox')
+ *  mesh = img.active_layer.mesh
+ *  mesh.op('sphere', (0, 0, 8), (8, 8, 8), color=(255, 0, 0, 255))
+ *  voxels = numpy.asarray(mesh.read((-16, -16, 0), (32, 32, 32)))
+ *  for pos, id, block in mesh.blocks(unique=True):
+ *      ...
+ *  img.export('model.obj')
+ *
+ * The voxels returned by Mesh.read and Mesh.blocks support the buffer
+ * protocol, as uint8 arrays of shape (z, y, x, 4), so that they can be
+ * used directly by numpy.  The blocks stored uncompressed are not copied:
+ * their views point to the block data, kept alive by a copy of the mesh
+ * (the meshes data are copy on write, so modifying the mesh afterward
+ * doesn't change the views).  For this to be safe, the module disables
+ * the blocks paging.
+ */
+
+#if PYTHON
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "goxel.h"
+#include "file_format.h"
+
+// A dense array of voxels, either owned or pointing to a block data.
+typedef struct {
+    PyObject_HEAD
+    uint8_t     *data;
+    bool        owned;
+    bool        readonly;
+    Py_ssize_t  shape[4];
+    Py_ssize_t  strides[4];
+    PyObject    *base;      // Keeps the borrowed data alive.
+} VoxelsObject;
+
+typedef struct {
+    PyObject_HEAD
+    mesh_t      *mesh;
+    PyObject    *owner;     // Layer of the mesh, or NULL if we own it.
+} MeshObject;
+
+typedef struct {
+    PyObject_HEAD
+    layer_t     *layer;
+    PyObject    *image;
+} LayerObject;
+
+typedef struct {
+    PyObject_HEAD
+    image_t     *img;
+} ImageObject;
+
+static PyTypeObject VoxelsType;
+static PyTypeObject MeshType;
+static PyTypeObject LayerType;
+static PyTypeObject ImageType;
+
+static VoxelsObject *voxels_new(const int size[3], uint8_t *data, bool owned,
+                                PyObject *base)
+{
+    VoxelsObject *self;
+    int i;
+
+    self = PyObject_New(VoxelsObject, &VoxelsType);
+    if (!self) return NULL;
+    self->data = data;
+    self->owned = owned;
+    self->readonly = !owned;
+    self->shape[0] = size[2];
+    self->shape[1] = size[1];
+    self->shape[2] = size[0];
+    self->shape[3] = 4;
+    self->strides[3] = 1;
+    for (i = 2; i >= 0; i--)
+        self->strides[i] = self->strides[i + 1] * self->shape[i + 1];
+    self->base = base;
+    Py_XINCREF(base);
+    return self;
+}
+
+static void voxels_dealloc(VoxelsObject *self)
+{
+    if (self->owned) free(self->data);
+    Py_XDECREF(self->base);
+    PyObject_Free(self);
+}
+
+static int voxels_getbuffer(VoxelsObject *self, Py_buffer *view, int flags)
+{
+    if ((flags & PyBUF_WRITABLE) && self->readonly) {
+        PyErr_SetString(PyExc_BufferError, "Block voxels are read only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = (PyObject*)self;
+    view->buf = self->data;
+    view->len = self->shape[0] * self->strides[0];
+    view->readonly = self->readonly;
+    view->itemsize = 1;
+    view->format = (flags & PyBUF_FORMAT) ? "B" : NULL;
+    view->ndim = 4;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    Py_INCREF(self);
+    return 0;
+}
+
+static PyBufferProcs voxels_as_buffer = {
+    .bf_getbuffer = (getbufferproc)voxels_getbuffer,
+};
+
+static PyTypeObject VoxelsType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "goxel.Voxels",
+    .tp_doc = "Dense uint8 array of voxels, of shape (z, y, x, 4)",
+    .tp_basicsize = sizeof(VoxelsObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)voxels_dealloc,
+    .tp_as_buffer = &voxels_as_buffer,
+};
+
+// Parse a sequence of numbers with a PyArg_ParseTuple format.
+static bool parse_seq(PyObject *obj, const char *format, const char *err,
+                      void *a, void *b, void *c, void *d)
+{
+    PyObject *tuple;
+    bool ret;
+
+    tuple = PySequence_Check(obj) ? PySequence_Tuple(obj) : NULL;
+    ret = tuple && PyArg_ParseTuple(tuple, format, a, b, c, d);
+    Py_XDECREF(tuple);
+    if (!ret) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_TypeError, err);
+    }
+    return ret;
+}
+
+static bool parse_vec3(PyObject *obj, float v[3])
+{
+    return parse_seq(obj, "fff", "Expected a sequence of 3 numbers",
+                     &v[0], &v[1], &v[2], NULL);
+}
+
+static bool parse_ivec3(PyObject *obj, int v[3])
+{
+    return parse_seq(obj, "iii", "Expected a sequence of 3 integers",
+                     &v[0], &v[1], &v[2], NULL);
+}
+
+static bool parse_color(PyObject *obj, uint8_t color[4])
+{
+    color[3] = 255;
+    return parse_seq(obj, "bbb|b", "Expected a color of 3 or 4 integers",
+                     &color[0], &color[1], &color[2], &color[3]);
+}
+
+static MeshObject *mesh_object_new(mesh_t *mesh, PyObject *owner)
+{
+    MeshObject *self;
+    self = PyObject_New(MeshObject, &MeshType);
+    if (!self) {
+        if (!owner) mesh_delete(mesh);
+        return NULL;
+    }
+    self->mesh = mesh;
+    self->owner = owner;
+    Py_XINCREF(owner);
+    return self;
+}
+
+static PyObject *mesh_tp_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwds)
+{
+    if (!PyArg_ParseTuple(args, "")) return NULL;
+    return (PyObject*)mesh_object_new(mesh_new(), NULL);
+}
+
+static void mesh_dealloc(MeshObject *self)
+{
+    if (self->owner)
+        Py_DECREF(self->owner);
+    else
+        mesh_delete(self->mesh);
+    PyObject_Free(self);
+}
+
+static PyObject *mesh_py_copy(MeshObject *self, PyObject *args)
+{
+    return (PyObject*)mesh_object_new(mesh_copy(self->mesh), NULL);
+}
+
+static PyObject *mesh_py_clear(MeshObject *self, PyObject *args)
+{
+    mesh_clear(self->mesh);
+    Py_RETURN_NONE;
+}
+
+static PyObject *mesh_py_op(MeshObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"shape", "pos", "size", "color", "mode", NULL};
+    const char *shape;
+    PyObject *pos_obj, *size_obj, *color_obj = NULL;
+    float pos[3], size[3], box[4][4];
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .color = {255, 255, 255, 255},
+    };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sOO|Oi", kwlist, &shape,
+                &pos_obj, &size_obj, &color_obj, &painter.mode))
+        return NULL;
+    if (strcmp(shape, "sphere") == 0) painter.shape = &shape_sphere;
+    if (strcmp(shape, "cube") == 0) painter.shape = &shape_cube;
+    if (strcmp(shape, "cylinder") == 0) painter.shape = &shape_cylinder;
+    if (!painter.shape) {
+        PyErr_Format(PyExc_ValueError, "Unknown shape '%s'", shape);
+        return NULL;
+    }
+    if (!parse_vec3(pos_obj, pos) || !parse_vec3(size_obj, size))
+        return NULL;
+    if (color_obj && !parse_color(color_obj, painter.color))
+        return NULL;
+    bbox_from_extents(box, pos, size[0], size[1], size[2]);
+    mesh_op(self->mesh, &painter, box);
+    Py_RETURN_NONE;
+}
+
+static PyObject *mesh_py_merge(MeshObject *self, PyObject *args,
+                               PyObject *kwds)
+{
+    static char *kwlist[] = {"other", "mode", "color", NULL};
+    MeshObject *other;
+    PyObject *color_obj = NULL;
+    int mode = MODE_OVER;
+    uint8_t color[4];
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|iO", kwlist,
+                &MeshType, &other, &mode, &color_obj))
+        return NULL;
+    if (color_obj && color_obj != Py_None && !parse_color(color_obj, color))
+        return NULL;
+    mesh_merge(self->mesh, other->mesh, mode,
+               (color_obj && color_obj != Py_None) ? color : NULL);
+    Py_RETURN_NONE;
+}
+
+static PyObject *mesh_py_read(MeshObject *self, PyObject *args)
+{
+    PyObject *pos_obj, *size_obj;
+    int pos[3], size[3];
+    uint8_t *data;
+    VoxelsObject *ret;
+
+    if (!PyArg_ParseTuple(args, "OO", &pos_obj, &size_obj)) return NULL;
+    if (!parse_ivec3(pos_obj, pos) || !parse_ivec3(size_obj, size))
+        return NULL;
+    if (size[0] < 0 || size[1] < 0 || size[2] < 0) {
+        PyErr_SetString(PyExc_ValueError, "Negative size");
+        return NULL;
+    }
+    data = malloc(max((size_t)size[0] * size[1] * size[2] * 4, 1));
+    if (!data) return PyErr_NoMemory();
+    mesh_read(self->mesh, pos, size, data);
+    ret = voxels_new(size, data, true, NULL);
+    if (!ret) free(data);
+    return (PyObject*)ret;
+}
+
+static PyObject *mesh_py_write(MeshObject *self, PyObject *args)
+{
+    PyObject *pos_obj, *data_obj;
+    Py_buffer buf;
+    int pos[3], size[3];
+
+    if (!PyArg_ParseTuple(args, "OO", &pos_obj, &data_obj)) return NULL;
+    if (!parse_ivec3(pos_obj, pos)) return NULL;
+    if (PyObject_GetBuffer(data_obj, &buf,
+                           PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+        return NULL;
+    if (    buf.ndim != 4 || buf.shape[3] != 4 || buf.itemsize != 1 ||
+            (buf.format && strcmp(buf.format, "B") != 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Expected an uint8 array of shape (z, y, x, 4)");
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    size[0] = buf.shape[2];
+    size[1] = buf.shape[1];
+    size[2] = buf.shape[0];
+    mesh_write(self->mesh, pos, size, buf.buf);
+    PyBuffer_Release(&buf);
+    Py_RETURN_NONE;
+}
+
+typedef struct {
+    MeshObject  *snapshot;
+    PyObject    *list;
+    bool        error;
+} blocks_ctx_t;
+
+static void blocks_add(void *user, const int pos[3], uint64_t id,
+                       const uint8_t (*voxels)[4])
+{
+    const int N = BLOCK_SIZE;
+    blocks_ctx_t *ctx = user;
+    const mesh_t *mesh = ctx->snapshot->mesh;
+    VoxelsObject *view;
+    PyObject *item;
+    uint8_t *data;
+
+    if (ctx->error) return;
+    // The blocks stored linearly are given directly, the others are
+    // decoded into a temporary buffer that we have to copy.
+    if ((void*)voxels == mesh_get_block_data(mesh, NULL, pos, NULL)) {
+        view = voxels_new((int[]){N, N, N}, (uint8_t*)voxels, false,
+                          (PyObject*)ctx->snapshot);
+    } else {
+        data = malloc(N * N * N * 4);
+        memcpy(data, voxels, N * N * N * 4);
+        view = voxels_new((int[]){N, N, N}, data, true, NULL);
+        if (!view) free(data);
+        else view->readonly = true;
+    }
+    item = view ? Py_BuildValue("(iii)KN", pos[0], pos[1], pos[2],
+                                (unsigned long long)id, view) : NULL;
+    if (!item || PyList_Append(ctx->list, item) != 0) ctx->error = true;
+    Py_XDECREF(item);
+}
+
+static PyObject *mesh_py_blocks(MeshObject *self, PyObject *args,
+                                PyObject *kwds)
+{
+    static char *kwlist[] = {"unique", NULL};
+    int unique = 0;
+    blocks_ctx_t ctx = {};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &unique))
+        return NULL;
+    ctx.list = PyList_New(0);
+    ctx.snapshot = mesh_object_new(mesh_copy(self->mesh), NULL);
+    if (!ctx.list || !ctx.snapshot) goto error;
+    mesh_foreach_block(ctx.snapshot->mesh,
+                       unique ? MESH_FOREACH_UNIQUE : 0, blocks_add, &ctx);
+    if (ctx.error) goto error;
+    Py_DECREF(ctx.snapshot);
+    return ctx.list;
+
+error:
+    Py_XDECREF(ctx.list);
+    Py_XDECREF(ctx.snapshot);
+    return NULL;
+}
+
+static PyObject *mesh_py_get_bbox(MeshObject *self, PyObject *args,
+                                  PyObject *kwds)
+{
+    static char *kwlist[] = {"exact", NULL};
+    int exact = 1;
+    int bbox[2][3];
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &exact))
+        return NULL;
+    if (!mesh_get_bbox(self->mesh, bbox, exact)) Py_RETURN_NONE;
+    return Py_BuildValue("(iii)(iii)", bbox[0][0], bbox[0][1], bbox[0][2],
+                         bbox[1][0], bbox[1][1], bbox[1][2]);
+}
+
+static PyMethodDef mesh_methods[] = {
+    {"copy", (PyCFunction)mesh_py_copy, METH_NOARGS,
+     "Return a copy of the mesh."},
+    {"clear", (PyCFunction)mesh_py_clear, METH_NOARGS,
+     "Remove all the voxels."},
+    {"op", (PyCFunction)mesh_py_op, METH_VARARGS | METH_KEYWORDS,
+     "op(shape, pos, size, color=(255, 255, 255, 255), mode=MODE_OVER)\n"
+     "Paint a 'sphere', 'cube' or 'cylinder' of a given center and half "
+     "size."},
+    {"merge", (PyCFunction)mesh_py_merge, METH_VARARGS | METH_KEYWORDS,
+     "merge(other, mode=MODE_OVER, color=None)\n"
+     "Merge an other mesh into this one."},
+    {"read", (PyCFunction)mesh_py_read, METH_VARARGS,
+     "read(pos, size)\n"
+     "Return the voxels of a box as a (z, y, x, 4) array."},
+    {"write", (PyCFunction)mesh_py_write, METH_VARARGS,
+     "write(pos, data)\n"
+     "Set the voxels of a box from a (z, y, x, 4) uint8 array."},
+    {"blocks", (PyCFunction)mesh_py_blocks, METH_VARARGS | METH_KEYWORDS,
+     "blocks(unique=False)\n"
+     "Return a list of (pos, id, voxels) for all the non empty blocks.  "
+     "With unique set, only return one block per data id."},
+    {"get_bbox", (PyCFunction)mesh_py_get_bbox, METH_VARARGS | METH_KEYWORDS,
+     "get_bbox(exact=True)\n"
+     "Return the voxels bounding box, or None if the mesh is empty."},
+    {}
+};
+
+static PyTypeObject MeshType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "goxel.Mesh",
+    .tp_doc = "Sparse voxels volume",
+    .tp_basicsize = sizeof(MeshObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = mesh_tp_new,
+    .tp_dealloc = (destructor)mesh_dealloc,
+    .tp_methods = mesh_methods,
+};
+
+static LayerObject *layer_object_new(layer_t *layer, PyObject *image)
+{
+    LayerObject *self;
+    self = PyObject_New(LayerObject, &LayerType);
+    if (!self) return NULL;
+    self->layer = layer;
+    self->image = image;
+    Py_INCREF(image);
+    return self;
+}
+
+static void layer_dealloc(LayerObject *self)
+{
+    Py_DECREF(self->image);
+    PyObject_Free(self);
+}
+
+static PyObject *layer_get_name(LayerObject *self, void *closure)
+{
+    return PyUnicode_FromString(self->layer->name);
+}
+
+static int layer_set_name(LayerObject *self, PyObject *value, void *closure)
+{
+    const char *name;
+    if (!value || !(name = PyUnicode_AsUTF8(value))) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "Cannot delete the name");
+        return -1;
+    }
+    snprintf(self->layer->name, sizeof(self->layer->name), "%s", name);
+    return 0;
+}
+
+static PyObject *layer_get_visible(LayerObject *self, void *closure)
+{
+    return PyBool_FromLong(self->layer->visible);
+}
+
+static int layer_set_visible(LayerObject *self, PyObject *value,
+                             void *closure)
+{
+    int v;
+    if (!value || (v = PyObject_IsTrue(value)) < 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "Cannot delete visible");
+        return -1;
+    }
+    self->layer->visible = v;
+    return 0;
+}
+
+static PyObject *layer_get_mesh(LayerObject *self, void *closure)
+{
+    return (PyObject*)mesh_object_new(self->layer->mesh, (PyObject*)self);
+}
+
+static PyGetSetDef layer_getset[] = {
+    {"name", (getter)layer_get_name, (setter)layer_set_name,
+     "Layer name"},
+    {"visible", (getter)layer_get_visible, (setter)layer_set_visible,
+     "Layer visibility"},
+    {"mesh", (getter)layer_get_mesh, NULL,
+     "Layer mesh, modified in place"},
+    {}
+};
+
+static PyTypeObject LayerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "goxel.Layer",
+    .tp_doc = "Layer of an image",
+    .tp_basicsize = sizeof(LayerObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)layer_dealloc,
+    .tp_getset = layer_getset,
+};
+
+static int image_import(image_t *img, const char *path, const char *format)
+{
+    const file_format_t *f;
+
+    if (!format && str_endswith(path, ".gox")) {
+        if (gox_import(img, path) == 0) return 0;
+        PyErr_Format(PyExc_IOError, "Cannot load '%s'", path);
+        return -1;
+    }
+    f = file_format_for_path(format ? NULL : path, format, "r");
+    if (!f) {
+        PyErr_Format(PyExc_ValueError, "No importer for '%s'", path);
+        return -1;
+    }
+    if (f->import_func(img, path) != 0) {
+        PyErr_Format(PyExc_IOError, "Cannot import '%s'", path);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *image_tp_new(PyTypeObject *type, PyObject *args,
+                              PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "format", NULL};
+    const char *path = NULL, *format = NULL;
+    ImageObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zz", kwlist,
+                                     &path, &format))
+        return NULL;
+    self = (ImageObject*)type->tp_alloc(type, 0);
+    if (!self) return NULL;
+    self->img = image_new();
+    if (path && image_import(self->img, path, format) != 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static void image_dealloc(ImageObject *self)
+{
+    image_delete(self->img);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *image_py_import(ImageObject *self, PyObject *args,
+                                 PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "format", NULL};
+    const char *path, *format = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", kwlist,
+                                     &path, &format))
+        return NULL;
+    if (image_import(self->img, path, format) != 0) return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *image_py_export(ImageObject *self, PyObject *args,
+                                 PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "format", NULL};
+    const char *path, *format = NULL;
+    const file_format_t *f;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", kwlist,
+                                     &path, &format))
+        return NULL;
+    if (!format && str_endswith(path, ".gox")) {
+        save_to_file(self->img, path);
+        Py_RETURN_NONE;
+    }
+    f = file_format_for_path(format ? NULL : path, format, "w");
+    if (!f) {
+        PyErr_Format(PyExc_ValueError, "No exporter for '%s'", path);
+        return NULL;
+    }
+    if (f->export_func(self->img, path) != 0) {
+        PyErr_Format(PyExc_IOError, "Cannot export '%s'", path);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *image_py_add_layer(ImageObject *self, PyObject *args)
+{
+    const char *name = NULL;
+    layer_t *layer;
+
+    if (!PyArg_ParseTuple(args, "|z", &name)) return NULL;
+    layer = image_add_layer(self->img, NULL);
+    if (name) snprintf(layer->name, sizeof(layer->name), "%s", name);
+    return (PyObject*)layer_object_new(layer, (PyObject*)self);
+}
+
+static PyObject *image_py_get_layers_mesh(ImageObject *self, PyObject *args)
+{
+    return (PyObject*)mesh_object_new(
+            mesh_copy(image_get_layers_mesh(self->img)), NULL);
+}
+
+static PyObject *image_get_layers(ImageObject *self, void *closure)
+{
+    PyObject *list, *item;
+    layer_t *layer;
+
+    list = PyList_New(0);
+    if (!list) return NULL;
+    DL_FOREACH(self->img->layers, layer) {
+        item = (PyObject*)layer_object_new(layer, (PyObject*)self);
+        if (!item || PyList_Append(list, item) != 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+static PyObject *image_get_active_layer(ImageObject *self, void *closure)
+{
+    if (!self->img->active_layer) Py_RETURN_NONE;
+    return (PyObject*)layer_object_new(self->img->active_layer,
+                                       (PyObject*)self);
+}
+
+static PyMethodDef image_methods[] = {
+    {"import_file", (PyCFunction)image_py_import,
+     METH_VARARGS | METH_KEYWORDS,
+     "import_file(path, format=None)\n"
+     "Import a file into the active layer."},
+    {"export", (PyCFunction)image_py_export, METH_VARARGS | METH_KEYWORDS,
+     "export(path, format=None)\n"
+     "Export the image, with the format guessed from the extension if not "
+     "given."},
+    {"add_layer", (PyCFunction)image_py_add_layer, METH_VARARGS,
+     "add_layer(name=None)\n"
+     "Add a new layer, and make it the active one."},
+    {"get_layers_mesh", (PyCFunction)image_py_get_layers_mesh, METH_NOARGS,
+     "Return a mesh of the merged visible layers."},
+    {}
+};
+
+static PyGetSetDef image_getset[] = {
+    {"layers", (getter)image_get_layers, NULL, "List of the layers"},
+    {"active_layer", (getter)image_get_active_layer, NULL,
+     "The active layer"},
+    {}
+};
+
+static PyTypeObject ImageType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "goxel.Image",
+    .tp_doc = "Image(path=None, format=None)\n"
+              "A goxel image, optionally imported from a file.",
+    .tp_basicsize = sizeof(ImageObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = image_tp_new,
+    .tp_dealloc = (destructor)image_dealloc,
+    .tp_methods = image_methods,
+    .tp_getset = image_getset,
+};
+
+static struct PyModuleDef goxel_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "goxel",
+    .m_doc = "Goxel voxels editing",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_goxel(void)
+{
+    PyObject *m;
+    PyTypeObject *types[] = {&VoxelsType, &MeshType, &LayerType, &ImageType};
+    const char *names[] = {"Voxels", "Mesh", "Layer", "Image"};
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        if (PyType_Ready(types[i]) < 0) return NULL;
+    }
+    m = PyModule_Create(&goxel_module);
+    if (!m) return NULL;
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        Py_INCREF(types[i]);
+        if (PyModule_AddObject(m, names[i], (PyObject*)types[i]) < 0) {
+            Py_DECREF(types[i]);
+            Py_DECREF(m);
+            return NULL;
+        }
+    }
+    PyModule_AddIntConstant(m, "BLOCK_SIZE", BLOCK_SIZE);
+    PyModule_AddIntConstant(m, "MODE_OVER", MODE_OVER);
+    PyModule_AddIntConstant(m, "MODE_SUB", MODE_SUB);
+    PyModule_AddIntConstant(m, "MODE_PAINT", MODE_PAINT);
+    PyModule_AddIntConstant(m, "MODE_MAX", MODE_MAX);
+    PyModule_AddIntConstant(m, "MODE_INTERSECT", MODE_INTERSECT);
+
+    if (!goxel.image) {
+        goxel.headless = true;
+        goxel_init();
+    }
+    // The blocks views point directly to the blocks data, that must not
+    // get paged out.
+    mesh_set_paging(0, NULL);
+    return m;
+}
+
+#endif // PYTHON
@@ -17,59 +17,216 @@
  */
 
 #include "goxel.h"
+#include "utils/parallel.h"
 
+#include <limits.h>
+
+/*
+ * Palette quantization using the median cut algorithm:
+ * https://en.wikipedia.org/wiki/Median_cut
+ *
+ * We first build the histogram of the distinct colors, then we keep
+ * splitting the bucket with the most colors at the weighted median of its
+ * longest channel, until we get the number of colors we want.  The
+ * buckets are ranges of the same array of colors, so a split only
+ * reorders the colors in place.
+ */
+
+// A distinct color and its number of voxels.
 typedef struct {
-    uint8_t c[4];
-    uint32_t n;
+    uint8_t     c[4];
+    uint32_t    n;
 } value_t;
 
-static UT_icd value_icd = {sizeof(value_t), NULL, NULL, NULL};
+// Histogram of the colors, as an open addressing hash table.  The empty
+// slots have a zero count.
+typedef struct {
+    value_t     *slots;
+    int         capacity;
+    int         nb;
+} hist_t;
+
+static void hist_add(hist_t *hist, const uint8_t c[4], uint32_t n);
+
+static void hist_grow(hist_t *hist)
+{
+    value_t *slots = hist->slots;
+    int i, capacity = hist->capacity;
 
+    hist->capacity = max(1024, capacity * 2);
+    hist->slots = calloc(hist->capacity, sizeof(*hist->slots));
+    hist->nb = 0;
+    for (i = 0; i < capacity; i++) {
+        if (slots[i].n) hist_add(hist, slots[i].c, slots[i].n);
+    }
+    free(slots);
+}
+
+static void hist_add(hist_t *hist, const uint8_t c[4], uint32_t n)
+{
+    uint32_t key, i, mask;
+
+    if (hist->nb >= hist->capacity / 2) hist_grow(hist);
+    memcpy(&key, c, 4);
+    mask = hist->capacity - 1;
+    for (i = (key * 2654435761u) & mask;; i = (i + 1) & mask) {
+        if (!hist->slots[i].n) {
+            memcpy(hist->slots[i].c, c, 4);
+            hist->slots[i].n = n;
+            hist->nb++;
+            return;
+        }
+        if (memcmp(hist->slots[i].c, c, 4) == 0) {
+            hist->slots[i].n += n;
+            return;
+        }
+    }
+}
+
+// Move all the values of the histogram at the start of the slots array,
+// and return it.
+static value_t *hist_get_values(hist_t *hist)
+{
+    int i, j;
+    for (i = 0, j = 0; i < hist->capacity; i++) {
+        if (hist->slots[i].n) hist->slots[j++] = hist->slots[i];
+    }
+    return hist->slots;
+}
+
+static int color_cmp(const void *a, const void *b)
+{
+    return cmp(*(const uint32_t*)a, *(const uint32_t*)b);
+}
+
+// Distinct colors of a few blocks of a mesh, computed in parallel.
 typedef struct {
-    UT_array *values;
-} bucket_t;
+    const mesh_t    *mesh;
+    int             (*blocks_pos)[3];
+    int             start;      // Index of the first block of the batch.
+    value_t         **values;   // Distinct colors of each block.
+    int             *nb_values;
+} hist_job_t;
 
-static void bucket_add(bucket_t *b, const uint8_t c[4], int n, bool check)
+static void hist_block(void *user, int i)
 {
-    assert(b->values);
-    int size = utarray_len(b->values);
-    value_t v, *values = (value_t*)utarray_front(b->values);
-    int i;
-
-    assert(n);
-    if (check) {
-        for (i = 0; i < size; i++) {
-            if (memcmp(values[i].c, c, 4) == 0) {
-                values[i].n += n;
-                return;
-            }
+    const int N = BLOCK_SIZE;
+    hist_job_t *job = user;
+    uint8_t (*voxels)[4];
+    uint32_t *colors, c;
+    value_t *values;
+    int j, nb = 0, nb_values = 0;
+
+    voxels = malloc(N * N * N * 4);
+    colors = malloc(N * N * N * sizeof(*colors));
+    mesh_read(job->mesh, job->blocks_pos[job->start + i],
+              (int[]){N, N, N}, (uint8_t*)voxels);
+    for (j = 0; j < N * N * N; j++) {
+        if (voxels[j][3] < 127) continue;
+        voxels[j][3] = 255;
+        memcpy(&colors[nb++], voxels[j], 4);
+    }
+    qsort(colors, nb, sizeof(*colors), color_cmp);
+    values = malloc(max(nb, 1) * sizeof(*values));
+    for (j = 0; j < nb; j++) {
+        c = colors[j];
+        if (nb_values && memcmp(values[nb_values - 1].c, &c, 4) == 0) {
+            values[nb_values - 1].n++;
+            continue;
         }
+        memcpy(values[nb_values].c, &c, 4);
+        values[nb_values++].n = 1;
     }
-    memcpy(v.c, c, 4);
-    v.n = n;
-    utarray_push_back(b->values, &v);
+    job->values[i] = values;
+    job->nb_values[i] = nb_values;
+    free(colors);
+    free(voxels);
 }
 
-static int g_k; // Used in the sorting algo.
-                // qsort_r is not portable!
-static int value_cmp(const void *a_, const void *b_)
+// Number of blocks we process at once, to limit the memory used.
+#define HIST_BATCH 1024
+
+// Compute the histogram of the visible colors of a mesh.
+static void mesh_get_hist(const mesh_t *mesh, hist_t *hist)
 {
-    int k = g_k;
-    const value_t *a = a_;
-    const value_t *b = b_;
-    return cmp(a->c[k], b->c[k]);
+    mesh_iterator_t iter;
+    int i, j, n, start, nb = 0, allocated = 0, bpos[3];
+    hist_job_t job = {mesh};
+
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS | MESH_ITER_SKIP_EMPTY);
+    while (mesh_iter(&iter, bpos)) {
+        if (nb == allocated) {
+            allocated = max(64, allocated * 2);
+            job.blocks_pos = realloc(job.blocks_pos,
+                                     allocated * sizeof(*job.blocks_pos));
+        }
+        memcpy(job.blocks_pos[nb++], bpos, sizeof(bpos));
+    }
+    job.values = calloc(HIST_BATCH, sizeof(*job.values));
+    job.nb_values = calloc(HIST_BATCH, sizeof(*job.nb_values));
+    for (start = 0; start < nb; start += n) {
+        n = min(HIST_BATCH, nb - start);
+        job.start = start;
+        parallel_for(n, hist_block, &job);
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < job.nb_values[i]; j++)
+                hist_add(hist, job.values[i][j].c, job.values[i][j].n);
+            free(job.values[i]);
+        }
+    }
+    free(job.values);
+    free(job.nb_values);
+    free(job.blocks_pos);
 }
 
-// Split a bucket into two new buckets.
-static void bucket_split(const bucket_t *bucket, bucket_t *a, bucket_t *b)
+// A bucket of the median cut, as a range of the values array.
+typedef struct {
+    int start;
+    int end;
+} bucket_t;
+
+// Max heap of the buckets, using their number of distinct colors.
+static void heap_push(bucket_t *heap, int *size, bucket_t b)
+{
+    int i = (*size)++, parent;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap[parent].end - heap[parent].start >= b.end - b.start) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = b;
+}
+
+static bucket_t heap_pop(bucket_t *heap, int *size)
+{
+    bucket_t ret = heap[0], last = heap[--(*size)];
+    int i = 0, child;
+    while ((child = i * 2 + 1) < *size) {
+        if (    child + 1 < *size &&
+                heap[child + 1].end - heap[child + 1].start >
+                heap[child].end - heap[child].start)
+            child++;
+        if (heap[child].end - heap[child].start <= last.end - last.start)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return ret;
+}
+
+// Split a bucket at the weighted median of the channel with the largest
+// range, and return the index of the first value of the second half.  The
+// values are sorted along the channel with a counting sort.
+static int bucket_split(value_t *values, value_t *tmp, bucket_t b)
 {
-    int size = utarray_len(bucket->values);
-    value_t *values = (value_t*)utarray_front(bucket->values);
-    int i, j, k, nb = 0;
+    int i, k, m, pos[257] = {};
     uint8_t min_c[4] = {255, 255, 255, 255};
     uint8_t max_c[4] = {0, 0, 0, 0};
-    // Find the channel with the max range
-    for (i = 0; i < size; i++) {
+    uint64_t nb = 0, acc = 0;
+
+    for (i = b.start; i < b.end; i++) {
         nb += values[i].n;
         for (k = 0; k < 4; k++) {
             min_c[k] = min(min_c[k], values[i].c[k]);
@@ -80,90 +237,151 @@ static void bucket_split(const bucket_t *bucket, bucket_t *a, bucket_t *b)
     for (i = 0; i < 4; i++)
         if (max_c[i] - min_c[i] > max_c[k] - min_c[k])
             k = i;
-    // Sort the values by color.
-    g_k = k;
-    qsort(values, size, sizeof(*values), value_cmp);
-    // Now take the bottom half into the first buket, and the top half into
-    // the second one.
-    utarray_new(a->values, &value_icd);
-    utarray_new(b->values, &value_icd);
-    for (i = 0, j = 0; i < size; i++) {
-        if (j < nb / 2)
-            bucket_add(a, values[i].c, min(values[i].n, nb / 2 - j), false);
-        j += values[i].n;
-        if (j > nb / 2)
-            bucket_add(b, values[i].c, min(values[i].n, j - nb / 2), false);
+
+    for (i = b.start; i < b.end; i++) pos[values[i].c[k] + 1]++;
+    for (i = 0; i < 256; i++) pos[i + 1] += pos[i];
+    for (i = b.start; i < b.end; i++)
+        tmp[pos[values[i].c[k]]++] = values[i];
+    memcpy(values + b.start, tmp, (b.end - b.start) * sizeof(*values));
+
+    for (m = b.start; m < b.end - 1; m++) {
+        acc += values[m].n;
+        if (acc * 2 >= nb) break;
     }
+    return m + 1;
 }
 
-static void bucket_average_color(const bucket_t *b, uint8_t out[4])
+static void bucket_average_color(const value_t *values, bucket_t b,
+                                 uint8_t out[4])
 {
-    int size = utarray_len(b->values);
-    value_t *values = (value_t*)utarray_front(b->values);
-    int s[4] = {}, n = 0, i, k;
-    if (size == 0) {
-        memset(out, 0, 4);
-        return;
-    }
-    for (i = 0; i < size; i++) {
-        assert(values[i].n);
+    uint64_t s[4] = {}, n = 0;
+    int i, k;
+    for (i = b.start; i < b.end; i++) {
         n += values[i].n;
         for (k = 0; k < 4; k++)
-            s[k] += values[i].n * values[i].c[k];
+            s[k] += (uint64_t)values[i].n * values[i].c[k];
     }
-    out[0] = s[0] / n;
-    out[1] = s[1] / n;
-    out[2] = s[2] / n;
-    out[3] = s[3] / n;
+    for (k = 0; k < 4; k++) out[k] = s[k] / n;
 }
 
-static int bucket_cmp(const void *a_, const void *b_)
+// Split the values into nb buckets, and use their average colors as the
+// palette.  If there are less distinct values than colors, the palette
+// colors are repeated.
+static void gen_palette(value_t *values, int nb_values, int nb,
+                        uint8_t (*palette)[4])
 {
-    const bucket_t *a = (void*)a_;
-    const bucket_t *b = (void*)b_;
-    int na = a->values ? utarray_len(a->values) : -1;
-    int nb = b->values ? utarray_len(b->values) : -1;
-    return cmp(nb, na);
+    bucket_t *heap, b;
+    value_t *tmp;
+    int i, m, size = 0;
+
+    if (!nb_values) {
+        memset(palette, 0, nb * sizeof(*palette));
+        return;
+    }
+    heap = malloc(nb * sizeof(*heap));
+    tmp = malloc(nb_values * sizeof(*tmp));
+    heap_push(heap, &size, (bucket_t){0, nb_values});
+    while (size < nb && heap[0].end - heap[0].start > 1) {
+        b = heap_pop(heap, &size);
+        m = bucket_split(values, tmp, b);
+        heap_push(heap, &size, (bucket_t){b.start, m});
+        heap_push(heap, &size, (bucket_t){m, b.end});
+    }
+    for (i = 0; i < size; i++)
+        bucket_average_color(values, heap[i], palette[i]);
+    for (i = size; i < nb; i++)
+        memcpy(palette[i], palette[i % size], 4);
+    free(heap);
+    free(tmp);
 }
 
-// Generate an optimal palette whith a fixed number of colors from a mesh.
-// This is based on https://en.wikipedia.org/wiki/Median_cut.
 void quantization_gen_palette(const mesh_t *mesh, int nb,
                               uint8_t (*palette)[4])
 {
-    uint8_t v[4];
-    int i, pos[3];
-    bucket_t *buckets, b;
-    mesh_iterator_t iter;
+    hist_t hist = {};
+    mesh_get_hist(mesh, &hist);
+    gen_palette(hist_get_values(&hist), hist.nb, nb, palette);
+    free(hist.slots);
+}
 
-    buckets = calloc(nb, sizeof(*buckets));
+void quantization_gen_palette_from_colors(
+        const uint8_t (*colors)[4], const uint32_t *counts, int nb_colors,
+        int nb, uint8_t (*palette)[4])
+{
+    int i, nb_values = 0;
+    value_t *values;
 
-    // Fill the initial bucket.
-    utarray_new(buckets[0].values, &value_icd);
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        bucket_add(&buckets[0], v, 1, true);
+    values = malloc(max(nb_colors, 1) * sizeof(*values));
+    for (i = 0; i < nb_colors; i++) {
+        if (!counts[i]) continue;
+        memcpy(values[nb_values].c, colors[i], 4);
+        values[nb_values++].n = counts[i];
     }
+    gen_palette(values, nb_values, nb, palette);
+    free(values);
+}
+
+// Nearest palette color of each histogram color, computed in parallel.
+typedef struct {
+    const uint8_t   (*colors)[4];
+    int             nb_colors;
+    const uint8_t   (*palette)[4];
+    int             nb;
+    int             *nearest;
+} nearest_job_t;
+
+#define NEAREST_CHUNK 1024
+
+static void nearest_chunk(void *user, int chunk)
+{
+    nearest_job_t *job = user;
+    int i, j, k, d, dist, best;
+    int end = min(job->nb_colors, (chunk + 1) * NEAREST_CHUNK);
 
-    // Split until we get nb buckets.  I do it a bit stupidly, by sorting
-    // the buckets at every iterations!  I should use a stack!
-    while (!buckets[nb - 1].values) {
-        assert(!buckets[nb - 1].values);
-        b = buckets[0];
-        memset(&buckets[0], 0, sizeof(buckets[0]));
-        bucket_split(&b, &buckets[0], &buckets[nb - 1]);
-        utarray_free(b.values);
-        qsort(buckets, nb, sizeof(*buckets), bucket_cmp);
+    for (i = chunk * NEAREST_CHUNK; i < end; i++) {
+        best = 0;
+        dist = INT_MAX;
+        for (j = 0; j < job->nb; j++) {
+            for (k = 0, d = 0; k < 4; k++) {
+                d += (job->colors[i][k] - job->palette[j][k]) *
+                     (job->colors[i][k] - job->palette[j][k]);
+            }
+            if (d < dist) {
+                dist = d;
+                best = j;
+            }
+        }
+        job->nearest[i] = best;
     }
+}
 
-    // Fill the palette colors and cleanup.
-    for (i = 0; i < nb; i++) {
-        assert(buckets[i].values);
-        bucket_average_color(&buckets[i], palette[i]);
-        utarray_free(buckets[i].values);
+void quantization_refine_palette(
+        const uint8_t (*colors)[4], const uint32_t *counts, int nb_colors,
+        int nb, uint8_t (*palette)[4], int iterations)
+{
+    int i, k, iter;
+    uint64_t (*sums)[5];
+    nearest_job_t job = {colors, nb_colors, (const uint8_t (*)[4])palette,
+                         nb};
+
+    job.nearest = malloc(max(nb_colors, 1) * sizeof(*job.nearest));
+    sums = malloc(nb * sizeof(*sums));
+    for (iter = 0; iter < iterations; iter++) {
+        parallel_for((nb_colors + NEAREST_CHUNK - 1) / NEAREST_CHUNK,
+                     nearest_chunk, &job);
+        memset(sums, 0, nb * sizeof(*sums));
+        for (i = 0; i < nb_colors; i++) {
+            for (k = 0; k < 4; k++)
+                sums[job.nearest[i]][k] += (uint64_t)counts[i] * colors[i][k];
+            sums[job.nearest[i]][4] += counts[i];
+        }
+        // The colors that are not used by any voxel are kept as they are.
+        for (i = 0; i < nb; i++) {
+            if (!sums[i][4]) continue;
+            for (k = 0; k < 4; k++)
+                palette[i][k] = (sums[i][k] + sums[i][4] / 2) / sums[i][4];
+        }
     }
-    free(buckets);
+    free(sums);
+    free(job.nearest);
 }
@@ -19,12 +19,56 @@
 
 #include "goxel.h"
 
+#include "brickmap.h"
+#include "gpu_mesher.h"
+#include "gpu_ops.h"
 #include "shader_cache.h"
+#include "utils/frame_tasks.h"
+#include "utils/parallel.h"
+#include "xxhash.h"
+
+#include <pthread.h>
 
 #ifndef RENDER_CACHE_SIZE
 #   define RENDER_CACHE_SIZE (1 * GB)
 #endif
 
+// Set if glDrawElementsBaseVertex can be used (if supported at runtime).
+#if !defined(GLES2) && defined(GL_VERSION_3_2)
+#   define HAS_BASE_VERTEX 1
+#else
+#   define HAS_BASE_VERTEX 0
+#endif
+
+// Set if persistent mapped buffers can be used (if supported at runtime).
+#if !defined(GLES2) && defined(GL_VERSION_4_4)
+#   define HAS_BUFFER_STORAGE 1
+#else
+#   define HAS_BUFFER_STORAGE 0
+#endif
+
+// Set if the quads can be rendered with vertex pulling from a storage
+// buffer of faces (if supported at runtime).
+#if !defined(GLES2) && defined(GL_VERSION_4_3)
+#   define HAS_VERTEX_PULLING 1
+#else
+#   define HAS_VERTEX_PULLING 0
+#endif
+
+// Set if the fence sync objects can be used (if supported at runtime).
+#if defined(GLES3) || (!defined(GLES2) && defined(GL_VERSION_3_2))
+#   define HAS_SYNC 1
+#else
+#   define HAS_SYNC 0
+#endif
+
+// Set if vertex array objects can be used (if supported at runtime).
+#if defined(GLES3) || (!defined(GLES2) && defined(GL_VERSION_3_0))
+#   define HAS_VAO 1
+#else
+#   define HAS_VAO 0
+#endif
+
 /*
  * The rendering is delayed from the time we call the different render
  * functions.  This allows to call `render_xxx` anywhere in the code, without
@@ -48,6 +92,8 @@ enum {
 typedef struct {
     uint64_t ids[27];
     int effects;
+    int lod;        // Level of detail, see mesh_generate_vertices_lod.
+    int faces;      // Set for the vertex pulling items.
 } block_item_key_t;
 
 struct render_item_t
@@ -61,6 +107,7 @@ struct render_item_t
         float           mat[4][4];
     };
     material_t      material;
+    float           model[4][4];    // Model matrix of the mesh items.
     uint8_t         color[4];
     float           clip_box[4][4];
     bool            proj_screen; // Render with a 2d proj.
@@ -69,6 +116,13 @@ struct render_item_t
     int             effects;
 
     GLuint      vertex_buffer;
+    GLuint      index_buffer;   // For the indexed triangles, or 0.
+    GLuint      vao;            // Vertex array of the buffers, or 0.
+    int         arena;          // Index + 1 of the shared buffer, or 0.
+    int         base_vertex;    // Offset of the vertices in the buffer.
+    bool        packed;         // Use voxel_packed_vertex_t vertices.
+    bool        faces;          // vertex_buffer is a voxel_face_t storage
+                                // buffer, used with vertex pulling.
     int         size;           // 4 (quads) or 3 (triangles).
     int         nb_elements;    // Number of quads or triangle.
     int         subdivide;      // Unit per voxel (usually 1).
@@ -79,10 +133,14 @@ struct render_item_t
 
 // The cache of the g_items.
 static cache_t   *g_items_cache;
+static int       g_items_cache_budget = RENDER_CACHE_SIZE;
 static const int BATCH_QUAD_COUNT = 1 << 14;
 static model3d_t *g_cube_model;
 static model3d_t *g_line_model;
 static model3d_t *g_wire_cube_model;
+// Merged vertices of the overlay items, see overlay_flush.
+static model3d_t *g_overlay_model;
+static int       g_overlay_capacity;
 static model3d_t *g_sphere_model;
 static model3d_t *g_grid_model;
 static model3d_t *g_rect_model;
@@ -90,12 +148,17 @@ static model3d_t *g_wire_rect_model;
 
 static GLuint g_index_buffer;
 static GLuint g_background_array_buffer;
+static GLuint g_bricks_box_buffer;
 static GLuint g_occlusion_tex;
 static GLuint g_bump_tex;
 static GLuint g_shadow_map_fbo;
 static texture_t *g_shadow_map; // XXX: the fbo should be part of the tex.
+// Key of the last rendered shadow map, or zero, and its matrix.
+static uint32_t g_shadow_map_key = 0;
+static float g_shadow_map_mvp[4][4];
 
 #define OFFSET(n) offsetof(voxel_vertex_t, n)
+#define POFFSET(n) offsetof(voxel_packed_vertex_t, n)
 
 enum {
     A_POS_LOC = 0,
@@ -107,15 +170,18 @@ enum {
     A_UV_LOC,
     A_BUMP_UV_LOC,
     A_OCCLUSION_UV_LOC,
+    A_FACE_DATA_LOC,
 };
 
-// The list of all the attributes used by the shaders.
-static const struct {
+typedef struct {
     int size;
     int type;
     int norm;
     int offset;
-} ATTRIBUTES[] = {
+} attribute_t;
+
+// The list of all the attributes used by the shaders.
+static const attribute_t ATTRIBUTES[] = {
     [A_POS_LOC] = {3, GL_UNSIGNED_BYTE, false, OFFSET(pos)},
     [A_NORMAL_LOC] = { 3, GL_BYTE, false, OFFSET(normal)},
     [A_TANGENT_LOC] = {3, GL_BYTE, false, OFFSET(tangent)},
@@ -127,6 +193,23 @@ static const struct {
     [A_OCCLUSION_UV_LOC] = {2, GL_UNSIGNED_BYTE, false, OFFSET(occlusion_uv)},
 };
 
+// The attributes of the packed vertices, as used by the PACKED_VERTICES
+// version of the shaders.  Entries with a zero size are not used.
+static const attribute_t PACKED_ATTRIBUTES[] = {
+    [A_POS_LOC] = {3, GL_UNSIGNED_BYTE, false, POFFSET(pos)},
+    [A_GRADIENT_LOC] = {3, GL_BYTE, false, POFFSET(gradient)},
+    [A_COLOR_LOC] = {3, GL_UNSIGNED_BYTE, true, POFFSET(color)},
+    [A_FACE_DATA_LOC] = {3, GL_UNSIGNED_BYTE, false, POFFSET(face)},
+};
+
+// Return the attributes of a given vertex format.
+static const attribute_t *get_attributes(bool packed, int *nb, int *stride)
+{
+    *nb = packed ? ARRAY_SIZE(PACKED_ATTRIBUTES) : ARRAY_SIZE(ATTRIBUTES);
+    *stride = packed ? sizeof(voxel_packed_vertex_t) : sizeof(voxel_vertex_t);
+    return packed ? PACKED_ATTRIBUTES : ATTRIBUTES;
+}
+
 static const char *ATTR_NAMES[] = {
     [A_POS_LOC] = "a_pos",
     [A_NORMAL_LOC] = "a_normal",
@@ -137,6 +220,7 @@ static const char *ATTR_NAMES[] = {
     [A_UV_LOC] = "a_uv",
     [A_BUMP_UV_LOC] = "a_bump_uv",
     [A_OCCLUSION_UV_LOC] = "a_occlusion_uv",
+    [A_FACE_DATA_LOC] = "a_face_data",
     NULL,
 };
 
@@ -298,6 +382,8 @@ static void shader_init(gl_shader_t *shader)
     gl_update_uniform(shader, "u_shadow_tex", 2);
 }
 
+static void arenas_init(void);
+
 void render_init()
 {
     // 6 vertices (2 triangles) per face.
@@ -329,8 +415,8 @@ void render_init()
     init_occlusion_texture();
     init_bump_texture();
 
-    // XXX: pick the proper memory size according to what is available.
-    g_items_cache = cache_create(RENDER_CACHE_SIZE);
+    g_items_cache = cache_create(g_items_cache_budget);
+    cache_set_mem_tag(g_items_cache, MEM_RENDER_CACHE);
     g_cube_model = model3d_cube();
     g_line_model = model3d_line();
     g_wire_cube_model = model3d_wire_cube();
@@ -338,11 +424,39 @@ void render_init()
     g_grid_model = model3d_grid(8, 8);
     g_rect_model = model3d_rect();
     g_wire_rect_model = model3d_wire_rect();
+    g_overlay_model = calloc(1, sizeof(*g_overlay_model));
+    g_overlay_model->stream = true;
+    arenas_init();
 }
 
+static void mesh_jobs_cleanup(bool all);
+static void uploads_stop(void);
+static void occlusions_cleanup(bool all);
+static void overdraw_release(void);
+static void arenas_release(void);
+
 void render_deinit(void)
 {
+    mesh_jobs_cleanup(true);
+    uploads_stop();
+    occlusions_cleanup(true);
+    overdraw_release();
     cache_delete(g_items_cache);
+    arenas_release();
+    gpu_mesher_release();
+    gpu_ops_release();
+    brickmap_release();
+    if (g_bricks_box_buffer) {
+        GL(glDeleteBuffers(1, &g_bricks_box_buffer));
+        g_bricks_box_buffer = 0;
+    }
+    if (g_shadow_map_fbo) {
+        GL(glDeleteFramebuffers(1, &g_shadow_map_fbo));
+        texture_delete(g_shadow_map);
+        g_shadow_map_fbo = 0;
+        g_shadow_map = NULL;
+        g_shadow_map_key = 0;
+    }
     GL(glDeleteBuffers(1, &g_index_buffer));
     g_index_buffer = 0;
     model3d_delete(g_cube_model);
@@ -354,32 +468,849 @@ void render_deinit(void)
     model3d_delete(g_wire_rect_model);
 }
 
-// A global buffer large enough to contain all the vertices for any block.
+// Global buffers large enough to contain all the vertices for any block.
 static voxel_vertex_t* g_vertices_buffer = NULL;
+static voxel_packed_vertex_t* g_packed_vertices_buffer = NULL;
+static uint16_t *g_triangles_indices_buffer = NULL;
+#define VERTICES_BUFFER_SIZE (BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4)
+
+/*
+ * Blocks meshing jobs.
+ *
+ * When a renderer is async and we already spent too much time meshing
+ * blocks in the current frame, the missing blocks are meshed in background
+ * tasks on a snapshot of the mesh.  Once a job is done, the render thread
+ * only has to upload the vertices, or with the background uploads, to
+ * swap in the buffers created by the upload thread.  The jobs are indexed
+ * by their item key, and deleted if they are not needed anymore.
+ */
+typedef struct mesh_job {
+    UT_hash_handle  hh;
+    block_item_key_t key;
+    mesh_t          *mesh;
+    int             pos[3];
+    int             effects;
+    task_t          *task;
+    int             frame;          // Last frame the job was needed.
+
+    // Set by the task.
+    void            *vertices;      // voxel_vertex_t or packed vertices.
+    uint16_t        *indices;       // Triangles indices, or NULL.
+    int             nb_vertices;
+    int             nb_elements;
+    int             size;
+    int             subdivide;
+
+    // Background upload of the item, see the uploads section.
+    int             upload;         // UPLOAD_ state, guarded by the lock.
+    struct mesh_job *upload_next;   // In the uploads queue.
+    render_item_t   *item;          // Not in the cache until it is ready.
+    int             cost;
+    GLsync          fence;          // Zero if the upload failed.
+} mesh_job_t;
+
+static mesh_job_t *g_mesh_jobs = NULL;
+static int g_frame = 0; // Incremented at each render_submit.
+// Number of frames we keep a job that is not needed anymore.
+static const int MESH_JOB_KEEP_FRAMES = 4;
+
+/*
+ * Shared vertex buffers (arenas) for the packed items.
+ *
+ * If glDrawElementsBaseVertex is available, the packed vertices of all the
+ * blocks are sub-allocated from a few large buffers.  This way we only
+ * bind a buffer and set the attributes pointers when the buffer changes,
+ * and each block is a single draw call with a base vertex.  The free space
+ * of each buffer is kept as a sorted list of ranges, allocated by slabs
+ * of ARENA_SLAB vertices to limit the fragmentation.
+ *
+ * With GL 4.4, the buffers are persistently mapped and we write the
+ * vertices directly into them.  Since the GPU could still be reading a
+ * freed range, the ranges are only put back into the free lists once a
+ * fence inserted after the frame that freed them is signaled.
+ */
+typedef struct {
+    int start;
+    int size;
+} range_t;
+
+typedef struct {
+    GLuint  buffer;
+    GLuint  vao;        // Vertex array of the buffer, or 0.
+    void    *data;      // Persistent mapping, or NULL.
+    range_t *free;      // Sorted free ranges.
+    int     nb_free;
+} arena_t;
+
+// A range waiting for the GPU to be done with it.
+typedef struct {
+    int     arena;
+    range_t range;
+    GLsync  fence;      // Zero until the end of the frame.
+} pending_free_t;
+
+static const int ARENA_SIZE = 1 << 20; // In vertices.
+static const int ARENA_SLAB = 64; // In vertices.
+static bool g_use_arenas = false;
+static bool g_use_persistent_arenas = false;
+static arena_t *g_arenas = NULL;
+static int g_nb_arenas = 0;
+static pending_free_t *g_pending_frees = NULL;
+static int g_nb_pending_frees = 0;
+
+/*
+ * With GL3 and GLES3 (WebGL2) we keep the attributes of each vertex buffer
+ * in a vertex array object, so that drawing a block only needs to bind it,
+ * instead of setting all the attributes pointers.  This matters mostly
+ * without the arenas (GLES3), where each block has its own buffers.
+ */
+static bool g_use_vao = false;
+
+/*
+ * With GL 4.3 the quads can also be uploaded as one voxel_face_t per quad
+ * in a storage buffer, that the mesh shader expands from gl_VertexID.
+ * This uses 8 bytes per quad instead of 48 for the packed vertices.
+ */
+static bool g_use_vertex_pulling = false;
+
+// Set if the fence sync objects are supported, needed for the background
+// uploads.
+static bool g_use_sync = false;
+
+// Create the vertex array of a vertex buffer, or return 0 if we don't use
+// them.  index_buffer is the element buffer to use with it.
+static GLuint vao_create(GLuint buffer, GLuint index_buffer, bool packed)
+{
+    GLuint vao = 0;
+#if HAS_VAO
+    int attr, nb_attrs, stride;
+    const attribute_t *attrs;
+
+    if (!g_use_vao) return 0;
+    GL(glGenVertexArrays(1, &vao));
+    GL(glBindVertexArray(vao));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, buffer));
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer));
+    attrs = get_attributes(packed, &nb_attrs, &stride);
+    for (attr = 0; attr < nb_attrs; attr++) {
+        if (!attrs[attr].size) continue;
+        GL(glEnableVertexAttribArray(attr));
+        GL(glVertexAttribPointer(attr,
+                                 attrs[attr].size,
+                                 attrs[attr].type,
+                                 attrs[attr].norm,
+                                 stride,
+                                 (void*)(intptr_t)attrs[attr].offset));
+    }
+    GL(glBindVertexArray(0));
+#endif
+    return vao;
+}
+
+static void vao_delete(GLuint vao)
+{
+#if HAS_VAO
+    if (vao) GL(glDeleteVertexArrays(1, &vao));
+#endif
+}
+
+static void vao_bind(GLuint vao)
+{
+#if HAS_VAO
+    GL(glBindVertexArray(vao));
+#endif
+}
+
+// Size really allocated for n vertices.
+static int arena_get_alloc_size(int n)
+{
+    return (n + ARENA_SLAB - 1) / ARENA_SLAB * ARENA_SLAB;
+}
+
+static void arena_create_buffer(arena_t *arena)
+{
+    const int size = ARENA_SIZE * sizeof(voxel_packed_vertex_t);
+    GL(glGenBuffers(1, &arena->buffer));
+    counter_add(COUNTER_GL_BUFFERS_CREATED, 1);
+    GL(glBindBuffer(GL_ARRAY_BUFFER, arena->buffer));
+#if HAS_BUFFER_STORAGE
+    if (g_use_persistent_arenas) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                                 GL_MAP_COHERENT_BIT;
+        GL(glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags));
+        GL(arena->data = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+        return;
+    }
+#endif
+    GL(glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STATIC_DRAW));
+}
+
+// Allocate n vertices in one of the arenas, return the arena index + 1.
+static int arena_alloc(int n, int *start)
+{
+    int a, i;
+    arena_t *arena;
+
+    n = arena_get_alloc_size(n);
+    for (a = 0; a < g_nb_arenas; a++) {
+        arena = &g_arenas[a];
+        for (i = 0; i < arena->nb_free; i++) {
+            if (arena->free[i].size < n) continue;
+            *start = arena->free[i].start;
+            arena->free[i].start += n;
+            arena->free[i].size -= n;
+            if (!arena->free[i].size) {
+                arena->nb_free--;
+                memmove(&arena->free[i], &arena->free[i + 1],
+                        (arena->nb_free - i) * sizeof(*arena->free));
+            }
+            return a + 1;
+        }
+    }
+
+    // No space left, create a new arena.
+    g_arenas = realloc(g_arenas, (g_nb_arenas + 1) * sizeof(*g_arenas));
+    arena = &g_arenas[g_nb_arenas++];
+    *arena = (arena_t){};
+    arena_create_buffer(arena);
+    arena->vao = vao_create(arena->buffer, g_index_buffer, true);
+    arena->free = malloc(sizeof(*arena->free));
+    arena->free[0] = (range_t){n, ARENA_SIZE - n};
+    arena->nb_free = 1;
+    *start = 0;
+    return g_nb_arenas;
+}
+
+static void arena_free(int a, int start, int n)
+{
+    arena_t *arena = &g_arenas[a - 1];
+    int i;
+
+    n = arena_get_alloc_size(n);
+    // Find where to insert the range, and merge it with its neighbors.
+    for (i = 0; i < arena->nb_free; i++) {
+        if (arena->free[i].start > start) break;
+    }
+    if (i > 0 && arena->free[i - 1].start + arena->free[i - 1].size == start) {
+        arena->free[i - 1].size += n;
+        if (i < arena->nb_free && start + n == arena->free[i].start) {
+            arena->free[i - 1].size += arena->free[i].size;
+            arena->nb_free--;
+            memmove(&arena->free[i], &arena->free[i + 1],
+                    (arena->nb_free - i) * sizeof(*arena->free));
+        }
+        return;
+    }
+    if (i < arena->nb_free && start + n == arena->free[i].start) {
+        arena->free[i].start = start;
+        arena->free[i].size += n;
+        return;
+    }
+    arena->free = realloc(arena->free,
+                          (arena->nb_free + 1) * sizeof(*arena->free));
+    memmove(&arena->free[i + 1], &arena->free[i],
+            (arena->nb_free - i) * sizeof(*arena->free));
+    arena->free[i] = (range_t){start, n};
+    arena->nb_free++;
+}
+
+// Free a range used by an item.  With persistent mapping we have to wait
+// for the GPU to be done with it before we can reuse it.
+static void arena_release_range(int a, int start, int n)
+{
+    if (!g_use_persistent_arenas) {
+        arena_free(a, start, n);
+        return;
+    }
+    g_pending_frees = realloc(g_pending_frees,
+            (g_nb_pending_frees + 1) * sizeof(*g_pending_frees));
+    g_pending_frees[g_nb_pending_frees++] = (pending_free_t){
+        .arena = a, .range = {start, n}};
+}
+
+// Called at the end of each frame to put the fence on the ranges freed
+// during the frame, and to free the ranges the GPU is done with.
+static void arenas_flush(void)
+{
+#if HAS_BUFFER_STORAGE
+    int i, nb;
+    GLsync fence = 0;
+    GLenum status;
+
+    if (!g_nb_pending_frees) return;
+    if (!g_pending_frees[g_nb_pending_frees - 1].fence) {
+        GL(fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+        for (i = g_nb_pending_frees - 1; i >= 0; i--) {
+            if (g_pending_frees[i].fence) break;
+            g_pending_frees[i].fence = fence;
+        }
+    }
+    // The ranges are sorted by fence, so we stop at the first fence not
+    // signaled yet.
+    for (nb = 0; nb < g_nb_pending_frees; nb = i) {
+        fence = g_pending_frees[nb].fence;
+        GL(status = glClientWaitSync(fence, 0, 0));
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        for (i = nb; i < g_nb_pending_frees; i++) {
+            if (g_pending_frees[i].fence != fence) break;
+            arena_free(g_pending_frees[i].arena,
+                       g_pending_frees[i].range.start,
+                       g_pending_frees[i].range.size);
+        }
+        GL(glDeleteSync(fence));
+    }
+    g_nb_pending_frees -= nb;
+    memmove(g_pending_frees, g_pending_frees + nb,
+            g_nb_pending_frees * sizeof(*g_pending_frees));
+#endif
+}
+
+static void arenas_init(void)
+{
+    int major = 0, minor = 0;
+    const char *version;
+    bool es = false;
+    // We also check for the vertex arrays here, since they use the version.
+    GL(version = (const char*)glGetString(GL_VERSION));
+    if (version && strncmp(version, "OpenGL ES ", 10) == 0) {
+        version += 10;
+        es = true;
+    }
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    g_use_vao = HAS_VAO && (major >= 3 ||
+                            gl_has_extension("GL_ARB_vertex_array_object"));
+    g_use_vertex_pulling = HAS_VERTEX_PULLING &&
+                           (major > 4 || (major == 4 && minor >= 3));
+    g_use_sync = HAS_SYNC && (es ? major >= 3 :
+                              (major > 3 || (major == 3 && minor >= 2)));
+    if (!HAS_BASE_VERTEX) return;
+    g_use_arenas = major > 3 || (major == 3 && minor >= 2) ||
+                   gl_has_extension("GL_ARB_draw_elements_base_vertex");
+    g_use_persistent_arenas = HAS_BUFFER_STORAGE && g_use_arenas &&
+        (major > 4 || (major == 4 && minor >= 4) ||
+         gl_has_extension("GL_ARB_buffer_storage"));
+}
+
+static void arenas_release(void)
+{
+    int a;
+#if HAS_BUFFER_STORAGE
+    int i;
+    GL(glFinish());
+    for (i = 0; i < g_nb_pending_frees; i++) {
+        if (i && g_pending_frees[i].fence == g_pending_frees[i - 1].fence)
+            continue;
+        if (g_pending_frees[i].fence)
+            GL(glDeleteSync(g_pending_frees[i].fence));
+    }
+#endif
+    free(g_pending_frees);
+    g_pending_frees = NULL;
+    g_nb_pending_frees = 0;
+    for (a = 0; a < g_nb_arenas; a++) {
+        if (g_arenas[a].data) {
+            GL(glBindBuffer(GL_ARRAY_BUFFER, g_arenas[a].buffer));
+            GL(glUnmapBuffer(GL_ARRAY_BUFFER));
+        }
+        GL(glDeleteBuffers(1, &g_arenas[a].buffer));
+        counter_add(COUNTER_GL_BUFFERS_DELETED, 1);
+        vao_delete(g_arenas[a].vao);
+        free(g_arenas[a].free);
+    }
+    free(g_arenas);
+    g_arenas = NULL;
+    g_nb_arenas = 0;
+}
 
 // Used for the cache.
 static int item_delete(void *item_)
 {
     render_item_t *item = item_;
-    GL(glDeleteBuffers(1, &item->vertex_buffer));
+    if (item->arena) {
+        arena_release_range(item->arena, item->base_vertex,
+                            item->nb_elements * item->size);
+    } else if (item->vertex_buffer) {
+        GL(glDeleteBuffers(1, &item->vertex_buffer));
+        counter_add(COUNTER_GL_BUFFERS_DELETED, 1);
+        vao_delete(item->vao);
+    }
+    if (item->index_buffer) {
+        GL(glDeleteBuffers(1, &item->index_buffer));
+        counter_add(COUNTER_GL_BUFFERS_DELETED, 1);
+    }
     free(item);
     return 0;
 }
 
-static render_item_t *get_item_for_block(
-        const mesh_t *mesh,
-        mesh_iterator_t *iter,
-        const int block_pos[3],
-        int effects, float smoothness)
+/*
+ * Merge the shared vertices of the triangles of a block.  Return the
+ * number of vertices, or -1 if they can't be indexed, in which case the
+ * triangles are rendered without indices.
+ */
+static int index_triangles(voxel_vertex_t *verts, int nb_triangles,
+                           uint16_t *indices)
+{
+    if (!nb_triangles) return -1;
+    return mesh_index_vertices(verts, nb_triangles * 3, indices);
+}
+
+/*
+ * Copy the vertices of a block from the shared tessellation cache.  We need
+ * a copy since the packing and indexing modify the buffer.
+ */
+static int get_block_vertices(const mesh_t *mesh, const int pos[3],
+                              int effects, int lod, voxel_vertex_t *out,
+                              int *size, int *subdivide)
+{
+    mesh_vertices_t *v;
+    int nb;
+
+    counter_add(COUNTER_BLOCKS_MESHED, 1);
+    v = mesh_get_vertices(mesh, pos, effects, lod);
+    memcpy(out, v->verts, v->nb * v->size * sizeof(*out));
+    nb = v->nb;
+    *size = v->size;
+    *subdivide = v->subdivide;
+    mesh_vertices_release(v);
+    return nb;
+}
+
+static void mesh_job_func(void *user)
+{
+    mesh_job_t *job = user;
+    voxel_vertex_t *verts;
+    int nb;
+
+    verts = malloc(VERTICES_BUFFER_SIZE * sizeof(*verts));
+    job->nb_elements = get_block_vertices(
+            job->mesh, job->pos, job->effects, job->key.lod, verts,
+            &job->size, &job->subdivide);
+    nb = max(1, job->nb_elements) * job->size;
+    if (job->size == 4) {
+        job->vertices = malloc(nb * sizeof(voxel_packed_vertex_t));
+        mesh_pack_vertices(verts, nb, job->vertices);
+        free(verts);
+    } else {
+        job->indices = malloc(nb * sizeof(*job->indices));
+        job->nb_vertices = index_triangles(verts, job->nb_elements,
+                                           job->indices);
+        if (job->nb_vertices < 0) {
+            free(job->indices);
+            job->indices = NULL;
+            job->nb_vertices = nb;
+        }
+        job->vertices = realloc(verts, job->nb_vertices * sizeof(*verts));
+    }
+}
+
+static void upload_cancel(mesh_job_t *job);
+
+static void mesh_job_delete(mesh_job_t *job)
+{
+    upload_cancel(job);
+    HASH_DEL(g_mesh_jobs, job);
+    task_delete(job->task);
+    mesh_delete(job->mesh);
+    free(job->vertices);
+    free(job->indices);
+    free(job);
+}
+
+// Delete all the jobs that have not been needed for a few frames.
+static void mesh_jobs_cleanup(bool all)
+{
+    mesh_job_t *job, *tmp;
+    HASH_ITER(hh, g_mesh_jobs, job, tmp) {
+        if (all || g_frame - job->frame > MESH_JOB_KEEP_FRAMES)
+            mesh_job_delete(job);
+    }
+}
+
+/*
+ * Create a new render item for a block, without its buffers.  The quads
+ * vertices are packed, and the triangles vertices are voxel_vertex_t.
+ */
+static render_item_t *item_new(const block_item_key_t *key,
+                               int nb_elements, int size, int subdivide)
+{
+    render_item_t *item;
+    item = calloc(1, sizeof(*item));
+    item->key = *key;
+    item->nb_elements = nb_elements;
+    item->size = size;
+    item->subdivide = subdivide;
+    item->packed = size == 4;
+    if (item->nb_elements > BATCH_QUAD_COUNT) {
+        LOG_W("Too many quads!");
+        item->nb_elements = BATCH_QUAD_COUNT;
+    }
+    item->faces = HAS_VERTEX_PULLING && key->faces && item->packed &&
+                  item->nb_elements;
+    return item;
+}
+
+// Test if an item gets its own buffers, that is if it is not empty and
+// doesn't use the arenas.
+static bool item_has_own_buffers(const render_item_t *item)
+{
+    return item->nb_elements &&
+           (item->faces || !(item->packed && g_use_arenas));
+}
+
+/*
+ * Create the buffers of a new item and upload its vertices.  The triangles
+ * can be indexed, in which case there are nb_vertices of them.  If the
+ * vertices are NULL, the quads are copied from the output of the GPU
+ * mesher, which is only used with the arenas.
+ *
+ * With background set, we are called from the upload thread, and the item
+ * must have its own buffers.  In that case we bind them to
+ * GL_COPY_WRITE_BUFFER, so that we don't change the vertex array state.
+ *
+ * Return the cache cost of the item.
+ */
+static int item_upload(render_item_t *item, const void *vertices,
+                       const uint16_t *indices, int nb_vertices,
+                       bool background)
+{
+    int vertex_size, cost;
+    arena_t *arena;
+    voxel_face_t *faces;
+    GLenum array_target = GL_ARRAY_BUFFER;
+    GLenum index_target = GL_ELEMENT_ARRAY_BUFFER;
+
+    assert(!background || item_has_own_buffers(item));
+#if HAS_SYNC
+    if (background) array_target = index_target = GL_COPY_WRITE_BUFFER;
+#endif
+    vertex_size = item->packed ? sizeof(voxel_packed_vertex_t) :
+                                 sizeof(voxel_vertex_t);
+    cost = item->nb_elements * item->size * vertex_size;
+    if (item->faces) {
+        faces = malloc(item->nb_elements * sizeof(*faces));
+        mesh_pack_faces(vertices, item->nb_elements, faces);
+        cost = item->nb_elements * sizeof(*faces);
+        GL(glGenBuffers(1, &item->vertex_buffer));
+#if HAS_VERTEX_PULLING
+        if (!background) array_target = GL_SHADER_STORAGE_BUFFER;
+        GL(glBindBuffer(array_target, item->vertex_buffer));
+        GL(glBufferData(array_target, cost, faces, GL_STATIC_DRAW));
+#endif
+        free(faces);
+        counter_add(COUNTER_GL_BUFFERS_CREATED, 1);
+        counter_add(COUNTER_GL_UPLOAD_BYTES, cost);
+    } else if (item->packed && g_use_arenas && item->nb_elements) {
+        item->arena = arena_alloc(item->nb_elements * item->size,
+                                  &item->base_vertex);
+        arena = &g_arenas[item->arena - 1];
+        item->vertex_buffer = arena->buffer;
+        item->vao = arena->vao;
+        if (!vertices) {
+            gpu_mesher_copy(arena->buffer, item->base_vertex * vertex_size,
+                            item->nb_elements);
+        } else if (arena->data) {
+            memcpy((voxel_packed_vertex_t*)arena->data + item->base_vertex,
+                   vertices, cost);
+        } else {
+            GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
+            GL(glBufferSubData(GL_ARRAY_BUFFER,
+                    item->base_vertex * vertex_size, cost, vertices));
+        }
+        if (vertices) counter_add(COUNTER_GL_UPLOAD_BYTES, cost);
+        // The cache cost is the memory really used in the arena.
+        cost = arena_get_alloc_size(item->nb_elements * item->size) *
+               vertex_size;
+    } else if (item->nb_elements != 0 && indices) {
+        cost = nb_vertices * vertex_size;
+        GL(glGenBuffers(1, &item->vertex_buffer));
+        GL(glBindBuffer(array_target, item->vertex_buffer));
+        GL(glBufferData(array_target, cost, vertices, GL_STATIC_DRAW));
+        GL(glGenBuffers(1, &item->index_buffer));
+        GL(glBindBuffer(index_target, item->index_buffer));
+        GL(glBufferData(index_target,
+                        item->nb_elements * 3 * sizeof(*indices),
+                        indices, GL_STATIC_DRAW));
+        if (!background)
+            GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+        cost += item->nb_elements * 3 * sizeof(*indices);
+        counter_add(COUNTER_GL_BUFFERS_CREATED, 2);
+        counter_add(COUNTER_GL_UPLOAD_BYTES, cost);
+    } else if (item->nb_elements != 0) {
+        GL(glGenBuffers(1, &item->vertex_buffer));
+        GL(glBindBuffer(array_target, item->vertex_buffer));
+        GL(glBufferData(array_target, cost, vertices, GL_STATIC_DRAW));
+        counter_add(COUNTER_GL_BUFFERS_CREATED, 1);
+        counter_add(COUNTER_GL_UPLOAD_BYTES, cost);
+    }
+    return cost;
+}
+
+// Create the vertex array of an uploaded item, and add it to the cache.
+static void item_add(render_item_t *item, int cost)
+{
+    if (item->vertex_buffer && !item->arena && !item->faces) {
+        item->vao = vao_create(item->vertex_buffer,
+                               item->index_buffer ?: g_index_buffer,
+                               item->packed);
+    }
+    cache_add(g_items_cache, &item->key, sizeof(item->key), item, cost,
+              item_delete);
+}
+
+/*
+ * Create a render item from a block vertices, and add it to the cache.
+ * See <item_upload> for the arguments.
+ */
+static render_item_t *item_create(const block_item_key_t *key,
+                                  const void *vertices,
+                                  const uint16_t *indices, int nb_vertices,
+                                  int nb_elements, int size, int subdivide)
+{
+    render_item_t *item;
+    int cost;
+    item = item_new(key, nb_elements, size, subdivide);
+    // We can be called while drawing the blocks, make sure we don't change
+    // the element buffer of the bound vertex array.
+    if (g_use_vao) vao_bind(0);
+    cost = item_upload(item, vertices, indices, nb_vertices, false);
+    item_add(item, cost);
+    return item;
+}
+
+/*
+ * Background uploads
+ *
+ * When the renderer background_uploads option is set and the platform
+ * gives us a second GL context shared with the main one (see
+ * <sys_set_upload_context_current>), the buffers of the items meshed by
+ * the background jobs are created and filled by an upload thread.  The
+ * thread puts a fence after each item, and the render thread only adds
+ * the item to the cache once the fence is signaled.
+ *
+ * The vertex arrays are container objects that are not shared between the
+ * contexts, so they are still created on the render thread, as well as
+ * the items using the arenas, that only copy their vertices into an
+ * existing buffer.
+ */
+
+enum {
+    UPLOAD_NONE = 0,
+    UPLOAD_QUEUED,
+    UPLOAD_RUNNING,
+    UPLOAD_DONE,
+};
+
+static struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool            started;
+    bool            stop;
+    bool            failed;     // Set if we can't use the upload context.
+    mesh_job_t      *queue;
+} g_uploads = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *upload_thread_func(void *arg)
+{
+    mesh_job_t *job;
+    bool current = false;
+
+    pthread_mutex_lock(&g_uploads.lock);
+    while (true) {
+        // Release the context while we wait for more jobs.
+        if (!g_uploads.queue && current) {
+            pthread_mutex_unlock(&g_uploads.lock);
+            sys_set_upload_context_current(false);
+            current = false;
+            pthread_mutex_lock(&g_uploads.lock);
+            continue;
+        }
+        if (g_uploads.stop) break;
+        if (!g_uploads.queue) {
+            pthread_cond_wait(&g_uploads.cond, &g_uploads.lock);
+            continue;
+        }
+        job = g_uploads.queue;
+        LL_DELETE2(g_uploads.queue, job, upload_next);
+        job->upload = UPLOAD_RUNNING;
+        pthread_mutex_unlock(&g_uploads.lock);
+
+        if (!current) current = sys_set_upload_context_current(true);
+#if HAS_SYNC
+        if (current) {
+            job->cost = item_upload(job->item, job->vertices, job->indices,
+                                    job->nb_vertices, true);
+            GL(job->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+            GL(glFlush());
+        }
+#endif
+
+        pthread_mutex_lock(&g_uploads.lock);
+        if (!current) g_uploads.failed = true;
+        job->upload = UPLOAD_DONE;
+        pthread_cond_broadcast(&g_uploads.cond);
+    }
+    pthread_mutex_unlock(&g_uploads.lock);
+    return NULL;
+}
+
+static void uploads_stop(void)
+{
+    if (!g_uploads.started) return;
+    pthread_mutex_lock(&g_uploads.lock);
+    g_uploads.stop = true;
+    pthread_cond_broadcast(&g_uploads.cond);
+    pthread_mutex_unlock(&g_uploads.lock);
+    pthread_join(g_uploads.thread, NULL);
+    g_uploads.started = false;
+    g_uploads.stop = false;
+}
+
+/*
+ * Queue the upload of the item of a finished job.  Return false if it
+ * can't be done in the background, in which case the caller creates the
+ * item directly.
+ */
+static bool upload_queue(const renderer_t *rend, mesh_job_t *job)
 {
     render_item_t *item;
-    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH;
+    bool failed;
+
+    if (!rend->background_uploads || !g_use_sync) return false;
+    pthread_mutex_lock(&g_uploads.lock);
+    failed = g_uploads.failed;
+    pthread_mutex_unlock(&g_uploads.lock);
+    if (failed) return false;
+    if (!g_uploads.started) {
+        if (pthread_create(&g_uploads.thread, NULL, upload_thread_func,
+                           NULL) != 0) {
+            LOG_W("Cannot start the upload thread");
+            g_uploads.failed = true;
+            return false;
+        }
+        g_uploads.started = true;
+    }
+    item = item_new(&job->key, job->nb_elements, job->size,
+                    job->subdivide);
+    if (!item_has_own_buffers(item)) {
+        free(item);
+        return false;
+    }
+    job->item = item;
+    pthread_mutex_lock(&g_uploads.lock);
+    job->upload = UPLOAD_QUEUED;
+    LL_APPEND2(g_uploads.queue, job, upload_next);
+    pthread_cond_signal(&g_uploads.cond);
+    pthread_mutex_unlock(&g_uploads.lock);
+    return true;
+}
+
+// Return the item of a job queued for upload and add it to the cache, or
+// return NULL if it is not ready yet.
+static render_item_t *upload_get_item(mesh_job_t *job)
+{
+    render_item_t *item = job->item;
+    int state;
+    GLenum status;
+
+    pthread_mutex_lock(&g_uploads.lock);
+    state = job->upload;
+    pthread_mutex_unlock(&g_uploads.lock);
+    if (state != UPLOAD_DONE) return NULL;
+
+    if (!job->fence) {
+        // The upload thread couldn't use its context, do it here.
+        if (g_use_vao) vao_bind(0);
+        job->cost = item_upload(item, job->vertices, job->indices,
+                                job->nb_vertices, false);
+    }
+#if HAS_SYNC
+    if (job->fence) {
+        GL(status = glClientWaitSync(job->fence, 0, 0));
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            return NULL;
+        GL(glDeleteSync(job->fence));
+        job->fence = 0;
+        // The changes made by an other context are only guaranteed to be
+        // visible once the buffers have been bound again in this one.
+        GL(glBindBuffer(GL_COPY_READ_BUFFER, item->vertex_buffer));
+        if (item->index_buffer)
+            GL(glBindBuffer(GL_COPY_READ_BUFFER, item->index_buffer));
+    }
+#endif
+    (void)status;
+    item_add(item, job->cost);
+    job->item = NULL;
+    job->upload = UPLOAD_NONE;
+    return item;
+}
+
+// Cancel the upload of a job, waiting for it if it is running.
+static void upload_cancel(mesh_job_t *job)
+{
+    if (job->upload == UPLOAD_NONE) return;
+    pthread_mutex_lock(&g_uploads.lock);
+    if (job->upload == UPLOAD_QUEUED)
+        LL_DELETE2(g_uploads.queue, job, upload_next);
+    while (job->upload == UPLOAD_RUNNING)
+        pthread_cond_wait(&g_uploads.cond, &g_uploads.lock);
+    job->upload = UPLOAD_NONE;
+    pthread_mutex_unlock(&g_uploads.lock);
+#if HAS_SYNC
+    if (job->fence) GL(glDeleteSync(job->fence));
+#endif
+    job->fence = 0;
+    item_delete(job->item);
+    job->item = NULL;
+}
+
+// Test if we can generate the vertices of a block with the GPU mesher.
+static bool can_use_gpu_mesher(const renderer_t *rend, int effects, int lod)
+{
+    return rend->gpu_meshing && g_use_arenas && lod == 0 &&
+           !(effects & (EFFECT_MARCHING_CUBES | EFFECT_MERGE_FACES)) &&
+           gpu_mesher_is_supported();
+}
+
+// Create the render item of a block with the GPU mesher.  Return NULL in
+// case of error.
+static render_item_t *item_create_gpu(const block_item_key_t *key,
+                                      const mesh_t *mesh,
+                                      const int block_pos[3], int effects)
+{
+    const int n = BLOCK_SIZE + 2;
+    uint8_t *data;
+    int nb;
+
+    counter_add(COUNTER_BLOCKS_MESHED, 1);
+    data = malloc(n * n * n * 4);
+    mesh_read(mesh, (int[]){block_pos[0] - 1, block_pos[1] - 1,
+                            block_pos[2] - 1},
+              (int[]){n, n, n}, data);
+    nb = gpu_mesher_run(data, effects);
+    free(data);
+    if (nb < 0) return NULL;
+    return item_create(key, NULL, NULL, 0, nb, 4, 1);
+}
+
+// Compute the cache key of the render item of a block.
+static void get_block_item_key(const mesh_t *mesh, const int block_pos[3],
+                               int effects, int lod, bool faces,
+                               block_item_key_t *key)
+{
+    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+                             EFFECT_MERGE_FACES;
     uint64_t block_data_id;
     int p[3], i, x, y, z;
-    block_item_key_t key = {};
 
-    memset(&key, 0, sizeof(key)); // Just to be sure!
-    key.effects = effects & effects_mask;
+    memset(key, 0, sizeof(*key)); // Just to be sure!
+    key->effects = effects & effects_mask;
+    key->lod = lod;
+    key->faces = faces;
     // The hash key take into consideration all the blocks adjacent to
     // the current block!
     for (i = 0, z = -1; z <= 1; z++)
@@ -389,217 +1320,1020 @@ static render_item_t *get_item_for_block(
         p[1] = block_pos[1] + y * BLOCK_SIZE;
         p[2] = block_pos[2] + z * BLOCK_SIZE;
         mesh_get_block_data(mesh, NULL, p, &block_data_id);
-        key.ids[i] = block_data_id;
+        key->ids[i] = block_data_id;
     }
+}
+
+/*
+ * Return the render item of a block, or NULL if the renderer is async and
+ * the block is not ready yet.  With cached_only set, only return the item
+ * if it is already in the cache.
+ *
+ * In async mode the main thread work (meshing and GL uploads) is limited
+ * by the frame tasks budget, and the rest is done by background jobs or
+ * in the next frames.
+ */
+static render_item_t *get_item_for_block(
+        const renderer_t *rend,
+        const mesh_t *mesh,
+        const block_item_key_t *key_,
+        const int block_pos[3],
+        int effects, int lod, bool cached_only)
+{
+    render_item_t *item;
+    mesh_job_t *job;
+    double time;
+    int nb_elements, nb_vertices, size, subdivide;
+    block_item_key_t key = *key_;
 
     item = cache_get(g_items_cache, &key, sizeof(key));
-    if (item) return item;
+    if (item || cached_only) return item;
+
+    HASH_FIND(hh, g_mesh_jobs, &key, sizeof(key), job);
+    if (job && task_is_done(job->task)) {
+        if (job->upload || upload_queue(rend, job)) {
+            time = sys_get_time();
+            item = upload_get_item(job);
+            frame_tasks_spend(sys_get_time() - time);
+            if (item) mesh_job_delete(job);
+            else job->frame = g_frame;
+            return item;
+        }
+        if (rend->async && !frame_tasks_has_time()) {
+            job->frame = g_frame;
+            return NULL;
+        }
+        time = sys_get_time();
+        item = item_create(&key, job->vertices, job->indices,
+                           job->nb_vertices, job->nb_elements,
+                           job->size, job->subdivide);
+        frame_tasks_spend(sys_get_time() - time);
+        mesh_job_delete(job);
+        return item;
+    }
 
-    item = calloc(1, sizeof(*item));
-    item->key = key;
-    GL(glGenBuffers(1, &item->vertex_buffer));
-    GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
-    if (!g_vertices_buffer)
-        g_vertices_buffer = calloc(
-                BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
-                sizeof(*g_vertices_buffer));
-    item->nb_elements = mesh_generate_vertices(
-            mesh, block_pos, effects, g_vertices_buffer,
-            &item->size, &item->subdivide);
-    if (item->nb_elements > BATCH_QUAD_COUNT) {
-        LOG_W("Too many quads!");
-        item->nb_elements = BATCH_QUAD_COUNT;
+    // With the GPU mesher we don't need background jobs, but since each
+    // block waits for the GPU we still spread the work over several frames.
+    if (!key.faces && can_use_gpu_mesher(rend, effects, lod)) {
+        if (rend->async && !frame_tasks_has_time()) {
+            if (job) mesh_job_delete(job);
+            return NULL;
+        }
+        time = sys_get_time();
+        item = item_create_gpu(&key, mesh, block_pos, effects);
+        frame_tasks_spend(sys_get_time() - time);
+        if (item) {
+            if (job) mesh_job_delete(job);
+            return item;
+        }
     }
-    if (item->nb_elements != 0) {
-        GL(glBufferData(GL_ARRAY_BUFFER,
-                item->nb_elements * item->size * sizeof(*g_vertices_buffer),
-                g_vertices_buffer, GL_STATIC_DRAW));
+
+    if (rend->async && (job || !frame_tasks_has_time())) {
+        if (!job) {
+            job = calloc(1, sizeof(*job));
+            job->key = key;
+            job->mesh = mesh_copy(mesh);
+            memcpy(job->pos, block_pos, sizeof(job->pos));
+            job->effects = effects;
+            HASH_ADD(hh, g_mesh_jobs, key, sizeof(key), job);
+            job->task = task_start(mesh_job_func, job);
+        }
+        job->frame = g_frame;
+        return NULL;
     }
+    if (job) mesh_job_delete(job); // We can't wait, just do it now.
 
-    cache_add(g_items_cache, &key, sizeof(key), item,
-              item->nb_elements * item->size * sizeof(*g_vertices_buffer),
-              item_delete);
+    time = sys_get_time();
+    if (!g_vertices_buffer)
+        g_vertices_buffer = calloc(VERTICES_BUFFER_SIZE,
+                                   sizeof(*g_vertices_buffer));
+    nb_elements = get_block_vertices(
+            mesh, block_pos, effects, lod, g_vertices_buffer,
+            &size, &subdivide);
+    if (size == 4) {
+        if (!g_packed_vertices_buffer)
+            g_packed_vertices_buffer = calloc(
+                    VERTICES_BUFFER_SIZE, sizeof(*g_packed_vertices_buffer));
+        mesh_pack_vertices(g_vertices_buffer, nb_elements * size,
+                           g_packed_vertices_buffer);
+        item = item_create(&key, g_packed_vertices_buffer, NULL, 0,
+                           nb_elements, size, subdivide);
+    } else {
+        if (!g_triangles_indices_buffer)
+            g_triangles_indices_buffer = calloc(VERTICES_BUFFER_SIZE,
+                    sizeof(*g_triangles_indices_buffer));
+        nb_vertices = index_triangles(g_vertices_buffer, nb_elements,
+                                      g_triangles_indices_buffer);
+        item = item_create(&key, g_vertices_buffer,
+                nb_vertices >= 0 ? g_triangles_indices_buffer : NULL,
+                nb_vertices, nb_elements, size, subdivide);
+    }
+    frame_tasks_spend(sys_get_time() - time);
     return item;
 }
 
-static void render_block_(renderer_t *rend, mesh_t *mesh,
-                          mesh_iterator_t *iter,
+// Draw the triangles of an item, using its indices if it has some.
+static void draw_triangles(const render_item_t *item)
+{
+    counter_add(COUNTER_GL_DRAW_CALLS, 1);
+    if (!item->index_buffer) {
+        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * 3));
+        return;
+    }
+    // The vertex array already uses the item indices.
+    if (!item->vao)
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, item->index_buffer));
+    GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 3,
+                      GL_UNSIGNED_SHORT, 0));
+    if (!item->vao)
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+}
+
+// Draw the quads of an item, using the base vertex if needed.
+static void draw_quads(const render_item_t *item, GLenum mode, int count,
+                       intptr_t offset)
+{
+    counter_add(COUNTER_GL_DRAW_CALLS, 1);
+#if HAS_BASE_VERTEX
+    if (item->base_vertex) {
+        GL(glDrawElementsBaseVertex(mode, count, GL_UNSIGNED_SHORT,
+                                    (void*)offset, item->base_vertex));
+        return;
+    }
+#endif
+    GL(glDrawElements(mode, count, GL_UNSIGNED_SHORT, (void*)offset));
+}
+
+// Give an id to a block rendered into the pick buffer, and record its
+// position, so that we can find it back with render_get_block_pos.
+static int add_block_id(renderer_t *rend, const int pos[3])
+{
+    render_blocks_table_t *table = rend->blocks_table;
+    if (!table) return 0;
+    if (table->size > RENDER_MAX_BLOCK_ID) {
+        table->overflow = true;
+        return 0;
+    }
+    if (table->size >= table->allocated) {
+        table->allocated = max(256, table->allocated * 2);
+        table->pos = realloc(table->pos,
+                             table->allocated * sizeof(*table->pos));
+    }
+    memcpy(table->pos[table->size], pos, sizeof(table->pos[0]));
+    return table->size++;
+}
+
+/*
+ * Render a single block.  bound_buffer is the vertex buffer currently
+ * bound with its attributes set, so that we can skip that when the blocks
+ * share the same arena buffer.  With the vertex arrays we always bind the
+ * item one, since creating the items in the loop unbinds it.
+ */
+static void render_block_(renderer_t *rend, const render_item_t *item,
                           const int block_pos[3],
-                          int block_id,
-                          const material_t *material,
                           int effects, gl_shader_t *shader,
-                          const float model[4][4])
+                          const float model[4][4],
+                          GLuint *bound_buffer)
 {
-    render_item_t *item;
     float block_model[4][4];
-    int attr;
-    float block_id_f[2];
+    int attr, nb_attrs, stride;
+    int block_id;
+    float block_id_f[3];
+    const attribute_t *attrs;
 
-    item = get_item_for_block(mesh, iter, block_pos, effects,
-                              rend->settings.smoothness);
     if (item->nb_elements == 0) return;
-    GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
     if (gl_has_uniform(shader, "u_block_id")) {
-        block_id_f[1] = ((block_id >> 8) & 0xff) / 255.0;
+        block_id = add_block_id(rend, block_pos) << RENDER_PICK_SUB_BITS;
         block_id_f[0] = ((block_id >> 0) & 0xff) / 255.0;
+        block_id_f[1] = ((block_id >> 8) & 0xff) / 255.0;
+        block_id_f[2] = (block_id >> 16) & 0x01;
         gl_update_uniform(shader, "u_block_id", block_id_f);
     }
-    gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
 
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++) {
-        GL(glVertexAttribPointer(attr,
-                                 ATTRIBUTES[attr].size,
-                                 ATTRIBUTES[attr].type,
-                                 ATTRIBUTES[attr].norm,
-                                 sizeof(voxel_vertex_t),
-                                 (void*)(intptr_t)ATTRIBUTES[attr].offset));
+    // All the items of a shared buffer use the same subdivide value.
+    if (item->faces) {
+#if HAS_VERTEX_PULLING
+        GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0,
+                            item->vertex_buffer));
+#endif
+        gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
+    } else if (item->vao) {
+        vao_bind(item->vao);
+        gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
+    } else if (item->vertex_buffer != *bound_buffer) {
+        *bound_buffer = item->vertex_buffer;
+        GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
+        gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
+        attrs = get_attributes(item->packed, &nb_attrs, &stride);
+        for (attr = 0; attr < nb_attrs; attr++) {
+            if (!attrs[attr].size) continue;
+            GL(glVertexAttribPointer(attr,
+                                     attrs[attr].size,
+                                     attrs[attr].type,
+                                     attrs[attr].norm,
+                                     stride,
+                                     (void*)(intptr_t)attrs[attr].offset));
+        }
     }
 
     mat4_copy(model, block_model);
     mat4_itranslate(block_model, block_pos[0], block_pos[1], block_pos[2]);
     gl_update_uniform(shader, "u_model", block_model);
-    if (item->size == 4) {
+    if (item->faces) {
+        counter_add(COUNTER_GL_DRAW_CALLS, 1);
+        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * 6));
+    } else if (item->size == 4) {
         if (!(effects & (EFFECT_GRID | EFFECT_EDGES))) {
-            GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
+            draw_quads(item, GL_TRIANGLES, item->nb_elements * 6, 0);
         } else {
             gl_update_uniform(shader, "u_l_amb", 0.0);
             gl_update_uniform(shader, "u_z_ofs", -0.001);
-            GL(glDrawElements(GL_LINES, item->nb_elements * 8,
-                              GL_UNSIGNED_SHORT,
-                              (void*)(uintptr_t)(BATCH_QUAD_COUNT * 6 * 2)));
+            draw_quads(item, GL_LINES, item->nb_elements * 8,
+                       BATCH_QUAD_COUNT * 6 * 2);
             gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
             gl_update_uniform(shader, "u_z_ofs", 0.0);
         }
     } else {
-        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+        draw_triangles(item);
+    }
+
+#ifndef GLES2
+    if (effects & EFFECT_WIREFRAME) {
+        gl_update_uniform(shader, "u_l_amb", 0.0);
+        GL(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
+        if (item->size == 4)
+            draw_quads(item, GL_TRIANGLES, item->nb_elements * 6, 0);
+        else
+            draw_triangles(item);
+        GL(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
+        gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+    }
+#endif
+}
+
+static void get_light_dir(const renderer_t *rend, float out[3])
+{
+    float light_dir[4];
+    float m[4][4];
+
+    mat4_set_identity(m);
+    mat4_irotate(m, rend->light.yaw, 0, 0, 1);
+    mat4_irotate(m, rend->light.pitch, 1, 0, 0);
+    mat4_mul_vec4(m, VEC(0, 0, 1, 0), light_dir);
+
+    if (rend->light.fixed) {
+        mat4_invert(rend->view_mat, m);
+        mat4_irotate(m, -M_PI / 4, 1, 0, 0);
+        mat4_irotate(m, -M_PI / 4, 0, 0, 1);
+        mat4_mul_vec4(m, light_dir, light_dir);
+    }
+    vec3_copy(light_dir, out);
+}
+
+void render_get_light_dir(const renderer_t *rend, float out[3])
+{
+    get_light_dir(rend, out);
+}
+
+// Compute the minimum projection box to use for the shadow map.
+static void compute_shadow_map_box(
+                const renderer_t *rend,
+                float rect[6])
+{
+    const float POS[8][3] = {
+        {0, 0, 0},
+        {1, 0, 0},
+        {1, 0, 1},
+        {0, 0, 1},
+        {0, 1, 0},
+        {1, 1, 0},
+        {1, 1, 1},
+        {0, 1, 1},
+    };
+    const int N = BLOCK_SIZE;
+
+    render_item_t *item;
+    float p[3];
+    int i, bpos[3];
+    mesh_iterator_t iter;
+    float view_mat[4][4], light_dir[3];
+
+    get_light_dir(rend, light_dir);
+    mat4_lookat(view_mat, light_dir, VEC(0, 0, 0), VEC(0, 1, 0));
+    rect[0] = +FLT_MAX;
+    rect[1] = -FLT_MAX;
+    rect[2] = +FLT_MAX;
+    rect[3] = -FLT_MAX;
+    rect[4] = +FLT_MAX;
+    rect[5] = -FLT_MAX;
+
+    DL_FOREACH(rend->items, item) {
+        if (item->type != ITEM_MESH) continue;
+        iter = mesh_get_iterator(item->mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            for (i = 0; i < 8; i++) {
+                vec3_set(p, bpos[0], bpos[1], bpos[2]);
+                vec3_addk(p, POS[i], N, p);
+                mat4_mul_vec3(item->model, p, p);
+                mat4_mul_vec3(view_mat, p, p);
+                rect[0] = min(rect[0], p[0]);
+                rect[1] = max(rect[1], p[0]);
+                rect[2] = min(rect[2], p[1]);
+                rect[3] = max(rect[3], p[1]);
+                rect[4] = min(rect[4], -p[2]);
+                rect[5] = max(rect[5], -p[2]);
+            }
+        }
+    }
+}
+
+/*
+ * Test if a block bounding box is outside the view frustum.  We transform
+ * the corners in clip space and check if they are all outside the same
+ * clipping plane.  The box is a bit larger than the block since the
+ * marching cubes vertices can go past the block limits.
+ *
+ * If near is set, it is set to true if the box crosses the near plane.
+ */
+static bool block_is_culled(const float mvp[4][4], const int pos[3],
+                            bool *near)
+{
+    const int N = BLOCK_SIZE;
+    int i, j, outside[6] = {};
+    float p[4];
+
+    for (i = 0; i < 8; i++) {
+        p[0] = pos[0] - 1 + ((i >> 0) & 1) * (N + 2);
+        p[1] = pos[1] - 1 + ((i >> 1) & 1) * (N + 2);
+        p[2] = pos[2] - 1 + ((i >> 2) & 1) * (N + 2);
+        p[3] = 1;
+        mat4_mul_vec4(mvp, p, p);
+        for (j = 0; j < 3; j++) {
+            outside[j * 2 + 0] += p[j] < -p[3];
+            outside[j * 2 + 1] += p[j] > p[3];
+        }
+    }
+    for (j = 0; j < 6; j++) {
+        if (outside[j] == 8) return true;
+    }
+    if (near) *near = outside[4] > 0;
+    return false;
+}
+
+/*
+ * Blocks occlusion culling.
+ *
+ * We use hardware occlusion queries with the results of the previous
+ * frames, so that we never have to wait for the GPU:
+ *   - A block that was visible is rendered normally, inside a query.
+ *   - A block that was occluded is not rendered, instead we test its
+ *     bounding box (without writing to the color and depth buffers).
+ * When the result of a query is available, it updates the visibility of
+ * the block for the next frames.  A block that gets uncovered thus
+ * appears one frame late.
+ */
+#if !defined(GLES2) || defined(GLES3)
+#   define HAS_OCCLUSION_QUERY 1
+#else
+#   define HAS_OCCLUSION_QUERY 0
+#endif
+
+// GLES3 only has the boolean queries.
+#ifdef GLES3
+#   define OCCLUSION_QUERY GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+#else
+#   define OCCLUSION_QUERY GL_SAMPLES_PASSED
+#endif
+
+typedef struct {
+    int      pos[3];
+    uint32_t model;     // Hash of the model matrix, for the instances.
+    uint64_t id;        // Data id of the block.
+    int      view;      // See renderer_t.views.
+} occlusion_key_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    occlusion_key_t key;
+    GLuint          query;
+    bool            pending;    // Set if we wait for a query result.
+    bool            visible;
+    int             frame;      // Last frame the block was rendered.
+} occlusion_t;
+
+static occlusion_t *g_occlusions = NULL;
+static GLuint g_occlusion_box_buffer = 0;
+static GLuint g_occlusion_box_vao = 0;
+static GLuint g_occlusion_box_faces = 0;
+// Number of frames we keep the occlusion state of a block not rendered.
+static const int OCCLUSION_KEEP_FRAMES = 8;
+
+static occlusion_t *get_occlusion(const renderer_t *rend,
+                                  const mesh_t *mesh, mesh_iterator_t *iter,
+                                  const int pos[3], uint32_t model_key)
+{
+    occlusion_key_t key = {};
+    occlusion_t *occ;
+    unsigned int available, samples;
+
+    memcpy(key.pos, pos, sizeof(key.pos));
+    key.model = model_key;
+    key.view = rend->views.current;
+    mesh_get_block_data(mesh, iter, pos, &key.id);
+    HASH_FIND(hh, g_occlusions, &key, sizeof(key), occ);
+    if (!occ) {
+        occ = calloc(1, sizeof(*occ));
+        occ->key = key;
+        occ->visible = true;
+        GL(glGenQueries(1, &occ->query));
+        HASH_ADD(hh, g_occlusions, key, sizeof(key), occ);
+    }
+    occ->frame = g_frame;
+    if (occ->pending) {
+        GL(glGetQueryObjectuiv(occ->query, GL_QUERY_RESULT_AVAILABLE,
+                               &available));
+        if (available) {
+            GL(glGetQueryObjectuiv(occ->query, GL_QUERY_RESULT, &samples));
+            occ->visible = samples > 0;
+            occ->pending = false;
+        }
+    }
+    return occ;
+}
+
+static void occlusions_cleanup(bool all)
+{
+    occlusion_t *occ, *tmp;
+    HASH_ITER(hh, g_occlusions, occ, tmp) {
+        if (!all && g_frame - occ->frame < OCCLUSION_KEEP_FRAMES) continue;
+        HASH_DEL(g_occlusions, occ);
+        GL(glDeleteQueries(1, &occ->query));
+        free(occ);
+    }
+    if (all) {
+        GL(glDeleteBuffers(1, &g_occlusion_box_buffer));
+        g_occlusion_box_buffer = 0;
+        vao_delete(g_occlusion_box_vao);
+        g_occlusion_box_vao = 0;
+        GL(glDeleteBuffers(1, &g_occlusion_box_faces));
+        g_occlusion_box_faces = 0;
+    }
+}
+
+/*
+ * Overdraw measure.
+ *
+ * The samples that pass the depth test in the main passes of the opaque
+ * meshes are counted with queries, and once the results of a frame are
+ * known we divide them by the number of samples of the viewport.  This is
+ * the average number of times the mesh fragment shader ran per sample,
+ * that the front to back order and the depth pre-pass try to bring close
+ * to one.  The passes that use the occlusion queries are not measured,
+ * since the queries of a given type can't be nested.  Only one frame is
+ * measured at a time.
+ */
+#if !defined(GLES2) && !defined(GLES3)
+#   define HAS_SAMPLES_QUERY 1
+#else
+#   define HAS_SAMPLES_QUERY 0
+#endif
+
+#define OVERDRAW_MAX_QUERIES 32
+
+static struct {
+    GLuint  queries[OVERDRAW_MAX_QUERIES];
+    int     nb;         // Queries issued for the measured frame.
+    bool    waiting;    // Set once the measured frame has been submitted.
+    double  samples;    // Samples of the viewport of the measured frame.
+    float   value;      // Last measured overdraw, or zero.
+} g_overdraw;
+
+// Start to count the samples of a mesh pass.  Return false if we don't.
+static bool overdraw_begin(const renderer_t *rend, const float viewport[4])
+{
+#if HAS_SAMPLES_QUERY
+    GLint samples = 0;
+    if (g_overdraw.waiting || g_overdraw.nb >= OVERDRAW_MAX_QUERIES)
+        return false;
+    if (!g_overdraw.queries[g_overdraw.nb])
+        GL(glGenQueries(1, &g_overdraw.queries[g_overdraw.nb]));
+    GL(glGetIntegerv(GL_SAMPLES, &samples));
+    g_overdraw.samples = viewport[2] * viewport[3] *
+                         rend->scale * rend->scale * max(samples, 1);
+    GL(glBeginQuery(GL_SAMPLES_PASSED, g_overdraw.queries[g_overdraw.nb]));
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void overdraw_end(void)
+{
+#if HAS_SAMPLES_QUERY
+    GL(glEndQuery(GL_SAMPLES_PASSED));
+    g_overdraw.nb++;
+#endif
+}
+
+// Called at the end of each frame, to collect the results of the measured
+// frame once they are available.
+static void overdraw_update(void)
+{
+#if HAS_SAMPLES_QUERY
+    GLuint available, value;
+    uint64_t total = 0;
+    int i;
+
+    if (!g_overdraw.nb) return;
+    if (!g_overdraw.waiting) {
+        g_overdraw.waiting = true;
+        return;
+    }
+    GL(glGetQueryObjectuiv(g_overdraw.queries[g_overdraw.nb - 1],
+                           GL_QUERY_RESULT_AVAILABLE, &available));
+    if (!available) return;
+    for (i = 0; i < g_overdraw.nb; i++) {
+        GL(glGetQueryObjectuiv(g_overdraw.queries[i], GL_QUERY_RESULT,
+                               &value));
+        total += value;
+    }
+    g_overdraw.value = g_overdraw.samples ? total / g_overdraw.samples : 0;
+    g_overdraw.nb = 0;
+    g_overdraw.waiting = false;
+#endif
+}
+
+static void overdraw_release(void)
+{
+#if HAS_SAMPLES_QUERY
+    GL(glDeleteQueries(OVERDRAW_MAX_QUERIES, g_overdraw.queries));
+#endif
+    memset(&g_overdraw, 0, sizeof(g_overdraw));
+}
+
+// Render the bounding box of a block with a packed vertices shader, or
+// with the vertex pulling shader if faces is set.
+static void render_occlusion_box(gl_shader_t *shader, const int pos[3],
+                                 const float model[4][4], bool faces,
+                                 GLuint *bound_buffer)
+{
+    const int N = BLOCK_SIZE;
+    voxel_packed_vertex_t verts[6 * 4] = {};
+    float block_model[4][4];
+    int f, i, attr, nb_attrs, stride;
+    const attribute_t *attrs;
+
+    if (!g_occlusion_box_buffer || (faces && !g_occlusion_box_faces)) {
+        for (f = 0; f < 6; f++)
+        for (i = 0; i < 4; i++) {
+            vec3_set(verts[f * 4 + i].pos,
+                     VERTICES_POSITIONS[FACES_VERTICES[f][i]][0] * N,
+                     VERTICES_POSITIONS[FACES_VERTICES[f][i]][1] * N,
+                     VERTICES_POSITIONS[FACES_VERTICES[f][i]][2] * N);
+            verts[f * 4 + i].face = f * 4 + i;
+        }
+    }
+#if HAS_VERTEX_PULLING
+    voxel_face_t box_faces[6];
+    if (faces && !g_occlusion_box_faces) {
+        mesh_pack_faces(verts, 6, box_faces);
+        GL(glGenBuffers(1, &g_occlusion_box_faces));
+        GL(glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_occlusion_box_faces));
+        GL(glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(box_faces),
+                        box_faces, GL_STATIC_DRAW));
+    }
+    if (faces) {
+        GL(glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0,
+                            g_occlusion_box_faces));
+        gl_update_uniform(shader, "u_pos_scale", 1.f);
+        mat4_copy(model, block_model);
+        mat4_itranslate(block_model, pos[0], pos[1], pos[2]);
+        gl_update_uniform(shader, "u_model", block_model);
+        counter_add(COUNTER_GL_DRAW_CALLS, 1);
+        GL(glDrawArrays(GL_TRIANGLES, 0, 6 * 6));
+        return;
+    }
+#endif
+    if (!g_occlusion_box_buffer) {
+        GL(glGenBuffers(1, &g_occlusion_box_buffer));
+        GL(glBindBuffer(GL_ARRAY_BUFFER, g_occlusion_box_buffer));
+        GL(glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts,
+                        GL_STATIC_DRAW));
+        *bound_buffer = 0;
+        g_occlusion_box_vao = vao_create(g_occlusion_box_buffer,
+                                         g_index_buffer, true);
+    }
+    if (g_occlusion_box_vao) {
+        vao_bind(g_occlusion_box_vao);
+        gl_update_uniform(shader, "u_pos_scale", 1.f);
+    } else if (*bound_buffer != g_occlusion_box_buffer) {
+        *bound_buffer = g_occlusion_box_buffer;
+        GL(glBindBuffer(GL_ARRAY_BUFFER, g_occlusion_box_buffer));
+        gl_update_uniform(shader, "u_pos_scale", 1.f);
+        attrs = get_attributes(true, &nb_attrs, &stride);
+        for (attr = 0; attr < nb_attrs; attr++) {
+            if (!attrs[attr].size) continue;
+            GL(glVertexAttribPointer(attr,
+                                     attrs[attr].size,
+                                     attrs[attr].type,
+                                     attrs[attr].norm,
+                                     stride,
+                                     (void*)(intptr_t)attrs[attr].offset));
+        }
+    }
+    mat4_copy(model, block_model);
+    mat4_itranslate(block_model, pos[0], pos[1], pos[2]);
+    gl_update_uniform(shader, "u_model", block_model);
+    counter_add(COUNTER_GL_DRAW_CALLS, 1);
+    GL(glDrawElements(GL_TRIANGLES, 6 * 6, GL_UNSIGNED_SHORT, 0));
+}
+
+/*
+ * Pick the level of detail of a block so that the downsampled voxels don't
+ * cover more than about one pixel on screen.
+ */
+static int get_block_lod(const renderer_t *rend, const float viewport[4],
+                         const float camera[3], const int pos[3])
+{
+    const float N = BLOCK_SIZE;
+    const float radius = N * 0.87; // Half the block diagonal.
+    float center[3], dist, voxel_size;
+    int lod;
+
+    // Size of a voxel in pixels.
+    voxel_size = rend->proj_mat[1][1] * viewport[3] * rend->scale / 2;
+    if (rend->proj_mat[3][3] == 0) { // Perspective.
+        vec3_set(center, pos[0] + N / 2, pos[1] + N / 2, pos[2] + N / 2);
+        dist = vec3_dist(center, camera) - radius;
+        if (dist < 1) return 0;
+        voxel_size /= dist;
+    }
+    for (lod = 0; lod < 3 && voxel_size * (2 << lod) <= 1; lod++) {}
+    return lod;
+}
+
+// Get the shader used to render a mesh with the normal effects.
+// With depth_only set, get the variant used for the depth pre-pass, that
+// has the same vertex shader.
+static gl_shader_t *get_mesh_shader(const render_settings_t *settings,
+                                    int effects, bool packed, bool faces,
+                                    bool depth_only)
+{
+    shader_define_t defines[] = {
+        {"#version 430 compatibility", faces},
+        {"SHADOW", settings->shadow},
+        {"MATERIAL_UNLIT", (settings->effects & EFFECT_UNLIT) ||
+                           (effects & EFFECT_EDGES)},
+        {"HAS_TANGENTS", effects & EFFECT_BORDERS},
+        {"ONLY_EDGES", effects & EFFECT_EDGES},
+        {"HAS_OCCLUSION_MAP", settings->occlusion_strength > 0},
+        {"VERTEX_LIGHTNING", !(effects & (EFFECT_BORDERS | EFFECT_UNLIT))},
+        {"SMOOTHNESS", settings->smoothness > 0},
+        {"PACKED_VERTICES", packed},
+        {"FACES", faces},
+        {"DEPTH_ONLY", depth_only},
+        {}
+    };
+    return shader_get("mesh", defines, ATTR_NAMES, shader_init);
+}
+
+void render_prepare_shaders(const renderer_t *rend)
+{
+    render_settings_t settings;
+    int i, effects;
+
+    for (i = 0; i < 7; i++) {
+        settings = rend->settings;
+        switch (i) {
+        case 1: settings.effects ^= EFFECT_BORDERS; break;
+        case 2: settings.effects ^= EFFECT_UNLIT; break;
+        case 3: settings.effects ^= EFFECT_MARCHING_CUBES; break;
+        case 4: settings.shadow = settings.shadow ? 0 : 0.3; break;
+        case 5: settings.smoothness = settings.smoothness ? 0 : 1; break;
+        case 6:
+            settings.occlusion_strength = settings.occlusion_strength ? 0 : 1;
+            break;
+        }
+        // Same as in render_mesh_.
+        effects = settings.effects;
+        if (effects & EFFECT_MARCHING_CUBES) effects &= ~EFFECT_BORDERS;
+        get_mesh_shader(&settings, effects,
+                        !(effects & EFFECT_MARCHING_CUBES), false, false);
+    }
+}
+
+/*
+ * Set the view, light and material uniforms, shared by the mesh and the
+ * bricks shaders.  If shadow_mvp is set, also bind the shadow map.
+ */
+static void set_light_uniforms(const renderer_t *rend, gl_shader_t *shader,
+                               const material_t *material,
+                               const float light_dir[3],
+                               const float shadow_mvp[4][4])
+{
+    float camera[4][4];
+
+    if (shadow_mvp) {
+        GL(glActiveTexture(GL_TEXTURE2));
+        GL(glBindTexture(GL_TEXTURE_2D, g_shadow_map->tex));
+        gl_update_uniform(shader, "u_shadow_mvp", shadow_mvp);
+        gl_update_uniform(shader, "u_shadow_tex", 2);
+        gl_update_uniform(shader, "u_shadow_strength", rend->settings.shadow);
+    }
+
+    gl_update_uniform(shader, "u_proj", rend->proj_mat);
+    gl_update_uniform(shader, "u_view", rend->view_mat);
+    gl_update_uniform(shader, "u_l_dir", light_dir);
+    gl_update_uniform(shader, "u_l_int", rend->light.intensity);
+    gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+
+    gl_update_uniform(shader, "u_m_metallic", material->metallic);
+    gl_update_uniform(shader, "u_m_roughness", material->roughness);
+    gl_update_uniform(shader, "u_m_base_color", material->base_color);
+    gl_update_uniform(shader, "u_m_emissive_factor", material->emission);
+    gl_update_uniform(shader, "u_m_smoothness", rend->settings.smoothness);
+
+    gl_update_uniform(shader, "u_occlusion_strength",
+                      rend->settings.occlusion_strength);
+
+    mat4_invert(rend->view_mat, camera);
+    gl_update_uniform(shader, "u_camera", camera[3]);
+}
+
+// The effects that the ray marching doesn't support.
+static const int RAY_MARCHING_EXCLUDED_EFFECTS =
+    EFFECT_RENDER_POS | EFFECT_SHADOW_MAP | EFFECT_SEE_BACK |
+    EFFECT_SEMI_TRANSPARENT | EFFECT_MARCHING_CUBES | EFFECT_GRID |
+    EFFECT_EDGES | EFFECT_WIREFRAME;
+
+/*
+ * Render a mesh by ray marching the voxels of its brick map.
+ *
+ * We draw the back faces of the grid box, and the shader writes the depth
+ * of the hit voxels, so that the mesh mixes with the other items.  Return
+ * false if the mesh has no brick map, in which case we rasterize the
+ * blocks instead.
+ *
+ * With EFFECT_GRID_ONLY, the mesh is a selection, and we only blend an
+ * outline and a hatch pattern over the hit faces, slightly in front of
+ * the voxels they cover.
+ */
+static bool render_mesh_bricks_(renderer_t *rend, const mesh_t *mesh,
+                                const float model[4][4],
+                                const material_t *material, int effects,
+                                const float shadow_mvp[4][4])
+{
+    typedef struct {
+        int8_t pos[3] __attribute__((aligned(4)));
+    } vertex_t;
+    vertex_t vertices[24];
+    const brickmap_t *map;
+    gl_shader_t *shader;
+    float light_dir[3], camera[4][4], imodel[4][4], local_camera[3], v[3];
+    const bool selection = effects & EFFECT_GRID_ONLY;
+    const bool shadow = rend->settings.shadow && !selection;
+    const int *p;
+    int i;
+
+    if (material->base_color[3] < 1 && !selection) return false;
+    map = brickmap_get(mesh);
+    if (!map) return false;
+
+    shader_define_t defines[] = {
+        {"SHADOW", shadow},
+        {"MATERIAL_UNLIT", rend->settings.effects & EFFECT_UNLIT},
+        {"SELECTION", selection},
+        {}
+    };
+    shader = shader_get("bricks", defines, ATTR_NAMES, shader_init);
+
+    if (!g_bricks_box_buffer) {
+        // The unit cube, with the same faces as the blocks.
+        for (i = 0; i < 24; i++) {
+            p = VERTICES_POSITIONS[FACES_VERTICES[i / 4][i % 4]];
+            vertices[i] = (vertex_t){{p[0], p[1], p[2]}};
+        }
+        GL(glGenBuffers(1, &g_bricks_box_buffer));
+        GL(glBindBuffer(GL_ARRAY_BUFFER, g_bricks_box_buffer));
+        GL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,
+                        GL_STATIC_DRAW));
+    }
+
+    GL(glEnable(GL_DEPTH_TEST));
+    GL(glDepthFunc(GL_LEQUAL));
+    GL(glEnable(GL_CULL_FACE));
+    GL(glCullFace(GL_FRONT));
+    if (selection) {
+        GL(glEnable(GL_BLEND));
+        GL(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+        GL(glDepthMask(false));
+    } else {
+        GL(glDisable(GL_BLEND));
     }
 
-#ifndef GLES2
-    if (effects & EFFECT_WIREFRAME) {
-        gl_update_uniform(shader, "u_l_amb", 0.0);
-        GL(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
-        if (item->size == 4)
-            GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
-        else
-            GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
-        GL(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
-        gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+    GL(glUseProgram(shader->prog));
+    get_light_dir(rend, light_dir);
+    set_light_uniforms(rend, shader, material, light_dir,
+                       shadow ? shadow_mvp : NULL);
+
+    GL(glActiveTexture(GL_TEXTURE3));
+    GL(glBindTexture(GL_TEXTURE_3D, map->grid_tex));
+    GL(glActiveTexture(GL_TEXTURE4));
+    GL(glBindTexture(GL_TEXTURE_3D, map->pool_tex));
+    gl_update_uniform(shader, "u_grid_tex", 3);
+    gl_update_uniform(shader, "u_pool_tex", 4);
+    vec3_set(v, map->grid_origin[0], map->grid_origin[1],
+             map->grid_origin[2]);
+    gl_update_uniform(shader, "u_grid_origin", v);
+    vec3_set(v, map->grid_size[0], map->grid_size[1], map->grid_size[2]);
+    gl_update_uniform(shader, "u_grid_size", v);
+    vec3_set(v, map->pool_size[0], map->pool_size[1], map->pool_size[2]);
+    gl_update_uniform(shader, "u_pool_size", v);
+    gl_update_uniform(shader, "u_block_size", (float)BLOCK_SIZE);
+
+    gl_update_uniform(shader, "u_model", model);
+    mat4_invert(rend->view_mat, camera);
+    mat4_invert(model, imodel);
+    mat4_mul_vec3(imodel, camera[3], local_camera);
+    gl_update_uniform(shader, "u_local_camera", local_camera);
+
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_bricks_box_buffer));
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+    GL(glEnableVertexAttribArray(A_POS_LOC));
+    GL(glVertexAttribPointer(A_POS_LOC, 3, GL_BYTE, false, sizeof(vertex_t),
+                             (void*)(intptr_t)offsetof(vertex_t, pos)));
+    counter_add(COUNTER_GL_DRAW_CALLS, 1);
+    GL(glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0));
+    GL(glDisableVertexAttribArray(A_POS_LOC));
+    GL(glCullFace(GL_BACK));
+    GL(glActiveTexture(GL_TEXTURE0));
+    if (selection) {
+        GL(glDisable(GL_BLEND));
+        GL(glDepthMask(true));
     }
-#endif
+    rend->stats.nb_ray_marched++;
+    return true;
 }
 
-static void get_light_dir(const renderer_t *rend, float out[3])
-{
-    float light_dir[4];
-    float m[4][4];
+// A visible block to draw.
+typedef struct {
+    int         pos[3];
+    int         lod;
+    float       dist;   // Squared distance to the camera.
+    occlusion_t *occ;
+} draw_block_t;
 
-    mat4_set_identity(m);
-    mat4_irotate(m, rend->light.yaw, 0, 0, 1);
-    mat4_irotate(m, rend->light.pitch, 1, 0, 0);
-    mat4_mul_vec4(m, VEC(0, 0, 1, 0), light_dir);
+static int draw_block_cmp(const void *a_, const void *b_)
+{
+    const draw_block_t *a = a_, *b = b_;
+    return cmp(a->dist, b->dist);
+}
 
-    if (rend->light.fixed) {
-        mat4_invert(rend->view_mat, m);
-        mat4_irotate(m, -M_PI / 4, 1, 0, 0);
-        mat4_irotate(m, -M_PI / 4, 0, 0, 1);
-        mat4_mul_vec4(m, light_dir, light_dir);
+static void add_draw_block(draw_block_t **blocks, int *nb, int *capacity,
+                           const draw_block_t *block)
+{
+    if (*nb == *capacity) {
+        *capacity = max(64, *capacity * 2);
+        *blocks = realloc(*blocks, *capacity * sizeof(**blocks));
     }
-    vec3_copy(light_dir, out);
+    (*blocks)[(*nb)++] = *block;
 }
 
-void render_get_light_dir(const renderer_t *rend, float out[3])
+// Number of distance buckets used to sort the blocks front to back.
+#define DEPTH_BUCKETS 256
+
+/*
+ * Sort the blocks front to back, so that the depth test rejects the hidden
+ * fragments before the mesh fragment shader runs.  A coarse order is
+ * enough for that, so we use a counting sort on buckets of one block size
+ * of distance, the blocks further away all going into the last one.
+ */
+static void sort_blocks_front_to_back(draw_block_t *blocks, int nb)
 {
-    get_light_dir(rend, out);
+    int count[DEPTH_BUCKETS + 1] = {}, i, b;
+    uint8_t *buckets;
+    draw_block_t *sorted;
+
+    if (nb < 2) return;
+    buckets = malloc(nb);
+    sorted = malloc(nb * sizeof(*sorted));
+    for (i = 0; i < nb; i++) {
+        b = min(sqrtf(blocks[i].dist) / BLOCK_SIZE, DEPTH_BUCKETS - 1);
+        buckets[i] = b;
+        count[b + 1]++;
+    }
+    for (b = 0; b < DEPTH_BUCKETS; b++) count[b + 1] += count[b];
+    for (i = 0; i < nb; i++) sorted[count[buckets[i]]++] = blocks[i];
+    memcpy(blocks, sorted, nb * sizeof(*blocks));
+    free(sorted);
+    free(buckets);
 }
 
-// Compute the minimum projection box to use for the shadow map.
-static void compute_shadow_map_box(
-                const renderer_t *rend,
-                float rect[6])
+// Render a block, inside its occlusion query if it has one to issue.
+static void render_block_occ_(renderer_t *rend, const render_item_t *item,
+                              const int block_pos[3], int effects,
+                              gl_shader_t *shader, const float model[4][4],
+                              occlusion_t *occ, GLuint *bound_buffer)
 {
-    const float POS[8][3] = {
-        {0, 0, 0},
-        {1, 0, 0},
-        {1, 0, 1},
-        {0, 0, 1},
-        {0, 1, 0},
-        {1, 1, 0},
-        {1, 1, 1},
-        {0, 1, 1},
-    };
-    const int N = BLOCK_SIZE;
-
-    render_item_t *item;
-    float p[3];
-    int i, bpos[3];
-    mesh_iterator_t iter;
-    float view_mat[4][4], light_dir[3];
-
-    get_light_dir(rend, light_dir);
-    mat4_lookat(view_mat, light_dir, VEC(0, 0, 0), VEC(0, 1, 0));
-    rect[0] = +FLT_MAX;
-    rect[1] = -FLT_MAX;
-    rect[2] = +FLT_MAX;
-    rect[3] = -FLT_MAX;
-    rect[4] = +FLT_MAX;
-    rect[5] = -FLT_MAX;
+    if (occ && !occ->pending)
+        GL(glBeginQuery(OCCLUSION_QUERY, occ->query));
+    render_block_(rend, item, block_pos, effects, shader, model,
+                  bound_buffer);
+    if (occ && !occ->pending) {
+        GL(glEndQuery(OCCLUSION_QUERY));
+        occ->pending = true;
+    }
+}
 
-    DL_FOREACH(rend->items, item) {
-        if (item->type != ITEM_MESH) continue;
-        iter = mesh_get_iterator(item->mesh, MESH_ITER_BLOCKS);
-        while (mesh_iter(&iter, bpos)) {
-            for (i = 0; i < 8; i++) {
-                vec3_set(p, bpos[0], bpos[1], bpos[2]);
-                vec3_addk(p, POS[i], N, p);
-                mat4_mul_vec3(view_mat, p, p);
-                rect[0] = min(rect[0], p[0]);
-                rect[1] = max(rect[1], p[0]);
-                rect[2] = min(rect[2], p[1]);
-                rect[3] = max(rect[3], p[1]);
-                rect[4] = min(rect[4], -p[2]);
-                rect[5] = max(rect[5], -p[2]);
-            }
-        }
+// Record a block rendered in the first pass of EFFECT_SEE_BACK.
+static void add_drawn_block(int (**drawn)[4], int *nb, int *capacity,
+                            const int pos[3], int lod)
+{
+    if (*nb == *capacity) {
+        *capacity = max(64, *capacity * 2);
+        *drawn = realloc(*drawn, *capacity * sizeof(**drawn));
     }
+    memcpy((*drawn)[*nb], pos, sizeof(int[3]));
+    (*drawn)[(*nb)++][3] = lod;
 }
 
 static void render_mesh_(renderer_t *rend, mesh_t *mesh,
+                         const float model[4][4],
                          const material_t *material, int effects,
-                         const float shadow_mvp[4][4])
+                         const float shadow_mvp[4][4],
+                         const float viewport[4])
 {
-    gl_shader_t *shader;
-    float model[4][4], camera[4][4];
-    int attr, block_pos[3], block_id;
+    gl_shader_t *shader, *prepass_shader;
+    float camera[4][4], mvp[4][4], imodel[4][4], local_camera[3];
+    uint32_t model_key;
+    int attr, block_pos[3], nb_attrs, stride, i;
+    GLuint bound_buffer = 0;
     float light_dir[3], alpha;
-    bool shadow = false;
+    bool shadow = false, occlusion, near, use_lod, prepass, measure;
+    // Blocks rendered in the first pass of EFFECT_SEE_BACK: pos and lod.
+    int (*drawn)[4] = NULL, nb_drawn = 0, drawn_capacity = 0;
+    // The visible blocks, the ones without a render item yet, done after
+    // the others, and the occluded ones whose bounding box we test.
+    draw_block_t block, *blocks = NULL, *pending = NULL, *pend,
+                 *occluded = NULL;
+    int nb_blocks = 0, blocks_capacity = 0;
+    int nb_pending = 0, pending_capacity = 0;
+    int nb_occluded = 0, occluded_capacity = 0;
     mesh_iterator_t iter;
+    const attribute_t *attrs;
+    render_item_t *item;
+    block_item_key_t key;
+    // Only the marching cube effect doesn't use packed vertices.
+    const bool packed = !(effects & EFFECT_MARCHING_CUBES);
+    // Vertex pulling is only done by the main mesh shader, and doesn't
+    // support the subdivided vertices of the smooth shading.
+    const bool faces = HAS_VERTEX_PULLING && g_use_vertex_pulling &&
+                       rend->vertex_pulling && packed &&
+                       rend->settings.smoothness == 0 &&
+                       !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                                    EFFECT_GRID | EFFECT_EDGES |
+                                    EFFECT_WIREFRAME));
+
+    if (    (effects & EFFECT_RAY_MARCHING) &&
+            !(effects & RAY_MARCHING_EXCLUDED_EFFECTS) &&
+            render_mesh_bricks_(rend, mesh, model, material, effects,
+                                shadow_mvp))
+        return;
+
+    // The selections are also ray marched when possible, so that they
+    // don't go through the blocks meshing and the items cache.
+    if (effects & EFFECT_GRID_ONLY) {
+        if (render_mesh_bricks_(rend, mesh, model, material, effects,
+                                shadow_mvp))
+            return;
+        effects &= ~EFFECT_GRID_ONLY;
+    }
 
-    mat4_set_identity(model);
     get_light_dir(rend, light_dir);
 
     if (effects & EFFECT_MARCHING_CUBES)
         effects &= ~EFFECT_BORDERS;
 
-    if (effects & EFFECT_RENDER_POS)
-        shader = shader_get("pos_data", NULL, ATTR_NAMES, shader_init);
+    // The effects that need the individual voxel faces: the borders bump
+    // map, the faces lines, and the voxel positions for picking.
+    if (!(effects & (EFFECT_BORDERS | EFFECT_GRID | EFFECT_EDGES |
+                     EFFECT_WIREFRAME | EFFECT_RENDER_POS)))
+        effects |= EFFECT_MERGE_FACES;
+
+    if (effects & EFFECT_RENDER_POS) {
+        shader_define_t defines[] = {
+            {"PACKED_VERTICES", packed},
+            {"BLOCK_SIZE_32", BLOCK_SIZE == 32},
+            {}
+        };
+        shader = shader_get("pos_data", defines, ATTR_NAMES, shader_init);
+    }
     else if (effects & EFFECT_SHADOW_MAP)
         shader = shader_get("shadow_map", NULL, ATTR_NAMES, shader_init);
     else {
         shadow = rend->settings.shadow;
-        shader_define_t defines[] = {
-            {"SHADOW", shadow},
-            {"MATERIAL_UNLIT", (rend->settings.effects & EFFECT_UNLIT) ||
-                               (effects & EFFECT_EDGES)},
-            {"HAS_TANGENTS", effects & EFFECT_BORDERS},
-            {"ONLY_EDGES", effects & EFFECT_EDGES},
-            {"HAS_OCCLUSION_MAP", rend->settings.occlusion_strength > 0},
-            {"VERTEX_LIGHTNING", !(effects & (EFFECT_BORDERS | EFFECT_UNLIT))},
-            {"SMOOTHNESS", rend->settings.smoothness > 0},
-            {}
-        };
-        shader = shader_get("mesh", defines, ATTR_NAMES, shader_init);
+        shader = get_mesh_shader(&rend->settings, effects, packed, faces,
+                                 false);
     }
 
     GL(glEnable(GL_DEPTH_TEST));
@@ -623,6 +2357,25 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh,
     alpha = material->base_color[3];
     if (effects & EFFECT_SEMI_TRANSPARENT) alpha *= 0.75;
 
+    // The lower levels of details only work for the merged faces, since
+    // the other effects need the individual voxels.
+    use_lod = viewport && (effects & EFFECT_MERGE_FACES) &&
+              !(effects & EFFECT_MARCHING_CUBES);
+
+    // Only opaque blocks can occlude, and we don't use the queries for
+    // the passes that render the faces more than once.
+    occlusion = HAS_OCCLUSION_QUERY && rend->occlusion_culling &&
+                packed && alpha == 1 &&
+                !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                             EFFECT_SEE_BACK | EFFECT_GRID | EFFECT_EDGES |
+                             EFFECT_WIREFRAME));
+
+    // The depth pre-pass only pays off with the most expensive fragment
+    // shader, with the shadows and the borders bump map.
+    prepass = rend->depth_prepass && shadow && alpha == 1 &&
+              (effects & EFFECT_BORDERS) &&
+              !(effects & (EFFECT_SEE_BACK | EFFECT_WIREFRAME));
+
     if (alpha < 1) {
         GL(glEnable(GL_BLEND));
         GL(glBlendFunc(GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR));
@@ -630,84 +2383,210 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh,
     }
 
     GL(glUseProgram(shader->prog));
-
-    if (shadow) {
-        assert(shadow_mvp);
-        GL(glActiveTexture(GL_TEXTURE2));
-        GL(glBindTexture(GL_TEXTURE_2D, g_shadow_map->tex));
-        gl_update_uniform(shader, "u_shadow_mvp", shadow_mvp);
-        gl_update_uniform(shader, "u_shadow_tex", 2);
-        gl_update_uniform(shader, "u_shadow_strength", rend->settings.shadow);
-    }
-
-    gl_update_uniform(shader, "u_proj", rend->proj_mat);
-    gl_update_uniform(shader, "u_view", rend->view_mat);
+    set_light_uniforms(rend, shader, material, light_dir,
+                       shadow ? shadow_mvp : NULL);
     gl_update_uniform(shader, "u_normal_sampler", 0);
     gl_update_uniform(shader, "u_occlusion_tex", 1);
     gl_update_uniform(shader, "u_normal_scale",
                       effects & EFFECT_BORDERS ? 0.5 : 0.0);
-    gl_update_uniform(shader, "u_l_dir", light_dir);
-    gl_update_uniform(shader, "u_l_int", rend->light.intensity);
-    gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
-
-    gl_update_uniform(shader, "u_m_metallic", material->metallic);
-    gl_update_uniform(shader, "u_m_roughness", material->roughness);
-    gl_update_uniform(shader, "u_m_base_color", material->base_color);
-    gl_update_uniform(shader, "u_m_emissive_factor", material->emission);
-    gl_update_uniform(shader, "u_m_smoothness", rend->settings.smoothness);
-
-    gl_update_uniform(shader, "u_occlusion_strength",
-                      rend->settings.occlusion_strength);
-
     mat4_invert(rend->view_mat, camera);
-    gl_update_uniform(shader, "u_camera", camera[3]);
 
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
-        GL(glEnableVertexAttribArray(attr));
+    // With the vertex arrays, the attributes are set in each of them, and
+    // vertex pulling doesn't use any.
+    attrs = get_attributes(packed, &nb_attrs, &stride);
+    if (faces) nb_attrs = 0;
+    for (attr = 0; attr < nb_attrs && !g_use_vao; attr++) {
+        if (attrs[attr].size) GL(glEnableVertexAttribArray(attr));
+    }
 
     GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
 
-    block_id = 1;
+    // The blocks culling and levels of details are computed in the mesh
+    // space, since the model matrix of the instances is a rigid transform.
+    mat4_mul(rend->proj_mat, rend->view_mat, mvp);
+    mat4_imul(mvp, model);
+    mat4_invert(model, imodel);
+    mat4_mul_vec3(imodel, camera[3], local_camera);
+    model_key = XXH32(model, sizeof(float[4][4]), 0);
+
     iter = mesh_get_iterator(mesh,
             MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
     while (mesh_iter(&iter, block_pos)) {
-        render_block_(rend, mesh, &iter, block_pos,
-                      block_id++, material, effects, shader, model);
+        if (block_is_culled(mvp, block_pos, &near)) {
+            rend->stats.nb_culled++;
+            continue;
+        }
+        block = (draw_block_t){
+            .pos = {block_pos[0], block_pos[1], block_pos[2]},
+            .dist = vec3_dist2(local_camera, VEC(
+                    block_pos[0] + BLOCK_SIZE / 2,
+                    block_pos[1] + BLOCK_SIZE / 2,
+                    block_pos[2] + BLOCK_SIZE / 2)),
+        };
+        // We don't trust the queries of the blocks crossing the near
+        // plane, since their bounding box can be clipped.
+        block.occ = (occlusion && !near) ?
+              get_occlusion(rend, mesh, &iter, block_pos, model_key) : NULL;
+        // The bounding boxes of the occluded blocks are tested once all
+        // the other blocks are in the depth buffer.
+        if (block.occ && !block.occ->visible) {
+            rend->stats.nb_occluded++;
+            if (block.occ->pending) continue;
+            add_draw_block(&occluded, &nb_occluded, &occluded_capacity,
+                           &block);
+            continue;
+        }
+        rend->stats.nb_blocks++;
+        if (use_lod) {
+            block.lod = get_block_lod(rend, viewport, local_camera,
+                                      block_pos);
+            if (block.lod) rend->stats.nb_lod++;
+        }
+        add_draw_block(&blocks, &nb_blocks, &blocks_capacity, &block);
+    }
+    if (alpha == 1) sort_blocks_front_to_back(blocks, nb_blocks);
+
+    // Depth pre-pass of the blocks that are ready, so that the shadows
+    // and borders are only computed once per sample.  The pass is pushed
+    // back a bit, so that the main pass still passes the depth test.
+    if (prepass) {
+        profiler_gpu_begin("depth_prepass");
+        prepass_shader = get_mesh_shader(&rend->settings, effects, packed,
+                                         faces, true);
+        GL(glUseProgram(prepass_shader->prog));
+        set_light_uniforms(rend, prepass_shader, material, light_dir, NULL);
+        GL(glColorMask(false, false, false, false));
+        GL(glEnable(GL_POLYGON_OFFSET_FILL));
+        GL(glPolygonOffset(1, 1));
+        for (i = 0; i < nb_blocks; i++) {
+            get_block_item_key(mesh, blocks[i].pos, effects, blocks[i].lod,
+                               faces, &key);
+            item = get_item_for_block(rend, mesh, &key, blocks[i].pos,
+                                      effects, blocks[i].lod, true);
+            if (!item) continue;
+            render_block_(rend, item, blocks[i].pos, effects,
+                          prepass_shader, model, &bound_buffer);
+        }
+        GL(glDisable(GL_POLYGON_OFFSET_FILL));
+        GL(glColorMask(true, true, true, true));
+        GL(glUseProgram(shader->prog));
+        profiler_gpu_end();
     }
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
-        GL(glDisableVertexAttribArray(attr));
 
+    measure = viewport && alpha == 1 && !occlusion &&
+              !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP)) &&
+              overdraw_begin(rend, viewport);
+
+    for (i = 0; i < nb_blocks; i++) {
+        block = blocks[i];
+        // In async mode we first render the blocks that are ready, and
+        // then create the missing ones nearest to the camera first, as
+        // long as we have time in the frame.
+        get_block_item_key(mesh, block.pos, effects, block.lod, faces,
+                           &key);
+        item = get_item_for_block(rend, mesh, &key, block.pos, effects,
+                                  block.lod, rend->async);
+        if (!item) {
+            add_draw_block(&pending, &nb_pending, &pending_capacity,
+                           &block);
+            continue;
+        }
+        render_block_occ_(rend, item, block.pos, effects, shader, model,
+                          block.occ, &bound_buffer);
+        if (effects & EFFECT_SEE_BACK)
+            add_drawn_block(&drawn, &nb_drawn, &drawn_capacity, block.pos,
+                            block.lod);
+    }
+    free(blocks);
+
+    if (nb_pending)
+        qsort(pending, nb_pending, sizeof(*pending), draw_block_cmp);
+    for (i = 0; i < nb_pending; i++) {
+        pend = &pending[i];
+        get_block_item_key(mesh, pend->pos, effects, pend->lod, faces,
+                           &key);
+        item = get_item_for_block(rend, mesh, &key, pend->pos, effects,
+                                  pend->lod, false);
+        if (!item) {
+            rend->stats.nb_pending++;
+            continue;
+        }
+        render_block_occ_(rend, item, pend->pos, effects, shader, model,
+                          pend->occ, &bound_buffer);
+        if (effects & EFFECT_SEE_BACK)
+            add_drawn_block(&drawn, &nb_drawn, &drawn_capacity, pend->pos,
+                            pend->lod);
+    }
+    free(pending);
+    if (measure) overdraw_end();
+
+    if (nb_occluded) {
+        GL(glColorMask(false, false, false, false));
+        GL(glDepthMask(false));
+        for (i = 0; i < nb_occluded; i++) {
+            GL(glBeginQuery(OCCLUSION_QUERY, occluded[i].occ->query));
+            render_occlusion_box(shader, occluded[i].pos, model, faces,
+                                 &bound_buffer);
+            GL(glEndQuery(OCCLUSION_QUERY));
+            occluded[i].occ->pending = true;
+        }
+        GL(glColorMask(true, true, true, true));
+        GL(glDepthMask(true));
+    }
+    free(occluded);
+
+    /*
+     * Second pass of EFFECT_SEE_BACK: the front faces, semi transparent,
+     * over all the back faces.  We only change the states that differ
+     * from the first pass, and redraw the blocks we already selected,
+     * without running the culling and levels of details again.
+     */
     if (effects & EFFECT_SEE_BACK) {
         effects &= ~EFFECT_SEE_BACK;
         effects |= EFFECT_SEMI_TRANSPARENT;
-        render_mesh_(rend, mesh, material, effects, shadow_mvp);
+        GL(glCullFace(GL_BACK));
+        get_light_dir(rend, light_dir);
+        gl_update_uniform(shader, "u_l_dir", light_dir);
+        alpha = material->base_color[3] * 0.75;
+        GL(glEnable(GL_BLEND));
+        GL(glBlendFunc(GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR));
+        GL(glBlendColor(alpha, alpha, alpha, alpha));
+        for (i = 0; i < nb_drawn; i++) {
+            get_block_item_key(mesh, drawn[i], effects, drawn[i][3], faces,
+                               &key);
+            item = get_item_for_block(rend, mesh, &key, drawn[i], effects,
+                                      drawn[i][3], true);
+            if (!item) continue;
+            render_block_(rend, item, drawn[i], effects, shader, model,
+                          &bound_buffer);
+        }
+        free(drawn);
+    }
+
+    if (g_use_vao) vao_bind(0);
+    for (attr = 0; attr < nb_attrs && !g_use_vao; attr++) {
+        if (attrs[attr].size) GL(glDisableVertexAttribArray(attr));
     }
     GL(glDisable(GL_BLEND));
 }
 
-// XXX: this is quite ugly.  We could maybe use a callback of some sort
-// in the renderer instead.
-void render_get_block_pos(renderer_t *rend, const mesh_t *mesh,
+bool render_get_block_pos(const render_blocks_table_t *table,
                           int id, int pos[3])
 {
-    // Basically we simulate the algo of render_mesh_ but without rendering
-    // anything.
-    int block_id, block_pos[3];
-    mesh_iterator_t iter;
-    block_id = 1;
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, block_pos)) {
-        if (block_id == id) {
-            memcpy(pos, block_pos, sizeof(block_pos));
-            return;
-        }
-        block_id++;
-    }
+    if (id <= 0 || id >= table->size) return false;
+    memcpy(pos, table->pos[id], sizeof(table->pos[id]));
+    return true;
 }
 
 void render_mesh(renderer_t *rend, const mesh_t *mesh,
                  const material_t *material, int effects)
+{
+    render_mesh_instance(rend, mesh, mat4_identity, material, effects);
+}
+
+void render_mesh_instance(renderer_t *rend, const mesh_t *mesh,
+                          const float model[4][4],
+                          const material_t *material, int effects)
 {
     render_item_t *item;
     const material_t default_material = MATERIAL_DEFAULT;
@@ -719,6 +2598,7 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
         item = calloc(1, sizeof(*item));
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
+        mat4_copy(model, item->model);
         item->material = *material;
         item->effects = effects | rend->settings.effects;
         item->effects &= ~(EFFECT_GRID | EFFECT_EDGES);
@@ -736,7 +2616,11 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
         item = calloc(1, sizeof(*item));
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
-        item->effects = EFFECT_GRID | EFFECT_BORDERS;
+        mat4_copy(model, item->model);
+        // Keep EFFECT_GRID_ONLY, so that the selections can be rendered
+        // from their brick maps.
+        item->effects = EFFECT_GRID | EFFECT_BORDERS |
+                        (effects & EFFECT_GRID_ONLY);
         item->material = *material;
         vec4_set(item->material.base_color, 0, 0, 0, alpha);
         DL_APPEND(rend->items, item);
@@ -747,6 +2631,7 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
         item = calloc(1, sizeof(*item));
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
+        mat4_copy(model, item->model);
         item->effects = EFFECT_EDGES | EFFECT_BORDERS;
         item->material = *material;
         vec4_set(item->material.base_color, 0, 0, 0, alpha);
@@ -780,23 +2665,112 @@ static void render_model_item(renderer_t *rend, const render_item_t *item,
                    item->tex, light, item->clip_box, item->effects);
 }
 
-static void render_grid_item(renderer_t *rend, const render_item_t *item)
+/*
+ * Overlays batching.
+ *
+ * The untextured model items (lines, boxes, grids...) that follow each
+ * other in the rendering queue with the same effects are merged into a
+ * single model, with the vertices transformed and colored on the CPU, so
+ * that they are rendered with one draw call.
+ */
+
+// Whether the model shader lights an item, using the model normals.
+static bool model_item_is_lit(const render_item_t *item)
+{
+    return item->type == ITEM_MODEL3D && item->model3d->solid &&
+           !(item->effects & (EFFECT_WIREFRAME | EFFECT_NO_SHADING));
+}
+
+static bool model_item_can_batch(const render_item_t *item)
+{
+    if (item->type != ITEM_MODEL3D && item->type != ITEM_GRID) return false;
+    if (item->tex) return false;
+    // The lighting uses the normals in the model space, but the grid
+    // effect uses them in the world space, so we can't have both.
+    if (model_item_is_lit(item) && (item->effects & EFFECT_GRID))
+        return false;
+    return true;
+}
+
+static bool model_items_match(const render_item_t *a, const render_item_t *b)
+{
+    return model_item_can_batch(a) && model_item_can_batch(b) &&
+           a->model3d->solid == b->model3d->solid &&
+           a->model3d->cull == b->model3d->cull &&
+           model_item_is_lit(a) == model_item_is_lit(b) &&
+           a->effects == b->effects &&
+           a->proj_screen == b->proj_screen &&
+           memcmp(a->clip_box, b->clip_box, sizeof(a->clip_box)) == 0;
+}
+
+static void overlay_add_model(const render_item_t *item,
+                              const float mat[4][4])
+{
+    model3d_t *batch = g_overlay_model;
+    const model3d_t *model = item->model3d;
+    model_vertex_t *v;
+    float n[4];
+    int i, j;
+
+    if (batch->nb_vertices + model->nb_vertices > g_overlay_capacity) {
+        g_overlay_capacity = max(1024, g_overlay_capacity * 2);
+        g_overlay_capacity = max(g_overlay_capacity,
+                                 batch->nb_vertices + model->nb_vertices);
+        batch->vertices = realloc(batch->vertices,
+                                  g_overlay_capacity * sizeof(*v));
+    }
+    for (i = 0; i < model->nb_vertices; i++) {
+        v = &batch->vertices[batch->nb_vertices++];
+        *v = model->vertices[i];
+        mat4_mul_vec3(mat, model->vertices[i].pos, v->pos);
+        if (item->effects & EFFECT_GRID) {
+            vec4_set(n, v->normal[0], v->normal[1], v->normal[2], 0);
+            mat4_mul_vec4(mat, n, n);
+            vec3_copy(n, v->normal);
+        }
+        for (j = 0; j < 4; j++)
+            v->color[j] = v->color[j] * item->color[j] / 255;
+    }
+}
+
+static void overlay_add_item(const render_item_t *item)
 {
     int x, y, n;
     float model_mat[4][4];
 
+    if (item->type == ITEM_MODEL3D) {
+        overlay_add_model(item, item->mat);
+        return;
+    }
+    // The grids are made of 6x6 tiles of the grid model.
     n = 3;
     for (y = -n; y < n; y++)
     for (x = -n; x < n; x++) {
         mat4_copy(item->mat, model_mat);
         mat4_translate(model_mat, x + 0.5, y + 0.5, 0, model_mat);
-        model3d_render(item->model3d,
-                       model_mat, rend->view_mat, rend->proj_mat,
-                       item->color, NULL, NULL, item->clip_box,
-                       item->effects);
+        overlay_add_model(item, model_mat);
     }
 }
 
+// Render the batched items, using the state of the last one.
+static void overlay_flush(renderer_t *rend, const render_item_t *item,
+                          const float viewport[4])
+{
+    render_item_t batch = *item;
+
+    if (!g_overlay_model->nb_vertices) return;
+    g_overlay_model->solid = item->model3d->solid;
+    g_overlay_model->cull = item->model3d->cull;
+    g_overlay_model->dirty = true;
+    batch.model3d = g_overlay_model;
+    mat4_set_identity(batch.mat);
+    copy_color(NULL, batch.color);
+    if (!model_item_is_lit(item)) batch.effects |= EFFECT_NO_SHADING;
+    render_model_item(rend, &batch, viewport);
+    g_overlay_model->nb_vertices = 0;
+    rend->stats.nb_overlay_draws++;
+}
+
 void render_grid(renderer_t *rend, const float plane[4][4],
                  const uint8_t color[4], const float clip_box[4][4])
 {
@@ -930,21 +2904,106 @@ static int item_sort_cmp(const render_item_t *a, const render_item_t *b)
 }
 
 
+/*
+ * Reduce the x and y extents of the shadow map box to the part seen by the
+ * view frustum, so that the resolution is spent where the viewer looks.
+ * The depth extent is kept, since objects outside of the view can still
+ * cast shadows into it.
+ */
+static void fit_shadow_map_box_to_view(const renderer_t *rend,
+                                       const float light_view[4][4],
+                                       float rect[6])
+{
+    float mat[4][4], p[4], r[4] = {+FLT_MAX, -FLT_MAX, +FLT_MAX, -FLT_MAX};
+    int i;
+
+    mat4_mul(rend->proj_mat, rend->view_mat, mat);
+    if (!mat4_invert(mat, mat)) return;
+    for (i = 0; i < 8; i++) {
+        vec4_set(p, (i & 1) ? 1 : -1, (i & 2) ? 1 : -1, (i & 4) ? 1 : -1, 1);
+        mat4_mul_vec4(mat, p, p);
+        if (p[3] <= 0) return;
+        vec3_imul(p, 1 / p[3]);
+        mat4_mul_vec3(light_view, p, p);
+        r[0] = min(r[0], p[0]);
+        r[1] = max(r[1], p[0]);
+        r[2] = min(r[2], p[1]);
+        r[3] = max(r[3], p[1]);
+    }
+    // Nothing visible, no need to change anything.
+    if (r[0] >= rect[1] || r[1] <= rect[0] ||
+        r[2] >= rect[3] || r[3] <= rect[2]) return;
+    rect[0] = max(rect[0], r[0]);
+    rect[1] = min(rect[1], r[1]);
+    rect[2] = max(rect[2], r[2]);
+    rect[3] = min(rect[3], r[3]);
+}
+
+// The map is only fitted to the view if there is a single view per frame.
+static bool shadow_map_fits_view(const renderer_t *rend)
+{
+    return rend->settings.shadow_fit_view && rend->views.nb <= 1;
+}
+
+// Compute a key for the shadow map: it only depends on the rendered meshes,
+// the light direction, and the view if we fit the map to it.
+static uint32_t get_shadow_map_key(const renderer_t *rend,
+                                   const float light_dir[3])
+{
+    render_item_t *item;
+    uint32_t key;
+    uint64_t k;
+    int effects;
+
+    key = XXH32(light_dir, 3 * sizeof(float), 0);
+    DL_FOREACH(rend->items, item) {
+        if (item->type != ITEM_MESH) continue;
+        k = mesh_get_key(item->mesh);
+        effects = item->effects & (EFFECT_MARCHING_CUBES | EFFECT_BORDERS);
+        key = XXH32(&k, sizeof(k), key);
+        key = XXH32(item->model, sizeof(item->model), key);
+        key = XXH32(&effects, sizeof(effects), key);
+    }
+    if (shadow_map_fits_view(rend)) {
+        key = XXH32(rend->view_mat, sizeof(rend->view_mat), key);
+        key = XXH32(rend->proj_mat, sizeof(rend->proj_mat), key);
+    }
+    return key ?: 1;
+}
+
 static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
 {
     render_item_t *item;
     float rect[6], light_dir[3];
     int effects;
-    // Create a renderer looking at the scene from the light.
-    compute_shadow_map_box(rend, rect);
-    float bias_mat[4][4] = {{0.5, 0.0, 0.0, 0.0},
-                            {0.0, 0.5, 0.0, 0.0},
-                            {0.0, 0.0, 0.5, 0.0},
-                            {0.5, 0.5, 0.5, 1.0}};
+    uint32_t key;
+    const float bias_mat[4][4] = {{0.5, 0.0, 0.0, 0.0},
+                                  {0.0, 0.5, 0.0, 0.0},
+                                  {0.0, 0.0, 0.5, 0.0},
+                                  {0.5, 0.5, 0.5, 1.0}};
     float ret[4][4];
-    renderer_t srend = {};
+    renderer_t srend = {.async = rend->async};
+
+    // The other views of the frame use the map of the first one, and the
+    // items drawn over a render use the map of that render.
+    if (g_shadow_map_fbo && (rend->views.current > 0 || rend->keep_target)) {
+        mat4_copy(g_shadow_map_mvp, shadow_mvp);
+        return;
+    }
+
+    // Reuse the last shadow map if nothing changed.
     get_light_dir(rend, light_dir);
+    key = get_shadow_map_key(rend, light_dir);
+    if (g_shadow_map_fbo && key == g_shadow_map_key) {
+        mat4_copy(g_shadow_map_mvp, shadow_mvp);
+        return;
+    }
+
+    // Create a renderer looking at the scene from the light.
+    compute_shadow_map_box(rend, rect);
     mat4_lookat(srend.view_mat, light_dir, VEC(0, 0, 0), VEC(0, 1, 0));
+    if (shadow_map_fits_view(rend))
+        fit_shadow_map_box_to_view(rend, srend.view_mat, rect);
     mat4_ortho(srend.proj_mat,
                rect[0], rect[1], rect[2], rect[3], rect[4], rect[5]);
 
@@ -952,7 +3011,10 @@ static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
     if (!g_shadow_map_fbo) {
         GL(glGenFramebuffers(1, &g_shadow_map_fbo));
         GL(glBindFramebuffer(GL_FRAMEBUFFER, g_shadow_map_fbo));
-        #ifndef GLES2
+        #if defined(GLES3)
+        GL(glDrawBuffers(1, (GLenum[]){GL_NONE}));
+        GL(glReadBuffer(GL_NONE));
+        #elif !defined(GLES2)
         GL(glDrawBuffer(GL_NONE));
         GL(glReadBuffer(GL_NONE));
         #endif
@@ -974,15 +3036,23 @@ static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
 
     DL_FOREACH(rend->items, item) {
         if (item->type == ITEM_MESH) {
-            effects = (item->effects & EFFECT_MARCHING_CUBES);
+            // Keep the effects that change the vertices, so that we can
+            // reuse the blocks items.
+            effects = item->effects & (EFFECT_MARCHING_CUBES |
+                                       EFFECT_BORDERS);
             effects |= EFFECT_SHADOW_MAP;
-            render_mesh_(&srend, item->mesh, &item->material, effects, NULL);
+            render_mesh_(&srend, item->mesh, item->model, &item->material,
+                         effects, NULL, NULL);
         }
     }
     mat4_copy(bias_mat, ret);
     mat4_imul(ret, srend.proj_mat);
     mat4_imul(ret, srend.view_mat);
     mat4_copy(ret, shadow_mvp);
+
+    // Don't keep the map if some blocks were not ready yet.
+    g_shadow_map_key = srend.stats.nb_pending ? 0 : key;
+    mat4_copy(ret, g_shadow_map_mvp);
 }
 
 static void render_background(renderer_t *rend, const uint8_t col[4])
@@ -1027,6 +3097,7 @@ static void render_background(renderer_t *rend, const uint8_t col[4])
     GL(glVertexAttribPointer(4, 4, GL_FLOAT, false, sizeof(vertex_t),
                              (void*)(intptr_t)offsetof(vertex_t, color)));
     GL(glDepthMask(false));
+    counter_add(COUNTER_GL_DRAW_CALLS, 1);
     GL(glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0));
     GL(glDepthMask(true));
 }
@@ -1040,9 +3111,17 @@ void render_submit(renderer_t *rend, const float viewport[4],
     bool shadow = rend->settings.shadow &&
         !(rend->settings.effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
 
+    rend->stats = (render_stats_t){.overdraw = g_overdraw.value};
+    if (rend->blocks_table) {
+        rend->blocks_table->size = 1;
+        rend->blocks_table->overflow = false;
+    }
+    profiler_gpu_begin("render_submit");
     if (shadow) {
         GL(glDisable(GL_SCISSOR_TEST));
+        profiler_gpu_begin("shadow_map");
         render_shadow_map(rend, shadow_mvp);
+        profiler_gpu_end();
     }
 
     GL(glBindFramebuffer(GL_FRAMEBUFFER, rend->fbo));
@@ -1052,21 +3131,27 @@ void render_submit(renderer_t *rend, const float viewport[4],
     GL(glScissor(viewport[0] * s, viewport[1] * s,
                  viewport[2] * s, viewport[3] * s));
     GL(glLineWidth(rend->scale));
-    render_background(rend, clear_color);
+    if (!rend->keep_target) render_background(rend, clear_color);
 
+    profiler_gpu_begin("render_items");
     DL_SORT(rend->items, item_sort_cmp);
     DL_FOREACH_SAFE(rend->items, item, tmp) {
         switch (item->type) {
         case ITEM_MESH:
-            render_mesh_(rend, item->mesh, &item->material, item->effects,
-                         shadow_mvp);
+            render_mesh_(rend, item->mesh, item->model, &item->material,
+                         item->effects, shadow_mvp, viewport);
             mesh_delete(item->mesh);
             break;
         case ITEM_MODEL3D:
-            render_model_item(rend, item, viewport);
-            break;
         case ITEM_GRID:
-            render_grid_item(rend, item);
+            if (!model_item_can_batch(item)) {
+                render_model_item(rend, item, viewport);
+                rend->stats.nb_overlay_draws++;
+                break;
+            }
+            overlay_add_item(item);
+            if (!tmp || !model_items_match(item, tmp))
+                overlay_flush(rend, item, viewport);
             break;
         default:
             assert(false);
@@ -1076,9 +3161,107 @@ void render_submit(renderer_t *rend, const float viewport[4],
         free(item);
     }
     assert(rend->items == NULL);
+    profiler_gpu_end();
+
+    if (rend->views.current + 1 >= rend->views.nb) {
+        g_frame++;
+        mesh_jobs_cleanup(false);
+        occlusions_cleanup(false);
+        brickmap_end_frame();
+        arenas_flush();
+        overdraw_update();
+    }
+    profiler_gpu_end();
+}
+
+uint32_t render_get_key(const renderer_t *rend, const float viewport[4],
+                        const uint8_t clear_color[4])
+{
+    const render_item_t *item;
+    const render_settings_t *settings = &rend->settings;
+    uint32_t key = 0;
+    uint64_t mesh_key;
+    int tex_flags;
+
+    key = XXH32(rend->view_mat, sizeof(rend->view_mat), key);
+    key = XXH32(rend->proj_mat, sizeof(rend->proj_mat), key);
+    key = XXH32(&rend->scale, sizeof(rend->scale), key);
+    key = XXH32(&rend->light.pitch, sizeof(rend->light.pitch), key);
+    key = XXH32(&rend->light.yaw, sizeof(rend->light.yaw), key);
+    key = XXH32(&rend->light.fixed, sizeof(rend->light.fixed), key);
+    key = XXH32(&rend->light.intensity, sizeof(rend->light.intensity), key);
+    key = XXH32(&settings->ambient, sizeof(settings->ambient), key);
+    key = XXH32(&settings->smoothness, sizeof(settings->smoothness), key);
+    key = XXH32(&settings->shadow, sizeof(settings->shadow), key);
+    key = XXH32(&settings->effects, sizeof(settings->effects), key);
+    key = XXH32(&settings->occlusion_strength,
+                sizeof(settings->occlusion_strength), key);
+    key = XXH32(&settings->shadow_fit_view,
+                sizeof(settings->shadow_fit_view), key);
+    key = XXH32(viewport, 4 * sizeof(float), key);
+    if (clear_color) key = XXH32(clear_color, 4, key);
+
+    DL_FOREACH(rend->items, item) {
+        key = XXH32(&item->type, sizeof(item->type), key);
+        key = XXH32(&item->effects, sizeof(item->effects), key);
+        key = XXH32(item->color, sizeof(item->color), key);
+        key = XXH32(&item->proj_screen, sizeof(item->proj_screen), key);
+        key = XXH32(item->model, sizeof(item->model), key);
+        key = XXH32(item->clip_box, sizeof(item->clip_box), key);
+        key = XXH32(&item->material, sizeof(item->material), key);
+        key = XXH32(&item->model3d, sizeof(item->model3d), key);
+        if (item->type == ITEM_MESH) {
+            mesh_key = mesh_get_key(item->mesh);
+            key = XXH32(&mesh_key, sizeof(mesh_key), key);
+        } else {
+            key = XXH32(item->mat, sizeof(item->mat), key);
+        }
+        if (item->tex) {
+            // The flags change when an async texture gets its data.
+            tex_flags = item->tex->flags;
+            key = XXH32(&item->tex, sizeof(item->tex), key);
+            key = XXH32(&tex_flags, sizeof(tex_flags), key);
+        }
+    }
+    return key ?: 1;
+}
+
+void render_discard(renderer_t *rend)
+{
+    render_item_t *item;
+    while ((item = rend->items)) {
+        DL_DELETE(rend->items, item);
+        if (item->type == ITEM_MESH) mesh_delete(item->mesh);
+        texture_delete(item->tex);
+        free(item);
+    }
+}
+
+void render_on_low_memory(renderer_t *rend, bool all)
+{
+    cache_stats_t stats;
+    // Only keep the most recently used half of the items.
+    cache_get_stats(g_items_cache, &stats);
+    cache_shrink(g_items_cache, all ? 0 : stats.size / 2);
+    mesh_vertices_cache_clear();
 }
 
-void render_on_low_memory(renderer_t *rend)
+void render_set_cache_budget(int size)
 {
-    cache_clear(g_items_cache);
+    g_items_cache_budget = size;
+    if (g_items_cache) cache_set_max_size(g_items_cache, size);
+}
+
+int render_get_cache_budget(void)
+{
+    return g_items_cache_budget;
+}
+
+void render_get_cache_stats(cache_stats_t *stats)
+{
+    if (!g_items_cache) {
+        *stats = (cache_stats_t){.max_size = g_items_cache_budget};
+        return;
+    }
+    cache_get_stats(g_items_cache, stats);
 }
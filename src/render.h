@@ -22,6 +22,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "utils/cache.h"
+
 enum {
     EFFECT_RENDER_POS       = 1 << 1,
     EFFECT_BORDERS          = 1 << 3,
@@ -42,6 +44,17 @@ enum {
     EFFECT_PROJ_SCREEN      = 1 << 16, // Image project in screen.
     EFFECT_ANTIALIASING     = 1 << 17,
     EFFECT_UNLIT            = 1 << 18,
+
+    // Merge the coplanar faces of same color into bigger quads when
+    // generating the blocks vertices.
+    EFFECT_MERGE_FACES      = 1 << 19,
+    // Ignore the occlusion and the smooth normals, so that all the faces
+    // can be merged.  For the exports that only use the flat normals.
+    EFFECT_FLAT_FACES       = 1 << 20,
+    // Render the meshes by ray marching their voxels from a brick map
+    // instead of rasterizing the blocks quads, when possible.  See
+    // brickmap.h.
+    EFFECT_RAY_MARCHING     = 1 << 21,
 };
 
 typedef struct {
@@ -50,10 +63,40 @@ typedef struct {
     float shadow;
     int   effects;
     float occlusion_strength;
+    // If set, the shadow map only covers the visible part of the scene.
+    bool  shadow_fit_view;
 } render_settings_t;
 
 typedef struct renderer renderer_t;
+
+// The blocks ids written into the pick buffer use 17 bits.  With blocks of
+// 32, the 3 low bits give the 16^3 cube of the block the voxel is in.
+#define RENDER_PICK_SUB_BITS (BLOCK_SIZE > 16 ? 3 : 0)
+#define RENDER_MAX_BLOCK_ID ((1 << (17 - RENDER_PICK_SUB_BITS)) - 1)
+
+// Positions of the blocks rendered with EFFECT_RENDER_POS, indexed by the
+// block ids written into the pick buffer.  The id zero means no block.
+typedef struct {
+    int     (*pos)[3];
+    int     size;       // Number of ids used, including zero.
+    int     allocated;
+    bool    overflow;   // Set if some blocks didn't get an id.
+} render_blocks_table_t;
 typedef struct render_item_t render_item_t;
+
+// Blocks rendering statistics of the last submitted frame.
+typedef struct {
+    int nb_blocks;          // Number of blocks drawn.
+    int nb_culled;          // Number of blocks culled.
+    int nb_occluded;        // Number of blocks hidden by other blocks.
+    int nb_lod;             // Number of blocks drawn with a lower lod.
+    int nb_pending;         // Number of blocks waiting for their mesh.
+    int nb_ray_marched;     // Number of meshes rendered by ray marching.
+    int nb_overlay_draws;   // Number of draws of the overlay items.
+    // Average number of opaque mesh samples shaded per viewport sample,
+    // measured a few frames ago, or zero if not known.
+    float overdraw;
+} render_stats_t;
 struct renderer
 {
     float view_mat[4][4];
@@ -70,14 +113,82 @@ struct renderer
 
     render_settings_t settings;
 
+    // If set, the blocks are meshed in background threads when they take
+    // too long to generate, and are not rendered until they are ready.
+    bool             async;
+
+    // If set, use the occlusion queries results of the previous frames to
+    // skip the blocks hidden by other blocks.
+    bool             occlusion_culling;
+
+    // If set, generate the blocks quads with a compute shader when the GL
+    // context supports it, see gpu_mesher.h.
+    bool             gpu_meshing;
+
+    // If set, upload the blocks quads as one voxel_face_t each, and let
+    // the vertex shader expand them, when the GL context supports it.
+    bool             vertex_pulling;
+
+    // If set, create the buffers of the blocks meshed in the background
+    // on an upload thread, with a second GL context shared with the main
+    // one, when the system provides it.
+    bool             background_uploads;
+
+    // If set, first render the depth of the opaque blocks when they use
+    // the shadows and the borders, so that their expensive fragment shader
+    // only runs for the visible samples.
+    bool             depth_prepass;
+
+    // If set, render_submit draws the items over the current content of the
+    // target, without clearing it, and with the shadow map of the last
+    // submit, so that a few items can be added to a cached render.
+    bool             keep_target;
+
+    // Set when several views of the same frame are submitted one after the
+    // other.  The views share the shadow map, that is then not fitted to
+    // any of them, and keep their own occlusion culling state.  The frame
+    // ends with the submit of the last view.
+    struct {
+        int  nb;
+        int  current;
+    } views;
+
+    render_stats_t   stats;
+
+    // If set, filled with the positions of the blocks rendered with
+    // EFFECT_RENDER_POS.  It is reset by render_submit.
+    render_blocks_table_t *blocks_table;
+
     render_item_t    *items;
 };
 
 void render_init(void);
 void render_deinit(void);
+
+/*
+ * Function: render_prepare_shaders
+ * Create the shaders used to render the meshes with the current settings,
+ * and with any one of the shadow, borders, smoothness, unlit, occlusion
+ * and marching cubes settings toggled, so that changing them doesn't
+ * stall the rendering.
+ */
+void render_prepare_shaders(const renderer_t *rend);
 void render_mesh(renderer_t *rend, const mesh_t *mesh,
                  const material_t *material,
                  int effects);
+
+/*
+ * Function: render_mesh_instance
+ * Render a mesh with a model matrix.
+ *
+ * The matrix should be a rigid transformation: it is used to render the
+ * clone layers as instances of their base layer mesh, sharing the same
+ * blocks vertex buffers.
+ */
+void render_mesh_instance(renderer_t *rend, const mesh_t *mesh,
+                          const float model[4][4],
+                          const material_t *material, int effects);
+
 void render_grid(renderer_t *rend, const float plane[4][4],
                  const uint8_t color[4], const float clip_box[4][4]);
 void render_line(renderer_t *rend, const float a[3], const float b[3],
@@ -105,15 +216,67 @@ void render_rect(renderer_t *rend, const float plane[4][4], int effects);
 //  clear_color: clear the screen with this first.
 void render_submit(renderer_t *rend, const float viewport[4],
                    const uint8_t clear_color[4]);
+
+/*
+ * Function: render_get_key
+ * Compute a key of the queued items and of the renderer settings.
+ *
+ * If the key is the same as the one of a previous submit with the same
+ * arguments, and that submit had no pending blocks, it would render the
+ * same image, so a copy of it can be used instead.
+ */
+uint32_t render_get_key(const renderer_t *rend, const float viewport[4],
+                        const uint8_t clear_color[4]);
+
+/*
+ * Function: render_discard
+ * Remove all the queued items without rendering them.
+ */
+void render_discard(renderer_t *rend);
+
 // Compute the light direction in the model coordinates (toward the light)
 void render_get_light_dir(const renderer_t *rend, float out[3]);
 
-// Ugly function that return the position of the block at a given id
-// when the mesh is rendered with render_mesh.
-void render_get_block_pos(renderer_t *rend, const mesh_t *mesh,
+/*
+ * Function: render_get_block_pos
+ * Return the position of the block at a given id of the pick buffer.
+ *
+ * Parameters:
+ *   table - The blocks table filled when rendering the pick buffer.
+ *   id    - A block id read from the pick buffer.
+ *   pos   - Set to the position of the block.
+ *
+ * Return:
+ *   False if no block has this id.
+ */
+bool render_get_block_pos(const render_blocks_table_t *table,
                           int id, int pos[3]);
 
-// Attempt to release some memory.
-void render_on_low_memory(renderer_t *rend);
+/*
+ * Function: render_on_low_memory
+ * Release some of the cached blocks vertices.
+ *
+ * Parameters:
+ *   rend - The renderer.
+ *   all  - If set, release all the cached items, otherwise only the least
+ *          recently used half of them.
+ */
+void render_on_low_memory(renderer_t *rend, bool all);
+
+/*
+ * Function: render_set_cache_budget
+ * Set the maximum memory (in bytes) used by the blocks vertex buffers.
+ *
+ * The least recently used blocks are released when the budget is reached.
+ */
+void render_set_cache_budget(int size);
+
+int render_get_cache_budget(void);
+
+/*
+ * Function: render_get_cache_stats
+ * Get the usage statistics of the blocks vertex buffers cache.
+ */
+void render_get_cache_stats(cache_stats_t *stats);
 
 #endif // RENDER_H
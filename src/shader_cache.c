@@ -20,13 +20,97 @@
 #include "goxel.h"
 
 #include "shader_cache.h"
+#include "xxhash.h"
 
 typedef struct {
     char key[256];
     gl_shader_t *shader;
 } shader_t;
 
-static shader_t g_shaders[16] = {};
+static shader_t g_shaders[32] = {};
+
+/*
+ * Programs binaries cache.
+ *
+ * The linked programs are saved in the user directory, so that we don't
+ * have to compile them again at the next launch.  The files are named
+ * after a hash of the sources, defines, attributes and driver version, so
+ * that any change gives a new file.  The file format is:
+ *
+ *   'GXSB' magic, int32 binary format, then the binary data.
+ */
+
+static uint32_t get_binary_key(const char *code, const char *pre,
+                               const char **attr_names)
+{
+    uint32_t key = 0;
+    const char *str;
+    int i;
+    const GLenum infos[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+
+    for (i = 0; i < ARRAY_SIZE(infos); i++) {
+        GL(str = (const char*)glGetString(infos[i]));
+        if (str) key = XXH32(str, strlen(str), key);
+    }
+    key = XXH32(code, strlen(code), key);
+    key = XXH32(pre, strlen(pre), key);
+    for (i = 0; attr_names && attr_names[i]; i++)
+        key = XXH32(attr_names[i], strlen(attr_names[i]), key);
+    return key;
+}
+
+static bool get_binary_path(uint32_t key, char *path, int size)
+{
+    const char *dir;
+    if (!gl_has_program_binary()) return false;
+    dir = sys_get_user_dir();
+    if (!dir || !*dir) return false;
+    snprintf(path, size, "%s/shaders/%08x.bin", dir, key);
+    return true;
+}
+
+static gl_shader_t *load_binary(uint32_t key)
+{
+    char path[1024], *data;
+    int size, format;
+    gl_shader_t *shader;
+
+    if (!get_binary_path(key, path, sizeof(path))) return NULL;
+    data = read_file(path, &size);
+    if (!data) return NULL;
+    if (size <= 8 || memcmp(data, "GXSB", 4) != 0) {
+        free(data);
+        return NULL;
+    }
+    memcpy(&format, data + 4, 4);
+    shader = gl_shader_create_from_binary(format, data + 8, size - 8);
+    free(data);
+    if (!shader) LOG_I("Outdated shader binary %s", path);
+    return shader;
+}
+
+static void save_binary(uint32_t key, const gl_shader_t *shader)
+{
+    char path[1024];
+    void *data;
+    int size, format;
+    FILE *file;
+
+    if (!get_binary_path(key, path, sizeof(path))) return;
+    data = gl_shader_get_binary(shader, &format, &size);
+    if (!data) return;
+    sys_make_dir(path);
+    file = fopen(path, "wb");
+    if (file) {
+        fwrite("GXSB", 4, 1, file);
+        fwrite(&format, 4, 1, file);
+        fwrite(data, size, 1, file);
+        fclose(file);
+    } else {
+        LOG_W("Cannot write %s", path);
+    }
+    free(data);
+}
 
 gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
                         const char **attr_names,
@@ -39,7 +123,7 @@ gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
     char path[128];
     char pre[256] = {};
     const shader_define_t *define;
-
+    uint32_t binary_key;
 
     // Create the key of the form:
     // <name>_define1_define2
@@ -65,10 +149,22 @@ gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
     assert(code);
 
     for (define = defines; define && define->name; define++) {
-        if (define->set)
+        if (!define->set) continue;
+        if (define->name[0] == '#') {
+            // Those have to come first (#version).
+            memmove(pre + strlen(define->name) + 1, pre, strlen(pre) + 1);
+            memcpy(pre, define->name, strlen(define->name));
+            pre[strlen(define->name)] = '\n';
+        } else {
             sprintf(pre + strlen(pre), "#define %s\n", define->name);
+        }
+    }
+    binary_key = get_binary_key(code, pre, attr_names);
+    s->shader = load_binary(binary_key);
+    if (!s->shader) {
+        s->shader = gl_shader_create(code, code, pre, attr_names);
+        if (s->shader) save_binary(binary_key, s->shader);
     }
-    s->shader = gl_shader_create(code, code, pre, attr_names);
     if (on_created) on_created(s->shader);
     return s->shader;
 }
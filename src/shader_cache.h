@@ -21,6 +21,8 @@
 
 #include "goxel.h"
 
+// A define of a shader.  The names starting with '#' are added as they are,
+// for example to set the GLSL version.
 typedef struct {
     const char  *name;
     bool        set;
@@ -103,18 +103,42 @@ static float cylinder_func(const float p[3], const float s[3],
     return min(rz, r - d);
 }
 
+/*
+ * Define a row version of a shape function.  The point is moved
+ * incrementally along the row, and the shape function gets inlined into
+ * the loop, so that the compiler can vectorize it.
+ */
+#define SHAPE_ROW_FUNC(name, func) \
+static void name(const float p[3], const float dp[3], int n, \
+                 const float s[3], float smoothness, float *out) \
+{ \
+    int i; \
+    for (i = 0; i < n; i++) { \
+        out[i] = func(VEC(p[0] + i * dp[0], \
+                          p[1] + i * dp[1], \
+                          p[2] + i * dp[2]), s, smoothness); \
+    } \
+}
+
+SHAPE_ROW_FUNC(sphere_func_row, sphere_func)
+SHAPE_ROW_FUNC(cube_func_row, cube_func)
+SHAPE_ROW_FUNC(cylinder_func_row, cylinder_func)
+
 void shapes_init(void)
 {
     shape_sphere = (shape_t){
         .id     = "sphere",
         .func   = sphere_func,
+        .func_row = sphere_func_row,
     };
     shape_cube = (shape_t){
         .id     = "cube",
         .func   = cube_func,
+        .func_row = cube_func_row,
     };
     shape_cylinder = (shape_t){
         .id     = "cylinder",
         .func = cylinder_func,
+        .func_row = cylinder_func_row,
     };
 }
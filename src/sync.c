@@ -0,0 +1,502 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "sync.h"
+#include "xxhash.h"
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Protocol
+ * ========
+ *
+ * The messages start with a 4 bytes type and a 4 bytes payload size.
+ *
+ * HELO: sent first by both sides:
+ *      4 bytes: protocol version.
+ *      4 bytes: instance id.
+ *
+ * BLKS: some modified cubes:
+ *      4 bytes: number of cubes.
+ *      for each cube:
+ *          4 bytes: x
+ *          4 bytes: y
+ *          4 bytes: z
+ *          4 bytes: version
+ *          4 bytes: id of the instance that did the edit
+ *      n bytes: the cubes voxels, encoded with gox_encode_blocks.
+ */
+
+#define PROTOCOL_VERSION 1
+// Size of the cubes we send.  This is the gox file blocks size.
+#define CUBE_SIZE 16
+#define CUBE_DIM ((int[]){CUBE_SIZE, CUBE_SIZE, CUBE_SIZE})
+#define CUBE_VOXELS (CUBE_SIZE * CUBE_SIZE * CUBE_SIZE)
+// Maximum number of cubes per BLKS message.
+#define MAX_CUBES 256
+// Reject the messages bigger than that.
+#define MAX_MESSAGE_SIZE (64 * MB)
+
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint32_t        version;
+    uint32_t        peer;   // Id of the instance that did the last edit.
+    bool            dirty;  // Used to collect the changed cubes.
+} cube_t;
+
+typedef struct {
+    uint8_t *data;
+    int     size;
+    int     allocated;
+} buffer_t;
+
+typedef struct {
+    int32_t     pos[3];
+    uint32_t    version;
+    uint32_t    peer;
+} cube_header_t;
+
+struct sync {
+    int             fd;
+    int             listen_fd;
+    uint32_t        id;
+    bool            hello_received;
+    const mesh_t    *mesh;          // Mesh of the last update.
+    uint64_t        mesh_version;   // Its version after the last update.
+    bool            full;           // Send all the blocks at the next update.
+    cube_t          *cubes;
+    buffer_t        out;
+    buffer_t        in;
+    sync_stats_t    stats;
+};
+
+static int floor_div(int x, int n)
+{
+    return (x >= 0) ? x / n : -((-x + n - 1) / n);
+}
+
+static void buffer_append(buffer_t *buf, const void *data, int size)
+{
+    if (buf->size + size > buf->allocated) {
+        buf->allocated = max(buf->size + size, buf->allocated * 2);
+        buf->data = realloc(buf->data, buf->allocated);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void buffer_consume(buffer_t *buf, int size)
+{
+    memmove(buf->data, buf->data + size, buf->size - size);
+    buf->size -= size;
+}
+
+static void send_message(sync_t *sync, const char type[4], int size,
+                         const void *data)
+{
+    buffer_append(&sync->out, type, 4);
+    buffer_append(&sync->out, &size, 4);
+    if (size) buffer_append(&sync->out, data, size);
+}
+
+// Start a connection on a connected socket.
+static void sync_start(sync_t *sync, int fd)
+{
+    uint32_t hello[2] = {PROTOCOL_VERSION, sync->id};
+    int one = 1;
+
+    sync->fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    send_message(sync, "HELO", sizeof(hello), hello);
+    sync->full = true;
+}
+
+static sync_t *sync_alloc(void)
+{
+    sync_t *sync = calloc(1, sizeof(*sync));
+    double t = sys_get_time();
+    pid_t pid = getpid();
+
+    sync->fd = -1;
+    sync->listen_fd = -1;
+    sync->id = XXH32(&t, sizeof(t), XXH32(&pid, sizeof(pid), 0));
+    return sync;
+}
+
+sync_t *sync_new(int fd)
+{
+    sync_t *sync = sync_alloc();
+    sync_start(sync, fd);
+    return sync;
+}
+
+sync_t *sync_listen(int port)
+{
+    int fd, one = 1;
+    struct sockaddr_in addr = {};
+    sync_t *sync;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) goto error;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) goto error;
+    if (listen(fd, 1) != 0) goto error;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    sync = sync_alloc();
+    sync->listen_fd = fd;
+    LOG_I("Sync waiting for a connection on port %d", port);
+    return sync;
+
+error:
+    LOG_E("Cannot listen on port %d: %s", port, strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+sync_t *sync_connect(const char *host, int port)
+{
+    struct addrinfo hints = {}, *res, *ai;
+    char service[16];
+    int fd = -1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        LOG_E("Cannot resolve %s", host);
+        return NULL;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        LOG_E("Cannot connect to %s:%d", host, port);
+        return NULL;
+    }
+    LOG_I("Sync connected to %s:%d", host, port);
+    return sync_new(fd);
+}
+
+void sync_delete(sync_t *sync)
+{
+    cube_t *cube, *tmp;
+    if (!sync) return;
+    if (sync->fd >= 0) close(sync->fd);
+    if (sync->listen_fd >= 0) close(sync->listen_fd);
+    HASH_ITER(hh, sync->cubes, cube, tmp) {
+        HASH_DEL(sync->cubes, cube);
+        free(cube);
+    }
+    free(sync->out.data);
+    free(sync->in.data);
+    free(sync);
+}
+
+static cube_t *get_cube(sync_t *sync, const int pos[3])
+{
+    cube_t *cube;
+    HASH_FIND(hh, sync->cubes, pos, sizeof(cube->pos), cube);
+    if (cube) return cube;
+    cube = calloc(1, sizeof(*cube));
+    memcpy(cube->pos, pos, sizeof(cube->pos));
+    HASH_ADD(hh, sync->cubes, pos, sizeof(cube->pos), cube);
+    return cube;
+}
+
+static void add_cube(cube_t *cube, cube_t ***list, int *nb, int *allocated)
+{
+    if (cube->dirty) return;
+    cube->dirty = true;
+    if (*nb >= *allocated) {
+        *allocated = max(256, *allocated * 2);
+        *list = realloc(*list, *allocated * sizeof(**list));
+    }
+    (*list)[(*nb)++] = cube;
+}
+
+// Add the cubes covering a block to the list of changed cubes.
+static void add_block_cubes(sync_t *sync, const int bpos[3],
+                            cube_t ***list, int *nb, int *allocated)
+{
+    const int n = BLOCK_SIZE;
+    int x, y, z;
+
+    for (z = floor_div(bpos[2], CUBE_SIZE); z * CUBE_SIZE < bpos[2] + n; z++)
+    for (y = floor_div(bpos[1], CUBE_SIZE); y * CUBE_SIZE < bpos[1] + n; y++)
+    for (x = floor_div(bpos[0], CUBE_SIZE); x * CUBE_SIZE < bpos[0] + n; x++) {
+        add_cube(get_cube(sync, (int[]){x * CUBE_SIZE, y * CUBE_SIZE,
+                                        z * CUBE_SIZE}),
+                 list, nb, allocated);
+    }
+}
+
+// Get the cubes modified since the last update.
+static int get_changed_cubes(sync_t *sync, const mesh_t *mesh,
+                             cube_t ***list)
+{
+    int i, nb = 0, allocated = 0, nb_blocks = -1, (*blocks_pos)[3] = NULL;
+    int bpos[3];
+    mesh_iterator_t iter;
+    cube_t *cube, *tmp;
+
+    *list = NULL;
+    if (!sync->full && mesh == sync->mesh)
+        nb_blocks = mesh_get_changes(mesh, sync->mesh_version, &blocks_pos);
+
+    if (nb_blocks >= 0) {
+        for (i = 0; i < nb_blocks; i++)
+            add_block_cubes(sync, blocks_pos[i], list, &nb, &allocated);
+    } else {
+        // Send everything, including the cubes we sent before, in case
+        // they are now empty.
+        HASH_ITER(hh, sync->cubes, cube, tmp) {
+            add_cube(cube, list, &nb, &allocated);
+        }
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos))
+            add_block_cubes(sync, bpos, list, &nb, &allocated);
+    }
+    free(blocks_pos);
+    for (i = 0; i < nb; i++) (*list)[i]->dirty = false;
+    return nb;
+}
+
+static void send_cubes(sync_t *sync, const mesh_t *mesh,
+                       cube_t **cubes, int nb)
+{
+    uint8_t *voxels, *data;
+    const uint8_t *blocks[MAX_CUBES];
+    cube_header_t header;
+    buffer_t msg = {};
+    int i, size;
+
+    voxels = malloc(MAX_CUBES * CUBE_VOXELS * 4);
+    for (i = 0; i < nb; i++) {
+        blocks[i] = voxels + i * CUBE_VOXELS * 4;
+        mesh_read(mesh, cubes[i]->pos, CUBE_DIM, voxels + i * CUBE_VOXELS * 4);
+        cubes[i]->version++;
+        cubes[i]->peer = sync->id;
+    }
+    buffer_append(&msg, &nb, 4);
+    for (i = 0; i < nb; i++) {
+        memcpy(header.pos, cubes[i]->pos, sizeof(header.pos));
+        header.version = cubes[i]->version;
+        header.peer = cubes[i]->peer;
+        buffer_append(&msg, &header, sizeof(header));
+    }
+    data = gox_encode_blocks(nb, blocks, &size);
+    buffer_append(&msg, data, size);
+    send_message(sync, "BLKS", msg.size, msg.data);
+    sync->stats.blocks_sent += nb;
+    free(data);
+    free(msg.data);
+    free(voxels);
+}
+
+// Apply a BLKS message, return the number of cubes applied, or -1 if the
+// message is invalid.
+static int apply_cubes(sync_t *sync, mesh_t *mesh,
+                       const uint8_t *data, int size)
+{
+    int i, nb, ret = 0;
+    cube_header_t header;
+    cube_t *cube;
+    uint8_t *voxels;
+
+    if (size < 4) return -1;
+    memcpy(&nb, data, 4);
+    if (nb < 0 || nb > MAX_CUBES || size < 4 + nb * sizeof(header))
+        return -1;
+    voxels = malloc(nb * CUBE_VOXELS * 4);
+    if (gox_decode_blocks(data + 4 + nb * sizeof(header),
+                          size - 4 - nb * sizeof(header), nb, voxels)) {
+        free(voxels);
+        return -1;
+    }
+    for (i = 0; i < nb; i++) {
+        memcpy(&header, data + 4 + i * sizeof(header), sizeof(header));
+        cube = get_cube(sync, (int*)header.pos);
+        // Concurrent edits of the same cube.
+        if (header.version <= cube->version && header.peer != cube->peer)
+            sync->stats.conflicts++;
+        if (header.version < cube->version ||
+                (header.version == cube->version &&
+                 header.peer <= cube->peer)) {
+            continue;
+        }
+        cube->version = header.version;
+        cube->peer = header.peer;
+        mesh_write(mesh, cube->pos, CUBE_DIM, voxels + i * CUBE_VOXELS * 4);
+        ret++;
+    }
+    sync->stats.blocks_received += ret;
+    free(voxels);
+    return ret;
+}
+
+static int flush(sync_t *sync)
+{
+    ssize_t r;
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (sync->out.size) {
+        r = send(sync->fd, sync->out.data, sync->out.size, flags);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        sync->stats.bytes_sent += r;
+        buffer_consume(&sync->out, r);
+    }
+    return 0;
+}
+
+// Read the available data and apply all the complete messages.
+static int receive(sync_t *sync, mesh_t *mesh)
+{
+    uint8_t buf[64 * KB];
+    ssize_t r;
+    int size, ret = 0, nb;
+    uint32_t hello[2];
+
+    while (true) {
+        r = recv(sync->fd, buf, sizeof(buf), 0);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        sync->stats.bytes_received += r;
+        buffer_append(&sync->in, buf, r);
+    }
+
+    while (sync->in.size >= 8) {
+        memcpy(&size, sync->in.data + 4, 4);
+        if (size < 0 || size > MAX_MESSAGE_SIZE) return -1;
+        if (sync->in.size < 8 + size) break;
+        if (memcmp(sync->in.data, "HELO", 4) == 0) {
+            if (size != sizeof(hello)) return -1;
+            memcpy(hello, sync->in.data + 8, sizeof(hello));
+            if (hello[0] != PROTOCOL_VERSION) {
+                LOG_E("Sync protocol version mismatch");
+                return -1;
+            }
+            sync->hello_received = true;
+        } else if (memcmp(sync->in.data, "BLKS", 4) == 0) {
+            if (!sync->hello_received) return -1;
+            nb = apply_cubes(sync, mesh, sync->in.data + 8, size);
+            if (nb < 0) return -1;
+            ret += nb;
+        }
+        // Ignore the unknown messages, for future extensions.
+        buffer_consume(&sync->in, 8 + size);
+    }
+    return ret;
+}
+
+int sync_update(sync_t *sync, mesh_t *mesh)
+{
+    cube_t **cubes;
+    int i, nb, ret, fd;
+
+    if (sync->fd < 0) {
+        fd = accept(sync->listen_fd, NULL, NULL);
+        if (fd < 0) return 0;
+        close(sync->listen_fd);
+        sync->listen_fd = -1;
+        LOG_I("Sync connection accepted");
+        sync_start(sync, fd);
+    }
+
+    // Send the local changes first, so that the remote ones we apply next
+    // don't get sent back.
+    nb = get_changed_cubes(sync, mesh, &cubes);
+    for (i = 0; i < nb; i += MAX_CUBES)
+        send_cubes(sync, mesh, cubes + i, min(nb - i, MAX_CUBES));
+    free(cubes);
+    sync->full = false;
+    if (flush(sync)) return -1;
+
+    ret = receive(sync, mesh);
+    sync->mesh = mesh;
+    sync->mesh_version = mesh_get_version(mesh);
+    if (ret < 0) return -1;
+    if (flush(sync)) return -1;
+    return ret;
+}
+
+void sync_get_stats(const sync_t *sync, sync_stats_t *stats)
+{
+    *stats = sync->stats;
+}
+
+#else // No sockets support.
+
+sync_t *sync_new(int fd)
+{
+    return NULL;
+}
+
+sync_t *sync_listen(int port)
+{
+    LOG_E("Sync is not supported on this system");
+    return NULL;
+}
+
+sync_t *sync_connect(const char *host, int port)
+{
+    LOG_E("Sync is not supported on this system");
+    return NULL;
+}
+
+void sync_delete(sync_t *sync)
+{
+}
+
+int sync_update(sync_t *sync, mesh_t *mesh)
+{
+    return -1;
+}
+
+void sync_get_stats(const sync_t *sync, sync_stats_t *stats)
+{
+    *stats = (sync_stats_t){};
+}
+
+#endif
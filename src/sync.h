@@ -0,0 +1,123 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Sync
+ *
+ * Share the edits of a mesh between two goxel instances over a socket.
+ *
+ * Only the blocks modified since the last update, as given by the mesh
+ * changes journal (see <mesh_get_changes>), are sent, compressed with the
+ * gox blocks codec (see <gox_encode_blocks>).  The blocks are sent as
+ * cubes of 16 voxels, so that instances built with different block sizes
+ * can still talk to each other.
+ *
+ * Each cube has a version number, incremented by every edit, and the id of
+ * the instance that did the last edit.  When both instances modify the
+ * same cube at the same time, they both keep the edit with the highest
+ * version, and then the highest instance id, so that they always end up
+ * with the same voxels.  Those cases are counted as conflicts.
+ *
+ * The sockets are non blocking, so the updates can be done every frame.
+ * This is only supported on the posix systems.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+#include "mesh.h"
+
+typedef struct sync sync_t;
+
+/*
+ * Type: sync_stats_t
+ * Statistics of a sync connection.
+ *
+ * Attributes:
+ *   bytes_sent      - Number of bytes written to the socket.
+ *   bytes_received  - Number of bytes read from the socket.
+ *   blocks_sent     - Number of cubes sent.
+ *   blocks_received - Number of cubes received and applied.
+ *   conflicts       - Number of cubes modified by both sides at the same
+ *                     time.
+ */
+typedef struct {
+    uint64_t    bytes_sent;
+    uint64_t    bytes_received;
+    int         blocks_sent;
+    int         blocks_received;
+    int         conflicts;
+} sync_stats_t;
+
+/*
+ * Function: sync_new
+ * Create a sync connection from a connected stream socket.
+ *
+ * The connection takes the ownership of the socket.
+ */
+sync_t *sync_new(int fd);
+
+/*
+ * Function: sync_listen
+ * Create a sync connection that waits for an other instance to connect.
+ *
+ * The first incoming connection is accepted by <sync_update>.
+ *
+ * Return:
+ *   The connection, or NULL in case of error.
+ */
+sync_t *sync_listen(int port);
+
+/*
+ * Function: sync_connect
+ * Create a sync connection to an other instance.
+ *
+ * Return:
+ *   The connection, or NULL in case of error.
+ */
+sync_t *sync_connect(const char *host, int port);
+
+/*
+ * Function: sync_delete
+ * Close a sync connection.
+ */
+void sync_delete(sync_t *sync);
+
+/*
+ * Function: sync_update
+ * Send the local changes of a mesh, and apply the remote ones.
+ *
+ * This never blocks.  The first update after the connection sends all the
+ * blocks of the mesh, as well as the updates on a different mesh, or when
+ * the mesh journal doesn't go back to the previous update.
+ *
+ * Return:
+ *   The number of cubes applied from the other instance, or -1 if the
+ *   connection has been closed or the other side sent invalid data.
+ */
+int sync_update(sync_t *sync, mesh_t *mesh);
+
+/*
+ * Function: sync_get_stats
+ * Get the statistics of a sync connection.
+ */
+void sync_get_stats(const sync_t *sync, sync_stats_t *stats);
+
+#endif // SYNC_H
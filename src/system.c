@@ -250,6 +250,27 @@ void sys_show_keyboard(bool has_text)
     sys_callbacks.show_keyboard(sys_callbacks.user, has_text);
 }
 
+/*
+ * Function: sys_set_upload_context_current
+ * Make the GL context of the background uploads current, or release it.
+ */
+bool sys_set_upload_context_current(bool current)
+{
+    if (!sys_callbacks.set_upload_context_current) return false;
+    return sys_callbacks.set_upload_context_current(sys_callbacks.user,
+                                                    current);
+}
+
+/*
+ * Function: sys_get_cursor_pos
+ * Get the current position of the mouse in the window.
+ */
+bool sys_get_cursor_pos(float pos[2])
+{
+    if (!sys_callbacks.get_cursor_pos) return false;
+    return sys_callbacks.get_cursor_pos(sys_callbacks.user, pos);
+}
+
 /*
  * Function: sys_save_to_photos
  * Save a png file to the system photo album.
@@ -42,6 +42,8 @@ typedef struct {
     void (*show_keyboard)(void *user, bool has_text);
     void (*save_to_photos)(void *user, const uint8_t *data, int size,
                            void (*on_finished)(int r));
+    bool (*set_upload_context_current)(void *user, bool current);
+    bool (*get_cursor_pos)(void *user, float pos[2]);
 } sys_callbacks_t;
 extern sys_callbacks_t sys_callbacks;
 
@@ -122,6 +124,33 @@ void sys_show_keyboard(bool has_text);
 void sys_save_to_photos(const uint8_t *data, int size,
                         void (*on_finished)(int r));
 
+/*
+ * Function: sys_set_upload_context_current
+ * Make the GL context used for the background uploads current on the
+ * calling thread, or release it.
+ *
+ * This context shares its objects with the main one.  It can only be
+ * current on one thread at a time: a thread that made it current has to
+ * release it before any other thread can use it.
+ *
+ * Return:
+ *   false if there is no such context, in which case nothing is done.
+ */
+bool sys_set_upload_context_current(bool current);
+
+/*
+ * Function: sys_get_cursor_pos
+ * Get the current position of the mouse, in window coordinates.
+ *
+ * Contrary to the inputs, that are read at the start of the frame, this
+ * gives the position at the time of the call, so that the cursor can be
+ * drawn where the mouse is when the frame is rendered.
+ *
+ * Return:
+ *   false if the system cannot give the position.
+ */
+bool sys_get_cursor_pos(float pos[2]);
+
 /*
  * Function: sys_get_save_path
  * Get the path where to save an image.  By default this opens a file dialog.
@@ -17,8 +17,15 @@
  */
 
 #include "goxel.h"
+#include "file_format.h"
 
 #include "utils/b64.h"
+#include "utils/frame_tasks.h"
+#include "utils/parallel.h"
+#include "pointcloud.h"
+#include "voxelize.h"
+
+#include <limits.h>
 
 #define TEST(cond) \
     do { \
@@ -28,6 +35,17 @@
         } \
     } while(0)
 
+static int count_voxels(const mesh_t *mesh)
+{
+    int n = 0, pos[3];
+    mesh_iterator_t iter;
+    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
+    while (mesh_iter(&iter, pos)) {
+        if (mesh_get_alpha_at(mesh, &iter, pos)) n++;
+    }
+    return n;
+}
+
 static void test_file(const char *b64_data, uint32_t crc32)
 {
     FILE *file;
@@ -127,9 +145,4026 @@ static void test_load_corrupt(void)
     TEST(err != 0);
 }
 
+// Save and load back an image with uniform, palette and raw blocks.
+static void test_save_load_file(void)
+{
+    int i, j, err;
+    uint64_t hash;
+    uint8_t *voxels;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    voxels = malloc(16 * 16 * 16 * 4);
+    for (i = 0; i < 100; i++) {
+        for (j = 0; j < 16 * 16 * 16; j++) {
+            if (i % 3 == 0)
+                memcpy(&voxels[j * 4], (uint8_t[]){i, 0, 0, 255}, 4);
+            if (i % 3 == 1)
+                memcpy(&voxels[j * 4], (uint8_t[]){j % 7, i, 0, 255}, 4);
+            if (i % 3 == 2)
+                memcpy(&voxels[j * 4],
+                       (uint8_t[]){j % 256, j / 256, i, 255}, 4);
+        }
+        mesh_write(mesh, (int[]){i * 16, 0, 0}, (int[]){16, 16, 16}, voxels);
+    }
+    free(voxels);
+    hash = mesh_get_hash(mesh);
+    save_to_file(goxel.image, "/tmp/goxel_test.gox");
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file("/tmp/goxel_test.gox", NULL);
+    TEST(err == 0);
+    TEST(mesh_get_hash(goxel.image->active_layer->mesh) == hash);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Load a file lazily, and check that we can still access the blocks not
+// loaded yet after overwriting the file.
+static void test_load_file_lazy(void)
+{
+    int i, j, err;
+    uint64_t hash;
+    uint8_t *voxels;
+    mesh_t *mesh = goxel.image->active_layer->mesh, *copy;
+
+    if (DEFINED(WIN32)) return;
+    voxels = malloc(16 * 16 * 16 * 4);
+    for (i = 0; i < 100; i++) {
+        for (j = 0; j < 16 * 16 * 16; j++) {
+            memcpy(&voxels[j * 4],
+                   (uint8_t[]){i, (i % 2) ? j % 256 : 0, j % 3, 255}, 4);
+        }
+        mesh_write(mesh, (int[]){0, i * 16, 0}, (int[]){16, 16, 16}, voxels);
+    }
+    free(voxels);
+    hash = mesh_get_hash(mesh);
+    save_to_file(goxel.image, "/tmp/goxel_test_lazy.gox");
+    image_delete(goxel.image);
+    goxel.image = image_new();
+
+    gox_set_lazy_load_size(0);
+    err = goxel_import_file("/tmp/goxel_test_lazy.gox", NULL);
+    gox_set_lazy_load_size(64 * MB);
+    TEST(err == 0);
+    copy = mesh_copy(goxel.image->active_layer->mesh);
+    mesh_clear(goxel.image->active_layer->mesh);
+    save_to_file(goxel.image, "/tmp/goxel_test_lazy.gox");
+    TEST(mesh_get_hash(copy) == hash);
+    mesh_delete(copy);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Load a file with a hidden layer, whose blocks only get decoded when
+// first accessed.
+static void test_load_hidden_layer(void)
+{
+    int i;
+    uint64_t hash;
+    int64_t before, deferred;
+    layer_t *layer = goxel.image->active_layer;
+
+    if (DEFINED(WIN32)) return;
+    for (i = 0; i < 50; i++) {
+        mesh_set_at(layer->mesh, NULL, (int[]){i * 16, i % 7, 0},
+                    (uint8_t[]){i, 100, 200, 255});
+    }
+    hash = mesh_get_hash(layer->mesh);
+    layer->visible = false;
+    image_add_layer(goxel.image, NULL);
+    save_to_file(goxel.image, "/tmp/goxel_test_hidden.gox");
+    image_delete(goxel.image);
+    goxel.image = image_new();
+
+    mem_stats_get(MEM_DEFERRED, &before, NULL);
+    TEST(goxel_import_file("/tmp/goxel_test_hidden.gox", NULL) == 0);
+    mem_stats_get(MEM_DEFERRED, &deferred, NULL);
+    // The blocks can only stay compressed if they are the file blocks.
+    if (BLOCK_SIZE == 16) TEST(deferred > before);
+    layer = goxel.image->layers;
+    TEST(!layer->visible);
+    TEST(mesh_get_hash(layer->mesh) == hash);
+    mem_stats_get(MEM_DEFERRED, &deferred, NULL);
+    TEST(deferred == before);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Infos of a gox file read by gox_iter_infos.
+typedef struct {
+    int     nb_layers;
+    int64_t nb_voxels;
+    int     bbox[2][3];
+    bool    has_bbox;
+} test_gox_infos_t;
+
+static int test_gox_infos_callback(const char *attr, int size, void *value,
+                                   void *user)
+{
+    test_gox_infos_t *infos = user;
+    if (strcmp(attr, "layer") == 0) infos->nb_layers++;
+    if (strcmp(attr, "nb-voxels") == 0)
+        memcpy(&infos->nb_voxels, value, sizeof(infos->nb_voxels));
+    if (strcmp(attr, "bbox") == 0) {
+        memcpy(infos->bbox, value, sizeof(infos->bbox));
+        infos->has_bbox = true;
+    }
+    return 0;
+}
+
+// Check the summary of a file that we get without loading it, and that it
+// is ignored after an incremental save.
+static void test_gox_infos(void)
+{
+    const char *path = "/tmp/goxel_test_infos.gox";
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+    test_gox_infos_t infos = {};
+    int err;
+
+    if (DEFINED(WIN32)) return;
+    image_add_layer(goxel.image, NULL);
+    mesh_set_at(mesh, NULL, (int[]){-3, 2, 5}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){40, 2, 7}, (uint8_t[]){255, 0, 0, 255});
+    save_to_file(goxel.image, path);
+    err = gox_iter_infos(path, test_gox_infos_callback, &infos);
+    TEST(err == 0);
+    TEST(infos.nb_layers == 2);
+    TEST(infos.nb_voxels == 2);
+    TEST(infos.has_bbox);
+    TEST(memcmp(infos.bbox, ((int[2][3]){{-3, 2, 5}, {41, 3, 8}}),
+                sizeof(infos.bbox)) == 0);
+
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    save_to_file_incremental(goxel.image, path);
+    memset(&infos, 0, sizeof(infos));
+    err = gox_iter_infos(path, test_gox_infos_callback, &infos);
+    TEST(err == 0);
+    TEST(infos.nb_layers == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static long get_file_size(const char *path)
+{
+    long size;
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// Check that the incremental save only appends the changed blocks.
+static void test_save_incremental(void)
+{
+    const char *path = "/tmp/goxel_test_incremental.gox";
+    int i, j, err, nb_layers;
+    uint64_t hash;
+    long size;
+    uint8_t *voxels;
+    layer_t *layer;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    voxels = malloc(16 * 16 * 16 * 4);
+    for (i = 0; i < 50; i++) {
+        for (j = 0; j < 16 * 16 * 16; j++) {
+            memcpy(&voxels[j * 4],
+                   (uint8_t[]){j % 256, j / 256, i, 255}, 4);
+        }
+        mesh_write(mesh, (int[]){0, 0, i * 16}, (int[]){16, 16, 16}, voxels);
+    }
+    free(voxels);
+    save_to_file(goxel.image, path);
+    size = get_file_size(path);
+
+    mesh_set_at(mesh, NULL, (int[]){1, 2, 3}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 1000}, (uint8_t[]){1, 2, 3, 255});
+    hash = mesh_get_hash(mesh);
+    save_to_file_incremental(goxel.image, path);
+    TEST(get_file_size(path) > size);
+    TEST(get_file_size(path) < size + size / 10);
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    TEST(mesh_get_hash(goxel.image->active_layer->mesh) == hash);
+    DL_COUNT(goxel.image->layers, layer, nb_layers);
+    TEST(nb_layers == 1);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static int test_count_files(const char *dir, const char *name, void *user)
+{
+    (*(int*)user)++;
+    return 0;
+}
+
+// Check that the saves into a blocks store only write the new blocks.
+static void test_save_store(void)
+{
+    const char *dir = "/tmp/goxel_test_store";
+    const char *path = "/tmp/goxel_test_store/test.gox";
+    const char *blocks_dir = "/tmp/goxel_test_store/blocks";
+    int i, j, err, nb_files;
+    uint64_t hash;
+    uint8_t *voxels;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    // Start from an empty store.
+    sys_make_dir(path);
+    sys_delete_file(path);
+    gox_store_gc(dir);
+
+    voxels = malloc(16 * 16 * 16 * 4);
+    for (i = 0; i < 10; i++) {
+        for (j = 0; j < 16 * 16 * 16; j++) {
+            memcpy(&voxels[j * 4],
+                   (uint8_t[]){j % 256, j / 256, i, 255}, 4);
+        }
+        mesh_write(mesh, (int[]){0, 0, i * 16}, (int[]){16, 16, 16}, voxels);
+    }
+    free(voxels);
+    save_to_store(goxel.image, path);
+    nb_files = 0;
+    sys_list_dir(blocks_dir, test_count_files, &nb_files);
+    TEST(nb_files == 10);
+
+    mesh_set_at(mesh, NULL, (int[]){1, 2, 3}, (uint8_t[]){1, 2, 3, 255});
+    hash = mesh_get_hash(mesh);
+    save_to_store(goxel.image, path);
+    nb_files = 0;
+    sys_list_dir(blocks_dir, test_count_files, &nb_files);
+    TEST(nb_files == 11);
+    // The previous version of the modified block is not used anymore.
+    TEST(gox_store_gc(dir) == 1);
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    TEST(mesh_get_hash(goxel.image->active_layer->mesh) == hash);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Check that the background save writes the image as it was when the save
+// started.
+static void test_save_async(void)
+{
+    const char *path = "/tmp/goxel_test_async.gox";
+    int i, err;
+    uint64_t hash;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    for (i = 0; i < 64; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i * 16, i, 0},
+                    (uint8_t[]){i, 255 - i, 0, 255});
+    }
+    hash = mesh_get_hash(mesh);
+    save_to_file_async(goxel.image, path);
+    mesh_clear(mesh);
+    gox_save_wait();
+    TEST(gox_save_get_progress() == -1);
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    TEST(mesh_get_hash(goxel.image->active_layer->mesh) == hash);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+typedef struct {
+    const char  *path;
+    image_t     *img;
+    int         err;
+    uint64_t    hash;
+} load_job_t;
+
+static void test_load_concurrent_func(void *user)
+{
+    load_job_t *job = user;
+    float box[4][4];
+    painter_t painter = {
+        .mode = MODE_SUB,
+        .shape = &shape_sphere,
+        .color = {255, 255, 255, 255},
+    };
+
+    job->img = image_new();
+    job->err = gox_import(job->img, job->path);
+    bbox_from_extents(box, VEC(8, 0, 0), 12, 12, 12);
+    mesh_op(job->img->active_layer->mesh, &painter, box);
+    job->hash = mesh_get_hash(image_get_layers_mesh(job->img));
+}
+
+// Load and edit the same file into several images from different threads.
+static void test_load_concurrent(void)
+{
+    const char *path = "/tmp/goxel_test_concurrent.gox";
+    int i;
+    float box[4][4];
+    load_job_t ref = {.path = path}, jobs[8];
+    task_t *tasks[8];
+    layer_t *layer;
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_cube,
+        .color = {255, 0, 0, 255},
+    };
+    bool ok = true;
+
+    if (DEFINED(WIN32)) return;
+    bbox_from_extents(box, VEC(0, 0, 0), 20, 20, 20);
+    mesh_op(goxel.image->active_layer->mesh, &painter, box);
+    layer = image_add_layer(goxel.image, NULL);
+    vec4_set(painter.color, 0, 255, 0, 255);
+    bbox_from_extents(box, VEC(20, 0, 0), 10, 30, 10);
+    mesh_op(layer->mesh, &painter, box);
+    save_to_file(goxel.image, path);
+
+    test_load_concurrent_func(&ref);
+    TEST(ref.err == 0);
+    for (i = 0; i < 8; i++) {
+        jobs[i] = (load_job_t){.path = path};
+        tasks[i] = task_start(test_load_concurrent_func, &jobs[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        task_wait(tasks[i]);
+        task_delete(tasks[i]);
+        ok = ok && jobs[i].err == 0 && jobs[i].hash == ref.hash;
+        image_delete(jobs[i].img);
+    }
+    TEST(ok);
+    image_delete(ref.img);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Export two layers in vox format, one of them bigger than the maximum
+// models size, and check that we get the same voxels back.
+static void test_vox_export(void)
+{
+    const char *path = "/tmp/goxel_test.vox";
+    int i, err;
+    uint64_t hash;
+    layer_t *layer;
+
+    if (DEFINED(WIN32)) return;
+    layer = goxel.image->active_layer;
+    for (i = 0; i < 300; i++) {
+        mesh_set_at(layer->mesh, NULL, (int[]){i - 100, i % 7, 3},
+                    (uint8_t[]){i % 5 * 50, 10, i % 3, 255});
+    }
+    layer = image_add_layer(goxel.image, NULL);
+    layer->visible = true;
+    mesh_set_at(layer->mesh, NULL, (int[]){-5, -6, -7},
+                (uint8_t[]){1, 2, 3, 255});
+    hash = mesh_get_hash(image_get_layers_mesh(goxel.image));
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    TEST(mesh_get_hash(image_get_layers_mesh(goxel.image)) == hash);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_vdb_export(void)
+{
+    const char *path = "/tmp/goxel_test.vdb";
+    int i, err;
+    uint64_t hash;
+    layer_t *layer;
+
+    if (DEFINED(WIN32)) return;
+    layer = goxel.image->active_layer;
+    for (i = 0; i < 300; i++) {
+        mesh_set_at(layer->mesh, NULL, (int[]){i - 100, i % 7, -i * 20},
+                    (uint8_t[]){i % 5 * 50, 10, i % 3, 255 - i % 2});
+    }
+    layer = image_add_layer(goxel.image, NULL);
+    mesh_set_at(layer->mesh, NULL, (int[]){-5, -6, -7},
+                (uint8_t[]){1, 2, 3, 255});
+    hash = mesh_get_hash(image_get_layers_mesh(goxel.image));
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    TEST(mesh_get_hash(image_get_layers_mesh(goxel.image)) == hash);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_obj_export(void)
+{
+    const char *path = "/tmp/goxel_test.obj";
+    char *data, *line;
+    int err, size, nb_v = 0, nb_f = 0;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    // A 2x1x1 box: all the vertices should be welded into the 8 corners.
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){1, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+    data = read_file(path, &size);
+    TEST(data);
+    for (line = strtok(data, "\n"); line; line = strtok(NULL, "\n")) {
+        if (strncmp(line, "v ", 2) == 0) nb_v++;
+        if (strncmp(line, "f ", 2) == 0) nb_f++;
+    }
+    TEST(nb_v == 8);
+    TEST(nb_f == 6);
+    free(data);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Import a raw uint16 volume and a heightmap.
+static void test_volume_import(void)
+{
+    const char *path = "/tmp/goxel_test_40x30x20_uint16.raw";
+    FILE *file;
+    int x, y, z, w, h, bpp, err;
+    uint16_t v;
+    uint8_t c[4], *img, *img2;
+    mesh_stats_t stats;
+    mesh_t *mesh;
+
+    if (DEFINED(WIN32)) return;
+    // Half of the volume above the threshold.
+    file = fopen(path, "wb");
+    for (z = 0; z < 20; z++)
+    for (y = 0; y < 30; y++)
+    for (x = 0; x < 40; x++) {
+        v = x < 20 ? 4095 : x < 30 ? 100 : 0;
+        fwrite(&v, 2, 1, file);
+    }
+    fclose(file);
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    mesh = goxel.image->active_layer->mesh;
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 20 * 30 * 20);
+    mesh_get_at(mesh, NULL, (int[]){19, 29, 19}, c);
+    TEST(c[0] == 255 && c[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){20, 0, 0}, c);
+    TEST(c[3] == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+
+    // A 20x10 heightmap with a white square in the top left corner.
+    path = "/tmp/goxel_test_heightmap.png";
+    img = calloc(20 * 10, 1);
+    for (y = 0; y < 5; y++)
+    for (x = 0; x < 5; x++)
+        img[y * 20 + x] = 255;
+    img_write(img, 20, 10, 1, path);
+    // The heightmap has to be written as a grey image.
+    bpp = 0;
+    img2 = img_read(path, &w, &h, &bpp);
+    TEST(img2 && w == 20 && h == 10 && bpp == 1);
+    TEST(memcmp(img, img2, 20 * 10) == 0);
+    free(img2);
+    free(img);
+    err = goxel_import_file(path, "heightmap");
+    TEST(err == 0);
+    mesh = goxel.image->active_layer->mesh;
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 5 * 5 * 64);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){4, 9, 63}));
+    TEST(!mesh_get_alpha_at(mesh, NULL, (int[]){4, 4, 0}));
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_voxelize(void)
+{
+    // The quads of a cube, as indices of the corners (bit 0 for x, bit 1
+    // for y, bit 2 for z).
+    const int QUADS[6][4] = {{0, 2, 6, 4}, {1, 5, 7, 3}, {0, 4, 5, 1},
+                             {2, 3, 7, 6}, {0, 1, 3, 2}, {4, 6, 7, 5}};
+    const char *path = "/tmp/goxel_test_cube.obj";
+    voxelize_triangle_t tris[12] = {};
+    mesh_stats_t stats;
+    mesh_t *mesh;
+    FILE *file;
+    int i, j, k, err;
+    uint8_t c[4];
+
+    // A cube from 2.5 to 9.5 covers the voxels 2 to 9.
+    for (i = 0; i < 12; i++) {
+        tris[i].texture = -1;
+        for (j = 0; j < 3; j++) {
+            k = QUADS[i / 2][i % 2 ? (j ? j + 1 : 0) : j];
+            vec3_set(tris[i].pos[j], k & 1 ? 9.5 : 2.5, k & 2 ? 9.5 : 2.5,
+                     k & 4 ? 9.5 : 2.5);
+            memcpy(tris[i].color[j], (uint8_t[]){255, 0, 0, 255}, 4);
+        }
+    }
+    mesh = mesh_new();
+    TEST(mesh_voxelize(mesh, tris, 12, NULL, false) == 0);
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 8 * 8 * 8 - 6 * 6 * 6);
+    mesh_get_at(mesh, NULL, (int[]){2, 5, 9}, c);
+    TEST(c[0] == 255 && c[1] == 0 && c[3] == 255);
+    TEST(!mesh_get_alpha_at(mesh, NULL, (int[]){5, 5, 5}));
+    mesh_clear(mesh);
+    TEST(mesh_voxelize(mesh, tris, 12, NULL, true) == 0);
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 8 * 8 * 8);
+    mesh_get_at(mesh, NULL, (int[]){5, 5, 5}, c);
+    TEST(c[0] == 255 && c[3] == 255);
+    mesh_delete(mesh);
+
+    // The same cube as an obj file, scaled to 16 voxels.
+    if (DEFINED(WIN32)) return;
+    file = fopen(path, "w");
+    for (i = 0; i < 8; i++)
+        fprintf(file, "v %d %d %d 0 1 0\n", i & 1, i >> 1 & 1, i >> 2 & 1);
+    for (i = 0; i < 6; i++) {
+        fprintf(file, "f %d %d %d %d\n", QUADS[i][0] + 1, QUADS[i][1] + 1,
+                QUADS[i][2] + 1, QUADS[i][3] + 1);
+    }
+    fclose(file);
+    voxelize_set_options(16, false);
+    err = goxel_import_file(path, NULL);
+    voxelize_set_options(128, false);
+    TEST(err == 0);
+    mesh = goxel.image->active_layer->mesh;
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 16 * 16 * 16 - 14 * 14 * 14);
+    mesh_get_at(mesh, NULL, (int[]){-8, -8, 0}, c);
+    TEST(c[1] == 255 && c[3] == 255);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){7, 7, 15}));
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_pointcloud(void)
+{
+    const char *path = "/tmp/goxel_test_points.xyz";
+    const char *ply_path = "/tmp/goxel_test_points.ply";
+    mesh_stats_t stats;
+    mesh_t *mesh;
+    FILE *file;
+    int err;
+    uint8_t c[4];
+
+    if (DEFINED(WIN32)) return;
+    // Three points in the first voxel, and one in the last, scaled to 4
+    // voxels.
+    file = fopen(path, "w");
+    fprintf(file, "X Y Z R G B\n");
+    fprintf(file, "0 0 0 255 0 0\n");
+    fprintf(file, "0.1 0.1 0.1 0 0 255\n");
+    fprintf(file, "0.2,0.2,0.2,255,0,0\n");
+    fprintf(file, "4 4 4 0 255 0");
+    fclose(file);
+    pointcloud_set_options(4, POINTCLOUD_AVERAGE);
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    mesh = goxel.image->active_layer->mesh;
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 2);
+    mesh_get_at(mesh, NULL, (int[]){-2, -2, 0}, c);
+    TEST(c[0] == 170 && c[1] == 0 && c[2] == 85 && c[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){1, 1, 3}, c);
+    TEST(c[0] == 0 && c[1] == 255 && c[2] == 0 && c[3] == 255);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+
+    pointcloud_set_options(4, POINTCLOUD_MAJORITY);
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    mesh = goxel.image->active_layer->mesh;
+    mesh_get_at(mesh, NULL, (int[]){-2, -2, 0}, c);
+    TEST(c[0] == 255 && c[1] == 0 && c[2] == 0 && c[3] == 255);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+
+    // A ply file without faces, with the y axis up.
+    file = fopen(ply_path, "w");
+    fprintf(file, "ply\nformat ascii 1.0\nelement vertex 2\n"
+                  "property float x\nproperty float y\nproperty float z\n"
+                  "property uchar red\nproperty uchar green\n"
+                  "property uchar blue\nend_header\n"
+                  "0 0 0 255 0 0\n2 2 2 0 255 0\n");
+    fclose(file);
+    pointcloud_set_options(2, POINTCLOUD_AVERAGE);
+    err = goxel_import_file(ply_path, NULL);
+    pointcloud_set_options(256, POINTCLOUD_AVERAGE);
+    TEST(err == 0);
+    mesh = goxel.image->active_layer->mesh;
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == 2);
+    mesh_get_at(mesh, NULL, (int[]){-1, 0, 0}, c);
+    TEST(c[0] == 255 && c[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){0, -1, 1}, c);
+    TEST(c[1] == 255 && c[3] == 255);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_glb_export(void)
+{
+    const char *path = "/tmp/goxel_test.glb";
+    char *data;
+    int i, err, size;
+    uint32_t header[5];
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    for (i = 0; i < 40; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i, 0, 0},
+                    (uint8_t[]){255, i * 5, 0, 255});
+    }
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+    data = read_file(path, &size);
+    TEST(data && size > 20);
+    memcpy(header, data, sizeof(header));
+    TEST(header[0] == 0x46546C67); // 'glTF'
+    TEST(header[1] == 2);
+    TEST(header[2] == size);
+    TEST(header[4] == 0x4E4F534A); // 'JSON'
+    // The binary chunk follows the json.
+    memcpy(header, data + 20 + header[3], 8);
+    TEST(header[1] == 0x004E4942); // 'BIN'
+    TEST(20 + 8 + header[0] + (int)((uint32_t*)data)[3] == size);
+    free(data);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_vxl_export(void)
+{
+    const char *path = "/tmp/goxel_test.vxl";
+    int i, err, pos[3];
+    uint32_t seed = 1;
+    uint8_t c[4], c2[4];
+    mesh_t *mesh = goxel.image->active_layer->mesh, *expected;
+    mesh_iterator_t iter;
+
+    if (DEFINED(WIN32)) return;
+    // Isolated voxels, so that they are all on the surface.  The import
+    // puts the voxels one unit lower along x than the export.
+    expected = mesh_new();
+    for (i = 0; i < 500; i++) {
+        seed = seed * 1103515245 + 12345;
+        vec3_set(pos, (int)(seed >> 8) % 200 * 2 - 200,
+                      (int)(seed >> 16) % 100 * 2 - 100, i % 16 * 2 - 16);
+        c[0] = seed & 255;
+        c[1] = i % 256;
+        c[2] = 7;
+        c[3] = 255;
+        mesh_set_at(mesh, NULL, pos, c);
+        pos[0] -= 1;
+        mesh_set_at(expected, NULL, pos, c);
+    }
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    // The import creates empty blocks, so we can't compare the crc.
+    mesh = goxel.image->active_layer->mesh;
+    TEST(count_voxels(mesh) == count_voxels(expected));
+    iter = mesh_get_iterator(expected, 0);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(expected, NULL, pos, c);
+        mesh_get_at(mesh, NULL, pos, c2);
+        TEST(memcmp(c, c2, 4) == 0);
+    }
+    mesh_delete(expected);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_qubicle(void)
+{
+    const char *path = "/tmp/goxel_test.qb";
+    int i, err, pos[3];
+    uint8_t c[4], c2[4];
+    mesh_t *mesh = goxel.image->active_layer->mesh, *expected;
+    mesh_iterator_t iter;
+
+    if (DEFINED(WIN32)) return;
+    for (i = 0; i < 1000; i++) {
+        vec3_set(pos, i % 37 - 10, i % 23 - 5, i % 19);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){i % 255, 3, i % 7, 255});
+    }
+    expected = mesh_copy(mesh);
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    err = goxel_import_file(path, NULL);
+    TEST(err == 0);
+    // The import puts the voxels in a new layer.
+    mesh = goxel.image->layers->next->mesh;
+    TEST(count_voxels(mesh) == count_voxels(expected));
+    iter = mesh_get_iterator(expected, 0);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(expected, NULL, pos, c);
+        mesh_get_at(mesh, NULL, pos, c2);
+        TEST(memcmp(c, c2, 4) == 0);
+    }
+    mesh_delete(expected);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Import truncated and corrupted files of the binary formats, that must
+// fail cleanly instead of reading past the data.
+static void test_import_corrupt(void)
+{
+    const char *paths[] = {"/tmp/goxel_test.vox", "/tmp/goxel_test.qb",
+                           "/tmp/goxel_test.kvx", "/tmp/goxel_test.vxl"};
+    int i, j, k, size;
+    char *data;
+    FILE *file;
+    mesh_t *mesh;
+
+    if (DEFINED(WIN32)) return;
+    srand(1);
+    for (i = 0; i < ARRAY_SIZE(paths); i++) {
+        mesh = goxel.image->active_layer->mesh;
+        for (j = 0; j < 100; j++) {
+            mesh_set_at(mesh, NULL, (int[]){j % 13, j % 7, j % 5},
+                        (uint8_t[]){j, 20, 30, 255});
+        }
+        TEST(goxel_export_to_file(paths[i], NULL) == 0);
+        data = read_file(paths[i], &size);
+        for (j = 0; j < 6; j++) {
+            file = fopen(paths[i], "wb");
+            if (j < 4) {
+                fwrite(data, size * j / 4, 1, file);
+            } else {
+                // Leave the header, that has the models size.
+                for (k = 0; k < 32; k++)
+                    data[64 + rand() % (size - 64)] = rand() % 256;
+                fwrite(data, size, 1, file);
+            }
+            fclose(file);
+            image_delete(goxel.image);
+            goxel.image = image_new();
+            goxel_import_file(paths[i], NULL);
+        }
+        free(data);
+        image_delete(goxel.image);
+        goxel.image = image_new();
+    }
+}
+
+static void test_png_slices(void)
+{
+    const char *path = "/tmp/goxel_test_slices.png";
+    int i, err, w, h, bpp, x, y, z;
+    uint8_t *img, *p;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    // A 20x20x20 volume, so that the bands of rows cross the blocks.
+    for (i = 0; i < 20; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i, i, i}, (uint8_t[]){i, 1, 2, 255});
+    }
+    bbox_from_aabb(goxel.image->box, (int[2][3]){{0, 0, 0}, {20, 20, 20}});
+    err = goxel_export_to_file(path, "png slices");
+    TEST(err == 0);
+    bpp = 4;
+    img = img_read(path, &w, &h, &bpp);
+    TEST(img && w == 20 * 20 && h == 20 && bpp == 4);
+    for (z = 0; z < 20; z++)
+    for (y = 0; y < 20; y++)
+    for (x = 0; x < 20; x++) {
+        p = &img[(y * w + z * 20 + x) * 4];
+        if (x == y && y == z)
+            TEST(p[0] == x && p[1] == 1 && p[2] == 2 && p[3] == 255);
+        else
+            TEST(p[3] == 0);
+    }
+    free(img);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_png_write(void)
+{
+    const char *path = "/tmp/goxel_test_write.png";
+    const int W = 1000, H = 1200;
+    int i, n, level, w, h, bpp, err;
+    uint8_t *img, *img2;
+
+    if (DEFINED(WIN32)) return;
+    // Large enough to be written in several bands.
+    img = malloc(W * H * 4);
+    for (i = 0; i < W * H * 4; i++)
+        img[i] = (i % (W * 4)) / 7 + (i / (W * 4)) + (i % 97 == 0) * 50;
+    for (level = 1; level <= 9; level += 8) {
+        err = img_write_png(img, W, H, 4, level, path);
+        TEST(err == 0);
+        bpp = 4;
+        img2 = img_read(path, &w, &h, &bpp);
+        TEST(img2 && w == W && h == H && bpp == 4);
+        TEST(memcmp(img, img2, W * H * 4) == 0);
+        free(img2);
+    }
+    // Small images, written in a single band, with all the formats.
+    for (n = 1; n <= 4; n++) {
+        err = img_write_png(img, 20, 10, n, 0, path);
+        TEST(err == 0);
+        bpp = n;
+        img2 = img_read(path, &w, &h, &bpp);
+        TEST(img2 && w == 20 && h == 10 && bpp == n);
+        TEST(memcmp(img, img2, 20 * 10 * n) == 0);
+        free(img2);
+    }
+    free(img);
+}
+
+static void test_povray_export(void)
+{
+    // The runs don't cross the blocks boundaries.
+    const int n = min(10, BLOCK_SIZE);
+    const char *path = "/tmp/goxel_test.povray";
+    char *data, *line, buf[64];
+    int i, err, size, nb = 0;
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    // Two runs of n voxels, and an isolated voxel.
+    for (i = 0; i < n; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+        mesh_set_at(mesh, NULL, (int[]){i, 1, 0}, (uint8_t[]){4, 5, 6, 255});
+    }
+    mesh_set_at(mesh, NULL, (int[]){n, 1, 0}, (uint8_t[]){7, 8, 9, 255});
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+    data = read_file(path, &size);
+    TEST(data);
+    snprintf(buf, sizeof(buf), "Vox(<0, 0, 0>, <%d, 1, 1>, <1, 2, 3>)", n);
+    TEST(strstr(data, buf));
+    snprintf(buf, sizeof(buf), "Vox(<0, 1, 0>, <%d, 1, 1>, <4, 5, 6>)", n);
+    TEST(strstr(data, buf));
+    snprintf(buf, sizeof(buf), "Vox(<%d, 1, 0>, <1, 1, 1>, <7, 8, 9>)", n);
+    TEST(strstr(data, buf));
+    for (line = strtok(data, "\n"); line; line = strtok(NULL, "\n")) {
+        if (strncmp(line, "    Vox(", 8) == 0) nb++;
+    }
+    TEST(nb == 3);
+    free(data);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static bool on_export_progress(void *user, float progress)
+{
+    float *last = user;
+    if (progress < last[0]) last[1] = 1; // Error: not monotonic.
+    last[0] = progress;
+    return progress < last[2];
+}
+
+static void test_export_progress(void)
+{
+    const char *path = "/tmp/goxel_test_progress.obj";
+    int i, err;
+    float state[3]; // Last progress, error flag, cancel threshold.
+    mesh_t *mesh = goxel.image->active_layer->mesh;
+
+    if (DEFINED(WIN32)) return;
+    for (i = 0; i < 200; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i, i % 3, 0},
+                    (uint8_t[]){255, 0, 0, 255});
+    }
+    file_format_set_progress_callback(on_export_progress, state);
+
+    memcpy(state, (float[]){0, 0, 2}, sizeof(state));
+    err = goxel_export_to_file(path, NULL);
+    TEST(err == 0);
+    TEST(state[0] == 1 && state[1] == 0);
+
+    // Cancel at half the export: the file should not be created.
+    remove(path);
+    memcpy(state, (float[]){0, 0, 0.5}, sizeof(state));
+    err = goxel_export_to_file(path, NULL);
+    TEST(err != 0);
+    TEST(state[0] >= 0.5 && state[0] < 1);
+    TEST(get_file_size(path) == -1);
+
+    file_format_set_progress_callback(NULL, NULL);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_mesh_blocks(void)
+{
+    const int n = 12; // Number of blocks per side.
+    const int N = BLOCK_SIZE;
+    int i, x, y, z, pos[3];
+    uint8_t v[4];
+    uint32_t seed = 1;
+    mesh_t *mesh, *copy;
+    double t;
+    long sum = 0;
+
+    // Put one voxel per block, with a color derived from its position.
+    mesh = mesh_new();
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n; x++) {
+        vec3_set(pos, (x - n / 2) * N + 3, (y - n / 2) * N, z * N + N - 1);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){x, y, z, 255});
+    }
+
+    // Copy on write.
+    copy = mesh_copy(mesh);
+    mesh_set_at(copy, NULL, (int[]){3, 0, N - 1}, (uint8_t[]){1, 2, 3, 255});
+    mesh_get_at(mesh, NULL, (int[]){3, 0, N - 1}, v);
+    TEST(v[0] == n / 2 && v[1] == n / 2 && v[2] == 0);
+    mesh_get_at(copy, NULL, (int[]){3, 0, N - 1}, v);
+    TEST(v[0] == 1 && v[1] == 2 && v[2] == 3);
+
+    // Remove every other block from the copy.
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n; x += 2) {
+        vec3_set(pos, (x - n / 2) * N, (y - n / 2) * N, z * N);
+        mesh_clear_block(copy, NULL, pos);
+    }
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n; x++) {
+        vec3_set(pos, (x - n / 2) * N + 3, (y - n / 2) * N, z * N + N - 1);
+        TEST(mesh_get_alpha_at(copy, NULL, pos) == (x % 2 ? 255 : 0));
+        mesh_get_at(mesh, NULL, pos, v);
+        TEST(v[0] == x && v[1] == y && v[2] == z && v[3] == 255);
+    }
+    mesh_delete(copy);
+
+    // Benchmark the blocks lookup: random access without accessor.
+    t = sys_get_time();
+    for (i = 0; i < 1 << 20; i++) {
+        seed = seed * 1103515245 + 12345;
+        vec3_set(pos, (int)(seed % (n * N)) - n * N / 2,
+                       (int)((seed >> 8) % (n * N)) - n * N / 2,
+                       (int)((seed >> 16) % (n * N)));
+        sum += mesh_get_alpha_at(mesh, NULL, pos);
+    }
+    t = sys_get_time() - t;
+    LOG_I("mesh blocks lookup: %.1f M/s (%ld)", (1 << 20) / t / 1e6, sum);
+    mesh_delete(mesh);
+}
+
+// Check that accesses through an accessor crossing blocks boundaries give
+// the same result as direct accesses, even after the mesh changed.
+static void test_mesh_blocks_array(void)
+{
+    const uint8_t red[4] = {255, 0, 0, 255};
+    const int N = BLOCK_SIZE;
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    int i, nb, pos[3];
+    bool ok = true;
+
+    // The blocks are stored in insertion order.
+    mesh = mesh_new();
+    for (i = 0; i < 100; i++)
+        mesh_set_at(mesh, NULL, (int[]){(i % 10) * N, (i / 10) * N, 0},
+                    red);
+    TEST(mesh_get_blocks_array_size(mesh) == 100);
+    for (i = 0; i < 100; i++) {
+        ok = ok && mesh_get_block_pos_by_index(mesh, i, pos) &&
+             pos[0] == (i % 10) * N && pos[1] == (i / 10) * N;
+    }
+    TEST(ok);
+
+    // Removing blocks while iterating a shared mesh visits all the blocks
+    // once.
+    copy = mesh_copy(mesh);
+    nb = 0;
+    iter = mesh_get_iterator(copy, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) {
+        nb++;
+        if (pos[0] != 0) mesh_clear_block(copy, &iter, pos);
+    }
+    TEST(nb == 100);
+    TEST(mesh_get_blocks_array_size(copy) == 100);
+    TEST(!mesh_get_block_pos_by_index(copy, 1, pos));
+    TEST(mesh_get_block_pos_by_index(copy, 10, pos) && pos[1] == N);
+
+    // The holes are removed when the array needs to grow.
+    for (i = 0; i < 100; i++)
+        mesh_set_at(copy, NULL, (int[]){0, i * N, N}, red);
+    TEST(mesh_get_blocks_array_size(copy) < 200);
+    nb = 0;
+    iter = mesh_get_iterator(copy, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) nb++;
+    TEST(nb == 110);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Check that writing into a copy of a mesh only copies the modified block,
+// and never changes the original mesh, through an accessor and after the
+// blocks array of the copy has been rebuilt.
+static void test_mesh_cow(void)
+{
+    const int n = 1000;
+    const int N = BLOCK_SIZE;
+    mesh_t *mesh, *copy;
+    mesh_accessor_t acc;
+    int i, pos[3];
+    uint64_t id1, id2;
+    uint8_t v[4];
+    bool ok = true;
+
+    mesh = mesh_new();
+    for (i = 0; i < n; i++) {
+        vec3_set(pos, (i % 10) * N, (i / 10 % 10) * N, (i / 100) * N);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){i % 256, i / 256, 0, 255});
+    }
+    copy = mesh_copy(mesh);
+    acc = mesh_get_accessor(copy);
+    mesh_get_at(copy, &acc, (int[]){0, 0, 0}, v);
+    mesh_set_at(copy, &acc, (int[]){1, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+    mesh_get_at(copy, &acc, (int[]){1, 0, 0}, v);
+    TEST(v[0] == 1 && v[1] == 2 && v[2] == 3);
+    mesh_get_at(mesh, NULL, (int[]){1, 0, 0}, v);
+    TEST(v[3] == 0);
+    // All the other blocks are still shared.
+    for (i = 0; i < n; i++) {
+        vec3_set(pos, (i % 10) * N, (i / 10 % 10) * N, (i / 100) * N);
+        mesh_get_block_data(mesh, NULL, pos, &id1);
+        mesh_get_block_data(copy, NULL, pos, &id2);
+        ok = ok && id1 && (i == 0 ? id1 != id2 : id1 == id2);
+    }
+    TEST(ok);
+
+    // Remove most of the blocks, so that the next block added rebuilds the
+    // blocks array of the copy.
+    for (i = 0; i < n; i++) {
+        if (i % 4 == 0) continue;
+        vec3_set(pos, (i % 10) * N, (i / 10 % 10) * N, (i / 100) * N);
+        mesh_clear_block(copy, NULL, pos);
+    }
+    for (i = 0; i < n; i++)
+        mesh_set_at(copy, NULL, (int[]){i * N, 0, 10 * N}, v);
+    for (i = 0; i < n; i++) {
+        vec3_set(pos, (i % 10) * N, (i / 10 % 10) * N, (i / 100) * N);
+        mesh_get_at(mesh, NULL, pos, v);
+        ok = ok && v[0] == i % 256 && v[1] == i / 256 && v[3] == 255;
+        mesh_get_at(copy, NULL, pos, v);
+        ok = ok && v[3] == (i % 4 == 0 ? 255 : 0);
+    }
+    TEST(ok);
+    TEST(mesh_get_blocks_array_size(copy) < 2 * n);
+    mesh_delete(mesh);
+    mesh_delete(copy);
+}
+
+// Check that the writes of a session only change the mesh key and the
+// blocks data ids once, and that they are changed again at the end.
+static void test_mesh_write_session(void)
+{
+    mesh_t *mesh, *copy;
+    uint64_t key, id, id2;
+    int i;
+    bool ok = true;
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    key = mesh_get_key(mesh);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &id);
+
+    mesh_begin_write(mesh);
+    mesh_set_at(mesh, NULL, (int[]){1, 0, 0}, (uint8_t[]){0, 255, 0, 255});
+    TEST(mesh_get_key(mesh) != key);
+    key = mesh_get_key(mesh);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &id2);
+    TEST(id2 != id);
+    id = id2;
+    mesh_begin_write(mesh);
+    for (i = 2; i < 16; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i, 0, 0},
+                    (uint8_t[]){0, 0, 255, 255});
+        mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &id2);
+        ok = ok && id2 == id && mesh_get_key(mesh) == key;
+    }
+    TEST(ok);
+    mesh_end_write(mesh);
+    TEST(mesh_get_key(mesh) == key);
+
+    // A copy made during the session keeps its value and key.
+    copy = mesh_copy(mesh);
+    mesh_set_at(mesh, NULL, (int[]){0, 1, 0}, (uint8_t[]){0, 0, 255, 255});
+    TEST(mesh_get_key(mesh) != mesh_get_key(copy));
+    TEST(mesh_get_alpha_at(copy, NULL, (int[]){0, 1, 0}) == 0);
+    key = mesh_get_key(mesh);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &id);
+
+    mesh_end_write(mesh);
+    TEST(mesh_get_key(mesh) != key);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &id2);
+    TEST(id2 != id);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+static void test_mesh_accessor(void)
+{
+    int i, x, y, z, pos[3], p[3];
+    int sum1 = 0, sum2 = 0;
+    mesh_t *mesh, *copy;
+    mesh_accessor_t acc;
+
+    mesh = mesh_new();
+    acc = mesh_get_accessor(mesh);
+    for (z = -20; z < 20; z++)
+    for (y = -20; y < 20; y++)
+    for (x = -20; x < 20; x++) {
+        if ((x + y * 3 + z * 7) % 5) continue;
+        vec3_set(pos, x, y, z);
+        mesh_set_at(mesh, &acc, pos, (uint8_t[]){255, 0, 0, 255});
+    }
+    mesh_clear_block(mesh, &acc, (int[]){0, 0, 0});
+
+    acc = mesh_get_accessor(mesh);
+    for (z = -20; z < 20; z++)
+    for (y = -20; y < 20; y++)
+    for (x = -20; x < 20; x++) {
+        for (i = 0; i < 6; i++) {
+            vec3_set(p, x + FACES_NORMALS[i][0], y + FACES_NORMALS[i][1],
+                        z + FACES_NORMALS[i][2]);
+            sum1 += mesh_get_alpha_at(mesh, &acc, p);
+            sum2 += mesh_get_alpha_at(mesh, NULL, p);
+        }
+        if (x == 0 && y == 0 && z == 0) {
+            // Force a copy of the blocks in the middle of the iteration.
+            copy = mesh_copy(mesh);
+            mesh_set_at(mesh, &acc, (int[]){-1, -1, -1},
+                        (uint8_t[]){0, 0, 0, 0});
+            TEST(mesh_get_alpha_at(mesh, &acc, (int[]){-1, -1, -1}) == 0);
+            mesh_delete(copy);
+        }
+    }
+    TEST(sum1 == sum2);
+    mesh_delete(mesh);
+}
+
+// Check that mesh_read and mesh_write on unaligned boxes give the same
+// values as per voxel accesses.
+static void test_mesh_read_write(void)
+{
+    int x, y, z, i, pos[3], p[3];
+    const int box_pos[3] = {-21, -5, 3};
+    const int size[3] = {37, 18, 20};
+    uint8_t v[4], *data;
+    mesh_t *mesh;
+    bool ok = true;
+
+    mesh = mesh_new();
+    for (z = -30; z < 30; z++)
+    for (y = -30; y < 30; y++)
+    for (x = -30; x < 30; x++) {
+        if ((x + y * 3 + z * 7) % 4) continue;
+        vec3_set(pos, x, y, z);
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){x, y, z, 255});
+    }
+    data = malloc(size[0] * size[1] * size[2] * 4);
+    mesh_read(mesh, box_pos, size, data);
+    for (z = 0, i = 0; z < size[2]; z++)
+    for (y = 0; y < size[1]; y++)
+    for (x = 0; x < size[0]; x++, i++) {
+        vec3_set(p, box_pos[0] + x, box_pos[1] + y, box_pos[2] + z);
+        mesh_get_at(mesh, NULL, p, v);
+        ok = ok && memcmp(v, &data[i * 4], 4) == 0;
+    }
+    TEST(ok);
+
+    // Write the box back with a new value, and clear it again.
+    memset(data, 128, size[0] * size[1] * size[2] * 4);
+    mesh_write(mesh, box_pos, size, data);
+    TEST(mesh_get_alpha_at(mesh, NULL, box_pos) == 128);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){-22, -5, 3}) == 255);
+    memset(data, 0, size[0] * size[1] * size[2] * 4);
+    mesh_write(mesh, box_pos, size, data);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){-21, 12, 22}) == 0);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){-21, 12, 23}) != 0);
+    free(data);
+    mesh_delete(mesh);
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    int nb_voxels;
+    bool ok;
+} foreach_test_t;
+
+static void foreach_test_block(void *user, const int pos[3], uint64_t id,
+                               const uint8_t (*voxels)[4])
+{
+    const int N = BLOCK_SIZE;
+    foreach_test_t *test = user;
+    int i, p[3], nb = 0;
+    uint8_t v[4];
+
+    for (i = 0; i < N * N * N; i++) {
+        vec3_set(p, pos[0] + i % N, pos[1] + i / N % N, pos[2] + i / (N * N));
+        mesh_get_at(test->mesh, NULL, p, v);
+        if (memcmp(v, voxels[i], 4) != 0) test->ok = false;
+        nb += voxels[i][3] ? 1 : 0;
+    }
+    __atomic_add_fetch(&test->nb_voxels, nb, __ATOMIC_RELAXED);
+}
+
+// Check that mesh_foreach_block gives the same voxels as mesh_get_at, for
+// all the blocks storage formats.
+static void test_mesh_foreach_block(void)
+{
+    int x, y, z, nb, nb_unique;
+    mesh_t *mesh;
+    mesh_stats_t stats;
+    foreach_test_t test;
+
+    mesh = mesh_new();
+    for (z = -20; z < 20; z++)
+    for (y = -20; y < 20; y++)
+    for (x = -20; x < 20; x++) {
+        // Some uniform blocks and some blocks with many colors.
+        if (x < 0 && (x + y * 3 + z * 7) % 4) continue;
+        mesh_set_at(mesh, NULL, (int[]){x, y, z},
+                    x < 0 ? (uint8_t[]){x, y, z, 255} :
+                            (uint8_t[]){10, 20, 30, 255});
+    }
+    mesh_remove_empty_blocks(mesh, false);
+    mesh_get_stats(mesh, &stats);
+
+    test = (foreach_test_t){.mesh = mesh, .ok = true};
+    nb = mesh_foreach_block(mesh, 0, foreach_test_block, &test);
+    TEST(test.ok);
+    TEST(test.nb_voxels == stats.nb_voxels);
+
+    test = (foreach_test_t){.mesh = mesh, .ok = true};
+    TEST(mesh_foreach_block(mesh, MESH_FOREACH_PARALLEL,
+                            foreach_test_block, &test) == nb);
+    TEST(test.ok);
+    TEST(test.nb_voxels == stats.nb_voxels);
+
+    nb_unique = mesh_foreach_block(mesh, MESH_FOREACH_UNIQUE,
+                                   foreach_test_block, &test);
+    TEST(nb_unique > 0 && nb_unique <= nb);
+    mesh_delete(mesh);
+}
+
+// Check mesh_replace_colors against a voxel by voxel replacement, on
+// uniform, indexed and full RGBA blocks.
+static void test_mesh_replace_colors(void)
+{
+    const int n = BLOCK_SIZE;
+    const uint8_t src[3][4] = {{255, 0, 0, 255}, {0, 255, 0, 255},
+                               {255, 0, 0, 255}};
+    const uint8_t dst[3][4] = {{255, 255, 0, 255}, {0, 0, 0, 0},
+                               {0, 0, 255, 255}};
+    mesh_t *mesh, *copy;
+    uint8_t v[4], w[4], c[4];
+    uint64_t id, id2;
+    int x, y, z, i, nb;
+    bool ok = true;
+    double t;
+
+    mesh = mesh_new();
+    mesh_fill_block(mesh, (int[]){0, 0, 0}, src[0]);
+    mesh_fill_block(mesh, (int[]){n * 3, 0, 0}, (uint8_t[]){0, 0, 255, 255});
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n; x++) {
+        // A few colors, and more than 256 colors.
+        mesh_set_at(mesh, NULL, (int[]){n + x, y, z},
+                    src[(x + y + z) % 2]);
+        mesh_set_at(mesh, NULL, (int[]){n * 2 + x, y, z},
+                    x % 4 ? (uint8_t[]){x, y, z, 255} : src[0]);
+    }
+    mesh_remove_empty_blocks(mesh, false);
+    copy = mesh_copy(mesh);
+    mesh_get_block_data(mesh, NULL, (int[]){n * 3, 0, 0}, &id);
+
+    TEST(mesh_replace_colors(mesh, 3, src, dst) == 3);
+    mesh_get_block_data(mesh, NULL, (int[]){n * 3, 0, 0}, &id2);
+    TEST(id2 == id);
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n * 4; x++) {
+        mesh_get_at(copy, NULL, (int[]){x, y, z}, v);
+        mesh_get_at(mesh, NULL, (int[]){x, y, z}, w);
+        memcpy(c, v, 4);
+        for (i = 2; i >= 0; i--) {
+            if (memcmp(v, src[i], 4) == 0) memcpy(c, dst[i], 4);
+        }
+        ok = ok && memcmp(c, w, 4) == 0;
+    }
+    TEST(ok);
+    // Nothing to replace anymore.
+    TEST(mesh_replace_colors(mesh, 3, src, dst) == 0);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+
+    // Benchmark on indexed blocks.
+    mesh = mesh_new();
+    for (z = 0; z < 128; z++)
+    for (y = 0; y < 128; y++)
+    for (x = 0; x < 128; x++) {
+        mesh_set_at(mesh, NULL, (int[]){x, y, z},
+                    (uint8_t[]){(x ^ y ^ z) & 15, 0, 0, 255});
+    }
+    mesh_remove_empty_blocks(mesh, false);
+    t = sys_get_time();
+    nb = mesh_replace_colors(mesh, 1, (uint8_t[][4]){{3, 0, 0, 255}},
+                             (uint8_t[][4]){{4, 0, 0, 255}});
+    t = sys_get_time() - t;
+    LOG_I("replace colors: %.1f M voxels/s (%d blocks)",
+          128 * 128 * 128 / t / 1e6, nb);
+    mesh_delete(mesh);
+}
+
+static int count_blocks(const mesh_t *mesh)
+{
+    mesh_iterator_t iter;
+    int nb = 0, pos[3];
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) nb++;
+    return nb;
+}
+
+// Check that mesh_blit replaces the voxels of whole and partial blocks, and
+// removes the blocks it leaves empty.
+static void test_mesh_blit(void)
+{
+    const int size = 32 * 16 * 16 * 4;
+    mesh_t *mesh;
+    uint8_t *data;
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){1, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){20, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    data = calloc(1, size);
+    mesh_blit(mesh, data, 0, 0, 0, 4, 4, 4, NULL);
+    TEST(count_blocks(mesh) == 1);
+
+    memset(data, 255, size);
+    mesh_blit(mesh, data, 16, 0, 0, 32, 16, 16, NULL);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){20, 1, 1}) == 255);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){47, 15, 15}) == 255);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){48, 0, 0}) == 0);
+    free(data);
+    mesh_delete(mesh);
+}
+
+// Check that mesh_remove_empty_blocks still finds the empty blocks when
+// it only looks at the blocks modified since the previous call.
+static void test_mesh_remove_empty_blocks(void)
+{
+    const uint8_t red[4] = {255, 0, 0, 255}, empty[4] = {0};
+    const int N = BLOCK_SIZE;
+    mesh_t *mesh, *copy;
+    int i;
+
+    mesh = mesh_new();
+    for (i = 0; i < 8; i++)
+        mesh_set_at(mesh, NULL, (int[]){i * N, 0, 0}, red);
+    mesh_remove_empty_blocks(mesh, false);
+    TEST(count_blocks(mesh) == 8);
+
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, empty);
+    mesh_set_at(mesh, NULL, (int[]){N, 1, 0}, red);
+    mesh_set_at(mesh, NULL, (int[]){N, 0, 0}, empty);
+    mesh_remove_empty_blocks(mesh, true);
+    TEST(count_blocks(mesh) == 7);
+
+    // The copy shares the state of the last call.
+    copy = mesh_copy(mesh);
+    mesh_set_at(copy, NULL, (int[]){2 * N, 0, 0}, empty);
+    mesh_set_at(copy, NULL, (int[]){3 * N, 0, 0}, empty);
+    mesh_remove_empty_blocks(copy, false);
+    TEST(count_blocks(copy) == 5);
+    TEST(count_blocks(mesh) == 7);
+    mesh_set_at(mesh, NULL, (int[]){N, 1, 0}, empty);
+    mesh_remove_empty_blocks(mesh, false);
+    TEST(count_blocks(mesh) == 6);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Check that uniform and palette blocks are stored without voxels array,
+// and that writing into them still works.
+static void test_mesh_compression(void)
+{
+    const int N = BLOCK_SIZE;
+    const int pos[3] = {-N, 0, 0}, size[3] = {2 * N, 2 * N, N};
+    mesh_global_stats_t stats1, stats2;
+    uint8_t *data, v[4];
+    mesh_t *mesh, *copy;
+
+    // The four blocks are identical, so don't let them share their data.
+    mesh_set_dedup(false);
+    mesh_get_global_stats(&stats1);
+    mesh = mesh_new();
+    data = malloc(size[0] * size[1] * size[2] * 4);
+    memset(data, 200, size[0] * size[1] * size[2] * 4);
+    mesh_write(mesh, pos, size, data);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_compressed - stats1.nb_compressed == 4);
+
+    copy = mesh_copy(mesh);
+    mesh_set_at(mesh, NULL, (int[]){-1, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+    mesh_get_at(mesh, NULL, (int[]){-2, 0, 0}, v);
+    TEST(v[0] == 200 && v[3] == 200);
+    mesh_get_at(mesh, NULL, (int[]){-1, 0, 0}, v);
+    TEST(v[0] == 1 && v[3] == 255);
+    mesh_get_at(copy, NULL, (int[]){-1, 0, 0}, v);
+    TEST(v[0] == 200 && v[3] == 200);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_compressed - stats1.nb_compressed == 4);
+
+    // Setting the voxel back should allow to compress the block again.
+    mesh_set_at(mesh, NULL, (int[]){-1, 0, 0},
+                (uint8_t[]){200, 200, 200, 200});
+    mesh_remove_empty_blocks(mesh, false);
+    mesh_read(mesh, pos, size, data);
+    TEST(data[0] == 200 && data[size[0] * size[1] * size[2] * 4 - 1] == 200);
+    mesh_delete(copy);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_compressed - stats1.nb_compressed == 4);
+
+    // A few different colors: the block should use a palette.
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(mesh, NULL, (int[]){5, 6, 7}, (uint8_t[]){4, 5, 6, 255});
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_compressed - stats1.nb_compressed == 3);
+    mesh_remove_empty_blocks(mesh, false);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_compressed - stats1.nb_compressed == 4);
+    mesh_get_at(mesh, NULL, (int[]){5, 6, 7}, v);
+    TEST(v[0] == 4 && v[1] == 5 && v[2] == 6 && v[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){5, 6, 6}, v);
+    TEST(v[0] == 200 && v[3] == 200);
+    free(data);
+    mesh_delete(mesh);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_compressed == stats1.nb_compressed);
+    TEST(stats2.mem == stats1.mem);
+    mesh_set_dedup(true);
+}
+
+// Check that iterating with the neighbors gives each missing block next to
+// the mesh blocks exactly once, without changing the mesh.
+static void test_mesh_journal(void)
+{
+    mesh_t *mesh, *copy;
+    uint64_t v1, v2;
+    int nb, (*pos)[3];
+    const int N = BLOCK_SIZE;
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){1, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    v1 = mesh_get_version(mesh);
+    TEST(mesh_get_changes(mesh, v1, &pos) == 0);
+
+    // Several changes in the same blocks are only reported once.
+    mesh_set_at(mesh, NULL, (int[]){2, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){N + 4, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){3, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    nb = mesh_get_changes(mesh, v1, &pos);
+    TEST(nb == 2);
+    TEST(memcmp(pos[0], (int[]){0, 0, 0}, sizeof(pos[0])) == 0);
+    TEST(memcmp(pos[1], (int[]){N, 0, 0}, sizeof(pos[1])) == 0);
+    free(pos);
+
+    // The copies keep the history of the mesh.
+    v2 = mesh_get_version(mesh);
+    copy = mesh_copy(mesh);
+    mesh_clear_block(mesh, NULL, (int[]){N, 0, 0});
+    mesh_clear_block(mesh, NULL, (int[]){2 * N, 0, 0}); // Doesn't exist.
+    TEST(mesh_get_changes(mesh, mesh_get_version(copy), &pos) == 1);
+    free(pos);
+    TEST(mesh_get_changes(mesh, v2, &pos) == 1);
+    free(pos);
+    TEST(mesh_get_changes(mesh, v1, &pos) == 2);
+    free(pos);
+
+    // But not if we diverged from them.
+    mesh_set_at(copy, NULL, (int[]){2 * N + 8, 1, 1}, (uint8_t[]){255, 0, 0, 255});
+    TEST(mesh_get_changes(mesh, mesh_get_version(copy), &pos) == -1);
+    TEST(mesh_get_changes(copy, v2, &pos) == 1);
+    free(pos);
+
+    mesh_clear(mesh);
+    TEST(mesh_get_changes(mesh, v1, &pos) == -1);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+static void test_mesh_iter_neighbors(void)
+{
+    int n = 0, pos[3];
+    const int N = BLOCK_SIZE;
+    uint64_t key;
+    mesh_t *mesh;
+    mesh_iterator_t iter;
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){N, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    key = mesh_get_key(mesh);
+    iter = mesh_get_iterator(mesh,
+            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+    while (mesh_iter(&iter, pos)) n++;
+    TEST(n == 2 + 10);
+    TEST(mesh_get_key(mesh) == key);
+    n = 0;
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos)) n++;
+    TEST(n == 2);
+
+    // The cached neighbors should follow the changes of the mesh.
+    mesh_set_at(mesh, NULL, (int[]){N, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    mesh_remove_empty_blocks(mesh, false);
+    n = 0;
+    iter = mesh_get_iterator(mesh,
+            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+    while (mesh_iter(&iter, pos)) n++;
+    TEST(n == 1 + 6);
+    mesh_delete(mesh);
+}
+
+// Check that identical blocks created independently share their data.
+static void test_mesh_dedup(void)
+{
+    int i, j, pos[3];
+    const int N = BLOCK_SIZE;
+    uint64_t id1, id2;
+    mesh_t *mesh1, *mesh2;
+    mesh_global_stats_t stats1, stats2;
+    uint8_t v[4];
+
+    mesh1 = mesh_new();
+    mesh2 = mesh_new();
+    for (i = 0; i < N * N * N; i++) {
+        // More than 256 colors, so that the blocks are not compressed.
+        pos[0] = i % N;
+        pos[1] = i / N % N;
+        pos[2] = i / (N * N);
+        mesh_set_at(mesh1, NULL, pos, (uint8_t[]){i % 256, i / 256, 0, 255});
+        pos[0] += 2 * N;
+        mesh_set_at(mesh2, NULL, pos, (uint8_t[]){i % 256, i / 256, 0, 255});
+    }
+    mesh_get_global_stats(&stats1);
+    mesh_remove_empty_blocks(mesh1, false);
+    mesh_remove_empty_blocks(mesh2, false);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_dedup - stats1.nb_dedup == 1);
+    TEST(stats2.mem < stats1.mem);
+    mesh_get_block_data(mesh1, NULL, (int[]){0, 0, 0}, &id1);
+    mesh_get_block_data(mesh2, NULL, (int[]){2 * N, 0, 0}, &id2);
+    TEST(id1 && id1 == id2);
+
+    // Writing into a shared block doesn't change the other one.
+    mesh_set_at(mesh1, NULL, (int[]){1, 2, 3}, (uint8_t[]){0, 0, 0, 0});
+    mesh_get_at(mesh2, NULL, (int[]){2 * N + 1, 2, 3}, v);
+    TEST(v[3] == 255);
+    mesh_delete(mesh1);
+    mesh_get_at(mesh2, NULL, (int[]){2 * N + 1, 2, 3}, v);
+    j = 1 + 2 * N + 3 * N * N;
+    TEST(v[0] == j % 256 && v[1] == j / 256 && v[3] == 255);
+    mesh_delete(mesh2);
+}
+
+// Page out the blocks data, and check that we get it back.
+static void test_mesh_paging(void)
+{
+    int i, pos[3];
+    mesh_t *mesh;
+    mesh_global_stats_t stats1, stats2;
+    uint8_t v[4];
+
+    mesh = mesh_new();
+    for (i = 0; i < 16 * 16 * 16; i++) {
+        pos[0] = i % 16;
+        pos[1] = i / 16 % 16;
+        pos[2] = i / 256;
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){i % 256, i / 256, 0, 255});
+    }
+    mesh_get_global_stats(&stats1);
+    TEST(mesh_set_paging(1, NULL) == 0);
+    // The blocks used since the previous call are never paged out.
+    mesh_page_out(NULL, 0);
+    mesh_page_out((const mesh_t*[]){mesh}, 1);
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_paged > stats1.nb_paged);
+    TEST(stats2.mem < stats1.mem);
+    TEST(mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, NULL) == NULL);
+
+    for (i = 0; i < 16 * 16 * 16; i++) {
+        pos[0] = i % 16;
+        pos[1] = i / 16 % 16;
+        pos[2] = i / 256;
+        mesh_get_at(mesh, NULL, pos, v);
+        TEST(v[0] == i % 256 && v[1] == i / 256 && v[3] == 255);
+    }
+    mesh_get_global_stats(&stats1);
+    TEST(stats1.nb_page_ins > stats2.nb_page_ins);
+    TEST(stats1.nb_paged < stats2.nb_paged);
+    mesh_set_paging(0, NULL);
+    mesh_delete(mesh);
+}
+
+// Check that the undo history stays into its memory budget.
+static void test_history_budget(void)
+{
+    int i, step, nb, pos[3];
+    uint64_t budget = image_history_get_budget();
+    image_t *img, *hist;
+    mesh_t *mesh;
+    uint8_t v[4];
+
+    img = image_new();
+    image_history_set_budget(256 * KB);
+    for (step = 0; step < 64; step++) {
+        image_history_push(img);
+        TEST(image_history_get_mem(img) <= 256 * KB);
+        mesh = img->active_layer->mesh;
+        // More than 256 colors, so that the blocks are not compressed.
+        for (i = 0; i < 16 * 16 * 16; i++) {
+            pos[0] = i % 16;
+            pos[1] = i / 16 % 16;
+            pos[2] = i / 256;
+            mesh_set_at(mesh, NULL, pos,
+                        (uint8_t[]){i % 256, i / 256, step, 255});
+        }
+    }
+    nb = 0;
+    for (hist = img->history; hist != img; hist = hist->history_next) nb++;
+    TEST(nb > 1 && nb < 64);
+
+    image_undo(img);
+    mesh_get_at(img->active_layer->mesh, NULL, (int[]){1, 0, 0}, v);
+    TEST(v[0] == 1 && v[2] == 62);
+    image_redo(img);
+    mesh_get_at(img->active_layer->mesh, NULL, (int[]){1, 0, 0}, v);
+    TEST(v[0] == 1 && v[2] == 63);
+    image_delete(img);
+    image_history_set_budget(budget);
+}
+
+// Check that the undo history only keeps the changed blocks, and can still
+// undo and redo all the steps.
+static void test_history_delta(void)
+{
+    int i;
+    image_t *img;
+    layer_t *layer2;
+    uint8_t v[4];
+
+    img = image_new();
+    layer2 = image_add_layer(img, NULL);
+    mesh_set_at(layer2->mesh, NULL, (int[]){100, 0, 0},
+                (uint8_t[]){1, 2, 3, 255});
+    for (i = 0; i < 8; i++) {
+        image_history_push(img);
+        mesh_set_at(img->active_layer->mesh, NULL, (int[]){i * 16, 0, 0},
+                    (uint8_t[]){i + 1, 0, 0, 255});
+    }
+    // Only the last snapshot still has full meshes.
+    TEST(mesh_is_delta(img->history->layers->mesh));
+    TEST(mesh_is_delta(img->history->layers->next->mesh));
+    TEST(!mesh_is_delta(img->history_prev->layers->mesh));
+
+    for (i = 7; i >= 0; i--) {
+        image_undo(img);
+        mesh_get_at(img->active_layer->mesh, NULL, (int[]){i * 16, 0, 0}, v);
+        TEST(v[3] == 0);
+        if (i) {
+            mesh_get_at(img->active_layer->mesh, NULL,
+                        (int[]){(i - 1) * 16, 0, 0}, v);
+            TEST(v[0] == i && v[3] == 255);
+        }
+        mesh_get_at(img->layers->next->mesh, NULL, (int[]){100, 0, 0}, v);
+        TEST(v[0] == 1 && v[3] == 255);
+    }
+    for (i = 0; i < 8; i++) {
+        image_redo(img);
+        mesh_get_at(img->active_layer->mesh, NULL, (int[]){i * 16, 0, 0}, v);
+        TEST(v[0] == i + 1 && v[3] == 255);
+        TEST(!mesh_is_delta(img->layers->mesh));
+    }
+    image_delete(img);
+}
+
+// Check that the old history snapshots are moved to the spill file, and
+// loaded back when we undo.
+static void test_history_spill(void)
+{
+    int i, step, pos[3];
+    image_t *img;
+    mesh_global_stats_t stats1, stats2;
+    uint8_t v[4];
+
+    TEST(mesh_set_spill_dir("/tmp") == 0);
+    image_history_set_spill_steps(2);
+    img = image_new();
+    mesh_get_global_stats(&stats1);
+    for (step = 0; step < 8; step++) {
+        image_history_push(img);
+        // More than 256 colors, so that the blocks are not compressed.
+        for (i = 0; i < 16 * 16 * 16; i++) {
+            pos[0] = i % 16;
+            pos[1] = i / 16 % 16;
+            pos[2] = i / 256;
+            mesh_set_at(img->active_layer->mesh, NULL, pos,
+                        (uint8_t[]){i % 256, i / 256, step, 255});
+        }
+    }
+    mesh_get_global_stats(&stats2);
+    TEST(stats2.nb_paged >= stats1.nb_paged + 5);
+    TEST(stats2.spill_size > stats1.spill_size);
+
+    for (step = 6; step >= 0; step--) {
+        image_undo(img);
+        mesh_get_at(img->active_layer->mesh, NULL, (int[]){1, 2, 0}, v);
+        TEST(v[0] == 33 && v[2] == step && v[3] == 255);
+    }
+    mesh_get_global_stats(&stats1);
+    TEST(stats1.nb_page_ins > stats2.nb_page_ins);
+    image_delete(img);
+    image_history_set_spill_steps(0);
+    mesh_set_spill_dir(NULL);
+}
+
+// Check that a transaction gives a single history step, and doesn't fill
+// the operations cache.
+static void test_transaction(void)
+{
+    int i, nb;
+    image_t *img;
+    mesh_t *ref;
+    const mesh_t *layers_mesh;
+    uint64_t layers_key;
+    float box[4][4];
+    const char *name;
+    cache_t *cache, *op_cache = NULL;
+    cache_stats_t stats;
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 255},
+    };
+
+    for (i = 0; cache_registry_get(i, &name, &cache); i++) {
+        if (strcmp(name, "Mesh op") == 0) op_cache = cache;
+    }
+    img = image_new();
+    ref = mesh_new();
+    layers_mesh = image_get_layers_mesh(img);
+    layers_key = mesh_get_key(layers_mesh);
+    cache_registry_clear();
+
+    image_begin_transaction(img);
+    for (i = 0; i < 64; i++) {
+        image_begin_transaction(img);
+        image_history_push(img);
+        bbox_from_extents(box, VEC(i * 2, i % 7, 0), 4, 4, 4);
+        mesh_op(img->active_layer->mesh, &painter, box);
+        mesh_op(ref, &painter, box);
+        image_end_transaction(img);
+        TEST(mesh_get_key(image_get_layers_mesh(img)) == layers_key);
+    }
+    image_end_transaction(img);
+
+    TEST(mesh_diff(img->active_layer->mesh, ref, 0, NULL, NULL) == 0);
+    TEST(mesh_get_key(image_get_layers_mesh(img)) != layers_key);
+    if (op_cache) {
+        cache_get_stats(op_cache, &stats);
+        TEST(stats.nb_items == 64); // Only the ref mesh ops.
+    }
+    nb = 0;
+    for (i = 0; img->history != img && i < 2; i++) {
+        image_undo(img);
+        nb++;
+    }
+    TEST(nb == 1 && mesh_is_empty(img->active_layer->mesh));
+    mesh_delete(ref);
+    image_delete(img);
+}
+
+// Check that the blocks skipped or filled without evaluating all their
+// voxels give the same result as a brute force evaluation.
+static void test_procedural(void)
+{
+    procedural_t *proc;
+    mesh_t *mesh;
+    float box[4][4], p[3], s[3] = {48, 40, 24};
+    const uint8_t color[4] = {10, 200, 30, 255};
+    int x, y, z, k, nb_errors = 0, nb_voxels = 0;
+    uint8_t v[4];
+    bool inside;
+
+    for (k = 0; k < 2; k++) {
+        proc = procedural_new(k == 0 ? &procedural_terrain : &procedural_csg);
+        proc->scale = 16;
+        proc->seed = 3;
+        bbox_from_extents(box, VEC(4, 0, 8), s[0], s[1], s[2]);
+        mesh = mesh_new();
+        procedural_apply(proc, box, color, mesh);
+        for (z = -20; z < 36; z++)
+        for (y = -44; y < 44; y++)
+        for (x = -48; x < 56; x++) {
+            vec3_set(p, x + 0.5 - 4, y + 0.5, z + 0.5 - 8);
+            inside = fabsf(p[0]) < s[0] && fabsf(p[1]) < s[1] &&
+                     fabsf(p[2]) < s[2] && proc->kernel->sdf(proc, p, s) < 0;
+            mesh_get_at(mesh, NULL, (int[]){x, y, z}, v);
+            if (inside != (v[3] != 0)) nb_errors++;
+            if (inside && memcmp(v, color, 4)) nb_errors++;
+            nb_voxels += inside;
+        }
+        TEST(nb_errors == 0);
+        mesh_delete(mesh);
+        free(proc);
+    }
+    TEST(nb_voxels > 1000);
+}
+
+// Check the exact bounding box computed from the blocks occupancy masks.
+static void test_mesh_bbox(void)
+{
+    int bbox[2][3];
+    mesh_t *mesh;
+
+    mesh = mesh_new();
+    TEST(!mesh_get_bbox(mesh, bbox, true));
+    mesh_set_at(mesh, NULL, (int[]){-3, 5, 17}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){20, -7, 2}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){40, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){40, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    TEST(mesh_get_bbox(mesh, bbox, true));
+    TEST(bbox[0][0] == -3 && bbox[0][1] == -7 && bbox[0][2] == 2);
+    TEST(bbox[1][0] == 21 && bbox[1][1] == 6 && bbox[1][2] == 18);
+    mesh_remove_empty_blocks(mesh, false);
+    // The cached box should follow the changes of the blocks.
+    mesh_set_at(mesh, NULL, (int[]){20, -7, 2}, (uint8_t[]){0, 0, 0, 0});
+    TEST(mesh_get_bbox(mesh, bbox, true));
+    TEST(bbox[0][1] == 5 && bbox[1][0] == -2);
+    mesh_set_at(mesh, NULL, (int[]){-3, 5, 17}, (uint8_t[]){0, 0, 0, 0});
+    TEST(!mesh_get_bbox(mesh, bbox, true));
+    mesh_remove_empty_blocks(mesh, false);
+    TEST(mesh_is_empty(mesh));
+    mesh_delete(mesh);
+}
+
+// Check the voxels statistics, and that they follow the mesh changes.
+static void test_mesh_stats(void)
+{
+    const int N = BLOCK_SIZE;
+    mesh_stats_t stats;
+    mesh_t *mesh, *copy;
+
+    mesh = mesh_new();
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_blocks == 0 && stats.nb_voxels == 0);
+    mesh_fill_block(mesh, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){-1, 0, 0}, (uint8_t[]){0, 255, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){-2, 0, 0}, (uint8_t[]){0, 0, 255, 255});
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_blocks == 2);
+    TEST(stats.nb_voxels == N * N * N + 2);
+    TEST(stats.max_colors >= 3);
+
+    copy = mesh_copy(mesh);
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    mesh_set_at(mesh, NULL, (int[]){-1, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    mesh_get_stats(mesh, &stats);
+    TEST(stats.nb_voxels == N * N * N);
+    mesh_get_stats(copy, &stats);
+    TEST(stats.nb_voxels == N * N * N + 2);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Check the ray casts into the mesh blocks.
+static void test_mesh_raycast(void)
+{
+    int pos[3], n[3];
+    mesh_t *mesh;
+    const uint8_t c[4] = {255, 0, 0, 255};
+
+    mesh = mesh_new();
+    TEST(!mesh_raycast(mesh, (float[]){0, 0, 0}, (float[]){1, 0, 0}, pos, n));
+    mesh_set_at(mesh, NULL, (int[]){5, 3, -20}, c);
+    mesh_set_at(mesh, NULL, (int[]){5, 3, -40}, c);
+    mesh_set_at(mesh, NULL, (int[]){40, 40, 40}, c);
+
+    TEST(mesh_raycast(mesh, (float[]){5.5, 3.5, 10}, (float[]){0, 0, -1},
+                      pos, n));
+    TEST(pos[0] == 5 && pos[1] == 3 && pos[2] == -20);
+    TEST(n[0] == 0 && n[1] == 0 && n[2] == 1);
+
+    TEST(mesh_raycast(mesh, (float[]){5.5, 3.5, -100}, (float[]){0, 0, 1},
+                      pos, n));
+    TEST(pos[0] == 5 && pos[1] == 3 && pos[2] == -40);
+    TEST(n[0] == 0 && n[1] == 0 && n[2] == -1);
+
+    // Starting inside a voxel.
+    TEST(mesh_raycast(mesh, (float[]){5.5, 3.5, -19.5}, (float[]){0, 0, -1},
+                      pos, n));
+    TEST(pos[0] == 5 && pos[1] == 3 && pos[2] == -20);
+
+    // Across empty blocks.
+    TEST(mesh_raycast(mesh, (float[]){-30.2, -20.7, -10.1},
+                      (float[]){70.7, 61.2, 50.6}, pos, n));
+    TEST(pos[0] == 40 && pos[1] == 40 && pos[2] == 40);
+    TEST(n[0] == -1 && n[1] == 0 && n[2] == 0);
+
+    TEST(!mesh_raycast(mesh, (float[]){5.5, 3.5, 10}, (float[]){0, 0, 1},
+                       pos, n));
+    TEST(!mesh_raycast(mesh, (float[]){6.5, 3.5, 10}, (float[]){0, 0, -1},
+                       pos, n));
+    mesh_delete(mesh);
+}
+
+// Ray casts and box iterations over large empty regions, that are skipped
+// using the blocks index.
+static void test_mesh_sparse(void)
+{
+    int i, nb, pos[3], n[3];
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    const uint8_t c[4] = {255, 0, 0, 255};
+    float box[4][4];
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){-3000, 7, 5}, c);
+    mesh_set_at(mesh, NULL, (int[]){4000, 2100, -1500}, c);
+    mesh_set_at(mesh, NULL, (int[]){100, 100, 100}, c);
+    // Added then removed, so that its index cells are empty.
+    mesh_set_at(mesh, NULL, (int[]){3000, 1500, -1000}, c);
+    mesh_set_at(mesh, NULL, (int[]){3000, 1500, -1000}, (uint8_t[4]){0});
+    mesh_remove_empty_blocks(mesh, false);
+    copy = mesh_copy(mesh);
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, c);
+
+    // Diagonal ray through the removed block and the far one.
+    TEST(mesh_raycast(copy, (float[]){2000.5, 1000.5, -499.5},
+                      (float[]){1000, 550, -500}, pos, n));
+    TEST(pos[0] == 4000 && pos[1] == 2100 && pos[2] == -1500);
+    TEST(mesh_raycast(copy, (float[]){5000.5, 7.5, 5.5},
+                      (float[]){-1, 0, 0}, pos, n));
+    TEST(pos[0] == -3000 && n[0] == 1);
+    TEST(!mesh_raycast(copy, (float[]){5000.5, 8.5, 5.5},
+                       (float[]){-1, 0, 0}, pos, n));
+    TEST(mesh_raycast(mesh, (float[]){0.5, 0.5, 5000.5},
+                      (float[]){0, 0, -1}, pos, n));
+    TEST(pos[0] == 0 && pos[1] == 0 && pos[2] == 0);
+
+    bbox_from_extents(box, VEC(0, 0, 0), 5000, 5000, 5000);
+    for (i = 0; i < 2; i++) {
+        iter = mesh_get_box_iterator(i ? copy : mesh, box,
+                                     MESH_ITER_BLOCKS | MESH_ITER_SKIP_EMPTY);
+        nb = 0;
+        while (mesh_iter(&iter, pos)) nb++;
+        TEST(nb == (i ? 3 : 4));
+    }
+    mesh_delete(mesh);
+    mesh_delete(copy);
+}
+
+// Check the blocks operations, that run in parallel.
+static void test_mesh_op(void)
+{
+    int i;
+    float box[4][4];
+    mesh_t *mesh, *mesh2;
+    uint8_t *data1, *data2;
+    const int pos[3] = {-24, -24, -24}, size[3] = {48, 48, 48};
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_cube,
+        .color = {255, 0, 0, 255},
+    };
+
+    mesh = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), 20, 20, 20);
+    mesh_op(mesh, &painter, box);
+    TEST(count_voxels(mesh) == 40 * 40 * 40);
+    painter.mode = MODE_SUB;
+    painter.shape = &shape_sphere;
+    bbox_from_extents(box, VEC(0, 0, 0), 10, 10, 10);
+    mesh_op(mesh, &painter, box);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){0, 0, 0}) == 0);
+    TEST(mesh_get_alpha_at(mesh, NULL, (int[]){19, 19, 19}) == 255);
+
+    // Merging into an empty mesh should give the same values (the color
+    // of the transparent voxels is not relevant).
+    mesh2 = mesh_new();
+    mesh_merge(mesh2, mesh, MODE_OVER, (uint8_t[]){255, 255, 255, 255});
+    data1 = malloc(48 * 48 * 48 * 4);
+    data2 = malloc(48 * 48 * 48 * 4);
+    mesh_read(mesh, pos, size, data1);
+    mesh_read(mesh2, pos, size, data2);
+    for (i = 0; i < 48 * 48 * 48; i++) {
+        if (!data1[i * 4 + 3]) memset(&data1[i * 4], 0, 4);
+    }
+    TEST(memcmp(data1, data2, 48 * 48 * 48 * 4) == 0);
+
+    bbox_from_extents(box, VEC(6, 6, 6), 5, 5, 5);
+    mesh_crop(mesh2, box);
+    TEST(count_voxels(mesh2) > 0 && count_voxels(mesh2) < 10 * 10 * 10);
+    free(data1);
+    free(data2);
+    mesh_delete(mesh);
+    mesh_delete(mesh2);
+}
+
+// Compare the voxels of two meshes in the [-32, 32] cube.
+static bool meshes_equal(const mesh_t *a, const mesh_t *b)
+{
+    const int pos[3] = {-32, -32, -32}, size[3] = {64, 64, 64};
+    uint8_t *d1, *d2;
+    bool ret;
+    d1 = malloc(64 * 64 * 64 * 4);
+    d2 = malloc(64 * 64 * 64 * 4);
+    mesh_read(a, pos, size, d1);
+    mesh_read(b, pos, size, d2);
+    ret = memcmp(d1, d2, 64 * 64 * 64 * 4) == 0;
+    free(d1);
+    free(d2);
+    return ret;
+}
+
+// The blocks fully inside a shape are filled at once, and share the same
+// data.
+static void test_mesh_op_full_blocks(void)
+{
+    const int N = BLOCK_SIZE, R = N * 5 / 2; // Sphere radius.
+    mesh_t *mesh;
+    float box[4][4];
+    uint64_t id1, id2;
+    int x, y, z, count = 0;
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 255},
+    };
+
+    mesh = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), R, R, R);
+    mesh_op(mesh, &painter, box);
+    for (z = -R; z < R; z++)
+    for (y = -R; y < R; y++)
+    for (x = -R; x < R; x++) {
+        if (shape_sphere.func(VEC(x + 0.5, y + 0.5, z + 0.5),
+                              VEC(R, R, R), 0) >= 0)
+            count++;
+    }
+    TEST(count_voxels(mesh) == count);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &id1);
+    mesh_get_block_data(mesh, NULL, (int[]){-N, -N, -N}, &id2);
+    TEST(id1 && id1 == id2);
+
+    mesh_fill_block(mesh, (int[]){4 * N, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_get_block_data(mesh, NULL, (int[]){4 * N, 0, 0}, &id2);
+    TEST(id1 == id2);
+    mesh_fill_block(mesh, (int[]){4 * N, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    TEST(count_voxels(mesh) == count);
+    mesh_delete(mesh);
+}
+
+// Carve and add a long diagonal cylinder, as the laser tool does, and
+// compare with the shape function evaluated at each voxel.
+static void test_mesh_op_oriented(void)
+{
+    const int pos[3] = {-32, -32, -32}, size[3] = {64, 64, 64};
+    float box[4][4], mat[4][4], s[3], p[3];
+    mesh_t *mesh, *added;
+    uint8_t *data1, *data2;
+    int x, y, z, i, errors = 0;
+    bool inside;
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_cube,
+        .color = {255, 255, 255, 255},
+    };
+
+    mesh = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), 32, 32, 32);
+    mesh_op(mesh, &painter, box);
+
+    mat4_set_identity(box);
+    mat4_itranslate(box, 0.3, -0.2, 0.1);
+    mat4_irotate(box, 0.7, 1, 0, 0);
+    mat4_irotate(box, 0.6, 0, 1, 0);
+    mat4_iscale(box, 4, 4, 1024);
+    painter.shape = &shape_cylinder;
+    painter.mode = MODE_SUB_CLAMP;
+    mesh_op(mesh, &painter, box);
+    added = mesh_new();
+    painter.mode = MODE_OVER;
+    mesh_op(added, &painter, box);
+
+    box_get_size(box, s);
+    mat4_copy(box, mat);
+    mat4_iscale(mat, 1 / s[0], 1 / s[1], 1 / s[2]);
+    mat4_invert(mat, mat);
+    data1 = malloc(64 * 64 * 64 * 4);
+    data2 = malloc(64 * 64 * 64 * 4);
+    mesh_read(mesh, pos, size, data1);
+    mesh_read(added, pos, size, data2);
+    for (z = 0; z < 64; z++)
+    for (y = 0; y < 64; y++)
+    for (x = 0; x < 64; x++) {
+        i = (z * 64 + y) * 64 + x;
+        vec3_set(p, x - 32 + 0.5, y - 32 + 0.5, z - 32 + 0.5);
+        mat4_mul_vec3(mat, p, p);
+        inside = shape_cylinder.func(p, s, 0) >= 0;
+        if (inside != (data1[i * 4 + 3] == 0)) errors++;
+        if (inside != (data2[i * 4 + 3] != 0)) errors++;
+    }
+    TEST(errors == 0);
+    free(data1);
+    free(data2);
+    mesh_delete(mesh);
+    mesh_delete(added);
+}
+
+static void test_mesh_merger(void)
+{
+    mesh_t *meshes[3], *expected;
+    mesh_merger_t merger = {};
+    int i, x, y, z;
+
+    for (i = 0; i < 3; i++) {
+        meshes[i] = mesh_new();
+        for (z = -20; z < 20; z++)
+        for (y = -20; y < 20; y++)
+        for (x = -20; x < 20; x++) {
+            if ((x + y * 3 + z * 7 + i) % 5) continue;
+            mesh_set_at(meshes[i], NULL, (int[]){x, y, z},
+                        (uint8_t[]){x, y, i * 100, 255});
+        }
+    }
+
+    // Compare with the full merge after each change.
+    for (i = 0; i < 4; i++) {
+        if (i == 1)
+            mesh_set_at(meshes[1], NULL, (int[]){5, 5, 5},
+                        (uint8_t[]){0, 0, 0, 255});
+        if (i == 2)
+            mesh_clear_block(meshes[0], NULL, (int[]){0, 0, 0});
+        if (i == 3)
+            mesh_set_at(meshes[2], NULL, (int[]){30, 30, 30},
+                        (uint8_t[]){1, 2, 3, 255});
+        mesh_merger_update(&merger, 3, (const mesh_t**)meshes, MODE_OVER);
+        expected = mesh_new();
+        mesh_merge(expected, meshes[0], MODE_OVER, NULL);
+        mesh_merge(expected, meshes[1], MODE_OVER, NULL);
+        mesh_merge(expected, meshes[2], MODE_OVER, NULL);
+        TEST(meshes_equal(merger.mesh, expected));
+        mesh_delete(expected);
+    }
+
+    // Changing the number of meshes redo the full merge.
+    mesh_merger_update(&merger, 2, (const mesh_t**)meshes, MODE_OVER);
+    expected = mesh_new();
+    mesh_merge(expected, meshes[0], MODE_OVER, NULL);
+    mesh_merge(expected, meshes[1], MODE_OVER, NULL);
+    TEST(meshes_equal(merger.mesh, expected));
+    mesh_delete(expected);
+
+    mesh_merger_release(&merger);
+    for (i = 0; i < 3; i++) mesh_delete(meshes[i]);
+}
+
+// The N-way merge should give the same result as the pairwise merges.
+static void test_mesh_merge_n(void)
+{
+    const int modes[] = {MODE_OVER, MODE_MAX, MODE_SUB};
+    mesh_t *meshes[4], *mesh, *expected;
+    int i, m, x, y, z;
+
+    for (i = 0; i < 4; i++) {
+        meshes[i] = mesh_new();
+        for (z = -20 * i; z < 20; z++)
+        for (y = -20; y < 20; y++)
+        for (x = -20; x < 20 * i; x++) {
+            if ((x + y * 3 + z * 7 + i) % 3) continue;
+            mesh_set_at(meshes[i], NULL, (int[]){x, y, z},
+                        (uint8_t[]){x, y, i * 60, 100 + i * 50});
+        }
+    }
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        mesh = mesh_copy(meshes[0]);
+        expected = mesh_copy(meshes[0]);
+        mesh_merge_n(mesh, 3, (const mesh_t**)meshes + 1, modes[m]);
+        for (i = 1; i < 4; i++)
+            mesh_merge(expected, meshes[i], modes[m], NULL);
+        TEST(meshes_equal(mesh, expected));
+        mesh_delete(mesh);
+        mesh_delete(expected);
+    }
+    for (i = 0; i < 4; i++) mesh_delete(meshes[i]);
+}
+
+// Update a merge incrementally with the blocks changed in the source, as
+// the brush tool does during a stroke.
+static void test_mesh_merge_blocks(void)
+{
+    const uint8_t color[4] = {255, 0, 0, 255};
+    mesh_t *base, *path, *mesh, *expected;
+    uint64_t version;
+    int i, nb, (*blocks_pos)[3];
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_MAX,
+        .color = {255, 255, 255, 255},
+    };
+    float box[4][4];
+
+    base = mesh_new();
+    for (i = -30; i < 30; i++)
+        mesh_set_at(base, NULL, (int[]){i, 0, 0}, (uint8_t[]){0, 0, 255, 255});
+    path = mesh_new();
+    mesh = mesh_copy(base);
+    mesh_merge(mesh, path, MODE_OVER, color);
+    version = mesh_get_version(path);
+
+    for (i = 0; i < 4; i++) {
+        bbox_from_extents(box, VEC(i * 10 - 20, 0, 0), 4, 4, 4);
+        mesh_op(path, &painter, box);
+        nb = mesh_get_changes(path, version, &blocks_pos);
+        TEST(nb > 0);
+        mesh_merge_blocks(mesh, base, path, MODE_OVER, color,
+                          nb, blocks_pos);
+        free(blocks_pos);
+        version = mesh_get_version(path);
+
+        expected = mesh_copy(base);
+        mesh_merge(expected, path, MODE_OVER, color);
+        TEST(meshes_equal(mesh, expected));
+        mesh_delete(expected);
+    }
+    mesh_delete(base);
+    mesh_delete(path);
+    mesh_delete(mesh);
+}
+
+// Check the integer translations fast path of mesh_move.
+static void test_mesh_move(void)
+{
+    const int offsets[][3] = {{16, -32, 48}, {5, -3, 17}, {-1, 0, 0}};
+    mesh_t *mesh, *moved, *expected;
+    float mat[4][4];
+    int i, x, y, z;
+    uint8_t c[4];
+
+    mesh = mesh_new();
+    for (z = -20; z < 20; z++)
+    for (y = -20; y < 20; y++)
+    for (x = -20; x < 20; x++) {
+        if ((x + y * 3 + z * 7) % 5) continue;
+        mesh_set_at(mesh, NULL, (int[]){x, y, z},
+                    (uint8_t[]){x, y, z, 255});
+    }
+    for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+        expected = mesh_new();
+        for (z = -20; z < 20; z++)
+        for (y = -20; y < 20; y++)
+        for (x = -20; x < 20; x++) {
+            if ((x + y * 3 + z * 7) % 5) continue;
+            mesh_set_at(expected, NULL,
+                        (int[]){x + offsets[i][0], y + offsets[i][1],
+                                z + offsets[i][2]},
+                        (uint8_t[]){x, y, z, 255});
+        }
+        moved = mesh_copy(mesh);
+        mat4_set_identity(mat);
+        mat4_itranslate(mat, offsets[i][0], offsets[i][1], offsets[i][2]);
+        mesh_move(moved, mat);
+        TEST(meshes_equal(moved, expected));
+        mesh_delete(moved);
+        mesh_delete(expected);
+    }
+    mesh_delete(mesh);
+
+    // A quarter turn, with a box whose faces lie on blocks boundaries.
+    mesh = mesh_new();
+    for (y = -11; y < -3; y++)
+    for (x = 0; x < 20; x++) {
+        mesh_set_at(mesh, NULL, (int[]){x, y, x % 7},
+                    (uint8_t[]){x, -y, x % 7, 255});
+    }
+    mat4_set_identity(mat);
+    mat4_itranslate(mat, 5, -3, 2);
+    mat4_irotate(mat, M_PI / 2, 0, 0, 1);
+    mesh_move(mesh, mat);
+    TEST(count_voxels(mesh) == 160);
+    mesh_get_at(mesh, NULL, (int[]){16, 16, 7}, c);
+    TEST(c[0] == 19 && c[1] == 11 && c[2] == 5 && c[3] == 255);
+    mesh_delete(mesh);
+}
+
+// Extrude a face of a mesh along the z axis.
+static void test_mesh_extrude(void)
+{
+    mesh_t *mesh, *expected;
+    float plane[4][4], box[4][4];
+    int x, y, z;
+
+    mesh = mesh_new();
+    expected = mesh_new();
+    for (y = 0; y < 16; y++)
+    for (x = 0; x < 16; x++) {
+        mesh_set_at(mesh, NULL, (int[]){x, y, 3}, (uint8_t[]){x, y, 0, 255});
+        // Voxels outside the box but in the covered blocks are cleared.
+        mesh_set_at(mesh, NULL, (int[]){x, y, 40}, (uint8_t[]){0, 0, 0, 255});
+    }
+    for (z = 3; z < 37; z++)
+    for (y = 0; y < 10; y++)
+    for (x = 0; x < 10; x++) {
+        mesh_set_at(expected, NULL, (int[]){x, y, z},
+                    (uint8_t[]){x, y, 0, 255});
+    }
+    mat4_set_identity(plane);
+    mat4_itranslate(plane, 0, 0, 3.5);
+    bbox_from_extents(box, VEC(5, 5, 20), 5, 5, 17);
+    mesh_extrude(mesh, plane, box);
+    TEST(meshes_equal(mesh, expected));
+    mesh_delete(mesh);
+    mesh_delete(expected);
+}
+
+static int test_mesh_select_cond(void *user, const mesh_t *mesh,
+                                 const int base_pos[3],
+                                 const int new_pos[3],
+                                 mesh_accessor_t *mesh_accessor)
+{
+    uint8_t v0[4], v1[4];
+    mesh_get_at(mesh, mesh_accessor, base_pos, v0);
+    mesh_get_at(mesh, mesh_accessor, new_pos, v1);
+    return memcmp(v0, v1, 4) == 0 ? 255 : 0;
+}
+
+// Select a connected region of the same color.
+static void test_mesh_select(void)
+{
+    mesh_t *mesh, *selection;
+    mesh_iterator_t iter;
+    int x, y, z, pos[3], nb = 0;
+    uint8_t v[4];
+    bool ok = true;
+
+    mesh = mesh_new();
+    selection = mesh_new();
+    for (z = 0; z < 4; z++)
+    for (y = -20; y < 20; y++)
+    for (x = -20; x < 20; x++) {
+        mesh_set_at(mesh, NULL, (int[]){x, y, z},
+                    x < 0 ? (uint8_t[]){255, 0, 0, 255} :
+                            (uint8_t[]){0, 0, 255, 255});
+    }
+    // A disconnected part with the same color.
+    mesh_set_at(mesh, NULL, (int[]){-5, 0, 10}, (uint8_t[]){255, 0, 0, 255});
+
+    mesh_select(mesh, (int[]){-5, 0, 0}, test_mesh_select_cond, NULL,
+                selection);
+    iter = mesh_get_iterator(selection, MESH_ITER_VOXELS);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(selection, &iter, pos, v);
+        if (!v[3]) continue;
+        ok = ok && pos[0] < 0 && pos[2] >= 0 && pos[2] < 4;
+        nb++;
+    }
+    TEST(ok && nb == 20 * 40 * 4);
+    mesh_delete(mesh);
+    mesh_delete(selection);
+}
+
+// Like meshes_equal, but ignore the color of the transparent voxels.
+static bool meshes_same_voxels(const mesh_t *a, const mesh_t *b)
+{
+    const int pos[3] = {-32, -32, -32}, size[3] = {64, 64, 64};
+    uint8_t (*d1)[4], (*d2)[4];
+    bool ret = true;
+    int i;
+    d1 = malloc(64 * 64 * 64 * 4);
+    d2 = malloc(64 * 64 * 64 * 4);
+    mesh_read(a, pos, size, (uint8_t*)d1);
+    mesh_read(b, pos, size, (uint8_t*)d2);
+    for (i = 0; i < 64 * 64 * 64 && ret; i++) {
+        if (!d1[i][3] && !d2[i][3]) continue;
+        ret = memcmp(d1[i], d2[i], 4) == 0;
+    }
+    free(d1);
+    free(d2);
+    return ret;
+}
+
+// Compare the operations applied with the cached stamps to the ones that
+// evaluate the shape, forced with a clipping box that contains everything.
+static void test_mesh_op_stamps(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT, MODE_MAX};
+    const int pos[3] = {-32, -32, -32}, size[3] = {64, 64, 64};
+    mesh_t *mesh, *expected;
+    float box[4][4], clip[4][4];
+    int i, m, nb_errors = 0;
+    uint8_t (*d1)[4], (*d2)[4];
+    painter_t painter = {
+        .shape = &shape_cube,
+        .mode = MODE_OVER,
+        .color = {255, 0, 0, 255},
+    };
+
+    d1 = malloc(64 * 64 * 64 * 4);
+    d2 = malloc(64 * 64 * 64 * 4);
+    bbox_from_extents(clip, VEC(0, 0, 0), 1000, 1000, 1000);
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        mesh = mesh_new();
+        painter.mode = MODE_OVER;
+        painter.shape = &shape_cube;
+        painter.smoothness = 0;
+        painter.box = NULL;
+        bbox_from_extents(box, VEC(3, 0, 0), 20, 10, 15);
+        mesh_op(mesh, &painter, box);
+        expected = mesh_copy(mesh);
+
+        painter.mode = modes[m];
+        painter.shape = &shape_sphere;
+        painter.smoothness = (m % 2) ? 1.5 : 0;
+        vec4_set(painter.color, 0, 255, 0, 255);
+        // A stroke, where the same sub voxel offsets come back.
+        for (i = 0; i < 12; i++) {
+            mat4_set_identity(box);
+            mat4_itranslate(box, -20 + i * 3.25, 5 - i * 1.5, 2.5);
+            mat4_irotate(box, 0.5, 1, 1, 0);
+            mat4_iscale(box, 7, 6, 5);
+            painter.box = NULL;
+            mesh_op(mesh, &painter, box);
+            painter.box = &clip;
+            mesh_op(expected, &painter, box);
+        }
+        // The smooth shapes alpha can be off by one, since the shape is
+        // not evaluated at the exact same positions.
+        mesh_read(mesh, pos, size, (uint8_t*)d1);
+        mesh_read(expected, pos, size, (uint8_t*)d2);
+        for (i = 0; i < 64 * 64 * 64; i++) {
+            if (!d1[i][3] && !d2[i][3]) continue;
+            if (    memcmp(d1[i], d2[i], 3) != 0 ||
+                    abs(d1[i][3] - d2[i][3]) > (painter.smoothness ? 1 : 0))
+                nb_errors++;
+        }
+        mesh_delete(mesh);
+        mesh_delete(expected);
+    }
+    TEST(nb_errors == 0);
+    free(d1);
+    free(d2);
+}
+
+// Compare the single pass symmetry of mesh_op with the successive
+// operations on the mirrored boxes.
+static void test_mesh_op_symmetry(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT};
+    // Mirror flips of the boxes, in the order of the operations.
+    const int flips[] = {7, 3, 5, 1, 6, 2, 4, 0};
+    const float origin[3] = {0.5, 0, -3};
+    mesh_t *mesh, *expected;
+    float box[4][4], mbox[4][4];
+    int i, m;
+    painter_t painter = {
+        .shape = &shape_cube,
+        .color = {255, 0, 0, 255},
+    };
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        mesh = mesh_new();
+        painter.mode = MODE_OVER;
+        painter.symmetry = 0;
+        bbox_from_extents(box, VEC(3, 0, 0), 20, 10, 15);
+        mesh_op(mesh, &painter, box);
+        expected = mesh_copy(mesh);
+
+        painter.mode = modes[m];
+        painter.shape = &shape_sphere;
+        vec4_set(painter.color, 0, 255, 0, 128);
+        mat4_set_identity(box);
+        mat4_itranslate(box, 8, 5, 2);
+        mat4_irotate(box, 0.5, 1, 1, 0);
+        mat4_iscale(box, 9, 7, 5);
+        for (i = 0; i < 8; i++) {
+            mat4_set_identity(mbox);
+            mat4_itranslate(mbox, origin[0], origin[1], origin[2]);
+            mat4_iscale(mbox, (flips[i] & 1) ? -1 : 1,
+                              (flips[i] & 2) ? -1 : 1,
+                              (flips[i] & 4) ? -1 : 1);
+            mat4_itranslate(mbox, -origin[0], -origin[1], -origin[2]);
+            mat4_imul(mbox, box);
+            mesh_op(expected, &painter, mbox);
+        }
+        painter.symmetry = 7;
+        vec3_copy(origin, painter.symmetry_origin);
+        mesh_op(mesh, &painter, box);
+        TEST(meshes_same_voxels(mesh, expected));
+        mesh_delete(mesh);
+        mesh_delete(expected);
+    }
+}
+
+// Compare the masks operations with the equivalent mesh operations.
+static void test_mask(void)
+{
+    const painter_t painter = {
+        .shape = &shape_cube,
+        .mode = MODE_INTERSECT,
+        .color = {255, 255, 255, 255},
+    };
+    const uint8_t white[4] = {255, 255, 255, 255};
+    float box[4][4];
+    mesh_t *mesh, *m1, *m2;
+    mask_t *mask, *mask2, *other;
+    int x, y, z;
+
+    mesh = mesh_new();
+    for (z = -20; z < 40; z++)
+    for (y = -20; y < 40; y++)
+    for (x = -20; x < 40; x++) {
+        if ((x + y * 3 + z * 7) % 5 == 0) continue;
+        mesh_set_at(mesh, NULL, (int[]){x, y, z},
+                    (uint8_t[]){x, y, z, 255});
+    }
+    bbox_from_extents(box, VEC(3, 5, 7), 24, 19, 13);
+    mask = mask_new();
+    mask_add_box(mask, box);
+
+    m1 = mesh_copy(mesh);
+    m2 = mesh_copy(mesh);
+    mesh_op(m1, &painter, box);
+    mask_apply(mask, m2, MODE_INTERSECT, NULL);
+    TEST(meshes_same_voxels(m1, m2));
+
+    mesh_set(m1, mesh);
+    mesh_set(m2, mesh);
+    mesh_op(m1, &(painter_t){.shape = &shape_cube, .mode = MODE_SUB,
+                             .color = {255, 255, 255, 255}}, box);
+    mask_apply(mask, m2, MODE_SUB, NULL);
+    TEST(meshes_same_voxels(m1, m2));
+
+    mesh_set(m1, mesh);
+    mesh_set(m2, mesh);
+    mesh_op(m1, &(painter_t){.shape = &shape_cube, .mode = MODE_OVER,
+                             .color = {10, 20, 30, 255}}, box);
+    mask_apply(mask, m2, MODE_OVER, (uint8_t[]){10, 20, 30, 255});
+    TEST(meshes_same_voxels(m1, m2));
+
+    // Boolean operations and conversions.
+    other = mask_new();
+    mask2 = mask_new();
+    mask_add_mesh(other, mesh);
+    mask_merge(other, mask, MODE_INTERSECT);
+    mask_to_mesh(other, m1, white);
+    mesh_set(m2, mesh);
+    mesh_op(m2, &painter, box);
+    mask_clear(mask2);
+    mask_add_mesh(mask2, m2);
+    mask_to_mesh(mask2, m2, white);
+    TEST(!mesh_is_empty(m1) && meshes_equal(m1, m2));
+    mask_merge(other, mask, MODE_SUB);
+    TEST(mask_is_empty(other));
+    mask_merge(other, mask, MODE_OVER);
+    TEST(mask_get_at(other, (int[]){3, 5, 7}));
+    TEST(!mask_get_at(other, (int[]){30, 5, 7}));
+
+    mask_delete(mask);
+    mask_delete(mask2);
+    mask_delete(other);
+    mesh_delete(mesh);
+    mesh_delete(m1);
+    mesh_delete(m2);
+}
+
+// Return the total area of a list of quads.
+static int get_quads_area(const voxel_vertex_t *verts, int nb)
+{
+    int i, j, k, a, ret = 0, vmin, vmax;
+    for (i = 0; i < nb; i++) {
+        a = 1;
+        for (k = 0; k < 3; k++) {
+            vmin = vmax = verts[i * 4].pos[k];
+            for (j = 1; j < 4; j++) {
+                vmin = min(vmin, verts[i * 4 + j].pos[k]);
+                vmax = max(vmax, verts[i * 4 + j].pos[k]);
+            }
+            if (vmax > vmin) a *= vmax - vmin;
+        }
+        ret += a;
+    }
+    return ret;
+}
+
+static void test_mesh_merge_faces(void)
+{
+    const int N = BLOCK_SIZE;
+    mesh_t *mesh;
+    voxel_vertex_t *verts;
+    uint8_t *data;
+    int i, nb, size, subdivide;
+
+    // A full block with one voxel of an other color on the top face.
+    data = malloc(N * N * N * 4);
+    for (i = 0; i < N * N * N; i++)
+        memcpy(data + i * 4, (uint8_t[]){255, 0, 0, 255}, 4);
+    memcpy(data + ((N - 1) * N * N + 5 * N + 5) * 4,
+           (uint8_t[]){0, 255, 0, 255}, 4);
+    mesh = mesh_new();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){N, N, N}, data);
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+
+    nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, 0, verts,
+                                &size, &subdivide);
+    TEST(nb == 6 * N * N);
+    TEST(get_quads_area(verts, nb) == 6 * N * N);
+
+    nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, EFFECT_MERGE_FACES,
+                                verts, &size, &subdivide);
+    // Each face gives 9 quads, since the voxels at the edges have
+    // different gradients, plus 4 for the top face voxel of other color.
+    TEST(size == 4 && nb == 6 * 9 + 4);
+    TEST(get_quads_area(verts, nb) == 6 * N * N);
+
+    free(verts);
+    free(data);
+    mesh_delete(mesh);
+}
+
+static void test_mesh_lod(void)
+{
+    const int N = BLOCK_SIZE;
+    mesh_t *mesh;
+    voxel_vertex_t *verts;
+    uint8_t *data;
+    int i, lod, nb, size, subdivide;
+
+    // A full block, with a single voxel removed in a corner.
+    data = malloc(N * N * N * 4);
+    for (i = 0; i < N * N * N; i++)
+        memcpy(data + i * 4, (uint8_t[]){255, 0, 0, 255}, 4);
+    data[3] = 0;
+    mesh = mesh_new();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){N, N, N}, data);
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+
+    for (lod = 1; lod <= 3; lod++) {
+        nb = mesh_generate_vertices_lod(mesh, (int[]){0, 0, 0}, 0, lod,
+                                        verts, &size, &subdivide);
+        // The missing voxel is covered by the other voxels of its cell.
+        TEST(size == 4 && nb == 6 * (N >> lod) * (N >> lod));
+        TEST(get_quads_area(verts, nb) == 6 * N * N);
+    }
+
+    free(verts);
+    free(data);
+    mesh_delete(mesh);
+}
+
+// Compare two vertices arrays, ignoring the padding bytes.
+static bool vertices_eq(const voxel_vertex_t *a, const voxel_vertex_t *b,
+                        int nb)
+{
+    int i;
+    for (i = 0; i < nb; i++) {
+        if (    memcmp(a[i].pos, b[i].pos, 3) ||
+                memcmp(a[i].normal, b[i].normal, 3) ||
+                memcmp(a[i].tangent, b[i].tangent, 3) ||
+                memcmp(a[i].gradient, b[i].gradient, 3) ||
+                memcmp(a[i].color, b[i].color, 4) ||
+                a[i].pos_data != b[i].pos_data ||
+                memcmp(a[i].uv, b[i].uv, 2) ||
+                memcmp(a[i].occlusion_uv, b[i].occlusion_uv, 2) ||
+                memcmp(a[i].bump_uv, b[i].bump_uv, 2))
+            return false;
+    }
+    return true;
+}
+
+static void test_mesh_vertices_cache(void)
+{
+    mesh_t *mesh, *copy;
+    mesh_vertices_t *v1, *v2, *v3;
+    voxel_vertex_t *verts;
+    int nb, size, subdivide;
+
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    verts = calloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
+                   sizeof(*verts));
+    nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, 0, verts,
+                                &size, &subdivide);
+
+    v1 = mesh_get_vertices(mesh, (int[]){0, 0, 0}, 0, 0);
+    TEST(v1->nb == nb && v1->size == size && v1->subdivide == subdivide);
+    TEST(vertices_eq(v1->verts, verts, nb * size));
+
+    // A copy of the mesh shares the same blocks, so the same vertices.
+    copy = mesh_copy(mesh);
+    v2 = mesh_get_vertices(copy, (int[]){0, 0, 0}, 0, 0);
+    TEST(v2 == v1);
+    // Other effects give other vertices.
+    v3 = mesh_get_vertices(mesh, (int[]){0, 0, 0}, EFFECT_MERGE_FACES, 0);
+    TEST(v3 != v1);
+
+    // The references stay valid after the cache is cleared.
+    mesh_vertices_cache_clear();
+    TEST(v1->nb == nb);
+    mesh_vertices_release(v1);
+    mesh_vertices_release(v2);
+    mesh_vertices_release(v3);
+
+    free(verts);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+// Check that the vertices built from the cached parts of the blocks are the
+// same as the ones of mesh_generate_vertices, and that changing a block
+// only tessellates again the parts of the neighbours next to it.
+static void test_mesh_vertices_parts(void)
+{
+    const int N = BLOCK_SIZE, EFFECTS[2] = {0, EFFECT_MERGE_FACES};
+    mesh_t *mesh;
+    mesh_vertices_t *v;
+    voxel_vertex_t *verts;
+    uint64_t c0[COUNTER_COUNT], c1[COUNTER_COUNT];
+    // Parts meshed after each step: all of them the first time, then the
+    // side next to the +x block and the edges, and then only the edges.
+    const int EXPECTED[3] = {8, 2, 1};
+    int i, e, nb, size, subdivide;
+
+    mesh = mesh_new();
+    for (i = 0; i < 2000; i++) {
+        mesh_set_at(mesh, NULL,
+                    (int[]){i * 7 % (N + 4) - 2, i * 13 % (N + 4) - 2,
+                            i * 29 % (N + 4) - 2},
+                    (uint8_t[]){i, 255 - i, 128, i % 5 ? 255 : 200});
+    }
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    mesh_vertices_cache_clear();
+
+    for (i = 0; i < 3; i++) {
+        counters_get(c0);
+        for (e = 0; e < 2; e++) {
+            nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, EFFECTS[e],
+                                        verts, &size, &subdivide);
+            v = mesh_get_vertices(mesh, (int[]){0, 0, 0}, EFFECTS[e], 0);
+            TEST(v->nb == nb && v->size == size);
+            TEST(vertices_eq(v->verts, verts, nb * size));
+            mesh_vertices_release(v);
+        }
+        counters_get(c1);
+        // The counters don't move when they are disabled at compile time.
+        if (COUNTERS) TEST(c1[COUNTER_BLOCK_PARTS_MESHED] -
+                           c0[COUNTER_BLOCK_PARTS_MESHED] == EXPECTED[i]);
+        if (i == 0)
+            mesh_set_at(mesh, NULL, (int[]){N, 5, 5},
+                        (uint8_t[]){0, 0, 0, 0});
+        if (i == 1)
+            mesh_set_at(mesh, NULL, (int[]){N, N, N},
+                        (uint8_t[]){1, 2, 3, 255});
+    }
+
+    free(verts);
+    mesh_delete(mesh);
+}
+
+// Check that we can recompute all the vertices attributes from the packed
+// vertices, the same way the shaders do it.
+static void test_mesh_pack_vertices(void)
+{
+    mesh_t *mesh;
+    voxel_vertex_t *verts;
+    voxel_packed_vertex_t *packed;
+    const voxel_vertex_t *v;
+    const voxel_packed_vertex_t *p;
+    int i, nb, size, subdivide, f, c;
+    const int ts = VOXEL_TEXTURE_SIZE;
+    bool ok = true;
+
+    mesh = mesh_new();
+    for (i = 0; i < 64; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i % 4, i / 4 % 4, i / 16 % 2 + i % 3},
+                    (uint8_t[]){i * 4, 255 - i, 128, 255});
+    }
+    verts = calloc(16 * 16 * 16 * 6 * 4, sizeof(*verts));
+    nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, 0, verts,
+                                &size, &subdivide);
+    packed = calloc(nb * 4, sizeof(*packed));
+    mesh_pack_vertices(verts, nb * 4, packed);
+    for (i = 0; i < nb * 4; i++) {
+        v = &verts[i];
+        p = &packed[i];
+        f = p->face / 4;
+        c = p->face % 4;
+        ok = ok && memcmp(v->pos, p->pos, 3) == 0 &&
+                   memcmp(v->color, p->color, 3) == 0 && v->color[3] == 255 &&
+                   memcmp(v->gradient, p->gradient, 3) == 0 &&
+                   v->normal[0] == FACES_NORMALS[f][0] &&
+                   v->normal[1] == FACES_NORMALS[f][1] &&
+                   v->normal[2] == FACES_NORMALS[f][2] &&
+                   v->tangent[0] == FACES_TANGENTS[f][0] &&
+                   v->tangent[1] == FACES_TANGENTS[f][1] &&
+                   v->tangent[2] == FACES_TANGENTS[f][2] &&
+                   v->uv[0] == VERTICE_UV[c][0] * 255 &&
+                   v->uv[1] == VERTICE_UV[c][1] * 255 &&
+                   v->occlusion_uv[0] == p->shadow_mask % 16 * ts +
+                                         VERTICE_UV[c][0] * (ts - 1) &&
+                   v->occlusion_uv[1] == p->shadow_mask / 16 * ts +
+                                         VERTICE_UV[c][1] * (ts - 1) &&
+                   v->bump_uv[0] == p->borders_mask % 16 * 16 &&
+                   v->bump_uv[1] == p->borders_mask / 16 * 16;
+    }
+    TEST(nb > 0 && ok);
+    free(verts);
+    free(packed);
+    mesh_delete(mesh);
+}
+
+// Expand a packed face vertex the same way as the mesh shader with the
+// vertex pulling, and compare it to the packed vertex.
+static bool test_face_vertex(const voxel_face_t *face, int c,
+                             const voxel_packed_vertex_t *p)
+{
+    const int *unit;
+    int i, f, n, pos[3], size[3] = {};
+    bool large;
+
+    f = (face->data[0] >> 18) & 7;
+    large = face->data[0] >> 31;
+    n = FACES_NORMALS[f][0] ? 0 : FACES_NORMALS[f][1] ? 1 : 2;
+    size[(n + 1) % 3] = large ? ((face->data[0] >> 21) & 31) + 1 : 1;
+    size[(n + 2) % 3] = large ? ((face->data[0] >> 26) & 31) + 1 : 1;
+    unit = VERTICES_POSITIONS[FACES_VERTICES[f][c]];
+    for (i = 0; i < 3; i++)
+        pos[i] = ((face->data[0] >> (i * 6)) & 63) + unit[i] * size[i];
+    return pos[0] == p->pos[0] && pos[1] == p->pos[1] &&
+           pos[2] == p->pos[2] && p->face == f * 4 + c &&
+           (face->data[1] & 0xffffff) ==
+                (p->color[0] | p->color[1] << 8 | p->color[2] << 16) &&
+           face->data[1] >> 24 == p->shadow_mask &&
+           (large ? 0 : (face->data[0] >> 21) & 255) == p->borders_mask;
+}
+
+// Check that the faces of the vertex pulling give back the same quads,
+// with and without the merged faces.
+static void test_mesh_pack_faces(void)
+{
+    mesh_t *mesh;
+    voxel_vertex_t *verts;
+    voxel_packed_vertex_t *packed;
+    voxel_face_t *faces;
+    int i, j, nb, size, subdivide;
+    bool ok = true;
+
+    // Some random voxels, and a flat slab whose faces get merged.
+    mesh = mesh_new();
+    for (i = 0; i < 256; i++) {
+        mesh_set_at(mesh, NULL, (int[]){i % 16, i / 16 % 4, i / 64 + i % 3},
+                    (uint8_t[]){i % 3 * 64, 255 - i % 5, 128, 255});
+        mesh_set_at(mesh, NULL, (int[]){i % 16, i / 16, 12},
+                    (uint8_t[]){255, 0, 0, 255});
+    }
+    verts = calloc(16 * 16 * 16 * 6 * 4, sizeof(*verts));
+    packed = calloc(16 * 16 * 16 * 6 * 4, sizeof(*packed));
+    faces = calloc(16 * 16 * 16 * 6, sizeof(*faces));
+    for (j = 0; j < 2; j++) {
+        nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0},
+                                    j ? EFFECT_MERGE_FACES : 0, verts,
+                                    &size, &subdivide);
+        mesh_pack_vertices(verts, nb * 4, packed);
+        mesh_pack_faces(packed, nb, faces);
+        for (i = 0; i < nb * 4; i++)
+            ok = ok && test_face_vertex(&faces[i / 4], i % 4, &packed[i]);
+        TEST(nb > 0 && ok);
+    }
+    free(verts);
+    free(packed);
+    free(faces);
+    mesh_delete(mesh);
+}
+
+// Check that indexing the marching cube triangles keeps the same
+// triangles, with fewer vertices.
+static void test_mesh_index_vertices(void)
+{
+    mesh_t *mesh;
+    voxel_vertex_t *verts, *copy;
+    uint16_t *indices;
+    int i, j, nb, nb_vertices, size, subdivide;
+    float box[4][4];
+    bool ok = true;
+    const int effects[] = {EFFECT_MARCHING_CUBES,
+                           EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH};
+    const painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 255},
+    };
+
+    mesh = mesh_new();
+    bbox_from_extents(box, VEC(8, 8, 8), 6, 6, 6);
+    mesh_op(mesh, &painter, box);
+    verts = calloc(16 * 16 * 16 * 6 * 4, sizeof(*verts));
+    for (j = 0; j < ARRAY_SIZE(effects); j++) {
+        nb = mesh_generate_vertices(mesh, (int[]){0, 0, 0}, effects[j],
+                                    verts, &size, &subdivide);
+        TEST(size == 3 && nb > 0);
+        copy = malloc(nb * 3 * sizeof(*copy));
+        indices = malloc(nb * 3 * sizeof(*indices));
+        memcpy(copy, verts, nb * 3 * sizeof(*copy));
+        nb_vertices = mesh_index_vertices(verts, nb * 3, indices);
+        TEST(nb_vertices > 0 && nb_vertices < nb * 3);
+        for (i = 0; i < nb * 3; i++) {
+            ok = ok && indices[i] < nb_vertices &&
+                 memcmp(&verts[indices[i]], &copy[i], sizeof(*copy)) == 0;
+        }
+        TEST(ok);
+        free(copy);
+        free(indices);
+    }
+    free(verts);
+    mesh_delete(mesh);
+}
+
+// Check that the vectorized combine functions give the same results as
+// the per voxel ones.
+static void test_combine_voxels(void)
+{
+    const int n = 1024 + 3;
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_SUB_CLAMP, MODE_PAINT,
+                         MODE_MAX, MODE_INTERSECT, MODE_MULT_ALPHA};
+    uint8_t *a, *b, *out1, *out2;
+    uint32_t seed = 1;
+    int i, m, c;
+    bool ok = true;
+
+    a = malloc(n * 4);
+    b = malloc(n * 4);
+    out1 = malloc(n * 4);
+    out2 = malloc(n * 4);
+    for (i = 0; i < n * 4; i++) {
+        seed = seed * 1103515245 + 12345;
+        a[i] = seed >> 16;
+        seed = seed * 1103515245 + 12345;
+        b[i] = (i % 8 == 3) ? 0 : (seed >> 16); // Some empty voxels.
+    }
+    for (c = 0; c < 2; c++)
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        combine_voxels(a, b, n, modes[m],
+                       c ? (uint8_t[]){10, 20, 30, 128} : NULL, out1);
+        for (i = 0; i < n; i++) {
+            combine_voxels(a + i * 4, b + i * 4, 1, modes[m],
+                           c ? (uint8_t[]){10, 20, 30, 128} : NULL,
+                           out2 + i * 4);
+        }
+        ok = ok && memcmp(out1, out2, n * 4) == 0;
+    }
+    TEST(ok);
+    free(a);
+    free(b);
+    free(out1);
+    free(out2);
+}
+
+// Check that the clone layers instances render the same voxels as the
+// baked clone meshes.
+static void test_clone_instance(void)
+{
+    image_t *img = image_new();
+    layer_t *base = img->active_layer, *clone;
+    mesh_iterator_t iter;
+    int pos[3], q[3], nb = 0;
+    float p[3], model[4][4];
+    uint8_t c1[4], c2[4];
+    bool ok = true;
+
+    for (pos[0] = 0; pos[0] < 20; pos[0]++)
+    for (pos[1] = -3; pos[1] < 5; pos[1]++) {
+        pos[2] = pos[0] % 7;
+        mesh_set_at(base->mesh, NULL, pos,
+                    (uint8_t[]){pos[0] * 10, 128, pos[1] + 10, 255});
+    }
+    clone = image_clone_layer(img, base);
+    mat4_set_identity(clone->mat);
+    mat4_itranslate(clone->mat, 5, -3, 2);
+    mat4_irotate(clone->mat, M_PI / 2, 0, 0, 1);
+    clone->base_mesh_key = 0;
+    image_update(img);
+
+    TEST(image_get_clone_instance(img, clone, model) == base);
+    iter = mesh_get_iterator(base->mesh, MESH_ITER_VOXELS);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(base->mesh, &iter, pos, c1);
+        if (!c1[3]) continue;
+        vec3_set(p, pos[0] + 0.5, pos[1] + 0.5, pos[2] + 0.5);
+        mat4_mul_vec3(model, p, p);
+        q[0] = floor(p[0]);
+        q[1] = floor(p[1]);
+        q[2] = floor(p[2]);
+        mesh_get_at(clone->mesh, NULL, q, c2);
+        ok = ok && memcmp(c1, c2, 4) == 0;
+        nb++;
+    }
+    iter = mesh_get_iterator(clone->mesh, MESH_ITER_VOXELS);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(clone->mesh, &iter, pos, c2);
+        if (c2[3]) nb--;
+    }
+    TEST(ok && nb == 0);
+
+    // Not a multiple of 90°.
+    mat4_irotate(clone->mat, M_PI / 4, 0, 0, 1);
+    TEST(image_get_clone_instance(img, clone, model) == NULL);
+    TEST(image_get_clone_instance(img, base, model) == NULL);
+    image_delete(img);
+}
+
+// Check that the clone and shape layers updated from the changed blocks
+// only are the same as after a full update.
+static void test_layers_update(void)
+{
+    image_t *img = image_new();
+    layer_t *base = img->active_layer, *clone, *shape, *ref;
+    mesh_t *full;
+    int i, t, nb, (*blocks_pos)[3];
+    uint64_t version;
+    const int T[2][3] = {{BLOCK_SIZE, 0, -BLOCK_SIZE}, {7, 3, -2}};
+
+    for (i = 0; i < 100; i++) {
+        mesh_set_at(base->mesh, NULL, (int[]){i, i % 5, i % 3},
+                    (uint8_t[]){i * 2, 100, 200, 255});
+    }
+    clone = image_clone_layer(img, base);
+    for (t = 0; t < 2; t++) {
+        mat4_set_identity(clone->mat);
+        mat4_itranslate(clone->mat, T[t][0], T[t][1], T[t][2]);
+        clone->base_mesh_key = 0;
+        image_update(img);
+        version = mesh_get_version(clone->mesh);
+        mesh_set_at(base->mesh, NULL, (int[]){3, 2, 1},
+                    (uint8_t[]){1, 2, 3, 255});
+        mesh_set_at(base->mesh, NULL, (int[]){5, 0, 2},
+                    (uint8_t[]){0, 0, 0, 0});
+        image_update(img);
+        // Only the blocks around the changed voxels have been updated.
+        nb = mesh_get_changes(clone->mesh, version, &blocks_pos);
+        free(blocks_pos);
+        TEST(nb >= 1 && nb <= 8);
+        full = mesh_copy(base->mesh);
+        mesh_move(full, clone->mat);
+        TEST(mesh_get_hash(full) == mesh_get_hash(clone->mesh));
+        mesh_delete(full);
+    }
+
+    // Shape layers moved by whole voxels, aligned or not to the blocks.
+    shape = image_add_layer(img, NULL);
+    ref = image_add_layer(img, NULL);
+    shape->shape = ref->shape = &shape_sphere;
+    memcpy(shape->color, (uint8_t[]){255, 0, 0, 255}, 4);
+    memcpy(ref->color, shape->color, 4);
+    mat4_itranslate(shape->mat, 0.5, 0.5, 10.5);
+    mat4_iscale(shape->mat, 5, 4, 3);
+    image_update(img);
+    for (t = 0; t < 2; t++) {
+        shape->mat[3][0] -= T[t][0] / 2;
+        shape->mat[3][1] += T[t][1];
+        mat4_copy(shape->mat, ref->mat);
+        image_update(img);
+        TEST(mesh_get_hash(shape->mesh) == mesh_get_hash(ref->mesh));
+        TEST(!mesh_is_empty(shape->mesh));
+    }
+
+    // The hidden shape layers are only generated when needed.
+    shape = image_add_layer(img, NULL);
+    shape->shape = &shape_sphere;
+    shape->visible = false;
+    memcpy(shape->color, (uint8_t[]){255, 0, 0, 255}, 4);
+    mat4_iscale(shape->mat, 5, 4, 3);
+    img->active_layer = base;
+    image_update(img);
+    TEST(mesh_is_empty(shape->mesh));
+    image_update_layer(img, shape);
+    TEST(!mesh_is_empty(shape->mesh));
+    image_delete(img);
+}
+
+// Check the ids of the layers of an image with many layers.
+static void test_layers_ids(void)
+{
+    image_t *img = image_new();
+    layer_t *layer, *base, *clone;
+    int i, nb = 0;
+    bool ok = true;
+
+    for (i = 0; i < 300; i++) image_add_layer(img, NULL);
+    DL_FOREACH(img->layers, layer) ok = ok && layer->id == ++nb;
+    TEST(ok && nb == 301);
+
+    // The ids of the deleted layers are reused.
+    DL_FOREACH(img->layers, layer) if (layer->id == 50) break;
+    image_delete_layer(img, layer);
+    TEST(image_add_layer(img, NULL)->id == 50);
+    TEST(image_add_layer(img, NULL)->id == 302);
+
+    // Merged layers are uncloned.
+    base = img->layers->next;
+    clone = image_clone_layer(img, base);
+    clone->visible = false;
+    image_update(img);
+    TEST(clone->base_id == base->id);
+    image_merge_visible_layers(img);
+    TEST(clone->base_id == 0);
+    DL_COUNT(img->layers, layer, nb);
+    TEST(nb == 2);
+    TEST(image_add_layer(img, NULL)->id == 1);
+    image_delete(img);
+}
+
+// Check that the animation frames restore the layers voxels, share the
+// blocks they have in common, and are saved in the gox files.
+static void test_frames(void)
+{
+    image_t *img = goxel.image;
+    mesh_t *mesh = img->active_layer->mesh;
+    uint64_t hashes[3], uid, uid2;
+    int i, err;
+
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    hashes[0] = mesh_get_hash(mesh);
+    for (i = 1; i < 3; i++) {
+        TEST(image_add_frame(img) == i);
+        mesh_set_at(mesh, NULL, (int[]){i * 64, 0, 0},
+                    (uint8_t[]){0, 255, 0, 255});
+        hashes[i] = mesh_get_hash(mesh);
+    }
+    TEST(image_get_nb_frames(img) == 3);
+    for (i = 2; i >= 0; i--) {
+        image_set_frame(img, i);
+        TEST(image_get_frame(img) == i);
+        TEST(mesh_get_hash(mesh) == hashes[i]);
+    }
+    // The first block is the same in all the frames.
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &uid);
+    image_set_frame(img, 2);
+    mesh_get_block_data(mesh, NULL, (int[]){0, 0, 0}, &uid2);
+    TEST(uid && uid == uid2);
+
+    if (!DEFINED(WIN32)) {
+        save_to_file(img, "/tmp/goxel_test.gox");
+        image_delete(goxel.image);
+        goxel.image = image_new();
+        err = goxel_import_file("/tmp/goxel_test.gox", NULL);
+        TEST(err == 0);
+        img = goxel.image;
+        mesh = img->active_layer->mesh;
+        TEST(image_get_nb_frames(img) == 3 && image_get_frame(img) == 2);
+        TEST(mesh_get_hash(mesh) == hashes[2]);
+        image_set_frame(img, 1);
+        TEST(mesh_get_hash(mesh) == hashes[1]);
+    }
+
+    image_delete_frame(img, 1);
+    TEST(image_get_frame(img) == 1 && mesh_get_hash(mesh) == hashes[2]);
+    image_delete_frame(img, 0);
+    TEST(image_get_nb_frames(img) == 0 && mesh_get_hash(mesh) == hashes[2]);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// An operation of test_gpu_ops, done in a task, where the GPU is never
+// used.
+typedef struct {
+    mesh_t          *mesh;
+    const painter_t *painter;
+    const float     (*box)[4];
+    const mesh_t    *other;     // Merged after the operation if set.
+} test_gpu_ops_t;
+
+static void test_gpu_ops_func(void *user)
+{
+    test_gpu_ops_t *op = user;
+    mesh_ops_cache_enable(false);
+    mesh_op(op->mesh, op->painter, op->box);
+    if (op->other) mesh_merge(op->mesh, op->other, op->painter->mode, NULL);
+    mesh_ops_cache_enable(true);
+}
+
+// Check that the large operations give the same results on the GPU, if
+// it is available on this thread, and on the CPU.
+static void test_gpu_ops(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT, MODE_INTERSECT};
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    mesh_t *base, *other, *mesh, *expected;
+    float box[4][4];
+    int s, m, x, y, z;
+    uint8_t c[4];
+    mesh_accessor_t accessor;
+    painter_t painter = {.color = {200, 100, 50, 180}};
+    test_gpu_ops_t op;
+    task_t *task;
+    bool ok = true;
+
+    base = mesh_new();
+    accessor = mesh_get_accessor(base);
+    srand(1);
+    for (z = -48; z < 48; z++)
+    for (y = -48; y < 48; y++)
+    for (x = -48; x < 48; x++) {
+        if (x * x + y * y + z * z > 40 * 40 || rand() % 3 == 0) continue;
+        vec4_set(c, rand() % 256, rand() % 256, rand() % 256,
+                 (rand() % 2) ? 255 : rand() % 256);
+        mesh_set_at(base, &accessor, (int[]){x, y, z}, c);
+    }
+    other = mesh_copy(base);
+    mesh_move(other, (float[4][4]){{1, 0, 0, 0}, {0, 1, 0, 0},
+                                   {0, 0, 1, 0}, {13, -7, 5, 1}});
+
+    for (s = 0; s < ARRAY_SIZE(shapes); s++)
+    for (m = 0; m < ARRAY_SIZE(modes) * 2; m++) {
+        painter.shape = shapes[s];
+        painter.mode = modes[m / 2];
+        painter.smoothness = (m % 2) ? 2.5 : 0;
+        // Too large for the stamps.
+        mat4_set_identity(box);
+        mat4_itranslate(box, 3.3, -2.1, 4.7);
+        mat4_irotate(box, 0.3, 1, 1, 0);
+        mat4_iscale(box, 70.2, 60.7, 82.1);
+        mesh = mesh_copy(base);
+        expected = mesh_copy(base);
+        mesh_ops_cache_enable(false);
+        mesh_op(mesh, &painter, box);
+        op = (test_gpu_ops_t){expected, &painter, box};
+        // Also test the merges once per mode.
+        if (s == 0 && m % 2 == 0) {
+            mesh_merge(mesh, other, painter.mode, NULL);
+            op.other = other;
+        }
+        mesh_ops_cache_enable(true);
+        task = task_start(test_gpu_ops_func, &op);
+        while (!task_is_done(task)) {}
+        task_delete(task);
+        ok = ok && mesh_get_hash(mesh) == mesh_get_hash(expected);
+        mesh_delete(mesh);
+        mesh_delete(expected);
+    }
+    mesh_delete(base);
+    mesh_delete(other);
+    TEST(ok);
+}
+
+static void test_shapes_row(void)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const float size[3] = {1.0, 0.5, 0.75};
+    const float p[3] = {-1.25, 0.125, -0.25};
+    const float dp[3] = {0.125, 0.0625, 0.03125};
+    float row[20], q[3], v;
+    int s, i, sm;
+    bool ok = true;
+
+    for (sm = 0; sm < 2; sm++)
+    for (s = 0; s < ARRAY_SIZE(shapes); s++) {
+        shapes[s]->func_row(p, dp, ARRAY_SIZE(row), size, sm * 0.25, row);
+        for (i = 0; i < ARRAY_SIZE(row); i++) {
+            vec3_addk(p, dp, i, q);
+            v = shapes[s]->func(q, size, sm * 0.25);
+            ok = ok && (v == row[i] || fabs(v - row[i]) < 0.0001);
+        }
+    }
+    TEST(ok);
+}
+
+static int test_cache_delfunc(void *data)
+{
+    (*(int*)data)++;
+    return 0;
+}
+
+// Check the cache least recently used eviction and statistics.
+static void test_cache(void)
+{
+    int i, nb_deleted = 0;
+    cache_t *cache;
+    cache_stats_t stats;
+
+    cache = cache_create(100);
+    for (i = 0; i < 4; i++)
+        cache_add(cache, &i, sizeof(i), &nb_deleted, 20, test_cache_delfunc);
+    // Use the first item, so that the second one is the oldest.
+    TEST(cache_get(cache, (int[]){0}, sizeof(int)));
+    TEST(!cache_get(cache, (int[]){5}, sizeof(int)));
+    cache_shrink(cache, 60);
+    TEST(nb_deleted == 1);
+    TEST(!cache_get(cache, (int[]){1}, sizeof(int)));
+    TEST(cache_get(cache, (int[]){0}, sizeof(int)));
+    cache_set_max_size(cache, 30);
+    cache_get_stats(cache, &stats);
+    TEST(stats.nb_items == 1 && stats.size == 20 && stats.max_size == 30);
+    TEST(stats.hits == 2 && stats.misses == 2 && stats.evictions == 3);
+    TEST(cache_get(cache, (int[]){0}, sizeof(int)));
+    cache_delete(cache);
+    TEST(nb_deleted == 4);
+
+    // Benchmark with the access pattern of a brush stroke: the keys are
+    // mostly the ones of the last few operations, with a few new ones.
+    uint64_t key[3] = {}, seed = 1;
+    double t;
+    cache = cache_create(512);
+    t = sys_get_time();
+    for (i = 0; i < 1 << 20; i++) {
+        seed = seed * 1103515245 + 12345;
+        key[0] = i / 16 + (seed >> 16) % 64;
+        key[1] = key[0] * 31;
+        if (!cache_get(cache, key, sizeof(key)))
+            cache_add(cache, key, sizeof(key), &nb_deleted, 1,
+                      test_cache_delfunc);
+    }
+    t = sys_get_time() - t;
+    cache_get_stats(cache, &stats);
+    LOG_I("cache stroke: %.1f M/s (%d%% hits)", (1 << 20) / t / 1e6,
+          (int)(stats.hits * 100 / (1 << 20)));
+    cache_delete(cache);
+}
+
+// Check that the blocks data shared in a mesh are only counted once.
+static void test_mesh_get_mem(void)
+{
+    mesh_t *mesh, *other;
+    const uint8_t red[4] = {255, 0, 0, 255}, blue[4] = {0, 0, 255, 255};
+
+    mesh = mesh_new();
+    other = mesh_new();
+    TEST(mesh_get_mem(mesh) > 0);
+    mesh_fill_block(mesh, (int[]){0, 0, 0}, red);
+    mesh_fill_block(mesh, (int[]){BLOCK_SIZE, 0, 0}, red);
+    mesh_fill_block(other, (int[]){0, 0, 0}, red);
+    mesh_fill_block(other, (int[]){BLOCK_SIZE, 0, 0}, blue);
+    TEST(mesh_get_mem(mesh) < mesh_get_mem(other));
+    mesh_delete(other);
+    other = mesh_copy(mesh);
+    TEST(mesh_get_mem(mesh) == mesh_get_mem(other));
+    mesh_delete(other);
+    mesh_delete(mesh);
+}
+
+typedef struct {
+    int nb[4];          // Number of blocks per diff type.
+    int nb_voxels;
+    int nb_mask_bits;
+} diff_count_t;
+
+static void test_mesh_diff_callback(void *user, const mesh_diff_t *diff)
+{
+    diff_count_t *count = user;
+    int i;
+    count->nb[diff->type]++;
+    count->nb_voxels += diff->nb_voxels;
+    for (i = 0; diff->mask && i < BLOCK_SIZE * BLOCK_SIZE; i++)
+        count->nb_mask_bits += __builtin_popcount(diff->mask[i]);
+}
+
+static void test_mesh_diff(void)
+{
+    const int N = BLOCK_SIZE, R = N * 5 / 2;
+    mesh_t *mesh, *other;
+    int x, y, z;
+    uint8_t c[4], v[4];
+    diff_count_t count = {};
+
+    mesh = mesh_new();
+    for (z = 0; z < R; z++)
+    for (y = 0; y < R; y++)
+    for (x = 0; x < R; x++) {
+        c[0] = x * 3; c[1] = y * 3; c[2] = z * 3; c[3] = 255;
+        mesh_set_at(mesh, NULL, (int[]){x, y, z}, c);
+    }
+    other = mesh_copy(mesh);
+    TEST(mesh_diff(mesh, other, 0, NULL, NULL) == 0);
+
+    // Setting back the same value gives a new block data, with the same
+    // voxels.
+    mesh_get_at(other, NULL, (int[]){1, 2, 3}, v);
+    mesh_set_at(other, NULL, (int[]){1, 2, 3}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(other, NULL, (int[]){1, 2, 3}, v);
+    TEST(mesh_diff(mesh, other, 0, NULL, NULL) == 0);
+
+    mesh_set_at(other, NULL, (int[]){1, 2, 3}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(other, NULL, (int[]){2, 2, 3}, (uint8_t[]){1, 2, 3, 255});
+    mesh_set_at(other, NULL, (int[]){4 * N, 0, 0}, (uint8_t[]){1, 2, 3, 255});
+    mesh_clear_block(other, NULL, (int[]){N, 0, 0});
+    // Empty voxels with a different color are still equal.
+    mesh_set_at(other, NULL, (int[]){-1, 0, 0}, (uint8_t[]){1, 2, 3, 0});
+
+    TEST(mesh_diff(mesh, other, 0, test_mesh_diff_callback, &count) == 3);
+    TEST(count.nb[MESH_DIFF_ADDED] == 1);
+    TEST(count.nb[MESH_DIFF_REMOVED] == 1);
+    TEST(count.nb[MESH_DIFF_CHANGED] == 1);
+    TEST(count.nb_voxels == 0 && count.nb_mask_bits == 0);
+
+    count = (diff_count_t){};
+    mesh_diff(mesh, other, MESH_DIFF_VOXELS, test_mesh_diff_callback,
+              &count);
+    TEST(count.nb_voxels == 2 + 1 + N * N * N);
+    TEST(count.nb_mask_bits == count.nb_voxels);
+    TEST(mesh_diff(other, mesh, 0, NULL, NULL) == 3);
+
+    mesh_delete(other);
+    mesh_delete(mesh);
+}
+
+static void test_mesh_hash(void)
+{
+    const int N = BLOCK_SIZE, R = N * 5 / 2;
+    mesh_t *mesh, *other;
+    int x, y, z;
+    uint8_t c[4];
+    uint64_t hash;
+
+    mesh = mesh_new();
+    for (z = 0; z < R; z++)
+    for (y = 0; y < R; y++)
+    for (x = 0; x < R; x++) {
+        c[0] = x; c[1] = y % 4; c[2] = z % 4; c[3] = 255;
+        mesh_set_at(mesh, NULL, (int[]){x, y, z}, c);
+    }
+    hash = mesh_get_hash(mesh);
+    other = mesh_copy(mesh);
+    TEST(mesh_get_hash(other) == hash);
+
+    // Same voxels stored in other formats, with empty blocks and empty
+    // voxels of different colors.
+    mesh_remove_empty_blocks(other, false);
+    mesh_set_at(other, NULL, (int[]){4 * N, 0, 0}, (uint8_t[]){1, 2, 3, 0});
+    mesh_set_at(other, NULL, (int[]){-1, 0, 0}, (uint8_t[]){1, 2, 3, 0});
+    TEST(mesh_get_hash(other) == hash);
+
+    mesh_get_at(other, NULL, (int[]){1, 2, 3}, c);
+    mesh_set_at(other, NULL, (int[]){1, 2, 3}, (uint8_t[]){10, 20, 30, 255});
+    TEST(mesh_get_hash(other) != hash);
+    mesh_set_at(other, NULL, (int[]){1, 2, 3}, c);
+    TEST(mesh_get_hash(other) == hash);
+
+    // The same blocks at other positions.
+    mesh_clear(other);
+    mesh_copy_block(mesh, (int[]){0, 0, 0}, other, (int[]){0, 0, 0});
+    mesh_copy_block(mesh, (int[]){N, 0, 0}, other, (int[]){N, 0, 0});
+    hash = mesh_get_hash(other);
+    mesh_copy_block(mesh, (int[]){0, 0, 0}, other, (int[]){N, 0, 0});
+    mesh_copy_block(mesh, (int[]){N, 0, 0}, other, (int[]){0, 0, 0});
+    TEST(mesh_get_hash(other) != hash);
+    mesh_delete(other);
+    mesh_delete(mesh);
+}
+
+// Run the updates of two sync connections until the meshes are the same.
+static void sync_both(sync_t *sa, mesh_t *a, sync_t *sb, mesh_t *b)
+{
+    int i;
+    for (i = 0; i < 1000; i++) {
+        TEST(sync_update(sa, a) >= 0);
+        TEST(sync_update(sb, b) >= 0);
+        if (i >= 10 && mesh_diff(a, b, 0, NULL, NULL) == 0) break;
+    }
+}
+
+static void test_sync(void)
+{
+    const int port = 27183;
+    mesh_t *a, *b;
+    sync_t *sa, *sb;
+    sync_stats_t stats;
+    uint64_t bytes;
+    float box[4][4];
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .mode = MODE_OVER,
+        .color = {255, 0, 0, 255},
+    };
+
+    if (DEFINED(WIN32)) return;
+    sa = sync_listen(port);
+    if (!sa) return; // Not supported, or the port is used.
+    sb = sync_connect("127.0.0.1", port);
+    TEST(sb);
+
+    a = mesh_new();
+    b = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), 64, 64, 64);
+    mesh_op(a, &painter, box);
+    bbox_from_extents(box, VEC(100, 0, 0), 8, 8, 8);
+    mesh_op(b, &painter, box);
+    sync_both(sa, a, sb, b);
+    TEST(mesh_diff(a, b, 0, NULL, NULL) == 0);
+
+    // A small stroke only sends a few blocks.
+    sync_get_stats(sa, &stats);
+    bytes = stats.bytes_sent;
+    painter.color[1] = 255;
+    bbox_from_extents(box, VEC(10, 60, 0), 3, 3, 3);
+    mesh_op(a, &painter, box);
+    sync_both(sa, a, sb, b);
+    TEST(mesh_diff(a, b, 0, NULL, NULL) == 0);
+    sync_get_stats(sa, &stats);
+    TEST(stats.bytes_sent - bytes < 8 * KB);
+
+    // Concurrent edits of the same block end up the same on both sides.
+    painter.color[2] = 255;
+    bbox_from_extents(box, VEC(0, 0, 70), 4, 4, 4);
+    mesh_op(a, &painter, box);
+    painter.color[0] = 0;
+    mesh_op(b, &painter, box);
+    sync_both(sa, a, sb, b);
+    TEST(mesh_diff(a, b, 0, NULL, NULL) == 0);
+    sync_get_stats(sa, &stats);
+    TEST(stats.conflicts > 0);
+
+    sync_delete(sa);
+    sync_delete(sb);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+// Sum of the squared distances of the colors to their nearest palette
+// color.
+static double palette_error(const uint8_t (*colors)[4],
+                            const uint32_t *counts, int nb_colors,
+                            const uint8_t (*palette)[4], int nb)
+{
+    int i, j, k, d, best;
+    double ret = 0;
+    for (i = 0; i < nb_colors; i++) {
+        best = INT_MAX;
+        for (j = 0; j < nb; j++) {
+            for (k = 0, d = 0; k < 4; k++)
+                d += (colors[i][k] - palette[j][k]) *
+                     (colors[i][k] - palette[j][k]);
+            best = min(best, d);
+        }
+        ret += (double)best * counts[i];
+    }
+    return ret;
+}
+
+static void test_mesh_copy_box(void)
+{
+    const int N = BLOCK_SIZE, R = N * 5 / 2;
+    mesh_t *mesh, *a, *b;
+    mask_t *mask;
+    float box[4][4];
+    int i, x, y, z;
+    uint8_t c[4];
+
+    mesh = mesh_new();
+    for (z = -R; z < R; z++)
+    for (y = -R; y < R; y++)
+    for (x = -R; x < R; x++) {
+        c[0] = x * 3; c[1] = y * 3; c[2] = z * 3; c[3] = 255;
+        mesh_set_at(mesh, NULL, (int[]){x, y, z}, c);
+    }
+    for (i = 0; i < 2; i++) {
+        bbox_from_extents(box, VEC(3, -2, 5),
+                          R * 0.75, R * 0.625, R * 0.5);
+        if (i == 1) mat4_rotate(box, 0.5, 0, 0, 1, box);
+        a = mesh_copy_box(mesh, box);
+        b = mesh_copy(mesh);
+        mask = mask_new();
+        mask_add_box(mask, box);
+        mask_apply(mask, b, MODE_INTERSECT, NULL);
+        mask_delete(mask);
+        TEST(mesh_diff(a, b, 0, NULL, NULL) == 0);
+        // The blocks inside the box are not copied.
+        if (i == 0) TEST(mesh_get_unshared_mem(a, mesh) <
+                         mesh_get_unshared_mem(a, NULL));
+        mesh_delete(a);
+        mesh_delete(b);
+    }
+    mesh_delete(mesh);
+}
+
+static void test_quantization(void)
+{
+    const int size = 128;
+    int i, x, y, z, nb_colors = 4096;
+    uint8_t palette[256][4], before[256][4], (*colors)[4], *data, *v;
+    uint32_t *counts, seed = 1;
+    mesh_t *mesh;
+    double t;
+
+    // With less colors than the palette size, we get them all back.
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){1, 0, 0}, (uint8_t[]){0, 255, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){40, 0, 0}, (uint8_t[]){0, 0, 255, 255});
+    mesh_set_at(mesh, NULL, (int[]){41, 0, 0}, (uint8_t[]){0, 0, 255, 255});
+    quantization_gen_palette(mesh, 4, palette);
+    TEST(palette_error((const uint8_t[][4]){{255, 0, 0, 255},
+                                            {0, 255, 0, 255},
+                                            {0, 0, 255, 255}},
+                       (const uint32_t[]){1, 1, 2}, 3,
+                       (const uint8_t (*)[4])palette, 4) == 0);
+    mesh_delete(mesh);
+
+    // The k-means refinement should never make the palette worse.
+    colors = malloc(nb_colors * sizeof(*colors));
+    counts = malloc(nb_colors * sizeof(*counts));
+    for (i = 0; i < nb_colors; i++) {
+        seed = seed * 1103515245 + 12345;
+        colors[i][0] = seed >> 8;
+        colors[i][1] = seed >> 16;
+        colors[i][2] = (seed >> 24) & 0x3f;
+        colors[i][3] = 255;
+        counts[i] = 1 + (seed >> 4) % 16;
+    }
+    quantization_gen_palette_from_colors(
+            (const uint8_t (*)[4])colors, counts, nb_colors, 256, palette);
+    memcpy(before, palette, sizeof(palette));
+    quantization_refine_palette((const uint8_t (*)[4])colors, counts,
+                                nb_colors, 256, palette, 4);
+    TEST(palette_error((const uint8_t (*)[4])colors, counts, nb_colors,
+                       (const uint8_t (*)[4])palette, 256) <=
+         palette_error((const uint8_t (*)[4])colors, counts, nb_colors,
+                       (const uint8_t (*)[4])before, 256));
+    free(colors);
+    free(counts);
+
+    // Benchmark with a big mesh of smoothly varying colors.
+    mesh = mesh_new();
+    data = malloc(size * size * size * 4);
+    for (z = 0, v = data; z < size; z++)
+    for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++, v += 4) {
+        seed = seed * 1103515245 + 12345;
+        v[0] = x * 2;
+        v[1] = y * 2 + (seed >> 16) % 4;
+        v[2] = z * 2;
+        v[3] = 255;
+    }
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){size, size, size}, data);
+    free(data);
+    t = sys_get_time();
+    quantization_gen_palette(mesh, 256, palette);
+    t = sys_get_time() - t;
+    LOG_I("quantization: %.1f M voxels/s", size * size * size / t / 1e6);
+    mesh_delete(mesh);
+}
+
+static void test_tasks_func(void *user)
+{
+    int *v = user;
+    *v = *v * 2;
+}
+
+static void test_tasks(void)
+{
+    task_t *tasks[64];
+    int values[64];
+    int i;
+    bool ok = true;
+
+    for (i = 0; i < 64; i++) {
+        values[i] = i;
+        tasks[i] = task_start(test_tasks_func, &values[i]);
+    }
+    // Cancel half of the tasks, the other half must be done once deleted.
+    for (i = 1; i < 64; i += 2) task_delete(tasks[i]);
+    for (i = 0; i < 64; i += 2) {
+        while (!task_is_done(tasks[i])) {}
+        ok = ok && values[i] == i * 2;
+        task_delete(tasks[i]);
+    }
+    for (i = 1; i < 64; i += 2)
+        ok = ok && (values[i] == i || values[i] == i * 2);
+    TEST(ok);
+}
+
+static void test_tasks_deps_sum(void *user, int i)
+{
+    int *values = user;
+    __atomic_add_fetch(&values[64], values[i], __ATOMIC_RELAXED);
+}
+
+// Sum the values computed by the previous tasks, with a parallel_for
+// running at the same time as the one of the main thread.
+static void test_tasks_deps_func(void *user)
+{
+    parallel_for(64, test_tasks_deps_sum, user);
+}
+
+static void test_tasks_deps_double(void *user, int i)
+{
+    int *values = user;
+    values[i] *= 2;
+}
+
+static void test_tasks_deps_done(void *user)
+{
+    int *values = user;
+    values[65]++;
+}
+
+static void test_tasks_deps(void)
+{
+    task_t *tasks[64], *task;
+    int values[66] = {}, others[1024];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        values[i] = i;
+        tasks[i] = task_start(test_tasks_func, &values[i]);
+    }
+    task = task_start_full(test_tasks_deps_func, test_tasks_deps_done,
+                           values, 64, tasks);
+    // A deleted dependency doesn't block the task.
+    task_delete(tasks[0]);
+    for (i = 0; i < 1024; i++) others[i] = i;
+    parallel_for(1024, test_tasks_deps_double, others);
+    task_wait(task);
+    TEST(values[64] == 63 * 64);
+    TEST(values[65] == 0);
+    tasks_update();
+    TEST(values[65] == 1);
+    tasks_update();
+    TEST(values[65] == 1);
+    for (i = 0; i < 1024; i++) TEST(others[i] == i * 2);
+    task_delete(task);
+    for (i = 1; i < 64; i++) task_delete(tasks[i]);
+}
+
+static int g_frame_tasks_log[8];
+static int g_frame_tasks_nb;
+
+static void test_frame_tasks_func(void *user)
+{
+    g_frame_tasks_log[g_frame_tasks_nb++] = *(int*)user;
+}
+
+static void test_frame_tasks(void)
+{
+    int values[] = {0, 1, 2, 3};
+
+    g_frame_tasks_nb = 0;
+    frame_task_add(2, test_frame_tasks_func, &values[2]);
+    frame_task_add(0, test_frame_tasks_func, &values[0]);
+    frame_task_add(3, test_frame_tasks_func, &values[3]);
+    frame_task_add(1, test_frame_tasks_func, &values[1]);
+    frame_task_remove(test_frame_tasks_func, &values[3]);
+    TEST(frame_tasks_get_nb() == 3);
+
+    // With no budget, we still run one task per frame.
+    frame_tasks_begin(0);
+    frame_tasks_run();
+    TEST(g_frame_tasks_nb == 1 && g_frame_tasks_log[0] == 0);
+    TEST(!frame_tasks_has_time());
+    frame_tasks_begin(1000);
+    frame_tasks_run();
+    TEST(g_frame_tasks_nb == 3);
+    TEST(g_frame_tasks_log[1] == 1 && g_frame_tasks_log[2] == 2);
+    TEST(frame_tasks_get_nb() == 0);
+}
+
+static void test_counters_func(void *user)
+{
+    const uint8_t blue[4] = {0, 0, 255, 255};
+    mesh_set_at(user, NULL, (int[]){0, 0, 0}, blue);
+}
+
+static void test_counters(void)
+{
+    uint64_t before[COUNTER_COUNT], after[COUNTER_COUNT];
+    const uint8_t red[4] = {255, 0, 0, 255};
+    mesh_t *mesh, *copy;
+    mesh_accessor_t accessor;
+    task_t *task;
+    uint8_t v[4];
+
+    if (!COUNTERS) return;
+    mesh = mesh_new();
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, red);
+    copy = mesh_copy(mesh);
+    counters_get(before);
+    // The values from the other threads must be counted too.
+    task = task_start(test_counters_func, copy);
+    while (!task_is_done(task)) {}
+    task_delete(task);
+    accessor = mesh_get_accessor(mesh);
+    // Going back to a block we just left uses the accessor cache.
+    mesh_get_at(mesh, &accessor, (int[]){0, 0, 0}, v);
+    mesh_get_at(mesh, &accessor, (int[]){BLOCK_SIZE, 0, 0}, v);
+    mesh_get_at(mesh, &accessor, (int[]){0, 0, 0}, v);
+    counters_get(after);
+    TEST(after[COUNTER_MESH_TABLE_COPIES] > before[COUNTER_MESH_TABLE_COPIES]);
+    TEST(after[COUNTER_BLOCK_COPIES] > before[COUNTER_BLOCK_COPIES]);
+    TEST(after[COUNTER_MESH_LOOKUPS] > before[COUNTER_MESH_LOOKUPS]);
+    TEST(after[COUNTER_MESH_ACCESSOR_HITS] >
+         before[COUNTER_MESH_ACCESSOR_HITS]);
+    mesh_delete(copy);
+    mesh_delete(mesh);
+}
+
+static void test_inputs_trace(void)
+{
+    const char *path = "/tmp/goxel_test_inputs.trace";
+    inputs_trace_t *trace;
+    inputs_t frames[3] = {}, inputs;
+    int i;
+    bool ok = true;
+
+    for (i = 0; i < 3; i++) {
+        frames[i].window_size[0] = 640 + i;
+        frames[i].window_size[1] = 480;
+        frames[i].scale = 1.5;
+        frames[i].keys[KEY_LEFT_SHIFT] = i == 1;
+        frames[i].keys['A'] = true;
+        frames[i].chars[0] = 'a' + i;
+        frames[i].touches[0].pos[0] = 10.25 * i;
+        frames[i].touches[0].pos[1] = -3;
+        frames[i].touches[0].down[2] = i == 2;
+        frames[i].mouse_wheel = i - 1;
+    }
+    trace = inputs_trace_open(path, true);
+    for (i = 0; i < 3; i++) inputs_trace_write(trace, &frames[i]);
+    inputs_trace_close(trace);
+
+    trace = inputs_trace_open(path, false);
+    TEST(trace);
+    for (i = 0; i < 3; i++) {
+        ok = ok && inputs_trace_read(trace, &inputs);
+        ok = ok && memcmp(&inputs, &frames[i], sizeof(inputs)) == 0;
+    }
+    TEST(ok);
+    TEST(!inputs_trace_read(trace, &inputs));
+    inputs_trace_close(trace);
+}
+
+static void test_mem_stats(void)
+{
+    const uint8_t red[4] = {255, 0, 0, 255};
+    int64_t before, current, peak;
+    mesh_t *mesh;
+    int i;
+
+    mem_stats_get(MEM_BLOCKS, &before, NULL);
+    mesh = mesh_new();
+    for (i = 0; i < 4; i++)
+        mesh_set_at(mesh, NULL, (int[]){i * BLOCK_SIZE, 0, 0}, red);
+    mem_stats_get(MEM_BLOCKS, &current, &peak);
+    TEST(current > before);
+    TEST(peak >= current);
+    mesh_delete(mesh);
+    mem_stats_get(MEM_BLOCKS, &current, NULL);
+    TEST(current == before);
+}
+
+static void test_mempool(void)
+{
+    static mempool_t pool = MEMPOOL_INIT(64);
+    uint8_t *objs[1000];
+    int i;
+    int64_t mem;
+    bool ok = true;
+
+    for (i = 0; i < 1000; i++) {
+        objs[i] = mempool_alloc(&pool);
+        memset(objs[i], i % 256, 64);
+    }
+    for (i = 0; i < 1000; i++) {
+        ok = ok && objs[i][0] == i % 256 && objs[i][63] == i % 256;
+        mempool_free(&pool, objs[i]);
+    }
+    TEST(ok);
+    TEST(MEMPOOL_USE_MALLOC || mempool_get_mem(&pool) >= 1000 * 64);
+    // The freed objects are reused.
+    mem = mempool_get_mem(&pool);
+    objs[0] = mempool_alloc(&pool);
+    TEST(mempool_get_mem(&pool) == mem);
+    mempool_free(&pool, objs[0]);
+    mempool_trim(&pool);
+    TEST(mempool_get_mem(&pool) == 0);
+}
+
 void tests_run(void)
 {
+    test_mesh_blocks();
+    test_mesh_blocks_array();
+    test_mesh_cow();
+    test_mesh_write_session();
+    test_mesh_accessor();
+    test_mesh_read_write();
+    test_mesh_foreach_block();
+    test_mesh_replace_colors();
+    test_mesh_blit();
+    test_mesh_remove_empty_blocks();
+    test_mesh_compression();
+    test_mesh_journal();
+    test_mesh_iter_neighbors();
+    test_mesh_dedup();
+    test_mesh_paging();
+    test_history_budget();
+    test_history_delta();
+    test_history_spill();
+    test_transaction();
+    test_procedural();
+    test_mesh_bbox();
+    test_mesh_stats();
+    test_mesh_raycast();
+    test_mesh_sparse();
+    test_mesh_op();
+    test_mesh_op_oriented();
+    test_mesh_op_full_blocks();
+    test_mesh_merger();
+    test_mesh_merge_n();
+    test_mesh_merge_blocks();
+    test_mesh_move();
+    test_mesh_extrude();
+    test_mesh_select();
+    test_mesh_op_symmetry();
+    test_mesh_op_stamps();
+    test_mask();
+    test_mesh_merge_faces();
+    test_mesh_lod();
+    test_mesh_vertices_cache();
+    test_mesh_vertices_parts();
+    test_mesh_pack_vertices();
+    test_mesh_pack_faces();
+    test_mesh_index_vertices();
+    test_combine_voxels();
+    test_clone_instance();
+    test_layers_update();
+    test_layers_ids();
+    test_frames();
+    test_gpu_ops();
+    test_shapes_row();
+    test_cache();
+    test_mesh_get_mem();
+    test_mesh_diff();
+    test_mesh_hash();
+    test_sync();
+    test_mesh_copy_box();
+    test_quantization();
+    test_tasks();
+    test_tasks_deps();
+    test_frame_tasks();
+    test_counters();
+    test_inputs_trace();
+    test_mem_stats();
+    test_mempool();
     test_load_file_v2();
     test_load_file_v1_with_preview();
     test_load_corrupt();
+    test_save_load_file();
+    test_load_file_lazy();
+    test_load_hidden_layer();
+    test_save_incremental();
+    test_save_store();
+    test_gox_infos();
+    test_save_async();
+    test_load_concurrent();
+    test_vox_export();
+    test_vdb_export();
+    test_obj_export();
+    test_volume_import();
+    test_voxelize();
+    test_pointcloud();
+    test_glb_export();
+    test_vxl_export();
+    test_qubicle();
+    test_import_corrupt();
+    test_png_slices();
+    test_png_write();
+    test_povray_export();
+    test_export_progress();
 }
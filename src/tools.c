@@ -26,6 +26,8 @@ static void a_tool_set(void *data)
         mesh_delete(goxel.tool_mesh);
         goxel.tool_mesh = NULL;
     }
+    mesh_delete(goxel.tool_overlay);
+    goxel.tool_overlay = NULL;
     goxel.tool = (tool_t*)data;
 }
 
@@ -52,7 +54,7 @@ const tool_t *tool_get(int id)
 static int pick_color_gesture(gesture3d_t *gest, void *user)
 {
     cursor_t *curs = &goxel.cursor;
-    const mesh_t *mesh = goxel_get_layers_mesh(goxel.image);
+    const mesh_t *mesh = image_get_layers_mesh(goxel.image);
     int pi[3] = {floor(curs->pos[0]),
                  floor(curs->pos[1]),
                  floor(curs->pos[2])};
@@ -97,6 +99,15 @@ int tool_gui(tool_t *tool)
     return tool->gui_fn(tool);
 }
 
+void tool_render_cursor(tool_t *tool, const cursor_t *curs)
+{
+    if (!tool->cursor_fn) return;
+    if (    (tool->flags & TOOL_REQUIRE_CAN_EDIT) &&
+            !image_layer_can_edit(goxel.image, goxel.image->active_layer))
+        return;
+    tool->cursor_fn(tool, curs);
+}
+
 
 static bool snap_button(const char *label, int s, float w)
 {
@@ -19,6 +19,7 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
+#include "gesture3d.h"
 #include "shape.h"
 #include "mesh_utils.h"
 
@@ -55,6 +56,10 @@ struct tool {
     int (*iter_fn)(tool_t *tool, const painter_t *painter,
                    const float viewport[4]);
     int (*gui_fn)(tool_t *tool);
+    // Optional, queue the render items of the tool cursor, like the brush
+    // outline.  Called at render time with the latest position of the
+    // cursor, so it should only queue a few simple items.
+    void (*cursor_fn)(tool_t *tool, const cursor_t *curs);
     const char *default_shortcut;
     int state; // XXX: to be removed I guess.
     int flags;
@@ -78,6 +83,7 @@ const tool_t *tool_get(int id);
 
 int tool_iter(tool_t *tool, const painter_t *painter, const float viewport[4]);
 int tool_gui(tool_t *tool);
+void tool_render_cursor(tool_t *tool, const cursor_t *curs);
 
 int tool_gui_snap(void);
 int tool_gui_shape(const shape_t **shape);
@@ -25,6 +25,13 @@ typedef struct {
     mesh_t *mesh_orig; // Original mesh.
     mesh_t *mesh;      // Mesh containing only the tool path.
 
+    // Version of the tool path after the last update, so that we only
+    // recompute the blocks touched since then.
+    uint64_t mesh_version;
+
+    // Key of the layer mesh the hover preview was computed from.
+    uint64_t hover_key;
+
     // Gesture start and last pos (should we put it in the 3d gesture?)
     float start_pos[3];
     float last_pos[3];
@@ -47,7 +54,7 @@ typedef struct {
 static bool check_can_skip(tool_brush_t *brush, const cursor_t *curs,
                            int mode)
 {
-    mesh_t *mesh = goxel.tool_mesh;
+    const mesh_t *mesh = goxel_get_tool_preview();
     const bool pressed = curs->flags & CURSOR_PRESSED;
     if (    pressed == brush->last_op.pressed &&
             mode == brush->last_op.mode &&
@@ -116,7 +123,7 @@ static int on_drag(gesture3d_t *gest, void *user)
     cursor_t *curs = gest->cursor;
     bool shift = curs->flags & CURSOR_SHIFT;
     float r = goxel.tool_radius;
-    int nb, i;
+    int nb, i, (*blocks_pos)[3];
     float pos[3];
 
     if (gest->state == GESTURE_BEGIN) {
@@ -154,18 +161,23 @@ static int on_drag(gesture3d_t *gest, void *user)
         mesh_op(brush->mesh, &painter, box);
     }
 
+    // Update the tool preview.  Only the blocks of the path changed since
+    // the last update need to be merged again.
     painter = *(painter_t*)USER_GET(user, 1);
-    if (!goxel.tool_mesh) goxel.tool_mesh = mesh_new();
-    mesh_set(goxel.tool_mesh, brush->mesh_orig);
-    mesh_merge(goxel.tool_mesh, brush->mesh, painter.mode, painter.color);
+    nb = -1;
+    blocks_pos = NULL;
+    if (gest->state != GESTURE_BEGIN)
+        nb = mesh_get_changes(brush->mesh, brush->mesh_version, &blocks_pos);
+    goxel_set_tool_preview(brush->mesh_orig, brush->mesh, painter.mode,
+                           painter.color, nb, blocks_pos);
+    free(blocks_pos);
+    brush->mesh_version = mesh_get_version(brush->mesh);
     vec3_copy(curs->pos, brush->start_pos);
-    brush->last_op.mesh_key = mesh_get_key(goxel.tool_mesh);
+    brush->last_op.mesh_key = mesh_get_key(goxel_get_tool_preview());
 
     if (gest->state == GESTURE_END) {
-        mesh_set(goxel.image->active_layer->mesh, goxel.tool_mesh);
-        mesh_set(brush->mesh_orig, goxel.tool_mesh);
-        mesh_delete(goxel.tool_mesh);
-        goxel.tool_mesh = NULL;
+        goxel_apply_tool_preview(goxel.image->active_layer->mesh);
+        mesh_set(brush->mesh_orig, goxel.image->active_layer->mesh);
     }
     vec3_copy(curs->pos, brush->last_pos);
     return 0;
@@ -176,33 +188,50 @@ static int on_hover(gesture3d_t *gest, void *user)
     mesh_t *mesh = goxel.image->active_layer->mesh;
     tool_brush_t *brush = USER_GET(user, 0);
     const painter_t *painter = USER_GET(user, 1);
+    painter_t path_painter = *painter;
     cursor_t *curs = gest->cursor;
     float box[4][4];
     bool shift = curs->flags & CURSOR_SHIFT;
+    bool skip;
 
     if (gest->state == GESTURE_END || !curs->snaped) {
         mesh_delete(goxel.tool_mesh);
+        mesh_delete(goxel.tool_overlay);
         goxel.tool_mesh = NULL;
+        goxel.tool_overlay = NULL;
         return 0;
     }
 
     if (shift)
         render_line(&goxel.rend, brush->start_pos, curs->pos, NULL, 0);
 
-    if (goxel.tool_mesh && check_can_skip(brush, curs, painter->mode))
+    skip = check_can_skip(brush, curs, painter->mode);
+    if (    skip && goxel_get_tool_preview() &&
+            brush->hover_key == mesh_get_key(mesh))
         return 0;
 
+    // Same preview as when drawing, so that it only touches the blocks of
+    // the brush shape when it is rendered as an overlay.
     get_box(curs->pos, NULL, curs->normal, goxel.tool_radius, NULL, box);
-
-    if (!goxel.tool_mesh) goxel.tool_mesh = mesh_new();
-    mesh_set(goxel.tool_mesh, mesh);
-    mesh_op(goxel.tool_mesh, painter, box);
-
-    brush->last_op.mesh_key = mesh_get_key(mesh);
-
+    path_painter.mode = MODE_MAX;
+    vec4_set(path_painter.color, 255, 255, 255, 255);
+    mesh_clear(brush->mesh);
+    mesh_op(brush->mesh, &path_painter, box);
+    goxel_set_tool_preview(mesh, brush->mesh, painter->mode, painter->color,
+                           -1, NULL);
+    brush->hover_key = mesh_get_key(mesh);
+    brush->last_op.mesh_key = mesh_get_key(goxel_get_tool_preview());
     return 0;
 }
 
+// Outline of the brush at the cursor.
+static void render_cursor(tool_t *tool, const cursor_t *curs)
+{
+    float box[4][4];
+    if (!curs->snaped || (curs->flags & CURSOR_OUT)) return;
+    get_box(curs->pos, NULL, curs->normal, goxel.tool_radius, NULL, box);
+    render_box(&goxel.rend, box, NULL, EFFECT_WIREFRAME);
+}
 
 static int iter(tool_t *tool, const painter_t *painter,
                 const float viewport[4])
@@ -254,6 +283,7 @@ TOOL_REGISTER(TOOL_BRUSH, brush, tool_brush_t,
               .name = "Brush",
               .iter_fn = iter,
               .gui_fn = gui,
+              .cursor_fn = render_cursor,
               .flags = TOOL_REQUIRE_CAN_EDIT | TOOL_ALLOW_PICK_COLOR,
               .default_shortcut = "B"
 )
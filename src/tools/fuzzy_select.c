@@ -20,7 +20,8 @@
 
 typedef struct {
     tool_t tool;
-    mesh_t *selection;
+    mask_t *mask;
+    mesh_t *selection;  // The mask as a mesh, for the rendering.
     int threshold;
     struct {
         gesture3d_t click;
@@ -55,8 +56,11 @@ static int on_click(gesture3d_t *gest, void *user)
     pi[1] = floor(curs->pos[1]);
     pi[2] = floor(curs->pos[2]);
     if (!tool->selection) tool->selection = mesh_new();
+    if (!tool->mask) tool->mask = mask_new();
     mesh_clear(tool->selection);
+    mask_clear(tool->mask);
     mesh_select(mesh, pi, select_cond, tool, tool->selection);
+    mask_add_mesh(tool->mask, tool->selection);
     return 0;
 }
 
@@ -86,13 +90,13 @@ static int iter(tool_t *tool_, const painter_t *painter,
 }
 
 static layer_t *cut_as_new_layer(image_t *img, layer_t *layer,
-                                 const mesh_t *mask)
+                                 const mask_t *mask)
 {
     layer_t *new_layer;
 
     new_layer = image_duplicate_layer(img, layer);
-    mesh_merge(new_layer->mesh, mask, MODE_INTERSECT, NULL);
-    mesh_merge(layer->mesh, mask, MODE_SUB, NULL);
+    mask_apply(mask, new_layer->mesh, MODE_INTERSECT, NULL);
+    mask_apply(mask, layer->mesh, MODE_SUB, NULL);
     return new_layer;
 }
 
@@ -108,7 +112,7 @@ static int gui(tool_t *tool_)
         gui_input_int("Threshold", &tool->threshold, 1, 254);
     }
 
-    if (!tool->selection || mesh_is_empty(tool->selection))
+    if (!tool->mask || mask_is_empty(tool->mask))
         return 0;
 
     mesh_t *mesh = goxel.image->active_layer->mesh;
@@ -116,16 +120,16 @@ static int gui(tool_t *tool_)
     gui_group_begin(NULL);
     if (gui_button("Clear", 1, 0)) {
         image_history_push(goxel.image);
-        mesh_merge(mesh, tool->selection, MODE_SUB, NULL);
+        mask_apply(tool->mask, mesh, MODE_SUB, NULL);
     }
     if (gui_button("Fill", 1, 0)) {
         image_history_push(goxel.image);
-        mesh_merge(mesh, tool->selection, MODE_OVER, goxel.painter.color);
+        mask_apply(tool->mask, mesh, MODE_OVER, goxel.painter.color);
     }
     if (gui_button("Cut as new layer", 1, 0)) {
         image_history_push(goxel.image);
         cut_as_new_layer(goxel.image, goxel.image->active_layer,
-                         tool->selection);
+                         tool->mask);
     }
     gui_group_end();
     return 0;
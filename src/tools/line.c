@@ -104,15 +104,12 @@ static int on_drag(gesture3d_t *gest, void *user)
     mesh_op(tool->mesh, &painter, box);
 
     painter = *(painter_t*)USER_GET(user, 1);
-    if (!goxel.tool_mesh) goxel.tool_mesh = mesh_new();
-    mesh_set(goxel.tool_mesh, tool->mesh_orig);
-    mesh_merge(goxel.tool_mesh, tool->mesh, painter.mode, painter.color);
+    goxel_set_tool_preview(tool->mesh_orig, tool->mesh, painter.mode,
+                           painter.color, -1, NULL);
 
     if (gest->state == GESTURE_END) {
-        mesh_set(goxel.image->active_layer->mesh, goxel.tool_mesh);
-        mesh_set(tool->mesh_orig, goxel.tool_mesh);
-        mesh_delete(goxel.tool_mesh);
-        goxel.tool_mesh = NULL;
+        goxel_apply_tool_preview(goxel.image->active_layer->mesh);
+        mesh_set(tool->mesh_orig, goxel.image->active_layer->mesh);
     }
 
     return 0;
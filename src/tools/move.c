@@ -38,7 +38,8 @@ static void do_move(layer_t *layer, const float mat[4][4])
     mat4_imul(m, mat);
     mat4_itranslate(m, +0.5, +0.5, +0.5);
 
-    if (layer->base_id || layer->image || layer->shape) {
+    if (    layer->base_id || layer->image || layer->shape ||
+            layer->procedural) {
         mat4_mul(mat, layer->mat, layer->mat);
         layer->base_mesh_key = 0;
     } else {
@@ -70,7 +71,7 @@ static int gui(tool_t *tool)
     int i;
 
     layer = goxel.image->active_layer;
-    if (layer->shape) {
+    if (layer->shape || layer->procedural) {
         tool_gui_drag_mode(&goxel.tool_drag_mode);
     } else {
         goxel.tool_drag_mode = DRAG_MOVE;
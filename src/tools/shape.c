@@ -23,6 +23,7 @@ typedef struct {
     tool_t tool;
     float  start_pos[3];
     mesh_t *mesh_orig;
+    mesh_t *mesh;      // Mesh containing only the shape.
     bool   planar; // Stay on the original plane.
 
     struct {
@@ -95,6 +96,7 @@ static int on_drag(gesture3d_t *gest, void *user)
 {
     tool_shape_t *shape = USER_GET(user, 0);
     const painter_t *painter = USER_GET(user, 1);
+    painter_t path_painter;
     mesh_t *layer_mesh = goxel.image->active_layer->mesh;
     float box[4][4], pos[3];
     cursor_t *curs = gest->cursor;
@@ -111,14 +113,17 @@ static int on_drag(gesture3d_t *gest, void *user)
 
     goxel_set_help_text("Drag.");
     get_box(shape->start_pos, curs->pos, curs->normal, 0, goxel.plane, box);
-    if (!goxel.tool_mesh) goxel.tool_mesh = mesh_new();
-    mesh_set(goxel.tool_mesh, shape->mesh_orig);
-    mesh_op(goxel.tool_mesh, painter, box);
+    // Render the shape alone, and merge it as with the brush.
+    path_painter = *painter;
+    path_painter.mode = MODE_MAX;
+    vec4_set(path_painter.color, 255, 255, 255, 255);
+    mesh_clear(shape->mesh);
+    mesh_op(shape->mesh, &path_painter, box);
+    goxel_set_tool_preview(shape->mesh_orig, shape->mesh, painter->mode,
+                           painter->color, -1, NULL);
 
     if (gest->state == GESTURE_END) {
-        mesh_set(layer_mesh, goxel.tool_mesh);
-        mesh_delete(goxel.tool_mesh);
-        goxel.tool_mesh = NULL;
+        goxel_apply_tool_preview(layer_mesh);
         mat4_copy(plane_null, goxel.tool_plane);
     }
     return 0;
@@ -135,6 +140,8 @@ static int iter(tool_t *tool, const painter_t *painter,
 
     if (!shape->mesh_orig)
         shape->mesh_orig = mesh_copy(goxel.image->active_layer->mesh);
+    if (!shape->mesh)
+        shape->mesh = mesh_new();
 
     if (!shape->gestures.drag.type) {
         shape->gestures.drag = (gesture3d_t) {
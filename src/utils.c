@@ -78,7 +78,6 @@ char *read_file(const char *path, int *size)
 {
     FILE *file;
     char *ret = NULL;
-    long read_size __attribute__((unused));
     int size_default;
 
     size = size ?: &size_default; // Allow to pass NULL as size;
@@ -87,10 +86,12 @@ char *read_file(const char *path, int *size)
     fseek(file, 0, SEEK_END);
     *size = (int)ftell(file);
     fseek(file, 0, SEEK_SET);
-    ret = malloc(*size + 1);
-    read_size = fread(ret, *size, 1, file);
-    assert(read_size == 1 || *size == 0);
-    ret[*size] = '\0';
+    ret = *size >= 0 ? malloc(*size + 1) : NULL;
+    if (ret && *size && fread(ret, *size, 1, file) != 1) {
+        free(ret);
+        ret = NULL;
+    }
+    if (ret) ret[*size] = '\0';
     fclose(file);
     return ret;
 }
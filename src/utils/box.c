@@ -51,6 +51,29 @@ bool box_intersect_box(const float b1[4][4], const float b2[4][4])
     return box_intersect_box_(b1, b2) || box_intersect_box_(b2, b1);
 }
 
+bool box_intersect_aabb(const float box[4][4], const int aabb[2][3])
+{
+    const float AXES[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    float h[3], t[3], l[3], ra, rb;
+    int i, k;
+
+    for (i = 0; i < 3; i++) {
+        h[i] = (aabb[1][i] - aabb[0][i]) / 2.0f;
+        t[i] = aabb[0][i] + h[i] - box[3][i];
+    }
+    for (k = 0; k < 15; k++) {
+        if (k < 3) vec3_copy(AXES[k], l);
+        else if (k < 6) vec3_copy(box[k - 3], l);
+        else vec3_cross(AXES[(k - 6) / 3], box[(k - 6) % 3], l);
+        ra = fabsf(vec3_dot(box[0], l)) +
+             fabsf(vec3_dot(box[1], l)) +
+             fabsf(vec3_dot(box[2], l));
+        rb = h[0] * fabsf(l[0]) + h[1] * fabsf(l[1]) + h[2] * fabsf(l[2]);
+        if (fabsf(vec3_dot(t, l)) > ra + rb) return false;
+    }
+    return true;
+}
+
 void box_union(const float a[4][4], const float b[4][4], float out[4][4])
 {
     float verts[16][3];
@@ -298,13 +298,16 @@ static inline void box_get_vertices(const float box[4][4],
 
 bool box_intersect_box(const float b1[4][4], const float b2[4][4]);
 
-static inline bool box_intersect_aabb(const float box[4][4],
-                                      const int aabb[2][3])
-{
-    float b2[4][4];
-    bbox_from_aabb(b2, aabb);
-    return box_intersect_box(box, b2);
-}
+/*
+ * Function: box_intersect_aabb
+ * Exact test of the intersection of a box with an axis aligned box.
+ *
+ * This uses the separating axis theorem, testing the three axes of each
+ * box and their nine cross products, so it is cheap enough to be called
+ * for every block of a mesh.  Boxes that only touch are considered to
+ * intersect.
+ */
+bool box_intersect_aabb(const float box[4][4], const int aabb[2][3]);
 
 /*
  * Function: box_union
@@ -17,94 +17,226 @@
  */
 
 #include "cache.h"
+#include "mem_stats.h"
 #include "uthash.h"
+#include "utlist.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 
+/*
+ * The items are indexed in a hash table, and also kept in a list sorted
+ * from the least to the most recently used, so that both getting an item
+ * and removing the oldest one don't need to rehash anything.
+ */
 typedef struct item item_t;
 struct item {
     UT_hash_handle  hh;
-    char            key[256];
+    item_t          *prev, *next;   // Least recently used list.
     void            *data;
     int             cost;
-    uint64_t        last_used;
     int             (*delfunc)(void *data);
+    char            key[];          // Stored inline, with its real size.
 };
 
 struct cache {
-    item_t *items;
-    uint64_t clock;
+    pthread_mutex_t lock;   // Recursive, see cache_lock.
+    item_t *items;  // The hash table.
+    item_t *lru;    // All the items, least recently used first.
     int size;
     int max_size;
+    int mem_tag;    // MEM_ value used to report the size, or -1.
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 };
 
 cache_t *cache_create(int size)
 {
+    pthread_mutexattr_t attr;
     cache_t *cache = calloc(1, sizeof(*cache));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
     cache->max_size = size;
+    cache->mem_tag = MEM_CACHES;
     return cache;
 }
 
+static void remove_item(cache_t *cache, item_t *item)
+{
+    HASH_DEL(cache->items, item);
+    DL_DELETE(cache->lru, item);
+    item->delfunc(item->data);
+    cache->size -= item->cost;
+    if (cache->mem_tag >= 0) mem_stats_add(cache->mem_tag, -item->cost);
+    free(item);
+}
+
 static void cleanup(cache_t *cache)
 {
-    item_t *item;
-    while (cache->size >= cache->max_size) {
-        assert(cache->items);
-        item = cache->items;
-        HASH_DEL(cache->items, item);
-        assert(item != cache->items);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
+    while (cache->lru && cache->size >= cache->max_size) {
+        remove_item(cache, cache->lru);
+        cache->evictions++;
     }
 }
 
 void cache_add(cache_t *cache, const void *key, int len, void *data,
                int cost, int (*delfunc)(void *data))
 {
-    item_t *item = calloc(1, sizeof(*item));
-    assert(len <= sizeof(item->key));
+    item_t *item = calloc(1, sizeof(*item) + len);
     memcpy(item->key, key, len);
     item->data = data;
     item->cost = cost;
-    item->last_used = cache->clock++;
     item->delfunc = delfunc;
+    cache_lock(cache);
     HASH_ADD(hh, cache->items, key, len, item);
+    DL_APPEND(cache->lru, item);
     cache->size += cost;
+    if (cache->mem_tag >= 0) mem_stats_add(cache->mem_tag, cost);
     if (cache->size >= cache->max_size) cleanup(cache);
+    cache_unlock(cache);
 }
 
 void *cache_get(cache_t *cache, const void *key, int keylen)
 {
     item_t *item;
+    void *data = NULL;
+    cache_lock(cache);
     HASH_FIND(hh, cache->items, key, keylen, item);
-    if (!item) return NULL;
-    item->last_used = cache->clock++;
-    // Reinsert item on top of the hash list so that it stays sorted.
-    HASH_DEL(cache->items, item);
-    HASH_ADD(hh, cache->items, key, keylen, item);
-    return item->data;
+    if (!item) {
+        cache->misses++;
+        goto end;
+    }
+    cache->hits++;
+    // Move the item at the end of the list, unless it's already there.
+    if (item->next) {
+        DL_DELETE(cache->lru, item);
+        DL_APPEND(cache->lru, item);
+    }
+    data = item->data;
+end:
+    cache_unlock(cache);
+    return data;
+}
+
+void cache_set_mem_tag(cache_t *cache, int tag)
+{
+    cache_lock(cache);
+    if (cache->mem_tag >= 0) mem_stats_add(cache->mem_tag, -cache->size);
+    cache->mem_tag = tag;
+    if (cache->mem_tag >= 0) mem_stats_add(cache->mem_tag, cache->size);
+    cache_unlock(cache);
 }
 
 void cache_clear(cache_t *cache)
 {
-    item_t *item;
-    while ((item = cache->items)) {
-        HASH_DEL(cache->items, item);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
-    }
+    cache_lock(cache);
+    while (cache->lru) remove_item(cache, cache->lru);
     assert(cache->size == 0);
+    cache_unlock(cache);
+}
+
+void cache_shrink(cache_t *cache, int size)
+{
+    cache_lock(cache);
+    while (cache->lru && cache->size > size) {
+        remove_item(cache, cache->lru);
+        cache->evictions++;
+    }
+    cache_unlock(cache);
+}
+
+void cache_set_max_size(cache_t *cache, int size)
+{
+    cache_lock(cache);
+    cache->max_size = size;
+    cleanup(cache);
+    cache_unlock(cache);
+}
+
+void cache_get_stats(const cache_t *cache, cache_stats_t *stats)
+{
+    cache_lock((cache_t*)cache);
+    *stats = (cache_stats_t) {
+        .nb_items = HASH_COUNT(cache->items),
+        .size = cache->size,
+        .max_size = cache->max_size,
+        .hits = cache->hits,
+        .misses = cache->misses,
+        .evictions = cache->evictions,
+    };
+    cache_unlock((cache_t*)cache);
+}
+
+void cache_lock(cache_t *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+}
+
+void cache_unlock(cache_t *cache)
+{
+    pthread_mutex_unlock(&cache->lock);
 }
 
-/*
- * Function: cache_delete
- * Delete a cache.
- */
 void cache_delete(cache_t *cache)
 {
     cache_clear(cache);
+    pthread_mutex_destroy(&cache->lock);
     free(cache);
 }
+
+// Global registry of caches, see cache_register.
+#define REGISTRY_MAX_SIZE 16
+static struct {
+    const char  *name;
+    cache_t     *cache;
+} g_registry[REGISTRY_MAX_SIZE];
+static int g_registry_size = 0;
+static pthread_mutex_t g_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_register(cache_t *cache, const char *name)
+{
+    pthread_mutex_lock(&g_registry_lock);
+    assert(g_registry_size < REGISTRY_MAX_SIZE);
+    g_registry[g_registry_size].name = name;
+    g_registry[g_registry_size].cache = cache;
+    g_registry_size++;
+    pthread_mutex_unlock(&g_registry_lock);
+}
+
+bool cache_registry_get(int i, const char **name, cache_t **cache)
+{
+    bool ret = false;
+    pthread_mutex_lock(&g_registry_lock);
+    if (i >= 0 && i < g_registry_size) {
+        if (name) *name = g_registry[i].name;
+        if (cache) *cache = g_registry[i].cache;
+        ret = true;
+    }
+    pthread_mutex_unlock(&g_registry_lock);
+    return ret;
+}
+
+void cache_registry_shrink(float ratio)
+{
+    int i;
+    cache_stats_t stats;
+    pthread_mutex_lock(&g_registry_lock);
+    for (i = 0; i < g_registry_size; i++) {
+        cache_get_stats(g_registry[i].cache, &stats);
+        cache_shrink(g_registry[i].cache, stats.size * ratio);
+    }
+    pthread_mutex_unlock(&g_registry_lock);
+}
+
+void cache_registry_clear(void)
+{
+    int i;
+    pthread_mutex_lock(&g_registry_lock);
+    for (i = 0; i < g_registry_size; i++)
+        cache_clear(g_registry[i].cache);
+    pthread_mutex_unlock(&g_registry_lock);
+}
@@ -19,11 +19,26 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // Generic data cache structure.
+//
+// All the functions are thread safe.
 
 // Allow to cache blocks merge operations.
 typedef struct cache cache_t;
 
+// Usage statistics of a cache.
+typedef struct {
+    int         nb_items;
+    int         size;       // Total cost of the items.
+    int         max_size;
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;  // Number of items removed to make space.
+} cache_stats_t;
+
 /*
  * Function: cache_create
  * Create a new cache with a given max size (in byte).
@@ -61,17 +76,99 @@ void cache_add(cache_t *cache, const void *key, int keylen, void *data,
  */
 void *cache_get(cache_t *cache, const void *key, int keylen);
 
+/*
+ * Function: cache_set_mem_tag
+ * Set the subsystem the cache size is reported to in the memory stats.
+ *
+ * Parameters:
+ *   cache  - A cache_t instance.
+ *   tag    - One of the MEM_ enum values (see mem_stats.h), or -1 if
+ *            the costs are not memory sizes.  Default to MEM_CACHES.
+ */
+void cache_set_mem_tag(cache_t *cache, int tag);
+
 /*
  * Function: cache_clear
  * Delete all the cached items.
  */
 void cache_clear(cache_t *cache);
 
+/*
+ * Function: cache_shrink
+ * Delete the least recently used items until the cache size is at most
+ * a given value.
+ */
+void cache_shrink(cache_t *cache, int size);
+
+/*
+ * Function: cache_set_max_size
+ * Change the max size of a cache, deleting the least recently used items
+ * if needed.
+ */
+void cache_set_max_size(cache_t *cache, int size);
+
+/*
+ * Function: cache_get_stats
+ * Get the usage statistics of a cache.
+ */
+void cache_get_stats(const cache_t *cache, cache_stats_t *stats);
+
+/*
+ * Function: cache_lock
+ * Lock a cache, so that the data it returns stays valid.
+ *
+ * Without the lock, an item returned by <cache_get> can be deleted at any
+ * time by an other thread adding or clearing items.  The lock is recursive,
+ * so the other cache functions can still be called while holding it.
+ */
+void cache_lock(cache_t *cache);
+
+/*
+ * Function: cache_unlock
+ * Release the lock taken by <cache_lock>.
+ */
+void cache_unlock(cache_t *cache);
+
 /*
  * Function: cache_delete
  * Delete a cache.
  */
 void cache_delete(cache_t *cache);
 
+/*
+ * Function: cache_register
+ * Add a cache to the global registry of caches.
+ *
+ * The registered caches are listed in the debug panel, and can all be
+ * cleared at once with <cache_registry_clear>, for example when we are
+ * low on memory.
+ *
+ * Parameters:
+ *   cache  - The cache to register.  It should never be deleted.
+ *   name   - A static string used to show the cache.
+ */
+void cache_register(cache_t *cache, const char *name);
+
+/*
+ * Function: cache_registry_get
+ * Get a registered cache by index.
+ *
+ * Return false if the index is past the last registered cache.
+ */
+bool cache_registry_get(int i, const char **name, cache_t **cache);
+
+/*
+ * Function: cache_registry_clear
+ * Clear all the registered caches.
+ */
+void cache_registry_clear(void);
+
+/*
+ * Function: cache_registry_shrink
+ * Delete the least recently used items of all the registered caches, so
+ * that their size is at most a fraction of their current size.
+ */
+void cache_registry_shrink(float ratio);
+
 
 #endif // CACHE_H
@@ -0,0 +1,125 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "counters.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if COUNTERS
+
+/*
+ * The counters of each thread.  They are never freed: when a thread exits
+ * its counters are given to the next new thread, so that the totals stay
+ * correct and the memory doesn't grow with short lived threads.
+ */
+typedef struct thread_counters thread_counters_t;
+struct thread_counters {
+    thread_counters_t   *next;
+    bool                used;
+    uint64_t            values[COUNTER_COUNT];
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_counters_t *g_threads = NULL;
+static pthread_key_t g_key;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+
+static void on_thread_exit(void *data)
+{
+    thread_counters_t *counters = data;
+    pthread_mutex_lock(&g_lock);
+    counters->used = false;
+    pthread_mutex_unlock(&g_lock);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&g_key, on_thread_exit);
+}
+
+uint64_t *counters_get_thread_values_(void)
+{
+    thread_counters_t *counters;
+
+    // Each file including counters.h has its own thread local pointer, so
+    // we can be called several times from the same thread.
+    pthread_once(&g_key_once, create_key);
+    counters = pthread_getspecific(g_key);
+    if (counters) return counters->values;
+
+    pthread_mutex_lock(&g_lock);
+    for (counters = g_threads; counters; counters = counters->next) {
+        if (!counters->used) break;
+    }
+    if (!counters) {
+        counters = calloc(1, sizeof(*counters));
+        counters->next = g_threads;
+        g_threads = counters;
+    }
+    counters->used = true;
+    pthread_mutex_unlock(&g_lock);
+    pthread_setspecific(g_key, counters);
+    return counters->values;
+}
+
+void counters_get(uint64_t values[COUNTER_COUNT])
+{
+    const thread_counters_t *counters;
+    int i;
+
+    memset(values, 0, COUNTER_COUNT * sizeof(*values));
+    pthread_mutex_lock(&g_lock);
+    for (counters = g_threads; counters; counters = counters->next) {
+        for (i = 0; i < COUNTER_COUNT; i++) {
+            values[i] += __atomic_load_n(&counters->values[i],
+                                         __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+#else
+
+void counters_get(uint64_t values[COUNTER_COUNT])
+{
+    memset(values, 0, COUNTER_COUNT * sizeof(*values));
+}
+
+#endif
+
+const char *counter_get_name(int counter)
+{
+    static const char *NAMES[COUNTER_COUNT] = {
+        [COUNTER_MESH_LOOKUPS]          = "Mesh lookups",
+        [COUNTER_MESH_ACCESSOR_HITS]    = "Accessor hits",
+        [COUNTER_BLOCK_COPIES]          = "Block copies",
+        [COUNTER_MESH_TABLE_COPIES]     = "Mesh table copies",
+        [COUNTER_BLOCKS_MESHED]         = "Blocks meshed",
+        [COUNTER_BLOCK_PARTS_MESHED]    = "Block parts meshed",
+        [COUNTER_GL_BUFFERS_CREATED]    = "GL buffers created",
+        [COUNTER_GL_BUFFERS_DELETED]    = "GL buffers deleted",
+        [COUNTER_GL_UPLOAD_BYTES]       = "GL upload bytes",
+        [COUNTER_GL_DRAW_CALLS]         = "GL draw calls",
+    };
+    assert(counter >= 0 && counter < COUNTER_COUNT);
+    return NAMES[counter];
+}
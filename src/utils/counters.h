@@ -0,0 +1,93 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Section: Counters
+ * Global counters of the hot path operations.
+ *
+ * Each thread increments its own copy of the counters, so that there is
+ * no contention, and the values are only summed when we read them.  The
+ * counters are compiled out if the COUNTERS macro is set to 0.
+ */
+
+#ifndef COUNTERS
+#   define COUNTERS 1
+#endif
+
+enum {
+    COUNTER_MESH_LOOKUPS,       // Blocks hash table lookups.
+    COUNTER_MESH_ACCESSOR_HITS, // Blocks found in an accessor cache.
+    COUNTER_BLOCK_COPIES,       // Copy on write of a block data.
+    COUNTER_MESH_TABLE_COPIES,  // Copy on write of a mesh blocks table.
+    COUNTER_BLOCKS_MESHED,      // Blocks vertices generated.
+    COUNTER_BLOCK_PARTS_MESHED, // Blocks parts faces generated.
+    COUNTER_GL_BUFFERS_CREATED,
+    COUNTER_GL_BUFFERS_DELETED,
+    COUNTER_GL_UPLOAD_BYTES,    // Bytes sent to GL buffers.
+    COUNTER_GL_DRAW_CALLS,
+
+    COUNTER_COUNT
+};
+
+#if COUNTERS
+
+uint64_t *counters_get_thread_values_(void);
+
+/*
+ * Function: counter_add
+ * Increase a counter.  This can be called from any thread.
+ */
+static inline void counter_add(int counter, uint64_t v)
+{
+    static __thread uint64_t *values = NULL;
+    if (__builtin_expect(!values, 0)) values = counters_get_thread_values_();
+    // Only this thread writes the value, but other threads can read it.
+    __atomic_store_n(&values[counter],
+                     __atomic_load_n(&values[counter], __ATOMIC_RELAXED) + v,
+                     __ATOMIC_RELAXED);
+}
+
+#else
+
+static inline void counter_add(int counter, uint64_t v) {}
+
+#endif
+
+/*
+ * Function: counters_get
+ * Get the total of all the counters, from all the threads.
+ *
+ * Parameters:
+ *   values - Set to the counters values, indexed by the COUNTER_ enum.
+ *            All zero if the counters are disabled.
+ */
+void counters_get(uint64_t values[COUNTER_COUNT]);
+
+/*
+ * Function: counter_get_name
+ * Return a readable name for a counter.
+ */
+const char *counter_get_name(int counter);
+
+#endif // COUNTERS_H
@@ -0,0 +1,120 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frame_tasks.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    float   priority;
+    int     order;      // To keep the insertion order between equals.
+    void    (*func)(void *user);
+    void    *user;
+} frame_task_t;
+
+static struct {
+    frame_task_t    *tasks;
+    int             nb;
+    int             allocated;
+    int             counter;
+    bool            sorted;
+    double          budget;
+    double          spent;
+    bool            started;    // Set once some work is done in the frame.
+} g = {
+    .budget = 0.004,
+};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int task_cmp(const void *a_, const void *b_)
+{
+    const frame_task_t *a = a_, *b = b_;
+    if (a->priority != b->priority) return a->priority < b->priority ? -1 : 1;
+    return a->order - b->order;
+}
+
+void frame_tasks_begin(double budget)
+{
+    g.budget = budget;
+    g.spent = 0;
+    g.started = false;
+}
+
+void frame_task_add(float priority, void (*func)(void *user), void *user)
+{
+    if (g.nb == g.allocated) {
+        g.allocated = g.allocated ? g.allocated * 2 : 64;
+        g.tasks = realloc(g.tasks, g.allocated * sizeof(*g.tasks));
+    }
+    g.tasks[g.nb++] = (frame_task_t){priority, g.counter++, func, user};
+    g.sorted = false;
+}
+
+void frame_task_remove(void (*func)(void *user), const void *user)
+{
+    int i, nb = 0;
+    for (i = 0; i < g.nb; i++) {
+        if (g.tasks[i].func == func && (!user || g.tasks[i].user == user))
+            continue;
+        g.tasks[nb++] = g.tasks[i];
+    }
+    g.nb = nb;
+}
+
+void frame_tasks_run(void)
+{
+    frame_task_t task;
+    double time;
+
+    // The tasks can queue new tasks, so we check the order after each call.
+    while (g.nb && frame_tasks_has_time()) {
+        if (!g.sorted) qsort(g.tasks, g.nb, sizeof(*g.tasks), task_cmp);
+        g.sorted = true;
+        task = g.tasks[0];
+        memmove(g.tasks, g.tasks + 1, (g.nb - 1) * sizeof(*g.tasks));
+        g.nb--;
+        time = get_time();
+        task.func(task.user);
+        frame_tasks_spend(get_time() - time);
+    }
+    if (!g.nb) g.counter = 0;
+}
+
+bool frame_tasks_has_time(void)
+{
+    return !g.started || g.spent < g.budget;
+}
+
+void frame_tasks_spend(double time)
+{
+    g.spent += time;
+    g.started = true;
+}
+
+int frame_tasks_get_nb(void)
+{
+    return g.nb;
+}
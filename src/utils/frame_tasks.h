@@ -0,0 +1,100 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Frame tasks
+ *
+ * Scheduler of the work that has to run on the main thread, like the GL
+ * buffers and textures uploads, spread over several frames so that the
+ * frame time stays flat while a large scene streams in.
+ *
+ * Each frame gets a time budget.  The queued tasks are run by
+ * <frame_tasks_run> in order of priority until the budget is spent, and
+ * the code doing its own deferred work (like the blocks rendering) can
+ * check and use the same budget directly.
+ *
+ * All the functions must be called from the main thread.
+ */
+
+#ifndef FRAME_TASKS_H
+#define FRAME_TASKS_H
+
+#include <stdbool.h>
+
+/*
+ * Function: frame_tasks_begin
+ * Start a new frame, with a given time budget.
+ *
+ * Parameters:
+ *   budget - Time allowed for the deferred work of the frame, in seconds.
+ */
+void frame_tasks_begin(double budget);
+
+/*
+ * Function: frame_task_add
+ * Queue a function call to run in a following call to <frame_tasks_run>.
+ *
+ * Parameters:
+ *   priority - The tasks with the lowest values are run first.
+ *   func     - The function to call.
+ *   user     - User data passed to the function.
+ */
+void frame_task_add(float priority, void (*func)(void *user), void *user);
+
+/*
+ * Function: frame_task_remove
+ * Remove a queued task that has not run yet.
+ *
+ * Parameters:
+ *   func     - The task function.
+ *   user     - The task user data, or NULL to remove all the tasks with
+ *              the given function.
+ */
+void frame_task_remove(void (*func)(void *user), const void *user);
+
+/*
+ * Function: frame_tasks_run
+ * Run the queued tasks, in order of priority, until the frame budget is
+ * spent.
+ *
+ * At least one task is run per frame, so that the queue always makes
+ * progress, even with a zero budget.
+ */
+void frame_tasks_run(void);
+
+/*
+ * Function: frame_tasks_has_time
+ * Return whether some time is left in the frame budget.
+ *
+ * Return true if no deferred work has been done yet in the frame.
+ */
+bool frame_tasks_has_time(void);
+
+/*
+ * Function: frame_tasks_spend
+ * Add some time spent doing deferred work to the frame budget.
+ */
+void frame_tasks_spend(double time);
+
+/*
+ * Function: frame_tasks_get_nb
+ * Return the number of queued tasks.
+ */
+int frame_tasks_get_nb(void);
+
+#endif // FRAME_TASKS_H
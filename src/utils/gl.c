@@ -20,9 +20,24 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Set if the program binaries can be used (if supported at runtime).
+#if !defined(GLES2) && defined(GL_VERSION_4_1)
+#   define HAS_PROGRAM_BINARY 1
+#else
+#   define HAS_PROGRAM_BINARY 0
+#endif
+
+// Set if the compute shaders can be used (if supported at runtime).
+#if !defined(GLES2) && defined(GL_VERSION_4_3)
+#   define HAS_COMPUTE_SHADER 1
+#else
+#   define HAS_COMPUTE_SHADER 0
+#endif
+
 #ifndef LOG_E
 #   define LOG_E(...)
 #endif
@@ -60,7 +75,9 @@ int gl_check_errors(const char *file, int line)
     }
 }
 
+// If version is set, it is put first instead of the common header.
 static int compile_shader(int shader, const char *code,
+                          const char *version,
                           const char *include1,
                           const char *include2)
 {
@@ -72,7 +89,8 @@ static int compile_shader(int shader, const char *code,
 #else
     const char *pre = "";
 #endif
-    const char *sources[] = {pre, include1, include2, "#line 0\n", code};
+    const char *sources[] = {version ?: pre, include1, include2,
+                             "#line 0\n", code};
     assert(code);
     glShaderSource(shader, 5, (const char**)&sources, NULL);
     glCompileShader(shader);
@@ -95,13 +113,11 @@ static void gl_delete_prog(int prog)
 {
     int i;
     GLuint shaders[2];
-    GLint count;
-    if (DEBUG) {
-        GL(glGetProgramiv(prog, GL_ATTACHED_SHADERS, &count));
-        assert(count == 2);
-    }
-    GL(glGetAttachedShaders(prog, 2, NULL, shaders));
-    for (i = 0; i < 2; i++)
+    GLsizei count;
+    // Zero for the programs created from a binary, one for the compute
+    // programs.
+    GL(glGetAttachedShaders(prog, 2, &count, shaders));
+    for (i = 0; i < count; i++)
         GL(glDeleteShader(shaders[i]));
     GL(glDeleteProgram(prog));
 }
@@ -222,6 +238,31 @@ bool gl_has_extension(const char *ext)
     return strstr(str, ext);
 }
 
+// Create a shader from a linked program, and get its uniforms.
+static gl_shader_t *create_from_prog(GLint prog)
+{
+    int i, count;
+    gl_shader_t *shader;
+    gl_uniform_t *uni;
+
+    shader = calloc(1, sizeof(*shader));
+    shader->prog = prog;
+
+    GL(glGetProgramiv(shader->prog, GL_ACTIVE_UNIFORMS, &count));
+    for (i = 0; i < count; i++) {
+        uni = &shader->uniforms[i];
+        GL(glGetActiveUniform(shader->prog, i, sizeof(uni->name),
+                              NULL, &uni->size, &uni->type, uni->name));
+        // Special case for array uniforms: remove the '[0]'
+        if (uni->size > 1) {
+            assert(uni->type == GL_FLOAT);
+            *strchr(uni->name, '[') = '\0';
+        }
+        GL(uni->loc = glGetUniformLocation(shader->prog, uni->name));
+    }
+    return shader;
+}
+
 /*
  * Function: gl_shader_create
  * Helper function that compiles an opengl shader.
@@ -238,22 +279,26 @@ bool gl_has_extension(const char *ext)
 gl_shader_t *gl_shader_create(const char *vert, const char *frag,
                               const char *include, const char **attr_names)
 {
-    int i, status, len, count;
+    int i, status, len;
     int vertex_shader, fragment_shader;
-    char log[1024];
-    gl_shader_t *shader;
+    char log[1024], version[64] = "";
     GLint prog;
-    gl_uniform_t *uni;
 
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
     include = include ? : "";
+    // The version line has to come before anything else.
+    if (strncmp(include, "#version", 8) == 0 && strchr(include, '\n')) {
+        len = strchr(include, '\n') - include + 1;
+        snprintf(version, sizeof(version), "%.*s", len, include);
+        include += len;
+    }
+    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
     assert(vertex_shader);
-    if (compile_shader(vertex_shader, vert,
+    if (compile_shader(vertex_shader, vert, *version ? version : NULL,
                        "#define VERTEX_SHADER\n", include))
         return NULL;
     fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
     assert(fragment_shader);
-    if (compile_shader(fragment_shader, frag,
+    if (compile_shader(fragment_shader, frag, *version ? version : NULL,
                        "#define FRAGMENT_SHADER\n", include))
         return NULL;
     prog = glCreateProgram();
@@ -267,6 +312,10 @@ gl_shader_t *gl_shader_create(const char *vert, const char *frag,
         }
     }
 
+#if HAS_PROGRAM_BINARY
+    if (gl_has_program_binary())
+        glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
     glLinkProgram(prog);
     glGetProgramiv(prog, GL_LINK_STATUS, &status);
     if (status != GL_TRUE) {
@@ -277,23 +326,96 @@ gl_shader_t *gl_shader_create(const char *vert, const char *frag,
         return NULL;
     }
 
-    shader = calloc(1, sizeof(*shader));
-    shader->prog = prog;
+    return create_from_prog(prog);
+}
 
-    GL(glGetProgramiv(shader->prog, GL_ACTIVE_UNIFORMS, &count));
-    for (i = 0; i < count; i++) {
-        uni = &shader->uniforms[i];
-        GL(glGetActiveUniform(shader->prog, i, sizeof(uni->name),
-                              NULL, &uni->size, &uni->type, uni->name));
-        // Special case for array uniforms: remove the '[0]'
-        if (uni->size > 1) {
-            assert(uni->type == GL_FLOAT);
-            *strchr(uni->name, '[') = '\0';
-        }
-        GL(uni->loc = glGetUniformLocation(shader->prog, uni->name));
+gl_shader_t *gl_shader_create_compute(const char *code, const char *include)
+{
+#if HAS_COMPUTE_SHADER
+    int status, len, shader;
+    char log[1024];
+    GLint prog;
+
+    shader = glCreateShader(GL_COMPUTE_SHADER);
+    assert(shader);
+    if (compile_shader(shader, code, "#version 430\n",
+                       "#define COMPUTE_SHADER\n", include ?: ""))
+        return NULL;
+    prog = glCreateProgram();
+    glAttachShader(prog, shader);
+    glLinkProgram(prog);
+    glGetProgramiv(prog, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        LOG_E("Link Error");
+        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &len);
+        glGetProgramInfoLog(prog, sizeof(log), NULL, log);
+        LOG_E("%s", log);
+        return NULL;
     }
+    return create_from_prog(prog);
+#else
+    return NULL;
+#endif
+}
 
-    return shader;
+bool gl_has_program_binary(void)
+{
+#if HAS_PROGRAM_BINARY
+    static int support = 0; // 0: unknown, 1: supported, -1: not supported.
+    int major = 0, minor = 0, nb_formats = 0;
+    const char *version;
+    if (support == 0) {
+        GL(version = (const char*)glGetString(GL_VERSION));
+        if (version) sscanf(version, "%d.%d", &major, &minor);
+        if (major > 4 || (major == 4 && minor >= 1) ||
+                gl_has_extension("GL_ARB_get_program_binary"))
+            GL(glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nb_formats));
+        support = nb_formats > 0 ? 1 : -1;
+    }
+    return support > 0;
+#else
+    return false;
+#endif
+}
+
+gl_shader_t *gl_shader_create_from_binary(int format, const void *data,
+                                          int size)
+{
+#if HAS_PROGRAM_BINARY
+    GLint prog, status;
+    if (!gl_has_program_binary()) return NULL;
+    prog = glCreateProgram();
+    glProgramBinary(prog, format, data, size);
+    glGetProgramiv(prog, GL_LINK_STATUS, &status);
+    // Not an error: the driver can reject old binaries.
+    if (status != GL_TRUE) {
+        glDeleteProgram(prog);
+        return NULL;
+    }
+    return create_from_prog(prog);
+#else
+    return NULL;
+#endif
+}
+
+void *gl_shader_get_binary(const gl_shader_t *shader, int *format,
+                           int *size)
+{
+#if HAS_PROGRAM_BINARY
+    GLint len = 0;
+    GLenum binary_format;
+    void *data;
+    if (!gl_has_program_binary()) return NULL;
+    GL(glGetProgramiv(shader->prog, GL_PROGRAM_BINARY_LENGTH, &len));
+    if (len <= 0) return NULL;
+    data = malloc(len);
+    GL(glGetProgramBinary(shader->prog, len, &len, &binary_format, data));
+    *format = binary_format;
+    *size = len;
+    return data;
+#else
+    return NULL;
+#endif
 }
 
 void gl_shader_delete(gl_shader_t *shader)
@@ -303,45 +425,83 @@ void gl_shader_delete(gl_shader_t *shader)
     free(shader);
 }
 
-bool gl_has_uniform(gl_shader_t *shader, const char *name)
+/*
+ * Find a uniform by name.  The names are almost always string literals, so
+ * we first look for the same pointer than the previous lookups.
+ */
+static gl_uniform_t *get_uniform(gl_shader_t *shader, const char *name)
 {
     gl_uniform_t *uni;
     for (uni = &shader->uniforms[0]; uni->size; uni++) {
-        if (strcmp(uni->name, name) == 0) return true;
+        if (uni->key == name) return uni;
     }
-    return false;
+    for (uni = &shader->uniforms[0]; uni->size; uni++) {
+        if (strcmp(uni->name, name) == 0) {
+            uni->key = name;
+            return uni;
+        }
+    }
+    return NULL;
+}
+
+bool gl_has_uniform(gl_shader_t *shader, const char *name)
+{
+    return get_uniform(shader, name) != NULL;
+}
+
+// Update the cached value of a uniform, and return false if it was already
+// set to the same value.
+static bool set_value(gl_uniform_t *uni, const float *v, int n)
+{
+    if (uni->has_value && memcmp(uni->value, v, n * sizeof(*v)) == 0)
+        return false;
+    memcpy(uni->value, v, n * sizeof(*v));
+    uni->has_value = true;
+    return true;
 }
 
 void gl_update_uniform(gl_shader_t *shader, const char *name, ...)
 {
     gl_uniform_t *uni;
     va_list args;
+    float f;
+    int i;
+    const float *v;
 
-    for (uni = &shader->uniforms[0]; uni->size; uni++) {
-        if (strcmp(uni->name, name) == 0) break;
-    }
-    if (!uni->size) return; // No such uniform.
+    uni = get_uniform(shader, name);
+    if (!uni) return; // No such uniform.
 
     va_start(args, name);
     switch (uni->type) {
     case GL_INT:
     case GL_SAMPLER_2D:
-        GL(glUniform1i(uni->loc, va_arg(args, int)));
+#ifdef GL_SAMPLER_3D
+    case GL_SAMPLER_3D:
+#endif
+        i = va_arg(args, int);
+        f = i;
+        if (set_value(uni, &f, 1)) GL(glUniform1i(uni->loc, i));
         break;
     case GL_FLOAT:
-        GL(glUniform1f(uni->loc, va_arg(args, double)));
+        f = va_arg(args, double);
+        if (set_value(uni, &f, 1)) GL(glUniform1f(uni->loc, f));
         break;
     case GL_FLOAT_VEC2:
-        GL(glUniform2fv(uni->loc, 1, va_arg(args, const float*)));
+        v = va_arg(args, const float*);
+        if (set_value(uni, v, 2)) GL(glUniform2fv(uni->loc, 1, v));
         break;
     case GL_FLOAT_VEC3:
-        GL(glUniform3fv(uni->loc, 1, va_arg(args, const float*)));
+        v = va_arg(args, const float*);
+        if (set_value(uni, v, 3)) GL(glUniform3fv(uni->loc, 1, v));
         break;
     case GL_FLOAT_VEC4:
-        GL(glUniform4fv(uni->loc, 1, va_arg(args, const float*)));
+        v = va_arg(args, const float*);
+        if (set_value(uni, v, 4)) GL(glUniform4fv(uni->loc, 1, v));
         break;
     case GL_FLOAT_MAT4:
-        GL(glUniformMatrix4fv(uni->loc, 1, 0, va_arg(args, const float*)));
+        v = va_arg(args, const float*);
+        if (set_value(uni, v, 16))
+            GL(glUniformMatrix4fv(uni->loc, 1, 0, v));
         break;
     default:
         assert(false);
@@ -32,6 +32,14 @@
 
 // Include OpenGL properly.
 #define GL_GLEXT_PROTOTYPES
+
+// The GLES3 builds (WebGL2) are also GLES2 builds, since they miss the same
+// desktop features (polygon mode, line smooth...).  The GLES3 only
+// features are checked with GLES3.
+#if defined(GLES3) && !defined(GLES2)
+#   define GLES2 1
+#endif
+
 #ifdef WIN32
 #    include <windows.h>
 #    include "GL/glew.h"
@@ -46,7 +54,10 @@
 #       include <OpenGL/gl.h>
 #   endif
 #else
-#   ifdef GLES2
+#   if defined(GLES3)
+#       include <GLES3/gl3.h>
+#       include <GLES2/gl2ext.h>
+#   elif defined(GLES2)
 #       include <GLES2/gl2.h>
 #       include <GLES2/gl2ext.h>
 #   else
@@ -69,6 +80,12 @@ typedef struct gl_uniform {
     GLint       size;
     GLenum      type;
     GLint       loc;
+    // Last name pointer used to find this uniform, so that we can skip
+    // the strcmp when called again with the same string literal.
+    const char  *key;
+    // Last value set, so that we don't call glUniform if it didn't change.
+    bool        has_value;
+    float       value[16];
 } gl_uniform_t;
 
 typedef struct gl_shader {
@@ -108,7 +125,8 @@ int gl_gen_fbo(int w, int h, GLenum format, int msaa,
  * Parameters:
  *   vert       - The vertex shader code.
  *   frag       - The fragment shader code.
- *   include    - Extra includes added to both shaders.
+ *   include    - Extra includes added to both shaders.  It can start with
+ *                a '#version' line, that is then put first.
  *   attr_names - NULL terminated list of attribute names that will be binded.
  *
  * Return:
@@ -119,6 +137,46 @@ gl_shader_t *gl_shader_create(const char *vert, const char *frag,
 
 void gl_shader_delete(gl_shader_t *shader);
 
+/*
+ * Function: gl_shader_create_compute
+ * Compile a compute shader program.
+ *
+ * The code is compiled as GLSL 430, with COMPUTE_SHADER defined, so this
+ * should only be called if the context supports GL 4.3.
+ *
+ * Return:
+ *   A new gl_shader_t instance, or NULL if compute shaders are not
+ *   available in this build.
+ */
+gl_shader_t *gl_shader_create_compute(const char *code, const char *include);
+
+/*
+ * Function: gl_has_program_binary
+ * Return whether we can save and load the programs binaries.
+ */
+bool gl_has_program_binary(void);
+
+/*
+ * Function: gl_shader_create_from_binary
+ * Create a shader from a program binary returned by <gl_shader_get_binary>.
+ *
+ * Return:
+ *   A new gl_shader_t instance, or NULL if the binary is not supported,
+ *   for example after a driver update.
+ */
+gl_shader_t *gl_shader_create_from_binary(int format, const void *data,
+                                          int size);
+
+/*
+ * Function: gl_shader_get_binary
+ * Get the program binary of a shader.
+ *
+ * Return:
+ *   The binary data, to be freed by the caller, or NULL if not supported.
+ */
+void *gl_shader_get_binary(const gl_shader_t *shader, int *format,
+                           int *size);
+
 bool gl_has_uniform(gl_shader_t *shader, const char *name);
 void gl_update_uniform(gl_shader_t *shader, const char *name, ...);
 
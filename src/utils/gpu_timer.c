@@ -0,0 +1,114 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpu_timer.h"
+#include "gl.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Same test as in the profiler.
+#if !defined(GLES2) && defined(GL_VERSION_3_3)
+#   define HAS_TIMER_QUERY 1
+#else
+#   define HAS_TIMER_QUERY 0
+#endif
+
+#define MAX_PENDING 4
+
+struct gpu_timer {
+    bool    supported;
+    bool    running;
+    int     nb;         // Total number of measures started.
+    int     nb_read;    // Total number of results read.
+    int     ids[MAX_PENDING];
+    GLuint  queries[MAX_PENDING][2];
+};
+
+gpu_timer_t *gpu_timer_new(void)
+{
+    gpu_timer_t *timer = calloc(1, sizeof(*timer));
+#if HAS_TIMER_QUERY
+    int major = 0, minor = 0;
+    const char *version;
+    GL(version = (const char*)glGetString(GL_VERSION));
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    timer->supported = major > 3 || (major == 3 && minor >= 3) ||
+                       gl_has_extension("GL_ARB_timer_query");
+    if (timer->supported)
+        GL(glGenQueries(MAX_PENDING * 2, &timer->queries[0][0]));
+#endif
+    return timer;
+}
+
+void gpu_timer_delete(gpu_timer_t *timer)
+{
+    if (!timer) return;
+#if HAS_TIMER_QUERY
+    if (timer->supported)
+        GL(glDeleteQueries(MAX_PENDING * 2, &timer->queries[0][0]));
+#endif
+    free(timer);
+}
+
+void gpu_timer_begin(gpu_timer_t *timer, int id)
+{
+#if HAS_TIMER_QUERY
+    int i = timer->nb % MAX_PENDING;
+    if (!timer->supported || timer->running) return;
+    if (timer->nb - timer->nb_read >= MAX_PENDING) return;
+    timer->ids[i] = id;
+    GL(glQueryCounter(timer->queries[i][0], GL_TIMESTAMP));
+    timer->running = true;
+#endif
+}
+
+void gpu_timer_end(gpu_timer_t *timer)
+{
+#if HAS_TIMER_QUERY
+    int i = timer->nb % MAX_PENDING;
+    if (!timer->running) return;
+    GL(glQueryCounter(timer->queries[i][1], GL_TIMESTAMP));
+    timer->running = false;
+    timer->nb++;
+#endif
+}
+
+bool gpu_timer_poll(gpu_timer_t *timer, double *time, int *id)
+{
+#if HAS_TIMER_QUERY
+    int i = timer->nb_read % MAX_PENDING;
+    GLuint available;
+    GLuint64 t0, t1;
+
+    if (timer->nb_read == timer->nb) return false;
+    GL(glGetQueryObjectuiv(timer->queries[i][1],
+                           GL_QUERY_RESULT_AVAILABLE, &available));
+    if (!available) return false;
+    GL(glGetQueryObjectui64v(timer->queries[i][0], GL_QUERY_RESULT, &t0));
+    GL(glGetQueryObjectui64v(timer->queries[i][1], GL_QUERY_RESULT, &t1));
+    if (time) *time = ((int64_t)t1 - (int64_t)t0) / 1e9;
+    if (id) *id = timer->ids[i];
+    timer->nb_read++;
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,70 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <stdbool.h>
+
+/*
+ * Section: GPU timer
+ * Measure the time spent by the GPU on some commands.
+ *
+ * Unlike the profiler, this is always active, and meant to be used by the
+ * code that adapts to the GPU load.  It uses GL timestamp queries when they
+ * are supported, and the results are only known a few frames later, so each
+ * measure gets a user id to know what it corresponds to.
+ */
+
+typedef struct gpu_timer gpu_timer_t;
+
+/*
+ * Function: gpu_timer_new
+ * Create a new timer.  Must be called with a GL context current.
+ */
+gpu_timer_t *gpu_timer_new(void);
+
+void gpu_timer_delete(gpu_timer_t *timer);
+
+/*
+ * Function: gpu_timer_begin
+ * Start a measure of the GL commands issued until <gpu_timer_end>.
+ *
+ * Does nothing if timestamp queries are not supported, or if too many
+ * measures are still waiting for their results.
+ *
+ * Parameters:
+ *   id - Any value, given back by <gpu_timer_poll> with the result.
+ */
+void gpu_timer_begin(gpu_timer_t *timer, int id);
+void gpu_timer_end(gpu_timer_t *timer);
+
+/*
+ * Function: gpu_timer_poll
+ * Get the oldest measure result, if it is available.
+ *
+ * Parameters:
+ *   time - Set to the GPU time of the measure, in seconds.
+ *   id   - Set to the id passed to <gpu_timer_begin>.
+ *
+ * Return:
+ *   false if no result is available yet.
+ */
+bool gpu_timer_poll(gpu_timer_t *timer, double *time, int *id);
+
+#endif // GPU_TIMER_H
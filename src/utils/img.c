@@ -17,6 +17,7 @@
  */
 
 #include "img.h"
+#include "parallel.h"
 
 #include <stdbool.h>
 
@@ -83,6 +84,12 @@ uint8_t *img_read_from_mem(const char *data, int size,
     return stbi_load_from_memory((uint8_t*)data, size, w, h, bpp, *bpp);
 }
 
+bool img_get_size_from_mem(const char *data, int size, int *w, int *h)
+{
+    int comp;
+    return stbi_info_from_memory((uint8_t*)data, size, w, h, &comp);
+}
+
 uint8_t *img_read(const char *path, int *width, int *height, int *bpp)
 {
     int size;
@@ -97,26 +104,289 @@ uint8_t *img_read(const char *path, int *width, int *height, int *bpp)
     return img;
 }
 
-#if !HAVE_LIBPNG
+/*
+ * Parallel png writer.
+ *
+ * The image is split into bands of rows that are filtered and compressed
+ * independently in parallel, and written as one IDAT chunk each.  stb only
+ * produces complete zlib streams made of a single fixed huffman block, so
+ * for each band we strip the zlib header and checksum, clear the final
+ * block bit, and end the band with an empty stored block (like a zlib sync
+ * flush) so that the next band starts on a byte boundary.  The adler32
+ * checksums of the bands are then combined.  The bands don't share their
+ * deflate window, which only makes the files very slightly larger.
+ */
 
-void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
+#define PNG_BAND_SIZE (1 << 20) // Size of the filtered data of a band.
+#define PNG_BANDS_GROUP 32      // Number of bands compressed at once.
+
+typedef struct {
+    uint8_t     *chunk;     // Full IDAT chunk, with length and crc.
+    int         size;
+    uint32_t    adler;
+    int         len;        // Size of the uncompressed data.
+} png_band_t;
+
+typedef struct {
+    const uint8_t *img;
+    int         w;
+    int         h;
+    int         bpp;
+    int         quality;    // stb hash chain length.
+    int         band_rows;
+    int         nb_bands;
+    int         band;       // First band of the current group.
+    png_band_t  bands[PNG_BANDS_GROUP];
+} png_writer_t;
+
+static int png_get_band_rows(int w, int bpp)
 {
-    stbi_write_png(path, w, h, bpp, img, 0);
+    int rows = PNG_BAND_SIZE / (w * bpp + 1);
+    return rows > 0 ? rows : 1;
 }
 
-#else
+// Same as the filtering loop of stbi_write_png_to_mem.
+static void png_filter_line(const png_writer_t *png, int y,
+                            signed char *tmp, uint8_t *out)
+{
+    int filter, best = 0, best_val = 0x7fffffff, est, i;
+    int size = png->w * png->bpp;
+    uint8_t *pixels = (uint8_t*)png->img;
 
-void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
+    if (stbi_write_force_png_filter >= 0 && stbi_write_force_png_filter < 5) {
+        best = stbi_write_force_png_filter;
+    } else {
+        for (filter = 0; filter < 5; filter++) {
+            stbiw__encode_png_line(pixels, size, png->w, png->h, y, png->bpp,
+                                   filter, tmp);
+            est = 0;
+            for (i = 0; i < size; i++) est += abs(tmp[i]);
+            if (est < best_val) {
+                best_val = est;
+                best = filter;
+            }
+        }
+    }
+    stbiw__encode_png_line(pixels, size, png->w, png->h, y, png->bpp,
+                           best, tmp);
+    out[0] = best;
+    memcpy(out + 1, tmp, size);
+}
+
+static int bits_read(const uint8_t *data, int size, int *pos, int n)
+{
+    int i, v = 0;
+    for (i = 0; i < n; i++, (*pos)++) {
+        if (*pos / 8 >= size) return -1;
+        v |= ((data[*pos / 8] >> (*pos % 8)) & 1) << i;
+    }
+    return v;
+}
+
+// Huffman codes are stored starting from their most significant bit.
+static int bits_read_code(const uint8_t *data, int size, int *pos, int n)
+{
+    int i, b, v = 0;
+    for (i = 0; i < n; i++) {
+        b = bits_read(data, size, pos, 1);
+        if (b < 0) return -1;
+        v = (v << 1) | b;
+    }
+    return v;
+}
+
+/*
+ * Return the bit position just after the end of block code of a deflate
+ * stream made of a single fixed huffman block, or -1 if the data is not
+ * valid.
+ */
+static int deflate_fixed_block_end(const uint8_t *data, int size)
+{
+    static const uint8_t length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    int pos = 3, code, sym, extra;
+
+    while (true) {
+        code = bits_read_code(data, size, &pos, 7);
+        if (code < 0) return -1;
+        if (code <= 23) {
+            sym = 256 + code;
+        } else {
+            code = (code << 1) | bits_read(data, size, &pos, 1);
+            if (code >= 0x30 && code <= 0xbf) continue; // Literal 0-143.
+            if (code >= 0xc0 && code <= 0xc7) {
+                sym = 280 + code - 0xc0;
+            } else {
+                bits_read(data, size, &pos, 1); // Literal 144-255.
+                continue;
+            }
+        }
+        if (sym == 256) return pos;
+        if (sym > 285) return -1;
+        extra = length_extra[sym - 257];
+        if (extra) bits_read(data, size, &pos, extra);
+        code = bits_read_code(data, size, &pos, 5);
+        if (code < 0 || code > 29) return -1;
+        extra = code < 4 ? 0 : code / 2 - 1;
+        if (extra && bits_read(data, size, &pos, extra) < 0) return -1;
+    }
+}
+
+static uint32_t adler32_combine(uint32_t a, uint32_t b, int len_b)
+{
+    const uint64_t BASE = 65521;
+    uint64_t s1a = a & 0xffff, s2a = a >> 16;
+    uint64_t s1b = b & 0xffff, s2b = b >> 16;
+    uint64_t s1, s2;
+    s1 = (s1a + s1b + BASE - 1) % BASE;
+    s2 = (s2a + s2b + (len_b % BASE) * (s1a + BASE - 1)) % BASE;
+    return (uint32_t)(s2 << 16 | s1);
+}
+
+static void png_band_func(void *user, int i)
+{
+    png_writer_t *png = user;
+    png_band_t *band = &png->bands[i];
+    int y0 = (png->band + i) * png->band_rows;
+    int y1 = y0 + png->band_rows < png->h ? y0 + png->band_rows : png->h;
+    int line = png->w * png->bpp + 1;
+    bool first = y0 == 0, last = y1 == png->h;
+    uint8_t *filt, *zlib, *z, *o;
+    signed char *tmp;
+    int y, zlen, size, end;
+
+    filt = malloc((size_t)line * (y1 - y0));
+    tmp = malloc(line);
+    for (y = y0; y < y1; y++)
+        png_filter_line(png, y, tmp, filt + (size_t)(y - y0) * line);
+    free(tmp);
+    band->len = line * (y1 - y0);
+    zlib = stbi_zlib_compress(filt, band->len, &zlen, png->quality);
+    free(filt);
+    z = zlib + zlen - 4;
+    band->adler = (uint32_t)z[0] << 24 | z[1] << 16 | z[2] << 8 | z[3];
+
+    // Deflate data without the zlib header and checksum.
+    size = zlen - 6;
+    band->chunk = malloc(12 + 2 + size + 5);
+    o = band->chunk + 8;
+    if (first) {
+        memcpy(o, zlib, 2);
+        o += 2;
+    }
+    memcpy(o, zlib + 2, size);
+    if (!last) {
+        o[0] &= ~1; // Clear the final block bit.
+        end = deflate_fixed_block_end(o, size);
+        assert(end >= 0 && (end + 7) / 8 == size);
+        // The stored block header needs three zero bits after the end of
+        // block code.  The padding bits of stb are already zeros.
+        if (size * 8 - end < 3) o[size++] = 0;
+        memcpy(o + size, (uint8_t[]){0, 0, 0xff, 0xff}, 4);
+        size += 4;
+    }
+    free(zlib);
+    size += o - (band->chunk + 8);
+    o = band->chunk;
+    stbiw__wp32(o, size);
+    stbiw__wptag(o, "IDAT");
+    o += size;
+    stbiw__wpcrc(&o, size);
+    band->size = size + 12;
+}
+
+static int png_write_bands(const uint8_t *img, int w, int h, int bpp,
+                           int quality, const char *path)
+{
+    const int ctype[5] = {-1, 0, 4, 2, 6};
+    uint8_t header[8 + 25], adler[4 + 12], end[12], *o;
+    uint32_t checksum = 1;
+    png_writer_t *png;
+    png_band_t *band;
+    FILE *file;
+    int i, n;
+
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
+    png = calloc(1, sizeof(*png));
+    png->img = img;
+    png->w = w;
+    png->h = h;
+    png->bpp = bpp;
+    png->quality = quality;
+    png->band_rows = png_get_band_rows(w, bpp);
+    png->nb_bands = (h + png->band_rows - 1) / png->band_rows;
+
+    o = header;
+    memcpy(o, (uint8_t[]){137, 80, 78, 71, 13, 10, 26, 10}, 8);
+    o += 8;
+    stbiw__wp32(o, 13);
+    stbiw__wptag(o, "IHDR");
+    stbiw__wp32(o, w);
+    stbiw__wp32(o, h);
+    memcpy(o, (uint8_t[]){8, ctype[bpp], 0, 0, 0}, 5);
+    o += 5;
+    stbiw__wpcrc(&o, 13);
+    fwrite(header, sizeof(header), 1, file);
+
+    // Compress a group of bands at a time, to limit the memory usage.
+    for (png->band = 0; png->band < png->nb_bands;
+         png->band += PNG_BANDS_GROUP)
+    {
+        n = png->nb_bands - png->band;
+        if (n > PNG_BANDS_GROUP) n = PNG_BANDS_GROUP;
+        parallel_for(n, png_band_func, png);
+        for (i = 0; i < n; i++) {
+            band = &png->bands[i];
+            fwrite(band->chunk, band->size, 1, file);
+            free(band->chunk);
+            checksum = adler32_combine(checksum, band->adler, band->len);
+        }
+    }
+
+    // The zlib checksum in its own IDAT chunk.
+    o = adler;
+    stbiw__wp32(o, 4);
+    stbiw__wptag(o, "IDAT");
+    stbiw__wp32(o, checksum);
+    stbiw__wpcrc(&o, 4);
+    fwrite(adler, sizeof(adler), 1, file);
+
+    o = end;
+    stbiw__wp32(o, 0);
+    stbiw__wptag(o, "IEND");
+    stbiw__wpcrc(&o, 0);
+    fwrite(end, sizeof(end), 1, file);
+
+    free(png);
+    if (fclose(file) != 0) {
+        LOG_E("Cannot write %s", path);
+        return -1;
+    }
+    return 0;
+}
+
+#if HAVE_LIBPNG
+
+static int img_write_libpng(const uint8_t *img, int w, int h, int bpp,
+                            int level, const char *path)
 {
     int i;
     FILE *fp;
     png_structp png_ptr;
     png_infop info_ptr;
+    const int ctype[5] = {-1, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+                          PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
 
+    assert(bpp >= 1 && bpp <= 4);
     fp = fopen(path, "wb");
     if (!fp) {
         LOG_E("Cannot open %s", path);
-        return;
+        return -1;
     }
     png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
                                       NULL, NULL, NULL);
@@ -124,33 +394,56 @@ void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
         // With ubuntu 19.04, libpng seems to fail!
         LOG_E("Libpng error: fallback to stb-img");
         fclose(fp);
-        stbi_write_png(path, w, h, bpp, img, 0);
-        return;
+        return -2;
     }
 
     info_ptr = png_create_info_struct(png_ptr);
     if (setjmp(png_jmpbuf(png_ptr))) {
        png_destroy_write_struct(&png_ptr, &info_ptr);
        fclose(fp);
-       return;
+       return -1;
     }
     png_init_io(png_ptr, fp);
-    png_set_IHDR(png_ptr, info_ptr, w, h, 8,
-                 bpp == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+    if (level) png_set_compression_level(png_ptr, level);
+    png_set_IHDR(png_ptr, info_ptr, w, h, 8, ctype[bpp],
                  PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_DEFAULT);
 
     png_write_info(png_ptr, info_ptr);
     for (i = 0; i < h; i++)
-        png_write_row(png_ptr, (png_bytep)(img + i * w * bpp));
+        png_write_row(png_ptr, (png_bytep)(img + (size_t)i * w * bpp));
     png_write_end(png_ptr, info_ptr);
     png_destroy_write_struct(&png_ptr, &info_ptr);
     fclose(fp);
+    return 0;
 }
 
 #endif
 
+int img_write_png(const uint8_t *img, int w, int h, int bpp, int level,
+                  const char *path)
+{
+    int quality = stbi_write_png_compression_level;
+
+    // Map the levels to stb hash chains lengths, 3 being the stb default.
+    if (level > 9) level = 9;
+    if (level > 0) quality = 2 * level + 2;
+#if HAVE_LIBPNG
+    // Only the large images are worth writing in parallel.
+    if (png_get_band_rows(w, bpp) >= h) {
+        int ret = img_write_libpng(img, w, h, bpp, level, path);
+        if (ret != -2) return ret;
+    }
+#endif
+    return png_write_bands(img, w, h, bpp, quality, path);
+}
+
+void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
+{
+    img_write_png(img, w, h, bpp, 0, path);
+}
+
 uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp, int *size)
 {
     return stbi_write_png_to_mem((void*)img, 0, w, h, bpp, size);
@@ -175,3 +468,16 @@ void img_downsample(const uint8_t *img, int w, int h, int bpp,
     }
 #undef IX
 }
+
+uint8_t *img_zlib_compress(const uint8_t *data, int size, int *out_size)
+{
+    return stbi_zlib_compress((uint8_t*)data, size, out_size,
+                              stbi_write_png_compression_level);
+}
+
+uint8_t *img_zlib_uncompress(const uint8_t *data, int size, int hint_size,
+                             int *out_size)
+{
+    return (uint8_t*)stbi_zlib_decode_malloc_guesssize(
+            (const char*)data, size, hint_size > 0 ? hint_size : 1, out_size);
+}
@@ -24,6 +24,7 @@
 #ifndef IMG_H
 #define IMG_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /*
@@ -39,12 +40,38 @@ uint8_t *img_read(const char *path, int *width, int *height, int *bpp);
 uint8_t *img_read_from_mem(const char *data, int size,
                            int *w, int *h, int *bpp);
 
+/*
+ * Function: img_get_size_from_mem
+ * Read the size of an image from memory, without decoding it.
+ *
+ * Return:
+ *   false if the data is not a supported image.
+ */
+bool img_get_size_from_mem(const char *data, int size, int *w, int *h);
+
 /*
  * Function: img_write
  * Write an image to a file.
  */
 void img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
 
+/*
+ * Function: img_write_png
+ * Write an image to a png file, with a given compression level.
+ *
+ * The large images are filtered and compressed in parallel, by bands of
+ * rows.
+ *
+ * Parameters:
+ *   level - Compression level from 1 (fastest) to 9 (smallest), or 0 for
+ *           the default.
+ *
+ * Return:
+ *   0 on success, or -1 in case of error.
+ */
+int img_write_png(const uint8_t *img, int w, int h, int bpp, int level,
+                  const char *path);
+
 /*
  * Function: img_write_to_mem
  * Write an image to memory.
@@ -59,4 +86,30 @@ uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp,
 void img_downsample(const uint8_t *img, int w, int h, int bpp,
                     uint8_t *out);
 
+/*
+ * Function: img_zlib_compress
+ * Compress some data into the zlib format.
+ *
+ * This uses the same deflate implementation as the png images.  The
+ * returned buffer should be released with free.
+ */
+uint8_t *img_zlib_compress(const uint8_t *data, int size, int *out_size);
+
+/*
+ * Function: img_zlib_uncompress
+ * Uncompress some zlib data.
+ *
+ * Parameters:
+ *   data      - The compressed data.
+ *   size      - Size of the compressed data.
+ *   hint_size - Expected size of the uncompressed data.
+ *   out_size  - Set to the size of the uncompressed data.
+ *
+ * Return:
+ *   A new buffer that should be released with free, or NULL in case of
+ *   error.
+ */
+uint8_t *img_zlib_uncompress(const uint8_t *data, int size, int hint_size,
+                             int *out_size);
+
 #endif // IMG_H
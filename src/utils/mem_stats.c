@@ -0,0 +1,85 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mem_stats.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+static struct {
+    int64_t current;
+    int64_t peak;
+} g_stats[MEM_COUNT] = {};
+
+void mem_stats_add(int tag, int64_t size)
+{
+    int64_t v, peak;
+    assert(tag >= 0 && tag < MEM_COUNT);
+    v = __atomic_add_fetch(&g_stats[tag].current, size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&g_stats[tag].peak, __ATOMIC_RELAXED);
+    while (v > peak) {
+        if (__atomic_compare_exchange_n(&g_stats[tag].peak, &peak, v, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+void mem_stats_get(int tag, int64_t *current, int64_t *peak)
+{
+    assert(tag >= 0 && tag < MEM_COUNT);
+    if (current)
+        *current = __atomic_load_n(&g_stats[tag].current, __ATOMIC_RELAXED);
+    if (peak)
+        *peak = __atomic_load_n(&g_stats[tag].peak, __ATOMIC_RELAXED);
+}
+
+const char *mem_stats_get_name(int tag)
+{
+    static const char *NAMES[MEM_COUNT] = {
+        [MEM_BLOCKS]        = "Blocks",
+        [MEM_HISTORY]       = "History",
+        [MEM_RENDER_CACHE]  = "Render cache",
+        [MEM_PATHTRACER]    = "Path tracer",
+        [MEM_CACHES]        = "Caches",
+        [MEM_TEXTURES]      = "Textures",
+        [MEM_GUI]           = "GUI",
+        [MEM_DEFERRED]      = "Deferred",
+    };
+    assert(tag >= 0 && tag < MEM_COUNT);
+    return NAMES[tag];
+}
+
+void mem_stats_report(FILE *out)
+{
+    int i;
+    int64_t current, peak, total = 0, total_peak = 0;
+    const double MB = 1 << 20;
+
+    fprintf(out, "%-16s %12s %12s\n", "Memory", "Current (MB)", "Peak (MB)");
+    for (i = 0; i < MEM_COUNT; i++) {
+        mem_stats_get(i, &current, &peak);
+        fprintf(out, "%-16s %12.2f %12.2f\n", mem_stats_get_name(i),
+                current / MB, peak / MB);
+        total += current;
+        total_peak += peak;
+    }
+    // The total peak is only an upper bound, since the subsystems don't
+    // reach their peak at the same time.
+    fprintf(out, "%-16s %12.2f %12.2f\n", "Total", total / MB,
+            total_peak / MB);
+}
@@ -0,0 +1,69 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Section: Memory stats
+ * Accounting of the memory used by each part of goxel.
+ *
+ * Each subsystem reports the memory it allocates and frees, so that we
+ * know the current and peak usage of each of them.  For the GPU objects
+ * (render cache, textures) this is the memory used on the GPU side.
+ *
+ * All the functions are thread safe.
+ */
+
+enum {
+    MEM_BLOCKS,         // Meshes blocks data.
+    MEM_HISTORY,        // Undo snapshots, not shared with the image.
+    MEM_RENDER_CACHE,   // Blocks vertices buffers.
+    MEM_PATHTRACER,     // Path tracer scene, bvh and images.
+    MEM_CACHES,         // Operations and merge caches.
+    MEM_TEXTURES,
+    MEM_GUI,            // Dear imgui allocations.
+    MEM_DEFERRED,       // Compressed blocks of the hidden layers.
+
+    MEM_COUNT
+};
+
+/*
+ * Function: mem_stats_add
+ * Report some memory allocated (or freed if size is negative).
+ */
+void mem_stats_add(int tag, int64_t size);
+
+/*
+ * Function: mem_stats_get
+ * Get the current and peak memory used by a subsystem, in bytes.
+ */
+void mem_stats_get(int tag, int64_t *current, int64_t *peak);
+
+const char *mem_stats_get_name(int tag);
+
+/*
+ * Function: mem_stats_report
+ * Print a table of the current and peak memory of all the subsystems.
+ */
+void mem_stats_report(FILE *out);
+
+#endif // MEM_STATS_H
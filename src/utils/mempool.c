@@ -0,0 +1,257 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mempool.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define SLAB_SIZE (256 * 1024)
+#define MAX_POOLS 16
+// Maximum number of free objects kept by a thread for each pool, and the
+// number of objects moved at once from or to the shared free list.
+#define THREAD_LIST_MAX 64
+#define BATCH_SIZE 32
+
+#if !MEMPOOL_USE_MALLOC
+
+// The free objects are linked using their first bytes.
+#define NEXT(obj) (*(void**)(obj))
+
+typedef struct {
+    void    *list;
+    int     nb;
+} thread_list_t;
+
+static mempool_t *g_pools[MAX_POOLS];
+static int g_nb_pools = 0;
+static pthread_mutex_t g_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_key;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+
+static __thread thread_list_t t_lists[MAX_POOLS];
+static __thread bool t_registered = false;
+
+static int get_slab_nb_objs(const mempool_t *pool)
+{
+    return pool->size >= SLAB_SIZE / 8 ? 8 : SLAB_SIZE / pool->size;
+}
+
+// Move the n first objects of a thread list to the shared free list.
+static void give_back(mempool_t *pool, thread_list_t *list, int n)
+{
+    void *head = list->list, *tail = head;
+    int i;
+
+    if (n == 0) return;
+    for (i = 1; i < n; i++) tail = NEXT(tail);
+    list->list = NEXT(tail);
+    list->nb -= n;
+    pthread_mutex_lock(&pool->lock);
+    NEXT(tail) = pool->free_list;
+    pool->free_list = head;
+    pool->nb_free += n;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void on_thread_exit(void *data)
+{
+    int i, nb_pools;
+    nb_pools = __atomic_load_n(&g_nb_pools, __ATOMIC_ACQUIRE);
+    for (i = 0; i < nb_pools; i++)
+        give_back(g_pools[i], &t_lists[i], t_lists[i].nb);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&g_key, on_thread_exit);
+}
+
+static thread_list_t *get_thread_list(mempool_t *pool)
+{
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(!id, 0)) {
+        pthread_mutex_lock(&g_pools_lock);
+        id = pool->id;
+        if (!id) {
+            assert(g_nb_pools < MAX_POOLS);
+            assert(pool->size >= (int)sizeof(void*));
+            g_pools[g_nb_pools] = pool;
+            id = g_nb_pools + 1;
+            __atomic_store_n(&g_nb_pools, id, __ATOMIC_RELEASE);
+            __atomic_store_n(&pool->id, id, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&g_pools_lock);
+    }
+    // Make sure the objects go back to the pools when the thread exits.
+    if (__builtin_expect(!t_registered, 0)) {
+        pthread_once(&g_key_once, create_key);
+        pthread_setspecific(g_key, (void*)1);
+        t_registered = true;
+    }
+    return &t_lists[id - 1];
+}
+
+// Allocate a new slab and add all its objects to the shared free list.
+// Should be called with the pool locked.
+static void add_slab(mempool_t *pool)
+{
+    int i, nb = get_slab_nb_objs(pool);
+    char *slab = malloc((size_t)nb * pool->size);
+
+    if (pool->nb_slabs == pool->slabs_capacity) {
+        pool->slabs_capacity = pool->slabs_capacity * 2 ?: 16;
+        pool->slabs = realloc(pool->slabs,
+                              pool->slabs_capacity * sizeof(*pool->slabs));
+    }
+    pool->slabs[pool->nb_slabs] = slab;
+    __atomic_store_n(&pool->nb_slabs, pool->nb_slabs + 1, __ATOMIC_RELAXED);
+    // In reverse order, so that the objects are given in address order.
+    for (i = nb - 1; i >= 0; i--) {
+        NEXT(slab + i * pool->size) = pool->free_list;
+        pool->free_list = slab + i * pool->size;
+    }
+    pool->nb_free += nb;
+}
+
+// Take a batch of objects from the shared free list.
+static void refill(mempool_t *pool, thread_list_t *list)
+{
+    void *head, *tail;
+    int i, n;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->nb_free) add_slab(pool);
+    n = pool->nb_free < BATCH_SIZE ? pool->nb_free : BATCH_SIZE;
+    head = tail = pool->free_list;
+    for (i = 1; i < n; i++) tail = NEXT(tail);
+    pool->free_list = NEXT(tail);
+    pool->nb_free -= n;
+    pthread_mutex_unlock(&pool->lock);
+    NEXT(tail) = list->list;
+    list->list = head;
+    list->nb += n;
+}
+
+void *mempool_alloc(mempool_t *pool)
+{
+    thread_list_t *list = get_thread_list(pool);
+    void *obj;
+
+    if (!list->list) refill(pool, list);
+    obj = list->list;
+    list->list = NEXT(obj);
+    list->nb--;
+    return obj;
+}
+
+void mempool_free(mempool_t *pool, void *ptr)
+{
+    thread_list_t *list;
+
+    if (!ptr) return;
+    list = get_thread_list(pool);
+    NEXT(ptr) = list->list;
+    list->list = ptr;
+    list->nb++;
+    if (list->nb > THREAD_LIST_MAX) give_back(pool, list, BATCH_SIZE);
+}
+
+static int slab_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void**)a, y = (uintptr_t)*(void**)b;
+    return x < y ? -1 : x > y ? +1 : 0;
+}
+
+// Index of the slab containing an object, with the slabs sorted.
+static int find_slab(const mempool_t *pool, const void *obj)
+{
+    int lo = 0, hi = pool->nb_slabs - 1, mid;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if ((uintptr_t)pool->slabs[mid] <= (uintptr_t)obj) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+void mempool_trim(mempool_t *pool)
+{
+    thread_list_t *list = get_thread_list(pool);
+    int i, j, nb_objs = get_slab_nb_objs(pool);
+    int *counts;
+    void **obj;
+
+    give_back(pool, list, list->nb);
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->nb_slabs) goto end;
+    qsort(pool->slabs, pool->nb_slabs, sizeof(*pool->slabs), slab_cmp);
+
+    // Count the free objects of each slab.
+    counts = calloc(pool->nb_slabs, sizeof(*counts));
+    for (obj = &pool->free_list; *obj; obj = &NEXT(*obj))
+        counts[find_slab(pool, *obj)]++;
+    // Remove the objects of the fully free slabs from the list.
+    obj = &pool->free_list;
+    while (*obj) {
+        if (counts[find_slab(pool, *obj)] == nb_objs) {
+            *obj = NEXT(*obj);
+            pool->nb_free--;
+        } else {
+            obj = &NEXT(*obj);
+        }
+    }
+    for (i = 0, j = 0; i < pool->nb_slabs; i++) {
+        if (counts[i] == nb_objs) free(pool->slabs[i]);
+        else pool->slabs[j++] = pool->slabs[i];
+    }
+    __atomic_store_n(&pool->nb_slabs, j, __ATOMIC_RELAXED);
+    free(counts);
+end:
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int64_t mempool_get_mem(const mempool_t *pool)
+{
+    return (int64_t)__atomic_load_n(&pool->nb_slabs, __ATOMIC_RELAXED) *
+           get_slab_nb_objs(pool) * pool->size;
+}
+
+#else // MEMPOOL_USE_MALLOC
+
+void *mempool_alloc(mempool_t *pool)
+{
+    return malloc(pool->size);
+}
+
+void mempool_free(mempool_t *pool, void *ptr)
+{
+    free(ptr);
+}
+
+void mempool_trim(mempool_t *pool)
+{
+}
+
+int64_t mempool_get_mem(const mempool_t *pool)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Section: Memory pools
+ * Allocator for many objects of the same size.
+ *
+ * The objects are allocated by slabs, and the freed objects are kept in a
+ * free list to be reused.  Each thread keeps a small list of free objects
+ * for each pool, so that most allocations don't need any lock.
+ *
+ * The pools are meant to be static, initialized with <MEMPOOL_INIT>:
+ *
+ *   static mempool_t g_pool = MEMPOOL_INIT(sizeof(my_object_t));
+ *
+ * If MEMPOOL_USE_MALLOC is set to 1 (the default with address sanitizer),
+ * the pools just call malloc and free, so that the memory errors can still
+ * be detected.
+ */
+
+#ifndef MEMPOOL_USE_MALLOC
+#   if defined(__SANITIZE_ADDRESS__)
+#       define MEMPOOL_USE_MALLOC 1
+#   else
+#       define MEMPOOL_USE_MALLOC 0
+#   endif
+#endif
+
+/*
+ * Type: mempool_t
+ * A pool of objects of a given size.  All the attributes are private.
+ */
+typedef struct mempool {
+    int             size;       // Size of the objects.
+    int             id;         // Index of the threads lists, 1 based.
+    pthread_mutex_t lock;
+    void            *free_list; // Free objects shared by all the threads.
+    int             nb_free;    // Number of objects in free_list.
+    void            **slabs;
+    int             nb_slabs;
+    int             slabs_capacity;
+} mempool_t;
+
+#define MEMPOOL_INIT(size_) {.size = (size_), \
+                             .lock = PTHREAD_MUTEX_INITIALIZER}
+
+/*
+ * Function: mempool_alloc
+ * Allocate an object from a pool.  The memory is not initialized.
+ *
+ * This can be called from any thread.
+ */
+void *mempool_alloc(mempool_t *pool);
+
+/*
+ * Function: mempool_free
+ * Give an object back to its pool.  Does nothing if ptr is NULL.
+ *
+ * The object can be freed from a different thread than the one that
+ * allocated it.
+ */
+void mempool_free(mempool_t *pool, void *ptr);
+
+/*
+ * Function: mempool_trim
+ * Release the slabs where all the objects are free.
+ *
+ * Only the objects in the shared free list and in the calling thread list
+ * are considered, the objects kept by the other threads are not released.
+ * This is slow, and meant to be called when we are low in memory.
+ */
+void mempool_trim(mempool_t *pool);
+
+/*
+ * Function: mempool_get_mem
+ * Return the total memory allocated by a pool for its slabs.
+ */
+int64_t mempool_get_mem(const mempool_t *pool);
+
+#endif // MEMPOOL_H
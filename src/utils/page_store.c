@@ -0,0 +1,191 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "page_store.h"
+#include "img.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    bool        used;
+    uint8_t     *buf;       // Compressed data, if kept in memory.
+    int64_t     offset;     // Offset in the spill file.
+    int         size;       // Size of the compressed data.
+} page_t;
+
+struct page_store {
+    pthread_mutex_t lock;
+    char            *path;
+    FILE            *file;
+    int64_t         file_size;
+    page_t          *pages;
+    int             nb_pages;   // Number of used pages.
+    int             allocated;
+    int             *free_list; // Indices of the unused pages.
+    int             nb_free;
+    uint64_t        mem;
+};
+
+page_store_t *page_store_new(const char *path)
+{
+    page_store_t *store;
+    FILE *file = NULL;
+
+    if (path) {
+        file = fopen(path, "w+b");
+        if (!file) return NULL;
+    }
+    store = calloc(1, sizeof(*store));
+    pthread_mutex_init(&store->lock, NULL);
+    store->file = file;
+    store->path = path ? strdup(path) : NULL;
+    return store;
+}
+
+void page_store_delete(page_store_t *store)
+{
+    int i;
+    if (!store) return;
+    for (i = 0; i < store->allocated; i++) free(store->pages[i].buf);
+    if (store->file) {
+        fclose(store->file);
+        remove(store->path);
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store->path);
+    free(store->pages);
+    free(store->free_list);
+    free(store);
+}
+
+static int new_page(page_store_t *store)
+{
+    int i, old = store->allocated;
+    if (!store->nb_free) {
+        store->allocated = old * 2 ?: 64;
+        store->pages = realloc(store->pages,
+                               store->allocated * sizeof(*store->pages));
+        store->free_list = realloc(store->free_list,
+                                   store->allocated * sizeof(int));
+        memset(store->pages + old, 0,
+               (store->allocated - old) * sizeof(*store->pages));
+        // In reverse order, so that the lowest indices are used first.
+        for (i = store->allocated - 1; i >= old; i--)
+            store->free_list[store->nb_free++] = i;
+    }
+    return store->free_list[--store->nb_free];
+}
+
+int page_store_add(page_store_t *store, const void *data, int size)
+{
+    uint8_t *z;
+    int z_size, page;
+    page_t *p;
+
+    // Compress outside of the lock, this is the slow part.
+    z = img_zlib_compress(data, size, &z_size);
+    if (!z) return -1;
+
+    pthread_mutex_lock(&store->lock);
+    page = new_page(store);
+    p = &store->pages[page];
+    p->size = z_size;
+    if (store->file) {
+        fseek(store->file, store->file_size, SEEK_SET);
+        if (fwrite(z, z_size, 1, store->file) != 1) {
+            store->free_list[store->nb_free++] = page;
+            pthread_mutex_unlock(&store->lock);
+            free(z);
+            return -1;
+        }
+        p->offset = store->file_size;
+        store->file_size += z_size;
+        free(z);
+    } else {
+        p->buf = z;
+        store->mem += z_size;
+    }
+    p->used = true;
+    store->nb_pages++;
+    pthread_mutex_unlock(&store->lock);
+    return page;
+}
+
+bool page_store_read(page_store_t *store, int page, void *data, int size)
+{
+    uint8_t *z, *buf;
+    int z_size, out_size = 0;
+    page_t *p;
+    bool ret;
+
+    pthread_mutex_lock(&store->lock);
+    p = &store->pages[page];
+    assert(p->used);
+    z_size = p->size;
+    z = malloc(z_size);
+    if (p->buf) {
+        memcpy(z, p->buf, z_size);
+        ret = true;
+    } else {
+        fflush(store->file);
+        ret = fseek(store->file, p->offset, SEEK_SET) == 0 &&
+              fread(z, z_size, 1, store->file) == 1;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    buf = ret ? img_zlib_uncompress(z, z_size, size, &out_size) : NULL;
+    free(z);
+    ret = buf && out_size == size;
+    if (ret) memcpy(data, buf, size);
+    free(buf);
+    return ret;
+}
+
+void page_store_remove(page_store_t *store, int page)
+{
+    page_t *p;
+    pthread_mutex_lock(&store->lock);
+    p = &store->pages[page];
+    assert(p->used);
+    if (p->buf) store->mem -= p->size;
+    free(p->buf);
+    memset(p, 0, sizeof(*p));
+    store->free_list[store->nb_free++] = page;
+    store->nb_pages--;
+    // We never reuse the space of the removed pages, but we can restart
+    // from scratch once the file is not used anymore.
+    if (store->file && store->nb_pages == 0) {
+        fflush(store->file);
+        if (ftruncate(fileno(store->file), 0) == 0) store->file_size = 0;
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+void page_store_get_stats(page_store_t *store, page_store_stats_t *stats)
+{
+    pthread_mutex_lock(&store->lock);
+    stats->nb_pages = store->nb_pages;
+    stats->mem = store->mem;
+    stats->file_size = store->file_size;
+    pthread_mutex_unlock(&store->lock);
+}
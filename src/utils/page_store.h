@@ -0,0 +1,100 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAGE_STORE_H
+#define PAGE_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Section: Page store
+ * Keep some buffers compressed, in memory or in a spill file.
+ *
+ * The buffers are compressed with zlib, and identified by a page index.
+ * If the store has a file, the compressed data is appended to it, and the
+ * file is only truncated when all the pages have been removed, so it is
+ * meant for pages that don't live very long.
+ *
+ * All the functions can be called from any thread.
+ */
+
+typedef struct page_store page_store_t;
+
+/*
+ * Type: page_store_stats_t
+ * Statistics of a page store.
+ *
+ * Attributes:
+ *   nb_pages  - Number of pages in the store.
+ *   mem       - Compressed data kept in memory.
+ *   file_size - Size of the spill file.
+ */
+typedef struct {
+    int         nb_pages;
+    uint64_t    mem;
+    uint64_t    file_size;
+} page_store_stats_t;
+
+/*
+ * Function: page_store_new
+ * Create a new page store.
+ *
+ * Parameters:
+ *   path - Path of the spill file, or NULL to keep the pages in memory.
+ *          The file is created, and removed when the store is deleted.
+ *
+ * Return:
+ *   The new store, or NULL if the file could not be created.
+ */
+page_store_t *page_store_new(const char *path);
+
+void page_store_delete(page_store_t *store);
+
+/*
+ * Function: page_store_add
+ * Add a new page with a copy of some data.
+ *
+ * Return:
+ *   The page index, or -1 in case of error.
+ */
+int page_store_add(page_store_t *store, const void *data, int size);
+
+/*
+ * Function: page_store_read
+ * Read the data of a page.
+ *
+ * Parameters:
+ *   page - A page index returned by <page_store_add>.
+ *   data - Buffer that receives the data.
+ *   size - Size of the buffer, must be the size of the page data.
+ *
+ * Return:
+ *   false in case of error.
+ */
+bool page_store_read(page_store_t *store, int page, void *data, int size);
+
+/*
+ * Function: page_store_remove
+ * Remove a page, its index can then be reused.
+ */
+void page_store_remove(page_store_t *store, int page);
+
+void page_store_get_stats(page_store_t *store, page_store_stats_t *stats);
+
+#endif // PAGE_STORE_H
@@ -0,0 +1,418 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <unistd.h>
+#endif
+
+/*
+ * Simple pool of worker threads, created the first time we need it.  The
+ * running jobs are kept in a list, and the threads get the indices to
+ * process from an atomic counter of the first job that still has some, so
+ * that several threads (for example the main thread and a background
+ * task) can run parallel jobs at the same time.  The jobs are kept on the
+ * callers stack, so the callers have to wait for all the workers to
+ * release them before returning.
+ */
+
+typedef struct job job_t;
+struct job {
+    void    (*func)(void *user, int i);
+    void    *user;
+    int     count;
+    int     next;       // Next index to process.
+    int     users;      // Number of workers using the job.
+    job_t   *next_job;
+};
+
+static struct {
+    int             nb_threads;
+    pthread_once_t  once;
+    pthread_mutex_t lock;
+    pthread_cond_t  job_cond;     // Signaled when a new job is available.
+    pthread_cond_t  done_cond;    // Signaled when a worker is done.
+    job_t           *jobs;
+} g_pool = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .job_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Set in the threads currently running a job.
+static __thread bool g_in_job = false;
+
+static int get_nb_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+// Process the indices of a job until there are none left.
+static void job_run(job_t *job)
+{
+    int i;
+    g_in_job = true;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+            job->count) {
+        job->func(job->user, i);
+    }
+    g_in_job = false;
+}
+
+// Return the first job with some indices left.  Called with the lock.
+static job_t *pool_get_job(void)
+{
+    job_t *job;
+    for (job = g_pool.jobs; job; job = job->next_job) {
+        if (__atomic_load_n(&job->next, __ATOMIC_RELAXED) < job->count)
+            return job;
+    }
+    return NULL;
+}
+
+static void *worker_func(void *arg)
+{
+    job_t *job;
+    pthread_mutex_lock(&g_pool.lock);
+    while (true) {
+        job = pool_get_job();
+        if (!job) {
+            pthread_cond_wait(&g_pool.job_cond, &g_pool.lock);
+            continue;
+        }
+        job->users++;
+        pthread_mutex_unlock(&g_pool.lock);
+
+        job_run(job);
+
+        pthread_mutex_lock(&g_pool.lock);
+        if (--job->users == 0) pthread_cond_broadcast(&g_pool.done_cond);
+    }
+    return NULL;
+}
+
+static void pool_init(void)
+{
+    int i;
+    pthread_t thread;
+    if (!PARALLEL_THREADS) return;
+    g_pool.nb_threads = get_nb_cpus() - 1;
+    for (i = 0; i < g_pool.nb_threads; i++) {
+        if (pthread_create(&thread, NULL, worker_func, NULL)) {
+            LOG_W("Cannot create worker thread");
+            g_pool.nb_threads = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void parallel_for(int count, void (*func)(void *user, int i), void *user)
+{
+    int i;
+    job_t job = {func, user, count}, **ptr;
+
+    if (count > 1 && !g_in_job) pthread_once(&g_pool.once, pool_init);
+    if (count <= 1 || g_in_job || g_pool.nb_threads <= 0) goto serial;
+
+    pthread_mutex_lock(&g_pool.lock);
+    job.next_job = g_pool.jobs;
+    g_pool.jobs = &job;
+    pthread_cond_broadcast(&g_pool.job_cond);
+    pthread_mutex_unlock(&g_pool.lock);
+
+    job_run(&job);
+
+    pthread_mutex_lock(&g_pool.lock);
+    for (ptr = &g_pool.jobs; *ptr != &job; ptr = &(*ptr)->next_job) {}
+    *ptr = job.next_job;
+    while (job.users) pthread_cond_wait(&g_pool.done_cond, &g_pool.lock);
+    pthread_mutex_unlock(&g_pool.lock);
+    return;
+
+serial:
+    for (i = 0; i < count; i++) func(user, i);
+}
+
+/*
+ * Background tasks.  They use their own threads, separated from the
+ * parallel_for pool, so that a long list of tasks never blocks a
+ * parallel_for call.  The pending tasks are kept in a FIFO list, the tasks
+ * waiting for their dependencies are only added to it once the last one
+ * is done, and the done tasks with a callback are added to a second FIFO
+ * list, processed by tasks_update.
+ */
+
+enum {
+    TASK_WAITING,   // Some dependencies are not done yet.
+    TASK_PENDING,
+    TASK_RUNNING,
+    TASK_DONE,
+};
+
+struct task {
+    void    (*func)(void *user);
+    void    (*done)(void *user);
+    void    *user;
+    int     state;
+    task_t  *next;      // Next pending task, or next done task.
+    bool    in_done_list;
+    // Dependencies not done yet, the entries are set to NULL once done.
+    task_t  **deps;
+    int     nb_deps;
+    int     nb_waiting_deps;
+    // Tasks waiting for this one.
+    task_t  **dependents;
+    int     nb_dependents;
+};
+
+static struct {
+    int             nb_threads;
+    pthread_once_t  once;
+    pthread_mutex_t lock;
+    pthread_cond_t  task_cond;    // Signaled when a task is queued.
+    pthread_cond_t  done_cond;    // Signaled when a task is done.
+    task_t          *first;
+    task_t          *last;
+    task_t          *first_done;  // Done tasks waiting for their callback.
+    task_t          *last_done;
+    int             nb_active;    // Number of tasks not done yet.
+} g_tasks = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .task_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// All the following functions are called with the tasks lock.
+
+static void task_queue(task_t *task)
+{
+    task->state = TASK_PENDING;
+    task->next = NULL;
+    if (g_tasks.last) g_tasks.last->next = task;
+    else g_tasks.first = task;
+    g_tasks.last = task;
+    pthread_cond_signal(&g_tasks.task_cond);
+}
+
+// Remove a task from one of the two lists.
+static void task_unlink(task_t *task, task_t **first, task_t **last)
+{
+    task_t *t, *prev = NULL;
+    for (t = *first; t != task; t = t->next) prev = t;
+    if (prev) prev->next = task->next;
+    else *first = task->next;
+    if (*last == task) *last = prev;
+    task->next = NULL;
+}
+
+// Release the tasks waiting for a task that is done or cancelled.
+static void task_release_dependents(task_t *task)
+{
+    int i, j;
+    task_t *dep;
+    for (i = 0; i < task->nb_dependents; i++) {
+        dep = task->dependents[i];
+        for (j = 0; j < dep->nb_deps; j++) {
+            if (dep->deps[j] == task) dep->deps[j] = NULL;
+        }
+        if (--dep->nb_waiting_deps == 0) task_queue(dep);
+    }
+    free(task->dependents);
+    task->dependents = NULL;
+    task->nb_dependents = 0;
+}
+
+// Set a task as done and run what depends on it.
+static void task_set_done(task_t *task)
+{
+    __atomic_store_n(&task->state, TASK_DONE, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&g_tasks.nb_active, 1, __ATOMIC_RELEASE);
+    task_release_dependents(task);
+    if (task->done) {
+        task->in_done_list = true;
+        if (g_tasks.last_done) g_tasks.last_done->next = task;
+        else g_tasks.first_done = task;
+        g_tasks.last_done = task;
+    }
+    pthread_cond_broadcast(&g_tasks.done_cond);
+}
+
+static void *task_worker_func(void *arg)
+{
+    task_t *task;
+    while (true) {
+        pthread_mutex_lock(&g_tasks.lock);
+        while (!g_tasks.first)
+            pthread_cond_wait(&g_tasks.task_cond, &g_tasks.lock);
+        task = g_tasks.first;
+        task_unlink(task, &g_tasks.first, &g_tasks.last);
+        __atomic_store_n(&task->state, TASK_RUNNING, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&g_tasks.lock);
+
+        task->func(task->user);
+
+        pthread_mutex_lock(&g_tasks.lock);
+        task_set_done(task);
+        pthread_mutex_unlock(&g_tasks.lock);
+    }
+    return NULL;
+}
+
+static void tasks_init(void)
+{
+    int i, nb;
+    pthread_t thread;
+    if (!PARALLEL_THREADS) return;
+    nb = get_nb_cpus() - 1;
+    if (nb < 1) nb = 1;
+    for (i = 0; i < nb; i++) {
+        if (pthread_create(&thread, NULL, task_worker_func, NULL)) {
+            LOG_W("Cannot create task thread");
+            break;
+        }
+        pthread_detach(thread);
+    }
+    g_tasks.nb_threads = i;
+}
+
+task_t *task_start(void (*func)(void *user), void *user)
+{
+    return task_start_full(func, NULL, user, 0, NULL);
+}
+
+task_t *task_start_full(void (*func)(void *user), void (*done)(void *user),
+                        void *user, int nb_deps, task_t *const *deps)
+{
+    int i;
+    task_t *task = calloc(1, sizeof(*task)), *dep;
+    task->func = func;
+    task->done = done;
+    task->user = user;
+    pthread_once(&g_tasks.once, tasks_init);
+
+    pthread_mutex_lock(&g_tasks.lock);
+    __atomic_add_fetch(&g_tasks.nb_active, 1, __ATOMIC_RELAXED);
+    if (nb_deps) task->deps = calloc(nb_deps, sizeof(*task->deps));
+    for (i = 0; i < nb_deps; i++) {
+        dep = deps[i];
+        if (dep->state == TASK_DONE) continue;
+        task->deps[task->nb_deps++] = dep;
+        task->nb_waiting_deps++;
+        dep->dependents = realloc(dep->dependents,
+                (dep->nb_dependents + 1) * sizeof(*dep->dependents));
+        dep->dependents[dep->nb_dependents++] = task;
+    }
+    if (task->nb_waiting_deps) {
+        task->state = TASK_WAITING;
+    } else if (!g_tasks.nb_threads) {
+        // No thread, run the task now.  The dependencies are always done
+        // already in that case.
+        pthread_mutex_unlock(&g_tasks.lock);
+        func(user);
+        pthread_mutex_lock(&g_tasks.lock);
+        task_set_done(task);
+    } else {
+        task_queue(task);
+    }
+    pthread_mutex_unlock(&g_tasks.lock);
+    return task;
+}
+
+bool task_is_done(const task_t *task)
+{
+    return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == TASK_DONE;
+}
+
+void task_wait(task_t *task)
+{
+    pthread_mutex_lock(&g_tasks.lock);
+    while (task->state != TASK_DONE)
+        pthread_cond_wait(&g_tasks.done_cond, &g_tasks.lock);
+    pthread_mutex_unlock(&g_tasks.lock);
+}
+
+int tasks_get_nb_active(void)
+{
+    return __atomic_load_n(&g_tasks.nb_active, __ATOMIC_ACQUIRE);
+}
+
+void tasks_update(void)
+{
+    task_t *task;
+    while (true) {
+        pthread_mutex_lock(&g_tasks.lock);
+        task = g_tasks.first_done;
+        if (task) {
+            task_unlink(task, &g_tasks.first_done, &g_tasks.last_done);
+            task->in_done_list = false;
+        }
+        pthread_mutex_unlock(&g_tasks.lock);
+        if (!task) break;
+        // The callback can delete the task.
+        task->done(task->user);
+    }
+}
+
+void task_delete(task_t *task)
+{
+    int i, j;
+    task_t *dep;
+    if (!task) return;
+    pthread_mutex_lock(&g_tasks.lock);
+    if (task->state == TASK_WAITING) {
+        // Remove the task from the dependents of its dependencies.
+        for (i = 0; i < task->nb_deps; i++) {
+            if (!(dep = task->deps[i])) continue;
+            for (j = 0; j < dep->nb_dependents; j++) {
+                if (dep->dependents[j] != task) continue;
+                dep->dependents[j] = dep->dependents[--dep->nb_dependents];
+                break;
+            }
+        }
+    }
+    if (task->state == TASK_PENDING)
+        task_unlink(task, &g_tasks.first, &g_tasks.last);
+    if (task->state == TASK_WAITING || task->state == TASK_PENDING) {
+        // The tasks waiting for a cancelled task can still run.
+        __atomic_sub_fetch(&g_tasks.nb_active, 1, __ATOMIC_RELEASE);
+        task_release_dependents(task);
+    }
+    while (task->state == TASK_RUNNING)
+        pthread_cond_wait(&g_tasks.done_cond, &g_tasks.lock);
+    if (task->in_done_list)
+        task_unlink(task, &g_tasks.first_done, &g_tasks.last_done);
+    pthread_mutex_unlock(&g_tasks.lock);
+    free(task->deps);
+    free(task);
+}
@@ -0,0 +1,128 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2020 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+
+/*
+ * Function: parallel_for
+ * Call a function for all the indices in [0, count) using a pool of worker
+ * threads, and wait for all the calls to be done.
+ *
+ * The calling thread also runs some of the calls.  The order of the calls
+ * is not specified, so the function should only write data specific to
+ * its index.  Several threads can call parallel_for at the same time, the
+ * workers are then shared between the jobs.  If called from inside a
+ * parallel_for function, the calls are done serially on the current
+ * thread.
+ *
+ * Parameters:
+ *   count - Number of calls.
+ *   func  - The function to call.
+ *   user  - User data passed to the function.
+ */
+void parallel_for(int count, void (*func)(void *user, int i), void *user);
+
+/*
+ * Type: task_t
+ * A function call running in a background thread.
+ */
+typedef struct task task_t;
+
+/*
+ * Function: task_start
+ * Queue a function call to be run in a background thread.
+ *
+ * The tasks are run in the order they are started, with as many threads
+ * as there are cpus minus one (but at least one).  If no thread can be
+ * created, the function is called immediately on the current thread.
+ *
+ * Parameters:
+ *   func  - The function to call.
+ *   user  - User data passed to the function.
+ *
+ * Return:
+ *   A new task, that should be released with <task_delete>.
+ */
+task_t *task_start(void (*func)(void *user), void *user);
+
+/*
+ * Function: task_start_full
+ * Same as <task_start>, with dependencies and a completion callback.
+ *
+ * The task is only queued once all its dependencies are done (or deleted).
+ * The callback is called on the thread calling <tasks_update>, normally
+ * the main thread, so that it can safely update the application state.
+ *
+ * Parameters:
+ *   func    - The function to call.
+ *   done    - Function called by <tasks_update> once the task is done,
+ *             can be NULL.  It is allowed to delete the task.
+ *   user    - User data passed to the functions.
+ *   nb_deps - Number of dependencies.
+ *   deps    - Tasks that have to be done before this one starts.
+ */
+task_t *task_start_full(void (*func)(void *user), void (*done)(void *user),
+                        void *user, int nb_deps, task_t *const *deps);
+
+/*
+ * Function: task_is_done
+ * Return whether the function of a task has returned.
+ *
+ * If it returns true, all the data written by the task function is visible
+ * from the calling thread.
+ */
+bool task_is_done(const task_t *task);
+
+/*
+ * Function: task_wait
+ * Block until the function of a task has returned.
+ */
+void task_wait(task_t *task);
+
+/*
+ * Function: task_delete
+ * Release a task.
+ *
+ * If the task has not started yet it is cancelled and the function will
+ * never be called, and the tasks depending on it are released.  If it is
+ * running, wait for it to be done.  The completion callback is never
+ * called after the task is deleted.
+ */
+void task_delete(task_t *task);
+
+/*
+ * Function: tasks_get_nb_active
+ * Return the number of tasks started and not done yet.
+ *
+ * Zero means that no background task is running, until the next call to
+ * <task_start>.
+ */
+int tasks_get_nb_active(void);
+
+/*
+ * Function: tasks_update
+ * Call the completion callbacks of the tasks done since the last call.
+ *
+ * Called once per frame by the main loop.
+ */
+void tasks_update(void);
+
+#endif // PARALLEL_H
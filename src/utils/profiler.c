@@ -0,0 +1,383 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profiler.h"
+#include "gl.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Set if GL timestamp queries can be used (if supported at runtime).
+#if !defined(GLES2) && defined(GL_VERSION_3_3)
+#   define HAS_TIMER_QUERY 1
+#else
+#   define HAS_TIMER_QUERY 0
+#endif
+
+#define MAX_EVENTS 512
+#define MAX_DEPTH 32
+#define MAX_GPU_EVENTS 32
+
+typedef struct {
+    double              start;      // Absolute time.
+    double              duration;
+    double              input;      // See profiler_mark_input, or -INFINITY.
+    int                 nb;
+    profiler_event_t    events[MAX_EVENTS];
+
+    // The GPU scopes, each one using a pair of timestamp queries.
+    int                 nb_gpu;
+    int                 nb_gpu_read; // Number of results already read.
+    int                 gpu_events[MAX_GPU_EVENTS];
+    int64_t             gpu_base;    // GPU timestamp at gpu_base_time.
+    double              gpu_base_time;
+    bool                has_queries;
+    GLuint              queries[MAX_GPU_EVENTS][2];
+} frame_t;
+
+static struct {
+    bool        enabled;
+    bool        recording;  // Set when the current frame is recorded.
+    pthread_t   thread;
+    frame_t     *frames;    // Ring buffer of PROFILER_NB_FRAMES frames.
+    int         nb_frames;  // Total number of frames started.
+    int         stack[MAX_DEPTH];
+    int         depth;
+    int         gpu_support; // 0: unknown, 1: supported, -1: not supported.
+} g = {};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static frame_t *get_frame(int n)
+{
+    return &g.frames[n % PROFILER_NB_FRAMES];
+}
+
+static bool gpu_supported(void)
+{
+#if HAS_TIMER_QUERY
+    int major = 0, minor = 0;
+    const char *version;
+    if (g.gpu_support == 0) {
+        GL(version = (const char*)glGetString(GL_VERSION));
+        if (version) sscanf(version, "%d.%d", &major, &minor);
+        g.gpu_support = (major > 3 || (major == 3 && minor >= 3) ||
+                         gl_has_extension("GL_ARB_timer_query")) ? 1 : -1;
+    }
+    return g.gpu_support > 0;
+#else
+    return false;
+#endif
+}
+
+// Read back the GPU timestamps that are available.
+static void collect_gpu_results(void)
+{
+#if HAS_TIMER_QUERY
+    int n, first;
+    frame_t *frame;
+    profiler_event_t *ev;
+    GLuint available;
+    GLuint64 t0, t1;
+
+    first = g.nb_frames > PROFILER_NB_FRAMES ?
+            g.nb_frames - PROFILER_NB_FRAMES : 0;
+    for (n = first; n < g.nb_frames; n++) {
+        frame = get_frame(n);
+        while (frame->nb_gpu_read < frame->nb_gpu) {
+            GL(glGetQueryObjectuiv(frame->queries[frame->nb_gpu_read][1],
+                                   GL_QUERY_RESULT_AVAILABLE, &available));
+            // The queries complete in order, no need to check the rest.
+            if (!available) return;
+            GL(glGetQueryObjectui64v(frame->queries[frame->nb_gpu_read][0],
+                                     GL_QUERY_RESULT, &t0));
+            GL(glGetQueryObjectui64v(frame->queries[frame->nb_gpu_read][1],
+                                     GL_QUERY_RESULT, &t1));
+            ev = &frame->events[frame->gpu_events[frame->nb_gpu_read]];
+            ev->gpu_start = frame->gpu_base_time +
+                            ((int64_t)t0 - frame->gpu_base) / 1e9;
+            ev->gpu_end = frame->gpu_base_time +
+                          ((int64_t)t1 - frame->gpu_base) / 1e9;
+            frame->nb_gpu_read++;
+        }
+    }
+#endif
+}
+
+void profiler_set_enabled(bool enabled)
+{
+    g.enabled = enabled;
+}
+
+bool profiler_is_enabled(void)
+{
+    return g.enabled;
+}
+
+void profiler_frame(void)
+{
+    double time = get_time();
+    frame_t *frame;
+
+    if (g.recording) {
+        frame = get_frame(g.nb_frames - 1);
+        frame->duration = time - frame->start;
+        collect_gpu_results();
+    }
+    g.recording = g.enabled;
+    if (!g.enabled) return;
+
+    if (!g.frames) g.frames = calloc(PROFILER_NB_FRAMES, sizeof(*g.frames));
+    g.thread = pthread_self();
+    g.depth = 0;
+    frame = get_frame(g.nb_frames++);
+    frame->start = time;
+    frame->duration = 0;
+    frame->input = -INFINITY;
+    frame->nb = 0;
+    frame->nb_gpu = 0;
+    frame->nb_gpu_read = 0;
+}
+
+static bool is_recording(void)
+{
+    return g.recording && pthread_equal(pthread_self(), g.thread);
+}
+
+static void gpu_timestamp(frame_t *frame, int event, bool end)
+{
+#if HAS_TIMER_QUERY
+    int i;
+    GLint64 now;
+
+    if (!end) {
+        if (frame->nb_gpu >= MAX_GPU_EVENTS || !gpu_supported()) return;
+        if (!frame->has_queries) {
+            GL(glGenQueries(MAX_GPU_EVENTS * 2, &frame->queries[0][0]));
+            frame->has_queries = true;
+        }
+        if (frame->nb_gpu == 0) {
+            GL(glGetInteger64v(GL_TIMESTAMP, &now));
+            frame->gpu_base = now;
+            frame->gpu_base_time = get_time() - frame->start;
+        }
+        frame->gpu_events[frame->nb_gpu] = event;
+        GL(glQueryCounter(frame->queries[frame->nb_gpu][0], GL_TIMESTAMP));
+        frame->nb_gpu++;
+        return;
+    }
+
+    for (i = frame->nb_gpu - 1; i >= 0; i--) {
+        if (frame->gpu_events[i] != event) continue;
+        GL(glQueryCounter(frame->queries[i][1], GL_TIMESTAMP));
+        return;
+    }
+#endif
+}
+
+static void begin(const char *name, bool gpu)
+{
+    frame_t *frame;
+    int event = -1;
+
+    if (!is_recording()) return;
+    frame = get_frame(g.nb_frames - 1);
+    if (g.depth < MAX_DEPTH && frame->nb < MAX_EVENTS) {
+        event = frame->nb++;
+        frame->events[event] = (profiler_event_t) {
+            .name = name,
+            .depth = g.depth,
+            .start = get_time() - frame->start,
+            .end = -1,
+            .gpu = gpu,
+            .gpu_end = -1,
+        };
+        if (gpu) gpu_timestamp(frame, event, false);
+    }
+    if (g.depth < MAX_DEPTH) g.stack[g.depth] = event;
+    g.depth++;
+}
+
+static void end(void)
+{
+    frame_t *frame;
+    profiler_event_t *ev;
+    int event;
+
+    if (!is_recording() || g.depth == 0) return;
+    g.depth--;
+    if (g.depth >= MAX_DEPTH) return;
+    event = g.stack[g.depth];
+    if (event < 0) return;
+    frame = get_frame(g.nb_frames - 1);
+    ev = &frame->events[event];
+    ev->end = get_time() - frame->start;
+    if (ev->gpu) gpu_timestamp(frame, event, true);
+}
+
+void profiler_begin(const char *name)
+{
+    begin(name, false);
+}
+
+void profiler_end(void)
+{
+    end();
+}
+
+void profiler_gpu_begin(const char *name)
+{
+    begin(name, true);
+}
+
+void profiler_gpu_end(void)
+{
+    end();
+}
+
+void profiler_mark_input(void)
+{
+    frame_t *frame;
+    if (!is_recording()) return;
+    frame = get_frame(g.nb_frames - 1);
+    frame->input = get_time() - frame->start;
+}
+
+bool profiler_get_frame(int i, double *duration,
+                        const profiler_event_t **events, int *nb)
+{
+    int nb_done = g.nb_frames - (g.recording ? 1 : 0);
+    int nb_max = PROFILER_NB_FRAMES - (g.recording ? 1 : 0);
+    frame_t *frame;
+
+    if (i < 0 || i >= nb_max || i >= nb_done) return false;
+    frame = get_frame(nb_done - 1 - i);
+    if (duration) *duration = frame->duration;
+    if (events) *events = frame->events;
+    if (nb) *nb = frame->nb;
+    return true;
+}
+
+double profiler_get_gpu_time(int i)
+{
+    const profiler_event_t *events, *ev;
+    int nb;
+    double ret = 0, last_end = -1;
+
+    if (!profiler_get_frame(i, NULL, &events, &nb)) return -1;
+    for (ev = events; ev < events + nb; ev++) {
+        if (!ev->gpu) continue;
+        if (ev->gpu_end < ev->gpu_start) return -1;
+        // Skip the scopes nested into the previous one.
+        if (ev->gpu_start < last_end) continue;
+        ret += ev->gpu_end - ev->gpu_start;
+        last_end = ev->gpu_end;
+    }
+    return ret;
+}
+
+double profiler_get_input_latency(int i)
+{
+    const profiler_event_t *events, *ev;
+    double duration, end = -1;
+    int nb;
+    const frame_t *frame;
+
+    if (!profiler_get_frame(i, &duration, &events, &nb)) return -1;
+    frame = get_frame(g.nb_frames - (g.recording ? 2 : 1) - i);
+    if (frame->input == -INFINITY) return -1;
+    for (ev = events; ev < events + nb; ev++) {
+        if (!ev->gpu) continue;
+        if (ev->gpu_end < ev->gpu_start) return -1;
+        end = fmax(end, ev->gpu_end);
+    }
+    if (end < 0) end = duration;
+    return end - frame->input;
+}
+
+int profiler_dump_trace(const char *path)
+{
+    FILE *file;
+    int i, nb;
+    double duration, t0 = 0, t;
+    const profiler_event_t *events, *ev;
+    const char *sep;
+
+    file = fopen(path, "w");
+    if (!file) return -1;
+    fprintf(file, "{\"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+                  "\"tid\": 0, \"args\": {\"name\": \"CPU\"}},\n");
+    fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+                  "\"tid\": 1, \"args\": {\"name\": \"GPU\"}}");
+    sep = ",\n";
+
+    // Oldest frame first.
+    for (i = PROFILER_NB_FRAMES - 1; i >= 0; i--) {
+        if (!profiler_get_frame(i, &duration, &events, &nb)) continue;
+        t = get_frame(g.nb_frames - (g.recording ? 2 : 1) - i)->start;
+        if (t0 == 0) t0 = t;
+        t = (t - t0) * 1e6;
+        fprintf(file, "%s{\"name\": \"frame\", \"ph\": \"X\", \"pid\": 0, "
+                "\"tid\": 0, \"ts\": %.3f, \"dur\": %.3f}",
+                sep, t, duration * 1e6);
+        for (ev = events; ev < events + nb; ev++) {
+            if (ev->end < ev->start) continue;
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, "
+                    "\"tid\": 0, \"ts\": %.3f, \"dur\": %.3f}",
+                    sep, ev->name, t + ev->start * 1e6,
+                    (ev->end - ev->start) * 1e6);
+            if (!ev->gpu || ev->gpu_end < ev->gpu_start) continue;
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, "
+                    "\"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+                    sep, ev->name, t + ev->gpu_start * 1e6,
+                    (ev->gpu_end - ev->gpu_start) * 1e6);
+        }
+    }
+    fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(file);
+    return 0;
+}
+
+void profiler_release(void)
+{
+    int i;
+    if (!g.frames) return;
+    for (i = 0; i < PROFILER_NB_FRAMES; i++) {
+        // Drop the pending results, their queries are gone.
+        g.frames[i].nb_gpu = g.frames[i].nb_gpu_read;
+#if HAS_TIMER_QUERY
+        if (g.frames[i].has_queries) {
+            GL(glDeleteQueries(MAX_GPU_EVENTS * 2,
+                               &g.frames[i].queries[0][0]));
+        }
+#endif
+        g.frames[i].has_queries = false;
+    }
+    g.gpu_support = 0;
+}
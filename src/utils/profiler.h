@@ -0,0 +1,169 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+
+/*
+ * Section: Profiler
+ * Frame time profiler with named scopes.
+ *
+ * The scopes are recorded per frame into a ring buffer of the last
+ * PROFILER_NB_FRAMES frames.  Only the thread that calls <profiler_frame>
+ * records anything, and only when the profiler is enabled, so that the
+ * begin and end calls can stay in the code at almost no cost.
+ *
+ * The GPU scopes also measure the time the GPU spent on the commands
+ * issued between the begin and end calls, using GL timestamp queries when
+ * they are supported.  Those results are only known a few frames later.
+ */
+
+#define PROFILER_NB_FRAMES 128
+
+/*
+ * Type: profiler_event_t
+ * A recorded scope.  All the times are in seconds, relative to the start
+ * of the frame.
+ */
+typedef struct {
+    const char  *name;      // Must be a static string.
+    int         depth;
+    double      start;
+    double      end;
+    bool        gpu;        // Set for the GPU scopes.
+    double      gpu_start;  // Only valid if gpu_end >= gpu_start.
+    double      gpu_end;
+} profiler_event_t;
+
+/*
+ * Function: profiler_set_enabled
+ * Start or stop the recording of the scopes.
+ */
+void profiler_set_enabled(bool enabled);
+bool profiler_is_enabled(void);
+
+/*
+ * Function: profiler_frame
+ * Mark the start of a new frame.
+ *
+ * Should be called once per frame, before any scope, from the main thread.
+ * This also collects the GPU times of the previous frames.
+ */
+void profiler_frame(void);
+
+/*
+ * Function: profiler_begin
+ * Open a new scope, nested into the current one.
+ *
+ * Parameters:
+ *   name - Name of the scope.  Must be a static string.
+ */
+void profiler_begin(const char *name);
+
+/*
+ * Function: profiler_end
+ * Close the scope opened by the last call to <profiler_begin>.
+ */
+void profiler_end(void);
+
+/*
+ * Function: profiler_gpu_begin
+ * Same as <profiler_begin>, but also measure the GPU time.
+ *
+ * Must be called with a GL context current.
+ */
+void profiler_gpu_begin(const char *name);
+void profiler_gpu_end(void);
+
+/*
+ * Function: profiler_mark_input
+ * Record that the inputs shown by the current frame were read now.
+ *
+ * Can be called several times per frame if the inputs are read again, in
+ * which case the last call is used.
+ */
+void profiler_mark_input(void);
+
+/*
+ * Function: profiler_get_frame
+ * Get a recorded frame.
+ *
+ * Parameters:
+ *   i        - Index of the frame, starting from the last completed one.
+ *   duration - Set to the duration of the frame, in seconds.
+ *   events   - Set to the frame events, in the order they started.
+ *   nb       - Set to the number of events.
+ *
+ * Return:
+ *   false if there is no such frame.
+ */
+bool profiler_get_frame(int i, double *duration,
+                        const profiler_event_t **events, int *nb);
+
+/*
+ * Function: profiler_get_gpu_time
+ * Get the total time spent by the GPU in the scopes of a recorded frame.
+ *
+ * Parameters:
+ *   i - Index of the frame, as in <profiler_get_frame>.
+ *
+ * Return:
+ *   The time in seconds, or -1 if some of the GPU results are not known
+ *   yet, or if there is no such frame.
+ */
+double profiler_get_gpu_time(int i);
+
+/*
+ * Function: profiler_get_input_latency
+ * Get the time between the last read of the inputs of a recorded frame and
+ * the end of its rendering.
+ *
+ * The end of the rendering is the end of the last GPU scope of the frame,
+ * or the end of the frame if it has no GPU scopes.  The time the frame
+ * then waits to be displayed is not included.
+ *
+ * Parameters:
+ *   i - Index of the frame, as in <profiler_get_frame>.
+ *
+ * Return:
+ *   The latency in seconds, or -1 if it is not known.
+ */
+double profiler_get_input_latency(int i);
+
+/*
+ * Function: profiler_dump_trace
+ * Save all the recorded frames as a chrome trace event json file.
+ *
+ * The file can be opened with chrome://tracing or https://ui.perfetto.dev.
+ * The GPU scopes are put in their own track.
+ *
+ * Return:
+ *   0 on success, -1 if the file could not be written.
+ */
+int profiler_dump_trace(const char *path);
+
+/*
+ * Function: profiler_release
+ * Release the GL queries.  Need to be called before the GL context is
+ * destroyed.
+ */
+void profiler_release(void);
+
+#endif // PROFILER_H
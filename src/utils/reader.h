@@ -0,0 +1,151 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Section: Reader
+ * Bounds checked cursor into binary data, used by the files importers.
+ *
+ * The importers read the whole file in memory first (see <read_file>), and
+ * then parse it with those functions.  Reading past the end of the data
+ * never fails: it returns zero values, moves the cursor to the end, and sets
+ * the error flag, so that the parsers only have to check for errors once
+ * per structure.  All the values are little endian.
+ *
+ * Example:
+ *
+ *   reader_t r = {data, size};
+ *   w = reader_u32(&r);
+ *   h = reader_u32(&r);
+ *   if (r.error) goto error;
+ */
+typedef struct {
+    const uint8_t   *data;
+    int64_t         size;
+    int64_t         pos;
+    bool            error;  // Set if we tried to read past the end.
+} reader_t;
+
+/*
+ * Function: reader_bytes
+ * Return a pointer to the next bytes of the data and move past them.
+ *
+ * Return:
+ *   A pointer into the data, or NULL if there are less than size bytes
+ *   left, in which case the error flag is set.
+ */
+static inline const uint8_t *reader_bytes(reader_t *r, int64_t size)
+{
+    const uint8_t *ret;
+    if (size < 0 || size > r->size - r->pos) {
+        r->pos = r->size;
+        r->error = true;
+        return NULL;
+    }
+    ret = r->data + r->pos;
+    r->pos += size;
+    return ret;
+}
+
+/*
+ * Function: reader_read
+ * Copy the next bytes of the data, or fill the output with zeros if there
+ * are not enough.
+ */
+static inline bool reader_read(reader_t *r, void *out, int64_t size)
+{
+    const uint8_t *p = reader_bytes(r, size);
+    if (p) memcpy(out, p, size);
+    else if (size > 0) memset(out, 0, size);
+    return p != NULL;
+}
+
+// Move the cursor to an absolute position, or to the end if it is outside
+// of the data.
+static inline bool reader_seek(reader_t *r, int64_t pos)
+{
+    if (pos < 0 || pos > r->size) {
+        r->pos = r->size;
+        r->error = true;
+        return false;
+    }
+    r->pos = pos;
+    return true;
+}
+
+// Number of bytes left to read.
+static inline int64_t reader_remaining(const reader_t *r)
+{
+    return r->size - r->pos;
+}
+
+static inline uint8_t reader_u8(reader_t *r)
+{
+    const uint8_t *p = reader_bytes(r, 1);
+    return p ? p[0] : 0;
+}
+
+static inline uint16_t reader_u16(reader_t *r)
+{
+    const uint8_t *p = reader_bytes(r, 2);
+    return p ? (uint16_t)(p[0] | p[1] << 8) : 0;
+}
+
+static inline uint32_t reader_u32(reader_t *r)
+{
+    const uint8_t *p = reader_bytes(r, 4);
+    if (!p) return 0;
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline int32_t reader_i32(reader_t *r)
+{
+    return (int32_t)reader_u32(r);
+}
+
+static inline int64_t reader_i64(reader_t *r)
+{
+    uint64_t lo = reader_u32(r);
+    uint64_t hi = reader_u32(r);
+    return (int64_t)(lo | hi << 32);
+}
+
+static inline float reader_float(reader_t *r)
+{
+    uint32_t v = reader_u32(r);
+    float ret;
+    memcpy(&ret, &v, 4);
+    return ret;
+}
+
+static inline double reader_double(reader_t *r)
+{
+    int64_t v = reader_i64(r);
+    double ret;
+    memcpy(&ret, &v, 8);
+    return ret;
+}
+
+#endif // READER_H
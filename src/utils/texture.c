@@ -20,6 +20,7 @@
 #include "texture.h"
 
 #include "utils/gl.h"
+#include "utils/mem_stats.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -40,6 +41,16 @@ static int next_pow2(int x)
 
 static bool is_pow2(int x) { return x == next_pow2(x); }
 
+// Approximate GPU memory used by a texture, for the memory stats.
+static int64_t texture_get_mem(const texture_t *tex)
+{
+    int64_t bpp = tex->format == GL_RGBA ? 4 :
+                  tex->format == GL_RGB ? 3 : 2;
+    int64_t ret = tex->tex_w * tex->tex_h * bpp;
+    if (tex->flags & TF_MIPMAP) ret = ret * 4 / 3;
+    return ret;
+}
+
 static void texture_create_empty(texture_t *tex)
 {
     assert(tex->flags & TF_HAS_TEX);
@@ -51,11 +62,15 @@ static void texture_create_empty(texture_t *tex)
         GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
             (tex->flags & TF_MIPMAP)? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR));
     } else {
+        // Keep the pixels sharp up close, but use the mipmaps when zoomed
+        // out, so that large images don't alias.
         GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-        GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+            (tex->flags & TF_MIPMAP)? GL_LINEAR_MIPMAP_NEAREST : GL_NEAREST));
     }
     GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w, tex->tex_h,
             0, tex->format, GL_UNSIGNED_BYTE, NULL));
+    mem_stats_add(MEM_TEXTURES, texture_get_mem(tex));
 }
 
 static void blit(const uint8_t *src, int src_w, int src_h, int bpp,
@@ -71,7 +86,10 @@ void texture_set_data(texture_t *tex,
                       const uint8_t *data, int w, int h, int bpp)
 {
     uint8_t *buf = NULL;
-    assert(tex->tex);
+    if (!tex->tex) {
+        tex->format = (int[]){0, 0, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA}[bpp];
+        texture_create_empty(tex);
+    }
     if (!is_pow2(w) || !is_pow2(h)) {
         buf = calloc(bpp, tex->tex_w * tex->tex_h);
         blit(data, w, h, bpp, buf, tex->tex_w, tex->tex_h);
@@ -85,6 +103,30 @@ void texture_set_data(texture_t *tex,
         GL(glGenerateMipmap(GL_TEXTURE_2D));
 }
 
+void texture_set_sub_data(texture_t *tex, const uint8_t *data, int stride,
+                          int x, int y, int w, int h, int bpp)
+{
+    uint8_t *buf = NULL;
+    int i;
+    assert(tex->tex);
+    if (w <= 0 || h <= 0) return;
+    data += (y * stride + x) * bpp;
+    // GLES2 has no GL_UNPACK_ROW_LENGTH, so unless we update full rows we
+    // first copy the rectangle into a contiguous buffer.
+    if (w != stride && h > 1) {
+        buf = malloc(w * h * bpp);
+        for (i = 0; i < h; i++)
+            memcpy(buf + i * w * bpp, data + i * stride * bpp, w * bpp);
+        data = buf;
+    }
+    GL(glBindTexture(GL_TEXTURE_2D, tex->tex));
+    GL(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h,
+                       tex->format, GL_UNSIGNED_BYTE, data));
+    free(buf);
+    if (tex->flags & TF_MIPMAP)
+        GL(glGenerateMipmap(GL_TEXTURE_2D));
+}
+
 texture_t *texture_new_from_buf(const uint8_t *data,
                                 int w, int h, int bpp, int flags)
 {
@@ -102,6 +144,19 @@ texture_t *texture_new_from_buf(const uint8_t *data,
     return tex;
 }
 
+texture_t *texture_new_empty(int w, int h, int flags)
+{
+    texture_t *tex;
+    tex = calloc(1, sizeof(*tex));
+    tex->tex_w = next_pow2(w);
+    tex->tex_h = next_pow2(h);
+    tex->w = w;
+    tex->h = h;
+    tex->flags = TF_HAS_TEX | flags;
+    tex->ref = 1;
+    return tex;
+}
+
 texture_t *texture_new_surface(int w, int h, int flags)
 {
     texture_t *tex;
@@ -129,6 +184,7 @@ texture_t *texture_new_buffer(int w, int h, int flags)
     tex->flags = flags | TF_HAS_FB | TF_HAS_TEX;
     gl_gen_fbo(tex->tex_w, tex->tex_h, tex->format, 1,
                &tex->framebuffer, &tex->tex);
+    mem_stats_add(MEM_TEXTURES, texture_get_mem(tex));
     tex->ref = 1;
     return tex;
 }
@@ -148,8 +204,10 @@ void texture_delete(texture_t *tex)
             GL(glDeleteRenderbuffers(1, &tex->stencil));
         GL(glDeleteFramebuffers(1, &tex->framebuffer));
     }
-    if (tex->tex)
+    if (tex->tex) {
         GL(glDeleteTextures(1, &tex->tex));
+        mem_stats_add(MEM_TEXTURES, -texture_get_mem(tex));
+    }
     free(tex);
 }
 
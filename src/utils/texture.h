@@ -32,6 +32,7 @@ enum {
     TF_HAS_TEX  = 1 << 6,
     TF_HAS_FB   = 1 << 7,
     TF_NEAREST  = 1 << 8,
+    TF_ASYNC    = 1 << 9, // Data still being decoded in the background.
 };
 
 // Type: texture_t
@@ -54,6 +55,16 @@ texture_t *texture_new_from_buf(const uint8_t *data,
                                 int w, int h, int bpp, int flags);
 texture_t *texture_new_surface(int w, int h, int flags);
 texture_t *texture_new_buffer(int w, int h, int flags);
+
+/*
+ * Function: texture_new_empty
+ * Create a texture without any GL texture yet.
+ *
+ * The GL texture is created by the first call to <texture_set_data>, so
+ * that the texture size is known before its data.  Until then the tex
+ * attribute is zero.
+ */
+texture_t *texture_new_empty(int w, int h, int flags);
 void texture_get_data(const texture_t *tex, int w, int h, int bpp,
                       uint8_t *buf);
 
@@ -63,4 +74,19 @@ void texture_delete(texture_t *tex);
 void texture_set_data(texture_t *tex,
                       const uint8_t *data, int w, int h, int bpp);
 
+/*
+ * Function: texture_set_sub_data
+ * Update a rectangle of a texture.
+ *
+ * Parameters:
+ *   tex    - A texture with at least the size of the rectangle.
+ *   data   - The pixels of the full source image.
+ *   stride - Width of the source image, in pixels.
+ *   x, y   - Position of the rectangle in the source and in the texture.
+ *   w, h   - Size of the rectangle.
+ *   bpp    - Bytes per pixel of the source.
+ */
+void texture_set_sub_data(texture_t *tex, const uint8_t *data, int stride,
+                          int x, int y, int w, int h, int bpp);
+
 #endif // TEXTURE_H
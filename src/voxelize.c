@@ -0,0 +1,565 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "voxelize.h"
+
+#include "goxel.h"
+#include "file_format.h"
+#include "utils/parallel.h"
+
+#include <limits.h>
+
+#define N BLOCK_SIZE
+
+// Number of blocks or columns of blocks computed in parallel before we
+// write them into the mesh.
+#define BATCH_SIZE 256
+
+static struct {
+    int     size;
+    bool    solid;
+} g_options = {
+    .size = 128,
+};
+
+/*
+ * Values precomputed for each triangle, for the triangle / voxel overlap
+ * test from 'Fast Parallel Surface and Solid Voxelization on GPUs'
+ * (Schwarz and Seidel 2010): the voxel intersects the triangle plane, and
+ * the projections of the voxel on the xy, yz and zx planes intersect the
+ * projections of the triangle.
+ */
+typedef struct {
+    bool    valid;          // Unset for the degenerated triangles.
+    float   n[3];           // Normal (not normalized).
+    float   d1, d2;         // Plane test offsets.
+    float   ne[3][3][2];    // Edges normals of each projection.
+    float   de[3][3];       // Edges offsets of each projection.
+    int     aabb[2][3];     // Covered voxels (max excluded).
+} tri_setup_t;
+
+// Axes of the xy, yz and zx projections.
+static const int PROJS[3][2] = {{0, 1}, {1, 2}, {2, 0}};
+
+// A triangle in a bin, sorted by bin key.
+typedef struct {
+    uint64_t    key;
+    int         tri;
+} bin_item_t;
+
+// The triangles of a block, or of a column of blocks.
+typedef struct {
+    int         pos[3];     // Position of the block.
+    int         start;      // First item of the bin.
+    int         count;
+} bin_t;
+
+typedef struct {
+    const voxelize_triangle_t *tris;
+    const voxelize_texture_t *textures;
+    tri_setup_t *setups;
+    int         nb;
+    bool        columns;    // Bins of columns of blocks instead of blocks.
+    int         *offsets;   // First item of each triangle.
+    bin_item_t  *items;
+    bin_t       *bins;
+    int         first;      // First bin of the current batch.
+    int         zrange[2];  // Voxels z range of all the triangles.
+    uint8_t     *voxels;    // Values of the batch bins.
+    bool        *filled;    // Set for the non empty bins of the batch.
+} job_t;
+
+static inline int floor_div(int a, int b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Pack a block position into a key, with the z axis first, so that the
+// sorted bins are in the order we write them.
+static uint64_t bin_key(int x, int y, int z)
+{
+    const uint64_t m = (1 << 21) - 1, o = 1 << 20;
+    return ((uint64_t)(z + o) & m) << 42 | ((uint64_t)(y + o) & m) << 21 |
+           ((uint64_t)(x + o) & m);
+}
+
+static void bin_key_get_pos(uint64_t key, int pos[3])
+{
+    const uint64_t m = (1 << 21) - 1, o = 1 << 20;
+    pos[0] = (int)((key & m) - o) * N;
+    pos[1] = (int)((key >> 21 & m) - o) * N;
+    pos[2] = (int)((key >> 42 & m) - o) * N;
+}
+
+static void tri_setup(void *user, int i)
+{
+    job_t *job = user;
+    const float (*v)[3] = job->tris[i].pos;
+    tri_setup_t *t = &job->setups[i];
+    float e[3][3], c[3], p[3], s, *ne;
+    int j, k, a, b;
+
+    for (j = 0; j < 3; j++) vec3_sub(v[(j + 1) % 3], v[j], e[j]);
+    vec3_cross(e[0], e[1], t->n);
+    t->valid = vec3_norm2(t->n) > 0;
+    if (!t->valid) return;
+
+    // Critical point of the voxel, relative to its min corner.
+    for (j = 0; j < 3; j++) c[j] = t->n[j] > 0 ? 1 : 0;
+    vec3_sub(c, v[0], p);
+    t->d1 = vec3_dot(t->n, p);
+    for (j = 0; j < 3; j++) p[j] = 1 - c[j] - v[0][j];
+    t->d2 = vec3_dot(t->n, p);
+
+    for (k = 0; k < 3; k++) {
+        a = PROJS[k][0];
+        b = PROJS[k][1];
+        // Sign of the normal along the projection axis.
+        s = t->n[3 - a - b] >= 0 ? 1 : -1;
+        for (j = 0; j < 3; j++) {
+            ne = t->ne[k][j];
+            ne[0] = -e[j][b] * s;
+            ne[1] = e[j][a] * s;
+            t->de[k][j] = -(ne[0] * v[j][a] + ne[1] * v[j][b]) +
+                          max(0.f, ne[0]) + max(0.f, ne[1]);
+        }
+    }
+
+    for (j = 0; j < 3; j++) {
+        t->aabb[0][j] = floorf(min3(v[0][j], v[1][j], v[2][j]));
+        t->aabb[1][j] = floorf(max3(v[0][j], v[1][j], v[2][j])) + 1;
+    }
+}
+
+// Test if the voxel with a given min corner overlaps a triangle.
+static bool tri_overlap(const tri_setup_t *t, const float p[3])
+{
+    float np = vec3_dot(t->n, p);
+    int j, k;
+
+    if ((np + t->d1) * (np + t->d2) > 0) return false;
+    for (k = 0; k < 3; k++) {
+        for (j = 0; j < 3; j++) {
+            if (t->ne[k][j][0] * p[PROJS[k][0]] +
+                t->ne[k][j][1] * p[PROJS[k][1]] + t->de[k][j] < 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Compute the color of a triangle at the projection of a point, and
+// return the distance from the point to the triangle plane.
+static float tri_get_color(const job_t *job, int i, const float p[3],
+                           uint8_t out[4])
+{
+    const voxelize_triangle_t *tri = &job->tris[i];
+    const tri_setup_t *t = &job->setups[i];
+    const voxelize_texture_t *tex;
+    float a[3], b[3], c[3], w[3], sum, n2, uv[2] = {0}, col[4] = {0};
+    const uint8_t *texel;
+    int j, k, x, y;
+
+    // Barycentric coordinates, clamped to the triangle.
+    n2 = vec3_norm2(t->n);
+    sum = 0;
+    for (j = 0; j < 3; j++) {
+        vec3_sub(tri->pos[(j + 1) % 3], p, a);
+        vec3_sub(tri->pos[(j + 2) % 3], p, b);
+        vec3_cross(a, b, c);
+        w[j] = max(0.f, vec3_dot(t->n, c) / n2);
+        sum += w[j];
+    }
+    for (j = 0; j < 3; j++) {
+        w[j] = sum > 0 ? w[j] / sum : 1 / 3.f;
+        for (k = 0; k < 2; k++) uv[k] += w[j] * tri->uv[j][k];
+        for (k = 0; k < 4; k++) col[k] += w[j] * tri->color[j][k];
+    }
+    for (k = 0; k < 4; k++) out[k] = clamp(roundf(col[k]), 0, 255);
+
+    if (tri->texture >= 0 && job->textures) {
+        tex = &job->textures[tri->texture];
+        x = (int)floorf((uv[0] - floorf(uv[0])) * tex->w) % tex->w;
+        y = (int)floorf((uv[1] - floorf(uv[1])) * tex->h) % tex->h;
+        texel = tex->data + (y * tex->w + x) * 4;
+        for (k = 0; k < 4; k++) out[k] = out[k] * texel[k] / 255;
+    }
+
+    vec3_sub(p, tri->pos[0], a);
+    return fabsf(vec3_dot(t->n, a)) / sqrtf(n2);
+}
+
+// Blocks (or columns) range covered by a triangle.
+static int tri_get_bins(const job_t *job, int i, int range[2][3])
+{
+    const tri_setup_t *t = &job->setups[i];
+    int j;
+
+    if (!t->valid) return 0;
+    for (j = 0; j < 3; j++) {
+        range[0][j] = floor_div(t->aabb[0][j], N);
+        range[1][j] = floor_div(t->aabb[1][j] - 1, N) + 1;
+    }
+    if (job->columns) {
+        // Vertical triangles are never crossed by the rays.
+        if (t->n[2] == 0) return 0;
+        range[0][2] = 0;
+        range[1][2] = 1;
+    }
+    return (range[1][0] - range[0][0]) * (range[1][1] - range[0][1]) *
+           (range[1][2] - range[0][2]);
+}
+
+static void bin_count(void *user, int i)
+{
+    job_t *job = user;
+    int range[2][3];
+    job->offsets[i] = tri_get_bins(job, i, range);
+}
+
+static void bin_fill(void *user, int i)
+{
+    job_t *job = user;
+    int x, y, z, range[2][3], k = job->offsets[i];
+
+    if (!tri_get_bins(job, i, range)) return;
+    for (z = range[0][2]; z < range[1][2]; z++)
+    for (y = range[0][1]; y < range[1][1]; y++)
+    for (x = range[0][0]; x < range[1][0]; x++) {
+        job->items[k++] = (bin_item_t){bin_key(x, y, z), i};
+    }
+}
+
+static int bin_item_cmp(const void *a_, const void *b_)
+{
+    const bin_item_t *a = a_, *b = b_;
+    if (a->key != b->key) return a->key < b->key ? -1 : +1;
+    return cmp(a->tri, b->tri);
+}
+
+// Bin the triangles by blocks or columns of blocks, and return the number
+// of bins.
+static int bin_triangles(job_t *job)
+{
+    int i, nb_items = 0, nb_bins = 0, count;
+
+    job->offsets = malloc(max(job->nb, 1) * sizeof(*job->offsets));
+    parallel_for(job->nb, bin_count, job);
+    for (i = 0; i < job->nb; i++) {
+        count = job->offsets[i];
+        job->offsets[i] = nb_items;
+        nb_items += count;
+    }
+    job->items = malloc(max(nb_items, 1) * sizeof(*job->items));
+    parallel_for(job->nb, bin_fill, job);
+    qsort(job->items, nb_items, sizeof(*job->items), bin_item_cmp);
+
+    job->bins = malloc(max(nb_items, 1) * sizeof(*job->bins));
+    for (i = 0; i < nb_items; i++) {
+        if (i && job->items[i].key == job->items[i - 1].key) {
+            job->bins[nb_bins - 1].count++;
+            continue;
+        }
+        job->bins[nb_bins] = (bin_t){.start = i, .count = 1};
+        bin_key_get_pos(job->items[i].key, job->bins[nb_bins].pos);
+        nb_bins++;
+    }
+    free(job->offsets);
+    job->offsets = NULL;
+    return nb_bins;
+}
+
+// Rasterize the triangles of a block, keeping for each voxel the color of
+// the closest triangle.
+static void rasterize_block(void *user, int i)
+{
+    job_t *job = user;
+    const bin_t *bin = &job->bins[job->first + i];
+    const tri_setup_t *t;
+    uint8_t *voxels = job->voxels + (size_t)i * N * N * N * 4, c[4];
+    float *dists, p[3], q[3], d;
+    int k, tri, x, y, z, a[3], b[3], j, idx;
+
+    memset(voxels, 0, N * N * N * 4);
+    dists = malloc(N * N * N * sizeof(*dists));
+    for (j = 0; j < N * N * N; j++) dists[j] = FLT_MAX;
+    for (k = 0; k < bin->count; k++) {
+        tri = job->items[bin->start + k].tri;
+        t = &job->setups[tri];
+        for (j = 0; j < 3; j++) {
+            a[j] = max(t->aabb[0][j], bin->pos[j]) - bin->pos[j];
+            b[j] = min(t->aabb[1][j], bin->pos[j] + N) - bin->pos[j];
+        }
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++)
+        for (x = a[0]; x < b[0]; x++) {
+            vec3_set(p, bin->pos[0] + x, bin->pos[1] + y, bin->pos[2] + z);
+            if (!tri_overlap(t, p)) continue;
+            idx = (z * N + y) * N + x;
+            vec3_set(q, p[0] + 0.5, p[1] + 0.5, p[2] + 0.5);
+            d = tri_get_color(job, tri, q, c);
+            if (d >= dists[idx] || c[3] < 128) continue;
+            dists[idx] = d;
+            memcpy(&voxels[idx * 4], (uint8_t[]){c[0], c[1], c[2], 255}, 4);
+            job->filled[i] = true;
+        }
+    }
+    free(dists);
+}
+
+// Test if a point is inside the xy projection of a triangle.  The points
+// on an edge are only inside one of the two triangles sharing it, so that
+// the rays never cross a surface twice.
+static bool tri_contains_xy(const float v[3][3], float x, float y)
+{
+    float area, e, ex, ey;
+    int i, j;
+
+    area = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) -
+           (v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+    if (area == 0) return false;
+    for (i = 0; i < 3; i++) {
+        j = (i + 1) % 3;
+        ex = (v[j][0] - v[i][0]) * (area > 0 ? 1 : -1);
+        ey = (v[j][1] - v[i][1]) * (area > 0 ? 1 : -1);
+        e = ex * (y - v[i][1]) - ey * (x - v[i][0]);
+        if (e < 0) return false;
+        if (e == 0 && !(ey > 0 || (ey == 0 && ex < 0))) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    float   z;
+    int     tri;
+} hit_t;
+
+static int hit_cmp(const void *a_, const void *b_)
+{
+    const hit_t *a = a_, *b = b_;
+    return cmp(a->z, b->z);
+}
+
+// Fill the inside of a column of blocks, using the parity of the number
+// of triangles crossed by a vertical ray at each voxel center.
+static void fill_column(void *user, int i)
+{
+    job_t *job = user;
+    const bin_t *bin = &job->bins[job->first + i];
+    const voxelize_triangle_t *tri;
+    const tri_setup_t *t;
+    int h = job->zrange[1] - job->zrange[0];
+    uint8_t *voxels = job->voxels + (size_t)i * N * N * h * 4, c[4];
+    hit_t *hits;
+    float px, py, p[3];
+    int k, x, y, z, z0, z1, nb;
+
+    memset(voxels, 0, (size_t)N * N * h * 4);
+    hits = malloc(bin->count * sizeof(*hits));
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        px = bin->pos[0] + x + 0.5;
+        py = bin->pos[1] + y + 0.5;
+        nb = 0;
+        for (k = 0; k < bin->count; k++) {
+            hits[nb].tri = job->items[bin->start + k].tri;
+            tri = &job->tris[hits[nb].tri];
+            t = &job->setups[hits[nb].tri];
+            if (!tri_contains_xy(tri->pos, px, py)) continue;
+            hits[nb].z = tri->pos[0][2] -
+                (t->n[0] * (px - tri->pos[0][0]) +
+                 t->n[1] * (py - tri->pos[0][1])) / t->n[2];
+            nb++;
+        }
+        qsort(hits, nb, sizeof(*hits), hit_cmp);
+        // Each pair of hits is an inside segment.
+        for (k = 0; k + 1 < nb; k += 2) {
+            vec3_set(p, px, py, hits[k].z);
+            tri_get_color(job, hits[k].tri, p, c);
+            z0 = max((int)ceilf(hits[k].z - 0.5f), job->zrange[0]);
+            z1 = min((int)floorf(hits[k + 1].z - 0.5f) + 1, job->zrange[1]);
+            for (z = z0; z < z1; z++) {
+                memcpy(&voxels[(((z - job->zrange[0]) * N + y) * N + x) * 4],
+                       (uint8_t[]){c[0], c[1], c[2], 255}, 4);
+                job->filled[i] = true;
+            }
+        }
+    }
+    free(hits);
+}
+
+// Add the filled columns of a batch to the mesh, without changing the
+// surface voxels.
+static void write_columns(job_t *job, mesh_t *mesh, int nb)
+{
+    int i, j, z, h = job->zrange[1] - job->zrange[0], bpos[3];
+    uint8_t *voxels, *col, *src, *dst;
+    bool changed;
+
+    voxels = malloc(N * N * N * 4);
+    for (i = 0; i < nb; i++) {
+        if (!job->filled[i]) continue;
+        col = job->voxels + (size_t)i * N * N * h * 4;
+        for (z = floor_div(job->zrange[0], N) * N; z < job->zrange[1];
+             z += N) {
+            vec3_set(bpos, job->bins[job->first + i].pos[0],
+                     job->bins[job->first + i].pos[1], z);
+            mesh_read(mesh, bpos, (int[]){N, N, N}, voxels);
+            changed = false;
+            for (j = 0; j < N * N * N; j++) {
+                if (z + j / (N * N) < job->zrange[0]) continue;
+                if (z + j / (N * N) >= job->zrange[1]) break;
+                dst = &voxels[j * 4];
+                src = &col[(j + (z - job->zrange[0]) * N * N) * 4];
+                if (dst[3] || !src[3]) continue;
+                memcpy(dst, src, 4);
+                changed = true;
+            }
+            if (changed) mesh_write(mesh, bpos, (int[]){N, N, N}, voxels);
+        }
+    }
+    free(voxels);
+}
+
+int mesh_voxelize(mesh_t *mesh, const voxelize_triangle_t *triangles, int nb,
+                  const voxelize_texture_t *textures, bool solid)
+{
+    job_t job = {.tris = triangles, .textures = textures, .nb = nb};
+    int i, j, nb_bins, batch, ret = 0;
+
+    job.setups = calloc(max(nb, 1), sizeof(*job.setups));
+    parallel_for(nb, tri_setup, &job);
+    job.zrange[0] = INT_MAX;
+    job.zrange[1] = INT_MIN;
+    for (i = 0; i < nb; i++) {
+        if (!job.setups[i].valid) continue;
+        job.zrange[0] = min(job.zrange[0], job.setups[i].aabb[0][2]);
+        job.zrange[1] = max(job.zrange[1], job.setups[i].aabb[1][2]);
+    }
+
+    // The surface, one batch of blocks at a time.
+    nb_bins = bin_triangles(&job);
+    job.voxels = malloc((size_t)BATCH_SIZE * N * N * N * 4);
+    job.filled = calloc(BATCH_SIZE, sizeof(*job.filled));
+    mesh_begin_write(mesh);
+    for (job.first = 0; job.first < nb_bins; job.first += BATCH_SIZE) {
+        batch = min(BATCH_SIZE, nb_bins - job.first);
+        memset(job.filled, 0, BATCH_SIZE * sizeof(*job.filled));
+        parallel_for(batch, rasterize_block, &job);
+        for (i = 0; i < batch; i++) {
+            if (!job.filled[i]) continue;
+            mesh_write(mesh, job.bins[job.first + i].pos, (int[]){N, N, N},
+                       job.voxels + (size_t)i * N * N * N * 4);
+        }
+        mesh_remove_empty_blocks(mesh, false);
+        if (!file_format_report_progress(
+                    (float)(job.first + batch) / nb_bins * (solid ? 0.5 : 1))) {
+            ret = -1;
+            break;
+        }
+    }
+    free(job.items);
+    free(job.bins);
+    free(job.voxels);
+    job.voxels = NULL;
+
+    // The inside, one batch of columns at a time, with a smaller batch for
+    // the tall models, so that we don't use too much memory.
+    if (solid && ret == 0 && job.zrange[0] < job.zrange[1]) {
+        job.columns = true;
+        nb_bins = bin_triangles(&job);
+        batch = clamp((1 << 26) / (N * N * 4 *
+                      (job.zrange[1] - job.zrange[0])), 1, BATCH_SIZE);
+        job.voxels = malloc((size_t)batch * N * N *
+                            (job.zrange[1] - job.zrange[0]) * 4);
+        for (job.first = 0; job.first < nb_bins; job.first += batch) {
+            j = min(batch, nb_bins - job.first);
+            memset(job.filled, 0, BATCH_SIZE * sizeof(*job.filled));
+            parallel_for(j, fill_column, &job);
+            write_columns(&job, mesh, j);
+            mesh_remove_empty_blocks(mesh, false);
+            if (!file_format_report_progress(
+                        0.5 + 0.5 * (job.first + j) / nb_bins)) {
+                ret = -1;
+                break;
+            }
+        }
+        free(job.items);
+        free(job.bins);
+        free(job.voxels);
+    }
+    mesh_end_write(mesh);
+    free(job.filled);
+    free(job.setups);
+    return ret;
+}
+
+int voxelize_import(image_t *image, voxelize_triangle_t *triangles, int nb,
+                    const voxelize_texture_t *textures)
+{
+    float aabb[2][3] = {{FLT_MAX, FLT_MAX, FLT_MAX},
+                        {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+    float p[3], size, n, scale[3], ofs[3];
+    int i, j, k, box[2][3];
+    mesh_t *mesh = image->active_layer->mesh;
+
+    if (!nb) {
+        LOG_E("No triangles to import");
+        return -1;
+    }
+    // From y up to z up.
+    for (i = 0; i < nb; i++)
+    for (j = 0; j < 3; j++) {
+        vec3_copy(triangles[i].pos[j], p);
+        vec3_set(triangles[i].pos[j], p[0], -p[2], p[1]);
+        for (k = 0; k < 3; k++) {
+            aabb[0][k] = min(aabb[0][k], triangles[i].pos[j][k]);
+            aabb[1][k] = max(aabb[1][k], triangles[i].pos[j][k]);
+        }
+    }
+    size = max3(aabb[1][0] - aabb[0][0], aabb[1][1] - aabb[0][1],
+                aabb[1][2] - aabb[0][2]);
+    // Round the size of each side to a number of voxels, and keep the
+    // vertices slightly inside, so that the faces on the sides don't add
+    // an extra layer of voxels.
+    for (k = 0; k < 3; k++) {
+        n = aabb[1][k] - aabb[0][k];
+        box[1][k] = size > 0 ?
+            max(1, (int)ceilf(n / size * g_options.size - 0.001f)) : 1;
+        scale[k] = n > 0 ? (box[1][k] - 0.01f) / n : 0;
+        ofs[k] = k == 2 ? 0 : -(box[1][k] / 2);
+        box[0][k] = ofs[k];
+        box[1][k] += ofs[k];
+    }
+    for (i = 0; i < nb; i++)
+    for (j = 0; j < 3; j++)
+    for (k = 0; k < 3; k++) {
+        triangles[i].pos[j][k] = (triangles[i].pos[j][k] - aabb[0][k]) *
+                                 scale[k] + ofs[k] + 0.005f;
+    }
+    if (mesh_voxelize(mesh, triangles, nb, textures, g_options.solid))
+        return -1;
+    bbox_from_aabb(image->active_layer->box, box);
+    return 0;
+}
+
+void voxelize_set_options(int size, bool solid)
+{
+    g_options.size = max(1, size);
+    g_options.solid = solid;
+}
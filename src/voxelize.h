@@ -0,0 +1,94 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Voxelize
+ *
+ * Conversion of triangles meshes into voxels, used by the polygon meshes
+ * importers (obj, ply and gltf).
+ *
+ * The triangles are first binned into the blocks they overlap, and then
+ * each block is rasterized independently, in parallel.  A voxel is set if
+ * its cube intersects a triangle (conservative voxelization), with the
+ * color of the closest triangle at the voxel center.  Optionally the
+ * inside of the closed meshes is filled as well, using the parity of the
+ * number of triangles crossed along vertical rays.
+ */
+
+#ifndef VOXELIZE_H
+#define VOXELIZE_H
+
+#include "image.h"
+#include "mesh.h"
+
+typedef struct {
+    float       pos[3][3];      // Vertices positions.
+    float       uv[3][2];       // Texture coordinates, with v going down.
+    uint8_t     color[3][4];    // Vertices colors.
+    int         texture;        // Index of the texture, or -1.
+} voxelize_triangle_t;
+
+typedef struct {
+    uint8_t     *data;          // RGBA pixels, top row first.
+    int         w;
+    int         h;
+} voxelize_texture_t;
+
+/*
+ * Function: mesh_voxelize
+ * Add the voxels of some triangles to a mesh.
+ *
+ * Parameters:
+ *   mesh       - The mesh where the voxels are added.
+ *   triangles  - The triangles, with the positions in voxels.
+ *   nb         - Number of triangles.
+ *   textures   - Textures of the triangles, can be NULL if they don't use
+ *                any.
+ *   solid      - If set, also fill the inside of the closed meshes.
+ *
+ * Return:
+ *   0 on success, or -1 if the import was cancelled, see
+ *   <file_format_report_progress>.
+ */
+int mesh_voxelize(mesh_t *mesh, const voxelize_triangle_t *triangles, int nb,
+                  const voxelize_texture_t *textures, bool solid);
+
+/*
+ * Function: voxelize_import
+ * Voxelize the triangles of an imported file into the active layer.
+ *
+ * The triangles use the usual y up convention of the polygon formats.
+ * The model is scaled so that its largest side has the size set with
+ * <voxelize_set_options>, and placed on the ground, centered.
+ */
+int voxelize_import(image_t *image, voxelize_triangle_t *triangles, int nb,
+                    const voxelize_texture_t *textures);
+
+/*
+ * Function: voxelize_set_options
+ * Set the options of the polygon meshes imports.
+ *
+ * Parameters:
+ *   size   - Number of voxels along the largest side of the models
+ *            (128 by default).
+ *   solid  - If set, fill the inside of the closed models (false by
+ *            default).
+ */
+void voxelize_set_options(int size, bool solid);
+
+#endif // VOXELIZE_H